@@ -36,6 +36,7 @@
 #include "../common/sysutils.h" /* (gnupg_fd_t) */
 #include "../common/session-env.h"
 #include "../common/shareddefs.h"
+#include "../common/stats.h"
 
 /* To convey some special hash algorithms we use algorithm numbers
    reserved for application use. */
@@ -98,6 +99,10 @@ struct
      upon this timeout value.  */
   unsigned long pinentry_timeout;
 
+  /* If not 0 a pinentry is kept running for this many seconds after
+     use and then reused for the same session.  */
+  unsigned long pinentry_idle_timeout;
+
   /* The default and maximum TTL of cache entries. */
   unsigned long def_cache_ttl;     /* Default. */
   unsigned long def_cache_ttl_ssh; /* for SSH. */
@@ -127,6 +132,17 @@ struct
   /* If set the extended key format is used for new keys.  */
   int enable_extended_key_format;
 
+  /* If set unprotected private keys are cached in memory.  */
+  int enable_private_key_cache;
+
+  /* If set the key files are stored in subdirectories of the private
+     key directory named after the first two digits of the keygrip.  */
+  int private_keys_fanout;
+
+  /* The number of keys to pre-generate for each kind of requested
+     key; 0 disables the pool.  */
+  unsigned int keygen_pool_size;
+
   int running_detached; /* We are running detached from the tty. */
 
   /* If this global option is true, the passphrase cache is ignored
@@ -212,6 +228,8 @@ struct server_control_s
      spawning a new connection thread.  */
   struct {
     gnupg_fd_t fd;
+    void *(*func) (void *arg);  /* The handler for this connection.  */
+    ctrl_t next;                /* Next in the connection queue.  */
   } thread_startup;
 
   /* Flag indicating the connection is run in restricted mode.
@@ -358,6 +376,10 @@ gpg_error_t agent_copy_startup_env (ctrl_t ctrl);
 const char *get_agent_socket_name (void);
 const char *get_agent_ssh_socket_name (void);
 int get_agent_active_connection_count (void);
+int get_agent_connection_queue_length (void);
+size_t agent_secmem_budget (void);
+void agent_cpu_begin (void);
+void agent_cpu_end (void);
 #ifdef HAVE_W32_SYSTEM
 void *get_agent_scd_notify_event (void);
 #endif
@@ -374,6 +396,7 @@ gpg_error_t agent_print_status (ctrl_t ctrl, const char *keyword,
      GPGRT_ATTR_PRINTF(3,4);
 void bump_key_eventcounter (void);
 void bump_card_eventcounter (void);
+unsigned int get_card_eventcounter (void);
 void start_command_handler (ctrl_t, gnupg_fd_t, gnupg_fd_t);
 gpg_error_t pinentry_loopback (ctrl_t, const char *keyword,
 	                       unsigned char **buffer, size_t *size,
@@ -385,6 +408,7 @@ int serve_mmapped_ssh_request (ctrl_t ctrl,
 #endif /*HAVE_W32_SYSTEM*/
 
 /*-- command-ssh.c --*/
+void initialize_module_command_ssh (void);
 ssh_control_file_t ssh_open_control_file (void);
 void ssh_close_control_file (ssh_control_file_t cf);
 gpg_error_t ssh_read_control_file (ssh_control_file_t cf,
@@ -419,6 +443,9 @@ gpg_error_t agent_public_key_from_file (ctrl_t ctrl,
 int agent_is_dsa_key (gcry_sexp_t s_key);
 int agent_is_eddsa_key (gcry_sexp_t s_key);
 int agent_key_available (const unsigned char *grip);
+char *agent_key_file_name (const char *hexgrip);
+gpg_error_t agent_list_keygrips (unsigned char **r_grips, size_t *r_ngrips);
+unsigned int agent_key_files_serial (void);
 gpg_error_t agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
                                       int *r_keytype,
                                       unsigned char **r_shadow_info);
@@ -430,6 +457,8 @@ gpg_error_t agent_delete_key (ctrl_t ctrl, const char *desc_text,
 void initialize_module_call_pinentry (void);
 void agent_query_dump_state (void);
 void agent_reset_query (ctrl_t ctrl);
+void agent_query_housekeeping (void);
+void agent_query_flush_idle (void);
 int pinentry_active_p (ctrl_t ctrl, int waitseconds);
 gpg_error_t agent_askpin (ctrl_t ctrl,
                           const char *desc_text, const char *prompt_text,
@@ -458,9 +487,24 @@ int agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
                      const char *data, int ttl);
 char *agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode);
 void agent_store_cache_hit (const char *key);
+gpg_error_t agent_put_cache_key (ctrl_t ctrl, const char *hexgrip,
+                                 cache_mode_t cache_mode,
+                                 const unsigned char *canon_skey, int ttl);
+unsigned char *agent_get_cache_key (ctrl_t ctrl, const char *hexgrip,
+                                    cache_mode_t cache_mode);
+void agent_clear_cache_key (const char *hexgrip);
+void agent_cache_stats_report (stats_sink_t sink);
 
 
 /*-- pksign.c --*/
+/* A hash to be signed by agent_pksign_multi.  */
+struct pksign_hash_s
+{
+  int algo;
+  unsigned char value[MAX_DIGEST_LEN];
+  int valuelen;
+};
+
 gpg_error_t agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
                              const char *desc_text,
                              gcry_sexp_t *signature_sexp,
@@ -469,13 +513,25 @@ gpg_error_t agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
 gpg_error_t agent_pksign (ctrl_t ctrl, const char *cache_nonce,
                           const char *desc_text,
                           membuf_t *outbuf, cache_mode_t cache_mode);
+gpg_error_t agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce,
+                                const char *desc_text,
+                                const struct pksign_hash_s *hashes,
+                                unsigned int nhashes,
+                                membuf_t *outbuf, cache_mode_t cache_mode);
 
 /*-- pkdecrypt.c --*/
 int agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
                      const unsigned char *ciphertext, size_t ciphertextlen,
                      membuf_t *outbuf, int *r_padding);
+int agent_pkdecrypt_multi (ctrl_t ctrl, const char *desc_text,
+                           const unsigned char *ciphertexts,
+                           size_t ciphertextslen, membuf_t *outbuf);
 
 /*-- genkey.c --*/
+void initialize_module_genkey (void);
+void agent_flush_keygen_pool (void);
+unsigned int agent_keygen_pool_count (void);
+int agent_keygen_pool_thread_p (void);
 int check_passphrase_constraints (ctrl_t ctrl, const char *pw,
 				  char **failed_constraint);
 gpg_error_t agent_ask_new_passphrase (ctrl_t ctrl, const char *prompt,
@@ -488,6 +544,11 @@ gpg_error_t agent_protect_and_store (ctrl_t ctrl, gcry_sexp_t s_skey,
                                      char **passphrase_addr);
 
 /*-- protect.c --*/
+unsigned long calibrate_s2k_count (int no_log);
+void set_calibrated_s2k_count (unsigned long count);
+void register_s2k_calibration_wait (void (*fnc) (void));
+gpg_error_t read_s2k_calibration (unsigned long *r_count);
+void write_s2k_calibration (unsigned long count);
 unsigned long get_calibrated_s2k_count (void);
 unsigned long get_standard_s2k_count (void);
 unsigned char get_standard_s2k_count_rfc4880 (void);
@@ -499,6 +560,7 @@ gpg_error_t agent_unprotect (ctrl_t ctrl,
                      const unsigned char *protectedkey, const char *passphrase,
                      gnupg_isotime_t protected_at,
                      unsigned char **result, size_t *resultlen);
+void agent_flush_kek_cache (void);
 int agent_private_key_type (const unsigned char *privatekey);
 unsigned char *make_shadow_info (const char *serialno, const char *idstring);
 int agent_shadow_key (const unsigned char *pubkey,
@@ -67,8 +67,35 @@ struct cache_item_s {
   char key[1];
 };
 
-/* The cache himself.  */
-static ITEM thecache;
+/* The number of buckets of the cache.  Must be a power of 2.  */
+#define CACHE_TABLE_SIZE 256
+
+/* The cache himself.  This is a hash table with the items of a
+ * bucket in a linked list.  Only the key is hashed because a lookup
+ * with CACHE_MODE_ANY matches items of several modes.  */
+static ITEM thecache[CACHE_TABLE_SIZE];
+
+/* The time at which the next item needs to be expired or 0 to force
+ * a run of the housekeeping.  This avoids walking the entire cache
+ * on each access.  */
+static time_t next_housekeeping;
+
+/* The cache object for unprotected private keys.  These are stored
+ * in the same encrypted form as the passphrases.  */
+typedef struct key_item_s *KEY_ITEM;
+struct key_item_s {
+  KEY_ITEM next;
+  time_t created;
+  time_t accessed;
+  int ttl;  /* max. lifetime given in seconds, -1 one means infinite */
+  struct secret_data_s *skey;  /* The key as canonical S-expression.  */
+  cache_mode_t cache_mode;
+  int restricted;  /* The value of ctrl->restricted is part of the key.  */
+  char hexgrip[2*KEYGRIP_LEN+1];
+};
+
+/* The cache of unprotected private keys.  */
+static KEY_ITEM thekeys;
 
 /* NULL or the last cache key stored by agent_store_cache_hit.  */
 static char *last_stored_cache_key;
@@ -144,12 +171,13 @@ release_data (struct secret_data_s *data)
    xfree (data);
 }
 
+
+/* Create a new encrypted data object from the DATA of LENGTH.  */
 static gpg_error_t
-new_data (const char *string, struct secret_data_s **r_data)
+new_data (const void *data, size_t length, struct secret_data_s **r_data)
 {
   gpg_error_t err;
   struct secret_data_s *d, *d_enc;
-  size_t length;
   int total;
 
   *r_data = NULL;
@@ -158,8 +186,6 @@ new_data (const char *string, struct secret_data_s **r_data)
   if (err)
     return err;
 
-  length = strlen (string) + 1;
-
   /* We pad the data to 32 bytes so that it get more complicated
      finding something out by watching allocation patterns.  This is
      usually not possible but we better assume nothing about our secure
@@ -170,7 +196,7 @@ new_data (const char *string, struct secret_data_s **r_data)
   d = xtrymalloc_secure (sizeof *d + total - 1);
   if (!d)
     return gpg_error_from_syserror ();
-  memcpy (d->data, string, length);
+  memcpy (d->data, data, length);
 
   d_enc = xtrymalloc (sizeof *d_enc + total - 1);
   if (!d_enc)
@@ -195,79 +221,195 @@ new_data (const char *string, struct secret_data_s **r_data)
 
 
 
-/* Check whether there are items to expire.  */
+/* Return the bucket for KEY.  */
+static unsigned int
+hash_key (const char *key)
+{
+  unsigned int h = 0;
+
+  for (; *key; key++)
+    h = h * 31 + *(const unsigned char *)key;
+  return h & (CACHE_TABLE_SIZE - 1);
+}
+
+
+/* Make sure that the housekeeping is run not later than at DUE.  */
 static void
-housekeeping (void)
+schedule_housekeeping (time_t due)
 {
-  ITEM r, rprev;
-  time_t current = gnupg_get_time ();
+  if (due < next_housekeeping)
+    next_housekeeping = due;
+}
+
 
-  /* First expire the actual data */
-  for (r=thecache; r; r = r->next)
+/* Return the maximum TTL for items with CACHE_MODE.  */
+static unsigned long
+max_ttl_for_mode (cache_mode_t cache_mode)
+{
+  switch (cache_mode)
     {
-      if (r->pw && r->ttl >= 0 && r->accessed + r->ttl < current)
-        {
-          if (DBG_CACHE)
-            log_debug ("  expired '%s'.%d (%ds after last access)\n",
-                       r->key, r->restricted, r->ttl);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = current;
-        }
+    case CACHE_MODE_SSH: return opt.max_cache_ttl_ssh;
+    default: return opt.max_cache_ttl;
     }
+}
 
-  /* Second, make sure that we also remove them based on the created
-   * stamp so that the user has to enter it from time to time.  We
-   * don't do this for data items which are used to storage secrets in
-   * meory and are not user entered passphrases etc.  */
-  for (r=thecache; r; r = r->next)
-    {
-      unsigned long maxttl;
 
-      switch (r->cache_mode)
+/* Remove all expired items from the cache of private keys.  Unlike
+ * passphrase items, key items are removed right away.  Returns the
+ * earlier one of DUE and the time the next key expires.  */
+static time_t
+housekeeping_keys (time_t current, time_t due)
+{
+  KEY_ITEM k, kprev, k2;
+  time_t t;
+
+  for (kprev=NULL, k=thekeys; k; )
+    {
+      if ((k->ttl >= 0 && k->accessed + k->ttl < current)
+          || k->created + max_ttl_for_mode (k->cache_mode) < current)
         {
-        case CACHE_MODE_DATA:
-          continue;  /* No MAX TTL here.  */
-        case CACHE_MODE_SSH: maxttl = opt.max_cache_ttl_ssh; break;
-        default: maxttl = opt.max_cache_ttl; break;
+          if (DBG_CACHE)
+            log_debug ("  expired key '%s'.%d\n", k->hexgrip, k->restricted);
+          k2 = k->next;
+          release_data (k->skey);
+          xfree (k);
+          if (!kprev)
+            thekeys = k2;
+          else
+            kprev->next = k2;
+          k = k2;
         }
-      if (r->pw && r->created + maxttl < current)
+      else
         {
-          if (DBG_CACHE)
-            log_debug ("  expired '%s'.%d (%lus after creation)\n",
-                       r->key, r->restricted, opt.max_cache_ttl);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = current;
+          if (k->ttl >= 0 && (t = k->accessed + k->ttl + 1) < due)
+            due = t;
+          if ((t = k->created + max_ttl_for_mode (k->cache_mode) + 1) < due)
+            due = t;
+          kprev = k;
+          k = k->next;
         }
     }
 
-  /* Third, make sure that we don't have too many items in the list.
-   * Expire old and unused entries after 30 minutes.  */
-  for (rprev=NULL, r=thecache; r; )
+  return due;
+}
+
+
+/* Remove all cached private keys with HEXGRIP.  */
+static void
+clear_keys (const char *hexgrip)
+{
+  KEY_ITEM k, kprev, k2;
+
+  for (kprev=NULL, k=thekeys; k; )
     {
-      if (!r->pw && r->ttl >= 0 && r->accessed + 60*30 < current)
+      if (!hexgrip || !strcmp (k->hexgrip, hexgrip))
         {
-          ITEM r2 = r->next;
           if (DBG_CACHE)
-            log_debug ("  removed '%s'.%d (mode %d) (slot not used for 30m)\n",
-                       r->key, r->restricted, r->cache_mode);
-          xfree (r);
-          if (!rprev)
-            thecache = r2;
+            log_debug ("  flushing key '%s'.%d\n", k->hexgrip, k->restricted);
+          k2 = k->next;
+          release_data (k->skey);
+          xfree (k);
+          if (!kprev)
+            thekeys = k2;
           else
-            rprev->next = r2;
-          r = r2;
+            kprev->next = k2;
+          k = k2;
         }
       else
         {
-          rprev = r;
-          r = r->next;
+          kprev = k;
+          k = k->next;
         }
     }
 }
 
 
+/* Check whether there are items to expire.  */
+static void
+housekeeping (void)
+{
+  ITEM r, rprev, r2;
+  time_t current = gnupg_get_time ();
+  time_t due, t;
+  unsigned long maxttl;
+  unsigned int idx;
+
+  if (current < next_housekeeping)
+    return;
+
+  /* Run at least every 30 minutes to cleanup the unused slots.  */
+  due = current + 60*30;
+
+  for (idx=0; idx < CACHE_TABLE_SIZE; idx++)
+    for (rprev=NULL, r=thecache[idx]; r; )
+      {
+        /* First expire the actual data */
+        if (r->pw && r->ttl >= 0 && r->accessed + r->ttl < current)
+          {
+            if (DBG_CACHE)
+              log_debug ("  expired '%s'.%d (%ds after last access)\n",
+                         r->key, r->restricted, r->ttl);
+            release_data (r->pw);
+            r->pw = NULL;
+            r->accessed = current;
+          }
+
+        /* Second, make sure that we also remove them based on the
+         * created stamp so that the user has to enter it from time to
+         * time.  We don't do this for data items which are used to
+         * storage secrets in meory and are not user entered
+         * passphrases etc.  */
+        maxttl = max_ttl_for_mode (r->cache_mode);
+        if (r->pw && r->cache_mode != CACHE_MODE_DATA
+            && r->created + maxttl < current)
+          {
+            if (DBG_CACHE)
+              log_debug ("  expired '%s'.%d (%lus after creation)\n",
+                         r->key, r->restricted, maxttl);
+            release_data (r->pw);
+            r->pw = NULL;
+            r->accessed = current;
+          }
+
+        /* Third, make sure that we don't have too many items in the
+         * list.  Expire old and unused entries after 30 minutes.  */
+        if (!r->pw && r->ttl >= 0 && r->accessed + 60*30 < current)
+          {
+            r2 = r->next;
+            if (DBG_CACHE)
+              log_debug ("  removed '%s'.%d (mode %d)"
+                         " (slot not used for 30m)\n",
+                         r->key, r->restricted, r->cache_mode);
+            xfree (r);
+            if (!rprev)
+              thecache[idx] = r2;
+            else
+              rprev->next = r2;
+            r = r2;
+            continue;
+          }
+
+        /* Remember when this item needs to be looked at again.  */
+        if (r->pw)
+          {
+            if (r->ttl >= 0 && (t = r->accessed + r->ttl + 1) < due)
+              due = t;
+            if (r->cache_mode != CACHE_MODE_DATA
+                && (t = r->created + maxttl + 1) < due)
+              due = t;
+          }
+        else if (r->ttl >= 0 && (t = r->accessed + 60*30 + 1) < due)
+          due = t;
+
+        rprev = r;
+        r = r->next;
+      }
+
+  /* Finally expire the cached private keys.  */
+  next_housekeeping = housekeeping_keys (current, due);
+}
+
+
 void
 agent_cache_housekeeping (void)
 {
@@ -293,6 +435,7 @@ agent_flush_cache (void)
 {
   ITEM r;
   int res;
+  unsigned int idx;
 
   if (DBG_CACHE)
     log_debug ("agent_flush_cache\n");
@@ -301,17 +444,21 @@ agent_flush_cache (void)
   if (res)
     log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
 
-  for (r=thecache; r; r = r->next)
-    {
-      if (r->pw)
-        {
-          if (DBG_CACHE)
-            log_debug ("  flushing '%s'.%d\n", r->key, r->restricted);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = 0;
-        }
-    }
+  for (idx=0; idx < CACHE_TABLE_SIZE; idx++)
+    for (r=thecache[idx]; r; r = r->next)
+      {
+        if (r->pw)
+          {
+            if (DBG_CACHE)
+              log_debug ("  flushing '%s'.%d\n", r->key, r->restricted);
+            release_data (r->pw);
+            r->pw = NULL;
+            r->accessed = 0;
+          }
+      }
+  clear_keys (NULL);
+  agent_flush_kek_cache ();
+  next_housekeeping = 0;
 
   res = npth_mutex_unlock (&cache_lock);
   if (res)
@@ -346,6 +493,7 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
   ITEM r;
   int res;
   int restricted = ctrl? ctrl->restricted : -1;
+  unsigned int idx;
 
   res = npth_mutex_lock (&cache_lock);
   if (res)
@@ -368,7 +516,13 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
   if ((!ttl && data) || cache_mode == CACHE_MODE_IGNORE)
     goto out;
 
-  for (r=thecache; r; r = r->next)
+  /* If the passphrase for a key is cleared, the key itself may not
+   * be used from the cache anymore either.  */
+  if (!data && strlen (key) == 2*KEYGRIP_LEN)
+    clear_keys (key);
+
+  idx = hash_key (key);
+  for (r=thecache[idx]; r; r = r->next)
     {
       if (((cache_mode != CACHE_MODE_USER
             && cache_mode != CACHE_MODE_NONCE)
@@ -389,10 +543,12 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
           r->created = r->accessed = gnupg_get_time ();
           r->ttl = ttl;
           r->cache_mode = cache_mode;
-          err = new_data (data, &r->pw);
+          err = new_data (data, strlen (data) + 1, &r->pw);
           if (err)
             log_error ("error replacing cache item: %s\n", gpg_strerror (err));
         }
+      else
+        schedule_housekeeping (r->accessed + 60*30 + 1);
     }
   else if (data) /* Insert.  */
     {
@@ -406,19 +562,27 @@ agent_put_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode,
           r->created = r->accessed = gnupg_get_time ();
           r->ttl = ttl;
           r->cache_mode = cache_mode;
-          err = new_data (data, &r->pw);
+          err = new_data (data, strlen (data) + 1, &r->pw);
           if (err)
             xfree (r);
           else
             {
-              r->next = thecache;
-              thecache = r;
+              r->next = thecache[idx];
+              thecache[idx] = r;
             }
         }
       if (err)
         log_error ("error inserting cache item: %s\n", gpg_strerror (err));
     }
 
+  if (data && r && r->pw)
+    {
+      if (ttl >= 0)
+        schedule_housekeeping (r->created + ttl + 1);
+      if (cache_mode != CACHE_MODE_DATA)
+        schedule_housekeeping (r->created + max_ttl_for_mode (cache_mode) + 1);
+    }
+
  out:
   res = npth_mutex_unlock (&cache_lock);
   if (res)
@@ -460,7 +624,7 @@ agent_get_cache (ctrl_t ctrl, const char *key, cache_mode_t cache_mode)
                last_stored? " (stored cache key)":"");
   housekeeping ();
 
-  for (r=thecache; r; r = r->next)
+  for (r=thecache[hash_key (key)]; r; r = r->next)
     {
       if (r->pw
           && ((cache_mode != CACHE_MODE_USER
@@ -542,3 +706,201 @@ agent_store_cache_hit (const char *key)
 
   xfree (old);
 }
+
+
+/* Store the unprotected private key CANON_SKEY, given as a canonical
+ * S-expression, under HEXGRIP in the cache.  TTL and CACHE_MODE have
+ * the same meaning as with agent_put_cache; the key is not stored if
+ * the resulting TTL is 0.  */
+gpg_error_t
+agent_put_cache_key (ctrl_t ctrl, const char *hexgrip, cache_mode_t cache_mode,
+                     const unsigned char *canon_skey, int ttl)
+{
+  gpg_error_t err = 0;
+  KEY_ITEM k;
+  size_t length;
+  int res;
+  int restricted = ctrl? ctrl->restricted : -1;
+
+  if (cache_mode == CACHE_MODE_IGNORE || cache_mode == CACHE_MODE_DATA
+      || strlen (hexgrip) != 2*KEYGRIP_LEN)
+    return 0;
+  length = gcry_sexp_canon_len (canon_skey, 0, NULL, NULL);
+  if (!length)
+    return gpg_error (GPG_ERR_INV_SEXP);
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  if (DBG_CACHE)
+    log_debug ("agent_put_cache_key '%s'.%d (mode %d) requested ttl=%d\n",
+               hexgrip, restricted, cache_mode, ttl);
+  housekeeping ();
+
+  if (!ttl)
+    ttl = (cache_mode == CACHE_MODE_SSH? opt.def_cache_ttl_ssh
+           /**/                         : opt.def_cache_ttl);
+  if (!ttl)
+    goto out;
+
+  for (k=thekeys; k; k = k->next)
+    if (k->restricted == restricted && !strcmp (k->hexgrip, hexgrip))
+      break;
+  if (!k)
+    {
+      k = xtrycalloc (1, sizeof *k);
+      if (!k)
+        {
+          err = gpg_error_from_syserror ();
+          goto out;
+        }
+      strcpy (k->hexgrip, hexgrip);
+      k->restricted = restricted;
+      k->next = thekeys;
+      thekeys = k;
+    }
+  else
+    {
+      release_data (k->skey);
+      k->skey = NULL;
+    }
+
+  k->created = k->accessed = gnupg_get_time ();
+  k->ttl = ttl;
+  k->cache_mode = cache_mode;
+  err = new_data (canon_skey, length, &k->skey);
+  if (err)
+    {
+      log_error ("error inserting cached key: %s\n", gpg_strerror (err));
+      clear_keys (hexgrip);
+    }
+  else
+    {
+      if (ttl >= 0)
+        schedule_housekeeping (k->created + ttl + 1);
+      schedule_housekeeping (k->created + max_ttl_for_mode (cache_mode) + 1);
+    }
+
+ out:
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+
+  return err;
+}
+
+
+/* Return the unprotected private key stored under HEXGRIP as a
+ * canonical S-expression in secure memory or NULL if it is not
+ * cached.  */
+unsigned char *
+agent_get_cache_key (ctrl_t ctrl, const char *hexgrip, cache_mode_t cache_mode)
+{
+  gpg_error_t err;
+  KEY_ITEM k;
+  unsigned char *value = NULL;
+  int res;
+  int restricted = ctrl? ctrl->restricted : -1;
+
+  if (cache_mode == CACHE_MODE_IGNORE || !thekeys)
+    return NULL;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  housekeeping ();
+
+  for (k=thekeys; k; k = k->next)
+    if (k->restricted == restricted && !strcmp (k->hexgrip, hexgrip))
+      break;
+  if (k)
+    {
+      k->accessed = gnupg_get_time ();
+      if (k->skey->totallen < 32)
+        err = gpg_error (GPG_ERR_INV_LENGTH);
+      else if ((err = init_encryption ()))
+        ;
+      else if (!(value = xtrymalloc_secure (k->skey->totallen - 8)))
+        err = gpg_error_from_syserror ();
+      else
+        err = gcry_cipher_decrypt (encryption_handle,
+                                   value, k->skey->totallen - 8,
+                                   k->skey->data, k->skey->totallen);
+      if (err)
+        {
+          xfree (value);
+          value = NULL;
+          log_error ("retrieving cached key '%s'.%d failed: %s\n",
+                     hexgrip, restricted, gpg_strerror (err));
+        }
+    }
+  if (DBG_CACHE)
+    log_debug ("agent_get_cache_key '%s'.%d ... %s\n",
+               hexgrip, restricted, value? "hit":"miss");
+
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+
+  return value;
+}
+
+
+/* Remove the private key with HEXGRIP from the cache.  */
+void
+agent_clear_cache_key (const char *hexgrip)
+{
+  int res;
+
+  if (!thekeys)
+    return;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  clear_keys (hexgrip);
+
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+}
+
+
+/* The report function for the "cache" statistics.  */
+void
+agent_cache_stats_report (stats_sink_t sink)
+{
+  ITEM r;
+  KEY_ITEM k;
+  unsigned long long nitems = 0, nkeys = 0, bytes = 0;
+  unsigned int idx;
+  int res;
+
+  res = npth_mutex_lock (&cache_lock);
+  if (res)
+    log_fatal ("failed to acquire cache mutex: %s\n", strerror (res));
+
+  for (idx=0; idx < CACHE_TABLE_SIZE; idx++)
+    for (r=thecache[idx]; r; r = r->next)
+      if (r->pw)
+        {
+          nitems++;
+          bytes += r->pw->totallen;
+        }
+  for (k=thekeys; k; k = k->next)
+    {
+      nkeys++;
+      bytes += k->skey->totallen;
+    }
+
+  res = npth_mutex_unlock (&cache_lock);
+  if (res)
+    log_fatal ("failed to release cache mutex: %s\n", strerror (res));
+
+  stats_put (sink, "items", nitems);
+  stats_put (sink, "keys", nkeys);
+  stats_put (sink, "bytes", bytes);
+}
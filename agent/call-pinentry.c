@@ -56,6 +56,21 @@
 /* The assuan context of the current pinentry. */
 static assuan_context_t entry_ctx;
 
+/* A string describing the session the current pinentry has been
+   started for; see pinentry_session_key.  */
+static char *entry_session;
+
+/* Set if the current pinentry must not be kept for reuse.  */
+static int entry_no_reuse;
+
+/* With --pinentry-idle-timeout a pinentry is kept running after use.
+   This is its assuan context, the session it has been started for,
+   and the time it has been released.  The entry lock is not held
+   for an idle pinentry.  */
+static assuan_context_t idle_entry_ctx;
+static char *idle_entry_session;
+static time_t idle_entry_time;
+
 /* A list of features of the current pinentry.  */
 static struct
 {
@@ -129,6 +144,161 @@ agent_reset_query (ctrl_t ctrl)
 }
 
 
+/* Return a malloced string describing the session of CTRL to decide
+   whether an idle pinentry may be reused.  This covers everything
+   passed to a new pinentry via its environment and options.  Returns
+   NULL on error.  */
+static char *
+pinentry_session_key (ctrl_t ctrl)
+{
+  membuf_t mb;
+  int iterator = 0;
+  const char *name, *value;
+  char numbuf[35];
+
+  init_membuf (&mb, 256);
+  snprintf (numbuf, sizeof numbuf, "%d", ctrl->client_uid);
+  put_membuf_str (&mb, numbuf);
+  while ((name = session_env_list_stdenvnames (&iterator, NULL)))
+    {
+      value = session_env_getenv (ctrl->session_env, name);
+      put_membuf (&mb, "\n", 1);
+      if (value)
+        put_membuf_str (&mb, value);
+    }
+  put_membuf (&mb, "\n", 1);
+  if (ctrl->lc_ctype)
+    put_membuf_str (&mb, ctrl->lc_ctype);
+  put_membuf (&mb, "\n", 1);
+  if (ctrl->lc_messages)
+    put_membuf_str (&mb, ctrl->lc_messages);
+  put_membuf (&mb, "", 1);
+  return get_membuf (&mb, NULL);
+}
+
+
+/* Return true if the pinentry may be kept after an operation which
+   finished with RC.  Only user errors are okay; after any other
+   error the state of the pinentry is not known.  */
+static int
+pinentry_reusable_p (gpg_error_t rc)
+{
+  if (!opt.pinentry_idle_timeout || entry_no_reuse || !entry_session)
+    return 0;
+
+  switch (gpg_err_code (rc))
+    {
+    case GPG_ERR_NO_ERROR:
+    case GPG_ERR_CANCELED:
+    case GPG_ERR_FULLY_CANCELED:
+    case GPG_ERR_NO_PASSPHRASE:
+    case GPG_ERR_BAD_PASSPHRASE:
+    case GPG_ERR_BAD_PIN:
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+
+/* Try to take over the idle pinentry for CTRL.  Must be called with
+   the entry lock held.  Returns true on success.  */
+static int
+reuse_idle_pinentry (ctrl_t ctrl)
+{
+  assuan_context_t ctx = idle_entry_ctx;
+  char *session = idle_entry_session;
+  char *mysession;
+
+  idle_entry_ctx = NULL;
+  idle_entry_session = NULL;
+
+  mysession = pinentry_session_key (ctrl);
+  if (!mysession || strcmp (mysession, session)
+      || assuan_transact (ctx, "RESET", NULL, NULL, NULL, NULL, NULL, NULL))
+    {
+      /* Different session or the pinentry died.  */
+      xfree (mysession);
+      xfree (session);
+      assuan_release (ctx);
+      return 0;
+    }
+  xfree (session);
+
+  if (DBG_IPC)
+    log_debug ("reusing idle PIN Entry\n");
+
+  ctrl->pinentry_active = 1;
+  entry_ctx = ctx;
+  entry_session = mysession;
+  entry_no_reuse = 0;
+
+  /* The owner is likely a different process of the same session.  */
+  if (ctrl->client_pid)
+    {
+      char *optstr;
+      const char *nodename = "";
+
+#ifndef HAVE_W32_SYSTEM
+      struct utsname utsbuf;
+      if (!uname (&utsbuf))
+        nodename = utsbuf.nodename;
+#endif /*!HAVE_W32_SYSTEM*/
+
+      if ((optstr = xtryasprintf ("OPTION owner=%lu/%d %s",
+                                  ctrl->client_pid, ctrl->client_uid,
+                                  nodename)))
+        {
+          assuan_transact (entry_ctx, optstr, NULL, NULL, NULL, NULL, NULL,
+                           NULL);
+          xfree (optstr);
+        }
+    }
+
+  return 1;
+}
+
+
+/* Terminate the idle pinentry if it has been idle for longer than
+   --pinentry-idle-timeout or, if FORCE is set, in any case.  */
+static void
+close_idle_pinentry (int force)
+{
+  assuan_context_t ctx = idle_entry_ctx;
+
+  if (!ctx)
+    return;
+  if (!force && opt.pinentry_idle_timeout
+      && idle_entry_time + opt.pinentry_idle_timeout > gnupg_get_time ())
+    return;
+
+  idle_entry_ctx = NULL;
+  xfree (idle_entry_session);
+  idle_entry_session = NULL;
+  if (DBG_IPC)
+    log_debug ("closing idle PIN Entry\n");
+  assuan_release (ctx);
+}
+
+
+/* This function is called by the ticker to terminate an idle
+   pinentry after the timeout.  */
+void
+agent_query_housekeeping (void)
+{
+  close_idle_pinentry (0);
+}
+
+
+/* Terminate an idle pinentry right away.  This is used on SIGHUP so
+   that a new configuration is used for the next pinentry.  */
+void
+agent_query_flush_idle (void)
+{
+  close_idle_pinentry (1);
+}
+
+
 /* Unlock the pinentry so that another thread can start one and
    disconnect that pinentry - we do this after the unlock so that a
    stalled pinentry does not block other threads.  Fixme: We should
@@ -174,6 +344,19 @@ unlock_pinentry (ctrl_t ctrl, gpg_error_t rc)
   if (--ctrl->pinentry_active == 0)
     {
       entry_ctx = NULL;
+      if (pinentry_reusable_p (rc))
+        {
+          /* Keep it; the previous idle one can't be used for this
+             session anyway.  */
+          close_idle_pinentry (1);
+          idle_entry_ctx = ctx;
+          idle_entry_session = entry_session;
+          idle_entry_time = gnupg_get_time ();
+          ctx = NULL;
+        }
+      else
+        xfree (entry_session);
+      entry_session = NULL;
       err = npth_mutex_unlock (&entry_lock);
       if (err)
         {
@@ -181,7 +364,8 @@ unlock_pinentry (ctrl_t ctrl, gpg_error_t rc)
           if (!rc)
             rc = gpg_error_from_errno (err);
         }
-      assuan_release (ctx);
+      if (ctx)
+        assuan_release (ctx);
     }
   return rc;
 }
@@ -310,6 +494,9 @@ start_pinentry (ctrl_t ctrl)
   if (entry_ctx)
     return 0;
 
+  if (idle_entry_ctx && reuse_idle_pinentry (ctrl))
+    return 0;
+
   if (opt.verbose)
     log_info ("starting a new PIN Entry\n");
 
@@ -377,6 +564,9 @@ start_pinentry (ctrl_t ctrl)
 
   ctrl->pinentry_active = 1;
   entry_ctx = ctx;
+  entry_no_reuse = 0;
+  if (opt.pinentry_idle_timeout)
+    entry_session = pinentry_session_key (ctrl);
 
   /* We don't want to log the pinentry communication to make the logs
      easier to read.  We might want to add a new debug option to enable
@@ -1558,7 +1748,8 @@ agent_popup_message_stop (ctrl_t ctrl)
      to the same content that a static global variable has.  */
   memset (&popup_tid, '\0', sizeof (popup_tid));
 
-  /* Now we can close the connection. */
+  /* Now we can close the connection; the pinentry has been killed.  */
+  entry_no_reuse = 1;
   unlock_pinentry (ctrl, 0);
 }
 
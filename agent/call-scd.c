@@ -80,6 +80,28 @@ struct learn_parm_s
 };
 
 
+/* The status lines returned by a LEARN for a card.  An entry is only
+   valid as long as the card event counter has not changed; any
+   operation which may change the card flushes all entries.  */
+struct learn_cache_s
+{
+  struct learn_cache_s *next;
+  unsigned int eventcounter;  /* The card event counter at LEARN time.  */
+  strlist_t lines;            /* The status lines in received order.  */
+  char serialno[1];           /* The serial number of the card.  */
+};
+typedef struct learn_cache_s *learn_cache_t;
+
+/* Callback parameter for learn_with_cache.  */
+struct learn_cache_parm_s
+{
+  gpg_error_t (*status_cb)(void *, const char *);
+  void *status_cb_arg;
+  strlist_t lines;
+  int error;
+};
+
+
 /* Callback parameter used by inq_getpin and inq_writekey_parms.  */
 struct inq_needpin_parm_s
 {
@@ -117,9 +139,22 @@ static assuan_context_t primary_scd_ctx;
    any connection. */
 static int primary_scd_ctx_reusable;
 
+/* Connections to the SCdaemon which are not used by any session.  A
+   session returning its non-primary connection sends a RESTART and
+   puts it here so that the next session does not need to connect
+   again.  The RESTART resets the state of that connection including
+   the selected card and any lock on the reader.  */
+#define MAX_IDLE_SCD_CTX 8
+static assuan_context_t idle_scd_ctx[MAX_IDLE_SCD_CTX];
+static int n_idle_scd_ctx;
+
+/* The cached results of the LEARN command.  */
+static learn_cache_t learn_cache;
+
 
 
 /* Local prototypes.  */
+static gpg_error_t get_serialno_cb (void *opaque, const char *line);
 
 
 
@@ -261,6 +296,14 @@ start_scd (ctrl_t ctrl)
         log_info ("new connection to SCdaemon established (reusing)\n");
       goto leave;
     }
+  if (n_idle_scd_ctx)
+    {
+      ctx = idle_scd_ctx[--n_idle_scd_ctx];
+      idle_scd_ctx[n_idle_scd_ctx] = NULL;
+      if (opt.verbose)
+        log_info ("new connection to SCdaemon established (reusing idle)\n");
+      goto leave;
+    }
 
   rc = assuan_new (&ctx);
   if (rc)
@@ -513,6 +556,11 @@ agent_scd_check_aliveness (void)
                   sl->ctx = NULL;
                 }
             }
+          while (n_idle_scd_ctx)
+            {
+              assuan_release (idle_scd_ctx[--n_idle_scd_ctx]);
+              idle_scd_ctx[n_idle_scd_ctx] = NULL;
+            }
 
           primary_scd_ctx = NULL;
           primary_scd_ctx_reusable = 0;
@@ -549,8 +597,8 @@ agent_reset_scd (ctrl_t ctrl)
                  primary connection as a kind of virtual EOF; we don't
                  have another way to tell it that the next command
                  should be viewed as if a new connection has been
-                 made.  For the non-primary connections this is not
-                 needed as we simply close the socket.  We don't check
+                 made.  For the non-primary connections this is only
+                 needed if we keep them for reuse.  We don't check
                  for an error here because the RESTART may fail for
                  example if the scdaemon has already been terminated.
                  Anyway, we need to set the reusable flag to make sure
@@ -560,7 +608,22 @@ agent_reset_scd (ctrl_t ctrl)
               primary_scd_ctx_reusable = 1;
             }
           else
-            assuan_release (ctrl->scd_local->ctx);
+            {
+              assuan_context_t ctx = ctrl->scd_local->ctx;
+
+              /* Keep the connection only if the RESTART worked and
+                 the daemon is still the one we started.  Note that
+                 the transaction may switch threads.  */
+              ctrl->scd_local->ctx = NULL;
+              if (n_idle_scd_ctx < MAX_IDLE_SCD_CTX
+                  && !assuan_transact (ctx, "RESTART",
+                                       NULL, NULL, NULL, NULL, NULL, NULL)
+                  && primary_scd_ctx
+                  && n_idle_scd_ctx < MAX_IDLE_SCD_CTX)
+                idle_scd_ctx[n_idle_scd_ctx++] = ctx;
+              else
+                assuan_release (ctx);
+            }
           ctrl->scd_local->ctx = NULL;
         }
 
@@ -616,6 +679,136 @@ learn_status_cb (void *opaque, const char *line)
   return 0;
 }
 
+/* Release all entries of the LEARN cache.  This needs to be called
+   for all commands which may change the data on the card.  */
+static void
+flush_learn_cache (void)
+{
+  learn_cache_t lc;
+
+  while ((lc = learn_cache))
+    {
+      learn_cache = lc->next;
+      free_strlist (lc->lines);
+      xfree (lc);
+    }
+}
+
+
+/* Status callback for learn_with_cache storing the lines.  */
+static gpg_error_t
+learn_cache_status_cb (void *opaque, const char *line)
+{
+  struct learn_cache_parm_s *parm = opaque;
+
+  if (!parm->error && !append_to_strlist_try (&parm->lines, line))
+    parm->error = gpg_error_from_syserror ();
+  return parm->status_cb (parm->status_cb_arg, line);
+}
+
+
+/* Run "LEARN --force" for the card of CTRL and call STATUS_CB for
+   each status line.  The result is taken from the cache if the card
+   has been learned before and no card event happened since then.
+   gpg, gpgsm and the ssh support thus read the card only once.  The
+   caller must have called start_scd.  */
+static gpg_error_t
+learn_with_cache (ctrl_t ctrl,
+                  gpg_error_t (*status_cb)(void *, const char *),
+                  void *status_cb_arg)
+{
+  gpg_error_t err;
+  struct learn_cache_parm_s parm;
+  unsigned int counter;
+  char *serialno = NULL;
+  learn_cache_t lc, *lcp;
+  strlist_t sl;
+
+  counter = get_card_eventcounter ();
+  /* Drop the entries of the cards learned before a card event.  */
+  for (lcp = &learn_cache; (lc = *lcp); )
+    if (lc->eventcounter != counter)
+      {
+        *lcp = lc->next;
+        free_strlist (lc->lines);
+        xfree (lc);
+      }
+    else
+      lcp = &lc->next;
+
+  if (learn_cache
+      && !assuan_transact (ctrl->scd_local->ctx, "SERIALNO",
+                           NULL, NULL, NULL, NULL,
+                           get_serialno_cb, &serialno)
+      && serialno)
+    {
+      for (lc = learn_cache; lc; lc = lc->next)
+        if (!strcmp (lc->serialno, serialno)
+            && lc->eventcounter == get_card_eventcounter ())
+          {
+            if (DBG_IPC)
+              log_debug ("using cached LEARN result for %s\n", serialno);
+            xfree (serialno);
+            for (sl = lc->lines; sl; sl = sl->next)
+              status_cb (status_cb_arg, sl->d);
+            return 0;
+          }
+    }
+  xfree (serialno);
+  serialno = NULL;
+
+  memset (&parm, 0, sizeof parm);
+  parm.status_cb = status_cb;
+  parm.status_cb_arg = status_cb_arg;
+  err = assuan_transact (ctrl->scd_local->ctx, "LEARN --force",
+                         NULL, NULL, NULL, NULL,
+                         learn_cache_status_cb, &parm);
+  if (!err && !parm.error && counter == get_card_eventcounter ())
+    {
+      /* Find the serial number and store the result.  */
+      for (sl = parm.lines; sl; sl = sl->next)
+        if (!strncmp (sl->d, "SERIALNO", 8) && spacep (sl->d + 8))
+          break;
+      if (sl)
+        {
+          const char *s = sl->d + 9;
+          size_t n;
+
+          while (spacep (s))
+            s++;
+          for (n=0; hexdigitp (s+n); n++)
+            ;
+          lc = n? xtrymalloc (sizeof *lc + n) : NULL;
+          if (lc)
+            {
+              learn_cache_t tmp;
+
+              for (lcp = &learn_cache; (tmp = *lcp); )
+                if (strlen (tmp->serialno) == n
+                    && !memcmp (tmp->serialno, s, n))
+                  {
+                    *lcp = tmp->next;
+                    free_strlist (tmp->lines);
+                    xfree (tmp);
+                  }
+                else
+                  lcp = &tmp->next;
+
+              memcpy (lc->serialno, s, n);
+              lc->serialno[n] = 0;
+              lc->eventcounter = counter;
+              lc->lines = parm.lines;
+              parm.lines = NULL;
+              lc->next = learn_cache;
+              learn_cache = lc;
+            }
+        }
+    }
+  free_strlist (parm.lines);
+  return err;
+}
+
+
 /* Perform the LEARN command and return a list of all private keys
    stored on the card. */
 int
@@ -641,9 +834,7 @@ agent_card_learn (ctrl_t ctrl,
   parm.certinfo_cb_arg = certinfo_cb_arg;
   parm.sinfo_cb = sinfo_cb;
   parm.sinfo_cb_arg = sinfo_cb_arg;
-  rc = assuan_transact (ctrl->scd_local->ctx, "LEARN --force",
-                        NULL, NULL, NULL, NULL,
-                        learn_status_cb, &parm);
+  rc = learn_with_cache (ctrl, learn_status_cb, &parm);
   if (rc)
     return unlock_scd (ctrl, rc);
 
@@ -833,6 +1024,9 @@ agent_card_pksign (ctrl_t ctrl,
   if (rc)
     return rc;
 
+  /* This may change the PIN retry or signature counters.  */
+  flush_learn_cache ();
+
   if (indatalen*2 + 50 > DIM(line))
     return unlock_scd (ctrl, gpg_error (GPG_ERR_GENERAL));
 
@@ -920,6 +1114,9 @@ agent_card_pkdecrypt (ctrl_t ctrl,
   if (rc)
     return rc;
 
+  /* This may change the PIN retry or signature counters.  */
+  flush_learn_cache ();
+
   /* FIXME: use secure memory where appropriate */
 
   for (len = 0; len < indatalen;)
@@ -1071,6 +1268,8 @@ agent_card_writekey (ctrl_t ctrl,  int force, const char *serialno,
   if (rc)
     return rc;
 
+  flush_learn_cache ();
+
   snprintf (line, DIM(line), "WRITEKEY %s%s", force ? "--force " : "", id);
   parms.ctx = ctrl->scd_local->ctx;
   parms.getpin_cb = getpin_cb;
@@ -1283,6 +1482,26 @@ pass_data_thru (void *opaque, const void *buffer, size_t length)
 }
 
 
+/* Return true if the scdaemon command CMDLINE does not change the
+   card so that the LEARN cache may be kept.  */
+static int
+is_readonly_scd_command (const char *cmdline)
+{
+  static const char *const names[] =
+    { "SERIALNO", "LEARN", "READCERT", "READKEY", "GETATTR", "GETINFO",
+      NULL };
+  size_t n;
+  int i;
+
+  for (n=0; cmdline[n] && !spacep (cmdline+n); n++)
+    ;
+  for (i=0; names[i]; i++)
+    if (strlen (names[i]) == n && !ascii_memcasecmp (cmdline, names[i], n))
+      return 1;
+  return 0;
+}
+
+
 /* Send the line CMDLINE with command for the SCDdaemon to it and send
    all status messages back.  This command is used as a general quoting
    mechanism to pass everything verbatim to SCDAEMON.  The PIN
@@ -1311,10 +1530,17 @@ agent_card_scd (ctrl_t ctrl, const char *cmdline,
 
   saveflag = assuan_get_flag (ctrl->scd_local->ctx, ASSUAN_CONVEY_COMMENTS);
   assuan_set_flag (ctrl->scd_local->ctx, ASSUAN_CONVEY_COMMENTS, 1);
-  rc = assuan_transact (ctrl->scd_local->ctx, cmdline,
-                        pass_data_thru, assuan_context,
-                        inq_needpin, &inqparm,
-                        pass_status_thru, assuan_context);
+  if (!strcmp (cmdline, "LEARN --force"))
+    rc = learn_with_cache (ctrl, pass_status_thru, assuan_context);
+  else
+    {
+      if (!is_readonly_scd_command (cmdline))
+        flush_learn_cache ();
+      rc = assuan_transact (ctrl->scd_local->ctx, cmdline,
+                            pass_data_thru, assuan_context,
+                            inq_needpin, &inqparm,
+                            pass_status_thru, assuan_context);
+    }
 
   assuan_set_flag (ctrl->scd_local->ctx, ASSUAN_CONVEY_COMMENTS, saveflag);
   if (rc)
@@ -42,6 +42,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <npth.h>
 #ifndef HAVE_W32_SYSTEM
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -223,6 +224,39 @@ struct ssh_control_file_s
 };
 
 
+/* An item of the cache of the identities listed in sshcontrol.  */
+struct identity_item_s
+{
+  struct identity_item_s *next;
+  char hexgrip[40+1];
+  time_t key_mtime;  /* The mtime and the size of the key file at the */
+  off_t key_size;    /* time BLOB was created.  */
+  char *blob;        /* NULL or the key as written by ssh_send_key_public.  */
+  size_t bloblen;
+};
+
+/* The cache of the enabled identities listed in sshcontrol.  This
+ * avoids parsing the sshcontrol file and the key files for each
+ * REQUEST_IDENTITIES: The list is valid as long as the mtime and size
+ * of sshcontrol do not change and a blob as long as those of its key
+ * file do not change.  In addition the serialized identities are
+ * kept as long as the key files serial of findkey.c does not change;
+ * this saves the check of the key files.  IDENTITY_LOCK protects the
+ * cache.  */
+static struct
+{
+  int valid;
+  time_t mtime;
+  off_t size;
+  struct identity_item_s *items;
+  unsigned int key_serial;  /* 0 or the serial for LIST.  */
+  char *list;               /* The serialized identities.  */
+  size_t listlen;
+  u32 listcount;            /* The number of identities in LIST.  */
+} identity_cache;
+static npth_mutex_t identity_lock;
+
+
 /* Prototypes.  */
 static gpg_error_t ssh_handler_request_identities (ctrl_t ctrl,
 						   estream_t request,
@@ -812,6 +846,34 @@ stream_copy (estream_t dst, estream_t src)
   return err;
 }
 
+/* Make sure that the identities are read again.  Due to the
+   non-preemptive threads this does not need IDENTITY_LOCK.  */
+static void
+invalidate_identity_cache (void)
+{
+  identity_cache.valid = 0;
+  identity_cache.key_serial = 0;
+}
+
+
+/* This function must be called once to initialize this module.  This
+   has to be done before a second thread is spawned.  */
+void
+initialize_module_command_ssh (void)
+{
+  static int initialized;
+  int err;
+
+  if (!initialized)
+    {
+      err = npth_mutex_init (&identity_lock, NULL);
+      if (err)
+        log_fatal ("failed to init mutex in %s: %s\n", __FILE__,strerror (err));
+      initialized = 1;
+    }
+}
+
+
 /* Open the ssh control file and create it if not available.  With
    APPEND passed as true the file will be opened in append mode,
    otherwise in read only mode.  On success 0 is returned and a new
@@ -1094,6 +1156,8 @@ add_control_entry (ctrl_t ctrl, ssh_key_type_spec_t *spec,
                tp->tm_hour, tp->tm_min, tp->tm_sec,
                fpr_md5, fpr_sha256, hexgrip, ttl, confirm? " confirm":"");
 
+      /* The mtime might not change within the same second.  */
+      invalidate_identity_cache ();
     }
  out:
   xfree (fpr_md5);
@@ -2583,6 +2647,256 @@ card_key_available (ctrl_t ctrl, gcry_sexp_t *r_pk, char **cardsn)
 */
 
 
+/* Release the list of identity ITEMS.  */
+static void
+release_identity_items (struct identity_item_s *items)
+{
+  struct identity_item_s *next;
+
+  for (; items; items = next)
+    {
+      next = items->next;
+      xfree (items->blob);
+      xfree (items);
+    }
+}
+
+
+/* Re-read the sshcontrol file if it has been changed since the last
+ * call.  The blobs of keys which are still listed are kept.  Must be
+ * called with IDENTITY_LOCK held.  */
+static gpg_error_t
+update_identity_list (void)
+{
+  gpg_error_t err;
+  ssh_control_file_t cf;
+  struct stat st;
+  struct identity_item_s *items = NULL;
+  struct identity_item_s **tail = &items;
+  struct identity_item_s *item, **pp;
+
+  err = open_control_file (&cf, 0);
+  if (err)
+    return err;
+
+  if (fstat (fileno (cf->fp), &st))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (identity_cache.valid
+      && identity_cache.mtime == st.st_mtime
+      && identity_cache.size == st.st_size)
+    goto leave;  /* Not changed.  */
+
+  while (!read_control_file_item (cf))
+    {
+      if (!cf->item.valid)
+        continue; /* Should not happen.  */
+      if (cf->item.disabled)
+        continue;
+      assert (strlen (cf->item.hexgrip) == 40);
+
+      /* Take the item from the old list or create a new one.  */
+      for (pp = &identity_cache.items; *pp; pp = &(*pp)->next)
+        if (!strcmp ((*pp)->hexgrip, cf->item.hexgrip))
+          break;
+      if (*pp)
+        {
+          item = *pp;
+          *pp = item->next;
+        }
+      else if (!(item = xtrycalloc (1, sizeof *item)))
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      else
+        strcpy (item->hexgrip, cf->item.hexgrip);
+      item->next = NULL;
+      *tail = item;
+      tail = &item->next;
+    }
+
+  release_identity_items (identity_cache.items);
+  identity_cache.items = items;
+  items = NULL;
+  identity_cache.key_serial = 0;
+  identity_cache.mtime = st.st_mtime;
+  identity_cache.size = st.st_size;
+  identity_cache.valid = 1;
+
+ leave:
+  release_identity_items (items);
+  close_control_file (cf);
+  return err;
+}
+
+
+/* Create the blob for the identity ITEM.  */
+static gpg_error_t
+load_identity (ctrl_t ctrl, struct identity_item_s *item)
+{
+  gpg_error_t err;
+  unsigned char grip[20];
+  char *fname;
+  struct stat st;
+  gcry_sexp_t key_public = NULL;
+  estream_t stream = NULL;
+  void *blob;
+  size_t bloblen;
+
+  /* Get the stamp first so that a concurrent change of the key file
+   * is detected with the next request.  */
+  fname = agent_key_file_name (item->hexgrip);
+  if (!fname)
+    return gpg_error_from_syserror ();
+  if (stat (fname, &st))
+    st.st_mtime = st.st_size = 0;
+  xfree (fname);
+
+  hex2bin (item->hexgrip, grip, sizeof (grip));
+  err = agent_public_key_from_file (ctrl, grip, &key_public);
+  if (err)
+    goto leave;
+
+  stream = es_fopenmem (0, "r+b");
+  if (!stream)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  err = ssh_send_key_public (stream, key_public, NULL);
+  if (err)
+    goto leave;
+  if (es_fclose_snatch (stream, &blob, &bloblen))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  stream = NULL;
+
+  /* Use our own allocator for the blob.  */
+  item->blob = xtrymalloc (bloblen + 1);
+  if (!item->blob)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      memcpy (item->blob, blob, bloblen);
+      item->bloblen = bloblen;
+      item->key_mtime = st.st_mtime;
+      item->key_size = st.st_size;
+    }
+  es_free (blob);
+
+ leave:
+  es_fclose (stream);
+  gcry_sexp_release (key_public);
+  return err;
+}
+
+
+/* Write the public keys of all enabled identities from sshcontrol to
+ * STREAM and add their number to R_COUNT.  */
+static gpg_error_t
+send_control_file_identities (ctrl_t ctrl, estream_t stream, u32 *r_count)
+{
+  gpg_error_t err;
+  struct identity_item_s *item;
+  char *fname;
+  struct stat st;
+  unsigned int key_serial;
+  membuf_t mb;
+  u32 count = 0;
+  int res;
+
+  res = npth_mutex_lock (&identity_lock);
+  if (res)
+    log_fatal ("failed to acquire identity mutex: %s\n", strerror (res));
+
+  key_serial = agent_key_files_serial ();
+  err = update_identity_list ();
+  if (err)
+    goto leave;
+
+  if (key_serial && identity_cache.key_serial == key_serial)
+    {
+      /* Nothing has changed - send the serialized list.  */
+      if (es_write (stream, identity_cache.list, identity_cache.listlen, NULL))
+        err = gpg_error_from_syserror ();
+      else
+        *r_count += identity_cache.listcount;
+      goto leave;
+    }
+
+  xfree (identity_cache.list);
+  identity_cache.list = NULL;
+  identity_cache.key_serial = 0;
+  init_membuf (&mb, 4096);
+  for (item = identity_cache.items; !err && item; item = item->next)
+    {
+      if (item->blob)
+        {
+          fname = agent_key_file_name (item->hexgrip);
+          if (!fname)
+            {
+              err = gpg_error_from_syserror ();
+              break;
+            }
+          if (stat (fname, &st)
+              || st.st_mtime != item->key_mtime
+              || st.st_size != item->key_size)
+            {
+              xfree (item->blob);
+              item->blob = NULL;
+            }
+          xfree (fname);
+        }
+
+      if (!item->blob)
+        {
+          err = load_identity (ctrl, item);
+          if (err)
+            {
+              log_error ("%s: key '%s' skipped: %s\n",
+                         SSH_CONTROL_FILE_NAME, item->hexgrip,
+                         gpg_strerror (err));
+              err = 0;
+              continue;
+            }
+        }
+
+      put_membuf (&mb, item->blob, item->bloblen);
+      count++;
+    }
+
+  identity_cache.list = get_membuf (&mb, &identity_cache.listlen);
+  if (!identity_cache.list)
+    {
+      if (!err)
+        err = gpg_error_from_syserror ();
+    }
+  else if (!err)
+    {
+      if (es_write (stream, identity_cache.list, identity_cache.listlen, NULL))
+        err = gpg_error_from_syserror ();
+      else
+        {
+          *r_count += count;
+          identity_cache.listcount = count;
+          identity_cache.key_serial = key_serial;
+        }
+    }
+
+ leave:
+  res = npth_mutex_unlock (&identity_lock);
+  if (res)
+    log_fatal ("failed to release identity mutex: %s\n", strerror (res));
+
+  return err;
+}
+
+
 /* Handler for the "request_identities" command.  */
 static gpg_error_t
 ssh_handler_request_identities (ctrl_t ctrl,
@@ -2593,7 +2907,6 @@ ssh_handler_request_identities (ctrl_t ctrl,
   gcry_sexp_t key_public;
   gpg_error_t err;
   int ret;
-  ssh_control_file_t cf = NULL;
   gpg_error_t ret_err;
 
   (void)request;
@@ -2666,40 +2979,10 @@ ssh_handler_request_identities (ctrl_t ctrl,
 
  scd_out:
   /* Then look at all the registered and non-disabled keys. */
-  err = open_control_file (&cf, 0);
+  err = send_control_file_identities (ctrl, key_blobs, &key_counter);
   if (err)
     goto out;
 
-  while (!read_control_file_item (cf))
-    {
-      unsigned char grip[20];
-
-      if (!cf->item.valid)
-        continue; /* Should not happen.  */
-      if (cf->item.disabled)
-        continue;
-      assert (strlen (cf->item.hexgrip) == 40);
-      hex2bin (cf->item.hexgrip, grip, sizeof (grip));
-
-      err = agent_public_key_from_file (ctrl, grip, &key_public);
-      if (err)
-        {
-          log_error ("%s:%d: key '%s' skipped: %s\n",
-                     cf->fname, cf->lnr, cf->item.hexgrip,
-                     gpg_strerror (err));
-          continue;
-        }
-
-      err = ssh_send_key_public (key_blobs, key_public, NULL);
-      if (err)
-        goto out;
-      gcry_sexp_release (key_public);
-      key_public = NULL;
-
-      key_counter++;
-    }
-  err = 0;
-
   ret = es_fseek (key_blobs, 0, SEEK_SET);
   if (ret)
     {
@@ -2726,7 +3009,6 @@ ssh_handler_request_identities (ctrl_t ctrl,
     }
 
   es_fclose (key_blobs);
-  close_control_file (cf);
 
   return ret_err;
 }
@@ -3282,6 +3564,7 @@ ssh_handler_add_identity (ctrl_t ctrl, estream_t request, estream_t response)
     goto out;
 
   err = ssh_identity_register (ctrl, &spec, key, ttl, confirm);
+  invalidate_identity_cache ();
 
  out:
 
@@ -3322,6 +3605,7 @@ ssh_handler_remove_identity (ctrl_t ctrl,
     goto out;
 
   err = ssh_identity_drop (key);
+  invalidate_identity_cache ();
 
  out:
 
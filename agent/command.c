@@ -33,7 +33,6 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
 
 #include "agent.h"
 #include <assuan.h>
@@ -42,10 +41,16 @@
 #include "../common/ssh-utils.h"
 #include "../common/asshelp.h"
 #include "../common/server-help.h"
+#include "../common/stats.h"
+#include "../common/tracepoint.h"
 
 
 /* Maximum allowed size of the inquired ciphertext.  */
 #define MAXLEN_CIPHERTEXT 4096
+/* Maximum allowed size of the hash list for PKSIGN --multi.  */
+#define MAXLEN_HASHLIST (256*1024)
+/* Maximum allowed size of the ciphertexts for PKDECRYPT --multi.  */
+#define MAXLEN_CIPHERTEXTLIST (1024*1024)
 /* Maximum allowed size of the key parameters.  */
 #define MAXLEN_KEYPARAM 1024
 /* Maximum allowed size of key data as used in inquiries (bytes). */
@@ -479,6 +484,15 @@ bump_card_eventcounter (void)
 }
 
 
+/* Return the current value of the card event counter.  This function
+   is assured not to do any context switches. */
+unsigned int
+get_card_eventcounter (void)
+{
+  return eventcounter.card;
+}
+
+
 
 
 static const char hlp_istrusted[] =
@@ -586,15 +600,30 @@ cmd_marktrusted (assuan_context_t ctx, char *line)
 
 static const char hlp_havekey[] =
   "HAVEKEY <hexstrings_with_keygrips>\n"
+  "HAVEKEY --list\n"
   "\n"
   "Return success if at least one of the secret keys with the given\n"
-  "keygrips is available.";
+  "keygrips is available.  With --list return all available keygrips\n"
+  "as binary data; each keygrip has 20 bytes.  This allows a client\n"
+  "to check the availability of many keys with one request.";
 static gpg_error_t
 cmd_havekey (assuan_context_t ctx, char *line)
 {
   gpg_error_t err;
   unsigned char buf[20];
 
+  if (has_option (line, "--list"))
+    {
+      unsigned char *grips;
+      size_t ngrips;
+
+      err = agent_list_keygrips (&grips, &ngrips);
+      if (!err && ngrips)
+        err = assuan_send_data (ctx, grips, ngrips * 20);
+      xfree (grips);
+      return leave_cmd (ctx, err);
+    }
+
   do
     {
       err = parse_keygrip (ctx, line, buf);
@@ -770,11 +799,92 @@ cmd_sethash (assuan_context_t ctx, char *line)
 }
 
 
+/* Parse the list of hashes for PKSIGN --multi in the string LIST.
+ * Each line has an algorithm number and a hex encoded hash as used
+ * by SETHASH.  On success an array is stored at R_HASHES and its
+ * length at R_NHASHES.  */
+static gpg_error_t
+parse_hash_list (assuan_context_t ctx, char *list,
+                 struct pksign_hash_s **r_hashes, unsigned int *r_nhashes)
+{
+  gpg_error_t err;
+  struct pksign_hash_s *hashes;
+  unsigned int nhashes, nalloc;
+  char *line, *next, *endp, *p;
+  size_t n;
+  int algo;
+
+  *r_hashes = NULL;
+  *r_nhashes = 0;
+
+  for (nalloc=1, p = list; (p = strchr (p, '\n')); p++)
+    nalloc++;
+  hashes = xtrycalloc (nalloc, sizeof *hashes);
+  if (!hashes)
+    return out_of_core ();
+
+  nhashes = 0;
+  for (line = list; line; line = next)
+    {
+      next = strchr (line, '\n');
+      if (next)
+        *next++ = 0;
+      trim_spaces (line);
+      if (!*line)
+        continue;
+
+      algo = (int)strtoul (line, &endp, 10);
+      for (line = endp; *line == ' ' || *line == '\t'; line++)
+        ;
+      if (!algo || algo == MD_USER_TLS_MD5SHA1 || gcry_md_test_algo (algo))
+        {
+          err = set_error (GPG_ERR_UNSUPPORTED_ALGORITHM, NULL);
+          goto leave;
+        }
+      err = parse_hexstring (ctx, line, &n);
+      if (err)
+        goto leave;
+      n /= 2;
+      if (n != 16 && n != 20 && n != 24
+          && n != 28 && n != 32 && n != 48 && n != 64)
+        {
+          err = set_error (GPG_ERR_ASS_PARAMETER,
+                           "unsupported length of hash");
+          goto leave;
+        }
+
+      hashes[nhashes].algo = algo;
+      hashes[nhashes].valuelen = n;
+      for (p=line, n=0; n < hashes[nhashes].valuelen; p += 2, n++)
+        hashes[nhashes].value[n] = xtoi_2 (p);
+      nhashes++;
+    }
+  err = 0;
+
+ leave:
+  if (err)
+    xfree (hashes);
+  else
+    {
+      *r_hashes = hashes;
+      *r_nhashes = nhashes;
+    }
+  return err;
+}
+
+
 static const char hlp_pksign[] =
-  "PKSIGN [<options>] [<cache_nonce>]\n"
+  "PKSIGN [--multi] [<cache_nonce>]\n"
   "\n"
   "Perform the actual sign operation.  Neither input nor output are\n"
-  "sensitive to eavesdropping.";
+  "sensitive to eavesdropping.\n"
+  "\n"
+  "With option --multi, the hash set by SETHASH is not used; instead\n"
+  "the server inquires HASHLIST.  This is a list of lines, each with\n"
+  "the algorithm number and the hex encoded hash as used by SETHASH.\n"
+  "All hashes are signed with the same key and the signatures are\n"
+  "returned as a sequence of canonical S-expressions in the order of\n"
+  "the hashes.";
 static gpg_error_t
 cmd_pksign (assuan_context_t ctx, char *line)
 {
@@ -784,7 +894,14 @@ cmd_pksign (assuan_context_t ctx, char *line)
   membuf_t outbuf;
   char *cache_nonce = NULL;
   char *p;
+  int opt_multi;
+  unsigned char *value;
+  size_t valuelen;
+  char *list;
+  struct pksign_hash_s *hashes = NULL;
+  unsigned int nhashes = 0;
 
+  opt_multi = has_option (line, "--multi");
   line = skip_options (line);
 
   for (p=line; *p && *p != ' ' && *p != '\t'; p++)
@@ -798,15 +915,45 @@ cmd_pksign (assuan_context_t ctx, char *line)
   else if (!ctrl->server_local->use_cache_for_signing)
     cache_mode = CACHE_MODE_IGNORE;
 
+  if (opt_multi)
+    {
+      err = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u",
+                                 MAXLEN_HASHLIST);
+      if (!err)
+        err = assuan_inquire (ctx, "HASHLIST", &value, &valuelen,
+                              MAXLEN_HASHLIST);
+      if (err)
+        goto leave;
+      list = xtrymalloc (valuelen + 1);
+      if (!list)
+        err = out_of_core ();
+      else
+        {
+          memcpy (list, value, valuelen);
+          list[valuelen] = 0;
+          err = parse_hash_list (ctx, list, &hashes, &nhashes);
+          xfree (list);
+        }
+      xfree (value);
+      if (err)
+        goto leave;
+    }
+
   init_membuf (&outbuf, 512);
 
-  err = agent_pksign (ctrl, cache_nonce, ctrl->server_local->keydesc,
-                      &outbuf, cache_mode);
+  if (opt_multi)
+    err = agent_pksign_multi (ctrl, cache_nonce, ctrl->server_local->keydesc,
+                              hashes, nhashes, &outbuf, cache_mode);
+  else
+    err = agent_pksign (ctrl, cache_nonce, ctrl->server_local->keydesc,
+                        &outbuf, cache_mode);
   if (err)
     clear_outbuf (&outbuf);
   else
     err = write_and_clear_outbuf (ctx, &outbuf);
 
+ leave:
+  xfree (hashes);
   xfree (cache_nonce);
   xfree (ctrl->server_local->keydesc);
   ctrl->server_local->keydesc = NULL;
@@ -815,10 +962,16 @@ cmd_pksign (assuan_context_t ctx, char *line)
 
 
 static const char hlp_pkdecrypt[] =
-  "PKDECRYPT [<options>]\n"
+  "PKDECRYPT [--multi]\n"
   "\n"
   "Perform the actual decrypt operation.  Input is not\n"
-  "sensitive to eavesdropping.";
+  "sensitive to eavesdropping.\n"
+  "\n"
+  "With option --multi the server inquires CIPHERTEXTLIST, a sequence\n"
+  "of canonical S-expressions, and decrypts all of them with the same\n"
+  "key.  The results are returned in the same order; a ciphertext\n"
+  "which can't be decrypted yields (5:error<n>:<code>) and a known\n"
+  "padding is given by (7:padding1:<n>) before the value.";
 static gpg_error_t
 cmd_pkdecrypt (assuan_context_t ctx, char *line)
 {
@@ -827,22 +980,39 @@ cmd_pkdecrypt (assuan_context_t ctx, char *line)
   unsigned char *value;
   size_t valuelen;
   membuf_t outbuf;
-  int padding;
+  int padding = -1;
+  int opt_multi;
 
-  (void)line;
+  opt_multi = has_option (line, "--multi");
 
   /* First inquire the data to decrypt */
-  rc = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u", MAXLEN_CIPHERTEXT);
-  if (!rc)
-    rc = assuan_inquire (ctx, "CIPHERTEXT",
-			&value, &valuelen, MAXLEN_CIPHERTEXT);
+  if (opt_multi)
+    {
+      rc = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u",
+                                MAXLEN_CIPHERTEXTLIST);
+      if (!rc)
+        rc = assuan_inquire (ctx, "CIPHERTEXTLIST",
+                             &value, &valuelen, MAXLEN_CIPHERTEXTLIST);
+    }
+  else
+    {
+      rc = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u",
+                                MAXLEN_CIPHERTEXT);
+      if (!rc)
+        rc = assuan_inquire (ctx, "CIPHERTEXT",
+                             &value, &valuelen, MAXLEN_CIPHERTEXT);
+    }
   if (rc)
     return rc;
 
   init_membuf (&outbuf, 512);
 
-  rc = agent_pkdecrypt (ctrl, ctrl->server_local->keydesc,
-                        value, valuelen, &outbuf, &padding);
+  if (opt_multi)
+    rc = agent_pkdecrypt_multi (ctrl, ctrl->server_local->keydesc,
+                                value, valuelen, &outbuf);
+  else
+    rc = agent_pkdecrypt (ctrl, ctrl->server_local->keydesc,
+                          value, valuelen, &outbuf, &padding);
   xfree (value);
   if (rc)
     clear_outbuf (&outbuf);
@@ -1264,7 +1434,8 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
   ctrl_t ctrl = assuan_get_pointer (ctx);
   int err;
   unsigned char grip[20];
-  DIR *dir = NULL;
+  unsigned char *grips = NULL;
+  size_t ngrips, idx;
   int list_mode;
   int opt_data, opt_ssh_fpr, opt_with_ssh;
   ssh_control_file_t cf = NULL;
@@ -1305,35 +1476,15 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
     }
   else if (list_mode)
     {
-      char *dirname;
-      struct dirent *dir_entry;
-
-      dirname = make_filename_try (gnupg_homedir (),
-                                   GNUPG_PRIVATE_KEYS_DIR, NULL);
-      if (!dirname)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
-      dir = opendir (dirname);
-      if (!dir)
-        {
-          err = gpg_error_from_syserror ();
-          xfree (dirname);
-          goto leave;
-        }
-      xfree (dirname);
+      /* Use the key index instead of reading the directory.  */
+      err = agent_list_keygrips (&grips, &ngrips);
+      if (err)
+        goto leave;
 
-      while ( (dir_entry = readdir (dir)) )
+      for (idx=0; idx < ngrips; idx++)
         {
-          if (strlen (dir_entry->d_name) != 44
-              || strcmp (dir_entry->d_name + 40, ".key"))
-            continue;
-          strncpy (hexgrip, dir_entry->d_name, 40);
-          hexgrip[40] = 0;
-
-          if ( hex2bin (hexgrip, grip, 20) < 0 )
-            continue; /* Bad hex string.  */
+          memcpy (grip, grips + idx * 20, 20);
+          bin2hex (grip, 20, hexgrip);
 
           disabled = ttl = confirm = is_ssh = 0;
           if (opt_with_ssh)
@@ -1375,8 +1526,7 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
 
  leave:
   ssh_close_control_file (cf);
-  if (dir)
-    closedir (dir);
+  xfree (grips);
   if (err && gpg_err_code (err) != GPG_ERR_NOT_FOUND)
     leave_cmd (ctx, err);
   return err;
@@ -3035,8 +3185,10 @@ static const char hlp_getinfo[] =
   "  std_startup_env - List the standard startup environment.\n"
   "  getenv NAME     - Return value of envvar NAME.\n"
   "  connections     - Return number of active connections.\n"
+  "  connection_queue - Return number of queued connections.\n"
   "  jent_active     - Returns OK if Libgcrypt's JENT is active.\n"
   "  restricted      - Returns OK if the connection is in restricted mode.\n"
+  "  stats           - Return the statistics as a JSON object.\n"
   "  cmd_has_option CMD OPT\n"
   "                  - Returns OK if command CMD has option OPT.\n";
 static gpg_error_t
@@ -3195,6 +3347,26 @@ cmd_getinfo (assuan_context_t ctx, char *line)
                 get_agent_active_connection_count ());
       rc = assuan_send_data (ctx, numbuf, strlen (numbuf));
     }
+  else if (!strcmp (line, "connection_queue"))
+    {
+      char numbuf[20];
+
+      snprintf (numbuf, sizeof numbuf, "%d",
+                get_agent_connection_queue_length ());
+      rc = assuan_send_data (ctx, numbuf, strlen (numbuf));
+    }
+  else if (!strcmp (line, "stats"))
+    {
+      char *buf = stats_to_json ();
+
+      if (!buf)
+        rc = gpg_error_from_syserror ();
+      else
+        {
+          rc = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
   else if (!strcmp (line, "jent_active"))
     {
 #if GCRYPT_VERSION_NUMBER >= 0x010800
@@ -3359,7 +3531,8 @@ post_cmd_notify (assuan_context_t ctx, gpg_error_t err)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
 
-  (void)err;
+  GNUPG_TRACE2 (agent_command_done, assuan_get_command_name (ctx),
+                gpg_err_code (err));
 
   /* Switch off any I/O monitor controlled logging pausing. */
   ctrl->server_local->pause_io_logging = 0;
@@ -3396,6 +3569,19 @@ io_monitor (assuan_context_t ctx, void *hook, int direction,
     }
 
 
+#ifdef ENABLE_TRACEPOINTS
+  /* Only the command name is passed so that no data of the command
+   * is exposed to the tracer.  */
+  if (ctx && direction == ASSUAN_IO_FROM_PEER)
+    {
+      size_t n;
+
+      for (n=0; n < linelen && line[n] != ' '; n++)
+        ;
+      GNUPG_TRACE2 (agent_command, line, n);
+    }
+#endif /*ENABLE_TRACEPOINTS*/
+
   /* Do not log self-connections.  This makes the log cleaner because
    * we won't see the check-our-own-socket calls.  */
   if (ctx && ctrl->server_local->connect_from_self)
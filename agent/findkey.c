@@ -29,6 +29,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <assert.h>
 #include <npth.h> /* (we use pth_sleep) */
 
@@ -36,6 +37,7 @@
 #include "../common/i18n.h"
 #include "../common/ssh-utils.h"
 #include "../common/name-value.h"
+#include "../common/sysutils.h"
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -51,6 +53,232 @@ struct try_unprotect_arg_s
                           user should change the passphrase.  */
 };
 
+/* A counter bumped for each change of the key files.  See
+ * agent_key_files_serial.  */
+static unsigned int key_files_serial = 1;
+
+
+/* Return true if NAME is the name of a fan-out subdirectory.  */
+static int
+is_fanout_dirname (const char *name)
+{
+  return (name[0] && strchr ("0123456789ABCDEF", name[0])
+          && name[1] && strchr ("0123456789ABCDEF", name[1])
+          && !name[2]);
+}
+
+
+/* Return true if NAME is the name of a key file.  */
+static int
+is_key_filename (const char *name)
+{
+  return strlen (name) == 44 && !strcmp (name + 40, ".key");
+}
+
+
+/* Return the file name for the key with the keygrip HEXGRIP, which
+ * must be 40 hex digits.  If FANOUT is set the name in the fan-out
+ * subdirectory, which is named after the first two digits of the
+ * keygrip, is returned; otherwise the name in the private key
+ * directory itself.  Returns NULL on error.  */
+static char *
+make_key_fname (const char *hexgrip, int fanout)
+{
+  char keyname[40+4+1];
+  char subdir[3];
+
+  memcpy (keyname, hexgrip, 40);
+  strcpy (keyname+40, ".key");
+  if (!fanout)
+    return make_filename_try (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
+                              keyname, NULL);
+  subdir[0] = hexgrip[0];
+  subdir[1] = hexgrip[1];
+  subdir[2] = 0;
+  return make_filename_try (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
+                            subdir, keyname, NULL);
+}
+
+
+/* Make sure that the directory of the file FNAME exists.  */
+static gpg_error_t
+create_key_dir (const char *fname)
+{
+  gpg_error_t err;
+  char *dirname;
+  char *p;
+
+  dirname = xtrystrdup (fname);
+  if (!dirname)
+    return gpg_error_from_syserror ();
+  p = strrchr (dirname, '/');
+  if (p)
+    *p = 0;
+  if (access (dirname, F_OK) && gnupg_mkdir (dirname, "-rwx")
+      && errno != EEXIST)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't create directory '%s': %s\n"),
+                 dirname, gpg_strerror (err));
+      xfree (dirname);
+      return err;
+    }
+  xfree (dirname);
+  return 0;
+}
+
+
+/* Move the key file OLDNAME to NEWNAME, which is either its fan-out
+ * name or its name in the private key directory itself.  */
+static gpg_error_t
+move_key_file (const char *oldname, const char *newname)
+{
+  gpg_error_t err;
+
+  err = create_key_dir (newname);
+  if (!err)
+    err = gnupg_rename_file (oldname, newname, NULL);
+  if (err)
+    log_error ("error moving '%s' to '%s': %s\n",
+               oldname, newname, gpg_strerror (err));
+  else
+    key_files_serial++;
+  return err;
+}
+
+
+/* Move all key files from the fan-out subdirectory SUBDIR of the
+ * private key directory DIRNAME back to DIRNAME and remove SUBDIR if
+ * it is then empty.  Returns the number of moved files.  */
+static unsigned int
+unfan_key_subdir (const char *dirname, const char *subdir)
+{
+  char *subdirname, *oldname, *newname;
+  DIR *dir;
+  struct dirent *dir_entry;
+  unsigned int count = 0;
+
+  subdirname = make_filename_try (dirname, subdir, NULL);
+  if (!subdirname)
+    return 0;
+  dir = opendir (subdirname);
+  if (!dir)
+    {
+      xfree (subdirname);
+      return 0;
+    }
+
+  while ((dir_entry = readdir (dir)))
+    {
+      if (!is_key_filename (dir_entry->d_name))
+        continue;
+      oldname = make_filename_try (subdirname, dir_entry->d_name, NULL);
+      newname = make_key_fname (dir_entry->d_name, 0);
+      if (oldname && newname && access (newname, F_OK)
+          && !move_key_file (oldname, newname))
+        count++;
+      xfree (oldname);
+      xfree (newname);
+    }
+  closedir (dir);
+  rmdir (subdirname);  /* Fails if not empty.  */
+  xfree (subdirname);
+  return count;
+}
+
+
+/* With --private-keys-fanout move all key files from the private key
+ * directory into their fan-out subdirectories.  Without that option
+ * move the key files from the subdirectories back so that older
+ * versions and other tools find them again.  This is done only once;
+ * key files showing up later are moved when they are looked up.  */
+static void
+migrate_key_files (void)
+{
+  static int done;
+  char *dirname, *oldname, *newname;
+  DIR *dir;
+  struct dirent *dir_entry;
+  unsigned int count = 0;
+  int fanout = opt.private_keys_fanout;
+
+  if (done)
+    return;
+  done = 1;
+
+  dirname = make_filename_try (gnupg_homedir (),
+                               GNUPG_PRIVATE_KEYS_DIR, NULL);
+  if (!dirname)
+    return;
+  dir = opendir (dirname);
+  if (!dir)
+    {
+      xfree (dirname);
+      return;
+    }
+
+  while ((dir_entry = readdir (dir)))
+    {
+      if (!fanout)
+        {
+          if (is_fanout_dirname (dir_entry->d_name))
+            count += unfan_key_subdir (dirname, dir_entry->d_name);
+          continue;
+        }
+      if (!is_key_filename (dir_entry->d_name))
+        continue;
+      oldname = make_filename_try (dirname, dir_entry->d_name, NULL);
+      newname = make_key_fname (dir_entry->d_name, 1);
+      if (oldname && newname && access (newname, F_OK)
+          && !move_key_file (oldname, newname))
+        count++;
+      xfree (oldname);
+      xfree (newname);
+    }
+  closedir (dir);
+  if (count && fanout)
+    log_info ("%u key files moved to subdirectories of '%s'\n",
+              count, dirname);
+  else if (count)
+    log_info ("%u key files moved back from subdirectories of '%s'\n",
+              count, dirname);
+  xfree (dirname);
+}
+
+
+/* Return the name of the file for the key with the keygrip HEXGRIP,
+ * which must be 40 hex digits.  The name of an existing key file is
+ * returned, either from the private key directory itself or from its
+ * fan-out subdirectory; if no such file exists the name to be used
+ * for a new key is returned.  A key file found at the other place
+ * is moved to the place given by --private-keys-fanout.  Returns NULL
+ * on error.  */
+char *
+agent_key_file_name (const char *hexgrip)
+{
+  int fanout = opt.private_keys_fanout;
+  char *fname, *other;
+
+  migrate_key_files ();
+
+  fname = make_key_fname (hexgrip, fanout);
+  if (!fname || !access (fname, F_OK))
+    return fname;
+  other = make_key_fname (hexgrip, !fanout);
+  if (!other || access (other, F_OK))
+    {
+      xfree (other);
+      return fname;  /* Not found - use the preferred name.  */
+    }
+  if (!move_key_file (other, fname))
+    {
+      xfree (other);
+      return fname;
+    }
+  xfree (fname);
+  return other;
+}
+
 
 /* Note: Ownership of FNAME and FP are moved to this function.  */
 static gpg_error_t
@@ -93,6 +321,11 @@ write_extended_private_key (char *fname, estream_t fp, int update,
   if (err)
     goto leave;
 
+  /* Shadowed keys are for example written again each time a card
+   * is learned.  There is no need to rewrite an unchanged file.  */
+  if (update && !nvc_modified (pk))
+    goto leave;
+
   err = es_fseek (fp, 0, SEEK_SET);
   if (err)
     goto leave;
@@ -144,13 +377,16 @@ agent_write_private_key (const unsigned char *grip,
 {
   char *fname;
   estream_t fp;
-  char hexgrip[40+4+1];
+  char hexgrip[40+1];
+  gpg_error_t tmperr;
 
   bin2hex (grip, 20, hexgrip);
-  strcpy (hexgrip+40, ".key");
+  agent_clear_cache_key (hexgrip);
+  key_files_serial++;
 
-  fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
-                         hexgrip, NULL);
+  fname = agent_key_file_name (hexgrip);
+  if (!fname)
+    return gpg_error_from_syserror ();
 
   /* FIXME: Write to a temp file first so that write failures during
      key updates won't lead to a key loss.  */
@@ -162,10 +398,20 @@ agent_write_private_key (const unsigned char *grip,
       return gpg_error (GPG_ERR_EEXIST);
     }
 
+  if (opt.private_keys_fanout)
+    {
+      tmperr = create_key_dir (fname);
+      if (tmperr)
+        {
+          xfree (fname);
+          return tmperr;
+        }
+    }
+
   fp = es_fopen (fname, force? "rb+,mode=-rw" : "wbx,mode=-rw");
   if (!fp)
     {
-      gpg_error_t tmperr = gpg_error_from_syserror ();
+      tmperr = gpg_error_from_syserror ();
 
       if (force && gpg_err_code (tmperr) == GPG_ERR_ENOENT)
         {
@@ -685,28 +931,40 @@ unprotect (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
 
 
 /* Read the key identified by GRIP from the private key directory and
-   return it as an gcrypt S-expression object in RESULT.  On failure
-   returns an error code and stores NULL at RESULT. */
+   return it as an gcrypt S-expression object in RESULT.  If R_KEYBUF
+   is not NULL the key is also returned as a canonical encoded
+   S-expression in a newly allocated buffer at R_KEYBUF and its length
+   at R_KEYBUFLEN; RESULT may be NULL if only that buffer is needed.
+   Because key files are usually stored in canonical format, the
+   buffer is then returned as read without parsing the key into an
+   object.  On failure returns an error code and stores NULL at
+   RESULT and R_KEYBUF. */
 static gpg_error_t
-read_key_file (const unsigned char *grip, gcry_sexp_t *result)
+read_key_file (const unsigned char *grip, gcry_sexp_t *result,
+               unsigned char **r_keybuf, size_t *r_keybuflen)
 {
   gpg_error_t err;
   char *fname;
   estream_t fp;
   struct stat st;
   unsigned char *buf;
-  size_t buflen, erroff;
-  gcry_sexp_t s_skey;
-  char hexgrip[40+4+1];
+  size_t buflen, erroff, canonlen;
+  gcry_sexp_t s_skey = NULL;
+  char hexgrip[40+1];
   char first;
 
-  *result = NULL;
+  if (result)
+    *result = NULL;
+  if (r_keybuf)
+    {
+      *r_keybuf = NULL;
+      *r_keybuflen = 0;
+    }
 
   bin2hex (grip, 20, hexgrip);
-  strcpy (hexgrip+40, ".key");
-
-  fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
-                         hexgrip, NULL);
+  fname = agent_key_file_name (hexgrip);
+  if (!fname)
+    return gpg_error_from_syserror ();
   fp = es_fopen (fname, "rb");
   if (!fp)
     {
@@ -750,13 +1008,19 @@ read_key_file (const unsigned char *grip, gcry_sexp_t *result)
                    fname, line, gpg_strerror (err));
       else
         {
-          err = nvc_get_private_key (pk, result);
+          err = nvc_get_private_key (pk, &s_skey);
           nvc_release (pk);
           if (err)
             log_error ("error getting private key from '%s': %s\n",
                        fname, gpg_strerror (err));
         }
+      if (!err && r_keybuf)
+        err = make_canon_sexp (s_skey, r_keybuf, r_keybuflen);
 
+      if (!err && result)
+        *result = s_skey;
+      else
+        gcry_sexp_release (s_skey);
       xfree (fname);
       return err;
     }
@@ -795,18 +1059,47 @@ read_key_file (const unsigned char *grip, gcry_sexp_t *result)
       return err;
     }
 
-  /* Convert the file into a gcrypt S-expression object.  */
-  err = gcry_sexp_sscan (&s_skey, &erroff, (char*)buf, buflen);
   xfree (fname);
   es_fclose (fp);
-  xfree (buf);
-  if (err)
+
+  /* Convert the file into a gcrypt S-expression object.  This is not
+   * required if only the canonical encoding is requested and the file
+   * is already in that format.  */
+  canonlen = gcry_sexp_canon_len (buf, buflen, NULL, NULL);
+  if (result || !canonlen)
     {
-      log_error ("failed to build S-Exp (off=%u): %s\n",
-                 (unsigned int)erroff, gpg_strerror (err));
-      return err;
+      err = gcry_sexp_sscan (&s_skey, &erroff, (char*)buf, buflen);
+      if (err)
+        {
+          log_error ("failed to build S-Exp (off=%u): %s\n",
+                     (unsigned int)erroff, gpg_strerror (err));
+          xfree (buf);
+          return err;
+        }
     }
-  *result = s_skey;
+
+  if (r_keybuf && canonlen)
+    {
+      *r_keybuf = buf;
+      *r_keybuflen = canonlen;
+      buf = NULL;
+    }
+  else if (r_keybuf)
+    {
+      err = make_canon_sexp (s_skey, r_keybuf, r_keybuflen);
+      if (err)
+        {
+          xfree (buf);
+          gcry_sexp_release (s_skey);
+          return err;
+        }
+    }
+  xfree (buf);
+
+  if (result)
+    *result = s_skey;
+  else
+    gcry_sexp_release (s_skey);
   return 0;
 }
 
@@ -817,12 +1110,14 @@ remove_key_file (const unsigned char *grip)
 {
   gpg_error_t err = 0;
   char *fname;
-  char hexgrip[40+4+1];
+  char hexgrip[40+1];
 
   bin2hex (grip, 20, hexgrip);
-  strcpy (hexgrip+40, ".key");
-  fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
-                         hexgrip, NULL);
+  agent_clear_cache_key (hexgrip);
+  key_files_serial++;
+  fname = agent_key_file_name (hexgrip);
+  if (!fname)
+    return gpg_error_from_syserror ();
   if (gnupg_remove (fname))
     err = gpg_error_from_syserror ();
   xfree (fname);
@@ -856,6 +1151,8 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
   unsigned char *buf;
   size_t len, buflen, erroff;
   gcry_sexp_t s_skey;
+  char hexgrip[2*KEYGRIP_LEN+1];
+  int use_key_cache;
 
   *result = NULL;
   if (shadow_info)
@@ -863,7 +1160,33 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
   if (r_passphrase)
     *r_passphrase = NULL;
 
-  err = read_key_file (grip, &s_skey);
+  /* With --enable-private-key-cache we first try the cache of
+   * unprotected keys.  A caller asking for the passphrase needs the
+   * real thing.  */
+  use_key_cache = (opt.enable_private_key_cache && !r_passphrase
+                   && cache_mode != CACHE_MODE_IGNORE);
+  if (use_key_cache)
+    {
+      bin2hex (grip, KEYGRIP_LEN, hexgrip);
+      buf = agent_get_cache_key (ctrl, hexgrip, cache_mode);
+      if (buf)
+        {
+          buflen = gcry_sexp_canon_len (buf, 0, NULL, NULL);
+          err = gcry_sexp_sscan (&s_skey, &erroff, (char*)buf, buflen);
+          wipememory (buf, buflen);
+          xfree (buf);
+          if (!err)
+            {
+              *result = s_skey;
+              return 0;
+            }
+          agent_clear_cache_key (hexgrip);
+        }
+    }
+
+  /* For use with the protection functions we also need the key as an
+     canonical encoded S-expression in a buffer.  */
+  err = read_key_file (grip, &s_skey, &buf, &len);
   if (err)
     {
       if (gpg_err_code (err) == GPG_ERR_ENOENT)
@@ -871,13 +1194,6 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
       return err;
     }
 
-  /* For use with the protection functions we also need the key as an
-     canonical encoded S-expression in a buffer.  Create this buffer
-     now.  */
-  err = make_canon_sexp (s_skey, &buf, &len);
-  if (err)
-    return err;
-
   switch (agent_private_key_type (buf))
     {
     case PRIVATE_KEY_CLEAR:
@@ -934,6 +1250,7 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
       }
       break;
     case PRIVATE_KEY_SHADOWED:
+      use_key_cache = 0;  /* Nothing to cache.  */
       if (shadow_info)
         {
           const unsigned char *s;
@@ -977,6 +1294,10 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
       return err;
     }
 
+  if (use_key_cache)
+    agent_put_cache_key (ctrl, hexgrip, cache_mode, buf,
+                         lookup_ttl? lookup_ttl (hexgrip) : 0);
+
   buflen = gcry_sexp_canon_len (buf, 0, NULL, NULL);
   err = gcry_sexp_sscan (&s_skey, &erroff, (char*)buf, buflen);
   wipememory (buf, buflen);
@@ -1193,7 +1514,7 @@ agent_raw_key_from_file (ctrl_t ctrl, const unsigned char *grip,
 
   *result = NULL;
 
-  err = read_key_file (grip, &s_skey);
+  err = read_key_file (grip, &s_skey, NULL, NULL);
   if (!err)
     *result = s_skey;
   return err;
@@ -1231,7 +1552,7 @@ agent_public_key_from_file (ctrl_t ctrl,
 
   *result = NULL;
 
-  err = read_key_file (grip, &s_skey);
+  err = read_key_file (grip, &s_skey, NULL, NULL);
   if (err)
     return err;
 
@@ -1332,6 +1653,196 @@ agent_public_key_from_file (ctrl_t ctrl,
 
 
 
+/* qsort and bsearch compare function for keygrips.  */
+static int
+cmp_keygrips (const void *a, const void *b)
+{
+  return memcmp (a, b, 20);
+}
+
+
+/* An index with the keygrips of all key files in the private key
+ * directory and its fan-out subdirectories.  It is kept up to date
+ * using an inotify watch on these directories; if no watch can be
+ * created, the index is not used.
+ * No locking is required because we don't call any npth function
+ * while updating the index.  */
+static struct
+{
+  int valid;               /* The index is up to date.  */
+  unsigned char *grips;    /* NGRIPS sorted keygrips of 20 bytes.  */
+  size_t ngrips;
+} keyindex;
+static int keyindex_fd = -1;  /* The inotify handle.  */
+
+
+/* Append the keygrips of the key files in the directory DIRNAME to
+ * the array at R_GRIPS which has R_SIZE slots of which R_NGRIPS are
+ * used.  If TOPLEVEL is set, the fan-out subdirectories are read as
+ * well; if WATCH_FD is not -1 they are then also added to that
+ * inotify handle.  */
+static gpg_error_t
+read_keygrips_dir (const char *dirname, int toplevel, int watch_fd,
+                   unsigned char **r_grips, size_t *r_ngrips,
+                   size_t *r_size)
+{
+  gpg_error_t err = 0;
+  DIR *dir;
+  struct dirent *dir_entry;
+  unsigned char *tmp;
+  char *subdir;
+  char hexgrip[41];
+
+  dir = opendir (dirname);
+  if (!dir)
+    return gpg_error_from_syserror ();
+
+  while ((dir_entry = readdir (dir)))
+    {
+      if (toplevel && is_fanout_dirname (dir_entry->d_name))
+        {
+          subdir = make_filename_try (dirname, dir_entry->d_name, NULL);
+          if (!subdir)
+            {
+              err = gpg_error_from_syserror ();
+              goto leave;
+            }
+          if (watch_fd != -1)
+            err = gnupg_inotify_add_dir (watch_fd, subdir);
+          if (!err)
+            err = read_keygrips_dir (subdir, 0, -1,
+                                     r_grips, r_ngrips, r_size);
+          xfree (subdir);
+          if (gpg_err_code (err) == GPG_ERR_ENOTDIR)
+            err = 0;
+          if (err)
+            goto leave;
+          continue;
+        }
+      if (!is_key_filename (dir_entry->d_name))
+        continue;
+      if (*r_ngrips == *r_size)
+        {
+          *r_size = *r_size? *r_size * 2 : 256;
+          tmp = xtryrealloc (*r_grips, *r_size * 20);
+          if (!tmp)
+            {
+              err = gpg_error_from_syserror ();
+              goto leave;
+            }
+          *r_grips = tmp;
+        }
+      /* hex2bin does not accept the ".key" suffix.  */
+      memcpy (hexgrip, dir_entry->d_name, 40);
+      hexgrip[40] = 0;
+      if (hex2bin (hexgrip, *r_grips + *r_ngrips * 20, 20) == 40)
+        (*r_ngrips)++;
+    }
+
+ leave:
+  closedir (dir);
+  return err;
+}
+
+
+/* Read the private key directory and store an allocated array with the
+ * sorted keygrips of all key files at R_GRIPS and their number at
+ * R_NGRIPS.  If WATCH_FD is not -1 the fan-out subdirectories are
+ * added to that inotify handle.  */
+static gpg_error_t
+read_keygrips (int watch_fd, unsigned char **r_grips, size_t *r_ngrips)
+{
+  gpg_error_t err;
+  char *dirname;
+  unsigned char *grips = NULL;
+  size_t ngrips = 0;
+  size_t size = 0;
+  size_t i, n;
+
+  *r_grips = NULL;
+  *r_ngrips = 0;
+
+  dirname = make_filename_try (gnupg_homedir (),
+                               GNUPG_PRIVATE_KEYS_DIR, NULL);
+  if (!dirname)
+    return gpg_error_from_syserror ();
+  err = read_keygrips_dir (dirname, 1, watch_fd, &grips, &ngrips, &size);
+  xfree (dirname);
+  if (err)
+    {
+      xfree (grips);
+      return err;
+    }
+
+  if (ngrips > 1)
+    {
+      qsort (grips, ngrips, 20, cmp_keygrips);
+      /* A key may show up in both places while it is moved.  */
+      for (i=n=1; i < ngrips; i++)
+        if (memcmp (grips + (n-1) * 20, grips + i * 20, 20))
+          memmove (grips + n++ * 20, grips + i * 20, 20);
+      ngrips = n;
+    }
+  *r_grips = grips;
+  *r_ngrips = ngrips;
+  return 0;
+}
+
+
+/* Make sure that the key index is up to date.  Returns an error if
+ * the index can't be used.  */
+static gpg_error_t
+update_keyindex (void)
+{
+  gpg_error_t err;
+  char *dirname;
+
+  if (keyindex_fd != -1 && gnupg_inotify_pending (keyindex_fd))
+    {
+      /* Start over with a new watch so that a removed and re-created
+       * directory is also handled.  */
+      close (keyindex_fd);
+      keyindex_fd = -1;
+      keyindex.valid = 0;
+      key_files_serial++;
+    }
+  if (keyindex.valid)
+    return 0;
+
+  migrate_key_files ();
+
+  xfree (keyindex.grips);
+  keyindex.grips = NULL;
+  keyindex.ngrips = 0;
+
+  /* Create the watch before reading the directory so that we do not
+   * miss any change.  */
+  if (keyindex_fd == -1)
+    {
+      dirname = make_filename_try (gnupg_homedir (),
+                                   GNUPG_PRIVATE_KEYS_DIR, NULL);
+      if (!dirname)
+        return gpg_error_from_syserror ();
+      err = gnupg_inotify_watch_dir (&keyindex_fd, dirname);
+      xfree (dirname);
+      if (err)
+        return err;
+    }
+
+  err = read_keygrips (keyindex_fd, &keyindex.grips, &keyindex.ngrips);
+  if (err)
+    {
+      close (keyindex_fd);
+      keyindex_fd = -1;
+      return err;
+    }
+  keyindex.valid = 1;
+  if (DBG_CACHE)
+    log_debug ("keyindex: %u keys\n", (unsigned int)keyindex.ngrips);
+  return 0;
+}
+
+
 /* Check whether the secret key identified by GRIP is available.
    Returns 0 is the key is available.  */
 int
@@ -1339,19 +1850,60 @@ agent_key_available (const unsigned char *grip)
 {
   int result;
   char *fname;
-  char hexgrip[40+4+1];
+  char hexgrip[40+1];
 
-  bin2hex (grip, 20, hexgrip);
-  strcpy (hexgrip+40, ".key");
+  if (!update_keyindex ())
+    return bsearch (grip, keyindex.grips, keyindex.ngrips, 20,
+                    cmp_keygrips)? 0 : -1;
 
-  fname = make_filename (gnupg_homedir (), GNUPG_PRIVATE_KEYS_DIR,
-                         hexgrip, NULL);
+  bin2hex (grip, 20, hexgrip);
+  fname = agent_key_file_name (hexgrip);
+  if (!fname)
+    return -1;
   result = !access (fname, R_OK)? 0 : -1;
   xfree (fname);
   return result;
 }
 
 
+/* Store an allocated array with the keygrips of all available secret
+ * keys at R_GRIPS and their number at R_NGRIPS.  Each keygrip is 20
+ * bytes and the array is sorted.  */
+gpg_error_t
+agent_list_keygrips (unsigned char **r_grips, size_t *r_ngrips)
+{
+  *r_grips = NULL;
+  *r_ngrips = 0;
+
+  if (update_keyindex ())
+    return read_keygrips (-1, r_grips, r_ngrips);
+
+  if (keyindex.ngrips)
+    {
+      *r_grips = xtrymalloc (keyindex.ngrips * 20);
+      if (!*r_grips)
+        return gpg_error_from_syserror ();
+      memcpy (*r_grips, keyindex.grips, keyindex.ngrips * 20);
+      *r_ngrips = keyindex.ngrips;
+    }
+  return 0;
+}
+
+
+
+/* Return a number which changes whenever a key file has been created,
+ * written, renamed or removed.  Returns 0 if changes by other
+ * processes can't be detected; in this case the caller needs to check
+ * the files itself.  Note that an in-place modification of a key
+ * file by another process is not detected.  */
+unsigned int
+agent_key_files_serial (void)
+{
+  if (update_keyindex ())
+    return 0;
+  return key_files_serial;
+}
+
 
 /* Return the information about the secret key specified by the binary
    keygrip GRIP.  If the key is a shadowed one the shadow information
@@ -1373,22 +1925,14 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
   if (r_shadow_info)
     *r_shadow_info = NULL;
 
-  {
-    gcry_sexp_t sexp;
-
-    err = read_key_file (grip, &sexp);
-    if (err)
-      {
-        if (gpg_err_code (err) == GPG_ERR_ENOENT)
-          return gpg_error (GPG_ERR_NOT_FOUND);
-        else
-          return err;
-      }
-    err = make_canon_sexp (sexp, &buf, &len);
-    gcry_sexp_release (sexp);
-    if (err)
-      return err;
-  }
+  err = read_key_file (grip, NULL, &buf, &len);
+  if (err)
+    {
+      if (gpg_err_code (err) == GPG_ERR_ENOENT)
+        return gpg_error (GPG_ERR_NOT_FOUND);
+      else
+        return err;
+    }
 
   keytype = agent_private_key_type (buf);
   switch (keytype)
@@ -1460,16 +2004,12 @@ agent_delete_key (ctrl_t ctrl, const char *desc_text,
   char *default_desc = NULL;
   int key_type;
 
-  err = read_key_file (grip, &s_skey);
+  err = read_key_file (grip, &s_skey, &buf, &len);
   if (gpg_err_code (err) == GPG_ERR_ENOENT)
     err = gpg_error (GPG_ERR_NO_SECKEY);
   if (err)
     goto leave;
 
-  err = make_canon_sexp (s_skey, &buf, &len);
-  if (err)
-    goto leave;
-
   key_type = agent_private_key_type (buf);
   if (only_stubs && key_type != PRIVATE_KEY_SHADOWED)
     {
@@ -25,11 +25,67 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <npth.h>
 
 #include "agent.h"
 #include "../common/i18n.h"
 #include "../common/exechelp.h"
 #include "../common/sysutils.h"
+#include "../common/check-pattern.h"
+
+/* The number of different key parameters for which keys are
+   pre-generated and the maximum number of keys kept for each.  */
+#define KEYGEN_POOL_CLASSES  4
+#define KEYGEN_POOL_MAX     64
+
+
+/* The pool of pre-generated keys.  A class is created for the key
+   parameters of each GENKEY request for a slow to generate key; if
+   there are more, the least recently used class is replaced.  The
+   keys are S-expressions as returned by gcry_pk_genkey and thus the
+   secret parts are stored in secure memory.  */
+struct keygen_class_s
+{
+  char *keyparam;            /* The key parameters in canonical format. */
+  size_t keyparamlen;
+  unsigned long used;        /* Value of KEYGEN_POOL_TICK at last use.  */
+  size_t keysize;            /* Size of the last generated key.  */
+  unsigned int nkeys;
+  gcry_sexp_t keys[KEYGEN_POOL_MAX];
+};
+static struct keygen_class_s keygen_pool[KEYGEN_POOL_CLASSES];
+
+/* A counter to track the least recently used class.  */
+static unsigned long keygen_pool_tick;
+
+/* Incremented with each flush and each replacement of a class so
+   that the generator thread can detect that the pool has been
+   changed while it was busy.  */
+static unsigned int keygen_pool_serial;
+
+/* Lock and condition to wake up the generator thread.  */
+static npth_mutex_t keygen_pool_lock;
+static npth_cond_t keygen_pool_cond;
+static int keygen_thread_running;
+
+/* The generator thread; only valid if KEYGEN_POOL_HAVE_TID is set.  */
+static npth_t keygen_pool_tid;
+static int keygen_pool_have_tid;
+
+#ifndef DISABLE_REGEX
+/* The compiled pattern file of --check-passphrase-pattern.  The file
+   is compiled on first use and again only if its name, size or
+   modification time changes.  */
+static struct
+{
+  char *fname;
+  time_t mtime;
+  off_t size;
+  pattern_list_t list;
+} pattern_cache;
+#endif /*!DISABLE_REGEX*/
 
 static int
 store_key (gcry_sexp_t private, const char *passphrase, int force,
@@ -89,6 +145,98 @@ nonalpha_count (const char *s)
 }
 
 
+#ifndef DISABLE_REGEX
+/* Return the compiled pattern list for FNAME from the cache or load
+   it.  Returns NULL on error.  */
+static pattern_list_t
+get_passphrase_pattern (const char *fname)
+{
+  gpg_error_t err;
+  struct stat st;
+  estream_t fp;
+  char *buf = NULL;
+  size_t buflen, nread;
+  pattern_list_t list;
+
+  if (stat (fname, &st))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("can't stat '%s': %s\n", fname, gpg_strerror (err));
+      return NULL;
+    }
+
+  if (pattern_cache.list && !strcmp (pattern_cache.fname, fname)
+      && pattern_cache.mtime == st.st_mtime
+      && pattern_cache.size == st.st_size)
+    return pattern_cache.list;
+
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("can't open '%s': %s\n", fname, gpg_strerror (err));
+      return NULL;
+    }
+  buflen = st.st_size;
+  buf = xtrymalloc (buflen + 1);
+  if (!buf)
+    err = gpg_error_from_syserror ();
+  else if (es_read (fp, buf, buflen, &nread))
+    err = gpg_error_from_syserror ();
+  else if (nread != buflen)
+    err = gpg_error (GPG_ERR_EOF);
+  else
+    err = 0;
+  es_fclose (fp);
+  if (!err)
+    err = check_pattern_compile (buf, buflen, &list);
+  xfree (buf);
+  if (err)
+    {
+      log_error ("error loading '%s': %s\n", fname, gpg_strerror (err));
+      return NULL;
+    }
+
+  /* The es_ calls may have let another thread update the cache in
+     the meantime; in this case we simply replace its result.  */
+  check_pattern_release (pattern_cache.list);
+  xfree (pattern_cache.fname);
+  pattern_cache.fname = xtrystrdup (fname);
+  if (!pattern_cache.fname)
+    {
+      /* Use the list just once.  */
+      pattern_cache.list = NULL;
+      return list;
+    }
+  pattern_cache.mtime = st.st_mtime;
+  pattern_cache.size = st.st_size;
+  pattern_cache.list = list;
+  return list;
+}
+
+
+/* Check PW against a list of pattern.  Return 0 if PW does not match
+   these pattern.  The pattern file is compiled only once and cached
+   so that we do not need to run gpg-check-pattern for each new
+   passphrase.  */
+static int
+check_passphrase_pattern (ctrl_t ctrl, const char *pw)
+{
+  pattern_list_t list;
+  int result;
+
+  (void)ctrl;
+
+  list = get_passphrase_pattern (opt.check_passphrase_pattern);
+  if (!list)
+    return 1; /* Error - assume password should not be used.  */
+
+  result = check_pattern_match (list, pw, NULL);
+  if (list != pattern_cache.list)
+    check_pattern_release (list);
+  return result;
+}
+#else /*DISABLE_REGEX*/
 /* Check PW against a list of pattern.  Return 0 if PW does not match
    these pattern.  */
 static int
@@ -146,6 +294,7 @@ check_passphrase_pattern (ctrl_t ctrl, const char *pw)
   fclose (infp);
   return result;
 }
+#endif /*DISABLE_REGEX*/
 
 
 static int
@@ -262,9 +411,8 @@ check_passphrase_constraints (ctrl_t ctrl, const char *pw,
     }
 
   /* If configured check the passphrase against a list of known words
-     and pattern.  The actual test is done by an external program.
-     The warning message is generic to give the user no hint on how to
-     circumvent this list.  */
+     and pattern.  The warning message is generic to give the user no
+     hint on how to circumvent this list.  */
   if (*pw && opt.check_passphrase_pattern &&
       check_passphrase_pattern (ctrl, pw))
     {
@@ -436,6 +584,304 @@ agent_ask_new_passphrase (ctrl_t ctrl, const char *prompt,
 }
 
 
+/* This function must be called once to initialize this module.  It
+   has to be done before a second thread is spawned.  */
+void
+initialize_module_genkey (void)
+{
+  int err;
+
+  err = npth_mutex_init (&keygen_pool_lock, NULL);
+  if (!err)
+    err = npth_cond_init (&keygen_pool_cond, NULL);
+  if (err)
+    log_fatal ("error initializing genkey module: %s\n", strerror (err));
+}
+
+
+/* Return true if called by the generator thread of the key pool.
+   That thread runs gcry_pk_genkey without the nPth lock and thus the
+   progress callback must not do anything for it.  */
+int
+agent_keygen_pool_thread_p (void)
+{
+  return keygen_pool_have_tid && npth_self () == keygen_pool_tid;
+}
+
+
+/* Return the number of keys to keep for each class.  */
+static unsigned int
+keygen_pool_size (void)
+{
+  return opt.keygen_pool_size > KEYGEN_POOL_MAX? KEYGEN_POOL_MAX
+         /**/                                   : opt.keygen_pool_size;
+}
+
+
+/* Return the number of keys to keep for CLASS.  Unless the secure
+   memory may grow, the keys of a class may only use their share of
+   the agent's secure memory budget.  Must be called with
+   KEYGEN_POOL_LOCK held.  */
+static unsigned int
+keygen_pool_capacity (struct keygen_class_s *class)
+{
+  unsigned int n = keygen_pool_size ();
+  size_t budget = agent_secmem_budget ();
+
+  if (n && budget && class->keysize)
+    {
+      budget /= KEYGEN_POOL_CLASSES;
+      if (budget / class->keysize < n)
+        n = budget / class->keysize;
+      if (!n)
+        n = 1;
+    }
+  return n;
+}
+
+
+/* Return the number of keys in the pool.  */
+unsigned int
+agent_keygen_pool_count (void)
+{
+  unsigned int n = 0;
+  int i;
+
+  for (i=0; i < KEYGEN_POOL_CLASSES; i++)
+    n += keygen_pool[i].nkeys;
+  return n;
+}
+
+
+/* Return true if it is worth to pre-generate keys for S_KEYPARAM.
+   ECC keys are created fast enough on demand.  */
+static int
+keygen_pool_algo_p (gcry_sexp_t s_keyparam)
+{
+  static const char *names[] = { "rsa", "dsa", "elg", NULL };
+  gcry_sexp_t l;
+  int i;
+
+  for (i=0; names[i]; i++)
+    if ((l = gcry_sexp_find_token (s_keyparam, names[i], 0)))
+      {
+        gcry_sexp_release (l);
+        return 1;
+      }
+  return 0;
+}
+
+
+/* Return the class for the canonical KEYPARAM of length KEYPARAMLEN.
+   If CREATE is set a new class is created if needed.  Must be called
+   with KEYGEN_POOL_LOCK held.  */
+static struct keygen_class_s *
+keygen_pool_class (const char *keyparam, size_t keyparamlen, int create)
+{
+  struct keygen_class_s *class, *lru = NULL;
+  int i;
+
+  for (i=0; i < KEYGEN_POOL_CLASSES; i++)
+    {
+      class = keygen_pool + i;
+      if (class->keyparam && class->keyparamlen == keyparamlen
+          && !memcmp (class->keyparam, keyparam, keyparamlen))
+        return class;
+      if (!class->keyparam)
+        {
+          if (!lru || lru->keyparam)
+            lru = class;
+        }
+      else if (!lru || (lru->keyparam && class->used < lru->used))
+        lru = class;
+    }
+  if (!create)
+    return NULL;
+
+  class = lru;
+  if (class->keyparam)
+    keygen_pool_serial++;  /* Tell the generator about the change.  */
+  while (class->nkeys)
+    gcry_sexp_release (class->keys[--class->nkeys]);
+  class->keysize = 0;
+  xfree (class->keyparam);
+  class->keyparam = xtrymalloc (keyparamlen);
+  if (!class->keyparam)
+    return NULL;
+  memcpy (class->keyparam, keyparam, keyparamlen);
+  class->keyparamlen = keyparamlen;
+  return class;
+}
+
+
+/* The generator thread which keeps the pool filled.  The key
+   generation itself runs outside of the npth lock so that the
+   connections are served meanwhile.  */
+static void *
+keygen_pool_thread (void *arg)
+{
+  struct keygen_class_s *class;
+  gcry_sexp_t s_keyparam, s_key;
+  unsigned int serial;
+  gpg_error_t err;
+  int i;
+
+  (void)arg;
+
+  keygen_pool_tid = npth_self ();
+  keygen_pool_have_tid = 1;
+
+  npth_mutex_lock (&keygen_pool_lock);
+  for (;;)
+    {
+      for (i=0; i < KEYGEN_POOL_CLASSES; i++)
+        if (keygen_pool[i].keyparam
+            && keygen_pool[i].nkeys < keygen_pool_capacity (keygen_pool + i))
+          break;
+      if (i == KEYGEN_POOL_CLASSES)
+        {
+          npth_cond_wait (&keygen_pool_cond, &keygen_pool_lock);
+          continue;
+        }
+
+      class = keygen_pool + i;
+      err = gcry_sexp_sscan (&s_keyparam, NULL,
+                             class->keyparam, class->keyparamlen);
+      if (err)
+        {
+          log_error ("keygen pool: invalid keyparam: %s\n",
+                     gpg_strerror (err));
+          xfree (class->keyparam);
+          class->keyparam = NULL;
+          continue;
+        }
+      serial = keygen_pool_serial;
+      npth_mutex_unlock (&keygen_pool_lock);
+
+      npth_unprotect ();
+      err = gcry_pk_genkey (&s_key, s_keyparam);
+      npth_protect ();
+      gcry_sexp_release (s_keyparam);
+
+      npth_mutex_lock (&keygen_pool_lock);
+      if (err)
+        {
+          log_error ("keygen pool: key generation failed: %s\n",
+                     gpg_strerror (err));
+          if (serial == keygen_pool_serial)
+            {
+              xfree (class->keyparam);
+              class->keyparam = NULL;
+            }
+        }
+      else if (serial == keygen_pool_serial
+               && class->nkeys < keygen_pool_capacity (class))
+        {
+          class->keysize = gcry_sexp_sprint (s_key, GCRYSEXP_FMT_CANON,
+                                             NULL, 0);
+          class->keys[class->nkeys++] = s_key;
+          if (DBG_CRYPTO)
+            log_debug ("keygen pool: class %d has %u keys\n",
+                       i, class->nkeys);
+        }
+      else
+        gcry_sexp_release (s_key);
+    }
+
+  /*NOTREACHED*/
+  return NULL;
+}
+
+
+/* Take a key for S_KEYPARAM from the pool and store it at R_KEY.
+   Returns 0 on success or GPG_ERR_NOT_FOUND if there is no
+   pre-generated key.  If the pool is enabled, the generator is
+   woken up to (re)fill the pool for these parameters.  */
+static gpg_error_t
+keygen_pool_get (gcry_sexp_t s_keyparam, gcry_sexp_t *r_key)
+{
+  gpg_error_t err = gpg_error (GPG_ERR_NOT_FOUND);
+  struct keygen_class_s *class;
+  char *keyparam;
+  size_t keyparamlen;
+
+  *r_key = NULL;
+  if (!keygen_pool_size () || !keygen_pool_algo_p (s_keyparam))
+    return err;
+
+  keyparamlen = gcry_sexp_sprint (s_keyparam, GCRYSEXP_FMT_CANON, NULL, 0);
+  keyparam = xtrymalloc (keyparamlen);
+  if (!keyparam)
+    return err;
+  keyparamlen = gcry_sexp_sprint (s_keyparam, GCRYSEXP_FMT_CANON,
+                                  keyparam, keyparamlen);
+
+  npth_mutex_lock (&keygen_pool_lock);
+  class = keygen_pool_class (keyparam, keyparamlen, 1);
+  if (class)
+    {
+      class->used = ++keygen_pool_tick;
+      if (class->nkeys)
+        {
+          *r_key = class->keys[--class->nkeys];
+          class->keys[class->nkeys] = NULL;
+          err = 0;
+        }
+    }
+
+  if (!keygen_thread_running)
+    {
+      npth_attr_t tattr;
+      npth_t thread;
+      int ret;
+
+      npth_attr_init (&tattr);
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+      ret = npth_create (&thread, &tattr, keygen_pool_thread, NULL);
+      if (ret)
+        log_error ("error spawning keygen pool thread: %s\n", strerror (ret));
+      else
+        {
+          npth_setname_np (thread, "keygen-pool");
+          keygen_thread_running = 1;
+        }
+      npth_attr_destroy (&tattr);
+    }
+  npth_cond_signal (&keygen_pool_cond);
+  npth_mutex_unlock (&keygen_pool_lock);
+
+  xfree (keyparam);
+  if (!err && DBG_CRYPTO)
+    log_debug ("using a pre-generated key\n");
+  return err;
+}
+
+
+/* Release all pre-generated keys.  */
+void
+agent_flush_keygen_pool (void)
+{
+  int i;
+
+  npth_mutex_lock (&keygen_pool_lock);
+  keygen_pool_serial++;
+  for (i=0; i < KEYGEN_POOL_CLASSES; i++)
+    {
+      while (keygen_pool[i].nkeys)
+        {
+          keygen_pool[i].nkeys--;
+          gcry_sexp_release (keygen_pool[i].keys[keygen_pool[i].nkeys]);
+          keygen_pool[i].keys[keygen_pool[i].nkeys] = NULL;
+        }
+      xfree (keygen_pool[i].keyparam);
+      keygen_pool[i].keyparam = NULL;
+      keygen_pool[i].used = 0;
+      keygen_pool[i].keysize = 0;
+    }
+  npth_mutex_unlock (&keygen_pool_lock);
+}
+
+
 
 /* Generate a new keypair according to the parameters given in
    KEYPARAM.  If CACHE_NONCE is given first try to lookup a passphrase
@@ -485,7 +931,10 @@ agent_genkey (ctrl_t ctrl, const char *cache_nonce,
       passphrase = passphrase_buffer;
     }
 
-  rc = gcry_pk_genkey (&s_key, s_keyparam );
+  if (keygen_pool_get (s_keyparam, &s_key))
+    rc = gcry_pk_genkey (&s_key, s_keyparam );
+  else
+    rc = 0;
   gcry_sexp_release (s_keyparam);
   if (rc)
     {
@@ -59,6 +59,8 @@
 #include "../common/exechelp.h"
 #include "../common/asshelp.h"
 #include "../common/init.h"
+#include "../common/stats.h"
+#include "../common/asynclog.h"
 
 
 enum cmd_and_opt_values
@@ -86,6 +88,7 @@ enum cmd_and_opt_values
   oGrab,
   oNoGrab,
   oLogFile,
+  oAsyncLog,
   oServer,
   oDaemon,
   oSupervised,
@@ -95,6 +98,7 @@ enum cmd_and_opt_values
   oPinentryTouchFile,
   oPinentryInvisibleChar,
   oPinentryTimeout,
+  oPinentryIdleTimeout,
   oDisplay,
   oTTYname,
   oTTYtype,
@@ -113,6 +117,8 @@ enum cmd_and_opt_values
   oMaxPassphraseDays,
   oEnablePassphraseHistory,
   oEnableExtendedKeyFormat,
+  oEnablePrivateKeyCache,
+  oKeygenPoolSize,
   oUseStandardSocket,
   oNoUseStandardSocket,
   oExtraSocket,
@@ -137,6 +143,9 @@ enum cmd_and_opt_values
   oS2KCount,
   oAutoExpandSecmem,
   oListenBacklog,
+  oMaxConnections,
+  oPrivateKeysFanout,
+  oSecmemSize,
 
   oWriteEnvFile
 };
@@ -179,11 +188,13 @@ static ARGPARSE_OPTS opts[] = {
                 /* N_("let PIN-Entry grab keyboard and mouse")), */
   ARGPARSE_s_n (oNoGrab,    "no-grab",   "@"),
   ARGPARSE_s_s (oLogFile,   "log-file",  N_("use a log file for the server")),
+  ARGPARSE_s_n (oAsyncLog,  "async-log", "@"),
   ARGPARSE_s_s (oPinentryProgram, "pinentry-program",
                 /* */             N_("|PGM|use PGM as the PIN-Entry program")),
   ARGPARSE_s_s (oPinentryTouchFile, "pinentry-touch-file", "@"),
   ARGPARSE_s_s (oPinentryInvisibleChar, "pinentry-invisible-char", "@"),
   ARGPARSE_s_u (oPinentryTimeout, "pinentry-timeout", "@"),
+  ARGPARSE_s_u (oPinentryIdleTimeout, "pinentry-idle-timeout", "@"),
   ARGPARSE_s_s (oScdaemonProgram, "scdaemon-program",
                 /* */             N_("|PGM|use PGM as the SCdaemon program") ),
   ARGPARSE_s_n (oDisableScdaemon, "disable-scdaemon",
@@ -251,12 +262,17 @@ static ARGPARSE_OPTS opts[] = {
 #endif
                 ),
   ARGPARSE_s_n (oEnableExtendedKeyFormat, "enable-extended-key-format", "@"),
+  ARGPARSE_s_n (oEnablePrivateKeyCache, "enable-private-key-cache", "@"),
+  ARGPARSE_s_u (oKeygenPoolSize, "keygen-pool-size", "@"),
 
   ARGPARSE_s_u (oS2KCount, "s2k-count", "@"),
 
+  ARGPARSE_s_u (oSecmemSize, "secmem-size", "@"),
   ARGPARSE_op_u (oAutoExpandSecmem, "auto-expand-secmem", "@"),
 
   ARGPARSE_s_i (oListenBacklog, "listen-backlog", "@"),
+  ARGPARSE_s_i (oMaxConnections, "max-connections", "@"),
+  ARGPARSE_s_n (oPrivateKeysFanout, "private-keys-fanout", "@"),
 
   /* Dummy options for backward compatibility.  */
   ARGPARSE_o_s (oWriteEnvFile, "write-env-file", "@"),
@@ -379,6 +395,18 @@ static assuan_sock_nonce_t socket_nonce_ssh;
  * Let's try this as default.  Change at runtime with --listen-backlog.  */
 static int listen_backlog = 64;
 
+/* The maximum number of connections handled at the same time.  More
+ * connections are queued.  0 means no limit.  Change at runtime with
+ * --max-connections.  */
+static int max_connections;
+
+/* The size of the secure memory pool and whether and in which steps
+ * Libgcrypt may expand it.  Change with --secmem-size and
+ * --auto-expand-secmem.  */
+static unsigned int secmem_size = SECMEM_BUFFER_SIZE;
+static int secmem_auto_expand;
+static unsigned int secmem_expand_size;
+
 /* Default values for options passed to the pinentry. */
 static char *default_display;
 static char *default_ttyname;
@@ -397,6 +425,9 @@ static const char *debug_level;
    the log file after a SIGHUP if it didn't changed. Malloced. */
 static char *current_logfile;
 
+/* Flag to write the log from a separate thread.  */
+static int async_log;
+
 /* The handle_tick() function may test whether a parent is still
  * running.  We record the PID of the parent here or -1 if it should
  * be watched.  */
@@ -415,6 +446,31 @@ static int reliable_homedir_inotify;
 /* Number of active connections.  */
 static int active_connections;
 
+/* The connection threads are kept in a pool: A thread which is done
+ * with its connection waits for up to WORKER_IDLE_TIMEOUT seconds for
+ * the next accepted connection before it terminates.  Connections
+ * which can't be handed to an idle thread and exceed MAX_CONNECTIONS
+ * are queued.  If the queue holds CONNECTION_QUEUE_MAX items the
+ * listening sockets are not polled anymore so that further clients
+ * wait in the listen backlog of the kernel.  */
+#define WORKER_IDLE_TIMEOUT  30
+#define MAX_IDLE_WORKERS     8
+#define CONNECTION_QUEUE_MAX 64
+static npth_mutex_t pool_lock;
+static npth_cond_t pool_cond;
+static ctrl_t pool_queue_head;
+static ctrl_t pool_queue_tail;
+static int pool_queue_len;
+static int pool_workers;       /* Number of connection threads.  */
+static int pool_idle_workers;  /* Number of waiting threads.  */
+
+/* Lock and condition to wait for the S2K calibration which runs in
+ * the background after startup.  S2K_CALIBRATION_RUNNING is set while
+ * the calibration thread is active.  */
+static npth_mutex_t s2k_calibration_lock;
+static npth_cond_t s2k_calibration_cond;
+static int s2k_calibration_running;
+
 /* This object is used to dispatch progress messages from Libgcrypt to
  * the right thread.  Given that we will have at max only a few dozen
  * connections at a time, using a linked list is the easiest way to
@@ -464,6 +520,7 @@ static void handle_connections (gnupg_fd_t listen_fd,
                                 gnupg_fd_t listen_fd_ssh);
 static void check_own_socket (void);
 static int check_for_running_agent (int silent);
+static void secmem_stats_report (stats_sink_t sink);
 
 /* Pth wrapper function definitions. */
 ASSUAN_SYSTEM_NPTH_IMPL;
@@ -812,6 +869,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       xfree (opt.pinentry_invisible_char);
       opt.pinentry_invisible_char = NULL;
       opt.pinentry_timeout = 0;
+      opt.pinentry_idle_timeout = 0;
       opt.scdaemon_program = NULL;
       opt.def_cache_ttl = DEFAULT_CACHE_TTL;
       opt.def_cache_ttl_ssh = DEFAULT_CACHE_TTL_SSH;
@@ -824,6 +882,8 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.max_passphrase_days = MAX_PASSPHRASE_DAYS;
       opt.enable_passphrase_history = 0;
       opt.enable_extended_key_format = 0;
+      opt.enable_private_key_cache = 0;
+      opt.keygen_pool_size = 0;
       opt.ignore_cache_for_signing = 0;
       opt.allow_mark_trusted = 1;
       opt.allow_external_cache = 1;
@@ -855,7 +915,10 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       if (!current_logfile || !pargs->r.ret_str
           || strcmp (current_logfile, pargs->r.ret_str))
         {
-          log_set_file (pargs->r.ret_str);
+          if (async_log_is_active ())
+            async_log_set_file (pargs->r.ret_str);
+          else
+            log_set_file (pargs->r.ret_str);
           xfree (current_logfile);
           current_logfile = xtrystrdup (pargs->r.ret_str);
         }
@@ -871,6 +934,9 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.pinentry_invisible_char = xtrystrdup (pargs->r.ret_str); break;
       break;
     case oPinentryTimeout: opt.pinentry_timeout = pargs->r.ret_ulong; break;
+    case oPinentryIdleTimeout:
+      opt.pinentry_idle_timeout = pargs->r.ret_ulong;
+      break;
     case oScdaemonProgram: opt.scdaemon_program = pargs->r.ret_str; break;
     case oDisableScdaemon: opt.disable_scdaemon = 1; break;
     case oDisableCheckOwnSocket: disable_check_own_socket = 1; break;
@@ -901,6 +967,12 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.enable_extended_key_format = 1;
       break;
 
+    case oEnablePrivateKeyCache:
+      opt.enable_private_key_cache = 1;
+      break;
+
+    case oKeygenPoolSize: opt.keygen_pool_size = pargs->r.ret_ulong; break;
+
     case oIgnoreCacheForSigning: opt.ignore_cache_for_signing = 1; break;
 
     case oAllowMarkTrusted: opt.allow_mark_trusted = 1; break;
@@ -978,6 +1050,8 @@ initialize_modules (void)
   initialize_module_call_pinentry ();
   initialize_module_call_scd ();
   initialize_module_trustlist ();
+  initialize_module_command_ssh ();
+  initialize_module_genkey ();
 }
 
 
@@ -1005,6 +1079,9 @@ main (int argc, char **argv )
   struct assuan_malloc_hooks malloc_hooks;
 
   early_system_init ();
+  stats_init ();
+  stats_register ("secmem", secmem_stats_report);
+  stats_register ("cache", agent_cache_stats_report);
 
   /* Before we do anything else we save the list of currently open
      file descriptors and the signal mask.  This info is required to
@@ -1111,11 +1188,13 @@ main (int argc, char **argv )
           {
             gcry_control (GCRYCTL_ENABLE_QUICK_RANDOM, 0);
           }
+	else if (pargs.r_opt == oSecmemSize)
+          secmem_size = pargs.r.ret_ulong;
 
     }
 
   /* Initialize the secure memory. */
-  gcry_control (GCRYCTL_INIT_SECMEM, SECMEM_BUFFER_SIZE, 0);
+  gcry_control (GCRYCTL_INIT_SECMEM, secmem_size, 0);
   maybe_setuid = 0;
 
   /*
@@ -1192,6 +1271,7 @@ main (int argc, char **argv )
         case oHomedir: gnupg_set_homedir (pargs.r.ret_str); break;
         case oNoDetach: nodetach = 1; break;
         case oLogFile: logfile = pargs.r.ret_str; break;
+        case oAsyncLog: async_log = 1; break;
         case oCsh: csh_style = 1; break;
         case oSh: csh_style = 0; break;
         case oServer: pipe_server = 1; break;
@@ -1250,12 +1330,36 @@ main (int argc, char **argv )
            * on the quiet and thus we use the numeric value value.  */
           gcry_control (78 /*GCRYCTL_AUTO_EXPAND_SECMEM*/,
                         (unsigned int)pargs.r.ret_ulong,  0);
+          secmem_auto_expand = 1;
+          secmem_expand_size = pargs.r.ret_ulong;
+          break;
+
+        case oSecmemSize:
+          /* The secure memory has already been initialized; this is
+           * only a larger value from the config file.  We can't
+           * resize the pool and thus let it grow in steps of the
+           * requested size.  */
+          if (pargs.r.ret_ulong > secmem_size && !secmem_auto_expand)
+            {
+              gcry_control (78 /*GCRYCTL_AUTO_EXPAND_SECMEM*/,
+                            (unsigned int)pargs.r.ret_ulong, 0);
+              secmem_auto_expand = 1;
+              secmem_expand_size = pargs.r.ret_ulong;
+            }
           break;
 
         case oListenBacklog:
           listen_backlog = pargs.r.ret_int;
           break;
 
+        case oMaxConnections:
+          max_connections = pargs.r.ret_int;
+          break;
+
+        case oPrivateKeysFanout:
+          opt.private_keys_fanout = 1;
+          break;
+
         case oDebugQuickRandom:
           /* Only used by the first stage command line parser.  */
           break;
@@ -1448,6 +1552,10 @@ main (int argc, char **argv )
                  GC_OPT_FLAG_NONE|GC_OPT_FLAG_RUNTIME);
       es_printf ("grab:%lu:\n",
                  GC_OPT_FLAG_NONE|GC_OPT_FLAG_RUNTIME);
+      es_printf ("secmem-size:%lu:%u:\n",
+                 GC_OPT_FLAG_DEFAULT, SECMEM_BUFFER_SIZE);
+      es_printf ("auto-expand-secmem:%lu:\n",
+                 GC_OPT_FLAG_NONE);
 
       agent_exit (0);
     }
@@ -1839,6 +1947,11 @@ agent_libgcrypt_progress_cb (void *data, const char *what, int printchar,
 
   (void)data;
 
+  /* The key pool generator does not hold the nPth lock; neither the
+   * dispatch list nor the nPth functions may be used.  */
+  if (agent_keygen_pool_thread_p ())
+    return;
+
   for (dispatch = progress_dispatch_list; dispatch; dispatch = dispatch->next)
     if (dispatch->ctrl && dispatch->tid == mytid)
       break;
@@ -2081,6 +2194,57 @@ get_agent_active_connection_count (void)
 }
 
 
+/* Return the number of accepted connections waiting for a handler.  */
+int
+get_agent_connection_queue_length (void)
+{
+  return pool_queue_len;
+}
+
+
+/* Return the number of bytes of secure memory the caches of the
+ * agent may use for long-lived objects or 0 if there is no limit
+ * because the secure memory can grow.  Half of the pool is left for
+ * the actual crypto operations.  */
+size_t
+agent_secmem_budget (void)
+{
+  return secmem_auto_expand? 0 : secmem_size / 2;
+}
+
+
+/* The report function for the "secmem" statistics.  */
+static void
+secmem_stats_report (stats_sink_t sink)
+{
+  stats_put (sink, "size", secmem_size);
+  stats_put (sink, "auto_expand", secmem_auto_expand);
+  stats_put (sink, "expand_size", secmem_expand_size);
+  stats_put (sink, "budget", agent_secmem_budget ());
+  stats_put (sink, "keygen_pool_keys", agent_keygen_pool_count ());
+}
+
+
+/* Release the nPth lock for a CPU bound operation so that other
+ * connections can run meanwhile.  Code between this and
+ * agent_cpu_end may only touch data owned by the caller and must not
+ * call any non thread-safe function, in particular the log
+ * functions.  */
+void
+agent_cpu_begin (void)
+{
+  npth_unprotect ();
+}
+
+
+/* Take the nPth lock again after agent_cpu_begin.  */
+void
+agent_cpu_end (void)
+{
+  npth_protect ();
+}
+
+
 /* Under W32, this function returns the handle of the scdaemon
    notification event.  Calling it the first time creates that
    event.  */
@@ -2401,6 +2565,9 @@ handle_tick (void)
   /* Need to check for expired cache entries.  */
   agent_cache_housekeeping ();
 
+  /* Terminate an idle pinentry.  */
+  agent_query_housekeeping ();
+
   /* Check whether the homedir is still available.  */
   if (!shutdown_pending
       && (!have_homedir_inotify || !reliable_homedir_inotify)
@@ -2421,6 +2588,8 @@ agent_sighup_action (void)
             "re-reading configuration and flushing cache\n");
 
   agent_flush_cache ();
+  agent_flush_keygen_pool ();
+  agent_query_flush_idle ();
   reread_configuration ();
   agent_reload_trustlist ();
   /* We flush the module name cache so that after installing a
@@ -2805,6 +2974,189 @@ start_connection_thread_ssh (void *arg)
 }
 
 
+/* Take the next connection from the queue.  If the queue is empty
+ * wait for a new one as long as the pool needs idle threads.  Returns
+ * NULL if the calling thread shall terminate.  */
+static ctrl_t
+next_queued_connection (void)
+{
+  struct timespec abstime;
+  ctrl_t ctrl = NULL;
+  int ret;
+
+  ret = npth_mutex_lock (&pool_lock);
+  if (ret)
+    log_fatal ("failed to acquire pool mutex: %s\n", strerror (ret));
+
+  if (!pool_queue_head && pool_idle_workers < MAX_IDLE_WORKERS)
+    {
+      npth_clock_gettime (&abstime);
+      abstime.tv_sec += WORKER_IDLE_TIMEOUT;
+      pool_idle_workers++;
+      while (!pool_queue_head && !shutdown_pending)
+        {
+          ret = npth_cond_timedwait (&pool_cond, &pool_lock, &abstime);
+          if (ret == ETIMEDOUT)
+            break;
+          else if (ret && ret != EINTR)
+            {
+              log_error ("waiting for a connection failed: %s\n",
+                         strerror (ret));
+              break;
+            }
+        }
+      pool_idle_workers--;
+    }
+
+  if (pool_queue_head)
+    {
+      ctrl = pool_queue_head;
+      pool_queue_head = ctrl->thread_startup.next;
+      if (!pool_queue_head)
+        pool_queue_tail = NULL;
+      ctrl->thread_startup.next = NULL;
+      pool_queue_len--;
+    }
+  else
+    pool_workers--;
+
+  ret = npth_mutex_unlock (&pool_lock);
+  if (ret)
+    log_fatal ("failed to release pool mutex: %s\n", strerror (ret));
+
+  return ctrl;
+}
+
+
+/* The main function of the connection threads.  ARG is the first
+ * connection to handle.  */
+static void *
+connection_worker_thread (void *arg)
+{
+  ctrl_t ctrl = arg;
+
+  do
+    ctrl->thread_startup.func (ctrl);
+  while ((ctrl = next_queued_connection ()));
+
+  return NULL;
+}
+
+
+/* Hand the accepted connection CTRL to an idle connection thread,
+ * start a new thread, or queue the connection if MAX_CONNECTIONS
+ * threads are busy.  Returns an error code from npth_create.  */
+static int
+dispatch_connection (ctrl_t ctrl, npth_attr_t *tattr)
+{
+  npth_t thread;
+  int ret;
+
+  ret = npth_mutex_lock (&pool_lock);
+  if (ret)
+    log_fatal ("failed to acquire pool mutex: %s\n", strerror (ret));
+
+  if (pool_idle_workers <= pool_queue_len
+      && (!max_connections
+          || pool_workers - pool_idle_workers < max_connections))
+    {
+      ret = npth_create (&thread, tattr, connection_worker_thread, ctrl);
+      if (!ret)
+        pool_workers++;
+    }
+  else
+    {
+      if (pool_queue_tail)
+        pool_queue_tail->thread_startup.next = ctrl;
+      else
+        pool_queue_head = ctrl;
+      pool_queue_tail = ctrl;
+      pool_queue_len++;
+      npth_cond_signal (&pool_cond);
+    }
+
+  npth_mutex_unlock (&pool_lock);
+  return ret;
+}
+
+
+/* The thread doing the S2K calibration in the background.  */
+static void *
+s2k_calibration_thread (void *arg)
+{
+  unsigned long count;
+
+  (void)arg;
+
+  /* The calibration takes a noticeable time but hash_passphrase
+   * releases the nPth lock while hashing; thus the connections are
+   * not blocked meanwhile.  */
+  count = calibrate_s2k_count (1);
+
+  if (opt.verbose)
+    log_info ("S2K calibration: %lu\n", count);
+  set_calibrated_s2k_count (count);
+  write_s2k_calibration (count);
+
+  npth_mutex_lock (&s2k_calibration_lock);
+  s2k_calibration_running = 0;
+  npth_cond_broadcast (&s2k_calibration_cond);
+  npth_mutex_unlock (&s2k_calibration_lock);
+  return NULL;
+}
+
+
+/* Wait until the background S2K calibration has finished.  */
+static void
+wait_s2k_calibration (void)
+{
+  npth_mutex_lock (&s2k_calibration_lock);
+  while (s2k_calibration_running)
+    npth_cond_wait (&s2k_calibration_cond, &s2k_calibration_lock);
+  npth_mutex_unlock (&s2k_calibration_lock);
+}
+
+
+/* Take the S2K calibration from the file written by an earlier
+ * agent on this machine or start it in the background.  Thus the
+ * first protect operation does not need to wait for it.  */
+static void
+start_s2k_calibration (npth_attr_t *tattr)
+{
+  unsigned long count;
+  npth_t thread;
+  int ret;
+
+  if (opt.s2k_count)
+    return;  /* Calibration not needed; it is done on demand.  */
+
+  if (!read_s2k_calibration (&count))
+    {
+      set_calibrated_s2k_count (count);
+      return;
+    }
+
+  ret = npth_mutex_init (&s2k_calibration_lock, NULL);
+  if (!ret)
+    ret = npth_cond_init (&s2k_calibration_cond, NULL);
+  if (ret)
+    {
+      log_error ("error initializing the S2K calibration: %s\n",
+                 strerror (ret));
+      return;
+    }
+  s2k_calibration_running = 1;
+  register_s2k_calibration_wait (wait_s2k_calibration);
+  ret = npth_create (&thread, tattr, s2k_calibration_thread, NULL);
+  if (ret)
+    {
+      log_error ("error spawning S2K calibration thread: %s\n",
+                 strerror (ret));
+      s2k_calibration_running = 0;
+    }
+}
+
+
 /* Connection handler loop.  Wait for connection requests and spawn a
    thread after accepting a connection.  */
 static void
@@ -2843,12 +3195,26 @@ handle_connections (gnupg_fd_t listen_fd,
   };
 
 
+  /* The log writer thread needs to be started by the daemon process
+   * itself.  */
+  if (async_log && current_logfile)
+    async_log_set_file (current_logfile);
+
   ret = npth_attr_init(&tattr);
   if (ret)
     log_fatal ("error allocating thread attributes: %s\n",
 	       strerror (ret));
   npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
 
+  ret = npth_mutex_init (&pool_lock, NULL);
+  if (!ret)
+    ret = npth_cond_init (&pool_cond, NULL);
+  if (ret)
+    log_fatal ("error initializing the connection pool: %s\n",
+               strerror (ret));
+
+  start_s2k_calibration (&tattr);
+
 #ifndef HAVE_W32_SYSTEM
   npth_sigev_init ();
   npth_sigev_add (SIGHUP);
@@ -2956,7 +3322,7 @@ handle_connections (gnupg_fd_t listen_fd,
       /* Shutdown test.  */
       if (shutdown_pending)
         {
-          if (active_connections == 0)
+          if (active_connections == 0 && !pool_queue_len)
             break; /* ready */
 
           /* Do not accept new connections but keep on running the
@@ -2985,6 +3351,16 @@ handle_connections (gnupg_fd_t listen_fd,
          thus a simple assignment is fine to copy the entire set.  */
       read_fdset = fdset;
 
+      /* Apply backpressure if too many connections are waiting.  */
+      if (pool_queue_len >= CONNECTION_QUEUE_MAX)
+        {
+          int idx;
+
+          for (idx=0; idx < DIM(listentbl); idx++)
+            if (listentbl[idx].l_fd != GNUPG_INVALID_FD)
+              FD_CLR (FD2INT (listentbl[idx].l_fd), &read_fdset);
+        }
+
       npth_clock_gettime (&curtime);
       if (!(npth_timercmp (&curtime, &abstime, <)))
 	{
@@ -3053,7 +3429,6 @@ handle_connections (gnupg_fd_t listen_fd,
         {
           int idx;
           ctrl_t ctrl;
-          npth_t thread;
 
           for (idx=0; idx < DIM(listentbl); idx++)
             {
@@ -3086,8 +3461,8 @@ handle_connections (gnupg_fd_t listen_fd,
               else
                 {
                   ctrl->thread_startup.fd = fd;
-                  ret = npth_create (&thread, &tattr,
-                                     listentbl[idx].func, ctrl);
+                  ctrl->thread_startup.func = listentbl[idx].func;
+                  ret = dispatch_connection (ctrl, &tattr);
                   if (ret)
                     {
                       log_error ("error spawning connection handler for %s:"
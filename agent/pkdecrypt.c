@@ -30,36 +30,19 @@
 #include "agent.h"
 
 
-/* DECRYPT the stuff in ciphertext which is expected to be a S-Exp.
-   Try to get the key from CTRL and write the decoded stuff back to
-   OUTFP.   The padding information is stored at R_PADDING with -1
-   for not known.  */
-int
-agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
-                 const unsigned char *ciphertext, size_t ciphertextlen,
-                 membuf_t *outbuf, int *r_padding)
+/* Parse CIPHERTEXT of CIPHERTEXTLEN into R_CIPHER.  */
+static int
+parse_ciphertext (ctrl_t ctrl,
+                  const unsigned char *ciphertext, size_t ciphertextlen,
+                  gcry_sexp_t *r_cipher)
 {
-  gcry_sexp_t s_skey = NULL, s_cipher = NULL, s_plain = NULL;
-  unsigned char *shadow_info = NULL;
   int rc;
-  char *buf = NULL;
-  size_t len;
-
-  *r_padding = -1;
-
-  if (!ctrl->have_keygrip)
-    {
-      log_error ("speculative decryption not yet supported\n");
-      rc = gpg_error (GPG_ERR_NO_SECKEY);
-      goto leave;
-    }
 
-  rc = gcry_sexp_sscan (&s_cipher, NULL, (char*)ciphertext, ciphertextlen);
+  rc = gcry_sexp_sscan (r_cipher, NULL, (char*)ciphertext, ciphertextlen);
   if (rc)
     {
       log_error ("failed to convert ciphertext: %s\n", gpg_strerror (rc));
-      rc = gpg_error (GPG_ERR_INV_DATA);
-      goto leave;
+      return gpg_error (GPG_ERR_INV_DATA);
     }
 
   if (DBG_CRYPTO)
@@ -67,15 +50,28 @@ agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
       log_printhex (ctrl->keygrip, 20, "keygrip:");
       log_printhex (ciphertext, ciphertextlen, "cipher: ");
     }
-  rc = agent_key_from_file (ctrl, NULL, desc_text,
-                            ctrl->keygrip, &shadow_info,
-                            CACHE_MODE_NORMAL, NULL, &s_skey, NULL);
-  if (rc)
-    {
-      if (gpg_err_code (rc) != GPG_ERR_NO_SECKEY)
-        log_error ("failed to read the secret key\n");
-      goto leave;
-    }
+  return 0;
+}
+
+
+/* Decrypt the ciphertext S_CIPHER, which has been parsed from
+   CIPHERTEXT of CIPHERTEXTLEN, using the secret key S_SKEY or, if
+   SHADOW_INFO is not NULL, the smartcard.  The decoded stuff is
+   written to OUTBUF.  The padding information is stored at R_PADDING
+   with -1 for not known.  */
+static int
+decrypt_with_key (ctrl_t ctrl, const char *desc_text,
+                  gcry_sexp_t s_skey, const unsigned char *shadow_info,
+                  gcry_sexp_t s_cipher,
+                  const unsigned char *ciphertext, size_t ciphertextlen,
+                  membuf_t *outbuf, int *r_padding)
+{
+  gcry_sexp_t s_plain = NULL;
+  int rc;
+  char *buf = NULL;
+  size_t len;
+
+  *r_padding = -1;
 
   if (shadow_info)
     { /* divert operation to the smartcard */
@@ -137,10 +133,147 @@ agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
 
 
  leave:
-  gcry_sexp_release (s_skey);
   gcry_sexp_release (s_plain);
+  xfree (buf);
+  return rc;
+}
+
+
+/* DECRYPT the stuff in ciphertext which is expected to be a S-Exp.
+   Try to get the key from CTRL and write the decoded stuff back to
+   OUTFP.   The padding information is stored at R_PADDING with -1
+   for not known.  */
+int
+agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
+                 const unsigned char *ciphertext, size_t ciphertextlen,
+                 membuf_t *outbuf, int *r_padding)
+{
+  gcry_sexp_t s_skey = NULL, s_cipher = NULL;
+  unsigned char *shadow_info = NULL;
+  int rc;
+
+  *r_padding = -1;
+
+  if (!ctrl->have_keygrip)
+    {
+      log_error ("speculative decryption not yet supported\n");
+      return gpg_error (GPG_ERR_NO_SECKEY);
+    }
+
+  rc = parse_ciphertext (ctrl, ciphertext, ciphertextlen, &s_cipher);
+  if (rc)
+    return rc;
+
+  rc = agent_key_from_file (ctrl, NULL, desc_text,
+                            ctrl->keygrip, &shadow_info,
+                            CACHE_MODE_NORMAL, NULL, &s_skey, NULL);
+  if (rc)
+    {
+      if (gpg_err_code (rc) != GPG_ERR_NO_SECKEY)
+        log_error ("failed to read the secret key\n");
+    }
+  else
+    rc = decrypt_with_key (ctrl, desc_text, s_skey, shadow_info, s_cipher,
+                           ciphertext, ciphertextlen, outbuf, r_padding);
+
   gcry_sexp_release (s_cipher);
+  gcry_sexp_release (s_skey);
+  xfree (shadow_info);
+  return rc;
+}
+
+
+/* Decrypt all ciphertexts in the buffer CIPHERTEXTS of
+   CIPHERTEXTSLEN, which holds a sequence of canonical S-Exps, with
+   the key set in CTRL.  The key is read and unprotected only once.
+   For each ciphertext the result is appended to OUTBUF in the same
+   order: the S-Exp as returned by agent_pkdecrypt, preceded by
+   "(7:padding1:N)" if the padding is known, or "(5:error<n>:<code>)"
+   with the decimal error code if this ciphertext could not be
+   decrypted.  An error is only returned if the key can't be used or
+   CIPHERTEXTS is malformed; nothing is appended to OUTBUF then.  */
+int
+agent_pkdecrypt_multi (ctrl_t ctrl, const char *desc_text,
+                       const unsigned char *ciphertexts,
+                       size_t ciphertextslen, membuf_t *outbuf)
+{
+  gcry_sexp_t s_skey = NULL, s_cipher;
+  unsigned char *shadow_info = NULL;
+  membuf_t result, one;
+  const unsigned char *p;
+  size_t n, left, len;
+  char *buf;
+  char numbuf[35];
+  int rc, err, padding;
+
+  if (!ctrl->have_keygrip)
+    {
+      log_error ("speculative decryption not yet supported\n");
+      return gpg_error (GPG_ERR_NO_SECKEY);
+    }
+
+  rc = agent_key_from_file (ctrl, NULL, desc_text,
+                            ctrl->keygrip, &shadow_info,
+                            CACHE_MODE_NORMAL, NULL, &s_skey, NULL);
+  if (rc)
+    {
+      if (gpg_err_code (rc) != GPG_ERR_NO_SECKEY)
+        log_error ("failed to read the secret key\n");
+      return rc;
+    }
+
+  init_membuf (&result, 1024);
+  for (p = ciphertexts, left = ciphertextslen; left; p += n, left -= n)
+    {
+      n = gcry_sexp_canon_len (p, left, NULL, NULL);
+      if (!n)
+        {
+          rc = gpg_error (GPG_ERR_INV_SEXP);
+          break;
+        }
+
+      padding = -1;
+      init_membuf (&one, 512);
+      err = parse_ciphertext (ctrl, p, n, &s_cipher);
+      if (!err)
+        {
+          err = decrypt_with_key (ctrl, desc_text, s_skey, shadow_info,
+                                  s_cipher, p, n, &one, &padding);
+          gcry_sexp_release (s_cipher);
+        }
+      buf = get_membuf (&one, &len);
+      if (!err && !buf)
+        err = gpg_error_from_syserror ();
+      /* The result may have a trailing Nul; only take the S-Exp.  */
+      if (!err && !(len = gcry_sexp_canon_len (buf, len, NULL, NULL)))
+        err = gpg_error (GPG_ERR_INV_SEXP);
+      if (err)
+        {
+          snprintf (numbuf, sizeof numbuf, "%u", gpg_err_code (err));
+          put_membuf_printf (&result, "(5:error%u:%s)",
+                             (unsigned int)strlen (numbuf), numbuf);
+        }
+      else
+        {
+          if (padding != -1)
+            {
+              snprintf (numbuf, sizeof numbuf, "%d", padding);
+              put_membuf_printf (&result, "(7:padding%u:%s)",
+                                 (unsigned int)strlen (numbuf), numbuf);
+            }
+          put_membuf (&result, buf, len);
+        }
+      xfree (buf);
+    }
+
+  buf = get_membuf (&result, &len);
+  if (!buf && !rc)
+    rc = gpg_error_from_syserror ();
+  if (!rc)
+    put_membuf (outbuf, buf, len);
   xfree (buf);
+
+  gcry_sexp_release (s_skey);
   xfree (shadow_info);
   return rc;
 }
@@ -270,6 +270,81 @@ do_encode_raw_pkcs1 (const byte *md, size_t mdlen, unsigned int nbits,
 
 
 
+/* Sign DATA of DATALEN using the digest algorithm from CTRL and the
+ * secret key S_SKEY which is not on a smartcard.  On success the
+ * signature is stored at R_SIG.  */
+static gpg_error_t
+sign_with_skey (ctrl_t ctrl, gcry_sexp_t s_skey,
+                const unsigned char *data, size_t datalen,
+                gcry_sexp_t *r_sig)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_hash = NULL;
+  gcry_sexp_t s_sig = NULL;
+  int dsaalgo = 0;
+
+  *r_sig = NULL;
+
+  /* Put the hash into a sexp */
+  if (agent_is_eddsa_key (s_skey))
+    err = do_encode_eddsa (data, datalen,
+                           &s_hash);
+  else if (ctrl->digest.algo == MD_USER_TLS_MD5SHA1)
+    err = do_encode_raw_pkcs1 (data, datalen,
+                               gcry_pk_get_nbits (s_skey),
+                               &s_hash);
+  else if ( (dsaalgo = agent_is_dsa_key (s_skey)) )
+    err = do_encode_dsa (data, datalen,
+                         dsaalgo, s_skey,
+                         &s_hash);
+  else
+    err = do_encode_md (data, datalen,
+                        ctrl->digest.algo,
+                        &s_hash,
+                        ctrl->digest.raw_value);
+  if (err)
+    return err;
+
+  if (DBG_CRYPTO)
+    {
+      gcry_log_debugsxp ("skey", s_skey);
+      gcry_log_debugsxp ("hash", s_hash);
+    }
+
+  /* sign */
+  err = gcry_pk_sign (&s_sig, s_hash, s_skey);
+  if (err)
+    {
+      log_error ("signing failed: %s\n", gpg_strerror (err));
+      gcry_sexp_release (s_hash);
+      return err;
+    }
+
+  if (DBG_CRYPTO)
+    gcry_log_debugsxp ("rslt", s_sig);
+
+  /* Check that the signature verification worked and nothing is
+   * fooling us e.g. by a bug in the signature create code or by
+   * deliberately introduced faults.  Libgcrypt 1.7 does this for RSA
+   * internally.  */
+  if (dsaalgo == 0 && GCRYPT_VERSION_NUMBER < 0x010700)
+    {
+      err = gcry_pk_verify (s_sig, s_hash, s_skey);
+      if (err)
+        {
+          log_error (_("checking created signature failed: %s\n"),
+                     gpg_strerror (err));
+          gcry_sexp_release (s_sig);
+          s_sig = NULL;
+        }
+    }
+
+  gcry_sexp_release (s_hash);
+  *r_sig = s_sig;
+  return err;
+}
+
+
 /* SIGN whatever information we have accumulated in CTRL and return
  * the signature S-expression.  LOOKUP is an optional function to
  * provide a way for lower layers to ask for the caching TTL.  If a
@@ -451,50 +526,9 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
   else
     {
       /* No smartcard, but a private key */
-      int dsaalgo = 0;
-
-      /* Put the hash into a sexp */
-      if (agent_is_eddsa_key (s_skey))
-        err = do_encode_eddsa (data, datalen,
-                               &s_hash);
-      else if (ctrl->digest.algo == MD_USER_TLS_MD5SHA1)
-        err = do_encode_raw_pkcs1 (data, datalen,
-                                   gcry_pk_get_nbits (s_skey),
-                                   &s_hash);
-      else if ( (dsaalgo = agent_is_dsa_key (s_skey)) )
-        err = do_encode_dsa (data, datalen,
-                             dsaalgo, s_skey,
-                             &s_hash);
-      else
-        err = do_encode_md (data, datalen,
-                            ctrl->digest.algo,
-                            &s_hash,
-                            ctrl->digest.raw_value);
+      err = sign_with_skey (ctrl, s_skey, data, datalen, &s_sig);
       if (err)
         goto leave;
-
-      if (dsaalgo == 0 && GCRYPT_VERSION_NUMBER < 0x010700)
-        {
-          /* It's RSA and Libgcrypt < 1.7 */
-          check_signature = 1;
-        }
-
-      if (DBG_CRYPTO)
-        {
-          gcry_log_debugsxp ("skey", s_skey);
-          gcry_log_debugsxp ("hash", s_hash);
-        }
-
-      /* sign */
-      err = gcry_pk_sign (&s_sig, s_hash, s_skey);
-      if (err)
-        {
-          log_error ("signing failed: %s\n", gpg_strerror (err));
-          goto leave;
-        }
-
-      if (DBG_CRYPTO)
-        gcry_log_debugsxp ("rslt", s_sig);
     }
 
   /* Check that the signature verification worked and nothing is
@@ -575,3 +609,82 @@ agent_pksign (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
 
   return err;
 }
+
+
+/* Sign each of the NHASHES hashes at HASHES with the key set in CTRL
+ * and append the signatures as canonical S-expressions to OUTBUF.
+ * The secret key is read and unprotected only once.  On error
+ * nothing is appended to OUTBUF.  The digest in CTRL is overwritten.  */
+gpg_error_t
+agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce,
+                    const char *desc_text,
+                    const struct pksign_hash_s *hashes, unsigned int nhashes,
+                    membuf_t *outbuf, cache_mode_t cache_mode)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_skey = NULL;
+  gcry_sexp_t s_sig = NULL;
+  unsigned char *shadow_info = NULL;
+  membuf_t sigbuf;
+  unsigned int n;
+  char *buf;
+  size_t len;
+
+  if (!ctrl->have_keygrip)
+    return gpg_error (GPG_ERR_NO_SECKEY);
+
+  err = agent_key_from_file (ctrl, cache_nonce, desc_text, ctrl->keygrip,
+                             &shadow_info, cache_mode, NULL, &s_skey, NULL);
+  if (err)
+    {
+      if (gpg_err_code (err) != GPG_ERR_NO_SECKEY)
+        log_error ("failed to read the secret key\n");
+      return err;
+    }
+
+  init_membuf (&sigbuf, 512 * (nhashes? nhashes : 1));
+  for (n=0; !err && n < nhashes; n++)
+    {
+      ctrl->digest.algo = hashes[n].algo;
+      ctrl->digest.raw_value = 0;
+      ctrl->digest.valuelen = hashes[n].valuelen;
+      memcpy (ctrl->digest.value, hashes[n].value, hashes[n].valuelen);
+
+      /* A smartcard does the signing itself and scdaemon caches the
+       * PIN; thus we simply do the regular operation for each hash.  */
+      if (shadow_info)
+        err = agent_pksign_do (ctrl, cache_nonce, desc_text, &s_sig,
+                               cache_mode, NULL, NULL, 0);
+      else
+        err = sign_with_skey (ctrl, s_skey, hashes[n].value,
+                              hashes[n].valuelen, &s_sig);
+      if (err)
+        break;
+
+      len = gcry_sexp_sprint (s_sig, GCRYSEXP_FMT_CANON, NULL, 0);
+      log_assert (len);
+      buf = xtrymalloc (len);
+      if (!buf)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          len = gcry_sexp_sprint (s_sig, GCRYSEXP_FMT_CANON, buf, len);
+          log_assert (len);
+          put_membuf (&sigbuf, buf, len);
+          xfree (buf);
+        }
+      gcry_sexp_release (s_sig);
+      s_sig = NULL;
+    }
+
+  buf = get_membuf (&sigbuf, &len);
+  if (!buf && !err)
+    err = gpg_error_from_syserror ();
+  if (!err)
+    put_membuf (outbuf, buf, len);
+  xfree (buf);
+
+  gcry_sexp_release (s_skey);
+  xfree (shadow_info);
+  return err;
+}
@@ -818,3 +818,15 @@ agent_write_private_key (const unsigned char *grip,
 
   return 0;
 }
+
+
+/* Stub functions; this tool does not use nPth.  */
+void
+agent_cpu_begin (void)
+{
+}
+
+void
+agent_cpu_end (void)
+{
+}
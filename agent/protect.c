@@ -41,6 +41,7 @@
 
 #include "cvt-openpgp.h"
 #include "../common/sexp-parse.h"
+#include "../common/i18n.h"
 
 
 /* The protection mode for encryption.  The supported modes for
@@ -52,6 +53,12 @@
 /* Decode an rfc4880 encoded S2K count.  */
 #define S2K_DECODE_COUNT(_val) ((16ul + ((_val) & 15)) << (((_val) >> 4) + 6))
 
+/* The file in the homedir used to store the S2K calibration, its
+   version and the maximum number of machines it keeps.  */
+#define S2K_CALIBRATION_FILE    "s2kcalib.txt"
+#define S2K_CALIBRATION_VERSION 1
+#define S2K_CALIBRATION_MAX     16
+
 
 /* A table containing the information needed to create a protected
    private key.  */
@@ -71,6 +78,30 @@ static const struct {
 };
 
 
+/* The cache of derived protection keys.  The S2K derivation with the
+   calibrated count takes about 100ms; this cache allows to skip it
+   if the same key is unprotected again with the same passphrase.  An
+   item is identified by a HMAC over the passphrase and the S2K
+   parameters using a random key.  The cache is allocated in secure
+   memory and its items expire like the items of the passphrase
+   cache.  */
+#define KEK_CACHE_SIZE 16
+struct kek_cache_item_s
+{
+  unsigned char tag[32];  /* The HMAC.  */
+  unsigned char kek[32];  /* The derived key.  */
+  size_t keklen;          /* Length of KEK; 0 for an unused item.  */
+  time_t created;
+  time_t accessed;
+};
+struct kek_cache_s
+{
+  unsigned char hmackey[32];
+  struct kek_cache_item_s items[KEK_CACHE_SIZE];
+};
+static struct kek_cache_s *kek_cache;
+
+
 /* A helper object for time measurement.  */
 struct calibrate_time_s
 {
@@ -82,6 +113,17 @@ struct calibrate_time_s
 };
 
 
+/* The number of hash_passphrase calls currently running without the
+   nPth lock and a counter incremented for each call.  Both are only
+   changed with the nPth lock held.  They allow the calibration to
+   detect that other hashing was running concurrently.  */
+static unsigned int hash_passphrase_running;
+static unsigned int hash_passphrase_seqno;
+
+/* The number of attempts to measure without concurrent hashing.  */
+#define CALIBRATE_MAX_TRIES 10
+
+
 static int
 hash_passphrase (const char *passphrase, int hashalgo,
                  int s2kmode,
@@ -91,20 +133,15 @@ hash_passphrase (const char *passphrase, int hashalgo,
 
 
 
-/* Get the process time and store it in DATA.  */
+/* Get the CPU time of the current thread, or of the process if that
+   is not available, and store it in DATA.  */
 static void
 calibrate_get_time (struct calibrate_time_s *data)
 {
 #ifdef HAVE_W32_SYSTEM
-# ifdef HAVE_W32CE_SYSTEM
   GetThreadTimes (GetCurrentThread (),
                   &data->creation_time, &data->exit_time,
                   &data->kernel_time, &data->user_time);
-# else
-  GetProcessTimes (GetCurrentProcess (),
-                   &data->creation_time, &data->exit_time,
-                   &data->kernel_time, &data->user_time);
-# endif
 #elif defined (CLOCK_THREAD_CPUTIME_ID)
   struct timespec tmp;
 
@@ -145,27 +182,43 @@ calibrate_elapsed_time (struct calibrate_time_s *starttime)
 
 
 /* Run a test hashing for COUNT and return the time required in
-   milliseconds.  */
+   milliseconds.  Where only the process time is available, hashing
+   done by other connections meanwhile would be counted as well; thus
+   the measurement is repeated if other hashing was running.  */
 static unsigned long
 calibrate_s2k_count_one (unsigned long count)
 {
   int rc;
   char keybuf[PROT_CIPHER_KEYLEN];
   struct calibrate_time_s starttime;
+  unsigned long ms;
+  unsigned int seqno;
+  int concurrent, tries;
 
-  calibrate_get_time (&starttime);
-  rc = hash_passphrase ("123456789abcdef0", GCRY_MD_SHA1,
-                        3, "saltsalt", count, keybuf, sizeof keybuf);
-  if (rc)
-    BUG ();
-  return calibrate_elapsed_time (&starttime);
+  for (tries=0; ; tries++)
+    {
+      concurrent = hash_passphrase_running;
+      seqno = hash_passphrase_seqno;
+      calibrate_get_time (&starttime);
+      rc = hash_passphrase ("123456789abcdef0", GCRY_MD_SHA1,
+                            3, "saltsalt", count, keybuf, sizeof keybuf);
+      if (rc)
+        BUG ();
+      ms = calibrate_elapsed_time (&starttime);
+      if (hash_passphrase_seqno != seqno + 1)
+        concurrent = 1;
+      if (!concurrent || tries + 1 >= CALIBRATE_MAX_TRIES)
+        return ms;
+    }
 }
 
 
 /* Measure the time we need to do the hash operations and deduce an
-   S2K count which requires roughly some targeted amount of time.  */
-static unsigned long
-calibrate_s2k_count (void)
+   S2K count which requires roughly some targeted amount of time.  If
+   NO_LOG is set, nothing is logged; this is required if the function
+   is called without the nPth lock held.  */
+unsigned long
+calibrate_s2k_count (int no_log)
 {
   unsigned long count;
   unsigned long ms;
@@ -173,7 +226,7 @@ calibrate_s2k_count (void)
   for (count = 65536; count; count *= 2)
     {
       ms = calibrate_s2k_count_one (count);
-      if (opt.verbose > 1)
+      if (opt.verbose > 1 && !no_log)
         log_info ("S2K calibration: %lu -> %lums\n", count, ms);
       if (ms > AGENT_S2K_CALIBRATION)
         break;
@@ -185,7 +238,7 @@ calibrate_s2k_count (void)
   if (count < 65536)
     count = 65536;
 
-  if (opt.verbose)
+  if (opt.verbose && !no_log)
     {
       ms = calibrate_s2k_count_one (count);
       log_info ("S2K calibration: %lu -> %lums\n", count, ms);
@@ -195,18 +248,240 @@ calibrate_s2k_count (void)
 }
 
 
+/* The calibrated S2K count or 0 if not yet known.  */
+static unsigned long calibrated_s2k_count;
+
+/* A function to wait for a calibration running in the background or
+   NULL.  */
+static void (*s2k_calibration_wait_fnc) (void);
+
+
+/* Set the calibrated S2K count to COUNT.  This is used by gpg-agent
+ * to install a stored value or the result of a calibration done in
+ * the background.  */
+void
+set_calibrated_s2k_count (unsigned long count)
+{
+  calibrated_s2k_count = count;
+}
+
+
+/* Register FNC to be called before a calibration is done in the
+ * foreground.  FNC shall return after a calibration running in the
+ * background has been finished.  */
+void
+register_s2k_calibration_wait (void (*fnc) (void))
+{
+  s2k_calibration_wait_fnc = fnc;
+}
+
+
 /* Return the calibrated S2K count.  This is only public for the use
  * of the Assuan getinfo s2k_count_cal command.  */
 unsigned long
 get_calibrated_s2k_count (void)
 {
-  static unsigned long count;
-
-  if (!count)
-    count = calibrate_s2k_count ();
+  if (!calibrated_s2k_count && s2k_calibration_wait_fnc)
+    s2k_calibration_wait_fnc ();
+  if (!calibrated_s2k_count)
+    calibrated_s2k_count = calibrate_s2k_count (0);
 
   /* Enforce a lower limit.  */
-  return count < 65536 ? 65536 : count;
+  return calibrated_s2k_count < 65536 ? 65536 : calibrated_s2k_count;
+}
+
+
+/* Return a malloced string identifying the machine for the stored S2K
+ * calibration or NULL if that is not possible.  The string is made up
+ * from the CPU model, the Libgcrypt version and the targeted time;
+ * it does not contain a colon or a linefeed.  */
+static char *
+s2k_calibration_key (void)
+{
+  char *model = NULL;
+  char *result, *p;
+#if defined(HAVE_W32_SYSTEM)
+  const char *s = getenv ("PROCESSOR_IDENTIFIER");
+
+  if (s && *s)
+    model = xtrystrdup (s);
+#else
+  estream_t fp;
+  char line[256];
+
+  fp = es_fopen ("/proc/cpuinfo", "r");
+  if (fp)
+    {
+      while (!model && es_fgets (line, DIM(line)-1, fp))
+        {
+          if (strncmp (line, "model name", 10)
+              && strncmp (line, "Processor", 9)
+              && strncmp (line, "cpu model", 9))
+            continue;
+          p = strchr (line, ':');
+          if (!p)
+            continue;
+          p++;
+          trim_spaces (p);
+          if (*p)
+            model = xtrystrdup (p);
+        }
+      es_fclose (fp);
+    }
+#endif
+  if (!model)
+    return NULL;
+
+  result = xtryasprintf ("%d %s %s",
+                         AGENT_S2K_CALIBRATION, gcry_check_version (NULL),
+                         model);
+  xfree (model);
+  if (result)
+    for (p = result; *p; p++)
+      if (*p == ':' || *p == '\n' || *p == '\r')
+        *p = ' ';
+  return result;
+}
+
+
+/* Read the stored S2K calibration for this machine and store it at
+ * R_COUNT.  Returns GPG_ERR_NOT_FOUND if there is none.  */
+gpg_error_t
+read_s2k_calibration (unsigned long *r_count)
+{
+  gpg_error_t err = gpg_error (GPG_ERR_NOT_FOUND);
+  char *key, *fname, *p;
+  estream_t fp;
+  char line[512];
+  unsigned long count;
+  int lineno = 0;
+
+  *r_count = 0;
+  key = s2k_calibration_key ();
+  if (!key)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  fname = make_filename (gnupg_homedir (), S2K_CALIBRATION_FILE, NULL);
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info (_("can't open '%s': %s\n"), fname, strerror (errno));
+      goto leave;
+    }
+  while (es_fgets (line, DIM(line)-1, fp))
+    {
+      trim_trailing_spaces (line);
+      if (!lineno++)
+        {
+          if (strncmp (line, "v:", 2)
+              || atoi (line+2) != S2K_CALIBRATION_VERSION)
+            break;
+          continue;
+        }
+      if (*line == '#' || !(p = strchr (line, ':')))
+        continue;
+      *p++ = 0;
+      if (strcmp (p, key))
+        continue;
+      count = strtoul (line, NULL, 10);
+      if (count > 65536)  /* See write_s2k_calibration.  */
+        {
+          *r_count = count;
+          err = 0;
+        }
+      break;
+    }
+  es_fclose (fp);
+
+ leave:
+  if (!err && opt.verbose)
+    log_info ("using stored S2K calibration: %lu\n", *r_count);
+  xfree (fname);
+  xfree (key);
+  return err;
+}
+
+
+/* Store the S2K calibration COUNT for this machine.  The values for
+ * other machines, which may share the same homedir, are kept.  A
+ * COUNT not above the minimum of 65536 is not stored; it is most
+ * likely the result of a disturbed measurement and a later start
+ * shall calibrate again instead of using a weak count for good.  */
+void
+write_s2k_calibration (unsigned long count)
+{
+  gpg_error_t err;
+  char *key, *fname, *tmpfname = NULL;
+  estream_t fp, outfp = NULL;
+  char line[512];
+  const char *p;
+  int lineno = 0;
+  int nlines = 0;
+
+  if (count <= 65536)
+    return;
+
+  key = s2k_calibration_key ();
+  if (!key)
+    return;
+
+  fname = make_filename (gnupg_homedir (), S2K_CALIBRATION_FILE, NULL);
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  outfp = es_fopen (tmpfname, "w");
+  if (!outfp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  es_fprintf (outfp, "v:%d:\n", S2K_CALIBRATION_VERSION);
+  es_fputs ("# S2K calibration per machine.  Created by gpg-agent"
+            " - do not edit.\n", outfp);
+  es_fprintf (outfp, "%lu:%s\n", count, key);
+
+  /* Copy the values for other machines.  */
+  fp = es_fopen (fname, "r");
+  if (fp)
+    {
+      while (es_fgets (line, DIM(line)-1, fp)
+             && nlines + 1 < S2K_CALIBRATION_MAX)
+        {
+          if (!lineno++)
+            {
+              if (strncmp (line, "v:", 2)
+                  || atoi (line+2) != S2K_CALIBRATION_VERSION)
+                break;
+              continue;
+            }
+          if (*line == '#' || !strchr (line, '\n')
+              || !(p = strchr (line, ':')))
+            continue;
+          if (!strncmp (p+1, key, strlen (key))
+              && (p[1+strlen (key)] == '\n' || p[1+strlen (key)] == '\r'))
+            continue;  /* Our old value.  */
+          es_fputs (line, outfp);
+          nlines++;
+        }
+      es_fclose (fp);
+    }
+
+  err = es_fclose (outfp)? gpg_error_from_syserror () : 0;
+  outfp = NULL;
+  if (!err)
+    err = gnupg_rename_file (tmpfname, fname, NULL);
+
+ leave:
+  if (err)
+    log_error (_("error writing '%s': %s\n"), fname, gpg_strerror (err));
+  es_fclose (outfp);
+  xfree (tmpfname);
+  xfree (fname);
+  xfree (key);
 }
 
 
@@ -751,6 +1026,129 @@ agent_protect (const unsigned char *plainkey, const char *passphrase,
 
 
 
+/* Compute the tag for the cache of derived keys into TAG.  */
+static gpg_error_t
+kek_cache_tag (const char *passphrase, const unsigned char *s2ksalt,
+               unsigned long s2kcount, size_t keylen, unsigned char *tag)
+{
+  gpg_error_t err;
+  gcry_md_hd_t md;
+  unsigned char buf[8];
+
+  err = gcry_md_open (&md, GCRY_MD_SHA256,
+                      (GCRY_MD_FLAG_HMAC | GCRY_MD_FLAG_SECURE));
+  if (err)
+    return err;
+  err = gcry_md_setkey (md, kek_cache->hmackey, sizeof kek_cache->hmackey);
+  if (!err)
+    {
+      gcry_md_write (md, passphrase, strlen (passphrase) + 1);
+      gcry_md_write (md, s2ksalt, 8);
+      buf[0] = s2kcount >> 24;
+      buf[1] = s2kcount >> 16;
+      buf[2] = s2kcount >> 8;
+      buf[3] = s2kcount;
+      buf[4] = keylen >> 24;
+      buf[5] = keylen >> 16;
+      buf[6] = keylen >> 8;
+      buf[7] = keylen;
+      gcry_md_write (md, buf, 8);
+      memcpy (tag, gcry_md_read (md, 0), 32);
+    }
+  gcry_md_close (md);
+  return err;
+}
+
+
+/* Derive the protection key from PASSPHRASE as done by hash_passphrase
+   with SHA-1 and S2K mode 3, but use the cache of derived keys.  */
+static gpg_error_t
+hash_passphrase_cached (const char *passphrase,
+                        const unsigned char *s2ksalt, unsigned long s2kcount,
+                        unsigned char *key, size_t keylen)
+{
+  gpg_error_t err;
+  unsigned char tag[32];
+  struct kek_cache_item_s *item, *slot;
+  time_t now;
+  int i;
+
+  if (!opt.def_cache_ttl || !passphrase || !*passphrase
+      || keylen > sizeof kek_cache->items[0].kek)
+    return hash_passphrase (passphrase, GCRY_MD_SHA1, 3, s2ksalt, s2kcount,
+                            key, keylen);
+
+  if (!kek_cache)
+    {
+      struct kek_cache_s *newcache;
+
+      /* Note that allocating secure memory may switch threads.  */
+      newcache = xtrycalloc_secure (1, sizeof *newcache);
+      if (!newcache)
+        return gpg_error_from_syserror ();
+      gcry_randomize (newcache->hmackey, sizeof newcache->hmackey,
+                      GCRY_STRONG_RANDOM);
+      if (kek_cache)
+        xfree (newcache);
+      else
+        kek_cache = newcache;
+    }
+
+  err = kek_cache_tag (passphrase, s2ksalt, s2kcount, keylen, tag);
+  if (err)
+    return err;
+
+  /* From here on we must not switch threads until we are done with
+   * the cache.  */
+  now = gnupg_get_time ();
+  slot = NULL;
+  for (i=0; i < KEK_CACHE_SIZE; i++)
+    {
+      item = kek_cache->items + i;
+      if (item->keklen
+          && (item->accessed + opt.def_cache_ttl < now
+              || item->created + opt.max_cache_ttl < now))
+        {
+          wipememory (item, sizeof *item);  /* Expired.  */
+        }
+      if (item->keklen == keylen && !memcmp (item->tag, tag, sizeof tag))
+        {
+          memcpy (key, item->kek, keylen);
+          item->accessed = now;
+          wipememory (tag, sizeof tag);
+          return 0;
+        }
+      if (!slot || !item->keklen
+          || (slot->keklen && item->accessed < slot->accessed))
+        slot = item;
+    }
+
+  err = hash_passphrase (passphrase, GCRY_MD_SHA1, 3, s2ksalt, s2kcount,
+                         key, keylen);
+  if (!err)
+    {
+      /* The KDF may have switched threads; thus SLOT might have been
+       * reused by now.  We don't care because at worst another item
+       * is dropped from the cache.  */
+      memcpy (slot->tag, tag, sizeof tag);
+      memcpy (slot->kek, key, keylen);
+      slot->keklen = keylen;
+      slot->created = slot->accessed = gnupg_get_time ();
+    }
+  wipememory (tag, sizeof tag);
+  return err;
+}
+
+
+/* Remove all items from the cache of derived keys.  */
+void
+agent_flush_kek_cache (void)
+{
+  if (kek_cache)
+    wipememory (kek_cache->items, sizeof kek_cache->items);
+}
+
+
 /* Do the actual decryption and check the return list for consistency.  */
 static gpg_error_t
 do_decryption (const unsigned char *aad_begin, size_t aad_len,
@@ -804,8 +1202,8 @@ do_decryption (const unsigned char *aad_begin, size_t aad_len,
         rc = out_of_core ();
       else
         {
-          rc = hash_passphrase (passphrase, GCRY_MD_SHA1,
-                                3, s2ksalt, s2kcount, key, prot_cipher_keylen);
+          rc = hash_passphrase_cached (passphrase, s2ksalt, s2kcount,
+                                       key, prot_cipher_keylen);
           if (!rc)
             rc = gcry_cipher_setkey (hd, key, prot_cipher_keylen);
           xfree (key);
@@ -1426,6 +1824,10 @@ agent_private_key_type (const unsigned char *privatekey)
    provide an HASHALGO, a valid S2KMODE (see rfc-2440) and depending on
    that mode an S2KSALT of 8 random bytes and an S2KCOUNT.
 
+   The KDF is run without the nPth lock so that several connections,
+   for example a bulk IMPORT_KEY by several clients, can derive their
+   keys concurrently.
+
    Returns an error code on failure.  */
 static int
 hash_passphrase (const char *passphrase, int hashalgo,
@@ -1434,17 +1836,25 @@ hash_passphrase (const char *passphrase, int hashalgo,
                  unsigned long s2kcount,
                  unsigned char *key, size_t keylen)
 {
+  gpg_error_t err;
+
   /* The key derive function does not support a zero length string for
      the passphrase in the S2K modes.  Return a better suited error
      code than GPG_ERR_INV_DATA.  */
   if (!passphrase || !*passphrase)
     return gpg_error (GPG_ERR_NO_PASSPHRASE);
-  return gcry_kdf_derive (passphrase, strlen (passphrase),
-                          s2kmode == 3? GCRY_KDF_ITERSALTED_S2K :
-                          s2kmode == 1? GCRY_KDF_SALTED_S2K :
-                          s2kmode == 0? GCRY_KDF_SIMPLE_S2K : GCRY_KDF_NONE,
-                          hashalgo, s2ksalt, 8, s2kcount,
-                          keylen, key);
+  hash_passphrase_running++;
+  hash_passphrase_seqno++;
+  agent_cpu_begin ();
+  err = gcry_kdf_derive (passphrase, strlen (passphrase),
+                         s2kmode == 3? GCRY_KDF_ITERSALTED_S2K :
+                         s2kmode == 1? GCRY_KDF_SALTED_S2K :
+                         s2kmode == 0? GCRY_KDF_SIMPLE_S2K : GCRY_KDF_NONE,
+                         hashalgo, s2ksalt, 8, s2kcount,
+                         keylen, key);
+  agent_cpu_end ();
+  hash_passphrase_running--;
+  return err;
 }
 
 
@@ -0,0 +1,186 @@
+/* t-cache.c - Module tests for cache.c
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "agent.h"
+
+
+#define fail()  do { fprintf (stderr, "%s:%d: test failed\n",\
+                              __FILE__,__LINE__);            \
+                     exit (1);                               \
+                   } while(0)
+
+static const char grip1[] = "0123456789ABCDEF0123456789ABCDEF01234567";
+static const char grip2[] = "76543210FEDCBA9876543210FEDCBA9876543210";
+static const unsigned char skey[] = "(11:private-key(3:rsa(1:n3:abc)))";
+
+
+/* Return true if the key HEXGRIP is cached for CTRL and has the value
+ * SKEY.  */
+static int
+key_is_cached (ctrl_t ctrl, const char *hexgrip)
+{
+  unsigned char *value;
+  int okay;
+
+  value = agent_get_cache_key (ctrl, hexgrip, CACHE_MODE_NORMAL);
+  okay = value && !memcmp (value, skey, sizeof skey - 1);
+  xfree (value);
+  return okay;
+}
+
+
+static void
+test_put_get (void)
+{
+  struct server_control_s ctrl, rctrl;
+
+  memset (&ctrl, 0, sizeof ctrl);
+  memset (&rctrl, 0, sizeof rctrl);
+  rctrl.restricted = 1;
+
+  if (agent_put_cache_key (&ctrl, grip1, CACHE_MODE_NORMAL, skey, 0))
+    fail ();
+  if (!key_is_cached (&ctrl, grip1))
+    fail ();
+  if (key_is_cached (&ctrl, grip2))
+    fail ();
+  /* The restricted flag is part of the key.  */
+  if (key_is_cached (&rctrl, grip1))
+    fail ();
+  /* CACHE_MODE_IGNORE never hits.  */
+  if (agent_get_cache_key (&ctrl, grip1, CACHE_MODE_IGNORE))
+    fail ();
+
+  /* Nothing is stored with CACHE_MODE_IGNORE or a bad keygrip.  */
+  if (agent_put_cache_key (&ctrl, grip2, CACHE_MODE_IGNORE, skey, 0))
+    fail ();
+  if (agent_put_cache_key (&ctrl, "0123", CACHE_MODE_NORMAL, skey, 0))
+    fail ();
+  if (key_is_cached (&ctrl, grip2))
+    fail ();
+
+  /* Clearing a key leaves the other keys alone.  */
+  if (agent_put_cache_key (&ctrl, grip2, CACHE_MODE_NORMAL, skey, 0))
+    fail ();
+  agent_clear_cache_key (grip1);
+  if (key_is_cached (&ctrl, grip1) || !key_is_cached (&ctrl, grip2))
+    fail ();
+
+  /* Clearing the passphrase also clears the key.  */
+  if (agent_put_cache (&ctrl, grip2, CACHE_MODE_NORMAL, "abc", 0))
+    fail ();
+  if (!key_is_cached (&ctrl, grip2))
+    fail ();
+  if (agent_put_cache (&ctrl, grip2, CACHE_MODE_NORMAL, NULL, 0))
+    fail ();
+  if (key_is_cached (&ctrl, grip2))
+    fail ();
+
+  /* A flush removes all keys.  */
+  if (agent_put_cache_key (&ctrl, grip1, CACHE_MODE_NORMAL, skey, 0)
+      || agent_put_cache_key (&rctrl, grip1, CACHE_MODE_NORMAL, skey, 0))
+    fail ();
+  agent_flush_cache ();
+  if (key_is_cached (&ctrl, grip1) || key_is_cached (&rctrl, grip1))
+    fail ();
+}
+
+
+static void
+test_expire (void)
+{
+  struct server_control_s ctrl;
+  time_t now = gnupg_get_time ();
+  int i;
+
+  memset (&ctrl, 0, sizeof ctrl);
+
+  /* A key expires TTL seconds after the last access.  */
+  gnupg_set_time (now, 1);
+  if (agent_put_cache_key (&ctrl, grip1, CACHE_MODE_NORMAL, skey, 10))
+    fail ();
+  gnupg_set_time (now + 8, 1);
+  if (!key_is_cached (&ctrl, grip1))
+    fail ();
+  gnupg_set_time (now + 16, 1);
+  if (!key_is_cached (&ctrl, grip1))
+    fail ();
+  gnupg_set_time (now + 27, 1);
+  if (key_is_cached (&ctrl, grip1))
+    fail ();
+
+  /* And --max-cache-ttl seconds after its creation.  */
+  now += 100;
+  gnupg_set_time (now, 1);
+  if (agent_put_cache_key (&ctrl, grip1, CACHE_MODE_NORMAL, skey, 10))
+    fail ();
+  for (i=8; i <= opt.max_cache_ttl; i += 8)
+    {
+      gnupg_set_time (now + i, 1);
+      if (!key_is_cached (&ctrl, grip1))
+        fail ();
+    }
+  gnupg_set_time (now + opt.max_cache_ttl + 1, 1);
+  if (key_is_cached (&ctrl, grip1))
+    fail ();
+
+  /* Without a TTL nothing is stored.  */
+  opt.def_cache_ttl = 0;
+  if (agent_put_cache_key (&ctrl, grip1, CACHE_MODE_NORMAL, skey, 0))
+    fail ();
+  if (key_is_cached (&ctrl, grip1))
+    fail ();
+  opt.def_cache_ttl = 600;
+
+  gnupg_set_time ((time_t)(-1), 0);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  (void)argv;
+
+  opt.verbose = argc - 1;
+  gcry_control (GCRYCTL_DISABLE_SECMEM);
+
+  opt.def_cache_ttl = 600;
+  opt.max_cache_ttl = 60;
+  initialize_module_cache ();
+
+  test_put_get ();
+  test_expire ();
+
+  deinitialize_module_cache ();
+  return 0;
+}
+
+
+/* Stub function.  */
+void
+agent_flush_kek_cache (void)
+{
+}
@@ -348,3 +348,15 @@ convert_from_openpgp_native (gcry_sexp_t s_pgp, const char *passphrase,
   (void)r_key;
   return gpg_error (GPG_ERR_BUG);
 }
+
+
+/* Stub functions; this test does not use nPth.  */
+void
+agent_cpu_begin (void)
+{
+}
+
+void
+agent_cpu_end (void)
+{
+}
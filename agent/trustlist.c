@@ -47,15 +47,23 @@ struct trustitem_s
     int cm:1;             /* Use chain model for validation. */
   } flags;
   unsigned char fpr[20];  /* The binary fingerprint. */
+  unsigned int seqno;     /* The position in the files; used to keep
+                             the first of duplicate entries.  */
 };
 typedef struct trustitem_s trustitem_t;
 
-/* Malloced table and its allocated size with all trust items. */
+/* Malloced table and its allocated size with all trust items.  The
+   table is sorted by fingerprint.  */
 static trustitem_t *trusttable;
 static size_t trusttablesize;
-/* A mutex used to protect the table. */
+/* A mutex used to protect the table.  Because nPth is not preemptive
+   it is only required while the table is being read.  */
 static npth_mutex_t trusttable_lock;
 
+/* The state of the trust files when the table was read.  Index 0 is
+   for the user's file and index 1 for the system file.  */
+static gnupg_file_stamp_t trustfile_stamps[2];
+
 
 static const char headerblurb[] =
 "# This is the list of trusted keys.  Comment lines, like this one, as\n"
@@ -128,6 +136,63 @@ clear_trusttable (void)
 }
 
 
+/* Store the state of the trust files at STAMPS.  */
+static void
+get_trustfile_stamps (gnupg_file_stamp_t *stamps)
+{
+  char *fname;
+  int i;
+
+  for (i=0; i < 2; i++)
+    {
+      fname = make_filename (i? gnupg_sysconfdir () : gnupg_homedir (),
+                             "trustlist.txt", NULL);
+      gnupg_get_file_stamp (fname, stamps + i);
+      xfree (fname);
+    }
+}
+
+
+/* Sort function for the trust items.  */
+static int
+compare_trustitems (const void *arg_a, const void *arg_b)
+{
+  const trustitem_t *a = arg_a;
+  const trustitem_t *b = arg_b;
+  int cmp;
+
+  cmp = memcmp (a->fpr, b->fpr, 20);
+  if (!cmp)
+    cmp = a->seqno < b->seqno? -1 : a->seqno > b->seqno;
+  return cmp;
+}
+
+
+/* Return the item for the binary fingerprint FPR or NULL.  The
+   trusttable must have been read.  */
+static trustitem_t *
+find_trustitem (const unsigned char *fpr)
+{
+  size_t lo = 0;
+  size_t hi = trusttablesize;
+  size_t mid;
+  int cmp;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      cmp = memcmp (trusttable[mid].fpr, fpr, 20);
+      if (!cmp)
+        return trusttable + mid;
+      if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return NULL;
+}
+
+
 static gpg_error_t
 read_one_trustfile (const char *fname, int allow_include,
                     trustitem_t **addr_of_table,
@@ -236,6 +301,7 @@ read_one_trustfile (const char *fname, int allow_include,
       ti = table + tableidx;
 
       memset (&ti->flags, 0, sizeof ti->flags);
+      ti->seqno = tableidx;
       if (*p == '!')
         {
           ti->flags.disabled = 1;
@@ -337,6 +403,12 @@ read_trustfiles (void)
   size_t tablesize;
   char *fname;
   int allow_include = 1;
+  gnupg_file_stamp_t stamps[2];
+  size_t i, n;
+
+  /* Take the stamps first so that a change while reading the files
+     leads to another read at the next reload.  */
+  get_trustfile_stamps (stamps);
 
   tablesize = 20;
   table = xtrycalloc (tablesize, sizeof *table);
@@ -381,7 +453,14 @@ read_trustfiles (void)
       return err;
     }
 
-  /* Fixme: we should drop duplicates and sort the table. */
+  /* Sort the table and drop the duplicates; the first entry read
+     wins as it did with the former linear search.  */
+  qsort (table, tableidx, sizeof *table, compare_trustitems);
+  for (i=n=0; i < tableidx; i++)
+    if (!n || memcmp (table[n-1].fpr, table[i].fpr, 20))
+      table[n++] = table[i];
+  tableidx = n;
+
   ti = xtryrealloc (table, (tableidx?tableidx:1) * sizeof *table);
   if (!ti)
     {
@@ -394,6 +473,7 @@ read_trustfiles (void)
   xfree (trusttable);
   trusttable = ti;
   trusttablesize = tableidx;
+  memcpy (trustfile_stamps, stamps, sizeof trustfile_stamps);
   return 0;
 }
 
@@ -406,29 +486,28 @@ istrusted_internal (ctrl_t ctrl, const char *fpr, int *r_disabled,
                     int already_locked)
 {
   gpg_error_t err = 0;
-  int locked = already_locked;
+  int locked = 0;
   trustitem_t *ti;
-  size_t len;
   unsigned char fprbin[20];
+  int disabled, relax, cm;
 
   if (r_disabled)
     *r_disabled = 0;
 
   if ( hexcolon2bin (fpr, fprbin, 20) < 0 )
-    {
-      err = gpg_error (GPG_ERR_INV_VALUE);
-      goto leave;
-    }
-
-  if (!already_locked)
-    {
-      lock_trusttable ();
-      locked = 1;
-    }
+    return gpg_error (GPG_ERR_INV_VALUE);
 
+  /* The lock is only needed to read the table.  The lookup itself
+     does not call into nPth and thus can't be interrupted.  */
   if (!trusttable)
     {
-      err = read_trustfiles ();
+      if (!already_locked)
+        {
+          lock_trusttable ();
+          locked = 1;
+        }
+      if (!trusttable)
+        err = read_trustfiles ();
       if (err)
         {
           log_error (_("error reading list of trusted root certificates\n"));
@@ -436,40 +515,38 @@ istrusted_internal (ctrl_t ctrl, const char *fpr, int *r_disabled,
         }
     }
 
-  if (trusttable)
+  ti = trusttable? find_trustitem (fprbin) : NULL;
+  if (!ti)
     {
-      for (ti=trusttable, len = trusttablesize; len; ti++, len--)
-        if (!memcmp (ti->fpr, fprbin, 20))
-          {
-            if (ti->flags.disabled && r_disabled)
-              *r_disabled = 1;
-
-            /* Print status messages only if we have not been called
-               in a locked state.  */
-            if (already_locked)
-              ;
-            else if (ti->flags.relax)
-              {
-                unlock_trusttable ();
-                locked = 0;
-                err = agent_write_status (ctrl, "TRUSTLISTFLAG", "relax", NULL);
-              }
-            else if (ti->flags.cm)
-              {
-                unlock_trusttable ();
-                locked = 0;
-                err = agent_write_status (ctrl, "TRUSTLISTFLAG", "cm", NULL);
-              }
-
-            if (!err)
-              err = ti->flags.disabled? gpg_error (GPG_ERR_NOT_TRUSTED) : 0;
-            goto leave;
-          }
+      err = gpg_error (GPG_ERR_NOT_TRUSTED);
+      goto leave;
     }
-  err = gpg_error (GPG_ERR_NOT_TRUSTED);
+  disabled = ti->flags.disabled;
+  relax = ti->flags.relax;
+  cm = ti->flags.cm;
+
+  if (disabled && r_disabled)
+    *r_disabled = 1;
+
+  /* Print status messages only if we have not been called in a
+     locked state.  */
+  if (locked)
+    {
+      unlock_trusttable ();
+      locked = 0;
+    }
+  if (already_locked)
+    ;
+  else if (relax)
+    err = agent_write_status (ctrl, "TRUSTLISTFLAG", "relax", NULL);
+  else if (cm)
+    err = agent_write_status (ctrl, "TRUSTLISTFLAG", "cm", NULL);
+
+  if (!err)
+    err = disabled? gpg_error (GPG_ERR_NOT_TRUSTED) : 0;
 
  leave:
-  if (locked && !already_locked)
+  if (locked)
     unlock_trusttable ();
   return err;
 }
@@ -816,10 +893,19 @@ agent_marktrusted (ctrl_t ctrl, const char *name, const char *fpr, int flag)
 void
 agent_reload_trustlist (void)
 {
+  gnupg_file_stamp_t stamps[2];
+
   /* All we need to do is to delete the trusttable.  At the next
-     access it will get re-read. */
+     access it will get re-read.  If the files have not been changed
+     since they were read we keep the table.  */
   lock_trusttable ();
-  clear_trusttable ();
+  if (trusttable)
+    {
+      get_trustfile_stamps (stamps);
+      if (!gnupg_file_stamp_equal (stamps, trustfile_stamps)
+          || !gnupg_file_stamp_equal (stamps+1, trustfile_stamps+1))
+        clear_trusttable ();
+    }
   unlock_trusttable ();
   bump_key_eventcounter ();
 }
@@ -0,0 +1,442 @@
+/* asynclog.c - Asynchronous writer for the log stream
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* The daemons log from all their threads to the one log stream of
+ * libgpg-error which writes each line synchronously.  With a slow
+ * disk or a stalled watchgnupg at the other end of a log socket every
+ * thread which logs has to wait for it.  The stream created here
+ * only copies the formatted lines into a ring buffer; a dedicated
+ * thread writes them out.  If the ring is full a line is dropped and
+ * the number of dropped lines is noted in the log as soon as the
+ * writer has caught up.
+ *
+ * nPth runs only one thread at a time and the producers as well as
+ * the writer update the ring only while holding the nPth lock.  Thus
+ * the ring itself needs no lock; the writer reads the part between
+ * the tail and the head while it is in a write(2) and the producers
+ * only append after the head.  The mutex is only used with the
+ * condition variable to wake up an idle writer.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef HAVE_W32_SYSTEM
+# include <sys/socket.h>
+# include <sys/un.h>
+#endif
+#include <npth.h>
+
+#include "util.h"
+#include "asynclog.h"
+
+
+/* The size of the ring buffer.  This must be a power of two so that
+ * the byte counters may wrap around.  */
+#define ASYNCLOG_RINGSIZE (1024 * 1024)
+
+/* The minimum number of seconds between two attempts to connect a
+ * log socket.  */
+#define ASYNCLOG_RECONNECT_INTERVAL 2
+
+/* The maximum number of seconds to wait for the writer to write out
+ * the ring when it is stopped.  */
+#define ASYNCLOG_DRAIN_TIMEOUT 2
+
+
+/* The object behind the cookie stream.  */
+struct asynclog_s
+{
+  char *sockname;         /* The name of the log socket or NULL.  */
+  int fd;                 /* The fd of the sink or -1.  */
+  time_t last_connect;    /* Time of the last connect attempt.  */
+  unsigned char *ring;
+  size_t head;            /* Number of bytes put into RING.  */
+  size_t tail;            /* Number of bytes written out from RING.  */
+  unsigned long dropped;  /* Lines dropped since the last notice.  */
+  size_t drop_mark;       /* HEAD at the time of the first drop.  */
+  npth_t thread;
+  npth_mutex_t lock;
+  npth_cond_t cond;
+  npth_cond_t done_cond;  /* Signaled when the writer terminates.  */
+  unsigned int running:1; /* The writer thread is running.  */
+  unsigned int waiting:1; /* The writer waits for COND.  */
+  unsigned int stop:1;    /* The writer shall terminate.  */
+  unsigned int done:1;    /* The writer has terminated.  */
+};
+typedef struct asynclog_s *asynclog_t;
+
+
+/* The currently used writer or NULL.  */
+static asynclog_t the_asynclog;
+
+
+static gpgrt_ssize_t asynclog_cookie_write (void *cookie,
+                                            const void *buffer, size_t size);
+static int asynclog_cookie_close (void *cookie);
+static es_cookie_io_functions_t asynclog_cookie_functions =
+  {
+    NULL,
+    asynclog_cookie_write,
+    NULL,
+    asynclog_cookie_close
+  };
+
+
+
+#ifndef HAVE_W32_SYSTEM
+/* Try to connect the log socket of CTX.  */
+static void
+connect_socket (asynclog_t ctx)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  ctx->last_connect = time (NULL);
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return;
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, ctx->sockname, sizeof addr.sun_path - 1);
+  if (npth_connect (fd, (struct sockaddr *)&addr, SUN_LEN (&addr)) == -1)
+    {
+      close (fd);
+      return;
+    }
+  ctx->fd = fd;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Write BUFFER of LENGTH to the sink of CTX.  Data for a log socket
+ * which is not connected is discarded.  */
+static void
+write_sink (asynclog_t ctx, const void *buffer, size_t length)
+{
+  const unsigned char *p = buffer;
+  ssize_t n;
+
+#ifndef HAVE_W32_SYSTEM
+  if (ctx->fd == -1 && ctx->sockname
+      && time (NULL) - ctx->last_connect >= ASYNCLOG_RECONNECT_INTERVAL)
+    connect_socket (ctx);
+#endif
+
+  while (length && ctx->fd != -1)
+    {
+      n = npth_write (ctx->fd, p, length);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == -1)
+        {
+          /* The other end of the socket went away; try to connect
+           * again later.  For a file we can't do anything.  */
+          if (ctx->sockname)
+            {
+              close (ctx->fd);
+              ctx->fd = -1;
+            }
+          break;
+        }
+      p += n;
+      length -= n;
+    }
+}
+
+
+/* The thread writing out the ring of CTX.  */
+static void *
+writer_thread (void *arg)
+{
+  asynclog_t ctx = arg;
+  char notice[50];
+  size_t off, n;
+
+  for (;;)
+    {
+      if (ctx->dropped && ctx->tail == ctx->drop_mark)
+        {
+          snprintf (notice, sizeof notice, "[%lu log lines dropped]\n",
+                    ctx->dropped);
+          ctx->dropped = 0;
+          write_sink (ctx, notice, strlen (notice));
+          continue;
+        }
+      if (ctx->head == ctx->tail)
+        {
+          if (ctx->stop)
+            break;
+          npth_mutex_lock (&ctx->lock);
+          ctx->waiting = 1;
+          while (ctx->head == ctx->tail && !ctx->stop)
+            npth_cond_wait (&ctx->cond, &ctx->lock);
+          ctx->waiting = 0;
+          npth_mutex_unlock (&ctx->lock);
+          continue;
+        }
+
+      /* Write out the contiguous part up to the head or, if lines
+       * have been dropped, up to the place where that happened.  */
+      off = ctx->tail % ASYNCLOG_RINGSIZE;
+      n = ctx->head - ctx->tail;
+      if (ctx->dropped && n > ctx->drop_mark - ctx->tail)
+        n = ctx->drop_mark - ctx->tail;
+      if (n > ASYNCLOG_RINGSIZE - off)
+        n = ASYNCLOG_RINGSIZE - off;
+      write_sink (ctx, ctx->ring + off, n);
+      ctx->tail += n;
+    }
+
+  npth_mutex_lock (&ctx->lock);
+  ctx->done = 1;
+  npth_cond_broadcast (&ctx->done_cond);
+  npth_mutex_unlock (&ctx->lock);
+  return NULL;
+}
+
+
+/* Stop the writer thread of CTX after it has written out the ring.
+ * Lines logged after this are written synchronously.  We wait at
+ * most ASYNCLOG_DRAIN_TIMEOUT seconds because a stalled log socket
+ * must not block the process, in particular not at its termination.
+ * Returns false if the writer is still busy; it has then been
+ * detached and CTX may not be released.  */
+static int
+stop_writer (asynclog_t ctx)
+{
+  struct timespec abstime;
+  int ret, done;
+
+  if (!ctx->running)
+    return 1;
+
+  npth_mutex_lock (&ctx->lock);
+  ctx->stop = 1;
+  npth_cond_signal (&ctx->cond);
+  npth_clock_gettime (&abstime);
+  abstime.tv_sec += ASYNCLOG_DRAIN_TIMEOUT;
+  while (!ctx->done)
+    {
+      ret = npth_cond_timedwait (&ctx->done_cond, &ctx->lock, &abstime);
+      if (ret && ret != EINTR)
+        break;
+    }
+  done = ctx->done;
+  npth_mutex_unlock (&ctx->lock);
+
+  if (!done)
+    {
+      npth_detach (ctx->thread);
+      return 0;
+    }
+  npth_join (ctx->thread, NULL);
+  ctx->running = 0;
+  return 1;
+}
+
+
+/* The write function of the log stream.  Because the stream is line
+ * buffered this is called for each line.  */
+static gpgrt_ssize_t
+asynclog_cookie_write (void *cookie, const void *buffer, size_t size)
+{
+  asynclog_t ctx = cookie;
+  size_t off, n;
+
+  if (!buffer && !size)
+    return 0;  /* Flush request.  */
+
+  if (!ctx->running)
+    {
+      write_sink (ctx, buffer, size);
+      return size;
+    }
+
+  if (size > ASYNCLOG_RINGSIZE - (ctx->head - ctx->tail))
+    {
+      /* Don't let the caller wait; drop the line.  */
+      if (!ctx->dropped++)
+        ctx->drop_mark = ctx->head;
+      return size;
+    }
+
+  off = ctx->head % ASYNCLOG_RINGSIZE;
+  n = ASYNCLOG_RINGSIZE - off;
+  if (n > size)
+    n = size;
+  memcpy (ctx->ring + off, buffer, n);
+  memcpy (ctx->ring, (const unsigned char *)buffer + n, size - n);
+  ctx->head += size;
+
+  if (ctx->waiting)
+    {
+      npth_mutex_lock (&ctx->lock);
+      npth_cond_signal (&ctx->cond);
+      npth_mutex_unlock (&ctx->lock);
+    }
+
+  return size;
+}
+
+
+/* Release CTX.  */
+static void
+release_asynclog (asynclog_t ctx)
+{
+  if (!ctx)
+    return;
+  if (ctx->fd != -1)
+    close (ctx->fd);
+  npth_cond_destroy (&ctx->done_cond);
+  npth_cond_destroy (&ctx->cond);
+  npth_mutex_destroy (&ctx->lock);
+  xfree (ctx->ring);
+  xfree (ctx->sockname);
+  xfree (ctx);
+}
+
+
+/* The close function of the log stream.  This is called by
+ * libgpg-error when the log stream is replaced.  */
+static int
+asynclog_cookie_close (void *cookie)
+{
+  asynclog_t ctx = cookie;
+
+  if (the_asynclog == ctx)
+    the_asynclog = NULL;
+  /* If the writer is stuck we leak CTX because it is still used.  */
+  if (stop_writer (ctx))
+    release_asynclog (ctx);
+  return 0;
+}
+
+
+/* Write out the pending lines at process termination.  */
+static void
+asynclog_atexit (void)
+{
+  if (the_asynclog)
+    stop_writer (the_asynclog);
+}
+
+
+
+/* Log to NAME like log_set_file does but write the lines from a
+ * separate thread.  nPth must have been initialized and, because the
+ * thread does not survive a fork, this should be called by the
+ * daemon process itself.  For names which can't be handled here,
+ * like "tcp://" sockets, and on errors log_set_file is used.  */
+void
+async_log_set_file (const char *name)
+{
+#ifdef HAVE_W32_SYSTEM
+  log_set_file (name);
+#else
+  static int atexit_registered;
+  asynclog_t ctx;
+  estream_t stream;
+  npth_attr_t tattr;
+  int ret;
+
+  if (!name || !strcmp (name, "-") || !strncmp (name, "tcp://", 6)
+      || !strcmp (name, "socket://"))
+    {
+      log_set_file (name);
+      return;
+    }
+
+  ctx = xtrycalloc (1, sizeof *ctx);
+  if (!ctx)
+    goto fallback;
+  ctx->fd = -1;
+  npth_mutex_init (&ctx->lock, NULL);
+  npth_cond_init (&ctx->cond, NULL);
+  npth_cond_init (&ctx->done_cond, NULL);
+  ctx->ring = xtrymalloc (ASYNCLOG_RINGSIZE);
+  if (!ctx->ring)
+    goto fallback;
+
+  if (!strncmp (name, "socket://", 9))
+    {
+      ctx->sockname = xtrystrdup (name + 9);
+      if (!ctx->sockname)
+        goto fallback;
+      connect_socket (ctx);
+    }
+  else
+    {
+      /* The log may contain private information; thus we do not
+       * allow others to read a new log file.  */
+      ctx->fd = open (name, O_WRONLY | O_APPEND | O_CREAT,
+                      S_IRUSR | S_IWUSR);
+      if (ctx->fd == -1)
+        goto fallback;
+    }
+
+  stream = es_fopencookie (ctx, "w", asynclog_cookie_functions);
+  if (!stream)
+    goto fallback;
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  ret = npth_create (&ctx->thread, &tattr, writer_thread, ctx);
+  npth_attr_destroy (&tattr);
+  if (ret)
+    {
+      es_fclose (stream);  /* This releases CTX.  */
+      log_set_file (name);
+      return;
+    }
+  npth_setname_np (ctx->thread, "log-writer");
+  ctx->running = 1;
+
+  /* This closes the old log stream and thus also stops an old
+   * writer.  */
+  gpgrt_log_set_sink (NULL, stream, -1);
+  the_asynclog = ctx;
+
+  if (!atexit_registered)
+    {
+      atexit (asynclog_atexit);
+      atexit_registered = 1;
+    }
+  return;
+
+ fallback:
+  release_asynclog (ctx);
+  log_set_file (name);
+#endif /*!HAVE_W32_SYSTEM*/
+}
+
+
+/* Return true if the log is currently written by a separate
+ * thread.  */
+int
+async_log_is_active (void)
+{
+  return !!the_asynclog;
+}
@@ -0,0 +1,27 @@
+/* asynclog.h - Definitions for the asynchronous log writer
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#ifndef GNUPG_COMMON_ASYNCLOG_H
+#define GNUPG_COMMON_ASYNCLOG_H
+
+void async_log_set_file (const char *name);
+int async_log_is_active (void);
+
+#endif /*GNUPG_COMMON_ASYNCLOG_H*/
@@ -59,6 +59,37 @@ enum decoder_states
 
 
 
+/* Decode the complete groups of 4 base64 characters from the LENGTH
+   bytes at BUFFER and store the result at RESULT, which may be the
+   same as BUFFER.  Decoding stops at the first character which is
+   not a base64 character; this includes white space and the pad
+   character.  Returns the number of characters consumed, which is a
+   multiple of 4; 3 bytes are stored for each group.  */
+size_t
+b64dec_groups (void *result, const void *buffer, size_t length)
+{
+  const unsigned char *s = buffer;
+  unsigned char *d = result;
+  unsigned int c0, c1, c2, c3;
+
+  for (; length >= 4; length -= 4, s += 4, d += 3)
+    {
+      if (((s[0] | s[1] | s[2] | s[3]) & 0x80)
+          || (c0 = asctobin[s[0]]) == 255
+          || (c1 = asctobin[s[1]]) == 255
+          || (c2 = asctobin[s[2]]) == 255
+          || (c3 = asctobin[s[3]]) == 255)
+        break;
+      c0 = (c0 << 18) | (c1 << 12) | (c2 << 6) | c3;
+      d[0] = c0 >> 16;
+      d[1] = c0 >> 8;
+      d[2] = c0;
+    }
+
+  return s - (const unsigned char *)buffer;
+}
+
+
 /* Initialize the context for the base64 decoder.  If TITLE is NULL a
    plain base64 decoding is done.  If it is the empty string the
    decoder will skip everything until a "-----BEGIN " line has been
@@ -106,6 +137,20 @@ b64dec_proc (struct b64state *state, void *buffer, size_t length,
 
   for (s=d=buffer; length && !state->stop_seen; length--, s++)
     {
+      if (ds == s_b64_0 && length > 4)
+        {
+          /* Fast path for runs of complete groups.  We keep at least
+             one character for the regular processing below so that
+             the loop control stays the same.  */
+          size_t n = b64dec_groups (d, s, length - 1);
+
+          if (n)
+            {
+              d += n / 4 * 3;
+              s += n;
+              length -= n;
+            }
+        }
     again:
       switch (ds)
         {
@@ -138,6 +138,78 @@ static const u32 crc_table[256] = {
   0x56d11cce, 0x56575035, 0x575bc9c3, 0x57dd8538
 };
 
+/* The tables for the slice-by-8 computation of the CRC.  They are
+   derived from crc_table on first use and hold the values shifted
+   left by 8 bits so that the CRC can be kept in the high 24 bits of
+   a 32 bit word.  */
+static u32 crc_slice[8][256];
+static int crc_slice_initialized;
+
+
+static void
+init_crc_slice (void)
+{
+  int i, k;
+
+  for (i=0; i < 256; i++)
+    crc_slice[0][i] = crc_table[i] << 8;
+  for (k=1; k < 8; k++)
+    for (i=0; i < 256; i++)
+      crc_slice[k][i] = ((crc_slice[k-1][i] << 8)
+                         ^ crc_slice[0][crc_slice[k-1][i] >> 24]);
+  crc_slice_initialized = 1;
+}
+
+
+/* Update the OpenPGP CRC24 value CRC with the LENGTH bytes at BUFFER
+   and return the new value.  The initial value for a new checksum is
+   0xB704CE.  This processes 8 bytes at a time and is thus much faster
+   than the usual byte wise table lookup.  */
+u32
+b64_crc24_update (u32 crc, const void *buffer, size_t length)
+{
+  const unsigned char *p = buffer;
+  u32 c, w;
+
+  if (!crc_slice_initialized)
+    init_crc_slice ();
+
+  c = crc << 8;
+  for (; length >= 8; p += 8, length -= 8)
+    {
+      w = c ^ (((u32)p[0] << 24) | ((u32)p[1] << 16)
+               | ((u32)p[2] << 8) | p[3]);
+      c = (crc_slice[7][w >> 24] ^ crc_slice[6][(w >> 16) & 0xff]
+           ^ crc_slice[5][(w >> 8) & 0xff] ^ crc_slice[4][w & 0xff]
+           ^ crc_slice[3][p[4]] ^ crc_slice[2][p[5]]
+           ^ crc_slice[1][p[6]] ^ crc_slice[0][p[7]]);
+    }
+  for (; length; p++, length--)
+    c = (c << 8) ^ crc_slice[0][(c >> 24) ^ *p];
+
+  return c >> 8;
+}
+
+
+/* Encode the NGROUPS groups of 3 bytes at BUFFER and store the
+   resulting 4*NGROUPS base64 characters at RESULT.  No padding and no
+   line breaks are written.  */
+void
+b64enc_groups (char *result, const void *buffer, size_t ngroups)
+{
+  const unsigned char *p = buffer;
+  u32 v;
+
+  for (; ngroups; ngroups--, p += 3)
+    {
+      v = ((u32)p[0] << 16) | ((u32)p[1] << 8) | p[2];
+      *result++ = bintoasc[v >> 18];
+      *result++ = bintoasc[(v >> 12) & 077];
+      *result++ = bintoasc[(v >> 6) & 077];
+      *result++ = bintoasc[v & 077];
+    }
+}
+
 
 static gpg_error_t
 enc_start (struct b64state *state, FILE *fp, estream_t stream,
@@ -240,49 +312,52 @@ b64enc_write (struct b64state *state, const void *buffer, size_t nbytes)
   memcpy (radbuf, state->radbuf, idx);
 
   if ( (state->flags & B64ENC_USE_PGPCRC) )
+    state->crc = b64_crc24_update (state->crc, buffer, nbytes);
+
+  for (p=buffer; nbytes; )
     {
-      size_t n;
-      u32 crc = state->crc;
+      char tmp[64];
+      size_t ngroups;
 
-      for (p=buffer, n=nbytes; n; p++, n-- )
-        crc = ((u32)crc << 8) ^ crc_table[((crc >> 16)&0xff) ^ *p];
-      state->crc = (crc & 0x00ffffff);
-    }
+      if (idx || nbytes < 3)
+        {
+          /* Collect a group from several calls.  */
+          radbuf[idx++] = *p++;
+          nbytes--;
+          if (idx < 3)
+            continue;
+          b64enc_groups (tmp, radbuf, 1);
+          idx = 0;
+          ngroups = 1;
+        }
+      else
+        {
+          /* Encode the rest of the line in one go.  */
+          ngroups = nbytes / 3;
+          if (ngroups > (64/4) - quad_count)
+            ngroups = (64/4) - quad_count;
+          b64enc_groups (tmp, p, ngroups);
+          p += 3 * ngroups;
+          nbytes -= 3 * ngroups;
+        }
 
-  for (p=buffer; nbytes; p++, nbytes--)
-    {
-      radbuf[idx++] = *p;
-      if (idx > 2)
+      if (state->stream)
+        {
+          if (es_write (state->stream, tmp, 4 * ngroups, NULL))
+            goto write_error;
+        }
+      else
+        {
+          if (fwrite (tmp, 4 * ngroups, 1, state->fp) != 1)
+            goto write_error;
+        }
+      quad_count += ngroups;
+      if (quad_count >= (64/4))
         {
-          char tmp[4];
-
-          tmp[0] = bintoasc[(*radbuf >> 2) & 077];
-          tmp[1] = bintoasc[(((*radbuf<<4)&060)|((radbuf[1] >> 4)&017))&077];
-          tmp[2] = bintoasc[(((radbuf[1]<<2)&074)|((radbuf[2]>>6)&03))&077];
-          tmp[3] = bintoasc[radbuf[2]&077];
-          if (state->stream)
-            {
-              for (idx=0; idx < 4; idx++)
-                es_putc (tmp[idx], state->stream);
-              idx = 0;
-              if (es_ferror (state->stream))
-                goto write_error;
-            }
-          else
-            {
-              for (idx=0; idx < 4; idx++)
-                putc (tmp[idx], state->fp);
-              idx = 0;
-              if (ferror (state->fp))
-                goto write_error;
-            }
-          if (++quad_count >= (64/4))
-            {
-              quad_count = 0;
-              if (!(state->flags & B64ENC_NO_LINEFEEDS)
-                  && my_fputs ("\n", state) == EOF)
-                goto write_error;
-            }
+          quad_count = 0;
+          if (!(state->flags & B64ENC_NO_LINEFEEDS)
+              && my_fputs ("\n", state) == EOF)
+            goto write_error;
         }
     }
   memcpy (state->radbuf, radbuf, idx);
@@ -0,0 +1,216 @@
+/* bench-iobuf.c - Benchmark for iobuf.c
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "iobuf.h"
+#include "bench.h"
+
+#define BENCH_FILE "bench-iobuf.tmp"
+
+/* The buffer used to read from an iobuf.  */
+static byte readbuf[8192];
+
+
+/* A filter which passes the data unchanged in both directions.  */
+static int
+copy_filter (void *opaque, int control,
+             iobuf_t chain, byte *buf, size_t *len)
+{
+  int n;
+
+  (void)opaque;
+
+  if (control == IOBUFCTRL_DESC)
+    mem2str ((char *)buf, "copy_filter", *len);
+  else if (control == IOBUFCTRL_UNDERFLOW)
+    {
+      n = iobuf_read (chain, buf, *len);
+      if (n == -1)
+        {
+          *len = 0;
+          return -1;
+        }
+      *len = n;
+    }
+  else if (control == IOBUFCTRL_FLUSH)
+    return iobuf_write (chain, buf, *len);
+
+  return 0;
+}
+
+
+/* Read all data from A and return the number of bytes read.  */
+static size_t
+read_all (iobuf_t a)
+{
+  size_t total = 0;
+  int n;
+
+  while ((n = iobuf_read (a, readbuf, sizeof readbuf)) != -1)
+    total += n;
+  return total;
+}
+
+
+/* Read DATA of LENGTH from a memory iobuf through NFILTERS copy
+ * filters.  */
+static void
+bench_filter_read (const byte *data, size_t length, int nfilters)
+{
+  unsigned long long t0, usec;
+  unsigned int run, nruns = bench_repeat ();
+  char name[32];
+  iobuf_t a;
+  int i;
+
+  for (run=0, usec=~0ULL; run < nruns; run++)
+    {
+      t0 = bench_now ();
+      a = iobuf_temp_with_content ((const char *)data, length);
+      for (i=0; i < nfilters; i++)
+        iobuf_push_filter (a, copy_filter, NULL);
+      if (read_all (a) != length)
+        {
+          fprintf (stderr, "bench-iobuf: short read\n");
+          exit (1);
+        }
+      iobuf_close (a);
+      usec = bench_elapsed (t0, usec);
+    }
+
+  snprintf (name, sizeof name, "read-filters-%d", nfilters);
+  bench_report ("iobuf", name, 1, length, usec);
+}
+
+
+/* Write DATA of LENGTH in chunks of CHUNK bytes through NFILTERS
+ * copy filters to a temporary iobuf.  */
+static void
+bench_filter_write (const byte *data, size_t length, size_t chunk,
+                    int nfilters)
+{
+  unsigned long long t0, usec;
+  unsigned int run, nruns = bench_repeat ();
+  char name[40];
+  size_t off, n;
+  iobuf_t a;
+  int i;
+
+  for (run=0, usec=~0ULL; run < nruns; run++)
+    {
+      t0 = bench_now ();
+      a = iobuf_temp ();
+      for (i=0; i < nfilters; i++)
+        iobuf_push_filter (a, copy_filter, NULL);
+      for (off=0; off < length; off += n)
+        {
+          n = length - off < chunk? length - off : chunk;
+          if (iobuf_write (a, data + off, n))
+            {
+              fprintf (stderr, "bench-iobuf: write failed\n");
+              exit (1);
+            }
+        }
+      if (iobuf_close (a))
+        {
+          fprintf (stderr, "bench-iobuf: close failed\n");
+          exit (1);
+        }
+      usec = bench_elapsed (t0, usec);
+    }
+
+  snprintf (name, sizeof name, "write-filters-%d-chunk-%u",
+            nfilters, (unsigned int)chunk);
+  bench_report ("iobuf", name, length / chunk, length, usec);
+}
+
+
+/* Write DATA of LENGTH to a file and read it back.  */
+static void
+bench_file (const byte *data, size_t length)
+{
+  unsigned long long t0, usec_w, usec_r;
+  unsigned int run, nruns = bench_repeat ();
+  iobuf_t a;
+
+  for (run=0, usec_w=usec_r=~0ULL; run < nruns; run++)
+    {
+      t0 = bench_now ();
+      a = iobuf_create (BENCH_FILE, 0);
+      if (!a || iobuf_write (a, data, length) || iobuf_close (a))
+        {
+          fprintf (stderr, "bench-iobuf: error writing '%s'\n", BENCH_FILE);
+          exit (1);
+        }
+      usec_w = bench_elapsed (t0, usec_w);
+      /* Do not reuse the write-only fd of the close cache.  */
+      iobuf_ioctl (NULL, IOBUF_IOCTL_INVALIDATE_CACHE, 0, (char*)BENCH_FILE);
+
+      t0 = bench_now ();
+      a = iobuf_open (BENCH_FILE);
+      if (!a || read_all (a) != length)
+        {
+          fprintf (stderr, "bench-iobuf: error reading '%s'\n", BENCH_FILE);
+          exit (1);
+        }
+      iobuf_close (a);
+      usec_r = bench_elapsed (t0, usec_r);
+    }
+  remove (BENCH_FILE);
+
+  bench_report ("iobuf", "file-write", 1, length, usec_w);
+  bench_report ("iobuf", "file-read", 1, length, usec_r);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  size_t length = 16 * 1024 * 1024 * (size_t)bench_scale ();
+  byte *data;
+
+  (void)argc;
+  (void)argv;
+
+  data = malloc (length);
+  if (!data)
+    {
+      fprintf (stderr, "bench-iobuf: out of core\n");
+      return 1;
+    }
+  bench_randomize (data, length);
+
+  bench_filter_read (data, length, 0);
+  bench_filter_read (data, length, 1);
+  bench_filter_read (data, length, 4);
+  bench_filter_write (data, length, 1, 0);
+  bench_filter_write (data, length, 8192, 0);
+  bench_filter_write (data, length, 8192, 4);
+  bench_file (data, length);
+
+  free (data);
+  return 0;
+}
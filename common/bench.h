@@ -0,0 +1,138 @@
+/* bench.h - Helper for the micro benchmarks
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* This header is included by the bench-*.c programs which are built
+ * and run by "make bench".  Each result is printed to stdout as a
+ * single line with a JSON object:
+ *
+ *   {"bench":"iobuf","case":"filters-4","count":16,"bytes":16777216,
+ *    "usec":12345}
+ *
+ * COUNT is the number of operations of one run, BYTES the number of
+ * bytes processed by one run, and USEC the fastest of BENCH_REPEAT
+ * runs in microseconds.  All input data is created by a PRNG with a
+ * fixed seed so that the results of different builds are comparable.
+ *
+ * The environment variable BENCH_REPEAT sets the number of runs
+ * (default 3) and BENCH_SCALE a factor for the sizes (default 1).  */
+
+#ifndef GNUPG_COMMON_BENCH_H
+#define GNUPG_COMMON_BENCH_H 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+
+/* Return the current time in microseconds.  */
+static unsigned long long
+bench_now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/* Return the value of the envvar NAME as a positive number or DEF.  */
+static unsigned int
+bench_getenv_uint (const char *name, unsigned int def)
+{
+  const char *s = getenv (name);
+  int n;
+
+  if (!s || (n = atoi (s)) < 1)
+    return def;
+  return n;
+}
+
+
+/* Return the number of runs of each case.  */
+static unsigned int
+bench_repeat (void)
+{
+  return bench_getenv_uint ("BENCH_REPEAT", 3);
+}
+
+
+/* Return the scale factor for the sizes.  */
+static unsigned int
+bench_scale (void)
+{
+  return bench_getenv_uint ("BENCH_SCALE", 1);
+}
+
+
+/* The state of the PRNG.  */
+static unsigned int bench_prng_state = 0x2545f491;
+
+/* Fill BUFFER of LENGTH with pseudo random bytes.  This is a simple
+ * xorshift generator which is good enough to create test data.  */
+static void
+bench_randomize (void *buffer, size_t length)
+{
+  unsigned char *p = buffer;
+  unsigned int x = bench_prng_state;
+
+  while (length--)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      *p++ = x;
+    }
+  bench_prng_state = x;
+}
+
+
+/* Print the result of the case NAME of benchmark BENCH.  */
+static void
+bench_report (const char *bench, const char *name,
+              unsigned long long count, unsigned long long bytes,
+              unsigned long long usec)
+{
+  printf ("{\"bench\":\"%s\",\"case\":\"%s\",\"count\":%llu,"
+          "\"bytes\":%llu,\"usec\":%llu}\n",
+          bench, name, count, bytes, usec);
+  fflush (stdout);
+}
+
+
+/* Return the smaller one of BEST and the time elapsed since T0.  This
+ * is used to keep the fastest of several runs:
+ *
+ *   for (run=0, usec=~0ULL; run < nruns; run++)
+ *     {
+ *       t0 = bench_now ();
+ *       do_something ();
+ *       usec = bench_elapsed (t0, usec);
+ *     }
+ */
+static unsigned long long
+bench_elapsed (unsigned long long t0, unsigned long long best)
+{
+  unsigned long long t = bench_now () - t0;
+
+  return t < best? t : best;
+}
+
+
+#endif /*GNUPG_COMMON_BENCH_H*/
@@ -0,0 +1,286 @@
+/* check-pattern.c - Match passphrases against a pattern list
+ * Copyright (C) 2007 Free Software Foundation, Inc.
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: (LGPL-3.0+ OR GPL-2.0+)
+ */
+
+/* This module implements the matching of strings against a pattern
+ * file as used by gpg-check-pattern and gpg-agent's option
+ * --check-passphrase-pattern.  Each line of the file is either a
+ * string which is compared case-insensitive to the entire input or,
+ * if it starts with a slash, an extended regular expression.  Empty
+ * lines and lines starting with a '#' are ignored.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifndef DISABLE_REGEX
+# include <regex.h>
+#endif
+
+#include "util.h"
+#include "check-pattern.h"
+
+#ifndef DISABLE_REGEX
+
+enum {
+  PAT_NULL,    /* Indicates end of the array.  */
+  PAT_STRING,  /* The pattern is a simple string.  */
+  PAT_REGEX    /* The pattern is an extended regualr expression. */
+};
+
+
+/* An object to describe an item of our pattern table. */
+struct pattern_s
+{
+  int type;
+  unsigned int lineno;     /* Line number of the pattern file.  */
+  union {
+    struct {
+      const char *string;  /* Pointer to the actual string (nul termnated).  */
+      size_t length;       /* The length of this string (strlen).  */
+    } s; /*PAT_STRING*/
+    struct {
+      /* We allocate the regex_t because this type is larger than what
+         we need for PAT_STRING and we expect only a few regex in a
+         patternfile.  It would be a waste of core to have so many
+         unused stuff in the table.  */
+      regex_t *regex;
+    } r; /*PAT_REGEX*/
+  } u;
+};
+typedef struct pattern_s pattern_t;
+
+
+/* The object returned by check_pattern_compile.  */
+struct pattern_list_s
+{
+  char *data;        /* Our copy of the pattern file.  */
+  pattern_t array[1];  /* The pattern; terminated by a PAT_NULL item.  */
+};
+
+
+
+static char *
+get_regerror (int errcode, regex_t *compiled)
+{
+  size_t length = regerror (errcode, compiled, NULL, 0);
+  char *buffer = xtrymalloc (length);
+  if (buffer)
+    regerror (errcode, compiled, buffer, length);
+  return buffer;
+}
+
+
+/* Release the pattern list LIST.  NULL is allowed.  */
+void
+check_pattern_release (pattern_list_t list)
+{
+  pattern_t *pat;
+
+  if (!list)
+    return;
+
+  for (pat = list->array; pat->type != PAT_NULL; pat++)
+    if (pat->type == PAT_REGEX && pat->u.r.regex)
+      {
+        regfree (pat->u.r.regex);
+        xfree (pat->u.r.regex);
+      }
+  xfree (list->data);
+  xfree (list);
+}
+
+
+/* Parse the pattern file given in the memory area DATA/DATALEN and
+ * store a new pattern list at R_LIST.  The data is copied and thus
+ * the caller may release it after the call.  All invalid regular
+ * expressions are logged; if there was any, an error is returned and
+ * NULL is stored at R_LIST.  */
+gpg_error_t
+check_pattern_compile (const char *data, size_t datalen,
+                       pattern_list_t *r_list)
+{
+  gpg_error_t err = 0;
+  char *buf, *line, *p, *p2;
+  size_t n;
+  pattern_list_t list;
+  pattern_t *array;
+  size_t arraysize, arrayidx;
+  unsigned int lineno = 0;
+
+  *r_list = NULL;
+
+  buf = xtrymalloc (datalen + 1);
+  if (!buf)
+    return gpg_error_from_syserror ();
+  memcpy (buf, data, datalen);
+  buf[datalen] = 0;
+
+  /* Estimate the number of entries by counting the non-comment lines.  */
+  arraysize = 0;
+  p = buf;
+  for (n = datalen; n && (p2 = memchr (p, '\n', n)); p2++, n -= p2 - p, p = p2)
+    if (*p != '#')
+      arraysize++;
+  arraysize += 2; /* For the terminating NULL and a last line w/o a LF.  */
+
+  list = xtrycalloc (1, sizeof *list + (arraysize - 1) * sizeof *array);
+  if (!list)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (buf);
+      return err;
+    }
+  list->data = buf;
+  array = list->array;
+  arrayidx = 0;
+
+  /* Loop over all lines.  */
+  line = buf;
+  while (datalen && line)
+    {
+      lineno++;
+      p = line;
+      p2 = line = memchr (p, '\n', datalen);
+      if (p2)
+        {
+          *line++ = 0;
+          datalen -= line - p;
+        }
+      else
+        p2 = p + datalen;
+      log_assert (!*p2);
+      p2--;
+      while (isascii (*p) && isspace (*p))
+        p++;
+      if (*p == '#')
+        continue;
+      while (p2 > p && isascii (*p2) && isspace (*p2))
+        *p2-- = 0;
+      if (!*p)
+        continue;
+      log_assert (arrayidx < arraysize);
+      array[arrayidx].lineno = lineno;
+      if (*p == '/')
+        {
+          int rerr;
+
+          p++;
+          array[arrayidx].type = PAT_REGEX;
+          if (*p && p[strlen(p)-1] == '/')
+            p[strlen(p)-1] = 0;  /* Remove optional delimiter.  */
+          array[arrayidx].u.r.regex = xtrycalloc (1, sizeof (regex_t));
+          if (!array[arrayidx].u.r.regex)
+            {
+              err = gpg_error_from_syserror ();
+              break;
+            }
+          rerr = regcomp (array[arrayidx].u.r.regex, p,
+                          REG_ICASE|REG_NOSUB|REG_EXTENDED);
+          if (rerr)
+            {
+              char *rerrbuf = get_regerror (rerr, array[arrayidx].u.r.regex);
+              log_error ("invalid r.e. at line %u: %s\n",
+                         lineno, rerrbuf? rerrbuf : "?");
+              xfree (rerrbuf);
+              xfree (array[arrayidx].u.r.regex);
+              array[arrayidx].u.r.regex = NULL;
+              err = gpg_error (GPG_ERR_INV_DATA);
+              /* Continue to report all errors.  */
+            }
+        }
+      else
+        {
+          array[arrayidx].type = PAT_STRING;
+          array[arrayidx].u.s.string = p;
+          array[arrayidx].u.s.length = strlen (p);
+        }
+      arrayidx++;
+    }
+  log_assert (arrayidx < arraysize);
+  array[arrayidx].type = PAT_NULL;
+
+  if (err)
+    check_pattern_release (list);
+  else
+    *r_list = list;
+  return err;
+}
+
+
+/* Check whether STRING matches any of the pattern in LIST.  Returns
+ * true on a match and stores the line number of the matching pattern
+ * at R_LINENO if that is not NULL.  An empty STRING never matches.
+ * An error while matching is considered a match.  */
+int
+check_pattern_match (pattern_list_t list, const char *string,
+                     unsigned int *r_lineno)
+{
+  pattern_t *pat;
+
+  if (!*string)
+    return 0;
+
+  for (pat = list->array; pat->type != PAT_NULL; pat++)
+    {
+      if (pat->type == PAT_STRING)
+        {
+          if (!strcasecmp (pat->u.s.string, string))
+            break;
+        }
+      else if (pat->type == PAT_REGEX)
+        {
+          int rerr;
+
+          rerr = regexec (pat->u.r.regex, string, 0, NULL, 0);
+          if (!rerr)
+            break;
+          else if (rerr != REG_NOMATCH)
+            {
+              char *rerrbuf = get_regerror (rerr, pat->u.r.regex);
+              log_error ("matching r.e. failed: %s\n",
+                         rerrbuf? rerrbuf : "?");
+              xfree (rerrbuf);
+              break;  /* Better indicate a match on error.  */
+            }
+        }
+      else
+        BUG ();
+    }
+  if (pat->type == PAT_NULL)
+    return 0;
+
+  if (r_lineno)
+    *r_lineno = pat->lineno;
+  return 1;
+}
+
+#endif /*!DISABLE_REGEX*/
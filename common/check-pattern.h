@@ -0,0 +1,56 @@
+/* check-pattern.h - Match passphrases against a pattern list
+ * Copyright (C) 2007 Free Software Foundation, Inc.
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: (LGPL-3.0+ OR GPL-2.0+)
+ */
+
+#ifndef GNUPG_COMMON_CHECK_PATTERN_H
+#define GNUPG_COMMON_CHECK_PATTERN_H
+
+#include <gpg-error.h>
+
+/* An opaque object holding a compiled pattern file.  */
+struct pattern_list_s;
+typedef struct pattern_list_s *pattern_list_t;
+
+
+/*-- check-pattern.c --*/
+
+/* Compile the pattern file given by DATA of DATALEN.  */
+gpg_error_t check_pattern_compile (const char *data, size_t datalen,
+                                   pattern_list_t *r_list);
+
+/* Release a pattern list.  */
+void check_pattern_release (pattern_list_t list);
+
+/* Return true if STRING matches any of the pattern in LIST.  */
+int check_pattern_match (pattern_list_t list, const char *string,
+                         unsigned int *r_lineno);
+
+
+#endif /*GNUPG_COMMON_CHECK_PATTERN_H*/
@@ -29,13 +29,62 @@
 
 #include <config.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <ctype.h>
 
 #include "util.h"
 
 
-#define tohex(n) ((n) < 10 ? ((n) + '0') : (((n) - 10) + 'A'))
+/* The two hex digits for each byte value.  Looking up both digits at
+ * once is faster than converting each nibble.  */
+#define HEXPAIR_ROW(h) h"0" h"1" h"2" h"3" h"4" h"5" h"6" h"7" \
+                       h"8" h"9" h"A" h"B" h"C" h"D" h"E" h"F"
+static const char hexpairs[] =
+  HEXPAIR_ROW("0") HEXPAIR_ROW("1") HEXPAIR_ROW("2") HEXPAIR_ROW("3")
+  HEXPAIR_ROW("4") HEXPAIR_ROW("5") HEXPAIR_ROW("6") HEXPAIR_ROW("7")
+  HEXPAIR_ROW("8") HEXPAIR_ROW("9") HEXPAIR_ROW("A") HEXPAIR_ROW("B")
+  HEXPAIR_ROW("C") HEXPAIR_ROW("D") HEXPAIR_ROW("E") HEXPAIR_ROW("F");
+#undef HEXPAIR_ROW
+
+/* The value of each hex digit or -1 for other characters.  */
+static const signed char hexvalues[256] =
+  {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+  };
+
+
+/* Return the value of the two hex digits at S or -1 if S does not
+ * start with two hex digits.  S[1] is only accessed if S[0] is a hex
+ * digit.  */
+static GPGRT_INLINE int
+hexpair (const char *s)
+{
+  int hi, lo;
+
+  hi = hexvalues[*(const unsigned char *)s];
+  if (hi < 0)
+    return -1;
+  lo = hexvalues[((const unsigned char *)s)[1]];
+  if (lo < 0)
+    return -1;
+  return (hi << 4) | lo;
+}
 
 
 /* Convert STRING consisting of hex characters into its binary
@@ -47,14 +96,15 @@
 int
 hex2bin (const char *string, void *buffer, size_t length)
 {
-  int i;
+  size_t i;
+  int c;
   const char *s = string;
 
   for (i=0; i < length; )
     {
-      if (!hexdigitp (s) || !hexdigitp (s+1))
+      if ((c = hexpair (s)) < 0)
         return -1;           /* Invalid hex digits. */
-      ((unsigned char*)buffer)[i++] = xtoi_2 (s);
+      ((unsigned char*)buffer)[i++] = c;
       s += 2;
     }
   if (*s && (!isascii (*s) || !isspace (*s)) )
@@ -78,7 +128,8 @@ hex2bin (const char *string, void *buffer, size_t length)
 int
 hexcolon2bin (const char *string, void *buffer, size_t length)
 {
-  int i;
+  size_t i;
+  int c;
   const char *s = string;
   int need_colon = 0;
 
@@ -93,9 +144,9 @@ hexcolon2bin (const char *string, void *buffer, size_t length)
         s++;
       else if (need_colon)
         return -1;           /* Colon expected. */
-      if (!hexdigitp (s) || !hexdigitp (s+1))
+      if ((c = hexpair (s)) < 0)
         return -1;           /* Invalid hex digits. */
-      ((unsigned char*)buffer)[i++] = xtoi_2 (s);
+      ((unsigned char*)buffer)[i++] = c;
       s += 2;
     }
   if (*s == ':')
@@ -133,12 +184,26 @@ do_bin2hex (const void *buffer, size_t length, char *stringbuf, int with_colon)
         return NULL;
     }
 
-  for (s = buffer, p = stringbuf; length; length--, s++)
+  s = buffer;
+  p = stringbuf;
+  if (with_colon && length)
+    {
+      memcpy (p, hexpairs + 2 * *s++, 2);
+      p += 2;
+      for (length--; length; length--, s++)
+        {
+          *p++ = ':';
+          memcpy (p, hexpairs + 2 * *s, 2);
+          p += 2;
+        }
+    }
+  else
     {
-      if (with_colon && s != buffer)
-        *p++ = ':';
-      *p++ = tohex ((*s>>4)&15);
-      *p++ = tohex (*s&15);
+      for (; length; length--, s++)
+        {
+          memcpy (p, hexpairs + 2 * *s, 2);
+          p += 2;
+        }
     }
   *p = 0;
 
@@ -199,13 +264,13 @@ const char *
 hex2str (const char *hexstring, char *buffer, size_t bufsize, size_t *buflen)
 {
   const char *s = hexstring;
-  int idx, count;
+  int idx, count, c;
   int need_nul = 0;
 
   if (buflen)
     *buflen = 0;
 
-  for (s=hexstring, count=0; hexdigitp (s) && hexdigitp (s+1); s += 2, count++)
+  for (s=hexstring, count=0; hexpair (s) >= 0; s += 2, count++)
     ;
   if (*s && (!isascii (*s) || !isspace (*s)) )
     {
@@ -226,8 +291,8 @@ hex2str (const char *hexstring, char *buffer, size_t bufsize, size_t *buflen)
           return NULL; /* Too long.  */
         }
 
-      for (s=hexstring, idx=0; hexdigitp (s) && hexdigitp (s+1); s += 2)
-        ((unsigned char*)buffer)[idx++] = xtoi_2 (s);
+      for (s=hexstring, idx=0; (c = hexpair (s)) >= 0; s += 2)
+        ((unsigned char*)buffer)[idx++] = c;
       if (need_nul)
         buffer[idx] = 0;
     }
@@ -69,8 +69,23 @@
 #if __linux__
 # include <sys/types.h>
 # include <dirent.h>
+# include <sys/syscall.h>
 #endif /*__linux__ */
 
+#if defined(HAVE_SPAWN_H) && defined(HAVE_POSIX_SPAWN) \
+    && defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP)
+# include <spawn.h>
+# define USE_POSIX_SPAWN 1
+#endif
+
+/* Without a libc wrapper we can still use the close_range system
+ * call on Linux 5.9 and later.  */
+#if !defined(HAVE_CLOSE_RANGE) && defined(__linux__) \
+    && defined(SYS_close_range)
+# define close_range(a,b,c) syscall (SYS_close_range, (a), (b), (c))
+# define HAVE_CLOSE_RANGE 1
+#endif
+
 #include "util.h"
 #include "i18n.h"
 #include "sysutils.h"
@@ -190,9 +205,36 @@ get_max_fds (void)
 void
 close_all_fds (int first, int *except)
 {
-  int max_fd = get_max_fds ();
+  int max_fd;
   int fd, i, except_start;
 
+#ifdef HAVE_CLOSE_RANGE
+  /* Let the kernel close the ranges between the exceptions.  This
+   * fails only if the system call is not supported, in which case we
+   * fall back to the loop; the ranges closed so far do not harm.  */
+  {
+    int next = first;
+    int okay = 1;
+
+    for (i=0; okay && except && except[i] != -1; i++)
+      {
+        if (except[i] < next)
+          continue;
+        if (except[i] > next
+            && close_range (next, except[i] - 1, 0))
+          okay = 0;
+        next = except[i] + 1;
+      }
+    if (okay && !close_range (next, ~0U, 0))
+      {
+        gpg_err_set_errno (0);
+        return;
+      }
+  }
+#endif /*HAVE_CLOSE_RANGE*/
+
+  max_fd = get_max_fds ();
+
   if (except)
     {
       except_start = 0;
@@ -333,6 +375,68 @@ do_exec (const char *pgmname, const char *argv[],
 }
 
 
+#ifdef USE_POSIX_SPAWN
+/* Start PGMNAME with posix_spawn while connecting FD_IN, FD_OUT, and
+ * FD_ERR to the standard descriptors (-1 connects them to /dev/null)
+ * and closing all other descriptors.  This is the same as forking and
+ * calling do_exec but avoids copying the page tables of a large
+ * process.  */
+static gpg_error_t
+do_posix_spawn (const char *pgmname, const char *argv[],
+                int fd_in, int fd_out, int fd_err, pid_t *pid)
+{
+  extern char **environ;
+  posix_spawn_file_actions_t actions;
+  char **arg_list;
+  int i, j, rc;
+  int fds[3];
+
+  fds[0] = fd_in;
+  fds[1] = fd_out;
+  fds[2] = fd_err;
+
+  i = 0;
+  if (argv)
+    while (argv[i])
+      i++;
+  arg_list = xtrycalloc (i+2, sizeof *arg_list);
+  if (!arg_list)
+    return my_error_from_syserror ();
+  arg_list[0] = strrchr (pgmname, '/');
+  if (arg_list[0])
+    arg_list[0]++;
+  else
+    arg_list[0] = (char*)pgmname;
+  if (argv)
+    for (i=0,j=1; argv[i]; i++, j++)
+      arg_list[j] = (char*)argv[i];
+
+  rc = posix_spawn_file_actions_init (&actions);
+  for (i=0; !rc && i <= 2; i++)
+    {
+      if (fds[i] == -1)
+        rc = posix_spawn_file_actions_addopen (&actions, i, "/dev/null",
+                                               i? O_WRONLY : O_RDONLY, 0);
+      else if (fds[i] != i)
+        rc = posix_spawn_file_actions_adddup2 (&actions, fds[i], i);
+    }
+  if (!rc)
+    rc = posix_spawn_file_actions_addclosefrom_np (&actions, 3);
+  if (!rc)
+    rc = posix_spawn (pid, pgmname, &actions, NULL, arg_list, environ);
+  posix_spawn_file_actions_destroy (&actions);
+  xfree (arg_list);
+
+  if (rc)
+    {
+      *pid = (pid_t)(-1);
+      return my_error (gpg_err_code_from_errno (rc));
+    }
+  return 0;
+}
+#endif /*USE_POSIX_SPAWN*/
+
+
 static gpg_error_t
 do_create_pipe (int filedes[2])
 {
@@ -488,6 +592,17 @@ gnupg_spawn_process (const char *pgmname, const char *argv[],
         }
     }
 
+#ifdef USE_POSIX_SPAWN
+  /* The fast path works only if nothing needs to run in the child.  */
+  if (!except && !preexec)
+    {
+      err = do_posix_spawn (pgmname, argv, inpipe[0], outpipe[1], errpipe[1],
+                            pid);
+      if (err)
+        log_error (_("error running '%s': %s\n"), pgmname, gpg_strerror (err));
+      goto leave;
+    }
+#endif /*USE_POSIX_SPAWN*/
 
   *pid = fork ();
   if (*pid == (pid_t)(-1))
@@ -531,6 +646,10 @@ gnupg_spawn_process (const char *pgmname, const char *argv[],
     }
 
   /* This is the parent. */
+  err = 0;
+#ifdef USE_POSIX_SPAWN
+ leave:
+#endif
   if (inpipe[0] != -1)
     close (inpipe[0]);
   if (outpipe[1] != -1)
@@ -538,6 +657,14 @@ gnupg_spawn_process (const char *pgmname, const char *argv[],
   if (errpipe[1] != -1)
     close (errpipe[1]);
 
+  if (err)
+    {
+      es_fclose (infp);
+      es_fclose (outfp);
+      es_fclose (errfp);
+      return err;
+    }
+
   if (r_infp)
     *r_infp = infp;
   if (r_outfp)
@@ -564,6 +691,13 @@ gnupg_spawn_process_fd (const char *pgmname, const char *argv[],
 {
   gpg_error_t err;
 
+#ifdef USE_POSIX_SPAWN
+  err = do_posix_spawn (pgmname, argv, infd, outfd, errfd, pid);
+  if (err)
+    log_error (_("error running '%s': %s\n"), pgmname, gpg_strerror (err));
+  return err;
+#else /*!USE_POSIX_SPAWN*/
+
   *pid = fork ();
   if (*pid == (pid_t)(-1))
     {
@@ -581,6 +715,7 @@ gnupg_spawn_process_fd (const char *pgmname, const char *argv[],
     }
 
   return 0;
+#endif /*!USE_POSIX_SPAWN*/
 }
 
 
@@ -35,6 +35,7 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <gpg-error.h>
 
 #include <assuan.h>
@@ -192,10 +193,20 @@ read_and_log_stderr (read_and_log_buffer_t *state, es_poll_t *fderr)
 
 
 
+/* The size of the buffers used to copy the data from and to the
+   child.  Large blocks save many rounds through es_poll when large
+   amounts of data are piped through the child, e.g. by gpgtar.  */
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+/* The size requested for the data pipes to the child, where the
+   system allows setting it.  */
+#define PIPE_BUFFER_SIZE (1024 * 1024)
+
+
 /* A buffer to copy from one stream to another.  */
 struct copy_buffer
 {
-  char buffer[4096];
+  char buffer[COPY_BUFFER_SIZE];
   char *writep;
   size_t nread;
 };
@@ -299,6 +310,21 @@ copy_buffer_flush (struct copy_buffer *c, estream_t sink)
 
 
 
+/* Try to enlarge the kernel buffer of the pipe STREAM so that the
+ * child and we need to switch less often.  This is only a hint and
+ * errors are ignored.  */
+static void
+enlarge_pipe (estream_t stream)
+{
+#ifdef F_SETPIPE_SZ
+  if (stream)
+    fcntl (es_fileno (stream), F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+#else
+  (void)stream;
+#endif
+}
+
+
 /* Run the program PGMNAME with the command line arguments given in
  * the NULL terminates array ARGV.  If INPUT is not NULL it will be
  * fed to stdin of the process.  stderr is logged using log_info and
@@ -415,6 +441,9 @@ gnupg_exec_tool_stream (const char *pgmname, const char *argv[],
       goto leave;
     }
 
+  enlarge_pipe (infp);
+  enlarge_pipe (outfp);
+
   fds[0].stream = infp;
   fds[0].want_write = 1;
   if (!input)
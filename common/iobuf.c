@@ -35,6 +35,7 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -50,11 +51,16 @@
 # include <kernel.h>
 # include <swis.h>
 #endif /* __riscos__ */
+#if defined(HAVE_MMAP) && !defined(HAVE_W32_SYSTEM)
+# include <sys/mman.h>
+# define IOBUF_USE_MMAP 1
+#endif
 
 #include <assuan.h>
 
 #include "util.h"
 #include "sysutils.h"
+#include "tracepoint.h"
 #include "iobuf.h"
 
 /*-- Begin configurable part.  --*/
@@ -66,12 +72,40 @@
    the number of filters in a chain.  */
 #define MAX_NESTING_FILTER 64
 
+/* Regular input files of at least this size are read using mmap
+   instead of read(2) if the caller asks for it using
+   IOBUF_IOCTL_MMAP.  The file is mapped in windows of
+   IOBUF_MMAP_WINDOW bytes which must be a multiple of the page
+   size.  */
+#define IOBUF_MMAP_MIN_SIZE  (1024*1024)
+#define IOBUF_MMAP_WINDOW    (8*1024*1024)
+
+/* Regular input files of at least IOBUF_LARGE_FILE_SIZE bytes get a
+   buffer of IOBUF_LARGE_BUFFER_SIZE bytes unless the size has been
+   set explicitly with iobuf_set_buffer_size.  */
+#define IOBUF_LARGE_FILE_SIZE    (16*1024*1024)
+#define IOBUF_LARGE_BUFFER_SIZE  (1024*1024)
+
+/* The maximum number of released buffers of the standard size we
+   keep for reuse.  */
+#define IOBUF_FREELIST_SIZE 8
+
 /*-- End configurable part.  --*/
 
 /* The size of the iobuffers.  This can be chnages using the
  * iobuf_set_buffer_size fucntion.  */
 static unsigned int iobuf_buffer_size = DEFAULT_IOBUF_BUFFER_SIZE;
 
+/* True if iobuf_set_buffer_size has been used.  */
+static int iobuf_buffer_size_set;
+
+/* A list of released buffers of size IOBUF_BUFFER_SIZE.  Temporary
+   iobufs are often created and destroyed in a loop (e.g. for each
+   keyblock during an import) and this saves us the malloc and free
+   calls for them.  */
+static byte *buffer_freelist[IOBUF_FREELIST_SIZE];
+static int buffer_freelist_len;
+
 
 #ifdef HAVE_W32_SYSTEM
 # ifdef HAVE_W32CE_SYSTEM
@@ -96,6 +130,15 @@ typedef struct
   int eof_seen;
   int delayed_rc;
   int print_only_name; /* Flags indicating that fname is not a real file.  */
+#ifdef IOBUF_USE_MMAP
+  int may_mmap;        /* Freshly opened; IOBUF_IOCTL_MMAP may be used.  */
+  int use_mmap;        /* Read using the mapping below.  */
+  byte *map;           /* The currently mapped window or NULL.  */
+  size_t map_len;      /* Length of that window.  */
+  off_t map_off;       /* File offset of that window.  */
+  off_t map_pos;       /* Current read position in the file.  */
+  off_t map_size;      /* Size of the file when the mapping was set up.  */
+#endif
   char fname[1];       /* Name of the file.  */
 } file_filter_ctx_t;
 
@@ -121,6 +164,16 @@ struct close_cache_s
 typedef struct close_cache_s *close_cache_t;
 static close_cache_t close_cache;
 
+/* Statistics of the file filter.  */
+static struct
+{
+  unsigned long reads;          /* Number of underflows.  */
+  unsigned long writes;         /* Number of flushes.  */
+  unsigned long long bytes_read;
+  unsigned long long bytes_written;
+  unsigned long long bytes_skipped;  /* Skipped without reading.  */
+} file_stats;
+
 
 
 #ifdef HAVE_W32_SYSTEM
@@ -142,6 +195,9 @@ typedef struct
 #define OP_MIN_PARTIAL_CHUNK	  512
 #define OP_MIN_PARTIAL_CHUNK_2POW 9
 
+/* The largest partial body length which can be encoded is 2^30.  */
+#define OP_MAX_PARTIAL_CHUNK_2POW 30
+
 /* The context we use for the block filter (used to handle OpenPGP
    length information header).  */
 typedef struct
@@ -404,17 +460,19 @@ fd_cache_close (const char *fname, gnupg_fd_t fp)
  * Do a direct_open on FNAME but first try to reuse one from the fd_cache
  */
 static gnupg_fd_t
-fd_cache_open (const char *fname, const char *mode)
+fd_cache_open (const char *fname, const char *mode, int *r_cached)
 {
   close_cache_t cc;
 
   assert (fname);
+  *r_cached = 0;
   for (cc = close_cache; cc; cc = cc->next)
     {
       if (cc->fp != GNUPG_INVALID_FD && !fd_cache_strcmp (cc->fname, fname))
 	{
 	  gnupg_fd_t fp = cc->fp;
 	  cc->fp = GNUPG_INVALID_FD;
+	  *r_cached = 1;
 	  if (DBG_IOBUF)
 	    log_debug ("fd_cache_open (%s) using cached fp\n", fname);
 #ifdef HAVE_W32_SYSTEM
@@ -439,6 +497,127 @@ fd_cache_open (const char *fname, const char *mode)
   return direct_open (fname, mode, 0);
 }
 
+#ifdef IOBUF_USE_MMAP
+/* Release the mapping of the file filter context A.  */
+static void
+mmap_release (file_filter_ctx_t *a)
+{
+  if (a->map)
+    {
+      munmap (a->map, a->map_len);
+      a->map = NULL;
+      a->map_len = 0;
+    }
+  a->use_mmap = 0;
+}
+
+
+/* Switch the file filter context A to mmap mode if its file is a
+   regular file we can map.  Reading continues at the current file
+   position.  Note that a file which is truncated by another process
+   while we are reading it will raise a SIGBUS; this is thus only done
+   on request of the caller using IOBUF_IOCTL_MMAP.  */
+static void
+mmap_setup (file_filter_ctx_t *a)
+{
+  struct stat st;
+  off_t pos;
+
+  if (fstat (a->fp, &st) || !S_ISREG (st.st_mode)
+      || st.st_size < IOBUF_MMAP_MIN_SIZE)
+    return;
+  pos = lseek (a->fp, 0, SEEK_CUR);
+  if (pos == (off_t)(-1))
+    return;
+
+  a->use_mmap = 1;
+  a->map = NULL;
+  a->map_len = 0;
+  a->map_off = 0;
+  a->map_pos = pos;
+  a->map_size = st.st_size;
+  if (DBG_IOBUF)
+    log_debug ("%s: using mmap for %llu bytes\n",
+               a->fname, (unsigned long long)st.st_size);
+}
+
+
+/* Copy up to SIZE bytes from the mapped file of A to BUF and store
+   the number of copied bytes at R_NBYTES.  If less than SIZE bytes
+   are returned the mapping has been released and the file pointer
+   positioned so that the caller can continue with read(2); this
+   happens at the end of the file as known at setup time and if mmap
+   fails for a window.  */
+static gpg_error_t
+mmap_read (file_filter_ctx_t *a, byte *buf, size_t size, size_t *r_nbytes)
+{
+  static long pagesize;
+  size_t nbytes = 0;
+  size_t n;
+  off_t off;
+  void *p;
+
+  if (!pagesize)
+    {
+      pagesize = sysconf (_SC_PAGESIZE);
+      if (pagesize <= 0)
+        pagesize = 4096;
+    }
+
+  while (nbytes < size && a->map_pos < a->map_size)
+    {
+      if (!a->map
+          || a->map_pos < a->map_off
+          || a->map_pos >= a->map_off + (off_t)a->map_len)
+        {
+          if (a->map)
+            {
+              munmap (a->map, a->map_len);
+              a->map = NULL;
+              a->map_len = 0;
+            }
+          off = a->map_pos - (a->map_pos % pagesize);
+          if (a->map_size - off > IOBUF_MMAP_WINDOW)
+            n = IOBUF_MMAP_WINDOW;
+          else
+            n = a->map_size - off;
+          p = mmap (NULL, n, PROT_READ, MAP_PRIVATE, a->fp, off);
+          if (p == MAP_FAILED)
+            {
+              if (DBG_IOBUF)
+                log_debug ("%s: mmap failed: %s - using read\n",
+                           a->fname, strerror (errno));
+              break;
+            }
+#ifdef MADV_SEQUENTIAL
+          madvise (p, n, MADV_SEQUENTIAL);
+#endif
+          a->map = p;
+          a->map_len = n;
+          a->map_off = off;
+        }
+
+      n = a->map_off + a->map_len - a->map_pos;
+      if (n > size - nbytes)
+        n = size - nbytes;
+      memcpy (buf + nbytes, a->map + (a->map_pos - a->map_off), n);
+      nbytes += n;
+      a->map_pos += n;
+    }
+
+  *r_nbytes = nbytes;
+  if (nbytes < size)
+    {
+      /* Continue with read(2) from the current position.  This also
+         takes care of a file which has grown in the meantime.  */
+      mmap_release (a);
+      if (lseek (a->fp, a->map_pos, SEEK_SET) == (off_t)(-1))
+        return gpg_error_from_syserror ();
+    }
+  return 0;
+}
+#endif /*IOBUF_USE_MMAP*/
+
 
 static int
 file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
@@ -498,6 +677,25 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
 	  int n;
 
 	  nbytes = 0;
+#ifdef IOBUF_USE_MMAP
+          if (a->use_mmap)
+            {
+              rc = mmap_read (a, buf, size, &nbytes);
+              if (rc)
+                {
+                  log_error ("%s: read error: %s\n",
+                             a->fname, gpg_strerror (rc));
+                  if (nbytes)
+                    {
+                      a->delayed_rc = rc;
+                      rc = 0;
+                    }
+                  goto read_done;
+                }
+              if (nbytes == size)
+                goto read_done;
+            }
+#endif /*IOBUF_USE_MMAP*/
         read_more:
           do
             {
@@ -531,8 +729,15 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
                   rc = 0;
                 }
             }
+#ifdef IOBUF_USE_MMAP
+        read_done:
+          ;
+#endif
 #endif
 	  *ret_len = nbytes;
+          file_stats.reads++;
+          file_stats.bytes_read += nbytes;
+          GNUPG_TRACE1 (iobuf_file_read, nbytes);
 	}
     }
   else if (control == IOBUFCTRL_FLUSH)
@@ -584,6 +789,9 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
 	    }
 	  nbytes = p - buf;
 #endif
+          file_stats.writes++;
+          file_stats.bytes_written += nbytes;
+          GNUPG_TRACE1 (iobuf_file_write, nbytes);
 	}
       *ret_len = nbytes;
     }
@@ -593,6 +801,12 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
       a->delayed_rc = 0;
       a->keep_open = 0;
       a->no_cache = 0;
+#ifdef IOBUF_USE_MMAP
+      a->may_mmap = 0;
+      a->use_mmap = 0;
+      a->map = NULL;
+      a->map_len = 0;
+#endif
     }
   else if (control == IOBUFCTRL_DESC)
     {
@@ -600,6 +814,9 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
     }
   else if (control == IOBUFCTRL_FREE)
     {
+#ifdef IOBUF_USE_MMAP
+      mmap_release (a);
+#endif
       if (f != FD_FOR_STDIN && f != FD_FOR_STDOUT)
 	{
 	  if (DBG_IOBUF)
@@ -955,13 +1172,14 @@ block_filter (void *opaque, int control, iobuf_t chain, byte * buffer,
 		  /* find the best matching block length - this is limited
 		   * by the size of the internal buffering */
 		  for (blen = OP_MIN_PARTIAL_CHUNK * 2,
-		       c = OP_MIN_PARTIAL_CHUNK_2POW + 1; blen <= nbytes;
+		       c = OP_MIN_PARTIAL_CHUNK_2POW + 1;
+		       blen <= nbytes && c <= OP_MAX_PARTIAL_CHUNK_2POW;
 		       blen *= 2, c++)
 		    ;
 		  blen /= 2;
 		  c--;
 		  /* write the partial length header */
-		  assert (c <= 0x1f);	/*;-) */
+		  assert (c <= OP_MAX_PARTIAL_CHUNK_2POW);
 		  c |= 0xe0;
 		  iobuf_put (chain, c);
 		  if ((n = a->buflen))
@@ -1083,17 +1301,19 @@ block_filter (void *opaque, int control, iobuf_t chain, byte * buffer,
 unsigned int
 iobuf_set_buffer_size (unsigned int kilobyte)
 {
-  static int used;
-
-  if (!used && kilobyte)
+  if (!iobuf_buffer_size_set && kilobyte)
     {
       if (kilobyte < 4)
         kilobyte = 4;
       else if (kilobyte > 16*1024)
         kilobyte = 16*1024;
 
+      /* The cached buffers have the old size.  */
+      while (buffer_freelist_len)
+        xfree (buffer_freelist[--buffer_freelist_len]);
+
       iobuf_buffer_size = kilobyte * 1024;
-      used = 1;
+      iobuf_buffer_size_set = 1;
     }
   return iobuf_buffer_size / 1024;
 }
@@ -1140,6 +1360,51 @@ iobuf_print_chain (iobuf_t a)
   return 0;
 }
 
+/* Allocate a buffer of SIZE bytes for an iobuf.  A buffer of the
+   standard size is taken from the freelist if possible.  */
+static byte *
+buffer_alloc (size_t size)
+{
+  if (size == iobuf_buffer_size && buffer_freelist_len)
+    return buffer_freelist[--buffer_freelist_len];
+  return xmalloc (size);
+}
+
+
+/* Release the buffer BUF of SIZE bytes which has been allocated by
+   buffer_alloc or xmalloc.  */
+static void
+buffer_free (byte *buf, size_t size)
+{
+  if (!buf)
+    return;
+  if (size == iobuf_buffer_size && buffer_freelist_len < IOBUF_FREELIST_SIZE)
+    buffer_freelist[buffer_freelist_len++] = buf;
+  else
+    xfree (buf);
+}
+
+
+/* Return the buffer size to be used for reading the file FP.  */
+static size_t
+buffer_size_for_file (gnupg_fd_t fp)
+{
+#ifndef HAVE_W32_SYSTEM
+  struct stat st;
+
+  if (!iobuf_buffer_size_set
+      && iobuf_buffer_size < IOBUF_LARGE_BUFFER_SIZE
+      && !fstat (FD2INT (fp), &st)
+      && S_ISREG (st.st_mode)
+      && st.st_size >= IOBUF_LARGE_FILE_SIZE)
+    return IOBUF_LARGE_BUFFER_SIZE;
+#else
+  (void)fp;
+#endif
+  return iobuf_buffer_size;
+}
+
+
 iobuf_t
 iobuf_alloc (int use, size_t bufsize)
 {
@@ -1156,7 +1421,7 @@ iobuf_alloc (int use, size_t bufsize)
 
   a = xcalloc (1, sizeof *a);
   a->use = use;
-  a->d.buf = xmalloc (bufsize);
+  a->d.buf = buffer_alloc (bufsize);
   a->d.size = bufsize;
   a->no = ++number;
   a->subno = 0;
@@ -1197,7 +1462,7 @@ iobuf_close (iobuf_t a)
       if (a->d.buf)
 	{
 	  memset (a->d.buf, 0, a->d.size);	/* erase the buffer */
-	  xfree (a->d.buf);
+	  buffer_free (a->d.buf, a->d.size);
 	}
       xfree (a);
     }
@@ -1297,6 +1562,7 @@ do_open (const char *fname, int special_filenames,
   file_filter_ctx_t *fcx;
   size_t len = 0;
   int print_only = 0;
+  int cached = 0;
   int fd;
   byte desc[MAX_IOBUF_DESC];
 
@@ -1327,14 +1593,15 @@ do_open (const char *fname, int special_filenames,
   else
     {
       if (use == IOBUF_INPUT)
-	fp = fd_cache_open (fname, opentype);
+	fp = fd_cache_open (fname, opentype, &cached);
       else
 	fp = direct_open (fname, opentype, mode700);
       if (fp == GNUPG_INVALID_FD)
 	return NULL;
     }
 
-  a = iobuf_alloc (use, iobuf_buffer_size);
+  a = iobuf_alloc (use, (use == IOBUF_INPUT && !print_only)
+                   ? buffer_size_for_file (fp) : iobuf_buffer_size);
   fcx = xmalloc (sizeof *fcx + strlen (fname));
   fcx->fp = fp;
   fcx->print_only_name = print_only;
@@ -1344,6 +1611,12 @@ do_open (const char *fname, int special_filenames,
   a->filter = file_filter;
   a->filter_ov = fcx;
   file_filter (fcx, IOBUFCTRL_INIT, NULL, NULL, &len);
+#ifdef IOBUF_USE_MMAP
+  /* We allow mmap only for freshly opened files.  */
+  fcx->may_mmap = (use == IOBUF_INPUT && !print_only && !cached);
+#else
+  (void)cached;
+#endif
   if (DBG_IOBUF)
     log_debug ("iobuf-%d.%d: open '%s' desc=%s fd=%d\n",
 	       a->no, a->subno, fname, iobuf_desc (a, desc), FD2INT (fcx->fp));
@@ -1525,6 +1798,35 @@ iobuf_ioctl (iobuf_t a, iobuf_ioctl_t cmd, int intval, void *ptrval)
 	  }
 #endif
     }
+  else if (cmd == IOBUF_IOCTL_MMAP)
+    {
+      /* Read a large regular file using mmap instead of read(2).  The
+         caller must be sure that the file is not truncated by another
+         process while we read it, because accessing the truncated
+         part of a mapping raises SIGBUS.  Using 0 switches back to
+         read(2).  */
+      if (DBG_IOBUF)
+	log_debug ("iobuf-%d.%d: ioctl '%s' mmap=%d\n",
+		   a ? a->no : -1, a ? a->subno : -1, iobuf_desc (a, desc),
+		   intval);
+      for (; a; a = a->chain)
+	if (!a->chain && a->filter == file_filter)
+	  {
+#ifdef IOBUF_USE_MMAP
+	    file_filter_ctx_t *b = a->filter_ov;
+
+	    if (intval && b->may_mmap && !b->use_mmap && !b->eof_seen)
+	      mmap_setup (b);
+	    else if (!intval && b->use_mmap)
+	      {
+		mmap_release (b);
+		if (lseek (b->fp, b->map_pos, SEEK_SET) == (off_t)(-1))
+		  return -1;
+	      }
+#endif /*IOBUF_USE_MMAP*/
+	    return 0;
+	  }
+    }
   else if (cmd == IOBUF_IOCTL_FSYNC)
     {
       /* Do a fsync on the open fd and return any errors to the caller
@@ -1575,6 +1877,8 @@ iobuf_push_filter2 (iobuf_t a,
       return GPG_ERR_BAD_DATA;
     }
 
+  GNUPG_TRACE3 (iobuf_push, a->no, a->subno + 1, f);
+
   /* We want to create a new filter and put it in front of A.  A
      simple implementation would do:
 
@@ -1665,7 +1969,7 @@ iobuf_push_filter2 (iobuf_t a,
      the new filter (A) means that data that has read from (B), but
      not yet read from the pipeline won't be processed by the new
      filter (A)!  That's certainly not what we want.  */
-  a->d.buf = xmalloc (a->d.size);
+  a->d.buf = buffer_alloc (a->d.size);
   a->d.len = 0;
   a->d.start = 0;
 
@@ -1714,6 +2018,7 @@ iobuf_pop_filter (iobuf_t a, int (*f) (void *opaque, int control,
   if (DBG_IOBUF)
     log_debug ("iobuf-%d.%d: pop '%s'\n",
 	       a->no, a->subno, iobuf_desc (a, desc));
+  GNUPG_TRACE3 (iobuf_pop, a->no, a->subno, f);
   if (a->use == IOBUF_INPUT_TEMP || a->use == IOBUF_OUTPUT_TEMP)
     {
       /* This should be the last filter in the pipeline.  */
@@ -1724,7 +2029,7 @@ iobuf_pop_filter (iobuf_t a, int (*f) (void *opaque, int control,
     {				/* this is simple */
       b = a->chain;
       assert (b);
-      xfree (a->d.buf);
+      buffer_free (a->d.buf, a->d.size);
       xfree (a->real_fname);
       memcpy (a, b, sizeof *a);
       xfree (b);
@@ -1766,7 +2071,7 @@ iobuf_pop_filter (iobuf_t a, int (*f) (void *opaque, int control,
        * a flush has been done on the to be removed entry
        */
       b = a->chain;
-      xfree (a->d.buf);
+      buffer_free (a->d.buf, a->d.size);
       xfree (a->real_fname);
       memcpy (a, b, sizeof *a);
       xfree (b);
@@ -1847,7 +2152,7 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	  if (DBG_IOBUF)
 	    log_debug ("iobuf-%d.%d: filter popped (pending EOF returned)\n",
 		       a->no, a->subno);
-	  xfree (a->d.buf);
+	  buffer_free (a->d.buf, a->d.size);
 	  xfree (a->real_fname);
 	  memcpy (a, b, sizeof *a);
 	  xfree (b);
@@ -1926,7 +2231,7 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	      if (DBG_IOBUF)
 		log_debug ("iobuf-%d.%d: pop in underflow (nothing buffered, got EOF)\n",
 			   a->no, a->subno);
-	      xfree (a->d.buf);
+	      buffer_free (a->d.buf, a->d.size);
 	      xfree (a->real_fname);
 	      memcpy (a, b, sizeof *a);
 	      xfree (b);
@@ -1968,7 +2273,14 @@ filter_flush (iobuf_t a)
 
   if (a->use == IOBUF_OUTPUT_TEMP)
     {				/* increase the temp buffer */
-      size_t newsize = a->d.size + iobuf_buffer_size;
+      size_t newsize;
+
+      /* Grow linearly for small buffers but double the size of large
+         ones to avoid quadratic copying.  */
+      if (a->d.size < 16 * iobuf_buffer_size)
+        newsize = a->d.size + iobuf_buffer_size;
+      else
+        newsize = 2 * a->d.size;
 
       if (DBG_IOBUF)
 	log_debug ("increasing temp iobuf from %lu to %lu\n",
@@ -2103,6 +2415,56 @@ iobuf_read (iobuf_t a, void *buffer, unsigned int buflen)
 
 
 
+int
+iobuf_read_view (iobuf_t a, const byte **r_buf)
+{
+  size_t n;
+
+  *r_buf = NULL;
+  if (a->use == IOBUF_OUTPUT || a->use == IOBUF_OUTPUT_TEMP)
+    {
+      log_bug ("iobuf_read_view called on a non-INPUT pipeline!\n");
+      return -1;
+    }
+
+  if (a->nlimit && a->nbytes >= a->nlimit)
+    return -1;			/* forced EOF */
+
+  assert (a->d.start <= a->d.len);
+  if (a->d.start == a->d.len)
+    {
+      if (underflow (a, 1) == -1)
+	return -1;		/* EOF */
+
+      /* Underflow consumes the first character (it's the return
+	 value).  unget() it by resetting the "file position".  */
+      assert (a->d.start);
+      a->d.start--;
+    }
+
+  n = a->d.len - a->d.start;
+  if (a->nlimit && n > a->nlimit - a->nbytes)
+    n = a->nlimit - a->nbytes;
+  if (n > INT_MAX)
+    n = INT_MAX;
+
+  *r_buf = a->d.buf + a->d.start;
+  return n;
+}
+
+
+void
+iobuf_release_view (iobuf_t a, size_t n)
+{
+  assert (a->use == IOBUF_INPUT || a->use == IOBUF_INPUT_TEMP);
+  assert (n <= a->d.len - a->d.start);
+
+  a->d.start += n;
+  a->nbytes += n;
+}
+
+
+
 int
 iobuf_peek (iobuf_t a, byte * buf, unsigned buflen)
 {
@@ -2256,11 +2618,8 @@ iobuf_temp_to_buffer (iobuf_t a, byte * buffer, size_t buflen)
 size_t
 iobuf_copy (iobuf_t dest, iobuf_t source)
 {
-  char *temp;
-  /* Use a 32 KB buffer.  */
-  const size_t temp_size = 32 * 1024;
-
-  size_t nread;
+  const byte *data;
+  int nread;
   size_t nwrote = 0;
   int err;
 
@@ -2270,24 +2629,17 @@ iobuf_copy (iobuf_t dest, iobuf_t source)
   if (iobuf_error (dest))
     return -1;
 
-  temp = xmalloc (temp_size);
-  while (1)
+  /* Write directly from the source's buffer to avoid an extra copy
+   * through a temporary buffer.  */
+  while ((nread = iobuf_read_view (source, &data)) != -1)
     {
-      nread = iobuf_read (source, temp, temp_size);
-      if (nread == -1)
-        /* EOF.  */
-        break;
-
-      err = iobuf_write (dest, temp, nread);
+      err = iobuf_write (dest, data, nread);
+      iobuf_release_view (source, nread);
       if (err)
         break;
       nwrote += nread;
     }
 
-  /* Burn the buffer.  */
-  wipememory (temp, sizeof (temp));
-  xfree (temp);
-
   return nwrote;
 }
 
@@ -2391,6 +2743,18 @@ iobuf_get_filelength (iobuf_t a, int *overflow)
 }
 
 
+/* Emit the statistics of the file filter for the stats registry.  */
+void
+iobuf_stats_report (stats_sink_t sink)
+{
+  stats_put (sink, "file_reads", file_stats.reads);
+  stats_put (sink, "file_writes", file_stats.writes);
+  stats_put (sink, "file_bytes_read", file_stats.bytes_read);
+  stats_put (sink, "file_bytes_written", file_stats.bytes_written);
+  stats_put (sink, "file_bytes_skipped", file_stats.bytes_skipped);
+}
+
+
 int
 iobuf_get_fd (iobuf_t a)
 {
@@ -2475,6 +2839,10 @@ iobuf_seek (iobuf_t a, off_t newpos)
 	  log_error ("can't lseek: %s\n", strerror (errno));
 	  return -1;
 	}
+# ifdef IOBUF_USE_MMAP
+      if (b->use_mmap)
+        b->map_pos = newpos;
+# endif
 #endif
       /* Discard the buffer it is not a temp stream.  */
       a->d.len = 0;
@@ -2610,10 +2978,35 @@ iobuf_read_line (iobuf_t a, byte ** addr_of_buffer,
     }
 
   p = buffer;
-  while ((c = iobuf_get (a)) != -1)
+  for (;;)
     {
-      *p++ = c;
-      nbytes++;
+      if (!a->nofast && a->d.start < a->d.len)
+	/* Copy directly from the internal buffer up to and including
+	   the next LF but not more than fits into BUFFER.  */
+	{
+	  byte *s = a->d.buf + a->d.start;
+	  byte *lf;
+	  size_t n = a->d.len - a->d.start;
+
+	  if (n > length - 1 - nbytes)
+	    n = length - 1 - nbytes;
+	  lf = memchr (s, '\n', n);
+	  if (lf)
+	    n = lf - s + 1;
+	  memcpy (p, s, n);
+	  p += n;
+	  nbytes += n;
+	  a->d.start += n;
+	  a->nbytes += n;
+	  c = p[-1];
+	}
+      else if ((c = iobuf_readbyte (a)) == -1)
+	break;
+      else
+	{
+	  *p++ = c;
+	  nbytes++;
+	}
       if (c == '\n')
 	break;
 
@@ -2693,6 +3086,59 @@ translate_file_handle (int fd, int for_write)
 }
 
 
+/* Try to skip the next N bytes of A without reading them.  This is
+   possible if A is a plain file without any other filter and its
+   buffer is empty.  Returns true if the bytes have been skipped.  If
+   the file has less than N bytes left nothing is done so that the
+   caller reads up to the end and sees the EOF as before.  */
+static int
+file_filter_skip (iobuf_t a, unsigned long n)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)a;
+  (void)n;
+  return 0;
+#else
+  file_filter_ctx_t *b;
+  struct stat st;
+  off_t pos;
+
+  if (a->use != IOBUF_INPUT || a->chain || a->filter != file_filter
+      || a->filter_eof || a->nofast || a->d.start < a->d.len)
+    return 0;
+  b = a->filter_ov;
+  if (b->eof_seen)
+    return 0;
+
+# ifdef IOBUF_USE_MMAP
+  if (b->use_mmap)
+    {
+      if (b->map_size - b->map_pos < (off_t)n)
+        return 0;
+      b->map_pos += n;
+      goto skipped;
+    }
+# endif /*IOBUF_USE_MMAP*/
+
+  if (fstat (FD2INT (b->fp), &st) || !S_ISREG (st.st_mode))
+    return 0;
+  pos = lseek (FD2INT (b->fp), 0, SEEK_CUR);
+  if (pos == (off_t)(-1) || st.st_size - pos < (off_t)n)
+    return 0;
+  if (lseek (FD2INT (b->fp), n, SEEK_CUR) == (off_t)(-1))
+    return 0;
+
+# ifdef IOBUF_USE_MMAP
+ skipped:
+# endif
+  if (DBG_IOBUF)
+    log_debug ("iobuf-%d.%d: skipped %lu bytes\n", a->no, a->subno, n);
+  file_stats.bytes_skipped += n;
+  return 1;
+#endif /*!HAVE_W32_SYSTEM*/
+}
+
+
 void
 iobuf_skip_rest (iobuf_t a, unsigned long n, int partial)
 {
@@ -2720,7 +3166,14 @@ iobuf_skip_rest (iobuf_t a, unsigned long n, int partial)
       unsigned long remaining = n;
       while (remaining > 0)
         {
-          if (a->nofast || a->d.start >= a->d.len)
+          /* Seek over large packet bodies of a plain file instead
+             of reading them into the buffer.  */
+          if (remaining > a->d.size && file_filter_skip (a, remaining))
+            {
+              a->nbytes += remaining;
+              remaining = 0;
+            }
+          else if (a->nofast || a->d.start >= a->d.len)
             {
               if (iobuf_readbyte (a) == -1)
                 {
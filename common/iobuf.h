@@ -94,6 +94,7 @@
 
 #include "../common/types.h"
 #include "../common/sysutils.h"
+#include "../common/stats.h"
 
 #define DBG_IOBUF   iobuf_debug_mode
 
@@ -116,7 +117,8 @@ typedef enum
     IOBUF_IOCTL_KEEP_OPEN        = 1, /* Uses intval.  */
     IOBUF_IOCTL_INVALIDATE_CACHE = 2, /* Uses ptrval.  */
     IOBUF_IOCTL_NO_CACHE         = 3, /* Uses intval.  */
-    IOBUF_IOCTL_FSYNC            = 4  /* Uses ptrval.  */
+    IOBUF_IOCTL_FSYNC            = 4, /* Uses ptrval.  */
+    IOBUF_IOCTL_MMAP             = 5  /* Uses intval.  */
   } iobuf_ioctl_t;
 
 enum iobuf_use
@@ -491,6 +493,20 @@ int iobuf_readbyte (iobuf_t a);
    bytes read.  */
 int iobuf_read (iobuf_t a, void *buf, unsigned buflen);
 
+/* Return a pointer to the data buffered by the input pipeline A at
+   R_BUF, reading more data if the internal buffer is empty.  This
+   allows processing the data without copying it into another buffer.
+   Returns the number of bytes available at R_BUF or -1 on EOF.  The
+   data is owned by the pipeline and is only valid until the next
+   operation on A.  The data is not consumed; the caller needs to call
+   iobuf_release_view for the number of bytes actually used.  */
+int iobuf_read_view (iobuf_t a, const byte **r_buf);
+
+/* Consume N bytes of the data returned by the last call to
+   iobuf_read_view.  N may not be larger than the value returned by
+   that call.  */
+void iobuf_release_view (iobuf_t a, size_t n);
+
 /* Read a line of input (including the '\n') from the pipeline.
 
    The semantics are the same as for fgets(), but if the buffer is too
@@ -614,6 +630,10 @@ void iobuf_skip_rest (iobuf_t a, unsigned long n, int partial);
 
 #define iobuf_where(a)	"[don't know]"
 
+/* Emit the number of bytes read from and written to files for the
+   stats registry.  */
+void iobuf_stats_report (stats_sink_t sink);
+
 /* Each time a filter is allocated (via iobuf_alloc()), a
    monotonically increasing counter is incremented and this field is
    set to the new value.  This macro returns that number.  */
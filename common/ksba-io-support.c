@@ -190,14 +190,13 @@ base64_reader_cb (void *cb_value, char *buffer, size_t count, size_t *nread)
       /* read an entire line or up to the size of the buffer */
       parm->line_counter++;
       parm->have_lf = 0;
+      es_flockfile (parm->fp);
       for (n=0; n < DIM(parm->line);)
         {
-          c = es_getc (parm->fp);
+          c = es_getc_unlocked (parm->fp);
           if (c == EOF)
             {
               parm->eof_seen = 1;
-              if (es_ferror (parm->fp))
-                return -1;
               break;
             }
           parm->line[n++] = c;
@@ -209,6 +208,9 @@ base64_reader_cb (void *cb_value, char *buffer, size_t count, size_t *nread)
               break;
             }
         }
+      es_funlockfile (parm->fp);
+      if (parm->eof_seen && es_ferror (parm->fp))
+        return -1;
       parm->linelen = n;
       if (!n)
         return -1; /* eof */
@@ -323,6 +325,23 @@ base64_reader_cb (void *cb_value, char *buffer, size_t count, size_t *nread)
 
           while (n < count && parm->readpos < parm->linelen )
             {
+              if (!idx && count - n >= 3
+                  && parm->linelen - parm->readpos >= 4)
+                {
+                  /* Fast path for runs of complete groups.  */
+                  size_t len = parm->linelen - parm->readpos;
+
+                  if (len > (count - n) / 3 * 4)
+                    len = (count - n) / 3 * 4;
+                  len = b64dec_groups (buffer + n,
+                                       parm->line + parm->readpos, len);
+                  if (len)
+                    {
+                      n += len / 4 * 3;
+                      parm->readpos += len;
+                      continue;
+                    }
+                }
               c = parm->line[parm->readpos++];
               if (c == '\n' || c == ' ' || c == '\r' || c == '\t')
                 continue;
@@ -387,25 +406,24 @@ simple_reader_cb (void *cb_value, char *buffer, size_t count, size_t *nread)
 {
   struct reader_cb_parm_s *parm = cb_value;
   size_t n;
-  int c = 0;
 
   *nread = 0;
   if (!buffer)
     return -1; /* not supported */
 
-  for (n=0; n < count; n++)
+  if (es_read (parm->fp, buffer, count, &n))
     {
-      c = es_getc (parm->fp);
-      if (c == EOF)
-        {
-          parm->eof_seen = 1;
-          if (es_ferror (parm->fp))
-            return -1;
-          if (n)
-            break; /* Return what we have before an EOF.  */
-          return -1;
-        }
-      *(byte *)buffer++ = c;
+      parm->eof_seen = 1;
+      return -1;
+    }
+  if (n < count)
+    {
+      parm->eof_seen = 1;
+      if (es_ferror (parm->fp))
+        return -1;
+      if (!n)
+        return -1;
+      /* Return what we have before an EOF.  */
     }
 
   *nread = n;
@@ -420,8 +438,10 @@ base64_writer_cb (void *cb_value, const void *buffer, size_t count)
 {
   struct writer_cb_parm_s *parm = cb_value;
   unsigned char radbuf[4];
-  int i, c, idx, quad_count;
-  const unsigned char *p;
+  char tmp[64];
+  int i, idx, quad_count;
+  size_t ngroups;
+  const unsigned char *p = buffer;
   estream_t stream = parm->stream;
 
   if (!count)
@@ -445,25 +465,35 @@ base64_writer_cb (void *cb_value, const void *buffer, size_t count)
   for (i=0; i < idx; i++)
     radbuf[i] = parm->base64.radbuf[i];
 
-  for (p=buffer; count; p++, count--)
+  while (count)
     {
-      radbuf[idx++] = *p;
-      if (idx > 2)
+      if (idx || count < 3)
         {
+          /* Collect the bytes of an incomplete group.  */
+          radbuf[idx++] = *p++;
+          count--;
+          if (idx < 3)
+            continue;
           idx = 0;
-          c = bintoasc[(*radbuf >> 2) & 077];
-          es_putc (c, stream);
-          c = bintoasc[(((*radbuf<<4)&060)|((radbuf[1] >> 4)&017))&077];
-          es_putc (c, stream);
-          c = bintoasc[(((radbuf[1]<<2)&074)|((radbuf[2]>>6)&03))&077];
-          es_putc (c, stream);
-          c = bintoasc[radbuf[2]&077];
-          es_putc (c, stream);
-          if (++quad_count >= (64/4))
-            {
-              es_fputs (LF, stream);
-              quad_count = 0;
-            }
+          b64enc_groups (tmp, radbuf, 1);
+          ngroups = 1;
+        }
+      else
+        {
+          /* Encode the rest of the line at once.  */
+          ngroups = (64/4) - quad_count;
+          if (ngroups > count / 3)
+            ngroups = count / 3;
+          b64enc_groups (tmp, p, ngroups);
+          p += 3 * ngroups;
+          count -= 3 * ngroups;
+        }
+      es_write (stream, tmp, 4 * ngroups, NULL);
+      quad_count += ngroups;
+      if (quad_count >= (64/4))
+        {
+          es_fputs (LF, stream);
+          quad_count = 0;
         }
     }
   for (i=0; i < idx; i++)
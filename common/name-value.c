@@ -39,7 +39,6 @@
 #include <string.h>
 
 #include "mischelp.h"
-#include "strlist.h"
 #include "util.h"
 #include "name-value.h"
 
@@ -47,7 +46,15 @@ struct name_value_container
 {
   struct name_value_entry *first;
   struct name_value_entry *last;
+
+  /* In private key mode the entry with the name "Key:".  This is the
+     most often looked up entry and there may be only one.  */
+  struct name_value_entry *key_entry;
+
   unsigned int private_key_mode:1;
+
+  /* Set if the container has been changed after parsing.  */
+  unsigned int modified:1;
 };
 
 
@@ -56,12 +63,15 @@ struct name_value_entry
   struct name_value_entry *prev;
   struct name_value_entry *next;
 
-  /* The name.  Comments and blank lines have NAME set to NULL.  */
+  /* The name.  Comments and blank lines have NAME set to NULL.  The
+     name is stored in the same allocation as the entry.  */
   char *name;
 
-  /* The value as stored in the file.  We store it when we parse
-     a file so that we can reproduce it.  */
-  strlist_t raw_value;
+  /* The value as stored in the file, i.e. the rest of the line after
+     the name followed by all continuation lines.  The lines are
+     terminated by a LF.  We store it when we parse a file so that we
+     can reproduce it.  */
+  char *raw_value;
 
   /* The decoded value.  */
   char *value;
@@ -112,14 +122,12 @@ nve_release (nve_t entry, int private_key_mode)
   if (entry == NULL)
     return;
 
-  xfree (entry->name);
   if (entry->value && private_key_mode)
     wipememory (entry->value, strlen (entry->value));
   xfree (entry->value);
-  if (private_key_mode)
-    free_strlist_wipe (entry->raw_value);
-  else
-    free_strlist (entry->raw_value);
+  if (entry->raw_value && private_key_mode)
+    wipememory (entry->raw_value, strlen (entry->raw_value));
+  xfree (entry->raw_value);
   xfree (entry);
 }
 
@@ -169,98 +177,108 @@ valid_name (const char *name)
 static gpg_error_t
 assert_raw_value (nve_t entry)
 {
-  gpg_error_t err = 0;
-  size_t len, offset;
+  size_t len, offset, total;
+  size_t amount, linelen, i;
+  char *p = NULL;
+  int pass;
 #define LINELEN	70
-  char buf[LINELEN+3];
 
   if (entry->raw_value)
     return 0;
 
-  len = strlen (entry->value);
-  offset = 0;
-  while (len)
+  /* We do two passes; the first one to compute the length and the
+     second one to fill the buffer.  */
+  for (pass = 0; pass < 2; pass++)
     {
-      size_t amount, linelen = LINELEN;
-
-      /* On the first line we need to subtract space for the name.  */
-      if (entry->raw_value == NULL && strlen (entry->name) < linelen)
-	linelen -= strlen (entry->name);
-
-      /* See if the rest of the value fits in this line.  */
-      if (len <= linelen)
-	amount = len;
-      else
-	{
-	  size_t i;
-
-	  /* Find a suitable space to break on.  */
-	  for (i = linelen - 1; linelen - i < 30 && linelen - i > offset; i--)
-	    if (ascii_isspace (entry->value[i]))
-	      break;
-
-	  if (ascii_isspace (entry->value[i]))
-	    {
-	      /* Found one.  */
-	      amount = i;
-	    }
-	  else
-	    {
-	      /* Just induce a hard break.  */
-	      amount = linelen;
-	    }
-	}
-
-      snprintf (buf, sizeof buf, " %.*s\n", (int) amount,
-		&entry->value[offset]);
-      if (append_to_strlist_try (&entry->raw_value, buf) == NULL)
-	{
-	  err = my_error_from_syserror ();
-	  goto leave;
-	}
+      len = strlen (entry->value);
+      offset = 0;
+      total = 0;
+      while (len)
+        {
+          linelen = LINELEN;
+
+          /* On the first line we need to subtract space for the name.  */
+          if (!offset && strlen (entry->name) < linelen)
+            linelen -= strlen (entry->name);
+
+          /* See if the rest of the value fits in this line.  */
+          if (len <= linelen)
+            amount = len;
+          else
+            {
+              /* Find a suitable space to break on.  */
+              for (i = linelen - 1;
+                   linelen - i < 30 && linelen - i > offset; i--)
+                if (ascii_isspace (entry->value[i]))
+                  break;
 
-      offset += amount;
-      len -= amount;
-    }
+              if (ascii_isspace (entry->value[i]))
+                {
+                  /* Found one.  */
+                  amount = i;
+                }
+              else
+                {
+                  /* Just induce a hard break.  */
+                  amount = linelen;
+                }
+            }
 
- leave:
-  if (err)
-    {
-      free_strlist_wipe (entry->raw_value);
-      entry->raw_value = NULL;
+          if (p)
+            {
+              p[total] = ' ';
+              memcpy (p + total + 1, entry->value + offset, amount);
+              p[total + 1 + amount] = '\n';
+            }
+          total += 1 + amount + 1;
+
+          offset += amount;
+          len -= amount;
+        }
+
+      if (!pass)
+        {
+          p = xtrymalloc (total + 1);
+          if (!p)
+            return my_error_from_syserror ();
+        }
     }
 
-  return err;
+  p[total] = 0;
+  entry->raw_value = p;
+  return 0;
 #undef LINELEN
 }
 
 
-/* Computes the length of the value encoded as continuation.  If
-   *SWALLOW_WS is set, all whitespace at the beginning of S is
-   swallowed.  If START is given, a pointer to the beginning of the
-   value is stored there.  */
+/* Computes the length of the value encoded as continuation in the
+   line S of length N.  If *SWALLOW_WS is set, all whitespace at the
+   beginning of S is swallowed.  If START is given, a pointer to the
+   beginning of the value is stored there.  */
 static size_t
-continuation_length (const char *s, int *swallow_ws, const char **start)
+continuation_length (const char *s, size_t n, int *swallow_ws,
+                     const char **start)
 {
+  const char *end = s + n;
   size_t len;
 
   if (*swallow_ws)
     {
       /* The previous line was a blank line and we inserted a newline.
 	 Swallow all whitespace at the beginning of this line.  */
-      while (ascii_isspace (*s))
+      while (s < end && ascii_isspace (*s))
 	s++;
     }
   else
     {
       /* Iff a continuation starts with more than one space, it
 	 encodes a space.  */
-      if (ascii_isspace (*s))
+      if (s < end && ascii_isspace (*s))
 	s++;
     }
 
   /* Strip whitespace at the end.  */
-  len = strlen (s);
+  len = end - s;
   while (len > 0 && ascii_isspace (s[len-1]))
     len--;
 
@@ -285,18 +303,25 @@ continuation_length (const char *s, int *swallow_ws, const char **start)
 static gpg_error_t
 assert_value (nve_t entry)
 {
-  size_t len;
+  size_t len, n;
   int swallow_ws;
-  strlist_t s;
+  const char *s;
   char *p;
 
   if (entry->value)
     return 0;
 
+  /* Note that the lines of the raw value are terminated by a LF with
+     the possible exception of the last line.  */
   len = 0;
   swallow_ws = 0;
-  for (s = entry->raw_value; s; s = s->next)
-    len += continuation_length (s->d, &swallow_ws, NULL);
+  for (s = entry->raw_value; *s; s += n)
+    {
+      n = strcspn (s, "\n");
+      if (s[n])
+        n++;
+      len += continuation_length (s, n, &swallow_ws, NULL);
+    }
 
   /* Add one for the terminating zero.  */
   len += 1;
@@ -306,11 +331,15 @@ assert_value (nve_t entry)
     return my_error_from_syserror ();
 
   swallow_ws = 0;
-  for (s = entry->raw_value; s; s = s->next)
+  for (s = entry->raw_value; *s; s += n)
     {
       const char *start;
-      size_t l = continuation_length (s->d, &swallow_ws, &start);
+      size_t l;
 
+      n = strcspn (s, "\n");
+      if (s[n])
+        n++;
+      l = continuation_length (s, n, &swallow_ws, &start);
       memcpy (p, start, l);
       p += l;
     }
@@ -346,13 +375,14 @@ nve_value (nve_t pke)
 /* Add (NAME, VALUE, RAW_VALUE) to PK.  NAME may be NULL for comments
    and blank lines.  At least one of VALUE and RAW_VALUE must be
    given.  If PRESERVE_ORDER is not given, entries with the same name
-   are grouped.  NAME, VALUE and RAW_VALUE is consumed.  */
+   are grouped.  VALUE and RAW_VALUE are consumed; NAME is copied.  */
 static gpg_error_t
-_nvc_add (nvc_t pk, char *name, char *value, strlist_t raw_value,
+_nvc_add (nvc_t pk, const char *name, char *value, char *raw_value,
 	  int preserve_order)
 {
   gpg_error_t err = 0;
   nve_t e;
+  int is_key = 0;
 
   assert (value || raw_value);
 
@@ -364,23 +394,30 @@ _nvc_add (nvc_t pk, char *name, char *value, strlist_t raw_value,
 
   if (name
       && pk->private_key_mode
-      && !ascii_strcasecmp (name, "Key:")
-      && nvc_lookup (pk, "Key:"))
+      && !ascii_strcasecmp (name, "Key:"))
     {
-      err = my_error (GPG_ERR_INV_NAME);
-      goto leave;
+      if (pk->key_entry)
+        {
+          err = my_error (GPG_ERR_INV_NAME);
+          goto leave;
+        }
+      is_key = 1;
     }
 
-  e = xtrycalloc (1, sizeof *e);
+  e = xtrycalloc (1, sizeof *e + (name? strlen (name) + 1 : 0));
   if (e == NULL)
     {
       err = my_error_from_syserror ();
       goto leave;
     }
 
-  e->name = name;
+  if (name)
+    e->name = strcpy ((char *)(e + 1), name);
   e->value = value;
   e->raw_value = raw_value;
+  if (is_key)
+    pk->key_entry = e;
+  pk->modified = 1;
 
   if (pk->first)
     {
@@ -430,11 +467,12 @@ _nvc_add (nvc_t pk, char *name, char *value, strlist_t raw_value,
  leave:
   if (err)
     {
-      xfree (name);
       if (value)
 	wipememory (value, strlen (value));
       xfree (value);
-      free_strlist_wipe (raw_value);
+      if (raw_value)
+	wipememory (raw_value, strlen (raw_value));
+      xfree (raw_value);
     }
 
   return err;
@@ -446,20 +484,13 @@ _nvc_add (nvc_t pk, char *name, char *value, strlist_t raw_value,
 gpg_error_t
 nvc_add (nvc_t pk, const char *name, const char *value)
 {
-  char *k, *v;
-
-  k = xtrystrdup (name);
-  if (k == NULL)
-    return my_error_from_syserror ();
+  char *v;
 
   v = xtrystrdup (value);
   if (v == NULL)
-    {
-      xfree (k);
-      return my_error_from_syserror ();
-    }
+    return my_error_from_syserror ();
 
-  return _nvc_add (pk, k, v, NULL, 0);
+  return _nvc_add (pk, name, v, NULL, 0);
 }
 
 
@@ -479,16 +510,24 @@ nvc_set (nvc_t pk, const char *name, const char *value)
     {
       char *v;
 
+      /* Keep the entry and its formatting if the value does not
+         change.  */
+      if (!assert_value (e) && !strcmp (e->value, value))
+        return 0;
+
       v = xtrystrdup (value);
       if (v == NULL)
 	return my_error_from_syserror ();
 
-      free_strlist_wipe (e->raw_value);
+      if (e->raw_value)
+        wipememory (e->raw_value, strlen (e->raw_value));
+      xfree (e->raw_value);
       e->raw_value = NULL;
       if (e->value)
 	wipememory (e->value, strlen (e->value));
       xfree (e->value);
       e->value = v;
+      pk->modified = 1;
 
       return 0;
     }
@@ -511,9 +550,21 @@ nvc_delete (nvc_t pk, nve_t entry)
   else
     pk->last = entry->prev;
 
+  if (entry == pk->key_entry)
+    pk->key_entry = NULL;
+  pk->modified = 1;
+
   nve_release (entry, pk->private_key_mode);
 }
 
+
+/* Return true if PK has been changed since it was parsed.  */
+int
+nvc_modified (nvc_t pk)
+{
+  return pk->modified;
+}
+
 
 
 /* Lookup and iteration.  */
@@ -535,6 +586,10 @@ nve_t
 nvc_lookup (nvc_t pk, const char *name)
 {
   nve_t entry;
+
+  if (pk->private_key_mode && !ascii_strcasecmp (name, "Key:"))
+    return pk->key_entry;
+
   for (entry = pk->first; entry; entry = entry->next)
     if (entry->name && ascii_strcasecmp (entry->name, name) == 0)
       return entry;
@@ -648,6 +703,37 @@ nvc_set_private_key (nvc_t pk, gcry_sexp_t sexp)
 
 /* Parsing and serialization.  */
 
+/* Append the string S to the buffer *R_BUF of length *R_LEN and
+   allocated size *R_SIZE.  The old buffer is wiped when the buffer
+   needs to be enlarged because it may hold a private key.  */
+static gpg_error_t
+append_to_raw (char **r_buf, size_t *r_len, size_t *r_size, const char *s)
+{
+  size_t n = strlen (s);
+
+  if (*r_len + n + 1 > *r_size)
+    {
+      size_t newsize = 2 * *r_size + n + 128;
+      char *newbuf;
+
+      newbuf = xtrymalloc (newsize);
+      if (!newbuf)
+        return my_error_from_syserror ();
+      if (*r_buf)
+        {
+          memcpy (newbuf, *r_buf, *r_len);
+          wipememory (*r_buf, *r_len);
+          xfree (*r_buf);
+        }
+      *r_buf = newbuf;
+      *r_size = newsize;
+    }
+  memcpy (*r_buf + *r_len, s, n + 1);
+  *r_len += n;
+  return 0;
+}
+
+
 static gpg_error_t
 do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
               int for_private_key)
@@ -656,8 +742,13 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
   gpgrt_ssize_t len;
   char *buf = NULL;
   size_t buf_len = 0;
-  char *name = NULL;
-  strlist_t raw_value = NULL;
+  char *name = NULL;       /* Buffer for the name of the entry.  */
+  size_t name_size = 0;
+  int have_name = 0;       /* The current entry has a name.  */
+  int have_entry = 0;      /* An entry has been started.  */
+  char *raw = NULL;        /* The raw value of the current entry.  */
+  size_t raw_len = 0;
+  size_t raw_size = 0;
 
   *result = for_private_key? nvc_new_private_key () : nvc_new ();
   if (*result == NULL)
@@ -675,32 +766,33 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
       for (p = buf; *p && ascii_isspace (*p); p++)
 	/* Do nothing.  */;
 
-      if (name && (spacep (buf) || *p == 0))
+      if (have_name && (spacep (buf) || *p == 0))
 	{
 	  /* A continuation.  */
-	  if (append_to_strlist_try (&raw_value, buf) == NULL)
-	    {
-	      err = my_error_from_syserror ();
-	      goto leave;
-	    }
+	  err = append_to_raw (&raw, &raw_len, &raw_size, buf);
+	  if (err)
+	    goto leave;
 	  continue;
 	}
 
       /* No continuation.  Add the current entry if any.  */
-      if (raw_value)
+      if (have_entry)
 	{
-	  err = _nvc_add (*result, name, NULL, raw_value, 1);
+	  err = _nvc_add (*result, have_name? name : NULL, NULL, raw, 1);
+	  raw = NULL;
+	  raw_len = raw_size = 0;
 	  if (err)
 	    goto leave;
 	}
 
       /* And prepare for the next one.  */
-      name = NULL;
-      raw_value = NULL;
+      have_name = 0;
+      have_entry = 1;
 
       if (*p != 0 && *p != '#')
 	{
-	  char *colon, *value, tmp;
+	  char *colon, *value;
+	  size_t n;
 
 	  colon = strchr (buf, ':');
 	  if (colon == NULL)
@@ -710,30 +802,28 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
 	    }
 
 	  value = colon + 1;
-	  tmp = *value;
-	  *value = 0;
-	  name = xtrystrdup (p);
-	  *value = tmp;
-
-	  if (name == NULL)
+	  n = value - p;
+	  if (n + 1 > name_size)
 	    {
-	      err = my_error_from_syserror ();
-	      goto leave;
+	      xfree (name);
+	      name_size = n + 32;
+	      name = xtrymalloc (name_size);
+	      if (name == NULL)
+		{
+		  err = my_error_from_syserror ();
+		  goto leave;
+		}
 	    }
+	  memcpy (name, p, n);
+	  name[n] = 0;
+	  have_name = 1;
 
-	  if (append_to_strlist_try (&raw_value, value) == NULL)
-	    {
-	      err = my_error_from_syserror ();
-	      goto leave;
-	    }
-	  continue;
-	}
-
-      if (append_to_strlist_try (&raw_value, buf) == NULL)
-	{
-	  err = my_error_from_syserror ();
-	  goto leave;
+	  err = append_to_raw (&raw, &raw_len, &raw_size, value);
 	}
+      else
+	err = append_to_raw (&raw, &raw_len, &raw_size, buf);
+      if (err)
+	goto leave;
     }
   if (len < 0)
     {
@@ -742,11 +832,22 @@ do_nvc_parse (nvc_t *result, int *errlinep, estream_t stream,
     }
 
   /* Add the final entry.  */
-  if (raw_value)
-    err = _nvc_add (*result, name, NULL, raw_value, 1);
+  if (have_entry)
+    {
+      err = _nvc_add (*result, have_name? name : NULL, NULL, raw, 1);
+      raw = NULL;
+    }
+  if (!err)
+    (*result)->modified = 0;
 
  leave:
   gpgrt_free (buf);
+  xfree (name);
+  if (raw)
+    {
+      wipememory (raw, raw_len);
+      xfree (raw);
+    }
   if (err)
     {
       nvc_release (*result);
@@ -784,7 +885,6 @@ nvc_write (nvc_t pk, estream_t stream)
 {
   gpg_error_t err;
   nve_t entry;
-  strlist_t s;
 
   for (entry = pk->first; entry; entry = entry->next)
     {
@@ -795,8 +895,7 @@ nvc_write (nvc_t pk, estream_t stream)
       if (err)
 	return err;
 
-      for (s = entry->raw_value; s; s = s->next)
-	es_fputs (s->d, stream);
+      es_fputs (entry->raw_value, stream);
 
       if (es_ferror (stream))
 	return my_error_from_syserror ();
@@ -88,6 +88,9 @@ gpg_error_t nvc_set (nvc_t pk, const char *name, const char *value);
 /* Delete the given entry from PK.  */
 void nvc_delete (nvc_t pk, nve_t pke);
 
+/* Return true if PK has been changed since it was parsed.  */
+int nvc_modified (nvc_t pk);
+
 
 
 /* Private key handling.  */
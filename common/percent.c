@@ -29,6 +29,7 @@
 
 #include <config.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <ctype.h>
 #include <assert.h>
@@ -87,47 +88,78 @@ percent_plus_escape (const char *string)
 }
 
 
-/* Create a newly alloced string from (DATA,DATALEN) with embedded
- * Nuls quoted as %00.  The standard percent unescaping can be
- * used to reverse this encoding.   */
-char *
-percent_data_escape (const void *data, size_t datalen)
+/* Return the length of the string percent_data_escape creates from
+ * (DATA,DATALEN) not counting the terminating Nul.  */
+size_t
+percent_data_escape_len (const void *data, size_t datalen)
 {
-  char *buffer, *p;
   const char *s;
-  size_t n, length;
+  const char *end = (const char *)data + datalen;
+  size_t length = datalen;
 
-  for (length=1, s=data, n=datalen; n; s++, n--)
-    {
-      if (!*s || *s == '%')
-        length += 3;
-      else
-        length++;
-    }
+  /* memchr is usually much faster than a byte loop.  */
+  for (s = data; (s = memchr (s, 0, end - s)); s++)
+    length += 2;
+  for (s = data; (s = memchr (s, '%', end - s)); s++)
+    length += 2;
 
-  buffer = p = xtrymalloc (length);
-  if (!buffer)
-    return NULL;
+  return length;
+}
 
-  for (s=data, n=datalen; n; s++, n--)
+
+/* Store the percent_data_escape encoding of (DATA,DATALEN) as a
+ * string at BUFFER which must have a size of at least
+ * percent_data_escape_len (DATA,DATALEN)+1 bytes.  Returns
+ * BUFFER.  */
+char *
+percent_data_escape_buf (char *buffer, const void *data, size_t datalen)
+{
+  const char *s = data;
+  const char *end = s + datalen;
+  const char *nul, *pct, *q;
+  char *p = buffer;
+
+  /* Copy the spans between the characters to escape in one go.  */
+  nul = memchr (s, 0, datalen);
+  pct = memchr (s, '%', datalen);
+  for (;;)
     {
-      if (!*s)
-        {
-          memcpy (p, "%00", 3);
-          p += 3;
-        }
-      else if (*s == '%')
+      q = (nul && (!pct || nul < pct))? nul : pct;
+      if (!q)
         {
-          memcpy (p, "%25", 3);
-          p += 3;
+          memcpy (p, s, end - s);
+          p += end - s;
+          break;
         }
+      memcpy (p, s, q - s);
+      p += q - s;
+      memcpy (p, *q? "%25" : "%00", 3);
+      p += 3;
+      s = q + 1;
+      if (q == nul)
+        nul = memchr (s, 0, end - s);
       else
-        *p++ = *s;
+        pct = memchr (s, '%', end - s);
     }
   *p = 0;
 
   return buffer;
+}
+
 
+/* Create a newly alloced string from (DATA,DATALEN) with embedded
+ * Nuls quoted as %00.  The standard percent unescaping can be
+ * used to reverse this encoding.   */
+char *
+percent_data_escape (const void *data, size_t datalen)
+{
+  char *buffer;
+
+  buffer = xtrymalloc (percent_data_escape_len (data, datalen) + 1);
+  if (!buffer)
+    return NULL;
+
+  return percent_data_escape_buf (buffer, data, datalen);
 }
 
 
@@ -140,9 +172,18 @@ do_unescape (unsigned char *buffer, const unsigned char *string,
              int withplus, int nulrepl)
 {
   unsigned char *p = buffer;
+  size_t n;
 
   while (*string)
     {
+      n = strcspn ((const char *)string, withplus? "%+" : "%");
+      if (n)
+        {
+          memcpy (p, string, n);
+          p += n;
+          string += n;
+          continue;
+        }
       if (*string == '%' && string[1] && string[2])
         {
           string++;
@@ -169,9 +210,17 @@ static size_t
 count_unescape (const unsigned char *string)
 {
   size_t n = 0;
+  size_t span;
 
   while (*string)
     {
+      span = strcspn ((const char *)string, "%");
+      if (span)
+        {
+          n += span;
+          string += span;
+          continue;
+        }
       if (*string == '%' && string[1] && string[2])
         {
           string++;
@@ -230,10 +279,20 @@ static size_t
 do_unescape_inplace (char *string, int withplus, int nulrepl)
 {
   unsigned char *p, *p0;
+  size_t n;
 
   p = p0 = string;
   while (*string)
     {
+      n = strcspn (string, withplus? "%+" : "%");
+      if (n)
+        {
+          if (p != (unsigned char *)string)
+            memmove (p, string, n);
+          p += n;
+          string += n;
+          continue;
+        }
       if (*string == '%' && string[1] && string[2])
         {
           string++;
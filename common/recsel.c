@@ -64,7 +64,9 @@ struct recsel_expr_s
   unsigned int not:1;   /* Negate operators. */
   unsigned int disjun:1;/* Start of a disjunction.  */
   unsigned int xcase:1; /* String match is case sensitive.  */
+  int propid;           /* Property id set by recsel_resolve or 0.  */
   const char *value;    /* (Points into NAME.)  */
+  size_t valuelen;      /* strlen of VALUE.  */
   long numvalue;        /* strtol of VALUE.  */
   char name[1];         /* Name of the property.  */
 };
@@ -252,6 +254,7 @@ recsel_parse_expr (recsel_expr_t *selector, const char *expression)
     return my_error_from_syserror ();
   strcpy (se->name, expr);
   se->next = NULL;
+  se->propid = 0;
   se->not = 0;
   se->disjun = disjun;
   se->xcase = xcase;
@@ -435,6 +438,7 @@ recsel_parse_expr (recsel_expr_t *selector, const char *expression)
       return my_error (GPG_ERR_MISSING_VALUE);
     }
 
+  se->valuelen = strlen (se->value);
   se->numvalue = strtol (se->value, NULL, 0);
 
   if (next_lc)
@@ -503,26 +507,114 @@ recsel_dump (recsel_expr_t selector)
 }
 
 
-/* Return true if the record RECORD has been selected.  The GETVAL
- * function is called with COOKIE and the NAME of a property used in
- * the expression.  */
-int
-recsel_select (recsel_expr_t selector,
-               const char *(*getval)(void *cookie, const char *propname),
-               void *cookie)
+/* Map the property names used by SELECTOR to numeric ids using the
+ * function PROPID which returns a positive id for a known NAME and 0
+ * for an unknown one.  This allows the use of recsel_select_id
+ * instead of recsel_select so that the properties need not be looked
+ * up by name for each record.  */
+void
+recsel_resolve (recsel_expr_t selector, int (*propid)(const char *propname))
 {
   recsel_expr_t se;
-  const char *value;
-  size_t selen, valuelen;
-  long numvalue;
+
+  for (se = selector; se; se = se->next)
+    se->propid = propid (se->name);
+}
+
+
+/* Return true if the expression SE is true for the non-empty VALUE of
+ * the property.  The negation flag is not considered.  */
+static int
+eval_term (recsel_expr_t se, const char *value)
+{
+  size_t valuelen;
+
+  switch (se->op)
+    {
+    case SELECT_SAME:
+      valuelen = strlen (value);
+      if (se->xcase)
+        return (valuelen == se->valuelen
+                && !memcmp (value, se->value, valuelen));
+      else
+        return (valuelen == se->valuelen
+                && !memicmp (value, se->value, valuelen));
+    case SELECT_SUB:
+      if (se->xcase)
+        return !!my_memstr (value, strlen (value), se->value);
+      else
+        return !!memistr (value, strlen (value), se->value);
+    case SELECT_NONEMPTY:
+      return 1;
+    case SELECT_ISTRUE:
+      return !!strtol (value, NULL, 0);
+    case SELECT_EQ:
+      return (strtol (value, NULL, 0) == se->numvalue);
+    case SELECT_GT:
+      return (strtol (value, NULL, 0) > se->numvalue);
+    case SELECT_GE:
+      return (strtol (value, NULL, 0) >= se->numvalue);
+    case SELECT_LT:
+      return (strtol (value, NULL, 0) < se->numvalue);
+    case SELECT_LE:
+      return (strtol (value, NULL, 0) <= se->numvalue);
+    case SELECT_STRGT:
+      if (se->xcase)
+        return strcmp (value, se->value) > 0;
+      else
+        return strcasecmp (value, se->value) > 0;
+    case SELECT_STRGE:
+      if (se->xcase)
+        return strcmp (value, se->value) >= 0;
+      else
+        return strcasecmp (value, se->value) >= 0;
+    case SELECT_STRLT:
+      if (se->xcase)
+        return strcmp (value, se->value) < 0;
+      else
+        return strcasecmp (value, se->value) < 0;
+    case SELECT_STRLE:
+      if (se->xcase)
+        return strcmp (value, se->value) <= 0;
+      else
+        return strcasecmp (value, se->value) <= 0;
+    }
+
+  return 0;
+}
+
+
+/* Common code for recsel_select and recsel_select_id.  Exactly one
+ * of GETVAL and GETVAL_ID is used; if both are NULL all properties
+ * are empty.  */
+static int
+do_select (recsel_expr_t selector,
+           const char *(*getval)(void *cookie, const char *propname),
+           const char *(*getval_id)(void *cookie, int propid),
+           void *cookie)
+{
+  recsel_expr_t se, last_se;
+  const char *value = NULL;
   int result = 1;
 
   se = selector;
+  last_se = NULL;
   while (se)
     {
-      value = getval? getval (cookie, se->name) : NULL;
-      if (!value)
-        value = "";
+      /* Expressions like "uid =~ foo || uid =~ bar" are common; thus
+       * we do not ask again for the same property.  */
+      if (!last_se
+          || (getval_id? (se->propid != last_se->propid)
+              /*     */: strcmp (se->name, last_se->name)))
+        {
+          if (getval_id)
+            value = getval_id (cookie, se->propid);
+          else
+            value = getval? getval (cookie, se->name) : NULL;
+          if (!value)
+            value = "";
+        }
+      last_se = se;
 
       if (!*value)
         {
@@ -530,72 +622,7 @@ recsel_select (recsel_expr_t selector,
           result = 0;
         }
       else /* Field has a value.  */
-        {
-          valuelen = strlen (value);
-          numvalue = strtol (value, NULL, 0);
-          selen = strlen (se->value);
-
-          switch (se->op)
-            {
-            case SELECT_SAME:
-              if (se->xcase)
-                result = (valuelen==selen && !memcmp (value,se->value,selen));
-              else
-                result = (valuelen==selen && !memicmp (value,se->value,selen));
-              break;
-            case SELECT_SUB:
-              if (se->xcase)
-                result = !!my_memstr (value, valuelen, se->value);
-              else
-                result = !!memistr (value, valuelen, se->value);
-              break;
-            case SELECT_NONEMPTY:
-              result = !!valuelen;
-              break;
-            case SELECT_ISTRUE:
-              result = !!numvalue;
-              break;
-            case SELECT_EQ:
-              result = (numvalue == se->numvalue);
-              break;
-            case SELECT_GT:
-              result = (numvalue > se->numvalue);
-              break;
-            case SELECT_GE:
-              result = (numvalue >= se->numvalue);
-              break;
-            case SELECT_LT:
-              result = (numvalue < se->numvalue);
-              break;
-            case SELECT_LE:
-              result = (numvalue <= se->numvalue);
-              break;
-            case SELECT_STRGT:
-              if (se->xcase)
-                result = strcmp (value, se->value) > 0;
-              else
-                result = strcasecmp (value, se->value) > 0;
-              break;
-            case SELECT_STRGE:
-              if (se->xcase)
-                result = strcmp (value, se->value) >= 0;
-              else
-                result = strcasecmp (value, se->value) >= 0;
-              break;
-            case SELECT_STRLT:
-              if (se->xcase)
-                result = strcmp (value, se->value) < 0;
-              else
-                result = strcasecmp (value, se->value) < 0;
-              break;
-            case SELECT_STRLE:
-              if (se->xcase)
-                result = strcmp (value, se->value) <= 0;
-              else
-                result = strcasecmp (value, se->value) <= 0;
-              break;
-            }
-        }
+        result = eval_term (se, value);
 
       if (se->not)
         result = !result;
@@ -622,3 +649,28 @@ recsel_select (recsel_expr_t selector,
 
   return result;
 }
+
+
+/* Return true if the record RECORD has been selected.  The GETVAL
+ * function is called with COOKIE and the NAME of a property used in
+ * the expression.  */
+int
+recsel_select (recsel_expr_t selector,
+               const char *(*getval)(void *cookie, const char *propname),
+               void *cookie)
+{
+  return do_select (selector, getval, NULL, cookie);
+}
+
+
+/* This is a variant of recsel_select for a SELECTOR prepared with
+ * recsel_resolve.  The GETVAL function is called with COOKIE and the
+ * id of a property used in the expression; an id of 0 denotes an
+ * unknown property.  */
+int
+recsel_select_id (recsel_expr_t selector,
+                  const char *(*getval)(void *cookie, int propid),
+                  void *cookie)
+{
+  return do_select (selector, NULL, getval, cookie);
+}
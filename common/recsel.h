@@ -38,6 +38,11 @@ void recsel_dump (recsel_expr_t selector);
 int recsel_select (recsel_expr_t selector,
                    const char *(*getval)(void *cookie, const char *propname),
                    void *cookie);
+void recsel_resolve (recsel_expr_t selector,
+                     int (*propid)(const char *propname));
+int recsel_select_id (recsel_expr_t selector,
+                      const char *(*getval)(void *cookie, int propid),
+                      void *cookie);
 
 
 #endif /*GNUPG_COMMON_RECSEL_H*/
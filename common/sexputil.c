@@ -563,17 +563,148 @@ get_pk_algo_from_key (gcry_sexp_t key)
 
 /* This is a variant of get_pk_algo_from_key but takes an canonical
  * encoded S-expression as input.  Returns a GCRYPT public key
- * identiier or 0 on error.  */
+ * identiier or 0 on error.  The buffer is parsed in place; no
+ * gcry_sexp_t object is created.  */
 int
 get_pk_algo_from_canon_sexp (const unsigned char *keydata, size_t keydatalen)
 {
-  gcry_sexp_t sexp;
+  const unsigned char *buf, *tok, *flags;
+  size_t buflen, toklen, flagslen;
+  int depth;
+  char algoname[6];
   int algo;
 
-  if (gcry_sexp_sscan (&sexp, NULL, keydata, keydatalen))
+  buf = keydata;
+  buflen = keydatalen;
+  depth = 0;
+  if (parse_sexp (&buf, &buflen, &depth, &tok, &toklen)
+      || parse_sexp (&buf, &buflen, &depth, &tok, &toklen)
+      || !tok
+      || parse_sexp (&buf, &buflen, &depth, &tok, &toklen)
+      || tok || depth != 2
+      || parse_sexp (&buf, &buflen, &depth, &tok, &toklen)
+      || !tok || toklen >= sizeof algoname)
     return 0;
+  memcpy (algoname, tok, toklen);
+  algoname[toklen] = 0;
+
+  algo = gcry_pk_map_name (algoname);
+  if (algo == GCRY_PK_ECC
+      && !canon_sexp_find_token (keydata, keydatalen, "flags",
+                                 &flags, &flagslen))
+    {
+      /* Skip the open parenthesis and the "flags" token.  */
+      buf = flags;
+      buflen = flagslen;
+      depth = 0;
+      if (parse_sexp (&buf, &buflen, &depth, &tok, &toklen)
+          || parse_sexp (&buf, &buflen, &depth, &tok, &toklen))
+        return algo;
+      while (!parse_sexp (&buf, &buflen, &depth, &tok, &toklen) && depth)
+        if (tok && toklen == 5 && !memcmp (tok, "eddsa", 5))
+          {
+            algo = GCRY_PK_EDDSA;
+            break;
+          }
+    }
 
-  algo = get_pk_algo_from_key (sexp);
-  gcry_sexp_release (sexp);
   return algo;
 }
+
+
+/* Find the first list in the canonical encoded S-expression SEXP of
+ * length SEXPLEN which starts with the string TOKEN.  On success a
+ * pointer to the opening parenthesis of that list is stored at R_LIST
+ * and its length at R_LISTLEN.  This is similar to
+ * gcry_sexp_find_token but works directly on the buffer and does not
+ * allocate anything.  Returns 0 on success, GPG_ERR_NOT_FOUND if
+ * there is no such list, or another error code for a malformed
+ * S-expression.  */
+gpg_error_t
+canon_sexp_find_token (const unsigned char *sexp, size_t sexplen,
+                       const char *token,
+                       unsigned char const **r_list, size_t *r_listlen)
+{
+  gpg_error_t err;
+  const unsigned char *buf, *tok, *start;
+  const unsigned char *list = NULL;
+  size_t buflen, toklen;
+  size_t tokenlen = strlen (token);
+  int depth, list_depth;
+
+  *r_list = NULL;
+  *r_listlen = 0;
+
+  buf = sexp;
+  buflen = sexplen;
+  depth = 0;
+  while (buflen)
+    {
+      start = buf;
+      if ((err = parse_sexp (&buf, &buflen, &depth, &tok, &toklen)))
+        return err;
+      if (!tok && !toklen)
+        {
+          list = start;  /* An open parenthesis.  */
+          continue;
+        }
+      if (list && tok && toklen == tokenlen && !memcmp (tok, token, toklen))
+        {
+          /* Found - skip to the end of the list.  */
+          list_depth = depth;
+          while (depth >= list_depth)
+            if ((err = parse_sexp (&buf, &buflen, &depth, &tok, &toklen)))
+              return err;
+          *r_list = list;
+          *r_listlen = buf - list;
+          return 0;
+        }
+      list = NULL;
+      if (!depth)
+        break;
+    }
+  if (depth)
+    return gpg_error (GPG_ERR_INV_SEXP);  /* Truncated.  */
+
+  return gpg_error (GPG_ERR_NOT_FOUND);
+}
+
+
+/* Find the first list in the canonical encoded S-expression SEXP of
+ * length SEXPLEN which starts with the string TOKEN and store a
+ * pointer to the data of its second element at R_DATA and the length
+ * of that data at R_DATALEN.  For example with TOKEN "comment" this
+ * returns "foo" for SEXP "(11:private-key(...)(7:comment3:foo))".
+ * Nothing is allocated; the result points into SEXP.  Returns 0 on
+ * success, GPG_ERR_NOT_FOUND if there is no such list or the second
+ * element is not a string, or another error code for a malformed
+ * S-expression.  */
+gpg_error_t
+canon_sexp_get_data (const unsigned char *sexp, size_t sexplen,
+                     const char *token,
+                     unsigned char const **r_data, size_t *r_datalen)
+{
+  gpg_error_t err;
+  const unsigned char *buf, *tok;
+  size_t buflen, toklen;
+  int depth;
+
+  *r_data = NULL;
+  *r_datalen = 0;
+
+  err = canon_sexp_find_token (sexp, sexplen, token, &buf, &buflen);
+  if (err)
+    return err;
+
+  depth = 0;
+  if ((err = parse_sexp (&buf, &buflen, &depth, &tok, &toklen))
+      || (err = parse_sexp (&buf, &buflen, &depth, &tok, &toklen))
+      || (err = parse_sexp (&buf, &buflen, &depth, &tok, &toklen)))
+    return err;
+  if (!tok || depth != 1)
+    return gpg_error (GPG_ERR_NOT_FOUND);
+
+  *r_data = tok;
+  *r_datalen = toklen;
+  return 0;
+}
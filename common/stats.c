@@ -0,0 +1,214 @@
+/* stats.c - A registry for performance counters
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: (LGPL-3.0+ OR GPL-2.0+)
+ */
+
+/* Many modules keep some counters to help with performance analysis.
+ * This module collects them into one report.  The modules keep
+ * counting in their own variables, so that the hot paths are not
+ * affected, and register a report function with stats_register.  A
+ * report created by stats_to_json is a JSON object with one member
+ * object for each registered module and a member "process" with the
+ * resource usage of the process:
+ *
+ *   {"process":{"wall_ms":12,"user_ms":8,"sys_ms":1},
+ *    "keydb":{"handles":3,"found":2}}
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_GETRUSAGE
+# include <sys/time.h>
+# include <sys/resource.h>
+#endif
+
+#include "util.h"
+#include "membuf.h"
+#include "stats.h"
+
+#define MAX_REPORTS 32
+
+struct stats_sink_s
+{
+  membuf_t mb;
+  int count;  /* Number of values emitted for the current module.  */
+};
+
+static struct
+{
+  const char *name;
+  stats_report_t report;
+} reports[MAX_REPORTS];
+static int n_reports;
+
+/* The start time of the process in milliseconds.  */
+static unsigned long long start_ms;
+
+
+
+/* Return the current time in milliseconds.  */
+static unsigned long long
+get_wall_ms (void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+  struct timeval tv;
+
+  if (!gettimeofday (&tv, NULL))
+    return (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+  return (unsigned long long)gnupg_get_time () * 1000;
+}
+
+
+/* Record the start time of the process.  This should be called early
+ * by main.  */
+void
+stats_init (void)
+{
+  if (!start_ms)
+    start_ms = get_wall_ms ();
+}
+
+
+/* Register the function REPORT to emit the counters of the module
+ * NAME.  NAME must be a static string and a valid JSON member name
+ * without any escaping.  Registering a name a second time replaces
+ * the old function.  */
+void
+stats_register (const char *name, stats_report_t report)
+{
+  int i;
+
+  stats_init ();
+  for (i=0; i < n_reports; i++)
+    if (!strcmp (reports[i].name, name))
+      {
+        reports[i].report = report;
+        return;
+      }
+  if (n_reports < MAX_REPORTS)
+    {
+      reports[n_reports].name = name;
+      reports[n_reports].report = report;
+      n_reports++;
+    }
+}
+
+
+/* Emit the counter NAME with VALUE.  To be called by a report
+ * function.  */
+void
+stats_put (stats_sink_t sink, const char *name, unsigned long long value)
+{
+  put_membuf_printf (&sink->mb, "%s\"%s\":%llu",
+                     sink->count++? ",":"", name, value);
+}
+
+
+static void
+put_process_stats (stats_sink_t sink)
+{
+  stats_put (sink, "wall_ms",
+             start_ms? get_wall_ms () - start_ms : 0);
+#ifdef HAVE_GETRUSAGE
+  {
+    struct rusage ru;
+
+    if (!getrusage (RUSAGE_SELF, &ru))
+      {
+        stats_put (sink, "user_ms", (ru.ru_utime.tv_sec * 1000
+                                     + ru.ru_utime.tv_usec / 1000));
+        stats_put (sink, "sys_ms", (ru.ru_stime.tv_sec * 1000
+                                    + ru.ru_stime.tv_usec / 1000));
+        stats_put (sink, "maxrss_kb", ru.ru_maxrss);
+      }
+  }
+#endif /*HAVE_GETRUSAGE*/
+}
+
+
+/* Return a malloced string with a JSON object holding the counters of
+ * all registered modules.  Returns NULL on error with ERRNO set.  */
+char *
+stats_to_json (void)
+{
+  struct stats_sink_s sink;
+  int i;
+
+  init_membuf (&sink.mb, 1024);
+  put_membuf_str (&sink.mb, "{\"process\":{");
+  sink.count = 0;
+  put_process_stats (&sink);
+  put_membuf_str (&sink.mb, "}");
+  for (i=0; i < n_reports; i++)
+    {
+      put_membuf_printf (&sink.mb, ",\"%s\":{", reports[i].name);
+      sink.count = 0;
+      reports[i].report (&sink);
+      put_membuf_str (&sink.mb, "}");
+    }
+  put_membuf (&sink.mb, "}\n", 3);  /* Including the terminating Nul.  */
+  return get_membuf (&sink.mb, NULL);
+}
+
+
+/* Write the report to the file FNAME.  If FNAME is "-" the report is
+ * written to stderr.  */
+gpg_error_t
+stats_write_json (const char *fname)
+{
+  gpg_error_t err = 0;
+  estream_t fp;
+  char *json;
+
+  json = stats_to_json ();
+  if (!json)
+    return gpg_error_from_syserror ();
+
+  if (!strcmp (fname, "-"))
+    fp = es_stderr;
+  else
+    fp = es_fopen (fname, "w");
+  if (!fp)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      if (es_fputs (json, fp) == EOF || es_fflush (fp))
+        err = gpg_error_from_syserror ();
+      if (fp != es_stderr && es_fclose (fp) && !err)
+        err = gpg_error_from_syserror ();
+    }
+  if (err)
+    log_error ("error writing statistics to '%s': %s\n",
+               fname, gpg_strerror (err));
+  xfree (json);
+  return err;
+}
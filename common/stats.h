@@ -0,0 +1,51 @@
+/* stats.h - Definitions for the statistics registry
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: (LGPL-3.0+ OR GPL-2.0+)
+ */
+
+#ifndef GNUPG_COMMON_STATS_H
+#define GNUPG_COMMON_STATS_H
+
+/* The object used by a report function to emit its values.  */
+struct stats_sink_s;
+typedef struct stats_sink_s *stats_sink_t;
+
+/* A function registered with stats_register.  It is called whenever
+ * a report is created and emits the current values of its counters
+ * with stats_put.  */
+typedef void (*stats_report_t) (stats_sink_t sink);
+
+/*-- stats.c --*/
+void stats_init (void);
+void stats_register (const char *name, stats_report_t report);
+void stats_put (stats_sink_t sink, const char *name,
+                unsigned long long value);
+char *stats_to_json (void);
+gpg_error_t stats_write_json (const char *fname);
+
+#endif /*GNUPG_COMMON_STATS_H*/
@@ -239,21 +239,16 @@ trim_trailing_spaces( char *string )
 unsigned
 trim_trailing_chars( byte *line, unsigned len, const char *trimchars )
 {
-    byte *p, *mark;
     unsigned n;
 
-    for(mark=NULL, p=line, n=0; n < len; n++, p++ ) {
-	if( strchr(trimchars, *p ) ) {
-	    if( !mark )
-		mark = p;
-	}
-	else
-	    mark = NULL;
-    }
+    /* Scan backwards so that only the trailing characters need to be
+       looked at.  */
+    for(n=len; n && strchr(trimchars, line[n-1]); n-- )
+	;
 
-    if( mark ) {
-	*mark = 0;
-	return mark - line;
+    if( n < len ) {
+	line[n] = 0;
+	return n;
     }
     return len;
 }
@@ -271,23 +266,12 @@ size_t
 length_sans_trailing_chars (const unsigned char *line, size_t len,
                             const char *trimchars )
 {
-  const unsigned char *p, *mark;
   size_t n;
 
-  for( mark=NULL, p=line, n=0; n < len; n++, p++ )
-    {
-      if (strchr (trimchars, *p ))
-        {
-          if( !mark )
-            mark = p;
-        }
-      else
-        mark = NULL;
-    }
+  for (n=len; n && strchr (trimchars, line[n-1]); n--)
+    ;
 
-  if (mark)
-    return mark - line;
-  return len;
+  return n;
 }
 
 /*
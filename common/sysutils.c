@@ -1282,6 +1282,100 @@ gnupg_inotify_has_name (int fd, const char *name)
 }
 
 
+/* Store a new non-blocking inotify file handle at R_FD to watch for
+ * files being created, removed or renamed in the directory DIRNAME.
+ * Use gnupg_inotify_pending to check for changes.  */
+gpg_error_t
+gnupg_inotify_watch_dir (int *r_fd, const char *dirname)
+{
+#if HAVE_INOTIFY_INIT
+  gpg_error_t err;
+  int fd;
+
+  *r_fd = -1;
+
+  if (!dirname)
+    return my_error (GPG_ERR_INV_VALUE);
+
+  fd = inotify_init ();
+  if (fd == -1)
+    return my_error_from_syserror ();
+
+  if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+      err = my_error_from_syserror ();
+      close (fd);
+      return err;
+    }
+  err = gnupg_inotify_add_dir (fd, dirname);
+  if (err)
+    {
+      close (fd);
+      return err;
+    }
+
+  *r_fd = fd;
+  return 0;
+#else /*!HAVE_INOTIFY_INIT*/
+
+  (void)dirname;
+  *r_fd = -1;
+  return my_error (GPG_ERR_NOT_SUPPORTED);
+
+#endif /*!HAVE_INOTIFY_INIT*/
+}
+
+
+/* Add a watch for the directory DIRNAME to the inotify file handle
+ * FD created by gnupg_inotify_watch_dir.  */
+gpg_error_t
+gnupg_inotify_add_dir (int fd, const char *dirname)
+{
+#if HAVE_INOTIFY_INIT
+  if (!dirname)
+    return my_error (GPG_ERR_INV_VALUE);
+
+  if (inotify_add_watch (fd, dirname,
+                         (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO
+                          |IN_DELETE_SELF|IN_MOVE_SELF)) == -1)
+    return my_error_from_syserror ();
+  return 0;
+#else /*!HAVE_INOTIFY_INIT*/
+
+  (void)fd;
+  (void)dirname;
+  return my_error (GPG_ERR_NOT_SUPPORTED);
+
+#endif /*!HAVE_INOTIFY_INIT*/
+}
+
+
+/* Return true if there are events for the non-blocking inotify file
+ * handle FD.  All pending events are consumed.  On a read error true
+ * is returned as well so that the caller does not rely on stale
+ * data.  */
+int
+gnupg_inotify_pending (int fd)
+{
+#if HAVE_INOTIFY_INIT
+  char buf[sizeof (struct inotify_event) + 255 + 1];
+  int any = 0;
+  int n;
+
+  while ((n = read (fd, buf, sizeof buf)) > 0)
+    any = 1;
+  if (n == -1 && errno != EAGAIN && errno != EINTR)
+    any = 1;
+  return any;
+#else /*!HAVE_INOTIFY_INIT*/
+
+  (void)fd;
+  return 1;
+
+#endif /*!HAVE_INOTIFY_INIT*/
+}
+
+
 /* Return a malloc'ed string that is the path to the passed
  * unix-domain socket (or return NULL if this is not a valid
  * unix-domain socket).  We use a plain int here because it is only
@@ -1337,3 +1431,40 @@ gnupg_fd_valid (int fd)
   close (d);
   return 1;
 }
+
+
+/* Store the state of the file FNAME at STAMP.  A file which can't be
+ * stat-ed is marked as not existing.  */
+void
+gnupg_get_file_stamp (const char *fname, gnupg_file_stamp_t *stamp)
+{
+#ifdef HAVE_STAT
+  struct stat st;
+#endif
+
+  memset (stamp, 0, sizeof *stamp);
+#ifdef HAVE_STAT
+  if (!stat (fname, &st))
+    {
+      stamp->exists = 1;
+      stamp->mtime = st.st_mtime;
+      stamp->size = st.st_size;
+      stamp->ino = st.st_ino;
+    }
+#else
+  (void)fname;
+#endif
+}
+
+
+/* Return true if the file stamps A and B are equal, i.e. the file has
+ * not been changed in between.  */
+int
+gnupg_file_stamp_equal (const gnupg_file_stamp_t *a,
+                        const gnupg_file_stamp_t *b)
+{
+  return (a->exists == b->exists
+          && a->mtime == b->mtime
+          && a->size == b->size
+          && a->ino == b->ino);
+}
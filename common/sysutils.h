@@ -46,6 +46,17 @@ typedef int gnupg_fd_t;
 #define FD2INT(h) (h)
 #endif
 
+/* The state of a file as used to detect changes of configuration
+   files which have been read into memory.  */
+struct gnupg_file_stamp_s
+{
+  int exists;
+  time_t mtime;
+  off_t size;
+  ino_t ino;
+};
+typedef struct gnupg_file_stamp_s gnupg_file_stamp_t;
+
 
 void trap_unaligned (void);
 int  disable_core_dumps (void);
@@ -74,10 +85,16 @@ int  gnupg_unsetenv (const char *name);
 char *gnupg_getcwd (void);
 char *gnupg_get_socket_name (int fd);
 int gnupg_fd_valid (int fd);
+void gnupg_get_file_stamp (const char *fname, gnupg_file_stamp_t *stamp);
+int gnupg_file_stamp_equal (const gnupg_file_stamp_t *a,
+                            const gnupg_file_stamp_t *b);
 
 gpg_error_t gnupg_inotify_watch_delete_self (int *r_fd, const char *fname);
 gpg_error_t gnupg_inotify_watch_socket (int *r_fd, const char *socket_name);
 int gnupg_inotify_has_name (int fd, const char *name);
+gpg_error_t gnupg_inotify_watch_dir (int *r_fd, const char *dirname);
+gpg_error_t gnupg_inotify_add_dir (int fd, const char *dirname);
+int gnupg_inotify_pending (int fd);
 
 
 #ifdef HAVE_W32_SYSTEM
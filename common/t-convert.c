@@ -241,6 +241,27 @@ test_bin2hex (void)
     fail (0);
   else if (errno != ENOMEM)
     fail (1);
+
+  /* Check all byte values and the round trip with lowercase
+   * digits.  */
+  {
+    unsigned char all[256], back[256];
+    char allhex[2*256+1];
+    int i;
+
+    for (i=0; i < 256; i++)
+      all[i] = i;
+    bin2hex (all, 256, allhex);
+    for (i=0; i < 256; i++)
+      if (allhex[2*i] != "0123456789ABCDEF"[i>>4]
+          || allhex[2*i+1] != "0123456789ABCDEF"[i&15])
+        fail (2);
+    ascii_strlwr (allhex);
+    if (hex2bin (allhex, back, 256) != 2*256)
+      fail (3);
+    else if (memcmp (all, back, 256))
+      fail (3);
+  }
 }
 
 
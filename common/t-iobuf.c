@@ -390,5 +390,77 @@ main (int argc, char *argv[])
     iobuf_close (iobuf);
   }
 
+  /* Check that iobuf_read_view returns the buffered data and that
+     only the released bytes are consumed.  Also check that a filter
+     EOF is returned exactly once.  */
+  {
+    char *content = "abcdefghijklmnopq";
+    char *content2 = "0123456789";
+    struct content_filter_state *state;
+    iobuf_t iobuf;
+    const byte *p;
+    int rc;
+    int n;
+
+    iobuf = iobuf_temp_with_content (content, strlen (content));
+    rc = iobuf_push_filter (iobuf, content_filter,
+                            state=content_filter_new (content2));
+    assert (rc == 0);
+
+    n = iobuf_read_view (iobuf, &p);
+    assert (n == 10);
+    assert (!memcmp (p, content2, n));
+    iobuf_release_view (iobuf, 4);
+    n = iobuf_read_view (iobuf, &p);
+    assert (n == 6);
+    assert (!memcmp (p, content2 + 4, n));
+    assert (iobuf_get (iobuf) == '4');
+    iobuf_release_view (iobuf, 0);
+    n = iobuf_read_view (iobuf, &p);
+    assert (n == 5);
+    iobuf_release_view (iobuf, n);
+    assert (iobuf_read_view (iobuf, &p) == -1);
+
+    n = iobuf_read_view (iobuf, &p);
+    assert (n == strlen (content));
+    assert (!memcmp (p, content, n));
+    iobuf_release_view (iobuf, n);
+    assert (iobuf_read_view (iobuf, &p) == -1);
+    assert (iobuf_tell (iobuf) == strlen (content));
+
+    iobuf_close (iobuf);
+    free (state);
+  }
+
+  /* Check that iobuf_skip_rest on a plain file ends up at the right
+     position and that skipping beyond the end of the file yields
+     EOF.  */
+  {
+    const char *fname = "t-iobuf-skip.tmp";
+    FILE *fp;
+    iobuf_t iobuf;
+    long i;
+
+    fp = fopen (fname, "wb");
+    assert (fp);
+    for (i = 0; i < 200000; i++)
+      putc (i % 251, fp);
+    assert (!fclose (fp));
+
+    iobuf = iobuf_open (fname);
+    assert (iobuf);
+    assert (iobuf_get (iobuf) == 0);
+    iobuf_skip_rest (iobuf, 150000, 0);
+    assert (iobuf_tell (iobuf) == 150001);
+    assert (iobuf_get (iobuf) == 150001 % 251);
+    iobuf_skip_rest (iobuf, 10, 0);
+    assert (iobuf_get (iobuf) == 150012 % 251);
+    iobuf_skip_rest (iobuf, 100000, 0);
+    assert (iobuf_get (iobuf) == -1);
+    iobuf_close (iobuf);
+
+    remove (fname);
+  }
+
   return 0;
 }
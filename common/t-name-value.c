@@ -266,6 +266,7 @@ run_tests (void)
         err = nvc_parse (&pk, NULL, source);
       assert (err == 0);
       assert (pk);
+      assert (!nvc_modified (pk));
 
       if (verbose)
 	{
@@ -307,6 +308,7 @@ run_modification_tests (void)
   buf = nvc_to_string (pk);
   assert (strcmp (buf, "Foo: Baz\n") == 0);
   xfree (buf);
+  assert (nvc_modified (pk));
 
   nvc_set (pk, "Bar:", "Bazzel");
   buf = nvc_to_string (pk);
@@ -400,6 +402,34 @@ run_modification_tests (void)
     }
   gcry_sexp_release (key);
   nvc_release (pk);
+
+  /* Setting an unchanged value keeps the formatting.  */
+  {
+    static char text[] = "Foo: Bar\n  baz\n";
+    estream_t source;
+
+    source = es_mopen (text, strlen (text), strlen (text),
+                       0, dummy_realloc, dummy_free, "r");
+    assert (source);
+    err = nvc_parse (&pk, NULL, source);
+    assert (err == 0);
+    es_fclose (source);
+
+    err = nvc_set (pk, "Foo:", "Bar baz");
+    assert (err == 0);
+    assert (!nvc_modified (pk));
+    buf = nvc_to_string (pk);
+    assert (strcmp (buf, text) == 0);
+    xfree (buf);
+
+    err = nvc_set (pk, "Foo:", "Bar");
+    assert (err == 0);
+    assert (nvc_modified (pk));
+    buf = nvc_to_string (pk);
+    assert (strcmp (buf, "Foo: Bar\n") == 0);
+    xfree (buf);
+    nvc_release (pk);
+  }
 }
 
 
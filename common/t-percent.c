@@ -125,6 +125,7 @@ test_percent_data_escape (void)
     }, { NULL, 0, NULL }
   };
   char *buf;
+  char buffer[20];
   int i;
   size_t len;
 
@@ -138,6 +139,14 @@ test_percent_data_escape (void)
         }
       if (strcmp (buf, tbl[i].expect))
         fail (i);
+      if (percent_data_escape_len (tbl[i].data, tbl[i].datalen)
+          != strlen (tbl[i].expect))
+        fail (i);
+      if (percent_data_escape_buf (buffer, tbl[i].data, tbl[i].datalen)
+          != buffer)
+        fail (i);
+      else if (strcmp (buffer, tbl[i].expect))
+        fail (i);
       len = percent_plus_unescape_inplace (buf, 0);
       if (len != tbl[i].datalen)
         fail (i);
@@ -384,6 +384,72 @@ run_test_2 (void)
 
 
 
+static int
+test_3_propid (const char *name)
+{
+  if (!strcmp (name, "uid"))
+    return 1;
+  else if (!strcmp (name, "count"))
+    return 2;
+  else
+    return 0;
+}
+
+static int test_3_calls;
+
+static const char *
+test_3_getval (void *cookie, int propid)
+{
+  test_3_calls++;
+  switch (propid)
+    {
+    case 1: return cookie;
+    case 2: return "42";
+    default: return NULL;
+    }
+}
+
+static void
+run_test_3 (void)
+{
+  gpg_error_t err;
+  recsel_expr_t se = NULL;
+
+  ADDEXPR ("uid =~ Alfa");
+  ADDEXPR ("|| uid =~ Alpha");
+  ADDEXPR ("&& count > 40");
+  recsel_resolve (se, test_3_propid);
+
+  test_3_calls = 0;
+  if (!recsel_select_id (se, test_3_getval, "Alfa"))
+    fail (0, 0);
+  if (test_3_calls != 1)
+    fail (0, 0);
+  test_3_calls = 0;
+  if (!recsel_select_id (se, test_3_getval, "Alpha"))
+    fail (0, 0);
+  if (test_3_calls != 2)  /* The uid is asked only once.  */
+    fail (0, 0);
+  if (recsel_select_id (se, test_3_getval, "Beta"))
+    fail (0, 0);
+
+  FREEEXPR();
+  ADDEXPR ("count == 42");
+  ADDEXPR ("&& unknown -z");
+  recsel_resolve (se, test_3_propid);
+  if (!recsel_select_id (se, test_3_getval, NULL))
+    fail (0, 0);
+
+  FREEEXPR();
+  ADDEXPR ("count < 42");
+  recsel_resolve (se, test_3_propid);
+  if (recsel_select_id (se, test_3_getval, NULL))
+    fail (0, 0);
+
+  FREEEXPR();
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -432,6 +498,7 @@ main (int argc, char **argv)
   run_test_1 ();
   run_test_1b ();
   run_test_2 ();
+  run_test_3 ();
   /* Fixme: We should add test for complex conditions.  */
 
   return 0;
@@ -20,6 +20,7 @@
 #include <config.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "util.h"
 
@@ -178,6 +179,95 @@ test_make_canon_sexp_from_rsa_pk (void)
 }
 
 
+static void
+test_canon_sexp_find_token (void)
+{
+  static struct {
+    const char *sexp;
+    const char *token;
+    gpg_err_code_t ec;
+    const char *list;
+    const char *data;
+  } tests[] = {
+    { "(11:private-key(3:rsa(1:n3:abc)(1:e1:x))(7:comment3:foo))",
+      "comment", 0, "(7:comment3:foo)", "foo" },
+    { "(11:private-key(3:rsa(1:n3:abc)(1:e1:x))(7:comment3:foo))",
+      "n", 0, "(1:n3:abc)", "abc" },
+    { "(11:private-key(3:rsa(1:n3:abc)(1:e1:x))(7:comment3:foo))",
+      "rsa", 0, "(3:rsa(1:n3:abc)(1:e1:x))", NULL },
+    { "(11:private-key(3:rsa(1:n3:abc)(1:e1:x))(7:comment3:foo))",
+      "private-key", 0,
+      "(11:private-key(3:rsa(1:n3:abc)(1:e1:x))(7:comment3:foo))", NULL },
+    { "(11:private-key(3:rsa(1:n3:abc)(1:e1:x))(7:comment3:foo))",
+      "uri", GPG_ERR_NOT_FOUND },
+    { "(11:private-key(3:rsa(1:n3:abc)(1:e1:x))(7:comment3:foo))",
+      "abc", GPG_ERR_NOT_FOUND },
+    { "(1:a(1:b)(1:c()(1:d1:x)))", "d", 0, "(1:d1:x)", "x" },
+    { "(1:a(1:b(1:c1:x", "c", GPG_ERR_INV_SEXP },
+    { "(1:a(1:b(1:c1:x)", "y", GPG_ERR_INV_SEXP },
+    { "(1:a(1:b9:c))", "b", GPG_ERR_INV_SEXP }
+  };
+  int idx;
+  gpg_error_t err;
+  const unsigned char *list, *data;
+  size_t listlen, datalen;
+
+  for (idx=0; idx < DIM (tests); idx++)
+    {
+      err = canon_sexp_find_token ((const unsigned char *)tests[idx].sexp,
+                                   strlen (tests[idx].sexp),
+                                   tests[idx].token, &list, &listlen);
+      if (gpg_err_code (err) != tests[idx].ec)
+        fail (idx);
+      if (err)
+        continue;
+      if (listlen != strlen (tests[idx].list)
+          || memcmp (list, tests[idx].list, listlen))
+        fail (idx);
+
+      err = canon_sexp_get_data ((const unsigned char *)tests[idx].sexp,
+                                 strlen (tests[idx].sexp),
+                                 tests[idx].token, &data, &datalen);
+      if (!tests[idx].data)
+        {
+          if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+            fail (idx);
+        }
+      else if (err || datalen != strlen (tests[idx].data)
+               || memcmp (data, tests[idx].data, datalen))
+        fail (idx);
+    }
+}
+
+
+static void
+test_get_pk_algo_from_canon_sexp (void)
+{
+  static struct {
+    const char *sexp;
+    int algo;
+  } tests[] = {
+    { "(10:public-key(3:rsa(1:n3:abc)(1:e1:x)))", GCRY_PK_RSA },
+    { "(11:private-key(3:ecc(5:curve7:Ed25519)(5:flags5:eddsa)(1:q1:x)))",
+      GCRY_PK_EDDSA },
+    { "(11:private-key(3:ecc(5:curve10:brainpool)(1:q1:x)))", GCRY_PK_ECC },
+    { "(10:public-key(3:ecc(5:flags6:djb-tweak)(1:q1:x)))", GCRY_PK_ECC },
+    { "(10:public-key(6:foobar(1:q1:x)))", 0 },
+    { "(10:public-key3:rsa)", 0 },
+    { "(10:public-key(3:rsa", GCRY_PK_RSA },
+    { "(10:public-key", 0 },
+    { "", 0 }
+  };
+  int idx;
+
+  for (idx=0; idx < DIM (tests); idx++)
+    if (get_pk_algo_from_canon_sexp ((const unsigned char *)tests[idx].sexp,
+                                     strlen (tests[idx].sexp))
+        != tests[idx].algo)
+      fail (idx);
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -186,6 +276,8 @@ main (int argc, char **argv)
 
   test_hash_algo_from_sigval ();
   test_make_canon_sexp_from_rsa_pk ();
+  test_canon_sexp_find_token ();
+  test_get_pk_algo_from_canon_sexp ();
 
   return 0;
 }
@@ -0,0 +1,56 @@
+/* tracepoint.h - Static tracepoints for use with USDT tools
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: (LGPL-3.0+ OR GPL-2.0+)
+ */
+
+/* The GNUPG_TRACEn macros define a static tracepoint NAME of the
+ * provider "gnupg" with N arguments.  If configure found <sys/sdt.h>
+ * they expand to the SystemTap SDT probes, which compile to a single
+ * nop instruction and a note used by tools like bpftrace, perf and
+ * stap to attach to them.  The arguments are evaluated even if no
+ * tool is attached and thus must be cheap to compute.  Without
+ * <sys/sdt.h> the macros expand to nothing.  See
+ * doc/examples/bpftrace/ for how to use them.  */
+
+#ifndef GNUPG_COMMON_TRACEPOINT_H
+#define GNUPG_COMMON_TRACEPOINT_H
+
+#ifdef ENABLE_TRACEPOINTS
+# include <sys/sdt.h>
+# define GNUPG_TRACE0(name)           DTRACE_PROBE (gnupg, name)
+# define GNUPG_TRACE1(name,a)         DTRACE_PROBE1 (gnupg, name, a)
+# define GNUPG_TRACE2(name,a,b)       DTRACE_PROBE2 (gnupg, name, a, b)
+# define GNUPG_TRACE3(name,a,b,c)     DTRACE_PROBE3 (gnupg, name, a, b, c)
+#else
+# define GNUPG_TRACE0(name)           do { } while (0)
+# define GNUPG_TRACE1(name,a)         do { } while (0)
+# define GNUPG_TRACE2(name,a,b)       do { } while (0)
+# define GNUPG_TRACE3(name,a,b,c)     do { } while (0)
+#endif
+
+#endif /*GNUPG_COMMON_TRACEPOINT_H*/
@@ -98,6 +98,70 @@ iconv_close (iconv_t cd)
 #endif /*HAVE_ANDROID_SYSTEM*/
 
 
+/* The iconv descriptors for the conversion from the active charset
+ * to utf-8 and back.  They are opened on first use and closed when
+ * the charset changes.  Opening a descriptor is expensive and a key
+ * listing converts each user id; caching them is thus worth the
+ * effort.  There is no per-thread cache: All our threads are nPth
+ * threads which never switch while within iconv; we reset the shift
+ * state of a descriptor before each conversion.  */
+static iconv_t cd_to_utf8 = (iconv_t)-1;
+static iconv_t cd_from_utf8 = (iconv_t)-1;
+
+
+/* Close the cached iconv descriptors.  */
+static void
+release_iconv_cache (void)
+{
+  if (cd_to_utf8 != (iconv_t)-1)
+    iconv_close (cd_to_utf8);
+  cd_to_utf8 = (iconv_t)-1;
+  if (cd_from_utf8 != (iconv_t)-1)
+    iconv_close (cd_from_utf8);
+  cd_from_utf8 = (iconv_t)-1;
+}
+
+
+/* Return the cached iconv descriptor to convert from FROM to TO; one
+ * of them must be "utf-8" and the other the active charset.  On
+ * error (iconv_t)-1 is returned and ERRNO is set.  */
+static iconv_t
+get_iconv (const char *to, const char *from)
+{
+  iconv_t *cdp = strcmp (to, "utf-8")? &cd_from_utf8 : &cd_to_utf8;
+
+  if (*cdp == (iconv_t)-1)
+    *cdp = iconv_open (to, from);
+  else
+    iconv (*cdp, NULL, NULL, NULL, NULL);  /* Reset the shift state.  */
+  return *cdp;
+}
+
+
+/* Return true if the LENGTH bytes at S are all plain ASCII.  This is
+ * checked a word at a time because most user ids are ASCII.  */
+static int
+is_plain_ascii (const unsigned char *s, size_t length)
+{
+  const unsigned long mask = ~0UL / 0xff * 0x80;  /* 0x8080...80 */
+  unsigned long w;
+
+  for (; length && ((size_t)s % sizeof w); s++, length--)
+    if ((*s & 0x80))
+      return 0;
+  for (; length >= sizeof w; s += sizeof w, length -= sizeof w)
+    {
+      memcpy (&w, s, sizeof w);
+      if ((w & mask))
+        return 0;
+    }
+  for (; length; s++, length--)
+    if ((*s & 0x80))
+      return 0;
+  return 1;
+}
+
+
 /* Error handler for iconv failures. This is needed to not clutter the
    output with repeated diagnostics about a missing conversion. */
 static void
@@ -137,6 +201,7 @@ handle_iconv_error (const char *to, const char *from, int use_fallback)
       /* To avoid further error messages we fallback to UTF-8 for the
          native encoding.  Nowadays this seems to be the best bet in
          case of errors from iconv or nl_langinfo.  */
+      release_iconv_cache ();
       active_charset_name = "utf-8";
       no_translation = 0;
       use_iconv = 0;
@@ -253,6 +318,7 @@ set_native_charset (const char *newset)
      messages and we have to handle all the "bug" reports. Latin-1 has
      traditionally been the character set used for 8 bit characters on
      Unix systems. */
+  release_iconv_cache ();
   if ( !*newset
        || !ascii_strcasecmp (newset, "8859-1" )
        || !ascii_strcasecmp (newset, "646" )
@@ -327,6 +393,13 @@ native_to_utf8 (const char *orig_string)
       /* Already utf-8 encoded. */
       buffer = xstrdup (orig_string);
     }
+  else if (is_plain_ascii (string, strlen (orig_string))
+           && (!use_iconv || !strchr (orig_string, '\x1b')))
+    {
+      /* Plain ASCII is the same in all supported charsets.  An ESC
+         may however switch the charset of an ISO-2022 encoding.  */
+      buffer = xstrdup (orig_string);
+    }
   else if (!use_iconv)
     {
       /* For Latin-1 we can avoid the iconv overhead. */
@@ -357,7 +430,7 @@ native_to_utf8 (const char *orig_string)
       char *outptr;
       size_t inbytes, outbytes;
 
-      cd = iconv_open ("utf-8", active_charset_name);
+      cd = get_iconv ("utf-8", active_charset_name);
       if (cd == (iconv_t)-1)
         {
           handle_iconv_error ("utf-8", active_charset_name, 1);
@@ -395,7 +468,6 @@ native_to_utf8 (const char *orig_string)
              much sense given that it will get freed anyway soon
              after.  */
         }
-      iconv_close (cd);
     }
   return buffer;
 }
@@ -418,6 +490,23 @@ do_utf8_to_native (const char *string, size_t length, int delim,
   size_t slen;
   int resync = 0;
 
+  /* Fast path for plain ASCII which needs no quoting.  */
+  if (is_plain_ascii ((const unsigned char *)string, length))
+    {
+      for (s = (const unsigned char *)string, slen = length; slen; s++, slen--)
+        if (delim != -1
+            && (*s < 0x20 || *s == 0x7f || *s == delim
+                || (delim && *s == '\\')))
+          break;
+      if (!slen)
+        {
+          buffer = xmalloc (length + 1);
+          memcpy (buffer, string, length);
+          buffer[length] = 0;
+          return buffer;
+        }
+    }
+
   /* First pass (p==NULL): count the extended utf-8 characters.  */
   /* Second pass (p!=NULL): create string.  */
   for (;;)
@@ -625,7 +714,7 @@ do_utf8_to_native (const char *string, size_t length, int delim,
 
           *p = 0;  /* Terminate the buffer. */
 
-          cd = iconv_open (active_charset_name, "utf-8");
+          cd = get_iconv (active_charset_name, "utf-8");
           if (cd == (iconv_t)-1)
             {
               handle_iconv_error (active_charset_name, "utf-8", 1);
@@ -665,7 +754,6 @@ do_utf8_to_native (const char *string, size_t length, int delim,
                    anyway soon after.  */
                 xfree (buffer);
               }
-          iconv_close (cd);
           return outbuf;
         }
       else /* Not using iconv. */
@@ -154,11 +154,14 @@ gpg_error_t b64enc_start_es (struct b64state *state, estream_t fp,
 gpg_error_t b64enc_write (struct b64state *state,
                           const void *buffer, size_t nbytes);
 gpg_error_t b64enc_finish (struct b64state *state);
+void b64enc_groups (char *result, const void *buffer, size_t ngroups);
+u32 b64_crc24_update (u32 crc, const void *buffer, size_t length);
 
 gpg_error_t b64dec_start (struct b64state *state, const char *title);
 gpg_error_t b64dec_proc (struct b64state *state, void *buffer, size_t length,
                          size_t *r_nbytes);
 gpg_error_t b64dec_finish (struct b64state *state);
+size_t b64dec_groups (void *result, const void *buffer, size_t length);
 
 /*-- sexputil.c */
 char *canon_sexp_to_string (const unsigned char *canon, size_t canonlen);
@@ -189,6 +192,14 @@ gpg_error_t get_rsa_pk_from_canon_sexp (const unsigned char *keydata,
 int get_pk_algo_from_key (gcry_sexp_t key);
 int get_pk_algo_from_canon_sexp (const unsigned char *keydata,
                                  size_t keydatalen);
+gpg_error_t canon_sexp_find_token (const unsigned char *sexp, size_t sexplen,
+                                   const char *token,
+                                   unsigned char const **r_list,
+                                   size_t *r_listlen);
+gpg_error_t canon_sexp_get_data (const unsigned char *sexp, size_t sexplen,
+                                 const char *token,
+                                 unsigned char const **r_data,
+                                 size_t *r_datalen);
 
 /*-- convert.c --*/
 int hex2bin (const char *string, void *buffer, size_t length);
@@ -202,6 +213,9 @@ char *hex2str_alloc (const char *hexstring, size_t *r_count);
 /*-- percent.c --*/
 char *percent_plus_escape (const char *string);
 char *percent_data_escape (const void *data, size_t datalen);
+size_t percent_data_escape_len (const void *data, size_t datalen);
+char *percent_data_escape_buf (char *buffer,
+                               const void *data, size_t datalen);
 char *percent_plus_unescape (const char *string, int nulrepl);
 char *percent_unescape (const char *string, int nulrepl);
 
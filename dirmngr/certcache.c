@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <unistd.h>
 #include <npth.h>
 
 #include "dirmngr.h"
@@ -32,9 +33,20 @@
 #include "../common/ksba-io-support.h"
 #include "crlfetch.h"
 #include "certcache.h"
+#include "validate.h"
 
 #define MAX_NONPERM_CACHED_CERTS 1000
 
+/* CA certificates put into the cache at runtime are also stored as
+   "<FPR>.der" in this directory below the cache directory so that
+   they need not be fetched again after a restart.  At most
+   MAX_STORED_CERTS are stored.  */
+#define CERTSTORE_D "certs.d"
+#define MAX_STORED_CERTS 500
+
+/* The number of slots of each of the secondary indices.  */
+#define CERT_INDEX_SIZE 256
+
 /* Constants used to classify search patterns.  */
 enum pattern_class
   {
@@ -56,16 +68,23 @@ enum pattern_class
 /* A certificate cache item.  This consists of a the KSBA cert object
    and some meta data for easier lookup.  We use a hash table to keep
    track of all items and use the (randomly distributed) first byte of
-   the fingerprint directly as the hash which makes it pretty easy. */
+   the fingerprint directly as the hash which makes it pretty easy.
+   Valid items are also linked into secondary hash tables for the
+   subject DN, the issuer DN, and the issuer DN plus serial number. */
 struct cert_item_s
 {
   struct cert_item_s *next; /* Next item with the same hash value. */
+  struct cert_item_s *next_subject; /* Next in SUBJECT_INDEX.  */
+  struct cert_item_s *next_issuer;  /* Next in ISSUER_INDEX.  */
+  struct cert_item_s *next_sn;      /* Next in SN_INDEX.  */
   ksba_cert_t cert;         /* The KSBA cert object or NULL is this is
                                not a valid item.  */
   unsigned char fpr[20];    /* The fingerprint of this object. */
   char *issuer_dn;          /* The malloced issuer DN.  */
   ksba_sexp_t sn;           /* The malloced serial number  */
   char *subject_dn;         /* The malloced subject DN - maybe NULL.  */
+  ksba_sexp_t subj_keyid;   /* The malloced subject key identifier
+                               - maybe NULL.  */
 
   /* If this field is set the certificate has been taken from some
    * configuration and shall not be flushed from the cache.  */
@@ -81,6 +100,15 @@ typedef struct cert_item_s *cert_item_t;
    the first byte of the fingerprint.  */
 static cert_item_t cert_cache[256];
 
+/* The secondary indices.  They are hash tables of the valid items
+   using the hash of the subject DN, the issuer DN, or the issuer DN
+   and the serial number.  This avoids scanning the entire cache when
+   building a chain; with the system's trust store loaded there are
+   a few hundred certificates in the cache.  */
+static cert_item_t subject_index[CERT_INDEX_SIZE];
+static cert_item_t issuer_index[CERT_INDEX_SIZE];
+static cert_item_t sn_index[CERT_INDEX_SIZE];
+
 /* This is the global cache_lock variable. In general locking is not
    needed but it would take extra efforts to make sure that no
    indirect use of npth functions is done, so we simply lock it
@@ -98,6 +126,11 @@ static unsigned int total_nonperm_certificates;
  * certificate of that class is loaded permanetly.  */
 static unsigned int any_cert_of_class;
 
+/* Flag to track whether the stored certificates have been loaded and
+ * the number of certificates in the store.  */
+static int stored_certs_loaded;
+static unsigned int stored_certs_count;
+
 
 #ifdef HAVE_W32_SYSTEM
 /* We load some functions dynamically.  Provide typedefs for tehse
@@ -171,6 +204,94 @@ compare_serialno (ksba_sexp_t serial1, ksba_sexp_t serial2 )
 
 
 
+/* Return the hash of BUFFER of LENGTH added to HASH.  This is the
+   FNV-1a function.  */
+static unsigned int
+hash_buffer (unsigned int hash, const void *buffer, size_t length)
+{
+  const unsigned char *s = buffer;
+
+  for (; length; length--, s++)
+    {
+      hash ^= *s;
+      hash *= 16777619;
+    }
+  return hash;
+}
+
+/* Return the index slot for the DN.  */
+static unsigned int
+dn_slot (const char *dn)
+{
+  return hash_buffer (2166136261, dn, strlen (dn)) % CERT_INDEX_SIZE;
+}
+
+/* Return the index slot for the ISSUER_DN and the serial number SN.  */
+static unsigned int
+sn_slot (const char *issuer_dn, ksba_const_sexp_t sn)
+{
+  unsigned int hash;
+
+  hash = hash_buffer (2166136261, issuer_dn, strlen (issuer_dn));
+  hash = hash_buffer (hash, sn, gcry_sexp_canon_len (sn, 0, NULL, NULL));
+  return hash % CERT_INDEX_SIZE;
+}
+
+
+/* Link the valid item CI into the secondary indices.  */
+static void
+link_item (cert_item_t ci)
+{
+  unsigned int n;
+
+  if (ci->subject_dn)
+    {
+      n = dn_slot (ci->subject_dn);
+      ci->next_subject = subject_index[n];
+      subject_index[n] = ci;
+    }
+  n = dn_slot (ci->issuer_dn);
+  ci->next_issuer = issuer_index[n];
+  issuer_index[n] = ci;
+  n = sn_slot (ci->issuer_dn, ci->sn);
+  ci->next_sn = sn_index[n];
+  sn_index[n] = ci;
+}
+
+
+/* Remove the valid item CI from the secondary indices.  */
+static void
+unlink_item (cert_item_t ci)
+{
+  cert_item_t *p;
+
+  if (ci->subject_dn)
+    {
+      for (p = &subject_index[dn_slot (ci->subject_dn)]; *p;
+           p = &(*p)->next_subject)
+        if (*p == ci)
+          {
+            *p = ci->next_subject;
+            break;
+          }
+    }
+  for (p = &issuer_index[dn_slot (ci->issuer_dn)]; *p; p = &(*p)->next_issuer)
+    if (*p == ci)
+      {
+        *p = ci->next_issuer;
+        break;
+      }
+  for (p = &sn_index[sn_slot (ci->issuer_dn, ci->sn)]; *p; p = &(*p)->next_sn)
+    if (*p == ci)
+      {
+        *p = ci->next_sn;
+        break;
+      }
+  ci->next_subject = ci->next_issuer = ci->next_sn = NULL;
+}
+
+
+
 /* Return a malloced canonical S-Expression with the serial number
  * converted from the hex string HEXSN.  Return NULL on memory
  * error.  */
@@ -234,6 +355,10 @@ clean_cache_slot (cert_item_t ci)
   if (!ci->cert)
     return; /* Already cleaned.  */
 
+  if (ci->issuer_dn && ci->sn)
+    unlink_item (ci);
+  ksba_free (ci->subj_keyid);
+  ci->subj_keyid = NULL;
   ksba_free (ci->sn);
   ci->sn = NULL;
   ksba_free (ci->issuer_dn);
@@ -344,8 +469,11 @@ put_cert (ksba_cert_t cert, int permanent, unsigned int trustclass,
       return gpg_error (GPG_ERR_INV_CERT_OBJ);
     }
   ci->subject_dn = ksba_cert_get_subject (cert, 0);
+  if (ksba_cert_get_subj_key_id (cert, NULL, &ci->subj_keyid))
+    ci->subj_keyid = NULL;
   ci->permanent = !!permanent;
   ci->trustclasses = trustclass;
+  link_item (ci);
 
   if (permanent)
     any_cert_of_class |= trustclass;
@@ -452,6 +580,167 @@ load_certs_from_dir (const char *dirname, unsigned int trustclass)
 }
 
 
+/* Load the certificates stored by store_cert into the cache if this
+ * has not yet been done.  Expired certificates and files which can't
+ * be parsed are removed from the store.  The cache must not be
+ * locked when calling this function.  */
+static void
+load_stored_certs (void)
+{
+  gpg_error_t err;
+  DIR *dir;
+  struct dirent *ep;
+  char *p;
+  estream_t fp;
+  ksba_reader_t reader;
+  ksba_cert_t cert;
+  char *dname;
+  char *fname = NULL;
+  ksba_isotime_t not_after;
+  gnupg_isotime_t current_time;
+  int okay;
+
+  if (stored_certs_loaded)
+    return;
+  stored_certs_loaded = 1;
+
+  dname = make_filename (opt.homedir_cache, CERTSTORE_D, NULL);
+  dir = opendir (dname);
+  if (!dir)
+    {
+      xfree (dname);
+      return; /* Nothing stored yet.  */
+    }
+
+  gnupg_get_isotime (current_time);
+  acquire_cache_write_lock ();
+  while ( (ep=readdir (dir)) )
+    {
+      p = ep->d_name;
+      if (strlen (p) != 44 || strcmp (p+40, ".der"))
+        continue;
+
+      xfree (fname);
+      fname = make_filename (dname, p, NULL);
+      fp = es_fopen (fname, "rb");
+      if (!fp)
+        {
+          log_error (_("can't open '%s': %s\n"), fname, strerror (errno));
+          continue;
+        }
+      cert = NULL;
+      err = create_estream_ksba_reader (&reader, fp);
+      if (!err)
+        {
+          err = ksba_cert_new (&cert);
+          if (!err)
+            err = ksba_cert_read_der (cert, reader);
+          ksba_reader_release (reader);
+        }
+      es_fclose (fp);
+
+      okay = 0;
+      if (err)
+        log_info (_("can't parse certificate '%s': %s\n"),
+                  fname, gpg_strerror (err));
+      else if (!ksba_cert_get_validity (cert, 1, not_after)
+               && *not_after && strcmp (not_after, current_time) < 0)
+        {
+          if (opt.verbose)
+            log_info ("removing expired certificate '%s'\n", fname);
+        }
+      else
+        {
+          err = put_cert (cert, 0, 0, NULL);
+          if (!err || gpg_err_code (err) == GPG_ERR_DUP_VALUE)
+            okay = 1;
+          else
+            log_error (_("error loading certificate '%s': %s\n"),
+                       fname, gpg_strerror (err));
+        }
+      ksba_cert_release (cert);
+
+      if (okay)
+        stored_certs_count++;
+      else if (gnupg_remove (fname))
+        log_error ("failed to remove '%s': %s\n", fname, strerror (errno));
+    }
+  release_cache_lock ();
+
+  if (opt.verbose)
+    log_info ("%u stored certificates loaded\n", stored_certs_count);
+  xfree (fname);
+  xfree (dname);
+  closedir (dir);
+}
+
+
+/* Store the CA certificate CERT so that it is available after a
+ * restart.  Other certificates are not stored.  The cache must not
+ * be locked when calling this function.  */
+static void
+store_cert (ksba_cert_t cert)
+{
+  int is_ca;
+  unsigned char fpr[20];
+  char fprname[40 + 4 + 1];
+  const unsigned char *der;
+  size_t derlen;
+  char *dname, *fname;
+  estream_t fp;
+  int rc;
+
+  if (ksba_cert_is_ca (cert, &is_ca, NULL) || !is_ca)
+    return;
+  der = ksba_cert_get_image (cert, &derlen);
+  if (!der)
+    return;
+
+  load_stored_certs ();  /* Required for the count.  */
+  if (stored_certs_count >= MAX_STORED_CERTS)
+    {
+      if (opt.verbose)
+        log_info ("certificate store is full - not storing certificate\n");
+      return;
+    }
+
+  cert_compute_fpr (cert, fpr);
+  bin2hex (fpr, 20, fprname);
+  strcpy (fprname + 40, ".der");
+  dname = make_filename (opt.homedir_cache, CERTSTORE_D, NULL);
+  fname = make_filename (dname, fprname, NULL);
+  if (!access (fname, F_OK))
+    goto leave;  /* Already stored.  */
+  if (access (dname, F_OK) && gnupg_mkdir (dname, "-rwx"))
+    {
+      log_error (_("error creating directory '%s': %s\n"),
+                 dname, strerror (errno));
+      goto leave;
+    }
+
+  fp = es_fopen (fname, "wb");
+  if (!fp)
+    {
+      log_error (_("error creating '%s': %s\n"), fname, strerror (errno));
+      goto leave;
+    }
+  rc = (es_fwrite (der, derlen, 1, fp) != 1);
+  if (es_fclose (fp))
+    rc = 1;
+  if (rc)
+    {
+      log_error (_("error writing '%s': %s\n"), fname, strerror (errno));
+      gnupg_remove (fname);
+      goto leave;
+    }
+  stored_certs_count++;
+
+ leave:
+  xfree (fname);
+  xfree (dname);
+}
+
+
 /* Load certificates from FILE.  The certificates are expected to be
  * PEM encoded so that it is possible to load several certificates.
  * TRUSTCLASSES is used to mark the certificates as trusted.  The
@@ -767,9 +1056,12 @@ cert_cache_deinit (int full)
     }
 
   http_register_cfg_ca (NULL);
+  validation_cache_flush ();
 
   total_nonperm_certificates = 0;
   any_cert_of_class = 0;
+  stored_certs_loaded = 0;
+  stored_certs_count = 0;
   initialization_done = 0;
   release_cache_lock ();
 }
@@ -826,6 +1118,36 @@ cert_cache_print_stats (void)
 }
 
 
+/* Emit the statistics of the cache for the stats registry.  */
+void
+cert_cache_stats_report (stats_sink_t sink)
+{
+  cert_item_t ci;
+  int idx;
+  unsigned int n_nonperm = 0;
+  unsigned int n_permanent = 0;
+  unsigned int n_trusted = 0;
+
+  acquire_cache_read_lock ();
+  for (idx = 0; idx < 256; idx++)
+    for (ci=cert_cache[idx]; ci; ci = ci->next)
+      if (ci->cert)
+        {
+          if (ci->permanent)
+            n_permanent++;
+          else
+            n_nonperm++;
+          if (ci->trustclasses)
+            n_trusted++;
+        }
+  release_cache_lock ();
+
+  stats_put (sink, "permanent", n_permanent);
+  stats_put (sink, "runtime", n_nonperm);
+  stats_put (sink, "trusted", n_trusted);
+}
+
+
 /* Return true if any cert of a class in MASK is permanently
  * loaded.  */
 int
@@ -847,7 +1169,10 @@ cache_cert (ksba_cert_t cert)
   if (gpg_err_code (err) == GPG_ERR_DUP_VALUE)
     log_info (_("certificate already cached\n"));
   else if (!err)
-    log_info (_("certificate cached\n"));
+    {
+      log_info (_("certificate cached\n"));
+      store_cert (cert);
+    }
   else
     log_error (_("error caching certificate: %s\n"), gpg_strerror (err));
   return err;
@@ -945,22 +1270,17 @@ get_cert_byhexfpr (const char *string)
 ksba_cert_t
 get_cert_bysn (const char *issuer_dn, ksba_sexp_t serialno)
 {
-  /* Simple and inefficient implementation.   fixme! */
   cert_item_t ci;
-  int i;
 
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && !strcmp (ci->issuer_dn, issuer_dn)
-            && !compare_serialno (ci->sn, serialno))
-          {
-            ksba_cert_ref (ci->cert);
-            release_cache_lock ();
-            return ci->cert;
-          }
-    }
+  for (ci=sn_index[sn_slot (issuer_dn, serialno)]; ci; ci = ci->next_sn)
+    if (!strcmp (ci->issuer_dn, issuer_dn)
+        && !compare_serialno (ci->sn, serialno))
+      {
+        ksba_cert_ref (ci->cert);
+        release_cache_lock ();
+        return ci->cert;
+      }
 
   release_cache_lock ();
   return NULL;
@@ -972,22 +1292,17 @@ get_cert_bysn (const char *issuer_dn, ksba_sexp_t serialno)
 ksba_cert_t
 get_cert_byissuer (const char *issuer_dn, unsigned int seq)
 {
-  /* Simple and very inefficient implementation and API.  fixme! */
   cert_item_t ci;
-  int i;
 
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && !strcmp (ci->issuer_dn, issuer_dn))
-          if (!seq--)
-            {
-              ksba_cert_ref (ci->cert);
-              release_cache_lock ();
-              return ci->cert;
-            }
-    }
+  for (ci=issuer_index[dn_slot (issuer_dn)]; ci; ci = ci->next_issuer)
+    if (!strcmp (ci->issuer_dn, issuer_dn))
+      if (!seq--)
+        {
+          ksba_cert_ref (ci->cert);
+          release_cache_lock ();
+          return ci->cert;
+        }
 
   release_cache_lock ();
   return NULL;
@@ -999,26 +1314,48 @@ get_cert_byissuer (const char *issuer_dn, unsigned int seq)
 ksba_cert_t
 get_cert_bysubject (const char *subject_dn, unsigned int seq)
 {
-  /* Simple and very inefficient implementation and API.  fixme! */
   cert_item_t ci;
-  int i;
 
   if (!subject_dn)
     return NULL;
 
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && ci->subject_dn
-            && !strcmp (ci->subject_dn, subject_dn))
-          if (!seq--)
-            {
-              ksba_cert_ref (ci->cert);
-              release_cache_lock ();
-              return ci->cert;
-            }
-    }
+  for (ci=subject_index[dn_slot (subject_dn)]; ci; ci = ci->next_subject)
+    if (!strcmp (ci->subject_dn, subject_dn))
+      if (!seq--)
+        {
+          ksba_cert_ref (ci->cert);
+          release_cache_lock ();
+          return ci->cert;
+        }
+
+  release_cache_lock ();
+  return NULL;
+}
+
+
+/* Return the first certificate matching SUBJECT_DN which has the
+   subject key identifier KEYID.  If KEYID is NULL this is the same
+   as get_cert_bysubject with SEQ 0.  */
+static ksba_cert_t
+get_cert_bysubject_keyid (const char *subject_dn, ksba_const_sexp_t keyid)
+{
+  cert_item_t ci;
+
+  if (!subject_dn)
+    return NULL;
+
+  acquire_cache_read_lock ();
+  for (ci=subject_index[dn_slot (subject_dn)]; ci; ci = ci->next_subject)
+    if (!strcmp (ci->subject_dn, subject_dn)
+        && (!keyid
+            || (ci->subj_keyid
+                && !cmp_simple_canon_sexp (keyid, ci->subj_keyid))))
+      {
+        ksba_cert_ref (ci->cert);
+        release_cache_lock ();
+        return ci->cert;
+      }
 
   release_cache_lock ();
   return NULL;
@@ -1337,6 +1674,15 @@ find_cert_bysn (ctrl_t ctrl, const char *issuer_dn, ksba_sexp_t serialno)
   if (cert)
     return cert;
 
+  /* Then try the certificates stored by an earlier run.  */
+  if (!stored_certs_loaded)
+    {
+      load_stored_certs ();
+      cert = get_cert_bysn (issuer_dn, serialno);
+      if (cert)
+        return cert;
+    }
+
   /* Ask back to the service requester to return the certificate.
    * This is because we can assume that he already used the
    * certificate while checking for the CRL.  */
@@ -1443,7 +1789,6 @@ ksba_cert_t
 find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
 {
   gpg_error_t err;
-  int seq;
   ksba_cert_t cert = NULL;
   cert_fetch_context_t context = NULL;
   ksba_sexp_t subj;
@@ -1458,43 +1803,37 @@ find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
     {
       cert_item_t ci;
       cert_ref_t cr;
-      int i;
 
       /* For efficiency reasons we won't use get_cert_bysubject here. */
       acquire_cache_read_lock ();
-      for (i=0; i < 256; i++)
-        for (ci=cert_cache[i]; ci; ci = ci->next)
-          if (ci->cert && ci->subject_dn
-              && !strcmp (ci->subject_dn, subject_dn))
-            for (cr=ctrl->ocsp_certs; cr; cr = cr->next)
-              if (!memcmp (ci->fpr, cr->fpr, 20))
-                {
-                  ksba_cert_ref (ci->cert);
-                  release_cache_lock ();
-                  return ci->cert; /* We use this certificate. */
-                }
+      for (ci=subject_index[dn_slot (subject_dn)]; ci; ci = ci->next_subject)
+        if (!strcmp (ci->subject_dn, subject_dn))
+          for (cr=ctrl->ocsp_certs; cr; cr = cr->next)
+            if (!memcmp (ci->fpr, cr->fpr, 20))
+              {
+                ksba_cert_ref (ci->cert);
+                release_cache_lock ();
+                return ci->cert; /* We use this certificate. */
+              }
       release_cache_lock ();
       if (DBG_LOOKUP)
         log_debug ("find_cert_bysubject: certificate not in ocsp_certs\n");
     }
 
   /* No check whether the certificate is cached.  */
-  for (seq=0; (cert = get_cert_bysubject (subject_dn, seq)); seq++)
-    {
-      if (!keyid)
-        break; /* No keyid requested, so return the first one found. */
-      if (!ksba_cert_get_subj_key_id (cert, NULL, &subj)
-          && !cmp_simple_canon_sexp (keyid, subj))
-        {
-          xfree (subj);
-          break; /* Found matching cert. */
-        }
-      xfree (subj);
-      ksba_cert_release (cert);
-    }
+  cert = get_cert_bysubject_keyid (subject_dn, keyid);
   if (cert)
     return cert; /* Done.  */
 
+  /* Then try the certificates stored by an earlier run.  */
+  if (!stored_certs_loaded)
+    {
+      load_stored_certs ();
+      cert = get_cert_bysubject_keyid (subject_dn, keyid);
+      if (cert)
+        return cert; /* Done.  */
+    }
+
   if (DBG_LOOKUP)
     log_debug ("find_cert_bysubject: certificate not in cache\n");
 
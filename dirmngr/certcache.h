@@ -39,6 +39,9 @@ void cert_cache_deinit (int full);
 /* Print some statistics to the log file.  */
 void cert_cache_print_stats (void);
 
+/* Emit the statistics for the stats registry.  */
+void cert_cache_stats_report (stats_sink_t sink);
+
 /* Return true if any cert of a class in MASK is permanently loaded.  */
 int cert_cache_any_in_class (unsigned int mask);
 
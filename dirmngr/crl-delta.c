@@ -0,0 +1,96 @@
+/* crl-delta.c - Helper for delta CRLs
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* These functions decide whether a delta CRL can be merged with a
+ * cached complete CRL.  They do not depend on the cache and are kept
+ * separate so that they can be tested on their own.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/util.h"
+#include "../common/tlv.h"
+#include "crl-delta.h"
+
+
+/* Return the BaseCRLNumber of the deltaCRLIndicator extension given
+   by DER and DERLEN as an allocated hex string or NULL if it is not
+   valid.  */
+char *
+crl_delta_base_number (const unsigned char *der, size_t derlen)
+{
+  int class, tag, constructed, ndef;
+  size_t objlen, hdrlen;
+  char *string;
+
+  if (parse_ber_header (&der, &derlen, &class, &tag, &constructed,
+                        &ndef, &objlen, &hdrlen)
+      || class != CLASS_UNIVERSAL || tag != TAG_INTEGER || constructed
+      || !objlen || objlen > derlen)
+    return NULL;
+  string = xtrymalloc (2*objlen + 1);
+  if (string)
+    bin2hex (der, objlen, string);
+  return string;
+}
+
+
+/* Compare the two hex encoded CRL numbers A and B numerically and
+   return -1, 0, or 1 as strcmp does.  */
+int
+crl_compare_numbers (const char *a, const char *b)
+{
+  size_t alen, blen;
+  int rc;
+
+  while (*a == '0')
+    a++;
+  while (*b == '0')
+    b++;
+  alen = strlen (a);
+  blen = strlen (b);
+  if (alen != blen)
+    return alen < blen? -1 : 1;
+  rc = ascii_strcasecmp (a, b);
+  return rc < 0? -1 : rc > 0? 1 : 0;
+}
+
+
+/* Return true if the delta CRL with the number DELTA_NUMBER and the
+   BaseCRLNumber BASE_NUMBER may be applied to the complete CRL with
+   the number CRL_NUMBER.  This requires that CRL_NUMBER is in the
+   range [BASE_NUMBER, DELTA_NUMBER).  APPLIED_NUMBER is NULL or the
+   number of the delta CRL which has already been applied; an older
+   delta CRL is not used.  */
+int
+crl_delta_applicable (const char *crl_number, const char *base_number,
+                      const char *delta_number, const char *applied_number)
+{
+  if (!crl_number || !base_number || !delta_number)
+    return 0;
+  if (crl_compare_numbers (crl_number, base_number) < 0
+      || crl_compare_numbers (crl_number, delta_number) >= 0)
+    return 0;
+  if (applied_number && crl_compare_numbers (applied_number, delta_number) > 0)
+    return 0;
+  return 1;
+}
@@ -0,0 +1,35 @@
+/* crl-delta.h - Helper for delta CRLs
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#ifndef DIRMNGR_CRL_DELTA_H
+#define DIRMNGR_CRL_DELTA_H
+
+/* Return the BaseCRLNumber of a deltaCRLIndicator as hex string.  */
+char *crl_delta_base_number (const unsigned char *der, size_t derlen);
+
+/* Compare two hex encoded CRL numbers.  */
+int crl_compare_numbers (const char *a, const char *b);
+
+/* Return true if a delta CRL may be applied to a CRL.  */
+int crl_delta_applicable (const char *crl_number, const char *base_number,
+                          const char *delta_number,
+                          const char *applied_number);
+
+#endif /*DIRMNGR_CRL_DELTA_H*/
@@ -68,6 +68,15 @@
         Field 9:  AuthorityKeyID.issuer, each Name separated by 0x01
         Field 10: AuthorityKeyID.serial
         Field 11: Hex fingerprint of trust anchor if field 1 is 'u'.
+        Field 12: optional CRL number of the applied delta CRL.
+        Field 13: 15 character ISO timestamp with THIS_UPDATE of the
+                  delta CRL.
+        Field 14: 15 character ISO timestamp with NEXT_UPDATE of the
+                  delta CRL.
+        Field 15: Hexadecimal encoded MD-5 hash of the delta DB file.
+
+        Fields 12 to 15 are only present if a delta CRL has been
+        applied to the CRL.
 
    2. Layout of the standard CRL Cache DB file:
 
@@ -84,6 +93,31 @@
       SHA-1 hash value of the issuer DN prefixed with a "crl-" and
       suffixed with a ".db".  Thus the length of the filename is 47.
 
+   3. Layout of the delta CRL Cache DB file:
+
+      The records are the same as in the standard DB file.  Entries
+      with removeFromCRL as reason (i.e. certificates which have been
+      put on hold and are valid again) use the reason byte 0xff.  A
+      delta DB file is only valid together with the standard DB file
+      of the same issuer whose CRL number is given by the DIR.txt
+      record; it is replaced by each new delta CRL and removed with
+      each new complete CRL.
+
+      The filename is constructed like the one of the standard DB
+      file but suffixed with a ".delta.db".
+
+   4. Layout of the DIR journal file:
+
+      A changed or new cache entry is not written by rewriting the
+      entire DIR.txt but by appending its CRL cache record to the
+      file "DIR.journal".  The records are the same as in DIR.txt; a
+      record replaces an earlier one with the same issuer hash.
+      After DBDIR_JOURNAL_MAX records the DIR.txt is rewritten with
+      all entries and the journal file is removed.
+
+      Note that the MD-5 hashes of the DB files are checked only when
+      a DB file is opened for the first time and not at startup.
+
 
 */
 
@@ -98,6 +132,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <npth.h>
 #ifndef HAVE_W32_SYSTEM
 #include <sys/utsname.h>
 #endif
@@ -111,25 +146,45 @@
 #include "certcache.h"
 #include "crlcache.h"
 #include "crlfetch.h"
+#include "crl-delta.h"
 #include "misc.h"
 #include "cdb.h"
+#include "ks-engine.h"  /* For ks_http_forget_validators.  */
+#include "../common/tlv.h"
 
 /* Change this whenever the format changes */
 #define DBDIR_D "crls.d"
 #define DBDIRFILE "DIR.txt"
+#define DBDIRJOURNAL "DIR.journal"
 #define DBDIRVERSION 1
 
-/* The number of DB files we may have open at one time.  We need to
-   limit this because there is no guarantee that the number of issuers
-   has a upper limit.  We are currently using mmap, so it is a good
-   idea anyway to limit the number of opened cache files. */
-#define MAX_OPEN_DB_FILES 5
+/* The number of records in the journal file after which DIR.txt is
+   rewritten.  */
+#define DBDIR_JOURNAL_MAX 100
 
 #ifndef O_BINARY
 # define O_BINARY 0
 #endif
 
+/* CRLs which have been used during the last CRL_REFRESH_USED_PERIOD
+   seconds are fetched again by the housekeeping if they expire within
+   the next CRL_REFRESH_AHEAD seconds plus a jitter of up to
+   CRL_REFRESH_JITTER seconds.  A failed refresh is retried after
+   CRL_REFRESH_RETRY seconds and at most MAX_CRL_REFRESH_PER_RUN CRLs
+   are fetched by one housekeeping run.  */
+#define CRL_REFRESH_USED_PERIOD (24*60*60)
+#define CRL_REFRESH_AHEAD       (30*60)
+#define CRL_REFRESH_JITTER      (30*60)
+#define CRL_REFRESH_RETRY       (60*60)
+#define MAX_CRL_REFRESH_PER_RUN 4
+
+/* The reason byte used in a delta DB file for entries which have
+   been removed from the CRL.  */
+#define CRL_REASON_REMOVED 0xff
+
 static const char oidstr_crlNumber[] = "2.5.29.20";
+static const char oidstr_deltaCRLIndicator[] = "2.5.29.27";
+static const char oidstr_freshestCRL[] = "2.5.29.46";
 /* static const char oidstr_issuingDistributionPoint[] = "2.5.29.28"; */
 static const char oidstr_authorityKeyIdentifier[] = "2.5.29.35";
 
@@ -159,9 +214,30 @@ struct crl_cache_entry_s
   struct cdb *cdb;             /* The cache file handle or NULL if not open. */
 
   unsigned int cdb_use_count;  /* Current use count. */
-  unsigned int cdb_lru_count;  /* Used for LRU purposes. */
+  crl_cache_entry_t lru_prev;  /* Links of the list of entries with an */
+  crl_cache_entry_t lru_next;  /* open cache file.  */
   int dbfile_checked;          /* Set to true if the dbfile_hash value has
                                   been checked one. */
+
+  /* Information about an applied delta CRL.  DELTA_DBFILE_HASH is
+     NULL if there is none.  */
+  char *delta_crl_number;      /* Malloced.  */
+  char *delta_dbfile_hash;     /* Malloced MD5 sum of the delta file.  */
+  ksba_isotime_t delta_this_update;
+  ksba_isotime_t delta_next_update;
+  int delta_dbfile_checked;    /* Set to true if the delta_dbfile_hash
+                                  value has been checked once.  */
+
+  time_t last_used;            /* Time of the last lookup or 0.  */
+  time_t refresh_tried;        /* Time of the last background refresh.  */
+
+  /* An entry is never changed while it is used; a new CRL for the
+     issuer replaces the entire entry and marks the old one as
+     deleted.  The old entry is released after the last user has
+     dropped its reference.  The lock is taken for reading by the
+     lookups and for writing to apply a delta CRL.  */
+  npth_rwlock_t lock;
+  unsigned int ref_count;      /* Number of users of this entry.  */
 };
 
 
@@ -169,6 +245,7 @@ struct crl_cache_entry_s
 struct crl_cache_s
 {
   crl_cache_entry_t entries;
+  unsigned int journal_count;  /* Number of records in the journal.  */
 };
 
 typedef struct crl_cache_s *crl_cache_t;
@@ -177,6 +254,8 @@ typedef struct crl_cache_s *crl_cache_t;
 /* Prototypes.  */
 static crl_cache_entry_t find_entry (crl_cache_entry_t first,
                                      const char *issuer_hash);
+static void close_db_file (crl_cache_entry_t entry);
+static gpg_error_t compact_dir (crl_cache_t cache);
 
 
 
@@ -184,6 +263,14 @@ static crl_cache_entry_t find_entry (crl_cache_entry_t first,
    right at startup.  */
 static crl_cache_t current_cache;
 
+/* The list of entries with an open cache file, most recently used
+   first, and the number of entries in that list.  The number of open
+   files is limited to opt.max_open_crl_files because there is no
+   guarantee that the number of issuers has an upper limit; with mmap
+   used by cdb_init each open file also claims address space.  */
+static crl_cache_entry_t lru_head, lru_tail;
+static unsigned int lru_count;
+
 
 
 
@@ -361,27 +448,182 @@ next_line_from_file (estream_t fp, gpg_error_t *r_err)
 }
 
 
+/* Unlink ENTRY from the LRU list.  */
+static void
+lru_unlink (crl_cache_entry_t entry)
+{
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    lru_head = entry->lru_next;
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+  lru_count--;
+}
+
+
+/* Put ENTRY at the head of the LRU list.  */
+static void
+lru_link (crl_cache_entry_t entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = lru_head;
+  if (lru_head)
+    lru_head->lru_prev = entry;
+  else
+    lru_tail = entry;
+  lru_head = entry;
+  lru_count++;
+}
+
+
+/* Close the cache file of ENTRY if it is open.  */
+static void
+close_db_file (crl_cache_entry_t entry)
+{
+  int fd;
+
+  if (!entry->cdb)
+    return;
+
+  lru_unlink (entry);
+  fd = cdb_fileno (entry->cdb);
+  cdb_free (entry->cdb);
+  xfree (entry->cdb);
+  entry->cdb = NULL;
+  if (close (fd))
+    log_error (_("error closing cache file: %s\n"), strerror(errno));
+}
+
+
+/* Allocate a new and empty cache entry.  Returns NULL and sets
+   ERRNO on error.  */
+static crl_cache_entry_t
+new_cache_entry (void)
+{
+  crl_cache_entry_t entry;
+  int rc;
+
+  entry = xtrycalloc (1, sizeof *entry);
+  if (!entry)
+    return NULL;
+  rc = npth_rwlock_init (&entry->lock, NULL);
+  if (rc)
+    {
+      log_error ("can't initialize the CRL entry lock: %s\n",
+                 strerror (rc));
+      xfree (entry);
+      gpg_err_set_errno (rc);
+      return NULL;
+    }
+  return entry;
+}
+
+
 /* Release one cache entry.  */
 static void
 release_one_cache_entry (crl_cache_entry_t entry)
 {
   if (entry)
     {
-      if (entry->cdb)
-        {
-          int fd = cdb_fileno (entry->cdb);
-          cdb_free (entry->cdb);
-          xfree (entry->cdb);
-          if (close (fd))
-            log_error (_("error closing cache file: %s\n"), strerror(errno));
-        }
+      close_db_file (entry);
+      npth_rwlock_destroy (&entry->lock);
       xfree (entry->release_ptr);
       xfree (entry->check_trust_anchor);
+      xfree (entry->delta_crl_number);
+      xfree (entry->delta_dbfile_hash);
       xfree (entry);
     }
 }
 
 
+/* Remove all entries of CACHE which are marked as deleted and not
+   used anymore.  */
+static void
+purge_deleted_entries (crl_cache_t cache)
+{
+  crl_cache_entry_t e, *eprev;
+
+  for (eprev = &cache->entries; (e = *eprev); )
+    {
+      if (e->deleted && !e->ref_count)
+        {
+          *eprev = e->next;
+          release_one_cache_entry (e);
+        }
+      else
+        eprev = &e->next;
+    }
+}
+
+
+/* Take a reference on ENTRY and lock it for reading or, if FOR_WRITE
+   is set, for writing.  Returns 0 on success.  Other threads may run
+   while waiting for the lock.  */
+static gpg_error_t
+acquire_entry (crl_cache_entry_t entry, int for_write)
+{
+  int rc;
+
+  entry->ref_count++;
+  if (for_write)
+    rc = npth_rwlock_wrlock (&entry->lock);
+  else
+    rc = npth_rwlock_rdlock (&entry->lock);
+  if (rc)
+    {
+      log_error ("can't acquire the CRL entry lock: %s\n", strerror (rc));
+      entry->ref_count--;
+      return gpg_error_from_errno (rc);
+    }
+  return 0;
+}
+
+
+/* Unlock ENTRY and drop the reference taken by acquire_entry.  If
+   ENTRY has been replaced in the meantime it is released.  */
+static void
+release_entry (crl_cache_t cache, crl_cache_entry_t entry)
+{
+  int rc;
+
+  rc = npth_rwlock_unlock (&entry->lock);
+  if (rc)
+    log_error ("can't release the CRL entry lock: %s\n", strerror (rc));
+  if (!entry->ref_count)
+    log_error ("calling release_entry on an unused entry\n");
+  else
+    entry->ref_count--;
+  if (!entry->ref_count && entry->deleted)
+    purge_deleted_entries (cache);
+}
+
+
+/* Find the current entry for ISSUER_HASH in CACHE and acquire it for
+   reading or writing.  Returns NULL if there is no entry.  Because
+   the entry may be replaced while waiting for its lock, we check
+   that it is still current and otherwise try again with the new
+   one.  The entry must be released with release_entry.  */
+static crl_cache_entry_t
+get_entry (crl_cache_t cache, const char *issuer_hash, int for_write)
+{
+  crl_cache_entry_t entry;
+
+  while ((entry = find_entry (cache->entries, issuer_hash)))
+    {
+      if (acquire_entry (entry, for_write))
+        return NULL;
+      if (!entry->deleted)
+        break;
+      release_entry (cache, entry);
+    }
+  return entry;
+}
+
+
 /* Release the CACHE object. */
 static void
 release_cache (crl_cache_t cache)
@@ -513,6 +755,227 @@ check_dir_version (estream_t *fpadr, const char *fname,
 }
 
 
+/* Parse the CRL cache record LINE read from line LINENO of the dir
+   file FNAME and store a new cache entry at R_ENTRY.  LINE is taken
+   over by the entry on success.  If the record is invalid NULL is
+   stored at R_ENTRY.  Returns an error only for a malloc failure.  */
+static gpg_error_t
+parse_dir_line (char *line, const char *fname, unsigned int lineno,
+                crl_cache_entry_t *r_entry)
+{
+  crl_cache_entry_t entry;
+  int fieldno;
+  char *p, *endp;
+
+  *r_entry = NULL;
+  entry = new_cache_entry ();
+  if (!entry)
+    return gpg_error_from_syserror ();
+  entry->lineno = lineno;
+  entry->release_ptr = line;
+  if (*line == 'i')
+    {
+      entry->invalid = atoi (line+1);
+      if (entry->invalid < 1)
+        entry->invalid = 1;
+    }
+  else if (*line == 'u')
+    entry->user_trust_req = 1;
+
+  for (fieldno=1, p = line; p; p = endp, fieldno++)
+    {
+      endp = strchr (p, ':');
+      if (endp)
+        *endp++ = '\0';
+
+      switch (fieldno)
+        {
+        case 1: /* record type */ break;
+        case 2: entry->issuer_hash = p; break;
+        case 3: entry->issuer = unpercent_string (p); break;
+        case 4: entry->url = unpercent_string (p); break;
+        case 5:
+          strncpy (entry->this_update, p, 15);
+          entry->this_update[15] = 0;
+          break;
+        case 6:
+          strncpy (entry->next_update, p, 15);
+          entry->next_update[15] = 0;
+          break;
+        case 7: entry->dbfile_hash = p; break;
+        case 8: if (*p) entry->crl_number = p; break;
+        case 9:
+          if (*p)
+            entry->authority_issuer = unpercent_string (p);
+          break;
+        case 10:
+          if (*p)
+            entry->authority_serialno = unpercent_string (p);
+          break;
+        case 11:
+          if (*p)
+            entry->check_trust_anchor = xtrystrdup (p);
+          break;
+        case 12:
+          if (*p)
+            entry->delta_crl_number = xtrystrdup (p);
+          break;
+        case 13:
+          strncpy (entry->delta_this_update, p, 15);
+          entry->delta_this_update[15] = 0;
+          break;
+        case 14:
+          strncpy (entry->delta_next_update, p, 15);
+          entry->delta_next_update[15] = 0;
+          break;
+        case 15:
+          if (*p)
+            entry->delta_dbfile_hash = xtrystrdup (p);
+          break;
+        default:
+          if (*p)
+            log_info (_("extra field detected in crl record of "
+                        "'%s' line %u\n"), fname, lineno);
+          break;
+        }
+    }
+
+  if (!entry->issuer_hash)
+    {
+      log_info (_("invalid line detected in '%s' line %u\n"),
+                fname, lineno);
+      entry->release_ptr = NULL;
+      release_one_cache_entry (entry);
+      return 0;
+    }
+
+  *r_entry = entry;
+  return 0;
+}
+
+
+/* Do some basic checks on the cache ENTRY read from the dir file
+   FNAME.  Returns true if the entry is not usable.  */
+static int
+check_dir_entry (crl_cache_entry_t entry, const char *fname)
+{
+  int anyerr = 0;
+
+  if (strlen (entry->issuer_hash) != 40)
+    {
+      anyerr++;
+      log_error (_("invalid issuer hash in '%s' line %u\n"),
+                 fname, entry->lineno);
+    }
+  else if ( !entry->issuer || !*entry->issuer )
+    {
+      anyerr++;
+      log_error (_("no issuer DN in '%s' line %u\n"),
+                 fname, entry->lineno);
+    }
+  else if ( check_isotime (entry->this_update)
+            || check_isotime (entry->next_update))
+    {
+      anyerr++;
+      log_error (_("invalid timestamp in '%s' line %u\n"),
+                 fname, entry->lineno);
+    }
+
+  /* Checks not leading to an immediate fail. */
+  if (!entry->dbfile_hash || strlen (entry->dbfile_hash) != 32)
+    log_info (_("WARNING: invalid cache file hash in '%s' line %u\n"),
+              fname, entry->lineno);
+  if (entry->delta_dbfile_hash
+      && (strlen (entry->delta_dbfile_hash) != 32
+          || check_isotime (entry->delta_this_update)
+          || check_isotime (entry->delta_next_update)))
+    {
+      log_info ("ignoring invalid delta CRL data in '%s' line %u\n",
+                fname, entry->lineno);
+      xfree (entry->delta_dbfile_hash);
+      entry->delta_dbfile_hash = NULL;
+    }
+  if (!entry->delta_dbfile_hash)
+    {
+      xfree (entry->delta_crl_number);
+      entry->delta_crl_number = NULL;
+      *entry->delta_this_update = *entry->delta_next_update = 0;
+    }
+
+  return anyerr;
+}
+
+
+/* Apply the records of the journal file to the entries of CACHE
+   just read from the dir file.  A missing journal is not an error.
+   Invalid records are skipped.  */
+static gpg_error_t
+read_dir_journal (crl_cache_t cache)
+{
+  char *fname;
+  char *line = NULL;
+  gpg_error_t lineerr = 0;
+  estream_t fp;
+  crl_cache_entry_t entry, *eprev;
+  unsigned int lineno = 0;
+  gpg_error_t err = 0;
+
+  fname = make_filename (opt.homedir_cache, DBDIR_D, DBDIRJOURNAL, NULL);
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_error (_("failed to open cache dir file '%s': %s\n"),
+                   fname, strerror (errno));
+      xfree (fname);
+      return 0;
+    }
+
+  while ((line = next_line_from_file (fp, &lineerr)))
+    {
+      lineno++;
+      if (*line == 'c' || *line == 'u' || *line == 'i')
+        {
+          err = parse_dir_line (line, fname, lineno, &entry);
+          if (err)
+            goto leave;
+          if (entry)
+            line = NULL;
+          if (entry && check_dir_entry (entry, fname))
+            {
+              release_one_cache_entry (entry);
+              entry = NULL;
+            }
+          if (entry)
+            {
+              /* Replace an existing entry for the issuer or append
+                 the new one.  */
+              for (eprev = &cache->entries; *eprev; eprev = &(*eprev)->next)
+                if (!strcmp ((*eprev)->issuer_hash, entry->issuer_hash))
+                  break;
+              if (*eprev)
+                {
+                  entry->next = (*eprev)->next;
+                  release_one_cache_entry (*eprev);
+                }
+              *eprev = entry;
+              cache->journal_count++;
+            }
+        }
+      xfree (line);
+    }
+  if (lineerr || es_ferror (fp))
+    log_error (_("error reading '%s': %s\n"), fname,
+               lineerr? gpg_strerror (lineerr) : strerror (errno));
+
+ leave:
+  xfree (line);
+  es_fclose (fp);
+  xfree (fname);
+  return err;
+}
+
+
 /* Open the dir file and read in all available information.  Store
    that in a newly allocated cache object and return that if
    everything worked out fine.  Create the cache directory and the dir
@@ -556,90 +1019,28 @@ open_dir (crl_cache_t *r_cache)
   xfree (line);
   while ((line = next_line_from_file (fp, &lineerr)))
     {
-      int fieldno;
-      char *p, *endp;
-
       lineno++;
       if ( *line == 'c' || *line == 'u' || *line == 'i' )
         {
-          entry = xtrycalloc (1, sizeof *entry);
+          err = parse_dir_line (line, fname, lineno, &entry);
+          if (err)
+            goto leave;
           if (!entry)
-            {
-              err = gpg_error_from_syserror ();
-              goto leave;
-            }
-          entry->lineno = lineno;
-          entry->release_ptr = line;
-          if (*line == 'i')
-            {
-              entry->invalid = atoi (line+1);
-              if (entry->invalid < 1)
-                entry->invalid = 1;
-            }
-          else if (*line == 'u')
-            entry->user_trust_req = 1;
-
-          for (fieldno=1, p = line; p; p = endp, fieldno++)
-            {
-              endp = strchr (p, ':');
-              if (endp)
-                *endp++ = '\0';
-
-              switch (fieldno)
-                {
-                case 1: /* record type */ break;
-                case 2: entry->issuer_hash = p; break;
-                case 3: entry->issuer = unpercent_string (p); break;
-                case 4: entry->url = unpercent_string (p); break;
-                case 5:
-		  strncpy (entry->this_update, p, 15);
-		  entry->this_update[15] = 0;
-		  break;
-                case 6:
-		  strncpy (entry->next_update, p, 15);
-		  entry->next_update[15] = 0;
-		  break;
-                case 7: entry->dbfile_hash = p; break;
-                case 8: if (*p) entry->crl_number = p; break;
-                case 9:
-                  if (*p)
-                    entry->authority_issuer = unpercent_string (p);
-                  break;
-                case 10:
-                  if (*p)
-                    entry->authority_serialno = unpercent_string (p);
-                  break;
-                case 11:
-                  if (*p)
-                    entry->check_trust_anchor = xtrystrdup (p);
-                  break;
-                default:
-                  if (*p)
-                    log_info (_("extra field detected in crl record of "
-                                "'%s' line %u\n"), fname, lineno);
-                  break;
-                }
-            }
-
-          if (!entry->issuer_hash)
-            {
-              log_info (_("invalid line detected in '%s' line %u\n"),
-                        fname, lineno);
-              xfree (entry);
-              entry = NULL;
-            }
+            ;
           else if (find_entry (cache->entries, entry->issuer_hash))
             {
               /* Fixme: The duplicate checking used is not very
                  effective for large numbers of issuers. */
               log_info (_("duplicate entry detected in '%s' line %u\n"),
                         fname, lineno);
-              xfree (entry);
-              entry = NULL;
+              line = NULL;
+              release_one_cache_entry (entry);
             }
           else
             {
               line = NULL;
+              if (check_dir_entry (entry, fname))
+                anyerr++;
               *entrytail = entry;
               entrytail = &entry->next;
             }
@@ -666,43 +1067,17 @@ open_dir (crl_cache_t *r_cache)
       goto leave;
     }
 
-  /* Now do some basic checks on the data. */
-  for (entry = cache->entries; entry; entry = entry->next)
-    {
-      assert (entry->lineno);
-      if (strlen (entry->issuer_hash) != 40)
-        {
-          anyerr++;
-          log_error (_("invalid issuer hash in '%s' line %u\n"),
-                     fname, entry->lineno);
-        }
-      else if ( !*entry->issuer )
-        {
-          anyerr++;
-          log_error (_("no issuer DN in '%s' line %u\n"),
-                     fname, entry->lineno);
-        }
-      else if ( check_isotime (entry->this_update)
-                || check_isotime (entry->next_update))
-        {
-          anyerr++;
-          log_error (_("invalid timestamp in '%s' line %u\n"),
-                     fname, entry->lineno);
-        }
-
-      /* Checks not leading to an immediate fail. */
-      if (strlen (entry->dbfile_hash) != 32)
-        log_info (_("WARNING: invalid cache file hash in '%s' line %u\n"),
-                  fname, entry->lineno);
-    }
-
   if (anyerr)
     {
       log_error (_("detected errors in cache dir file\n"));
       log_info (_("please check the reason and manually delete that file\n"));
       err = gpg_error (GPG_ERR_CONFIGURATION);
+      goto leave;
     }
 
+  /* Changes since the last rewrite of the dir file.  */
+  err = read_dir_journal (cache);
+
 
  leave:
   es_fclose (fp);
@@ -765,13 +1140,117 @@ write_dir_line_crl (estream_t fp, crl_cache_entry_t e)
   es_putc (':', fp);
   if (e->check_trust_anchor && e->user_trust_req)
     es_fputs (e->check_trust_anchor, fp);
+  if (e->delta_dbfile_hash)
+    {
+      es_putc (':', fp);
+      if (e->delta_crl_number)
+        es_fputs (e->delta_crl_number, fp);
+      es_putc (':', fp);
+      es_fwrite (e->delta_this_update, 15, 1, fp);
+      es_putc (':', fp);
+      es_fwrite (e->delta_next_update, 15, 1, fp);
+      es_putc (':', fp);
+      es_fputs (e->delta_dbfile_hash, fp);
+    }
   es_putc ('\n', fp);
 }
 
 
-/* Update the current dir file using the cache. */
+/* Return true if the CRL cache record LINE is for ISSUER_HASH.  */
+static int
+dir_line_has_issuer (const char *line, const char *issuer_hash)
+{
+  const char *s = strchr (line, ':');
+  size_t n = strlen (issuer_hash);
+
+  return s && !strncmp (s+1, issuer_hash, n) && s[1+n] == ':';
+}
+
+
+/* Return the records of the journal file for issuers not known by
+   CACHE; they have been written by other instances of dirmngr.  The
+   newest record for an issuer comes first; older ones are flagged.  */
+static strlist_t
+read_foreign_journal_records (crl_cache_t cache)
+{
+  char *fname;
+  char *line;
+  gpg_error_t lineerr = 0;
+  estream_t fp;
+  strlist_t list = NULL;
+  strlist_t sl;
+  char *fieldp, *endp;
+  int known;
+
+  fname = make_filename (opt.homedir_cache, DBDIR_D, DBDIRJOURNAL, NULL);
+  fp = es_fopen (fname, "r");
+  xfree (fname);
+  if (!fp)
+    return NULL;
+
+  while ((line = next_line_from_file (fp, &lineerr)))
+    {
+      if ((*line == 'c' || *line == 'u' || *line == 'i')
+          && (fieldp = strchr (line, ':'))
+          && (endp = strchr (++fieldp, ':')))
+        {
+          *endp = 0;
+          known = !!find_entry (cache->entries, fieldp);
+          if (!known)
+            for (sl = list; sl; sl = sl->next)
+              if (dir_line_has_issuer (sl->d, fieldp))
+                sl->flags = 1;
+          *endp = ':';
+          if (!known)
+            add_to_strlist (&list, line);
+        }
+      xfree (line);
+    }
+  es_fclose (fp);
+  return list;
+}
+
+
+/* Append the record of the changed or new cache entry E to the
+   journal.  The entire dir file is rewritten with all entries of
+   CACHE only after DBDIR_JOURNAL_MAX records or if writing to the
+   journal failed.  */
+static gpg_error_t
+update_dir (crl_cache_t cache, crl_cache_entry_t e)
+{
+  char *fname;
+  estream_t fp;
+  gpg_error_t err = 0;
+
+  if (cache->journal_count >= DBDIR_JOURNAL_MAX)
+    return compact_dir (cache);
+
+  fname = make_filename (opt.homedir_cache, DBDIR_D, DBDIRJOURNAL, NULL);
+  fp = es_fopen (fname, "a");
+  if (!fp)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      write_dir_line_crl (fp, e);
+      if (es_fclose (fp))
+        err = gpg_error_from_syserror ();
+    }
+  if (err)
+    {
+      log_error (_("error writing '%s': %s\n"), fname, gpg_strerror (err));
+      xfree (fname);
+      return compact_dir (cache);
+    }
+  xfree (fname);
+  cache->journal_count++;
+  return 0;
+}
+
+
+/* Rewrite the current dir file using the cache and remove the
+   journal.  */
 static gpg_error_t
-update_dir (crl_cache_t cache)
+compact_dir (crl_cache_t cache)
 {
   char *fname = NULL;
   char *tmpfname = NULL;
@@ -782,6 +1261,7 @@ update_dir (crl_cache_t cache)
   crl_cache_entry_t e;
   unsigned int lineno;
   gpg_error_t err = 0;
+  strlist_t foreign, sl;
 
   fname = make_filename (opt.homedir_cache, DBDIR_D, DBDIRFILE, NULL);
 
@@ -790,6 +1270,10 @@ update_dir (crl_cache_t cache)
   for (e= cache->entries; e; e = e->next)
     e->mark = 1;
 
+  /* Fixme: Records appended to the journal by another process while
+     we are rewriting the dir file get lost.  */
+  foreign = read_foreign_journal_records (cache);
+
   lineno = 0;
   fp = es_fopen (fname, "r");
   if (!fp)
@@ -877,11 +1361,23 @@ update_dir (crl_cache_t cache)
               else
                 { /* We ignore entries we don't have in our cache
                      because they may have been added in the meantime
-                     by other instances of dirmngr. */
+                     by other instances of dirmngr.  A newer record
+                     from the journal takes precedence. */
+                  *endp = 0;
+                  for (sl = foreign; sl; sl = sl->next)
+                    if (!sl->flags && dir_line_has_issuer (sl->d, fieldp))
+                      break;
+                  *endp = ':';
                   es_fprintf (fpout, "# Next line added by "
                               "another process; our pid is %lu\n",
                               (unsigned long)getpid ());
-                  es_fputs (line, fpout);
+                  if (sl)
+                    {
+                      es_fputs (sl->d, fpout);
+                      sl->flags = 1;
+                    }
+                  else
+                    es_fputs (line, fpout);
                   es_putc ('\n', fpout);
                 }
             }
@@ -911,6 +1407,15 @@ update_dir (crl_cache_t cache)
               write_dir_line_crl (fpout, e);
             e->mark = 0;
           }
+      for (sl = foreign; sl; sl = sl->next)
+        if (!sl->flags)
+          {
+            es_fprintf (fpout, "# Next line added by "
+                        "another process; our pid is %lu\n",
+                        (unsigned long)getpid ());
+            es_fputs (sl->d, fpout);
+            es_putc ('\n', fpout);
+          }
     }
   if (lineerr)
     {
@@ -954,8 +1459,16 @@ update_dir (crl_cache_t cache)
       goto leave;
     }
 
+  /* All records of the journal are now in the dir file.  */
+  xfree (fname);
+  fname = make_filename (opt.homedir_cache, DBDIR_D, DBDIRJOURNAL, NULL);
+  if (gnupg_remove (fname) && errno != ENOENT)
+    log_error ("failed to remove '%s': %s\n", fname, strerror (errno));
+  cache->journal_count = 0;
+
  leave:
   /* Fixme: Relinquish update lock. */
+  free_strlist (foreign);
   xfree (line);
   es_fclose (fp);
   xfree (fname);
@@ -987,6 +1500,21 @@ make_db_file_name (const char *issuer_hash)
 }
 
 
+/* Create the filename for the delta cache file from the 40 byte
+   ISSUER_HASH string. Caller must release the return string. */
+static char *
+make_delta_db_file_name (const char *issuer_hash)
+{
+  char bname[60];
+
+  assert (strlen (issuer_hash) == 40);
+  memcpy (bname, "crl-", 4);
+  memcpy (bname + 4, issuer_hash, 40);
+  strcpy (bname + 44, ".delta.db");
+  return make_filename (opt.homedir_cache, DBDIR_D, bname, NULL);
+}
+
+
 /* Hash the file FNAME and return the MD5 digest in MD5BUFFER. The
    caller must allocate MD%buffer wityh at least 16 bytes. Returns 0
    on success. */
@@ -1075,52 +1603,35 @@ lock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
 {
   char *fname;
   int fd;
-  int open_count;
   crl_cache_entry_t e;
 
+  (void)cache;
+
   if (entry->cdb)
     {
+      /* Move it to the head of the LRU list.  */
+      if (entry != lru_head)
+        {
+          lru_unlink (entry);
+          lru_link (entry);
+        }
       entry->cdb_use_count++;
       return entry->cdb;
     }
 
-  for (open_count = 0, e = cache->entries; e; e = e->next)
-    {
-      if (e->cdb)
-        open_count++;
-/*       log_debug ("CACHE: cdb=%p use_count=%u lru_count=%u\n", */
-/*                  e->cdb,e->cdb_use_count,e->cdb_lru_count); */
-    }
-
-  /* If there are too many file open, find the least recent used DB
-     file and close it.  Note that for Pth thread safeness we need to
+  /* If there are too many files open, close the least recently used
+     files not in use.  Note that for Pth thread safeness we need to
      use a loop here. */
-  while (open_count >= MAX_OPEN_DB_FILES )
+  while (lru_count >= opt.max_open_crl_files)
     {
-      crl_cache_entry_t last_e = NULL;
-      unsigned int last_lru = (unsigned int)(-1);
-
-      for (e = cache->entries; e; e = e->next)
-        if (e->cdb && !e->cdb_use_count && e->cdb_lru_count < last_lru)
-          {
-            last_lru = e->cdb_lru_count;
-            last_e = e;
-          }
-      if (!last_e)
+      for (e = lru_tail; e && e->cdb_use_count; e = e->lru_prev)
+        ;
+      if (!e)
         {
           log_error (_("too many open cache files; can't open anymore\n"));
           return NULL;
         }
-
-/*       log_debug ("CACHE: closing file at cdb=%p\n", last_e->cdb); */
-
-      fd = cdb_fileno (last_e->cdb);
-      cdb_free (last_e->cdb);
-      xfree (last_e->cdb);
-      last_e->cdb = NULL;
-      if (close (fd))
-        log_error (_("error closing cache file: %s\n"), strerror(errno));
-      open_count--;
+      close_db_file (e);
     }
 
 
@@ -1165,7 +1676,7 @@ lock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
   xfree (fname);
 
   entry->cdb_use_count = 1;
-  entry->cdb_lru_count = 0;
+  lru_link (entry);
 
   return entry->cdb;
 }
@@ -1179,28 +1690,84 @@ unlock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
   else if (!entry->cdb_use_count)
     log_error (_("calling unlock_db_file on an unlocked file\n"));
   else
+    entry->cdb_use_count--;
+
+  (void)cache;
+
+  /* A replaced entry won't be used again; thus there is no need to
+     keep its file open.  The entry itself is released by
+     release_entry.  */
+  if (!entry->cdb_use_count && entry->deleted)
+    close_db_file (entry);
+}
+
+
+/* Look up the serial number SN of length SNLEN in the delta DB file
+   of ENTRY.  Returns 1 and stores the record at RECORD if the serial
+   number is listed, 0 if it is not listed and -1 on error.  The delta
+   DB files are small and thus we open them only for the lookup.  */
+static int
+lookup_delta_db (crl_cache_entry_t entry,
+                 const unsigned char *sn, size_t snlen,
+                 unsigned char *record)
+{
+  char *fname;
+  struct cdb cdb;
+  int fd;
+  int rc;
+
+  fname = make_delta_db_file_name (entry->issuer_hash);
+  if (!entry->delta_dbfile_checked)
     {
-      entry->cdb_use_count--;
-      entry->cdb_lru_count++;
+      if (check_dbfile (fname, entry->delta_dbfile_hash))
+        {
+          log_error (_("cached CRL for issuer id %s tampered; "
+                       "we need to update\n"), entry->issuer_hash);
+          xfree (fname);
+          return -1;
+        }
+      entry->delta_dbfile_checked = 1;
     }
 
-  /* If the entry was marked for deletion in the meantime do it now.
-     We do this for the sake of Pth thread safeness. */
-  if (!entry->cdb_use_count && entry->deleted)
+  fd = open (fname, O_RDONLY | O_BINARY);
+  if (fd == -1)
+    {
+      log_error (_("error opening cache file '%s': %s\n"),
+                 fname, strerror (errno));
+      xfree (fname);
+      return -1;
+    }
+  if (cdb_init (&cdb, fd))
     {
-      crl_cache_entry_t eprev, enext;
+      log_error (_("error initializing cache file '%s' for reading: %s\n"),
+                 fname, strerror (errno));
+      close (fd);
+      xfree (fname);
+      return -1;
+    }
 
-      enext = entry->next;
-      for (eprev = cache->entries;
-           eprev && eprev->next != entry; eprev = eprev->next)
-        ;
-      assert (eprev);
-      if (eprev == cache->entries)
-        cache->entries = enext;
-      else
-        eprev->next = enext;
-      /* FIXME: Do we leak ENTRY? */
+  rc = cdb_find (&cdb, sn, snlen);
+  if (rc == 1)
+    {
+      if (cdb_datalen (&cdb) != 16
+          || cdb_read (&cdb, record, 16, cdb_datapos (&cdb)))
+        {
+          log_error (_("problem reading cache record: %s\n"),
+                     strerror (errno));
+          rc = -1;
+        }
+    }
+  else if (rc)
+    {
+      log_error (_("error getting data from cache file: %s\n"),
+                 strerror (errno));
+      rc = -1;
     }
+
+  cdb_free (&cdb);
+  close (fd);
+  xfree (fname);
+  return rc;
 }
 
 
@@ -1262,36 +1829,32 @@ crl_cache_flush (void)
 }
 
 
-/* Check whether the certificate identified by ISSUER_HASH and
-   SN/SNLEN is valid; i.e. not listed in our cache.  With
-   FORCE_REFRESH set to true, a new CRL will be retrieved even if the
-   cache has not yet expired.  We use a 30 minutes threshold here so
-   that invoking this function several times won't load the CRL over
-   and over.  */
+/* Worker for cache_isvalid to check the serial number SN/SNLEN
+   using the acquired cache ENTRY.  */
 static crl_cache_result_t
-cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
-               const unsigned char *sn, size_t snlen,
-               int force_refresh)
+entry_isvalid (ctrl_t ctrl, crl_cache_t cache, crl_cache_entry_t entry,
+               const unsigned char *sn, size_t snlen, int force_refresh)
 {
-  crl_cache_t cache = get_current_cache ();
+  const char *issuer_hash = entry->issuer_hash;
   crl_cache_result_t retval;
   struct cdb *cdb;
   int rc;
-  crl_cache_entry_t entry;
   gnupg_isotime_t current_time;
+  const char *next_update;
+  unsigned char record[16];
   size_t n;
 
   (void)ctrl;
 
-  entry = find_entry (cache->entries, issuer_hash);
-  if (!entry)
-    {
-      log_info (_("no CRL available for issuer id %s\n"), issuer_hash );
-      return CRL_CACHE_DONTKNOW;
-    }
+  entry->last_used = gnupg_get_time ();
+  /* An applied delta CRL extends the validity of the CRL.  */
+  next_update = entry->next_update;
+  if (entry->delta_dbfile_hash
+      && strcmp (entry->delta_next_update, next_update) > 0)
+    next_update = entry->delta_next_update;
 
   gnupg_get_isotime (current_time);
-  if (strcmp (entry->next_update, current_time) < 0 )
+  if (strcmp (next_update, current_time) < 0 )
     {
       log_info (_("cached CRL for issuer id %s too old; update required\n"),
                 issuer_hash);
@@ -1341,8 +1904,40 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
       return CRL_CACHE_DONTKNOW;
     }
 
-  rc = cdb_find (cdb, sn, snlen);
+  /* The delta CRL has precedence because it lists the changes since
+     the CRL.  */
+  if (entry->delta_dbfile_hash)
+    rc = lookup_delta_db (entry, sn, snlen, record);
+  else
+    rc = 0;
   if (rc == 1)
+    {
+      if (*record == CRL_REASON_REMOVED)
+        {
+          if (opt.verbose)
+            {
+              char *tmp = hexify_data (sn, snlen, 1);
+              log_info ("S/N %s is valid, it has been removed from the CRL\n",
+                        tmp);
+              xfree (tmp);
+            }
+          retval = CRL_CACHE_VALID;
+        }
+      else
+        {
+          if (opt.verbose)
+            {
+              char *tmp = hexify_data (sn, snlen, 1);
+              log_info (_("S/N %s is not valid; reason=%02X  date=%.15s\n"),
+                        tmp, *record, record+1);
+              xfree (tmp);
+            }
+          retval = CRL_CACHE_INVALID;
+        }
+    }
+  else if (rc)
+    retval = CRL_CACHE_DONTKNOW;
+  else if ((rc = cdb_find (cdb, sn, snlen)) == 1)
     {
       n = cdb_datalen (cdb);
       if (n != 16)
@@ -1353,7 +1948,6 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
         }
       else if (opt.verbose)
         {
-          unsigned char record[16];
           char *tmp = hexify_data (sn, snlen, 1);
 
           if (cdb_read (cdb, record, n, cdb_datapos (cdb)))
@@ -1412,6 +2006,36 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
 }
 
 
+/* Check whether the certificate identified by ISSUER_HASH and
+   SN/SNLEN is valid; i.e. not listed in our cache.  With
+   FORCE_REFRESH set to true, a new CRL will be retrieved even if the
+   cache has not yet expired.  We use a 30 minutes threshold here so
+   that invoking this function several times won't load the CRL over
+   and over.  */
+static crl_cache_result_t
+cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
+               const unsigned char *sn, size_t snlen,
+               int force_refresh)
+{
+  crl_cache_t cache = get_current_cache ();
+  crl_cache_result_t retval;
+  crl_cache_entry_t entry;
+
+  /* The entry is locked for reading so that it won't be changed by
+     a delta CRL while we are using it.  A new CRL for the issuer may
+     be inserted meanwhile; we then keep on using the old entry.  */
+  entry = get_entry (cache, issuer_hash, 0);
+  if (!entry)
+    {
+      log_info (_("no CRL available for issuer id %s\n"), issuer_hash );
+      return CRL_CACHE_DONTKNOW;
+    }
+  retval = entry_isvalid (ctrl, cache, entry, sn, snlen, force_refresh);
+  release_entry (cache, entry);
+  return retval;
+}
+
+
 /* Check whether the certificate identified by ISSUER_HASH and
    SERIALNO is valid; i.e. not listed in our cache.  With
    FORCE_REFRESH set to true, a new CRL will be retrieved even if the
@@ -1593,76 +2217,297 @@ finish_sig_check (ksba_crl_t crl, gcry_md_hd_t md, int algo,
   err = gcry_sexp_sscan (&s_sig, NULL, sigval, n);
   if (err)
     {
-      log_error (_("converting S-expression failed: %s\n"),
-                 gcry_strerror (err));
-      goto leave;
+      log_error (_("converting S-expression failed: %s\n"),
+                 gcry_strerror (err));
+      goto leave;
+    }
+
+  /* Get and convert the public key for the issuer certificate. */
+  if (DBG_X509)
+    dump_cert ("crl_issuer_cert", issuer_cert);
+  pubkey = ksba_cert_get_public_key (issuer_cert);
+  n = gcry_sexp_canon_len (pubkey, 0, NULL, NULL);
+  if (!n)
+    {
+      log_error (_("got an invalid S-expression from libksba\n"));
+      err = gpg_error (GPG_ERR_INV_SEXP);
+      goto leave;
+    }
+  err = gcry_sexp_sscan (&s_pkey, NULL, pubkey, n);
+  if (err)
+    {
+      log_error (_("converting S-expression failed: %s\n"),
+                 gcry_strerror (err));
+      goto leave;
+    }
+
+  /* Create an S-expression with the actual hash value. */
+  s = gcry_md_algo_name (algo);
+  for (i = 0; *s && i < sizeof(algoname) - 1; s++, i++)
+    algoname[i] = ascii_tolower (*s);
+  algoname[i] = 0;
+  err = gcry_sexp_build (&s_hash, NULL, "(data(flags pkcs1)(hash %s %b))",
+                         algoname,
+                         gcry_md_get_algo_dlen (algo), gcry_md_read (md, algo));
+  if (err)
+    {
+      log_error (_("creating S-expression failed: %s\n"), gcry_strerror (err));
+      goto leave;
+    }
+
+  /* Pass this on to the signature verification. */
+  err = gcry_pk_verify (s_sig, s_hash, s_pkey);
+  if (DBG_X509)
+    log_debug ("gcry_pk_verify: %s\n", gpg_strerror (err));
+
+ leave:
+  xfree (sigval);
+  xfree (pubkey);
+  gcry_sexp_release (s_sig);
+  gcry_sexp_release (s_hash);
+  gcry_sexp_release (s_pkey);
+  gcry_md_close (md);
+
+  return err;
+}
+
+
+/* Call this to match a start_sig_check that can not be completed
+   normally.  Takes ownership of MD if MD is not NULL.  */
+static void
+abort_sig_check (ksba_crl_t crl, gcry_md_hd_t md)
+{
+  (void)crl;
+  if (md)
+    gcry_md_close (md);
+}
+
+
+/* The size of one batch of CRL items handed to the builder thread.  */
+#define CRL_BATCH_SIZE 65536
+
+/* To load a large CRL faster we build the database in a separate
+   thread.  The KSBA parser and the hashing of the CRL run in the
+   calling thread and append the items to a batch.  A full batch is
+   handed over to the builder thread which adds its items to the
+   database while it does not hold the nPth lock.  Thus parsing and
+   building run in parallel.  Each item in a batch consists of the
+   2 byte length of the key, the key, and the 16 byte record.  */
+struct crl_builder_s
+{
+  struct cdb_make *cdb;
+  npth_mutex_t lock;
+  npth_cond_t cond;
+  unsigned char *batch;     /* The batch being filled.  */
+  size_t batchlen;
+  unsigned char *pending;   /* The batch handed over to the thread.  */
+  size_t pendinglen;
+  unsigned char *spare;     /* An unused batch.  */
+  int finished;             /* No more batches will follow.  */
+  int error;                /* The errno of a failed cdb_make_add.  */
+  npth_t thread;
+};
+typedef struct crl_builder_s *crl_builder_t;
+
+
+/* Add the items of the batch BUF of LEN to the database CDB.  This
+   is called without the nPth lock and thus must not call any nPth
+   function or use the logging.  Returns 0 or an errno.  */
+static int
+add_crl_batch (struct cdb_make *cdb, const unsigned char *buf, size_t len)
+{
+  size_t n;
+
+  while (len)
+    {
+      n = (buf[0] << 8) | buf[1];
+      if (cdb_make_add (cdb, buf + 2, n, buf + 2 + n, 1+15))
+        return errno? errno : EIO;
+      buf += 2 + n + 1+15;
+      len -= 2 + n + 1+15;
+    }
+  return 0;
+}
+
+
+/* The builder thread.  */
+static void *
+crl_builder_thread (void *arg)
+{
+  crl_builder_t bld = arg;
+  unsigned char *buf;
+  size_t len;
+  int rc;
+
+  npth_mutex_lock (&bld->lock);
+  for (;;)
+    {
+      while (!bld->pending && !bld->finished)
+        npth_cond_wait (&bld->cond, &bld->lock);
+      if (!bld->pending)
+        break;  /* Finished.  */
+      buf = bld->pending;
+      len = bld->pendinglen;
+      npth_mutex_unlock (&bld->lock);
+
+      rc = 0;
+      if (!bld->error)
+        {
+          npth_unprotect ();
+          rc = add_crl_batch (bld->cdb, buf, len);
+          npth_protect ();
+        }
+
+      npth_mutex_lock (&bld->lock);
+      if (rc)
+        bld->error = rc;
+      bld->spare = buf;
+      bld->pending = NULL;
+      npth_cond_signal (&bld->cond);
+    }
+  npth_mutex_unlock (&bld->lock);
+  return NULL;
+}
+
+
+/* Hand the current batch of BLD over to the builder thread.  */
+static void
+flush_crl_batch (crl_builder_t bld)
+{
+  unsigned char *buf;
+
+  if (!bld->batchlen)
+    return;
+
+  npth_mutex_lock (&bld->lock);
+  while (bld->pending)
+    npth_cond_wait (&bld->cond, &bld->lock);
+  buf = bld->spare;
+  bld->spare = NULL;
+  bld->pending = bld->batch;
+  bld->pendinglen = bld->batchlen;
+  npth_cond_signal (&bld->cond);
+  npth_mutex_unlock (&bld->lock);
+
+  bld->batch = buf;
+  bld->batchlen = 0;
+}
+
+
+/* Add the item with KEY of KEYLEN and the 16 byte RECORD to BLD.
+   Returns 0 or an error code.  */
+static gpg_error_t
+crl_builder_add (crl_builder_t bld, const void *key, size_t keylen,
+                 const unsigned char *record)
+{
+  size_t n = 2 + keylen + 1+15;
+
+  if (keylen > 0xffff || n > CRL_BATCH_SIZE)
+    return gpg_error (GPG_ERR_INV_CRL);
+  if (bld->error)
+    return gpg_error_from_errno (bld->error);
+
+  if (bld->batchlen + n > CRL_BATCH_SIZE)
+    flush_crl_batch (bld);
+
+  bld->batch[bld->batchlen++] = keylen >> 8;
+  bld->batch[bld->batchlen++] = keylen;
+  memcpy (bld->batch + bld->batchlen, key, keylen);
+  bld->batchlen += keylen;
+  memcpy (bld->batch + bld->batchlen, record, 1+15);
+  bld->batchlen += 1+15;
+  return 0;
+}
+
+
+/* Start a builder for CDB and store it at R_BLD.  */
+static gpg_error_t
+crl_builder_start (struct cdb_make *cdb, crl_builder_t *r_bld)
+{
+  gpg_error_t err;
+  crl_builder_t bld;
+  int rc;
+
+  *r_bld = NULL;
+  bld = xtrycalloc (1, sizeof *bld);
+  if (!bld)
+    return gpg_error_from_syserror ();
+  bld->cdb = cdb;
+  bld->batch = xtrymalloc (CRL_BATCH_SIZE);
+  bld->spare = xtrymalloc (CRL_BATCH_SIZE);
+  if (!bld->batch || !bld->spare)
+    {
+      err = gpg_error_from_syserror ();
+      goto failure;
     }
 
-  /* Get and convert the public key for the issuer certificate. */
-  if (DBG_X509)
-    dump_cert ("crl_issuer_cert", issuer_cert);
-  pubkey = ksba_cert_get_public_key (issuer_cert);
-  n = gcry_sexp_canon_len (pubkey, 0, NULL, NULL);
-  if (!n)
+  if ((rc = npth_mutex_init (&bld->lock, NULL)))
     {
-      log_error (_("got an invalid S-expression from libksba\n"));
-      err = gpg_error (GPG_ERR_INV_SEXP);
-      goto leave;
+      err = gpg_error_from_errno (rc);
+      goto failure;
     }
-  err = gcry_sexp_sscan (&s_pkey, NULL, pubkey, n);
-  if (err)
+  if ((rc = npth_cond_init (&bld->cond, NULL)))
     {
-      log_error (_("converting S-expression failed: %s\n"),
-                 gcry_strerror (err));
-      goto leave;
+      err = gpg_error_from_errno (rc);
+      npth_mutex_destroy (&bld->lock);
+      goto failure;
     }
-
-  /* Create an S-expression with the actual hash value. */
-  s = gcry_md_algo_name (algo);
-  for (i = 0; *s && i < sizeof(algoname) - 1; s++, i++)
-    algoname[i] = ascii_tolower (*s);
-  algoname[i] = 0;
-  err = gcry_sexp_build (&s_hash, NULL, "(data(flags pkcs1)(hash %s %b))",
-                         algoname,
-                         gcry_md_get_algo_dlen (algo), gcry_md_read (md, algo));
-  if (err)
+  if ((rc = npth_create (&bld->thread, NULL, crl_builder_thread, bld)))
     {
-      log_error (_("creating S-expression failed: %s\n"), gcry_strerror (err));
-      goto leave;
+      err = gpg_error_from_errno (rc);
+      log_error ("error spawning CRL builder thread: %s\n",
+                 gpg_strerror (err));
+      npth_cond_destroy (&bld->cond);
+      npth_mutex_destroy (&bld->lock);
+      goto failure;
     }
 
-  /* Pass this on to the signature verification. */
-  err = gcry_pk_verify (s_sig, s_hash, s_pkey);
-  if (DBG_X509)
-    log_debug ("gcry_pk_verify: %s\n", gpg_strerror (err));
-
- leave:
-  xfree (sigval);
-  xfree (pubkey);
-  gcry_sexp_release (s_sig);
-  gcry_sexp_release (s_hash);
-  gcry_sexp_release (s_pkey);
-  gcry_md_close (md);
+  *r_bld = bld;
+  return 0;
 
+ failure:
+  xfree (bld->batch);
+  xfree (bld->spare);
+  xfree (bld);
   return err;
 }
 
 
-/* Call this to match a start_sig_check that can not be completed
-   normally.  Takes ownership of MD if MD is not NULL.  */
-static void
-abort_sig_check (ksba_crl_t crl, gcry_md_hd_t md)
+/* Hand over the last batch, wait for the builder thread to terminate
+   and release BLD.  Returns the error of the builder.  */
+static gpg_error_t
+crl_builder_finish (crl_builder_t bld)
 {
-  (void)crl;
-  if (md)
-    gcry_md_close (md);
+  gpg_error_t err;
+
+  if (!bld)
+    return 0;
+
+  flush_crl_batch (bld);
+  npth_mutex_lock (&bld->lock);
+  bld->finished = 1;
+  npth_cond_signal (&bld->cond);
+  npth_mutex_unlock (&bld->lock);
+  npth_join (bld->thread, NULL);
+
+  err = bld->error? gpg_error_from_errno (bld->error) : 0;
+  if (err)
+    log_error (_("error inserting item into "
+                 "temporary cache file: %s\n"), gpg_strerror (err));
+  npth_cond_destroy (&bld->cond);
+  npth_mutex_destroy (&bld->lock);
+  xfree (bld->batch);
+  xfree (bld->spare);
+  xfree (bld);
+  return err;
 }
 
 
 /* Workhorse of the CRL loading machinery.  The CRL is read using the
-   CRL object and stored in the data base file DB with the name FNAME
-   (only used for printing error messages).  That DB should be a
-   temporary one and not the actual one.  If the function fails the
+   CRL object and stored by the builder BLD in the data base file with
+   the name FNAME (only used for printing error messages).  That DB
+   should be a temporary one and not the actual one.  The builder is
+   finished and released in all cases.  If the function fails the
    caller should delete this temporary database file.  CTRL is
    required to retrieve certificates using the general dirmngr
    callback service.  R_CRLISSUER returns an allocated string with the
@@ -1676,7 +2521,7 @@ abort_sig_check (ksba_crl_t crl, gcry_md_hd_t md)
 */
 static int
 crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
-                  struct cdb_make *cdb, const char *fname,
+                  crl_builder_t bld, const char *fname,
                   char **r_crlissuer,
                   ksba_isotime_t thisupdate, ksba_isotime_t nextupdate,
                   char **r_trust_anchor)
@@ -1740,7 +2585,6 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
             const unsigned char *p;
             ksba_isotime_t rdate;
             ksba_crl_reason_t reason;
-            int rc;
             unsigned char record[1+15];
 
             err = ksba_crl_get_item (crl, &serial, rdate, &reason);
@@ -1755,23 +2599,30 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
             p = serial_to_buffer (serial, &n);
             if (!p)
               BUG ();
-            record[0] = (reason & 0xff);
+            if ((reason & KSBA_CRLREASON_REMOVE_FROM_CRL))
+              record[0] = CRL_REASON_REMOVED; /* Only in delta CRLs.  */
+            else
+              record[0] = (reason & 0xff);
             memcpy (record+1, rdate, 15);
-            rc = cdb_make_add (cdb, p, n, record, 1+15);
-            if (rc)
+            err = crl_builder_add (bld, p, n, record);
+            ksba_free (serial);
+            if (err)
               {
-                err = gpg_error_from_errno (errno);
                 log_error (_("error inserting item into "
                              "temporary cache file: %s\n"),
-                           strerror (errno));
+                           gpg_strerror (err));
                 goto failure;
               }
-
-            ksba_free (serial);
           }
           break;
 
         case KSBA_SR_END_ITEMS:
+          /* All items have been read; get the result of the builder
+             before doing the signature and chain checks.  */
+          err = crl_builder_finish (bld);
+          bld = NULL;
+          if (err)
+            goto failure;
           break;
 
         case KSBA_SR_READY:
@@ -1881,6 +2732,11 @@ crl_parse_insert (ctrl_t ctrl, ksba_crl_t crl,
 
 
  failure:
+  {
+    gpg_error_t err2 = crl_builder_finish (bld);
+    if (!err)
+      err = err2;
+  }
   abort_sig_check (crl, md);
   ksba_cert_release (crlissuer_cert);
   return err;
@@ -1956,6 +2812,119 @@ get_auth_key_id (ksba_crl_t crl, char **serialno)
 
 
 
+/* Apply the delta CRL CRL which has been stored in the temporary DB
+   file FNAME to the cache entry for ISSUER_HASH.  BASE_NUMBER is the
+   BaseCRLNumber of the delta CRL, the other arguments are as computed
+   by crl_cache_insert.  On success FNAME has been renamed to the
+   delta DB file.  */
+static gpg_error_t
+insert_delta_crl (crl_cache_t cache, ksba_crl_t crl,
+                  const char *fname, const char *issuer_hash,
+                  const char *base_number, const char *checksum,
+                  ksba_isotime_t thisupdate, ksba_isotime_t nextupdate,
+                  int invalidate_crl, const char *trust_anchor)
+{
+  gpg_error_t err;
+  crl_cache_entry_t entry;
+  char *crl_number = NULL;
+  char *newfname = NULL;
+
+  /* Applying the delta CRL changes the entry; thus we need to wait
+     until the current lookups of this issuer are done.  */
+  entry = get_entry (cache, issuer_hash, 1);
+  if (entry && (entry->invalid || !entry->crl_number))
+    {
+      release_entry (cache, entry);
+      entry = NULL;
+    }
+  if (!entry)
+    {
+      log_info ("no usable CRL for delta CRL of issuer id %s\n",
+                issuer_hash);
+      err = gpg_error (GPG_ERR_NO_CRL_KNOWN);
+      goto leave;
+    }
+  if (invalidate_crl)
+    {
+      log_error ("delta CRL for issuer id %s can't be used\n", issuer_hash);
+      err = gpg_error (GPG_ERR_INV_CRL);
+      goto leave;
+    }
+
+  /* The delta CRL may only be applied to a CRL with a number not
+     less than BaseCRLNumber but less than the number of the delta
+     CRL.  */
+  crl_number = get_crl_number (crl);
+  if (!crl_delta_applicable (entry->crl_number, base_number, crl_number,
+                             NULL))
+    {
+      log_info ("delta CRL %s (base %s) does not match CRL %s"
+                " of issuer id %s\n", crl_number? crl_number : "[none]",
+                base_number, entry->crl_number, issuer_hash);
+      err = gpg_error (GPG_ERR_NO_CRL_KNOWN);
+      goto leave;
+    }
+  if (entry->delta_crl_number
+      && crl_compare_numbers (entry->delta_crl_number, crl_number) > 0)
+    {
+      log_info ("delta CRL %s is older than the applied one\n", crl_number);
+      err = gpg_error (GPG_ERR_NO_CRL_KNOWN);
+      goto leave;
+    }
+
+  /* Both CRLs need to be trusted in the same way.  */
+  if (!!trust_anchor != !!entry->user_trust_req
+      || (trust_anchor && (!entry->check_trust_anchor
+                           || strcmp (trust_anchor,
+                                      entry->check_trust_anchor))))
+    {
+      log_error ("delta CRL for issuer id %s has a different trust anchor\n",
+                 issuer_hash);
+      err = gpg_error (GPG_ERR_INV_CRL);
+      goto leave;
+    }
+
+  newfname = make_delta_db_file_name (issuer_hash);
+  if (opt.verbose)
+    log_info (_("creating cache file '%s'\n"), newfname);
+#ifdef HAVE_W32_SYSTEM
+  gnupg_remove (newfname);
+#endif
+  if (rename (fname, newfname))
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("problem renaming '%s' to '%s': %s\n"),
+                 fname, newfname, gpg_strerror (err));
+      goto leave;
+    }
+
+  xfree (entry->delta_crl_number);
+  entry->delta_crl_number = crl_number;
+  crl_number = NULL;
+  xfree (entry->delta_dbfile_hash);
+  entry->delta_dbfile_hash = xstrdup (checksum);
+  entry->delta_dbfile_checked = 0;
+  gnupg_copy_time (entry->delta_this_update, thisupdate);
+  gnupg_copy_time (entry->delta_next_update, nextupdate);
+  gnupg_get_isotime (entry->last_refresh);
+
+  err = update_dir (cache, entry);
+  if (err)
+    {
+      log_error (_("updating the DIR file failed - "
+                   "cache entry will get lost with the next program start\n"));
+      err = 0; /* Keep on running. */
+    }
+
+ leave:
+  if (entry)
+    release_entry (cache, entry);
+  xfree (crl_number);
+  xfree (newfname);
+  return err;
+}
+
+
 /* Insert the CRL retrieved using URL into the cache specified by
    CACHE.  The CRL itself will be read from the stream FP and is
    expected in binary format.
@@ -1980,6 +2949,7 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
   char *fname = NULL;
   char *newfname = NULL;
   struct cdb_make cdb;
+  crl_builder_t bld;
   int fd_cdb = -1;
   char *issuer = NULL;
   char *issuer_hash = NULL;
@@ -1992,7 +2962,10 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
   int idx;
   const char *oid;
   int critical;
+  const unsigned char *der;
+  size_t derlen;
   char *trust_anchor = NULL;
+  char *base_number = NULL;
 
   /* FIXME: We should acquire a mutex for the URL, so that we don't
      simultaneously enter the same CRL twice.  However this needs to be
@@ -2064,7 +3037,13 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
     }
   cdb_make_start(&cdb, fd_cdb);
 
-  err = crl_parse_insert (ctrl, crl, &cdb, fname,
+  err = crl_builder_start (&cdb, &bld);
+  if (err)
+    {
+      cdb_make_finish (&cdb);
+      goto leave;
+    }
+  err = crl_parse_insert (ctrl, crl, bld, fname,
                           &issuer, thisupdate, nextupdate, &trust_anchor);
   if (err)
     {
@@ -2124,8 +3103,15 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
 
   /* Check for unknown critical extensions. */
   for (idx=0; !(err=ksba_crl_get_extension (crl, idx, &oid, &critical,
-                                              NULL, NULL)); idx++)
+                                              &der, &derlen)); idx++)
     {
+      if (!strcmp (oid, oidstr_deltaCRLIndicator) && !base_number)
+        {
+          base_number = crl_delta_base_number (der, derlen);
+          if (base_number)
+            continue;
+          log_error ("invalid deltaCRLIndicator in CRL\n");
+        }
       if (!critical
           || !strcmp (oid, oidstr_authorityKeyIdentifier)
           || !strcmp (oid, oidstr_crlNumber) )
@@ -2149,8 +3135,25 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
      used as the key for the cache. */
   issuer_hash = hashify_data (issuer, strlen (issuer));
 
+  /* A delta CRL is stored along with the CRL it applies to.  */
+  if (base_number)
+    {
+      if (!err)
+        err = insert_delta_crl (cache, crl, fname, issuer_hash,
+                                base_number, checksum,
+                                thisupdate, nextupdate,
+                                invalidate_crl, trust_anchor);
+      if (!err)
+        {
+          xfree (fname);
+          fname = NULL;
+          err2 = 0;
+        }
+      goto leave;
+    }
+
   /* Create an ENTRY. */
-  entry = xtrycalloc (1, sizeof *entry);
+  entry = new_cache_entry ();
   if (!entry)
     {
       err = gpg_error_from_syserror ();
@@ -2186,7 +3189,11 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
      it as deleted. We better use a loop, just in case duplicates got
      somehow into the list. */
   for (e = cache->entries; (e=find_entry (e, entry->issuer_hash)); e = e->next)
-    e->deleted = 1;
+    {
+      e->deleted = 1;
+      if (e->last_used > entry->last_used)
+        entry->last_used = e->last_used;
+    }
 
   /* Rename the temporary DB to the real name. */
   newfname = make_db_file_name (entry->issuer_hash);
@@ -2195,28 +3202,10 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
 
   /* Just in case close unused matching files.  Actually we need this
      only under Windows but saving file descriptors is never bad.  */
-  {
-    int any;
-    do
-      {
-        any = 0;
-        for (e = cache->entries; e; e = e->next)
-          if (!e->cdb_use_count && e->cdb
-              && !strcmp (e->issuer_hash, entry->issuer_hash))
-            {
-              int fd = cdb_fileno (e->cdb);
-              cdb_free (e->cdb);
-              xfree (e->cdb);
-              e->cdb = NULL;
-              if (close (fd))
-                log_error (_("error closing cache file: %s\n"),
-                           strerror(errno));
-              any = 1;
-              break;
-            }
-      }
-    while (any);
-  }
+  for (e = cache->entries; e; e = e->next)
+    if (!e->cdb_use_count && e->cdb
+        && !strcmp (e->issuer_hash, entry->issuer_hash))
+      close_db_file (e);
 #ifdef HAVE_W32_SYSTEM
   gnupg_remove (newfname);
 #endif
@@ -2229,12 +3218,20 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
     }
   xfree (fname); fname = NULL; /*(let the cleanup code not try to remove it)*/
 
-  /* Link the new entry in. */
+  /* A delta CRL of the replaced CRL can't be used anymore.  */
+  xfree (newfname);
+  newfname = make_delta_db_file_name (entry->issuer_hash);
+  if (gnupg_remove (newfname) && errno != ENOENT)
+    log_error ("failed to remove '%s': %s\n", newfname, strerror (errno));
+
+  /* Link the new entry in.  Lookups still using a replaced entry
+     keep on using it; it is released when they are done.  */
   entry->next = cache->entries;
   cache->entries = entry;
+  e = entry;
   entry = NULL;
 
-  err = update_dir (cache);
+  err = update_dir (cache, e);
   if (err)
     {
       log_error (_("updating the DIR file failed - "
@@ -2244,6 +3241,7 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
 
 
  leave:
+  purge_deleted_entries (cache);
   release_one_cache_entry (entry);
   if (fd_cdb != -1)
     close (fd_cdb);
@@ -2258,6 +3256,7 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
   xfree (issuer_hash);
   xfree (checksum);
   xfree (trust_anchor);
+  xfree (base_number);
   return err ? err : err2;
 }
 
@@ -2295,6 +3294,13 @@ list_one_crl_entry (crl_cache_t cache, crl_cache_entry_t e, estream_t fp)
   es_fprintf (fp, " Trust Check:\t%s\n",
               !e->user_trust_req? "[system]" :
               e->check_trust_anchor? e->check_trust_anchor:"[missing]");
+  if (e->delta_dbfile_hash)
+    {
+      es_fprintf (fp, " Delta CRL  :\t%s\n",
+                  e->delta_crl_number? e->delta_crl_number : "none");
+      es_fprintf (fp, " Delta This :\t%s\n", e->delta_this_update);
+      es_fprintf (fp, " Delta Next :\t%s\n", e->delta_next_update);
+    }
 
   if ((e->invalid & 1))
     es_fprintf (fp, _(" ERROR: The CRL will not be used "
@@ -2393,13 +3399,25 @@ gpg_error_t
 crl_cache_list (estream_t fp)
 {
   crl_cache_t cache = get_current_cache ();
-  crl_cache_entry_t entry;
+  crl_cache_entry_t entry, next;
   gpg_error_t err = 0;
 
-  for (entry = cache->entries;
-       entry && !entry->deleted && !err;
-       entry = entry->next )
-    err = list_one_crl_entry (cache, entry, fp);
+  /* Writing to FP may let other threads run; the reference keeps
+     ENTRY and thus its link to the next entry valid.  */
+  for (entry = cache->entries; entry && !err; entry = next)
+    {
+      if (entry->deleted)
+        {
+          next = entry->next;
+          continue;
+        }
+      err = acquire_entry (entry, 0);
+      if (err)
+        break;
+      err = list_one_crl_entry (cache, entry, fp);
+      next = entry->next;
+      release_entry (cache, entry);
+    }
 
   return err;
 }
@@ -2432,8 +3450,155 @@ crl_cache_load (ctrl_t ctrl, const char *filename)
 }
 
 
+/* Return true if the CRL may be fetched from URL.  */
+static int
+crl_url_usable_p (const char *url)
+{
+  if (!strncmp (url, "ldap:", 5) || !strncmp (url, "ldaps:", 6))
+    return !opt.ignore_ldap_dp;
+  else if (!strncmp (url, "http:", 5) || !strncmp (url, "https:", 6))
+    return !opt.ignore_http_dp;
+  return 0; /* Unknown scheme or not retrieved by URL.  */
+}
+
+
+/* Return a list with the URIs of the freshestCRL extension of CERT
+   or NULL if there is none.  The extension uses the syntax of the
+   cRLDistributionPoints; we only look at the fullName of the
+   distribution points.  */
+static strlist_t
+get_freshest_crl_uris (ksba_cert_t cert)
+{
+  gpg_error_t err;
+  strlist_t list = NULL;
+  const unsigned char *image, *der, *dp, *names;
+  size_t imagelen, off, derlen, dplen, nameslen;
+  int idx, crit;
+  const char *oid;
+  int class, tag, cons, ndef;
+  size_t len, hdrlen;
+
+  image = ksba_cert_get_image (cert, &imagelen);
+  if (!image)
+    return NULL;
+  for (idx=0; !(err = ksba_cert_get_extension (cert, idx, &oid, &crit,
+                                               &off, &derlen)); idx++)
+    if (!strcmp (oid, oidstr_freshestCRL))
+      break;
+  if (err || off + derlen > imagelen)
+    return NULL;
+  der = image + off;
+
+  /* CRLDistributionPoints ::= SEQUENCE OF DistributionPoint  */
+  if (parse_ber_header (&der, &derlen, &class, &tag, &cons, &ndef,
+                        &len, &hdrlen)
+      || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE || len > derlen)
+    return NULL;
+  derlen = len;
+  while (derlen)
+    {
+      /* DistributionPoint ::= SEQUENCE { distributionPoint [0] ...}  */
+      if (parse_ber_header (&der, &derlen, &class, &tag, &cons, &ndef,
+                            &len, &hdrlen)
+          || class != CLASS_UNIVERSAL || tag != TAG_SEQUENCE || len > derlen)
+        break;
+      dp = der;
+      dplen = len;
+      der += len;
+      derlen -= len;
+
+      /* DistributionPointName ::= CHOICE { fullName [0] GeneralNames ...} */
+      if (parse_ber_header (&dp, &dplen, &class, &tag, &cons, &ndef,
+                            &len, &hdrlen)
+          || class != CLASS_CONTEXT || tag != 0 || len > dplen
+          || parse_ber_header (&dp, &dplen, &class, &tag, &cons, &ndef,
+                               &len, &hdrlen)
+          || class != CLASS_CONTEXT || tag != 0 || len > dplen)
+        continue;
+      names = dp;
+      nameslen = len;
+      while (nameslen)
+        {
+          if (parse_ber_header (&names, &nameslen, &class, &tag, &cons,
+                                &ndef, &len, &hdrlen)
+              || len > nameslen)
+            break;
+          /* uniformResourceIdentifier [6] IA5String  */
+          if (class == CLASS_CONTEXT && tag == 6 && !cons && len)
+            {
+              char *uri = xtrymalloc (len + 1);
+              if (!uri)
+                break;
+              memcpy (uri, names, len);
+              uri[len] = 0;
+              add_to_strlist (&list, uri);
+              xfree (uri);
+            }
+          names += len;
+          nameslen -= len;
+        }
+    }
+
+  return list;
+}
+
+
+/* Try to update the cached CRL for the certificate CERT using a
+   delta CRL.  Returns 0 if a delta CRL has been applied.  */
+static gpg_error_t
+try_delta_crl (ctrl_t ctrl, ksba_cert_t cert)
+{
+  gpg_error_t err = gpg_error (GPG_ERR_NO_CRL_KNOWN);
+  crl_cache_t cache = get_current_cache ();
+  crl_cache_entry_t entry;
+  ksba_reader_t reader = NULL;
+  strlist_t uris, sl;
+  char *issuer, *issuer_hash;
+
+  issuer = ksba_cert_get_issuer (cert, 0);
+  if (!issuer)
+    return gpg_error (GPG_ERR_INV_CERT_OBJ);
+  issuer_hash = hashify_data (issuer, strlen (issuer));
+  ksba_free (issuer);
+
+  /* Without a usable CRL a delta CRL does not help.  */
+  entry = find_entry (cache->entries, issuer_hash);
+  xfree (issuer_hash);
+  if (!entry || entry->invalid || !entry->crl_number)
+    return err;
+
+  uris = get_freshest_crl_uris (cert);
+  for (sl = uris; sl; sl = sl->next)
+    {
+      if (!crl_url_usable_p (sl->d))
+        continue;
+
+      if (opt.verbose)
+        log_info ("fetching delta CRL from '%s'\n", sl->d);
+      err = crl_fetch (ctrl, sl->d, &reader);
+      if (err)
+        {
+          log_info ("crl_fetch via freshestCRL failed: %s\n",
+                    gpg_strerror (err));
+          continue;
+        }
+      err = crl_cache_insert (ctrl, sl->d, reader);
+      crl_close_reader (reader);
+      reader = NULL;
+      if (!err)
+        break;
+      log_info ("inserting delta CRL failed: %s\n", gpg_strerror (err));
+    }
+
+  free_strlist (uris);
+  return err;
+}
+
+
 /* Locate the corresponding CRL for the certificate CERT, read and
-   verify the CRL and store it in the cache.  */
+   verify the CRL and store it in the cache.  If the certificate
+   points to a delta CRL which can be applied to the cached CRL only
+   that one is retrieved.  */
 gpg_error_t
 crl_cache_reload_crl (ctrl_t ctrl, ksba_cert_t cert)
 {
@@ -2447,6 +3612,9 @@ crl_cache_reload_crl (ctrl_t ctrl, ksba_cert_t cert)
   int any_dist_point = 0;
   int seq;
 
+  if (!try_delta_crl (ctrl, cert))
+    return 0;
+
   /* Loop over all distribution points, get the CRLs and put them into
      the cache. */
   if (opt.verbose)
@@ -2587,3 +3755,84 @@ crl_cache_reload_crl (ctrl_t ctrl, ksba_cert_t cert)
   ksba_free (issuer);
   return err;
 }
+
+
+/* Fetch new versions of the recently used CRLs which are about to
+   expire.  This is called by the housekeeping thread with CURTIME
+   being the current time so that the callers of crl_cache_isvalid will
+   not have to wait for the download.  Until a new CRL has been
+   inserted the old one is used.  A CRL fetched via HTTP is only
+   downloaded again if the server reports that it has been modified;
+   if not, the next try is done after CRL_REFRESH_RETRY seconds.  */
+void
+crl_cache_housekeeping (ctrl_t ctrl, time_t curtime)
+{
+  crl_cache_entry_t e;
+  gnupg_isotime_t current_time, threshold;
+  const char *next_update;
+  strlist_t urls = NULL;
+  strlist_t sl;
+  ksba_reader_t reader;
+  gpg_error_t err;
+  int count = 0;
+
+  if (!current_cache)
+    return;
+
+  /* First collect the URLs because the list of entries may change
+     while we are fetching the CRLs.  */
+  gnupg_get_isotime (current_time);
+  for (e = current_cache->entries; e; e = e->next)
+    {
+      if (e->deleted || !e->last_used
+          || e->last_used + CRL_REFRESH_USED_PERIOD < curtime
+          || (e->refresh_tried
+              && e->refresh_tried + CRL_REFRESH_RETRY > curtime)
+          || !crl_url_usable_p (e->url))
+        continue;
+
+      /* Derive the jitter from the issuer hash so that the CRLs of
+         different issuers are spread over several runs.  */
+      gnupg_copy_time (threshold, current_time);
+      add_seconds_to_isotime (threshold,
+                              CRL_REFRESH_AHEAD
+                              + (strtoul (e->issuer_hash + 36, NULL, 16)
+                                 % CRL_REFRESH_JITTER));
+      next_update = e->next_update;
+      if (e->delta_dbfile_hash
+          && strcmp (e->delta_next_update, next_update) > 0)
+        next_update = e->delta_next_update;
+      if (strcmp (next_update, threshold) >= 0)
+        continue;
+
+      if (count++ >= MAX_CRL_REFRESH_PER_RUN)
+        break;
+      e->refresh_tried = curtime;
+      add_to_strlist (&urls, e->url);
+    }
+
+  for (sl = urls; sl; sl = sl->next)
+    {
+      if (opt.verbose)
+        log_info ("refreshing CRL from '%s'\n", sl->d);
+      err = crl_fetch_refresh (ctrl, sl->d, &reader);
+      if (!err && !reader)
+        {
+          if (opt.verbose)
+            log_info ("CRL from '%s' has not been modified\n", sl->d);
+          continue;
+        }
+      if (!err)
+        {
+          err = crl_cache_insert (ctrl, sl->d, reader);
+          crl_close_reader (reader);
+          if (err)  /* Download it again with the next try.  */
+            ks_http_forget_validators (sl->d);
+        }
+      if (err)
+        log_info ("refreshing CRL from '%s' failed: %s\n",
+                  sl->d, gpg_strerror (err));
+    }
+
+  free_strlist (urls);
+}
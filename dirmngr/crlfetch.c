@@ -29,11 +29,15 @@
 #include "misc.h"
 #include "http.h"
 #include "ks-engine.h"  /* For ks_http_fetch.  */
+#include "../common/tracepoint.h"
 
 #if USE_LDAP
 # include "ldap-wrapper.h"
 #endif
 
+/* The maximum length of a certificate fetched via HTTP.  */
+#define MAX_FETCHED_CERT_LENGTH (16*1024)
+
 /* For detecting armored CRLs received via HTTP (yes, such CRLS really
    exits, e.g. http://grid.fzk.de/ca/gridka-crl.pem at least in June
    2008) we need a context in the reader callback.  */
@@ -149,9 +153,12 @@ my_es_read (void *opaque, char *buffer, size_t nbytes, size_t *nread)
 
 /* Fetch CRL from URL and return the entire CRL using new ksba reader
    object in READER.  Note that this reader object should be closed
-   only using ldap_close_reader. */
-gpg_error_t
-crl_fetch (ctrl_t ctrl, const char *url, ksba_reader_t *reader)
+   only using ldap_close_reader.  If CONDITIONAL is set and the CRL
+   has been fetched via HTTP before, it is only fetched if it has
+   been modified; if not, 0 is returned and READER is set to NULL. */
+static gpg_error_t
+do_crl_fetch (ctrl_t ctrl, const char *url, int conditional,
+              ksba_reader_t *reader)
 {
   gpg_error_t err;
   parsed_uri_t uri;
@@ -182,12 +189,15 @@ crl_fetch (ctrl_t ctrl, const char *url, ksba_reader_t *reader)
           err = ks_http_fetch (ctrl, url,
                                (KS_HTTP_FETCH_TRUST_CFG
                                 | KS_HTTP_FETCH_NO_CRL
-                                | KS_HTTP_FETCH_ALLOW_DOWNGRADE ),
+                                | KS_HTTP_FETCH_ALLOW_DOWNGRADE
+                                | (conditional? KS_HTTP_FETCH_CONDITIONAL:0)),
                                &httpfp);
         }
 
       if (err)
         log_error (_("error retrieving '%s': %s\n"), url, gpg_strerror (err));
+      else if (!httpfp)
+        ; /* Not modified.  */
       else
         {
           struct reader_cb_context_s *cb_ctx;
@@ -252,6 +262,33 @@ crl_fetch (ctrl_t ctrl, const char *url, ksba_reader_t *reader)
 }
 
 
+gpg_error_t
+crl_fetch (ctrl_t ctrl, const char *url, ksba_reader_t *reader)
+{
+  gpg_error_t err;
+
+  GNUPG_TRACE1 (crl_fetch, url);
+  err = do_crl_fetch (ctrl, url, 0, reader);
+  GNUPG_TRACE2 (crl_fetch_done, url, gpg_err_code (err));
+  return err;
+}
+
+
+/* Same as crl_fetch but used for refreshing a cached CRL: If the CRL
+   at URL has not been modified since it was last fetched by this
+   function, 0 is returned and READER is set to NULL.  */
+gpg_error_t
+crl_fetch_refresh (ctrl_t ctrl, const char *url, ksba_reader_t *reader)
+{
+  gpg_error_t err;
+
+  GNUPG_TRACE1 (crl_fetch, url);
+  err = do_crl_fetch (ctrl, url, 1, reader);
+  GNUPG_TRACE2 (crl_fetch_done, url, gpg_err_code (err));
+  return err;
+}
+
+
 /* Fetch CRL for ISSUER using a default server. Return the entire CRL
    as a newly opened stream returned in R_FP. */
 gpg_error_t
@@ -408,6 +445,69 @@ end_cert_fetch (cert_fetch_context_t context)
 }
 
 
+/* Helper for fetch_cert_by_url to fetch a DER encoded certificate
+   from the http or https URL into the new object at R_CERT.  */
+static gpg_error_t
+fetch_cert_by_http (ctrl_t ctrl, const char *url, ksba_cert_t *r_cert)
+{
+  gpg_error_t err;
+  estream_t httpfp = NULL;
+  char buffer[MAX_FETCHED_CERT_LENGTH];
+  size_t buflen, nread;
+
+  *r_cert = NULL;
+
+  if (opt.disable_http)
+    {
+      log_error (_("certificate access not possible due to disabled %s\n"),
+                 "HTTP");
+      return gpg_error (GPG_ERR_NOT_SUPPORTED);
+    }
+
+  /* The certificate is verified by the caller; thus we can allow a
+   * downgrade to http like we do for CRLs.  */
+  err = ks_http_fetch (ctrl, url,
+                       (KS_HTTP_FETCH_TRUST_CFG
+                        | KS_HTTP_FETCH_NO_CRL
+                        | KS_HTTP_FETCH_ALLOW_DOWNGRADE),
+                       &httpfp);
+  if (err)
+    {
+      log_error (_("error retrieving '%s': %s\n"), url, gpg_strerror (err));
+      return err;
+    }
+
+  for (buflen = 0; buflen < sizeof buffer; buflen += nread)
+    {
+      if (es_read (httpfp, buffer + buflen, sizeof buffer - buflen, &nread))
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      if (!nread)
+        break;
+    }
+  if (buflen == sizeof buffer)
+    {
+      err = gpg_error (GPG_ERR_TOO_LARGE);
+      goto leave;
+    }
+
+  err = ksba_cert_new (r_cert);
+  if (!err)
+    err = ksba_cert_init_from_mem (*r_cert, buffer, buflen);
+  if (err)
+    {
+      ksba_cert_release (*r_cert);
+      *r_cert = NULL;
+    }
+
+ leave:
+  es_fclose (httpfp);
+  return err;
+}
+
+
 /* Lookup a cert by it's URL.  */
 gpg_error_t
 fetch_cert_by_url (ctrl_t ctrl, const char *url,
@@ -418,6 +518,7 @@ fetch_cert_by_url (ctrl_t ctrl, const char *url,
   ksba_reader_t reader;
   ksba_cert_t cert;
   gpg_error_t err;
+  parsed_uri_t uri;
 
   *value = NULL;
   *valuelen = 0;
@@ -425,23 +526,34 @@ fetch_cert_by_url (ctrl_t ctrl, const char *url,
   reader = NULL;
   cert = NULL;
 
+  err = http_parse_uri (&uri, url, 0);
+  http_release_parsed_uri (uri);
+  if (!err) /* Yes, our HTTP code groks that. */
+    {
+      err = fetch_cert_by_http (ctrl, url, &cert);
+      if (err)
+        goto leave;
+    }
+  else
+    {
 #if USE_LDAP
-  err = url_fetch_ldap (ctrl, url, NULL, 0, &reader);
+      err = url_fetch_ldap (ctrl, url, NULL, 0, &reader);
 #else
-  (void)ctrl;
-  (void)url;
-  err = gpg_error (GPG_ERR_NOT_IMPLEMENTED);
+      (void)ctrl;
+      (void)url;
+      err = gpg_error (GPG_ERR_NOT_IMPLEMENTED);
 #endif /*USE_LDAP*/
-  if (err)
-    goto leave;
+      if (err)
+        goto leave;
 
-  err = ksba_cert_new (&cert);
-  if (err)
-    goto leave;
+      err = ksba_cert_new (&cert);
+      if (err)
+        goto leave;
 
-  err = ksba_cert_read_der (cert, reader);
-  if (err)
-    goto leave;
+      err = ksba_cert_read_der (cert, reader);
+      if (err)
+        goto leave;
+    }
 
   cert_image = ksba_cert_get_image (cert, &cert_image_n);
   if (!cert_image || !cert_image_n)
@@ -30,6 +30,10 @@ typedef struct cert_fetch_context_s *cert_fetch_context_t;
 /* Fetch CRL from URL. */
 gpg_error_t crl_fetch (ctrl_t ctrl, const char* url, ksba_reader_t *reader);
 
+/* Fetch CRL from URL only if it has been modified. */
+gpg_error_t crl_fetch_refresh (ctrl_t ctrl, const char* url,
+                               ksba_reader_t *reader);
+
 /* Fetch CRL for ISSUER using default server. */
 gpg_error_t crl_fetch_default (ctrl_t ctrl,
                                const char* issuer, ksba_reader_t *reader);
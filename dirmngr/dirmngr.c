@@ -62,6 +62,7 @@
 
 #include "certcache.h"
 #include "crlcache.h"
+#include "ocsp.h"
 #include "crlfetch.h"
 #include "misc.h"
 #if USE_LDAP
@@ -72,6 +73,7 @@
 # include "ldap-wrapper.h"
 #endif
 #include "../common/init.h"
+#include "../common/asynclog.h"
 #include "../common/gc-opt-flags.h"
 #include "dns-stuff.h"
 #include "http-common.h"
@@ -111,6 +113,7 @@ enum cmd_and_opt_values {
   oHomedir,
   oNoDetach,
   oLogFile,
+  oAsyncLog,
   oBatch,
   oDisableHTTP,
   oDisableLDAP,
@@ -132,6 +135,7 @@ enum cmd_and_opt_values {
   oOCSPMaxPeriod,
   oOCSPCurrentPeriod,
   oMaxReplies,
+  oMaxOpenCrlFiles,
   oHkpCaCert,
   oFakedSystemTime,
   oForce,
@@ -151,6 +155,7 @@ enum cmd_and_opt_values {
   oResolverTimeout,
   oConnectTimeout,
   oConnectQuickTimeout,
+  oRequestTimeout,
   oListenBacklog,
   aTest
 };
@@ -186,6 +191,7 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_n (oNoDetach, "no-detach", N_("do not detach from the console")),
   ARGPARSE_s_s (oLogFile,  "log-file",
                 N_("|FILE|write server mode logs to FILE")),
+  ARGPARSE_s_n (oAsyncLog, "async-log", "@"),
   ARGPARSE_s_n (oBatch,    "batch",       N_("run without asking a user")),
   ARGPARSE_s_n (oForce,    "force",       N_("force loading of outdated CRLs")),
   ARGPARSE_s_n (oAllowOCSP, "allow-ocsp", N_("allow sending OCSP requests")),
@@ -225,6 +231,7 @@ static ARGPARSE_OPTS opts[] = {
 
   ARGPARSE_s_i (oMaxReplies, "max-replies",
                 N_("|N|do not return more than N items in one query")),
+  ARGPARSE_s_i (oMaxOpenCrlFiles, "max-open-crl-files", "@"),
 
   ARGPARSE_s_s (oNameServer, "nameserver", "@"),
   ARGPARSE_s_s (oKeyServer, "keyserver", "@"),
@@ -257,6 +264,7 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_i (oResolverTimeout, "resolver-timeout", "@"),
   ARGPARSE_s_i (oConnectTimeout, "connect-timeout", "@"),
   ARGPARSE_s_i (oConnectQuickTimeout, "connect-quick-timeout", "@"),
+  ARGPARSE_s_i (oRequestTimeout, "request-timeout", "@"),
   ARGPARSE_s_i (oListenBacklog, "listen-backlog", "@"),
 
   ARGPARSE_group (302,N_("@\n(See the \"info\" manual for a complete listing "
@@ -283,6 +291,7 @@ static struct debug_flags_s debug_flags [] =
   };
 
 #define DEFAULT_MAX_REPLIES 10
+#define DEFAULT_MAX_OPEN_CRL_FILES 5
 #define DEFAULT_LDAP_TIMEOUT 15  /* seconds */
 
 #define DEFAULT_CONNECT_TIMEOUT       (15*1000)  /* 15 seconds */
@@ -309,6 +318,9 @@ static int cleanup_socket;
    the log file after a SIGHUP if it didn't changed. Malloced. */
 static char *current_logfile;
 
+/* Flag to write the log from a separate thread.  */
+static int async_log;
+
 /* Helper to implement --debug-level. */
 static const char *debug_level;
 
@@ -578,6 +590,7 @@ shutdown_reaper (void)
 {
 #if USE_LDAP
   ldap_wrapper_wait_connections ();
+  ks_ldap_flush_connection_pool (1);
 #endif
 }
 
@@ -612,6 +625,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.ocsp_max_period = 90 * 86400;       /* 90 days.  */
       opt.ocsp_current_period = 3 * 60 * 60;  /* 3 hours. */
       opt.max_replies = DEFAULT_MAX_REPLIES;
+      opt.max_open_crl_files = DEFAULT_MAX_OPEN_CRL_FILES;
       while (opt.ocsp_signer)
         {
           fingerprint_list_t tmp = opt.ocsp_signer->next;
@@ -630,6 +644,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       set_dns_timeout (0);
       opt.connect_timeout = 0;
       opt.connect_quick_timeout = 0;
+      opt.request_timeout = 0;
       return 1;
     }
 
@@ -650,7 +665,10 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       if (!current_logfile || !pargs->r.ret_str
           || strcmp (current_logfile, pargs->r.ret_str))
         {
-          log_set_file (pargs->r.ret_str);
+          if (async_log_is_active ())
+            async_log_set_file (pargs->r.ret_str);
+          else
+            log_set_file (pargs->r.ret_str);
           xfree (current_logfile);
           current_logfile = xtrystrdup (pargs->r.ret_str);
         }
@@ -688,6 +706,9 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
     case oOCSPCurrentPeriod: opt.ocsp_current_period = pargs->r.ret_int; break;
 
     case oMaxReplies: opt.max_replies = pargs->r.ret_int; break;
+    case oMaxOpenCrlFiles:
+      opt.max_open_crl_files = pargs->r.ret_int > 0? pargs->r.ret_int : 1;
+      break;
 
     case oHkpCaCert:
       {
@@ -739,6 +760,10 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.connect_quick_timeout = pargs->r.ret_ulong * 1000;
       break;
 
+    case oRequestTimeout:
+      opt.request_timeout = pargs->r.ret_ulong;
+      break;
+
     default:
       return 0; /* Not handled. */
     }
@@ -841,6 +866,10 @@ main (int argc, char **argv)
   struct assuan_malloc_hooks malloc_hooks;
 
   early_system_init ();
+  stats_init ();
+  stats_register ("certcache", cert_cache_stats_report);
+  stats_register ("domaininfo", domaininfo_stats_report);
+  stats_register ("ocspcache", ocsp_cache_stats_report);
   set_strusage (my_strusage);
   log_set_prefix (DIRMNGR_NAME, GPGRT_LOG_WITH_PREFIX | GPGRT_LOG_WITH_PID);
 
@@ -1005,6 +1034,7 @@ main (int argc, char **argv)
         case oHomedir: /* Ignore this option here. */; break;
         case oNoDetach: nodetach = 1; break;
         case oLogFile: logfile = pargs.r.ret_str; break;
+        case oAsyncLog: async_log = 1; break;
         case oCsh: csh_style = 1; break;
         case oSh: csh_style = 0; break;
 	case oLDAPFile:
@@ -1550,6 +1580,9 @@ main (int argc, char **argv)
 static void
 cleanup (void)
 {
+  http_flush_connection_pool (1);
+  ks_hkp_deinit ();
+  ocsp_cache_deinit ();
   crl_cache_deinit ();
   cert_cache_deinit (1);
   reload_dns_stuff (1);
@@ -1861,10 +1894,14 @@ dirmngr_sighup_action (void)
   reread_configuration ();
   cert_cache_deinit (0);
   crl_cache_deinit ();
+  ocsp_cache_deinit ();
   cert_cache_init (hkp_cacert_filenames);
   crl_cache_init ();
   reload_dns_stuff (0);
   ks_hkp_reload ();
+#if USE_LDAP
+  ks_ldap_flush_connection_pool (1);
+#endif
 }
 
 
@@ -1953,15 +1990,21 @@ housekeeping_thread (void *arg)
   dirmngr_init_default_ctrl (&ctrlbuf);
 
   ks_hkp_housekeeping (curtime);
+  http_flush_connection_pool (0);
+#if USE_LDAP
+  ks_ldap_flush_connection_pool (0);
+#endif
   if (network_activity_seen)
     {
       network_activity_seen = 0;
+      ks_hkp_revalidate (&ctrlbuf);
       if (opt.allow_version_check)
         dirmngr_load_swdb (&ctrlbuf, 0);
       workqueue_run_global_tasks (&ctrlbuf, 1);
     }
   else
     workqueue_run_global_tasks (&ctrlbuf, 0);
+  crl_cache_housekeeping (&ctrlbuf, curtime);
 
   dirmngr_deinit_default_ctrl (&ctrlbuf);
 
@@ -2147,6 +2190,11 @@ handle_connections (assuan_fd_t listen_fd)
   int saved_errno;
   int my_inotify_fd = -1;
 
+  /* The log writer thread needs to be started by the daemon process
+   * itself.  */
+  if (async_log && current_logfile)
+    async_log_set_file (current_logfile);
+
   npth_attr_init (&tattr);
   npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
 
@@ -33,6 +33,7 @@
 
 #include "../common/util.h"
 #include "../common/membuf.h"
+#include "../common/stats.h"
 #include "../common/sysutils.h" /* (gnupg_fd_t) */
 #include "../common/asshelp.h"  /* (assuan_context_t) */
 #include "../common/i18n.h"
@@ -101,6 +102,7 @@ struct
 
   unsigned int connect_timeout;       /* Timeout for connect.  */
   unsigned int connect_quick_timeout; /* Shorter timeout for connect.  */
+  unsigned int request_timeout;       /* Timeout for HTTP responses.  */
 
   int disable_http;       /* Do not use HTTP at all.  */
   int disable_ldap;       /* Do not use LDAP at all.  */
@@ -123,6 +125,7 @@ struct
   int allow_ocsp;     /* Allow using OCSP. */
 
   int max_replies;
+  unsigned int max_open_crl_files; /* Limit for open CRL cache files.  */
   unsigned int ldaptimeout;
 
   ldap_server_t ldapservers;
@@ -218,6 +221,9 @@ int dirmngr_use_tor (void);
 /*-- Various housekeeping functions.  --*/
 void ks_hkp_housekeeping (time_t curtime);
 void ks_hkp_reload (void);
+void ks_hkp_revalidate (ctrl_t ctrl);
+void ks_hkp_deinit (void);
+void ks_ldap_flush_connection_pool (int all);
 
 
 /*-- server.c --*/
@@ -248,11 +254,15 @@ gpg_error_t dirmngr_load_swdb (ctrl_t ctrl, int force);
 
 /*-- domaininfo.c --*/
 void domaininfo_print_stats (void);
+void domaininfo_stats_report (stats_sink_t sink);
 int  domaininfo_is_wkd_not_supported (const char *domain);
 void domaininfo_set_no_name (const char *domain);
 void domaininfo_set_wkd_supported (const char *domain);
 void domaininfo_set_wkd_not_supported (const char *domain);
 void domaininfo_set_wkd_not_found (const char *domain);
+gpg_err_code_t domaininfo_get_wkd_miss (const char *domain, const void *hash);
+void domaininfo_put_wkd_miss (const char *domain, const void *hash,
+                              gpg_err_code_t ec);
 
 /*-- workqueue.c --*/
 typedef const char *(*wqtask_t)(ctrl_t ctrl, const char *args);
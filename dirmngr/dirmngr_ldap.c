@@ -105,6 +105,13 @@ static void npth_protect (void) { }
 
 #define DEFAULT_LDAP_TIMEOUT 15 /* Arbitrary long timeout. */
 
+#ifndef USE_LDAPWRAPPER
+/* The maximum number of idle connections kept for reuse and the
+   number of seconds an idle connection is kept.  */
+# define MAX_POOLED_CONNECTIONS 8
+# define POOLED_CONNECTION_TTL 60
+#endif
+
 
 /* Constants for the options.  */
 enum
@@ -180,6 +187,26 @@ struct my_opt_s
 typedef struct my_opt_s *my_opt_t;
 
 
+#ifndef USE_LDAPWRAPPER
+/* An idle bound connection.  Because we run in the process of
+   dirmngr, the connections can be kept and reused by the next query
+   for the same server and user; this saves the connect and bind.  */
+struct pooled_conn_s
+{
+  struct pooled_conn_s *next;
+  LDAP *ld;
+  time_t expires;
+  char *key;   /* Host, port, user and password.  */
+};
+typedef struct pooled_conn_s *pooled_conn_t;
+
+/* The list of idle connections and their number.  The list is only
+   accessed while holding the npth lock.  */
+static pooled_conn_t conn_pool;
+static unsigned int conn_pool_count;
+#endif /*!USE_LDAPWRAPPER*/
+
+
 /* Prototypes.  */
 #ifndef HAVE_W32_SYSTEM
 static void catch_alarm (int dummy);
@@ -399,6 +426,11 @@ alarm_thread (void *arg)
 static void
 set_timeout (my_opt_t myopt)
 {
+#ifndef USE_LDAPWRAPPER
+  /* The alarm would terminate dirmngr; we need to rely on the
+     timeouts of the LDAP functions.  */
+  (void)myopt;
+#else
   if (myopt->alarm_timeout)
     {
 #ifdef HAVE_W32_SYSTEM
@@ -431,6 +463,7 @@ set_timeout (my_opt_t myopt)
       alarm (myopt->alarm_timeout);
 #endif
     }
+#endif /*USE_LDAPWRAPPER*/
 }
 
 
@@ -603,16 +636,176 @@ print_ldap_entries (my_opt_t myopt, LDAP *ld, LDAPMessage *msg, char *want_attr)
 
 
 
+#ifndef USE_LDAPWRAPPER
+/* Return the key for the connection pool.  */
+static char *
+make_pool_key (const char *host, int port, const char *user, const char *pass)
+{
+  /* The length of the user name avoids ambiguities with colons.  */
+  return xtryasprintf ("%s:%d:%u:%s:%s", host, port,
+                       user? (unsigned int)strlen (user) : 0,
+                       user? user : "", pass? pass : "");
+}
+
+
+/* Close the connection and release the pool item CONN.  */
+static void
+release_pooled_conn (pooled_conn_t conn)
+{
+  npth_unprotect ();
+  ldap_unbind (conn->ld);
+  npth_protect ();
+  wipememory (conn->key, strlen (conn->key));
+  xfree (conn->key);
+  xfree (conn);
+}
+
+
+/* Take a connection for KEY from the pool and return it.  Returns
+   NULL if there is none.  Expired connections are closed.  */
+static LDAP *
+get_pooled_conn (const char *key)
+{
+  pooled_conn_t conn, *connp;
+  time_t now = gnupg_get_time ();
+  LDAP *ld = NULL;
+
+  for (connp = &conn_pool; (conn = *connp); )
+    {
+      if (conn->expires <= now || (!ld && !strcmp (conn->key, key)))
+        {
+          *connp = conn->next;
+          conn_pool_count--;
+          if (conn->expires > now)
+            {
+              ld = conn->ld;
+              conn->ld = NULL;
+              wipememory (conn->key, strlen (conn->key));
+              xfree (conn->key);
+              xfree (conn);
+            }
+          else
+            release_pooled_conn (conn);
+          /* The unbind may have released the lock; start over.  */
+          connp = &conn_pool;
+        }
+      else
+        connp = &conn->next;
+    }
+
+  return ld;
+}
+
+
+/* Put the connection LD for KEY into the pool.  If the pool is full
+   the connection is closed.  KEY is owned by this function.  */
+static void
+put_pooled_conn (char *key, LDAP *ld)
+{
+  pooled_conn_t conn;
+
+  if (conn_pool_count >= MAX_POOLED_CONNECTIONS
+      || !(conn = xtrycalloc (1, sizeof *conn)))
+    {
+      npth_unprotect ();
+      ldap_unbind (ld);
+      npth_protect ();
+      wipememory (key, strlen (key));
+      xfree (key);
+      return;
+    }
+
+  conn->ld = ld;
+  conn->key = key;
+  conn->expires = gnupg_get_time () + POOLED_CONNECTION_TTL;
+  conn->next = conn_pool;
+  conn_pool = conn;
+  conn_pool_count++;
+}
+
+
+/* Close all idle connections.  */
+void
+ldap_wrapper_flush_pool (void)
+{
+  pooled_conn_t conn;
+
+  while ((conn = conn_pool))
+    {
+      conn_pool = conn->next;
+      conn_pool_count--;
+      release_pooled_conn (conn);
+    }
+}
+#endif /*!USE_LDAPWRAPPER*/
+
+
+/* Connect to HOST:PORT and bind.  On success the LDAP handle is
+   stored at R_LD and 0 returned.  */
+static int
+connect_ldap (my_opt_t myopt, const char *host, int port, LDAP **r_ld)
+{
+  LDAP *ld;
+  int ret;
+
+  *r_ld = NULL;
+  set_timeout (myopt);
+  npth_unprotect ();
+  ld = my_ldap_init (host, port);
+  npth_protect ();
+  if (!ld)
+    {
+      log_error (_("LDAP init to '%s:%d' failed: %s\n"),
+                 host, port, strerror (errno));
+      return -1;
+    }
+#if !defined(USE_LDAPWRAPPER) && defined(LDAP_OPT_NETWORK_TIMEOUT)
+  /* Without the alarm we need to limit the time for the connect.  */
+  ldap_set_option (ld, LDAP_OPT_NETWORK_TIMEOUT, &myopt->timeout);
+#endif
+  npth_unprotect ();
+  /* Fixme:  Can we use MYOPT->user or is it shared with other theeads?.  */
+  ret = my_ldap_simple_bind_s (ld, myopt->user, myopt->pass);
+  npth_protect ();
+#ifdef LDAP_VERSION3
+  if (ret == LDAP_PROTOCOL_ERROR)
+    {
+      /* Protocol error could mean that the server only supports v3. */
+      int version = LDAP_VERSION3;
+      if (myopt->verbose)
+        log_info ("protocol error; retrying bind with v3 protocol\n");
+      npth_unprotect ();
+      ldap_set_option (ld, LDAP_OPT_PROTOCOL_VERSION, &version);
+      ret = my_ldap_simple_bind_s (ld, myopt->user, myopt->pass);
+      npth_protect ();
+    }
+#endif
+  if (ret)
+    {
+      log_error (_("binding to '%s:%d' failed: %s\n"),
+                 host, port, ldap_err2string (ret));
+      ldap_unbind (ld);
+      return -1;
+    }
+
+  *r_ld = ld;
+  return 0;
+}
+
+
 /* Helper for the URL based LDAP query. */
 static int
 fetch_ldap (my_opt_t myopt, const char *url, const LDAPURLDesc *ludp)
 {
-  LDAP *ld;
+  LDAP *ld = NULL;
   LDAPMessage *msg;
-  int rc = 0;
+  int rc = -1;
   char *host, *dn, *filter, *attrs[2], *attr;
   int port;
-  int ret;
+#ifndef USE_LDAPWRAPPER
+  char *poolkey;
+  int retried = 0;
+#endif
 
   host     = myopt->host?   myopt->host   : ludp->lud_host;
   port     = myopt->port?   myopt->port   : ludp->lud_port;
@@ -666,41 +859,23 @@ fetch_ldap (my_opt_t myopt, const char *url, const LDAPURLDesc *ludp)
     log_info (_("WARNING: using first attribute only\n"));
 
 
-  set_timeout (myopt);
-  npth_unprotect ();
-  ld = my_ldap_init (host, port);
-  npth_protect ();
-  if (!ld)
+#ifndef USE_LDAPWRAPPER
+  poolkey = make_pool_key (host, port, myopt->user, myopt->pass);
+  if (!poolkey)
     {
-      log_error (_("LDAP init to '%s:%d' failed: %s\n"),
-                 host, port, strerror (errno));
+      log_error ("error allocating memory: %s\n", strerror (errno));
       return -1;
     }
-  npth_unprotect ();
-  /* Fixme:  Can we use MYOPT->user or is it shared with other theeads?.  */
-  ret = my_ldap_simple_bind_s (ld, myopt->user, myopt->pass);
-  npth_protect ();
-#ifdef LDAP_VERSION3
-  if (ret == LDAP_PROTOCOL_ERROR)
-    {
-      /* Protocol error could mean that the server only supports v3. */
-      int version = LDAP_VERSION3;
-      if (myopt->verbose)
-        log_info ("protocol error; retrying bind with v3 protocol\n");
-      npth_unprotect ();
-      ldap_set_option (ld, LDAP_OPT_PROTOCOL_VERSION, &version);
-      ret = my_ldap_simple_bind_s (ld, myopt->user, myopt->pass);
-      npth_protect ();
-    }
+  ld = get_pooled_conn (poolkey);
+  if (ld && myopt->verbose)
+    log_info ("reusing connection to '%s:%d'\n", host, port);
 #endif
-  if (ret)
-    {
-      log_error (_("binding to '%s:%d' failed: %s\n"),
-                 host, port, ldap_err2string (ret));
-      ldap_unbind (ld);
-      return -1;
-    }
+  if (!ld && connect_ldap (myopt, host, port, &ld))
+    goto leave;
 
+#ifndef USE_LDAPWRAPPER
+ again:
+#endif
   set_timeout (myopt);
   npth_unprotect ();
   rc = my_ldap_search_st (ld, dn, ludp->lud_scope, filter,
@@ -709,12 +884,27 @@ fetch_ldap (my_opt_t myopt, const char *url, const LDAPURLDesc *ludp)
                           0,
                           &myopt->timeout, &msg);
   npth_protect ();
+#ifndef USE_LDAPWRAPPER
+  if (rc == LDAP_SERVER_DOWN && !retried)
+    {
+      /* The server may have closed the pooled connection.  */
+      retried = 1;
+      ldap_msgfree (msg);
+      ldap_unbind (ld);
+      if (connect_ldap (myopt, host, port, &ld))
+        goto leave;
+      goto again;
+    }
+#endif
   if (rc == LDAP_SIZELIMIT_EXCEEDED && myopt->multi)
     {
       if (es_fwrite ("E\0\0\0\x09truncated", 14, 1, myopt->outstream) != 1)
         {
           log_error (_("error writing to stdout: %s\n"), strerror (errno));
-          return -1;
+          ldap_msgfree (msg);
+          ldap_unbind (ld);
+          rc = -1;
+          goto leave;
         }
     }
   else if (rc)
@@ -727,16 +917,31 @@ fetch_ldap (my_opt_t myopt, const char *url, const LDAPURLDesc *ludp)
 #endif
       if (rc != LDAP_NO_SUCH_OBJECT)
         {
-          /* FIXME: Need deinit (ld)?  */
           /* Hmmm: Do we need to released MSG in case of an error? */
-          return -1;
+          ldap_unbind (ld);
+          rc = -1;
+          goto leave;
         }
     }
 
   rc = print_ldap_entries (myopt, ld, msg, myopt->multi? NULL:attr);
 
   ldap_msgfree (msg);
+#ifndef USE_LDAPWRAPPER
+  put_pooled_conn (poolkey, ld);
+  poolkey = NULL;
+#else
   ldap_unbind (ld);
+#endif
+
+ leave:
+#ifndef USE_LDAPWRAPPER
+  if (poolkey)
+    {
+      wipememory (poolkey, strlen (poolkey));
+      xfree (poolkey);
+    }
+#endif
   return rc;
 }
 
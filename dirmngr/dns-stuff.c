@@ -73,6 +73,7 @@
 #include "./dirmngr-err.h"
 #include "../common/util.h"
 #include "../common/host2net.h"
+#include "../common/tracepoint.h"
 #include "dirmngr-status.h"
 #include "dns-stuff.h"
 
@@ -117,6 +118,16 @@
 
 #define RESOLV_CONF_NAME "/etc/resolv.conf"
 
+/* The maximum number of answers in the DNS cache and the number of
+ * seconds they are kept.  The TTL of the records is used if known
+ * but kept within the given limits.  Negative answers are kept for
+ * DNS_CACHE_NEG_TTL seconds.  */
+#define DNS_CACHE_MAX_ENTRIES  256
+#define DNS_CACHE_TTL          300
+#define DNS_CACHE_MIN_TTL       30
+#define DNS_CACHE_MAX_TTL     3600
+#define DNS_CACHE_NEG_TTL       60
+
 /* Two flags to enable verbose and debug mode.  */
 static int opt_verbose;
 static int opt_debug;
@@ -170,12 +181,43 @@ static int libdns_tor_port;
 #endif /*USE_LIBDNS*/
 
 
+/* An answer in the DNS cache.  The key describes the query.  */
+struct dns_cache_item_s;
+typedef struct dns_cache_item_s *dns_cache_item_t;
+struct dns_cache_item_s
+{
+  dns_cache_item_t next;
+  time_t expires;           /* The time the answer expires.  */
+  unsigned int hits;        /* Number of times the answer was used.  */
+  gpg_error_t err;          /* The error code of a negative answer.  */
+  dns_addrinfo_t ai;        /* The addresses (resolve_dns_name).  */
+  char *str;                /* The canonical name (resolve_dns_name),
+                             * the CNAME (get_dns_cname) or the URL
+                             * (get_dns_cert).  */
+  void *data;               /* The SRV records (get_dns_srv) or the
+                             * key (get_dns_cert).  */
+  size_t datalen;
+  unsigned char *fpr;       /* The fingerprint (get_dns_cert).  */
+  size_t fprlen;
+  char key[1];
+};
+
+/* The DNS cache, most recently used answers first.  It is shared by
+ * all threads.  */
+static dns_cache_item_t dns_cache;
+static unsigned int dns_cache_count;
+
+static void flush_dns_cache (void);
+
+
 /* Calling this function with YES set to True forces the use of the
  * standard resolver even if dirmngr has been built with support for
  * an alternative resolver.  */
 void
 enable_standard_resolver (int yes)
 {
+  if (!standard_resolver != !yes)
+    flush_dns_cache ();
   standard_resolver = yes;
 }
 
@@ -193,6 +235,8 @@ standard_resolver_p (void)
 void
 enable_recursive_resolver (int yes)
 {
+  if (!recursive_resolver != !yes)
+    flush_dns_cache ();
   recursive_resolver = yes;
 #ifdef USE_LIBDNS
   libdns_reinit_pending = 1;
@@ -227,6 +271,10 @@ enable_dns_tormode (int new_circuit)
                       "p%u", counter);
       counter++;
     }
+  /* Do not use answers received outside of Tor or with an older
+   * circuit.  */
+  if (!tor_mode || new_circuit)
+    flush_dns_cache ();
   tor_mode = 1;
 }
 
@@ -235,6 +283,8 @@ enable_dns_tormode (int new_circuit)
 void
 disable_dns_tormode (void)
 {
+  if (tor_mode)
+    flush_dns_cache ();
   tor_mode = 0;
 }
 
@@ -253,6 +303,8 @@ set_dns_verbose (int verbose, int debug)
 void
 set_dns_disable_ipv4 (int yes)
 {
+  if (opt_disable_ipv4 != !!yes)
+    flush_dns_cache ();
   opt_disable_ipv4 = !!yes;
 }
 
@@ -262,6 +314,8 @@ set_dns_disable_ipv4 (int yes)
 void
 set_dns_disable_ipv6 (int yes)
 {
+  if (opt_disable_ipv6 != !!yes)
+    flush_dns_cache ();
   opt_disable_ipv6 = !!yes;
 }
 
@@ -291,6 +345,7 @@ set_dns_nameserver (const char *ipaddr)
   strncpy (tor_nameserver, ipaddr? ipaddr : DEFAULT_NAMESERVER,
            sizeof tor_nameserver -1);
   tor_nameserver[sizeof tor_nameserver -1] = 0;
+  flush_dns_cache ();
 #ifdef USE_LIBDNS
   libdns_reinit_pending = 1;
   libdns_tor_port = 0;  /* Start again with the default port.  */
@@ -672,6 +727,8 @@ libdns_deinit (void)
 void
 reload_dns_stuff (int force)
 {
+  flush_dns_cache ();
+
 #ifdef USE_LIBDNS
   if (force)
     {
@@ -689,6 +746,193 @@ reload_dns_stuff (int force)
 }
 
 
+/* Release the cache item ITEM.  */
+static void
+release_dns_cache_item (dns_cache_item_t item)
+{
+  free_dns_addrinfo (item->ai);
+  xfree (item->str);
+  xfree (item->data);
+  xfree (item->fpr);
+  xfree (item);
+}
+
+
+/* Remove all answers from the DNS cache.  */
+static void
+flush_dns_cache (void)
+{
+  dns_cache_item_t item;
+
+  while ((item = dns_cache))
+    {
+      dns_cache = item->next;
+      release_dns_cache_item (item);
+    }
+  dns_cache_count = 0;
+}
+
+
+/* Return the cached answer for the query described by KEY or NULL.
+ * Expired answers are removed while looking.  */
+static dns_cache_item_t
+get_dns_cache_item (const char *key)
+{
+  dns_cache_item_t item, *itemp;
+  time_t now = gnupg_get_time ();
+
+  for (itemp = &dns_cache; (item = *itemp); )
+    {
+      if (item->expires <= now)
+        {
+          *itemp = item->next;
+          dns_cache_count--;
+          release_dns_cache_item (item);
+          continue;
+        }
+      if (!strcmp (item->key, key))
+        {
+          /* Move to the front.  */
+          *itemp = item->next;
+          item->next = dns_cache;
+          dns_cache = item;
+          item->hits++;
+          if (opt_debug)
+            log_debug ("dns: cache hit for %s\n", key);
+          return item;
+        }
+      itemp = &item->next;
+    }
+  return NULL;
+}
+
+
+/* Return a new cache item for the query KEY with the error code ERR.
+ * TTL is the time to live from the answer or 0 if not known.  The
+ * item is put into the cache and the caller needs to fill in the
+ * data.  Returns NULL if the answer shall not be cached.  */
+static dns_cache_item_t
+new_dns_cache_item (const char *key, gpg_error_t err, unsigned int ttl)
+{
+  dns_cache_item_t item, *itemp;
+  unsigned int count;
+
+  switch (gpg_err_code (err))
+    {
+    case 0:
+      if (!ttl)
+        ttl = DNS_CACHE_TTL;
+      else if (ttl < DNS_CACHE_MIN_TTL)
+        ttl = DNS_CACHE_MIN_TTL;
+      else if (ttl > DNS_CACHE_MAX_TTL)
+        ttl = DNS_CACHE_MAX_TTL;
+      break;
+
+    case GPG_ERR_NO_NAME:
+    case GPG_ERR_NO_DATA:
+    case GPG_ERR_NOT_FOUND:
+      /* The answers do not give us the SOA record and thus we can't
+       * use its minimum field as suggested by RFC-2308.  */
+      ttl = DNS_CACHE_NEG_TTL;
+      break;
+
+    default:
+      return NULL;  /* Do not cache temporary failures.  */
+    }
+
+  item = xtrycalloc (1, sizeof *item + strlen (key));
+  if (!item)
+    return NULL;
+  strcpy (item->key, key);
+  item->err = err;
+  item->expires = gnupg_get_time () + ttl;
+
+  /* Remove an older answer to the same query and the least recently
+   * used answer if the cache is full.  */
+  item->next = dns_cache;
+  dns_cache = item;
+  dns_cache_count++;
+  for (count=1, itemp = &item->next; (item = *itemp); )
+    {
+      if (!strcmp (item->key, key) || count >= DNS_CACHE_MAX_ENTRIES)
+        {
+          *itemp = item->next;
+          dns_cache_count--;
+          release_dns_cache_item (item);
+        }
+      else
+        {
+          count++;
+          itemp = &item->next;
+        }
+    }
+
+  return dns_cache;
+}
+
+
+/* Remove the just created cache item ITEM after an error.  */
+static void
+drop_dns_cache_item (dns_cache_item_t item)
+{
+  dns_cache_item_t *itemp;
+
+  for (itemp = &dns_cache; *itemp; itemp = &(*itemp)->next)
+    if (*itemp == item)
+      {
+        *itemp = item->next;
+        dns_cache_count--;
+        release_dns_cache_item (item);
+        return;
+      }
+}
+
+
+/* Return a copy of the address list AI.  On error NULL is
+ * returned.  */
+static dns_addrinfo_t
+copy_dns_addrinfo (dns_addrinfo_t ai)
+{
+  dns_addrinfo_t head = NULL, *tail = &head;
+
+  for (; ai; ai = ai->next)
+    {
+      *tail = xtrymalloc (sizeof **tail);
+      if (!*tail)
+        {
+          free_dns_addrinfo (head);
+          return NULL;
+        }
+      memcpy (*tail, ai, sizeof **tail);
+      (*tail)->next = NULL;
+      tail = &(*tail)->next;
+    }
+  return head;
+}
+
+
+/* Print the content of the DNS cache using status lines.  */
+gpg_error_t
+dns_cache_dump (ctrl_t ctrl)
+{
+  gpg_error_t err;
+  dns_cache_item_t item;
+  time_t now = gnupg_get_time ();
+
+  err = dirmngr_status_helpf (ctrl, "dns: number of entries: %u",
+                              dns_cache_count);
+  for (item = dns_cache; !err && item; item = item->next)
+    err = dirmngr_status_helpf (ctrl, "dns: %s ttl=%ld hits=%u%s%s",
+                                item->key,
+                                item->expires > now
+                                ? (long)(item->expires - now) : 0L,
+                                item->hits,
+                                item->err? " error=" : "",
+                                item->err? gpg_strerror (item->err) : "");
+  return err;
+}
+
+
 #ifdef USE_LIBDNS
 /*
  * Initialize libdns if needed and open a dns_resolver context.
@@ -1072,6 +1316,39 @@ resolve_dns_name (ctrl_t ctrl, const char *name, unsigned short port,
                   dns_addrinfo_t *r_ai, char **r_canonname)
 {
   gpg_error_t err;
+  char *cachekey = NULL;
+  dns_cache_item_t item;
+
+  GNUPG_TRACE1 (dns_resolve, name);
+
+  /* Numerical addresses do not need the cache.  */
+  if (!is_ip_address (name))
+    cachekey = xtryasprintf ("%s:%hu/%d/%d%s", name, port,
+                             want_family, want_socktype,
+                             r_canonname? "/canon":"");
+  if (cachekey && (item = get_dns_cache_item (cachekey)))
+    {
+      *r_ai = NULL;
+      if (r_canonname)
+        *r_canonname = NULL;
+      err = item->err;
+      if (!err)
+        {
+          *r_ai = copy_dns_addrinfo (item->ai);
+          if (!*r_ai)
+            err = gpg_error_from_syserror ();
+          else if (r_canonname && item->str
+                   && !(*r_canonname = xtrystrdup (item->str)))
+            {
+              err = gpg_error_from_syserror ();
+              free_dns_addrinfo (*r_ai);
+              *r_ai = NULL;
+            }
+        }
+      xfree (cachekey);
+      GNUPG_TRACE2 (dns_resolve_done, name, gpg_err_code (err));
+      return err;
+    }
 
 #ifdef USE_LIBDNS
   if (!standard_resolver)
@@ -1088,6 +1365,17 @@ resolve_dns_name (ctrl_t ctrl, const char *name, unsigned short port,
                                  r_ai, r_canonname);
   if (opt_debug)
     log_debug ("dns: resolve_dns_name(%s): %s\n", name, gpg_strerror (err));
+  GNUPG_TRACE2 (dns_resolve_done, name, gpg_err_code (err));
+
+  if (cachekey && (item = new_dns_cache_item (cachekey, err, 0)) && !err)
+    {
+      item->ai = copy_dns_addrinfo (*r_ai);
+      if (!item->ai
+          || (r_canonname && *r_canonname
+              && !(item->str = xtrystrdup (*r_canonname))))
+        drop_dns_cache_item (item);
+    }
+  xfree (cachekey);
   return err;
 }
 
@@ -1793,6 +2081,8 @@ get_dns_cert (ctrl_t ctrl, const char *name, int want_certtype,
               unsigned char **r_fpr, size_t *r_fprlen, char **r_url)
 {
   gpg_error_t err;
+  char *cachekey;
+  dns_cache_item_t item;
 
   if (r_key)
     *r_key = NULL;
@@ -1802,6 +2092,50 @@ get_dns_cert (ctrl_t ctrl, const char *name, int want_certtype,
   *r_fprlen = 0;
   *r_url = NULL;
 
+  cachekey = xtryasprintf ("CERT/%d%s/%s", want_certtype,
+                           r_key? "/key":"", name);
+  if (cachekey && (item = get_dns_cache_item (cachekey)))
+    {
+      xfree (cachekey);
+      if (item->err)
+        return item->err;
+      if (r_key && item->data)
+        {
+          if (!(*r_key = xtrymalloc (item->datalen)))
+            return gpg_error_from_syserror ();
+          memcpy (*r_key, item->data, item->datalen);
+          if (r_keylen)
+            *r_keylen = item->datalen;
+        }
+      if (item->fpr)
+        {
+          if (!(*r_fpr = xtrymalloc (item->fprlen)))
+            err = gpg_error_from_syserror ();
+          else
+            {
+              memcpy (*r_fpr, item->fpr, item->fprlen);
+              *r_fprlen = item->fprlen;
+              err = 0;
+            }
+        }
+      else
+        err = 0;
+      if (!err && item->str && !(*r_url = xtrystrdup (item->str)))
+        err = gpg_error_from_syserror ();
+      if (err)
+        {
+          if (r_key)
+            {
+              xfree (*r_key);
+              *r_key = NULL;
+            }
+          xfree (*r_fpr);
+          *r_fpr = NULL;
+          *r_fprlen = 0;
+        }
+      return err;
+    }
+
 #ifdef USE_LIBDNS
   if (!standard_resolver)
     {
@@ -1818,6 +2152,35 @@ get_dns_cert (ctrl_t ctrl, const char *name, int want_certtype,
 
   if (opt_debug)
     log_debug ("dns: get_dns_cert(%s): %s\n", name, gpg_strerror (err));
+
+  if (cachekey && (item = new_dns_cache_item (cachekey, err, 0)) && !err)
+    {
+      if (r_key && *r_key && r_keylen)
+        {
+          if ((item->data = xtrymalloc (*r_keylen)))
+            {
+              memcpy (item->data, *r_key, *r_keylen);
+              item->datalen = *r_keylen;
+            }
+          else
+            item->err = gpg_error (GPG_ERR_ENOMEM);
+        }
+      if (*r_fpr)
+        {
+          if ((item->fpr = xtrymalloc (*r_fprlen)))
+            {
+              memcpy (item->fpr, *r_fpr, *r_fprlen);
+              item->fprlen = *r_fprlen;
+            }
+          else
+            item->err = gpg_error (GPG_ERR_ENOMEM);
+        }
+      if (*r_url && !(item->str = xtrystrdup (*r_url)))
+        item->err = gpg_error (GPG_ERR_ENOMEM);
+      if (item->err)
+        drop_dns_cache_item (item);
+    }
+  xfree (cachekey);
   return err;
 }
 
@@ -1841,7 +2204,8 @@ priosort(const void *a,const void *b)
 #ifdef USE_LIBDNS
 static gpg_error_t
 getsrv_libdns (ctrl_t ctrl,
-               const char *name, struct srventry **list, unsigned int *r_count)
+               const char *name, struct srventry **list, unsigned int *r_count,
+               unsigned int *r_ttl)
 {
   gpg_error_t err;
   struct dns_resolver *res = NULL;
@@ -1851,6 +2215,7 @@ getsrv_libdns (ctrl_t ctrl,
   char host[DNS_D_MAXNAME + 1];
   int derr;
   unsigned int srvcount = 0;
+  unsigned int ttl = 0;
 
   err = libdns_res_open (ctrl, &res);
   if (err)
@@ -1902,6 +2267,8 @@ getsrv_libdns (ctrl_t ctrl,
       err = libdns_error_to_gpg_error (dns_srv_parse(&dsrv, &rr, ans));
       if (err)
         goto leave;
+      if (!srvcount || rr.ttl < ttl)
+        ttl = rr.ttl;
 
       newlist = xtryrealloc (*list, (srvcount+1)*sizeof(struct srventry));
       if (!newlist)
@@ -1924,6 +2291,7 @@ getsrv_libdns (ctrl_t ctrl,
     }
 
   *r_count = srvcount;
+  *r_ttl = ttl;
 
  leave:
   if (err)
@@ -2078,6 +2446,9 @@ get_dns_srv (ctrl_t ctrl,
   gpg_error_t err;
   char *namebuffer = NULL;
   unsigned int srvcount;
+  unsigned int ttl = 0;
+  char *cachekey;
+  dns_cache_item_t item;
   int i;
 
   *list = NULL;
@@ -2098,16 +2469,53 @@ get_dns_srv (ctrl_t ctrl,
     }
 
 
-#ifdef USE_LIBDNS
-  if (!standard_resolver)
+  /* The cache holds the unsorted records so that the weighting below
+   * still selects a random order.  */
+  cachekey = xtryasprintf ("SRV/%s", name);
+  if (cachekey && (item = get_dns_cache_item (cachekey)))
     {
-      err = getsrv_libdns (ctrl, name, list, &srvcount);
-      if (err && libdns_switch_port_p (err))
-        err = getsrv_libdns (ctrl, name, list, &srvcount);
+      err = item->err;
+      if (!err && item->datalen)
+        {
+          *list = xtrymalloc (item->datalen);
+          if (!*list)
+            err = gpg_error_from_syserror ();
+          else
+            {
+              memcpy (*list, item->data, item->datalen);
+              srvcount = item->datalen / sizeof (struct srventry);
+            }
+        }
     }
   else
+    {
+#ifdef USE_LIBDNS
+      if (!standard_resolver)
+        {
+          err = getsrv_libdns (ctrl, name, list, &srvcount, &ttl);
+          if (err && libdns_switch_port_p (err))
+            err = getsrv_libdns (ctrl, name, list, &srvcount, &ttl);
+        }
+      else
 #endif /*USE_LIBDNS*/
-    err = getsrv_standard (name, list, &srvcount);
+        err = getsrv_standard (name, list, &srvcount);
+
+      /* No records is cached like a non-existing name.  */
+      if (cachekey
+          && (item = new_dns_cache_item (cachekey,
+                                         (!err && !srvcount)
+                                         ? gpg_error (GPG_ERR_NO_NAME) : err,
+                                         ttl))
+          && !item->err)
+        {
+          item->datalen = srvcount * sizeof (struct srventry);
+          if (!(item->data = xtrymalloc (item->datalen)))
+            drop_dns_cache_item (item);
+          else
+            memcpy (item->data, *list, item->datalen);
+        }
+    }
+  xfree (cachekey);
 
   if (err)
     {
@@ -2364,23 +2772,41 @@ gpg_error_t
 get_dns_cname (ctrl_t ctrl, const char *name, char **r_cname)
 {
   gpg_error_t err;
+  char *cachekey;
+  dns_cache_item_t item;
 
   *r_cname = NULL;
 
+  cachekey = xtryasprintf ("CNAME/%s", name);
+  if (cachekey && (item = get_dns_cache_item (cachekey)))
+    {
+      xfree (cachekey);
+      if (item->err)
+        return item->err;
+      *r_cname = xtrystrdup (item->str);
+      return *r_cname? 0 : gpg_error_from_syserror ();
+    }
+
 #ifdef USE_LIBDNS
   if (!standard_resolver)
     {
       err = get_dns_cname_libdns (ctrl, name, r_cname);
       if (err && libdns_switch_port_p (err))
         err = get_dns_cname_libdns (ctrl, name, r_cname);
-      return err;
     }
+  else
 #endif /*USE_LIBDNS*/
+    {
+      err = get_dns_cname_standard (name, r_cname);
+      if (opt_debug)
+        log_debug ("get_dns_cname(%s)%s%s\n", name,
+                   err ? ": " : " -> ",
+                   err ? gpg_strerror (err) : *r_cname);
+    }
 
-  err = get_dns_cname_standard (name, r_cname);
-  if (opt_debug)
-    log_debug ("get_dns_cname(%s)%s%s\n", name,
-               err ? ": " : " -> ",
-               err ? gpg_strerror (err) : *r_cname);
+  if (cachekey && (item = new_dns_cache_item (cachekey, err, 0)) && !err
+      && !(item->str = xtrystrdup (*r_cname)))
+    drop_dns_cache_item (item);
+  xfree (cachekey);
   return err;
 }
@@ -26,33 +26,77 @@
 #include "dirmngr.h"
 
 
-/* Number of bucket for the hash array and limit for the length of a
- * bucket chain.  For debugging values of 13 and 10 are more suitable
- * and a command like
+/* Initial number of buckets for the hash array.  The array is doubled
+ * whenever the average chain length would exceed MAX_AVG_CHAIN_LEN.
+ * The total number of items is limited to MAX_DOMAINITEMS; if that
+ * limit is reached the least recently used items are removed.  For
+ * debugging values of 16 and 100 are more suitable and a command like
  *   for j   in a b c d e f g h i j k l m n o p q r s t u v w z y z; do \
  *     for i in a b c d e f g h i j k l m n o p q r s t u v w z y z; do \
  *       gpg-connect-agent --dirmngr "wkd_get foo@$i.$j.gnupg.net" /bye \
  *       >/dev/null ; done; done
  * will quickly add a couple of domains.
  */
-#define NO_OF_DOMAINBUCKETS  103
-#define MAX_DOMAINBUCKET_LEN  20
+#define INITIAL_DOMAINBUCKETS  128
+#define MAX_AVG_CHAIN_LEN        2
+#define MAX_DOMAINITEMS      65536
+
+/* The time in seconds after which the information about a domain is
+ * considered outdated.  A positive result is kept longer than a
+ * negative one because a domain seldom drops WKD support.  */
+#define DOMAININFO_TTL       (7*24*3600)
+#define DOMAININFO_NEG_TTL   (24*3600)
+
+/* For each domain the last MAX_WKD_MISSES addresses for which a WKD
+ * query failed are remembered so that a repeated lookup of the same
+ * address returns immediately.  A missing key is remembered for
+ * WKD_MISS_TTL seconds and a network error such as a timeout only for
+ * WKD_MISS_TMP_TTL seconds.  */
+#define MAX_WKD_MISSES          8
+#define WKD_MISS_TTL         3600
+#define WKD_MISS_TMP_TTL      600
+
+
+/* Object to remember a failed WKD query for one address.  */
+struct wkd_miss_s
+{
+  time_t expires;          /* 0 for an unused slot.              */
+  gpg_err_code_t ec;       /* The error returned by the query.   */
+  unsigned char hash[20];  /* SHA-1 hash of the local part.      */
+};
 
 
 /* Object to keep track of a domain name.  */
 struct domaininfo_s
 {
-  struct domaininfo_s *next;
+  struct domaininfo_s *next;         /* Next in the bucket chain.         */
+  struct domaininfo_s *lru_prev;     /* The more recently used item.      */
+  struct domaininfo_s *lru_next;     /* The less recently used item.      */
+  time_t expires;                    /* Time the info becomes outdated.   */
   unsigned int no_name:1;            /* Domain name not found.            */
   unsigned int wkd_not_found:1;      /* A WKD query failed.               */
   unsigned int wkd_supported:1;      /* One WKD entry was found.          */
   unsigned int wkd_not_supported:1;  /* Definitely does not support WKD.  */
+  struct wkd_miss_s *misses;         /* NULL or MAX_WKD_MISSES items.     */
   char name[1];
 };
 typedef struct domaininfo_s *domaininfo_t;
 
 /* And the hashed array.  */
-static domaininfo_t domainbuckets[NO_OF_DOMAINBUCKETS];
+static domaininfo_t *domainbuckets;
+static unsigned int no_of_domainbuckets;  /* A power of 2.  */
+
+/* The number of items.  */
+static unsigned int no_of_domainitems;
+
+/* The list of all items with the most recently used item first.  */
+static domaininfo_t lru_head;
+static domaininfo_t lru_tail;
+
+/* Statistics.  */
+static unsigned int evicted_items;
+static unsigned int expired_items;
+static unsigned int wkd_miss_hits;
 
 
 /* The hash function we use.  Must not call a system function.  */
@@ -75,14 +119,134 @@ hash_domain (const char *domain)
         }
     }
 
-  return hashval % NO_OF_DOMAINBUCKETS;
+  /* Mix the bits because we use only the low bits as index.  */
+  hashval ^= hashval >> 16;
+  hashval *= 0x45d9f3b;
+  hashval ^= hashval >> 16;
+  return hashval;
+}
+
+
+/* Remove DI from the LRU list.  */
+static void
+lru_unlink (domaininfo_t di)
+{
+  if (di->lru_prev)
+    di->lru_prev->lru_next = di->lru_next;
+  else
+    lru_head = di->lru_next;
+  if (di->lru_next)
+    di->lru_next->lru_prev = di->lru_prev;
+  else
+    lru_tail = di->lru_prev;
+  di->lru_prev = di->lru_next = NULL;
+}
+
+
+/* Put DI at the head of the LRU list.  DI must not be in the list.  */
+static void
+lru_push (domaininfo_t di)
+{
+  di->lru_prev = NULL;
+  di->lru_next = lru_head;
+  if (lru_head)
+    lru_head->lru_prev = di;
+  else
+    lru_tail = di;
+  lru_head = di;
+}
+
+
+/* Remove DI from the hash table and the LRU list and release it.  */
+static void
+remove_item (domaininfo_t di)
+{
+  domaininfo_t *dip;
+
+  for (dip = &domainbuckets[hash_domain (di->name)
+                            & (no_of_domainbuckets - 1)];
+       *dip; dip = &(*dip)->next)
+    if (*dip == di)
+      {
+        *dip = di->next;
+        break;
+      }
+  lru_unlink (di);
+  no_of_domainitems--;
+  xfree (di->misses);
+  xfree (di);
+}
+
+
+/* Double the size of the hash array.  On error the old array is
+ * kept.  */
+static void
+grow_table (void)
+{
+  domaininfo_t *newbuckets;
+  domaininfo_t di, dinext;
+  unsigned int newsize, bidx, idx;
+
+  newsize = no_of_domainbuckets? no_of_domainbuckets * 2
+    /**/                       : INITIAL_DOMAINBUCKETS;
+  newbuckets = xtrycalloc (newsize, sizeof *newbuckets);
+  if (!newbuckets)
+    return;  /* Out of core - we ignore this.  */
+
+  /* Note that we must not call a system function here so that other
+   * threads don't see a half moved table.  */
+  for (bidx = 0; bidx < no_of_domainbuckets; bidx++)
+    for (di = domainbuckets[bidx]; di; di = dinext)
+      {
+        dinext = di->next;
+        idx = hash_domain (di->name) & (newsize - 1);
+        di->next = newbuckets[idx];
+        newbuckets[idx] = di;
+      }
+
+  xfree (domainbuckets);
+  domainbuckets = newbuckets;
+  no_of_domainbuckets = newsize;
+}
+
+
+/* Return the item for DOMAIN or NULL if not found.  An outdated item
+ * is removed and NULL returned.  A found item is marked as recently
+ * used.  */
+static domaininfo_t
+find_domain (const char *domain)
+{
+  domaininfo_t di;
+
+  if (!domainbuckets)
+    return NULL;
+
+  for (di = domainbuckets[hash_domain (domain) & (no_of_domainbuckets - 1)];
+       di; di = di->next)
+    if (!strcmp (di->name, domain))
+      {
+        if (di->expires <= gnupg_get_time ())
+          {
+            expired_items++;
+            remove_item (di);
+            return NULL;
+          }
+        if (di != lru_head)
+          {
+            lru_unlink (di);
+            lru_push (di);
+          }
+        return di;
+      }
+
+  return NULL;
 }
 
 
 void
 domaininfo_print_stats (void)
 {
-  int bidx;
+  unsigned int bidx;
   domaininfo_t di;
   int count, no_name, wkd_not_found, wkd_supported, wkd_not_supported;
   int len, minlen, maxlen;
@@ -90,7 +254,7 @@ domaininfo_print_stats (void)
   count = no_name = wkd_not_found = wkd_supported = wkd_not_supported = 0;
   maxlen = 0;
   minlen = -1;
-  for (bidx = 0; bidx < NO_OF_DOMAINBUCKETS; bidx++)
+  for (bidx = 0; bidx < no_of_domainbuckets; bidx++)
     {
       len = 0;
       for (di = domainbuckets[bidx]; di; di = di->next)
@@ -111,11 +275,47 @@ domaininfo_print_stats (void)
       if (minlen == -1 || len < minlen)
         minlen = len;
     }
-  log_info ("domaininfo: items=%d chainlen=%d..%d nn=%d nf=%d ns=%d s=%d\n",
-            count,
+  log_info ("domaininfo: items=%d buckets=%u chainlen=%d..%d"
+            " nn=%d nf=%d ns=%d s=%d evicted=%u expired=%u misshits=%u\n",
+            count, no_of_domainbuckets,
             minlen > 0? minlen : 0,
             maxlen,
-            no_name, wkd_not_found, wkd_not_supported, wkd_supported);
+            no_name, wkd_not_found, wkd_not_supported, wkd_supported,
+            evicted_items, expired_items, wkd_miss_hits);
+}
+
+
+/* Emit the statistics for the stats registry.  */
+void
+domaininfo_stats_report (stats_sink_t sink)
+{
+  domaininfo_t di;
+  unsigned int count, no_name, wkd_not_found, wkd_supported;
+  unsigned int wkd_not_supported;
+
+  count = no_name = wkd_not_found = wkd_supported = wkd_not_supported = 0;
+  for (di = lru_head; di; di = di->lru_next)
+    {
+      count++;
+      if (di->no_name)
+        no_name++;
+      if (di->wkd_not_found)
+        wkd_not_found++;
+      if (di->wkd_supported)
+        wkd_supported++;
+      if (di->wkd_not_supported)
+        wkd_not_supported++;
+    }
+
+  stats_put (sink, "items", count);
+  stats_put (sink, "buckets", no_of_domainbuckets);
+  stats_put (sink, "no_name", no_name);
+  stats_put (sink, "wkd_not_found", wkd_not_found);
+  stats_put (sink, "wkd_supported", wkd_supported);
+  stats_put (sink, "wkd_not_supported", wkd_not_supported);
+  stats_put (sink, "evicted", evicted_items);
+  stats_put (sink, "expired", expired_items);
+  stats_put (sink, "wkd_miss_hits", wkd_miss_hits);
 }
 
 
@@ -126,14 +326,43 @@ domaininfo_is_wkd_not_supported (const char *domain)
 {
   domaininfo_t di;
 
-  for (di = domainbuckets[hash_domain (domain)]; di; di = di->next)
-    if (!strcmp (di->name, domain))
-      return !!di->wkd_not_supported;
+  di = find_domain (domain);
+  if (di)
+    return !!di->wkd_not_supported;
 
   return 0;  /* We don't know.  */
 }
 
 
+/* Return the error code of a recent failed WKD query for the address
+ * with the local part hashed to HASH at DOMAIN or 0 if there was no
+ * such query.  HASH is the 20 byte SHA-1 hash of the local part as
+ * used for the WKD URL.  Note that DOMAIN is expected to be
+ * lowercase.  */
+gpg_err_code_t
+domaininfo_get_wkd_miss (const char *domain, const void *hash)
+{
+  domaininfo_t di;
+  time_t now;
+  int i;
+
+  di = find_domain (domain);
+  if (!di || !di->misses)
+    return 0;
+
+  now = gnupg_get_time ();
+  for (i=0; i < MAX_WKD_MISSES; i++)
+    if (di->misses[i].expires > now
+        && !memcmp (di->misses[i].hash, hash, 20))
+      {
+        wkd_miss_hits++;
+        return di->misses[i].ec;
+      }
+
+  return 0;
+}
+
+
 /* Core update function.  DOMAIN is expected to be lowercase.
  * CALLBACK is called to update the existing or the newly inserted
  * item.  */
@@ -143,17 +372,14 @@ insert_or_update (const char *domain,
 {
   domaininfo_t di;
   domaininfo_t di_new;
-  domaininfo_t di_cut;
   u32 hash;
-  int count;
 
-  hash = hash_domain (domain);
-  for (di = domainbuckets[hash]; di; di = di->next)
-    if (!strcmp (di->name, domain))
-      {
-        callback (di, 0);  /* Update */
-        return;
-      }
+  di = find_domain (domain);
+  if (di)
+    {
+      callback (di, 0);  /* Update */
+      goto set_expires;
+    }
 
   di_new = xtrycalloc (1, sizeof *di + strlen (domain));
   if (!di_new)
@@ -162,41 +388,44 @@ insert_or_update (const char *domain,
 
   /* Need to do another lookup because the malloc is a system call and
    * thus the hash array may have been changed by another thread.  */
-  di_cut = NULL;
-  for (count=0, di = domainbuckets[hash]; di; di = di->next, count++)
-    if (!strcmp (di->name, domain))
-      {
-        callback (di, 0);  /* Update */
-        xfree (di_new);
-        return;
-      }
+  di = find_domain (domain);
+  if (di)
+    {
+      callback (di, 0);  /* Update */
+      xfree (di_new);
+      goto set_expires;
+    }
 
-  /* Before we insert we need to check whether the chain gets too long.  */
-  di_cut = NULL;
-  if (count >= MAX_DOMAINBUCKET_LEN)
+  if (no_of_domainitems + 1 > no_of_domainbuckets * MAX_AVG_CHAIN_LEN)
     {
-      for (count=0, di = domainbuckets[hash]; di; di = di->next, count++)
-        if (count >= MAX_DOMAINBUCKET_LEN/2)
-          {
-            di_cut = di->next;
-            di->next = NULL;
-            break;
-          }
+      grow_table ();
+      if (!domainbuckets)
+        {
+          xfree (di_new);
+          return;  /* Out of core - we ignore this.  */
+        }
+    }
+
+  /* Before we insert we need to check whether the table gets too
+   * large.  */
+  while (no_of_domainitems >= MAX_DOMAINITEMS && lru_tail)
+    {
+      evicted_items++;
+      remove_item (lru_tail);
     }
 
   /* Insert */
   callback (di_new, 1);
   di = di_new;
+  hash = hash_domain (domain) & (no_of_domainbuckets - 1);
   di->next = domainbuckets[hash];
   domainbuckets[hash] = di;
+  lru_push (di);
+  no_of_domainitems++;
 
-  /* Remove the rest of the cutted chain.  */
-  while (di_cut)
-    {
-      di = di_cut->next;
-      xfree (di_cut);
-      di_cut = di;
-    }
+ set_expires:
+  di->expires = gnupg_get_time ()
+    + (di->wkd_supported? DOMAININFO_TTL : DOMAININFO_NEG_TTL);
 }
 
 
@@ -289,3 +518,63 @@ domaininfo_set_wkd_not_found (const char *domain)
 {
   insert_or_update (domain, set_wkd_not_found_cb);
 }
+
+
+/* Helper for domaininfo_put_wkd_miss.  */
+static void
+put_wkd_miss_cb (domaininfo_t di, int insert_mode)
+{
+  (void)di;
+  (void)insert_mode;
+}
+
+
+/* Remember that the WKD query for the address with the local part
+ * hashed to HASH at DOMAIN failed with the error code EC.  */
+void
+domaininfo_put_wkd_miss (const char *domain, const void *hash,
+                         gpg_err_code_t ec)
+{
+  domaininfo_t di;
+  struct wkd_miss_s *misses;
+  time_t now;
+  int i, slot;
+
+  insert_or_update (domain, put_wkd_miss_cb);
+  di = find_domain (domain);
+  if (!di)
+    return;  /* Out of core - we ignore this.  */
+
+  if (!di->misses)
+    {
+      misses = xtrycalloc (MAX_WKD_MISSES, sizeof *misses);
+      if (!misses)
+        return;  /* Out of core - we ignore this.  */
+      /* The malloc may have given another thread the chance to do
+       * the same.  */
+      if (di->misses)
+        xfree (misses);
+      else
+        di->misses = misses;
+    }
+
+  /* Use the slot of the same address or else the one which expires
+   * first.  */
+  now = gnupg_get_time ();
+  for (slot=i=0; i < MAX_WKD_MISSES; i++)
+    {
+      if (di->misses[i].expires > now
+          && !memcmp (di->misses[i].hash, hash, 20))
+        {
+          slot = i;
+          break;
+        }
+      if (di->misses[i].expires < di->misses[slot].expires)
+        slot = i;
+    }
+
+  di->misses[slot].ec = ec;
+  memcpy (di->misses[slot].hash, hash, 20);
+  di->misses[slot].expires = now + (ec == GPG_ERR_NO_DATA? WKD_MISS_TTL
+                                    /**/                 : WKD_MISS_TMP_TTL);
+}
@@ -100,6 +100,7 @@
 #include "../common/util.h"
 #include "../common/i18n.h"
 #include "../common/sysutils.h" /* (gnupg_fd_t) */
+#include "../common/tracepoint.h"
 #include "dns-stuff.h"
 #include "http.h"
 #include "http-common.h"
@@ -128,6 +129,23 @@
 
 #define HTTP_PROXY_ENV           "http_proxy"
 #define MAX_LINELEN 20000  /* Max. length of a HTTP header line. */
+
+/* The maximum number of idle connections kept for reuse and the
+   number of seconds they are kept at most.  */
+/* The delay in milliseconds before the next address of a host is
+   tried while the connection attempts to the previous addresses are
+   still in progress (see RFC-8305) and the maximum number of addresses
+   tried that way.  */
+#define CONNECTION_ATTEMPT_DELAY 250
+#define MAX_CONNECTION_ATTEMPTS  16
+
+#define MAX_POOLED_CONNECTIONS   16
+#define POOLED_CONNECTION_TTL    30
+
+/* The maximum number of TLS sessions kept for resumption and the
+   number of seconds we try to resume them.  */
+#define MAX_RESUMABLE_SESSIONS   32
+#define RESUMABLE_SESSION_TTL    3600
 #define VALID_URI_CHARS "abcdefghijklmnopqrstuvwxyz"   \
                         "ABCDEFGHIJKLMNOPQRSTUVWXYZ"   \
                         "01234567890@"                 \
@@ -152,6 +170,7 @@ static int remove_escapes (char *string);
 static int insert_escapes (char *buffer, const char *string,
                            const char *special);
 static uri_tuple_t parse_tuple (char *string);
+static void flush_resume_cache (void);
 static gpg_error_t send_request (ctrl_t ctrl, http_t hd, const char *httphost,
                                  const char *auth,const char *proxy,
 				 const char *srvtag, unsigned int timeout,
@@ -182,6 +201,7 @@ struct my_socket_s
 {
   assuan_fd_t fd; /* The actual socket - shall never be ASSUAN_INVALID_FD.  */
   int refcount;   /* Number of references to this socket.  */
+  time_t deadline; /* Reads fail after this time; 0 for no deadline.  */
 };
 typedef struct my_socket_s *my_socket_t;
 
@@ -211,10 +231,47 @@ struct cookie_s
      the content length.  */
   uint64_t content_length;
   unsigned int content_length_valid:1;
+
+  /* Set if the connection may be put into the connection pool after
+     the content has been read.  */
+  unsigned int keep_alive:1;
+
+  /* The number of bytes read before the content length was known.  */
+  uint64_t nread;
+
+  /* The malloced key for the connection pool or NULL and the number
+     of seconds the server keeps an idle connection.  */
+  char *pool_key;
+  unsigned int keep_alive_timeout;
 };
 typedef struct cookie_s *cookie_t;
 
 
+/* An idle connection kept for reuse in the connection pool.  */
+struct pooled_conn_s
+{
+  struct pooled_conn_s *next;
+  my_socket_t sock;         /* The socket.  */
+  http_session_t session;   /* The session with the TLS state or NULL.  */
+  time_t expires;           /* Do not use after this time.  */
+  char key[1];              /* The key describing the connection.  */
+};
+typedef struct pooled_conn_s *pooled_conn_t;
+
+
+#if HTTP_USE_GNUTLS
+/* The data to resume a TLS session.  */
+struct resume_item_s
+{
+  struct resume_item_s *next;
+  gnutls_datum_t data;      /* The session data from GnuTLS.  */
+  time_t expires;           /* Do not try to resume after this time.  */
+  char key[1];              /* Server name, port and trust flags.  */
+};
+typedef struct resume_item_s *resume_item_t;
+#endif /*HTTP_USE_GNUTLS*/
+
+
 /* Simple cookie functions.  Here the cookie is an int with the
  * socket. */
 #if defined(HAVE_W32_SYSTEM) && defined(HTTP_USE_NTBTLS)
@@ -251,6 +308,7 @@ struct http_session_s
     unsigned int status; /* Verification status.  */
   } verify;
   char *servername; /* Malloced server name.  */
+  char *resume_key; /* Malloced key for the resumption cache or NULL.  */
 #endif /*USE_TLS*/
   /* A callback function to log details of TLS certifciates.  */
   void (*cert_log_cb) (http_session_t, gpg_error_t, const char *,
@@ -265,6 +323,9 @@ struct http_session_s
 
   /* The connect timeout */
   unsigned int connect_timeout;
+
+  /* The time in seconds to receive a response or 0 for no limit.  */
+  unsigned int request_timeout;
 };
 
 
@@ -304,6 +365,7 @@ struct http_context_s
   size_t buffer_size;
   unsigned int flags;
   header_t headers;      /* Received headers. */
+  char *pool_key;        /* Key for the connection pool or NULL.  */
 };
 
 
@@ -325,6 +387,16 @@ static strlist_t cfg_ca_certlist;
 /* The global callback for net activity.  */
 static void (*netactivity_cb)(void);
 
+/* The idle connections, most recently used first, and their number.  */
+static pooled_conn_t conn_pool;
+static unsigned int conn_pool_count;
+
+#if HTTP_USE_GNUTLS
+/* The cache of resumable TLS sessions, most recent first.  It is
+   shared by all connections of the process.  */
+static resume_item_t resume_cache;
+#endif /*HTTP_USE_GNUTLS*/
+
 
 
 #if defined(HAVE_W32_SYSTEM) && !defined(HTTP_NO_WSASTARTUP)
@@ -391,6 +463,7 @@ _my_socket_new (int lnr, assuan_fd_t fd)
     }
   so->fd = fd;
   so->refcount = 1;
+  so->deadline = 0;
   if (opt_debug)
     log_debug ("http.c:%d:socket_new: object %p for fd %d created\n",
                lnr, so, (int)so->fd);
@@ -437,11 +510,54 @@ _my_socket_unref (int lnr, my_socket_t so,
 #define my_socket_unref(a,b,c) _my_socket_unref (__LINE__,(a),(b),(c))
 
 
+/* Wait until data can be read from SO or its deadline has passed.
+ * Returns 0 if data is available or if SO has no deadline; otherwise
+ * -1 is returned and ERRNO set to ETIMEDOUT or to the error of
+ * select.  */
+static int
+wait_for_data (my_socket_t so)
+{
+  fd_set rset;
+  struct timeval tv;
+  time_t now;
+  int rc;
+
+  if (!so->deadline)
+    return 0;
+
+  do
+    {
+      now = time (NULL);
+      if (now >= so->deadline)
+        {
+          rc = 0;
+          break;
+        }
+      FD_ZERO (&rset);
+      FD_SET (FD2INT (so->fd), &rset);
+      tv.tv_sec = so->deadline - now;
+      tv.tv_usec = 0;
+      rc = my_select (FD2INT (so->fd)+1, &rset, NULL, NULL, &tv);
+    }
+  while (rc == -1 && errno == EINTR);
+
+  if (!rc)
+    {
+      log_info ("network read timed out\n");
+      gpg_err_set_errno (ETIMEDOUT);
+      return -1;
+    }
+  return rc == -1? -1 : 0;
+}
+
+
 #ifdef HTTP_USE_GNUTLS
 static ssize_t
 my_gnutls_read (gnutls_transport_ptr_t ptr, void *buffer, size_t size)
 {
   my_socket_t sock = ptr;
+  if (wait_for_data (sock))
+    return -1;
 #if USE_NPTH
   return npth_read (sock->fd, buffer, size);
 #else
@@ -581,6 +697,10 @@ http_register_tls_ca (const char *fname)
 {
   strlist_t sl;
 
+  /* Connections verified with the old list may not be used anymore.  */
+  http_flush_connection_pool (1);
+  flush_resume_cache ();
+
   if (!fname)
     {
       free_strlist (tls_ca_certlist);
@@ -610,6 +730,9 @@ http_register_cfg_ca (const char *fname)
 {
   strlist_t sl;
 
+  http_flush_connection_pool (1);
+  flush_resume_cache ();
+
   if (!fname)
     {
       free_strlist (cfg_ca_certlist);
@@ -669,6 +792,9 @@ close_tls_session (http_session_t sess)
         gnutls_certificate_free_credentials (sess->certcred);
 # endif /*HTTP_USE_GNUTLS*/
       xfree (sess->servername);
+      sess->servername = NULL;
+      xfree (sess->resume_key);
+      sess->resume_key = NULL;
       sess->tls_session = NULL;
     }
 }
@@ -931,6 +1057,337 @@ http_session_set_timeout (http_session_t sess, unsigned int timeout)
 }
 
 
+/* Set the TIMEOUT in seconds for receiving the response to a request
+ * sent with this session.  The time starts when the request is sent
+ * and a read which does not complete until then fails with
+ * GPG_ERR_ETIMEDOUT.  Using 0 disables the timeout.  */
+void
+http_session_set_request_timeout (http_session_t sess, unsigned int timeout)
+{
+  sess->request_timeout = timeout;
+}
+
+
+
+
+/* Release the pooled connection CONN.  */
+static void
+release_pooled_conn (pooled_conn_t conn)
+{
+  if (opt_debug)
+    log_debug ("http.c:pool: closing connection %s\n", conn->key);
+  my_socket_unref (conn->sock, NULL, NULL);
+  http_session_unref (conn->session);
+  xfree (conn);
+}
+
+
+/* Close the idle connections in the pool.  If ALL is false only
+ * those which are expired are closed.  This should be called from
+ * time to time.  */
+void
+http_flush_connection_pool (int all)
+{
+  pooled_conn_t conn, *connp;
+  time_t now = gnupg_get_time ();
+
+  for (connp = &conn_pool; (conn = *connp); )
+    {
+      if (all || conn->expires <= now)
+        {
+          *connp = conn->next;
+          conn_pool_count--;
+          release_pooled_conn (conn);
+        }
+      else
+        connp = &conn->next;
+    }
+}
+
+
+/* Return the key for the connection pool to reach SERVER and PORT
+ * using HTTPHOST and SRVTAG for the request HD or NULL if the
+ * connection shall not be reused.  */
+static char *
+make_pool_key (http_t hd, const char *httphost,
+               const char *server, unsigned short port, const char *srvtag)
+{
+  unsigned int flags;
+
+  /* For a shutdown we can't reuse the connection and without the
+   * content length we do not know the end of the response.  */
+  if ((hd->flags & (HTTP_FLAG_SHUTDOWN|HTTP_FLAG_IGNORE_CL)))
+    return NULL;
+
+  flags = hd->flags & (HTTP_FLAG_FORCE_TOR
+                       | HTTP_FLAG_IGNORE_IPv4 | HTTP_FLAG_IGNORE_IPv6);
+  if (hd->uri->use_tls)
+    {
+#if HTTP_USE_GNUTLS
+      /* The connection is only reused with the same trust settings
+       * it has been verified with.  */
+      flags |= hd->session->flags & (HTTP_FLAG_TRUST_DEF
+                                     | HTTP_FLAG_TRUST_SYS
+                                     | HTTP_FLAG_TRUST_CFG
+                                     | HTTP_FLAG_NO_CRL);
+#else
+      return NULL;  /* Not yet supported.  */
+#endif
+    }
+
+  return es_bsprintf ("%s://%s:%hu/%s/%s/%u",
+                      hd->uri->use_tls? "https":"http", server, port,
+                      httphost? httphost : "", srvtag? srvtag : "", flags);
+}
+
+
+/* Return true if the idle connection CONN has not been closed by the
+ * server.  Any data available for reading means that the server
+ * closed the connection or sent garbage.  */
+static int
+pooled_conn_alive_p (pooled_conn_t conn)
+{
+  fd_set rfds;
+  struct timeval tv;
+
+#if HTTP_USE_GNUTLS
+  if (conn->session && conn->session->tls_session
+      && gnutls_record_check_pending (conn->session->tls_session))
+    return 0;
+#endif /*HTTP_USE_GNUTLS*/
+
+  FD_ZERO (&rfds);
+  FD_SET (FD2INT (conn->sock->fd), &rfds);
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  /* No need for my_select because we do not wait.  */
+  return !select (FD2INT (conn->sock->fd) + 1, &rfds, NULL, NULL, &tv);
+}
+
+
+/* Take an idle connection to KEY from the pool.  On success the
+ * socket is stored at R_SOCK and the session with the TLS state at
+ * R_SESSION; both references are owned by the caller.  Returns false
+ * if there is no such connection.  */
+static int
+get_pooled_conn (const char *key, my_socket_t *r_sock,
+                 http_session_t *r_session)
+{
+  pooled_conn_t conn, *connp;
+  time_t now = gnupg_get_time ();
+
+  for (connp = &conn_pool; (conn = *connp); )
+    {
+      if (strcmp (conn->key, key))
+        {
+          connp = &conn->next;
+          continue;
+        }
+      *connp = conn->next;
+      conn_pool_count--;
+      if (conn->expires <= now || !pooled_conn_alive_p (conn))
+        {
+          release_pooled_conn (conn);
+          continue;
+        }
+
+      if (opt_debug)
+        log_debug ("http.c:pool: reusing connection %s\n", conn->key);
+      *r_sock = conn->sock;
+      *r_session = conn->session;
+      xfree (conn);
+      return 1;
+    }
+  return 0;
+}
+
+
+/* Put the connection described by the read cookie C into the pool.  */
+static void
+put_pooled_conn (cookie_t c)
+{
+  pooled_conn_t conn, *connp;
+  unsigned int ttl;
+
+  http_flush_connection_pool (0);
+
+  conn = xtrymalloc (sizeof *conn + strlen (c->pool_key));
+  if (!conn)
+    return;
+  strcpy (conn->key, c->pool_key);
+  conn->sock = my_socket_ref (c->sock);
+  conn->session = c->use_tls? http_session_ref (c->session) : NULL;
+  if (conn->session)
+    {
+      /* The verification has been done; the callbacks and their
+       * values may belong to an already terminated request.  */
+      conn->session->verify_cb = NULL;
+      conn->session->verify_cb_value = NULL;
+      conn->session->cert_log_cb = NULL;
+    }
+  ttl = POOLED_CONNECTION_TTL;
+  if (c->keep_alive_timeout && c->keep_alive_timeout <= ttl)
+    ttl = c->keep_alive_timeout > 1? c->keep_alive_timeout - 1 : 1;
+  conn->expires = gnupg_get_time () + ttl;
+
+  conn->next = conn_pool;
+  conn_pool = conn;
+  conn_pool_count++;
+  if (opt_debug)
+    log_debug ("http.c:pool: keeping connection %s\n", conn->key);
+
+  /* Drop the least recently used connection if there are too many.  */
+  if (conn_pool_count > MAX_POOLED_CONNECTIONS)
+    {
+      for (connp = &conn_pool; (*connp)->next; connp = &(*connp)->next)
+        ;
+      conn = *connp;
+      *connp = NULL;
+      conn_pool_count--;
+      release_pooled_conn (conn);
+    }
+}
+
+
+/* Remove all sessions from the TLS resumption cache.  */
+static void
+flush_resume_cache (void)
+{
+#if HTTP_USE_GNUTLS
+  resume_item_t item;
+
+  while ((item = resume_cache))
+    {
+      resume_cache = item->next;
+      gnutls_free (item->data.data);
+      xfree (item);
+    }
+#endif /*HTTP_USE_GNUTLS*/
+}
+
+
+#if HTTP_USE_GNUTLS
+/* Prepare the not yet established TLS session of HD to resume the last
+ * session with SERVER and PORT.  The key for the cache is stored in
+ * the session object so that the session can be saved when closing
+ * the connection.  */
+static void
+setup_session_resumption (http_t hd, unsigned short port)
+{
+  http_session_t sess = hd->session;
+  resume_item_t item, *itemp;
+  time_t now;
+  int rc;
+
+  xfree (sess->resume_key);
+  sess->resume_key = NULL;
+
+  /* With Tor a resumed session would allow the server to link
+   * requests made over different circuits.  */
+  if ((hd->flags & HTTP_FLAG_FORCE_TOR))
+    return;
+
+  /* The session must only be resumed with the same trust settings as
+   * used for the verification of the original session; this is also
+   * why the cache is flushed if the configured CAs change.  */
+  sess->resume_key = es_bsprintf ("%s:%hu/%u", sess->servername, port,
+                                  sess->flags & (HTTP_FLAG_TRUST_DEF
+                                                 | HTTP_FLAG_TRUST_SYS
+                                                 | HTTP_FLAG_TRUST_CFG
+                                                 | HTTP_FLAG_NO_CRL));
+  if (!sess->resume_key)
+    return;
+
+  now = gnupg_get_time ();
+  for (itemp = &resume_cache; (item = *itemp); )
+    {
+      if (item->expires <= now)
+        {
+          *itemp = item->next;
+          gnutls_free (item->data.data);
+          xfree (item);
+          continue;
+        }
+      if (!strcmp (item->key, sess->resume_key))
+        {
+          rc = gnutls_session_set_data (sess->tls_session,
+                                        item->data.data, item->data.size);
+          if (rc < 0)
+            log_info ("gnutls_session_set_data failed: %s\n",
+                      gnutls_strerror (rc));
+          else if (opt_debug)
+            log_debug ("http.c:tls: trying to resume session %s\n",
+                       item->key);
+          return;
+        }
+      itemp = &item->next;
+    }
+}
+
+
+/* Save the TLS session of SESS in the resumption cache.  */
+static void
+save_session_resumption (http_session_t sess)
+{
+  resume_item_t item, *itemp;
+  gnutls_datum_t data;
+  unsigned int count;
+  int rc;
+
+  if (!sess->resume_key || !sess->tls_session
+      || !sess->verify.done || sess->verify.rc)
+    return;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+  /* With TLS 1.3 the data is only usable after a ticket has been
+   * received.  */
+  if (gnutls_protocol_get_version (sess->tls_session) == GNUTLS_TLS1_3
+      && !(gnutls_session_get_flags (sess->tls_session)
+           & GNUTLS_SFLAGS_SESSION_TICKET))
+    return;
+#endif
+
+  rc = gnutls_session_get_data2 (sess->tls_session, &data);
+  if (rc < 0)
+    {
+      log_info ("gnutls_session_get_data2 failed: %s\n", gnutls_strerror (rc));
+      return;
+    }
+
+  item = xtrymalloc (sizeof *item + strlen (sess->resume_key));
+  if (!item)
+    {
+      gnutls_free (data.data);
+      return;
+    }
+  strcpy (item->key, sess->resume_key);
+  item->data = data;
+  item->expires = gnupg_get_time () + RESUMABLE_SESSION_TTL;
+  item->next = resume_cache;
+  resume_cache = item;
+
+  /* Remove an older item for the same key and the oldest item if the
+   * cache is full.  */
+  for (count=1, itemp = &item->next; (item = *itemp); count++)
+    {
+      if (count >= MAX_RESUMABLE_SESSIONS
+          || !strcmp (item->key, sess->resume_key))
+        {
+          *itemp = item->next;
+          gnutls_free (item->data.data);
+          xfree (item);
+          count--;
+        }
+      else
+        itemp = &item->next;
+    }
+
+  /* Save only once per session.  */
+  xfree (sess->resume_key);
+  sess->resume_key = NULL;
+}
+#endif /*HTTP_USE_GNUTLS*/
+
 
 
 /* Start a HTTP retrieval and on success store at R_HD a context
@@ -974,6 +1431,7 @@ http_open (ctrl_t ctrl, http_t *r_hd, http_req_t reqtype, const char *url,
       if (hd->fp_write)
         es_fclose (hd->fp_write);
       http_session_unref (hd->session);
+      xfree (hd->pool_key);
       xfree (hd);
     }
   else
@@ -1150,6 +1608,8 @@ http_wait_response (http_t hd)
   cookie->sock = my_socket_ref (hd->sock);
   cookie->session = http_session_ref (hd->session);
   cookie->use_tls = use_tls;
+  if (hd->pool_key)
+    cookie->pool_key = xtrystrdup (hd->pool_key);
 
   hd->read_cookie = cookie;
   hd->fp_read = es_fopencookie (cookie, "r", cookie_functions);
@@ -1158,12 +1618,14 @@ http_wait_response (http_t hd)
       err = gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
       my_socket_unref (cookie->sock, NULL, NULL);
       http_session_unref (cookie->session);
+      xfree (cookie->pool_key);
       xfree (cookie);
       hd->read_cookie = NULL;
       return err;
     }
 
   err = parse_response (hd);
+  GNUPG_TRACE2 (http_response, hd->status_code, gpg_err_code (err));
 
   if (!err)
     err = es_onclose (hd->fp_read, 1, fp_onclose_notification, hd);
@@ -1228,6 +1690,7 @@ http_close (http_t hd, int keep_read_stream)
       hd->headers = tmp;
     }
   xfree (hd->buffer);
+  xfree (hd->pool_key);
   xfree (hd);
 }
 
@@ -1727,6 +2190,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
   char *proxy_authstr = NULL;
   char *authstr = NULL;
   assuan_fd_t sock;
+  int reused = 0;
 #ifdef USE_TLS
   int have_http_proxy = 0;
 #endif
@@ -1736,6 +2200,8 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
       log_error ("TLS requested but no session object provided\n");
       return gpg_err_make (default_errsource, GPG_ERR_INTERNAL);
     }
+  GNUPG_TRACE3 (http_request, hd->uri->host, hd->uri->port,
+                hd->uri->path);
 #ifdef USE_TLS
   if (hd->uri->use_tls && !hd->session->tls_session)
     {
@@ -1870,8 +2336,28 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
     }
   else
     {
-      err = connect_server (ctrl,
-                            server, port, hd->flags, srvtag, timeout, &sock);
+      http_session_t pooled_session;
+
+      /* Try to reuse an idle connection.  The session of a reused TLS
+       * connection replaces the one passed by the caller because it
+       * holds the state of the connection.  */
+      hd->pool_key = make_pool_key (hd, httphost, server, port, srvtag);
+      if (hd->pool_key
+          && get_pooled_conn (hd->pool_key, &hd->sock, &pooled_session))
+        {
+          err = 0;
+          reused = 1;
+          if (hd->uri->use_tls)
+            {
+              http_session_unref (hd->session);
+              hd->session = pooled_session;
+            }
+          else
+            http_session_unref (pooled_session);
+        }
+      else
+        err = connect_server (ctrl,
+                              server, port, hd->flags, srvtag, timeout, &sock);
     }
 
   if (err)
@@ -1879,12 +2365,21 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
       xfree (proxy_authstr);
       return err;
     }
-  hd->sock = my_socket_new (sock);
-  if (!hd->sock)
+  if (!reused)
     {
-      xfree (proxy_authstr);
-      return gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+      hd->sock = my_socket_new (sock);
+      if (!hd->sock)
+        {
+          xfree (proxy_authstr);
+          return gpg_err_make (default_errsource,
+                               gpg_err_code_from_syserror ());
+        }
     }
+  /* The deadline also covers the TLS handshake.  */
+  if (hd->session && hd->session->request_timeout)
+    hd->sock->deadline = time (NULL) + hd->session->request_timeout;
+  else
+    hd->sock->deadline = 0;
 
 #if USE_TLS
   if (have_http_proxy && hd->uri->use_tls)
@@ -1976,7 +2471,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
 #endif	/* USE_TLS */
 
 #if HTTP_USE_NTBTLS
-  if (hd->uri->use_tls)
+  if (hd->uri->use_tls && !reused)
     {
       estream_t in, out;
 
@@ -2085,7 +2580,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
 
     }
 #elif HTTP_USE_GNUTLS
-  if (hd->uri->use_tls)
+  if (hd->uri->use_tls && !reused)
     {
       int rc;
 
@@ -2095,6 +2590,7 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
                                           my_gnutls_read);
       gnutls_transport_set_push_function (hd->session->tls_session,
                                           my_gnutls_write);
+      setup_session_resumption (hd, port);
 
     handshake_again:
       do
@@ -2203,13 +2699,14 @@ send_request (ctrl_t ctrl, http_t hd, const char *httphost, const char *auth,
         snprintf (portstr, sizeof portstr, ":%u", port);
 
       request = es_bsprintf
-        ("%s %s%s HTTP/1.0\r\nHost: %s%s\r\n%s",
+        ("%s %s%s HTTP/1.0\r\nHost: %s%s\r\n%s%s",
          hd->req_type == HTTP_REQ_GET ? "GET" :
          hd->req_type == HTTP_REQ_HEAD ? "HEAD" :
          hd->req_type == HTTP_REQ_POST ? "POST" : "OOPS",
          *p == '/' ? "" : "/", p,
          httphost? httphost : server,
          portstr,
+         hd->pool_key? "Connection: keep-alive\r\n" : "",
          authstr? authstr:"");
     }
   xfree (p);
@@ -2485,6 +2982,7 @@ parse_response (http_t hd)
   size_t maxlen, len;
   cookie_t cookie = hd->read_cookie;
   const char *s;
+  uint64_t hdrlen = 0;
 
   /* Delete old header lines.  */
   while (hd->headers)
@@ -2507,6 +3005,7 @@ parse_response (http_t hd)
 	return GPG_ERR_TRUNCATED; /* Line has been truncated. */
       if (!len)
 	return GPG_ERR_EOF;
+      hdrlen += len;
 
       if (opt_debug || (hd->flags & HTTP_FLAG_LOG_RESP))
         log_debug_string (line, "http.c:response:\n");
@@ -2550,6 +3049,7 @@ parse_response (http_t hd)
       /* Note, that we can silently ignore truncated lines. */
       if (!len)
 	return GPG_ERR_EOF;
+      hdrlen += len;
       /* Trim line endings of empty lines. */
       if ((*line == '\r' && line[1] == '\n') || *line == '\n')
 	*line = 0;
@@ -2566,6 +3066,7 @@ parse_response (http_t hd)
   while (len && *line);
 
   cookie->content_length_valid = 0;
+  cookie->keep_alive = 0;
   if (!(hd->flags & HTTP_FLAG_IGNORE_CL))
     {
       s = http_get_header (hd, "Content-Length");
@@ -2573,9 +3074,31 @@ parse_response (http_t hd)
         {
           cookie->content_length_valid = 1;
           cookie->content_length = string_to_u64 (s);
+
+          /* Account for the content already read into the stream's
+           * buffer along with the header lines.  */
+          if (cookie->nread - hdrlen > cookie->content_length)
+            cookie->content_length = 0; /* More data than expected.  */
+          else
+            {
+              cookie->content_length -= cookie->nread - hdrlen;
+              cookie->keep_alive = !!cookie->pool_key;
+            }
         }
     }
 
+  /* We sent a HTTP/1.0 request and thus the connection is only kept
+   * if the server says so.  */
+  if (cookie->keep_alive)
+    {
+      s = http_get_header (hd, "Connection");
+      if (!s || !ascii_memistr (s, strlen (s), "keep-alive"))
+        cookie->keep_alive = 0;
+      else if ((s = http_get_header (hd, "Keep-Alive"))
+               && (s = ascii_memistr (s, strlen (s), "timeout=")))
+        cookie->keep_alive_timeout = atoi (s + 8);
+    }
+
   return 0;
 }
 
@@ -2868,12 +3391,203 @@ connect_with_timeout (assuan_fd_t sock,
 }
 
 
+#ifndef HAVE_W32_SYSTEM
+/* Return the current time in milliseconds.  */
+static unsigned long long
+current_msec (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+/* Connect to one of the addresses in AIBUF using the "Happy
+ * Eyeballs" algorithm from RFC-8305: The addresses are tried with
+ * alternating address families and a new connection attempt is
+ * started every CONNECTION_ATTEMPT_DELAY milliseconds or as soon as
+ * an attempt failed, while the earlier attempts are still running.
+ * The first established connection is used.  TIMEOUT is the timeout
+ * in milliseconds for each attempt and must not be 0.  FLAGS are the
+ * HTTP_FLAG_IGNORE_IPv* flags.  On success the socket is stored at
+ * R_SOCK.  R_ANYHOSTADDR is set if an address was tried.  */
+static gpg_error_t
+connect_happy_eyeballs (dns_addrinfo_t aibuf, unsigned int flags,
+                        unsigned int timeout,
+                        assuan_fd_t *r_sock, int *r_anyhostaddr)
+{
+  gpg_error_t err;
+  gpg_error_t last_err = gpg_error (GPG_ERR_UNKNOWN_HOST);
+  dns_addrinfo_t addrs[MAX_CONNECTION_ATTEMPTS];
+  dns_addrinfo_t ai, ai6, ai4;
+  struct {
+    assuan_fd_t sock;
+    int oflags;
+    unsigned long long deadline;
+  } pending[MAX_CONNECTION_ATTEMPTS];
+  int naddrs, nextaddr, npending;
+  int want6, i, n, maxfd, syserr;
+  unsigned long long now, nextstart, waittime;
+  assuan_fd_t sock = ASSUAN_INVALID_FD;
+  fd_set wset;
+  struct timeval tval;
+  socklen_t slen;
+
+  *r_sock = ASSUAN_INVALID_FD;
+
+  /* Interleave the address families starting with the family of the
+   * first address.  */
+  ai6 = ai4 = aibuf;
+  want6 = aibuf && aibuf->family == AF_INET6;
+  for (naddrs = 0; naddrs < MAX_CONNECTION_ATTEMPTS; want6 = !want6)
+    {
+      for (ai = want6? ai6 : ai4; ai; ai = ai->next)
+        if (ai->family == (want6? AF_INET6 : AF_INET))
+          break;
+      if (want6)
+        ai6 = ai? ai->next : NULL;
+      else
+        ai4 = ai? ai->next : NULL;
+      if (ai && !(flags & (want6? HTTP_FLAG_IGNORE_IPv6
+                           /* */ : HTTP_FLAG_IGNORE_IPv4)))
+        addrs[naddrs++] = ai;
+      if (!ai6 && !ai4)
+        break;
+    }
+
+  nextaddr = npending = 0;
+  nextstart = 0;
+  while (nextaddr < naddrs || npending)
+    {
+      now = current_msec ();
+
+      /* Start the next connection attempt if it is time to do so.  */
+      if (nextaddr < naddrs && (!npending || now >= nextstart))
+        {
+          ai = addrs[nextaddr++];
+          *r_anyhostaddr = 1;
+          nextstart = now + CONNECTION_ATTEMPT_DELAY;
+
+          sock = my_sock_new_for_addr (ai->addr, ai->socktype, ai->protocol);
+          if (sock == ASSUAN_INVALID_FD)
+            {
+              last_err = gpg_err_make (default_errsource,
+                                       gpg_err_code_from_syserror ());
+              log_error ("error creating socket: %s\n",
+                         gpg_strerror (last_err));
+              continue;
+            }
+          pending[npending].sock = sock;
+          pending[npending].oflags = fcntl (sock, F_GETFL, 0);
+          pending[npending].deadline = now + timeout;
+          if (fcntl (sock, F_SETFL, pending[npending].oflags | O_NONBLOCK))
+            {
+              last_err = gpg_err_make (default_errsource,
+                                       gpg_err_code_from_syserror ());
+              assuan_sock_close (sock);
+              continue;
+            }
+          npending++;
+          if (!assuan_sock_connect (sock, (struct sockaddr *)ai->addr,
+                                    ai->addrlen))
+            {
+              i = npending - 1;
+              goto connected; /* Immediate connect.  */
+            }
+          err = gpg_err_make (default_errsource,
+                              gpg_err_code_from_syserror ());
+          if (gpg_err_code (err) != GPG_ERR_EINPROGRESS)
+            {
+              last_err = err;
+              assuan_sock_close (sock);
+              npending--;
+              nextstart = now;  /* Try the next address right away.  */
+            }
+          continue;
+        }
+
+      /* Wait for one of the pending connections or the time to start
+       * the next attempt.  */
+      if (nextaddr < naddrs)
+        waittime = nextstart > now? nextstart - now : 0;
+      else
+        waittime = timeout;
+      FD_ZERO (&wset);
+      maxfd = -1;
+      for (i=0; i < npending; i++)
+        {
+          FD_SET (FD2INT (pending[i].sock), &wset);
+          if (FD2INT (pending[i].sock) > maxfd)
+            maxfd = FD2INT (pending[i].sock);
+          if (pending[i].deadline <= now)
+            waittime = 0;
+          else if (pending[i].deadline - now < waittime)
+            waittime = pending[i].deadline - now;
+        }
+      tval.tv_sec = waittime / 1000;
+      tval.tv_usec = (waittime % 1000) * 1000;
+      n = my_select (maxfd+1, NULL, &wset, NULL, &tval);
+      if (n < 0)
+        {
+          last_err = gpg_err_make (default_errsource,
+                                   gpg_err_code_from_syserror ());
+          break;
+        }
+
+      now = current_msec ();
+      for (i=0; i < npending; i++)
+        {
+          if (FD_ISSET (FD2INT (pending[i].sock), &wset))
+            {
+              slen = sizeof (syserr);
+              if (getsockopt (FD2INT (pending[i].sock), SOL_SOCKET, SO_ERROR,
+                              (void*)&syserr, &slen) < 0)
+                err = gpg_err_make (default_errsource,
+                                    gpg_err_code_from_syserror ());
+              else if (syserr)
+                err = gpg_err_make (default_errsource,
+                                    gpg_err_code_from_errno (syserr));
+              else
+                goto connected;
+              nextstart = now;  /* Try the next address right away.  */
+            }
+          else if (pending[i].deadline <= now)
+            err = gpg_err_make (default_errsource, GPG_ERR_ETIMEDOUT);
+          else
+            continue;
+
+          last_err = err;
+          assuan_sock_close (pending[i].sock);
+          pending[i--] = pending[--npending];
+        }
+    }
+
+  for (i=0; i < npending; i++)
+    assuan_sock_close (pending[i].sock);
+  return last_err;
+
+ connected:
+  /* Restore the flags of the established connection and close the
+   * other ones.  */
+  sock = pending[i].sock;
+  fcntl (sock, F_SETFL, pending[i].oflags);
+  pending[i] = pending[--npending];
+  for (i=0; i < npending; i++)
+    assuan_sock_close (pending[i].sock);
+  *r_sock = sock;
+  return 0;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
 /* Actually connect to a server.  On success 0 is returned and the
  * file descriptor for the socket is stored at R_SOCK; on error an
  * error code is returned and ASSUAN_INVALID_FD is stored at R_SOCK.
  * TIMEOUT is the connect timeout in milliseconds.  Note that the
  * function tries to connect to all known addresses and the timeout is
- * for each one. */
+ * for each one.  With a timeout the connection attempts overlap as
+ * described for connect_happy_eyeballs.  */
 static gpg_error_t
 connect_server (ctrl_t ctrl, const char *server, unsigned short port,
                 unsigned int flags, const char *srvtag, unsigned int timeout,
@@ -2970,6 +3684,25 @@ connect_server (ctrl_t ctrl, const char *server, unsigned short port,
         }
       hostfound = 1;
 
+#ifndef HAVE_W32_SYSTEM
+      /* Without a timeout we can't use non-blocking sockets; for
+       * example in Tor mode the SOCKS handshake is done by connect.  */
+      if (timeout)
+        {
+          err = connect_happy_eyeballs (aibuf, flags, timeout,
+                                        &sock, &anyhostaddr);
+          if (err)
+            last_err = err;
+          else
+            {
+              connected = 1;
+              notify_netactivity ();
+            }
+          free_dns_addrinfo (aibuf);
+          continue;
+        }
+#endif /*!HAVE_W32_SYSTEM*/
+
       for (ai = aibuf; ai && !connected; ai = ai->next)
         {
           if (ai->family == AF_INET && (flags & HTTP_FLAG_IGNORE_IPv4))
@@ -3188,6 +3921,8 @@ cookie_read (void *cookie, void *buffer, size_t size)
   else
 #endif /*HTTP_USE_GNUTLS*/
     {
+      if (wait_for_data (c->sock))
+        return -1;
       nread = read_server (c->sock->fd, buffer, size);
     }
 
@@ -3198,6 +3933,8 @@ cookie_read (void *cookie, void *buffer, size_t size)
       else
         c->content_length = 0;
     }
+  else if (nread > 0)
+    c->nread += nread;
 
   return (gpgrt_ssize_t)nread;
 }
@@ -3331,6 +4068,13 @@ cookie_close (void *cookie)
   if (!c)
     return 0;
 
+  /* Keep the connection if the entire content has been read.  */
+  if (c->keep_alive && c->pool_key && c->sock
+      && c->content_length_valid && !c->content_length
+      && (!c->use_tls || c->session))
+    put_pooled_conn (c);
+  xfree (c->pool_key);
+
 #if HTTP_USE_NTBTLS
   if (c->use_tls && c->session && c->session->tls_session)
     {
@@ -3341,7 +4085,10 @@ cookie_close (void *cookie)
   else
 #elif HTTP_USE_GNUTLS
   if (c->use_tls && c->session && c->session->tls_session)
-    my_socket_unref (c->sock, send_gnutls_bye, c->session->tls_session);
+    {
+      save_session_resumption (c->session);
+      my_socket_unref (c->sock, send_gnutls_bye, c->session->tls_session);
+    }
   else
 #endif /*HTTP_USE_GNUTLS*/
     if (c->sock)
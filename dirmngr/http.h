@@ -113,6 +113,7 @@ void http_register_tls_callback (gpg_error_t (*cb)(http_t,http_session_t,int));
 void http_register_tls_ca (const char *fname);
 void http_register_cfg_ca (const char *fname);
 void http_register_netactivity_cb (void (*cb)(void));
+void http_flush_connection_pool (int all);
 
 
 gpg_error_t http_session_new (http_session_t *r_session,
@@ -128,6 +129,8 @@ void http_session_set_log_cb (http_session_t sess,
                                          const char *,
                                          const void **, size_t *));
 void http_session_set_timeout (http_session_t sess, unsigned int timeout);
+void http_session_set_request_timeout (http_session_t sess,
+                                       unsigned int timeout);
 
 
 gpg_error_t http_parse_uri (parsed_uri_t *ret_uri, const char *uri,
@@ -244,7 +244,21 @@ ks_action_get (ctrl_t ctrl, uri_item_t keyservers,
 		 || strcmp (uri->parsed_uri->scheme, "ldapi") == 0);
 #endif
 
-      if (is_hkp_s || is_http_s || is_ldap)
+      if (is_hkp_s && patterns->next)
+        {
+          gpg_error_t key_err;
+          int key_data;
+
+          /* Several keys are retrieved concurrently.  */
+          any_server = 1;
+          err = ks_hkp_get_many (ctrl, uri->parsed_uri, patterns, outfp,
+                                 &key_err, &key_data);
+          if (key_err)
+            first_err = key_err;
+          if (key_data)
+            any_data = 1;
+        }
+      else if (is_hkp_s || is_http_s || is_ldap)
         {
           any_server = 1;
           for (sl = patterns; !err && sl; sl = sl->next)
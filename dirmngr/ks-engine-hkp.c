@@ -34,10 +34,12 @@
 # include <sys/socket.h>
 # include <netdb.h>
 #endif /*!HAVE_W32_SYSTEM*/
+#include <npth.h>
 
 #include "dirmngr.h"
 #include "misc.h"
 #include "../common/userids.h"
+#include "../common/sysutils.h"
 #include "dns-stuff.h"
 #include "ks-engine.h"
 
@@ -57,6 +59,10 @@
 /* Number of seconds after a host is marked as resurrected.  */
 #define RESURRECT_INTERVAL  (3600+1800)  /* 1.5 hours */
 
+/* The weight of a new sample for the response time and error rate
+   averages of a host is 1/HOST_STATS_WEIGHT.  */
+#define HOST_STATS_WEIGHT   8
+
 /* To match the behaviour of our old gpgkeys helper code we escape
    more characters than actually needed. */
 #define EXTRA_ESCAPE_CHARS "@!\"#$%&'()*+,-./:;<=>?[\\]^_{|}~"
@@ -67,6 +73,15 @@
 /* Number of retries done for a dead host etc.  */
 #define SEND_REQUEST_RETRIES 3
 
+/* The maximum number of keys retrieved concurrently by
+   ks_hkp_get_many.  */
+#define MAX_CONCURRENT_GETS 4
+
+/* The file in the cache directory used to keep the hosttable across
+   restarts and its version.  */
+#define HOSTTABLE_FILE "hkphosts.txt"
+#define HOSTTABLE_VERSION 1
+
 enum ks_protocol { KS_PROTOCOL_HKP, KS_PROTOCOL_HKPS, KS_PROTOCOL_MAX };
 
 /* Objects used to maintain information about hosts.  */
@@ -92,6 +107,9 @@ struct hostinfo_s
   unsigned int did_srv_lookup:2;  /* One bit per protocol indicating
                                      whether we already did a SRV
                                      lookup.  */
+  unsigned int from_file:1;       /* The lookups were done by an
+                                     earlier process and need to be
+                                     revalidated.  */
   time_t died_at;    /* The time the host was marked dead.  If this is
                         0 the host has been manually marked dead.  */
   char *cname;       /* Canonical name of the host.  Only set if this
@@ -100,6 +118,10 @@ struct hostinfo_s
   unsigned short port[KS_PROTOCOL_MAX];
                      /* The port used by the host for all protocols, 0
                         if unknown.  */
+  unsigned int rtt;  /* Moving average of the response time in
+                        milliseconds or 0 if not known.  */
+  unsigned int errrate; /* Moving average of the failed requests in
+                           units of 1/1000.  */
   char name[1];      /* The hostname.  */
 };
 
@@ -112,6 +134,14 @@ static int hosttable_size;
 /* The number of host slots we initially allocate for HOSTTABLE.  */
 #define INITIAL_HOSTTABLE_SIZE 50
 
+/* Flags to keep track of the hosttable file.  HOSTTABLE_DIRTY is set
+   if the table has changed since it was read or written.  */
+static int hosttable_loaded;
+static int hosttable_dirty;
+
+static void load_hosttable (void);
+static void save_hosttable (void);
+
 
 /* Create a new hostinfo object, fill in NAME and put it into
    HOSTTABLE.  Return the index into hosttable on success or -1 on
@@ -139,12 +169,16 @@ create_new_hostinfo (const char *name)
   hi->dead = 0;
   hi->did_a_lookup = 0;
   hi->did_srv_lookup = 0;
+  hi->from_file = 0;
   hi->iporname_valid = 0;
   hi->died_at = 0;
   hi->cname = NULL;
   hi->iporname = NULL;
   hi->port[KS_PROTOCOL_HKP] = 0;
   hi->port[KS_PROTOCOL_HKPS] = 0;
+  hi->rtt = 0;
+  hi->errrate = 0;
+  hosttable_dirty = 1;
 
   /* Add it to the hosttable. */
   for (idx=0; idx < hosttable_size; idx++)
@@ -180,6 +214,7 @@ find_hostinfo (const char *name)
 {
   int idx;
 
+  load_hosttable ();
   for (idx=0; idx < hosttable_size; idx++)
     if (hosttable[idx] && !ascii_strcasecmp (hosttable[idx]->name, name))
       return idx;
@@ -215,9 +250,21 @@ host_in_pool_p (hostinfo_t hi, int tblidx)
 }
 
 
+/* Return a cost for using the host HI which is lower for hosts which
+   answered faster and failed less often.  Hosts without a known
+   response time have the lowest cost so that they are tried.  */
+static unsigned long
+host_cost (hostinfo_t hi)
+{
+  return (unsigned long)hi->rtt * (1000 + 4 * hi->errrate) / 1000;
+}
+
+
 /* Select a random host.  Consult HI->pool which indices into the global
    hosttable.  Returns index into HI->pool or -1 if no host could be
-   selected.  */
+   selected.  Two hosts are picked at random and the one with the lower
+   cost is used; this prefers the fast hosts without sending all
+   requests to the fastest one.  */
 static int
 select_random_host (hostinfo_t hi)
 {
@@ -247,7 +294,17 @@ select_random_host (hostinfo_t hi)
   if (tblsize == 1)  /* Save a get_uint_nonce.  */
     pidx = tbl[0];
   else
-    pidx = tbl[get_uint_nonce () % tblsize];
+    {
+      unsigned int n1, n2;
+
+      n1 = get_uint_nonce () % tblsize;
+      n2 = get_uint_nonce () % (tblsize - 1);
+      if (n2 >= n1)
+        n2++;
+      pidx = tbl[n1];
+      if (host_cost (hosttable[tbl[n2]]) < host_cost (hosttable[pidx]))
+        pidx = tbl[n2];
+    }
 
   xfree (tbl);
   return pidx;
@@ -372,6 +429,7 @@ add_host (ctrl_t ctrl, const char *name, int is_pool,
         }
       else  /* Set or update the entry. */
         {
+          hosttable_dirty = 1;
           if (port)
             hosttable[tmpidx]->port[protocol] = port;
 
@@ -434,63 +492,23 @@ hostinfo_sort_pool (hostinfo_t hi)
   qsort (hi->pool, hi->pool_len, sizeof *hi->pool, sort_hostpool);
 }
 
-/* Map the host name NAME to the actual to be used host name.  This
- * allows us to manage round robin DNS names.  We use our own strategy
- * to choose one of the hosts.  For example we skip those hosts which
- * failed for some time and we stick to one host for a time
- * independent of DNS retry times.  If FORCE_RESELECT is true a new
- * host is always selected.  If SRVTAG is NULL no service record
- * lookup will be done, if it is set that service name is used.  The
- * selected host is stored as a malloced string at R_HOST; on error
- * NULL is stored.  If we know the port used by the selected host from
- * a service record, a string representation is written to R_PORTSTR,
- * otherwise it is left untouched.  If R_HTTPFLAGS is not NULL it will
- * receive flags which are to be passed to http_open.  If R_HTTPHOST
- * is not NULL a malloced name of the host is stored there; this might
- * be different from R_HOST in case it has been selected from a
- * pool.  */
+/* Do the DNS lookups for the host HI unless they have already been
+ * done and add the found addresses to the hosttable.  If SRVTAG is
+ * not NULL a service record lookup is done for PROTOCOL.  If HI turns
+ * out to be a pool, its member hosts are stored in its pool.  */
 static gpg_error_t
-map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
-          enum ks_protocol protocol, char **r_host, char *r_portstr,
-          unsigned int *r_httpflags, char **r_httphost)
+lookup_hostinfo (ctrl_t ctrl, hostinfo_t hi, const char *srvtag,
+                 enum ks_protocol protocol)
 {
-  gpg_error_t err = 0;
-  hostinfo_t hi;
-  int idx;
+  gpg_error_t err;
   dns_addrinfo_t aibuf, ai;
   int is_pool;
   int new_hosts = 0;
   char *cname;
 
-  *r_host = NULL;
-  if (r_httpflags)
-    *r_httpflags = 0;
-  if (r_httphost)
-    *r_httphost = NULL;
-
-  /* No hostname means localhost.  */
-  if (!name || !*name)
-    {
-      *r_host = xtrystrdup ("localhost");
-      return *r_host? 0 : gpg_error_from_syserror ();
-    }
-
-  /* See whether the host is in our table.  */
-  idx = find_hostinfo (name);
-  if (idx == -1)
-    {
-      idx = create_new_hostinfo (name);
-      if (idx == -1)
-        return gpg_error_from_syserror ();
-      hi = hosttable[idx];
-      hi->onion = is_onion_address (name);
-    }
-  else
-    hi = hosttable[idx];
-
   is_pool = hi->pool != NULL;
 
-  if (srvtag && !is_ip_address (name)
+  if (srvtag && !is_ip_address (hi->name)
       && ! hi->onion
       && ! (hi->did_srv_lookup & 1 << protocol))
     {
@@ -498,7 +516,7 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
       unsigned int srvscount;
 
       /* Check for SRV records.  */
-      err = get_dns_srv (ctrl, name, srvtag, NULL, &srvs, &srvscount);
+      err = get_dns_srv (ctrl, hi->name, srvtag, NULL, &srvs, &srvscount);
       if (err)
         {
           if (gpg_err_code (err) == GPG_ERR_ECONNREFUSED)
@@ -520,7 +538,7 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
               if (err)
                 continue;
               dirmngr_tick (ctrl);
-              add_host (ctrl, name, is_pool, ai, protocol, srvs[i].port);
+              add_host (ctrl, hi->name, is_pool, ai, protocol, srvs[i].port);
               new_hosts = 1;
             }
 
@@ -528,6 +546,7 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
         }
 
       hi->did_srv_lookup |= 1 << protocol;
+      hosttable_dirty = 1;
     }
 
   if (! hi->did_a_lookup
@@ -535,10 +554,12 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
     {
       /* Find all A records for this entry and put them into the pool
          list - if any.  */
-      err = resolve_dns_name (ctrl, name, 0, 0, SOCK_STREAM, &aibuf, &cname);
+      err = resolve_dns_name (ctrl, hi->name, 0, 0, SOCK_STREAM,
+                              &aibuf, &cname);
       if (err)
         {
-          log_error ("resolving '%s' failed: %s\n", name, gpg_strerror (err));
+          log_error ("resolving '%s' failed: %s\n",
+                     hi->name, gpg_strerror (err));
           err = 0;
         }
       else
@@ -552,6 +573,7 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
             is_pool = arecords_is_pool (aibuf);
           if (is_pool && cname)
             {
+              xfree (hi->cname);
               hi->cname = cname;
               cname = NULL;
             }
@@ -566,11 +588,12 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
                 continue;
               dirmngr_tick (ctrl);
 
-              add_host (ctrl, name, is_pool, ai, 0, 0);
+              add_host (ctrl, hi->name, is_pool, ai, 0, 0);
               new_hosts = 1;
             }
 
           hi->did_a_lookup = 1;
+          hosttable_dirty = 1;
         }
       xfree (cname);
       free_dns_addrinfo (aibuf);
@@ -578,6 +601,65 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
   if (new_hosts)
     hostinfo_sort_pool (hi);
 
+  return 0;
+}
+
+
+/* Map the host name NAME to the actual to be used host name.  This
+ * allows us to manage round robin DNS names.  We use our own strategy
+ * to choose one of the hosts.  For example we skip those hosts which
+ * failed for some time and we stick to one host for a time
+ * independent of DNS retry times.  If FORCE_RESELECT is true a new
+ * host is always selected.  If SRVTAG is NULL no service record
+ * lookup will be done, if it is set that service name is used.  The
+ * selected host is stored as a malloced string at R_HOST; on error
+ * NULL is stored.  If we know the port used by the selected host from
+ * a service record, a string representation is written to R_PORTSTR,
+ * otherwise it is left untouched.  If R_HTTPFLAGS is not NULL it will
+ * receive flags which are to be passed to http_open.  If R_HTTPHOST
+ * is not NULL a malloced name of the host is stored there; this might
+ * be different from R_HOST in case it has been selected from a
+ * pool.  */
+static gpg_error_t
+map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
+          enum ks_protocol protocol, char **r_host, char *r_portstr,
+          unsigned int *r_httpflags, char **r_httphost)
+{
+  gpg_error_t err = 0;
+  hostinfo_t hi;
+  int idx;
+  dns_addrinfo_t aibuf, ai;
+
+  *r_host = NULL;
+  if (r_httpflags)
+    *r_httpflags = 0;
+  if (r_httphost)
+    *r_httphost = NULL;
+
+  /* No hostname means localhost.  */
+  if (!name || !*name)
+    {
+      *r_host = xtrystrdup ("localhost");
+      return *r_host? 0 : gpg_error_from_syserror ();
+    }
+
+  /* See whether the host is in our table.  */
+  idx = find_hostinfo (name);
+  if (idx == -1)
+    {
+      idx = create_new_hostinfo (name);
+      if (idx == -1)
+        return gpg_error_from_syserror ();
+      hi = hosttable[idx];
+      hi->onion = is_onion_address (name);
+    }
+  else
+    hi = hosttable[idx];
+
+  err = lookup_hostinfo (ctrl, hi, srvtag, protocol);
+  if (err)
+    return err;
+
   if (hi->pool)
     {
       /* Deal with the pool name before selecting a host. */
@@ -693,16 +775,16 @@ map_host (ctrl_t ctrl, const char *name, const char *srvtag, int force_reselect,
 }
 
 
-/* Mark the host NAME as dead.  NAME may be given as an URL.  Returns
-   true if a host was really marked as dead or was already marked dead
-   (e.g. by a concurrent session).  */
+/* Return the index into the hosttable for the host NAME or -1 if
+   not found.  NAME may be given as an URL.  Localhost is never
+   found.  */
 static int
-mark_host_dead (const char *name)
+find_hostinfo_by_url (const char *name)
 {
   const char *host;
   char *host_buffer = NULL;
   parsed_uri_t parsed_uri = NULL;
-  int done = 0;
+  int idx = -1;
 
   if (name && *name && !http_parse_uri (&parsed_uri, name, 1))
     {
@@ -710,7 +792,7 @@ mark_host_dead (const char *name)
         {
           host_buffer = strconcat ("[", parsed_uri->host, "]", NULL);
           if (!host_buffer)
-            log_error ("out of core in mark_host_dead");
+            log_error ("out of core in find_hostinfo_by_url");
           host = host_buffer;
         }
       else
@@ -720,27 +802,62 @@ mark_host_dead (const char *name)
     host = name;
 
   if (host && *host && strcmp (host, "localhost"))
-    {
-      hostinfo_t hi;
-      int idx;
-
-      idx = find_hostinfo (host);
-      if (idx != -1)
-        {
-          hi = hosttable[idx];
-          log_info ("marking host '%s' as dead%s\n",
-                    hi->name, hi->dead? " (again)":"");
-          hi->dead = 1;
-          hi->died_at = gnupg_get_time ();
-          if (!hi->died_at)
-            hi->died_at = 1;
-          done = 1;
-        }
-    }
+    idx = find_hostinfo (host);
 
   http_release_parsed_uri (parsed_uri);
   xfree (host_buffer);
-  return done;
+  return idx;
+}
+
+
+/* Mark the host NAME as dead.  NAME may be given as an URL.  Returns
+   true if a host was really marked as dead or was already marked dead
+   (e.g. by a concurrent session).  */
+static int
+mark_host_dead (const char *name)
+{
+  hostinfo_t hi;
+  int idx;
+
+  idx = find_hostinfo_by_url (name);
+  if (idx == -1)
+    return 0;
+
+  hi = hosttable[idx];
+  log_info ("marking host '%s' as dead%s\n",
+            hi->name, hi->dead? " (again)":"");
+  hi->dead = 1;
+  hi->died_at = gnupg_get_time ();
+  if (!hi->died_at)
+    hi->died_at = 1;
+  hosttable_dirty = 1;
+  return 1;
+}
+
+
+/* Update the statistics of the host NAME, which may be given as an
+   URL, with a request which took MSEC milliseconds.  FAILED is true
+   if the host did not answer the request.  */
+static void
+update_host_stats (const char *name, unsigned int msec, int failed)
+{
+  hostinfo_t hi;
+  int idx;
+
+  idx = find_hostinfo_by_url (name);
+  if (idx == -1)
+    return;
+  hi = hosttable[idx];
+
+  if (!msec)
+    msec = 1;  /* 0 means unknown.  */
+  if (!hi->rtt)
+    hi->rtt = msec;
+  else
+    hi->rtt = (hi->rtt * (HOST_STATS_WEIGHT - 1) + msec) / HOST_STATS_WEIGHT;
+  hi->errrate = ((hi->errrate * (HOST_STATS_WEIGHT - 1)
+                  + (failed? 1000 : 0)) / HOST_STATS_WEIGHT);
+  hosttable_dirty = 1;
 }
 
 
@@ -760,6 +877,7 @@ ks_hkp_mark_host (ctrl_t ctrl, const char *name, int alive)
   if (idx == -1)
     return gpg_error (GPG_ERR_NOT_FOUND);
 
+  hosttable_dirty = 1;
   hi = hosttable[idx];
   if (alive && hi->dead)
     {
@@ -838,6 +956,7 @@ ks_hkp_print_hosttable (ctrl_t ctrl)
     return err;
 
   /* FIXME: We need a lock for the hosttable.  */
+  load_hosttable ();
   curtime = gnupg_get_time ();
   for (idx=0; idx < hosttable_size; idx++)
     if ((hi=hosttable[idx]))
@@ -937,6 +1056,12 @@ ks_hkp_print_hosttable (ctrl_t ctrl)
         if (err)
           return err;
 
+        if (hi->rtt)
+          err = ks_printf_help (ctrl, "  .       rtt %ums, %u.%u%% failed",
+                                hi->rtt, hi->errrate / 10, hi->errrate % 10);
+        if (err)
+          return err;
+
         if (hi->pool)
           {
             init_membuf (&mb, 256);
@@ -1095,18 +1220,23 @@ ks_hkp_resolve (ctrl_t ctrl, parsed_uri_t uri)
 
 /* Housekeeping function called from the housekeeping thread.  It is
    used to mark dead hosts alive so that they may be tried again after
-   some time.  */
+   some time.  A changed hosttable is also written to disk.  */
 void
 ks_hkp_housekeeping (time_t curtime)
 {
   int idx;
   hostinfo_t hi;
 
+  load_hosttable ();
   for (idx=0; idx < hosttable_size; idx++)
     {
       hi = hosttable[idx];
       if (!hi)
         continue;
+      /* Select a new host from a pool from time to time so that the
+       * updated statistics are taken into account.  */
+      if (hi->pool)
+        hi->poolidx = -1;
       if (!hi->dead)
         continue;
       if (!hi->died_at)
@@ -1115,9 +1245,11 @@ ks_hkp_housekeeping (time_t curtime)
           || hi->died_at > curtime)
         {
           hi->dead = 0;
+          hosttable_dirty = 1;
           log_info ("resurrected host '%s'", hi->name);
         }
     }
+  save_hosttable ();
 }
 
 
@@ -1138,6 +1270,7 @@ ks_hkp_reload (void)
       if (!hi->dead)
         continue;
       hi->dead = 0;
+      hosttable_dirty = 1;
       count++;
     }
   if (count)
@@ -1145,6 +1278,360 @@ ks_hkp_reload (void)
 }
 
 
+/* Parse the host LINE of the hosttable file, which has the prefix
+ * "h:" already removed, and add the host to the hosttable.  CURTIME
+ * is used to drop outdated dead marks.  Returns the index into the
+ * hosttable or -1 if the line is not valid.  */
+static int
+parse_hosttable_line (char *line, time_t curtime)
+{
+  char *field[7];
+  const char *s;
+  hostinfo_t hi;
+  time_t died_at;
+  int i, idx;
+
+  /* The name is the last field because it may contain colons.  */
+  for (i=0; i < DIM (field); i++)
+    {
+      field[i] = line;
+      if (i+1 == DIM (field))
+        break;
+      line = strchr (line, ':');
+      if (!line)
+        return -1;
+      *line++ = 0;
+    }
+  trim_trailing_spaces (field[6]);
+  for (i=1; i < 6; i++)
+    if (!*field[i] || strspn (field[i], "0123456789") != strlen (field[i]))
+      return -1;
+  if (!*field[6] || strspn (field[0], "46odahH") != strlen (field[0])
+      || atoi (field[2]) > 65535 || atoi (field[3]) > 65535)
+    return -1;
+  for (idx=0; idx < hosttable_size; idx++)
+    if (hosttable[idx] && !ascii_strcasecmp (hosttable[idx]->name, field[6]))
+      return -1;  /* Duplicate.  */
+
+  idx = create_new_hostinfo (field[6]);
+  if (idx == -1)
+    return -1;
+  hi = hosttable[idx];
+  for (s = field[0]; *s; s++)
+    switch (*s)
+      {
+      case '4': hi->v4 = 1; break;
+      case '6': hi->v6 = 1; break;
+      case 'o': hi->onion = 1; break;
+      case 'a': hi->did_a_lookup = 1; break;
+      case 'h': hi->did_srv_lookup |= 1 << KS_PROTOCOL_HKP; break;
+      case 'H': hi->did_srv_lookup |= 1 << KS_PROTOCOL_HKPS; break;
+      }
+  died_at = (time_t)strtoul (field[1], NULL, 10);
+  if (strchr (field[0], 'd') && died_at
+      && died_at + RESURRECT_INTERVAL > curtime && died_at <= curtime)
+    {
+      hi->dead = 1;
+      hi->died_at = died_at;
+    }
+  hi->port[KS_PROTOCOL_HKP] = atoi (field[2]);
+  hi->port[KS_PROTOCOL_HKPS] = atoi (field[3]);
+  hi->rtt = strtoul (field[4], NULL, 10);
+  hi->errrate = strtoul (field[5], NULL, 10);
+  if (hi->errrate > 1000)
+    hi->errrate = 1000;
+  hi->from_file = (hi->did_a_lookup || hi->did_srv_lookup);
+  return idx;
+}
+
+
+/* Parse the pool LINE of the hosttable file, which has the prefix
+ * "p:" already removed.  IDXMAP maps the NIDXMAP host numbers of the
+ * file to indices into the hosttable.  */
+static void
+parse_hosttable_pool (char *line, const int *idxmap, int nidxmap)
+{
+  hostinfo_t hi;
+  char *p, *endp;
+  unsigned long n;
+  int *pool;
+  size_t pool_len, i;
+
+  n = strtoul (line, &endp, 10);
+  if (endp == line || *endp != ':' || n >= nidxmap || idxmap[n] == -1)
+    return;
+  hi = hosttable[idxmap[n]];
+  if (hi->pool)
+    return;  /* Duplicate.  */
+
+  pool = xtrycalloc (MAX_POOL_SIZE, sizeof *pool);
+  if (!pool)
+    return;
+  pool_len = 0;
+  for (p = endp + 1; *p && pool_len + 1 < MAX_POOL_SIZE; p = endp)
+    {
+      n = strtoul (p, &endp, 10);
+      if (endp == p)
+        break;
+      if (n < nidxmap && idxmap[n] != -1 && hosttable[idxmap[n]] != hi)
+        {
+          for (i=0; i < pool_len && pool[i] != idxmap[n]; i++)
+            ;
+          if (i == pool_len)
+            pool[pool_len++] = idxmap[n];
+        }
+    }
+  if (!pool_len)
+    {
+      xfree (pool);
+      return;
+    }
+  hi->pool = pool;
+  hi->pool_len = pool_len;
+  hi->pool_size = MAX_POOL_SIZE;
+  hostinfo_sort_pool (hi);
+}
+
+
+/* Read the hosttable file if not yet done.  This fills an empty
+ * hosttable with the hosts, their pools and their state as written
+ * by an earlier dirmngr process.  Hosts for which DNS lookups had
+ * been done are flagged so that ks_hkp_revalidate redoes them in the
+ * background.  */
+static void
+load_hosttable (void)
+{
+  char *fname;
+  estream_t fp;
+  char *line = NULL;
+  size_t linelen = 0;
+  size_t maxlen;
+  ssize_t len;
+  unsigned int lineno = 0;
+  int *idxmap = NULL;
+  int nidxmap = 0;
+  int idxmap_size = 0;
+  int *tmp;
+  int idx;
+  time_t curtime;
+
+  if (hosttable_loaded)
+    return;
+  hosttable_loaded = 1;
+
+  fname = make_filename (opt.homedir_cache, HOSTTABLE_FILE, NULL);
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info (_("can't open '%s': %s\n"), fname, strerror (errno));
+      xfree (fname);
+      return;
+    }
+
+  curtime = gnupg_get_time ();
+  maxlen = 2048;
+  while ((len = es_read_line (fp, &line, &linelen, &maxlen)) > 0)
+    {
+      if (!maxlen)
+        break;  /* Line too long - ignore the rest of the file.  */
+      maxlen = 2048;
+      if (!lineno++)
+        {
+          if (strncmp (line, "v:", 2) || atoi (line+2) != HOSTTABLE_VERSION)
+            {
+              log_info ("ignoring hosttable '%s' of an unknown version\n",
+                        fname);
+              break;
+            }
+          continue;
+        }
+      if (!strncmp (line, "h:", 2))
+        {
+          if (nidxmap >= idxmap_size)
+            {
+              idxmap_size += 64;
+              tmp = xtryrealloc (idxmap, idxmap_size * sizeof *idxmap);
+              if (!tmp)
+                break;
+              idxmap = tmp;
+            }
+          idxmap[nidxmap++] = parse_hosttable_line (line+2, curtime);
+        }
+      else if (!strncmp (line, "c:", 2) && nidxmap
+               && (idx = idxmap[nidxmap-1]) != -1
+               && !hosttable[idx]->cname)
+        {
+          trim_trailing_spaces (line+2);
+          if (line[2])
+            hosttable[idx]->cname = xtrystrdup (line+2);
+        }
+      else if (!strncmp (line, "p:", 2))
+        parse_hosttable_pool (line+2, idxmap, nidxmap);
+    }
+  xfree (line);
+  xfree (idxmap);
+  es_fclose (fp);
+
+  /* The table is the same as in the file.  */
+  hosttable_dirty = 0;
+  if (opt.verbose)
+    log_info ("hosttable: loaded %d hosts from '%s'\n", nidxmap, fname);
+  xfree (fname);
+}
+
+
+/* Write the hosttable to its file if it has been changed.  Hosts
+ * manually marked as dead are written as alive.  */
+static void
+save_hosttable (void)
+{
+  gpg_error_t err;
+  char *fname, *tmpfname;
+  estream_t fp;
+  hostinfo_t hi;
+  int *idxmap;
+  int idx, i, n;
+  void *buffer;
+  size_t buflen;
+
+  if (!hosttable_loaded || !hosttable_dirty)
+    return;
+
+  /* Map the indices into the hosttable to the host numbers in the
+   * file, which are counted without the empty slots.  */
+  idxmap = xtrycalloc (hosttable_size? hosttable_size : 1, sizeof *idxmap);
+  if (!idxmap)
+    {
+      log_error ("error saving the hosttable: %s\n",
+                 gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+  for (idx=n=0; idx < hosttable_size; idx++)
+    idxmap[idx] = hosttable[idx]? n++ : -1;
+
+  /* Format the file into memory first so that we do not see a
+   * changing table while writing the file.  */
+  fp = es_fopenmem (0, "w+b");
+  if (!fp)
+    {
+      log_error ("error creating memory stream: %s\n",
+                 gpg_strerror (gpg_error_from_syserror ()));
+      xfree (idxmap);
+      return;
+    }
+  es_fprintf (fp, "v:%d:\n", HOSTTABLE_VERSION);
+  es_fputs ("# HKP host table.  Created by dirmngr - do not edit.\n", fp);
+  for (idx=0; idx < hosttable_size; idx++)
+    if ((hi = hosttable[idx]))
+      {
+        es_fprintf (fp, "h:%s%s%s%s%s%s%s:%lu:%hu:%hu:%u:%u:%s\n",
+                    hi->v4? "4":"",
+                    hi->v6? "6":"",
+                    hi->onion? "o":"",
+                    hi->dead && hi->died_at? "d":"",
+                    hi->did_a_lookup? "a":"",
+                    (hi->did_srv_lookup & 1 << KS_PROTOCOL_HKP)? "h":"",
+                    (hi->did_srv_lookup & 1 << KS_PROTOCOL_HKPS)? "H":"",
+                    hi->dead? (unsigned long)hi->died_at : 0UL,
+                    hi->port[KS_PROTOCOL_HKP],
+                    hi->port[KS_PROTOCOL_HKPS],
+                    hi->rtt, hi->errrate, hi->name);
+        if (hi->cname)
+          es_fprintf (fp, "c:%s\n", hi->cname);
+      }
+  for (idx=0; idx < hosttable_size; idx++)
+    if ((hi = hosttable[idx]) && hi->pool && hi->pool_len)
+      {
+        es_fprintf (fp, "p:%d:", idxmap[idx]);
+        for (i=0; i < hi->pool_len && (n = hi->pool[i]) != -1; i++)
+          if (n < hosttable_size && idxmap[n] != -1)
+            es_fprintf (fp, " %d", idxmap[n]);
+        es_putc ('\n', fp);
+      }
+  xfree (idxmap);
+  hosttable_dirty = 0;
+  if (es_fclose_snatch (fp, &buffer, &buflen))
+    {
+      log_error ("error snatching memory stream: %s\n",
+                 gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+
+  fname = make_filename (opt.homedir_cache, HOSTTABLE_FILE, NULL);
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  fp = es_fopen (tmpfname, "w");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  err = es_write (fp, buffer, buflen, NULL)? gpg_error_from_syserror () : 0;
+  if (es_fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  if (!err)
+    err = gnupg_rename_file (tmpfname, fname, NULL);
+
+ leave:
+  if (err)
+    log_error (_("error writing '%s': %s\n"), fname, gpg_strerror (err));
+  xfree (tmpfname);
+  xfree (fname);
+  xfree (buffer);
+}
+
+
+/* Redo the DNS lookups for the hosts read from the hosttable file.
+ * This is called from the housekeeping thread once network activity
+ * has been seen.  Thus the first requests after a restart use the
+ * stored pools without waiting for the DNS, but the pools are
+ * nevertheless updated soon.  */
+void
+ks_hkp_revalidate (ctrl_t ctrl)
+{
+  static const char * const srvtags[KS_PROTOCOL_MAX] =
+    { "pgpkey-http", "pgpkey-https" };
+  hostinfo_t hi;
+  unsigned int srv;
+  int idx, protocol;
+
+  load_hosttable ();
+  for (idx=0; idx < hosttable_size; idx++)
+    {
+      hi = hosttable[idx];
+      if (!hi || !hi->from_file)
+        continue;
+      hi->from_file = 0;
+      if (hi->onion)
+        continue;
+
+      if (opt.verbose)
+        log_info ("revalidating host '%s'\n", hi->name);
+      srv = hi->did_srv_lookup;
+      hi->did_srv_lookup = 0;
+      hi->did_a_lookup = 0;
+      for (protocol=0; protocol < KS_PROTOCOL_MAX; protocol++)
+        if ((srv & 1 << protocol))
+          lookup_hostinfo (ctrl, hi, srvtags[protocol], protocol);
+      if (!hi->did_a_lookup)
+        lookup_hostinfo (ctrl, hi, NULL, KS_PROTOCOL_HKP);
+    }
+}
+
+
+/* Write the hosttable to disk.  This is called at shutdown.  */
+void
+ks_hkp_deinit (void)
+{
+  save_hosttable ();
+}
+
+
 /* Send an HTTP request.  On success returns an estream object at
    R_FP.  HOSTPORTSTR is only used for diagnostics.  If HTTPHOST is
    not NULL it will be used as HTTP "Host" header.  If POST_CB is not
@@ -1165,8 +1652,11 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
   char *request_buffer = NULL;
   parsed_uri_t uri = NULL;
   int is_onion;
+  struct timespec starttime, endtime;
+  int host_failed = 1;
 
   *r_fp = NULL;
+  npth_clock_gettime (&starttime);
 
   err = http_parse_uri (&uri, request, 0);
   if (err)
@@ -1181,6 +1671,7 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
     goto leave;
   http_session_set_log_cb (session, cert_log_cb);
   http_session_set_timeout (session, ctrl->timeout);
+  http_session_set_request_timeout (session, opt.request_timeout);
 
  once_more:
   err = http_open (ctrl, &http,
@@ -1231,6 +1722,8 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
                  hostportstr, gpg_strerror (err));
       goto leave;
     }
+  /* A server error is as bad as no response.  */
+  host_failed = http_get_status_code (http) >= 500;
 
   if (http_get_tls_info (http, NULL))
     {
@@ -1320,6 +1813,11 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
   http = NULL;
 
  leave:
+  npth_clock_gettime (&endtime);
+  update_host_stats (hostportstr,
+                     ((endtime.tv_sec - starttime.tv_sec) * 1000
+                      + (endtime.tv_nsec - starttime.tv_nsec) / 1000000),
+                     host_failed);
   http_close (http, 0);
   http_session_release (session);
   xfree (request_buffer);
@@ -1532,12 +2030,14 @@ ks_hkp_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 }
 
 
-/* Get the key described key the KEYSPEC string from the keyserver
+/* Get the key described by the KEYSPEC string from the keyserver
    identified by URI.  On success R_FP has an open stream to read the
    data.  The data will be provided in a format GnuPG can import
-   (either a binary OpenPGP message or an armored one).  */
-gpg_error_t
-ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
+   (either a binary OpenPGP message or an armored one).  The used host
+   is stored at R_SOURCE.  */
+static gpg_error_t
+hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
+         estream_t *r_fp, char **r_source)
 {
   gpg_error_t err;
   KEYDB_SEARCH_DESC desc;
@@ -1553,6 +2053,7 @@ ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
   unsigned int tries = SEND_REQUEST_RETRIES;
 
   *r_fp = NULL;
+  *r_source = NULL;
 
   /* Remove search type indicator and adjust PATTERN accordingly.
      Note that HKP keyservers like the 0x to be present when searching
@@ -1631,13 +2132,11 @@ ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
   if (err)
     goto leave;
 
-  err = dirmngr_status (ctrl, "SOURCE", hostport, NULL);
-  if (err)
-    goto leave;
-
-  /* Return the read stream and close the HTTP context.  */
+  /* Return the read stream and the used host.  */
   *r_fp = fp;
   fp = NULL;
+  *r_source = hostport;
+  hostport = NULL;
 
  leave:
   es_fclose (fp);
@@ -1649,6 +2148,235 @@ ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
 }
 
 
+/* Same as hkp_get but emits the used host as SOURCE status.  */
+gpg_error_t
+ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
+{
+  gpg_error_t err;
+  char *source;
+
+  err = hkp_get (ctrl, uri, keyspec, r_fp, &source);
+  if (err)
+    return err;
+
+  err = dirmngr_status (ctrl, "SOURCE", source, NULL);
+  xfree (source);
+  if (err)
+    {
+      es_fclose (*r_fp);
+      *r_fp = NULL;
+    }
+  return err;
+}
+
+
+/* The state shared by ks_hkp_get_many and its threads.  */
+struct get_many_s
+{
+  npth_mutex_t lock;
+  npth_cond_t cond;       /* Signaled when a job has been done.  */
+  parsed_uri_t uri;
+};
+
+/* A single key retrieval of ks_hkp_get_many.  */
+struct get_job_s
+{
+  struct get_many_s *parm;
+  const char *keyspec;
+  npth_t thread;
+  int started;            /* The thread has been created.  */
+  int done;               /* The job has been done.  */
+  gpg_error_t err;        /* The result of the job.  */
+  estream_t data;         /* The retrieved keys.  */
+  char *source;           /* The used host.  */
+
+  /* A control object for the thread.  The control object of the
+   * client can't be used because a thread must not talk to the
+   * client.  */
+  struct server_control_s ctrlbuf;
+};
+
+
+/* Copy the remaining data of IN to OUT.  */
+static gpg_error_t
+copy_data (estream_t in, estream_t out)
+{
+  char buffer[4096];
+  size_t nread;
+
+  while (!es_read (in, buffer, sizeof buffer, &nread) && nread)
+    if (es_write (out, buffer, nread, NULL))
+      return gpg_error_from_syserror ();
+  if (es_ferror (in))
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* The thread to do the get_job_s ARG.  */
+static void *
+get_job_thread (void *arg)
+{
+  struct get_job_s *job = arg;
+  gpg_error_t err;
+  estream_t fp;
+
+  err = hkp_get (&job->ctrlbuf, job->parm->uri, job->keyspec,
+                 &fp, &job->source);
+  /* We need to read the data here so that the connection can be
+   * reused by the next job.  */
+  if (!err)
+    {
+      job->data = es_fopenmem (0, "w+b");
+      if (!job->data)
+        err = gpg_error_from_syserror ();
+      else
+        err = copy_data (fp, job->data);
+      es_fclose (fp);
+    }
+
+  npth_mutex_lock (&job->parm->lock);
+  job->err = err;
+  job->done = 1;
+  npth_cond_signal (&job->parm->cond);
+  npth_mutex_unlock (&job->parm->lock);
+  return NULL;
+}
+
+
+/* Get the keys described by PATTERNS from the keyserver identified by
+ * URI and write them to OUTFP.  Up to MAX_CONCURRENT_GETS keys are
+ * retrieved concurrently and written in the order they arrive.  The
+ * first error of a single key is stored at R_FIRST_ERR and true at
+ * R_ANY_DATA if a key was written.  Errors writing to OUTFP are
+ * returned.  */
+gpg_error_t
+ks_hkp_get_many (ctrl_t ctrl, parsed_uri_t uri, strlist_t patterns,
+                 estream_t outfp, gpg_error_t *r_first_err, int *r_any_data)
+{
+  gpg_error_t err = 0;
+  struct get_many_s parm;
+  struct get_job_s *jobs, *job;
+  strlist_t sl;
+  int njobs, nstarted, nrunning, i;
+  int rc;
+
+  *r_first_err = 0;
+  *r_any_data = 0;
+
+  for (njobs=0, sl = patterns; sl; sl = sl->next)
+    njobs++;
+  jobs = xtrycalloc (njobs, sizeof *jobs);
+  if (!jobs)
+    return gpg_error_from_syserror ();
+
+  memset (&parm, 0, sizeof parm);
+  parm.uri = uri;
+  if ((rc = npth_mutex_init (&parm.lock, NULL)))
+    {
+      err = gpg_error_from_errno (rc);
+      xfree (jobs);
+      return err;
+    }
+  if ((rc = npth_cond_init (&parm.cond, NULL)))
+    {
+      err = gpg_error_from_errno (rc);
+      npth_mutex_destroy (&parm.lock);
+      xfree (jobs);
+      return err;
+    }
+
+  for (i=0, sl = patterns; sl; sl = sl->next, i++)
+    {
+      jobs[i].parm = &parm;
+      jobs[i].keyspec = sl->d;
+    }
+
+  npth_mutex_lock (&parm.lock);
+  nstarted = nrunning = 0;
+  while (nrunning || (!err && nstarted < njobs))
+    {
+      /* Start new jobs.  */
+      while (!err && nstarted < njobs && nrunning < MAX_CONCURRENT_GETS)
+        {
+          job = jobs + nstarted++;
+          dirmngr_init_default_ctrl (&job->ctrlbuf);
+          job->ctrlbuf.timeout = ctrl->timeout;
+          job->ctrlbuf.http_no_crl = ctrl->http_no_crl;
+          xfree (job->ctrlbuf.http_proxy);
+          job->ctrlbuf.http_proxy = NULL;
+          if (ctrl->http_proxy
+              && !(job->ctrlbuf.http_proxy = xtrystrdup (ctrl->http_proxy)))
+            {
+              err = gpg_error_from_syserror ();
+              job->err = err;
+              job->done = 1;
+              nrunning++;
+              break;
+            }
+          nrunning++;
+          if (!npth_create (&job->thread, NULL, get_job_thread, job))
+            job->started = 1;
+          else
+            {
+              /* Do it in this thread.  */
+              npth_mutex_unlock (&parm.lock);
+              get_job_thread (job);
+              npth_mutex_lock (&parm.lock);
+            }
+        }
+
+      /* Collect the finished jobs.  */
+      for (i=0; i < nstarted; i++)
+        if (jobs[i].done == 1)
+          break;
+      if (i == nstarted)
+        {
+          npth_cond_wait (&parm.cond, &parm.lock);
+          continue;
+        }
+      job = jobs + i;
+      job->done = 2;  /* Collected.  */
+      nrunning--;
+      npth_mutex_unlock (&parm.lock);
+
+      if (job->started)
+        npth_join (job->thread, NULL);
+      if (job->err)
+        {
+          /* It is possible that a server does not carry a key, thus we
+           * only save the error and continue with the next key.  */
+          if (!*r_first_err)
+            *r_first_err = job->err;
+        }
+      else if (!err)
+        {
+          err = dirmngr_status (ctrl, "SOURCE", job->source, NULL);
+          if (!err)
+            {
+              es_rewind (job->data);
+              err = copy_data (job->data, outfp);
+            }
+          if (!err)
+            *r_any_data = 1;
+        }
+      es_fclose (job->data);
+      job->data = NULL;
+      xfree (job->source);
+      job->source = NULL;
+      dirmngr_deinit_default_ctrl (&job->ctrlbuf);
+
+      npth_mutex_lock (&parm.lock);
+    }
+  npth_mutex_unlock (&parm.lock);
+
+  npth_cond_destroy (&parm.cond);
+  npth_mutex_destroy (&parm.lock);
+  xfree (jobs);
+  return err;
+}
+
+
 
 
 /* Callback parameters for put_post_cb.  */
@@ -31,6 +31,108 @@
 /* How many redirections do we allow.  */
 #define MAX_REDIRECTS 2
 
+/* The maximum number of URLs for which validators are kept.  */
+#define MAX_VALIDATORS 256
+
+
+/* The validators of a document fetched with the flag
+ * KS_HTTP_FETCH_CONDITIONAL.  They are sent with the next
+ * conditional fetch of the same URL so that the server can tell us
+ * that the document has not changed.  */
+struct validator_s
+{
+  struct validator_s *next;
+  char *etag;           /* The malloced ETag or NULL.  */
+  char *last_modified;  /* The malloced Last-Modified date or NULL.  */
+  char url[1];
+};
+typedef struct validator_s *validator_t;
+
+/* The list of validators, most recently used first.  */
+static validator_t validators;
+static unsigned int validator_count;
+
+
+
+static void
+release_validator (validator_t v)
+{
+  if (v)
+    {
+      xfree (v->etag);
+      xfree (v->last_modified);
+      xfree (v);
+    }
+}
+
+
+/* Remove the validators of URL from the list and return them.  */
+static validator_t
+take_validator (const char *url)
+{
+  validator_t v, *vp;
+
+  for (vp = &validators; (v = *vp); vp = &v->next)
+    if (!strcmp (v->url, url))
+      {
+        *vp = v->next;
+        v->next = NULL;
+        validator_count--;
+        return v;
+      }
+  return NULL;
+}
+
+
+/* Remember the validators ETAG and LAST_MODIFIED, which may both be
+ * NULL, for URL.  */
+static void
+put_validator (const char *url, const char *etag, const char *last_modified)
+{
+  validator_t v, *vp;
+
+  release_validator (take_validator (url));
+  if (!etag && !last_modified)
+    return;
+
+  v = xtrycalloc (1, sizeof *v + strlen (url));
+  if (!v)
+    return;
+  strcpy (v->url, url);
+  v->etag = etag? xtrystrdup (etag) : NULL;
+  v->last_modified = last_modified? xtrystrdup (last_modified) : NULL;
+  if ((etag && !v->etag) || (last_modified && !v->last_modified))
+    {
+      release_validator (v);
+      return;
+    }
+  v->next = validators;
+  validators = v;
+  validator_count++;
+
+  /* Drop the least recently used one.  */
+  if (validator_count > MAX_VALIDATORS)
+    {
+      for (vp = &validators; (*vp)->next; vp = &(*vp)->next)
+        ;
+      release_validator (*vp);
+      *vp = NULL;
+      validator_count--;
+    }
+}
+
+
+/* Forget the validators of URL.  A caller which uses
+ * KS_HTTP_FETCH_CONDITIONAL must call this if it was not able to
+ * process the document; otherwise the next fetch would claim that it
+ * has not been modified.  */
+void
+ks_http_forget_validators (const char *url)
+{
+  release_validator (take_validator (url));
+}
+
+
 /* Print a help output for the schemata supported by this module. */
 gpg_error_t
 ks_http_help (ctrl_t ctrl, parsed_uri_t uri)
@@ -64,7 +166,10 @@ ks_http_help (ctrl_t ctrl, parsed_uri_t uri)
 /* Get the key from URL which is expected to specify a http style
  * scheme.  On success R_FP has an open stream to read the data.
  * Despite its name this function is also used to retrieve arbitrary
- * data via https or http.
+ * data via https or http.  With the flag KS_HTTP_FETCH_CONDITIONAL
+ * the validators of the last fetch of URL are sent to the server; if
+ * the server replies that the document has not been modified
+ * meanwhile, 0 is returned and NULL is stored at R_FP.
  */
 gpg_error_t
 ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
@@ -79,7 +184,10 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
   char *request_buffer = NULL;
   parsed_uri_t uri = NULL;
   int is_onion, is_https;
+  const char *orig_url = url;
+  validator_t validator = NULL;
 
+  *r_fp = NULL;
   err = http_parse_uri (&uri, url, 0);
   if (err)
     goto leave;
@@ -94,6 +202,10 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
   if ((flags & KS_HTTP_FETCH_TRUST_CFG))
     session_flags |= HTTP_FLAG_TRUST_CFG;
 
+  /* The validators are put back after the response.  */
+  if ((flags & KS_HTTP_FETCH_CONDITIONAL))
+    validator = take_validator (orig_url);
+
  once_more:
   err = http_session_new (&session, NULL, session_flags,
                           gnupg_http_tls_verify_cb, ctrl);
@@ -101,6 +213,7 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
     goto leave;
   http_session_set_log_cb (session, cert_log_cb);
   http_session_set_timeout (session, ctrl->timeout);
+  http_session_set_request_timeout (session, opt.request_timeout);
 
   *r_fp = NULL;
   err = http_open (ctrl, &http,
@@ -126,6 +239,11 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
       if ((flags & KS_HTTP_FETCH_NOCACHE))
         es_fputs ("Pragma: no-cache\r\n"
                   "Cache-Control: no-cache\r\n", fp);
+      if (validator && validator->etag)
+        es_fprintf (fp, "If-None-Match: %s\r\n", validator->etag);
+      if (validator && validator->last_modified)
+        es_fprintf (fp, "If-Modified-Since: %s\r\n",
+                    validator->last_modified);
       http_start_data (http);
       if (es_ferror (fp))
         err = gpg_error_from_syserror ();
@@ -152,8 +270,28 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
     {
     case 200:
       err = 0;
+      if ((flags & KS_HTTP_FETCH_CONDITIONAL))
+        {
+          release_validator (validator);
+          validator = NULL;
+          put_validator (orig_url, http_get_header (http, "ETag"),
+                         http_get_header (http, "Last-Modified"));
+        }
       break; /* Success.  */
 
+    case 304:
+      if (validator)
+        {
+          if (opt.verbose)
+            log_info ("'%s' has not been modified\n", url);
+          err = 0;
+          goto leave;
+        }
+      log_error (_("error accessing '%s': http status %u\n"),
+                 url, http_get_status_code (http));
+      err = gpg_error (GPG_ERR_NO_DATA);
+      goto leave;
+
     case 301:
     case 302:
     case 307:
@@ -226,6 +364,9 @@ ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
   http = NULL;
 
  leave:
+  if (validator && !err)  /* Not modified; keep the validators.  */
+    put_validator (orig_url, validator->etag, validator->last_modified);
+  release_validator (validator);
   http_close (http, 0);
   http_session_release (session);
   xfree (request_buffer);
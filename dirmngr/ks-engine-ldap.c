@@ -52,6 +52,31 @@
 #ifndef HAVE_TIMEGM
 time_t timegm(struct tm *tm);
 #endif
+
+
+/* The maximum number of idle connections kept for reuse and the
+   number of seconds an idle connection is kept.  */
+#define MAX_POOLED_CONNECTIONS 4
+#define POOLED_CONNECTION_TTL  60
+
+/* An idle connection to an LDAP server along with the information we
+   learned about the server when connecting.  */
+struct pooled_conn_s
+{
+  struct pooled_conn_s *next;
+  LDAP *ldap_conn;
+  char *basedn;
+  char *pgpkeyattr;
+  int real_ldap;
+  time_t expires;
+  char *key;   /* Describes the server and the credentials.  */
+};
+typedef struct pooled_conn_s *pooled_conn_t;
+
+/* The list of idle connections and their number.  */
+static pooled_conn_t conn_pool;
+static unsigned int conn_pool_count;
+
 
 /* Convert an LDAP error to a GPG error.  */
 static int
@@ -439,10 +464,13 @@ keyspec_to_ldap_filter (const char *keyspec, char **filter, int only_exact)
    If no LDAP error occurred, you still need to check that *basednp is
    valid.  If it is NULL, then the server does not appear to be an
    OpenPGP Keyserver.  In this case, you also do not need to xfree
-   *pgpkeyattrp.  */
+   *pgpkeyattrp.
+
+   This is the worker for my_ldap_connect; it always creates a new
+   connection.  */
 static int
-my_ldap_connect (parsed_uri_t uri, LDAP **ldap_connp,
-                 char **basednp, char **pgpkeyattrp, int *real_ldapp)
+connect_server (parsed_uri_t uri, LDAP **ldap_connp,
+                char **basednp, char **pgpkeyattrp, int *real_ldapp)
 {
   int err = 0;
 
@@ -457,7 +485,7 @@ my_ldap_connect (parsed_uri_t uri, LDAP **ldap_connp,
   char *pgpkeyattr = "pgpKey";
   int real_ldap = 0;
 
-  log_debug ("my_ldap_connect(%s:%d/%s????%s%s%s%s%s)\n",
+  log_debug ("connect_server(%s:%d/%s????%s%s%s%s%s)\n",
 	     uri->host, uri->port,
 	     uri->path ?: "",
 	     uri->auth ? "bindname=" : "", uri->auth ?: "",
@@ -748,6 +776,186 @@ my_ldap_connect (parsed_uri_t uri, LDAP **ldap_connp,
   return err;
 }
 
+
+/* Return the key for the connection pool.  The returned string
+   contains the password and should thus be wiped before it is
+   released.  */
+static char *
+make_pool_key (parsed_uri_t uri)
+{
+  struct uri_tuple_s *password_param = uri_query_lookup (uri, "password");
+
+  return xtryasprintf ("%s://%s:%d/%s?%d?%u:%s?%s",
+                       uri->scheme, uri->host, uri->port,
+                       uri->path? uri->path : "", !!uri->use_tls,
+                       uri->auth? (unsigned int)strlen (uri->auth) : 0,
+                       uri->auth? uri->auth : "",
+                       password_param && password_param->value?
+                       password_param->value : "");
+}
+
+
+/* Release the string KEY returned by make_pool_key.  */
+static void
+release_pool_key (char *key)
+{
+  if (key)
+    {
+      wipememory (key, strlen (key));
+      xfree (key);
+    }
+}
+
+
+/* Release the pool item CONN and close its connection.  */
+static void
+release_pooled_conn (pooled_conn_t conn)
+{
+  if (conn->ldap_conn)
+    ldap_unbind (conn->ldap_conn);
+  xfree (conn->basedn);
+  xfree (conn->pgpkeyattr);
+  release_pool_key (conn->key);
+  xfree (conn);
+}
+
+
+/* Close the idle connections of the pool.  If ALL is not set only
+   the expired connections are closed.  */
+void
+ks_ldap_flush_connection_pool (int all)
+{
+  pooled_conn_t conn, *connp;
+  time_t now = gnupg_get_time ();
+
+  for (connp = &conn_pool; (conn = *connp); )
+    if (all || conn->expires <= now)
+      {
+        *connp = conn->next;
+        conn_pool_count--;
+        release_pooled_conn (conn);
+      }
+    else
+      connp = &conn->next;
+}
+
+
+/* Connect to the LDAP server described by URI.  This is a wrapper
+   around connect_server which returns an idle connection from the
+   pool if one is available; in this case the data learned when the
+   connection was created is returned and true is stored at
+   R_REUSED.  The connection should be released with
+   my_ldap_disconnect.  */
+static int
+my_ldap_connect (parsed_uri_t uri, LDAP **ldap_connp,
+                 char **basednp, char **pgpkeyattrp, int *real_ldapp,
+                 int *r_reused)
+{
+  pooled_conn_t conn, *connp;
+  char *key;
+
+  *r_reused = 0;
+
+  ks_ldap_flush_connection_pool (0);
+  key = make_pool_key (uri);
+  if (!key)
+    return connect_server (uri, ldap_connp, basednp, pgpkeyattrp, real_ldapp);
+
+  for (connp = &conn_pool; (conn = *connp); connp = &conn->next)
+    if (!strcmp (conn->key, key))
+      break;
+  release_pool_key (key);
+  if (!conn)
+    return connect_server (uri, ldap_connp, basednp, pgpkeyattrp, real_ldapp);
+
+  if (basednp)
+    *basednp = xstrdup (conn->basedn);
+  if (pgpkeyattrp)
+    *pgpkeyattrp = xstrdup (conn->pgpkeyattr);
+  if (real_ldapp)
+    *real_ldapp = conn->real_ldap;
+
+  *connp = conn->next;
+  conn_pool_count--;
+  *ldap_connp = conn->ldap_conn;
+  conn->ldap_conn = NULL;
+  release_pooled_conn (conn);
+
+  log_debug ("ldap_conn: %p (reused)\n", *ldap_connp);
+  *r_reused = 1;
+  return 0;
+}
+
+
+/* Release the connection LDAP_CONN to the server described by URI.
+   If KEEP is set the connection is put into the pool for reuse; the
+   caller needs to pass the BASEDN, PGPKEYATTR and REAL_LDAP values
+   returned by my_ldap_connect.  */
+static void
+my_ldap_disconnect (parsed_uri_t uri, LDAP *ldap_conn, int keep,
+                    const char *basedn, const char *pgpkeyattr, int real_ldap)
+{
+  pooled_conn_t conn;
+
+  if (!ldap_conn)
+    return;
+
+  if (!keep || !basedn || !pgpkeyattr
+      || conn_pool_count >= MAX_POOLED_CONNECTIONS
+      || !(conn = xtrycalloc (1, sizeof *conn)))
+    {
+      ldap_unbind (ldap_conn);
+      return;
+    }
+
+  conn->key = make_pool_key (uri);
+  conn->basedn = xtrystrdup (basedn);
+  conn->pgpkeyattr = xtrystrdup (pgpkeyattr);
+  if (!conn->key || !conn->basedn || !conn->pgpkeyattr)
+    {
+      conn->ldap_conn = ldap_conn;
+      release_pooled_conn (conn);
+      return;
+    }
+  conn->ldap_conn = ldap_conn;
+  conn->real_ldap = real_ldap;
+  conn->expires = gnupg_get_time () + POOLED_CONNECTION_TTL;
+  conn->next = conn_pool;
+  conn_pool = conn;
+  conn_pool_count++;
+}
+
+
+/* Run ldap_search_s on the connection at LDAP_CONNP.  If the
+   connection has been taken from the pool (*REUSEDP is set) and the
+   server closed it in the meantime, a new connection is created and
+   stored at LDAP_CONNP and the search is retried.  */
+static int
+my_ldap_search_s (parsed_uri_t uri, LDAP **ldap_connp, int *reusedp,
+                  const char *basedn, int scope, const char *filter,
+                  char **attrs, int attrsonly, LDAPMessage **r_message)
+{
+  int ldap_err;
+
+  ldap_err = ldap_search_s (*ldap_connp, basedn, scope, filter,
+                            attrs, attrsonly, r_message);
+  if (ldap_err == LDAP_SERVER_DOWN && *reusedp)
+    {
+      log_debug ("ldap: pooled connection closed by server; reconnecting\n");
+      *reusedp = 0;
+      ldap_msgfree (*r_message);
+      *r_message = NULL;
+      ldap_unbind (*ldap_connp);
+      *ldap_connp = NULL;
+      ldap_err = connect_server (uri, ldap_connp, NULL, NULL, NULL);
+      if (!ldap_err)
+        ldap_err = ldap_search_s (*ldap_connp, basedn, scope, filter,
+                                  attrs, attrsonly, r_message);
+    }
+
+  return ldap_err;
+}
+
 /* Extract keys from an LDAP reply and write them out to the output
    stream OUTPUT in a format GnuPG can import (either the OpenPGP
    binary format or armored format).  */
@@ -847,6 +1055,7 @@ ks_ldap_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
   estream_t fp = NULL;
 
   LDAPMessage *message = NULL;
+  int reused;
 
   (void) ctrl;
 
@@ -865,7 +1074,8 @@ ks_ldap_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
     return (err);
 
   /* Make sure we are talking to an OpenPGP LDAP server.  */
-  ldap_err = my_ldap_connect (uri, &ldap_conn, &basedn, &pgpkeyattr, NULL);
+  ldap_err = my_ldap_connect (uri, &ldap_conn, &basedn, &pgpkeyattr, NULL,
+                              &reused);
   if (ldap_err || !basedn)
     {
       if (ldap_err)
@@ -892,8 +1102,9 @@ ks_ldap_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
 
     int count;
 
-    ldap_err = ldap_search_s (ldap_conn, basedn, LDAP_SCOPE_SUBTREE,
-			      filter, attrs, attrsonly, &message);
+    ldap_err = my_ldap_search_s (uri, &ldap_conn, &reused,
+                                 basedn, LDAP_SCOPE_SUBTREE,
+                                 filter, attrs, attrsonly, &message);
     if (ldap_err)
       {
 	err = ldap_err_to_gpg_err (ldap_err);
@@ -1003,12 +1214,12 @@ ks_ldap_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
       *r_fp = fp;
     }
 
+  my_ldap_disconnect (uri, ldap_conn,
+                      !err || gpg_err_code (err) == GPG_ERR_NO_DATA,
+                      basedn, pgpkeyattr, 0);
   xfree (pgpkeyattr);
   xfree (basedn);
 
-  if (ldap_conn)
-    ldap_unbind (ldap_conn);
-
   xfree (filter);
 
   return err;
@@ -1028,6 +1239,9 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
   LDAP *ldap_conn = NULL;
 
   char *basedn = NULL;
+  char *pgpkeyattr = NULL;
+  int real_ldap = 0;
+  int reused;
 
   estream_t fp = NULL;
 
@@ -1051,7 +1265,8 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
     }
 
   /* Make sure we are talking to an OpenPGP LDAP server.  */
-  ldap_err = my_ldap_connect (uri, &ldap_conn, &basedn, NULL, NULL);
+  ldap_err = my_ldap_connect (uri, &ldap_conn, &basedn, &pgpkeyattr,
+                              &real_ldap, &reused);
   if (ldap_err || !basedn)
     {
       if (ldap_err)
@@ -1086,8 +1301,8 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 
     log_debug ("SEARCH '%s' => '%s' BEGIN\n", pattern, filter);
 
-    ldap_err = ldap_search_s (ldap_conn, basedn,
-			      LDAP_SCOPE_SUBTREE, filter, attrs, 0, &res);
+    ldap_err = my_ldap_search_s (uri, &ldap_conn, &reused, basedn,
+                                 LDAP_SCOPE_SUBTREE, filter, attrs, 0, &res);
 
     xfree (filter);
     filter = NULL;
@@ -1291,10 +1506,9 @@ ks_ldap_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
       *r_fp = fp;
     }
 
+  my_ldap_disconnect (uri, ldap_conn, !err, basedn, pgpkeyattr, real_ldap);
   xfree (basedn);
-
-  if (ldap_conn)
-    ldap_unbind (ldap_conn);
+  xfree (pgpkeyattr);
 
   xfree (filter);
 
@@ -1888,6 +2102,7 @@ ks_ldap_put (ctrl_t ctrl, parsed_uri_t uri,
   char *basedn = NULL;
   char *pgpkeyattr = NULL;
   int real_ldap;
+  int reused;
 
   LDAPMod **modlist = NULL;
   LDAPMod **addlist = NULL;
@@ -1917,7 +2132,8 @@ ks_ldap_put (ctrl_t ctrl, parsed_uri_t uri,
     }
 
   ldap_err = my_ldap_connect (uri,
-                              &ldap_conn, &basedn, &pgpkeyattr, &real_ldap);
+                              &ldap_conn, &basedn, &pgpkeyattr, &real_ldap,
+                              &reused);
   if (ldap_err || !basedn)
     {
       if (ldap_err)
@@ -2086,8 +2302,7 @@ ks_ldap_put (ctrl_t ctrl, parsed_uri_t uri,
   if (dump)
     es_fclose (dump);
 
-  if (ldap_conn)
-    ldap_unbind (ldap_conn);
+  my_ldap_disconnect (uri, ldap_conn, !err, basedn, pgpkeyattr, real_ldap);
 
   xfree (basedn);
   xfree (pgpkeyattr);
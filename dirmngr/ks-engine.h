@@ -37,6 +37,9 @@ gpg_error_t ks_hkp_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
                            estream_t *r_fp, unsigned int *r_http_status);
 gpg_error_t ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri,
                         const char *keyspec, estream_t *r_fp);
+gpg_error_t ks_hkp_get_many (ctrl_t ctrl, parsed_uri_t uri,
+                             strlist_t patterns, estream_t outfp,
+                             gpg_error_t *r_first_err, int *r_any_data);
 gpg_error_t ks_hkp_put (ctrl_t ctrl, parsed_uri_t uri,
                         const void *data, size_t datalen);
 
@@ -47,10 +50,12 @@ gpg_error_t ks_hkp_put (ctrl_t ctrl, parsed_uri_t uri,
 #define KS_HTTP_FETCH_TRUST_CFG       2  /* Requests HTTP_FLAG_TRUST_CFG.  */
 #define KS_HTTP_FETCH_NO_CRL          4  /* Requests HTTP_FLAG_NO_CRL.     */
 #define KS_HTTP_FETCH_ALLOW_DOWNGRADE 8  /* Allow redirect https -> http.  */
+#define KS_HTTP_FETCH_CONDITIONAL    16  /* Fetch only if modified.  */
 
 gpg_error_t ks_http_help (ctrl_t ctrl, parsed_uri_t uri);
 gpg_error_t ks_http_fetch (ctrl_t ctrl, const char *url, unsigned int flags,
                            estream_t *r_fp);
+void ks_http_forget_validators (const char *url);
 
 
 /*-- ks-engine-finger.c --*/
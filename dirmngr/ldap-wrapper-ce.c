@@ -1,4 +1,4 @@
-/* ldap-wrapper-ce.c - LDAP access via W32 threads
+/* ldap-wrapper-ce.c - LDAP access via threads
  * Copyright (C) 2010 Free Software Foundation, Inc.
  *
  * This file is part of GnuPG.
@@ -18,10 +18,13 @@
  */
 
 /*
-   Alternative wrapper for use with WindowsCE.  Under WindowsCE the
-   number of processes is strongly limited (32 processes including the
-   kernel processes) and thus we don't use the process approach but
-   implement a wrapper based on native threads.
+   Alternative wrapper which runs the LDAP queries in threads of
+   dirmngr.  This was first used with WindowsCE where the number of
+   processes is strongly limited (32 processes including the kernel
+   processes).  It is also used with the configure option
+   --disable-ldapwrapper to avoid the fork, exec and bind for each
+   query: the code of dirmngr_ldap keeps a pool of bound connections
+   in this case.
 
    See ldap-wrapper.c for  the standard wrapper interface.
  */
@@ -45,7 +48,6 @@
 #ifdef USE_LDAPWRAPPER
 # error This module is not expected to be build.
 #endif
-#error This module might not anymore work.
 
 
 
@@ -86,7 +88,9 @@ ldap_wrapper_launch_thread (void)
 void
 ldap_wrapper_wait_connections ()
 {
-  /* Not required.  */
+  /* We can't wait for the threads but we close the idle connections
+     so that the servers see an unbind.  */
+  ldap_wrapper_flush_pool ();
 }
 
 
@@ -107,10 +111,10 @@ struct outstream_cookie_s
 {
   int refcount; /* Reference counter - possible values are 1 and 2.  */
 
-  /* We don't need a mutex for the conditions, as npth provides a
-     simpler condition interface that relies on the global lock.  This
-     can be used if we never yield between testing the condition and
-     waiting on it.  */
+  /* The mutex for the conditions.  Strictly speaking it is not
+     required because we never yield between testing the condition and
+     waiting on it; however npth_cond_wait needs a mutex.  */
+  npth_mutex_t mutex;
   npth_cond_t wait_data; /* Condition that data is available.  */
   npth_cond_t wait_space; /* Condition that space is available.  */
 
@@ -143,7 +147,7 @@ buffer_get_data (struct outstream_cookie_s *cookie, char *dst, int cnt)
   left = amount;
 
   /* How large is the part up to the end of the buffer array?  */
-  chunk = DIM(cookie->buffer) - cookie->buffer_pos;
+  chunk = DIM(cookie->buffer) - cookie->buffer_read_pos;
   if (chunk > left)
     chunk = left;
 
@@ -158,6 +162,7 @@ buffer_get_data (struct outstream_cookie_s *cookie, char *dst, int cnt)
       BUFFER_INC_READ_POS (cookie, left);
     }
 
+  cookie->buffer_len -= amount;
   return amount;
 }
 
@@ -193,7 +198,7 @@ buffer_put_data (struct outstream_cookie_s *cookie, const char *src, int cnt)
       BUFFER_INC_POS (cookie, left);
     }
 
-  cookie->buffer_len -= amount;
+  cookie->buffer_len += amount;
   return amount;
 }
 
@@ -210,6 +215,7 @@ outstream_cookie_writer (void *cookie_arg, const void *buffer, size_t size)
   ssize_t amount = 0;
 
   src = buffer;
+  npth_mutex_lock (&cookie->mutex);
   do
     {
       int was_empty = 0;
@@ -218,9 +224,10 @@ outstream_cookie_writer (void *cookie_arg, const void *buffer, size_t size)
       while (BUFFER_FULL(cookie))
         {
           /* Buffer is full:  Wait for space.  */
-          res = npth_cond_wait (&cookie->wait_space, NULL);
+          res = npth_cond_wait (&cookie->wait_space, &cookie->mutex);
 	  if (res)
 	    {
+              npth_mutex_unlock (&cookie->mutex);
 	      gpg_err_set_errno (res);
 	      return -1;
 	    }
@@ -230,7 +237,7 @@ outstream_cookie_writer (void *cookie_arg, const void *buffer, size_t size)
 	was_empty = 1;
 
       /* Copy data.  */
-      nwritten = buffer_put_data (cookie, buffer, size);
+      nwritten = buffer_put_data (cookie, src, size);
       size -= nwritten;
       src += nwritten;
       amount += nwritten;
@@ -239,6 +246,7 @@ outstream_cookie_writer (void *cookie_arg, const void *buffer, size_t size)
 	npth_cond_signal (&cookie->wait_data);
     }
   while (size);  /* Until done.  */
+  npth_mutex_unlock (&cookie->mutex);
 
   return amount;
 }
@@ -252,6 +260,7 @@ outstream_release_cookie (struct outstream_cookie_s *cookie)
     {
       npth_cond_destroy (&cookie->wait_data);
       npth_cond_destroy (&cookie->wait_space);
+      npth_mutex_destroy (&cookie->mutex);
       xfree (cookie);
     }
 }
@@ -268,6 +277,7 @@ outstream_cookie_closer (void *cookie_arg)
     return 0;  /* Nothing to do.  */
 
   cookie->eof_seen = 1; /* (only useful if refcount > 1)  */
+  npth_cond_signal (&cookie->wait_data);
 
   assert (cookie->refcount > 0);
   outstream_release_cookie (cookie);
@@ -291,13 +301,17 @@ outstream_reader_cb (void *cb_value, char *buffer, size_t count,
 
   *r_nread = 0;
 
+  npth_mutex_lock (&cookie->mutex);
   while (BUFFER_EMPTY(cookie))
     {
       if (cookie->eof_seen)
-        return gpg_error (GPG_ERR_EOF);
+        {
+          npth_mutex_unlock (&cookie->mutex);
+          return gpg_error (GPG_ERR_EOF);
+        }
 
       /* Wait for data to become available.  */
-      npth_cond_wait (&cookie->wait_data, NULL);
+      npth_cond_wait (&cookie->wait_data, &cookie->mutex);
     }
 
   if (BUFFER_FULL(cookie))
@@ -309,6 +323,7 @@ outstream_reader_cb (void *cb_value, char *buffer, size_t count,
     {
       npth_cond_signal (&cookie->wait_space);
     }
+  npth_mutex_unlock (&cookie->mutex);
 
   *r_nread = nread;
   return 0; /* Success.  */
@@ -463,9 +478,19 @@ ldap_wrapper (ctrl_t ctrl, ksba_reader_t *r_reader, const char *argv[])
     }
   outstream_cookie->refcount++;
 
+  res = npth_mutex_init (&outstream_cookie->mutex, NULL);
+  if (res)
+    {
+      xfree (outstream_cookie);
+      free_arg_list (parms->arg_list);
+      xfree (parms);
+      return gpg_error_from_errno (res);
+    }
   res = npth_cond_init (&outstream_cookie->wait_data, NULL);
   if (res)
     {
+      npth_mutex_destroy (&outstream_cookie->mutex);
+      xfree (outstream_cookie);
       free_arg_list (parms->arg_list);
       xfree (parms);
       return gpg_error_from_errno (res);
@@ -474,6 +499,8 @@ ldap_wrapper (ctrl_t ctrl, ksba_reader_t *r_reader, const char *argv[])
   if (res)
     {
       npth_cond_destroy (&outstream_cookie->wait_data);
+      npth_mutex_destroy (&outstream_cookie->mutex);
+      xfree (outstream_cookie);
       free_arg_list (parms->arg_list);
       xfree (parms);
       return gpg_error_from_errno (res);
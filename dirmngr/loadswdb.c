@@ -30,6 +30,9 @@
 #include "misc.h"
 #include "ks-engine.h"
 
+/* The URL of the swdb file; the signature has the suffix ".sig".  */
+#define SWDB_URL "https://versions.gnupg.org/swdb.lst"
+
 
 /* Get the time from the current swdb file and store it at R_FILEDATE
  * and R_VERIFIED.  If the file does not exist 0 is stored at there.
@@ -116,9 +119,10 @@ time_of_saved_swdb (const char *fname, time_t *r_filedate, time_t *r_verified)
 
 
 /* Read a file from URL and return it as an estream memory buffer at
- * R_FP.  */
+ * R_FP.  If CONDITIONAL is set and the file has not been modified
+ * since the last fetch, NULL is stored at R_FP.  */
 static gpg_error_t
-fetch_file (ctrl_t ctrl, const char *url, estream_t *r_fp)
+fetch_file (ctrl_t ctrl, const char *url, int conditional, estream_t *r_fp)
 {
   gpg_error_t err;
   estream_t fp = NULL;
@@ -126,8 +130,14 @@ fetch_file (ctrl_t ctrl, const char *url, estream_t *r_fp)
   size_t nread, nwritten;
   char buffer[1024];
 
-  if ((err = ks_http_fetch (ctrl, url, KS_HTTP_FETCH_NOCACHE, &httpfp)))
+  *r_fp = NULL;
+  if ((err = ks_http_fetch (ctrl, url,
+                            (KS_HTTP_FETCH_NOCACHE
+                             | (conditional? KS_HTTP_FETCH_CONDITIONAL : 0)),
+                            &httpfp)))
     goto leave;
+  if (!httpfp)
+    goto leave;  /* Not modified.  */
 
   /* We now read the data from the web server into a memory buffer.
    * To avoid excessive memory use in case of a ill behaving server we
@@ -281,11 +291,16 @@ dirmngr_load_swdb (ctrl_t ctrl, int force)
       goto leave;
     }
 
-  /* Fetch the swdb from the web.  */
-  err = fetch_file (ctrl, "https://versions.gnupg.org/swdb.lst", &swdb);
+  /* Fetch the swdb from the web.  Unless we are forced to get a new
+   * copy, the server is asked to send it only if it has been
+   * modified since our last download.  This requires that we still
+   * have that copy.  */
+  err = fetch_file (ctrl, SWDB_URL, !force && filedate, &swdb);
   if (err)
     goto leave;
-  err = fetch_file (ctrl, "https://versions.gnupg.org/swdb.lst.sig", &swdb_sig);
+  if (!swdb)
+    goto leave;  /* Not modified.  */
+  err = fetch_file (ctrl, SWDB_URL ".sig", 0, &swdb_sig);
   if (err)
     goto leave;
 
@@ -392,6 +407,8 @@ dirmngr_load_swdb (ctrl_t ctrl, int force)
 
 
  leave:
+  if (err && swdb)
+    ks_http_forget_validators (SWDB_URL);  /* Get it again next time.  */
   es_fclose (outfp);
   if (tmp_fname)
     gnupg_remove (tmp_fname);  /* This is a temporary file.  */
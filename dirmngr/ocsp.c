@@ -26,6 +26,7 @@
 
 #include "dirmngr.h"
 #include "misc.h"
+#include "../common/sysutils.h"
 #include "http.h"
 #include "validate.h"
 #include "certcache.h"
@@ -34,6 +35,16 @@
 /* The maximum size we allow as a response from an OCSP reponder. */
 #define MAX_RESPONSE_SIZE 65536
 
+/* The name of the file to keep the OCSP cache across restarts and
+ * the version of its format.  */
+#define OCSP_CACHE_FILE "ocspcache.txt"
+#define OCSP_CACHE_VERSION 1
+
+/* Number of buckets of the OCSP cache and the maximum number of
+ * cached responses.  */
+#define NO_OF_OCSPBUCKETS 103
+#define MAX_OCSP_CACHE_ITEMS 4096
+
 
 static const char oidstr_ocsp[] = "1.3.6.1.5.5.7.48.1";
 
@@ -47,6 +58,424 @@ static const char oidstr_ocsp[] = "1.3.6.1.5.5.7.48.1";
 /* static const char oidstr_certHash[] = "1.3.36.8.3.13"; */
 
 
+/* An item of the OCSP cache.  We keep the status of a certificate as
+ * returned by the responder until the responder will have new
+ * information, i.e. until the nextUpdate time of the response.  The
+ * certificate is identified by the fingerprint of its issuer's
+ * certificate and its serial number.  Only responses which passed all
+ * checks are cached.  */
+struct ocsp_cache_item_s
+{
+  struct ocsp_cache_item_s *next;
+  unsigned char issuer_fpr[20];
+  unsigned int default_responder:1;  /* Response of the default responder. */
+  unsigned int revoked:1;            /* Status is revoked; else good.  */
+  ksba_isotime_t this_update;
+  ksba_isotime_t expires;            /* Do not use after this time.  */
+  ksba_isotime_t revocation_time;
+  char serialno[1];                  /* The serial number in hex.  */
+};
+typedef struct ocsp_cache_item_s *ocsp_cache_item_t;
+
+/* The hashed array of the cache items.  The cache is used without
+ * locking because none of its functions yields, except for the
+ * loading and writing of the file which take care of that.  */
+static ocsp_cache_item_t ocspbuckets[NO_OF_OCSPBUCKETS];
+static unsigned int ocsp_cache_count;
+
+/* Set once the file has been read and when the cache has been
+ * modified since.  */
+static int ocsp_cache_loaded;
+static int ocsp_cache_dirty;
+
+/* Statistics.  */
+static struct
+{
+  unsigned int lookups;
+  unsigned int hits;
+  unsigned int stored;
+} ocsp_cache_stats;
+
+
+
+
+/* The hash function for the cache.  */
+static unsigned int
+hash_ocsp_item (const unsigned char *issuer_fpr, const char *serialno)
+{
+  u32 hashval = (issuer_fpr[0] << 24 | issuer_fpr[1] << 16
+                 | issuer_fpr[2] << 8 | issuer_fpr[3]);
+
+  for (; *serialno; serialno++)
+    hashval = (hashval << 5) + hashval + *(const unsigned char *)serialno;
+  return hashval % NO_OF_OCSPBUCKETS;
+}
+
+
+/* Remove all items which expired before NOW.  */
+static void
+purge_ocsp_cache (const char *now)
+{
+  ocsp_cache_item_t item, *pp;
+  int bidx;
+
+  for (bidx = 0; bidx < NO_OF_OCSPBUCKETS; bidx++)
+    for (pp = &ocspbuckets[bidx]; (item = *pp); )
+      if (strcmp (item->expires, now) <= 0)
+        {
+          *pp = item->next;
+          xfree (item);
+          ocsp_cache_count--;
+          ocsp_cache_dirty = 1;
+        }
+      else
+        pp = &item->next;
+}
+
+
+/* Insert a new item into the cache.  Returns the new item or NULL if
+ * it was not inserted.  */
+static ocsp_cache_item_t
+insert_ocsp_item (const unsigned char *issuer_fpr, const char *serialno,
+                  int default_responder, int revoked,
+                  const char *this_update, const char *expires,
+                  const char *revocation_time)
+{
+  ocsp_cache_item_t item, *pp;
+  unsigned int bidx;
+  ksba_isotime_t now;
+
+  if (ocsp_cache_count >= MAX_OCSP_CACHE_ITEMS)
+    {
+      gnupg_get_isotime (now);
+      purge_ocsp_cache (now);
+      if (ocsp_cache_count >= MAX_OCSP_CACHE_ITEMS)
+        return NULL;
+    }
+
+  item = xtrycalloc (1, sizeof *item + strlen (serialno));
+  if (!item)
+    return NULL;
+  memcpy (item->issuer_fpr, issuer_fpr, 20);
+  strcpy (item->serialno, serialno);
+  item->default_responder = !!default_responder;
+  item->revoked = !!revoked;
+  gnupg_copy_time (item->this_update, this_update);
+  gnupg_copy_time (item->expires, expires);
+  if (revoked && revocation_time && *revocation_time)
+    gnupg_copy_time (item->revocation_time, revocation_time);
+
+  /* Replace an existing item.  */
+  bidx = hash_ocsp_item (issuer_fpr, serialno);
+  for (pp = &ocspbuckets[bidx]; *pp; pp = &(*pp)->next)
+    if ((*pp)->default_responder == item->default_responder
+        && !memcmp ((*pp)->issuer_fpr, issuer_fpr, 20)
+        && !strcmp ((*pp)->serialno, serialno))
+      {
+        ocsp_cache_item_t old = *pp;
+
+        *pp = old->next;
+        xfree (old);
+        ocsp_cache_count--;
+        break;
+      }
+
+  item->next = ocspbuckets[bidx];
+  ocspbuckets[bidx] = item;
+  ocsp_cache_count++;
+  ocsp_cache_dirty = 1;
+  return item;
+}
+
+
+/* Release all items of the cache.  */
+static void
+release_ocsp_cache (void)
+{
+  ocsp_cache_item_t item, tmp;
+  int bidx;
+
+  for (bidx = 0; bidx < NO_OF_OCSPBUCKETS; bidx++)
+    {
+      for (item = ocspbuckets[bidx]; item; item = tmp)
+        {
+          tmp = item->next;
+          xfree (item);
+        }
+      ocspbuckets[bidx] = NULL;
+    }
+  ocsp_cache_count = 0;
+  ocsp_cache_dirty = 0;
+}
+
+
+/* Parse one LINE of the cache file and insert it.  The format is
+
+     issuer_fpr:serialno:flags:this_update:expires:revocation_time
+
+   with FLAGS being 'g' for good or 'r' for revoked, followed by 'd'
+   for a response of the default responder.  Expired lines or lines
+   we do not understand are ignored.  */
+static void
+parse_ocsp_cache_line (char *line, const char *now)
+{
+  char *field[6];
+  unsigned char fpr[20];
+  int i;
+
+  for (i=0; i < DIM (field); i++)
+    {
+      field[i] = line;
+      line = strchr (line, ':');
+      if (line)
+        *line++ = 0;
+      else if (i+1 < DIM (field))
+        return;
+    }
+  trim_trailing_spaces (field[5]);
+
+  if (strlen (field[0]) != 40 || hex2bin (field[0], fpr, 20) < 0
+      || !*field[1] || strspn (field[1], "0123456789ABCDEF") != strlen (field[1])
+      || (*field[2] != 'g' && *field[2] != 'r')
+      || !isotime_p (field[3]) || !isotime_p (field[4])
+      || (*field[5] && !isotime_p (field[5])))
+    return;
+  if (strcmp (field[4], now) <= 0)
+    return;
+
+  insert_ocsp_item (fpr, field[1], field[2][1] == 'd', *field[2] == 'r',
+                    field[3], field[4], field[5]);
+}
+
+
+/* Read the cache file if not yet done.  */
+static void
+load_ocsp_cache (void)
+{
+  char *fname;
+  estream_t fp;
+  char *line = NULL;
+  size_t linelen = 0;
+  size_t maxlen;
+  ssize_t len;
+  unsigned int lineno = 0;
+  ksba_isotime_t now;
+
+  if (ocsp_cache_loaded)
+    return;
+  ocsp_cache_loaded = 1;
+
+  fname = make_filename (opt.homedir_cache, OCSP_CACHE_FILE, NULL);
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info (_("can't open '%s': %s\n"), fname, strerror (errno));
+      xfree (fname);
+      return;
+    }
+
+  gnupg_get_isotime (now);
+  maxlen = 2048;
+  while ((len = es_read_line (fp, &line, &linelen, &maxlen)) > 0)
+    {
+      if (!maxlen)
+        break;  /* Line too long - ignore the rest of the file.  */
+      maxlen = 2048;
+      if (!lineno++)
+        {
+          if (strncmp (line, "v:", 2) || atoi (line+2) != OCSP_CACHE_VERSION)
+            {
+              log_info ("ignoring OCSP cache '%s' of an unknown version\n",
+                        fname);
+              break;
+            }
+          continue;
+        }
+      if (*line == '#')
+        continue;
+      parse_ocsp_cache_line (line, now);
+    }
+  xfree (line);
+  es_fclose (fp);
+  xfree (fname);
+
+  /* The items are the same as in the file.  */
+  ocsp_cache_dirty = 0;
+  if (DBG_LOOKUP)
+    log_debug ("ocsp cache: loaded %u items\n", ocsp_cache_count);
+}
+
+
+/* Write ITEM to FP using the format of the cache file.  */
+static void
+write_ocsp_item (estream_t fp, ocsp_cache_item_t item)
+{
+  int i;
+
+  for (i=0; i < 20; i++)
+    es_fprintf (fp, "%02X", item->issuer_fpr[i]);
+  es_fprintf (fp, ":%s:%c%s:%s:%s:%s\n",
+              item->serialno,
+              item->revoked? 'r':'g',
+              item->default_responder? "d":"",
+              item->this_update, item->expires, item->revocation_time);
+}
+
+
+/* Write the cache to its file.  */
+static void
+save_ocsp_cache (void)
+{
+  gpg_error_t err;
+  char *fname, *tmpfname;
+  estream_t fp;
+  ocsp_cache_item_t item;
+  void *buffer;
+  size_t buflen;
+  int bidx;
+
+  if (!ocsp_cache_dirty)
+    return;
+
+  /* Format the file into memory first so that we do not see a
+   * changing cache while writing the file.  */
+  fp = es_fopenmem (0, "w+b");
+  if (!fp)
+    {
+      log_error ("error creating memory stream: %s\n",
+                 gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+  es_fprintf (fp, "v:%d:\n", OCSP_CACHE_VERSION);
+  es_fputs ("# Cached OCSP responses.  Created by dirmngr - do not edit.\n",
+            fp);
+  for (bidx = 0; bidx < NO_OF_OCSPBUCKETS; bidx++)
+    for (item = ocspbuckets[bidx]; item; item = item->next)
+      write_ocsp_item (fp, item);
+  ocsp_cache_dirty = 0;
+  if (es_fclose_snatch (fp, &buffer, &buflen))
+    {
+      log_error ("error snatching memory stream: %s\n",
+                 gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+
+  fname = make_filename (opt.homedir_cache, OCSP_CACHE_FILE, NULL);
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  fp = es_fopen (tmpfname, "w");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  err = es_write (fp, buffer, buflen, NULL)? gpg_error_from_syserror () : 0;
+  if (es_fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  if (!err)
+    err = gnupg_rename_file (tmpfname, fname, NULL);
+
+ leave:
+  if (err)
+    log_error (_("error writing '%s': %s\n"), fname, gpg_strerror (err));
+  xfree (tmpfname);
+  xfree (fname);
+  xfree (buffer);
+}
+
+
+/* Write the OCSP cache to disk and release it.  It will be read
+ * again on the next use.  */
+void
+ocsp_cache_deinit (void)
+{
+  if (!ocsp_cache_loaded)
+    return;
+  save_ocsp_cache ();
+  release_ocsp_cache ();
+  ocsp_cache_loaded = 0;
+}
+
+
+/* Remove all items from the OCSP cache, including its file.  */
+void
+ocsp_cache_flush (void)
+{
+  char *fname;
+
+  release_ocsp_cache ();
+  ocsp_cache_loaded = 1;
+  fname = make_filename (opt.homedir_cache, OCSP_CACHE_FILE, NULL);
+  if (gnupg_remove (fname) && errno != ENOENT)
+    log_error (_("error removing '%s': %s\n"), fname, strerror (errno));
+  xfree (fname);
+}
+
+
+/* Print the contents of the OCSP cache in a human readable format
+ * to stream FP.  */
+gpg_error_t
+ocsp_cache_list (estream_t fp)
+{
+  ocsp_cache_item_t item;
+  int bidx;
+  ksba_isotime_t now;
+
+  load_ocsp_cache ();
+  gnupg_get_isotime (now);
+  purge_ocsp_cache (now);
+  for (bidx = 0; bidx < NO_OF_OCSPBUCKETS; bidx++)
+    for (item = ocspbuckets[bidx]; item; item = item->next)
+      write_ocsp_item (fp, item);
+  return es_ferror (fp)? gpg_error_from_syserror () : 0;
+}
+
+
+/* Emit the statistics of the cache for the stats registry.  */
+void
+ocsp_cache_stats_report (stats_sink_t sink)
+{
+  stats_put (sink, "items", ocsp_cache_count);
+  stats_put (sink, "lookups", ocsp_cache_stats.lookups);
+  stats_put (sink, "hits", ocsp_cache_stats.hits);
+  stats_put (sink, "stored", ocsp_cache_stats.stored);
+}
+
+
+/* Look up the status of the certificate with SERIALNO issued by the
+ * certificate with ISSUER_FPR in the cache.  Returns the item or NULL
+ * if there is no current status.  */
+static ocsp_cache_item_t
+lookup_ocsp_cache (const unsigned char *issuer_fpr, const char *serialno,
+                   int default_responder)
+{
+  ocsp_cache_item_t item;
+  ksba_isotime_t now;
+
+  load_ocsp_cache ();
+
+  ocsp_cache_stats.lookups++;
+  gnupg_get_isotime (now);
+  for (item = ocspbuckets[hash_ocsp_item (issuer_fpr, serialno)];
+       item; item = item->next)
+    if (item->default_responder == !!default_responder
+        && !memcmp (item->issuer_fpr, issuer_fpr, 20)
+        && !strcmp (item->serialno, serialno))
+      {
+        if (strcmp (item->expires, now) <= 0)
+          return NULL;  /* Expired - will be replaced.  */
+        ocsp_cache_stats.hits++;
+        return item;
+      }
+
+  return NULL;
+}
+
 
 
 /* Read from FP and return a newly allocated buffer in R_BUFFER with the
@@ -543,6 +972,11 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   char *oid;
   ksba_name_t name;
   fingerprint_list_t default_signer = NULL;
+  unsigned char issuer_fpr[20];
+  ksba_sexp_t serial;
+  char *serialno = NULL;
+  ocsp_cache_item_t item;
+  int cacheable;
 
   /* Get the certificate.  */
   if (cert)
@@ -641,6 +1075,36 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
         log_info (_("using OCSP responder '%s'\n"), url);
     }
 
+  /* Check whether we have a current response in the cache.  */
+  cert_compute_fpr (issuer_cert, issuer_fpr);
+  serial = ksba_cert_get_serial (cert);
+  serialno = serial? serial_hex (serial) : NULL;
+  ksba_free (serial);
+  if (!serialno)
+    {
+      err = gpg_error (GPG_ERR_INV_CERT_OBJ);
+      goto leave;
+    }
+  item = lookup_ocsp_cache (issuer_fpr, serialno, !!default_signer);
+  if (item)
+    {
+      if (opt.verbose)
+        log_info (_("using cached OCSP status: %s  (this=%s  next=%s)\n"),
+                  item->revoked? _("revoked") : _("good"),
+                  item->this_update, item->expires);
+      if (item->revoked)
+        {
+          time_t validated_at = 0;
+          unsigned char fpr[20];
+
+          ksba_cert_set_user_data (cert, "validated_at",
+                                   &validated_at, sizeof (validated_at));
+          validation_cache_forget (cert_compute_fpr (cert, fpr));
+          err = gpg_error (GPG_ERR_CERT_REVOKED);
+        }
+      goto leave;
+    }
+
   /* Ask the OCSP responder. */
   err = gcry_md_open (&md, GCRY_MD_SHA1, 0);
   if (err)
@@ -685,6 +1149,9 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   if (status == KSBA_STATUS_REVOKED)
     {
       time_t validated_at = 0; /* That is: No cached validation available. */
+      unsigned char fpr[20];
+
+      validation_cache_forget (cert_compute_fpr (cert, fpr));
       err = ksba_cert_set_user_data (cert, "validated_at",
                                      &validated_at, sizeof (validated_at));
       if (err)
@@ -729,6 +1196,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
     }
 
 
+  cacheable = (status == KSBA_STATUS_GOOD || status == KSBA_STATUS_REVOKED);
   if (status == KSBA_STATUS_REVOKED)
     err = gpg_error (GPG_ERR_CERT_REVOKED);
   else if (status == KSBA_STATUS_UNKNOWN)
@@ -744,6 +1212,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
     {
       log_error (_("OCSP responder returned a status in the future\n"));
       log_info ("used now: %s  this_update: %s\n", current_time, this_update);
+      cacheable = 0;
       if (!err)
         err = gpg_error (GPG_ERR_TIME_CONFLICT);
     }
@@ -757,6 +1226,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
       log_error (_("OCSP responder returned a non-current status\n"));
       log_info ("used now: %s  this_update: %s\n",
                 current_time, this_update);
+      cacheable = 0;
       if (!err)
         err = gpg_error (GPG_ERR_TIME_CONFLICT);
     }
@@ -772,11 +1242,27 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
           log_error (_("OCSP responder returned an too old status\n"));
           log_info ("used now: %s  next_update: %s\n",
                     current_time, next_update);
+          cacheable = 0;
           if (!err)
             err = gpg_error (GPG_ERR_TIME_CONFLICT);
         }
     }
 
+  /* Cache the status until the responder has new information but
+   * not longer than we would accept this response.  */
+  if (cacheable)
+    {
+      gnupg_copy_time (tmp_time, this_update);
+      add_seconds_to_isotime (tmp_time, opt.ocsp_max_period);
+      if (*next_update && strcmp (next_update, tmp_time) < 0)
+        gnupg_copy_time (tmp_time, next_update);
+      if (*tmp_time
+          && insert_ocsp_item (issuer_fpr, serialno, !!default_signer,
+                               status == KSBA_STATUS_REVOKED,
+                               this_update, tmp_time, revocation_time))
+        ocsp_cache_stats.stored++;
+    }
+
 
  leave:
   gcry_md_close (md);
@@ -786,6 +1272,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   ksba_cert_release (cert);
   ksba_ocsp_release (ocsp);
   xfree (url_buffer);
+  xfree (serialno);
   return err;
 }
 
@@ -28,4 +28,9 @@ gpg_error_t ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
 /* Release the list of OCSP certificates hold in the CTRL object. */
 void release_ctrl_ocsp_certs (ctrl_t ctrl);
 
+void ocsp_cache_deinit (void);
+void ocsp_cache_flush (void);
+gpg_error_t ocsp_cache_list (estream_t fp);
+void ocsp_cache_stats_report (stats_sink_t sink);
+
 #endif /*OCSP_H*/
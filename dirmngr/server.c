@@ -67,6 +67,10 @@
  * certificates but also take PEM encoding into account.  */
 #define MAX_CERTLIST_LENGTH ((MAX_CERT_LENGTH * 20 * 4)/3)
 
+/* The maximum number of issuers returned by the ISSUERS command.
+ * This is the same limit as used by validate_cert_chain.  */
+#define MAX_CHAIN_DEPTH 10
+
 /* The same goes for OpenPGP keyblocks, but here we need to allow for
    much longer blocks; a 200k keyblock is not too unusual for keys
    with a lot of signatures (e.g. 0x5b0358a2).  9C31503C6D866396 even
@@ -113,6 +117,10 @@ struct server_local_s
   size_t inhibit_data_logging_count;
   unsigned int inhibit_data_logging : 1;
   unsigned int inhibit_data_logging_now : 1;
+
+  /* If not NULL the certificates returned by LOOKUP are written to
+   * this stream instead of being sent as data lines.  */
+  estream_t cert_outfp;
 };
 
 
@@ -252,6 +260,38 @@ data_line_write (assuan_context_t ctx, const void *buffer_arg, size_t size)
 }
 
 
+/* Return a stream for the output of the current command.  If the
+ * client has passed a file descriptor with the OUTPUT command the
+ * data is written directly to it, which avoids the escaping and
+ * splitting into data lines; otherwise the data is sent as data
+ * lines.  Returns NULL on error.  The stream must be closed with
+ * close_output_stream.  */
+static estream_t
+open_output_stream (assuan_context_t ctx)
+{
+  int fd;
+
+  fd = translate_sys2libc_fd (assuan_get_output_fd (ctx), 1);
+  if (fd != -1)
+    return es_fdopen_nc (fd, "wb");
+  return es_fopencookie (ctx, "w", data_line_cookie_functions);
+}
+
+
+/* Close FP as returned by open_output_stream and the output fd of
+ * CTX.  Returns an error if flushing the stream failed.  */
+static gpg_error_t
+close_output_stream (assuan_context_t ctx, estream_t fp)
+{
+  gpg_error_t err = 0;
+
+  if (fp && es_fclose (fp))
+    err = gpg_error_from_syserror ();
+  assuan_close_output_fd (ctx);
+  return err;
+}
+
+
 /* A write handler used by es_fopencookie to write assuan data
    lines.  */
 static gpgrt_ssize_t
@@ -864,15 +904,27 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
   *domain++ = 0;
   domain_orig = domain;
 
+  gcry_md_hash_buffer (GCRY_MD_SHA1, sha1buf, mbox, strlen (mbox));
+
   /* First check whether we already know that the domain does not
-   * support WKD.  */
+   * support WKD or that a query for this address failed recently.  */
   if (is_wkd_query)
     {
+      gpg_err_code_t ec;
+
       if (domaininfo_is_wkd_not_supported (domain_orig))
         {
           err = gpg_error (GPG_ERR_NO_DATA);
           goto leave;
         }
+      if ((ec = domaininfo_get_wkd_miss (domain_orig, sha1buf)))
+        {
+          if (opt.verbose)
+            log_info ("WKD query for '%s' skipped due to a recent failure"
+                      " (%s)\n", line, gpg_strerror (ec));
+          err = gpg_error (ec);
+          goto leave;
+        }
     }
 
   /* Check for SRV records.  */
@@ -919,7 +971,6 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
       xfree (srvs);
     }
 
-  gcry_md_hash_buffer (GCRY_MD_SHA1, sha1buf, mbox, strlen (mbox));
   encodedhash = zb32_encode (sha1buf, 8*20);
   if (!encodedhash)
     {
@@ -1005,6 +1056,8 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
               {
                 /* Mark that and schedule a check.  */
                 domaininfo_set_wkd_not_found (domain_orig);
+                domaininfo_put_wkd_miss (domain_orig, sha1buf,
+                                         GPG_ERR_NO_DATA);
                 workqueue_add_task (task_check_wkd_support, domain_orig,
                                     ctrl->server_local->session_id, 1);
               }
@@ -1012,6 +1065,18 @@ proc_wkd_get (ctrl_t ctrl, assuan_context_t ctx, char *line)
               domaininfo_set_wkd_not_supported (domain_orig);
             break;
 
+          case GPG_ERR_TIMEOUT:
+          case GPG_ERR_ETIMEDOUT:
+          case GPG_ERR_ECONNREFUSED:
+          case GPG_ERR_EHOSTUNREACH:
+          case GPG_ERR_ENETUNREACH:
+            /* Remember network errors for a short time so that the
+             * next lookup of this address does not wait again.  */
+            if (is_wkd_query)
+              domaininfo_put_wkd_miss (domain_orig, sha1buf,
+                                       gpg_err_code (err));
+            break;
+
           default:
             /* Don't register other errors.  */
             break;
@@ -1431,6 +1496,32 @@ cmd_checkocsp (assuan_context_t ctx, char *line)
 
 
 
+/* Send the certificate image DER of DERLEN for LOOKUP.  If the
+ * client has set up an output fd the image is just written to it;
+ * otherwise send it as data lines, flush the buffer and then send an
+ * END line as a certificate delimiter.  */
+static gpg_error_t
+send_cert_image (assuan_context_t ctx, const void *der, size_t derlen)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+
+  if (ctrl->server_local->cert_outfp)
+    {
+      if (es_fwrite (der, derlen, 1, ctrl->server_local->cert_outfp) != 1)
+        return gpg_error_from_syserror ();
+      return 0;
+    }
+
+  err = assuan_send_data (ctx, der, derlen);
+  if (!err)
+    err = assuan_send_data (ctx, NULL, 0);
+  if (!err)
+    err = assuan_write_line (ctx, "END");
+  return err;
+}
+
+
 static int
 lookup_cert_by_url (assuan_context_t ctx, const char *url)
 {
@@ -1447,12 +1538,7 @@ lookup_cert_by_url (assuan_context_t ctx, const char *url)
       goto leave;
     }
 
-  /* Send the data, flush the buffer and then send an END. */
-  err = assuan_send_data (ctx, value, valuelen);
-  if (!err)
-    err = assuan_send_data (ctx, NULL, 0);
-  if (!err)
-    err = assuan_write_line (ctx, "END");
+  err = send_cert_image (ctx, value, valuelen);
   if (err)
     {
       log_error (_("error sending data: %s\n"), gpg_strerror (err));
@@ -1478,13 +1564,7 @@ return_one_cert (void *opaque, ksba_cert_t cert)
   if (!der)
     err = gpg_error (GPG_ERR_INV_CERT_OBJ);
   else
-    {
-      err = assuan_send_data (ctx, der, derlen);
-      if (!err)
-        err = assuan_send_data (ctx, NULL, 0);
-      if (!err)
-        err = assuan_write_line (ctx, "END");
-    }
+    err = send_cert_image (ctx, der, derlen);
   if (err)
     log_error (_("error sending data: %s\n"), gpg_strerror (err));
   return err;
@@ -1636,13 +1716,7 @@ lookup_cert_by_pattern (assuan_context_t ctx, char *line,
             log_debug ("cmd_lookup: returning one cert%s\n",
                        truncated? " (truncated)":"");
 
-          /* Send the data, flush the buffer and then send an END line
-             as a certificate delimiter. */
-          err = assuan_send_data (ctx, value, valuelen);
-          if (!err)
-            err = assuan_send_data (ctx, NULL, 0);
-          if (!err)
-            err = assuan_write_line (ctx, "END");
+          err = send_cert_image (ctx, value, valuelen);
           if (err)
             {
               log_error (_("error sending data: %s\n"), gpg_strerror (err));
@@ -1699,18 +1773,36 @@ static const char hlp_lookup[] =
   "done.\n"
   "\n"
   "If --cache-only is given no external lookup is done so that only\n"
-  "certificates from the cache may get returned.";
+  "certificates from the cache may get returned.\n"
+  "\n"
+  "If an output file descriptor has been set with the OUTPUT command,\n"
+  "the certificates are written there one after the other in DER\n"
+  "format instead of being returned as data lines.";
 static gpg_error_t
 cmd_lookup (assuan_context_t ctx, char *line)
 {
-  gpg_error_t err;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err, err2;
   int lookup_url, single, cache_only;
+  int fd;
 
   lookup_url = has_leading_option (line, "--url");
   single = has_leading_option (line, "--single");
   cache_only = has_leading_option (line, "--cache-only");
   line = skip_options (line);
 
+  fd = translate_sys2libc_fd (assuan_get_output_fd (ctx), 1);
+  if (fd != -1)
+    {
+      ctrl->server_local->cert_outfp = es_fdopen_nc (fd, "wb");
+      if (!ctrl->server_local->cert_outfp)
+        {
+          err = gpg_error_from_syserror ();
+          assuan_close_output_fd (ctx);
+          return leave_cmd (ctx, err);
+        }
+    }
+
   if (lookup_url && cache_only)
     err = gpg_error (GPG_ERR_NOT_FOUND);
   else if (lookup_url && single)
@@ -1720,6 +1812,150 @@ cmd_lookup (assuan_context_t ctx, char *line)
   else
     err = lookup_cert_by_pattern (ctx, line, single, cache_only);
 
+  err2 = close_output_stream (ctx, ctrl->server_local->cert_outfp);
+  ctrl->server_local->cert_outfp = NULL;
+  if (!err)
+    err = err2;
+
+  return leave_cmd (ctx, err);
+}
+
+
+/* Helper for cmd_issuers.  Try to fetch the issuer of CERT from
+ * the caIssuers URLs of the authorityInfoAccess extension.  On
+ * success the issuer certificate is stored at R_CERT.  */
+static gpg_error_t
+fetch_issuer_by_aia (ctrl_t ctrl, ksba_cert_t cert, ksba_cert_t *r_cert)
+{
+  static const char oidstr_ca_issuers[] = "1.3.6.1.5.5.7.48.2";
+  gpg_error_t err;
+  char *oid;
+  ksba_name_t name;
+  char *url;
+  unsigned char *value;
+  size_t valuelen;
+  int idx, i;
+
+  *r_cert = NULL;
+  for (idx=0; !*r_cert && !(err=ksba_cert_get_authority_info_access
+                            (cert, idx, &oid, &name)); idx++)
+    {
+      if (!strcmp (oid, oidstr_ca_issuers))
+        {
+          for (i=0; !*r_cert && ksba_name_enum (name, i); i++)
+            {
+              url = ksba_name_get_uri (name, i);
+              if (!url)
+                continue;
+              if (opt.verbose)
+                log_info ("fetching issuer certificate from '%s'\n", url);
+              if (!fetch_cert_by_url (ctrl, url, &value, &valuelen))
+                {
+                  if (!ksba_cert_new (r_cert)
+                      && ksba_cert_init_from_mem (*r_cert, value, valuelen))
+                    {
+                      ksba_cert_release (*r_cert);
+                      *r_cert = NULL;
+                    }
+                  xfree (value);
+                }
+              xfree (url);
+            }
+        }
+      ksba_name_release (name);
+      ksba_free (oid);
+    }
+
+  if (*r_cert)
+    return 0;
+  if (err && gpg_err_code (err) != GPG_ERR_EOF)
+    return err;
+  return gpg_error (GPG_ERR_NOT_FOUND);
+}
+
+
+static const char hlp_issuers[] =
+  "ISSUERS\n"
+  "\n"
+  "Return the chain of issuer certificates for a certificate.  To get\n"
+  "the certificate, this command immediately inquires it using\n"
+  "\n"
+  "  INQUIRE TARGETCERT\n"
+  "\n"
+  "and the caller is expected to return the certificate as a binary\n"
+  "blob.  The issuers are located using the cache, the configured\n"
+  "LDAP servers and the caIssuers URLs of the certificates; they are\n"
+  "returned in the same format as used by LOOKUP, starting with the\n"
+  "direct issuer.  The certificates are not validated.  This allows a\n"
+  "client to get all missing certificates of a chain in one request.";
+static gpg_error_t
+cmd_issuers (assuan_context_t ctx, char *line)
+{
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  ksba_cert_t cert = NULL;
+  ksba_cert_t issuer_cert;
+  unsigned char *value = NULL;
+  size_t valuelen;
+  char *subject, *issuer;
+  int depth, is_root;
+
+  (void)line;
+
+  err = assuan_inquire (ctrl->server_local->assuan_ctx, "TARGETCERT",
+                        &value, &valuelen, MAX_CERT_LENGTH);
+  if (err)
+    {
+      log_error (_("assuan_inquire failed: %s\n"), gpg_strerror (err));
+      goto leave;
+    }
+
+  if (!valuelen) /* No data returned; return a comprehensible error. */
+    err = gpg_error (GPG_ERR_MISSING_CERT);
+  else
+    {
+      err = ksba_cert_new (&cert);
+      if (!err)
+        err = ksba_cert_init_from_mem (cert, value, valuelen);
+    }
+  xfree (value);
+  if (err)
+    goto leave;
+
+  for (depth=0; depth < MAX_CHAIN_DEPTH; depth++)
+    {
+      subject = ksba_cert_get_subject (cert, 0);
+      issuer = ksba_cert_get_issuer (cert, 0);
+      is_root = (!subject || !issuer || !strcmp (subject, issuer));
+      ksba_free (subject);
+      ksba_free (issuer);
+      if (is_root)
+        break;
+
+      err = find_issuing_cert (ctrl, cert, &issuer_cert);
+      if (gpg_err_code (err) == GPG_ERR_NOT_FOUND
+          && !opt.disable_http && !dirmngr_use_tor ())
+        {
+          err = fetch_issuer_by_aia (ctrl, cert, &issuer_cert);
+          if (!err)
+            cache_cert (issuer_cert);
+        }
+      if (err)
+        {
+          if (depth)
+            err = 0; /* We return what we found so far.  */
+          break;
+        }
+
+      err = return_one_cert (ctx, issuer_cert);
+      ksba_cert_release (cert);
+      cert = issuer_cert;
+      if (err)
+        break;
+    }
+
+ leave:
+  ksba_cert_release (cert);
   return leave_cmd (ctx, err);
 }
 
@@ -1808,6 +2044,51 @@ cmd_listcrls (assuan_context_t ctx, char *line)
 }
 
 
+static const char hlp_listocsp[] =
+  "LISTOCSP\n"
+  "\n"
+  "List the cached OCSP responses.  Each line of the output has the\n"
+  "colon delimited fields\n"
+  "\n"
+  "  issuer_fpr:serialno:flags:this_update:expires:revocation_time\n"
+  "\n"
+  "with FLAGS being 'g' for good or 'r' for revoked, followed by 'd'\n"
+  "if the response was returned by the default responder.";
+static gpg_error_t
+cmd_listocsp (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+  estream_t fp;
+
+  (void)line;
+
+  fp = es_fopencookie (ctx, "w", data_line_cookie_functions);
+  if (!fp)
+    err = set_error (GPG_ERR_ASS_GENERAL, "error setting up a data stream");
+  else
+    {
+      err = ocsp_cache_list (fp);
+      es_fclose (fp);
+    }
+  return leave_cmd (ctx, err);
+}
+
+
+static const char hlp_flushocsp[] =
+  "FLUSHOCSP\n"
+  "\n"
+  "Remove all cached OCSP responses.  The next check of a certificate\n"
+  "using OCSP will ask the responder again.";
+static gpg_error_t
+cmd_flushocsp (assuan_context_t ctx, char *line)
+{
+  (void)line;
+
+  ocsp_cache_flush ();
+  return leave_cmd (ctx, 0);
+}
+
+
 static const char hlp_cachecert[] =
   "CACHECERT\n"
   "\n"
@@ -2337,12 +2618,14 @@ static const char hlp_ks_get[] =
   "\n"
   "Get the keys matching PATTERN from the configured OpenPGP keyservers\n"
   "(see command KEYSERVER).  Each pattern should be a keyid, a fingerprint,\n"
-  "or an exact name indicated by the '=' prefix.";
+  "or an exact name indicated by the '=' prefix.  If an output file\n"
+  "descriptor has been set with the OUTPUT command, the keys are\n"
+  "written there instead of being returned as data lines.";
 static gpg_error_t
 cmd_ks_get (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
-  gpg_error_t err;
+  gpg_error_t err, err2;
   strlist_t list, sl;
   char *p;
   estream_t outfp;
@@ -2382,7 +2665,7 @@ cmd_ks_get (assuan_context_t ctx, char *line)
     goto leave;
 
   /* Setup an output stream and perform the get.  */
-  outfp = es_fopencookie (ctx, "w", data_line_cookie_functions);
+  outfp = open_output_stream (ctx);
   if (!outfp)
     err = set_error (GPG_ERR_ASS_GENERAL, "error setting up a data stream");
   else
@@ -2391,11 +2674,14 @@ cmd_ks_get (assuan_context_t ctx, char *line)
       ctrl->server_local->inhibit_data_logging_now = 0;
       ctrl->server_local->inhibit_data_logging_count = 0;
       err = ks_action_get (ctrl, ctrl->server_local->keyservers, list, outfp);
-      es_fclose (outfp);
+      err2 = close_output_stream (ctx, outfp);
+      if (!err)
+        err = err2;
       ctrl->server_local->inhibit_data_logging = 0;
     }
 
  leave:
+  assuan_close_output_fd (ctx);
   free_strlist (list);
   return leave_cmd (ctx, err);
 }
@@ -2404,12 +2690,14 @@ cmd_ks_get (assuan_context_t ctx, char *line)
 static const char hlp_ks_fetch[] =
   "KS_FETCH <URL>\n"
   "\n"
-  "Get the key(s) from URL.";
+  "Get the key(s) from URL.  If an output file descriptor has been set\n"
+  "with the OUTPUT command, the keys are written there instead of being\n"
+  "returned as data lines.";
 static gpg_error_t
 cmd_ks_fetch (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
-  gpg_error_t err;
+  gpg_error_t err, err2;
   estream_t outfp;
 
   if (has_option (line, "--quick"))
@@ -2421,7 +2709,7 @@ cmd_ks_fetch (assuan_context_t ctx, char *line)
     goto leave;
 
   /* Setup an output stream and perform the get.  */
-  outfp = es_fopencookie (ctx, "w", data_line_cookie_functions);
+  outfp = open_output_stream (ctx);
   if (!outfp)
     err = set_error (GPG_ERR_ASS_GENERAL, "error setting up a data stream");
   else
@@ -2430,11 +2718,14 @@ cmd_ks_fetch (assuan_context_t ctx, char *line)
       ctrl->server_local->inhibit_data_logging_now = 0;
       ctrl->server_local->inhibit_data_logging_count = 0;
       err = ks_action_fetch (ctrl, line, outfp);
-      es_fclose (outfp);
+      err2 = close_output_stream (ctx, outfp);
+      if (!err)
+        err = err2;
       ctrl->server_local->inhibit_data_logging = 0;
     }
 
  leave:
+  assuan_close_output_fd (ctx);
   return leave_cmd (ctx, err);
 }
 
@@ -2538,9 +2829,11 @@ static const char hlp_getinfo[] =
   "pid         - Return the process id of the server.\n"
   "tor         - Return OK if running in Tor mode\n"
   "dnsinfo     - Return info about the DNS resolver\n"
+  "dnscache    - List the content of the DNS cache\n"
   "socket_name - Return the name of the socket.\n"
   "session_id  - Return the current session_id.\n"
   "workqueue   - Inspect the work queue\n"
+  "stats       - Return the statistics as a JSON object\n"
   "getenv NAME - Return value of envvar NAME\n";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
@@ -2604,11 +2897,26 @@ cmd_getinfo (assuan_context_t ctx, char *line)
         }
       err = 0;
     }
+  else if (!strcmp (line, "dnscache"))
+    {
+      err = dns_cache_dump (ctrl);
+    }
   else if (!strcmp (line, "workqueue"))
     {
       workqueue_dump_queue (ctrl);
       err = 0;
     }
+  else if (!strcmp (line, "stats"))
+    {
+      char *s = stats_to_json ();
+      if (!s)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = assuan_send_data (ctx, s, strlen (s));
+          xfree (s);
+        }
+    }
   else if (!strncmp (line, "getenv", 6)
            && (line[6] == ' ' || line[6] == '\t' || !line[6]))
     {
@@ -2685,8 +2993,11 @@ register_commands (assuan_context_t ctx)
     { "CHECKCRL",   cmd_checkcrl,   hlp_checkcrl },
     { "CHECKOCSP",  cmd_checkocsp,  hlp_checkocsp },
     { "LOOKUP",     cmd_lookup,     hlp_lookup },
+    { "ISSUERS",    cmd_issuers,    hlp_issuers },
     { "LOADCRL",    cmd_loadcrl,    hlp_loadcrl },
     { "LISTCRLS",   cmd_listcrls,   hlp_listcrls },
+    { "LISTOCSP",   cmd_listocsp,   hlp_listocsp },
+    { "FLUSHOCSP",  cmd_flushocsp,  hlp_flushocsp },
     { "CACHECERT",  cmd_cachecert,  hlp_cachecert },
     { "VALIDATE",   cmd_validate,   hlp_validate },
     { "KEYSERVER",  cmd_keyserver,  hlp_keyserver },
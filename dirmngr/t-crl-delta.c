@@ -0,0 +1,146 @@
+/* t-crl-delta.c - Regression tests for crl-delta.c
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/util.h"
+#include "crl-delta.h"
+
+#include "t-support.h"
+
+
+static void
+test_base_number (void)
+{
+  static struct {
+    const char *der;
+    size_t derlen;
+    const char *result;
+  } tests[] = {
+    { "\x02\x01\x05", 3, "05" },
+    { "\x02\x02\x01\x00", 4, "0100" },
+    { "\x02\x02\x01\x00\xff", 5, "0100" },
+    { "\x04\x01\x05", 3, NULL },          /* Not an INTEGER.  */
+    { "\x22\x03\x02\x01\x05", 5, NULL },  /* Constructed.  */
+    { "\x02\x03\x01\x00", 4, NULL },      /* Truncated.  */
+    { "\x02\x00", 2, NULL },              /* Empty.  */
+    { "", 0, NULL }
+  };
+  int tidx;
+  char *result;
+
+  for (tidx=0; tidx < DIM (tests); tidx++)
+    {
+      result = crl_delta_base_number ((const unsigned char *)tests[tidx].der,
+                                      tests[tidx].derlen);
+      if (tests[tidx].result)
+        {
+          if (!result || strcmp (result, tests[tidx].result))
+            fail (tidx);
+        }
+      else if (result)
+        fail (tidx);
+      xfree (result);
+    }
+}
+
+
+static void
+test_compare_numbers (void)
+{
+  static struct {
+    const char *a;
+    const char *b;
+    int result;
+  } tests[] = {
+    { "05", "5", 0 },
+    { "0A", "0a", 0 },
+    { "00", "", 0 },
+    { "04", "05", -1 },
+    { "10", "0F", 1 },
+    { "FF", "0100", -1 },
+    { "000100", "FF", 1 },
+    { "7FFFFFFFFFFFFFFF01", "7FFFFFFFFFFFFFFF00", 1 }
+  };
+  int tidx;
+
+  for (tidx=0; tidx < DIM (tests); tidx++)
+    {
+      if (crl_compare_numbers (tests[tidx].a, tests[tidx].b)
+          != tests[tidx].result)
+        fail (100 + tidx);
+      if (crl_compare_numbers (tests[tidx].b, tests[tidx].a)
+          != -tests[tidx].result)
+        fail (100 + tidx);
+    }
+}
+
+
+static void
+test_applicable (void)
+{
+  static struct {
+    const char *crl_number;
+    const char *base_number;
+    const char *delta_number;
+    const char *applied_number;
+    int result;
+  } tests[] = {
+    { "05", "04", "07", NULL, 1 },
+    { "04", "04", "07", NULL, 1 },  /* The base CRL itself.  */
+    { "06", "04", "07", NULL, 1 },
+    { "03", "04", "07", NULL, 0 },  /* Older than the base.  */
+    { "07", "04", "07", NULL, 0 },  /* Not older than the delta.  */
+    { "08", "04", "07", NULL, 0 },
+    { "05", "04", "07", "06", 1 },  /* Replaces an older delta.  */
+    { "05", "04", "07", "07", 1 },  /* The same delta again.  */
+    { "05", "04", "07", "08", 0 },  /* Older than the applied delta.  */
+    { "FF", "F0", "0100", NULL, 1 },
+    { NULL, "04", "07", NULL, 0 },
+    { "05", NULL, "07", NULL, 0 },
+    { "05", "04", NULL, NULL, 0 }
+  };
+  int tidx;
+
+  for (tidx=0; tidx < DIM (tests); tidx++)
+    if (crl_delta_applicable (tests[tidx].crl_number,
+                              tests[tidx].base_number,
+                              tests[tidx].delta_number,
+                              tests[tidx].applied_number)
+        != tests[tidx].result)
+      fail (200 + tidx);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  (void)argc;
+  (void)argv;
+
+  test_base_number ();
+  test_compare_numbers ();
+  test_applicable ();
+
+  return 0;
+}
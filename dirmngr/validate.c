@@ -61,6 +61,30 @@ struct chain_item_s
 typedef struct chain_item_s *chain_item_t;
 
 
+/* The number of seconds a successful validation is cached and the
+   maximum number of cached validations.  */
+#define VALIDATION_CACHE_PERIOD   (30*60)
+#define MAX_VALIDATION_CACHE_ITEMS 1000
+
+/* An item of the validation cache.  Successful validations of a
+   chain are cached using the fingerprint of the target certificate
+   and the flags given to validate_cert_chain.  The table uses the
+   first byte of the fingerprint as hash like the certificate cache.
+   The cache is flushed along with the certificate cache.  */
+struct validation_item_s
+{
+  struct validation_item_s *next;
+  unsigned char fpr[20];     /* Fingerprint of the target certificate. */
+  unsigned int flags;        /* The flags used for the validation.  */
+  ksba_isotime_t expires;    /* Do not use after this time.  */
+  ksba_isotime_t exptime;    /* The nearest expiration time in the chain. */
+};
+typedef struct validation_item_s *validation_item_t;
+
+static validation_item_t validation_cache[256];
+static unsigned int validation_cache_count;
+
+
 /* A couple of constants with Object Identifiers.  */
 static const char oid_kp_serverAuth[]     = "1.3.6.1.5.5.7.3.1";
 static const char oid_kp_clientAuth[]     = "1.3.6.1.5.5.7.3.2";
@@ -318,6 +342,107 @@ check_revocations (ctrl_t ctrl, chain_item_t chain)
 }
 
 
+/* Release all validation cache items.  */
+void
+validation_cache_flush (void)
+{
+  validation_item_t vi, vi2;
+  int i;
+
+  for (i=0; i < 256; i++)
+    {
+      for (vi = validation_cache[i]; vi; vi = vi2)
+        {
+          vi2 = vi->next;
+          xfree (vi);
+        }
+      validation_cache[i] = NULL;
+    }
+  validation_cache_count = 0;
+}
+
+
+/* Remove all cached validations of the certificate with the
+   fingerprint FPR.  This is used if the certificate has been found
+   to be revoked.  */
+void
+validation_cache_forget (const unsigned char *fpr)
+{
+  validation_item_t vi, *pp;
+
+  for (pp = &validation_cache[*fpr]; (vi = *pp); )
+    if (!memcmp (vi->fpr, fpr, 20))
+      {
+        *pp = vi->next;
+        xfree (vi);
+        validation_cache_count--;
+      }
+    else
+      pp = &vi->next;
+}
+
+
+/* Return true if the certificate with FPR has been validated using
+   FLAGS and the result is still current at NOW.  In this case the
+   nearest expiration time of the chain is stored at EXPTIME.  */
+static int
+validation_cache_lookup (const unsigned char *fpr, unsigned int flags,
+                         const char *now, ksba_isotime_t exptime)
+{
+  validation_item_t vi, *pp;
+
+  for (pp = &validation_cache[*fpr]; (vi = *pp); pp = &vi->next)
+    if (vi->flags == flags && !memcmp (vi->fpr, fpr, 20))
+      {
+        if (strcmp (vi->expires, now) <= 0)
+          {
+            *pp = vi->next;
+            xfree (vi);
+            validation_cache_count--;
+            return 0;
+          }
+        gnupg_copy_time (exptime, vi->exptime);
+        return 1;
+      }
+
+  return 0;
+}
+
+
+/* Store a successful validation of the certificate with FPR using
+   FLAGS.  NOW is the time of the validation and EXPTIME the nearest
+   expiration time of the chain.  */
+static void
+validation_cache_store (const unsigned char *fpr, unsigned int flags,
+                        const char *now, const char *exptime)
+{
+  validation_item_t vi;
+  ksba_isotime_t expires;
+
+  if (validation_cache_count >= MAX_VALIDATION_CACHE_ITEMS)
+    validation_cache_flush ();  /* Simple but good enough.  */
+
+  gnupg_copy_time (expires, now);
+  add_seconds_to_isotime (expires, VALIDATION_CACHE_PERIOD);
+  if (*exptime && strcmp (exptime, expires) < 0)
+    gnupg_copy_time (expires, exptime);
+  if (!*expires)
+    return;
+
+  vi = xtrycalloc (1, sizeof *vi);
+  if (!vi)
+    return;  /* Not cached is not an error.  */
+  memcpy (vi->fpr, fpr, 20);
+  vi->flags = flags;
+  gnupg_copy_time (vi->expires, expires);
+  if (*exptime)
+    gnupg_copy_time (vi->exptime, exptime);
+  vi->next = validation_cache[*fpr];
+  validation_cache[*fpr] = vi;
+  validation_cache_count++;
+}
+
+
 /* Check whether CERT is a root certificate.  ISSUERDN and SUBJECTDN
    are the DNs already extracted by the caller from CERT.  Returns
    True if this is the case. */
@@ -415,6 +540,7 @@ validate_cert_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t r_exptime,
   int any_expired = 0;
   int any_no_policy_match = 0;
   chain_item_t chain;
+  unsigned char target_fpr[20];
 
   check_header_constants ();
 
@@ -464,6 +590,21 @@ validate_cert_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t r_exptime,
   /* Get the current time. */
   gnupg_get_isotime (current_time);
 
+  /* Check whether we validated a certificate with the same
+     fingerprint using the same flags recently.  Unlike the above
+     check this also works for certificates which are parsed anew for
+     each request, for example server certificates of TLS
+     connections.  */
+  cert_compute_fpr (cert, target_fpr);
+  if (validation_cache_lookup (target_fpr, flags, current_time, exptime))
+    {
+      if (opt.verbose)
+        log_info ("certificate chain is good (cached)\n");
+      if (r_exptime)
+        gnupg_copy_time (r_exptime, exptime);
+      return 0;
+    }
+
   /* We walk up the chain until we find a trust anchor. */
   subject_cert = cert;
   maxdepth = 10;  /* Sensible limit on the length of the chain.  */
@@ -817,6 +958,7 @@ validate_cert_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t r_exptime,
       chain_item_t citem;
       time_t validated_at = gnupg_get_time ();
 
+      validation_cache_store (target_fpr, flags, current_time, exptime);
       for (citem = chain; citem; citem = citem->next)
         {
           err = ksba_cert_set_user_data (citem->cert, "validated_at",
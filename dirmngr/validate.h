@@ -54,6 +54,12 @@ gpg_error_t validate_cert_chain (ctrl_t ctrl,
                                  ksba_cert_t cert, ksba_isotime_t r_exptime,
                                  unsigned int flags, char **r_trust_anchor);
 
+/* Flush the cache of successful validations.  */
+void validation_cache_flush (void);
+
+/* Remove the cached validations of the certificate with FPR.  */
+void validation_cache_forget (const unsigned char *fpr);
+
 /* Return 0 if the certificate CERT is usable for certification.  */
 gpg_error_t check_cert_use_cert (ksba_cert_t cert);
 
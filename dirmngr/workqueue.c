@@ -22,10 +22,20 @@
 #include <config.h>
 #include <stdlib.h>
 #include <string.h>
+#include <npth.h>
 
 #include "dirmngr.h"
 
 
+/* The maximum number of threads running tasks.  */
+#define MAX_WORKERS 4
+
+/* The number of seconds a task may wait in the queue.  Older tasks
+ * are dropped because their results are probably not needed
+ * anymore.  */
+#define TASK_DEADLINE (24*3600)
+
+
 /* An object for one item in the workqueue.  */
 struct wqitem_s
 {
@@ -34,10 +44,16 @@ struct wqitem_s
   /* This flag is set if the task requires network access.  */
   unsigned int need_network:1;
 
+  /* This flag is set if the task shall be run by the next worker.  */
+  unsigned int runnable:1;
+
   /* The id of the session which created this task.  If this is 0 the
    * task is not associated with a specific session.  */
   unsigned int session_id;
 
+  /* The time after which the task is not run anymore.  */
+  time_t deadline;
+
   /* The function to perform the backgrount task.  */
   wqtask_t func;
 
@@ -47,9 +63,17 @@ struct wqitem_s
 typedef struct wqitem_s *wqitem_t;
 
 
-/* The workque is a simple linked list.  */
+/* The workque is a simple linked list.  Tasks not requiring the
+ * network are kept in front of the other tasks so that they are run
+ * first.  */
 static wqitem_t workqueue;
 
+/* The tasks currently run by the workers.  */
+static wqitem_t running_tasks;
+
+/* The number of worker threads.  */
+static unsigned int nworkers;
+
 
 /* Dump the queue using Assuan status comments.  */
 void
@@ -84,16 +108,39 @@ workqueue_dump_queue (ctrl_t ctrl)
         item = item->next;
       item->next = saved_workqueue;
     }
+
+  /* The running tasks may finish while we are writing the status
+   * lines; thus we count them first.  */
+  for (count=0, item = running_tasks; item; item = item->next)
+    count++;
+  dirmngr_status_helpf (ctrl, "wq: workers: %u running tasks: %u",
+                        nworkers, count);
+}
+
+
+/* Return true if the task (FUNC,ARGS) is in the list LIST.  */
+static int
+task_in_list_p (wqitem_t list, wqtask_t func, const char *args)
+{
+  for (; list; list = list->next)
+    if (list->func == func && !strcmp (list->args, args))
+      return 1;
+  return 0;
 }
 
 
 /* Append the task (FUNC,ARGS) to the work queue.  FUNC shall return
- * its name when called with (NULL, NULL).  */
+ * its name when called with (NULL, NULL).  A task which is already
+ * queued or running is not added again.  */
 gpg_error_t
 workqueue_add_task (wqtask_t func, const char *args, unsigned int session_id,
                     int need_network)
 {
-  wqitem_t item, wi;
+  wqitem_t item, *itemp;
+
+  if (task_in_list_p (workqueue, func, args)
+      || task_in_list_p (running_tasks, func, args))
+    return 0;
 
   item = xtrycalloc (1, sizeof *item + strlen (args));
   if (!item)
@@ -102,15 +149,15 @@ workqueue_add_task (wqtask_t func, const char *args, unsigned int session_id,
   item->func = func;
   item->session_id = session_id;
   item->need_network = !!need_network;
-
-  if (!(wi=workqueue))
-    workqueue = item;
-  else
-    {
-      while (wi->next)
-        wi = wi->next;
-      wi->next = item;
-    }
+  item->deadline = gnupg_get_time () + TASK_DEADLINE;
+
+  /* Local tasks are put after the other local tasks but before the
+   * network tasks.  */
+  for (itemp = &workqueue; *itemp; itemp = &(*itemp)->next)
+    if (!need_network && (*itemp)->need_network)
+      break;
+  item->next = *itemp;
+  *itemp = item;
   return 0;
 }
 
@@ -120,53 +167,140 @@ workqueue_add_task (wqtask_t func, const char *args, unsigned int session_id,
 static void
 run_a_task (ctrl_t ctrl, wqitem_t item)
 {
+  wqitem_t *itemp;
+
   log_assert (!item->next);
 
+  if (item->deadline <= gnupg_get_time ())
+    {
+      if (opt.verbose)
+        log_info ("session %u: dropping expired task %s(\"%s%s\")\n",
+                  item->session_id,
+                  item->func? item->func (NULL, NULL): "nop",
+                  item->args, strlen (item->args) > 100? "[...]":"");
+      xfree (item);
+      return;
+    }
+
   if (opt.verbose)
     log_info ("session %u: running %s(\"%s%s\")\n",
               item->session_id,
               item->func? item->func (NULL, NULL): "nop",
               item->args, strlen (item->args) > 100? "[...]":"");
+
+  /* Keep it in the list of running tasks while running so that it is
+   * not added again.  */
+  item->next = running_tasks;
+  running_tasks = item;
+
   if (item->func)
     item->func (ctrl, item->args);
 
+  for (itemp = &running_tasks; *itemp; itemp = &(*itemp)->next)
+    if (*itemp == item)
+      {
+        *itemp = item->next;
+        break;
+      }
   xfree (item);
 }
 
 
+/* Detach the next runnable item from the workqueue and return it.
+ * Returns NULL if there is no such item.  */
+static wqitem_t
+get_runnable_task (void)
+{
+  wqitem_t item, *itemp;
+
+  for (itemp = &workqueue; (item = *itemp); itemp = &item->next)
+    if (item->runnable)
+      {
+        *itemp = item->next;
+        item->next = NULL;
+        return item;
+      }
+  return NULL;
+}
+
+
+/* The thread running the tasks.  It terminates if there are no
+ * runnable tasks left.  */
+static void *
+worker_thread (void *arg)
+{
+  struct server_control_s ctrlbuf;
+  wqitem_t item;
+
+  (void)arg;
+
+  memset (&ctrlbuf, 0, sizeof ctrlbuf);
+  dirmngr_init_default_ctrl (&ctrlbuf);
+
+  while ((item = get_runnable_task ()))
+    run_a_task (&ctrlbuf, item);
+
+  dirmngr_deinit_default_ctrl (&ctrlbuf);
+  nworkers--;
+  return NULL;
+}
+
+
+/* Start worker threads for the runnable tasks.  */
+static void
+start_workers (void)
+{
+  npth_attr_t tattr;
+  npth_t thread;
+  wqitem_t item;
+  unsigned int nrunnable;
+  int err;
+
+  for (nrunnable=0, item = workqueue; item; item = item->next)
+    if (item->runnable)
+      nrunnable++;
+  if (nrunnable <= nworkers || nworkers >= MAX_WORKERS)
+    return;
+
+  err = npth_attr_init (&tattr);
+  if (err)
+    {
+      log_error ("error preparing worker thread: %s\n", strerror (err));
+      return;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  for (; nworkers < nrunnable && nworkers < MAX_WORKERS; nworkers++)
+    {
+      err = npth_create (&thread, &tattr, worker_thread, NULL);
+      if (err)
+        {
+          log_error ("error spawning worker thread: %s\n", strerror (err));
+          break;
+        }
+    }
+  npth_attr_destroy (&tattr);
+}
+
+
 /* Run tasks not associated with a session.  This is called from the
  * ticker every few minutes.  If WITH_NETWORK is not set tasks which
- * require the network are not run.  */
+ * require the network are not run.  The tasks are run by worker
+ * threads and this function returns without waiting for them.  */
 void
 workqueue_run_global_tasks (ctrl_t ctrl, int with_network)
 {
-  wqitem_t item, prev;
+  wqitem_t item;
 
-  with_network = !!with_network;
+  (void)ctrl;
 
   if (opt.verbose)
     log_info ("running scheduled tasks%s\n", with_network?" (with network)":"");
 
-  for (;;)
-    {
-      prev = NULL;
-      for (item = workqueue; item; prev = item, item = item->next)
-        if (!item->session_id
-            && (!item->need_network || (item->need_network && with_network)))
-          break;
-      if (!item)
-        break;  /* No more tasks to run.  */
-
-      /* Detach that item from the workqueue.  */
-      if (!prev)
-        workqueue = item->next;
-      else
-        prev->next = item->next;
-      item->next = NULL;
-
-      /* Run the task.  */
-      run_a_task (ctrl, item);
-    }
+  for (item = workqueue; item; item = item->next)
+    if (!item->session_id && (!item->need_network || with_network))
+      item->runnable = 1;
+
+  start_workers ();
 }
 
 
@@ -175,40 +309,14 @@ workqueue_run_global_tasks (ctrl_t ctrl, int with_network)
 void
 workqueue_run_post_session_tasks (unsigned int session_id)
 {
-  struct server_control_s ctrlbuf;
-  ctrl_t ctrl = NULL;
-  wqitem_t item, prev;
+  wqitem_t item;
 
   if (!session_id)
     return;
 
-  for (;;)
-    {
-      prev = NULL;
-      for (item = workqueue; item; prev = item, item = item->next)
-        if (item->session_id == session_id)
-          break;
-      if (!item)
-        break;  /* No more tasks for this session.  */
-
-      /* Detach that item from the workqueue.  */
-      if (!prev)
-        workqueue = item->next;
-      else
-        prev->next = item->next;
-      item->next = NULL;
-
-      /* Create a CTRL object the first time we need it.  */
-      if (!ctrl)
-        {
-          memset (&ctrlbuf, 0, sizeof ctrlbuf);
-          ctrl = &ctrlbuf;
-          dirmngr_init_default_ctrl (ctrl);
-        }
-
-      /* Run the task.  */
-      run_a_task (ctrl, item);
-    }
+  for (item = workqueue; item; item = item->next)
+    if (item->session_id == session_id)
+      item->runnable = 1;
 
-  dirmngr_deinit_default_ctrl (ctrl);
+  start_workers ();
 }
@@ -38,12 +38,6 @@
 #define MAX_LINELEN 20000
 
 #define CRCINIT 0xB704CE
-#define CRCPOLY 0X864CFB
-#define CRCUPDATE(a,c) do {						    \
-			a = ((a) << 8) ^ crc_table[((a)&0xff >> 16) ^ (c)]; \
-			a &= 0x00ffffff;				    \
-		    } while(0)
-static u32 crc_table[256];
 static byte bintoasc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 			 "abcdefghijklmnopqrstuvwxyz"
 			 "0123456789+/";
@@ -161,25 +155,9 @@ push_armor_filter (armor_filter_context_t *afx, iobuf_t iobuf)
 static void
 initialize(void)
 {
-    int i, j;
-    u32 t;
+    int i;
     byte *s;
 
-    /* init the crc lookup table */
-    crc_table[0] = 0;
-    for(i=j=0; j < 128; j++ ) {
-	t = crc_table[j];
-	if( t & 0x00800000 ) {
-	    t <<= 1;
-	    crc_table[i++] = t ^ CRCPOLY;
-	    crc_table[i++] = t;
-	}
-	else {
-	    t <<= 1;
-	    crc_table[i++] = t;
-	    crc_table[i++] = t ^ CRCPOLY;
-	}
-    }
     /* build the helptable for radix64 to bin conversion */
     for(i=0; i < 256; i++ )
 	asctobin[i] = 255; /* used to detect invalid characters */
@@ -797,7 +775,7 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
     int checkcrc=0;
     int rc = 0;
     size_t n = 0;
-    int  idx, i, onlypad=0;
+    int  idx, onlypad=0;
     u32 crc;
 
     crc = afx->crc;
@@ -819,6 +797,23 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
 	    continue;
 	}
 
+	if( !idx && size - n >= 3 ) {
+	    /* Decode as many complete groups as possible in one go.
+	     * C is the first character of the group; thus we step
+	     * back one character.  */
+	    size_t nchars = afx->buffer_len - afx->buffer_pos + 1;
+
+	    if( nchars / 4 > (size - n) / 3 )
+		nchars = (size - n) / 3 * 4;
+	    nchars = b64dec_groups (buf + n,
+				    afx->buffer + afx->buffer_pos - 1, nchars);
+	    if( nchars ) {
+		afx->buffer_pos += nchars - 1;
+		n += nchars / 4 * 3;
+		continue;
+	    }
+	}
+
       again:
 	if( c == '\n' || c == ' ' || c == '\r' || c == '\t' )
 	    continue;
@@ -881,9 +876,7 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
 	idx = (idx+1) % 4;
     }
 
-    for(i=0; i < n; i++ )
-	crc = (crc << 8) ^ crc_table[((crc >> 16)&0xff) ^ buf[i]];
-    crc &= 0x00ffffff;
+    crc = b64_crc24_update (crc, buf, n);
     afx->crc = crc;
     afx->idx = idx;
     afx->radbuf[0] = val;
@@ -1197,28 +1190,38 @@ armor_filter( void *opaque, int control,
 	for(i=0; i < idx; i++ )
 	    radbuf[i] = afx->radbuf[i];
 
-	for(i=0; i < size; i++ )
-	    crc = (crc << 8) ^ crc_table[((crc >> 16)&0xff) ^ buf[i]];
-	crc &= 0x00ffffff;
+	crc = b64_crc24_update (crc, buf, size);
 
-	for( ; size; buf++, size-- ) {
-	    radbuf[idx++] = *buf;
-	    if( idx > 2 ) {
+	while( size ) {
+	    char line[64];
+	    size_t ngroups;
+
+	    if( idx || size < 3 ) {
+		/* Collect a group from several calls.  */
+		radbuf[idx++] = *buf++;
+		size--;
+		if( idx < 3 )
+		    continue;
+		b64enc_groups (line, radbuf, 1);
 		idx = 0;
-		c = bintoasc[(*radbuf >> 2) & 077];
-		iobuf_put(a, c);
-		c = bintoasc[(((*radbuf<<4)&060)|((radbuf[1] >> 4)&017))&077];
-		iobuf_put(a, c);
-		c = bintoasc[(((radbuf[1]<<2)&074)|((radbuf[2]>>6)&03))&077];
-		iobuf_put(a, c);
-		c = bintoasc[radbuf[2]&077];
-		iobuf_put(a, c);
-		if( ++idx2 >= (64/4) )
-		  { /* pgp doesn't like 72 here */
-		    iobuf_writestr(a,afx->eol);
-		    idx2=0;
-		  }
+		ngroups = 1;
+	    }
+	    else {
+		/* Encode the rest of the line in one go.  */
+		ngroups = size / 3;
+		if( ngroups > (64/4) - idx2 )
+		    ngroups = (64/4) - idx2;
+		b64enc_groups (line, buf, ngroups);
+		buf += 3 * ngroups;
+		size -= 3 * ngroups;
 	    }
+	    iobuf_write (a, line, 4 * ngroups);
+	    idx2 += ngroups;
+	    if( idx2 >= (64/4) )
+	      { /* pgp doesn't like 72 here */
+		iobuf_writestr(a,afx->eol);
+		idx2=0;
+	      }
 	}
 	for(i=0; i < idx; i++ )
 	    afx->radbuf[i] = radbuf[i];
@@ -1562,8 +1565,9 @@ unarmor_pump (UnarmorPump x, int c)
     }
 
     if ( !(rval & ~255) ) { /* compute the CRC */
-        x->crc = (x->crc << 8) ^ crc_table[((x->crc >> 16)&0xff) ^ rval];
-        x->crc &= 0x00ffffff;
+        byte tmp = rval;
+
+        x->crc = b64_crc24_update (x->crc, &tmp, 1);
     }
 
     return rval;
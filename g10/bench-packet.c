@@ -0,0 +1,443 @@
+/* bench-packet.c - Benchmark for packet parsing, armor and ciphers
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* This benchmark measures:
+ *
+ *  - parse_packet on synthetic keyblocks with a primary key, a number
+ *    of user ids each with several certifications, and a subkey,
+ *  - the armor filter in both directions,
+ *  - the bulk ciphers as used for CFB with MDC and for AEAD.  The
+ *    latter runs Libgcrypt directly with the chunk layout of
+ *    cipher-aead.c; thus it shows the cost of the modes without the
+ *    filter overhead.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/iobuf.h"
+#include "packet.h"
+#include "filter.h"
+#include "main.h"
+#include "options.h"
+#include "../common/bench.h"
+
+/* The buffer used to read from an iobuf.  */
+static byte readbuf[8192];
+
+
+/* Return an MPI with NBITS random bits and the high bit set.  */
+static gcry_mpi_t
+random_mpi (unsigned int nbits)
+{
+  byte buf[512];
+  gcry_mpi_t a;
+
+  log_assert (nbits && nbits <= 8 * sizeof buf && !(nbits % 8));
+  bench_randomize (buf, nbits / 8);
+  buf[0] |= 0x80;
+  if (gcry_mpi_scan (&a, GCRYMPI_FMT_USG, buf, nbits / 8, NULL))
+    log_fatal ("gcry_mpi_scan failed\n");
+  return a;
+}
+
+
+/* Write a public key or subkey packet of type PKTTYPE with a random
+ * 2048 bit RSA key to OUT and return the keyid at KEYID.  */
+static void
+write_key (iobuf_t out, int pkttype, u32 timestamp, u32 *keyid)
+{
+  PACKET pkt;
+  PKT_public_key *pk;
+
+  pk = xmalloc_clear (sizeof *pk);
+  pk->version = 4;
+  pk->timestamp = timestamp;
+  pk->pubkey_algo = PUBKEY_ALGO_RSA;
+  pk->pkey[0] = random_mpi (2048);
+  pk->pkey[1] = gcry_mpi_set_ui (NULL, 65537);
+  keyid_from_pk (pk, keyid);
+
+  init_packet (&pkt);
+  pkt.pkttype = pkttype;
+  pkt.pkt.public_key = pk;
+  if (build_packet (out, &pkt))
+    log_fatal ("build_packet failed\n");
+  free_packet (&pkt, NULL);
+}
+
+
+/* Write a user id packet with STRING to OUT.  */
+static void
+write_uid (iobuf_t out, const char *string)
+{
+  PACKET pkt;
+  PKT_user_id *uid;
+  size_t n = strlen (string);
+
+  uid = xmalloc_clear (sizeof *uid + n);
+  uid->len = n;
+  uid->ref = 1;
+  strcpy (uid->name, string);
+
+  init_packet (&pkt);
+  pkt.pkttype = PKT_USER_ID;
+  pkt.pkt.user_id = uid;
+  if (build_packet (out, &pkt))
+    log_fatal ("build_packet failed\n");
+  free_packet (&pkt, NULL);
+}
+
+
+/* Write a signature of class SIGCLASS issued by KEYID with a random
+ * 2048 bit RSA value to OUT.  */
+static void
+write_sig (iobuf_t out, int sigclass, u32 timestamp, u32 *keyid)
+{
+  PACKET pkt;
+  PKT_signature *sig;
+  byte buf[8];
+
+  sig = xmalloc_clear (sizeof *sig);
+  sig->version = 4;
+  sig->sig_class = sigclass;
+  sig->pubkey_algo = PUBKEY_ALGO_RSA;
+  sig->digest_algo = DIGEST_ALGO_SHA256;
+  sig->timestamp = timestamp;
+  sig->keyid[0] = keyid[0];
+  sig->keyid[1] = keyid[1];
+
+  buf[0] = timestamp >> 24;
+  buf[1] = timestamp >> 16;
+  buf[2] = timestamp >> 8;
+  buf[3] = timestamp;
+  build_sig_subpkt (sig, SIGSUBPKT_SIG_CREATED, buf, 4);
+  buf[0] = keyid[0] >> 24;
+  buf[1] = keyid[0] >> 16;
+  buf[2] = keyid[0] >> 8;
+  buf[3] = keyid[0];
+  buf[4] = keyid[1] >> 24;
+  buf[5] = keyid[1] >> 16;
+  buf[6] = keyid[1] >> 8;
+  buf[7] = keyid[1];
+  build_sig_subpkt (sig, SIGSUBPKT_ISSUER, buf, 8);
+
+  bench_randomize (sig->digest_start, 2);
+  sig->data[0] = random_mpi (2048);
+
+  init_packet (&pkt);
+  pkt.pkttype = PKT_SIGNATURE;
+  pkt.pkt.signature = sig;
+  if (build_packet (out, &pkt))
+    log_fatal ("build_packet failed\n");
+  free_packet (&pkt, NULL);
+}
+
+
+/* Return a buffer with NKEYS keyblocks, each with NUIDS user ids
+ * with NSIGS signatures each and one subkey.  The length of the
+ * buffer is stored at R_LENGTH and the number of packets at
+ * R_NPACKETS.  */
+static byte *
+make_keyblocks (unsigned int nkeys, unsigned int nuids, unsigned int nsigs,
+                size_t *r_length, unsigned int *r_npackets)
+{
+  iobuf_t out;
+  unsigned int i, j, k;
+  u32 stamp = 0x5b000000;
+  u32 keyid[2], subkid[2], certkid[2];
+  char uid[80];
+  byte *buffer;
+
+  *r_npackets = 0;
+  out = iobuf_temp ();
+  for (i=0; i < nkeys; i++, stamp++)
+    {
+      write_key (out, PKT_PUBLIC_KEY, stamp, keyid);
+      for (j=0; j < nuids; j++)
+        {
+          snprintf (uid, sizeof uid, "Bench User %u.%u <user-%u.%u@example.org>",
+                    i, j, i, j);
+          write_uid (out, uid);
+          write_sig (out, 0x13, stamp, keyid);
+          for (k=1; k < nsigs; k++)
+            {
+              certkid[0] = i;
+              certkid[1] = k;
+              write_sig (out, 0x10, stamp, certkid);
+            }
+          *r_npackets += 1 + nsigs;
+        }
+      write_key (out, PKT_PUBLIC_SUBKEY, stamp, subkid);
+      write_sig (out, 0x18, stamp, keyid);
+      *r_npackets += 3;
+    }
+
+  iobuf_flush_temp (out);
+  *r_length = iobuf_get_temp_length (out);
+  buffer = xmalloc (*r_length);
+  memcpy (buffer, iobuf_get_temp_buffer (out), *r_length);
+  iobuf_close (out);
+  return buffer;
+}
+
+
+/* Parse the keyblocks created for NKEYS, NUIDS and NSIGS.  */
+static void
+bench_parse (unsigned int nkeys, unsigned int nuids, unsigned int nsigs)
+{
+  unsigned long long t0, usec;
+  unsigned int run, nruns = bench_repeat ();
+  struct parse_packet_ctx_s parsectx;
+  PACKET *pkt;
+  byte *buffer;
+  size_t length;
+  unsigned int npackets, n;
+  iobuf_t inp;
+  char name[50];
+  int rc;
+
+  buffer = make_keyblocks (nkeys, nuids, nsigs, &length, &npackets);
+  pkt = xmalloc (sizeof *pkt);
+
+  for (run=0, usec=~0ULL; run < nruns; run++)
+    {
+      t0 = bench_now ();
+      inp = iobuf_temp_with_content ((const char *)buffer, length);
+      init_parse_packet (&parsectx, inp);
+      init_packet (pkt);
+      for (n=0; (rc = parse_packet (&parsectx, pkt)) != -1; n++)
+        {
+          if (rc)
+            log_fatal ("parse_packet failed: %s\n", gpg_strerror (rc));
+          free_packet (pkt, &parsectx);
+        }
+      deinit_parse_packet (&parsectx);
+      iobuf_close (inp);
+      if (n != npackets)
+        log_fatal ("parsed %u packets; expected %u\n", n, npackets);
+      usec = bench_elapsed (t0, usec);
+    }
+
+  snprintf (name, sizeof name, "parse-%ux%ux%u", nkeys, nuids, nsigs);
+  bench_report ("packet", name, npackets, length, usec);
+
+  xfree (pkt);
+  xfree (buffer);
+}
+
+
+/* Armor DATA of LENGTH and dearmor it again.  */
+static void
+bench_armor (const byte *data, size_t length)
+{
+  unsigned long long t0, usec_enc, usec_dec;
+  unsigned int run, nruns = bench_repeat ();
+  armor_filter_context_t *afx;
+  iobuf_t out, inp;
+  byte *armored = NULL;
+  size_t armoredlen = 0;
+  size_t total;
+  int n;
+
+  for (run=0, usec_enc=usec_dec=~0ULL; run < nruns; run++)
+    {
+      t0 = bench_now ();
+      out = iobuf_temp ();
+      afx = new_armor_context ();
+      afx->what = 4;
+      push_armor_filter (afx, out);
+      if (iobuf_write (out, data, length))
+        log_fatal ("writing to the armor filter failed\n");
+      iobuf_flush_temp (out);
+      release_armor_context (afx);
+      usec_enc = bench_elapsed (t0, usec_enc);
+
+      xfree (armored);
+      armoredlen = iobuf_get_temp_length (out);
+      armored = xmalloc (armoredlen);
+      memcpy (armored, iobuf_get_temp_buffer (out), armoredlen);
+      iobuf_close (out);
+
+      t0 = bench_now ();
+      inp = iobuf_temp_with_content ((const char *)armored, armoredlen);
+      afx = new_armor_context ();
+      push_armor_filter (afx, inp);
+      for (total=0; (n = iobuf_read (inp, readbuf, sizeof readbuf)) != -1;)
+        total += n;
+      iobuf_close (inp);
+      release_armor_context (afx);
+      if (total != length)
+        log_fatal ("dearmored %zu bytes; expected %zu\n", total, length);
+      usec_dec = bench_elapsed (t0, usec_dec);
+    }
+
+  bench_report ("armor", "encode", 1, length, usec_enc);
+  bench_report ("armor", "decode", 1, armoredlen, usec_dec);
+  xfree (armored);
+}
+
+
+/* Encrypt DATA of LENGTH with AES-256 in CFB mode and compute the
+ * MDC over it like cipher-cfb.c does.  */
+static void
+bench_cfb (byte *data, size_t length)
+{
+  unsigned long long t0, usec;
+  unsigned int run, nruns = bench_repeat ();
+  gcry_cipher_hd_t hd;
+  gcry_md_hd_t md;
+  byte key[32];
+  size_t off, n;
+
+  bench_randomize (key, sizeof key);
+  for (run=0, usec=~0ULL; run < nruns; run++)
+    {
+      t0 = bench_now ();
+      if (gcry_cipher_open (&hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_CFB,
+                            GCRY_CIPHER_ENABLE_SYNC)
+          || gcry_cipher_setkey (hd, key, sizeof key)
+          || gcry_cipher_setiv (hd, NULL, 0)
+          || gcry_md_open (&md, GCRY_MD_SHA1, 0))
+        log_fatal ("error setting up the cipher\n");
+      for (off=0; off < length; off += n)
+        {
+          n = length - off < sizeof readbuf? length - off : sizeof readbuf;
+          gcry_md_write (md, data + off, n);
+          gcry_cipher_encrypt (hd, data + off, n, NULL, 0);
+        }
+      gcry_md_final (md);
+      gcry_md_close (md);
+      gcry_cipher_close (hd);
+      usec = bench_elapsed (t0, usec);
+    }
+
+  bench_report ("cipher", "cfb-mdc", 1, length, usec);
+}
+
+
+/* Encrypt DATA of LENGTH with AES-256 using the AEAD algorithm ALGO
+ * and chunks of 2^CHUNKBITS bytes like cipher-aead.c does.  */
+static void
+bench_aead (byte *data, size_t length, aead_algo_t algo,
+            unsigned int chunkbits)
+{
+  unsigned long long t0, usec;
+  unsigned int run, nruns = bench_repeat ();
+  enum gcry_cipher_modes mode;
+  unsigned int noncelen;
+  gcry_cipher_hd_t hd;
+  byte key[32];
+  byte iv[16];
+  byte nonce[16];
+  byte adata[13];
+  byte tag[16];
+  size_t chunklen = (size_t)1 << chunkbits;
+  size_t off, chunkoff, n;
+  uint64_t chunkindex;
+  char name[40];
+  int i;
+
+  if (openpgp_aead_algo_info (algo, &mode, &noncelen)
+      || gcry_cipher_open (&hd, GCRY_CIPHER_AES256, mode, 0))
+    return;  /* Not supported by this Libgcrypt.  */
+  gcry_cipher_close (hd);
+
+  bench_randomize (key, sizeof key);
+  bench_randomize (iv, sizeof iv);
+  adata[0] = 0xd4;
+  adata[1] = 1;
+  adata[2] = CIPHER_ALGO_AES256;
+  adata[3] = algo;
+  adata[4] = chunkbits - 6;
+
+  for (run=0, usec=~0ULL; run < nruns; run++)
+    {
+      t0 = bench_now ();
+      if (gcry_cipher_open (&hd, GCRY_CIPHER_AES256, mode, 0)
+          || gcry_cipher_setkey (hd, key, sizeof key))
+        log_fatal ("error setting up the cipher\n");
+      for (off=0, chunkindex=0; off < length; off += chunklen, chunkindex++)
+        {
+          memcpy (nonce, iv, noncelen);
+          for (i=0; i < 8; i++)
+            {
+              nonce[noncelen - 8 + i] ^= chunkindex >> (56 - 8 * i);
+              adata[5 + i] = chunkindex >> (56 - 8 * i);
+            }
+          if (gcry_cipher_setiv (hd, nonce, noncelen)
+              || gcry_cipher_authenticate (hd, adata, sizeof adata))
+            log_fatal ("error starting the chunk\n");
+          for (chunkoff=0; chunkoff < chunklen && off + chunkoff < length;
+               chunkoff += n)
+            {
+              n = length - off - chunkoff;
+              if (n > chunklen - chunkoff)
+                n = chunklen - chunkoff;
+              if (n > sizeof readbuf)
+                n = sizeof readbuf;
+              if (chunkoff + n == chunklen || off + chunkoff + n == length)
+                gcry_cipher_final (hd);
+              gcry_cipher_encrypt (hd, data + off + chunkoff, n, NULL, 0);
+            }
+          gcry_cipher_gettag (hd, tag, sizeof tag);
+        }
+      gcry_cipher_close (hd);
+      usec = bench_elapsed (t0, usec);
+    }
+
+  snprintf (name, sizeof name, "aead-%s-chunk-%u",
+            openpgp_aead_algo_name (algo), chunkbits);
+  bench_report ("cipher", name, (length + chunklen - 1) / chunklen,
+                length, usec);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  unsigned int scale = bench_scale ();
+  size_t length = 16 * 1024 * 1024 * (size_t)scale;
+  byte *data;
+
+  (void)argc;
+  (void)argv;
+
+  gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
+  gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+  bench_parse (1000 * scale, 1, 1);
+  bench_parse (100 * scale, 10, 10);
+  bench_parse (10 * scale, 10, 100);
+
+  data = xmalloc (length);
+  bench_randomize (data, length);
+  bench_armor (data, length / 4);
+  bench_cfb (data, length);
+  bench_aead (data, length, AEAD_ALGO_OCB, 22);
+  bench_aead (data, length, AEAD_ALGO_OCB, 27);
+  bench_aead (data, length, AEAD_ALGO_EAX, 22);
+  xfree (data);
+
+  return 0;
+}
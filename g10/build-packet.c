@@ -1564,10 +1564,13 @@ do_signature( IOBUF out, int ctb, PKT_signature *sig )
   iobuf_put(a, sig->digest_start[0] );
   iobuf_put(a, sig->digest_start[1] );
   n = pubkey_get_nsig( sig->pubkey_algo );
-  if ( !n )
+  if ( !n || sig->flags.raw_data )
     write_fake_data( a, sig->data[0] );
-  for (i=0; i < n && !rc ; i++ )
-    rc = gpg_mpi_write (a, sig->data[i] );
+  else
+    {
+      for (i=0; i < n && !rc ; i++ )
+        rc = gpg_mpi_write (a, sig->data[i] );
+    }
 
   if (!rc)
     {
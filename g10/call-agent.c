@@ -48,6 +48,17 @@
 static assuan_context_t agent_ctx = NULL;
 static int did_early_card_test;
 
+/* The keygrips of all secret keys as returned by HAVEKEY --list.
+ * This saves a round trip to the agent for each key probed.  The
+ * list is invalidated by all functions which may create or delete
+ * a secret key.  */
+static struct
+{
+  int state;              /* 0 = not loaded, 1 = loaded, -1 = n/a.  */
+  unsigned char *grips;   /* NGRIPS sorted keygrips of 20 bytes.  */
+  size_t ngrips;
+} havekey_cache;
+
 struct default_inq_parm_s
 {
   ctrl_t ctrl;
@@ -104,6 +115,7 @@ struct cache_nonce_parm_s
 
 
 static gpg_error_t learn_status_cb (void *opaque, const char *line);
+static void havekey_cache_invalidate (void);
 
 
 
@@ -716,6 +728,7 @@ agent_scd_learn (struct agent_card_info_s *info, int force)
   struct default_inq_parm_s parm;
   struct agent_card_info_s dummyinfo;
 
+  havekey_cache_invalidate ();
   if (!info)
     info = &dummyinfo;
   memset (info, 0, sizeof *info);
@@ -806,6 +819,7 @@ agent_keytocard (const char *hexgrip, int keyno, int force,
   char line[ASSUAN_LINELENGTH];
   struct default_inq_parm_s parm;
 
+  havekey_cache_invalidate ();
   memset (&parm, 0, sizeof parm);
 
   snprintf (line, DIM(line), "KEYTOCARD %s%s %s OPENPGP.%d %s",
@@ -994,6 +1008,7 @@ agent_scd_writekey (int keyno, const char *serialno,
   struct writekey_parm_s parms;
   struct default_inq_parm_s dfltparm;
 
+  havekey_cache_invalidate ();
   memset (&dfltparm, 0, sizeof dfltparm);
 
   (void)serialno;
@@ -1057,6 +1072,7 @@ agent_scd_genkey (int keyno, int force, u32 *createtime)
   gnupg_isotime_t tbuf;
   struct default_inq_parm_s dfltparm;
 
+  havekey_cache_invalidate ();
   memset (&dfltparm, 0, sizeof dfltparm);
 
   rc = start_agent (NULL, 1);
@@ -1478,6 +1494,73 @@ agent_get_s2k_count (unsigned long *r_count)
 
 
 
+/* Drop the cached list of secret keys.  */
+static void
+havekey_cache_invalidate (void)
+{
+  if (havekey_cache.state == 1)
+    {
+      xfree (havekey_cache.grips);
+      havekey_cache.grips = NULL;
+      havekey_cache.ngrips = 0;
+      havekey_cache.state = 0;
+    }
+}
+
+
+/* qsort and bsearch compare function for keygrips.  */
+static int
+cmp_keygrips (const void *a, const void *b)
+{
+  return memcmp (a, b, KEYGRIP_LEN);
+}
+
+
+/* Check the cached list of secret keys for GRIP.  Returns 0 if the
+ * key is available, GPG_ERR_NO_SECKEY if not, and GPG_ERR_NOT_SUPPORTED
+ * if the agent does not support HAVEKEY --list.  The agent must have
+ * been started.  */
+static gpg_error_t
+havekey_cache_lookup (const unsigned char *grip)
+{
+  gpg_error_t err;
+  membuf_t data;
+  unsigned char *buf;
+  size_t len;
+
+  if (!havekey_cache.state)
+    {
+      init_membuf (&data, 1024);
+      err = assuan_transact (agent_ctx, "HAVEKEY --list",
+                             put_membuf_cb, &data,
+                             NULL, NULL, NULL, NULL);
+      buf = get_membuf (&data, &len);
+      if (err || !buf)
+        {
+          /* Probably an old agent; do not try again.  */
+          xfree (buf);
+          havekey_cache.state = -1;
+        }
+      else
+        {
+          havekey_cache.grips = buf;
+          havekey_cache.ngrips = len / KEYGRIP_LEN;
+          if (havekey_cache.ngrips > 1)
+            qsort (havekey_cache.grips, havekey_cache.ngrips, KEYGRIP_LEN,
+                   cmp_keygrips);
+          havekey_cache.state = 1;
+        }
+    }
+
+  if (havekey_cache.state != 1)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  if (bsearch (grip, havekey_cache.grips, havekey_cache.ngrips, KEYGRIP_LEN,
+               cmp_keygrips))
+    return 0;
+  return gpg_error (GPG_ERR_NO_SECKEY);
+}
+
+
 /* Ask the agent whether a secret key for the given public key is
    available.  Returns 0 if available.  */
 gpg_error_t
@@ -1486,11 +1569,19 @@ agent_probe_secret_key (ctrl_t ctrl, PKT_public_key *pk)
   gpg_error_t err;
   char line[ASSUAN_LINELENGTH];
   char *hexgrip;
+  unsigned char grip[KEYGRIP_LEN];
 
   err = start_agent (ctrl, 0);
   if (err)
     return err;
 
+  err = keygrip_from_pk (pk, grip);
+  if (err)
+    return err;
+  err = havekey_cache_lookup (grip);
+  if (gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED)
+    return err;
+
   err = hexkeygrip_from_pk (pk, &hexgrip);
   if (err)
     return err;
@@ -1520,6 +1611,24 @@ agent_probe_any_secret_key (ctrl_t ctrl, kbnode_t keyblock)
 
   err = gpg_error (GPG_ERR_NO_SECKEY); /* Just in case no key was
                                           found in KEYBLOCK.  */
+
+  /* First try the cached list of secret keys.  */
+  for (kbctx=NULL; (node = walk_kbnode (keyblock, &kbctx, 0)); )
+    if (node->pkt->pkttype == PKT_PUBLIC_KEY
+        || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+        || node->pkt->pkttype == PKT_SECRET_KEY
+        || node->pkt->pkttype == PKT_SECRET_SUBKEY)
+      {
+        err = keygrip_from_pk (node->pkt->pkt.public_key, grip);
+        if (!err)
+          err = havekey_cache_lookup (grip);
+        if (gpg_err_code (err) != GPG_ERR_NO_SECKEY)
+          break;
+      }
+  if (gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED)
+    return err;
+
+  err = gpg_error (GPG_ERR_NO_SECKEY);
   p = stpcpy (line, "HAVEKEY");
   for (kbctx=NULL, nkeys=0; (node = walk_kbnode (keyblock, &kbctx, 0)); )
     if (node->pkt->pkttype == PKT_PUBLIC_KEY
@@ -1638,6 +1747,59 @@ agent_get_keyinfo (ctrl_t ctrl, const char *hexkeygrip,
 }
 
 
+/* Status callback for agent_list_secret_keys.  */
+static gpg_error_t
+list_keyinfo_status_cb (void *opaque, const char *line)
+{
+  strlist_t *listp = opaque;
+  strlist_t sl;
+  char *fields[6];
+  char *s;
+
+  if ((s = has_leading_keyword (line, "KEYINFO"))
+      && split_fields (s, fields, DIM (fields)) == 6
+      && strlen (fields[0]) == 40)
+    {
+      sl = add_to_strlist_try (listp, fields[0]);
+      if (!sl)
+        return gpg_error_from_syserror ();
+      if (*fields[4] == '1' || *fields[5] == 'C')
+        sl->flags |= AGENT_KEYINFO_CACHED;
+      if (*fields[1] == 'T')
+        sl->flags |= AGENT_KEYINFO_TOKEN;
+    }
+  return 0;
+}
+
+
+/* Return the keygrips of all secret keys known to the agent at
+ * R_LIST.  The flags of each item are a combination of
+ * AGENT_KEYINFO_CACHED and AGENT_KEYINFO_TOKEN.  This needs only one
+ * round trip to the agent and is thus much faster than probing many
+ * keys with agent_probe_secret_key.  The caller must free the list
+ * with free_strlist.  */
+gpg_error_t
+agent_list_secret_keys (ctrl_t ctrl, strlist_t *r_list)
+{
+  gpg_error_t err;
+  strlist_t list = NULL;
+
+  *r_list = NULL;
+
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+
+  err = assuan_transact (agent_ctx, "KEYINFO --list", NULL, NULL, NULL, NULL,
+                         list_keyinfo_status_cb, &list);
+  if (err)
+    free_strlist (list);
+  else
+    *r_list = list;
+  return err;
+}
+
+
 /* Status callback for agent_import_key, agent_export_key and
    agent_genkey.  */
 static gpg_error_t
@@ -1718,6 +1880,7 @@ agent_genkey (ctrl_t ctrl, char **cache_nonce_addr, char **passwd_nonce_addr,
   unsigned char *buf;
   char line[ASSUAN_LINELENGTH];
 
+  havekey_cache_invalidate ();
   memset (&dfltparm, 0, sizeof dfltparm);
   dfltparm.ctrl = ctrl;
 
@@ -2156,6 +2319,7 @@ agent_import_key (ctrl_t ctrl, const char *desc, char **cache_nonce_addr,
   char line[ASSUAN_LINELENGTH];
   struct default_inq_parm_s dfltparm;
 
+  havekey_cache_invalidate ();
   memset (&dfltparm, 0, sizeof dfltparm);
   dfltparm.ctrl = ctrl;
   dfltparm.keyinfo.keyid       = keyid;
@@ -2280,6 +2444,7 @@ agent_delete_key (ctrl_t ctrl, const char *hexkeygrip, const char *desc,
   char line[ASSUAN_LINELENGTH];
   struct default_inq_parm_s dfltparm;
 
+  havekey_cache_invalidate ();
   memset (&dfltparm, 0, sizeof dfltparm);
   dfltparm.ctrl = ctrl;
 
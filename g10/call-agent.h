@@ -158,6 +158,13 @@ gpg_error_t agent_probe_any_secret_key (ctrl_t ctrl, kbnode_t keyblock);
 gpg_error_t agent_get_keyinfo (ctrl_t ctrl, const char *hexkeygrip,
                                char **r_serialno, int *r_cleartext);
 
+/* Flags of the items returned by agent_list_secret_keys.  */
+#define AGENT_KEYINFO_CACHED    1  /* Passphrase cached or unprotected.  */
+#define AGENT_KEYINFO_TOKEN     2  /* Key is stored on a smartcard.  */
+
+/* Return a list with the keygrips of all secret keys.  */
+gpg_error_t agent_list_secret_keys (ctrl_t ctrl, strlist_t *r_list);
+
 /* Generate a new key.  */
 gpg_error_t agent_genkey (ctrl_t ctrl,
                           char **cache_nonce_addr, char **passwd_nonce_addr,
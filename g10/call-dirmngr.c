@@ -631,6 +631,63 @@ ks_get_data_cb (void *opaque, const void *data, size_t datalen)
 }
 
 
+/* Ask the dirmngr to write the output of the next command to a
+ * temporary file instead of sending it as data lines.  This saves
+ * the escaping and line splitting for large keyblocks.  On success
+ * the stream of that file is stored at R_FP.  If the file descriptor
+ * can't be passed to the dirmngr, NULL is stored at R_FP and the
+ * data lines are used.  */
+static void
+setup_output_tmpfile (assuan_context_t ctx, estream_t *r_fp)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)ctx;
+  *r_fp = NULL;
+#else
+  estream_t fp;
+
+  *r_fp = NULL;
+  fp = es_tmpfile ();
+  if (!fp)
+    return;
+  if (assuan_sendfd (ctx, INT2FD (es_fileno (fp)))
+      || assuan_transact (ctx, "OUTPUT FD", NULL, NULL, NULL, NULL,
+                          NULL, NULL))
+    {
+      es_fclose (fp);
+      return;
+    }
+  *r_fp = fp;
+#endif
+}
+
+
+/* Return the stream with the result of KS_GET or KS_FETCH.  PARM is
+ * the parameter of the data callback and OUTFP the stream set up by
+ * setup_output_tmpfile.  A dirmngr which does not know about the
+ * output file still sends data lines; thus we take whatever got
+ * data.  The other stream is closed.  */
+static estream_t
+take_ks_get_result (struct ks_get_parm_s *parm, estream_t outfp)
+{
+  estream_t fp;
+
+  if (outfp && !es_ftello (parm->memfp))
+    {
+      es_fclose (parm->memfp);
+      fp = outfp;
+    }
+  else
+    {
+      es_fclose (outfp);
+      fp = parm->memfp;
+    }
+  parm->memfp = NULL;
+  es_rewind (fp);
+  return fp;
+}
+
+
 /* Run the KS_GET command using the patterns in the array PATTERN.  On
    success an estream object is returned to retrieve the keys.  On
    error an error code is returned and NULL stored at R_FP.
@@ -662,6 +719,7 @@ gpg_dirmngr_ks_get (ctrl_t ctrl, char **pattern,
   size_t linelen;
   membuf_t mb;
   int idx;
+  estream_t outfp = NULL;
 
   memset (&stparm, 0, sizeof stparm);
   memset (&parm, 0, sizeof parm);
@@ -722,14 +780,14 @@ gpg_dirmngr_ks_get (ctrl_t ctrl, char **pattern,
       err = gpg_error_from_syserror ();
       goto leave;
     }
+  setup_output_tmpfile (ctx, &outfp);
   err = assuan_transact (ctx, line, ks_get_data_cb, &parm,
                          NULL, NULL, ks_status_cb, &stparm);
   if (err)
     goto leave;
 
-  es_rewind (parm.memfp);
-  *r_fp = parm.memfp;
-  parm.memfp = NULL;
+  *r_fp = take_ks_get_result (&parm, outfp);
+  outfp = NULL;
 
   if (r_source)
     {
@@ -738,6 +796,7 @@ gpg_dirmngr_ks_get (ctrl_t ctrl, char **pattern,
     }
 
  leave:
+  es_fclose (outfp);
   es_fclose (parm.memfp);
   xfree (stparm.source);
   xfree (line);
@@ -761,6 +820,7 @@ gpg_dirmngr_ks_fetch (ctrl_t ctrl, const char *url, estream_t *r_fp)
   assuan_context_t ctx;
   struct ks_get_parm_s parm;
   char *line = NULL;
+  estream_t outfp = NULL;
 
   memset (&parm, 0, sizeof parm);
 
@@ -788,16 +848,17 @@ gpg_dirmngr_ks_fetch (ctrl_t ctrl, const char *url, estream_t *r_fp)
       err = gpg_error_from_syserror ();
       goto leave;
     }
+  setup_output_tmpfile (ctx, &outfp);
   err = assuan_transact (ctx, line, ks_get_data_cb, &parm,
                          NULL, NULL, NULL, NULL);
   if (err)
     goto leave;
 
-  es_rewind (parm.memfp);
-  *r_fp = parm.memfp;
-  parm.memfp = NULL;
+  *r_fp = take_ks_get_result (&parm, outfp);
+  outfp = NULL;
 
  leave:
+  es_fclose (outfp);
   es_fclose (parm.memfp);
   xfree (line);
   close_context (ctrl, ctx);
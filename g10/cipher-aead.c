@@ -55,12 +55,45 @@ my_iobuf_write (iobuf_t a, const void *buffer, size_t buflen)
 }
 
 
-/* Set the nonce and the additional data for the current chunk.  If
- * FINAL is set the final AEAD chunk is processed.  This also reset
- * the encryption machinery so that the handle can be used for a new
- * chunk.  */
+/* An object to encrypt one chunk in a worker thread.  */
+struct aead_chunk_s
+{
+  /* The job for the workpool; this must be the first member.  */
+  struct workpool_job_s job;
+
+  /* Our filter context.  The worker only reads the constant parameters
+   * of the encryption from it.  */
+  cipher_filter_context_t *cfx;
+
+  /* The cipher handle for this chunk object.  */
+  gcry_cipher_hd_t cipher_hd;
+
+  /* The index of the chunk.  */
+  uint64_t chunkindex;
+
+  /* The buffer with a size of CFX->CHUNKSIZE and its used length.  */
+  char *buffer;
+  size_t buflen;
+
+  /* The authentication tag and the result of the encryption.  */
+  byte tag[16];
+  gpg_error_t err;
+
+  /* Set while the chunk has been submitted but not yet written.  */
+  unsigned int pending:1;
+};
+typedef struct aead_chunk_s *aead_chunk_t;
+
+
+/* Set the nonce and the additional data for chunk CHUNKINDEX on the
+ * cipher handle HD.  If FINAL is set the final AEAD chunk is
+ * processed.  This also reset the encryption machinery so that the
+ * handle can be used for a new chunk.  If NOLOG is set debug output
+ * is suppressed; this is required when called from a worker
+ * thread.  */
 static gpg_error_t
-set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
+setup_chunk (cipher_filter_context_t *cfx, gcry_cipher_hd_t hd,
+             uint64_t chunkindex, int final, int nolog)
 {
   gpg_error_t err;
   unsigned char nonce[16];
@@ -83,18 +116,18 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
       BUG ();
     }
 
-  nonce[i++] ^= cfx->chunkindex >> 56;
-  nonce[i++] ^= cfx->chunkindex >> 48;
-  nonce[i++] ^= cfx->chunkindex >> 40;
-  nonce[i++] ^= cfx->chunkindex >> 32;
-  nonce[i++] ^= cfx->chunkindex >> 24;
-  nonce[i++] ^= cfx->chunkindex >> 16;
-  nonce[i++] ^= cfx->chunkindex >>  8;
-  nonce[i++] ^= cfx->chunkindex;
+  nonce[i++] ^= chunkindex >> 56;
+  nonce[i++] ^= chunkindex >> 48;
+  nonce[i++] ^= chunkindex >> 40;
+  nonce[i++] ^= chunkindex >> 32;
+  nonce[i++] ^= chunkindex >> 24;
+  nonce[i++] ^= chunkindex >> 16;
+  nonce[i++] ^= chunkindex >>  8;
+  nonce[i++] ^= chunkindex;
 
-  if (DBG_CRYPTO)
+  if (DBG_CRYPTO && !nolog)
     log_printhex (nonce, 15, "nonce:");
-  err = gcry_cipher_setiv (cfx->cipher_hd, nonce, i);
+  err = gcry_cipher_setiv (hd, nonce, i);
   if (err)
     return err;
 
@@ -103,14 +136,14 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
   ad[2] = cfx->dek->algo;
   ad[3] = cfx->dek->use_aead;
   ad[4] = cfx->chunkbyte;
-  ad[5] = cfx->chunkindex >> 56;
-  ad[6] = cfx->chunkindex >> 48;
-  ad[7] = cfx->chunkindex >> 40;
-  ad[8] = cfx->chunkindex >> 32;
-  ad[9] = cfx->chunkindex >> 24;
-  ad[10]= cfx->chunkindex >> 16;
-  ad[11]= cfx->chunkindex >>  8;
-  ad[12]= cfx->chunkindex;
+  ad[5] = chunkindex >> 56;
+  ad[6] = chunkindex >> 48;
+  ad[7] = chunkindex >> 40;
+  ad[8] = chunkindex >> 32;
+  ad[9] = chunkindex >> 24;
+  ad[10]= chunkindex >> 16;
+  ad[11]= chunkindex >>  8;
+  ad[12]= chunkindex;
   if (final)
     {
       ad[13] = cfx->total >> 56;
@@ -122,9 +155,126 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
       ad[19] = cfx->total >>  8;
       ad[20] = cfx->total;
     }
-  if (DBG_CRYPTO)
+  if (DBG_CRYPTO && !nolog)
     log_printhex (ad, final? 21 : 13, "authdata:");
-  return gcry_cipher_authenticate (cfx->cipher_hd, ad, final? 21 : 13);
+  return gcry_cipher_authenticate (hd, ad, final? 21 : 13);
+}
+
+
+/* The job function to encrypt a complete chunk.  This is run by a
+ * worker thread.  */
+static void
+encrypt_chunk_job (void *opaque)
+{
+  aead_chunk_t chunk = opaque;
+  gpg_error_t err;
+
+  err = setup_chunk (chunk->cfx, chunk->cipher_hd, chunk->chunkindex, 0, 1);
+  if (!err)
+    {
+      gcry_cipher_final (chunk->cipher_hd);
+      err = gcry_cipher_encrypt (chunk->cipher_hd,
+                                 chunk->buffer, chunk->buflen, NULL, 0);
+    }
+  if (!err)
+    err = gcry_cipher_gettag (chunk->cipher_hd, chunk->tag, 16);
+  chunk->err = err;
+}
+
+
+/* Set the nonce and the additional data for the current chunk.  If
+ * FINAL is set the final AEAD chunk is processed.  */
+static gpg_error_t
+set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
+{
+  return setup_chunk (cfx, cfx->cipher_hd, cfx->chunkindex, final, 0);
+}
+
+
+/* Detach CFX from the worker threads and release the chunk objects.  */
+static void
+release_workers (cipher_filter_context_t *cfx)
+{
+  unsigned int i;
+
+  if (cfx->aead_chunks)
+    {
+      for (i=0; i < cfx->aead_nchunks; i++)
+        {
+          /* The pool is shared; wait for our still running jobs.  */
+          if (cfx->aead_chunks[i].pending)
+            workpool_wait (cfx->aead_pool, &cfx->aead_chunks[i].job);
+          xfree (cfx->aead_chunks[i].buffer);
+          gcry_cipher_close (cfx->aead_chunks[i].cipher_hd);
+        }
+      xfree (cfx->aead_chunks);
+      cfx->aead_chunks = NULL;
+    }
+  cfx->aead_nchunks = 0;
+  cfx->aead_pool = NULL;
+}
+
+
+/* Get the worker threads for CFX and allocate one more chunk object
+ * than we have threads so that the next chunk can be filled while all
+ * threads are busy.  Each chunk object gets its own cipher handle
+ * using CIPHERMODE.  */
+static gpg_error_t
+setup_workers (cipher_filter_context_t *cfx, enum gcry_cipher_modes ciphermode)
+{
+  gpg_error_t err;
+  aead_chunk_t chunk;
+  unsigned int i;
+
+  if (cfx->chunksize > (size_t)(-1))
+    return gpg_error (GPG_ERR_TOO_LARGE);
+
+  err = workpool_get_shared (&cfx->aead_pool);
+  if (err)
+    return err;
+
+  cfx->aead_nchunks = workpool_nthreads (cfx->aead_pool) + 1;
+  cfx->aead_cur = 0;
+  cfx->aead_chunks = xtrycalloc (cfx->aead_nchunks, sizeof *cfx->aead_chunks);
+  if (!cfx->aead_chunks)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  for (i=0; i < cfx->aead_nchunks; i++)
+    {
+      chunk = cfx->aead_chunks + i;
+      chunk->cfx = cfx;
+      chunk->job.func = encrypt_chunk_job;
+      chunk->job.opaque = chunk;
+      chunk->buffer = xtrymalloc (cfx->chunksize);
+      if (!chunk->buffer)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      err = openpgp_cipher_open (&chunk->cipher_hd, cfx->dek->algo,
+                                 ciphermode, GCRY_CIPHER_SECURE);
+      if (!err)
+        err = gcry_cipher_setkey (chunk->cipher_hd,
+                                  cfx->dek->key, cfx->dek->keylen);
+      if (err)
+        goto leave;
+    }
+
+  if (DBG_FILTER)
+    log_debug ("using %u chunk objects of %ju bytes\n",
+               cfx->aead_nchunks, (uintmax_t)cfx->chunksize);
+
+ leave:
+  if (err)
+    {
+      log_error ("error setting up AEAD worker threads: %s\n",
+                 gpg_strerror (err));
+      release_workers (cfx);
+    }
+  return err;
 }
 
 
@@ -200,6 +350,13 @@ write_header (cipher_filter_context_t *cfx, iobuf_t a)
   if (err)
     return err;
 
+  if (opt.aead_threads > 1)
+    {
+      err = setup_workers (cfx, ciphermode);
+      if (err)
+        goto leave;
+    }
+
   cfx->wrote_header = 1;
 
  leave:
@@ -353,6 +510,126 @@ do_flush (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
 }
 
 
+/* Wait for the pending CHUNK and write it to stream A.  */
+static gpg_error_t
+write_pending_chunk (cipher_filter_context_t *cfx, aead_chunk_t chunk,
+                     iobuf_t a)
+{
+  gpg_error_t err;
+
+  workpool_wait (cfx->aead_pool, &chunk->job);
+  chunk->pending = 0;
+  err = chunk->err;
+  if (err)
+    {
+      log_error ("encrypting chunk %ju failed: %s\n",
+                 (uintmax_t)chunk->chunkindex, gpg_strerror (err));
+      return err;
+    }
+
+  if (DBG_FILTER)
+    log_debug ("writing chunk %ju: chunklen=%zu\n",
+               (uintmax_t)chunk->chunkindex, chunk->buflen);
+  err = my_iobuf_write (a, chunk->buffer, chunk->buflen);
+  if (!err)
+    err = my_iobuf_write (a, chunk->tag, 16);
+  chunk->buflen = 0;
+  return err;
+}
+
+
+/* Hand the current chunk of CFX over to the workers and switch to the
+ * next chunk object.  */
+static void
+submit_current_chunk (cipher_filter_context_t *cfx)
+{
+  aead_chunk_t chunk = cfx->aead_chunks + cfx->aead_cur;
+
+  chunk->chunkindex = cfx->chunkindex++;
+  chunk->pending = 1;
+  cfx->total += chunk->buflen;
+  workpool_submit (cfx->aead_pool, &chunk->job);
+  cfx->aead_cur = (cfx->aead_cur + 1) % cfx->aead_nchunks;
+}
+
+
+/* The multi-threaded version of do_flush.  Complete chunks are
+ * encrypted by the workers.  Because the chunk objects are used in a
+ * round robin fashion, a still pending chunk object we want to fill
+ * is always the oldest one; thus writing it before re-using it keeps
+ * the chunks in order.  */
+static gpg_error_t
+do_flush_threaded (cipher_filter_context_t *cfx, iobuf_t a,
+                   byte *buf, size_t size)
+{
+  gpg_error_t err;
+  aead_chunk_t chunk;
+  size_t n;
+
+  while (size)
+    {
+      chunk = cfx->aead_chunks + cfx->aead_cur;
+      if (chunk->pending)
+        {
+          err = write_pending_chunk (cfx, chunk, a);
+          if (err)
+            return err;
+        }
+
+      n = cfx->chunksize - chunk->buflen;
+      if (n > size)
+        n = size;
+      memcpy (chunk->buffer + chunk->buflen, buf, n);
+      chunk->buflen += n;
+      buf  += n;
+      size -= n;
+
+      if (chunk->buflen == cfx->chunksize)
+        submit_current_chunk (cfx);
+    }
+
+  return 0;
+}
+
+
+/* The multi-threaded version of do_free.  */
+static gpg_error_t
+do_free_threaded (cipher_filter_context_t *cfx, iobuf_t a)
+{
+  gpg_error_t err = 0;
+  unsigned int i;
+  aead_chunk_t chunk;
+
+  chunk = cfx->aead_chunks + cfx->aead_cur;
+  if (!chunk->pending && chunk->buflen)
+    submit_current_chunk (cfx);
+
+  /* Write all pending chunks starting with the oldest one.  */
+  for (i=0; i < cfx->aead_nchunks; i++)
+    {
+      chunk = cfx->aead_chunks + ((cfx->aead_cur + i) % cfx->aead_nchunks);
+      if (chunk->pending)
+        {
+          err = write_pending_chunk (cfx, chunk, a);
+          if (err)
+            goto leave;
+        }
+    }
+
+  if (DBG_FILTER)
+    log_debug ("creating final chunk\n");
+  err = write_final_chunk (cfx, a);
+
+ leave:
+  release_workers (cfx);
+  xfree (cfx->buffer);
+  cfx->buffer = NULL;
+  gcry_cipher_close (cfx->cipher_hd);
+  cfx->cipher_hd = NULL;
+  return err;
+}
+
+
 /* The core of the free sub-function of cipher_filter_aead.   */
 static gpg_error_t
 do_free (cipher_filter_context_t *cfx, iobuf_t a)
@@ -432,12 +709,17 @@ cipher_filter_aead (void *opaque, int control,
     {
       if (!cfx->wrote_header && (rc=write_header (cfx, a)))
         ;
+      else if (cfx->aead_pool)
+        rc = do_flush_threaded (cfx, a, buf, size);
       else
         rc = do_flush (cfx, a, buf, size);
     }
   else if (control == IOBUFCTRL_FREE)
     {
-      rc = do_free (cfx, a);
+      if (cfx->aead_pool)
+        rc = do_free_threaded (cfx, a);
+      else
+        rc = do_free (cfx, a);
     }
   else if (control == IOBUFCTRL_DESC)
     {
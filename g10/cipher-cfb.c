@@ -136,8 +136,21 @@ cipher_filter_cfb (void *opaque, int control,
       if (!cfx->wrote_header)
         write_header (cfx, a);
       if (cfx->mdc_hash)
-        gcry_md_write (cfx->mdc_hash, buf, size);
-      gcry_cipher_encrypt (cfx->cipher_hd, buf, size, NULL, 0);
+        {
+          byte *p;
+          size_t n, len;
+
+          /* Hash and encrypt cache sized chunks so that the data is
+           * read only once from memory.  */
+          for (p = buf, len = size; len; p += n, len -= n)
+            {
+              n = len < CRYPT_CHUNK_SIZE? len : CRYPT_CHUNK_SIZE;
+              gcry_md_write (cfx->mdc_hash, p, n);
+              gcry_cipher_encrypt (cfx->cipher_hd, p, n, NULL, 0);
+            }
+        }
+      else
+        gcry_cipher_encrypt (cfx->cipher_hd, buf, size, NULL, 0);
       if (cfx->short_blklen_warn)
         {
           cfx->short_blklen_count += size;
@@ -57,6 +57,73 @@ int compress_filter_bz2( void *opaque, int control,
 			 IOBUF a, byte *buf, size_t *ret_len);
 
 #ifdef HAVE_ZIP
+/* The size of the blocks compressed by the worker threads.  */
+#define ZBLOCK_SIZE (128 * 1024)
+
+/* An object to compress one block in a worker thread.  Each block is
+ * compressed into a raw deflate stream which is primed with the end
+ * of the previous block as dictionary and finished with a sync flush;
+ * the concatenation of these streams is thus a single valid deflate
+ * stream.  This is the same approach as used by pigz.  */
+struct zblock_s
+{
+  /* The job for the workpool; this must be the first member.  */
+  struct workpool_job_s job;
+
+  /* The deflate context of this block object.  */
+  z_stream zs;
+
+  /* The input data, the dictionary and the compressed data.  */
+  byte *inbuf;
+  size_t inlen;
+  byte *dict;
+  size_t dictlen;
+  byte *outbuf;
+  size_t outsize;
+  size_t outlen;
+
+  /* Set for the last block of the data.  */
+  int final;
+
+  /* Set if the Adler-32 checksum is required.  */
+  int want_adler;
+
+  /* The Adler-32 checksum of the input and the zlib return code.  */
+  uLong adler;
+  int zrc;
+
+  /* Set while the block has been submitted but not yet written.  */
+  unsigned int pending:1;
+};
+typedef struct zblock_s *zblock_t;
+
+
+/* The state for threaded compression.  */
+struct zworkers_s
+{
+  workpool_t pool;
+  int wbits;       /* The deflate window size.  */
+  uLong adler;     /* The running Adler-32 checksum for ZLIB.  */
+  int any_block;   /* A block has been submitted.  */
+  unsigned int nblocks;
+  unsigned int cur;
+  zblock_t blocks;
+};
+typedef struct zworkers_s *zworkers_t;
+
+
+static int
+get_compress_level (void)
+{
+    if( opt.compress_level >= 1 && opt.compress_level <= 9 )
+	return opt.compress_level;
+    else if( opt.compress_level == -1 )
+	return Z_DEFAULT_COMPRESSION;
+    log_error("invalid compression level; using default level\n");
+    return Z_DEFAULT_COMPRESSION;
+}
+
+
 static void
 init_compress( compress_filter_context_t *zfx, z_stream *zs )
 {
@@ -70,14 +137,7 @@ init_compress( compress_filter_context_t *zfx, z_stream *zs )
         zlib_initialized = riscos_load_module("ZLib", zlib_path, 1);
 #endif
 
-    if( opt.compress_level >= 1 && opt.compress_level <= 9 )
-	level = opt.compress_level;
-    else if( opt.compress_level == -1 )
-	level = Z_DEFAULT_COMPRESSION;
-    else {
-	log_error("invalid compression level; using default level\n");
-	level = Z_DEFAULT_COMPRESSION;
-    }
+    level = get_compress_level ();
 
     if( (rc = zfx->algo == 1? deflateInit2( zs, level, Z_DEFLATED,
 					    -13, 8, Z_DEFAULT_STRATEGY)
@@ -130,6 +190,302 @@ do_compress( compress_filter_context_t *zfx, z_stream *zs, int flush, IOBUF a )
     return 0;
 }
 
+
+/* The worker function to compress a block.  */
+static void
+compress_block_job (void *opaque)
+{
+  zblock_t blk = opaque;
+  z_stream *zs = &blk->zs;
+  int zrc;
+
+  zrc = deflateReset (zs);
+  if (zrc == Z_OK && blk->dictlen)
+    zrc = deflateSetDictionary (zs, BYTEF_CAST (blk->dict), blk->dictlen);
+  if (zrc != Z_OK)
+    {
+      blk->zrc = zrc;
+      return;
+    }
+
+  if (blk->want_adler)
+    blk->adler = adler32 (adler32 (0, NULL, 0), BYTEF_CAST (blk->inbuf),
+                          blk->inlen);
+  zs->next_in = BYTEF_CAST (blk->inbuf);
+  zs->avail_in = blk->inlen;
+  zs->next_out = BYTEF_CAST (blk->outbuf);
+  zs->avail_out = blk->outsize;
+  zrc = deflate (zs, blk->final? Z_FINISH : Z_SYNC_FLUSH);
+  blk->outlen = blk->outsize - zs->avail_out;
+
+  if (blk->final && zrc == Z_STREAM_END)
+    blk->zrc = Z_OK;
+  else if (!blk->final && zrc == Z_OK && !zs->avail_in && zs->avail_out)
+    blk->zrc = Z_OK;
+  else
+    blk->zrc = zrc == Z_OK? Z_BUF_ERROR : zrc;
+}
+
+
+/* Release the worker state of ZFX.  */
+static void
+release_compress_workers (compress_filter_context_t *zfx)
+{
+  zworkers_t zw = zfx->workers;
+  unsigned int i;
+
+  if (!zw)
+    return;
+
+  for (i=0; i < zw->nblocks; i++)
+    {
+      /* The pool is shared; wait for our still running jobs.  */
+      if (zw->blocks[i].pending)
+        workpool_wait (zw->pool, &zw->blocks[i].job);
+      deflateEnd (&zw->blocks[i].zs);
+      xfree (zw->blocks[i].inbuf);
+      xfree (zw->blocks[i].dict);
+      xfree (zw->blocks[i].outbuf);
+    }
+  xfree (zw->blocks);
+  xfree (zw);
+  zfx->workers = NULL;
+}
+
+
+/* Set up threaded compression for ZFX and write the zlib header to A
+ * if required.  Returns an error if threaded compression is not
+ * possible; the caller may then fall back to the standard method.  */
+static gpg_error_t
+init_compress_workers (compress_filter_context_t *zfx, iobuf_t a)
+{
+  gpg_error_t err;
+  zworkers_t zw;
+  zblock_t blk;
+  unsigned int i;
+  int level, rc;
+
+  level = get_compress_level ();
+
+  zw = xtrycalloc (1, sizeof *zw);
+  if (!zw)
+    return gpg_error_from_syserror ();
+  zfx->workers = zw;
+
+  /* Always create raw deflate streams; for ZLIB we write the header
+   * and the checksum ourselves.  The window size is the same as used
+   * by init_compress.  */
+  zw->wbits = zfx->algo == COMPRESS_ALGO_ZIP? 13 : MAX_WBITS;
+  zw->adler = adler32 (0, NULL, 0);
+
+  err = workpool_get_shared (&zw->pool);
+  if (err)
+    goto leave;
+
+  /* One more block than threads so that the next block can be
+   * filled while all threads are busy.  */
+  zw->nblocks = workpool_nthreads (zw->pool) + 1;
+  zw->blocks = xtrycalloc (zw->nblocks, sizeof *zw->blocks);
+  if (!zw->blocks)
+    {
+      err = gpg_error_from_syserror ();
+      zw->nblocks = 0;
+      goto leave;
+    }
+
+  for (i=0; i < zw->nblocks; i++)
+    {
+      blk = zw->blocks + i;
+      blk->job.func = compress_block_job;
+      blk->job.opaque = blk;
+      blk->want_adler = zfx->algo == COMPRESS_ALGO_ZLIB;
+      rc = deflateInit2 (&blk->zs, level, Z_DEFLATED,
+                         -zw->wbits, 8, Z_DEFAULT_STRATEGY);
+      if (rc != Z_OK)
+        {
+          log_error ("zlib problem: %s\n",
+                     rc == Z_MEM_ERROR ? "out of core" :
+                     rc == Z_VERSION_ERROR ? "invalid lib version" :
+                     /* */                 "unknown error");
+          err = gpg_error (GPG_ERR_INTERNAL);
+          /* Let the release function skip this one.  */
+          zw->nblocks = i;
+          goto leave;
+        }
+      /* The sync flush adds an empty stored block; we add some extra
+       * space to be on the safe side.  */
+      blk->outsize = deflateBound (&blk->zs, ZBLOCK_SIZE) + 64;
+      blk->inbuf = xtrymalloc (ZBLOCK_SIZE);
+      blk->dict = xtrymalloc (1 << zw->wbits);
+      blk->outbuf = xtrymalloc (blk->outsize);
+      if (!blk->inbuf || !blk->dict || !blk->outbuf)
+        {
+          err = gpg_error_from_syserror ();
+          zw->nblocks = i + 1;
+          goto leave;
+        }
+    }
+
+  if (zfx->algo == COMPRESS_ALGO_ZLIB)
+    {
+      unsigned int hdr;
+      byte tmp[2];
+
+      /* This is the same header deflateInit would write.  */
+      hdr = (Z_DEFLATED + ((zw->wbits - 8) << 4)) << 8;
+      if (level == Z_DEFAULT_COMPRESSION || level == 6)
+        hdr |= 2 << 6;
+      else if (level >= 2)
+        hdr |= (level < 6? 1 : 3) << 6;
+      hdr += 31 - (hdr % 31);
+      tmp[0] = hdr >> 8;
+      tmp[1] = hdr;
+      err = iobuf_write (a, tmp, 2);
+    }
+
+  if (DBG_FILTER)
+    log_debug ("compress: using %u block objects\n", zw->nblocks);
+
+ leave:
+  if (err)
+    release_compress_workers (zfx);
+  return err;
+}
+
+
+/* Wait for the pending block BLK and write it to A.  */
+static int
+write_pending_block (zworkers_t zw, zblock_t blk, iobuf_t a)
+{
+  workpool_wait (zw->pool, &blk->job);
+  blk->pending = 0;
+  if (blk->zrc != Z_OK)
+    log_fatal ("zlib deflate problem: rc=%d\n", blk->zrc);
+
+  if (DBG_FILTER)
+    log_debug ("compress: writing block: inlen=%zu outlen=%zu\n",
+               blk->inlen, blk->outlen);
+  if (blk->want_adler)
+    zw->adler = adler32_combine (zw->adler, blk->adler, blk->inlen);
+  blk->inlen = 0;
+  return iobuf_write (a, blk->outbuf, blk->outlen);
+}
+
+
+/* Hand the current block over to the workers and switch to the next
+ * block object.  */
+static void
+submit_current_block (zworkers_t zw, int final)
+{
+  zblock_t blk = zw->blocks + zw->cur;
+  zblock_t prev;
+  size_t n;
+
+  blk->dictlen = 0;
+  if (zw->any_block)
+    {
+      /* All blocks but the last are full and thus longer than the
+       * window.  The previous block is still unchanged because it is
+       * only re-used after this one.  */
+      prev = zw->blocks + (zw->cur + zw->nblocks - 1) % zw->nblocks;
+      n = 1 << zw->wbits;
+      memcpy (blk->dict, prev->inbuf + ZBLOCK_SIZE - n, n);
+      blk->dictlen = n;
+    }
+  blk->final = final;
+  blk->pending = 1;
+  zw->any_block = 1;
+  workpool_submit (zw->pool, &blk->job);
+  zw->cur = (zw->cur + 1) % zw->nblocks;
+}
+
+
+/* The threaded version of do_compress for IOBUFCTRL_FLUSH.  Because
+ * the block objects are used in a round robin fashion, a still
+ * pending block object we want to fill is always the oldest one; thus
+ * writing it before re-using it keeps the blocks in order.  */
+static int
+do_compress_threaded (compress_filter_context_t *zfx, iobuf_t a,
+                      const byte *buf, size_t size)
+{
+  zworkers_t zw = zfx->workers;
+  zblock_t blk;
+  size_t n;
+  int rc;
+
+  while (size)
+    {
+      blk = zw->blocks + zw->cur;
+      if (blk->pending && (rc = write_pending_block (zw, blk, a)))
+        return rc;
+
+      n = ZBLOCK_SIZE - blk->inlen;
+      if (n > size)
+        n = size;
+      memcpy (blk->inbuf + blk->inlen, buf, n);
+      blk->inlen += n;
+      buf += n;
+      size -= n;
+
+      /* We can't submit the block yet if this is the last data
+       * because only at IOBUFCTRL_FREE we know whether it is the
+       * final block.  */
+      if (blk->inlen == ZBLOCK_SIZE && size)
+        submit_current_block (zw, 0);
+    }
+
+  return 0;
+}
+
+
+/* The threaded version of do_compress for IOBUFCTRL_FREE.  */
+static int
+finish_compress_threaded (compress_filter_context_t *zfx, iobuf_t a)
+{
+  zworkers_t zw = zfx->workers;
+  zblock_t blk;
+  unsigned int i;
+  int rc = 0;
+
+  /* A full block left over by do_compress_threaded may still need
+   * to be written first.  */
+  blk = zw->blocks + zw->cur;
+  if (blk->pending)
+    rc = write_pending_block (zw, blk, a);
+  if (!rc && blk->inlen == ZBLOCK_SIZE)
+    {
+      submit_current_block (zw, 0);
+      blk = zw->blocks + zw->cur;
+      if (blk->pending)
+        rc = write_pending_block (zw, blk, a);
+    }
+  if (!rc)
+    submit_current_block (zw, 1);
+
+  /* Write all pending blocks starting with the oldest one.  */
+  for (i=0; !rc && i < zw->nblocks; i++)
+    {
+      blk = zw->blocks + (zw->cur + i) % zw->nblocks;
+      if (blk->pending)
+        rc = write_pending_block (zw, blk, a);
+    }
+
+  if (!rc && zfx->algo == COMPRESS_ALGO_ZLIB)
+    {
+      byte tmp[4];
+
+      tmp[0] = zw->adler >> 24;
+      tmp[1] = zw->adler >> 16;
+      tmp[2] = zw->adler >> 8;
+      tmp[3] = zw->adler;
+      rc = iobuf_write (a, tmp, 4);
+    }
+
+  release_compress_workers (zfx);
+  return rc;
+}
+
+
 static void
 init_uncompress( compress_filter_context_t *zfx, z_stream *zs )
 {
@@ -258,14 +614,23 @@ compress_filter( void *opaque, int control,
 	    pkt.pkt.compressed = &cd;
 	    if( build_packet( a, &pkt ))
 		log_bug("build_packet(PKT_COMPRESSED) failed\n");
-	    zs = zfx->opaque = xmalloc_clear( sizeof *zs );
-	    init_compress( zfx, zs );
-	    zfx->status = 2;
+	    if( opt.compress_threads > 1
+                && !init_compress_workers( zfx, a ) )
+		zfx->status = 3;
+	    else {
+		zs = zfx->opaque = xmalloc_clear( sizeof *zs );
+		init_compress( zfx, zs );
+		zfx->status = 2;
+	    }
 	}
 
-	zs->next_in = BYTEF_CAST (buf);
-	zs->avail_in = size;
-	rc = do_compress( zfx, zs, Z_NO_FLUSH, a );
+	if( zfx->status == 3 )
+	    rc = do_compress_threaded( zfx, a, buf, size );
+	else {
+	    zs->next_in = BYTEF_CAST (buf);
+	    zs->avail_in = size;
+	    rc = do_compress( zfx, zs, Z_NO_FLUSH, a );
+	}
     }
     else if( control == IOBUFCTRL_FREE ) {
 	if( zfx->status == 1 ) {
@@ -283,6 +648,8 @@ compress_filter( void *opaque, int control,
 	    zfx->opaque = NULL;
 	    xfree(zfx->outbuf); zfx->outbuf = NULL;
 	}
+	else if( zfx->status == 3 )
+	    finish_compress_threaded( zfx, a );
         if (zfx->release)
           zfx->release (zfx);
     }
@@ -292,6 +659,73 @@ compress_filter( void *opaque, int control,
 }
 #endif /*HAVE_ZIP*/
 
+/* The size of the sample used by is_file_incompressible.  */
+#define SAMPLE_SIZE (64 * 1024)
+
+/* Return true if a sample from the start of the file FNAME does not
+ * compress.  This catches formats not known to is_file_compressed
+ * and also already encrypted data.  The sample is compressed with the
+ * fastest level; if that saves less than 2 percent, compressing the
+ * entire file is not worth the time.  */
+int
+is_file_incompressible (const char *fname)
+{
+#ifdef HAVE_ZIP
+  iobuf_t a;
+  byte *inbuf, *outbuf;
+  int nread;
+  size_t outsize;
+  z_stream zs;
+  int rc = 0;
+
+  if (!fname || iobuf_is_pipe_filename (fname))
+    return 0;  /* We can't check stdin.  */
+
+  a = iobuf_open (fname);
+  if (!a)
+    return 0;
+  iobuf_ioctl (a, IOBUF_IOCTL_NO_CACHE, 1, NULL);
+
+  inbuf = xmalloc (SAMPLE_SIZE);
+  nread = iobuf_read (a, inbuf, SAMPLE_SIZE);
+  iobuf_close (a);
+  if (nread < 4096)
+    {
+      /* Too short for a meaningful result; compressing small files
+       * is cheap anyway.  */
+      xfree (inbuf);
+      return 0;
+    }
+
+  memset (&zs, 0, sizeof zs);
+  if (deflateInit2 (&zs, 1, Z_DEFLATED, -13, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      xfree (inbuf);
+      return 0;
+    }
+  outsize = deflateBound (&zs, nread);
+  outbuf = xmalloc (outsize);
+  zs.next_in = BYTEF_CAST (inbuf);
+  zs.avail_in = nread;
+  zs.next_out = BYTEF_CAST (outbuf);
+  zs.avail_out = outsize;
+  if (deflate (&zs, Z_FINISH) == Z_STREAM_END
+      && zs.total_out >= (uLong)nread / 50 * 49)
+    rc = 1;
+  if (DBG_FILTER)
+    log_debug ("compress: sample of %d bytes compresses to %lu bytes\n",
+               nread, (unsigned long)zs.total_out);
+  deflateEnd (&zs);
+  xfree (outbuf);
+  xfree (inbuf);
+  return rc;
+#else
+  (void)fname;
+  return 0;
+#endif
+}
+
+
 static void
 release_context (compress_filter_context_t *ctx)
 {
@@ -43,6 +43,12 @@
    this is NULL.  */
 static estream_t statusfp;
 
+/* If set the status lines are not flushed one by one.  */
+static int status_buffered;
+
+/* The size of the buffer used for buffered status output.  */
+#define STATUS_BUFFER_SIZE 65536
+
 
 static void
 progress_cb (void *ctx, const char *what, int printchar,
@@ -93,6 +99,35 @@ status_currently_allowed (int no)
 }
 
 
+/* Flush a status line with code NO unless buffered output has been
+   requested.  In that mode only lines the other side may need to act
+   upon immediately are flushed; the others are written once the
+   buffer is full or by status_flush.  */
+static void
+flush_status_line (int no)
+{
+  if (status_buffered)
+    {
+      switch (no)
+        {
+        case STATUS_GET_BOOL:
+        case STATUS_GET_LINE:
+        case STATUS_GET_HIDDEN:
+        case STATUS_PROGRESS:
+        case STATUS_PINENTRY_LAUNCHED:
+          break;
+        default:
+          if (es_ferror (statusfp) && opt.exit_on_status_write_error)
+            g10_exit (0);
+          return;
+        }
+    }
+
+  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
+    g10_exit (0);
+}
+
+
 void
 set_status_fd (int fd)
 {
@@ -122,11 +157,33 @@ set_status_fd (int fd)
                  fd, strerror (errno));
     }
   last_fd = fd;
+  if (status_buffered)
+    es_setvbuf (statusfp, NULL, _IOFBF, STATUS_BUFFER_SIZE);
 
   gcry_set_progress_handler (progress_cb, NULL);
 }
 
 
+/* Enable buffered status output.  This must be called before any
+   status line has been written.  */
+void
+set_status_buffered (void)
+{
+  status_buffered = 1;
+  if (statusfp)
+    es_setvbuf (statusfp, NULL, _IOFBF, STATUS_BUFFER_SIZE);
+}
+
+
+/* Write out all buffered status lines.  */
+void
+status_flush (void)
+{
+  if (statusfp && es_fflush (statusfp) && opt.exit_on_status_write_error)
+    g10_exit (0);
+}
+
+
 int
 is_status_enabled ()
 {
@@ -175,8 +232,7 @@ write_status_strings (int no, const char *text, ...)
       va_end (arg_ptr);
     }
   es_putc ('\n', statusfp);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  flush_status_line (no);
 }
 
 
@@ -208,8 +264,7 @@ write_status_printf (int no, const char *format, ...)
       va_end (arg_ptr);
     }
   es_putc ('\n', statusfp);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  flush_status_line (no);
 }
 
 
@@ -222,8 +277,7 @@ write_status_error (const char *where, gpg_error_t err)
 
   es_fprintf (statusfp, "[GNUPG:] %s %s %u\n",
               get_status_string (STATUS_ERROR), where, err);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  flush_status_line (STATUS_ERROR);
 }
 
 
@@ -236,8 +290,7 @@ write_status_errcode (const char *where, int errcode)
 
   es_fprintf (statusfp, "[GNUPG:] %s %s %u\n",
               get_status_string (STATUS_ERROR), where, gpg_err_code (errcode));
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  flush_status_line (STATUS_ERROR);
 }
 
 
@@ -254,8 +307,7 @@ write_status_failure (const char *where, gpg_error_t err)
   any_failure_printed = 1;
   es_fprintf (statusfp, "[GNUPG:] %s %s %u\n",
               get_status_string (STATUS_FAILURE), where, err);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  flush_status_line (STATUS_FAILURE);
 }
 
 
@@ -334,8 +386,7 @@ write_status_text_and_buffer (int no, const char *string,
   while (len);
 
   es_putc ('\n',statusfp);
-  if (es_fflush (statusfp) && opt.exit_on_status_write_error)
-    g10_exit (0);
+  flush_status_line (no);
 }
 
 
@@ -30,6 +30,12 @@
 #include "../common/i18n.h"
 #include "../common/status.h"
 #include "../common/compliance.h"
+#include "main.h"
+
+
+/* The largest chunk size we support for multi-threaded decryption.
+ * This is the largest chunk size gpg creates by default.  */
+#define MAX_THREADED_CHUNKSIZE ((uint64_t)1 << 27)
 
 
 static int aead_decode_filter (void *opaque, int control, iobuf_t a,
@@ -39,6 +45,38 @@ static int mdc_decode_filter ( void *opaque, int control, IOBUF a,
 static int decode_filter ( void *opaque, int control, IOBUF a,
 					byte *buf, size_t *ret_len);
 
+
+/* An object to decrypt one chunk in a worker thread.  */
+struct decode_chunk_s
+{
+  /* The job for the workpool.  */
+  struct workpool_job_s job;
+
+  /* The decode context.  The worker only reads the constant
+   * parameters of the decryption from it.  */
+  struct decode_filter_context_s *dfx;
+
+  /* The cipher handle for this chunk object.  */
+  gcry_cipher_hd_t cipher_hd;
+
+  /* The index of the chunk.  */
+  uint64_t chunkindex;
+
+  /* The buffer with the ciphertext followed by the tag and 16 extra
+   * bytes.  Its allocated size is the chunksize plus 32.  BUFLEN is
+   * the length of the ciphertext and thus of the plaintext after
+   * decryption.  OUTOFF is the number of plaintext bytes already
+   * delivered.  */
+  byte *buffer;
+  size_t buflen;
+  size_t outoff;
+
+  /* The result of the decryption and the tag check.  */
+  gpg_error_t err;
+};
+typedef struct decode_chunk_s *decode_chunk_t;
+
+
 /* Our context object.  */
 struct decode_filter_context_s
 {
@@ -94,10 +132,58 @@ struct decode_filter_context_s
   /* Remaining bytes in the packet according to the packet header.
    * Not used if PARTIAL is true.  */
   size_t length;
+
+  /* Worker threads and chunk objects used for multi-threaded AEAD
+   * decryption.  The chunk objects are used as a ring buffer:
+   * AEAD_IN is the index of the next object to fill and AEAD_OUT the
+   * index of the next object to deliver; AEAD_PENDING is the number
+   * of filled objects.  In this mode HOLDBACK has the 16 bytes read
+   * ahead to detect the EOF and, after the EOF, the final tag.  */
+  workpool_t aead_pool;
+  decode_chunk_t aead_chunks;
+  unsigned int aead_nchunks;
+  unsigned int aead_in;
+  unsigned int aead_out;
+  unsigned int aead_pending;
+
+  /* Set after the final tag has been checked in threaded mode.  */
+  unsigned int aead_finished : 1;
 };
 typedef struct decode_filter_context_s *decode_filter_ctx_t;
 
 
+/* Detach DFX from the worker threads and release the chunk objects.  */
+static void
+release_aead_workers (decode_filter_ctx_t dfx)
+{
+  unsigned int i;
+
+  if (dfx->aead_chunks)
+    {
+      /* The pool is shared; wait for our still running jobs.  */
+      for (i=0; i < dfx->aead_pending; i++)
+        workpool_wait (dfx->aead_pool,
+                       &dfx->aead_chunks[(dfx->aead_out + i)
+                                         % dfx->aead_nchunks].job);
+      dfx->aead_pending = 0;
+
+      for (i=0; i < dfx->aead_nchunks; i++)
+        {
+          if (dfx->aead_chunks[i].buffer)
+            {
+              wipememory (dfx->aead_chunks[i].buffer, dfx->chunksize + 32);
+              xfree (dfx->aead_chunks[i].buffer);
+            }
+          gcry_cipher_close (dfx->aead_chunks[i].cipher_hd);
+        }
+      xfree (dfx->aead_chunks);
+      dfx->aead_chunks = NULL;
+    }
+  dfx->aead_nchunks = 0;
+  dfx->aead_pool = NULL;
+}
+
+
 /* Helper to release the decode context.  */
 static void
 release_dfx_context (decode_filter_ctx_t dfx)
@@ -108,6 +194,7 @@ release_dfx_context (decode_filter_ctx_t dfx)
   log_assert (dfx->refcount);
   if ( !--dfx->refcount )
     {
+      release_aead_workers (dfx);
       gcry_cipher_close (dfx->cipher_hd);
       dfx->cipher_hd = NULL;
       gcry_md_close (dfx->mdc_hash);
@@ -117,12 +204,14 @@ release_dfx_context (decode_filter_ctx_t dfx)
 }
 
 
-/* Set the nonce and the additional data for the current chunk.  This
- * also reset the decryption machinery * so that the handle can be
- * used for a new chunk.  If FINAL is set the final AEAD chunk is
- * processed.  */
+/* Set the nonce and the additional data for chunk CHUNKINDEX on the
+ * cipher handle HD.  This also reset the decryption machinery so that
+ * the handle can be used for a new chunk.  If FINAL is set the final
+ * AEAD chunk is processed.  If NOLOG is set debug output is
+ * suppressed; this is required when called from a worker thread.  */
 static gpg_error_t
-aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
+aead_setup_chunk (decode_filter_ctx_t dfx, gcry_cipher_hd_t hd,
+                  uint64_t chunkindex, int final, int nolog)
 {
   gpg_error_t err;
   unsigned char ad[21];
@@ -144,18 +233,18 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
     default:
       BUG ();
     }
-  nonce[i++] ^= dfx->chunkindex >> 56;
-  nonce[i++] ^= dfx->chunkindex >> 48;
-  nonce[i++] ^= dfx->chunkindex >> 40;
-  nonce[i++] ^= dfx->chunkindex >> 32;
-  nonce[i++] ^= dfx->chunkindex >> 24;
-  nonce[i++] ^= dfx->chunkindex >> 16;
-  nonce[i++] ^= dfx->chunkindex >>  8;
-  nonce[i++] ^= dfx->chunkindex;
-
-  if (DBG_CRYPTO)
+  nonce[i++] ^= chunkindex >> 56;
+  nonce[i++] ^= chunkindex >> 48;
+  nonce[i++] ^= chunkindex >> 40;
+  nonce[i++] ^= chunkindex >> 32;
+  nonce[i++] ^= chunkindex >> 24;
+  nonce[i++] ^= chunkindex >> 16;
+  nonce[i++] ^= chunkindex >>  8;
+  nonce[i++] ^= chunkindex;
+
+  if (DBG_CRYPTO && !nolog)
     log_printhex (nonce, i, "nonce:");
-  err = gcry_cipher_setiv (dfx->cipher_hd, nonce, i);
+  err = gcry_cipher_setiv (hd, nonce, i);
   if (err)
     return err;
 
@@ -164,14 +253,14 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
   ad[2] = dfx->cipher_algo;
   ad[3] = dfx->aead_algo;
   ad[4] = dfx->chunkbyte;
-  ad[5] = dfx->chunkindex >> 56;
-  ad[6] = dfx->chunkindex >> 48;
-  ad[7] = dfx->chunkindex >> 40;
-  ad[8] = dfx->chunkindex >> 32;
-  ad[9] = dfx->chunkindex >> 24;
-  ad[10]= dfx->chunkindex >> 16;
-  ad[11]= dfx->chunkindex >>  8;
-  ad[12]= dfx->chunkindex;
+  ad[5] = chunkindex >> 56;
+  ad[6] = chunkindex >> 48;
+  ad[7] = chunkindex >> 40;
+  ad[8] = chunkindex >> 32;
+  ad[9] = chunkindex >> 24;
+  ad[10]= chunkindex >> 16;
+  ad[11]= chunkindex >>  8;
+  ad[12]= chunkindex;
   if (final)
     {
       ad[13] = dfx->total >> 56;
@@ -183,9 +272,102 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
       ad[19] = dfx->total >>  8;
       ad[20] = dfx->total;
     }
-  if (DBG_CRYPTO)
+  if (DBG_CRYPTO && !nolog)
     log_printhex (ad, final? 21 : 13, "authdata:");
-  return gcry_cipher_authenticate (dfx->cipher_hd, ad, final? 21 : 13);
+  return gcry_cipher_authenticate (hd, ad, final? 21 : 13);
+}
+
+
+/* Set the nonce and the additional data for the current chunk.  If
+ * FINAL is set the final AEAD chunk is processed.  */
+static gpg_error_t
+aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
+{
+  return aead_setup_chunk (dfx, dfx->cipher_hd, dfx->chunkindex, final, 0);
+}
+
+
+/* The job function to decrypt a chunk and to check its tag.  This is
+ * run by a worker thread.  */
+static void
+decrypt_chunk_job (void *opaque)
+{
+  decode_chunk_t chunk = opaque;
+  gpg_error_t err;
+
+  err = aead_setup_chunk (chunk->dfx, chunk->cipher_hd,
+                          chunk->chunkindex, 0, 1);
+  if (!err)
+    {
+      gcry_cipher_final (chunk->cipher_hd);
+      err = gcry_cipher_decrypt (chunk->cipher_hd,
+                                 chunk->buffer, chunk->buflen, NULL, 0);
+    }
+  if (!err)
+    err = gcry_cipher_checktag (chunk->cipher_hd,
+                                chunk->buffer + chunk->buflen, 16);
+  if (err)
+    wipememory (chunk->buffer, chunk->buflen);
+  chunk->err = err;
+}
+
+
+/* Start the worker threads for DFX.  One more chunk object than we
+ * have threads is allocated so that a chunk can be read while all
+ * threads are busy.  Each chunk object gets its own cipher handle
+ * using CIPHERMODE and the key from DEK.  */
+static gpg_error_t
+setup_aead_workers (decode_filter_ctx_t dfx, enum gcry_cipher_modes ciphermode,
+                    DEK *dek)
+{
+  gpg_error_t err;
+  decode_chunk_t chunk;
+  unsigned int i;
+
+  err = workpool_get_shared (&dfx->aead_pool);
+  if (err)
+    return err;
+
+  dfx->aead_nchunks = workpool_nthreads (dfx->aead_pool) + 1;
+  dfx->aead_chunks = xtrycalloc (dfx->aead_nchunks, sizeof *dfx->aead_chunks);
+  if (!dfx->aead_chunks)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  for (i=0; i < dfx->aead_nchunks; i++)
+    {
+      chunk = dfx->aead_chunks + i;
+      chunk->dfx = dfx;
+      chunk->job.func = decrypt_chunk_job;
+      chunk->job.opaque = chunk;
+      chunk->buffer = xtrymalloc (dfx->chunksize + 32);
+      if (!chunk->buffer)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      err = openpgp_cipher_open (&chunk->cipher_hd, dfx->cipher_algo,
+                                 ciphermode, GCRY_CIPHER_SECURE);
+      if (!err)
+        {
+          err = gcry_cipher_setkey (chunk->cipher_hd, dek->key, dek->keylen);
+          if (gpg_err_code (err) == GPG_ERR_WEAK_KEY)
+            err = 0;  /* Already diagnosed by the caller.  */
+        }
+      if (err)
+        goto leave;
+    }
+
+  if (DBG_FILTER)
+    log_debug ("using %u chunk objects of %ju bytes\n",
+               dfx->aead_nchunks, (uintmax_t)dfx->chunksize);
+
+ leave:
+  if (err)
+    release_aead_workers (dfx);
+  return err;
 }
 
 
@@ -368,6 +550,17 @@ decrypt_data (ctrl_t ctrl, void *procctx, PKT_encrypted *ed, DEK *dek)
           goto leave;
         }
 
+      if (opt.aead_threads > 1)
+        {
+          if (dfx->chunksize > MAX_THREADED_CHUNKSIZE)
+            log_info ("Note: chunk size too large for threaded decryption\n");
+          else if ((rc = setup_aead_workers (dfx, ciphermode, dek)))
+            {
+              log_info ("Note: threaded decryption not possible: %s\n",
+                        gpg_strerror (rc));
+              rc = 0;
+            }
+        }
     }
   else /* CFB encryption.  */
     {
@@ -831,6 +1024,198 @@ aead_underflow (decode_filter_ctx_t dfx, iobuf_t a, byte *buf, size_t *ret_len)
 }
 
 
+/* Fill BUFFER with up to NBYTES-OFFSET from STREAM like fill_buffer
+ * but read in bulk.  */
+static size_t
+fill_buffer_bulk (decode_filter_ctx_t dfx, iobuf_t stream,
+                  byte *buffer, size_t nbytes, size_t offset)
+{
+  size_t nread = offset;
+  size_t n;
+  int rc;
+
+  if (!dfx->partial && nbytes - offset > dfx->length)
+    nbytes = offset + dfx->length;
+
+  while (nread < nbytes)
+    {
+      n = nbytes - nread;
+      if (n > 65536)
+        n = 65536;
+      rc = iobuf_read (stream, buffer + nread, n);
+      if (rc == -1)
+        break;
+      nread += rc;
+    }
+
+  if (dfx->partial)
+    {
+      if (nread < nbytes)
+        dfx->eof_seen = 1; /* Normal EOF. */
+    }
+  else
+    {
+      dfx->length -= nread - offset;
+      if (nread < nbytes)
+        dfx->eof_seen = 3; /* Premature EOF. */
+      else if (!dfx->length)
+        dfx->eof_seen = 1; /* Normal EOF.  */
+    }
+
+  return nread;
+}
+
+
+/* Read chunks from stream A and hand them to the workers until all
+ * chunk objects of DFX are in use or the EOF has been reached.  To
+ * detect the last chunk we always read 16 bytes more than a chunk
+ * and its tag; these bytes are kept in the holdback buffer and are
+ * either the start of the next chunk or the final tag.  */
+static gpg_error_t
+aead_read_ahead (decode_filter_ctx_t dfx, iobuf_t a)
+{
+  decode_chunk_t chunk;
+  size_t len;
+
+  while (!dfx->eof_seen && dfx->aead_pending < dfx->aead_nchunks)
+    {
+      chunk = dfx->aead_chunks + dfx->aead_in;
+      memcpy (chunk->buffer, dfx->holdback, dfx->holdbacklen);
+      len = fill_buffer_bulk (dfx, a, chunk->buffer, dfx->chunksize + 32,
+                              dfx->holdbacklen);
+      dfx->holdbacklen = 0;
+      if (!dfx->eof_seen)
+        chunk->buflen = dfx->chunksize;
+      else if (dfx->eof_seen == 1 && len >= 32)
+        chunk->buflen = len - 32;  /* The last chunk.  */
+      else if (dfx->eof_seen == 1 && len == 16)
+        {
+          /* Only the final tag is left.  */
+          memcpy (dfx->holdback, chunk->buffer, 16);
+          dfx->holdbacklen = 16;
+          break;
+        }
+      else
+        {
+          /* Not enough data for the last two tags.  */
+          return gpg_error (GPG_ERR_TRUNCATED);
+        }
+
+      /* Keep the extra 16 bytes.  */
+      memcpy (dfx->holdback, chunk->buffer + len - 16, 16);
+      dfx->holdbacklen = 16;
+
+      chunk->chunkindex = dfx->chunkindex++;
+      chunk->outoff = 0;
+      chunk->err = 0;
+      dfx->total += chunk->buflen;
+      workpool_submit (dfx->aead_pool, &chunk->job);
+      dfx->aead_in = (dfx->aead_in + 1) % dfx->aead_nchunks;
+      dfx->aead_pending++;
+      if (DBG_FILTER)
+        log_debug ("submitted chunk %ju (len=%zu)%s\n",
+                   (uintmax_t)chunk->chunkindex, chunk->buflen,
+                   dfx->eof_seen? " eof":"");
+    }
+
+  return 0;
+}
+
+
+/* The multi-threaded version of aead_underflow.  The plaintext of a
+ * chunk is only delivered after its tag has been verified and the
+ * chunks are always delivered in order.  */
+static gpg_error_t
+aead_underflow_threaded (decode_filter_ctx_t dfx, iobuf_t a,
+                         byte *buf, size_t *ret_len)
+{
+  const size_t size = *ret_len; /* The allocated size of BUF.  */
+  gpg_error_t err = 0;
+  size_t totallen = 0;
+  size_t n;
+  decode_chunk_t chunk;
+
+  if (dfx->aead_finished)
+    {
+      *ret_len = 0;
+      return gpg_error (GPG_ERR_EOF);
+    }
+
+  while (totallen < size)
+    {
+      err = aead_read_ahead (dfx, a);
+      if (err)
+        goto leave;
+
+      if (!dfx->aead_pending)
+        {
+          /* All chunks have been delivered; check the final tag.  */
+          if (DBG_FILTER)
+            log_debug ("eof seen: holdback has the final tag\n");
+          log_assert (dfx->holdbacklen == 16);
+          err = aead_set_nonce_and_ad (dfx, 1);
+          if (err)
+            goto leave;
+          gcry_cipher_final (dfx->cipher_hd);
+          /* Decrypt an empty string (using HOLDBACK as a dummy).  */
+          err = gcry_cipher_decrypt (dfx->cipher_hd, dfx->holdback, 0,
+                                     NULL, 0);
+          if (err)
+            {
+              log_error ("gcry_cipher_decrypt failed (final): %s\n",
+                         gpg_strerror (err));
+              goto leave;
+            }
+          err = aead_checktag (dfx, 1, dfx->holdback);
+          if (err)
+            goto leave;
+          dfx->aead_finished = 1;
+          err = gpg_error (GPG_ERR_EOF);
+          goto leave;
+        }
+
+      chunk = dfx->aead_chunks + dfx->aead_out;
+      workpool_wait (dfx->aead_pool, &chunk->job);
+      if (chunk->err)
+        {
+          err = chunk->err;
+          log_error ("decrypting chunk %ju failed: %s\n",
+                     (uintmax_t)chunk->chunkindex, gpg_strerror (err));
+          goto leave;
+        }
+
+      n = chunk->buflen - chunk->outoff;
+      if (n > size - totallen)
+        n = size - totallen;
+      memcpy (buf + totallen, chunk->buffer + chunk->outoff, n);
+      chunk->outoff += n;
+      totallen += n;
+      if (chunk->outoff == chunk->buflen)
+        {
+          dfx->aead_out = (dfx->aead_out + 1) % dfx->aead_nchunks;
+          dfx->aead_pending--;
+        }
+    }
+
+ leave:
+  if (DBG_FILTER)
+    log_debug ("aead_underflow_threaded: returning %zu (%s)\n",
+               totallen, gpg_strerror (err));
+
+  /* In case of an auth error we map the error code to the same as
+   * used by the MDC decryption.  */
+  if (gpg_err_code (err) == GPG_ERR_CHECKSUM)
+    err = gpg_error (GPG_ERR_BAD_SIGNATURE);
+
+  if (err && gpg_err_code (err) != GPG_ERR_EOF)
+    memset (buf, 0, size);
+
+  *ret_len = totallen;
+
+  return err;
+}
+
+
 /* The IOBUF filter used to decrypt AEAD encrypted data.  */
 static int
 aead_decode_filter (void *opaque, int control, IOBUF a,
@@ -839,7 +1224,7 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
   decode_filter_ctx_t dfx = opaque;
   int rc = 0;
 
-  if ( control == IOBUFCTRL_UNDERFLOW && dfx->eof_seen )
+  if ( control == IOBUFCTRL_UNDERFLOW && dfx->eof_seen && !dfx->aead_pool)
     {
       *ret_len = 0;
       rc = -1;
@@ -848,7 +1233,10 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
     {
       log_assert (a);
 
-      rc = aead_underflow (dfx, a, buf, ret_len);
+      if (dfx->aead_pool)
+        rc = aead_underflow_threaded (dfx, a, buf, ret_len);
+      else
+        rc = aead_underflow (dfx, a, buf, ret_len);
       if (gpg_err_code (rc) == GPG_ERR_EOF)
         rc = -1; /* We need to use the old convention in the filter.  */
 
@@ -866,6 +1254,25 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
 }
 
 
+/* Decrypt BUF of LENGTH in place and hash the plaintext.  This is
+ * done in chunks which fit into the L1 cache so that the hash
+ * function reads the data while it is still cached.  CFB mode carries
+ * its state across calls and thus the chunks may have any size.  */
+static void
+decrypt_and_hash (gcry_cipher_hd_t cipher_hd, gcry_md_hd_t md,
+                  byte *buf, size_t length)
+{
+  size_t n;
+
+  for (; length; buf += n, length -= n)
+    {
+      n = length < CRYPT_CHUNK_SIZE? length : CRYPT_CHUNK_SIZE;
+      gcry_cipher_decrypt (cipher_hd, buf, n, NULL, 0);
+      gcry_md_write (md, buf, n);
+    }
+}
+
+
 static int
 mdc_decode_filter (void *opaque, int control, IOBUF a,
                    byte *buf, size_t *ret_len)
@@ -978,9 +1385,11 @@ mdc_decode_filter (void *opaque, int control, IOBUF a,
 
       if ( n )
         {
-          if ( dfx->cipher_hd )
+          if ( dfx->cipher_hd && dfx->mdc_hash )
+            decrypt_and_hash (dfx->cipher_hd, dfx->mdc_hash, buf, n);
+          else if ( dfx->cipher_hd )
             gcry_cipher_decrypt (dfx->cipher_hd, buf, n, NULL, 0);
-          if ( dfx->mdc_hash )
+          else if ( dfx->mdc_hash )
             gcry_md_write (dfx->mdc_hash, buf, n);
 	}
       else
@@ -69,6 +69,8 @@ decrypt_message (ctrl_t ctrl, const char *filename)
       return rc;
     }
 
+  if (opt.io_threads)
+    push_read_ahead_filter (fp);
   handle_progress (pfx, fp, filename);
 
   if ( !opt.no_armor )
@@ -247,6 +249,8 @@ decrypt_messages (ctrl_t ctrl, int nfiles, char *files[])
           goto next_file;
         }
 
+      if (opt.io_threads)
+        push_read_ahead_filter (fp);
       handle_progress (pfx, fp, filename);
 
       if (!opt.no_armor)
@@ -253,13 +253,19 @@ do_delete_key (ctrl_t ctrl, const char *username, int secret, int force,
 gpg_error_t
 delete_keys (ctrl_t ctrl, strlist_t names, int secret, int allow_both)
 {
-  gpg_error_t err;
+  gpg_error_t err = 0;
+  gpg_error_t err2;
   int avail;
   int force = (!allow_both && !secret && opt.expert);
+  int batch;
 
   /* Force allows us to delete a public key even if a secret key
      exists. */
 
+  /* Do all deletions in one keydb batch so that a keyring is
+     rewritten and a keybox compressed only once.  */
+  batch = !keydb_begin_batch ();
+
   for ( ;names ; names=names->next )
     {
       err = do_delete_key (ctrl, names->d, secret, force, &avail);
@@ -278,7 +284,7 @@ delete_keys (ctrl_t ctrl, strlist_t names, int secret, int allow_both)
               log_info(_("use option \"--delete-secret-keys\" to delete"
                          " it first.\n"));
               write_status_text (STATUS_DELETE_PROBLEM, "2");
-              return err;
+              break;
             }
         }
 
@@ -286,9 +292,16 @@ delete_keys (ctrl_t ctrl, strlist_t names, int secret, int allow_both)
         {
           log_error ("%s: delete key failed: %s\n",
                      names->d, gpg_strerror (err));
-          return err;
+          break;
         }
     }
 
-  return 0;
+  if (batch)
+    {
+      err2 = keydb_commit_batch ();
+      if (err2 && !err)
+        err = err2;
+    }
+
+  return err;
 }
@@ -380,7 +380,8 @@ encrypt_simple (const char *filename, int mode, int use_seskey)
   if (do_compress
       && cfx.dek
       && (cfx.dek->use_mdc || cfx.dek->use_aead)
-      && is_file_compressed(filename, &rc))
+      && (is_file_compressed (filename, &rc)
+          || (!rc && is_file_incompressible (filename))))
     {
       if (opt.verbose)
         log_info(_("'%s' already compressed\n"), filename);
@@ -815,7 +816,8 @@ encrypt_crypt (ctrl_t ctrl, int filefd, const char *filename,
    * ciphertext attacks. */
   if (do_compress
       && (cfx.dek->use_mdc || cfx.dek->use_aead)
-      && is_file_compressed (filename, &rc2))
+      && (is_file_compressed (filename, &rc2)
+          || (!rc2 && is_file_incompressible (filename))))
     {
       if (opt.verbose)
         log_info(_("'%s' already compressed\n"), filename);
@@ -1067,6 +1069,36 @@ encrypt_filter (void *opaque, int control,
 }
 
 
+/* Write the pubkey-enc packet ENC with the session key DEK to OUT.  */
+static int
+write_pubkey_enc_packet (ctrl_t ctrl, PKT_pubkey_enc *enc, DEK *dek,
+                         iobuf_t out)
+{
+  PACKET pkt;
+  int rc;
+
+  if ( opt.verbose )
+    {
+      char *ustr = get_user_id_string_native (ctrl, enc->keyid);
+      log_info (_("%s/%s.%s encrypted for: \"%s\"\n"),
+                openpgp_pk_algo_name (enc->pubkey_algo),
+                openpgp_cipher_algo_name (dek->algo),
+                dek->use_aead? openpgp_aead_algo_name (dek->use_aead)
+                /**/         : "CFB",
+                ustr );
+      xfree (ustr);
+    }
+  /* And write it. */
+  init_packet (&pkt);
+  pkt.pkttype = PKT_PUBKEY_ENC;
+  pkt.pkt.pubkey_enc = enc;
+  rc = build_packet (out, &pkt);
+  if (rc)
+    log_error ("build_packet(pubkey_enc) failed: %s\n", gpg_strerror (rc));
+  return rc;
+}
+
+
 /*
  * Write a pubkey-enc packet for the public key PK to OUT.
  */
@@ -1074,7 +1106,6 @@ int
 write_pubkey_enc (ctrl_t ctrl,
                   PKT_public_key *pk, int throw_keyid, DEK *dek, iobuf_t out)
 {
-  PACKET pkt;
   PKT_pubkey_enc *enc;
   int rc;
   gcry_mpi_t frame;
@@ -1104,28 +1135,128 @@ write_pubkey_enc (ctrl_t ctrl,
   if (rc)
     log_error ("pubkey_encrypt failed: %s\n", gpg_strerror (rc) );
   else
+    rc = write_pubkey_enc_packet (ctrl, enc, dek, out);
+  free_pubkey_enc(enc);
+  return rc;
+}
+
+
+/* An object to run the public key operation for one recipient in a
+ * worker thread.  */
+struct pubkey_enc_job_s
+{
+  struct workpool_job_s job;
+  gcry_mpi_t frame;     /* The encoded session key.  */
+  gcry_sexp_t s_data;   /* FRAME prepared for libgcrypt.  */
+  gcry_sexp_t s_pkey;   /* The public key prepared for libgcrypt.  */
+  gcry_sexp_t s_ciph;   /* The result.  */
+  gpg_error_t err;
+  int submitted;
+};
+
+
+/* The worker pool used for the public key operations or NULL if none
+ * could be created.  */
+static workpool_t
+get_pubkey_enc_pool (void)
+{
+  static workpool_t pool;
+  static int no_pool;
+
+  if (!pool && !no_pool && workpool_new (&pool, opt.pubkey_enc_threads))
+    no_pool = 1;
+  return pool;
+}
+
+
+/* The job function running in a worker thread.  */
+static void
+pubkey_enc_job_func (void *opaque)
+{
+  struct pubkey_enc_job_s *pj = opaque;
+
+  pj->err = gcry_pk_encrypt (&pj->s_ciph, pj->s_data, pj->s_pkey);
+}
+
+
+/* The multi-threaded version of write_pubkey_enc_from_list.  The
+ * public key operations for all recipients are started at once and
+ * the packets are then written in the order of PK_LIST; thus the
+ * output is the same as with a single thread.  */
+static int
+write_pubkey_enc_threaded (ctrl_t ctrl, workpool_t pool, PK_LIST pk_list,
+                           DEK *dek, iobuf_t out)
+{
+  struct pubkey_enc_job_s *jobs;
+  PK_LIST pkr;
+  int n, i;
+  int rc = 0;
+
+  for (n=0, pkr=pk_list; pkr; pkr = pkr->next)
+    n++;
+  jobs = xtrycalloc (n, sizeof *jobs);
+  if (!jobs)
+    return gpg_error_from_syserror ();
+
+  for (i=0, pkr=pk_list; pkr; pkr = pkr->next, i++)
     {
-      if ( opt.verbose )
+      PKT_public_key *pk = pkr->pk;
+
+      print_pubkey_algo_note (pk->pubkey_algo);
+      jobs[i].frame = encode_session_key (pk->pubkey_algo, dek,
+                                          pubkey_nbits (pk->pubkey_algo,
+                                                        pk->pkey));
+      jobs[i].err = pk_encrypt_prepare (pk->pubkey_algo, jobs[i].frame,
+                                        pk->pkey,
+                                        &jobs[i].s_pkey, &jobs[i].s_data);
+      if (!jobs[i].err)
         {
-          char *ustr = get_user_id_string_native (ctrl, enc->keyid);
-          log_info (_("%s/%s.%s encrypted for: \"%s\"\n"),
-                    openpgp_pk_algo_name (enc->pubkey_algo),
-                    openpgp_cipher_algo_name (dek->algo),
-                    dek->use_aead? openpgp_aead_algo_name (dek->use_aead)
-                    /**/         : "CFB",
-                    ustr );
-          xfree (ustr);
+          jobs[i].job.func = pubkey_enc_job_func;
+          jobs[i].job.opaque = jobs + i;
+          workpool_submit (pool, &jobs[i].job);
+          jobs[i].submitted = 1;
         }
-      /* And write it. */
-      init_packet (&pkt);
-      pkt.pkttype = PKT_PUBKEY_ENC;
-      pkt.pkt.pubkey_enc = enc;
-      rc = build_packet (out, &pkt);
+    }
+
+  for (i=0, pkr=pk_list; pkr; pkr = pkr->next, i++)
+    {
+      PKT_public_key *pk = pkr->pk;
+      PKT_pubkey_enc *enc;
+      gpg_error_t err;
+
+      if (jobs[i].submitted)
+        workpool_wait (pool, &jobs[i].job);
+      gcry_sexp_release (jobs[i].s_data);
+      gcry_sexp_release (jobs[i].s_pkey);
+      err = jobs[i].err;
+
+      /* After an error we only need to wait for the other jobs.  */
       if (rc)
-        log_error ("build_packet(pubkey_enc) failed: %s\n",
-                   gpg_strerror (rc));
+        {
+          gcry_sexp_release (jobs[i].s_ciph);
+          gcry_mpi_release (jobs[i].frame);
+          continue;
+        }
+
+      enc = xmalloc_clear (sizeof *enc);
+      enc->pubkey_algo = pk->pubkey_algo;
+      keyid_from_pk (pk, enc->keyid);
+      enc->throw_keyid = (opt.throw_keyids || (pkr->flags&1));
+      if (!err)
+        err = pk_encrypt_finish (pk->pubkey_algo, enc->data, jobs[i].frame,
+                                 pk, pk->pkey, jobs[i].s_ciph);
+      else
+        gcry_sexp_release (jobs[i].s_ciph);
+      gcry_mpi_release (jobs[i].frame);
+      if (err)
+        log_error ("pubkey_encrypt failed: %s\n", gpg_strerror (err) );
+      else
+        err = write_pubkey_enc_packet (ctrl, enc, dek, out);
+      free_pubkey_enc (enc);
+      rc = err;
     }
-  free_pubkey_enc(enc);
+
+  xfree (jobs);
   return rc;
 }
 
@@ -1144,6 +1275,14 @@ write_pubkey_enc_from_list (ctrl_t ctrl, PK_LIST pk_list, DEK *dek, iobuf_t out)
       compliance_failure();
     }
 
+  if (opt.pubkey_enc_threads > 1 && pk_list && pk_list->next)
+    {
+      workpool_t pool = get_pubkey_enc_pool ();
+
+      if (pool)
+        return write_pubkey_enc_threaded (ctrl, pool, pk_list, dek, out);
+    }
+
   for ( ; pk_list; pk_list = pk_list->next )
     {
       PKT_public_key *pk = pk_list->pk;
@@ -1160,6 +1299,7 @@ void
 encrypt_crypt_files (ctrl_t ctrl, int nfiles, char **files, strlist_t remusr)
 {
   int rc = 0;
+  pk_list_t pk_list;
 
   if (opt.outfile)
     {
@@ -1167,6 +1307,15 @@ encrypt_crypt_files (ctrl_t ctrl, int nfiles, char **files, strlist_t remusr)
       return;
     }
 
+  /* Resolve the recipients only once for all files.  */
+  rc = build_pk_list (ctrl, remusr, &pk_list);
+  if (rc)
+    {
+      log_error ("building the recipient list failed: %s\n",
+                 gpg_strerror (rc));
+      return;
+    }
+
   if (!nfiles)
     {
       char line[2048];
@@ -1177,11 +1326,11 @@ encrypt_crypt_files (ctrl_t ctrl, int nfiles, char **files, strlist_t remusr)
           if (!*line || line[strlen(line)-1] != '\n')
             {
               log_error("input line %u too long or missing LF\n", lno);
-              return;
+              break;
             }
           line[strlen(line)-1] = '\0';
           print_file_status(STATUS_FILE_START, line, 2);
-          rc = encrypt_crypt (ctrl, -1, line, remusr, 0, NULL, -1);
+          rc = encrypt_crypt (ctrl, -1, line, NULL, 0, pk_list, -1);
           if (rc)
             log_error ("encryption of '%s' failed: %s\n",
                        print_fname_stdin(line), gpg_strerror (rc) );
@@ -1193,11 +1342,13 @@ encrypt_crypt_files (ctrl_t ctrl, int nfiles, char **files, strlist_t remusr)
       while (nfiles--)
         {
           print_file_status(STATUS_FILE_START, *files, 2);
-          if ( (rc = encrypt_crypt (ctrl, -1, *files, remusr, 0, NULL, -1)) )
+          if ( (rc = encrypt_crypt (ctrl, -1, *files, NULL, 0, pk_list, -1)) )
             log_error("encryption of '%s' failed: %s\n",
                       print_fname_stdin(*files), gpg_strerror (rc) );
           write_status( STATUS_FILE_DONE );
           files++;
         }
     }
+
+  release_pk_list (pk_list);
 }
@@ -44,6 +44,11 @@
 #include "key-clean.h"
 
 
+/* The number of keyblocks read ahead when exporting all keys with
+ * cleaning.  */
+#define EXPORT_BATCH_SIZE 128
+
+
 /* An object to keep track of subkeys. */
 struct subkey_list_s
 {
@@ -180,9 +185,15 @@ parse_and_set_export_filter (const char *string)
   register_mem_cleanup_func (cleanup_export_globals);
 
   if (!strncmp (string, "keep-uid=", 9))
-    err = recsel_parse_expr (&export_keep_uid, string+9);
+    {
+      err = recsel_parse_expr (&export_keep_uid, string+9);
+      recsel_resolve (export_keep_uid, impex_filter_propid);
+    }
   else if (!strncmp (string, "drop-subkey=", 12))
-    err = recsel_parse_expr (&export_drop_subkey, string+12);
+    {
+      err = recsel_parse_expr (&export_drop_subkey, string+12);
+      recsel_resolve (export_drop_subkey, impex_filter_propid);
+    }
   else
     err = gpg_error (GPG_ERR_INV_NAME);
 
@@ -1351,7 +1362,7 @@ apply_keep_uid_filter (ctrl_t ctrl, kbnode_t keyblock, recsel_expr_t selector)
       if (node->pkt->pkttype == PKT_USER_ID)
         {
           parm.node = node;
-          if (!recsel_select (selector, impex_filter_getval, &parm))
+          if (!recsel_select_id (selector, impex_filter_getval_id, &parm))
             {
               /* log_debug ("keep-uid: deleting '%s'\n", */
               /*            node->pkt->pkt.user_id->name); */
@@ -1393,7 +1404,7 @@ apply_drop_subkey_filter (ctrl_t ctrl, kbnode_t keyblock,
           || node->pkt->pkttype == PKT_SECRET_SUBKEY)
         {
           parm.node = node;
-          if (recsel_select (selector, impex_filter_getval, &parm))
+          if (recsel_select_id (selector, impex_filter_getval_id, &parm))
             {
               /*log_debug ("drop-subkey: deleting a key\n");*/
               /* The subkey packet and all following packets up to the
@@ -1856,6 +1867,11 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
   gcry_cipher_hd_t cipherhd = NULL;
   struct export_stats_s dummystats;
   iobuf_t out_help = NULL;
+  kbnode_t *batch = NULL;
+  int nbatch = 0;
+  int batchpos = 0;
+  gpg_error_t batch_err = 0;
+  int batch_read_error = 0;
 
   if (!stats)
     stats = &dummystats;
@@ -1942,26 +1958,71 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
       kek = NULL;
     }
 
+  /* When exporting all keys with cleaning, we read the keyblocks in
+   * batches so that the self-signatures checked by the cleaning can
+   * be verified in parallel.  */
+  if (!users && !keyblock_out && (options & EXPORT_CLEAN)
+      && opt.sig_check_threads > 1)
+    batch = xcalloc (EXPORT_BATCH_SIZE, sizeof *batch);
+
   for (;;)
     {
       u32 keyid[2];
       PKT_public_key *pk;
 
-      err = keydb_search (kdbhd, desc, ndesc, &descindex);
-      if (!users)
-        desc[0].mode = KEYDB_SEARCH_MODE_NEXT;
-      if (err)
-        break;
-
-      /* Read the keyblock. */
       release_kbnode (keyblock);
       keyblock = NULL;
-      err = keydb_get_keyblock (kdbhd, &keyblock);
-      if (err)
+
+      if (batch)
         {
-          log_error (_("error reading keyblock: %s\n"), gpg_strerror (err));
-          goto leave;
-	}
+          if (batchpos == nbatch)
+            {
+              nbatch = batchpos = 0;
+              while (nbatch < EXPORT_BATCH_SIZE && !batch_err)
+                {
+                  batch_err = keydb_search (kdbhd, desc, ndesc, &descindex);
+                  desc[0].mode = KEYDB_SEARCH_MODE_NEXT;
+                  if (batch_err)
+                    break;
+                  batch_err = keydb_get_keyblock (kdbhd, batch + nbatch);
+                  if (batch_err)
+                    {
+                      log_error (_("error reading keyblock: %s\n"),
+                                 gpg_strerror (batch_err));
+                      batch_read_error = 1;
+                      break;
+                    }
+                  nbatch++;
+                }
+              check_self_sigs_batch (batch, nbatch);
+            }
+          if (batchpos == nbatch)
+            {
+              err = batch_err;
+              if (batch_read_error)
+                goto leave;
+              break;
+            }
+          keyblock = batch[batchpos];
+          batch[batchpos++] = NULL;
+        }
+      else
+        {
+          err = keydb_search (kdbhd, desc, ndesc, &descindex);
+          if (!users)
+            desc[0].mode = KEYDB_SEARCH_MODE_NEXT;
+          if (err)
+            break;
+
+          /* Read the keyblock. */
+          err = keydb_get_keyblock (kdbhd, &keyblock);
+          if (err)
+            {
+              log_error (_("error reading keyblock: %s\n"),
+                         gpg_strerror (err));
+              goto leave;
+            }
+        }
 
       node = find_kbnode (keyblock, PKT_PUBLIC_KEY);
       if (!node)
@@ -2072,6 +2133,12 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
     err = 0;
 
  leave:
+  if (batch)
+    {
+      for (; batchpos < nbatch; batchpos++)
+        release_kbnode (batch[batchpos]);
+      xfree (batch);
+    }
   iobuf_cancel (out_help);
   gcry_cipher_close (cipherhd);
   xfree(desc);
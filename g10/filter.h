@@ -27,6 +27,7 @@ typedef struct {
     gcry_md_hd_t md;      /* catch all */
     gcry_md_hd_t md2;     /* if we want to calculate an alternate hash */
     size_t maxbuf_size;
+    void *workers;        /* used for threaded hashing */
 } md_filter_context_t;
 
 typedef struct {
@@ -83,6 +84,7 @@ struct compress_filter_context_s {
     int algo;	 /* compress algo */
     int algo1hack;
     int new_ctb;
+    void *workers;  /* (used for threaded compression) */
     void (*release)(struct compress_filter_context_s*);
 };
 typedef struct compress_filter_context_s compress_filter_context_t;
@@ -134,6 +136,14 @@ typedef struct
   size_t bufsize;  /* Allocated length.  */
   size_t buflen;   /* Used length.       */
 
+  /* Worker threads and chunk objects used for multi-threaded AEAD
+   * encryption.  AEAD_CUR is the index of the chunk object currently
+   * being filled.  */
+  struct workpool_s *aead_pool;
+  struct aead_chunk_s *aead_chunks;
+  unsigned int aead_nchunks;
+  unsigned int aead_cur;
+
 } cipher_filter_context_t;
 
 
@@ -166,6 +176,9 @@ typedef struct {
 /*-- mdfilter.c --*/
 int md_filter( void *opaque, int control, iobuf_t a, byte *buf, size_t *ret_len);
 void free_md_filter_context( md_filter_context_t *mfx );
+gpg_error_t md_filter_start_workers (md_filter_context_t *mfx);
+void md_filter_wait (md_filter_context_t *mfx);
+gcry_md_hd_t md_filter_get_md (md_filter_context_t *mfx, int algo);
 
 /*-- armor.c --*/
 armor_filter_context_t *new_armor_context (void);
@@ -181,6 +194,7 @@ gpg_error_t push_compress_filter (iobuf_t out, compress_filter_context_t *zfx,
                                   int algo);
 gpg_error_t push_compress_filter2 (iobuf_t out,compress_filter_context_t *zfx,
                                    int algo, int rel);
+int is_file_incompressible (const char *fname);
 
 /*-- cipher.c --*/
 int cipher_filter_cfb (void *opaque, int control,
@@ -25,11 +25,141 @@
 
 #include "gpg.h"
 #include "../common/util.h"
+#include "../common/init.h"
 #include "packet.h"
 #include "../common/iobuf.h"
 #include "options.h"
 
 
+/* Parsing a keyblock allocates a PACKET and a signature or public key
+ * object for nearly every packet and releasing the keyblock frees
+ * them again; for large keyrings this malloc/free traffic is a
+ * substantial part of a key lookup.  Thus we keep the released
+ * objects on free lists, as kbnode.c already does for the nodes, and
+ * hand them out again to the parser.  The lists are limited to
+ * MAX_UNUSED_OBJECTS items each.  */
+#define MAX_UNUSED_OBJECTS 4096
+
+/* An item of the free lists.  The objects are larger than this.  */
+struct unused_object_s
+{
+  struct unused_object_s *next;
+};
+
+static struct unused_object_s *unused_packets;
+static struct unused_object_s *unused_signatures;
+static struct unused_object_s *unused_public_keys;
+static unsigned int n_unused_packets;
+static unsigned int n_unused_signatures;
+static unsigned int n_unused_public_keys;
+static int cleanup_registered;
+
+
+static void
+release_unused_list (struct unused_object_s **list, unsigned int *count)
+{
+  struct unused_object_s *obj;
+
+  while ((obj = *list))
+    {
+      *list = obj->next;
+      xfree (obj);
+    }
+  *count = 0;
+}
+
+
+static void
+release_unused_objects (void)
+{
+  release_unused_list (&unused_packets, &n_unused_packets);
+  release_unused_list (&unused_signatures, &n_unused_signatures);
+  release_unused_list (&unused_public_keys, &n_unused_public_keys);
+}
+
+
+/* Return a zeroed object of SIZE bytes, taking it from LIST if
+ * possible.  */
+static void *
+alloc_object (struct unused_object_s **list, unsigned int *count, size_t size)
+{
+  struct unused_object_s *obj = *list;
+
+  if (!obj)
+    return xmalloc_clear (size);
+  *list = obj->next;
+  (*count)--;
+  memset (obj, 0, size);
+  return obj;
+}
+
+
+/* Release OBJECT by putting it onto LIST.  */
+static void
+free_object (struct unused_object_s **list, unsigned int *count, void *object)
+{
+  struct unused_object_s *obj = object;
+
+  if (!obj)
+    return;
+  /* Objects in secure memory are not kept so that the small pool of
+   * secure memory is not used up.  */
+  if (*count >= MAX_UNUSED_OBJECTS || gcry_is_secure (obj))
+    {
+      xfree (obj);
+      return;
+    }
+  if (!cleanup_registered)
+    {
+      cleanup_registered = 1;
+      register_mem_cleanup_func (release_unused_objects);
+    }
+  obj->next = *list;
+  *list = obj;
+  (*count)++;
+}
+
+
+/* Return a new initialized PACKET object which may be released with
+ * release_packet_object or xfree.  */
+PACKET *
+alloc_packet_object (void)
+{
+  PACKET *pkt;
+
+  pkt = alloc_object (&unused_packets, &n_unused_packets, sizeof *pkt);
+  init_packet (pkt);
+  return pkt;
+}
+
+
+/* Release the PACKET object PKT but not its content; the caller
+ * should have called free_packet before.  */
+void
+release_packet_object (PACKET *pkt)
+{
+  free_object (&unused_packets, &n_unused_packets, pkt);
+}
+
+
+/* Return a new zeroed signature object.  */
+PKT_signature *
+alloc_signature_object (void)
+{
+  return alloc_object (&unused_signatures, &n_unused_signatures,
+                       sizeof (PKT_signature));
+}
+
+
+/* Return a new zeroed public key object.  */
+PKT_public_key *
+alloc_public_key_object (void)
+{
+  return alloc_object (&unused_public_keys, &n_unused_public_keys,
+                       sizeof (PKT_public_key));
+}
+
+
 /* This is mpi_copy with a fix for opaque MPIs which store a NULL
    pointer.  This will also be fixed in Libggcrypt 1.7.0.  */
 static gcry_mpi_t
@@ -83,8 +213,9 @@ free_seckey_enc( PKT_signature *sig )
       xfree (sig->pka_info);
     }
   xfree (sig->signers_uid);
+  xfree (sig->digest);
 
-  xfree(sig);
+  free_object (&unused_signatures, &n_unused_signatures, sig);
 }
 
 
@@ -104,6 +235,14 @@ release_public_key_parts (PKT_public_key *pk)
       mpi_release (pk->pkey[i]);
       pk->pkey[i] = NULL;
     }
+  pk->fprlen = 0;
+  pk->flags.keygrip_valid = 0;
+  if (pk->pkey_sexp && !--pk->pkey_sexp->refcount)
+    {
+      gcry_sexp_release (pk->pkey_sexp->sexp);
+      xfree (pk->pkey_sexp);
+    }
+  pk->pkey_sexp = NULL;
   if (pk->seckey_info)
     {
       xfree (pk->seckey_info);
@@ -143,7 +282,7 @@ free_public_key (PKT_public_key *pk)
   if (pk)
     {
       release_public_key_parts (pk);
-      xfree(pk);
+      free_object (&unused_public_keys, &n_unused_public_keys, pk);
     }
 }
 
@@ -202,6 +341,8 @@ copy_public_key (PKT_public_key *d, PKT_public_key *s)
   d->seckey_info = NULL;
   d->user_id = scopy_user_id (s->user_id);
   d->prefs = copy_prefs (s->prefs);
+  if (d->pkey_sexp)
+    d->pkey_sexp->refcount++;
 
   n = pubkey_get_npkey (s->pubkey_algo);
   i = 0;
@@ -269,6 +410,11 @@ copy_signature( PKT_signature *d, PKT_signature *s )
     d->unhashed = cp_subpktarea (s->unhashed);
     if (s->signers_uid)
       d->signers_uid = xstrdup (s->signers_uid);
+    if (s->digest)
+      {
+        d->digest = xmalloc (s->digest_len);
+        memcpy (d->digest, s->digest, s->digest_len);
+      }
     if(s->numrevkeys)
       {
 	d->revkey=NULL;
@@ -532,6 +678,8 @@ cmp_signatures( PKT_signature *a, PKT_signature *b )
     n = pubkey_get_nsig( a->pubkey_algo );
     if( !n )
 	return -1; /* can't compare due to unknown algorithm */
+    if (parse_sig_data (a) || parse_sig_data (b))
+        return -1;
     for(i=0; i < n; i++ ) {
 	if( mpi_cmp( a->data[i] , b->data[i] ) )
 	    return -1;
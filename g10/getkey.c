@@ -36,6 +36,7 @@
 #include "../common/i18n.h"
 #include "keyserver-internal.h"
 #include "call-agent.h"
+#include "pkglue.h"
 #include "../common/host2net.h"
 #include "../common/mbox-util.h"
 #include "../common/status.h"
@@ -96,32 +97,47 @@ struct getkey_ctx_s
   KEYDB_SEARCH_DESC items[1];
 };
 
-#if 0
+/* Some statistics for getkey_stats_report.  */
 static struct
 {
-  int any;
-  int okay_count;
-  int nokey_count;
-  int error_count;
-} lkup_stats[21];
-#endif
+  unsigned int pk_cache_hits;
+  unsigned int pk_cache_misses;
+  unsigned int lookup_okay;
+  unsigned int lookup_nokey;
+  unsigned int lookup_error;
+} getkey_stats;
 
 typedef struct keyid_list
 {
   struct keyid_list *next;
   char fpr[MAX_FINGERPRINT_LEN];
   u32 keyid[2];
+  struct user_id_db *owner;       /* The cache entry of this key.  */
+  struct keyid_list *kid_next;    /* Next key in the keyid bucket.  */
+  struct keyid_list *fpr_next;    /* Next key in the fingerprint bucket.  */
 } *keyid_list_t;
 
 
+/* The public key cache and the user id cache are hash tables.  The
+ * entries are also linked into a list in the order of their last
+ * use; if a cache is full the least recently used entry is removed.
+ * The maximum number of entries of each cache can be set with
+ * --key-cache-size and defaults to PK_UID_CACHE_SIZE.  The number of
+ * buckets is fixed when a cache is first used.  */
+
 #if MAX_PK_CACHE_ENTRIES
 typedef struct pk_cache_entry
 {
-  struct pk_cache_entry *next;
+  struct pk_cache_entry *next;      /* Next entry in the bucket.  */
+  struct pk_cache_entry *lru_prev;  /* Entry used more recently.  */
+  struct pk_cache_entry *lru_next;  /* Entry used less recently.  */
   u32 keyid[2];
   PKT_public_key *pk;
 } *pk_cache_entry_t;
-static pk_cache_entry_t pk_cache;
+static pk_cache_entry_t *pk_cache;  /* The buckets.  */
+static unsigned int pk_cache_nbuckets;
+static pk_cache_entry_t pk_cache_head;  /* Most recently used entry.  */
+static pk_cache_entry_t pk_cache_tail;  /* Least recently used entry.  */
 static int pk_cache_entries;	/* Number of entries in pk cache.  */
 static int pk_cache_disabled;
 #endif
@@ -131,12 +147,17 @@ static int pk_cache_disabled;
 #endif
 typedef struct user_id_db
 {
-  struct user_id_db *next;
+  struct user_id_db *next;      /* Entry used less recently.  */
+  struct user_id_db *prev;      /* Entry used more recently.  */
   keyid_list_t keyids;
   int len;
   char name[1];
 } *user_id_db_t;
-static user_id_db_t user_id_db;
+static user_id_db_t user_id_db;       /* Most recently used entry.  */
+static user_id_db_t user_id_db_tail;  /* Least recently used entry.  */
+static keyid_list_t *uid_cache_kids;  /* The keyid buckets.  */
+static keyid_list_t *uid_cache_fprs;  /* The fingerprint buckets.  */
+static unsigned int uid_cache_nbuckets;
 static int uid_cache_entries;	/* Number of entries in uid cache. */
 
 static void merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock);
@@ -148,22 +169,136 @@ static kbnode_t finish_lookup (kbnode_t keyblock,
 static void print_status_key_considered (kbnode_t keyblock, unsigned int flags);
 
 
-#if 0
-static void
-print_stats ()
+/* Emit the statistics of this module for the stats registry.  */
+void
+getkey_stats_report (stats_sink_t sink)
+{
+  stats_put (sink, "pk_cache_entries", pk_cache_entries);
+  stats_put (sink, "pk_cache_hits", getkey_stats.pk_cache_hits);
+  stats_put (sink, "pk_cache_misses", getkey_stats.pk_cache_misses);
+  stats_put (sink, "uid_cache_entries", uid_cache_entries);
+  stats_put (sink, "lookup_okay", getkey_stats.lookup_okay);
+  stats_put (sink, "lookup_nokey", getkey_stats.lookup_nokey);
+  stats_put (sink, "lookup_error", getkey_stats.lookup_error);
+}
+
+
+/* Return the maximum number of entries of the key caches.  */
+static int
+max_cache_entries (void)
 {
+  if (opt.key_cache_size >= 5)
+    return opt.key_cache_size;
+  return PK_UID_CACHE_SIZE;
+}
+
+
+/* Return a suitable number of buckets for a cache with up to N
+ * entries.  The returned value is a power of 2.  */
+static unsigned int
+cache_nbuckets (int n)
+{
+  unsigned int nbuckets = 64;
+
+  while (nbuckets < n && nbuckets < (1 << 20))
+    nbuckets <<= 1;
+  return nbuckets;
+}
+
+
+static unsigned int
+keyid_hash (const u32 *keyid, unsigned int nbuckets)
+{
+  return (keyid[1] ^ (keyid[0] >> 7)) & (nbuckets - 1);
+}
+
+
+static unsigned int
+fpr_hash (const char *fpr, unsigned int nbuckets)
+{
+  const unsigned char *p = (const unsigned char *)fpr;
+  u32 h = 0;
   int i;
-  for (i = 0; i < DIM (lkup_stats); i++)
+
+  for (i=0; i < MAX_FINGERPRINT_LEN; i++)
+    h = (h << 5) + h + p[i];
+  return h & (nbuckets - 1);
+}
+
+
+#if MAX_PK_CACHE_ENTRIES
+/* Move the entry CE of the public key cache to the head of the LRU
+ * list.  If NEW is set CE is not yet in the list.  */
+static void
+pk_cache_touch (pk_cache_entry_t ce, int new)
+{
+  if (!new)
     {
-      if (lkup_stats[i].any)
-	es_fprintf (es_stderr,
-		 "lookup stats: mode=%-2d  ok=%-6d  nokey=%-6d  err=%-6d\n",
-		 i,
-		 lkup_stats[i].okay_count,
-		 lkup_stats[i].nokey_count, lkup_stats[i].error_count);
+      if (ce == pk_cache_head)
+        return;
+      if (ce->lru_prev)
+        ce->lru_prev->lru_next = ce->lru_next;
+      if (ce->lru_next)
+        ce->lru_next->lru_prev = ce->lru_prev;
+      else
+        pk_cache_tail = ce->lru_prev;
     }
+  ce->lru_prev = NULL;
+  ce->lru_next = pk_cache_head;
+  if (pk_cache_head)
+    pk_cache_head->lru_prev = ce;
+  pk_cache_head = ce;
+  if (!pk_cache_tail)
+    pk_cache_tail = ce;
 }
-#endif
+
+
+/* Return the public key cache entry for KEYID or NULL.  */
+static pk_cache_entry_t
+pk_cache_lookup (u32 *keyid)
+{
+  pk_cache_entry_t ce;
+
+  if (!pk_cache)
+    return NULL;
+
+  for (ce = pk_cache[keyid_hash (keyid, pk_cache_nbuckets)]; ce; ce = ce->next)
+    if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
+      {
+        pk_cache_touch (ce, 0);
+        return ce;
+      }
+  return NULL;
+}
+
+
+/* Remove the least recently used entry from the public key cache.  */
+static void
+pk_cache_evict (void)
+{
+  pk_cache_entry_t ce = pk_cache_tail;
+  pk_cache_entry_t *p;
+
+  if (!ce)
+    return;
+
+  for (p = &pk_cache[keyid_hash (ce->keyid, pk_cache_nbuckets)];
+       *p; p = &(*p)->next)
+    if (*p == ce)
+      {
+        *p = ce->next;
+        break;
+      }
+  pk_cache_tail = ce->lru_prev;
+  if (pk_cache_tail)
+    pk_cache_tail->lru_next = NULL;
+  else
+    pk_cache_head = NULL;
+  free_public_key (ce->pk);
+  xfree (ce);
+  pk_cache_entries--;
+}
+#endif /*MAX_PK_CACHE_ENTRIES*/
 
 
 /* Cache a copy of a public key in the public key cache.  PK is not
@@ -182,8 +317,9 @@ void
 cache_public_key (PKT_public_key * pk)
 {
 #if MAX_PK_CACHE_ENTRIES
-  pk_cache_entry_t ce, ce2;
+  pk_cache_entry_t ce;
   u32 keyid[2];
+  unsigned int bucket;
 
   if (pk_cache_disabled)
     return;
@@ -203,40 +339,28 @@ cache_public_key (PKT_public_key * pk)
   else
     return; /* Don't know how to get the keyid.  */
 
-  for (ce = pk_cache; ce; ce = ce->next)
-    if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-      {
-	if (DBG_CACHE)
-	  log_debug ("cache_public_key: already in cache\n");
-	return;
-      }
-
-  if (pk_cache_entries >= MAX_PK_CACHE_ENTRIES)
+  if (pk_cache_lookup (keyid))
     {
-      int n;
+      if (DBG_CACHE)
+        log_debug ("cache_public_key: already in cache\n");
+      return;
+    }
 
-      /* Remove the last 50% of the entries.  */
-      for (ce = pk_cache, n = 0; ce && n < pk_cache_entries/2; n++)
-        ce = ce->next;
-      if (ce && ce != pk_cache && ce->next)
-        {
-          ce2 = ce->next;
-          ce->next = NULL;
-          ce = ce2;
-          for (; ce; ce = ce2)
-            {
-              ce2 = ce->next;
-              free_public_key (ce->pk);
-              xfree (ce);
-              pk_cache_entries--;
-            }
-        }
-      log_assert (pk_cache_entries < MAX_PK_CACHE_ENTRIES);
+  if (!pk_cache)
+    {
+      pk_cache_nbuckets = cache_nbuckets (max_cache_entries ());
+      pk_cache = xcalloc (pk_cache_nbuckets, sizeof *pk_cache);
     }
+
+  while (pk_cache_entries >= max_cache_entries ())
+    pk_cache_evict ();
+
   pk_cache_entries++;
   ce = xmalloc (sizeof *ce);
-  ce->next = pk_cache;
-  pk_cache = ce;
+  bucket = keyid_hash (keyid, pk_cache_nbuckets);
+  ce->next = pk_cache[bucket];
+  pk_cache[bucket] = ce;
+  pk_cache_touch (ce, 1);
   ce->pk = copy_public_key (NULL, pk);
   ce->keyid[0] = keyid[0];
   ce->keyid[1] = keyid[1];
@@ -296,6 +420,110 @@ release_keyid_list (keyid_list_t k)
     }
 }
 
+
+/* Move the user id cache entry R to the head of the LRU list.  If NEW
+ * is set R is not yet in the list.  */
+static void
+uid_cache_touch (user_id_db_t r, int new)
+{
+  if (!new)
+    {
+      if (r == user_id_db)
+        return;
+      if (r->prev)
+        r->prev->next = r->next;
+      if (r->next)
+        r->next->prev = r->prev;
+      else
+        user_id_db_tail = r->prev;
+    }
+  r->prev = NULL;
+  r->next = user_id_db;
+  if (user_id_db)
+    user_id_db->prev = r;
+  user_id_db = r;
+  if (!user_id_db_tail)
+    user_id_db_tail = r;
+}
+
+
+/* Return the user id cache entry for the key with KEYID or NULL.  */
+static user_id_db_t
+uid_cache_lookup_kid (u32 *keyid)
+{
+  keyid_list_t a;
+
+  if (!uid_cache_kids)
+    return NULL;
+  for (a = uid_cache_kids[keyid_hash (keyid, uid_cache_nbuckets)];
+       a; a = a->kid_next)
+    if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
+      {
+        uid_cache_touch (a->owner, 0);
+        return a->owner;
+      }
+  return NULL;
+}
+
+
+/* Return the user id cache entry for the key with the fingerprint
+ * FPR, which has MAX_FINGERPRINT_LEN bytes, or NULL.  */
+static user_id_db_t
+uid_cache_lookup_fpr (const char *fpr)
+{
+  keyid_list_t a;
+
+  if (!uid_cache_fprs)
+    return NULL;
+  for (a = uid_cache_fprs[fpr_hash (fpr, uid_cache_nbuckets)];
+       a; a = a->fpr_next)
+    if (!memcmp (a->fpr, fpr, MAX_FINGERPRINT_LEN))
+      {
+        uid_cache_touch (a->owner, 0);
+        return a->owner;
+      }
+  return NULL;
+}
+
+
+/* Remove the least recently used entry from the user id cache.  */
+static void
+uid_cache_evict (void)
+{
+  user_id_db_t r = user_id_db_tail;
+  keyid_list_t a, *p;
+
+  if (!r)
+    return;
+
+  for (a = r->keyids; a; a = a->next)
+    {
+      for (p = &uid_cache_kids[keyid_hash (a->keyid, uid_cache_nbuckets)];
+           *p; p = &(*p)->kid_next)
+        if (*p == a)
+          {
+            *p = a->kid_next;
+            break;
+          }
+      for (p = &uid_cache_fprs[fpr_hash (a->fpr, uid_cache_nbuckets)];
+           *p; p = &(*p)->fpr_next)
+        if (*p == a)
+          {
+            *p = a->fpr_next;
+            break;
+          }
+    }
+
+  user_id_db_tail = r->prev;
+  if (user_id_db_tail)
+    user_id_db_tail->next = NULL;
+  else
+    user_id_db = NULL;
+  release_keyid_list (r->keyids);
+  xfree (r);
+  uid_cache_entries--;
+}
+
 /****************
  * Store the association of keyid and userid
  * Feed only public keys to this function.
@@ -320,22 +548,14 @@ cache_user_id (KBNODE keyblock)
           fingerprint_from_pk (k->pkt->pkt.public_key, a->fpr, NULL);
 	  keyid_from_pk (k->pkt->pkt.public_key, a->keyid);
 	  /* First check for duplicates.  */
-	  for (r = user_id_db; r; r = r->next)
-	    {
-	      keyid_list_t b;
-
-	      for (b = r->keyids; b; b = b->next)
-		{
-		  if (!memcmp (b->fpr, a->fpr, MAX_FINGERPRINT_LEN))
-		    {
-		      if (DBG_CACHE)
-			log_debug ("cache_user_id: already in cache\n");
-		      release_keyid_list (keyids);
-		      xfree (a);
-		      return;
-		    }
-		}
-	    }
+          if (uid_cache_lookup_fpr (a->fpr))
+            {
+              if (DBG_CACHE)
+                log_debug ("cache_user_id: already in cache\n");
+              release_keyid_list (keyids);
+              xfree (a);
+              return;
+            }
 	  /* Now put it into the cache.  */
 	  a->next = keyids;
 	  keyids = a;
@@ -347,21 +567,34 @@ cache_user_id (KBNODE keyblock)
 
   uid = get_primary_uid (keyblock, &uidlen);
 
-  if (uid_cache_entries >= MAX_UID_CACHE_ENTRIES)
+  if (!uid_cache_kids)
     {
-      /* fixme: use another algorithm to free some cache slots */
-      r = user_id_db;
-      user_id_db = r->next;
-      release_keyid_list (r->keyids);
-      xfree (r);
-      uid_cache_entries--;
+      /* Each entry has usually more than one key.  */
+      uid_cache_nbuckets = cache_nbuckets (2 * max_cache_entries ());
+      uid_cache_kids = xcalloc (uid_cache_nbuckets, sizeof *uid_cache_kids);
+      uid_cache_fprs = xcalloc (uid_cache_nbuckets, sizeof *uid_cache_fprs);
     }
+
+  while (uid_cache_entries >= max_cache_entries ())
+    uid_cache_evict ();
+
   r = xmalloc (sizeof *r + uidlen - 1);
   r->keyids = keyids;
   r->len = uidlen;
   memcpy (r->name, uid, r->len);
-  r->next = user_id_db;
-  user_id_db = r;
+  for (; keyids; keyids = keyids->next)
+    {
+      unsigned int bucket;
+
+      keyids->owner = r;
+      bucket = keyid_hash (keyids->keyid, uid_cache_nbuckets);
+      keyids->kid_next = uid_cache_kids[bucket];
+      uid_cache_kids[bucket] = keyids;
+      bucket = fpr_hash (keyids->fpr, uid_cache_nbuckets);
+      keyids->fpr_next = uid_cache_fprs[bucket];
+      uid_cache_fprs[bucket] = keyids;
+    }
+  uid_cache_touch (r, 1);
   uid_cache_entries++;
 }
 
@@ -373,19 +606,11 @@ void
 getkey_disable_caches ()
 {
 #if MAX_PK_CACHE_ENTRIES
-  {
-    pk_cache_entry_t ce, ce2;
-
-    for (ce = pk_cache; ce; ce = ce2)
-      {
-	ce2 = ce->next;
-	free_public_key (ce->pk);
-	xfree (ce);
-      }
-    pk_cache_disabled = 1;
-    pk_cache_entries = 0;
-    pk_cache = NULL;
-  }
+  while (pk_cache_tail)
+    pk_cache_evict ();
+  xfree (pk_cache);
+  pk_cache = NULL;
+  pk_cache_disabled = 1;
 #endif
   /* fixme: disable user id cache ? */
 }
@@ -729,16 +954,20 @@ get_pubkey (ctrl_t ctrl, PKT_public_key * pk, u32 * keyid)
          NULL as it does not guarantee that the user IDs are
          cached. */
       pk_cache_entry_t ce;
-      for (ce = pk_cache; ce; ce = ce->next)
-	{
-	  if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-	    /* XXX: We don't check PK->REQ_USAGE here, but if we don't
-	       read from the cache, we do check it!  */
-	    {
-	      copy_public_key (pk, ce->pk);
-	      return 0;
-	    }
-	}
+
+      ce = pk_cache_lookup (keyid);
+      if (ce)
+        {
+          /* XXX: We don't check PK->REQ_USAGE here, but if we don't
+             read from the cache, we do check it!  */
+          getkey_stats.pk_cache_hits++;
+          /* A key requested again is likely used to check further
+           * signatures; share the S-expression with all copies.  */
+          pk_verify_prepare (ce->pk);
+          copy_public_key (pk, ce->pk);
+          return 0;
+        }
+      getkey_stats.pk_cache_misses++;
     }
 #endif
   /* More init stuff.  */
@@ -830,18 +1059,18 @@ get_pubkey_fast (PKT_public_key * pk, u32 * keyid)
     /* Try to get it from the cache */
     pk_cache_entry_t ce;
 
-    for (ce = pk_cache; ce; ce = ce->next)
+    ce = pk_cache_lookup (keyid);
+    if (ce
+        /* Only consider primary keys.  */
+        && ce->pk->keyid[0] == ce->pk->main_keyid[0]
+        && ce->pk->keyid[1] == ce->pk->main_keyid[1])
       {
-	if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1]
-	    /* Only consider primary keys.  */
-	    && ce->pk->keyid[0] == ce->pk->main_keyid[0]
-	    && ce->pk->keyid[1] == ce->pk->main_keyid[1])
-	  {
-	    if (pk)
-	      copy_public_key (pk, ce->pk);
-	    return 0;
-	  }
+        getkey_stats.pk_cache_hits++;
+        if (pk)
+          copy_public_key (pk, ce->pk);
+        return 0;
       }
+    getkey_stats.pk_cache_misses++;
   }
 #endif
 
@@ -952,6 +1181,26 @@ get_pubkeyblock (ctrl_t ctrl, u32 * keyid)
  * using merge_selfsigs.  */
 gpg_error_t
 get_seckey (ctrl_t ctrl, PKT_public_key *pk, u32 *keyid)
+{
+  gpg_error_t err;
+
+  err = get_pubkey_exact (ctrl, pk, keyid);
+  if (!err)
+    {
+      err = agent_probe_secret_key (/*ctrl*/NULL, pk);
+      if (err)
+	release_public_key_parts (pk);
+    }
+
+  return err;
+}
+
+
+/* Same as get_seckey but do not ask the agent whether the secret key
+ * is available.  This is used by callers which already know the set
+ * of available secret keys.  */
+gpg_error_t
+get_pubkey_exact (ctrl_t ctrl, PKT_public_key *pk, u32 *keyid)
 {
   gpg_error_t err;
   struct getkey_ctx_s ctx;
@@ -977,13 +1226,6 @@ get_seckey (ctrl_t ctrl, PKT_public_key *pk, u32 *keyid)
   getkey_end (ctrl, &ctx);
   release_kbnode (keyblock);
 
-  if (!err)
-    {
-      err = agent_probe_secret_key (/*ctrl*/NULL, pk);
-      if (err)
-	release_public_key_parts (pk);
-    }
-
   return err;
 }
 
@@ -1775,28 +2017,40 @@ get_pubkey_fromfile (ctrl_t ctrl, PKT_public_key *pk, const char *fname)
 {
   gpg_error_t err;
   kbnode_t keyblock;
-  kbnode_t found_key;
-  unsigned int infoflags;
 
   err = read_key_from_file (ctrl, fname, &keyblock);
   if (!err)
-    {
-      /* Warning: node flag bits 0 and 1 should be preserved by
-       * merge_selfsigs.  FIXME: Check whether this still holds. */
-      merge_selfsigs (ctrl, keyblock);
-      found_key = finish_lookup (keyblock, pk->req_usage, 0, 0, &infoflags);
-      print_status_key_considered (keyblock, infoflags);
-      if (found_key)
-        pk_from_block (pk, keyblock, found_key);
-      else
-        err = gpg_error (GPG_ERR_UNUSABLE_PUBKEY);
-    }
+    err = get_pubkey_from_keyblock (ctrl, pk, keyblock);
 
   release_kbnode (keyblock);
   return err;
 }
 
 
+/* Get the public key from KEYBLOCK matching PK->REQ_USAGE and store
+ * it in PK.  KEYBLOCK is not released but the self-signed data is
+ * merged into it using merge_selfsigs.  Returns 0 on success or
+ * GPG_ERR_UNUSABLE_PUBKEY if no suitable key was found.  The caller
+ * must release the content of PK by calling release_public_key_parts
+ * (or, if PK was malloced, using free_public_key).  */
+gpg_error_t
+get_pubkey_from_keyblock (ctrl_t ctrl, PKT_public_key *pk, kbnode_t keyblock)
+{
+  kbnode_t found_key;
+  unsigned int infoflags;
+
+  /* Warning: node flag bits 0 and 1 should be preserved by
+   * merge_selfsigs.  FIXME: Check whether this still holds. */
+  merge_selfsigs (ctrl, keyblock);
+  found_key = finish_lookup (keyblock, pk->req_usage, 0, 0, &infoflags);
+  print_status_key_considered (keyblock, infoflags);
+  if (!found_key)
+    return gpg_error (GPG_ERR_UNUSABLE_PUBKEY);
+  pk_from_block (pk, keyblock, found_key);
+  return 0;
+}
+
+
 /* Lookup a key with the specified fingerprint.
  *
  * If PK is not NULL, the public key of the first result is returned
@@ -3432,6 +3686,10 @@ merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock)
       BUG ();
     }
 
+  /* Verify the self-signatures up front so that the checks below
+   * can use the cached results.  */
+  check_self_sigs_parallel (keyblock);
+
   merge_selfsigs_main (ctrl, keyblock, &revoked, &rinfo);
 
   /* Now merge in the data from each of the subkeys.  */
@@ -3933,6 +4191,16 @@ lookup (ctrl_t ctrl, getkey_ctx_t ctx, int want_secret,
   else if (gpg_err_code (rc) == GPG_ERR_NOT_FOUND)
     rc = want_secret? GPG_ERR_NO_SECKEY : GPG_ERR_NO_PUBKEY;
 
+  if (!rc)
+    getkey_stats.lookup_okay++;
+  else if (gpg_err_code (rc) == GPG_ERR_NO_SECKEY
+           || gpg_err_code (rc) == GPG_ERR_NO_PUBKEY
+           || gpg_err_code (rc) == GPG_ERR_UNUSABLE_SECKEY
+           || gpg_err_code (rc) == GPG_ERR_UNUSABLE_PUBKEY)
+    getkey_stats.lookup_nokey++;
+  else
+    getkey_stats.lookup_error++;
+
   release_kbnode (keyblock);
 
   if (ret_found_key)
@@ -4186,7 +4454,6 @@ get_user_id_string (ctrl_t ctrl, u32 * keyid, int mode, size_t *r_len,
                     int *r_nouid)
 {
   user_id_db_t r;
-  keyid_list_t a;
   int pass = 0;
   char *p;
 
@@ -4196,39 +4463,34 @@ get_user_id_string (ctrl_t ctrl, u32 * keyid, int mode, size_t *r_len,
   /* Try it two times; second pass reads from the database.  */
   do
     {
-      for (r = user_id_db; r; r = r->next)
-	{
-	  for (a = r->keyids; a; a = a->next)
-	    {
-	      if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
-		{
-                  if (mode == 2)
-                    {
-                      /* An empty string as user id is possible.  Make
-                         sure that the malloc allocates one byte and
-                         does not bail out.  */
-                      p = xmalloc (r->len? r->len : 1);
-                      memcpy (p, r->name, r->len);
-                      if (r_len)
-                        *r_len = r->len;
-                    }
-                  else
-                    {
-                      if (mode)
-                        p = xasprintf ("%08lX%08lX %.*s",
-                                       (ulong) keyid[0], (ulong) keyid[1],
-                                       r->len, r->name);
-                      else
-                        p = xasprintf ("%s %.*s", keystr (keyid),
-                                       r->len, r->name);
-                      if (r_len)
-                        *r_len = strlen (p);
-                    }
+      r = uid_cache_lookup_kid (keyid);
+      if (r)
+        {
+          if (mode == 2)
+            {
+              /* An empty string as user id is possible.  Make
+                 sure that the malloc allocates one byte and
+                 does not bail out.  */
+              p = xmalloc (r->len? r->len : 1);
+              memcpy (p, r->name, r->len);
+              if (r_len)
+                *r_len = r->len;
+            }
+          else
+            {
+              if (mode)
+                p = xasprintf ("%08lX%08lX %.*s",
+                               (ulong) keyid[0], (ulong) keyid[1],
+                               r->len, r->name);
+              else
+                p = xasprintf ("%s %.*s", keystr (keyid),
+                               r->len, r->name);
+              if (r_len)
+                *r_len = strlen (p);
+            }
 
-                  return p;
-		}
-	    }
-	}
+          return p;
+        }
     }
   while (++pass < 2 && !get_pubkey (ctrl, NULL, keyid));
 
@@ -4299,23 +4561,16 @@ get_user_id_byfpr (ctrl_t ctrl, const byte *fpr, size_t *rn)
   /* Try it two times; second pass reads from the database.  */
   do
     {
-      for (r = user_id_db; r; r = r->next)
-	{
-	  keyid_list_t a;
-	  for (a = r->keyids; a; a = a->next)
-	    {
-	      if (!memcmp (a->fpr, fpr, MAX_FINGERPRINT_LEN))
-		{
-                  /* An empty string as user id is possible.  Make
-                     sure that the malloc allocates one byte and does
-                     not bail out.  */
-		  p = xmalloc (r->len? r->len : 1);
-		  memcpy (p, r->name, r->len);
-		  *rn = r->len;
-		  return p;
-		}
-	    }
-	}
+      r = uid_cache_lookup_fpr ((const char *)fpr);
+      if (r)
+        {
+          /* An empty string as user id is possible.  Make sure that
+             the malloc allocates one byte and does not bail out.  */
+          p = xmalloc (r->len? r->len : 1);
+          memcpy (p, r->name, r->len);
+          *rn = r->len;
+          return p;
+        }
     }
   while (++pass < 2
 	 && !get_pubkey_byfprint (ctrl, NULL, NULL, fpr, MAX_FINGERPRINT_LEN));
@@ -106,6 +106,17 @@ enum cmd_and_opt_values
     oMaxOutput,
     oInputSizeHint,
     oChunkSize,
+    oAeadThreads,
+    oPubkeyEncThreads,
+    oCompressThreads,
+    oHashThreads,
+    oIOThreads,
+    oKeyCacheSize,
+    oTrustDBCacheSize,
+    oSigCheckThreads,
+    oStatsJSON,
+    oImportMaxSigs,
+    oDataFile,
     oSigNotation,
     oCertNotation,
     oShowNotation,
@@ -125,6 +136,8 @@ enum cmd_and_opt_values
     aLSignKey,
     aQuickSignKey,
     aQuickLSignKey,
+    aQuickSignKeys,
+    aQuickLSignKeys,
     aQuickAddUid,
     aQuickAddKey,
     aQuickRevUid,
@@ -228,6 +241,7 @@ enum cmd_and_opt_values
     oDebugAllowLargeChunks,
     oStatusFD,
     oStatusFile,
+    oStatusBuffered,
     oAttributeFD,
     oAttributeFile,
     oEmitVersion,
@@ -349,6 +363,7 @@ enum cmd_and_opt_values
     oIgnoreValidFrom,
     oIgnoreCrcError,
     oIgnoreMDCError,
+    oMmapSignedData,
     oShowSessionKey,
     oOverrideSessionKey,
     oOverrideSessionKeyFD,
@@ -484,6 +499,8 @@ static ARGPARSE_OPTS opts[] = {
               N_("quickly sign a key")),
   ARGPARSE_c (aQuickLSignKey, "quick-lsign-key",
               N_("quickly sign a key locally")),
+  ARGPARSE_c (aQuickSignKeys,  "quick-sign-keys", "@"),
+  ARGPARSE_c (aQuickLSignKeys, "quick-lsign-keys", "@"),
   ARGPARSE_c (aSignKey,  "sign-key"   ,N_("sign a key")),
   ARGPARSE_c (aLSignKey, "lsign-key"  ,N_("sign a key locally")),
   ARGPARSE_c (aEditKey,  "edit-key"   ,N_("sign or edit a key")),
@@ -595,6 +612,17 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_p_u (oMaxOutput, "max-output", "@"),
   ARGPARSE_s_s (oInputSizeHint, "input-size-hint", "@"),
   ARGPARSE_s_i (oChunkSize, "chunk-size", "@"),
+  ARGPARSE_s_i (oAeadThreads, "aead-threads", "@"),
+  ARGPARSE_s_i (oPubkeyEncThreads, "pubkey-enc-threads", "@"),
+  ARGPARSE_s_i (oCompressThreads, "compress-threads", "@"),
+  ARGPARSE_s_i (oHashThreads, "hash-threads", "@"),
+  ARGPARSE_s_n (oIOThreads, "io-threads", "@"),
+  ARGPARSE_s_i (oKeyCacheSize, "key-cache-size", "@"),
+  ARGPARSE_s_i (oTrustDBCacheSize, "trustdb-cache-size", "@"),
+  ARGPARSE_s_i (oSigCheckThreads, "sig-check-threads", "@"),
+  ARGPARSE_s_s (oStatsJSON, "stats-json", "@"),
+  ARGPARSE_s_i (oImportMaxSigs, "import-max-sigs", "@"),
+  ARGPARSE_s_s (oDataFile, "data-file", "@"),
 
   ARGPARSE_s_n (oVerbose, "verbose", N_("verbose")),
   ARGPARSE_s_n (oQuiet,	  "quiet",   "@"),
@@ -638,6 +666,7 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_u (oDebugAllowLargeChunks, "debug-allow-large-chunks", "@"),
   ARGPARSE_s_i (oStatusFD, "status-fd", "@"),
   ARGPARSE_s_s (oStatusFile, "status-file", "@"),
+  ARGPARSE_s_n (oStatusBuffered, "status-buffered", "@"),
   ARGPARSE_s_i (oAttributeFD, "attribute-fd", "@"),
   ARGPARSE_s_s (oAttributeFile, "attribute-file", "@"),
 
@@ -811,6 +840,7 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_n (oIgnoreValidFrom,    "ignore-valid-from", "@"),
   ARGPARSE_s_n (oIgnoreCrcError, "ignore-crc-error", "@"),
   ARGPARSE_s_n (oIgnoreMDCError, "ignore-mdc-error", "@"),
+  ARGPARSE_s_n (oMmapSignedData, "mmap-signed-data", "@"),
   ARGPARSE_s_n (oShowSessionKey, "show-session-key", "@"),
   ARGPARSE_s_s (oOverrideSessionKey, "override-session-key", "@"),
   ARGPARSE_s_i (oOverrideSessionKeyFD, "override-session-key-fd", "@"),
@@ -959,6 +989,9 @@ static int maybe_setuid = 1;
 static unsigned int opt_set_iobuf_size;
 static unsigned int opt_set_iobuf_size_used;
 
+/* The file given with --stats-json or NULL.  */
+static const char *stats_json_file;
+
 static char *build_list( const char *text, char letter,
 			 const char *(*mapf)(int), int (*chkf)(int) );
 static void set_cmd( enum cmd_and_opt_values *ret_cmd,
@@ -2337,6 +2370,7 @@ main (int argc, char **argv)
     char *pers_compress_list = NULL;
     int eyes_only=0;
     int multifile=0;
+    const char *data_file = NULL;
     int pwfd = -1;
     int ovrseskeyfd = -1;
     int fpr_maybe_cmd = 0; /* --fingerprint maybe a command.  */
@@ -2360,6 +2394,7 @@ main (int argc, char **argv)
        when adding any stuff between here and the call to
        secmem_init() somewhere after the option parsing. */
     early_system_init ();
+    stats_init ();
     gnupg_reopen_std (GPG_NAME);
     trap_unaligned ();
     gnupg_rl_initialize ();
@@ -2622,6 +2657,8 @@ main (int argc, char **argv)
 	  case aSign:
 	  case aQuickSignKey:
 	  case aQuickLSignKey:
+	  case aQuickSignKeys:
+	  case aQuickLSignKeys:
 	  case aSignKey:
 	  case aLSignKey:
 	  case aStore:
@@ -2692,6 +2729,50 @@ main (int argc, char **argv)
             opt.chunk_size = pargs.r.ret_int;
             break;
 
+          case oAeadThreads:
+            opt.aead_threads = pargs.r.ret_int;
+            break;
+
+          case oPubkeyEncThreads:
+            opt.pubkey_enc_threads = pargs.r.ret_int;
+            break;
+
+          case oCompressThreads:
+            opt.compress_threads = pargs.r.ret_int;
+            break;
+
+          case oHashThreads:
+            opt.hash_threads = pargs.r.ret_int;
+            break;
+
+          case oIOThreads:
+            opt.io_threads = 1;
+            break;
+
+          case oKeyCacheSize:
+            opt.key_cache_size = pargs.r.ret_int;
+            break;
+
+          case oTrustDBCacheSize:
+            opt.trustdb_cache_size = pargs.r.ret_int;
+            break;
+
+          case oSigCheckThreads:
+            opt.sig_check_threads = pargs.r.ret_int;
+            break;
+
+          case oStatsJSON:
+            stats_json_file = pargs.r.ret_str;
+            break;
+
+          case oImportMaxSigs:
+            opt.import_max_sigs = pargs.r.ret_int;
+            break;
+
+          case oDataFile:
+            data_file = pargs.r.ret_str;
+            break;
+
 	  case oQuiet: opt.quiet = 1; break;
 	  case oNoTTY: tty_no_terminal(1); break;
 	  case oDryRun: opt.dry_run = 1; break;
@@ -2774,6 +2855,9 @@ main (int argc, char **argv)
 	  case oStatusFile:
             set_status_fd ( open_info_file (pargs.r.ret_str, 1, 0) );
             break;
+	  case oStatusBuffered:
+            set_status_buffered ();
+            break;
 	  case oAttributeFD:
             set_attrib_fd ( translate_sys2libc_fd_int (pargs.r.ret_int, 1) );
             break;
@@ -3412,6 +3496,7 @@ main (int argc, char **argv)
 	  case oIgnoreValidFrom: opt.ignore_valid_from = 1; break;
 	  case oIgnoreCrcError: opt.ignore_crc_error = 1; break;
 	  case oIgnoreMDCError: opt.ignore_mdc_error = 1; break;
+	  case oMmapSignedData: opt.mmap_signed_data = 1; break;
 	  case oNoRandomSeedFile: use_random_seed = 0; break;
 
 	  case oAutoKeyRetrieve:
@@ -3902,6 +3987,32 @@ main (int argc, char **argv)
         opt.chunk_size = (allow_large_chunks? 62 : 27);
         log_info (_("chunk size invalid - using %d\n"), opt.chunk_size);
       }
+    if (opt.aead_threads < 0)
+      opt.aead_threads = 0;
+    else if (opt.aead_threads > 64)
+      opt.aead_threads = 64;
+    if (opt.pubkey_enc_threads < 0)
+      opt.pubkey_enc_threads = 0;
+    else if (opt.pubkey_enc_threads > 64)
+      opt.pubkey_enc_threads = 64;
+    if (opt.compress_threads < 0)
+      opt.compress_threads = 0;
+    else if (opt.compress_threads > 64)
+      opt.compress_threads = 64;
+    if (opt.hash_threads < 0)
+      opt.hash_threads = 0;
+    else if (opt.hash_threads > 64)
+      opt.hash_threads = 64;
+    if (opt.key_cache_size && opt.key_cache_size < 5)
+      opt.key_cache_size = 5;
+    if (opt.trustdb_cache_size && opt.trustdb_cache_size < 16)
+      opt.trustdb_cache_size = 16;
+    if (opt.sig_check_threads < 0)
+      opt.sig_check_threads = 0;
+    else if (opt.sig_check_threads > 64)
+      opt.sig_check_threads = 64;
+    if (opt.import_max_sigs < 0)
+      opt.import_max_sigs = 0;
 
     /* We don't support all possible commands with multifile yet */
     if(multifile)
@@ -4087,16 +4198,33 @@ main (int argc, char **argv)
     /* Add the keyrings, but not for some special commands.  We always
      * need to add the keyrings if we are running under SELinux, this
      * is so that the rings are added to the list of secured files.
-     * We do not add any keyring if --no-keyring has been used.  */
+     * We do not add any keyring if --no-keyring has been used.  In all
+     * other cases the keyrings are only opened (or created) when a
+     * command actually accesses the key database; thus commands like
+     * --print-md or --list-packets on signed data do not touch them.  */
     if (default_keyring >= 0
         && (ALWAYS_ADD_KEYRINGS
-            || (cmd != aDeArmor && cmd != aEnArmor && cmd != aGPGConfTest)))
+            || (cmd != aDeArmor && cmd != aEnArmor && cmd != aGPGConfTest
+                && cmd != aPrintMD && cmd != aPrintMDs && cmd != aGenRandom
+                && cmd != aPrimegen && cmd != aListConfig
+                && cmd != aListGcryptConfig)))
       {
 	if (!nrings || default_keyring > 0)  /* Add default ring. */
-	    keydb_add_resource ("pubring" EXTSEP_S GPGEXT_GPG,
-                                KEYDB_RESOURCE_FLAG_DEFAULT);
+          {
+            if (ALWAYS_ADD_KEYRINGS)
+              keydb_add_resource ("pubring" EXTSEP_S GPGEXT_GPG,
+                                  KEYDB_RESOURCE_FLAG_DEFAULT);
+            else
+              keydb_add_resource_lazy ("pubring" EXTSEP_S GPGEXT_GPG,
+                                       KEYDB_RESOURCE_FLAG_DEFAULT);
+          }
 	for (sl = nrings; sl; sl = sl->next )
-          keydb_add_resource (sl->d, sl->flags);
+          {
+            if (ALWAYS_ADD_KEYRINGS)
+              keydb_add_resource (sl->d, sl->flags);
+            else
+              keydb_add_resource_lazy (sl->d, sl->flags);
+          }
       }
     FREE_STRLIST(nrings);
 
@@ -4160,6 +4288,18 @@ main (int argc, char **argv)
                  gpg_strerror (rc));
 #endif /*!NO_TRUST_MODELS*/
 
+    if (DBG_CLOCK)
+      log_clock ("setup done");
+
+    if (stats_json_file)
+      {
+        stats_register ("keydb", keydb_stats_report);
+        stats_register ("getkey", getkey_stats_report);
+        stats_register ("sigcheck", sig_check_stats_report);
+        stats_register ("sigcache", sigcache_stats_report);
+        stats_register ("iobuf", iobuf_stats_report);
+      }
+
     switch (cmd)
       {
       case aStore:
@@ -4380,7 +4520,18 @@ main (int argc, char **argv)
 	break;
 
       case aVerify:
-	if (multifile)
+        /* Register all signatures in as few TOFU transactions as
+         * possible; this matters when verifying a large mbox.  */
+#ifdef USE_TOFU
+        tofu_begin_batch_update (ctrl);
+#endif
+	if (data_file)
+	  {
+	    if ((rc = verify_detached_signatures (ctrl, data_file,
+                                                  argc, argv)))
+	      log_error("verify signatures failed: %s\n", gpg_strerror (rc) );
+	  }
+	else if (multifile)
 	  {
 	    if ((rc = verify_files (ctrl, argc, argv)))
 	      log_error("verify files failed: %s\n", gpg_strerror (rc) );
@@ -4390,6 +4541,9 @@ main (int argc, char **argv)
 	    if ((rc = verify_signatures (ctrl, argc, argv)))
 	      log_error("verify signatures failed: %s\n", gpg_strerror (rc) );
 	  }
+#ifdef USE_TOFU
+        tofu_end_batch_update (ctrl);
+#endif
         if (rc)
           write_status_failure ("verify", rc);
 	break;
@@ -4425,6 +4579,33 @@ main (int argc, char **argv)
         }
 	break;
 
+      case aQuickSignKeys:
+      case aQuickLSignKeys:
+        {
+          char line[256];
+
+          sl = NULL;
+          if (argc)
+            {
+              for ( ; argc; argc--, argv++)
+                append_to_strlist (&sl, *argv);
+            }
+          else
+            {
+              /* Read the fingerprints from stdin, one per line.  */
+              while (es_fgets (line, sizeof line, es_stdin))
+                {
+                  trim_spaces (line);
+                  if (*line && *line != '#')
+                    append_to_strlist (&sl, line);
+                }
+            }
+          keyedit_quick_sign_keys (ctrl, sl, locusr,
+                                   (cmd == aQuickLSignKeys));
+          free_strlist (sl);
+        }
+	break;
+
       case aSignKey:
 	if( argc != 1 )
 	  wrong_args("--sign-key user-id");
@@ -4486,6 +4667,18 @@ main (int argc, char **argv)
            proper order :) */
 	for( ; argc; argc-- )
 	  add_to_strlist2( &sl, argv[argc-1], utf8_strings );
+        if (!sl && opt.batch)
+          {
+            char line[256];
+
+            /* Read the names from stdin, one per line.  */
+            while (es_fgets (line, sizeof line, es_stdin))
+              {
+                trim_spaces (line);
+                if (*line && *line != '#')
+                  append_to_strlist2 (&sl, line, utf8_strings);
+              }
+          }
 	delete_keys (ctrl, sl,
                      cmd==aDeleteSecretKeys, cmd==aDeleteSecretAndPublicKeys);
 	free_strlist(sl);
@@ -5204,11 +5397,15 @@ g10_exit( int rc )
    * status line. */
   if (rc)
     write_status_failure ("gpg-exit", gpg_error (GPG_ERR_GENERAL));
+  status_flush ();
 
   gcry_control (GCRYCTL_UPDATE_RANDOM_SEED_FILE);
   if (DBG_CLOCK)
     log_clock ("stop");
 
+  if (stats_json_file)
+    stats_write_json (stats_json_file);
+
   if ( (opt.debug & DBG_MEMSTAT_VALUE) )
     {
       keydb_dump_stats ();
@@ -5219,6 +5416,7 @@ g10_exit( int rc )
   if (opt.debug)
     gcry_control (GCRYCTL_DUMP_SECMEM_STATS );
 
+  sigcache_flush ();
   emergency_cleanup ();
 
   rc = rc? rc : log_get_errorcount(0)? 2 : g10_errors_seen? 1 : 0;
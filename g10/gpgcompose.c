@@ -21,10 +21,13 @@
 #include <errno.h>
 
 #include "gpg.h"
+#include "../common/init.h"
 #include "packet.h"
 #include "keydb.h"
 #include "main.h"
 #include "options.h"
+#include "pkglue.h"
+#include "../kbx/keybox.h"
 
 static int do_debug;
 #define debug(fmt, ...) \
@@ -497,6 +500,8 @@ static int signature (const char *option, int argc, char *argv[],
                       void *cookie);
 static int copy (const char *option, int argc, char *argv[],
                  void *cookie);
+static int synthetic_keyring (const char *option, int argc, char *argv[],
+                              void *cookie);
 
 static struct option major_options[] = {
   { "--user-id", user_id, "Create a user id packet." },
@@ -519,6 +524,8 @@ static struct option major_options[] = {
   { "--signature", signature, "Create a signature packet." },
   { "--onepass-sig", NULL, "Create a one-pass signature packet." },
   { "--copy", copy, "Copy the specified file." },
+  { "--synthetic-keyring", synthetic_keyring,
+    "Create a large keyring for scale tests." },
   { NULL, NULL,
     "To get more information about a given command, use:\n\n"
     "  $ gpgcompose --command --help to list a command's options."},
@@ -701,9 +708,11 @@ public_key (const char *option, int argc, char *argv[], void *cookie)
     log_fatal ("%s: key to extract public key parameters from not given",
                option);
 
-  /* Clear the keyid in case we updated one of the relevant fields
-     after accessing it.  */
+  /* Clear the keyid and the other cached values in case we updated
+     one of the relevant fields after accessing it.  */
   pk->keyid[0] = pk->keyid[1] = 0;
+  pk->fprlen = 0;
+  pk->flags.keygrip_valid = 0;
 
   err = build_packet (out, &components[c]);
   if (err)
@@ -2617,6 +2626,42 @@ encrypted_pop (const char *option, int argc, char *argv[], void *cookie)
   return processed;
 }
 
+/* Return the next value of the splitmix64 generator at STATE.  The
+   synthetic data does not need good random numbers but it must be
+   reproducible.  */
+static uint64_t
+synth_next (uint64_t *state)
+{
+  uint64_t z;
+
+  z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static void
+synth_fill (uint64_t *state, void *buffer, size_t length)
+{
+  unsigned char *p = buffer;
+  uint64_t v;
+  int i;
+
+  while (length)
+    {
+      v = synth_next (state);
+      for (i = 0; i < 8 && length; i ++, length --, v >>= 8)
+        *p++ = v;
+    }
+}
+
+/* Return a number in the range [0, N).  */
+static unsigned int
+synth_uniform (uint64_t *state, size_t n)
+{
+  return synth_next (state) % n;
+}
+
 struct data
 {
   int file;
@@ -2625,6 +2670,9 @@ struct data
     char *data;
     char *filename;
   };
+  /* If not 0, DATA is NULL and this many bytes of filler are
+     used.  */
+  size_t filler;
   struct data *next;
 };
 
@@ -2641,9 +2689,20 @@ add_value (const char *option, int argc, char *argv[], void *cookie)
 {
   struct datahead *dh = cookie;
   struct data *d = xmalloc_clear (sizeof (struct data));
+  char *tail;
 
   d->file = strcmp ("--file", option) == 0;
-  if (! d->file)
+  if (! d->file && strcmp ("--filler", option) == 0)
+    {
+      if (argc == 0)
+        log_fatal ("Usage: %s SIZE\n", option);
+
+      errno = 0;
+      d->filler = strtoul (argv[0], &tail, 0);
+      if (errno || (tail && *tail) || ! d->filler)
+        log_fatal ("Invalid value passed to %s (%s)\n", option, argv[0]);
+    }
+  else if (! d->file)
     log_assert (strcmp ("--value", option) == 0);
 
   if (argc == 0)
@@ -2663,7 +2722,7 @@ add_value (const char *option, int argc, char *argv[], void *cookie)
 
   if (d->file)
     d->filename = argv[0];
-  else
+  else if (! d->filler)
     d->data = argv[0];
 
   /* Append it.  */
@@ -2765,6 +2824,9 @@ static struct option literal_options[] = {
     "A string to store in the literal packet." },
   { "--file", add_value,
     "A file to copy into the literal packet." },
+  { "--filler", add_value,
+    "The number of bytes of reproducible pseudo-random data to store "
+    "in the literal packet." },
   { "--timestamp", literal_timestamp,
     "The literal packet's time stamp.  This defaults to the current time." },
   { "--mode", literal_mode,
@@ -2859,6 +2921,16 @@ literal (const char *option, int argc, char *argv[], void *cookie)
 
               pt->len += off;
             }
+          else if (data->filler)
+            {
+              if (data->filler > 0xffffffff - pt->len)
+                /* Too large for a length header.  */
+                {
+                  pt->len = 0;
+                  break;
+                }
+              pt->len += data->filler;
+            }
           else
             pt->len += strlen (data->data);
         }
@@ -2893,6 +2965,21 @@ literal (const char *option, int argc, char *argv[], void *cookie)
 
           iobuf_close (in);
         }
+      else if (data->filler)
+        {
+          uint64_t state = 0;
+          byte buffer[8192];
+          size_t left, n;
+
+          for (left = data->filler; left; left -= n)
+            {
+              n = left < sizeof buffer ? left : sizeof buffer;
+              synth_fill (&state, buffer, n);
+              err = iobuf_write (out, buffer, n);
+              if (err)
+                log_fatal ("Writing literal data: %s\n", gpg_strerror (err));
+            }
+        }
       else
         {
           err = iobuf_write (out, data->data, strlen (data->data));
@@ -2979,6 +3066,658 @@ copy (const char *option, int argc, char *argv[], void *cookie)
   return processed;
 }
 
+/* The synthetic keyring generator.  It creates large keyrings for
+   scale testing from a seed so that the same options always yield
+   the same output.  All primary keys are Ed25519 keys whose secret
+   is derived from the seed and the key's index; the subkeys are
+   Curve25519 keys with a random public value and no secret at all,
+   which is enough to encrypt to them.  */
+
+/* The creation time of the first key if --timestamp is not given
+   (2017-07-14).  Key N is created N seconds later.  */
+#define SYNTH_DEFAULT_TIMESTAMP 1500000000
+
+/* The maximum number of certifications of a key.  */
+#define SYNTH_MAX_CERTS 1000
+
+enum synth_graph
+  {
+    SYNTH_GRAPH_RANDOM,
+    SYNTH_GRAPH_CHAIN,
+    SYNTH_GRAPH_STAR,
+    SYNTH_GRAPH_SCALE_FREE
+  };
+
+struct synth_flood
+{
+  unsigned int key;    /* The index of the key to flood.  */
+  unsigned int count;  /* The number of signatures to add.  */
+};
+
+struct synthinfo
+{
+  unsigned int nkeys;
+  unsigned int nuids;
+  unsigned int nsubkeys;
+  unsigned int ncerts;
+  enum synth_graph graph;
+  struct synth_flood *floods;
+  unsigned int nfloods;
+  uint64_t seed;
+  u32 timestamp;
+  char *keybox;
+
+  /* The state of the generator.  */
+  uint64_t rng;
+  unsigned char (*q)[32];  /* The public values of all primary keys.  */
+  unsigned int *edges;     /* Issuers and targets of all certifications.  */
+  size_t nedges;
+  uint64_t nthrowaway;     /* The number of keys used for flooding.  */
+};
+
+/* A signing key.  */
+struct synth_signer
+{
+  unsigned char d[32];
+  unsigned char q[32];
+  PKT_public_key *pk;
+};
+
+
+static int
+synth_uint_arg (const char *option, int argc, char *argv[], void *cookie)
+{
+  struct synthinfo *si = cookie;
+  char *tail;
+  unsigned long v;
+
+  if (argc == 0)
+    log_fatal ("Usage: %s N\n", option);
+
+  errno = 0;
+  v = strtoul (argv[0], &tail, 0);
+  if (errno || (tail && *tail) || v > 0x7fffffff)
+    log_fatal ("Invalid value passed to %s (%s)\n", option, argv[0]);
+
+  if (strcmp (option, "--keys") == 0)
+    si->nkeys = v;
+  else if (strcmp (option, "--user-ids") == 0)
+    si->nuids = v;
+  else if (strcmp (option, "--subkeys") == 0)
+    si->nsubkeys = v;
+  else if (strcmp (option, "--certifications") == 0)
+    {
+      if (v > SYNTH_MAX_CERTS)
+        log_fatal ("%s: at most %d certifications are supported\n",
+                   option, SYNTH_MAX_CERTS);
+      si->ncerts = v;
+    }
+  else
+    log_fatal ("Cannot handle %s\n", option);
+
+  return 1;
+}
+
+static int
+synth_graph_arg (const char *option, int argc, char *argv[], void *cookie)
+{
+  struct synthinfo *si = cookie;
+
+  if (argc == 0)
+    log_fatal ("Usage: %s random|chain|star|scale-free\n", option);
+
+  if (strcmp (argv[0], "random") == 0)
+    si->graph = SYNTH_GRAPH_RANDOM;
+  else if (strcmp (argv[0], "chain") == 0)
+    si->graph = SYNTH_GRAPH_CHAIN;
+  else if (strcmp (argv[0], "star") == 0)
+    si->graph = SYNTH_GRAPH_STAR;
+  else if (strcmp (argv[0], "scale-free") == 0)
+    si->graph = SYNTH_GRAPH_SCALE_FREE;
+  else
+    log_fatal ("%s: unknown graph '%s'\n", option, argv[0]);
+
+  return 1;
+}
+
+static int
+synth_flood_arg (const char *option, int argc, char *argv[], void *cookie)
+{
+  struct synthinfo *si = cookie;
+  struct synth_flood *flood;
+  char *tail1, *tail2;
+  unsigned long key, count;
+
+  if (argc < 2)
+    log_fatal ("Usage: %s KEY COUNT\n", option);
+
+  errno = 0;
+  key = strtoul (argv[0], &tail1, 0);
+  count = strtoul (argv[1], &tail2, 0);
+  if (errno || (tail1 && *tail1) || (tail2 && *tail2)
+      || key > 0x7fffffff || count > 0x7fffffff)
+    log_fatal ("Invalid value passed to %s (%s %s)\n",
+               option, argv[0], argv[1]);
+
+  si->floods = xrealloc (si->floods,
+                         (si->nfloods + 1) * sizeof *si->floods);
+  flood = &si->floods[si->nfloods ++];
+  flood->key = key;
+  flood->count = count;
+
+  return 2;
+}
+
+static int
+synth_seed (const char *option, int argc, char *argv[], void *cookie)
+{
+  struct synthinfo *si = cookie;
+  char *tail;
+
+  if (argc == 0)
+    log_fatal ("Usage: %s SEED\n", option);
+
+  errno = 0;
+  si->seed = strtoull (argv[0], &tail, 0);
+  if (errno || (tail && *tail))
+    log_fatal ("Invalid value passed to %s (%s)\n", option, argv[0]);
+
+  return 1;
+}
+
+static int
+synth_timestamp (const char *option, int argc, char *argv[], void *cookie)
+{
+  struct synthinfo *si = cookie;
+  char *tail = NULL;
+
+  if (argc == 0)
+    log_fatal ("Usage: %s TIMESTAMP\n", option);
+
+  errno = 0;
+  si->timestamp = parse_timestamp (argv[0], &tail);
+  if (errno || (tail && *tail))
+    log_fatal ("Invalid value passed to %s (%s)\n", option, argv[0]);
+
+  return 1;
+}
+
+static int
+synth_keybox (const char *option, int argc, char *argv[], void *cookie)
+{
+  struct synthinfo *si = cookie;
+
+  if (argc == 0)
+    log_fatal ("Usage: %s FILE\n", option);
+
+  si->keybox = argv[0];
+
+  return 1;
+}
+
+static struct option synth_options[] = {
+  { "--keys", synth_uint_arg,
+    "The number of keys to create (default: 1000)." },
+  { "--user-ids", synth_uint_arg,
+    "The number of user ids of each key (default: 1)." },
+  { "--subkeys", synth_uint_arg,
+    "The number of encryption subkeys of each key (default: 1)." },
+  { "--certifications", synth_uint_arg,
+    "The number of certifications of the first user id of each key "
+    "by other keys of the keyring (default: 0)." },
+  { "--graph", synth_graph_arg,
+    "The shape of the web of trust formed by the certifications: "
+    "'random' (default) picks the issuers uniformly from the keys "
+    "created before, 'chain' uses the immediately preceding keys, "
+    "'star' lets the first keys certify all others and 'scale-free' "
+    "prefers keys which already have many certifications." },
+  { "--flood", synth_flood_arg,
+    "Takes two arguments: the index of a key and a number of "
+    "signatures from keys not in the keyring to add to its first "
+    "user id.  May be given several times." },
+  { "--seed", synth_seed,
+    "The seed for the generator (default: 0)." },
+  { "--timestamp", synth_timestamp,
+    "The creation time of the first key.  " TIMESTAMP_HELP },
+  { "--keybox", synth_keybox,
+    "Write the keys to a new keybox FILE instead of writing a keyring "
+    "to the output." },
+  { NULL, NULL,
+    "Example:\n\n"
+    "  $ gpgcompose --synthetic-keyring --keys 100000 --user-ids 2 \\\n"
+    "  --certifications 5 --graph scale-free --seed 42 --keybox x.kbx" }
+};
+
+
+/* Build the public key packet from the Ed25519 public value Q.  */
+static PKT_public_key *
+synth_primary_pk (const unsigned char *q, u32 timestamp)
+{
+  PKT_public_key *pk;
+  byte buf[33];
+  gpg_error_t err;
+
+  pk = xmalloc_clear (sizeof *pk);
+  pk->version = 4;
+  pk->timestamp = timestamp;
+  pk->pubkey_algo = PUBKEY_ALGO_EDDSA;
+  err = openpgp_oid_from_str (openpgp_curve_to_oid ("Ed25519", NULL),
+                              &pk->pkey[0]);
+  if (err)
+    log_fatal ("creating the curve OID: %s\n", gpg_strerror (err));
+  buf[0] = 0x40;
+  memcpy (buf + 1, q, 32);
+  if (gcry_mpi_scan (&pk->pkey[1], GCRYMPI_FMT_USG, buf, sizeof buf, NULL))
+    BUG ();
+  return pk;
+}
+
+/* Build an encryption subkey with a random public value.  */
+static PKT_public_key *
+synth_subkey_pk (struct synthinfo *si, u32 timestamp)
+{
+  PKT_public_key *pk;
+  byte buf[33];
+  gpg_error_t err;
+
+  pk = xmalloc_clear (sizeof *pk);
+  pk->version = 4;
+  pk->timestamp = timestamp;
+  pk->pubkey_algo = PUBKEY_ALGO_ECDH;
+  err = openpgp_oid_from_str (openpgp_curve_to_oid ("Curve25519", NULL),
+                              &pk->pkey[0]);
+  if (err)
+    log_fatal ("creating the curve OID: %s\n", gpg_strerror (err));
+  buf[0] = 0x40;
+  synth_fill (&si->rng, buf + 1, 32);
+  if (gcry_mpi_scan (&pk->pkey[1], GCRYMPI_FMT_USG, buf, sizeof buf, NULL))
+    BUG ();
+  pk->pkey[2] = pk_ecdh_default_params (255);
+  if (!pk->pkey[2])
+    log_fatal ("creating the KDF parameters: %s\n",
+               gpg_strerror (gpg_error_from_syserror ()));
+  return pk;
+}
+
+/* Derive the secret key with the number IDX from the seed and store
+   it at D.  Throwaway keys for flooding use numbers which do not fit
+   into 32 bits.  */
+static void
+synth_secret (struct synthinfo *si, uint64_t idx, unsigned char *d)
+{
+  uint64_t state = si->seed ^ (idx * 0xd1b54a32d192ed03ULL);
+
+  synth_next (&state);
+  synth_fill (&state, d, 32);
+}
+
+/* Store the secret key IDX and its public value at SIGNER.  */
+static void
+synth_derive_key (struct synthinfo *si, uint64_t idx,
+                  struct synth_signer *signer)
+{
+  gcry_sexp_t s_skey, s_pkey, l;
+  gcry_ctx_t ctx;
+  const char *q;
+  size_t n;
+
+  synth_secret (si, idx, signer->d);
+
+  /* Libgcrypt computes the public key if the context has only D.  */
+  if (gcry_sexp_build (&s_skey, NULL,
+                       "(private-key(ecc(curve Ed25519)(flags eddsa)(d%b)))",
+                       32, signer->d)
+      || gcry_mpi_ec_new (&ctx, s_skey, NULL)
+      || gcry_pubkey_get_sexp (&s_pkey, GCRY_PK_GET_PUBKEY, ctx))
+    log_fatal ("computing the public key failed\n");
+  l = gcry_sexp_find_token (s_pkey, "q", 0);
+  q = l ? gcry_sexp_nth_data (l, 1, &n) : NULL;
+  if (!q || n != 32)
+    log_fatal ("computing the public key failed\n");
+  memcpy (signer->q, q, 32);
+  gcry_sexp_release (l);
+  gcry_sexp_release (s_pkey);
+  gcry_ctx_release (ctx);
+  gcry_sexp_release (s_skey);
+  signer->pk = NULL;
+}
+
+/* Load the primary key IDX of the keyring into SIGNER.  This is
+   faster than synth_derive_key because the public value has been
+   saved when the key was created.  */
+static void
+synth_load_signer (struct synthinfo *si, unsigned int idx,
+                   struct synth_signer *signer)
+{
+  synth_secret (si, idx, signer->d);
+  memcpy (signer->q, si->q[idx], 32);
+  signer->pk = synth_primary_pk (signer->q, si->timestamp + idx);
+}
+
+/* Create a signature of class SIGCLASS by SIGNER over PK and UID or
+   SUBPK.  KEYFLAGS are put into the signature if not 0; PRIMARY
+   requests the primary user id flag.  */
+static PKT_signature *
+synth_sign (struct synth_signer *signer,
+            PKT_public_key *pk, PKT_user_id *uid, PKT_public_key *subpk,
+            int sigclass, u32 timestamp, int keyflags, int primary)
+{
+  gpg_error_t err;
+  PKT_signature *sig;
+  gcry_md_hd_t md;
+  gcry_sexp_t s_skey, s_hash, s_sig;
+  byte buf[33];
+  const byte *dp;
+
+  sig = xmalloc_clear (sizeof *sig);
+  sig->version = 4;
+  sig->sig_class = sigclass;
+  sig->pubkey_algo = PUBKEY_ALGO_EDDSA;
+  sig->digest_algo = DIGEST_ALGO_SHA256;
+  sig->timestamp = timestamp;
+  sig->flags.exportable = 1;
+  sig->flags.revocable = 1;
+  keyid_from_pk (signer->pk, sig->keyid);
+
+  build_sig_subpkt_from_sig (sig, signer->pk);
+  if (keyflags)
+    {
+      buf[0] = keyflags;
+      build_sig_subpkt (sig, SIGSUBPKT_KEY_FLAGS, buf, 1);
+    }
+  if (primary)
+    {
+      buf[0] = 1;
+      build_sig_subpkt (sig, SIGSUBPKT_PRIMARY_UID, buf, 1);
+    }
+  if (sigclass == 0x13)
+    {
+      buf[0] = 0x01;  /* MDC */
+      build_sig_subpkt (sig, SIGSUBPKT_FEATURES, buf, 1);
+    }
+
+  if (gcry_md_open (&md, sig->digest_algo, 0))
+    BUG ();
+  hash_public_key (md, pk);
+  if (subpk)
+    hash_public_key (md, subpk);
+  else if (uid)
+    hash_uid (md, sig->version, uid);
+  hash_sigversion_to_magic (md, sig);
+  gcry_md_final (md);
+  dp = gcry_md_read (md, sig->digest_algo);
+  sig->digest_start[0] = dp[0];
+  sig->digest_start[1] = dp[1];
+
+  buf[0] = 0x40;
+  memcpy (buf + 1, signer->q, 32);
+  err = gcry_sexp_build (&s_skey, NULL,
+                         "(private-key(ecc(curve Ed25519)(flags eddsa)"
+                         "(q%b)(d%b)))", 33, buf, 32, signer->d);
+  if (!err)
+    {
+      err = gcry_sexp_build (&s_hash, NULL,
+                             "(data(flags eddsa)(hash-algo sha512)"
+                             "(value %b))", 32, dp);
+      if (!err)
+        {
+          err = gcry_pk_sign (&s_sig, s_hash, s_skey);
+          gcry_sexp_release (s_hash);
+        }
+      gcry_sexp_release (s_skey);
+    }
+  gcry_md_close (md);
+  if (err)
+    log_fatal ("signing failed: %s\n", gpg_strerror (err));
+
+  sig->data[0] = get_mpi_from_sexp (s_sig, "r", GCRYMPI_FMT_OPAQUE);
+  sig->data[1] = get_mpi_from_sexp (s_sig, "s", GCRYMPI_FMT_OPAQUE);
+  gcry_sexp_release (s_sig);
+  if (!sig->data[0] || !sig->data[1])
+    log_fatal ("signing failed: %s\n", "no signature value");
+
+  return sig;
+}
+
+/* Serialize the object OBJ of PKTTYPE to OUT.  */
+static void
+synth_write (iobuf_t out, int pkttype, void *obj)
+{
+  gpg_error_t err;
+  PACKET pkt;
+
+  pkt.pkttype = pkttype;
+  pkt.pkt.generic = obj;
+  err = build_packet (out, &pkt);
+  if (err)
+    log_fatal ("serializing a packet: %s\n", gpg_strerror (err));
+}
+
+static void
+synth_write_sig (iobuf_t out, PKT_signature *sig)
+{
+  synth_write (out, PKT_SIGNATURE, sig);
+  free_seckey_enc (sig);
+}
+
+/* Return the issuer of the certification number N of key IDX.  N is
+   less than IDX.  */
+static unsigned int
+synth_pick_issuer (struct synthinfo *si, unsigned int idx, unsigned int n)
+{
+  switch (si->graph)
+    {
+    case SYNTH_GRAPH_CHAIN:
+      return idx - 1 - n;
+    case SYNTH_GRAPH_STAR:
+      return n;
+    case SYNTH_GRAPH_SCALE_FREE:
+      /* Picking an end point of an existing certification chooses a
+         key with a probability proportional to the number of its
+         certifications.  */
+      if (si->nedges && synth_uniform (&si->rng, 2))
+        return si->edges[synth_uniform (&si->rng, si->nedges)];
+      /* fall through */
+    case SYNTH_GRAPH_RANDOM:
+    default:
+      return synth_uniform (&si->rng, idx);
+    }
+}
+
+/* Write the certifications of the user id UID of key IDX to OUT.  */
+static void
+synth_certify (struct synthinfo *si, iobuf_t out, unsigned int idx,
+               PKT_public_key *pk, PKT_user_id *uid)
+{
+  unsigned int issuers[SYNTH_MAX_CERTS];
+  unsigned int ncerts = si->ncerts < idx ? si->ncerts : idx;
+  unsigned int n, i, tries;
+  struct synth_signer signer;
+
+  for (n = 0; n < ncerts; n ++)
+    {
+      /* Try to avoid duplicate certifications.  */
+      for (tries = 0; tries < 8; tries ++)
+        {
+          issuers[n] = synth_pick_issuer (si, idx, n);
+          for (i = 0; i < n && issuers[i] != issuers[n]; i ++)
+            ;
+          if (i == n)
+            break;
+        }
+
+      synth_load_signer (si, issuers[n], &signer);
+      synth_write_sig (out, synth_sign (&signer, pk, uid, NULL, 0x10,
+                                        si->timestamp + idx + 1, 0, 0));
+      free_public_key (signer.pk);
+    }
+
+  if (si->graph == SYNTH_GRAPH_SCALE_FREE)
+    for (n = 0; n < ncerts; n ++)
+      {
+        si->edges[si->nedges ++] = issuers[n];
+        si->edges[si->nedges ++] = idx;
+      }
+}
+
+/* Write the flooding signatures of the user id UID of key IDX to
+   OUT.  */
+static void
+synth_flood_uid (struct synthinfo *si, iobuf_t out, unsigned int idx,
+                 PKT_public_key *pk, PKT_user_id *uid)
+{
+  struct synth_signer signer;
+  unsigned int i, n;
+
+  for (i = 0; i < si->nfloods; i ++)
+    if (si->floods[i].key == idx)
+      for (n = 0; n < si->floods[i].count; n ++)
+        {
+          synth_derive_key (si, (((uint64_t)1) << 32) + si->nthrowaway,
+                            &signer);
+          signer.pk = synth_primary_pk (signer.q, si->timestamp + idx);
+          si->nthrowaway ++;
+          synth_write_sig (out, synth_sign (&signer, pk, uid, NULL, 0x10,
+                                            si->timestamp + idx + 1, 0, 0));
+          free_public_key (signer.pk);
+        }
+}
+
+/* Write the keyblock of key IDX to OUT.  */
+static void
+synth_keyblock (struct synthinfo *si, iobuf_t out, unsigned int idx)
+{
+  struct synth_signer self;
+  PKT_public_key *subpk;
+  PKT_user_id *uid;
+  char name[100];
+  unsigned int n;
+  u32 created = si->timestamp + idx;
+
+  synth_derive_key (si, idx, &self);
+  memcpy (si->q[idx], self.q, 32);
+  self.pk = synth_primary_pk (self.q, created);
+  synth_write (out, PKT_PUBLIC_KEY, self.pk);
+
+  for (n = 0; n < si->nuids; n ++)
+    {
+      if (n)
+        snprintf (name, sizeof name,
+                  "Synthetic Key %u (%u) <key%u.%u@example.org>",
+                  idx, n, idx, n);
+      else
+        snprintf (name, sizeof name,
+                  "Synthetic Key %u <key%u@example.org>", idx, idx);
+      uid = xmalloc_clear (sizeof *uid + strlen (name));
+      strcpy (uid->name, name);
+      uid->len = strlen (name);
+      uid->ref = 1;
+      synth_write (out, PKT_USER_ID, uid);
+
+      /* Certify and sign.  */
+      synth_write_sig (out, synth_sign (&self, self.pk, uid, NULL, 0x13,
+                                        created, 0x03, !n));
+      if (!n)
+        {
+          synth_certify (si, out, idx, self.pk, uid);
+          synth_flood_uid (si, out, idx, self.pk, uid);
+        }
+      free_user_id (uid);
+    }
+
+  for (n = 0; n < si->nsubkeys; n ++)
+    {
+      subpk = synth_subkey_pk (si, created);
+      synth_write (out, PKT_PUBLIC_SUBKEY, subpk);
+      /* Encrypt communications and storage.  */
+      synth_write_sig (out, synth_sign (&self, self.pk, NULL, subpk, 0x18,
+                                        created, 0x0c, 0));
+      free_public_key (subpk);
+    }
+
+  free_public_key (self.pk);
+}
+
+static int
+synthetic_keyring (const char *option, int argc, char *argv[], void *cookie)
+{
+  iobuf_t out = cookie;
+  gpg_error_t err;
+  struct synthinfo si;
+  int processed;
+  unsigned int idx;
+  size_t n;
+  iobuf_t a;
+  KEYBOX_HANDLE kbx = NULL;
+  void *token;
+  FILE *fp;
+
+  memset (&si, 0, sizeof (si));
+  si.nkeys = 1000;
+  si.nuids = 1;
+  si.nsubkeys = 1;
+  si.timestamp = SYNTH_DEFAULT_TIMESTAMP;
+
+  processed = process_options (option,
+                               major_options,
+                               synth_options, &si,
+                               global_options, NULL,
+                               argc, argv);
+
+  if (!si.nuids && (si.ncerts || si.nfloods))
+    log_fatal ("%s: certifications require a user id\n", option);
+
+  si.rng = si.seed;
+  si.q = xcalloc (si.nkeys? si.nkeys : 1, sizeof *si.q);
+  if (si.graph == SYNTH_GRAPH_SCALE_FREE && si.ncerts)
+    si.edges = xcalloc ((size_t)2 * si.nkeys, si.ncerts * sizeof *si.edges);
+
+  if (si.keybox)
+    {
+      /* Start with an empty keybox.  */
+      fp = fopen (si.keybox, "wb");
+      if (!fp)
+        log_fatal ("creating '%s': %s\n", si.keybox, strerror (errno));
+      err = _keybox_write_header_blob (fp, 1);
+      if (fclose (fp) && !err)
+        err = gpg_error_from_syserror ();
+      if (!err)
+        err = keybox_register_file (si.keybox, 0, &token);
+      if (!err && !(kbx = keybox_new_openpgp (token, 0)))
+        err = gpg_error_from_syserror ();
+      if (err)
+        log_fatal ("creating '%s': %s\n", si.keybox, gpg_strerror (err));
+    }
+
+  for (idx = 0; idx < si.nkeys; idx ++)
+    {
+      if (!kbx)
+        synth_keyblock (&si, out, idx);
+      else
+        {
+          a = iobuf_temp ();
+          synth_keyblock (&si, a, idx);
+          n = iobuf_get_temp_length (a);
+          err = keybox_insert_keyblock (kbx, iobuf_get_temp_buffer (a), n,
+                                        NULL);
+          iobuf_close (a);
+          if (err)
+            log_fatal ("writing key %u to '%s': %s\n",
+                       idx, si.keybox, gpg_strerror (err));
+        }
+
+      if (!((idx + 1) % 10000))
+        debug ("Wrote %u keys\n", idx + 1);
+    }
+
+  keybox_release (kbx);
+  xfree (si.edges);
+  xfree (si.q);
+  xfree (si.floods);
+
+  return processed;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -2988,6 +3727,9 @@ main (int argc, char *argv[])
   int processed;
   ctrl_t ctrl;
 
+  early_system_init ();
+  init_common_subsystems (&argc, &argv);
+
   opt.ignore_time_conflict = 1;
   /* Allow notations in the IETF space, for instance.  */
   opt.expert = 1;
@@ -65,6 +65,9 @@ enum cmd_and_opt_values {
   oHomedir,
   oWeakDigest,
   oEnableSpecialFilenames,
+  oFilesFrom,
+  oDataFile,
+  oMmapSignedData,
   oDebug,
   aTest
 };
@@ -88,6 +91,11 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_s (oWeakDigest, "weak-digest",
                 N_("|ALGO|reject signatures made with ALGO")),
   ARGPARSE_s_n (oEnableSpecialFilenames, "enable-special-filenames", "@"),
+  ARGPARSE_s_s (oFilesFrom, "files-from",
+                N_("|FILE|verify the signatures listed in FILE")),
+  ARGPARSE_s_s (oDataFile, "data-file",
+                N_("|FILE|verify the signatures against FILE")),
+  ARGPARSE_s_n (oMmapSignedData, "mmap-signed-data", "@"),
   ARGPARSE_s_s (oDebug, "debug", "@"),
 
   ARGPARSE_end ()
@@ -174,6 +182,8 @@ main( int argc, char **argv )
   strlist_t nrings = NULL;
   unsigned configlineno;
   ctrl_t ctrl;
+  const char *files_from = NULL;
+  const char *data_file = NULL;
 
   early_system_init ();
   set_strusage (my_strusage);
@@ -246,6 +256,9 @@ main( int argc, char **argv )
         case oEnableSpecialFilenames:
           enable_special_filenames ();
           break;
+        case oFilesFrom: files_from = pargs.r.ret_str; break;
+        case oDataFile: data_file = pargs.r.ret_str; break;
+        case oMmapSignedData: opt.mmap_signed_data = 1; break;
         default : pargs.err = ARGPARSE_PRINT_ERROR; break;
 	}
     }
@@ -268,7 +281,19 @@ main( int argc, char **argv )
 
   ctrl = xcalloc (1, sizeof *ctrl);
 
-  if ((rc = verify_signatures (ctrl, argc, argv)))
+  if (files_from)
+    {
+      if (argc)
+        log_error (_("no files may be given with --files-from\n"));
+      else
+        verify_signature_list (ctrl, files_from);
+    }
+  else if (data_file)
+    {
+      if ((rc = verify_detached_signatures (ctrl, data_file, argc, argv)))
+        log_error("verify signatures failed: %s\n", gpg_strerror (rc) );
+    }
+  else if ((rc = verify_signatures (ctrl, argc, argv)))
     log_error("verify signatures failed: %s\n", gpg_strerror (rc) );
 
   keydb_release (ctrl->cached_getkey_kdb);
@@ -498,6 +523,17 @@ get_session_key (ctrl_t ctrl, PKT_pubkey_enc *k, DEK *dek)
   return GPG_ERR_GENERAL;
 }
 
+/* Stub: */
+gpg_error_t
+get_session_key_from_list (ctrl_t ctrl, struct pubkey_enc_list *list,
+                           DEK *dek)
+{
+  (void)ctrl;
+  (void)list;
+  (void)dek;
+  return GPG_ERR_GENERAL;
+}
+
 /* Stub: */
 gpg_error_t
 get_override_session_key (DEK *dek, const char *string)
@@ -519,6 +555,74 @@ decrypt_data (ctrl_t ctrl, void *procctx, PKT_encrypted *ed, DEK *dek)
 }
 
 
+/* Stubs:
+ * gpgv does not write to the home directory and thus does not use a
+ * persistent signature cache.
+ */
+gpg_error_t
+sigcache_lookup (const byte *key)
+{
+  (void)key;
+  return gpg_error (GPG_ERR_NOT_FOUND);
+}
+
+void
+sigcache_store (const byte *key, gpg_error_t rc)
+{
+  (void)key;
+  (void)rc;
+}
+
+void
+sigcache_dump_stats (void)
+{
+}
+
+/* Stubs:
+ * No threads here; the signatures are checked without a workpool.
+ */
+gpg_error_t
+workpool_new (workpool_t *r_pool, int nthreads)
+{
+  (void)nthreads;
+  *r_pool = NULL;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+void
+workpool_release (workpool_t pool)
+{
+  (void)pool;
+}
+
+gpg_error_t
+workpool_get_shared (workpool_t *r_pool)
+{
+  *r_pool = NULL;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+int
+workpool_nthreads (workpool_t pool)
+{
+  (void)pool;
+  return 0;
+}
+
+void
+workpool_submit (workpool_t pool, workpool_job_t job)
+{
+  (void)pool;
+  (void)job;
+}
+
+void
+workpool_wait (workpool_t pool, workpool_job_t job)
+{
+  (void)pool;
+  (void)job;
+}
+
 /* Stub:
  * No interactive commands, so we don't need the helptexts
  */
@@ -76,6 +76,10 @@ struct import_stats_s
 /* A node flag used to temporary mark a node. */
 #define NODE_FLAG_A  8
 
+/* The number of keyblocks read ahead to check their self-signatures
+ * in parallel.  */
+#define IMPORT_BATCH_SIZE 128
+
 
 /* An object and a global instance to store selectors created from
  * --import-filter keep-uid=EXPR.
@@ -100,7 +104,7 @@ static int import (ctrl_t ctrl,
 		   unsigned char **fpr, size_t *fpr_len, unsigned int options,
 		   import_screener_t screener, void *screener_arg,
                    int origin, const char *url);
-static int read_block (IOBUF a, int with_meta,
+static int read_block (IOBUF a, unsigned int options,
                        PACKET **pending_pkt, kbnode_t *ret_root, int *r_v3keys);
 static void revocation_present (ctrl_t ctrl, kbnode_t keyblock);
 static gpg_error_t import_one (ctrl_t ctrl,
@@ -191,6 +195,9 @@ parse_import_options(char *str,unsigned int *options,int noisy)
       {"repair-keys", IMPORT_REPAIR_KEYS, NULL,
        N_("repair keys on import")},
 
+      {"self-sigs-only", IMPORT_SELF_SIGS_ONLY, NULL,
+       N_("drop all third-party signatures on import")},
+
       /* No description to avoid string change: Fixme for 2.3 */
       {"show-only", (IMPORT_SHOW | IMPORT_DRY_RUN), NULL,
        NULL},
@@ -245,9 +252,15 @@ parse_and_set_import_filter (const char *string)
   register_mem_cleanup_func (cleanup_import_globals);
 
   if (!strncmp (string, "keep-uid=", 9))
-    err = recsel_parse_expr (&import_filter.keep_uid, string+9);
+    {
+      err = recsel_parse_expr (&import_filter.keep_uid, string+9);
+      recsel_resolve (import_filter.keep_uid, impex_filter_propid);
+    }
   else if (!strncmp (string, "drop-sig=", 9))
-    err = recsel_parse_expr (&import_filter.drop_sig, string+9);
+    {
+      err = recsel_parse_expr (&import_filter.drop_sig, string+9);
+      recsel_resolve (import_filter.drop_sig, impex_filter_propid);
+    }
   else
     err = gpg_error (GPG_ERR_INV_NAME);
 
@@ -448,10 +461,15 @@ import_keys_internal (ctrl_t ctrl, iobuf_t inp, char **fnames, int nnames,
   int i;
   gpg_error_t err = 0;
   struct import_stats_s *stats = stats_handle;
+  int batch = 0;
 
   if (!stats)
     stats = import_new_stats_handle ();
 
+  /* Write all changes to the keyrings in one go.  */
+  if (!(options & IMPORT_DRY_RUN) && !opt.dry_run)
+    batch = !keydb_begin_batch ();
+
   if (inp)
     {
       err = import (ctrl, inp, "[stream]", stats, fpr, fpr_len, options,
@@ -493,6 +511,13 @@ import_keys_internal (ctrl_t ctrl, iobuf_t inp, char **fnames, int nnames,
 	}
     }
 
+  if (batch)
+    {
+      gpg_error_t err2 = keydb_commit_batch ();
+      if (err2 && !err)
+        err = err2;
+    }
+
   if (!stats_handle)
     {
       if ((options & (IMPORT_SHOW | IMPORT_DRY_RUN))
@@ -563,7 +588,10 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
                                 grasp the return semantics of
                                 read_block. */
   int rc = 0;
+  int read_rc = 0;
   int v3keys;
+  kbnode_t *batch;
+  int batchsize, nbatch, i;
 
   getkey_disable_caches ();
 
@@ -577,43 +605,87 @@ import (ctrl_t ctrl, IOBUF inp, const char* fname,struct import_stats_s *stats,
       release_armor_context (afx);
     }
 
-  while (!(rc = read_block (inp, !!(options & IMPORT_RESTORE),
-                            &pending_pkt, &keyblock, &v3keys)))
+  /* With several threads for signature checks we read a batch of
+   * keyblocks and check all their self-signatures at once; the
+   * keyblocks are then imported one after the other in the order they
+   * have been read.  The check of a keyblock affected by the PKS
+   * subkey bug needs to be done after its repair; thus we don't
+   * batch in this case.  */
+  if (opt.sig_check_threads > 1 && !opt.interactive
+      && !(options & IMPORT_REPAIR_PKS_SUBKEY_BUG))
+    batchsize = IMPORT_BATCH_SIZE;
+  else
+    batchsize = 1;
+  batch = xcalloc (batchsize, sizeof *batch);
+
+  for (;;)
     {
-      stats->v3keys += v3keys;
-      if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
-        rc = import_one (ctrl, keyblock,
-                         stats, fpr, fpr_len, options, 0, 0,
-                         screener, screener_arg, origin, url);
-      else if (keyblock->pkt->pkttype == PKT_SECRET_KEY)
-        rc = import_secret_one (ctrl, keyblock, stats,
-                                opt.batch, options, 0,
-                                screener, screener_arg);
-      else if (keyblock->pkt->pkttype == PKT_SIGNATURE
-               && IS_KEY_REV (keyblock->pkt->pkt.signature) )
-        rc = import_revoke_cert (ctrl, keyblock, options, stats);
-      else
+      nbatch = 0;
+      while (nbatch < batchsize
+             && !(read_rc = read_block (inp, options,
+                                        &pending_pkt, &keyblock, &v3keys)))
         {
-          log_info (_("skipping block of type %d\n"), keyblock->pkt->pkttype);
-	}
-      release_kbnode (keyblock);
+          stats->v3keys += v3keys;
+          batch[nbatch++] = keyblock;
+        }
+      if (nbatch > 1)
+        check_self_sigs_batch (batch, nbatch);
 
-      /* fixme: we should increment the not imported counter but
-         this does only make sense if we keep on going despite of
-         errors.  For now we do this only if the imported key is too
-         large. */
-      if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
-            && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
+      for (i=0; i < nbatch; i++)
         {
-          stats->not_imported++;
+          keyblock = batch[i];
+          batch[i] = NULL;
+          if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
+            rc = import_one (ctrl, keyblock,
+                             stats, fpr, fpr_len, options, 0, 0,
+                             screener, screener_arg, origin, url);
+          else if (keyblock->pkt->pkttype == PKT_SECRET_KEY)
+            rc = import_secret_one (ctrl, keyblock, stats,
+                                    opt.batch, options, 0,
+                                    screener, screener_arg);
+          else if (keyblock->pkt->pkttype == PKT_SIGNATURE
+                   && IS_KEY_REV (keyblock->pkt->pkt.signature) )
+            rc = import_revoke_cert (ctrl, keyblock, options, stats);
+          else
+            {
+              log_info (_("skipping block of type %d\n"),
+                        keyblock->pkt->pkttype);
+            }
+          release_kbnode (keyblock);
+
+          /* fixme: we should increment the not imported counter but
+             this does only make sense if we keep on going despite of
+             errors.  For now we do this only if the imported key is too
+             large. */
+          if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
+              && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
+            {
+              stats->not_imported++;
+              rc = 0;
+            }
+          else if (rc)
+            break;
+
+          if (!(++stats->count % 100) && !opt.quiet)
+            log_info (_("%lu keys processed so far\n"), stats->count );
         }
-      else if (rc)
-        break;
 
-      if (!(++stats->count % 100) && !opt.quiet)
-        log_info (_("%lu keys processed so far\n"), stats->count );
+      if (rc)
+        {
+          /* Release the keyblocks we did not process.  */
+          for (i++; i < nbatch; i++)
+            release_kbnode (batch[i]);
+          break;
+        }
+      if (read_rc)
+        {
+          stats->v3keys += v3keys;
+          rc = read_rc;
+          break;
+        }
     }
-  stats->v3keys += v3keys;
+  xfree (batch);
+
   if (rc == -1)
     rc = 0;
   else if (rc && gpg_err_code (rc) != GPG_ERR_INV_KEYRING)
@@ -774,7 +846,7 @@ valid_keyblock_packet (int pkttype)
  *         keyblocks.
  */
 static int
-read_block( IOBUF a, int with_meta,
+read_block( IOBUF a, unsigned int options,
             PACKET **pending_pkt, kbnode_t *ret_root, int *r_v3keys)
 {
   int rc;
@@ -782,9 +854,22 @@ read_block( IOBUF a, int with_meta,
   PACKET *pkt;
   kbnode_t root = NULL;
   int in_cert, in_v3key, skip_sigs;
+  int max_sigs;  /* Third-party signatures to keep or -1 for all.  */
+  int n_sigs, n_dropped;
+  u32 main_kid[2];
+  int have_kid;
 
   *r_v3keys = 0;
 
+  if ((options & IMPORT_SELF_SIGS_ONLY))
+    max_sigs = 0;
+  else if (opt.import_max_sigs > 0)
+    max_sigs = opt.import_max_sigs;
+  else
+    max_sigs = -1;
+  n_sigs = n_dropped = 0;
+  have_kid = 0;
+
   if (*pending_pkt)
     {
       root = new_kbnode( *pending_pkt );
@@ -797,7 +882,7 @@ read_block( IOBUF a, int with_meta,
   pkt = xmalloc (sizeof *pkt);
   init_packet (pkt);
   init_parse_packet (&parsectx, a);
-  if (!with_meta)
+  if (!(options & IMPORT_RESTORE))
     parsectx.skip_meta = 1;
   in_v3key = 0;
   skip_sigs = 0;
@@ -865,6 +950,37 @@ read_block( IOBUF a, int with_meta,
         }
       in_v3key = 0;
 
+      /* Drop third-party signatures beyond the limit right here and
+       * not after the keyblock has been read so that a key flooded
+       * with signatures is never held in memory.  Revocations are
+       * kept because they may have been issued by a designated
+       * revoker.  */
+      if (max_sigs >= 0 && root && pkt->pkttype == PKT_SIGNATURE
+          && (root->pkt->pkttype == PKT_PUBLIC_KEY
+              || root->pkt->pkttype == PKT_SECRET_KEY)
+          && !IS_KEY_REV (pkt->pkt.signature)
+          && !IS_SUBKEY_REV (pkt->pkt.signature))
+        {
+          PKT_signature *sig = pkt->pkt.signature;
+
+          if (!have_kid)
+            {
+              keyid_from_pk (root->pkt->pkt.public_key, main_kid);
+              have_kid = 1;
+            }
+          if (sig->keyid[0] != main_kid[0] || sig->keyid[1] != main_kid[1])
+            {
+              if (n_sigs >= max_sigs)
+                {
+                  n_dropped++;
+                  free_packet (pkt, &parsectx);
+                  init_packet (pkt);
+                  continue;
+                }
+              n_sigs++;
+            }
+        }
+
       if (!root && pkt->pkttype == PKT_SIGNATURE
           && IS_KEY_REV (pkt->pkt.signature) )
         {
@@ -933,6 +1049,10 @@ read_block( IOBUF a, int with_meta,
   if (rc == -1 && root )
     rc = 0;
 
+  if (n_dropped && opt.verbose)
+    log_info (_("key %s: %d third-party signatures dropped\n"),
+              keystr (main_kid), n_dropped);
+
   if (rc )
     release_kbnode( root );
   else
@@ -1234,9 +1354,71 @@ check_prefs (ctrl_t ctrl, kbnode_t keyblock)
 }
 
 
-/* Helper for apply_*_filter in import.c and export.c.  */
+/* The properties known to impex_filter_getval_id.  */
+enum impex_filter_props
+  {
+    IMPEX_PROP_UNKNOWN = 0,
+    IMPEX_PROP_UID,
+    IMPEX_PROP_MBOX,
+    IMPEX_PROP_PRIMARY,
+    IMPEX_PROP_EXPIRED,
+    IMPEX_PROP_REVOKED,
+    IMPEX_PROP_SIG_CREATED,
+    IMPEX_PROP_SIG_CREATED_D,
+    IMPEX_PROP_SIG_ALGO,
+    IMPEX_PROP_SIG_DIGEST_ALGO,
+    IMPEX_PROP_SECRET,
+    IMPEX_PROP_KEY_ALGO,
+    IMPEX_PROP_KEY_CREATED,
+    IMPEX_PROP_KEY_CREATED_D,
+    IMPEX_PROP_DISABLED,
+    IMPEX_PROP_USAGE
+  };
+
+static struct
+{
+  const char *name;
+  enum impex_filter_props id;
+} impex_filter_propnames[] =
+  {
+    { "uid",             IMPEX_PROP_UID },
+    { "mbox",            IMPEX_PROP_MBOX },
+    { "primary",         IMPEX_PROP_PRIMARY },
+    { "expired",         IMPEX_PROP_EXPIRED },
+    { "revoked",         IMPEX_PROP_REVOKED },
+    { "sig_created",     IMPEX_PROP_SIG_CREATED },
+    { "sig_created_d",   IMPEX_PROP_SIG_CREATED_D },
+    { "sig_algo",        IMPEX_PROP_SIG_ALGO },
+    { "sig_digest_algo", IMPEX_PROP_SIG_DIGEST_ALGO },
+    { "secret",          IMPEX_PROP_SECRET },
+    { "key_algo",        IMPEX_PROP_KEY_ALGO },
+    { "key_created",     IMPEX_PROP_KEY_CREATED },
+    { "key_created_d",   IMPEX_PROP_KEY_CREATED_D },
+    { "disabled",        IMPEX_PROP_DISABLED },
+    { "usage",           IMPEX_PROP_USAGE }
+  };
+
+
+/* Map the property name PROPNAME to the id used by
+ * impex_filter_getval_id.  Returns 0 for an unknown name.  This is
+ * used with recsel_resolve.  */
+int
+impex_filter_propid (const char *propname)
+{
+  int i;
+
+  for (i=0; i < DIM (impex_filter_propnames); i++)
+    if (!strcmp (propname, impex_filter_propnames[i].name))
+      return impex_filter_propnames[i].id;
+  return IMPEX_PROP_UNKNOWN;
+}
+
+
+/* Helper for apply_*_filter in import.c and export.c.  Return the
+ * value of the property with the id PROPID for the node in COOKIE or
+ * NULL if the node has no such property.  */
 const char *
-impex_filter_getval (void *cookie, const char *propname)
+impex_filter_getval_id (void *cookie, int propid)
 {
   /* FIXME: Malloc our static buffers and access them via PARM.  */
   struct impex_filter_parm_s *parm = cookie;
@@ -1252,60 +1434,60 @@ impex_filter_getval (void *cookie, const char *propname)
     {
       PKT_user_id *uid = node->pkt->pkt.user_id;
 
-      if (!strcmp (propname, "uid"))
-        result = uid->name;
-      else if (!strcmp (propname, "mbox"))
+      switch (propid)
         {
+        case IMPEX_PROP_UID:
+          result = uid->name;
+          break;
+        case IMPEX_PROP_MBOX:
           if (!uid->mbox)
             {
               uid->mbox = mailbox_from_userid (uid->name);
             }
           result = uid->mbox;
-        }
-      else if (!strcmp (propname, "primary"))
-        {
+          break;
+        case IMPEX_PROP_PRIMARY:
           result = uid->flags.primary? "1":"0";
-        }
-      else if (!strcmp (propname, "expired"))
-        {
+          break;
+        case IMPEX_PROP_EXPIRED:
           result = uid->flags.expired? "1":"0";
-        }
-      else if (!strcmp (propname, "revoked"))
-        {
+          break;
+        case IMPEX_PROP_REVOKED:
           result = uid->flags.revoked? "1":"0";
+          break;
+        default:
+          result = NULL;
+          break;
         }
-      else
-        result = NULL;
     }
   else if (node->pkt->pkttype == PKT_SIGNATURE)
     {
       PKT_signature *sig = node->pkt->pkt.signature;
 
-      if (!strcmp (propname, "sig_created"))
+      switch (propid)
         {
+        case IMPEX_PROP_SIG_CREATED:
           snprintf (numbuf, sizeof numbuf, "%lu", (ulong)sig->timestamp);
           result = numbuf;
-        }
-      else if (!strcmp (propname, "sig_created_d"))
-        {
+          break;
+        case IMPEX_PROP_SIG_CREATED_D:
           result = datestr_from_sig (sig);
-        }
-      else if (!strcmp (propname, "sig_algo"))
-        {
+          break;
+        case IMPEX_PROP_SIG_ALGO:
           snprintf (numbuf, sizeof numbuf, "%d", sig->pubkey_algo);
           result = numbuf;
-        }
-      else if (!strcmp (propname, "sig_digest_algo"))
-        {
+          break;
+        case IMPEX_PROP_SIG_DIGEST_ALGO:
           snprintf (numbuf, sizeof numbuf, "%d", sig->digest_algo);
           result = numbuf;
-        }
-      else if (!strcmp (propname, "expired"))
-        {
+          break;
+        case IMPEX_PROP_EXPIRED:
           result = sig->flags.expired? "1":"0";
+          break;
+        default:
+          result = NULL;
+          break;
         }
-      else
-        result = NULL;
     }
   else if (node->pkt->pkttype == PKT_PUBLIC_KEY
            || node->pkt->pkttype == PKT_SECRET_KEY
@@ -1314,39 +1496,33 @@ impex_filter_getval (void *cookie, const char *propname)
     {
       PKT_public_key *pk = node->pkt->pkt.public_key;
 
-      if (!strcmp (propname, "secret"))
+      switch (propid)
         {
+        case IMPEX_PROP_SECRET:
           result = (node->pkt->pkttype == PKT_SECRET_KEY
                     || node->pkt->pkttype == PKT_SECRET_SUBKEY)? "1":"0";
-        }
-      else if (!strcmp (propname, "key_algo"))
-        {
+          break;
+        case IMPEX_PROP_KEY_ALGO:
           snprintf (numbuf, sizeof numbuf, "%d", pk->pubkey_algo);
           result = numbuf;
-        }
-      else if (!strcmp (propname, "key_created"))
-        {
+          break;
+        case IMPEX_PROP_KEY_CREATED:
           snprintf (numbuf, sizeof numbuf, "%lu", (ulong)pk->timestamp);
           result = numbuf;
-        }
-      else if (!strcmp (propname, "key_created_d"))
-        {
+          break;
+        case IMPEX_PROP_KEY_CREATED_D:
           result = datestr_from_pk (pk);
-        }
-      else if (!strcmp (propname, "expired"))
-        {
+          break;
+        case IMPEX_PROP_EXPIRED:
           result = pk->has_expired? "1":"0";
-        }
-      else if (!strcmp (propname, "revoked"))
-        {
+          break;
+        case IMPEX_PROP_REVOKED:
           result = pk->flags.revoked? "1":"0";
-        }
-      else if (!strcmp (propname, "disabled"))
-        {
+          break;
+        case IMPEX_PROP_DISABLED:
           result = pk_is_disabled (pk)? "1":"0";
-        }
-      else if (!strcmp (propname, "usage"))
-        {
+          break;
+        case IMPEX_PROP_USAGE:
           snprintf (numbuf, sizeof numbuf, "%s%s%s%s%s",
                     (pk->pubkey_usage & PUBKEY_USAGE_ENC)?"e":"",
                     (pk->pubkey_usage & PUBKEY_USAGE_SIG)?"s":"",
@@ -1354,9 +1530,11 @@ impex_filter_getval (void *cookie, const char *propname)
                     (pk->pubkey_usage & PUBKEY_USAGE_AUTH)?"a":"",
                     (pk->pubkey_usage & PUBKEY_USAGE_UNKNOWN)?"?":"");
           result = numbuf;
+          break;
+        default:
+          result = NULL;
+          break;
         }
-      else
-        result = NULL;
     }
   else
     result = NULL;
@@ -1383,7 +1561,7 @@ apply_keep_uid_filter (ctrl_t ctrl, kbnode_t keyblock, recsel_expr_t selector)
       if (node->pkt->pkttype == PKT_USER_ID)
         {
           parm.node = node;
-          if (!recsel_select (selector, impex_filter_getval, &parm))
+          if (!recsel_select_id (selector, impex_filter_getval_id, &parm))
             {
 
               /* log_debug ("keep-uid: deleting '%s'\n", */
@@ -1446,7 +1624,7 @@ apply_drop_sig_filter (ctrl_t ctrl, kbnode_t keyblock, recsel_expr_t selector)
       if (IS_UID_SIG(sig) || IS_UID_REV(sig))
         {
           parm.node = node;
-          if (recsel_select (selector, impex_filter_getval, &parm))
+          if (recsel_select_id (selector, impex_filter_getval_id, &parm))
             delete_kbnode (node);
         }
     }
@@ -1943,7 +2121,7 @@ import_one (ctrl_t ctrl,
 
           clear_ownertrusts (ctrl, pk);
           if (non_self)
-            revalidation_mark (ctrl);
+            revalidation_mark_key (ctrl, pk);
         }
 
       /* Release the handle and thus unlock the keyring asap.  */
@@ -2030,7 +2208,7 @@ import_one (ctrl_t ctrl,
             log_error (_("error writing keyring '%s': %s\n"),
                        keydb_get_resource_name (hd), gpg_strerror (err));
           else if (non_self)
-            revalidation_mark (ctrl);
+            revalidation_mark_key (ctrl, pk);
 
           /* Release the handle and thus unlock the keyring asap.  */
           keydb_release (hd);
@@ -2084,13 +2262,24 @@ import_one (ctrl_t ctrl,
 	}
       else
         {
+          /* We track the time we last checked a key for updates only
+           * for a limited refresh because this requires to rewrite
+           * even the keys which have no changes.  */
+          if ((options & IMPORT_MARK_REFRESHED) && origin == KEYORG_KS
+              && !(options & IMPORT_RESTORE))
+            {
+              err = update_key_origin (keyblock_orig, curtime, origin, url);
+              if (!err)
+                err = keydb_update_keyblock (ctrl, hd, keyblock_orig);
+              if (err)
+                log_error (_("error writing keyring '%s': %s\n"),
+                           keydb_get_resource_name (hd), gpg_strerror (err));
+            }
+
           /* Release the handle and thus unlock the keyring asap.  */
           keydb_release (hd);
           hd = NULL;
 
-          /* Fixme: we do not track the time we last checked a key for
-           * updates.  To do this we would need to rewrite even the
-           * keys which have no changes.  */
           same_key = 1;
           if (is_status_enabled ())
             print_import_ok (pk, 0);
@@ -3018,7 +3207,7 @@ import_revoke_cert (ctrl_t ctrl, kbnode_t node, unsigned int options,
       if (get_ownertrust (ctrl, pk) == TRUST_ULTIMATE)
         clear_ownertrusts (ctrl, pk);
 
-      revalidation_mark (ctrl);
+      revalidation_mark_key (ctrl, pk);
     }
   stats->n_revoc++;
 
@@ -3412,6 +3601,110 @@ any_uid_left (kbnode_t keyblock)
 
 
 
+/* A set of signature nodes used to detect duplicate signatures
+ * without comparing each signature with all others; flooded keys may
+ * carry tens of thousands of signatures on one user id.  The
+ * signatures are hashed over the keyid of the issuer, the creation
+ * time and the first two bytes of the digest; signatures with the
+ * same values are compared with cmp_signatures.  */
+struct sig_set_s
+{
+  unsigned int size;  /* Number of slots; a power of 2 or 0.  */
+  unsigned int used;  /* Number of used slots.  */
+  kbnode_t *slots;
+};
+typedef struct sig_set_s sig_set_t;
+
+
+static void
+sig_set_init (sig_set_t *set)
+{
+  set->size = set->used = 0;
+  set->slots = NULL;
+}
+
+
+static void
+sig_set_release (sig_set_t *set)
+{
+  xfree (set->slots);
+  sig_set_init (set);
+}
+
+
+static unsigned int
+sig_set_hash (PKT_signature *sig)
+{
+  unsigned int h;
+
+  h = sig->keyid[0];
+  h = h * 0x9e3779b1 ^ sig->keyid[1];
+  h = h * 0x9e3779b1 ^ sig->timestamp;
+  h = h * 0x9e3779b1 ^ ((sig->digest_start[0] << 8) | sig->digest_start[1]);
+  return h ^ (h >> 15);
+}
+
+
+/* Return the node of SET with a signature equal to SIG or NULL.  */
+static kbnode_t
+sig_set_find (sig_set_t *set, PKT_signature *sig)
+{
+  unsigned int i;
+  PKT_signature *s;
+
+  if (!set->size)
+    return NULL;
+
+  for (i = sig_set_hash (sig) & (set->size - 1);
+       set->slots[i];
+       i = (i + 1) & (set->size - 1))
+    {
+      s = set->slots[i]->pkt->pkt.signature;
+      if (s->keyid[0] == sig->keyid[0]
+          && s->keyid[1] == sig->keyid[1]
+          && s->timestamp == sig->timestamp
+          && s->digest_start[0] == sig->digest_start[0]
+          && s->digest_start[1] == sig->digest_start[1]
+          && !cmp_signatures (s, sig))
+        return set->slots[i];
+    }
+  return NULL;
+}
+
+
+/* Add the signature NODE to SET.  */
+static void
+sig_set_add (sig_set_t *set, kbnode_t node)
+{
+  unsigned int i;
+
+  log_assert (node->pkt->pkttype == PKT_SIGNATURE);
+
+  if ((set->used + 1) * 2 > set->size)
+    {
+      kbnode_t *old = set->slots;
+      unsigned int oldsize = set->size;
+      unsigned int j;
+
+      set->size = oldsize? oldsize * 2 : 64;
+      set->slots = xcalloc (set->size, sizeof *set->slots);
+      set->used = 0;
+      for (j=0; j < oldsize; j++)
+        if (old[j])
+          sig_set_add (set, old[j]);
+      xfree (old);
+    }
+
+  for (i = sig_set_hash (node->pkt->pkt.signature) & (set->size - 1);
+       set->slots[i];
+       i = (i + 1) & (set->size - 1))
+    ;
+  set->slots[i] = node;
+  set->used++;
+}
+
+
+
 /****************
  * It may happen that the imported keyblock has duplicated user IDs.
  * We check this here and collapse those user IDs together with their
@@ -3422,6 +3715,7 @@ int
 collapse_uids( kbnode_t *keyblock )
 {
   kbnode_t uid1;
+  sig_set_t sigset;
   int any=0;
 
   for(uid1=*keyblock;uid1;uid1=uid1->next)
@@ -3472,10 +3766,9 @@ collapse_uids( kbnode_t *keyblock )
 	      delete_kbnode(uid2);
 
 	      /* Now dedupe uid1 */
+	      sig_set_init (&sigset);
 	      for(sig1=uid1->next;sig1;sig1=sig1->next)
 		{
-		  kbnode_t sig2;
-
 		  if(is_deleted_kbnode(sig1))
 		    continue;
 
@@ -3487,29 +3780,16 @@ collapse_uids( kbnode_t *keyblock )
 		  if(sig1->pkt->pkttype!=PKT_SIGNATURE)
 		    continue;
 
-		  for(sig2=sig1->next,last=sig1;sig2;last=sig2,sig2=sig2->next)
+		  if (sig_set_find (&sigset, sig1->pkt->pkt.signature))
 		    {
-		      if(is_deleted_kbnode(sig2))
-			continue;
-
-		      if(sig2->pkt->pkttype==PKT_USER_ID
-			 || sig2->pkt->pkttype==PKT_PUBLIC_SUBKEY
-			 || sig2->pkt->pkttype==PKT_SECRET_SUBKEY)
-			break;
-
-		      if(sig2->pkt->pkttype!=PKT_SIGNATURE)
-			continue;
-
-		      if(cmp_signatures(sig1->pkt->pkt.signature,
-					sig2->pkt->pkt.signature)==0)
-			{
-			  /* We have a match, so delete the second
-			     signature */
-			  delete_kbnode(sig2);
-			  sig2=last;
-			}
+		      /* We have a match, so delete the later
+			 signature */
+		      delete_kbnode(sig1);
 		    }
+		  else
+		    sig_set_add (&sigset, sig1);
 		}
+	      sig_set_release (&sigset);
 	    }
 	}
     }
@@ -3638,9 +3918,19 @@ merge_blocks (ctrl_t ctrl, unsigned int options,
 	      int *n_uids, int *n_sigs, int *n_subk )
 {
   kbnode_t onode, node;
-  int rc, found;
+  sig_set_t sigset;
+  int rc;
 
   /* 1st: handle revocation certificates */
+  sig_set_init (&sigset);
+  for (onode=keyblock_orig->next; onode; onode=onode->next)
+    {
+      if (onode->pkt->pkttype == PKT_USER_ID )
+        break;
+      else if (onode->pkt->pkttype == PKT_SIGNATURE
+               && IS_KEY_REV (onode->pkt->pkt.signature))
+        sig_set_add (&sigset, onode);
+    }
   for (node=keyblock->next; node; node=node->next )
     {
       if (node->pkt->pkttype == PKT_USER_ID )
@@ -3649,24 +3939,11 @@ merge_blocks (ctrl_t ctrl, unsigned int options,
                && IS_KEY_REV (node->pkt->pkt.signature))
         {
           /* check whether we already have this */
-          found = 0;
-          for (onode=keyblock_orig->next; onode; onode=onode->next)
-            {
-              if (onode->pkt->pkttype == PKT_USER_ID )
-                break;
-              else if (onode->pkt->pkttype == PKT_SIGNATURE
-                       && IS_KEY_REV (onode->pkt->pkt.signature)
-                       && !cmp_signatures(onode->pkt->pkt.signature,
-                                          node->pkt->pkt.signature))
-                {
-                  found = 1;
-                  break;
-                }
-	    }
-          if (!found)
+          if (!sig_set_find (&sigset, node->pkt->pkt.signature))
             {
               kbnode_t n2 = clone_kbnode(node);
               insert_kbnode( keyblock_orig, n2, 0 );
+              sig_set_add (&sigset, n2);
               n2->flag |= NODE_FLAG_A;
               ++*n_sigs;
               if(!opt.quiet)
@@ -3680,7 +3957,17 @@ merge_blocks (ctrl_t ctrl, unsigned int options,
 	}
     }
 
+  sig_set_release (&sigset);
+
   /* 2nd: merge in any direct key (0x1F) sigs */
+  for (onode=keyblock_orig->next; onode; onode=onode->next)
+    {
+      if (onode->pkt->pkttype == PKT_USER_ID)
+        break;
+      else if (onode->pkt->pkttype == PKT_SIGNATURE
+               && IS_KEY_SIG (onode->pkt->pkt.signature))
+        sig_set_add (&sigset, onode);
+    }
   for(node=keyblock->next; node; node=node->next)
     {
       if (node->pkt->pkttype == PKT_USER_ID )
@@ -3689,24 +3976,11 @@ merge_blocks (ctrl_t ctrl, unsigned int options,
                && IS_KEY_SIG (node->pkt->pkt.signature))
         {
           /* check whether we already have this */
-          found = 0;
-          for (onode=keyblock_orig->next; onode; onode=onode->next)
-            {
-              if (onode->pkt->pkttype == PKT_USER_ID)
-                break;
-              else if (onode->pkt->pkttype == PKT_SIGNATURE
-                       && IS_KEY_SIG (onode->pkt->pkt.signature)
-                       && !cmp_signatures(onode->pkt->pkt.signature,
-                                          node->pkt->pkt.signature))
-                {
-                  found = 1;
-                  break;
-		}
-	    }
-          if (!found )
+          if (!sig_set_find (&sigset, node->pkt->pkt.signature))
             {
               kbnode_t n2 = clone_kbnode(node);
               insert_kbnode( keyblock_orig, n2, 0 );
+              sig_set_add (&sigset, n2);
               n2->flag |= NODE_FLAG_A;
               ++*n_sigs;
               if(!opt.quiet)
@@ -3715,6 +3989,7 @@ merge_blocks (ctrl_t ctrl, unsigned int options,
             }
 	}
     }
+  sig_set_release (&sigset);
 
   /* 3rd: try to merge new certificates in */
   for (onode=keyblock_orig->next; onode; onode=onode->next)
@@ -3896,11 +4171,16 @@ static int
 merge_sigs (kbnode_t dst, kbnode_t src, int *n_sigs)
 {
   kbnode_t n, n2;
-  int found = 0;
+  sig_set_t sigset;
 
   log_assert (dst->pkt->pkttype == PKT_USER_ID);
   log_assert (src->pkt->pkttype == PKT_USER_ID);
 
+  sig_set_init (&sigset);
+  for (n2=dst->next; n2 && n2->pkt->pkttype != PKT_USER_ID; n2 = n2->next)
+    if (n2->pkt->pkttype == PKT_SIGNATURE)
+      sig_set_add (&sigset, n2);
+
   for (n=src->next; n && n->pkt->pkttype != PKT_USER_ID; n = n->next)
     {
       if (n->pkt->pkttype != PKT_SIGNATURE )
@@ -3909,26 +4189,21 @@ merge_sigs (kbnode_t dst, kbnode_t src, int *n_sigs)
           || IS_SUBKEY_REV (n->pkt->pkt.signature) )
         continue; /* skip signatures which are only valid on subkeys */
 
-      found = 0;
-      for (n2=dst->next; n2 && n2->pkt->pkttype != PKT_USER_ID; n2 = n2->next)
-        if (!cmp_signatures(n->pkt->pkt.signature,n2->pkt->pkt.signature))
-          {
-            found++;
-            break;
-          }
-      if (!found )
+      if (!sig_set_find (&sigset, n->pkt->pkt.signature))
         {
           /* This signature is new or newer, append N to DST.
            * We add a clone to the original keyblock, because this
            * one is released first */
           n2 = clone_kbnode(n);
           insert_kbnode( dst, n2, PKT_SIGNATURE );
+          sig_set_add (&sigset, n2);
           n2->flag |= NODE_FLAG_A;
           n->flag |= NODE_FLAG_A;
           ++*n_sigs;
 	}
     }
 
+  sig_set_release (&sigset);
   return 0;
 }
 
@@ -0,0 +1,375 @@
+/* iothread.c - Reader and writer threads for the data pipeline
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* With --io-threads the input file of a decryption is read by a
+ * separate thread and the plaintext is written by another thread.  Both use a
+ * workpool with a single thread; because such a pool runs its jobs in
+ * the order they have been submitted, a job for each buffer of a
+ * small ring is all the synchronization we need.  The jobs only call
+ * read(2) or es_fwrite on an object not used by the main thread while
+ * the job is queued.  All the filters of the iobuf chain keep running
+ * in the main thread.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/iobuf.h"
+#include "options.h"
+#include "main.h"
+
+
+/* The number and size of the buffers of a reader or writer.  */
+#define IO_NSLOTS    4
+#define IO_SLOT_SIZE (64 * 1024)
+
+
+/* A buffer of the ring.  */
+struct io_slot_s
+{
+  struct workpool_job_s job;
+  int fd;              /* The fd to read from.  */
+  estream_t fp;        /* The stream to write to.  */
+  byte *buffer;
+  size_t len;          /* The number of valid bytes in BUFFER.  */
+  size_t off;          /* The number of bytes already consumed.  */
+  int err;             /* The errno of a failed read or write.  */
+  unsigned int busy:1; /* Set while the job is queued.  */
+};
+typedef struct io_slot_s *io_slot_t;
+
+
+/* The context of the reader and the writer.  */
+struct io_thread_s
+{
+  workpool_t pool;
+  unsigned int cur;    /* The slot currently used by the main thread.  */
+  int eof;             /* A read returned EOF or an error.  */
+  gpg_error_t err;     /* The first error of a writer.  */
+  struct io_slot_s slots[IO_NSLOTS];
+  unsigned char *mem;  /* Memory for all buffers.  */
+};
+typedef struct io_thread_s *io_thread_t;
+
+
+
+/* The job to fill a slot.  Runs without the nPth lock.  */
+static void
+read_slot_job (void *opaque)
+{
+  io_slot_t slot = opaque;
+  ssize_t n;
+
+  slot->off = 0;
+  slot->err = 0;
+  do
+    n = read (slot->fd, slot->buffer, IO_SLOT_SIZE);
+  while (n == -1 && errno == EINTR);
+  if (n == -1)
+    {
+      slot->err = errno;
+      slot->len = 0;
+    }
+  else
+    slot->len = n;
+}
+
+
+/* The job to write out a slot.  Runs without the nPth lock.  */
+static void
+write_slot_job (void *opaque)
+{
+  io_slot_t slot = opaque;
+
+  slot->err = 0;
+  if (es_fwrite (slot->buffer, 1, slot->len, slot->fp) != slot->len)
+    slot->err = errno? errno : EIO;
+  slot->len = 0;
+}
+
+
+static void
+submit_slot (io_thread_t io, io_slot_t slot)
+{
+  slot->busy = 1;
+  workpool_submit (io->pool, &slot->job);
+}
+
+
+static void
+wait_slot (io_thread_t io, io_slot_t slot)
+{
+  if (slot->busy)
+    {
+      workpool_wait (io->pool, &slot->job);
+      slot->busy = 0;
+    }
+}
+
+
+/* Wait for all jobs of IO and release it.  */
+static void
+release_io_thread (io_thread_t io)
+{
+  int i;
+
+  if (!io)
+    return;
+  for (i=0; i < IO_NSLOTS; i++)
+    wait_slot (io, io->slots + i);
+  workpool_release (io->pool);
+  xfree (io->mem);
+  xfree (io);
+}
+
+
+/* Create a new context with a thread for IO using FUNC as job.  */
+static gpg_error_t
+new_io_thread (io_thread_t *r_io, void (*func) (void *))
+{
+  gpg_error_t err;
+  io_thread_t io;
+  int i;
+
+  *r_io = NULL;
+  io = xtrycalloc (1, sizeof *io);
+  if (!io)
+    return gpg_error_from_syserror ();
+  io->mem = xtrymalloc (IO_NSLOTS * IO_SLOT_SIZE);
+  if (!io->mem)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (io);
+      return err;
+    }
+  err = workpool_new (&io->pool, 1);
+  if (err)
+    {
+      xfree (io->mem);
+      xfree (io);
+      return err;
+    }
+  for (i=0; i < IO_NSLOTS; i++)
+    {
+      io->slots[i].job.func = func;
+      io->slots[i].job.opaque = io->slots + i;
+      io->slots[i].buffer = io->mem + i * IO_SLOT_SIZE;
+    }
+
+  *r_io = io;
+  return 0;
+}
+
+
+
+/* The iobuf filter reading ahead from the fd of the file filter.  */
+static int
+read_ahead_filter (void *opaque, int control,
+                   iobuf_t chain, byte *buf, size_t *ret_len)
+{
+  io_thread_t io = opaque;
+  io_slot_t slot;
+  size_t n;
+  int rc = 0;
+
+  (void)chain;
+
+  if (control == IOBUFCTRL_UNDERFLOW)
+    {
+      n = 0;
+      while (!io->eof && n < *ret_len)
+        {
+          slot = io->slots + io->cur;
+          wait_slot (io, slot);
+          if (slot->err)
+            {
+              io->eof = 1;
+              if (!n)
+                {
+                  log_error ("read error: %s\n", strerror (slot->err));
+                  rc = gpg_error_from_errno (slot->err);
+                }
+              break;
+            }
+          if (!slot->len)
+            {
+              io->eof = 1;
+              break;
+            }
+          if (slot->len - slot->off > *ret_len - n)
+            {
+              memcpy (buf + n, slot->buffer + slot->off, *ret_len - n);
+              slot->off += *ret_len - n;
+              n = *ret_len;
+            }
+          else
+            {
+              memcpy (buf + n, slot->buffer + slot->off,
+                      slot->len - slot->off);
+              n += slot->len - slot->off;
+              /* Refill this slot and go to the next one.  */
+              submit_slot (io, slot);
+              io->cur = (io->cur + 1) % IO_NSLOTS;
+              /* Do not wait for more data if we have something.  */
+              if (io->slots[io->cur].busy)
+                break;
+            }
+        }
+      *ret_len = n;
+      if (!n && !rc)
+        rc = -1;  /* EOF */
+    }
+  else if (control == IOBUFCTRL_FREE)
+    release_io_thread (io);
+  else if (control == IOBUFCTRL_DESC)
+    mem2str ((char *)buf, "read_ahead_filter", *ret_len);
+
+  return rc;
+}
+
+
+/* Push a filter on A which reads the data in a separate thread.  A
+ * must have been opened by iobuf_open or iobuf_fdopen and no data
+ * may have been read from it yet; the filter reads directly from the
+ * file descriptor.  This is only done for regular files: On a pipe
+ * or socket a read ahead could block after the end of the message
+ * and closing A would then wait for it.  If the thread can't be
+ * started A is not changed.  */
+void
+push_read_ahead_filter (iobuf_t a)
+{
+  io_thread_t io;
+  int fd, i;
+  struct stat sb;
+
+#ifdef HAVE_W32_SYSTEM
+  /* The file filter uses a handle and not an fd.  */
+  (void)a;
+  return;
+#endif
+  fd = iobuf_get_fd (a);
+  if (fd == -1 || fstat (fd, &sb) || !S_ISREG (sb.st_mode))
+    return;
+  if (new_io_thread (&io, read_slot_job))
+    return;
+  for (i=0; i < IO_NSLOTS; i++)
+    {
+      io->slots[i].fd = fd;
+      submit_slot (io, io->slots + i);
+    }
+  if (iobuf_push_filter (a, read_ahead_filter, io))
+    release_io_thread (io);
+}
+
+
+
+/* Return a new writer for FP at R_WB.  On error NULL is stored and
+ * the caller shall write directly to FP.  */
+gpg_error_t
+write_behind_new (write_behind_t *r_wb, estream_t fp)
+{
+  gpg_error_t err;
+  io_thread_t io;
+  int i;
+
+  err = new_io_thread (&io, write_slot_job);
+  if (err)
+    {
+      *r_wb = NULL;
+      return err;
+    }
+  for (i=0; i < IO_NSLOTS; i++)
+    io->slots[i].fp = fp;
+  *r_wb = io;
+  return 0;
+}
+
+
+/* Queue DATA of LENGTH for writing.  An error of an earlier write is
+ * returned.  */
+gpg_error_t
+write_behind_write (write_behind_t wb, const void *data, size_t length)
+{
+  const byte *p = data;
+  io_slot_t slot;
+  size_t n;
+
+  while (length && !wb->err)
+    {
+      slot = wb->slots + wb->cur;
+      if (slot->busy)
+        {
+          wait_slot (wb, slot);
+          if (slot->err)
+            {
+              wb->err = gpg_error_from_errno (slot->err);
+              break;
+            }
+        }
+      n = IO_SLOT_SIZE - slot->len;
+      if (n > length)
+        n = length;
+      memcpy (slot->buffer + slot->len, p, n);
+      slot->len += n;
+      p += n;
+      length -= n;
+      if (slot->len == IO_SLOT_SIZE)
+        {
+          submit_slot (wb, slot);
+          wb->cur = (wb->cur + 1) % IO_NSLOTS;
+        }
+    }
+
+  return wb->err;
+}
+
+
+/* Write all pending data and release WB.  Returns the first error.  */
+gpg_error_t
+write_behind_close (write_behind_t wb)
+{
+  gpg_error_t err;
+  io_slot_t slot;
+  int i;
+
+  if (!wb)
+    return 0;
+
+  slot = wb->slots + wb->cur;
+  if (!wb->err && !slot->busy && slot->len)
+    submit_slot (wb, slot);
+  for (i=0; i < IO_NSLOTS; i++)
+    {
+      slot = wb->slots + i;
+      wait_slot (wb, slot);
+      if (slot->err && !wb->err)
+        wb->err = gpg_error_from_errno (slot->err);
+    }
+  err = wb->err;
+  release_io_thread (wb);
+  return err;
+}
@@ -31,19 +31,39 @@
 
 #define USE_UNUSED_NODES 1
 
+/* The nodes are carved from slabs of this many nodes.  Freed nodes go
+ * to a free list and are reused.  Keyblocks often have hundreds of
+ * nodes and this saves most of the calls to malloc and free when
+ * reading and releasing keyblocks.  A slab is not owned by a keyblock
+ * because nodes are frequently moved from one keyblock to another.  */
+#define NODES_PER_SLAB 256
+
+struct kbnode_slab_s
+{
+  struct kbnode_slab_s *next;
+  struct kbnode_struct nodes[NODES_PER_SLAB];
+};
+
 static int cleanup_registered;
 static KBNODE unused_nodes;
+static struct kbnode_slab_s *node_slabs;
+static unsigned int nodes_in_use;
 
 static void
 release_unused_nodes (void)
 {
 #if USE_UNUSED_NODES
-  while (unused_nodes)
+  struct kbnode_slab_s *slab;
+
+  /* The slabs can only be released if no node is in use.  */
+  if (nodes_in_use)
+    return;
+  while ((slab = node_slabs))
     {
-      kbnode_t next = unused_nodes->next;
-      xfree (unused_nodes);
-      unused_nodes = next;
+      node_slabs = slab->next;
+      xfree (slab);
     }
+  unused_nodes = NULL;
 #endif /*USE_UNUSED_NODES*/
 }
 
@@ -53,18 +73,32 @@ alloc_node (void)
 {
   kbnode_t n;
 
-  n = unused_nodes;
-  if (n)
-    unused_nodes = n->next;
-  else
+#if USE_UNUSED_NODES
+  if (!unused_nodes)
     {
+      struct kbnode_slab_s *slab;
+      int i;
+
       if (!cleanup_registered)
         {
           cleanup_registered = 1;
           register_mem_cleanup_func (release_unused_nodes);
         }
-      n = xmalloc (sizeof *n);
+      slab = xmalloc (sizeof *slab);
+      slab->next = node_slabs;
+      node_slabs = slab;
+      for (i=NODES_PER_SLAB-1; i >= 0; i--)
+        {
+          slab->nodes[i].next = unused_nodes;
+          unused_nodes = slab->nodes + i;
+        }
     }
+  n = unused_nodes;
+  unused_nodes = n->next;
+  nodes_in_use++;
+#else
+  n = xmalloc (sizeof *n);
+#endif /*USE_UNUSED_NODES*/
   n->next = NULL;
   n->pkt = NULL;
   n->flag = 0;
@@ -81,6 +115,7 @@ free_node( KBNODE n )
 #if USE_UNUSED_NODES
       n->next = unused_nodes;
       unused_nodes = n;
+      nodes_in_use--;
 #else
       xfree (n);
 #endif
@@ -118,7 +153,7 @@ release_kbnode( KBNODE n )
 	n2 = n->next;
 	if( !is_cloned_kbnode(n) ) {
             free_packet (n->pkt, NULL);
-            xfree( n->pkt );
+            release_packet_object (n->pkt);
 	}
 	free_node( n );
 	n = n2;
@@ -160,6 +160,8 @@ remove_duplicate_sigs (kbnode_t kb, int *dups, int *modified)
         }
       sig = n->pkt->pkt.signature;
       sig->help_counter = block;
+      /* The comparison needs the decoded MPIs.  */
+      parse_sig_data (sig);
       sigs[i++] = n;
     }
   log_assert (i == nsigs);
@@ -579,6 +581,8 @@ key_check_all_keysigs (ctrl_t ctrl, int mode, kbnode_t kb,
             {
               int i;
 
+              parse_sig_data (sig);
+
               for (i = 0; i < pubkey_get_nsig (sig->pubkey_algo); i ++)
                 {
                   char buffer[1024];
@@ -35,6 +35,33 @@
 #include "key-clean.h"
 
 
+/* An item of the list of certifications used by
+ * mark_usable_uid_certs.  */
+struct cert_item
+{
+  kbnode_t node;
+  size_t seqno;   /* The position in the keyblock.  */
+};
+
+
+/* qsort helper to sort cert_items by the keyid of the issuer and
+ * then by their position in the keyblock.  */
+static int
+cmp_cert_items (const void *a_arg, const void *b_arg)
+{
+  const struct cert_item *a = a_arg;
+  const struct cert_item *b = b_arg;
+  PKT_signature *asig = a->node->pkt->pkt.signature;
+  PKT_signature *bsig = b->node->pkt->pkt.signature;
+
+  if (asig->keyid[0] != bsig->keyid[0])
+    return asig->keyid[0] < bsig->keyid[0]? -1 : 1;
+  if (asig->keyid[1] != bsig->keyid[1])
+    return asig->keyid[1] < bsig->keyid[1]? -1 : 1;
+  return a->seqno < b->seqno? -1 : a->seqno > b->seqno;
+}
+
+
 /*
  * Mark the signature of the given UID which are used to certify it.
  * To do this, we first revmove all signatures which are not valid and
@@ -51,6 +78,8 @@ mark_usable_uid_certs (ctrl_t ctrl, kbnode_t keyblock, kbnode_t uidnode,
 {
   kbnode_t node;
   PKT_signature *sig;
+  struct cert_item *certs;
+  size_t ncerts, i, j;
 
   /* First check all signatures.  */
   for (node=uidnode->next; node; node = node->next)
@@ -91,44 +120,58 @@ mark_usable_uid_certs (ctrl_t ctrl, kbnode_t keyblock, kbnode_t uidnode,
     node->flag &= ~(1<<8 | 1<<9 | 1<<10 | 1<<11 | 1<<12);
 
   /* kbnode flag usage: bit 9 is here set for signatures to consider,
-   * bit 10 will be set by the loop to keep track of keyIDs already
-   * processed, bit 8 will be set for the usable signatures, and bit
-   * 11 will be set for usable revocations. */
+   * bit 8 will be set for the usable signatures, and bit 11 will be
+   * set for usable revocations. */
 
-  /* For each cert figure out the latest valid one.  */
+  /* Collect the signatures to consider and sort them by the keyID of
+   * the issuer.  Thus the signatures of one issuer are adjacent and
+   * we do not need to scan the list for each issuer.  */
+  ncerts = 0;
   for (node=uidnode->next; node; node = node->next)
     {
-      KBNODE n, signode;
-      u32 kid[2];
-      u32 sigdate;
-
       if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY
           || node->pkt->pkttype == PKT_SECRET_SUBKEY)
         break;
-      if ( !(node->flag & (1<<9)) )
-        continue; /* not a node to look at */
-      if ( (node->flag & (1<<10)) )
-        continue; /* signature with a keyID already processed */
-      node->flag |= (1<<10); /* mark this node as processed */
+      if ((node->flag & (1<<9)))
+        ncerts++;
+    }
+  if (!ncerts)
+    return;
+  certs = xmalloc (ncerts * sizeof *certs);
+  ncerts = 0;
+  for (node=uidnode->next; node; node = node->next)
+    {
+      if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+          || node->pkt->pkttype == PKT_SECRET_SUBKEY)
+        break;
+      if ((node->flag & (1<<9)))
+        {
+          certs[ncerts].node = node;
+          certs[ncerts].seqno = ncerts;
+          ncerts++;
+        }
+    }
+  qsort (certs, ncerts, sizeof *certs, cmp_cert_items);
+
+  /* For each cert figure out the latest valid one.  */
+  for (i=0; i < ncerts; i = j)
+    {
+      KBNODE n, signode;
+      u32 sigdate;
+
+      node = certs[i].node;
       sig = node->pkt->pkt.signature;
       signode = node;
       sigdate = sig->timestamp;
-      kid[0] = sig->keyid[0]; kid[1] = sig->keyid[1];
 
       /* Now find the latest and greatest signature */
-      for (n=uidnode->next; n; n = n->next)
+      for (j=i+1; j < ncerts; j++)
         {
-          if (n->pkt->pkttype == PKT_PUBLIC_SUBKEY
-              || n->pkt->pkttype == PKT_SECRET_SUBKEY)
-            break;
-          if ( !(n->flag & (1<<9)) )
-            continue;
-          if ( (n->flag & (1<<10)) )
-            continue; /* shortcut already processed signatures */
+          n = certs[j].node;
           sig = n->pkt->pkt.signature;
-          if (kid[0] != sig->keyid[0] || kid[1] != sig->keyid[1])
-            continue;
-          n->flag |= (1<<10); /* mark this node as processed */
+          if (node->pkt->pkt.signature->keyid[0] != sig->keyid[0]
+              || node->pkt->pkt.signature->keyid[1] != sig->keyid[1])
+            break;
 
 	  /* If signode is nonrevocable and unexpired and n isn't,
              then take signode (skip).  It doesn't matter which is
@@ -205,6 +248,8 @@ mark_usable_uid_certs (ctrl_t ctrl, kbnode_t keyblock, kbnode_t uidnode,
       else
 	signode->flag |= (1<<11);
     }
+
+  xfree (certs);
 }
 
 
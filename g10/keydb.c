@@ -36,6 +36,7 @@
 #include "../kbx/keybox.h"
 #include "keydb.h"
 #include "../common/i18n.h"
+#include "../common/tracepoint.h"
 
 static int active_handles;
 
@@ -55,11 +56,24 @@ struct resource_item
     KEYBOX_HANDLE kb;
   } u;
   void *token;
+  int shard_group;  /* 0 or the group of a sharded keybox.  */
+  int shard;        /* The number of the shard within that group.  */
 };
 
 static struct resource_item all_resources[MAX_KEYDB_RESOURCES];
 static int used_resources;
 
+/* A sharded keybox is a directory with KEYDB_NSHARDS keybox files
+   named "shard-X.kbx".  A keyblock is stored in the file given by
+   the low bits of its primary key's fingerprint, which are also the
+   low bits of its keyid.  Each file is registered as a separate
+   keybox resource and the files of one directory share the same
+   SHARD_GROUP.  Searches work as with any list of resources; the
+   advantage is that an insert, update or delete only locks and
+   rewrites one of the smaller files.  */
+#define KEYDB_NSHARDS 16
+static int last_shard_group;
+
 /* A pointer used to check for the primary key database by comparing
    to the struct resource_item's TOKEN.  */
 static void *primary_keydb;
@@ -67,6 +81,16 @@ static void *primary_keydb;
 /* Whether we have successfully registered any resource.  */
 static int any_registered;
 
+/* The resources given to keydb_add_resource_lazy which have not yet
+   been registered.  The flags of the resource are stored in the
+   flags of the list item.  */
+static strlist_t pending_resources;
+
+/* The handle holding the locks during a batch of changes and the
+   nesting level of keydb_begin_batch.  */
+static KEYDB_HANDLE batch_hd;
+static int batch_level;
+
 /* This is a simple cache used to return the last result of a
    successful fingerprint search.  This works only for keybox resources
    because (due to lack of a copy_keyblock function) we need to store
@@ -82,13 +106,87 @@ struct keyblock_cache {
   enum keyblock_cache_states state;
   byte fpr[MAX_FINGERPRINT_LEN];
   iobuf_t iobuf; /* Image of the keyblock.  */
+  u32 *sigstatus; /* The signature status from the keybox or NULL.  */
   int pk_no;
   int uid_no;
   /* Offset of the record in the keybox.  */
   int resource;
   off_t offset;
+  /* Offset of the start of the record if the result shall be put
+     into the keyblock LRU or -1.  */
+  off_t lru_offset;
+};
+
+
+/* In addition to the per-handle cache we keep a process wide cache
+   of keyblocks found by fingerprint.  This helps long running
+   processes like gpg in --server mode, which fetch the same keys
+   again and again.  For the reasons given above this is again
+   limited to keyboxes and stores the images of the keyblocks.  The
+   cache is a hash table with the items also linked into a list with
+   the most recently used item at the head.  If one of the limits
+   below is exceeded the least recently used item is removed.
+
+   Only the first result from the start of the database is cached.
+   On a hit we seek right to the record and do a new search there so
+   that the keybox has the same state as after a regular search; this
+   requires reading only that one record.
+
+   The cache is flushed when a keyblock is changed via this module or
+   when the size, modification time or inode of one of the resource
+   files changed.  */
+#define KEYBLOCK_LRU_BUCKETS      1024
+#define KEYBLOCK_LRU_MAX_ITEMS    4096
+#define KEYBLOCK_LRU_MAX_BYTES    (32*1024*1024)
+
+struct keyblock_lru_item
+{
+  struct keyblock_lru_item *next;      /* Next item in the bucket.  */
+  struct keyblock_lru_item *lru_prev;  /* More recently used item.  */
+  struct keyblock_lru_item *lru_next;  /* Less recently used item.  */
+  byte fpr[20];      /* The fingerprint used for the search.  */
+  int resource;      /* Index of the resource.  */
+  void *token;       /* Token of the resource.  */
+  off_t offset;      /* Offset of the record in the keybox.  */
+  int pk_no;
+  int uid_no;
+  u32 *sigstatus;    /* The signature status or NULL.  */
+  size_t imagelen;
+  byte image[1];     /* Image of the keyblock.  */
 };
 
+static struct keyblock_lru_item *keyblock_lru[KEYBLOCK_LRU_BUCKETS];
+static struct keyblock_lru_item *keyblock_lru_head;
+static struct keyblock_lru_item *keyblock_lru_tail;
+
+/* The state of the resource files when the cache was filled.  */
+struct keyblock_lru_stamp
+{
+  void *token;
+  off_t size;
+  time_t mtime;
+  ino_t ino;
+};
+static struct keyblock_lru_stamp keyblock_lru_stamps[MAX_KEYDB_RESOURCES];
+static int keyblock_lru_nstamps;
+
+/* A counter incremented for each change of the key database; see
+   keydb_get_generation.  The stamps are those of the resource files
+   as seen by the last call of that function.  */
+static unsigned int keydb_generation;
+static struct keyblock_lru_stamp generation_stamps[MAX_KEYDB_RESOURCES];
+static int generation_nstamps;
+
+struct
+{
+  unsigned int count;     /* The current number of items.  */
+  size_t bytes;           /* The current size of all items.  */
+  unsigned int hits;      /* Number of successful lookups.  */
+  unsigned int misses;    /* Number of failed lookups.  */
+  unsigned int evictions; /* Number of items removed due to the limits.  */
+  unsigned int flushes;   /* The number of flushes.  */
+} keyblock_lru_stats;
+
 
 struct keydb_handle
 {
@@ -184,6 +282,7 @@ struct
 
 
 static int lock_all (KEYDB_HANDLE hd);
+static int lock_resources (KEYDB_HANDLE hd, int only);
 static void unlock_all (KEYDB_HANDLE hd);
 
 
@@ -277,8 +376,236 @@ keyblock_cache_clear (struct keydb_handle *hd)
   hd->keyblock_cache.state = KEYBLOCK_CACHE_EMPTY;
   iobuf_close (hd->keyblock_cache.iobuf);
   hd->keyblock_cache.iobuf = NULL;
+  xfree (hd->keyblock_cache.sigstatus);
+  hd->keyblock_cache.sigstatus = NULL;
   hd->keyblock_cache.resource = -1;
   hd->keyblock_cache.offset = -1;
+  hd->keyblock_cache.lru_offset = -1;
+}
+
+
+static unsigned int
+keyblock_lru_hash (const byte *fpr)
+{
+  return ((fpr[18] << 8) | fpr[19]) % KEYBLOCK_LRU_BUCKETS;
+}
+
+
+/* Unlink ITEM from the LRU list.  */
+static void
+keyblock_lru_unlink (struct keyblock_lru_item *item)
+{
+  if (item->lru_prev)
+    item->lru_prev->lru_next = item->lru_next;
+  else
+    keyblock_lru_head = item->lru_next;
+  if (item->lru_next)
+    item->lru_next->lru_prev = item->lru_prev;
+  else
+    keyblock_lru_tail = item->lru_prev;
+  item->lru_prev = item->lru_next = NULL;
+}
+
+
+/* Put ITEM at the head of the LRU list.  */
+static void
+keyblock_lru_push (struct keyblock_lru_item *item)
+{
+  item->lru_prev = NULL;
+  item->lru_next = keyblock_lru_head;
+  if (keyblock_lru_head)
+    keyblock_lru_head->lru_prev = item;
+  else
+    keyblock_lru_tail = item;
+  keyblock_lru_head = item;
+}
+
+
+/* Remove ITEM from the cache and release it.  */
+static void
+keyblock_lru_remove (struct keyblock_lru_item *item)
+{
+  struct keyblock_lru_item **p;
+
+  for (p = &keyblock_lru[keyblock_lru_hash (item->fpr)]; *p; p = &(*p)->next)
+    if (*p == item)
+      {
+        *p = item->next;
+        break;
+      }
+  keyblock_lru_unlink (item);
+  keyblock_lru_stats.count--;
+  keyblock_lru_stats.bytes -= item->imagelen;
+  xfree (item->sigstatus);
+  xfree (item);
+}
+
+
+/* Flush the keyblock LRU.  */
+static void
+keyblock_lru_flush (void)
+{
+  if (!keyblock_lru_stats.count)
+    return;
+
+  if (DBG_CACHE)
+    log_debug ("keydb: keyblock_lru_flush\n");
+
+  while (keyblock_lru_head)
+    keyblock_lru_remove (keyblock_lru_head);
+  keyblock_lru_stats.flushes++;
+}
+
+
+/* Store the stamps of the NRES resource files RES at STAMPS.  Returns
+   false if a file can't be checked.  */
+static int
+get_resource_stamps (struct resource_item *res, int nres,
+                     struct keyblock_lru_stamp *stamps)
+{
+  struct stat st;
+  const char *fname;
+  int i;
+
+  for (i=0; i < nres; i++)
+    {
+      fname = NULL;
+      switch (res[i].type)
+        {
+        case KEYDB_RESOURCE_TYPE_NONE:
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYRING:
+          fname = keyring_get_resource_name (res[i].u.kr);
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          fname = keybox_get_resource_name (res[i].u.kb);
+          break;
+        }
+      memset (&stamps[i], 0, sizeof stamps[i]);
+      stamps[i].token = res[i].token;
+      if (!fname || stat (fname, &st))
+        {
+          if (errno != ENOENT)
+            return 0;
+        }
+      else
+        {
+          stamps[i].size = st.st_size;
+          stamps[i].mtime = st.st_mtime;
+          stamps[i].ino = st.st_ino;
+        }
+    }
+  return 1;
+}
+
+
+/* Check that the resource files of HD have not changed since the
+   keyblock LRU was filled; flush it if they have.  Returns true if
+   the files can be checked.  */
+static int
+keyblock_lru_check (KEYDB_HANDLE hd)
+{
+  struct keyblock_lru_stamp stamps[MAX_KEYDB_RESOURCES];
+
+  if (!get_resource_stamps (hd->active, hd->used, stamps))
+    return 0;
+
+  if (keyblock_lru_nstamps != hd->used
+      || memcmp (keyblock_lru_stamps, stamps, hd->used * sizeof *stamps))
+    {
+      keyblock_lru_flush ();
+      memcpy (keyblock_lru_stamps, stamps, hd->used * sizeof *stamps);
+      keyblock_lru_nstamps = hd->used;
+    }
+  return 1;
+}
+
+
+/* Return the item for FPR from the keyblock LRU or NULL.  */
+static struct keyblock_lru_item *
+keyblock_lru_get (KEYDB_HANDLE hd, const byte *fpr)
+{
+  struct keyblock_lru_item *item;
+
+  if (!keyblock_lru_check (hd))
+    return NULL;
+
+  for (item = keyblock_lru[keyblock_lru_hash (fpr)]; item; item = item->next)
+    if (!memcmp (item->fpr, fpr, 20))
+      break;
+  if (!item || item->resource >= hd->used
+      || hd->active[item->resource].token != item->token)
+    {
+      keyblock_lru_stats.misses++;
+      return NULL;
+    }
+
+  keyblock_lru_unlink (item);
+  keyblock_lru_push (item);
+  keyblock_lru_stats.hits++;
+  return item;
+}
+
+
+/* Store the result described by the filled keyblock cache of HD in
+   the keyblock LRU.  */
+static void
+keyblock_lru_put (KEYDB_HANDLE hd)
+{
+  struct keyblock_cache *c = &hd->keyblock_cache;
+  struct keyblock_lru_item *item;
+  size_t imagelen;
+  unsigned int bucket;
+
+  log_assert (c->state == KEYBLOCK_CACHE_FILLED && c->lru_offset != -1);
+
+  imagelen = iobuf_get_temp_length (c->iobuf);
+  if (imagelen > KEYBLOCK_LRU_MAX_BYTES / 16 || !keyblock_lru_check (hd))
+    return;
+
+  bucket = keyblock_lru_hash (c->fpr);
+  for (item = keyblock_lru[bucket]; item; item = item->next)
+    if (!memcmp (item->fpr, c->fpr, 20))
+      return;  /* Already cached.  */
+
+  item = xtrymalloc (sizeof *item + imagelen);
+  if (!item)
+    return;
+  memcpy (item->fpr, c->fpr, 20);
+  item->resource = c->resource;
+  item->token = hd->active[c->resource].token;
+  item->offset = c->lru_offset;
+  item->pk_no = c->pk_no;
+  item->uid_no = c->uid_no;
+  item->sigstatus = NULL;
+  if (c->sigstatus)
+    {
+      item->sigstatus = xtrymalloc ((1 + c->sigstatus[0])
+                                    * sizeof *item->sigstatus);
+      if (!item->sigstatus)
+        {
+          xfree (item);
+          return;
+        }
+      memcpy (item->sigstatus, c->sigstatus,
+              (1 + c->sigstatus[0]) * sizeof *item->sigstatus);
+    }
+  item->imagelen = imagelen;
+  memcpy (item->image, iobuf_get_temp_buffer (c->iobuf), imagelen);
+
+  item->next = keyblock_lru[bucket];
+  keyblock_lru[bucket] = item;
+  keyblock_lru_push (item);
+  keyblock_lru_stats.count++;
+  keyblock_lru_stats.bytes += imagelen;
+
+  while (keyblock_lru_tail != item
+         && (keyblock_lru_stats.count > KEYBLOCK_LRU_MAX_ITEMS
+             || keyblock_lru_stats.bytes > KEYBLOCK_LRU_MAX_BYTES))
+    {
+      keyblock_lru_remove (keyblock_lru_tail);
+      keyblock_lru_stats.evictions++;
+    }
 }
 
 
@@ -597,6 +924,77 @@ keydb_search_desc_dump (struct keydb_search_desc *desc)
 
 
 
+/* Register the shards of the sharded keybox in the directory
+ * DIRNAME.  The directory and the files are created if they do not
+ * yet exist and READ_ONLY is not set.  */
+static gpg_error_t
+register_keybox_shards (const char *dirname, unsigned int flags,
+                        int read_only)
+{
+  gpg_error_t err = 0;
+  char *fname;
+  void *token;
+  int n, group, first;
+
+  if (access (dirname, F_OK))
+    {
+      if (read_only)
+        return gpg_error (GPG_ERR_ENOENT);
+      if (gnupg_mkdir (dirname, "-rwx"))
+        return gpg_error_from_syserror ();
+    }
+
+  if (used_resources + KEYDB_NSHARDS > MAX_KEYDB_RESOURCES)
+    return gpg_error (GPG_ERR_RESOURCE_LIMIT);
+
+  first = used_resources;
+  group = ++last_shard_group;
+  for (n=0; n < KEYDB_NSHARDS; n++)
+    {
+      fname = xtryasprintf ("%s%cshard-%x.kbx", dirname, DIRSEP_C, n);
+      if (!fname)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      err = maybe_create_keyring_or_box (fname, 1, !read_only);
+      if (!err)
+        err = keybox_register_file (fname, 0, &token);
+      xfree (fname);
+      if (gpg_err_code (err) == GPG_ERR_EEXIST && !n)
+        {
+          /* Already registered; all shards have been registered with
+             the first one.  */
+          if ((flags & KEYDB_RESOURCE_FLAG_PRIMARY))
+            primary_keydb = token;
+          last_shard_group--;
+          return 0;
+        }
+      if (err)
+        break;
+
+      if (!n && (flags & KEYDB_RESOURCE_FLAG_PRIMARY))
+        primary_keydb = token;
+      all_resources[used_resources].type = KEYDB_RESOURCE_TYPE_KEYBOX;
+      all_resources[used_resources].u.kb = NULL; /* Not used here */
+      all_resources[used_resources].token = token;
+      all_resources[used_resources].shard_group = group;
+      all_resources[used_resources].shard = n;
+      used_resources++;
+    }
+
+  if (err)
+    {
+      /* Do not use an incomplete set of shards.  */
+      if (primary_keydb && used_resources > first
+          && primary_keydb == all_resources[first].token)
+        primary_keydb = NULL;
+      used_resources = first;
+    }
+  return err;
+}
+
+
 /* Register a resource (keyring or keybox).  The first keyring or
  * keybox that is added using this function is created if it does not
  * already exist and the KEYDB_RESOURCE_FLAG_READONLY is not set.
@@ -607,6 +1005,7 @@ keydb_search_desc_dump (struct keydb_search_desc *desc)
  *
  *   gnupg-ring:filename  = plain keyring
  *   gnupg-kbx:filename   = keybox file
+ *   gnupg-kbx-shards:dirname = sharded keybox in a directory
  *   filename             = check file's type (create as a plain keyring)
  *
  * Note: on systems with drive letters (Windows) invalid URLs (i.e.,
@@ -653,12 +1052,19 @@ keydb_add_resource (const char *url, unsigned int flags)
   int is_gpgvdef = !!(flags&KEYDB_RESOURCE_FLAG_GPGVDEF);
   gpg_error_t err = 0;
   KeydbResourceType rt = KEYDB_RESOURCE_TYPE_NONE;
+  int sharded = 0;
   void *token;
 
   /* Create the resource if it is the first registered one.  */
   create = (!read_only && !any_registered);
 
-  if (strlen (resname) > 11 && !strncmp( resname, "gnupg-ring:", 11) )
+  if (strlen (resname) > 17 && !strncmp (resname, "gnupg-kbx-shards:", 17))
+    {
+      rt = KEYDB_RESOURCE_TYPE_KEYBOX;
+      sharded = 1;
+      resname += 17;
+    }
+  else if (strlen (resname) > 11 && !strncmp( resname, "gnupg-ring:", 11) )
     {
       rt = KEYDB_RESOURCE_TYPE_KEYRING;
       resname += 11;
@@ -696,6 +1102,12 @@ keydb_add_resource (const char *url, unsigned int flags)
   else
     filename = xstrdup (resname);
 
+  if (sharded)
+    {
+      err = register_keybox_shards (filename, flags, read_only);
+      goto leave;
+    }
+
   /* See whether we can determine the filetype.  */
   if (rt == KEYDB_RESOURCE_TYPE_NONE)
     {
@@ -856,6 +1268,69 @@ keydb_add_resource (const char *url, unsigned int flags)
 }
 
 
+/* Register the resource URL with FLAGS not now but on the first use
+ * of the key database.  Short running commands which do not need any
+ * key thus do not need to open or create the files.  Errors are
+ * printed when the resource is finally registered.  */
+void
+keydb_add_resource_lazy (const char *url, unsigned int flags)
+{
+  strlist_t sl;
+
+  sl = append_to_strlist (&pending_resources, url);
+  sl->flags = flags;
+}
+
+
+/* Register the resources given to keydb_add_resource_lazy.  */
+static void
+register_pending_resources (void)
+{
+  strlist_t list, sl;
+
+  if (!pending_resources)
+    return;
+
+  if (DBG_CLOCK)
+    log_clock ("keydb register start");
+  /* Detach the list first in case we get called recursively.  */
+  list = pending_resources;
+  pending_resources = NULL;
+  for (sl = list; sl; sl = sl->next)
+    keydb_add_resource (sl->d, sl->flags);
+  free_strlist (list);
+  if (DBG_CLOCK)
+    log_clock ("keydb register done");
+}
+
+
+/* Emit the statistics of this module for the stats registry.  */
+void
+keydb_stats_report (stats_sink_t sink)
+{
+  stats_put (sink, "handles", keydb_stats.handles);
+  stats_put (sink, "locks", keydb_stats.locks);
+  stats_put (sink, "parse_keyblocks", keydb_stats.parse_keyblocks);
+  stats_put (sink, "get_keyblocks", keydb_stats.get_keyblocks);
+  stats_put (sink, "build_keyblocks", keydb_stats.build_keyblocks);
+  stats_put (sink, "update_keyblocks", keydb_stats.update_keyblocks);
+  stats_put (sink, "insert_keyblocks", keydb_stats.insert_keyblocks);
+  stats_put (sink, "delete_keyblocks", keydb_stats.delete_keyblocks);
+  stats_put (sink, "search_resets", keydb_stats.search_resets);
+  stats_put (sink, "found", keydb_stats.found);
+  stats_put (sink, "found_cached", keydb_stats.found_cached);
+  stats_put (sink, "notfound", keydb_stats.notfound);
+  stats_put (sink, "notfound_cached", keydb_stats.notfound_cached);
+  stats_put (sink, "kid_not_found_count", kid_not_found_stats.count);
+  stats_put (sink, "kid_not_found_peak", kid_not_found_stats.peak);
+  stats_put (sink, "lru_count", keyblock_lru_stats.count);
+  stats_put (sink, "lru_bytes", keyblock_lru_stats.bytes);
+  stats_put (sink, "lru_hits", keyblock_lru_stats.hits);
+  stats_put (sink, "lru_misses", keyblock_lru_stats.misses);
+  stats_put (sink, "lru_evictions", keyblock_lru_stats.evictions);
+}
+
+
 void
 keydb_dump_stats (void)
 {
@@ -879,6 +1354,14 @@ keydb_dump_stats (void)
             kid_not_found_stats.count,
             kid_not_found_stats.peak,
             kid_not_found_stats.flushes);
+  log_info ("keyblock_lru: count=%u bytes=%zu hits=%u misses=%u"
+            " evictions=%u flushes=%u\n",
+            keyblock_lru_stats.count,
+            keyblock_lru_stats.bytes,
+            keyblock_lru_stats.hits,
+            keyblock_lru_stats.misses,
+            keyblock_lru_stats.evictions,
+            keyblock_lru_stats.flushes);
 }
 
 
@@ -899,6 +1382,8 @@ keydb_new (void)
   if (DBG_CLOCK)
     log_clock ("keydb_new");
 
+  register_pending_resources ();
+
   hd = xtrycalloc (1, sizeof *hd);
   if (!hd)
     goto leave;
@@ -927,6 +1412,8 @@ keydb_new (void)
         case KEYDB_RESOURCE_TYPE_KEYBOX:
           hd->active[j].type   = all_resources[i].type;
           hd->active[j].token  = all_resources[i].token;
+          hd->active[j].shard_group = all_resources[i].shard_group;
+          hd->active[j].shard  = all_resources[i].shard;
           hd->active[j].u.kb   = keybox_new_openpgp (all_resources[i].token, 0);
           if (!hd->active[j].u.kb)
             {
@@ -1008,6 +1495,73 @@ keydb_lock (KEYDB_HANDLE hd)
 }
 
 
+/* Start a batch of changes.  Until keydb_commit_batch is called all
+ * resources are kept locked and the changes to keyrings are collected
+ * in a working copy of each keyring which then replaces the keyring
+ * in one go.  Keyboxes are updated by appending anyway; for them the
+ * batch saves the locking for each change and a compress run is done
+ * only once at the end.  Calls may be nested.  */
+gpg_error_t
+keydb_begin_batch (void)
+{
+  gpg_error_t err;
+
+  if (batch_level++)
+    return 0;
+
+  batch_hd = keydb_new ();
+  if (!batch_hd)
+    {
+      err = gpg_error_from_syserror ();
+      batch_level = 0;
+      return err;
+    }
+
+  err = keydb_lock (batch_hd);
+  if (err)
+    {
+      keydb_release (batch_hd);
+      batch_hd = NULL;
+      batch_level = 0;
+      return err;
+    }
+
+  keyring_begin_batch ();
+  keybox_defer_compress (1);
+  return 0;
+}
+
+
+/* Commit the changes of a batch started by keydb_begin_batch and
+ * release the locks.  */
+gpg_error_t
+keydb_commit_batch (void)
+{
+  gpg_error_t err;
+  KEYDB_HANDLE hd;
+  int i;
+
+  if (!batch_level)
+    return gpg_error (GPG_ERR_INV_STATE);
+  if (--batch_level)
+    return 0;
+
+  err = keyring_commit_batch ();
+  keybox_defer_compress (0);
+  for (i=0; i < batch_hd->used; i++)
+    if (batch_hd->active[i].type == KEYDB_RESOURCE_TYPE_KEYBOX)
+      keybox_compress_pending (batch_hd->active[i].u.kb);
+  kid_not_found_flush ();
+  keyblock_lru_flush ();
+  keydb_generation++;
+
+  hd = batch_hd;
+  batch_hd = NULL;
+  keydb_release (hd);
+  return err;
+}
+
+
 /* Set a flag on the handle to suppress use of cached results.  This
  * is required for updating a keyring and for key listings.  Fixme:
  * Using a new parameter for keydb_new might be a better solution.  */
@@ -1063,9 +1617,22 @@ keydb_get_resource_name (KEYDB_HANDLE hd)
 
 static int
 lock_all (KEYDB_HANDLE hd)
+{
+  return lock_resources (hd, -1);
+}
+
+
+/* Lock the resources of HD.  If ONLY is the index of a shard of a
+ * sharded keybox, the other shards of all groups are not locked
+ * because the caller will only change that one.  */
+static int
+lock_resources (KEYDB_HANDLE hd, int only)
 {
   int i, rc = 0;
 
+  if (only >= 0 && (only >= hd->used || !hd->active[only].shard_group))
+    only = -1;
+
   /* Fixme: This locking scheme may lead to a deadlock if the resources
      are not added in the same order by all processes.  We are
      currently only allowing one resource so it is not a problem.
@@ -1075,6 +1642,8 @@ lock_all (KEYDB_HANDLE hd)
 
   for (i=0; !rc && i < hd->used; i++)
     {
+      if (only >= 0 && i != only && hd->active[i].shard_group)
+        continue;
       switch (hd->active[i].type)
         {
         case KEYDB_RESOURCE_TYPE_NONE:
@@ -1093,6 +1662,8 @@ lock_all (KEYDB_HANDLE hd)
       /* Revert the already taken locks.  */
       for (i--; i >= 0; i--)
         {
+          if (only >= 0 && i != only && hd->active[i].shard_group)
+            continue;
           switch (hd->active[i].type)
             {
             case KEYDB_RESOURCE_TYPE_NONE:
@@ -1124,6 +1695,13 @@ unlock_all (KEYDB_HANDLE hd)
   if (!hd->locked || hd->keep_lock)
     return;
 
+  /* During a batch the locks are held by BATCH_HD.  */
+  if (batch_hd && hd != batch_hd)
+    {
+      hd->locked = 0;
+      return;
+    }
+
   for (i=hd->used-1; i >= 0; i--)
     {
       switch (hd->active[i].type)
@@ -1216,9 +1794,86 @@ keydb_pop_found_state (KEYDB_HANDLE hd)
 
 
 
+/* Return the value to be stored in the keybox for the signature SIG
+ * of a key with the keyid MAINKID; MAINKID may be NULL if the keyblock
+ * has no primary key.  Only the results of self-signature
+ * checks are stored; they are the only ones used by merge_selfsigs
+ * and they do not depend on other keys.  */
+static u32
+sigstatus_from_sig (PKT_signature *sig, const u32 *mainkid)
+{
+  if (opt.no_sig_cache || !sig->flags.checked || !mainkid
+      || sig->keyid[0] != mainkid[0] || sig->keyid[1] != mainkid[1])
+    return 0;  /* Not checked.  */
+  if (!sig->flags.valid)
+    return 2;  /* Bad signature.  */
+  if (!sig->expiredate)
+    return 0xffffffff; /* Valid and does not expire.  */
+  if (sig->expiredate < 0x10000000)
+    return 0x10000000; /* Valid and expired long ago.  */
+  return sig->expiredate;
+}
+
+
+/* Set the cached status of the self-signatures of KEYBLOCK from
+ * SIGSTATUS as returned by keybox_get_keyblock.  This allows
+ * merge_selfsigs to skip the public key operations for keys read
+ * from a keybox.  SIGSTATUS is only returned by the keybox if it is
+ * bound to the keyblock image by a digest; as an additional sanity
+ * check nothing is done if the number of signatures does not match.  */
+static void
+apply_sigstatus (kbnode_t keyblock, const u32 *sigstatus)
+{
+  kbnode_t node;
+  PKT_signature *sig;
+  u32 mainkid[2];
+  u32 n;
+
+  if (!sigstatus || opt.no_sig_cache)
+    return;
+
+  for (n=0, node = keyblock; node; node = node->next)
+    if (node->pkt->pkttype == PKT_SIGNATURE)
+      n++;
+  if (n != sigstatus[0])
+    return;
+
+  node = find_kbnode (keyblock, PKT_PUBLIC_KEY);
+  if (!node)
+    return;
+  keyid_from_pk (node->pkt->pkt.public_key, mainkid);
+  for (n=1, node = keyblock; node; node = node->next)
+    {
+      if (node->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      sig = node->pkt->pkt.signature;
+      switch (sigstatus[n++])
+        {
+        case 0: /* Not checked.  */
+        case 1: /* Missing key.  */
+          break;
+        case 2: /* Bad signature.  */
+          if (sig->keyid[0] == mainkid[0] && sig->keyid[1] == mainkid[1])
+            {
+              sig->flags.checked = 1;
+              sig->flags.valid = 0;
+            }
+          break;
+        default:
+          if (sig->keyid[0] == mainkid[0] && sig->keyid[1] == mainkid[1])
+            {
+              sig->flags.checked = 1;
+              sig->flags.valid = 1;
+            }
+          break;
+        }
+    }
+}
+
+
 static gpg_error_t
 parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
-                      kbnode_t *r_keyblock)
+                      const u32 *sigstatus, kbnode_t *r_keyblock)
 {
   gpg_error_t err;
   struct parse_packet_ctx_s parsectx;
@@ -1230,11 +1885,9 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
 
   *r_keyblock = NULL;
 
-  pkt = xtrymalloc (sizeof *pkt);
-  if (!pkt)
-    return gpg_error_from_syserror ();
-  init_packet (pkt);
+  pkt = alloc_packet_object ();
   init_parse_packet (&parsectx, iobuf);
+  parsectx.lazy_sig_data = 1;
   save_mode = set_packet_list_mode (0);
   in_cert = 0;
   tail = NULL;
@@ -1319,13 +1972,7 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
       else
         *tail = node;
       tail = &node->next;
-      pkt = xtrymalloc (sizeof *pkt);
-      if (!pkt)
-        {
-          err = gpg_error_from_syserror ();
-          break;
-        }
-      init_packet (pkt);
+      pkt = alloc_packet_object ();
     }
   set_packet_list_mode (save_mode);
 
@@ -1336,12 +1983,13 @@ parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
     release_kbnode (keyblock);
   else
     {
+      apply_sigstatus (keyblock, sigstatus);
       *r_keyblock = keyblock;
       keydb_stats.parse_keyblocks++;
     }
   free_packet (pkt, &parsectx);
   deinit_parse_packet (&parsectx);
-  xfree (pkt);
+  release_packet_object (pkt);
   return err;
 }
 
@@ -1381,6 +2029,7 @@ keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
 	  err = parse_keyblock_image (hd->keyblock_cache.iobuf,
 				      hd->keyblock_cache.pk_no,
 				      hd->keyblock_cache.uid_no,
+				      hd->keyblock_cache.sigstatus,
 				      ret_kb);
 	  if (err)
 	    keyblock_cache_clear (hd);
@@ -1406,22 +2055,28 @@ keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
       {
         iobuf_t iobuf;
         int pk_no, uid_no;
+        u32 *sigstatus;
 
         err = keybox_get_keyblock (hd->active[hd->found].u.kb,
-                                   &iobuf, &pk_no, &uid_no);
+                                   &iobuf, &pk_no, &uid_no, &sigstatus);
         if (!err)
           {
-            err = parse_keyblock_image (iobuf, pk_no, uid_no, ret_kb);
+            err = parse_keyblock_image (iobuf, pk_no, uid_no, sigstatus,
+                                        ret_kb);
             if (!err && hd->keyblock_cache.state == KEYBLOCK_CACHE_PREPARED)
               {
                 hd->keyblock_cache.state     = KEYBLOCK_CACHE_FILLED;
                 hd->keyblock_cache.iobuf     = iobuf;
+                hd->keyblock_cache.sigstatus = sigstatus;
                 hd->keyblock_cache.pk_no     = pk_no;
                 hd->keyblock_cache.uid_no    = uid_no;
+                if (hd->keyblock_cache.lru_offset != -1)
+                  keyblock_lru_put (hd);
               }
             else
               {
                 iobuf_close (iobuf);
+                xfree (sigstatus);
               }
           }
       }
@@ -1442,17 +2097,41 @@ keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
 
 
 /* Build a keyblock image from KEYBLOCK.  Returns 0 on success and
- * only then stores a new iobuf object at R_IOBUF.  */
+ * only then stores a new iobuf object at R_IOBUF and an array with
+ * the status of the signatures for keybox_insert_keyblock at
+ * R_SIGSTATUS.  */
 static gpg_error_t
-build_keyblock_image (kbnode_t keyblock, iobuf_t *r_iobuf)
+build_keyblock_image (kbnode_t keyblock, iobuf_t *r_iobuf, u32 **r_sigstatus)
 {
   gpg_error_t err;
   iobuf_t iobuf;
   kbnode_t kbctx, node;
+  u32 *sigstatus;
+  u32 mainkid[2];
+  const u32 *kid = NULL;
+  unsigned int nsigs, n;
 
   *r_iobuf = NULL;
+  *r_sigstatus = NULL;
+
+  for (kbctx = NULL, nsigs = 0; (node = walk_kbnode (keyblock, &kbctx, 0));)
+    if (node->pkt->pkttype == PKT_SIGNATURE)
+      nsigs++;
+  sigstatus = xtrycalloc (1 + nsigs, sizeof *sigstatus);
+  if (!sigstatus)
+    return gpg_error_from_syserror ();
+  sigstatus[0] = nsigs;
+  /* Note that the keyblock from keygen starts with a comment packet
+   * and not with the primary key.  */
+  node = find_kbnode (keyblock, PKT_PUBLIC_KEY);
+  if (node)
+    {
+      keyid_from_pk (node->pkt->pkt.public_key, mainkid);
+      kid = mainkid;
+    }
 
   iobuf = iobuf_temp ();
+  n = 0;
   for (kbctx = NULL; (node = walk_kbnode (keyblock, &kbctx, 0));)
     {
       /* Make sure to use only packets valid on a keyblock.  */
@@ -1473,16 +2152,47 @@ build_keyblock_image (kbnode_t keyblock, iobuf_t *r_iobuf)
       if (err)
         {
           iobuf_close (iobuf);
+          xfree (sigstatus);
           return err;
         }
+      if (node->pkt->pkttype == PKT_SIGNATURE)
+        sigstatus[++n] = sigstatus_from_sig (node->pkt->pkt.signature, kid);
     }
 
   keydb_stats.build_keyblocks++;
   *r_iobuf = iobuf;
+  *r_sigstatus = sigstatus;
   return 0;
 }
 
 
+/* Return the index into HD->ACTIVE of the shard for a key with the
+ * fingerprint FPR of FPRLEN in the shard group of the resource IDX.
+ * If IDX is -1 the first shard group is used.  Returns IDX if there
+ * is no such shard.  */
+static int
+select_shard (KEYDB_HANDLE hd, int idx, const byte *fpr, size_t fprlen)
+{
+  int i, group, shard;
+
+  if (idx >= 0 && idx < hd->used)
+    group = hd->active[idx].shard_group;
+  else
+    {
+      for (group = 0, i = 0; i < hd->used && !group; i++)
+        group = hd->active[i].shard_group;
+    }
+  if (!group || !fprlen)
+    return idx;
+
+  shard = fpr[fprlen-1] % KEYDB_NSHARDS;
+  for (i=0; i < hd->used; i++)
+    if (hd->active[i].shard_group == group && hd->active[i].shard == shard)
+      return i;
+  return idx;
+}
+
+
 /* Update the keyblock KB (i.e., extract the fingerprint and find the
  * corresponding keyblock in the keyring).
  *
@@ -1505,6 +2215,7 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
   PKT_public_key *pk;
   KEYDB_SEARCH_DESC desc;
   size_t len;
+  int shard;
 
   log_assert (kb);
   log_assert (kb->pkt->pkttype == PKT_PUBLIC_KEY);
@@ -1514,19 +2225,13 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
     return gpg_error (GPG_ERR_INV_ARG);
 
   kid_not_found_flush ();
+  keyblock_lru_flush ();
+  keydb_generation++;
   keyblock_cache_clear (hd);
 
   if (opt.dry_run)
     return 0;
 
-  err = lock_all (hd);
-  if (err)
-    return err;
-
-#ifdef USE_TOFU
-  tofu_notice_key_changed (ctrl, kb);
-#endif
-
   memset (&desc, 0, sizeof (desc));
   fingerprint_from_pk (pk, desc.u.fpr, &len);
   if (len == 20)
@@ -1534,8 +2239,29 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
   else
     log_bug ("%s: Unsupported key length: %zu\n", __func__, len);
 
+  /* With a sharded keybox only the shard of the key is locked.  */
+  shard = select_shard (hd, -1, desc.u.fpr, len);
+  err = lock_resources (hd, shard);
+  if (err)
+    return err;
+
+#ifdef USE_TOFU
+  tofu_notice_key_changed (ctrl, kb);
+#endif
+
   keydb_search_reset (hd);
   err = keydb_search (hd, &desc, 1, NULL);
+  if (!err && shard >= 0 && hd->found != shard
+      && hd->active[hd->found].shard_group)
+    {
+      /* The key is stored in another shard; lock everything and
+       * search again.  */
+      err = lock_all (hd);
+      if (err)
+        return err;
+      keydb_search_reset (hd);
+      err = keydb_search (hd, &desc, 1, NULL);
+    }
   if (err)
     return gpg_error (GPG_ERR_VALUE_NOT_FOUND);
   log_assert (hd->found >= 0 && hd->found < hd->used);
@@ -1551,13 +2277,16 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
     case KEYDB_RESOURCE_TYPE_KEYBOX:
       {
         iobuf_t iobuf;
+        u32 *sigstatus;
 
-        err = build_keyblock_image (kb, &iobuf);
+        err = build_keyblock_image (kb, &iobuf, &sigstatus);
         if (!err)
           {
             err = keybox_update_keyblock (hd->active[hd->found].u.kb,
                                           iobuf_get_temp_buffer (iobuf),
-                                          iobuf_get_temp_length (iobuf));
+                                          iobuf_get_temp_length (iobuf),
+                                          sigstatus);
+            xfree (sigstatus);
             iobuf_close (iobuf);
           }
       }
@@ -1591,6 +2320,8 @@ keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
     return gpg_error (GPG_ERR_INV_ARG);
 
   kid_not_found_flush ();
+  keyblock_lru_flush ();
+  keydb_generation++;
   keyblock_cache_clear (hd);
 
   if (opt.dry_run)
@@ -1603,7 +2334,21 @@ keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
   else
     return gpg_error (GPG_ERR_GENERAL);
 
-  err = lock_all (hd);
+  if (hd->active[idx].shard_group)
+    {
+      byte fpr[MAX_FINGERPRINT_LEN];
+      size_t fprlen;
+      kbnode_t node;
+
+      /* The keyblock from keygen starts with a comment packet.  */
+      node = find_kbnode (kb, PKT_PUBLIC_KEY);
+      if (!node)
+        return gpg_error (GPG_ERR_INV_KEYRING);
+      fingerprint_from_pk (node->pkt->pkt.public_key, fpr, &fprlen);
+      idx = select_shard (hd, idx, fpr, fprlen);
+    }
+
+  err = lock_resources (hd, idx);
   if (err)
     return err;
 
@@ -1621,13 +2366,16 @@ keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
            included in the keybox code.  Eventually we can change this
            kludge to have the caller pass the image.  */
         iobuf_t iobuf;
+        u32 *sigstatus;
 
-        err = build_keyblock_image (kb, &iobuf);
+        err = build_keyblock_image (kb, &iobuf, &sigstatus);
         if (!err)
           {
             err = keybox_insert_keyblock (hd->active[idx].u.kb,
                                           iobuf_get_temp_buffer (iobuf),
-                                          iobuf_get_temp_length (iobuf));
+                                          iobuf_get_temp_length (iobuf),
+                                          sigstatus);
+            xfree (sigstatus);
             iobuf_close (iobuf);
           }
       }
@@ -1655,6 +2403,8 @@ keydb_delete_keyblock (KEYDB_HANDLE hd)
     return gpg_error (GPG_ERR_INV_ARG);
 
   kid_not_found_flush ();
+  keyblock_lru_flush ();
+  keydb_generation++;
   keyblock_cache_clear (hd);
 
   if (hd->found < 0 || hd->found >= hd->used)
@@ -1663,7 +2413,7 @@ keydb_delete_keyblock (KEYDB_HANDLE hd)
   if (opt.dry_run)
     return 0;
 
-  rc = lock_all (hd);
+  rc = lock_resources (hd, hd->found);
   if (rc)
     return rc;
 
@@ -1756,6 +2506,8 @@ keydb_rebuild_caches (ctrl_t ctrl, int noisy)
 {
   int i, rc;
 
+  register_pending_resources ();
+
   for (i=0; i < used_resources; i++)
     {
       if (!keyring_is_writable (all_resources[i].token))
@@ -1778,6 +2530,29 @@ keydb_rebuild_caches (ctrl_t ctrl, int noisy)
 }
 
 
+/* Return a counter which changes whenever the key database has been
+   modified by this process or the resource files have been changed
+   by another process.  Callers use this to invalidate data derived
+   from the keys.  */
+unsigned int
+keydb_get_generation (void)
+{
+  struct keyblock_lru_stamp stamps[MAX_KEYDB_RESOURCES];
+
+  if (!get_resource_stamps (all_resources, used_resources, stamps))
+    keydb_generation++;  /* Can't check - assume a change.  */
+  else if (generation_nstamps != used_resources
+           || memcmp (generation_stamps, stamps,
+                      used_resources * sizeof *stamps))
+    {
+      keydb_generation++;
+      memcpy (generation_stamps, stamps, used_resources * sizeof *stamps);
+      generation_nstamps = used_resources;
+    }
+  return keydb_generation;
+}
+
+
 /* Return the number of skipped blocks (because they were to large to
    read from a keybox) since the last search reset.  */
 unsigned long
@@ -1862,6 +2637,7 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   int was_reset = hd->is_reset;
   /* If an entry is already in the cache, then don't add it again.  */
   int already_in_cache = 0;
+  struct keyblock_lru_item *lru;
 
   if (descindex)
     *descindex = 0; /* Make sure it is always set on return.  */
@@ -1877,6 +2653,7 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
 
   if (DBG_CLOCK)
     log_clock ("keydb_search enter");
+  GNUPG_TRACE2 (keydb_search, ndesc? desc[0].mode : 0, ndesc);
 
   if (DBG_LOOKUP)
     {
@@ -1895,6 +2672,7 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
     {
       if (DBG_CLOCK)
         log_clock ("keydb_search leave (not found, cached)");
+      GNUPG_TRACE2 (keydb_search_done, GPG_ERR_NOT_FOUND, 1);
       keydb_stats.notfound_cached++;
       return gpg_error (GPG_ERR_NOT_FOUND);
     }
@@ -1918,6 +2696,7 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       /* (DESCINDEX is already set).  */
       if (DBG_CLOCK)
         log_clock ("keydb_search leave (cached)");
+      GNUPG_TRACE2 (keydb_search_done, 0, 1);
 
       hd->current = hd->keyblock_cache.resource;
       /* HD->KEYBLOCK_CACHE.OFFSET is the last byte in the record.
@@ -1928,6 +2707,62 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       return 0;
     }
 
+  /* Now try the keyblock LRU, which caches the first results from the
+     start of the database.  */
+  if (!hd->no_caching
+      && was_reset
+      && ndesc == 1
+      && (desc[0].mode == KEYDB_SEARCH_MODE_FPR20
+          || desc[0].mode == KEYDB_SEARCH_MODE_FPR)
+      && !desc[0].skipfnc
+      && (lru = keyblock_lru_get (hd, desc[0].u.fpr))
+      && hd->active[lru->resource].type == KEYDB_RESOURCE_TYPE_KEYBOX)
+    {
+      KEYBOX_HANDLE kb = hd->active[lru->resource].u.kb;
+
+      /* Search again at the cached offset so that the keybox has the
+         state of a regular search.  */
+      hd->current = lru->resource;
+      rc = keybox_seek (kb, lru->offset);
+      if (!rc)
+        rc = keybox_search (kb, desc, ndesc, KEYBOX_BLOBTYPE_PGP,
+                            descindex, &hd->skipped_long_blobs);
+      if (!rc && keybox_found_offset (kb) == lru->offset)
+        {
+          hd->found = hd->current;
+          hd->is_reset = 0;
+          keyblock_cache_clear (hd);
+          hd->keyblock_cache.iobuf = iobuf_temp_with_content
+            ((const char *)lru->image, lru->imagelen);
+          hd->keyblock_cache.state = KEYBLOCK_CACHE_FILLED;
+          hd->keyblock_cache.pk_no = lru->pk_no;
+          hd->keyblock_cache.uid_no = lru->uid_no;
+          if (lru->sigstatus)
+            {
+              hd->keyblock_cache.sigstatus
+                = xtrymalloc ((1 + lru->sigstatus[0])
+                              * sizeof *lru->sigstatus);
+              if (hd->keyblock_cache.sigstatus)
+                memcpy (hd->keyblock_cache.sigstatus, lru->sigstatus,
+                        (1 + lru->sigstatus[0]) * sizeof *lru->sigstatus);
+            }
+          hd->keyblock_cache.resource = hd->current;
+          hd->keyblock_cache.offset = keybox_offset (kb) - 1;
+          memcpy (hd->keyblock_cache.fpr, desc[0].u.fpr, 20);
+          if (DBG_CLOCK)
+            log_clock ("keydb_search leave (cached lru)");
+          GNUPG_TRACE2 (keydb_search_done, 0, 1);
+          keydb_stats.found_cached++;
+          return 0;
+        }
+
+      /* The cache is stale; do a regular search.  */
+      keyblock_lru_flush ();
+      keydb_search_reset (hd);
+      if (descindex)
+        *descindex = 0;
+    }
+
   rc = -1;
   while ((rc == -1 || gpg_err_code (rc) == GPG_ERR_EOF)
          && hd->current >= 0 && hd->current < hd->used)
@@ -1998,6 +2833,10 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       hd->keyblock_cache.offset
         = keybox_offset (hd->active[hd->current].u.kb) - 1;
       memcpy (hd->keyblock_cache.fpr, desc[0].u.fpr, 20);
+      /* The first result from the start can go into the LRU.  */
+      if (was_reset && !desc[0].skipfnc)
+        hd->keyblock_cache.lru_offset
+          = keybox_found_offset (hd->active[hd->current].u.kb);
     }
 
   if (gpg_err_code (rc) == GPG_ERR_NOT_FOUND
@@ -2008,6 +2847,7 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   if (DBG_CLOCK)
     log_clock (rc? "keydb_search leave (not found)"
                  : "keydb_search leave (found)");
+  GNUPG_TRACE2 (keydb_search_done, gpg_err_code (rc), 0);
   if (!rc)
     keydb_stats.found++;
   else
@@ -2016,6 +2856,152 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
 }
 
 
+/* Return the node of the public key or subkey in KEYBLOCK matching
+ * DESC.  Only the fingerprint and long keyid modes are supported; for
+ * all other modes NULL is returned.  */
+static kbnode_t
+keyblock_match_desc (kbnode_t keyblock, KEYDB_SEARCH_DESC *desc)
+{
+  kbnode_t node;
+  u32 kid[2];
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+
+  for (node = keyblock; node; node = node->next)
+    {
+      if (node->pkt->pkttype != PKT_PUBLIC_KEY
+          && node->pkt->pkttype != PKT_PUBLIC_SUBKEY)
+        continue;
+      switch (desc->mode)
+        {
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          keyid_from_pk (node->pkt->pkt.public_key, kid);
+          if (kid[0] == desc->u.kid[0] && kid[1] == desc->u.kid[1])
+            return node;
+          break;
+        case KEYDB_SEARCH_MODE_FPR:
+        case KEYDB_SEARCH_MODE_FPR20:
+          fingerprint_from_pk (node->pkt->pkt.public_key, fpr, &fprlen);
+          if (fprlen == 20 && !memcmp (fpr, desc->u.fpr, 20))
+            return node;
+          break;
+        default:
+          return NULL;
+        }
+    }
+  return NULL;
+}
+
+
+/* Search the database in a single pass for the keys matching the
+ * NDESC search terms in DESC.  Unlike keydb_search, which returns
+ * the next key matching any of the terms, this function collects a
+ * result for each term: The first keyblock matching DESC[i] is
+ * stored at R_KEYBLOCKS[i] or NULL if no key matches.  R_KEYBLOCKS
+ * must have space for NDESC items.  The search always starts at the
+ * beginning of the database.  The caller must release the returned
+ * keyblocks.
+ *
+ * Use this function instead of calling keydb_search for each term if
+ * many keys need to be looked up.  Note that if several terms match
+ * the same keyblock only fingerprint and long keyid terms are
+ * resolved to it; other terms are resolved to the next matching
+ * keyblock, if any.  */
+gpg_error_t
+keydb_search_batch (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc, size_t ndesc,
+                    kbnode_t *r_keyblocks)
+{
+  gpg_error_t err;
+  KEYDB_SEARCH_DESC *pending = NULL;
+  size_t *pendidx = NULL;
+  size_t npending, descindex, n, i;
+  kbnode_t keyblock, node;
+
+  for (n=0; n < ndesc; n++)
+    r_keyblocks[n] = NULL;
+
+  if (!hd)
+    return gpg_error (GPG_ERR_INV_ARG);
+  if (!ndesc)
+    return 0;
+
+  /* PENDING holds the terms not yet resolved and PENDIDX maps them
+   * back to DESC.  */
+  pending = xtrycalloc (ndesc, sizeof *pending);
+  pendidx = xtrycalloc (ndesc, sizeof *pendidx);
+  if (!pending || !pendidx)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (n=0; n < ndesc; n++)
+    {
+      pending[n] = desc[n];
+      pendidx[n] = n;
+    }
+  npending = ndesc;
+
+  err = keydb_search_reset (hd);
+  while (!err && npending)
+    {
+      err = keydb_search (hd, pending, npending, &descindex);
+      if (err)
+        break;
+      log_assert (descindex < npending);
+
+      err = keydb_get_keyblock (hd, &keyblock);
+      if (err)
+        break;
+      r_keyblocks[pendidx[descindex]] = keyblock;
+      npending--;
+      pending[descindex] = pending[npending];
+      pendidx[descindex] = pendidx[npending];
+
+      /* Resolve other terms which match a key of this keyblock.  They
+       * get their own copy of the keyblock with the flags set for the
+       * matching key.  */
+      for (i=0; !err && i < npending; )
+        {
+          node = keyblock_match_desc (keyblock, &pending[i]);
+          if (!node)
+            {
+              i++;
+              continue;
+            }
+          err = keydb_get_keyblock (hd, &r_keyblocks[pendidx[i]]);
+          if (err)
+            break;
+          for (node = r_keyblocks[pendidx[i]]; node; node = node->next)
+            node->flag &= ~3;
+          node = keyblock_match_desc (r_keyblocks[pendidx[i]], &pending[i]);
+          if (node)
+            node->flag |= 1;
+          npending--;
+          pending[i] = pending[npending];
+          pendidx[i] = pendidx[npending];
+        }
+    }
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    err = 0;
+
+ leave:
+  if (err)
+    {
+      for (n=0; n < ndesc; n++)
+        {
+          release_kbnode (r_keyblocks[n]);
+          r_keyblocks[n] = NULL;
+        }
+    }
+  xfree (pending);
+  xfree (pendidx);
+  if (DBG_LOOKUP)
+    log_debug ("%s: %zu search terms => %s\n",
+               __func__, ndesc, gpg_strerror (err));
+  return err;
+}
+
+
 /* Return the first non-legacy key in the database.
  *
  * If you want the very first key in the database, you can directly
@@ -24,6 +24,7 @@
 
 #include "../common/types.h"
 #include "../common/util.h"
+#include "../common/stats.h"
 #include "packet.h"
 
 /* What qualifies as a certification (key-signature in contrast to a
@@ -177,9 +178,15 @@ char *keydb_search_desc_dump (struct keydb_search_desc *desc);
 /* Register a resource (keyring or keybox).  */
 gpg_error_t keydb_add_resource (const char *url, unsigned int flags);
 
+/* Register a resource on the first use of the key database.  */
+void keydb_add_resource_lazy (const char *url, unsigned int flags);
+
 /* Dump some statistics to the log.  */
 void keydb_dump_stats (void);
 
+/* Emit the statistics for the stats registry.  */
+void keydb_stats_report (stats_sink_t sink);
+
 /* Create a new database handle.  Returns NULL on error, sets ERRNO,
    and prints an error diagnostic. */
 KEYDB_HANDLE keydb_new (void);
@@ -191,6 +198,12 @@ void keydb_release (KEYDB_HANDLE hd);
  * update.  This lock is released with keydb_release.  */
 gpg_error_t keydb_lock (KEYDB_HANDLE hd);
 
+/* Start a batch of changes which are committed by keydb_commit_batch.  */
+gpg_error_t keydb_begin_batch (void);
+
+/* Commit the changes of a batch.  */
+gpg_error_t keydb_commit_batch (void);
+
 /* Set a flag on the handle to suppress use of cached results.  This
    is required for updating a keyring and for key listings.  Fixme:
    Using a new parameter for keydb_new might be a better solution.  */
@@ -226,6 +239,7 @@ void keydb_rebuild_caches (ctrl_t ctrl, int noisy);
 /* Return the number of skipped blocks (because they were to large to
    read from a keybox) since the last search reset.  */
 unsigned long keydb_get_skipped_counter (KEYDB_HANDLE hd);
+unsigned int keydb_get_generation (void);
 
 /* Clears the current search result and resets the handle's position.  */
 gpg_error_t keydb_search_reset (KEYDB_HANDLE hd);
@@ -234,6 +248,11 @@ gpg_error_t keydb_search_reset (KEYDB_HANDLE hd);
 gpg_error_t keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
                           size_t ndesc, size_t *descindex);
 
+/* Search the database in a single pass for the keys matching each of
+   the search terms.  */
+gpg_error_t keydb_search_batch (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
+                                size_t ndesc, kbnode_t *r_keyblocks);
+
 /* Return the first non-legacy key in the database.  */
 gpg_error_t keydb_search_first (KEYDB_HANDLE hd);
 
@@ -312,6 +331,7 @@ void cache_public_key( PKT_public_key *pk );
 
 /* Disable and drop the public key cache.  */
 void getkey_disable_caches(void);
+void getkey_stats_report (stats_sink_t sink);
 
 /* Return the public key used for signature SIG and store it at PK.  */
 gpg_error_t get_pubkey_for_sig (ctrl_t ctrl,
@@ -374,10 +394,18 @@ gpg_error_t get_best_pubkey_byname (ctrl_t ctrl,
 gpg_error_t get_pubkey_fromfile (ctrl_t ctrl,
                                  PKT_public_key *pk, const char *fname);
 
+/* Get the public key from a keyblock retrieved from the database.  */
+gpg_error_t get_pubkey_from_keyblock (ctrl_t ctrl, PKT_public_key *pk,
+                                      kbnode_t keyblock);
+
 /* Return the public key with the key id KEYID iff the secret key is
  * available and store it at PK.  */
 gpg_error_t get_seckey (ctrl_t ctrl, PKT_public_key *pk, u32 *keyid);
 
+/* Return the public key with the key id KEYID without checking the
+ * availability of the secret key.  */
+gpg_error_t get_pubkey_exact (ctrl_t ctrl, PKT_public_key *pk, u32 *keyid);
+
 /* Lookup a key with the specified fingerprint.  */
 int get_pubkey_byfprint (ctrl_t ctrl, PKT_public_key *pk, kbnode_t *r_keyblock,
                          const byte *fprint, size_t fprint_len);
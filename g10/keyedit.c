@@ -2615,17 +2615,15 @@ find_by_primary_fpr (ctrl_t ctrl, const char *fpr,
 }
 
 
-/* Unattended key signing function.  If the key specifified by FPR is
-   available and FPR is the primary fingerprint all user ids of the
-   key are signed using the default signing key.  If UIDS is an empty
-   list all usable UIDs are signed, if it is not empty, only those
-   user ids matching one of the entries of the list are signed.  With
-   LOCAL being true the signatures are marked as non-exportable.  */
-void
-keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
-                    strlist_t locusr, int local)
+/* Worker for keyedit_quick_sign and keyedit_quick_sign_keys.  Signs
+   the key FPR but does not mark the trustdb for revalidation.
+   Returns 0 on success.  */
+static int
+quick_sign_key (ctrl_t ctrl, const char *fpr, strlist_t uids,
+                strlist_t locusr, int local)
 {
   gpg_error_t err;
+  int rc = -1;
   kbnode_t keyblock = NULL;
   KEYDB_HANDLE kdbhd = NULL;
   int modified = 0;
@@ -2758,14 +2756,66 @@ keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
     }
   else
     log_info (_("Key not changed so no update needed.\n"));
-
-  if (update_trust)
-    revalidation_mark (ctrl);
-
+  rc = 0;
 
  leave:
   release_kbnode (keyblock);
   keydb_release (kdbhd);
+  return rc;
+}
+
+
+/* Unattended key signing function.  If the key specifified by FPR is
+   available and FPR is the primary fingerprint all user ids of the
+   key are signed using the default signing key.  If UIDS is an empty
+   list all usable UIDs are signed, if it is not empty, only those
+   user ids matching one of the entries of the list are signed.  With
+   LOCAL being true the signatures are marked as non-exportable.  */
+void
+keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
+                    strlist_t locusr, int local)
+{
+  if (!quick_sign_key (ctrl, fpr, uids, locusr, local) && update_trust)
+    revalidation_mark (ctrl);
+}
+
+
+/* Unattended signing of many keys.  All usable user ids of each key
+   given by its primary fingerprint in the list FPRS are signed as
+   with keyedit_quick_sign.  All updated keyblocks are written in one
+   keydb batch and the trustdb is marked for revalidation only once
+   at the end.  A key which can't be signed is skipped.  */
+void
+keyedit_quick_sign_keys (ctrl_t ctrl, strlist_t fprs,
+                         strlist_t locusr, int local)
+{
+  gpg_error_t err;
+  strlist_t sl;
+  int batch;
+  unsigned int nsigned = 0, nfailed = 0;
+
+  batch = !keydb_begin_batch ();
+
+  for (sl = fprs; sl; sl = sl->next)
+    {
+      if (quick_sign_key (ctrl, sl->d, NULL, locusr, local))
+        nfailed++;
+      else
+        nsigned++;
+    }
+
+  if (batch)
+    {
+      err = keydb_commit_batch ();
+      if (err)
+        log_error (_("update failed: %s\n"), gpg_strerror (err));
+    }
+
+  if (update_trust)
+    revalidation_mark (ctrl);
+
+  if (opt.verbose || nfailed)
+    log_info ("%u keys processed, %u skipped\n", nsigned, nfailed);
 }
 
 
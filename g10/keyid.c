@@ -246,6 +246,26 @@ do_fingerprint_md( PKT_public_key *pk )
 }
 
 
+/* Compute the fingerprint of PK and store it and the keyid in PK.  */
+static void
+compute_fingerprint (PKT_public_key *pk)
+{
+  const byte *dp;
+  size_t len;
+  gcry_md_hd_t md;
+
+  md = do_fingerprint_md (pk);
+  dp = gcry_md_read (md, 0);
+  len = gcry_md_get_algo_dlen (gcry_md_get_algo (md));
+  log_assert (len <= MAX_FINGERPRINT_LEN);
+  memcpy (pk->fpr, dp, len);
+  pk->fprlen = len;
+  pk->keyid[0] = buf32_to_u32 (dp+12);
+  pk->keyid[1] = buf32_to_u32 (dp+16);
+  gcry_md_close (md);
+}
+
+
 /* fixme: Check whether we can replace this function or if not
    describe why we need it.  */
 u32
@@ -511,22 +531,10 @@ keyid_from_pk (PKT_public_key *pk, u32 *keyid)
     }
   else
     {
-      const byte *dp;
-      gcry_md_hd_t md;
-
-      md = do_fingerprint_md(pk);
-      if(md)
-	{
-	  dp = gcry_md_read ( md, 0 );
-	  keyid[0] = buf32_to_u32 (dp+12);
-	  keyid[1] = buf32_to_u32 (dp+16);
-	  lowbits = keyid[1];
-	  gcry_md_close (md);
-	  pk->keyid[0] = keyid[0];
-	  pk->keyid[1] = keyid[1];
-	}
-      else
-	pk->keyid[0]=pk->keyid[1]=keyid[0]=keyid[1]=lowbits=0xFFFFFFFF;
+      compute_fingerprint (pk);
+      keyid[0] = pk->keyid[0];
+      keyid[1] = pk->keyid[1];
+      lowbits = keyid[1];
     }
 
   return lowbits;
@@ -768,23 +776,15 @@ colon_expirestr_from_sig (PKT_signature *sig)
 byte *
 fingerprint_from_pk (PKT_public_key *pk, byte *array, size_t *ret_len)
 {
-  const byte *dp;
-  size_t len;
-  gcry_md_hd_t md;
+  if (!pk->fprlen)
+    compute_fingerprint (pk);
 
-  md = do_fingerprint_md(pk);
-  dp = gcry_md_read( md, 0 );
-  len = gcry_md_get_algo_dlen (gcry_md_get_algo (md));
-  log_assert( len <= MAX_FINGERPRINT_LEN );
   if (!array)
-    array = xmalloc ( len );
-  memcpy (array, dp, len );
-  pk->keyid[0] = buf32_to_u32 (dp+12);
-  pk->keyid[1] = buf32_to_u32 (dp+16);
-  gcry_md_close( md);
+    array = xmalloc (pk->fprlen);
+  memcpy (array, pk->fpr, pk->fprlen);
 
   if (ret_len)
-    *ret_len = len;
+    *ret_len = pk->fprlen;
   return array;
 }
 
@@ -909,13 +909,20 @@ format_hexfingerprint (const char *fingerprint, char *buffer, size_t buflen)
 
 /* Return the so called KEYGRIP which is the SHA-1 hash of the public
    key parameters expressed as an canoncial encoded S-Exp.  ARRAY must
-   be 20 bytes long.  Returns 0 on success or an error code.  */
+   be 20 bytes long.  Returns 0 on success or an error code.  The
+   keygrip is cached in PK.  */
 gpg_error_t
 keygrip_from_pk (PKT_public_key *pk, unsigned char *array)
 {
   gpg_error_t err;
   gcry_sexp_t s_pkey;
 
+  if (pk->flags.keygrip_valid)
+    {
+      memcpy (array, pk->keygrip, KEYGRIP_LEN);
+      return 0;
+    }
+
   if (DBG_PACKET)
     log_debug ("get_keygrip for public key\n");
 
@@ -983,7 +990,8 @@ keygrip_from_pk (PKT_public_key *pk, unsigned char *array)
     {
       if (DBG_PACKET)
         log_printhex (array, 20, "keygrip=");
-      /* FIXME: Save the keygrip in PK.  */
+      memcpy (pk->keygrip, array, KEYGRIP_LEN);
+      pk->flags.keygrip_valid = 1;
     }
   gcry_sexp_release (s_pkey);
 
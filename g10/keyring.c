@@ -24,6 +24,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -35,8 +36,13 @@
 #include "options.h"
 #include "main.h" /*for check_key_signature()*/
 #include "../common/i18n.h"
+#include "../common/host2net.h"
 #include "../kbx/keybox.h"
 
+#if defined(HAVE_DOSISH_SYSTEM) && !defined(ftruncate)
+#define ftruncate chsize
+#endif
+
 
 typedef struct keyring_resource *KR_RESOURCE;
 struct keyring_resource
@@ -46,6 +52,8 @@ struct keyring_resource
   dotlock_t lockhd;
   int is_locked;
   int did_full_scan;
+  char *batch_fname;     /* The working copy during a batch or NULL.  */
+  char *batch_bakfname;  /* The name of the backup for BATCH_FNAME.  */
   char fname[1];
 };
 typedef struct keyring_resource const * CONST_KR_RESOURCE;
@@ -77,6 +85,11 @@ struct keyring_handle
 /* The number of extant handles.  */
 static int active_handles;
 
+/* Set while a batch of changes is in progress.  */
+static int batch_mode;
+
+static gpg_error_t start_working_copy (KR_RESOURCE kr);
+static gpg_error_t append_to_working_copy (KR_RESOURCE kr, KBNODE root);
 static int do_copy (int mode, const char *fname, KBNODE root,
                     off_t start_offset, unsigned int n_packets );
 
@@ -210,6 +223,8 @@ keyring_register_filename (const char *fname, int read_only, void **ptr)
     kr->lockhd = NULL;
     kr->is_locked = 0;
     kr->did_full_scan = 0;
+    kr->batch_fname = NULL;
+    kr->batch_bakfname = NULL;
     /* keep a list of all issued pointers */
     kr->next = kr_resources;
     kr_resources = kr;
@@ -233,6 +248,15 @@ keyring_is_writable (void *token)
 
 
 
+/* Return the name of the file to read the keyring KR from.  During a
+ * batch this is the working copy.  */
+static const char *
+kr_fname (CONST_KR_RESOURCE kr)
+{
+  return kr->batch_fname? kr->batch_fname : kr->fname;
+}
+
+
 /* Create a new handle for the resource associated with TOKEN.
    On error NULL is returned and ERRNO is set.
    The returned handle must be released using keyring_release (). */
@@ -393,22 +417,22 @@ keyring_get_keyblock (KEYRING_HANDLE hd, KBNODE *ret_kb)
     if (!hd->found.kr)
         return -1; /* no successful search */
 
-    a = iobuf_open (hd->found.kr->fname);
+    a = iobuf_open (kr_fname (hd->found.kr));
     if (!a)
       {
-	log_error(_("can't open '%s'\n"), hd->found.kr->fname);
+	log_error(_("can't open '%s'\n"), kr_fname (hd->found.kr));
 	return GPG_ERR_KEYRING_OPEN;
       }
 
     if (iobuf_seek (a, hd->found.offset) ) {
-        log_error ("can't seek '%s'\n", hd->found.kr->fname);
+        log_error ("can't seek '%s'\n", kr_fname (hd->found.kr));
 	iobuf_close(a);
 	return GPG_ERR_KEYRING_OPEN;
     }
 
-    pkt = xmalloc (sizeof *pkt);
-    init_packet (pkt);
+    pkt = alloc_packet_object ();
     init_parse_packet (&parsectx, a);
+    parsectx.lazy_sig_data = 1;
     hd->found.n_packets = 0;
     lastnode = NULL;
     save_mode = set_packet_list_mode(0);
@@ -497,8 +521,7 @@ keyring_get_keyblock (KEYRING_HANDLE hd, KBNODE *ret_kb)
             break;
           }
 
-        pkt = xmalloc (sizeof *pkt);
-        init_packet(pkt);
+        pkt = alloc_packet_object ();
     }
     set_packet_list_mode(save_mode);
 
@@ -512,7 +535,7 @@ keyring_get_keyblock (KEYRING_HANDLE hd, KBNODE *ret_kb)
     }
     free_packet (pkt, &parsectx);
     deinit_parse_packet (&parsectx);
-    xfree (pkt);
+    release_packet_object (pkt);
     iobuf_close(a);
 
     /* Make sure that future search operations fail immediately when
@@ -673,7 +696,7 @@ keyring_search_reset (KEYRING_HANDLE hd)
 
     if (hd->current.kr)
       iobuf_ioctl (NULL, IOBUF_IOCTL_INVALIDATE_CACHE, 0,
-                   (char*)hd->current.kr->fname);
+                   (char*)kr_fname (hd->current.kr));
     hd->current.kr = NULL;
 
     return 0;
@@ -740,11 +763,11 @@ prepare_search (KEYRING_HANDLE hd)
     }
 
     hd->current.eof = 0;
-    hd->current.iobuf = iobuf_open (hd->current.kr->fname);
+    hd->current.iobuf = iobuf_open (kr_fname (hd->current.kr));
     if (!hd->current.iobuf)
       {
         hd->current.error = gpg_error_from_syserror ();
-        log_error(_("can't open '%s'\n"), hd->current.kr->fname );
+        log_error(_("can't open '%s'\n"), kr_fname (hd->current.kr));
         return hd->current.error;
       }
 
@@ -1039,14 +1062,31 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
                    __func__, need_keyid);
       need_keyid = 1;
     }
-  else if (ndesc == 1 && desc[0].mode == KEYDB_SEARCH_MODE_LONG_KID)
+  else if (ndesc == 1
+           && (desc[0].mode == KEYDB_SEARCH_MODE_LONG_KID
+               || ((desc[0].mode == KEYDB_SEARCH_MODE_FPR20
+                    || desc[0].mode == KEYDB_SEARCH_MODE_FPR)
+                   /* A v3 fingerprint is padded with zeroes.  */
+                   && buf32_to_u32 (desc[0].u.fpr+16))))
     {
       struct key_present *oi;
+      u32 kid[2];
 
       if (DBG_LOOKUP)
         log_debug ("%s: look up by long key id, checking cache\n", __func__);
 
-      oi = key_present_hash_lookup (key_present_hash, desc[0].u.kid);
+      /* The keyid of a v4 key is the low 64 bits of its fingerprint.  */
+      if (desc[0].mode == KEYDB_SEARCH_MODE_LONG_KID)
+        {
+          kid[0] = desc[0].u.kid[0];
+          kid[1] = desc[0].u.kid[1];
+        }
+      else
+        {
+          kid[0] = buf32_to_u32 (desc[0].u.fpr+12);
+          kid[1] = buf32_to_u32 (desc[0].u.fpr+16);
+        }
+      oi = key_present_hash_lookup (key_present_hash, kid);
       if (!oi)
         { /* We know that we don't have this key */
           if (DBG_LOOKUP)
@@ -1103,7 +1143,9 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       byte afp[MAX_FINGERPRINT_LEN];
       size_t an;
 
-      rc = search_packet (&parsectx, &pkt, &offset, need_uid);
+      /* Searches which do not need the user ids only compare the
+       * fingerprint or keyid and thus we skim the key packets.  */
+      rc = search_packet (&parsectx, &pkt, &offset, need_uid? 1 : -1);
       if (ignore_legacy && gpg_err_code (rc) == GPG_ERR_LEGACY_KEY)
         {
           free_packet (&pkt, &parsectx);
@@ -1605,12 +1647,30 @@ do_copy (int mode, const char *fname, KBNODE root,
     int rc=0;
     char *bakfname = NULL;
     char *tmpfname = NULL;
+    KR_RESOURCE kr = NULL;
 
     /* Open the source file. Because we do a rename, we have to check the
        permissions of the file */
     if (access (fname, W_OK))
       return gpg_error_from_syserror ();
 
+    /* During a batch all changes are done on the working copy.  */
+    if (batch_mode)
+      {
+        for (kr = kr_resources; kr; kr = kr->next)
+          if (kr->fname == fname)
+            break;
+        if (kr)
+          {
+            rc = start_working_copy (kr);
+            if (rc)
+              return rc;
+            if (mode == 1)
+              return append_to_working_copy (kr, root);
+            fname = kr->batch_fname;
+          }
+      }
+
     fp = iobuf_open (fname);
     if (mode == 1 && !fp && errno == ENOENT) {
 	/* insert mode but file does not exist: create a new file */
@@ -1732,10 +1792,178 @@ do_copy (int mode, const char *fname, KBNODE root,
 	goto leave;
     }
 
-    rc = rename_tmp_file (bakfname, tmpfname, fname);
+    if (kr)
+      {
+        /* No backup is needed for the working copy.  */
+        iobuf_ioctl (NULL, IOBUF_IOCTL_INVALIDATE_CACHE, 0, (char*)tmpfname);
+        iobuf_ioctl (NULL, IOBUF_IOCTL_INVALIDATE_CACHE, 0, (char*)fname);
+        rc = gnupg_rename_file (tmpfname, fname, NULL);
+      }
+    else
+      rc = rename_tmp_file (bakfname, tmpfname, fname);
 
   leave:
     xfree(bakfname);
     xfree(tmpfname);
     return rc;
 }
+
+
+/* Create the working copy of the keyring KR for a batch if it does
+ * not yet exist.  */
+static gpg_error_t
+start_working_copy (KR_RESOURCE kr)
+{
+  gpg_error_t err;
+  IOBUF fp, newfp;
+  char *bakfname, *tmpfname;
+
+  if (kr->batch_fname)
+    return 0;
+
+  fp = iobuf_open (kr->fname);
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't open '%s': %s\n"), kr->fname, gpg_strerror (err));
+      return err;
+    }
+
+  err = create_tmp_file (kr->fname, &bakfname, &tmpfname, &newfp);
+  if (err)
+    {
+      iobuf_close (fp);
+      return err;
+    }
+
+  err = copy_all_packets (fp, newfp);
+  iobuf_close (fp);
+  if (err != -1)
+    {
+      log_error ("%s: copy to '%s' failed: %s\n",
+                 kr->fname, tmpfname, gpg_strerror (err));
+      iobuf_cancel (newfp);
+      goto leave;
+    }
+  if (iobuf_close (newfp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("%s: close failed: %s\n", tmpfname, gpg_strerror (err));
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+
+  kr->batch_fname = tmpfname;
+  kr->batch_bakfname = bakfname;
+  return 0;
+
+ leave:
+  xfree (bakfname);
+  xfree (tmpfname);
+  return err;
+}
+
+
+/* Drop the working copy of the keyring KR.  The keyring itself stays
+ * unchanged.  */
+static void
+drop_working_copy (KR_RESOURCE kr)
+{
+  iobuf_ioctl (NULL, IOBUF_IOCTL_INVALIDATE_CACHE, 0, kr->batch_fname);
+  gnupg_remove (kr->batch_fname);
+  xfree (kr->batch_fname);
+  kr->batch_fname = NULL;
+  xfree (kr->batch_bakfname);
+  kr->batch_bakfname = NULL;
+}
+
+
+/* Append the keyblock ROOT to the working copy of KR.  */
+static gpg_error_t
+append_to_working_copy (KR_RESOURCE kr, KBNODE root)
+{
+  gpg_error_t err;
+  IOBUF fp;
+  off_t length;
+  int fd;
+
+  iobuf_ioctl (NULL, IOBUF_IOCTL_INVALIDATE_CACHE, 0, kr->batch_fname);
+  fp = iobuf_openrw (kr->batch_fname);
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't open '%s': %s\n"),
+                 kr->batch_fname, gpg_strerror (err));
+      return err;
+    }
+
+  length = iobuf_get_filelength (fp, NULL);
+  if (iobuf_seek (fp, length))
+    err = gpg_error (GPG_ERR_GENERAL);
+  else
+    err = write_keyblock (fp, root);
+  if (iobuf_close (fp) && !err)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("%s: close failed: %s\n", kr->batch_fname, gpg_strerror (err));
+    }
+  iobuf_ioctl (NULL, IOBUF_IOCTL_INVALIDATE_CACHE, 0, kr->batch_fname);
+  if (!err)
+    return 0;
+
+  /* Remove the partly written keyblock.  If that is not possible we
+   * need to give up the batch because the working copy is corrupt.  */
+  fd = open (kr->batch_fname, O_WRONLY);
+  if (fd == -1 || ftruncate (fd, length))
+    {
+      log_error ("%s: error truncating file: %s\n",
+                 kr->batch_fname, strerror (errno));
+      drop_working_copy (kr);
+    }
+  if (fd != -1)
+    close (fd);
+  return err;
+}
+
+
+/* Start a batch of changes.  Until keyring_commit_batch is called all
+ * changes are done on a working copy of the keyring, which is created
+ * by the first change.  The caller must hold the lock on the keyrings
+ * for the entire batch.  */
+void
+keyring_begin_batch (void)
+{
+  batch_mode = 1;
+}
+
+
+/* Finish a batch of changes by replacing each changed keyring by its
+ * working copy.  */
+gpg_error_t
+keyring_commit_batch (void)
+{
+  gpg_error_t err = 0;
+  gpg_error_t rc;
+  KR_RESOURCE kr;
+
+  batch_mode = 0;
+  for (kr = kr_resources; kr; kr = kr->next)
+    {
+      if (!kr->batch_fname)
+        continue;
+      rc = rename_tmp_file (kr->batch_bakfname, kr->batch_fname, kr->fname);
+      if (rc)
+        {
+          log_error ("%s: can't commit changes: %s\n",
+                     kr->fname, gpg_strerror (rc));
+          if (!err)
+            err = rc;
+        }
+      xfree (kr->batch_fname);
+      kr->batch_fname = NULL;
+      xfree (kr->batch_bakfname);
+      kr->batch_bakfname = NULL;
+    }
+
+  return err;
+}
@@ -41,5 +41,7 @@ int keyring_search_reset (KEYRING_HANDLE hd);
 int keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
 		    size_t ndesc, size_t *descindex, int skip_legacy);
 int keyring_rebuild_cache (ctrl_t ctrl, void *token,int noisy);
+void keyring_begin_batch (void);
+gpg_error_t keyring_commit_batch (void);
 
 #endif /*GPG_KEYRING_H*/
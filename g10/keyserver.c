@@ -89,6 +89,8 @@ static struct parse_options keyserver_opts[]=
     {"max-cert-size",0,NULL,NULL},  /* MUST be the first in this array! */
     {"http-proxy", KEYSERVER_HTTP_PROXY, NULL, /* MUST be the second!  */
      N_("override proxy options set for dirmngr")},
+    {"refresh-max-keys", 0, NULL,               /* MUST be the third!  */
+     N_("refresh only the N least recently updated keys")},
 
     {"include-revoked",0,NULL,N_("include revoked keys in search results")},
     {"include-subkeys",0,NULL,N_("include subkeys when searching by key ID")},
@@ -117,8 +119,17 @@ static gpg_error_t keyserver_put (ctrl_t ctrl, strlist_t keyspecs);
    is larger than 32k, thus we need at least this value. */
 #define DEFAULT_MAX_CERT_SIZE 65536
 
+/* The maximum number of keys and bytes sent to an HKP keyserver with
+   one request.  */
+#define KS_PUT_BATCH_KEYS 100
+#define KS_PUT_BATCH_SIZE (1024*1024)
+
 static size_t max_cert_size=DEFAULT_MAX_CERT_SIZE;
 
+/* The maximum number of keys to refresh with one --refresh-keys or 0
+   for no limit.  */
+static unsigned int refresh_max_keys;
+
 
 static void
 warn_kshelper_option(char *option, int noisy)
@@ -147,9 +158,11 @@ parse_keyserver_options(char *options)
   int ret=1;
   char *tok;
   char *max_cert=NULL;
+  char *max_refresh=NULL;
 
   keyserver_opts[0].value=&max_cert;
   keyserver_opts[1].value=&opt.keyserver_options.http_proxy;
+  keyserver_opts[2].value=&max_refresh;
 
   while((tok=optsep(&options)))
     {
@@ -178,6 +191,9 @@ parse_keyserver_options(char *options)
 	max_cert_size=DEFAULT_MAX_CERT_SIZE;
     }
 
+  if(max_refresh)
+    refresh_max_keys=strtoul(max_refresh,(char **)NULL,10);
+
   return ret;
 }
 
@@ -1197,10 +1213,12 @@ keyserver_import_keyid (ctrl_t ctrl,
 }
 
 
-/* code mostly stolen from do_export_stream */
+/* code mostly stolen from do_export_stream.  If R_KEYUPDATE is not
+   NULL an array with the time of the last update of the key for each
+   item of KLIST is stored there.  */
 static int
 keyidlist (ctrl_t ctrl, strlist_t users, KEYDB_SEARCH_DESC **klist,
-           int *count, int fakev3)
+           u32 **r_keyupdate, int *count, int fakev3)
 {
   int rc = 0;
   int num = 100;
@@ -1214,6 +1232,8 @@ keyidlist (ctrl_t ctrl, strlist_t users, KEYDB_SEARCH_DESC **klist,
   *count=0;
 
   *klist=xmalloc(sizeof(KEYDB_SEARCH_DESC)*num);
+  if (r_keyupdate)
+    *r_keyupdate=xmalloc(sizeof(u32)*num);
 
   kdbhd = keydb_new ();
   if (!kdbhd)
@@ -1278,12 +1298,17 @@ keyidlist (ctrl_t ctrl, strlist_t users, KEYDB_SEARCH_DESC **klist,
 	      (*klist)[*count].mode=KEYDB_SEARCH_MODE_LONG_KID;
 	      v3_keyid (node->pkt->pkt.public_key->pkey[0],
                         (*klist)[*count].u.kid);
+	      (*klist)[*count].skipfncvalue=NULL;
+	      if (r_keyupdate)
+		(*r_keyupdate)[*count]=node->pkt->pkt.public_key->keyupdate;
 	      (*count)++;
 
 	      if(*count==num)
 		{
 		  num+=100;
 		  *klist=xrealloc(*klist,sizeof(KEYDB_SEARCH_DESC)*num);
+		  if (r_keyupdate)
+		    *r_keyupdate=xrealloc(*r_keyupdate,sizeof(u32)*num);
 		}
 	    }
 
@@ -1313,6 +1338,8 @@ keyidlist (ctrl_t ctrl, strlist_t users, KEYDB_SEARCH_DESC **klist,
 	     time). */
 
 	  (*klist)[*count].skipfncvalue=NULL;
+	  if (r_keyupdate)
+	    (*r_keyupdate)[*count]=node->pkt->pkt.public_key->keyupdate;
 
 	  /* Are we honoring preferred keyservers? */
 	  if(opt.keyserver_options.options&KEYSERVER_HONOR_KEYSERVER_URL)
@@ -1349,6 +1376,8 @@ keyidlist (ctrl_t ctrl, strlist_t users, KEYDB_SEARCH_DESC **klist,
 	    {
 	      num+=100;
 	      *klist=xrealloc(*klist,sizeof(KEYDB_SEARCH_DESC)*num);
+	      if (r_keyupdate)
+		*r_keyupdate=xrealloc(*r_keyupdate,sizeof(u32)*num);
 	    }
 	}
     }
@@ -1361,6 +1390,11 @@ keyidlist (ctrl_t ctrl, strlist_t users, KEYDB_SEARCH_DESC **klist,
     {
       xfree(*klist);
       *klist = NULL;
+      if (r_keyupdate)
+        {
+          xfree (*r_keyupdate);
+          *r_keyupdate = NULL;
+        }
     }
   xfree(desc);
   keydb_release(kdbhd);
@@ -1369,8 +1403,57 @@ keyidlist (ctrl_t ctrl, strlist_t users, KEYDB_SEARCH_DESC **klist,
   return rc;
 }
 
+/* Helper for sort_by_keyupdate.  */
+struct refresh_item_s
+{
+  KEYDB_SEARCH_DESC desc;
+  u32 keyupdate;
+  int idx;
+};
+
+static int
+cmp_refresh_items (const void *a_arg, const void *b_arg)
+{
+  const struct refresh_item_s *a = a_arg;
+  const struct refresh_item_s *b = b_arg;
+
+  if (a->keyupdate != b->keyupdate)
+    return a->keyupdate < b->keyupdate? -1 : 1;
+  return a->idx - b->idx;  /* Keep the keyring order.  */
+}
+
+
+/* Sort the NDESC items of DESC so that the keys which have not been
+   updated for the longest time come first.  KEYUPDATE has the time
+   of the last update for each item; 0 means never.  */
+static void
+sort_by_keyupdate (KEYDB_SEARCH_DESC *desc, const u32 *keyupdate, int ndesc)
+{
+  struct refresh_item_s *items;
+  int i;
+
+  items = xtrymalloc (ndesc * sizeof *items);
+  if (!items)
+    return;  /* Not sorting is okay.  */
+  for (i=0; i < ndesc; i++)
+    {
+      items[i].desc = desc[i];
+      items[i].keyupdate = keyupdate[i];
+      items[i].idx = i;
+    }
+  qsort (items, ndesc, sizeof *items, cmp_refresh_items);
+  for (i=0; i < ndesc; i++)
+    desc[i] = items[i].desc;
+  xfree (items);
+}
+
+
 /* Note this is different than the original HKP refresh.  It allows
-   usernames to refresh only part of the keyring. */
+   usernames to refresh only part of the keyring.  The keys which
+   have not been updated for the longest time are requested first.
+   With the keyserver option refresh-max-keys only that many of them
+   are requested; by running such a refresh regularly all keys are
+   refreshed at a steady rate. */
 
 gpg_error_t
 keyserver_refresh (ctrl_t ctrl, strlist_t users)
@@ -1379,6 +1462,7 @@ keyserver_refresh (ctrl_t ctrl, strlist_t users)
   int count, numdesc;
   int fakev3 = 0;
   KEYDB_SEARCH_DESC *desc;
+  u32 *keyupdate;
   unsigned int options=opt.keyserver_options.import_options;
 
   /* We switch merge-only on during a refresh, as 'refresh' should
@@ -1403,9 +1487,31 @@ keyserver_refresh (ctrl_t ctrl, strlist_t users)
 	 ascii_strcasecmp(opt.keyserver->scheme,"mailto")==0))
     fakev3=1;
 
-  err = keyidlist (ctrl, users, &desc, &numdesc, fakev3);
+  err = keyidlist (ctrl, users, &desc, &keyupdate, &numdesc, fakev3);
   if (err)
-    return err;
+    {
+      opt.keyserver_options.import_options=options;
+      return err;
+    }
+
+  sort_by_keyupdate (desc, keyupdate, numdesc);
+  xfree (keyupdate);
+  if (refresh_max_keys && numdesc > refresh_max_keys)
+    {
+      int i;
+
+      if (opt.verbose)
+        log_info ("refreshing only %u of %d keys\n",
+                  refresh_max_keys, numdesc);
+      for (i=refresh_max_keys; i < numdesc; i++)
+        if (desc[i].skipfncvalue)
+          free_keyserver_spec (desc[i].skipfncvalue);
+      numdesc = refresh_max_keys;
+
+      /* Record the refresh even for unchanged keys so that the next
+         run continues with the next keys.  */
+      opt.keyserver_options.import_options|=IMPORT_MARK_REFRESHED;
+    }
 
   count=numdesc;
   if(count>0)
@@ -1801,7 +1907,38 @@ keyserver_get (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
 }
 
 
-/* Send all keys specified by KEYSPECS to the configured keyserver.  */
+/* Send the batch of keys collected in MB to the keyserver.  */
+static gpg_error_t
+keyserver_put_batch (ctrl_t ctrl, membuf_t *mb, int nkeys)
+{
+  gpg_error_t err;
+  void *data;
+  size_t datalen;
+
+  data = get_membuf (mb, &datalen);
+  if (!data)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      if (opt.verbose > 1)
+        log_info ("sending %d keys in one request\n", nkeys);
+      err = gpg_dirmngr_ks_put (ctrl, data, datalen, NULL);
+      xfree (data);
+    }
+  if (err)
+    {
+      write_status_error ("keyserver_send", err);
+      log_error (_("keyserver send failed: %s\n"), gpg_strerror (err));
+    }
+  return err;
+}
+
+
+/* Send all keys specified by KEYSPECS to the configured keyserver.
+ * An HKP keyserver accepts several keys with one request.  The keys
+ * are thus sent in batches of up to KS_PUT_BATCH_KEYS keys or
+ * KS_PUT_BATCH_SIZE bytes.  Other keyservers, like LDAP, need the
+ * meta data of each key and get them one by one.  */
 static gpg_error_t
 keyserver_put (ctrl_t ctrl, strlist_t keyspecs)
 
@@ -1809,6 +1946,9 @@ keyserver_put (ctrl_t ctrl, strlist_t keyspecs)
   gpg_error_t err;
   strlist_t kspec;
   char *ksurl;
+  int batch;
+  membuf_t mb;
+  int nbatch = 0;
 
   if (!keyspecs)
     return 0;  /* Return success if the list is empty.  */
@@ -1819,6 +1959,12 @@ keyserver_put (ctrl_t ctrl, strlist_t keyspecs)
       return gpg_error (GPG_ERR_NO_KEYSERVER);
     }
 
+  batch = (ksurl && keyspecs->next
+           && (!ascii_strncasecmp (ksurl, "hkp", 3)
+               || !ascii_strncasecmp (ksurl, "http", 4)));
+  if (batch)
+    init_membuf (&mb, 64*1024);
+
   for (kspec = keyspecs; kspec; kspec = kspec->next)
     {
       void *data;
@@ -1837,6 +1983,26 @@ keyserver_put (ctrl_t ctrl, strlist_t keyspecs)
                     keystr (keyblock->pkt->pkt.public_key->keyid),
                     ksurl?ksurl:"[?]");
 
+          if (batch)
+            {
+              release_kbnode (keyblock);
+              if (nbatch && get_membuf_len (&mb) + datalen > KS_PUT_BATCH_SIZE)
+                {
+                  err = keyserver_put_batch (ctrl, &mb, nbatch);
+                  init_membuf (&mb, 64*1024);
+                  nbatch = 0;
+                }
+              put_membuf (&mb, data, datalen);
+              xfree (data);
+              if (++nbatch == KS_PUT_BATCH_KEYS)
+                {
+                  err = keyserver_put_batch (ctrl, &mb, nbatch);
+                  init_membuf (&mb, 64*1024);
+                  nbatch = 0;
+                }
+              continue;
+            }
+
           err = gpg_dirmngr_ks_put (ctrl, data, datalen, keyblock);
           release_kbnode (keyblock);
           xfree (data);
@@ -1848,6 +2014,14 @@ keyserver_put (ctrl_t ctrl, strlist_t keyspecs)
         }
     }
 
+  if (batch)
+    {
+      if (nbatch)
+        err = keyserver_put_batch (ctrl, &mb, nbatch);
+      else
+        xfree (get_membuf (&mb, NULL));
+    }
+
   xfree (ksurl);
 
   return err;
@@ -58,6 +58,10 @@
 
 #define S2K_DIGEST_ALGO (opt.s2k_digest_algo?opt.s2k_digest_algo:DEFAULT_S2K_DIGEST_ALGO)
 
+/* Data which is encrypted or decrypted and also hashed is processed
+ * in chunks of this size so that both passes hit the L1 cache.  */
+#define CRYPT_CHUNK_SIZE 8192
+
 
 /* Various data objects.  */
 
@@ -202,6 +206,8 @@ unsigned int ecdsa_qbits_from_Q (unsigned int qbits);
 
 /*-- cpr.c --*/
 void set_status_fd ( int fd );
+void set_status_buffered (void);
+void status_flush (void);
 int  is_status_enabled ( void );
 void write_status ( int no );
 void write_status_error (const char *where, gpg_error_t err);
@@ -262,9 +268,12 @@ int sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 int clearsign_file (ctrl_t ctrl,
                     const char *fname, strlist_t locusr, const char *outfile);
 int sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr);
+void hash_uid (gcry_md_hd_t md, int sigversion, const PKT_user_id *uid);
+void hash_sigversion_to_magic (gcry_md_hd_t md, const PKT_signature *sig);
 
 /*-- sig-check.c --*/
 void sig_check_dump_stats (void);
+void sig_check_stats_report (stats_sink_t sink);
 
 /* SIG is a revocation signature.  Check if any of PK's designated
    revokers generated it.  If so, return 0.  Note: this function
@@ -299,6 +308,24 @@ gpg_error_t check_signature_over_key_or_uid (ctrl_t ctrl,
                                              int *is_selfsig,
                                              PKT_public_key *ret_pk);
 
+/* Check the self-signatures of KEYBLOCK in parallel and cache the
+   results in the signature packets.  */
+void check_self_sigs_parallel (kbnode_t keyblock);
+void check_self_sigs_batch (kbnode_t *keyblocks, int nkeyblocks);
+
+/* Check the user id certifications by keys in KLIST of several
+   keyblocks in parallel and cache the results.  */
+void check_uid_certs_parallel (ctrl_t ctrl, kbnode_t *keyblocks,
+                               int nkeyblocks, struct key_item *klist);
+
+/*-- sigcache.c --*/
+#define SIGCACHE_KEYLEN 32
+gpg_error_t sigcache_lookup (const byte *key);
+void sigcache_store (const byte *key, gpg_error_t rc);
+void sigcache_flush (void);
+void sigcache_dump_stats (void);
+void sigcache_stats_report (stats_sink_t sink);
+
 
 /*-- delkey.c --*/
 gpg_error_t delete_keys (ctrl_t ctrl,
@@ -383,14 +410,15 @@ gpg_error_t import_old_secring (ctrl_t ctrl, const char *fname);
 import_stats_t import_new_stats_handle (void);
 void import_release_stats_handle (import_stats_t hd);
 void import_print_stats (import_stats_t hd);
-/* Communication for impex_filter_getval */
+/* Communication for impex_filter_getval_id */
 struct impex_filter_parm_s
 {
   ctrl_t ctrl;
   kbnode_t node;
 };
 
-const char *impex_filter_getval (void *cookie, const char *propname);
+int impex_filter_propid (const char *propname);
+const char *impex_filter_getval_id (void *cookie, int propid);
 gpg_error_t transfer_secret_keys (ctrl_t ctrl, struct import_stats_s *stats,
                                   kbnode_t sec_keyblock, int batch, int force);
 
@@ -477,6 +505,9 @@ void print_key_line (ctrl_t ctrl, estream_t fp, PKT_public_key *pk, int secret);
 void print_file_status( int status, const char *name, int what );
 int verify_signatures (ctrl_t ctrl, int nfiles, char **files );
 int verify_files (ctrl_t ctrl, int nfiles, char **files );
+int verify_signature_list (ctrl_t ctrl, const char *listfile);
+int verify_detached_signatures (ctrl_t ctrl, const char *datafile,
+                                int nsigs, char **sigfiles);
 int gpg_verify (ctrl_t ctrl, int sig_fd, int data_fd, estream_t out_fp);
 
 /*-- decrypt.c --*/
@@ -505,6 +536,35 @@ gpg_error_t  card_generate_subkey (ctrl_t ctrl, kbnode_t pub_keyblock);
 int  card_store_subkey (KBNODE node, int use);
 #endif
 
+/*-- workpool.c --*/
+typedef struct workpool_s *workpool_t;
+
+/* A job for a workpool.  Callers usually embed this object into their
+ * own job description.  */
+struct workpool_job_s
+{
+  struct workpool_job_s *next;  /* Used internally.  */
+  void (*func) (void *opaque);  /* The function doing the job.  */
+  void *opaque;                 /* Its argument.  */
+  unsigned int done:1;          /* Set when FUNC has returned.  */
+};
+typedef struct workpool_job_s *workpool_job_t;
+
+gpg_error_t workpool_new (workpool_t *r_pool, int nthreads);
+void workpool_release (workpool_t pool);
+gpg_error_t workpool_get_shared (workpool_t *r_pool);
+int  workpool_nthreads (workpool_t pool);
+void workpool_submit (workpool_t pool, workpool_job_t job);
+void workpool_wait (workpool_t pool, workpool_job_t job);
+
+/*-- iothread.c --*/
+typedef struct io_thread_s *write_behind_t;
+void push_read_ahead_filter (iobuf_t a);
+gpg_error_t write_behind_new (write_behind_t *r_wb, estream_t fp);
+gpg_error_t write_behind_write (write_behind_t wb,
+                                const void *data, size_t length);
+gpg_error_t write_behind_close (write_behind_t wb);
+
 #define S2K_DECODE_COUNT(_val) ((16ul + ((_val) & 15)) << (((_val) >> 4) + 6))
 
 /*-- migrate.c --*/
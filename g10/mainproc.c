@@ -69,6 +69,7 @@ struct mainproc_context
   md_filter_context_t mfx;
   int sigs_only;    /* Process only signatures and reject all other stuff. */
   int encrypt_only; /* Process only encryption messages. */
+  int multi_message; /* The input may be a concatenation of messages. */
 
   /* Name of the file with the complete signature or the file with the
      detached signature.  This is currently only used to deduce the
@@ -96,6 +97,8 @@ struct mainproc_context
   int trustletter;  /* Temporary usage in list_node. */
   ulong symkeys;    /* Number of symmetrically encrypted session keys.  */
   struct kidlist_item *pkenc_list; /* List of encryption packets. */
+  /* List of encryption packets not yet tried.  */
+  struct pubkey_enc_list *pkenc_pending;
   struct {
     unsigned int sig_seen:1;      /* Set to true if a signature packet
                                      has been seen. */
@@ -115,6 +118,7 @@ static int literals_seen;
 static int do_proc_packets (ctrl_t ctrl, CTX c, iobuf_t a);
 static void list_node (CTX c, kbnode_t node);
 static void proc_tree (CTX c, kbnode_t node);
+static void proc_pending_pubkey_enc (CTX c);
 
 
 /*** Functions.  ***/
@@ -140,6 +144,13 @@ release_list( CTX c )
       c->pkenc_list = tmp;
     }
   c->pkenc_list = NULL;
+  while (c->pkenc_pending)
+    {
+      struct pubkey_enc_list *tmp = c->pkenc_pending->next;
+      free_pubkey_enc (c->pkenc_pending->enc);
+      xfree (c->pkenc_pending);
+      c->pkenc_pending = tmp;
+    }
   c->list = NULL;
   c->any.data = 0;
   c->any.uncompress_failed = 0;
@@ -149,11 +160,69 @@ release_list( CTX c )
 }
 
 
+/* Return true if the list of C has the marker of a plaintext.  */
+static int
+list_has_plaintext (CTX c)
+{
+  kbnode_t n;
+
+  for (n = c->list; n; n = n->next)
+    if (n->pkt->pkttype == PKT_GPG_CONTROL
+        && n->pkt->pkt.gpg_control->control == CTRLPKT_PLAINTEXT_MARK)
+      return 1;
+  return 0;
+}
+
+
+/* Return true if the packets in the list of C make up a complete
+ * signed message, that is a one-pass signed "O{1,n} P S{1,n}" or an
+ * old style "S{1,n} P" message.  This is used to process each message
+ * of a concatenation as soon as its last packet has been read.  */
+static int
+message_complete (CTX c)
+{
+  kbnode_t n;
+  int n_onepass = 0;
+  int n_sig = 0;
+
+  if (!c->list || !list_has_plaintext (c))
+    return 0;
+
+  if (c->list->pkt->pkttype != PKT_ONEPASS_SIG)
+    return c->list->pkt->pkttype == PKT_SIGNATURE;
+
+  for (n = c->list; n; n = n->next)
+    {
+      if (n->pkt->pkttype == PKT_ONEPASS_SIG)
+        n_onepass++;
+      else if (n->pkt->pkttype == PKT_SIGNATURE)
+        n_sig++;
+    }
+  return n_sig >= n_onepass;
+}
+
+
+/* Process the message in the list of C and prepare C for the next
+ * message of a concatenation.  */
+static void
+finish_message (CTX c)
+{
+  release_list (c);
+  free_md_filter_context (&c->mfx);
+  reset_literals_seen ();
+}
+
+
 static int
 add_onepass_sig (CTX c, PACKET *pkt)
 {
   kbnode_t node;
 
+  /* A one-pass signature after the plaintext starts a new message;
+   * this happens after a clear text signature.  */
+  if (c->multi_message && c->list && list_has_plaintext (c))
+    finish_message (c);
+
   if (c->list) /* Add another packet. */
     add_kbnode (c->list, new_kbnode (pkt));
   else /* Insert the first one.  */
@@ -170,7 +239,10 @@ add_gpg_control (CTX c, PACKET *pkt)
     {
       /* New clear text signature.
        * Process the last one and reset everything */
-      release_list(c);
+      if (c->multi_message)
+        finish_message (c);
+      else
+        release_list(c);
     }
 
   if (c->list)  /* Add another packet.  */
@@ -363,6 +435,10 @@ proc_symkey_enc (CTX c, PACKET *pkt)
   gpg_error_t err;
   PKT_symkey_enc *enc;
 
+  /* Try the public key encrypted packets first so that we do not ask
+   * for a passphrase if a secret key is available.  */
+  proc_pending_pubkey_enc (c);
+
   enc = pkt->pkt.symkey_enc;
   if (!enc)
     log_error ("invalid symkey encrypted packet\n");
@@ -503,9 +579,10 @@ proc_pubkey_enc (ctrl_t ctrl, CTX c, PACKET *pkt)
          There are still a couple of those keys in active use as a
          subkey.  */
 
-      /* FIXME: Store this all in a list and process it later so that
-         we can prioritize what key to use.  This gives a better user
-         experience if wildcard keyids are used.  */
+      /* The packets are stored in a list and processed by
+         proc_pending_pubkey_enc so that we can prioritize what key to
+         use.  This gives a better user experience if wildcard keyids
+         are used.  */
       if  (!c->dek && ((!enc->keyid[0] && !enc->keyid[1])
                        || opt.try_all_secrets
                        || have_secret_key_with_kid (enc->keyid)))
@@ -514,13 +591,18 @@ proc_pubkey_enc (ctrl_t ctrl, CTX c, PACKET *pkt)
             result = GPG_ERR_MISSING_ACTION; /* fixme: Use better error code. */
           else
             {
-              c->dek = xmalloc_secure_clear (sizeof *c->dek);
-              if ((result = get_session_key (ctrl, enc, c->dek)))
-                {
-                  /* Error: Delete the DEK. */
-                  xfree (c->dek);
-                  c->dek = NULL;
-		}
+              /* Keep the packet so that we can try all packets at
+               * once with the encrypted data.  */
+              struct pubkey_enc_list *item, **tail;
+
+              item = xmalloc_clear (sizeof *item);
+              item->enc = enc;
+              pkt->pkt.pubkey_enc = NULL;
+              for (tail = &c->pkenc_pending; *tail; tail = &(*tail)->next)
+                ;
+              *tail = item;
+              free_packet (pkt, NULL);
+              return;
 	    }
 	}
       else
@@ -548,6 +630,55 @@ proc_pubkey_enc (ctrl_t ctrl, CTX c, PACKET *pkt)
 }
 
 
+/* Try to get the session key from the pending public key encrypted
+ * packets and move them to the list for display.  */
+static void
+proc_pending_pubkey_enc (CTX c)
+{
+  struct pubkey_enc_list *item;
+  struct kidlist_item *x;
+
+  if (!c->pkenc_pending)
+    return;
+
+  if (!c->dek)
+    {
+      c->dek = xmalloc_secure_clear (sizeof *c->dek);
+      if (get_session_key_from_list (c->ctrl, c->pkenc_pending, c->dek))
+        {
+          /* Error: Delete the DEK. */
+          xfree (c->dek);
+          c->dek = NULL;
+        }
+    }
+  else
+    {
+      for (item = c->pkenc_pending; item; item = item->next)
+        item->result = GPG_ERR_NO_SECKEY;
+    }
+
+  while ((item = c->pkenc_pending))
+    {
+      c->pkenc_pending = item->next;
+
+      /* Store it for later display.  */
+      x = xmalloc (sizeof *x);
+      x->kid[0] = item->enc->keyid[0];
+      x->kid[1] = item->enc->keyid[1];
+      x->pubkey_algo = item->enc->pubkey_algo;
+      x->reason = item->result;
+      x->next = c->pkenc_list;
+      c->pkenc_list = x;
+
+      if (!item->result && opt.verbose > 1)
+        log_info (_("public key encrypted data: good DEK\n"));
+
+      free_pubkey_enc (item->enc);
+      xfree (item);
+    }
+}
+
+
 /*
  * Print the list of public key encrypted packets which we could
  * not decrypt.
@@ -624,6 +755,8 @@ proc_encrypted (CTX c, PACKET *pkt)
       /* We fail only later so that we can print some more info first.  */
     }
 
+  proc_pending_pubkey_enc (c);
+
   if (!opt.quiet)
     {
       if (c->symkeys>1)
@@ -634,8 +767,6 @@ proc_encrypted (CTX c, PACKET *pkt)
       print_pkenc_list (c->ctrl, c->pkenc_list, 0 );
     }
 
-  /* FIXME: Figure out the session key by looking at all pkenc packets. */
-
   write_status (STATUS_BEGIN_DECRYPTION);
 
   /*log_debug("dat: %sencrypted data\n", c->dek?"":"conventional ");*/
@@ -1138,8 +1269,16 @@ do_check_sig (CTX c, kbnode_t node, int *is_selfsig,
   if (md_good)
     {
       unsigned char *buffer = gcry_md_read (md_good, sig->digest_algo);
-      sig->digest_len = gcry_md_get_algo_dlen (map_md_openpgp_to_gcry (algo));
-      memcpy (sig->digest, buffer, sig->digest_len);
+      unsigned int len = gcry_md_get_algo_dlen (map_md_openpgp_to_gcry (algo));
+
+      xfree (sig->digest);
+      sig->digest_len = 0;
+      sig->digest = xtrymalloc (len);
+      if (sig->digest)
+        {
+          memcpy (sig->digest, buffer, len);
+          sig->digest_len = len;
+        }
     }
 
   gcry_md_close (md);
@@ -1384,6 +1523,7 @@ proc_signature_packets (ctrl_t ctrl, void *anchor, iobuf_t a,
   c->ctrl = ctrl;
   c->anchor = anchor;
   c->sigs_only = 1;
+  c->multi_message = anchor && ((CTX)anchor)->multi_message;
 
   c->signed_data.data_fd = -1;
   c->signed_data.data_names = signedfiles;
@@ -1414,6 +1554,36 @@ proc_signature_packets (ctrl_t ctrl, void *anchor, iobuf_t a,
 }
 
 
+/* Verify the input A which may be a concatenation of signed messages,
+ * for example an mbox style file.  Each message is verified and its
+ * status lines are emitted as soon as its last signature has been
+ * read; the context and thus the key lookup caches are kept for all
+ * messages.  SIGFILENAME is the name of the input file.  */
+int
+proc_signature_stream (ctrl_t ctrl, iobuf_t a, const char *sigfilename)
+{
+  CTX c = xmalloc_clear (sizeof *c);
+  int rc;
+
+  c->ctrl = ctrl;
+  c->sigs_only = 1;
+  c->multi_message = 1;
+  c->signed_data.data_fd = -1;
+  c->sigfilename = sigfilename;
+  rc = do_proc_packets (ctrl, c, a);
+
+  if (!rc && !c->any.sig_seen)
+    {
+      write_status_text (STATUS_NODATA, "4");
+      log_error (_("no signature found\n"));
+      rc = GPG_ERR_NO_DATA;
+    }
+
+  xfree (c);
+  return rc;
+}
+
+
 int
 proc_signature_packets_by_fd (ctrl_t ctrl,
                               void *anchor, iobuf_t a, int signed_data_fd )
@@ -1636,6 +1806,17 @@ do_proc_packets (ctrl_t ctrl, CTX c, iobuf_t a)
 	}
       else
         free_packet (pkt, &parsectx);
+
+      /* With a concatenation of messages process each one as soon as
+       * it is complete.  A compressed message has already been
+       * processed by its own context.  */
+      if (c->multi_message && c->sigs_only)
+        {
+          if (message_complete (c))
+            finish_message (c);
+          else if (!c->list && literals_seen)
+            reset_literals_seen ();
+        }
     }
 
   if (rc == GPG_ERR_INV_PACKET)
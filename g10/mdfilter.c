@@ -28,8 +28,239 @@
 #include "../common/iobuf.h"
 #include "../common/util.h"
 #include "filter.h"
+#include "main.h"
 
 
+/* The size of the slots of the buffer ring used for threaded
+ * hashing.  */
+#define MD_SLOT_SIZE (256 * 1024)
+
+/* The maximum number of digest algorithms hashed by threads.  */
+#define MD_MAX_ALGOS 8
+
+/* A job to hash a slot with one algorithm.  */
+struct md_job_s
+{
+  /* The job for the workpool; this must be the first member.  */
+  struct workpool_job_s job;
+
+  /* The digest context of the algorithm and the data to hash.  */
+  gcry_md_hd_t md;
+  const byte *data;
+  size_t datalen;
+
+  /* Set while the job has been submitted but not yet waited for.  */
+  unsigned int pending:1;
+};
+
+/* The state for threaded hashing.  Instead of writing all data to the
+ * catch all context MD, which runs the algorithms one after the
+ * other, each algorithm gets its own context and the data is hashed
+ * by one job per algorithm.  The data is collected in two slots so
+ * that one slot can be filled while the other one is hashed.  The
+ * jobs for a slot are not submitted before those for the previous
+ * slot are finished; this keeps the order of the data for each
+ * context and also makes sure that a slot is not refilled while it is
+ * still being hashed.  */
+struct md_workers_s
+{
+  workpool_t pool;
+  int nalgos;
+  int algos[MD_MAX_ALGOS];
+  gcry_md_hd_t mds[MD_MAX_ALGOS];
+  struct md_job_s jobs[2][MD_MAX_ALGOS];
+  byte *slots[2];
+  size_t slotlen;  /* The used length of the current slot.  */
+  int cur;         /* The index of the current slot.  */
+};
+typedef struct md_workers_s *md_workers_t;
+
+
+/* The worker function to hash data.  */
+static void
+md_job_func (void *opaque)
+{
+  struct md_job_s *job = opaque;
+
+  gcry_md_write (job->md, job->data, job->datalen);
+}
+
+
+/* Wait for the jobs of slot IDX.  */
+static void
+wait_slot (md_workers_t mw, int idx)
+{
+  int j;
+
+  for (j=0; j < mw->nalgos; j++)
+    if (mw->jobs[idx][j].pending)
+      {
+        workpool_wait (mw->pool, &mw->jobs[idx][j].job);
+        mw->jobs[idx][j].pending = 0;
+      }
+}
+
+
+/* Submit the jobs for the current slot and switch to the other
+ * slot.  */
+static void
+submit_slot (md_workers_t mw)
+{
+  struct md_job_s *job;
+  int j;
+
+  wait_slot (mw, !mw->cur);
+  for (j=0; j < mw->nalgos; j++)
+    {
+      job = &mw->jobs[mw->cur][j];
+      job->data = mw->slots[mw->cur];
+      job->datalen = mw->slotlen;
+      job->pending = 1;
+      workpool_submit (mw->pool, &job->job);
+    }
+  mw->cur = !mw->cur;
+  mw->slotlen = 0;
+}
+
+
+/* Hash the LEN bytes at BUF using the workers.  */
+static void
+md_workers_write (md_workers_t mw, const byte *buf, size_t len)
+{
+  size_t n;
+
+  while (len)
+    {
+      n = MD_SLOT_SIZE - mw->slotlen;
+      if (n > len)
+        n = len;
+      memcpy (mw->slots[mw->cur] + mw->slotlen, buf, n);
+      mw->slotlen += n;
+      buf += n;
+      len -= n;
+      if (mw->slotlen == MD_SLOT_SIZE)
+        submit_slot (mw);
+    }
+}
+
+
+static void
+release_md_workers (md_filter_context_t *mfx)
+{
+  md_workers_t mw = mfx->workers;
+  int j;
+
+  if (!mw)
+    return;
+
+  wait_slot (mw, 0);
+  wait_slot (mw, 1);
+  for (j=0; j < mw->nalgos; j++)
+    gcry_md_close (mw->mds[j]);
+  xfree (mw->slots[0]);
+  xfree (mw->slots[1]);
+  xfree (mw);
+  mfx->workers = NULL;
+}
+
+
+/* Hash the data passing MFX with worker threads.  This must be called
+ * after all algorithms have been enabled on MFX->MD and before data
+ * is read.  On success MFX->MD is not updated anymore; the caller
+ * needs to call md_filter_wait and use md_filter_get_md to get the
+ * actual context for an algorithm.  On error MFX is not changed.  */
+gpg_error_t
+md_filter_start_workers (md_filter_context_t *mfx)
+{
+  gpg_error_t err;
+  md_workers_t mw;
+  int algo, i, j;
+
+  mw = xtrycalloc (1, sizeof *mw);
+  if (!mw)
+    return gpg_error_from_syserror ();
+
+  for (algo=1; algo <= 110; algo++)
+    {
+      if (!map_md_openpgp_to_gcry (algo)
+          || !gcry_md_is_enabled (mfx->md, map_md_openpgp_to_gcry (algo)))
+        continue;
+      if (mw->nalgos == MD_MAX_ALGOS)
+        {
+          err = gpg_error (GPG_ERR_TOO_MANY);
+          goto leave;
+        }
+      err = gcry_md_open (&mw->mds[mw->nalgos],
+                          map_md_openpgp_to_gcry (algo), 0);
+      if (err)
+        goto leave;
+      mw->algos[mw->nalgos++] = algo;
+    }
+  if (!mw->nalgos)
+    {
+      err = gpg_error (GPG_ERR_DIGEST_ALGO);
+      goto leave;
+    }
+
+  err = workpool_get_shared (&mw->pool);
+  if (err)
+    goto leave;
+
+  for (i=0; i < 2; i++)
+    {
+      mw->slots[i] = xtrymalloc (MD_SLOT_SIZE);
+      if (!mw->slots[i])
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      for (j=0; j < mw->nalgos; j++)
+        {
+          mw->jobs[i][j].job.func = md_job_func;
+          mw->jobs[i][j].job.opaque = &mw->jobs[i][j];
+          mw->jobs[i][j].md = mw->mds[j];
+        }
+    }
+
+ leave:
+  mfx->workers = mw;
+  if (err)
+    release_md_workers (mfx);
+  return err;
+}
+
+
+/* Wait until all data read through MFX has been hashed.  */
+void
+md_filter_wait (md_filter_context_t *mfx)
+{
+  md_workers_t mw = mfx->workers;
+
+  if (!mw)
+    return;
+
+  if (mw->slotlen)
+    submit_slot (mw);
+  wait_slot (mw, 0);
+  wait_slot (mw, 1);
+}
+
+
+/* Return the digest context for ALGO of MFX.  With threaded hashing
+ * md_filter_wait must have been called before.  */
+gcry_md_hd_t
+md_filter_get_md (md_filter_context_t *mfx, int algo)
+{
+  md_workers_t mw = mfx->workers;
+  int j;
+
+  if (mw)
+    for (j=0; j < mw->nalgos; j++)
+      if (mw->algos[j] == algo)
+        return mw->mds[j];
+  return mfx->md;
+}
+
 
 /****************
  * This filter is used to collect a message digest
@@ -48,7 +279,10 @@ md_filter( void *opaque, int control,
 	i = iobuf_read( a, buf, size );
 	if( i == -1 ) i = 0;
 	if( i ) {
-	    gcry_md_write(mfx->md, buf, i );
+	    if( mfx->workers )
+		md_workers_write (mfx->workers, buf, i );
+	    else
+		gcry_md_write(mfx->md, buf, i );
 	    if( mfx->md2 )
 		gcry_md_write(mfx->md2, buf, i );
 	}
@@ -65,6 +299,7 @@ md_filter( void *opaque, int control,
 void
 free_md_filter_context( md_filter_context_t *mfx )
 {
+    release_md_workers (mfx);
     gcry_md_close(mfx->md);
     gcry_md_close(mfx->md2);
     mfx->md = NULL;
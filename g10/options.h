@@ -65,6 +65,36 @@ struct
   /* The AEAD chunk size expressed as a power of 2.  */
   int chunk_size;
 
+  /* If > 1 the number of threads used for AEAD encryption.  */
+  int aead_threads;
+
+  /* If > 1 the number of threads used to encrypt the session key to
+     the recipients.  */
+  int pubkey_enc_threads;
+
+  /* If > 1 the number of threads used for ZIP and ZLIB compression.  */
+  int compress_threads;
+
+  /* If > 1 the number of threads used to hash the data to be signed.  */
+  int hash_threads;
+
+  /* If set read the input and write the output of a decryption in
+     separate threads.  */
+  int io_threads;
+
+  /* If set the maximum number of entries of the key caches.  */
+  int key_cache_size;
+
+  /* If set the number of trustdb records kept in memory.  */
+  int trustdb_cache_size;
+
+  /* If > 1 the number of threads used to check self-signatures.  */
+  int sig_check_threads;
+
+  /* If > 0 the maximum number of third-party signatures kept for an
+     imported key.  */
+  int import_max_sigs;
+
   int dry_run;
   int autostart;
   int list_only;
@@ -208,6 +238,7 @@ struct
   int ignore_valid_from;
   int ignore_crc_error;
   int ignore_mdc_error;
+  int mmap_signed_data;
   int command_fd;
   const char *override_session_key;
   int show_session_key;
@@ -360,6 +391,8 @@ EXTERN_UNLESS_MAIN_MODULE int memory_stat_debug_mode;
 #define IMPORT_RESTORE                   (1<<10)
 #define IMPORT_REPAIR_KEYS               (1<<11)
 #define IMPORT_DRY_RUN                   (1<<12)
+#define IMPORT_SELF_SIGS_ONLY            (1<<13)
+#define IMPORT_MARK_REFRESHED            (1<<14) /* Internal use.  */
 
 #define EXPORT_LOCAL_SIGS                (1<<0)
 #define EXPORT_ATTRIBUTES                (1<<1)
@@ -131,6 +131,17 @@ typedef struct {
 } PKT_pubkey_enc;
 
 
+/* A list of public-key encrypted session key packets.  This is used
+   to try all of them at once.  */
+struct pubkey_enc_list
+{
+  struct pubkey_enc_list *next;
+  PKT_pubkey_enc *enc;
+  /* The result of the decryption attempt.  */
+  gpg_error_t result;
+};
+
+
 /* A one-pass signature packet as defined in RFC 4880, Section
    5.4.  All fields are serialized.  */
 typedef struct {
@@ -208,6 +219,7 @@ typedef struct
     unsigned pref_ks:1;     /* At least one preferred keyserver is present */
     unsigned expired:1;
     unsigned pka_tried:1;   /* Set if we tried to retrieve the PKA record. */
+    unsigned raw_data:1;    /* DATA[0] holds the undecoded MPIs.  */
   } flags;
   /* The key that allegedly generated this signature.  (Directly
      serialized in v3 sigs; for v4 sigs, this must be explicitly added
@@ -231,6 +243,9 @@ typedef struct
   byte    digest_algo;
   byte    trust_depth;
   byte    trust_value;
+  /* First 2 bytes of the digest.  (Serialized.  Note: this is not
+     automatically filled in when serializing a signature!)  */
+  byte digest_start[2];
   const byte *trust_regexp;
   struct revocation_key *revkey;
   int numrevkeys;
@@ -242,16 +257,14 @@ typedef struct
                               * already been sanitized.  */
   subpktarea_t *hashed;      /* All subpackets with hashed data (v4 only). */
   subpktarea_t *unhashed;    /* Ditto for unhashed data. */
-  /* First 2 bytes of the digest.  (Serialized.  Note: this is not
-     automatically filled in when serializing a signature!)  */
-  byte digest_start[2];
   /* The signature.  (Serialized.)  */
   gcry_mpi_t  data[PUBKEY_MAX_NSIG];
-  /* The message digest and its length (in bytes).  Note the maximum
-     digest length is 512 bits (64 bytes).  If DIGEST_LEN is 0, then
-     the digest's value has not been saved here.  */
-  byte digest[512 / 8];
-  int digest_len;
+  /* The malloced message digest and its length (in bytes).  If
+     DIGEST is NULL, then the digest's value has not been saved here.
+     This is only done for data signatures; a keyring has far more
+     key signatures and they should not all carry a 64 byte buffer.  */
+  byte *digest;
+  unsigned int digest_len;
 } PKT_signature;
 
 #define ATTRIB_IMAGE 1
@@ -368,6 +381,15 @@ typedef struct
   u32     expiredate;     /* expires at this date or 0 if not at all */
   u32     max_expiredate; /* must not expire past this date */
   struct revoke_info revoked;
+  u32     has_expired;    /* set to the expiration date if expired */
+  u32     trust_timestamp;
+  u32     keyupdate;      /* From the ring trust packet.  */
+  /* keyid of the primary key.  Never access this value directly.
+     Instead, use pk_main_keyid().  */
+  u32     main_keyid[2];
+  /* keyid of this key.  Never access this value directly!  Instead,
+     use pk_keyid().  */
+  u32     keyid[2];
   /* An OpenPGP packet consists of a header and a body.  This is the
      size of the header.  If this is 0, an appropriate size is
      automatically chosen based on the size of the body.
@@ -381,14 +403,17 @@ typedef struct
   byte    pubkey_algo;
   byte    pubkey_usage;   /* for now only used to pass it to getkey() */
   byte    req_usage;      /* hack to pass a request to getkey() */
-  u32     has_expired;    /* set to the expiration date if expired */
-  /* keyid of the primary key.  Never access this value directly.
-     Instead, use pk_main_keyid().  */
-  u32     main_keyid[2];
-  /* keyid of this key.  Never access this value directly!  Instead,
-     use pk_keyid().  */
-  u32     keyid[2];
-  prefitem_t *prefs;      /* list of preferences (may be NULL) */
+  byte    trust_depth;
+  byte    trust_value;
+  byte    keyorg;         /* From the ring trust packet.  */
+  /* The fingerprint of this key or FPRLEN is 0 if not yet computed.
+     Never access this value directly!  Instead, use
+     fingerprint_from_pk().  */
+  byte    fprlen;
+  byte    fpr[MAX_FINGERPRINT_LEN];
+  /* The keygrip of this key if flags.keygrip_valid is set.  Never
+     access this value directly!  Instead, use keygrip_from_pk().  */
+  byte    keygrip[KEYGRIP_LEN];
   struct
   {
     unsigned int mdc:1;           /* MDC feature set.  */
@@ -407,15 +432,12 @@ typedef struct
     unsigned int backsig:2;       /* 0=none, 1=bad, 2=good.  */
     unsigned int serialno_valid:1;/* SERIALNO below is valid.  */
     unsigned int exact:1;         /* Found via exact (!) search.  */
+    unsigned int keygrip_valid:1; /* KEYGRIP below is valid.  */
   } flags;
+  int     numrevkeys;
+  prefitem_t *prefs;      /* list of preferences (may be NULL) */
   PKT_user_id *user_id;   /* If != NULL: found by that uid. */
   struct revocation_key *revkey;
-  int     numrevkeys;
-  u32     trust_timestamp;
-  byte    trust_depth;
-  byte    trust_value;
-  byte    keyorg;         /* From the ring trust packet.  */
-  u32     keyupdate;      /* From the ring trust packet.  */
   char    *updateurl;     /* NULL or the URL of the last update origin.  */
   const byte *trust_regexp;
   char    *serialno;      /* Malloced hex string or NULL if it is
@@ -424,6 +446,10 @@ typedef struct
   /* If not NULL this malloced structure describes a secret key.
      (Serialized.)  */
   struct seckey_info *seckey_info;
+  /* The public key as an S-expression for gcry_pk_verify or NULL if
+     not yet built.  This object is shared by the copies of the key
+     and reference counted; see pk_verify_prepare().  */
+  struct pkey_sexp_s *pkey_sexp;
   /* The public key.  Contains pubkey_get_npkey (pubkey_algo) +
      pubkey_get_nskey (pubkey_algo) MPIs.  (If pubkey_get_npkey
      returns 0, then the algorithm is not understood and the PKEY
@@ -438,6 +464,15 @@ typedef struct
    ((a)->flags.disabled):(cache_disabled_value(ctrl,(a))))
 
 
+/* A public key S-expression shared by copies of a PKT_public_key.
+   The reference counter is only changed by the main thread.  */
+struct pkey_sexp_s
+{
+  unsigned int refcount;
+  gcry_sexp_t sexp;
+};
+
+
 typedef struct {
     int  len;		  /* length of data */
     char data[1];
@@ -616,6 +651,7 @@ void reset_literals_seen(void);
 int proc_packets (ctrl_t ctrl, void *ctx, iobuf_t a );
 int proc_signature_packets (ctrl_t ctrl, void *ctx, iobuf_t a,
 			    strlist_t signedfiles, const char *sigfile );
+int proc_signature_stream (ctrl_t ctrl, iobuf_t a, const char *sigfile);
 int proc_signature_packets_by_fd (ctrl_t ctrl,
                                   void *anchor, IOBUF a, int signed_data_fd );
 int proc_encryption_packets (ctrl_t ctrl, void *ctx, iobuf_t a);
@@ -644,6 +680,7 @@ struct parse_packet_ctx_s
   struct packet_struct last_pkt; /* The last parsed packet.  */
   int free_last_pkt; /* Indicates that LAST_PKT must be freed.  */
   int skip_meta;     /* Skip ring trust packets.  */
+  int lazy_sig_data; /* Do not decode the MPIs of signatures.  */
   unsigned int n_parsed_packets;	/* Number of parsed packets.  */
 };
 typedef struct parse_packet_ctx_s *parse_packet_ctx_t;
@@ -654,6 +691,7 @@ typedef struct parse_packet_ctx_s *parse_packet_ctx_t;
     (a)->last_pkt.pkt.generic= NULL;\
     (a)->free_last_pkt = 0;         \
     (a)->skip_meta = 0;             \
+    (a)->lazy_sig_data = 0;         \
     (a)->n_parsed_packets = 0;      \
   } while (0)
 
@@ -700,7 +738,9 @@ int parse_packet (parse_packet_ctx_t ctx, PACKET *pkt);
 
 /* Return the first OpenPGP packet in *PKT that contains a key (either
  * a public subkey, a public key, a secret subkey or a secret key) or,
- * if WITH_UID is set, a user id.
+ * if WITH_UID is set, a user id.  If WITH_UID is -1 only key packets
+ * are returned and public keys are only skimmed; the returned public
+ * key object may then only be used to get the fingerprint or keyid.
  *
  * Saves the position in the pipeline of the start of the returned
  * packet (according to iobuf_tell) in RETPOS, if it is not NULL.
@@ -751,6 +791,11 @@ int skip_some_packets (iobuf_t inp, unsigned int n);
 int parse_signature( iobuf_t inp, int pkttype, unsigned long pktlen,
 		     PKT_signature *sig );
 
+/* Decode the MPIs of a signature which has been parsed with the
+   LAZY_SIG_DATA flag of the parser context.  This is a no-op for
+   other signatures.  */
+gpg_error_t parse_sig_data (PKT_signature *sig);
+
 /* Given a subpacket area (typically either PKT_signature.hashed or
    PKT_signature.unhashed), either:
 
@@ -854,6 +899,10 @@ struct notation *sig_to_notation(PKT_signature *sig);
 void free_notation(struct notation *notation);
 
 /*-- free-packet.c --*/
+PACKET *alloc_packet_object (void);
+void release_packet_object (PACKET *pkt);
+PKT_signature *alloc_signature_object (void);
+PKT_public_key *alloc_public_key_object (void);
 void free_symkey_enc( PKT_symkey_enc *enc );
 void free_pubkey_enc( PKT_pubkey_enc *enc );
 void free_seckey_enc( PKT_signature *enc );
@@ -890,6 +939,9 @@ gpg_error_t check_signature2 (ctrl_t ctrl,
 
 /*-- pubkey-enc.c --*/
 gpg_error_t get_session_key (ctrl_t ctrl, PKT_pubkey_enc *k, DEK *dek);
+gpg_error_t get_session_key_from_list (ctrl_t ctrl,
+                                       struct pubkey_enc_list *list,
+                                       DEK *dek);
 gpg_error_t get_override_session_key (DEK *dek, const char *string);
 
 /*-- compress.c --*/
@@ -35,6 +35,7 @@
 #include "main.h"
 #include "../common/i18n.h"
 #include "../common/host2net.h"
+#include "../common/tracepoint.h"
 
 
 /* Maximum length of packets to avoid excessive memory allocation.  */
@@ -68,6 +69,8 @@ static int parse_onepass_sig (IOBUF inp, int pkttype, unsigned long pktlen,
 			      PKT_onepass_sig * ops);
 static int parse_key (IOBUF inp, int pkttype, unsigned long pktlen,
 		      byte * hdr, int hdrlen, PACKET * packet);
+static int skim_key (IOBUF inp, int pkttype, unsigned long pktlen,
+                     byte * hdr, int hdrlen, PACKET * packet);
 static int parse_user_id (IOBUF inp, int pkttype, unsigned long pktlen,
 			  PACKET * packet);
 static int parse_attribute (IOBUF inp, int pkttype, unsigned long pktlen,
@@ -308,8 +311,8 @@ dbg_search_packet (parse_packet_ctx_t ctx, PACKET *pkt,
 
   do
     {
-      rc = parse (ctx, pkt, with_uid ? 2 : 1, retpos, &skip, NULL, 0, "search",
-                  dbg_f, dbg_l);
+      rc = parse (ctx, pkt, with_uid < 0? 3 : with_uid? 2 : 1,
+                  retpos, &skip, NULL, 0, "search", dbg_f, dbg_l);
     }
   while (skip && ! rc);
   return rc;
@@ -323,7 +326,8 @@ search_packet (parse_packet_ctx_t ctx, PACKET *pkt,
 
   do
     {
-      rc = parse (ctx, pkt, with_uid ? 2 : 1, retpos, &skip, NULL, 0);
+      rc = parse (ctx, pkt, with_uid < 0? 3 : with_uid? 2 : 1,
+                  retpos, &skip, NULL, 0);
     }
   while (skip && ! rc);
   return rc;
@@ -770,6 +774,7 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
 
   /* Count it.  */
   ctx->n_parsed_packets++;
+  GNUPG_TRACE2 (parse_packet, pkttype, pktlen);
 
   pkt->pkttype = pkttype;
   rc = GPG_ERR_UNKNOWN_PACKET;	/* default error */
@@ -779,8 +784,12 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
     case PKT_PUBLIC_SUBKEY:
     case PKT_SECRET_KEY:
     case PKT_SECRET_SUBKEY:
-      pkt->pkt.public_key = xmalloc_clear (sizeof *pkt->pkt.public_key);
-      rc = parse_key (inp, pkttype, pktlen, hdr, hdrlen, pkt);
+      pkt->pkt.public_key = alloc_public_key_object ();
+      if (onlykeypkts == 3 && !partial && !list_mode
+          && (pkttype == PKT_PUBLIC_KEY || pkttype == PKT_PUBLIC_SUBKEY))
+        rc = skim_key (inp, pkttype, pktlen, hdr, hdrlen, pkt);
+      else
+        rc = parse_key (inp, pkttype, pktlen, hdr, hdrlen, pkt);
       break;
     case PKT_SYMKEY_ENC:
       rc = parse_symkeyenc (inp, pkttype, pktlen, pkt);
@@ -789,7 +798,9 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
       rc = parse_pubkeyenc (inp, pkttype, pktlen, pkt);
       break;
     case PKT_SIGNATURE:
-      pkt->pkt.signature = xmalloc_clear (sizeof *pkt->pkt.signature);
+      pkt->pkt.signature = alloc_signature_object ();
+      /* Tell parse_signature that the MPIs may be kept raw.  */
+      pkt->pkt.signature->flags.raw_data = !!ctx->lazy_sig_data;
       rc = parse_signature (inp, pkttype, pktlen, pkt->pkt.signature);
       break;
     case PKT_ONEPASS_SIG:
@@ -857,6 +868,7 @@ parse (parse_packet_ctx_t ctx, PACKET *pkt, int onlykeypkts, off_t * retpos,
   /* FIXME: We leak in case of an error (see the xmalloc's above).  */
   if (!rc && iobuf_error (inp))
     rc = GPG_ERR_INV_KEYRING;
+  GNUPG_TRACE2 (parse_packet_done, pkt->pkttype, rc);
 
   /* FIXME: We use only the error code for now to avoid problems with
      callers which have not been checked to always use gpg_err_code()
@@ -903,31 +915,36 @@ copy_packet (IOBUF inp, IOBUF out, int pkttype,
 {
   int rc;
   int n;
-  char buf[100];
+  const byte *data;
 
-  if (partial)
-    {
-      while ((n = iobuf_read (inp, buf, sizeof (buf))) != -1)
-	if ((rc = iobuf_write (out, buf, n)))
-	  return rc;		/* write error */
-    }
-  else if (!pktlen && pkttype == PKT_COMPRESSED)
+  /* The data is written directly from the buffer of INP; thus the
+   * number of calls only depends on the size of the iobuf buffers and
+   * not on the length of the packet.  */
+  if (partial || (!pktlen && pkttype == PKT_COMPRESSED))
     {
-      log_debug ("copy_packet: compressed!\n");
-      /* compressed packet, copy till EOF */
-      while ((n = iobuf_read (inp, buf, sizeof (buf))) != -1)
-	if ((rc = iobuf_write (out, buf, n)))
-	  return rc;		/* write error */
+      if (!partial)
+        log_debug ("copy_packet: compressed!\n");
+      /* Copy till EOF.  */
+      while ((n = iobuf_read_view (inp, &data)) != -1)
+        {
+          rc = iobuf_write (out, data, n);
+          iobuf_release_view (inp, n);
+          if (rc)
+            return rc;		/* write error */
+        }
     }
   else
     {
       for (; pktlen; pktlen -= n)
 	{
-	  n = pktlen > sizeof (buf) ? sizeof (buf) : pktlen;
-	  n = iobuf_read (inp, buf, n);
+	  n = iobuf_read_view (inp, &data);
 	  if (n == -1)
 	    return gpg_error (GPG_ERR_EOF);
-	  if ((rc = iobuf_write (out, buf, n)))
+	  if (n > pktlen)
+	    n = pktlen;
+	  rc = iobuf_write (out, data, n);
+	  iobuf_release_view (inp, n);
+	  if (rc)
 	    return rc;		/* write error */
 	}
     }
@@ -1891,6 +1908,12 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
   int is_v4 = 0;
   int rc = 0;
   int i, ndata;
+  int lazy;
+
+  /* The RAW_DATA flag is used by parse() to request lazy decoding of
+   * the MPIs; it is only set again if we actually did that.  */
+  lazy = sig->flags.raw_data && !list_mode;
+  sig->flags.raw_data = 0;
 
   if (pktlen < 16)
     {
@@ -2145,6 +2168,17 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
 	  pktlen = 0;
 	}
     }
+  else if (lazy && pktlen && pktlen <= (5 * MAX_EXTERN_MPI_BITS / 8))
+    {
+      /* Keep the MPIs as one opaque blob; most signatures of a
+       * keyblock read from the key database are never verified.  The
+       * blob is decoded by parse_sig_data and written back as is by
+       * build_packet.  */
+      sig->data[0] = gcry_mpi_set_opaque (NULL, read_rest (inp, pktlen),
+                                          pktlen * 8);
+      pktlen = 0;
+      sig->flags.raw_data = 1;
+    }
   else
     {
       for (i = 0; i < ndata; i++)
@@ -2178,6 +2212,53 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
 }
 
 
+/* Decode the MPIs of SIG if they have been kept raw by
+ * parse_signature.  */
+gpg_error_t
+parse_sig_data (PKT_signature *sig)
+{
+  gcry_mpi_t data[PUBKEY_MAX_NSIG];
+  const void *p;
+  unsigned int nbits, n, len;
+  iobuf_t inp;
+  int i, ndata;
+  gpg_error_t err = 0;
+
+  if (!sig->flags.raw_data)
+    return 0;
+
+  p = sig->data[0]? gcry_mpi_get_opaque (sig->data[0], &nbits) : NULL;
+  if (!p)
+    return gpg_error (GPG_ERR_INV_PACKET);
+  len = (nbits + 7) / 8;
+
+  ndata = pubkey_get_nsig (sig->pubkey_algo);
+  inp = iobuf_temp_with_content (p, len);
+  for (i = 0; i < ndata; i++)
+    {
+      n = len;
+      data[i] = mpi_read (inp, &n, 0);
+      len -= n;
+      if (!data[i])
+        err = gpg_error (GPG_ERR_INV_PACKET);
+    }
+  iobuf_close (inp);
+
+  if (err)
+    {
+      for (i = 0; i < ndata; i++)
+        gcry_mpi_release (data[i]);
+      return err;
+    }
+
+  gcry_mpi_release (sig->data[0]);
+  for (i = 0; i < ndata; i++)
+    sig->data[i] = data[i];
+  sig->flags.raw_data = 0;
+  return 0;
+}
+
+
 static int
 parse_onepass_sig (IOBUF inp, int pkttype, unsigned long pktlen,
 		   PKT_onepass_sig * ops)
@@ -2231,6 +2312,125 @@ parse_onepass_sig (IOBUF inp, int pkttype, unsigned long pktlen,
 }
 
 
+/* Return true if the v4 public key packet BODY of LENGTH bytes uses
+ * only canonical encodings for its fields and has no trailing data.
+ * For such a packet the fingerprint is the hash of the raw body.  */
+static int
+key_body_is_canonical (const byte *body, size_t length)
+{
+  const byte *p = body + 6;
+  size_t n, len = length - 6;
+  unsigned int nbits;
+  int nmpis, with_oid = 0, with_kdf = 0;
+
+  switch (body[5])
+    {
+    case PUBKEY_ALGO_RSA:
+    case PUBKEY_ALGO_RSA_E:
+    case PUBKEY_ALGO_RSA_S:   nmpis = 2; break;
+    case PUBKEY_ALGO_DSA:     nmpis = 4; break;
+    case PUBKEY_ALGO_ELGAMAL_E:
+    case PUBKEY_ALGO_ELGAMAL: nmpis = 3; break;
+    case PUBKEY_ALGO_ECDSA:
+    case PUBKEY_ALGO_EDDSA:   nmpis = 1; with_oid = 1; break;
+    case PUBKEY_ALGO_ECDH:    nmpis = 1; with_oid = 1; with_kdf = 1; break;
+    default: return 0;
+    }
+
+  if (with_oid)
+    {
+      if (!len || *p < 2 || *p > 254 || *p >= len)
+        return 0;
+      n = *p + 1;
+      p += n;
+      len -= n;
+    }
+  for (; nmpis; nmpis--)
+    {
+      if (len < 2)
+        return 0;
+      nbits = buf16_to_uint (p);
+      n = (nbits + 7) / 8;
+      if (!nbits || n > len - 2)
+        return 0;
+      /* The most significant bit must be at the stated position.  */
+      if ((p[2] >> ((nbits - 1) % 8)) != 1)
+        return 0;
+      p += n + 2;
+      len -= n + 2;
+    }
+  if (with_kdf)
+    {
+      if (!len || *p < 2 || *p > 254 || *p >= len)
+        return 0;
+      n = *p + 1;
+      p += n;
+      len -= n;
+    }
+
+  return !len;
+}
+
+
+/* A variant of parse_key used by search_packet for key searches: It
+ * reads the body of the public key packet and, for a v4 key with
+ * correctly encoded fields, only sets the version, the algorithm,
+ * the creation time and the fingerprint and keyid of the key in
+ * PACKET.  The key material is not parsed; thus PACKET may only be
+ * used to compare the fingerprint or keyid.  Other packets are
+ * passed to parse_key.  */
+static int
+skim_key (IOBUF inp, int pkttype, unsigned long pktlen,
+          byte * hdr, int hdrlen, PACKET * pkt)
+{
+  PKT_public_key *pk = pkt->pkt.public_key;
+  byte *body;
+  iobuf_t tmp;
+  gcry_md_hd_t md;
+  int rc;
+
+  if (pktlen < 12 || pktlen > MAX_KEY_PACKET_LENGTH)
+    return parse_key (inp, pkttype, pktlen, hdr, hdrlen, pkt);
+
+  body = read_rest (inp, pktlen);
+  if (!body)
+    return gpg_error (GPG_ERR_INV_PACKET);
+
+  if (body[0] != 4 || pktlen > 0xffff
+      || !key_body_is_canonical (body, pktlen))
+    {
+      /* Let parse_key do the real work.  */
+      tmp = iobuf_temp_with_content (body, pktlen);
+      rc = parse_key (tmp, pkttype, pktlen, hdr, hdrlen, pkt);
+      iobuf_close (tmp);
+      xfree (body);
+      return rc;
+    }
+
+  pk->version = 4;
+  pk->timestamp = buf32_to_u32 (body + 1);
+  pk->pubkey_algo = body[5];
+  pk->hdrbytes = hdrlen;
+  pk->flags.primary = (pkttype == PKT_PUBLIC_KEY);
+
+  /* See hash_public_key.  */
+  if (gcry_md_open (&md, DIGEST_ALGO_SHA1, 0))
+    BUG ();
+  gcry_md_putc (md, 0x99);
+  gcry_md_putc (md, pktlen >> 8);
+  gcry_md_putc (md, pktlen);
+  gcry_md_write (md, body, pktlen);
+  memcpy (pk->fpr, gcry_md_read (md, DIGEST_ALGO_SHA1), 20);
+  gcry_md_close (md);
+  pk->fprlen = 20;
+  pk->keyid[0] = buf32_to_u32 (pk->fpr+12);
+  pk->keyid[1] = buf32_to_u32 (pk->fpr+16);
+
+  xfree (body);
+  return 0;
+}
+
+
 static int
 parse_key (IOBUF inp, int pkttype, unsigned long pktlen,
 	   byte * hdr, int hdrlen, PACKET * pkt)
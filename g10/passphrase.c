@@ -47,6 +47,30 @@ static char *fd_passwd = NULL;
 static char *next_pw = NULL;
 static char *last_pw = NULL;
 
+/* The number of keys kept by the derived key cache.  */
+#define S2K_KEYCACHE_SIZE 8
+
+/* An item of the derived key cache.  To avoid keeping the passphrase
+ * around only its SHA-256 digest is stored.  The item is used if
+ * all parameters of the S2K and the passphrase match.  */
+struct s2k_keycache_item_s
+{
+  int used;
+  int mode;
+  int hash_algo;
+  u32 count;
+  byte salt[8];
+  byte pwhash[32];
+  int keylen;
+  byte key[32];
+};
+
+/* The derived key cache, allocated in secure memory.  This lets
+ * --decrypt-files run the S2K only once for many files encrypted with
+ * the same passphrase and salt.  */
+static struct s2k_keycache_item_s *s2k_keycache;
+static unsigned int s2k_keycache_next;
+
 
 
 /* Pack an s2k iteration count into the form specified in 2440.  If
@@ -281,6 +305,76 @@ passphrase_get (int nocache, const char *cacheid, int repeat,
 }
 
 
+/* Return the item of the derived key cache matching S2K, KEYLEN and
+ * the passphrase digest PWHASH or NULL.  */
+static struct s2k_keycache_item_s *
+s2k_keycache_lookup (STRING2KEY *s2k, int keylen, const byte *pwhash)
+{
+  int i;
+
+  if (!s2k_keycache)
+    return NULL;
+  for (i=0; i < S2K_KEYCACHE_SIZE; i++)
+    if (s2k_keycache[i].used
+        && s2k_keycache[i].mode == s2k->mode
+        && s2k_keycache[i].hash_algo == s2k->hash_algo
+        && s2k_keycache[i].count == s2k->count
+        && s2k_keycache[i].keylen == keylen
+        && !memcmp (s2k_keycache[i].salt, s2k->salt, 8)
+        && !memcmp (s2k_keycache[i].pwhash, pwhash, 32))
+      return s2k_keycache + i;
+  return NULL;
+}
+
+
+/* Store KEY of KEYLEN derived using S2K from the passphrase with the
+ * digest PWHASH in the derived key cache.  The oldest item is
+ * replaced.  */
+static void
+s2k_keycache_put (STRING2KEY *s2k, const byte *key, int keylen,
+                  const byte *pwhash)
+{
+  struct s2k_keycache_item_s *item;
+
+  if (keylen > sizeof item->key)
+    return;
+  if (!s2k_keycache)
+    {
+      s2k_keycache = xtrycalloc_secure (S2K_KEYCACHE_SIZE,
+                                        sizeof *s2k_keycache);
+      if (!s2k_keycache)
+        return;
+    }
+  item = s2k_keycache + s2k_keycache_next;
+  s2k_keycache_next = (s2k_keycache_next + 1) % S2K_KEYCACHE_SIZE;
+  item->used = 1;
+  item->mode = s2k->mode;
+  item->hash_algo = s2k->hash_algo;
+  item->count = s2k->count;
+  memcpy (item->salt, s2k->salt, 8);
+  memcpy (item->pwhash, pwhash, 32);
+  item->keylen = keylen;
+  memcpy (item->key, key, keylen);
+}
+
+
+/* Remove all items with the salt given by the passphrase cache id
+ * CACHEID from the derived key cache.  */
+static void
+s2k_keycache_clear (const char *cacheid)
+{
+  byte salt[8];
+  int i;
+
+  if (!s2k_keycache || !cacheid || *cacheid != 'S'
+      || hex2bin (cacheid+1, salt, 8) < 0)
+    return;
+  for (i=0; i < S2K_KEYCACHE_SIZE; i++)
+    if (s2k_keycache[i].used && !memcmp (s2k_keycache[i].salt, salt, 8))
+      wipememory (s2k_keycache + i, sizeof *s2k_keycache);
+}
+
+
 /*
  * Clear the cached passphrase with CACHEID.
  */
@@ -289,6 +383,8 @@ passphrase_clear_cache (const char *cacheid)
 {
   int rc;
 
+  s2k_keycache_clear (cacheid);
+
   rc = agent_clear_passphrase (cacheid);
   if (rc)
     log_error (_("problem with the agent: %s\n"), gpg_strerror (rc));
@@ -412,26 +508,49 @@ passphrase_to_dek (int cipher_algo, STRING2KEY *s2k,
     dek->keylen = 0;
   else
     {
-      gpg_error_t err;
+      gpg_error_t err = 0;
+      byte pwhash[32];
+      struct s2k_keycache_item_s *item = NULL;
+      int use_keycache;
 
       dek->keylen = openpgp_cipher_get_algo_keylen (dek->algo);
       if (!(dek->keylen > 0 && dek->keylen <= DIM(dek->key)))
         BUG ();
-      err = gcry_kdf_derive (pw, strlen (pw),
-                             s2k->mode == 3? GCRY_KDF_ITERSALTED_S2K :
-                             s2k->mode == 1? GCRY_KDF_SALTED_S2K :
-                             /* */           GCRY_KDF_SIMPLE_S2K,
-                             s2k->hash_algo, s2k->salt, 8,
-                             S2K_DECODE_COUNT(s2k->count),
-                             dek->keylen, dek->key);
+
+      /* Only the costly iterated and salted S2K is cached.  A new key
+       * uses a fresh salt and thus never hits the cache.  */
+      use_keycache = (!nocache && !create && s2k->mode == 3);
+      if (use_keycache)
+        {
+          gcry_md_hash_buffer (GCRY_MD_SHA256, pwhash, pw, strlen (pw));
+          item = s2k_keycache_lookup (s2k, dek->keylen, pwhash);
+        }
+      if (item)
+        {
+          if (DBG_CRYPTO)
+            log_debug ("using cached S2K key\n");
+          memcpy (dek->key, item->key, dek->keylen);
+        }
+      else
+        err = gcry_kdf_derive (pw, strlen (pw),
+                               s2k->mode == 3? GCRY_KDF_ITERSALTED_S2K :
+                               s2k->mode == 1? GCRY_KDF_SALTED_S2K :
+                               /* */           GCRY_KDF_SIMPLE_S2K,
+                               s2k->hash_algo, s2k->salt, 8,
+                               S2K_DECODE_COUNT(s2k->count),
+                               dek->keylen, dek->key);
       if (err)
         {
           log_error ("gcry_kdf_derive failed: %s", gpg_strerror (err));
+          wipememory (pwhash, sizeof pwhash);
           xfree (pw);
           xfree (dek);
 	  write_status( STATUS_MISSING_PASSPHRASE );
           return NULL;
         }
+      if (use_keycache && !item)
+        s2k_keycache_put (s2k, dek->key, dek->keylen, pwhash);
+      wipememory (pwhash, sizeof pwhash);
     }
   if (s2k_cacheid)
     memcpy (dek->s2k_cacheid, s2k_cacheid, sizeof dek->s2k_cacheid);
@@ -808,33 +808,173 @@ expand_group (strlist_t input)
 }
 
 
-/* Helper for build_pk_list to find and check one key.  This helper is
- * also used directly in server mode by the RECIPIENTS command.  On
- * success the new key is added to PK_LIST_ADDR.  NAME is the user id
- * of the key.  USE the requested usage and a set MARK_HIDDEN will
- * mark the key in the updated list as a hidden recipient.  If
- * FROM_FILE is true, NAME is not a user ID but the name of a file
- * holding a key. */
-gpg_error_t
-find_and_check_key (ctrl_t ctrl, const char *name, unsigned int use,
-                    int mark_hidden, int from_file, pk_list_t *pk_list_addr)
+/* A cache of the resolved recipients.  A gpg running in server mode
+ * is often asked to encrypt to the same recipients again and again;
+ * each time the recipient lookup may run the auto key locate
+ * mechanism and the trust checks.  Only keys which are usable
+ * without asking the user are cached.  All items are flushed when the
+ * key database or the trustdb changes; an item is used at most
+ * RCPT_CACHE_TTL seconds so that changes of the trustdb done by other
+ * processes are eventually seen.  */
+#define RCPT_CACHE_TTL       60
+#define RCPT_CACHE_MAX_ITEMS 256
+
+struct rcpt_cache_item
+{
+  struct rcpt_cache_item *next;
+  unsigned int use;       /* The requested usage.  */
+  int trust_model;        /* The trust model used for the checks.  */
+  u32 created;            /* The time the item was created.  */
+  PKT_public_key *pk;     /* The key.  */
+  char name[1];           /* The recipient as given.  */
+};
+
+static struct rcpt_cache_item *rcpt_cache;
+static unsigned int rcpt_cache_count;
+static unsigned int rcpt_cache_keydb_generation;
+static unsigned int rcpt_cache_trust_generation;
+
+
+static void
+rcpt_cache_flush (void)
+{
+  struct rcpt_cache_item *item;
+
+  while ((item = rcpt_cache))
+    {
+      rcpt_cache = item->next;
+      free_public_key (item->pk);
+      xfree (item);
+    }
+  rcpt_cache_count = 0;
+}
+
+
+/* Flush the cache if the key database or the trustdb changed.  */
+static void
+rcpt_cache_check (void)
+{
+  unsigned int keydb_gen = keydb_get_generation ();
+  unsigned int trust_gen = trust_get_generation ();
+
+  if (keydb_gen != rcpt_cache_keydb_generation
+      || trust_gen != rcpt_cache_trust_generation)
+    {
+      rcpt_cache_flush ();
+      rcpt_cache_keydb_generation = keydb_gen;
+      rcpt_cache_trust_generation = trust_gen;
+    }
+}
+
+
+/* Return a copy of the cached key for NAME and USE or NULL.  */
+static PKT_public_key *
+rcpt_cache_get (const char *name, unsigned int use)
+{
+  struct rcpt_cache_item *item;
+  u32 now;
+
+  rcpt_cache_check ();
+  now = make_timestamp ();
+  for (item = rcpt_cache; item; item = item->next)
+    if (item->use == use
+        && item->trust_model == opt.trust_model
+        && !strcmp (item->name, name))
+      {
+        if (now - item->created >= RCPT_CACHE_TTL
+            || (item->pk->expiredate && item->pk->expiredate <= now))
+          return NULL;
+        if (DBG_CACHE)
+          log_debug ("recipient cache hit for '%s'\n", name);
+        return copy_public_key (NULL, item->pk);
+      }
+  return NULL;
+}
+
+
+/* Put a copy of PK as the key for NAME and USE into the cache.  */
+static void
+rcpt_cache_put (const char *name, unsigned int use, PKT_public_key *pk)
+{
+  struct rcpt_cache_item *item, **itemp;
+
+  rcpt_cache_check ();
+
+  /* Replace an outdated item.  */
+  for (itemp = &rcpt_cache; *itemp; itemp = &(*itemp)->next)
+    if ((*itemp)->use == use
+        && (*itemp)->trust_model == opt.trust_model
+        && !strcmp ((*itemp)->name, name))
+      {
+        item = *itemp;
+        *itemp = item->next;
+        free_public_key (item->pk);
+        xfree (item);
+        rcpt_cache_count--;
+        break;
+      }
+
+  if (rcpt_cache_count >= RCPT_CACHE_MAX_ITEMS)
+    rcpt_cache_flush ();
+
+  item = xtrymalloc (sizeof *item + strlen (name));
+  if (!item)
+    return;
+  strcpy (item->name, name);
+  item->use = use;
+  item->trust_model = opt.trust_model;
+  item->created = make_timestamp ();
+  item->pk = copy_public_key (NULL, pk);
+  item->next = rcpt_cache;
+  rcpt_cache = item;
+  rcpt_cache_count++;
+}
+
+
+/* Worker for find_and_check_key.  If KEYBLOCK is not NULL it is the
+ * keyblock for NAME as found by prefetch_recipient_keys; it is used
+ * instead of looking up NAME and released by this function.  */
+static gpg_error_t
+do_find_and_check_key (ctrl_t ctrl, const char *name, unsigned int use,
+                       int mark_hidden, int from_file, kbnode_t keyblock,
+                       pk_list_t *pk_list_addr)
 {
   int rc;
   PKT_public_key *pk;
-  KBNODE keyblock = NULL;
 
   if (!name || !*name)
-    return gpg_error (GPG_ERR_INV_USER_ID);
+    {
+      release_kbnode (keyblock);
+      return gpg_error (GPG_ERR_INV_USER_ID);
+    }
+
+  if (!from_file && (pk = rcpt_cache_get (name, use)))
+    {
+      release_kbnode (keyblock);
+      goto found;
+    }
 
   pk = xtrycalloc (1, sizeof *pk);
   if (!pk)
-    return gpg_error_from_syserror ();
+    {
+      rc = gpg_error_from_syserror ();
+      release_kbnode (keyblock);
+      return rc;
+    }
   pk->req_usage = use;
 
   if (from_file)
     rc = get_pubkey_fromfile (ctrl, pk, name);
+  else if (keyblock && !get_pubkey_from_keyblock (ctrl, pk, keyblock))
+    rc = 0;
   else
-    rc = get_best_pubkey_byname (ctrl, NULL, pk, name, &keyblock, 0, 0);
+    {
+      /* Not prefetched or the prefetched key is not usable; do a
+       * regular lookup which might find another key.  */
+      release_kbnode (keyblock);
+      keyblock = NULL;
+      rc = get_best_pubkey_byname (ctrl, NULL, pk, name, &keyblock, 0, 0);
+    }
   if (rc)
     {
       int code;
@@ -887,8 +1027,22 @@ find_and_check_key (ctrl_t ctrl, const char *name, unsigned int use,
           free_public_key (pk);
           return GPG_ERR_UNUSABLE_PUBKEY;
         }
+
+      /* Cache the key unless do_we_trust printed a warning or asked
+       * the user.  TOFU is not cached because it needs to track the
+       * use of keys.  */
+      if (opt.trust_model == TM_ALWAYS
+          || ((opt.trust_model == TM_CLASSIC || opt.trust_model == TM_PGP
+               || opt.trust_model == TM_DIRECT)
+              && ((trustlevel & TRUST_MASK) == TRUST_FULLY
+                  || (trustlevel & TRUST_MASK) == TRUST_ULTIMATE)))
+        rcpt_cache_put (name, use, pk);
     }
 
+  else
+    release_kbnode (keyblock);
+
+ found:
   /* Skip the actual key if the key is already present in the
      list.  */
   if (!key_present_in_pk_list (*pk_list_addr, pk))
@@ -918,6 +1072,94 @@ find_and_check_key (ctrl_t ctrl, const char *name, unsigned int use,
 }
 
 
+/* Helper for build_pk_list to find and check one key.  This helper is
+ * also used directly in server mode by the RECIPIENTS command.  On
+ * success the new key is added to PK_LIST_ADDR.  NAME is the user id
+ * of the key.  USE the requested usage and a set MARK_HIDDEN will
+ * mark the key in the updated list as a hidden recipient.  If
+ * FROM_FILE is true, NAME is not a user ID but the name of a file
+ * holding a key. */
+gpg_error_t
+find_and_check_key (ctrl_t ctrl, const char *name, unsigned int use,
+                    int mark_hidden, int from_file, pk_list_t *pk_list_addr)
+{
+  return do_find_and_check_key (ctrl, name, use, mark_hidden, from_file,
+                                NULL, pk_list_addr);
+}
+
+
+/* Look up the keys of the recipients in REMUSR which are given by
+ * fingerprint or long keyid with a single pass over the key database.
+ * Returns an array with one item for each item of REMUSR which is
+ * either the keyblock or NULL if the recipient needs to be looked up
+ * individually.  NULL is returned if it is not worth to do a batch
+ * lookup.  */
+static kbnode_t *
+prefetch_recipient_keys (strlist_t remusr)
+{
+  gpg_error_t err;
+  strlist_t sl;
+  KEYDB_SEARCH_DESC *desc;
+  size_t *descidx;
+  kbnode_t *keyblocks, *result;
+  KEYDB_HANDLE hd;
+  size_t nrcpts, ndesc, n;
+
+  for (nrcpts=0, sl=remusr; sl; sl = sl->next)
+    nrcpts++;
+  if (nrcpts < 2)
+    return NULL;
+
+  desc = xtrycalloc (nrcpts, sizeof *desc);
+  descidx = xtrycalloc (nrcpts, sizeof *descidx);
+  keyblocks = xtrycalloc (nrcpts, sizeof *keyblocks);
+  result = xtrycalloc (nrcpts, sizeof *result);
+  if (!desc || !descidx || !keyblocks || !result)
+    goto fail;
+
+  for (ndesc=n=0, sl=remusr; sl; sl = sl->next, n++)
+    {
+      if ((sl->flags & (PK_LIST_ENCRYPT_TO|PK_LIST_FROM_FILE)))
+        continue;
+      if (classify_user_id (sl->d, desc + ndesc, 1))
+        continue;
+      if (desc[ndesc].exact
+          || (desc[ndesc].mode != KEYDB_SEARCH_MODE_FPR
+              && desc[ndesc].mode != KEYDB_SEARCH_MODE_FPR20
+              && desc[ndesc].mode != KEYDB_SEARCH_MODE_LONG_KID))
+        continue;
+      descidx[ndesc++] = n;
+    }
+  if (ndesc < 2)
+    goto fail;
+
+  hd = keydb_new ();
+  if (!hd)
+    goto fail;
+  err = keydb_search_batch (hd, desc, ndesc, keyblocks);
+  keydb_release (hd);
+  if (err)
+    {
+      log_info ("batch lookup of recipient keys failed: %s\n",
+                gpg_strerror (err));
+      goto fail;
+    }
+
+  for (n=0; n < ndesc; n++)
+    result[descidx[n]] = keyblocks[n];
+  xfree (keyblocks);
+  xfree (descidx);
+  xfree (desc);
+  return result;
+
+ fail:
+  xfree (result);
+  xfree (keyblocks);
+  xfree (descidx);
+  xfree (desc);
+  return NULL;
+}
+
 
 /* This is the central function to collect the keys for recipients.
  * It is thus used to prepare a public key encryption. encrypt-to
@@ -1289,21 +1531,41 @@ build_pk_list (ctrl_t ctrl, strlist_t rcpts, PK_LIST *ret_pk_list)
     }
   else
     {
-      /* General case: Check all keys. */
+      /* General case: Check all keys.  To avoid scanning the
+       * keyring for each recipient we first look up all keys given
+       * by fingerprint or keyid at once.  */
+      kbnode_t *prefetched;
+      size_t idx;
+
       any_recipients = 0;
-      for (; remusr; remusr = remusr->next )
+      prefetched = prefetch_recipient_keys (remusr);
+      for (idx=0; remusr; remusr = remusr->next, idx++)
         {
           if ( (remusr->flags & PK_LIST_ENCRYPT_TO) )
             continue; /* encrypt-to keys are already handled. */
 
-          rc = find_and_check_key (ctrl, remusr->d, PUBKEY_USAGE_ENC,
-                                   !!(remusr->flags&PK_LIST_HIDDEN),
-                                   !!(remusr->flags&PK_LIST_FROM_FILE),
-                                   &pk_list);
+          rc = do_find_and_check_key (ctrl, remusr->d, PUBKEY_USAGE_ENC,
+                                      !!(remusr->flags&PK_LIST_HIDDEN),
+                                      !!(remusr->flags&PK_LIST_FROM_FILE),
+                                      prefetched? prefetched[idx] : NULL,
+                                      &pk_list);
+          if (prefetched)
+            prefetched[idx] = NULL;
           if (rc)
-            goto fail;
+            {
+              if (prefetched)
+                {
+                  strlist_t sl;
+
+                  for (sl = remusr; sl; sl = sl->next, idx++)
+                    release_kbnode (prefetched[idx]);
+                  xfree (prefetched);
+                }
+              goto fail;
+            }
           any_recipients = 1;
         }
+      xfree (prefetched);
     }
 
   if ( !rc && !any_recipients )
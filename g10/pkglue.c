@@ -48,71 +48,115 @@ get_mpi_from_sexp (gcry_sexp_t sexp, const char *item, int mpifmt)
 
 
 
-/****************
- * Emulate our old PK interface here - sometime in the future we might
- * change the internal design to directly fit to libgcrypt.
- */
-int
-pk_verify (pubkey_algo_t pkalgo, gcry_mpi_t hash,
-           gcry_mpi_t *data, gcry_mpi_t *pkey)
+/* Build the S-expression for the public key PKEY of algorithm PKALGO
+ * and store it at R_SEXP.  */
+static gpg_error_t
+pkey_to_sexp (pubkey_algo_t pkalgo, gcry_mpi_t *pkey, gcry_sexp_t *r_sexp)
 {
-  gcry_sexp_t s_sig, s_hash, s_pkey;
-  int rc;
-  unsigned int neededfixedlen = 0;
+  gpg_error_t rc;
 
-  /* Make a sexp from pkey.  */
+  *r_sexp = NULL;
   if (pkalgo == PUBKEY_ALGO_DSA)
     {
-      rc = gcry_sexp_build (&s_pkey, NULL,
+      rc = gcry_sexp_build (r_sexp, NULL,
 			    "(public-key(dsa(p%m)(q%m)(g%m)(y%m)))",
 			    pkey[0], pkey[1], pkey[2], pkey[3]);
     }
   else if (pkalgo == PUBKEY_ALGO_ELGAMAL_E || pkalgo == PUBKEY_ALGO_ELGAMAL)
     {
-      rc = gcry_sexp_build (&s_pkey, NULL,
+      rc = gcry_sexp_build (r_sexp, NULL,
 			    "(public-key(elg(p%m)(g%m)(y%m)))",
 			    pkey[0], pkey[1], pkey[2]);
     }
   else if (pkalgo == PUBKEY_ALGO_RSA || pkalgo == PUBKEY_ALGO_RSA_S)
     {
-      rc = gcry_sexp_build (&s_pkey, NULL,
+      rc = gcry_sexp_build (r_sexp, NULL,
 			    "(public-key(rsa(n%m)(e%m)))", pkey[0], pkey[1]);
     }
   else if (pkalgo == PUBKEY_ALGO_ECDSA)
     {
       char *curve = openpgp_oid_to_str (pkey[0]);
       if (!curve)
-        rc = gpg_error_from_syserror ();
-      else
-        {
-          rc = gcry_sexp_build (&s_pkey, NULL,
-                                "(public-key(ecdsa(curve %s)(q%m)))",
-                                curve, pkey[1]);
-          xfree (curve);
-        }
+        return gpg_error_from_syserror ();
+      rc = gcry_sexp_build (r_sexp, NULL,
+                            "(public-key(ecdsa(curve %s)(q%m)))",
+                            curve, pkey[1]);
+      xfree (curve);
     }
   else if (pkalgo == PUBKEY_ALGO_EDDSA)
     {
       char *curve = openpgp_oid_to_str (pkey[0]);
       if (!curve)
-        rc = gpg_error_from_syserror ();
-      else
-        {
-          rc = gcry_sexp_build (&s_pkey, NULL,
-                                "(public-key(ecc(curve %s)"
-                                "(flags eddsa)(q%m)))",
-                                curve, pkey[1]);
-          xfree (curve);
-        }
-
-      if (openpgp_oid_is_ed25519 (pkey[0]))
-        neededfixedlen = 256 / 8;
+        return gpg_error_from_syserror ();
+      rc = gcry_sexp_build (r_sexp, NULL,
+                            "(public-key(ecc(curve %s)"
+                            "(flags eddsa)(q%m)))",
+                            curve, pkey[1]);
+      xfree (curve);
     }
   else
     return GPG_ERR_PUBKEY_ALGO;
 
   if (rc)
     BUG ();  /* gcry_sexp_build should never fail.  */
+  return 0;
+}
+
+
+/* Build the S-expression of the public key PK used by pk_verify and
+ * attach it to PK.  Because the object is shared with all copies of
+ * PK made by copy_public_key, a key taken from the key cache needs
+ * to convert its MPIs only once, however many signatures it has
+ * issued.  This function must only be called by the main thread;
+ * pk_verify itself only reads the object and may thus run in a
+ * worker thread.  Errors are ignored; pk_verify will then build a
+ * temporary S-expression and report the error.  */
+void
+pk_verify_prepare (PKT_public_key *pk)
+{
+  gcry_sexp_t s_pkey;
+
+  if (pk->pkey_sexp)
+    return;
+  if (pkey_to_sexp (pk->pubkey_algo, pk->pkey, &s_pkey))
+    return;
+  pk->pkey_sexp = xtrycalloc (1, sizeof *pk->pkey_sexp);
+  if (!pk->pkey_sexp)
+    {
+      gcry_sexp_release (s_pkey);
+      return;
+    }
+  pk->pkey_sexp->refcount = 1;
+  pk->pkey_sexp->sexp = s_pkey;
+}
+
+
+/****************
+ * Emulate our old PK interface here - sometime in the future we might
+ * change the internal design to directly fit to libgcrypt.  The
+ * public key S-expression attached to PK by pk_verify_prepare is
+ * used if available.
+ */
+int
+pk_verify (PKT_public_key *pk, gcry_mpi_t hash, gcry_mpi_t *data)
+{
+  pubkey_algo_t pkalgo = pk->pubkey_algo;
+  gcry_sexp_t s_sig, s_hash, s_pkey;
+  int rc;
+  unsigned int neededfixedlen = 0;
+
+  /* Make a sexp from pkey.  */
+  if (pk->pkey_sexp)
+    s_pkey = pk->pkey_sexp->sexp;
+  else
+    {
+      rc = pkey_to_sexp (pkalgo, pk->pkey, &s_pkey);
+      if (rc)
+        return rc;
+    }
+
+  if (pkalgo == PUBKEY_ALGO_EDDSA && openpgp_oid_is_ed25519 (pk->pkey[0]))
+    neededfixedlen = 256 / 8;
 
   /* Put hash into a S-Exp s_hash. */
   if (pkalgo == PUBKEY_ALGO_EDDSA)
@@ -225,27 +269,29 @@ pk_verify (pubkey_algo_t pkalgo, gcry_mpi_t hash,
 
   gcry_sexp_release (s_sig);
   gcry_sexp_release (s_hash);
-  gcry_sexp_release (s_pkey);
+  if (!pk->pkey_sexp)
+    gcry_sexp_release (s_pkey);
   return rc;
 }
 
 
 
 
-/****************
- * Emulate our old PK interface here - sometime in the future we might
- * change the internal design to directly fit to libgcrypt.
- * PK is only required to compute the fingerprint for ECDH.
- */
-int
-pk_encrypt (pubkey_algo_t algo, gcry_mpi_t *resarr, gcry_mpi_t data,
-            PKT_public_key *pk, gcry_mpi_t *pkey)
+/* Build the S-expressions required by gcry_pk_encrypt for encrypting
+ * DATA with the public key PKEY using ALGO and store them at R_PKEY
+ * and R_DATA.  This is the first part of pk_encrypt; it is separate
+ * so that the actual encryption can be run in a worker thread.  */
+gpg_error_t
+pk_encrypt_prepare (pubkey_algo_t algo, gcry_mpi_t data, gcry_mpi_t *pkey,
+                    gcry_sexp_t *r_pkey, gcry_sexp_t *r_data)
 {
-  gcry_sexp_t s_ciph = NULL;
   gcry_sexp_t s_data = NULL;
   gcry_sexp_t s_pkey = NULL;
   int rc;
 
+  *r_pkey = NULL;
+  *r_data = NULL;
+
   /* Make a sexp from pkey.  */
   if (algo == PUBKEY_ALGO_ELGAMAL || algo == PUBKEY_ALGO_ELGAMAL_E)
     {
@@ -298,16 +344,28 @@ pk_encrypt (pubkey_algo_t algo, gcry_mpi_t *resarr, gcry_mpi_t data,
   else
     rc = gpg_error (GPG_ERR_PUBKEY_ALGO);
 
-  /* Pass it to libgcrypt. */
-  if (!rc)
-    rc = gcry_pk_encrypt (&s_ciph, s_data, s_pkey);
+  if (rc)
+    {
+      gcry_sexp_release (s_data);
+      gcry_sexp_release (s_pkey);
+      return rc;
+    }
+  *r_pkey = s_pkey;
+  *r_data = s_data;
+  return 0;
+}
 
-  gcry_sexp_release (s_data);
-  gcry_sexp_release (s_pkey);
 
-  if (rc)
-    ;
-  else if (algo == PUBKEY_ALGO_ECDH)
+/* Store the result S_CIPH of gcry_pk_encrypt for the DATA prepared
+ * by pk_encrypt_prepare in RESARR.  This is the last part of
+ * pk_encrypt.  S_CIPH is released by this function.  */
+gpg_error_t
+pk_encrypt_finish (pubkey_algo_t algo, gcry_mpi_t *resarr, gcry_mpi_t data,
+                   PKT_public_key *pk, gcry_mpi_t *pkey, gcry_sexp_t s_ciph)
+{
+  int rc = 0;
+
+  if (algo == PUBKEY_ALGO_ECDH)
     {
       gcry_mpi_t shared, public, result;
       byte fp[MAX_FINGERPRINT_LEN];
@@ -357,6 +415,37 @@ pk_encrypt (pubkey_algo_t algo, gcry_mpi_t *resarr, gcry_mpi_t data,
 }
 
 
+/****************
+ * Emulate our old PK interface here - sometime in the future we might
+ * change the internal design to directly fit to libgcrypt.
+ * PK is only required to compute the fingerprint for ECDH.
+ */
+int
+pk_encrypt (pubkey_algo_t algo, gcry_mpi_t *resarr, gcry_mpi_t data,
+            PKT_public_key *pk, gcry_mpi_t *pkey)
+{
+  gcry_sexp_t s_ciph = NULL;
+  gcry_sexp_t s_data;
+  gcry_sexp_t s_pkey;
+  int rc;
+
+  rc = pk_encrypt_prepare (algo, data, pkey, &s_pkey, &s_data);
+
+  /* Pass it to libgcrypt. */
+  if (!rc)
+    rc = gcry_pk_encrypt (&s_ciph, s_data, s_pkey);
+
+  gcry_sexp_release (s_data);
+  gcry_sexp_release (s_pkey);
+
+  if (!rc)
+    rc = pk_encrypt_finish (algo, resarr, data, pk, pkey, s_ciph);
+  else
+    gcry_sexp_release (s_ciph);
+  return rc;
+}
+
+
 /* Check whether SKEY is a suitable secret key. */
 int
 pk_check_secret_key (pubkey_algo_t pkalgo, gcry_mpi_t *skey)
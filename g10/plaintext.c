@@ -220,6 +220,20 @@ get_output_file (const byte *embedded_name, int embedded_namelen,
   return 0;
 }
 
+/* Write DATA of LENGTH to FP or, if WB is not NULL, queue it for
+ * writing by the writer thread.  */
+static gpg_error_t
+write_plaintext (write_behind_t wb, estream_t fp,
+                 const void *data, size_t length)
+{
+  if (wb)
+    return write_behind_write (wb, data, length);
+  if (es_fwrite (data, 1, length, fp) != length)
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
 /* Handle a plaintext packet.  If MFX is not NULL, update the MDs
  * Note: We should have used the filter stuff here, but we have to add
  * some easy mimic to set a read limit, so we calculate only the bytes
@@ -230,6 +244,7 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 {
   char *fname = NULL;
   estream_t fp = NULL;
+  write_behind_t wb = NULL;
   static off_t count = 0;
   int err = 0;
   int c;
@@ -273,6 +288,13 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
       err = get_output_file (pt->name, pt->namelen, pt->buf, &fname, &fp);
       if (err)
         goto leave;
+
+      /* Binary data may be written by a separate thread.  Not for
+       * stdout if status lines are printed because they could go to
+       * the same fd and would then be written out of order.  */
+      if (opt.io_threads && !convert && !clearsig
+          && !(fp == es_stdout && is_status_enabled ()))
+        write_behind_new (&wb, fp);
     }
 
   if (!pt->is_partial)
@@ -329,21 +351,22 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 	}
       else  /* Binary mode.  */
 	{
-	  byte *buffer = xmalloc (32768);
+          /* We hash and write directly from the iobuf's buffer.  */
+	  const byte *data;
 	  while (pt->len)
 	    {
-	      int len = pt->len > 32768 ? 32768 : pt->len;
-	      len = iobuf_read (pt->buf, buffer, len);
+	      int len = iobuf_read_view (pt->buf, &data);
 	      if (len == -1)
 		{
 		  err = gpg_error_from_syserror ();
 		  log_error ("problem reading source (%u bytes remaining)\n",
 			     (unsigned) pt->len);
-		  xfree (buffer);
 		  goto leave;
 		}
+	      if (len > pt->len)
+		len = pt->len;
 	      if (mfx->md)
-		gcry_md_write (mfx->md, buffer, len);
+		gcry_md_write (mfx->md, data, len);
 	      if (fp)
 		{
 		  if (opt.max_output && (count += len) > opt.max_output)
@@ -351,21 +374,18 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		      log_error ("error writing to '%s': %s\n",
 				 fname, "exceeded --max-output limit\n");
 		      err = gpg_error (GPG_ERR_TOO_LARGE);
-		      xfree (buffer);
 		      goto leave;
 		    }
-		  else if (es_fwrite (buffer, 1, len, fp) != len)
+		  else if ((err = write_plaintext (wb, fp, data, len)))
 		    {
-		      err = gpg_error_from_syserror ();
 		      log_error ("error writing to '%s': %s\n",
 				 fname, gpg_strerror (err));
-		      xfree (buffer);
 		      goto leave;
 		    }
 		}
+	      iobuf_release_view (pt->buf, len);
 	      pt->len -= len;
 	    }
-	  xfree (buffer);
 	}
     }
   else if (!clearsig)
@@ -404,31 +424,17 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 	}
       else
 	{			/* binary mode */
-	  byte *buffer;
-	  int eof_seen = 0;
-
-          buffer = xtrymalloc (32768);
-          if (!buffer)
-            {
-              err = gpg_error_from_syserror ();
-              goto leave;
-            }
-
-	  while (!eof_seen)
+	  /* Note that iobuf_read_view returns the EOF of the block
+	   * filter exactly once and does not read across it; thus we
+	   * can simply read until EOF.  The data is hashed and written
+	   * directly from the iobuf's buffer.  */
+	  const byte *data;
+	  int len;
+
+	  while ((len = iobuf_read_view (pt->buf, &data)) != -1)
 	    {
-	      /* Why do we check for len < 32768:
-	       * If we won't, we would practically read 2 EOFs but
-	       * the first one has already popped the block_filter
-	       * off and therefore we don't catch the boundary.
-	       * So, always assume EOF if iobuf_read returns less bytes
-	       * then requested */
-	      int len = iobuf_read (pt->buf, buffer, 32768);
-	      if (len == -1)
-		break;
-	      if (len < 32768)
-		eof_seen = 1;
 	      if (mfx->md)
-		gcry_md_write (mfx->md, buffer, len);
+		gcry_md_write (mfx->md, data, len);
 	      if (fp)
 		{
 		  if (opt.max_output && (count += len) > opt.max_output)
@@ -436,20 +442,17 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		      log_error ("error writing to '%s': %s\n",
 				 fname, "exceeded --max-output limit\n");
 		      err = gpg_error (GPG_ERR_TOO_LARGE);
-		      xfree (buffer);
 		      goto leave;
 		    }
-		  else if (es_fwrite (buffer, 1, len, fp) != len)
+		  else if ((err = write_plaintext (wb, fp, data, len)))
 		    {
-		      err = gpg_error_from_syserror ();
 		      log_error ("error writing to '%s': %s\n",
 				 fname, gpg_strerror (err));
-		      xfree (buffer);
 		      goto leave;
 		    }
 		}
+	      iobuf_release_view (pt->buf, len);
 	    }
-	  xfree (buffer);
 	}
       pt->buf = NULL;
     }
@@ -513,6 +516,18 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
       pt->buf = NULL;
     }
 
+  if (wb)
+    {
+      err = write_behind_close (wb);
+      wb = NULL;
+      if (err)
+        {
+          log_error ("error writing to '%s': %s\n",
+                     fname, gpg_strerror (err));
+          goto leave;
+        }
+    }
+
   if (fp && fp != es_stdout && fp != opt.outfp && es_fclose (fp))
     {
       err = gpg_error_from_syserror ();
@@ -523,6 +538,8 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
   fp = NULL;
 
  leave:
+  write_behind_close (wb);
+
   /* Make sure that stdout gets flushed after the plaintext has been
      handled.  This is for extra security as we do a flush anyway
      before checking the signature.  */
@@ -583,10 +600,14 @@ do_hash (gcry_md_hd_t md, gcry_md_hd_t md2, IOBUF fp, int textmode)
     }
   else
     {
-      while ((c = iobuf_get (fp)) != -1)
+      const byte *data;
+      int n;
+
+      while ((n = iobuf_read_view (fp, &data)) != -1)
 	{
 	  if (md)
-	    gcry_md_putc (md, c);
+	    gcry_md_write (md, data, n);
+	  iobuf_release_view (fp, n);
 	}
     }
 }
@@ -710,6 +731,10 @@ hash_datafiles (gcry_md_hd_t md, gcry_md_hd_t md2, strlist_t files,
   for (sl = files; sl; sl = sl->next)
     {
       fp = iobuf_open (sl->d);
+      if (fp)
+        iobuf_ioctl (fp, IOBUF_IOCTL_NO_CACHE, 1, NULL);
+      if (fp && opt.mmap_signed_data)
+        iobuf_ioctl (fp, IOBUF_IOCTL_MMAP, 1, NULL);
       if (fp && is_secured_file (iobuf_get_fd (fp)))
 	{
 	  iobuf_close (fp);
@@ -164,6 +164,229 @@ get_session_key (ctrl_t ctrl, PKT_pubkey_enc * k, DEK * dek)
 }
 
 
+/* An item of the table of keys tried by get_session_key_from_list.  */
+struct seskey_candidate
+{
+  struct pubkey_enc_list *item;
+  PKT_public_key *sk;
+  int prio;  /* 0 = passphrase cached, 1 = on disk, 2 = on a token.  */
+  int idx;   /* The original position to keep the sort stable.  */
+};
+
+
+/* qsort compare function for the candidates.  */
+static int
+cmp_candidates (const void *a_arg, const void *b_arg)
+{
+  const struct seskey_candidate *a = a_arg;
+  const struct seskey_candidate *b = b_arg;
+
+  if (a->prio != b->prio)
+    return a->prio - b->prio;
+  return a->idx - b->idx;
+}
+
+
+/* Check whether the secret key for SK is available.  GRIPS is the
+ * list of secret keys as returned by agent_list_secret_keys; if
+ * HAVE_GRIPS is false the agent is asked for this key.  On success
+ * the AGENT_KEYINFO flags are stored at R_FLAGS.  */
+static gpg_error_t
+check_secret_key (ctrl_t ctrl, strlist_t grips, int have_grips,
+                  PKT_public_key *sk, unsigned int *r_flags)
+{
+  gpg_error_t err;
+  char *hexgrip;
+  strlist_t sl;
+
+  *r_flags = 0;
+  if (!have_grips)
+    return agent_probe_secret_key (ctrl, sk);
+
+  err = hexkeygrip_from_pk (sk, &hexgrip);
+  if (err)
+    return err;
+  for (sl = grips; sl; sl = sl->next)
+    if (!strcmp (sl->d, hexgrip))
+      break;
+  xfree (hexgrip);
+  if (!sl)
+    return gpg_error (GPG_ERR_NO_SECKEY);
+  *r_flags = sl->flags;
+  return 0;
+}
+
+
+/* Return true if ITEM is to be tried with all secret keys.  */
+static int
+is_anonymous_recipient (struct pubkey_enc_list *item)
+{
+  return ((!item->enc->keyid[0] && !item->enc->keyid[1])
+          || opt.try_all_secrets);
+}
+
+
+/* Get the session key from one of the pubkey enc packets in LIST and
+ * return it in DEK, which should have been allocated in secure memory
+ * by the caller.  The result for each packet is stored in its RESULT
+ * field.  Unlike calling get_session_key for each packet, the agent
+ * is asked only once for all available secret keys so that packets
+ * for which no secret key is available do not need a round trip.
+ * The remaining keys are tried in an order which avoids a pinentry if
+ * possible: keys with a cached passphrase first, then keys on disk,
+ * and keys on a smartcard last.  */
+gpg_error_t
+get_session_key_from_list (ctrl_t ctrl, struct pubkey_enc_list *list,
+                           DEK *dek)
+{
+  gpg_error_t err;
+  gpg_error_t rc = gpg_error (GPG_ERR_NO_SECKEY);
+  strlist_t grips = NULL;
+  int have_grips;
+  struct pubkey_enc_list *item;
+  struct seskey_candidate *cands = NULL;
+  int ncands = 0;
+  int any_anonymous = 0;
+  unsigned int flags;
+  PKT_public_key *sk;
+  int i;
+
+  if (DBG_CLOCK)
+    log_clock ("get_session_key_from_list enter");
+
+  have_grips = !agent_list_secret_keys (ctrl, &grips);
+
+  for (item = list; item; item = item->next)
+    {
+      item->result = openpgp_pk_test_algo2 (item->enc->pubkey_algo,
+                                            PUBKEY_USAGE_ENC);
+      if (item->result)
+        continue;
+      item->result = gpg_error (GPG_ERR_NO_SECKEY);
+      if (is_anonymous_recipient (item))
+        {
+          any_anonymous = 1;
+          continue;
+        }
+
+      sk = xmalloc_clear (sizeof *sk);
+      sk->pubkey_algo = item->enc->pubkey_algo;
+      err = get_pubkey_exact (ctrl, sk, item->enc->keyid);
+      if (!err)
+        err = check_secret_key (ctrl, grips, have_grips, sk, &flags);
+      if (!err && !gnupg_pk_is_allowed (opt.compliance, PK_USE_DECRYPTION,
+                                        sk->pubkey_algo, sk->pkey,
+                                        nbits_from_pk (sk), NULL))
+        {
+          log_info (_("key %s is not suitable for decryption"
+                      " in %s mode\n"),
+                    keystr_from_pk (sk),
+                    gnupg_compliance_option_string (opt.compliance));
+          err = gpg_error (GPG_ERR_PUBKEY_ALGO);
+        }
+      if (err)
+        {
+          item->result = err;
+          free_public_key (sk);
+          continue;
+        }
+
+      cands = xrealloc (cands, (ncands + 1) * sizeof *cands);
+      cands[ncands].item = item;
+      cands[ncands].sk = sk;
+      cands[ncands].prio = ((flags & AGENT_KEYINFO_CACHED)? 0 :
+                            (flags & AGENT_KEYINFO_TOKEN)? 2 : 1);
+      cands[ncands].idx = ncands;
+      ncands++;
+    }
+
+  if (ncands > 1)
+    qsort (cands, ncands, sizeof *cands, cmp_candidates);
+  for (i=0; i < ncands; i++)
+    {
+      item = cands[i].item;
+      item->result = get_it (ctrl, item->enc, dek, cands[i].sk,
+                             item->enc->keyid);
+      rc = item->result;
+      if (!rc || gpg_err_code (rc) == GPG_ERR_FULLY_CANCELED)
+        goto leave;
+    }
+
+  if (!any_anonymous || opt.skip_hidden_recipients)
+    goto leave;
+
+  /* Anonymous receivers: Try all available secret keys.  */
+  {
+    void *enum_context = NULL;
+    u32 keyid[2];
+
+    for (sk = NULL;;)
+      {
+        free_public_key (sk);
+        sk = xmalloc_clear (sizeof *sk);
+        if (enum_secret_keys (ctrl, &enum_context, sk))
+          break;
+        if (!(sk->pubkey_usage & PUBKEY_USAGE_ENC))
+          continue;
+        /* If we know the secret keys we can skip subkeys without a
+         * secret key instead of asking the agent to decrypt.  */
+        if (have_grips && check_secret_key (ctrl, grips, 1, sk, &flags))
+          continue;
+
+        for (item = list; item; item = item->next)
+          {
+            if (!is_anonymous_recipient (item)
+                || item->enc->pubkey_algo != sk->pubkey_algo
+                || openpgp_pk_test_algo2 (item->enc->pubkey_algo,
+                                          PUBKEY_USAGE_ENC))
+              continue;
+
+            keyid_from_pk (sk, keyid);
+            if (!opt.quiet)
+              log_info (_("anonymous recipient; trying secret key %s ...\n"),
+                        keystr (keyid));
+
+            /* Check compliance.  */
+            if (! gnupg_pk_is_allowed (opt.compliance, PK_USE_DECRYPTION,
+                                       sk->pubkey_algo,
+                                       sk->pkey, nbits_from_pk (sk), NULL))
+              {
+                log_info (_("key %s is not suitable for decryption"
+                            " in %s mode\n"),
+                          keystr_from_pk (sk),
+                          gnupg_compliance_option_string (opt.compliance));
+                break;
+              }
+
+            item->result = get_it (ctrl, item->enc, dek, sk, keyid);
+            rc = item->result;
+            if (!rc)
+              {
+                if (!opt.quiet)
+                  log_info (_("okay, we are the anonymous recipient.\n"));
+                break;
+              }
+            else if (gpg_err_code (rc) == GPG_ERR_FULLY_CANCELED)
+              break; /* Don't try any more secret keys.  */
+          }
+        if (!rc || gpg_err_code (rc) == GPG_ERR_FULLY_CANCELED)
+          break;
+      }
+    free_public_key (sk);
+    enum_secret_keys (ctrl, &enum_context, NULL);  /* free context */
+  }
+
+ leave:
+  for (i=0; i < ncands; i++)
+    free_public_key (cands[i].sk);
+  xfree (cands);
+  free_strlist (grips);
+  if (DBG_CLOCK)
+    log_clock ("get_session_key_from_list leave");
+  return rc;
+}
+
+
 static gpg_error_t
 get_it (ctrl_t ctrl,
         PKT_pubkey_enc *enc, DEK *dek, PKT_public_key *sk, u32 *keyid)
@@ -407,6 +407,10 @@ cmd_verify (assuan_context_t ctx, char *line)
 
   rc = gpg_verify (ctrl, fd, ctrl->server_local->message_fd, out_fp);
 
+  /* A server may run for a long time; thus write new results of key
+   * signature verifications now and not only at exit.  */
+  sigcache_flush ();
+
   es_fclose (out_fp);
   close_message_fd (ctrl);
   assuan_close_input_fd (ctx);
@@ -442,9 +446,48 @@ cmd_sign (assuan_context_t ctx, char *line)
 static gpg_error_t
 cmd_import (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  gnupg_fd_t fd = assuan_get_input_fd (ctx);
+  es_syshd_t syshd;
+  estream_t fp;
+  import_stats_t stats;
+
   (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  if (fd == GNUPG_INVALID_FD)
+    return set_error (GPG_ERR_ASS_NO_INPUT, NULL);
+
+#ifdef HAVE_W32_SYSTEM
+  syshd.type = ES_SYSHD_HANDLE;
+  syshd.u.handle = fd;
+#else
+  syshd.type = ES_SYSHD_FD;
+  syshd.u.fd = fd;
+#endif
+  fp = es_sysopen_nc (&syshd, "rb");
+  if (!fp)
+    {
+      err = set_error (gpg_err_code_from_syserror (), "fdopen() failed");
+      goto leave;
+    }
+
+  stats = import_new_stats_handle ();
+  err = import_keys_es_stream (ctrl, fp, stats, NULL, NULL,
+                               opt.import_options, NULL, NULL,
+                               opt.key_origin, opt.key_origin_url);
+  import_print_stats (stats);
+  import_release_stats_handle (stats);
+  es_fclose (fp);
+
+ leave:
+  close_message_fd (ctrl);
+  assuan_close_input_fd (ctx);
+  assuan_close_output_fd (ctx);
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "IMPORT", gpg_strerror (err));
+  return err;
 }
 
 
@@ -41,7 +41,7 @@ static int check_signature_end (PKT_public_key *pk, PKT_signature *sig,
 				PKT_public_key *ret_pk);
 
 static int check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
-                                       gcry_md_hd_t digest);
+                                       gcry_md_hd_t digest, int use_sigcache);
 
 
 /* Statistics for signature verification.  */
@@ -53,6 +53,9 @@ struct
   unsigned int badsig; /* Number of bad verifications from the cache.  */
 } cache_stats;
 
+/* The number of public key operations done to verify signatures.  */
+static unsigned int pk_verify_count;
+
 
 /* Dump verification stats.  */
 void
@@ -61,6 +64,19 @@ sig_check_dump_stats (void)
   log_info ("sig_cache: total=%u cached=%u good=%u bad=%u\n",
             cache_stats.total, cache_stats.cached,
             cache_stats.goodsig, cache_stats.badsig);
+  sigcache_dump_stats ();
+}
+
+
+/* Emit the statistics of this module for the stats registry.  */
+void
+sig_check_stats_report (stats_sink_t sink)
+{
+  stats_put (sink, "pk_verify", pk_verify_count);
+  stats_put (sink, "keysig_total", cache_stats.total);
+  stats_put (sink, "keysig_cached", cache_stats.cached);
+  stats_put (sink, "keysig_cached_good", cache_stats.goodsig);
+  stats_put (sink, "keysig_cached_bad", cache_stats.badsig);
 }
 
 
@@ -432,7 +448,7 @@ check_signature_end (PKT_public_key *pk, PKT_signature *sig,
                                                r_expired, r_revoked)))
     return rc;
 
-  if ((rc = check_signature_end_simple (pk, sig, digest)))
+  if ((rc = check_signature_end_simple (pk, sig, digest, 0)))
     return rc;
 
   if (!rc && ret_pk)
@@ -442,17 +458,84 @@ check_signature_end (PKT_public_key *pk, PKT_signature *sig,
 }
 
 
-/* This function is similar to check_signature_end, but it only checks
- * whether the signature was generated by PK.  It does not check
- * expiration, revocation, etc.  */
+/* Compute the key for the persistent signature cache of the
+ * signature SIG made by PK over the finalized DIGEST and store it at
+ * KEY, which must have room for SIGCACHE_KEYLEN bytes.  Returns false
+ * if no key can be computed.  */
 static int
-check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
-                            gcry_md_hd_t digest)
+make_sigcache_key (PKT_public_key *pk, PKT_signature *sig,
+                   gcry_md_hd_t digest, byte *key)
+{
+  gcry_md_hd_t md;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+  const byte *dval;
+  int i, nsig;
+
+  dval = gcry_md_read (digest, sig->digest_algo);
+  if (!dval || gcry_md_open (&md, GCRY_MD_SHA256, 0))
+    return 0;
+
+  fingerprint_from_pk (pk, fpr, &fprlen);
+  gcry_md_putc (md, fprlen);
+  gcry_md_write (md, fpr, fprlen);
+  gcry_md_putc (md, sig->pubkey_algo);
+  gcry_md_putc (md, sig->digest_algo);
+  gcry_md_putc (md, sig->sig_class);
+  gcry_md_write (md, dval, gcry_md_get_algo_dlen (sig->digest_algo));
+
+  nsig = pubkey_get_nsig (sig->pubkey_algo);
+  for (i=0; i < nsig; i++)
+    {
+      const byte *p;
+      unsigned char *buf;
+      unsigned int nbits;
+      size_t n;
+
+      if (!sig->data[i])
+        {
+          gcry_md_close (md);
+          return 0;
+        }
+      if (gcry_mpi_get_flag (sig->data[i], GCRYMPI_FLAG_OPAQUE))
+        {
+          p = gcry_mpi_get_opaque (sig->data[i], &nbits);
+          gcry_md_putc (md, nbits >> 8);
+          gcry_md_putc (md, nbits);
+          if (p)
+            gcry_md_write (md, p, (nbits + 7) / 8);
+        }
+      else if (!gcry_mpi_aprint (GCRYMPI_FMT_PGP, &buf, &n, sig->data[i]))
+        {
+          gcry_md_write (md, buf, n);
+          gcry_free (buf);
+        }
+      else
+        {
+          gcry_md_close (md);
+          return 0;
+        }
+    }
+
+  memcpy (key, gcry_md_read (md, GCRY_MD_SHA256), SIGCACHE_KEYLEN);
+  gcry_md_close (md);
+  return 1;
+}
+
+
+/* Run the checks of check_signature_end_simple which come before the
+ * public key operation and complete DIGEST.  Returns 0 on success.  */
+static int
+check_signature_end_prepare (PKT_public_key *pk, PKT_signature *sig,
+                             gcry_md_hd_t digest)
 {
-  gcry_mpi_t result = NULL;
   int rc = 0;
   const struct weakhash *weak;
 
+  rc = parse_sig_data (sig);
+  if (rc)
+    return rc;
+
   if (!opt.flags.allow_weak_digest_algos)
     {
       for (weak = opt.weak_digests; weak; weak = weak->next)
@@ -538,21 +621,17 @@ check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
 	buf[5] = n;
 	gcry_md_write( digest, buf, 6 );
     }
-    gcry_md_final( digest );
+  gcry_md_final( digest );
 
-    /* Convert the digest to an MPI.  */
-    result = encode_md_value (pk, digest, sig->digest_algo );
-    if (!result)
-        return GPG_ERR_GENERAL;
+  return 0;
+}
 
-    /* Verify the signature.  */
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("enter pk_verify");
-    rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("leave pk_verify");
-    gcry_mpi_release (result);
 
+/* Run the checks of check_signature_end_simple which come after the
+ * public key operation.  RC is the result of that operation.  */
+static int
+check_signature_end_finish (PKT_public_key *pk, PKT_signature *sig, int rc)
+{
   if (!rc && sig->flags.unknown_critical)
     {
       log_info(_("assuming bad signature from key %s"
@@ -564,6 +643,55 @@ check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
 }
 
 
+/* This function is similar to check_signature_end, but it only checks
+ * whether the signature was generated by PK.  It does not check
+ * expiration, revocation, etc.  If USE_SIGCACHE is set the result of
+ * the public key operation is taken from or stored in the persistent
+ * signature cache.  */
+static int
+check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
+                            gcry_md_hd_t digest, int use_sigcache)
+{
+  gcry_mpi_t result = NULL;
+  int rc;
+  byte cachekey[SIGCACHE_KEYLEN];
+
+  rc = check_signature_end_prepare (pk, sig, digest);
+  if (rc)
+    return rc;
+
+  if (use_sigcache && !opt.no_sig_cache
+      && make_sigcache_key (pk, sig, digest, cachekey))
+    {
+      rc = sigcache_lookup (cachekey);
+      if (gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
+        return check_signature_end_finish (pk, sig, rc);
+    }
+  else
+    use_sigcache = 0;
+
+  /* Convert the digest to an MPI.  */
+  result = encode_md_value (pk, digest, sig->digest_algo );
+  if (!result)
+    return GPG_ERR_GENERAL;
+
+  /* Verify the signature.  */
+  if (DBG_CLOCK && sig->sig_class <= 0x01)
+    log_clock ("enter pk_verify");
+  pk_verify_count++;
+  pk_verify_prepare (pk);
+  rc = pk_verify (pk, result, sig->data);
+  if (DBG_CLOCK && sig->sig_class <= 0x01)
+    log_clock ("leave pk_verify");
+  gcry_mpi_release (result);
+
+  if (use_sigcache)
+    sigcache_store (cachekey, rc);
+
+  return check_signature_end_finish (pk, sig, rc);
+}
+
+
 /* Add a uid node to a hash context.  See section 5.2.4, paragraph 4
  * of RFC 4880.  */
 static void
@@ -771,6 +899,47 @@ check_backsig (PKT_public_key *main_pk,PKT_public_key *sub_pk,
 }
 
 
+/* Hash the data signed by the key signature SIG into MD.  PRIPK is
+ * the primary key of the keyblock, SIGNER the key which made the
+ * signature and PACKET the key, subkey or user id over which SIG has
+ * been made.  */
+static void
+hash_signed_key_data (gcry_md_hd_t md, PKT_public_key *pripk,
+                      PKT_public_key *signer, PKT_signature *sig,
+                      PACKET *packet)
+{
+  if (IS_KEY_SIG (sig) || IS_KEY_REV (sig))
+    {
+      log_assert (packet->pkttype == PKT_PUBLIC_KEY);
+      hash_public_key (md, packet->pkt.public_key);
+    }
+  else if (IS_BACK_SIG (sig))
+    {
+      log_assert (packet->pkttype == PKT_PUBLIC_KEY);
+      hash_public_key (md, packet->pkt.public_key);
+      hash_public_key (md, signer);
+    }
+  else if (IS_SUBKEY_SIG (sig) || IS_SUBKEY_REV (sig))
+    {
+      log_assert (packet->pkttype == PKT_PUBLIC_SUBKEY);
+      hash_public_key (md, pripk);
+      hash_public_key (md, packet->pkt.public_key);
+    }
+  else if (IS_UID_SIG (sig) || IS_UID_REV (sig))
+    {
+      log_assert (packet->pkttype == PKT_USER_ID);
+      hash_public_key (md, pripk);
+      hash_uid_packet (packet->pkt.user_id, md, sig);
+    }
+  else
+    {
+      /* We should never get here.  (The callers check the class of
+       * the signature.)  */
+      BUG ();
+    }
+}
+
+
 /* Check that a signature over a key is valid.  This is a
  * specialization of check_key_signature2 with the unnamed parameters
  * passed as NULL.  See the documentation for that function for more
@@ -943,42 +1112,8 @@ check_signature_over_key_or_uid (ctrl_t ctrl, PKT_public_key *signer,
   if (gcry_md_open (&md, sig->digest_algo, 0))
     BUG ();
 
-  /* Hash the relevant data.  */
-
-  if (IS_KEY_SIG (sig) || IS_KEY_REV (sig))
-    {
-      log_assert (packet->pkttype == PKT_PUBLIC_KEY);
-      hash_public_key (md, packet->pkt.public_key);
-      rc = check_signature_end_simple (signer, sig, md);
-    }
-  else if (IS_BACK_SIG (sig))
-    {
-      log_assert (packet->pkttype == PKT_PUBLIC_KEY);
-      hash_public_key (md, packet->pkt.public_key);
-      hash_public_key (md, signer);
-      rc = check_signature_end_simple (signer, sig, md);
-    }
-  else if (IS_SUBKEY_SIG (sig) || IS_SUBKEY_REV (sig))
-    {
-      log_assert (packet->pkttype == PKT_PUBLIC_SUBKEY);
-      hash_public_key (md, pripk);
-      hash_public_key (md, packet->pkt.public_key);
-      rc = check_signature_end_simple (signer, sig, md);
-    }
-  else if (IS_UID_SIG (sig) || IS_UID_REV (sig))
-    {
-      log_assert (packet->pkttype == PKT_USER_ID);
-      hash_public_key (md, pripk);
-      hash_uid_packet (packet->pkt.user_id, md, sig);
-      rc = check_signature_end_simple (signer, sig, md);
-    }
-  else
-    {
-      /* We should never get here.  (The first if above should have
-       * already caught this error.)  */
-      BUG ();
-    }
-
+  hash_signed_key_data (md, pripk, signer, sig, packet);
+  rc = check_signature_end_simple (signer, sig, md, 1);
   gcry_md_close (md);
 
  leave:
@@ -1192,3 +1327,358 @@ check_key_signature2 (ctrl_t ctrl,
 
   return rc;
 }
+
+
+/* A job to verify one signature in a worker thread.  */
+struct sig_job_s
+{
+  struct workpool_job_s job;
+  PKT_public_key *pk;       /* The signing key.  */
+  int pk_alloced;           /* PK has been looked up for this job.  */
+  PKT_signature *sig;       /* The signature.  */
+  gcry_mpi_t result;        /* The encoded digest.  */
+  int use_sigcache;         /* CACHEKEY is valid.  */
+  byte cachekey[SIGCACHE_KEYLEN];
+  int rc;                   /* The result of pk_verify.  */
+};
+
+
+/* The thread function of a sig_job_s.  This must not call any
+ * function which is not thread-safe.  */
+static void
+sig_job_func (void *opaque)
+{
+  struct sig_job_s *sj = opaque;
+
+  sj->rc = pk_verify (sj->pk, sj->result, sj->sig->data);
+}
+
+
+/* Release the resources of the job SJ.  */
+static void
+release_sig_job (struct sig_job_s *sj)
+{
+  gcry_mpi_release (sj->result);
+  sj->result = NULL;
+  if (sj->pk_alloced)
+    {
+      free_public_key (sj->pk);
+      sj->pk_alloced = 0;
+    }
+  sj->pk = NULL;
+}
+
+
+/* Prepare the job SJ to check the signature SIG by SIGNER over
+ * PACKET in the keyblock with the primary key PRIPK.  If SIGNER is
+ * NULL the signing key is looked up.  Returns false if the signature
+ * shall not be checked by a job; in this case the result may already
+ * have been cached in SIG.  */
+static int
+prepare_sig_job (ctrl_t ctrl, struct sig_job_s *sj, PKT_public_key *signer,
+                 PKT_public_key *pripk, PKT_signature *sig, PACKET *packet)
+{
+  gcry_md_hd_t md;
+  int rc;
+
+  if (openpgp_pk_test_algo (sig->pubkey_algo)
+      || openpgp_md_test_algo (sig->digest_algo))
+    return 0;
+
+  memset (sj, 0, sizeof *sj);
+  sj->sig = sig;
+  if (signer)
+    sj->pk = signer;
+  else
+    {
+      sj->pk = xtrycalloc (1, sizeof *sj->pk);
+      if (!sj->pk)
+        return 0;
+      sj->pk_alloced = 1;
+      if (IS_CERT (sig))
+        sj->pk->req_usage = PUBKEY_USAGE_CERT;
+      if (get_pubkey_for_sig (ctrl, sj->pk, sig))
+        {
+          release_sig_job (sj);
+          return 0;
+        }
+    }
+
+  if (gcry_md_open (&md, sig->digest_algo, 0))
+    {
+      release_sig_job (sj);
+      return 0;
+    }
+
+  hash_signed_key_data (md, pripk, sj->pk, sig, packet);
+  if (check_signature_end_prepare (sj->pk, sig, md))
+    {
+      /* Leave it to the regular check to return the error.  */
+      gcry_md_close (md);
+      release_sig_job (sj);
+      return 0;
+    }
+
+  if (make_sigcache_key (sj->pk, sig, md, sj->cachekey))
+    {
+      rc = sigcache_lookup (sj->cachekey);
+      if (gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
+        {
+          cache_sig_result (sig, check_signature_end_finish (sj->pk, sig, rc));
+          gcry_md_close (md);
+          release_sig_job (sj);
+          return 0;
+        }
+      sj->use_sigcache = 1;
+    }
+
+  sj->result = encode_md_value (sj->pk, md, sig->digest_algo);
+  gcry_md_close (md);
+  if (!sj->result)
+    {
+      release_sig_job (sj);
+      return 0;
+    }
+  /* The job may not build the S-expression itself.  */
+  pk_verify_prepare (sj->pk);
+  return 1;
+}
+
+
+/* The worker pool used for signature checks or NULL if none could
+ * be created.  */
+static workpool_t
+get_sig_pool (void)
+{
+  static workpool_t pool;
+  static int no_pool;
+
+  if (!pool && !no_pool && workpool_new (&pool, opt.sig_check_threads))
+    no_pool = 1;
+  return pool;
+}
+
+
+/* Queue the job SJ prepared by prepare_sig_job to POOL.  */
+static void
+submit_sig_job (workpool_t pool, struct sig_job_s *sj)
+{
+  sj->job.func = sig_job_func;
+  sj->job.opaque = sj;
+  pk_verify_count++;
+  workpool_submit (pool, &sj->job);
+}
+
+
+/* Wait for the job SJ and cache its result.  */
+static void
+finish_sig_job (workpool_t pool, struct sig_job_s *sj)
+{
+  workpool_wait (pool, &sj->job);
+  if (sj->use_sigcache)
+    sigcache_store (sj->cachekey, sj->rc);
+  cache_sig_result (sj->sig,
+                    check_signature_end_finish (sj->pk, sj->sig, sj->rc));
+  release_sig_job (sj);
+}
+
+
+/* Return true if SIG is a not yet checked self-signature for the
+ * key KEYID.  */
+static int
+is_unchecked_self_sig (PKT_signature *sig, u32 *keyid)
+{
+  return (!sig->flags.checked
+          && sig->keyid[0] == keyid[0] && sig->keyid[1] == keyid[1]);
+}
+
+
+/* Check all not yet checked self-signatures of KEYBLOCK using
+ * --sig-check-threads worker threads and store the results in the
+ * signatures' cache flags.  A later check_key_signature then takes
+ * the results from there; as for all cached results the meta data of
+ * the signatures is still checked by it.  This is only an
+ * optimization: Signatures which can't be handled here are left
+ * alone and will be checked the usual way.  */
+void
+check_self_sigs_parallel (kbnode_t keyblock)
+{
+  check_self_sigs_batch (&keyblock, 1);
+}
+
+
+/* Same as check_self_sigs_parallel but for the NKEYBLOCKS keyblocks
+ * at KEYBLOCKS.  This allows to spread the checks over the worker
+ * threads even if each keyblock has only a few self-signatures.  */
+void
+check_self_sigs_batch (kbnode_t *keyblocks, int nkeyblocks)
+{
+  workpool_t pool;
+  PKT_public_key *pripk;
+  u32 keyid[2];
+  kbnode_t node;
+  PACKET *subkey, *uid;
+  struct sig_job_s *jobs;
+  int njobs, n, i, k;
+
+  if (opt.no_sig_cache || opt.sig_check_threads < 2)
+    return;
+
+  /* Count the candidates.  */
+  for (n = k = 0; k < nkeyblocks; k++)
+    {
+      if (keyblocks[k]->pkt->pkttype != PKT_PUBLIC_KEY)
+        continue;
+      keyid_from_pk (keyblocks[k]->pkt->pkt.public_key, keyid);
+      for (node = keyblocks[k]->next; node; node = node->next)
+        if (node->pkt->pkttype == PKT_SIGNATURE
+            && is_unchecked_self_sig (node->pkt->pkt.signature, keyid))
+          n++;
+    }
+  if (n < 2)
+    return;
+
+  pool = get_sig_pool ();
+  if (!pool)
+    return;
+
+  jobs = xtrycalloc (n, sizeof *jobs);
+  if (!jobs)
+    return;
+
+  /* Queue the jobs.  The signed packets are determined the same way
+   * check_key_signature2 does it.  */
+  njobs = 0;
+  for (k = 0; k < nkeyblocks && njobs < n; k++)
+    {
+      if (keyblocks[k]->pkt->pkttype != PKT_PUBLIC_KEY)
+        continue;
+      pripk = keyblocks[k]->pkt->pkt.public_key;
+      keyid_from_pk (pripk, keyid);
+      subkey = uid = NULL;
+      for (node = keyblocks[k]->next; node && njobs < n; node = node->next)
+        {
+          PKT_signature *sig;
+          PACKET *packet;
+
+          if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+            subkey = node->pkt;
+          else if (node->pkt->pkttype == PKT_USER_ID)
+            uid = node->pkt;
+          if (node->pkt->pkttype != PKT_SIGNATURE)
+            continue;
+
+          sig = node->pkt->pkt.signature;
+          if (!is_unchecked_self_sig (sig, keyid))
+            continue;
+
+          if (IS_KEY_SIG (sig) || IS_KEY_REV (sig))
+            packet = keyblocks[k]->pkt;
+          else if (IS_SUBKEY_SIG (sig) || IS_SUBKEY_REV (sig))
+            packet = subkey;
+          else if (IS_UID_SIG (sig) || IS_UID_REV (sig))
+            packet = uid;
+          else
+            packet = NULL;
+          if (!packet)
+            continue;
+
+          if (prepare_sig_job (NULL, jobs + njobs, pripk, pripk, sig, packet))
+            submit_sig_job (pool, jobs + njobs++);
+        }
+    }
+
+  /* Collect the results in the order of the keyblocks.  */
+  for (i=0; i < njobs; i++)
+    finish_sig_job (pool, jobs + i);
+
+  xfree (jobs);
+}
+
+
+/* Return true if SIG is a user id certification which
+ * mark_usable_uid_certs would check for the key MAIN_KID given the
+ * klist KLIST.  */
+static int
+is_klist_uid_cert (PKT_signature *sig, u32 *main_kid, struct key_item *klist)
+{
+  if (sig->flags.checked)
+    return 0;
+  if (sig->keyid[0] == main_kid[0] && sig->keyid[1] == main_kid[1])
+    return 0;
+  if (!IS_UID_SIG (sig) && !IS_UID_REV (sig))
+    return 0;
+  if (sig->sig_class >= 0x11 && sig->sig_class <= 0x13
+      && sig->sig_class - 0x10 < opt.min_cert_level)
+    return 0;
+  return !!is_in_klist (klist, sig);
+}
+
+
+/* Check all not yet checked user id certifications issued by a key in
+ * KLIST in the NKEYBLOCKS keyblocks at KEYBLOCKS using
+ * --sig-check-threads worker threads.  This is used by the trustdb
+ * validation to verify the certifications of many keyblocks at once;
+ * the results are cached in the signatures the same way
+ * check_self_sigs_parallel does it.  */
+void
+check_uid_certs_parallel (ctrl_t ctrl, kbnode_t *keyblocks, int nkeyblocks,
+                          struct key_item *klist)
+{
+  workpool_t pool;
+  kbnode_t node;
+  PACKET *uid;
+  u32 keyid[2];
+  struct sig_job_s *jobs;
+  int njobs, n, i, k;
+
+  if (opt.no_sig_cache || opt.sig_check_threads < 2 || !klist)
+    return;
+
+  /* Count the candidates.  */
+  for (n = k = 0; k < nkeyblocks; k++)
+    {
+      keyid_from_pk (keyblocks[k]->pkt->pkt.public_key, keyid);
+      for (node = keyblocks[k]->next; node; node = node->next)
+        if (node->pkt->pkttype == PKT_SIGNATURE
+            && is_klist_uid_cert (node->pkt->pkt.signature, keyid, klist))
+          n++;
+    }
+  if (n < 2)
+    return;
+
+  pool = get_sig_pool ();
+  if (!pool)
+    return;
+
+  jobs = xtrycalloc (n, sizeof *jobs);
+  if (!jobs)
+    return;
+
+  njobs = 0;
+  for (k = 0; k < nkeyblocks && njobs < n; k++)
+    {
+      PKT_public_key *pripk = keyblocks[k]->pkt->pkt.public_key;
+
+      keyid_from_pk (pripk, keyid);
+      uid = NULL;
+      for (node = keyblocks[k]->next; node && njobs < n; node = node->next)
+        {
+          if (node->pkt->pkttype == PKT_USER_ID)
+            uid = node->pkt;
+          else if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+            uid = NULL;
+          else if (node->pkt->pkttype == PKT_SIGNATURE && uid
+                   && is_klist_uid_cert (node->pkt->pkt.signature,
+                                         keyid, klist)
+                   && prepare_sig_job (ctrl, jobs + njobs, NULL, pripk,
+                                       node->pkt->pkt.signature, uid))
+            submit_sig_job (pool, jobs + njobs++);
+        }
+    }
+
+  for (i=0; i < njobs; i++)
+    finish_sig_job (pool, jobs + i);
+
+  xfree (jobs);
+}
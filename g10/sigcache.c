@@ -0,0 +1,411 @@
+/* sigcache.c - Persistent cache of key signature verifications
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* The result of a key signature verification is stored in the
+ * signature packet only for the lifetime of the keyblock and only a
+ * keyring is able to keep it across invocations of gpg.  This module
+ * implements a cache file in the home directory which maps a digest
+ * over the signing key, the final hash of the signed data and the
+ * signature itself to the result of the verification.  Because all
+ * inputs of the verification are part of the cache key, entries never
+ * need to be invalidated: If a key changes the keys of the cache
+ * change as well and the old entries are simply not used anymore.
+ *
+ * The file starts with an 8 byte header:
+ *
+ *   byte 0-3  magic "GPsc"
+ *   byte 4    version (1)
+ *   byte 5-7  reserved
+ *
+ * followed by records of SIGCACHE_RECLEN bytes:
+ *
+ *   byte 0-31  the SHA-256 cache key
+ *   byte 32    'G' for a good signature, 'B' for a bad signature
+ *   byte 33-35 reserved
+ *
+ * New records are appended to the file with writes of whole records
+ * so that concurrent gpg processes do not corrupt it.  A new file is
+ * written under a temporary name and renamed into place; this is also
+ * done to start over if the file grows larger than
+ * SIGCACHE_MAX_RECORDS.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/host2net.h"
+#include "options.h"
+#include "main.h"
+
+#if defined(HAVE_DOSISH_SYSTEM) || defined(__CYGWIN__)
+#define MY_O_BINARY  O_BINARY
+#else
+#define MY_O_BINARY  0
+#endif
+
+#define SIGCACHE_NAME        "sigcache.dat"
+#define SIGCACHE_HDRLEN      8
+#define SIGCACHE_RECLEN      (SIGCACHE_KEYLEN + 4)
+#define SIGCACHE_MAX_RECORDS (256 * 1024)
+
+
+/* An item of the in-memory table.  */
+struct sigcache_item
+{
+  byte key[SIGCACHE_KEYLEN];
+  byte result;  /* 0 for an unused item or 'G' or 'B'.  */
+};
+
+/* The in-memory table using open addressing.  */
+static struct sigcache_item *table;
+static unsigned int table_size;  /* A power of 2.  */
+static unsigned int table_used;
+
+/* The records not yet written to the file.  */
+static byte *pending;
+static size_t pending_count;
+static size_t pending_size;
+
+/* The number of records in the file as seen when loading it.  */
+static size_t file_records;
+
+/* Set if the cache has been loaded.  */
+static int loaded;
+
+/* Statistics.  */
+static struct
+{
+  unsigned int lookups;
+  unsigned int hits;
+  unsigned int stored;
+} stats;
+
+
+
+static char *
+sigcache_fname (void)
+{
+  return make_filename (gnupg_homedir (), SIGCACHE_NAME, NULL);
+}
+
+
+/* Insert KEY with RESULT into the table.  Returns true if the key was
+ * not yet in the table.  */
+static int
+table_insert (const byte *key, byte result)
+{
+  unsigned int i;
+
+  if (!table || table_used + 1 > table_size / 2)
+    {
+      struct sigcache_item *old = table;
+      unsigned int old_size = table_size;
+      unsigned int j;
+
+      table_size = table_size? table_size * 2 : 1024;
+      table = xcalloc (table_size, sizeof *table);
+      table_used = 0;
+      for (j=0; j < old_size; j++)
+        if (old[j].result)
+          table_insert (old[j].key, old[j].result);
+      xfree (old);
+    }
+
+  i = buf32_to_uint (key) & (table_size - 1);
+  while (table[i].result)
+    {
+      if (!memcmp (table[i].key, key, SIGCACHE_KEYLEN))
+        {
+          table[i].result = result;
+          return 0;
+        }
+      i = (i + 1) & (table_size - 1);
+    }
+  memcpy (table[i].key, key, SIGCACHE_KEYLEN);
+  table[i].result = result;
+  table_used++;
+  return 1;
+}
+
+
+/* Read the cache file into the table.  */
+static void
+load_cache (void)
+{
+  char *fname;
+  estream_t fp;
+  byte buf[SIGCACHE_RECLEN];
+
+  loaded = 1;
+  fname = sigcache_fname ();
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    {
+      if (errno != ENOENT && opt.verbose)
+        log_info ("can't open '%s': %s\n", fname, strerror (errno));
+      xfree (fname);
+      return;
+    }
+
+  if (es_read (fp, buf, SIGCACHE_HDRLEN, NULL)
+      || memcmp (buf, "GPsc\x01", 5))
+    {
+      if (opt.verbose)
+        log_info ("ignoring invalid signature cache '%s'\n", fname);
+      file_records = SIGCACHE_MAX_RECORDS;  /* Force a rewrite.  */
+      goto leave;
+    }
+
+  for (;;)
+    {
+      size_t nread;
+
+      if (es_read (fp, buf, SIGCACHE_RECLEN, &nread)
+          || nread != SIGCACHE_RECLEN)
+        break;  /* Ignore a truncated last record.  */
+      file_records++;
+      if (buf[SIGCACHE_KEYLEN] == 'G' || buf[SIGCACHE_KEYLEN] == 'B')
+        table_insert (buf, buf[SIGCACHE_KEYLEN]);
+    }
+
+  if (DBG_CACHE)
+    log_debug ("sigcache: loaded %u entries from '%s'\n",
+               table_used, fname);
+
+ leave:
+  es_fclose (fp);
+  xfree (fname);
+}
+
+
+/* Return the cached result of the key signature verification
+ * identified by KEY.  Returns 0 for a good signature,
+ * GPG_ERR_BAD_SIGNATURE for a bad signature, and GPG_ERR_NOT_FOUND if
+ * the result is not known.  */
+gpg_error_t
+sigcache_lookup (const byte *key)
+{
+  unsigned int i;
+
+  if (!loaded)
+    load_cache ();
+
+  stats.lookups++;
+  if (!table)
+    return gpg_error (GPG_ERR_NOT_FOUND);
+
+  i = buf32_to_uint (key) & (table_size - 1);
+  for (; table[i].result; i = (i + 1) & (table_size - 1))
+    if (!memcmp (table[i].key, key, SIGCACHE_KEYLEN))
+      {
+        stats.hits++;
+        return table[i].result == 'G'? 0 : gpg_error (GPG_ERR_BAD_SIGNATURE);
+      }
+
+  return gpg_error (GPG_ERR_NOT_FOUND);
+}
+
+
+/* Store the result RC of the key signature verification identified
+ * by KEY.  Only good signatures and GPG_ERR_BAD_SIGNATURE are
+ * stored.  The file is updated by sigcache_flush.  */
+void
+sigcache_store (const byte *key, gpg_error_t rc)
+{
+  byte result;
+  byte *rec;
+
+  if (!rc)
+    result = 'G';
+  else if (gpg_err_code (rc) == GPG_ERR_BAD_SIGNATURE)
+    result = 'B';
+  else
+    return;
+
+  if (!loaded)
+    load_cache ();
+
+  if (!table_insert (key, result))
+    return;
+
+  if (pending_count == pending_size)
+    {
+      pending_size = pending_size? pending_size * 2 : 64;
+      pending = xrealloc (pending, pending_size * SIGCACHE_RECLEN);
+    }
+  rec = pending + pending_count * SIGCACHE_RECLEN;
+  memcpy (rec, key, SIGCACHE_KEYLEN);
+  rec[SIGCACHE_KEYLEN] = result;
+  memset (rec + SIGCACHE_KEYLEN + 1, 0, SIGCACHE_RECLEN - SIGCACHE_KEYLEN - 1);
+  pending_count++;
+  stats.stored++;
+}
+
+
+/* Write the pending records to FD.  Returns 0 on success or -1 with
+ * ERRNO set.  */
+static int
+write_pending (int fd)
+{
+  size_t off, n;
+  ssize_t nwritten;
+
+  /* Write whole records only; with O_APPEND each write is appended
+   * atomically and thus records of other processes are not split.  */
+  for (off=0; off < pending_count; off += n)
+    {
+      n = pending_count - off;
+      if (n > 256)
+        n = 256;
+      nwritten = write (fd, pending + off * SIGCACHE_RECLEN,
+                        n * SIGCACHE_RECLEN);
+      if (nwritten != n * SIGCACHE_RECLEN)
+        {
+          if (nwritten != -1)
+            gpg_err_set_errno (ENOSPC);
+          return -1;
+        }
+    }
+  return 0;
+}
+
+
+/* Create a new cache file FNAME with the header and the pending
+ * records.  The file is written under a temporary name and then
+ * renamed so that other processes never see a file without the
+ * header.  Returns 0 on success or -1 with ERRNO set.  */
+static int
+create_cache_file (const char *fname)
+{
+  gpg_error_t err;
+  char *tmpfname;
+  int fd;
+  int rc = -1;
+
+  tmpfname = xasprintf ("%s.%lu.tmp", fname, (unsigned long)getpid ());
+  gnupg_remove (tmpfname);  /* Left over by a crashed process.  */
+  fd = open (tmpfname, O_WRONLY | O_CREAT | O_EXCL | MY_O_BINARY,
+             S_IRUSR | S_IWUSR);
+  if (fd == -1)
+    goto leave;
+
+  if (write (fd, "GPsc\x01\0\0\0", SIGCACHE_HDRLEN) != SIGCACHE_HDRLEN
+      || write_pending (fd))
+    {
+      int saveerr = errno;
+      close (fd);
+      gnupg_remove (tmpfname);
+      gpg_err_set_errno (saveerr);
+      goto leave;
+    }
+  if (close (fd))
+    goto leave;
+
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    {
+      gnupg_remove (tmpfname);
+      gpg_err_set_errno (gpg_err_code_to_errno (gpg_err_code (err)));
+      goto leave;
+    }
+  rc = 0;
+
+ leave:
+  xfree (tmpfname);
+  return rc;
+}
+
+
+/* Write all new entries to the cache file.  */
+void
+sigcache_flush (void)
+{
+  char *fname;
+  int fd;
+
+  if (!pending_count || opt.dry_run)
+    return;
+
+  fname = sigcache_fname ();
+  if (file_records + pending_count > SIGCACHE_MAX_RECORDS)
+    {
+      /* Start over to keep the file at a sane size.  */
+      fd = -1;
+      gpg_err_set_errno (ENOENT);
+      file_records = 0;
+    }
+  else
+    fd = open (fname, O_WRONLY | O_APPEND | MY_O_BINARY);
+
+  if (fd == -1)
+    {
+      if (errno != ENOENT || create_cache_file (fname))
+        {
+          if (opt.verbose)
+            log_info ("can't create '%s': %s\n", fname, strerror (errno));
+          goto leave;
+        }
+    }
+  else
+    {
+      if (write_pending (fd))
+        {
+          if (opt.verbose)
+            log_info ("error writing '%s': %s\n", fname, strerror (errno));
+          close (fd);
+          goto leave;
+        }
+      close (fd);
+    }
+
+  file_records += pending_count;
+  pending_count = 0;
+
+ leave:
+  xfree (fname);
+}
+
+
+/* Emit the statistics of the cache for the stats registry.  */
+void
+sigcache_stats_report (stats_sink_t sink)
+{
+  stats_put (sink, "entries", table_used);
+  stats_put (sink, "lookups", stats.lookups);
+  stats_put (sink, "hits", stats.hits);
+  stats_put (sink, "stored", stats.stored);
+}
+
+
+/* Dump the statistics of the cache.  */
+void
+sigcache_dump_stats (void)
+{
+  log_info ("sigcache: entries=%u lookups=%u hits=%u stored=%u\n",
+            table_used, stats.lookups, stats.hits, stats.stored);
+}
@@ -181,7 +181,7 @@ mk_notation_policy_etc (PKT_signature *sig,
 /*
  * Helper to hash a user ID packet.
  */
-static void
+void
 hash_uid (gcry_md_hd_t md, int sigversion, const PKT_user_id *uid)
 {
   byte buf[5];
@@ -216,7 +216,7 @@ hash_uid (gcry_md_hd_t md, int sigversion, const PKT_user_id *uid)
 /*
  * Helper to hash some parts from the signature
  */
-static void
+void
 hash_sigversion_to_magic (gcry_md_hd_t md, const PKT_signature *sig)
 {
   byte buf[6];
@@ -699,11 +699,14 @@ write_plaintext_packet (IOBUF out, IOBUF inp, const char *fname, int ptmode)
 
 /*
  * Write the signatures from the SK_LIST to OUT. HASH must be a non-finalized
- * hash which will not be changes here.
+ * hash which will not be changes here.  If MFX is not NULL the hash for
+ * each key is instead taken from this md_filter context; this is
+ * required if threaded hashing is used.
  */
 static int
 write_signature_packets (ctrl_t ctrl,
                          SK_LIST sk_list, IOBUF out, gcry_md_hd_t hash,
+                         md_filter_context_t *mfx,
                          int sigclass, u32 timestamp, u32 duration,
 			 int status_letter, const char *cache_nonce)
 {
@@ -741,7 +744,8 @@ write_signature_packets (ctrl_t ctrl,
         sig->expiredate = sig->timestamp + duration;
       sig->sig_class = sigclass;
 
-      if (gcry_md_copy (&md, hash))
+      if (gcry_md_copy (&md, mfx? md_filter_get_md (mfx, hash_for (pk))
+                        /**/: hash))
         BUG ();
 
       if (sig->version >= 4)
@@ -989,6 +993,17 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
     for (sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
       gcry_md_enable (mfx.md, hash_for (sk_rover->pk));
 
+    if (opt.hash_threads > 1 && !DBG_HASHING)
+      {
+        rc = md_filter_start_workers (&mfx);
+        if (rc)
+          {
+            log_info ("threaded hashing not possible: %s\n",
+                      gpg_strerror (rc));
+            rc = 0;
+          }
+      }
+
     if( !multifile )
 	iobuf_push_filter( inp, md_filter, &mfx );
 
@@ -1101,7 +1116,8 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 	goto leave;
 
     /* write the signatures */
-    rc = write_signature_packets (ctrl, sk_list, out, mfx.md,
+    md_filter_wait (&mfx);
+    rc = write_signature_packets (ctrl, sk_list, out, mfx.md, &mfx,
                                   opt.textmode && !outfile? 0x01 : 0x00,
 				  0, duration, detached ? 'D':'S', NULL);
     if( rc )
@@ -1117,7 +1133,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
             write_status( STATUS_END_ENCRYPTION );
     }
     iobuf_close(inp);
-    gcry_md_close ( mfx.md );
+    free_md_filter_context (&mfx);
     release_sk_list( sk_list );
     release_pk_list( pk_list );
     recipient_digest_algo=0;
@@ -1244,7 +1260,7 @@ clearsign_file (ctrl_t ctrl,
     push_armor_filter (afx, out);
 
     /* Write the signatures.  */
-    rc = write_signature_packets (ctrl, sk_list, out, textmd, 0x01, 0,
+    rc = write_signature_packets (ctrl, sk_list, out, textmd, NULL, 0x01, 0,
                                   duration, 'C', NULL);
     if( rc )
         goto leave;
@@ -1360,6 +1376,17 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
     for (sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
       gcry_md_enable (mfx.md, hash_for (sk_rover->pk));
 
+    if (opt.hash_threads > 1 && !DBG_HASHING)
+      {
+        rc = md_filter_start_workers (&mfx);
+        if (rc)
+          {
+            log_info ("threaded hashing not possible: %s\n",
+                      gpg_strerror (rc));
+            rc = 0;
+          }
+      }
+
     iobuf_push_filter (inp, md_filter, &mfx);
 
     /* Push armor output filter */
@@ -1412,7 +1439,8 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
 
     /* Write the signatures */
     /*(current filters: zip - encrypt - armor)*/
-    rc = write_signature_packets (ctrl, sk_list, out, mfx.md,
+    md_filter_wait (&mfx);
+    rc = write_signature_packets (ctrl, sk_list, out, mfx.md, &mfx,
 				  opt.textmode? 0x01 : 0x00,
 				  0, duration, 'S', NULL);
     if( rc )
@@ -1428,7 +1456,7 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
     }
     iobuf_close(inp);
     release_sk_list( sk_list );
-    gcry_md_close( mfx.md );
+    free_md_filter_context (&mfx);
     xfree(cfx.dek);
     xfree(s2k);
     release_progress_context (pfx);
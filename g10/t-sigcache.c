@@ -0,0 +1,157 @@
+/* t-sigcache.c - Tests for the persistent signature cache
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INCLUDED_BY_MAIN_MODULE 1
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/sysutils.h"
+#include "options.h"
+#include "main.h"
+
+#include "test.c"
+
+#define HOMEDIR "t-sigcache.d"
+#define HDRLEN  8
+#define RECLEN  (SIGCACHE_KEYLEN + 4)
+
+
+/* Fill KEY with a cache key derived from N.  */
+static void
+make_key (byte *key, int n)
+{
+  gcry_md_hash_buffer (GCRY_MD_SHA256, key, &n, sizeof n);
+}
+
+
+/* Return the size of FNAME or -1 if it does not exist.  The inode is
+ * stored at R_INO.  */
+static long
+file_size (const char *fname, unsigned long *r_ino)
+{
+  struct stat st;
+
+  if (stat (fname, &st))
+    return -1;
+  if (r_ino)
+    *r_ino = st.st_ino;
+  return st.st_size;
+}
+
+
+/* Return true if FNAME starts with the header of a cache file and
+ * has the record for KEY with RESULT at index IDX.  */
+static int
+check_record (const char *fname, int idx, const byte *key, int result)
+{
+  FILE *fp;
+  byte buf[RECLEN];
+  int okay = 0;
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    return 0;
+  if (fread (buf, HDRLEN, 1, fp) == 1
+      && !memcmp (buf, "GPsc\x01", 5)
+      && !fseek (fp, HDRLEN + (long)idx * RECLEN, SEEK_SET)
+      && fread (buf, RECLEN, 1, fp) == 1
+      && !memcmp (buf, key, SIGCACHE_KEYLEN)
+      && buf[SIGCACHE_KEYLEN] == result)
+    okay = 1;
+  fclose (fp);
+  return okay;
+}
+
+
+static void
+do_test (int argc, char *argv[])
+{
+  byte key[SIGCACHE_KEYLEN];
+  char *fname;
+  unsigned long ino = 0;
+  unsigned long ino2 = 0;
+  int i;
+
+  (void)argc;
+  (void)argv;
+
+  gnupg_mkdir (HOMEDIR, "-rwx");
+  gnupg_set_homedir (HOMEDIR);
+  fname = make_filename (gnupg_homedir (), "sigcache.dat", NULL);
+  gnupg_remove (fname);
+
+  TEST_GROUP ("lookup and store");
+  make_key (key, 0);
+  TEST ("unknown key", gpg_err_code (sigcache_lookup (key)),
+        GPG_ERR_NOT_FOUND);
+  sigcache_store (key, 0);
+  TEST ("good signature", sigcache_lookup (key), 0);
+  make_key (key, 1);
+  sigcache_store (key, gpg_error (GPG_ERR_BAD_SIGNATURE));
+  TEST ("bad signature", gpg_err_code (sigcache_lookup (key)),
+        GPG_ERR_BAD_SIGNATURE);
+  make_key (key, 2);
+  sigcache_store (key, gpg_error (GPG_ERR_NO_PUBKEY));
+  TEST ("other errors are not stored", gpg_err_code (sigcache_lookup (key)),
+        GPG_ERR_NOT_FOUND);
+  sigcache_store (key, 0);
+  sigcache_store (key, 0);  /* Not written twice.  */
+
+  TEST_GROUP ("create the file");
+  TEST_P ("no file before flush", file_size (fname, NULL) == -1);
+  sigcache_flush ();
+  TEST ("file size", file_size (fname, &ino), HDRLEN + 3 * RECLEN);
+  make_key (key, 0);
+  TEST_P ("first record", check_record (fname, 0, key, 'G'));
+  make_key (key, 1);
+  TEST_P ("second record", check_record (fname, 1, key, 'B'));
+  sigcache_flush ();
+  TEST ("flush without new records", file_size (fname, NULL),
+        HDRLEN + 3 * RECLEN);
+
+  TEST_GROUP ("append to the file");
+  for (i=3; i < 100; i++)
+    {
+      make_key (key, i);
+      sigcache_store (key, 0);
+    }
+  sigcache_flush ();
+  TEST ("file size", file_size (fname, &ino2), HDRLEN + 100 * RECLEN);
+  TEST_P ("same file", ino2 == ino);
+  make_key (key, 99);
+  TEST_P ("last record", check_record (fname, 99, key, 'G'));
+
+  TEST_GROUP ("recreate the file");
+  gnupg_remove (fname);
+  make_key (key, 100);
+  sigcache_store (key, gpg_error (GPG_ERR_BAD_SIGNATURE));
+  sigcache_flush ();
+  TEST ("file size", file_size (fname, NULL), HDRLEN + RECLEN);
+  TEST_P ("header and record", check_record (fname, 0, key, 'B'));
+
+  gnupg_remove (fname);
+  xfree (fname);
+  rmdir (HOMEDIR);
+}
@@ -120,6 +120,37 @@ export_ownertrust (ctrl_t ctrl)
 }
 
 
+/* An ownertrust value read by import_ownertrust.  */
+struct otrust_item
+{
+  byte fpr[MAX_FINGERPRINT_LEN];
+  unsigned int otrust;
+  unsigned int lnr;   /* To keep the last one of duplicates.  */
+};
+
+
+/* qsort helper to sort otrust_items by fingerprint and line.  */
+static int
+cmp_otrust_item (const void *a_arg, const void *b_arg)
+{
+  const struct otrust_item *a = a_arg;
+  const struct otrust_item *b = b_arg;
+  int cmp;
+
+  cmp = memcmp (a->fpr, b->fpr, 20);
+  if (!cmp)
+    cmp = a->lnr < b->lnr? -1 : a->lnr > b->lnr;
+  return cmp;
+}
+
+
+/*
+ * Import the ownertrust values from FNAME.  All values are read in
+ * first and sorted by fingerprint, so that the hash table of the
+ * trustdb is updated in order, and then stored in one trustdb
+ * transaction, which writes all changed records with one sequential
+ * pass and a single sync.
+ */
 void
 import_ownertrust (ctrl_t ctrl, const char *fname )
 {
@@ -132,6 +163,9 @@ import_ownertrust (ctrl_t ctrl, const char *fname )
     byte fpr[MAX_FINGERPRINT_LEN];
     int any = 0;
     int rc;
+    struct otrust_item *items = NULL;
+    size_t nitems = 0, nalloced = 0, idx;
+    TRUSTREC rec;
 
     init_trustdb (ctrl, 0);
     if( iobuf_is_pipe_filename (fname) ) {
@@ -153,8 +187,6 @@ import_ownertrust (ctrl_t ctrl, const char *fname )
       }
 
     while (es_fgets (line, DIM(line)-1, fp)) {
-	TRUSTREC rec;
-
 	if( !*line || *line == '#' )
 	    continue;
 	n = strlen(line);
@@ -191,7 +223,54 @@ import_ownertrust (ctrl_t ctrl, const char *fname )
 	while (fprlen < MAX_FINGERPRINT_LEN)
 	    fpr[fprlen++] = 0;
 
-	rc = tdbio_search_trust_byfpr (ctrl, fpr, &rec);
+        if (nitems == nalloced)
+          {
+            struct otrust_item *tmp;
+
+            nalloced = nalloced? 2 * nalloced : 256;
+            tmp = xtryrealloc (items, nalloced * sizeof *items);
+            if (!tmp)
+              {
+                log_error ("error importing ownertrust: %s\n",
+                           gpg_strerror (gpg_error_from_syserror ()));
+                xfree (items);
+                if (!is_stdin)
+                  es_fclose (fp);
+                return;
+              }
+            items = tmp;
+          }
+        memcpy (items[nitems].fpr, fpr, MAX_FINGERPRINT_LEN);
+        items[nitems].otrust = otrust;
+        items[nitems].lnr = nitems;
+        nitems++;
+    }
+    if (es_ferror (fp))
+	log_error ( _("read error in '%s': %s\n"), fname, strerror(errno) );
+    if (!is_stdin)
+	es_fclose (fp);
+
+    if (!nitems)
+      return;
+
+    qsort (items, nitems, sizeof *items, cmp_otrust_item);
+
+    rc = tdbio_begin_transaction ();
+    if (rc)
+      {
+        log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc));
+        xfree (items);
+        return;
+      }
+
+    for (idx=0; idx < nitems; idx++) {
+        /* Of several lines for one key the last one takes effect.  */
+        if (idx + 1 < nitems
+            && !memcmp (items[idx].fpr, items[idx+1].fpr, 20))
+          continue;
+        otrust = items[idx].otrust;
+
+	rc = tdbio_search_trust_byfpr (ctrl, items[idx].fpr, &rec);
 	if( !rc ) { /* found: update */
 	    if (rec.r.trust.ownertrust != otrust)
               {
@@ -214,7 +293,7 @@ import_ownertrust (ctrl_t ctrl, const char *fname )
             memset (&rec, 0, sizeof rec);
             rec.recnum = tdbio_new_recnum (ctrl);
             rec.rectype = RECTYPE_TRUST;
-            memcpy (rec.r.trust.fingerprint, fpr, 20);
+            memcpy (rec.r.trust.fingerprint, items[idx].fpr, 20);
             rec.r.trust.ownertrust = otrust;
             write_record (ctrl, &rec);
             any = 1;
@@ -223,17 +302,12 @@ import_ownertrust (ctrl_t ctrl, const char *fname )
 	    log_error (_("error finding trust record in '%s': %s\n"),
                        fname, gpg_strerror (rc));
     }
-    if (es_ferror (fp))
-	log_error ( _("read error in '%s': %s\n"), fname, strerror(errno) );
-    if (!is_stdin)
-	es_fclose (fp);
+    xfree (items);
 
     if (any)
-      {
-        revalidation_mark (ctrl);
-        rc = tdbio_sync ();
-        if (rc)
-          log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc) );
-      }
+      revalidation_mark (ctrl);
 
+    rc = tdbio_end_transaction ();
+    if (rc)
+      log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc) );
 }
@@ -57,31 +57,46 @@
 #endif
 
 /*
- * Yes, this is a very simple implementation. We should really
- * use a page aligned buffer and read complete pages.
- * To implement a simple trannsaction system, this is sufficient.
+ * The record cache.  All records read from or written to the trustdb
+ * are kept in a hash table indexed by the record number.  Clean
+ * records are also linked into a LRU list from which they are evicted
+ * if the cache is full.  Dirty records are linked into a separate
+ * list and written back by tdbio_sync; while in a transaction they
+ * are kept until the end of the transaction.
  */
 typedef struct cache_ctrl_struct *CACHE_CTRL;
 struct cache_ctrl_struct
 {
-  CACHE_CTRL next;
+  CACHE_CTRL next;       /* Next item in the same hash bucket.  */
+  CACHE_CTRL prev_item;  /* Links for the LRU or the dirty list.  */
+  CACHE_CTRL next_item;
   struct {
-    unsigned used:1;
     unsigned dirty:1;
   } flags;
   ulong recno;
   char data[TRUST_RECORD_LEN];
 };
 
-/* Size of the cache.  The SOFT value is the general one.  While in a
-   transaction this may not be sufficient and thus we may increase it
-   then up to the HARD limit.  */
-#define MAX_CACHE_ENTRIES_SOFT	200
-#define MAX_CACHE_ENTRIES_HARD	10000
+/* A list of cache items with the most recently used item at HEAD.  */
+struct cache_list_s
+{
+  CACHE_CTRL head;
+  CACHE_CTRL tail;
+};
+
+/* Size of the cache.  The SOFT value is the general one and may be
+   changed with --trustdb-cache-size.  While in a transaction this may
+   not be sufficient and thus we may increase it then up to the HARD
+   limit.  */
+#define MAX_CACHE_ENTRIES_SOFT	4096
+#define MAX_CACHE_ENTRIES_HARD	262144
 
 
 /* The cache is controlled by these variables.  */
-static CACHE_CTRL cache_list;
+static CACHE_CTRL *cache_tbl;        /* The hash table.  */
+static unsigned int cache_tbl_size;  /* Its size; a power of 2.  */
+static struct cache_list_s cache_lru;    /* The clean items.  */
+static struct cache_list_s cache_dirty;  /* The dirty items.  */
 static int cache_entries;
 static int cache_is_dirty;
 
@@ -115,7 +130,53 @@ static unsigned int is_locked;
 static int  db_fd = -1;
 
 /* A flag indicating that a transaction is active.  */
-/* static int in_transaction;   Not yet used. */
+static int in_transaction;
+
+/* A counter incremented for each change of the trustdb.  Used by
+ * the callers to invalidate data derived from the records.  */
+static unsigned int db_generation;
+
+/* An in-memory index mapping the fingerprints of all trust records
+ * to their record numbers.  It is an open addressing hash table
+ * built by scanning the trustdb once and then kept up to date for
+ * our own changes.  */
+struct fpr_index_item
+{
+  ulong recno;    /* 0 for an empty slot or FPR_INDEX_DELETED.  */
+  byte fpr[20];
+};
+#define FPR_INDEX_DELETED ((ulong)(-1))
+static struct fpr_index_item *fpr_index;
+static unsigned int fpr_index_size;  /* A power of 2.  */
+static unsigned int fpr_index_used;  /* Including deleted slots.  */
+static off_t fpr_index_filesize;     /* The file size the index covers.  */
+static unsigned int fpr_index_lookups;
+static unsigned int fpr_index_builds;
+
+/* The number of lookups done via the on-disk hash table before the
+ * index is built and the maximum number of times the index is
+ * rebuilt due to changes by other processes.  */
+#define FPR_INDEX_MIN_LOOKUPS 16
+#define FPR_INDEX_MAX_BUILDS  4
+
+/* Set if the records of the current transaction had to be written
+ * before its end because it grew too large.  */
+static int transaction_flushed;
+
+/* New records of a transaction are appended to the file in chunks to
+ * avoid a write for each record.  SPARE_COUNT records starting at
+ * SPARE_RECNUM have been appended but are not yet used; they are put
+ * on the free list at the end of the transaction.  SPARE_CHUNK is the
+ * number of records appended next.  */
+#define SPARE_CHUNK_MIN 16
+#define SPARE_CHUNK_MAX 4096
+static ulong spare_recnum;
+static unsigned int spare_count;
+static unsigned int spare_chunk;
+
+
+static void release_fpr_index (void);
+static void release_spare_records (void);
 
 
 
@@ -188,6 +249,102 @@ release_write_lock (void)
  ************* record cache **********
  *************************************/
 
+/* Return the maximum number of items in the cache outside of a
+ * transaction.  */
+static int
+cache_max_entries (void)
+{
+  return opt.trustdb_cache_size > 0? opt.trustdb_cache_size
+                                   : MAX_CACHE_ENTRIES_SOFT;
+}
+
+
+/* Remove the item R from the list LIST.  */
+static void
+cache_list_unlink (struct cache_list_s *list, CACHE_CTRL r)
+{
+  if (r->prev_item)
+    r->prev_item->next_item = r->next_item;
+  else
+    list->head = r->next_item;
+  if (r->next_item)
+    r->next_item->prev_item = r->prev_item;
+  else
+    list->tail = r->prev_item;
+  r->prev_item = r->next_item = NULL;
+}
+
+
+/* Insert the item R at the head of the list LIST.  */
+static void
+cache_list_push (struct cache_list_s *list, CACHE_CTRL r)
+{
+  r->prev_item = NULL;
+  r->next_item = list->head;
+  if (list->head)
+    list->head->prev_item = r;
+  else
+    list->tail = r;
+  list->head = r;
+}
+
+
+/* Return the cache item for RECNO or NULL.  */
+static CACHE_CTRL
+cache_lookup (ulong recno)
+{
+  CACHE_CTRL r;
+
+  if (!cache_tbl)
+    return NULL;
+  for (r = cache_tbl[recno & (cache_tbl_size - 1)]; r; r = r->next)
+    if (r->recno == recno)
+      return r;
+  return NULL;
+}
+
+
+/* Resize the hash table so that the buckets stay short.  */
+static void
+cache_rehash (void)
+{
+  CACHE_CTRL *old = cache_tbl;
+  unsigned int old_size = cache_tbl_size;
+  CACHE_CTRL r, r2;
+  unsigned int i, idx;
+
+  cache_tbl_size = old_size? old_size * 2 : 1024;
+  cache_tbl = xcalloc (cache_tbl_size, sizeof *cache_tbl);
+  for (i=0; i < old_size; i++)
+    for (r = old[i]; r; r = r2)
+      {
+        r2 = r->next;
+        idx = r->recno & (cache_tbl_size - 1);
+        r->next = cache_tbl[idx];
+        cache_tbl[idx] = r;
+      }
+  xfree (old);
+}
+
+
+/* Remove the item R from the cache and release it.  */
+static void
+cache_remove (CACHE_CTRL r)
+{
+  CACHE_CTRL *rp;
+
+  for (rp = &cache_tbl[r->recno & (cache_tbl_size - 1)]; *rp; rp = &(*rp)->next)
+    if (*rp == r)
+      {
+        *rp = r->next;
+        break;
+      }
+  cache_list_unlink (r->flags.dirty? &cache_dirty : &cache_lru, r);
+  cache_entries--;
+  xfree (r);
+}
+
+
 /*
  * Get the data from the record cache and return a pointer into that
  * cache.  Caller should copy the returned data.  NULL is returned on
@@ -198,12 +355,15 @@ get_record_from_cache (ulong recno)
 {
   CACHE_CTRL r;
 
-  for (r = cache_list; r; r = r->next)
+  r = cache_lookup (recno);
+  if (!r)
+    return NULL;
+  if (!r->flags.dirty && r != cache_lru.head)
     {
-      if (r->flags.used && r->recno == recno)
-        return r->data;
+      cache_list_unlink (&cache_lru, r);
+      cache_list_push (&cache_lru, r);
     }
-  return NULL;
+  return r->data;
 }
 
 
@@ -233,190 +393,156 @@ write_cache_item (CACHE_CTRL r)
                  r->recno, n, strerror (errno) );
       return err;
     }
+  cache_list_unlink (&cache_dirty, r);
   r->flags.dirty = 0;
+  cache_list_push (&cache_lru, r);
   return 0;
 }
 
 
+/* qsort helper to sort cache items by record number.  */
+static int
+cmp_cache_recno (const void *a, const void *b)
+{
+  CACHE_CTRL ra = *(const CACHE_CTRL *)a;
+  CACHE_CTRL rb = *(const CACHE_CTRL *)b;
+
+  return ra->recno < rb->recno? -1 : ra->recno > rb->recno;
+}
+
+
 /*
- * Put data into the cache.  This function may flush
- * some cache entries if the cache is filled up.
+ * Write all dirty items back to the trustdb file.  The items are
+ * written in the order of the record numbers.
  *
  * Returns: 0 on success or an error code.
  */
 static int
-put_record_into_cache (ulong recno, const char *data)
+write_dirty_items (void)
 {
-  CACHE_CTRL r, unused;
-  int dirty_count = 0;
-  int clean_count = 0;
-
-  /* See whether we already cached this one.  */
-  for (unused = NULL, r = cache_list; r; r = r->next)
+  CACHE_CTRL r, *items;
+  int n, i, rc = 0;
+  int did_lock = 0;
+
+  if (!take_write_lock ())
+    did_lock = 1;
+
+  n = 0;
+  for (r = cache_dirty.head; r; r = r->next_item)
+    n++;
+  items = xtrymalloc (n * sizeof *items);
+  if (items)
     {
-      if (!r->flags.used)
-        {
-          if (!unused)
-            unused = r;
-	}
-      else if (r->recno == recno)
-        {
-          if (!r->flags.dirty)
-            {
-              /* Hmmm: should we use a copy and compare? */
-              if (memcmp (r->data, data, TRUST_RECORD_LEN))
-                {
-                  r->flags.dirty = 1;
-                  cache_is_dirty = 1;
-		}
-	    }
-          memcpy (r->data, data, TRUST_RECORD_LEN);
-          return 0;
-	}
-      if (r->flags.used)
-        {
-          if (r->flags.dirty)
-            dirty_count++;
-          else
-            clean_count++;
-	}
+      for (i=0, r = cache_dirty.head; r; r = r->next_item)
+        items[i++] = r;
+      qsort (items, n, sizeof *items, cmp_cache_recno);
+      for (i=0; i < n && !rc; i++)
+        rc = write_cache_item (items[i]);
+      xfree (items);
     }
-
-  /* Not in the cache: add a new entry. */
-  if (unused)
+  else
     {
-      /* Reuse this entry. */
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
+      while (!rc && (r = cache_dirty.tail))
+        rc = write_cache_item (r);
     }
 
-  /* See whether we reached the limit. */
-  if (cache_entries < MAX_CACHE_ENTRIES_SOFT)
-    {
-      /* No: Put into cache.  */
-      r = xmalloc (sizeof *r);
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      r->next = cache_list;
-      cache_list = r;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
-    }
-
-  /* Cache is full: discard some clean entries.  */
-  if (clean_count)
-    {
-      int n;
+  if (!rc)
+    cache_is_dirty = 0;
+  if (did_lock)
+    release_write_lock ();
+  return rc;
+}
 
-      /* We discard a third of the clean entries.  */
-      n = clean_count / 3;
-      if (!n)
-        n = 1;
 
-      for (unused = NULL, r = cache_list; r; r = r->next)
-        {
-          if (r->flags.used && !r->flags.dirty)
-            {
-              if (!unused)
-                unused = r;
-              r->flags.used = 0;
-              cache_entries--;
-              if (!--n)
-                break;
-	    }
-	}
+/*
+ * Make sure that a new item can be put into the cache.  This may
+ * evict a clean item or write back the dirty ones.
+ *
+ * Returns: 0 on success or an error code.
+ */
+static int
+make_room_in_cache (void)
+{
+  int rc;
 
-      /* Now put into the cache.  */
-      log_assert (unused);
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
-    }
+  if (cache_entries < cache_max_entries ())
+    return 0;
 
-  /* No clean entries: We have to flush some dirty entries.  */
-#if 0 /* Transactions are not yet used.  */
-  if (in_transaction)
+  if (!cache_lru.tail)
     {
-      /* But we can't do this while in a transaction.  Thus we
-       * increase the cache size instead.  */
-      if (cache_entries < MAX_CACHE_ENTRIES_HARD)
+      /* All items are dirty.  */
+      if (in_transaction)
         {
-          if (opt.debug && !(cache_entries % 100))
-            log_debug ("increasing tdbio cache size\n");
-          r = xmalloc (sizeof *r);
-          r->flags.used = 1;
-          r->recno = recno;
-          memcpy (r->data, data, TRUST_RECORD_LEN);
-          r->flags.dirty = 1;
-          r->next = cache_list;
-          cache_list = r;
-          cache_is_dirty = 1;
-          cache_entries++;
-          return 0;
-	}
-      /* Hard limit for the cache size reached.  */
-      log_info (_("trustdb transaction too large\n"));
-      return GPG_ERR_RESOURCE_LIMIT;
+          if (cache_entries < MAX_CACHE_ENTRIES_HARD)
+            return 0; /* Let the cache grow.  */
+          /* Hard limit for the cache size reached.  */
+          if (!transaction_flushed)
+            log_info (_("trustdb transaction too large\n"));
+          transaction_flushed = 1;
+        }
+      rc = write_dirty_items ();
+      if (rc)
+        return rc;
     }
-#endif
 
-  if (dirty_count)
-    {
-      int n;
-
-      /* Discard some dirty entries. */
-      n = dirty_count / 5;
-      if (!n)
-        n = 1;
+  cache_remove (cache_lru.tail);
+  return 0;
+}
 
-      take_write_lock ();
-      for (unused = NULL, r = cache_list; r; r = r->next)
-        {
-          if (r->flags.used && r->flags.dirty)
-            {
-              int rc;
 
-              rc = write_cache_item (r);
-              if (rc)
-                return rc;
-              if (!unused)
-                unused = r;
-              r->flags.used = 0;
-              cache_entries--;
-              if (!--n)
-                break;
-	    }
-	}
-      release_write_lock ();
+/*
+ * Put data into the cache.  DIRTY tells whether DATA still needs to
+ * be written to the file.  This function may flush some cache entries
+ * if the cache is filled up.
+ *
+ * Returns: 0 on success or an error code.
+ */
+static int
+put_record_into_cache (ulong recno, const char *data, int dirty)
+{
+  CACHE_CTRL r;
+  unsigned int idx;
+  int rc;
 
-      /* Now put into the cache.  */
-      log_assert (unused);
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
+  /* See whether we already cached this one.  */
+  r = cache_lookup (recno);
+  if (r)
+    {
+      if (dirty && !r->flags.dirty && memcmp (r->data, data, TRUST_RECORD_LEN))
+        {
+          cache_list_unlink (&cache_lru, r);
+          r->flags.dirty = 1;
+          cache_list_push (&cache_dirty, r);
+          cache_is_dirty = 1;
+        }
       memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
       return 0;
     }
 
-  /* We should never reach this.  */
-  BUG();
+  /* Not in the cache: add a new entry. */
+  rc = make_room_in_cache ();
+  if (rc)
+    return rc;
+
+  if (cache_entries >= 2 * cache_tbl_size)
+    cache_rehash ();
+
+  r = xmalloc (sizeof *r);
+  r->recno = recno;
+  memcpy (r->data, data, TRUST_RECORD_LEN);
+  r->flags.dirty = !!dirty;
+  idx = recno & (cache_tbl_size - 1);
+  r->next = cache_tbl[idx];
+  cache_tbl[idx] = r;
+  if (dirty)
+    {
+      cache_list_push (&cache_dirty, r);
+      cache_is_dirty = 1;
+    }
+  else
+    cache_list_push (&cache_lru, r);
+  cache_entries++;
+  return 0;
 }
 
 
@@ -429,53 +555,34 @@ tdbio_is_dirty()
 
 
 /*
- * Flush the cache.  This cannot be used while in a transaction.
+ * Flush the cache.  While in a transaction this does nothing because
+ * the records are written by tdbio_end_transaction.
  */
 int
 tdbio_sync()
 {
-    CACHE_CTRL r;
-    int did_lock = 0;
-
     if( db_fd == -1 )
 	open_db();
-#if 0 /* Transactions are not yet used.  */
     if( in_transaction )
-	log_bug("tdbio: syncing while in transaction\n");
-#endif
+	return 0;
 
     if( !cache_is_dirty )
 	return 0;
 
-    if (!take_write_lock ())
-        did_lock = 1;
-
-    for( r = cache_list; r; r = r->next ) {
-	if( r->flags.used && r->flags.dirty ) {
-	    int rc = write_cache_item( r );
-	    if( rc )
-		return rc;
-	}
-    }
-    cache_is_dirty = 0;
-    if (did_lock)
-        release_write_lock ();
-
-    return 0;
+    return write_dirty_items ();
 }
 
 
-#if 0  /* Not yet used.  */
 /*
  * Simple transactions system:
  * Everything between begin_transaction and end/cancel_transaction
  * is not immediately written but at the time of end_transaction.
- *
- * NOTE: The transaction code is disabled in the 1.2 branch, as it is
- * not yet used.
+ * This allows to write all records of a bulk update at once.  If a
+ * transaction grows too large for the cache its records are written
+ * early and it can't be canceled anymore.
  */
 int
-tdbio_begin_transaction ()  /* Not yet used.  */
+tdbio_begin_transaction ()
 {
   int rc;
 
@@ -486,11 +593,13 @@ tdbio_begin_transaction ()  /* Not yet used.  */
   if (rc)
     return rc;
   in_transaction = 1;
+  transaction_flushed = 0;
+  spare_chunk = SPARE_CHUNK_MIN;
   return 0;
 }
 
 int
-tdbio_end_transaction ()  /* Not yet used.  */
+tdbio_end_transaction ()
 {
   int rc;
 
@@ -499,42 +608,236 @@ tdbio_end_transaction ()  /* Not yet used.  */
   take_write_lock ();
   gnupg_block_all_signals ();
   in_transaction = 0;
+  release_spare_records ();
   rc = tdbio_sync();
+#ifdef HAVE_FSYNC
+  if (!rc && fsync (db_fd))
+    rc = gpg_error_from_syserror ();
+#endif
   gnupg_unblock_all_signals();
   release_write_lock ();
   return rc;
 }
 
 int
-tdbio_cancel_transaction () /* Not yet used.  */
+tdbio_cancel_transaction ()
 {
   CACHE_CTRL r;
 
   if (!in_transaction)
     log_bug ("tdbio: no active transaction\n");
 
+  in_transaction = 0;
+  db_generation++;
+  if (transaction_flushed)
+    {
+      release_spare_records ();
+      return gpg_error (GPG_ERR_CONFLICT);
+    }
+
   /* Remove all dirty marked entries, so that the original ones are
-   * read back the next time.  */
-  if (cache_is_dirty)
+   * read back the next time.  The fingerprint index may contain the
+   * removed trust records and needs to be rebuilt.  */
+  while ((r = cache_dirty.head))
+    cache_remove (r);
+  cache_is_dirty = 0;
+  release_fpr_index ();
+
+  /* The spare records are already part of the file.  Put them on the
+   * free list now that the cached version record has been dropped.  */
+  release_spare_records ();
+  tdbio_sync ();
+
+  return 0;
+}
+
+
+
+/*************************************
+ *********** fingerprint index *******
+ *************************************/
+
+/* Release the fingerprint index.  It will be rebuilt on demand.  */
+static void
+release_fpr_index (void)
+{
+  xfree (fpr_index);
+  fpr_index = NULL;
+  fpr_index_size = fpr_index_used = 0;
+}
+
+
+/* Return the slot for FPR in the fingerprint index.  This is either
+ * the slot holding FPR or the empty slot where it can be inserted.  */
+static struct fpr_index_item *
+fpr_index_slot (const byte *fpr)
+{
+  struct fpr_index_item *item, *deleted = NULL;
+  unsigned int i;
+
+  i = buf32_to_uint (fpr) & (fpr_index_size - 1);
+  for (;; i = (i + 1) & (fpr_index_size - 1))
     {
-      for (r = cache_list; r; r = r->next)
+      item = fpr_index + i;
+      if (!item->recno)
+        return deleted? deleted : item;
+      if (item->recno == FPR_INDEX_DELETED)
         {
-          if (r->flags.used && r->flags.dirty)
-            {
-              r->flags.used = 0;
-              cache_entries--;
-	    }
-	}
-      cache_is_dirty = 0;
+          if (!deleted)
+            deleted = item;
+        }
+      else if (!memcmp (item->fpr, fpr, 20))
+        return item;
     }
+}
 
-  in_transaction = 0;
+
+/* Store RECNO as the trust record for FPR in the index.  */
+static void
+fpr_index_put (const byte *fpr, ulong recno)
+{
+  struct fpr_index_item *item;
+
+  if ((fpr_index_used + 1) * 4 > fpr_index_size * 3)
+    {
+      struct fpr_index_item *old = fpr_index;
+      unsigned int old_size = fpr_index_size;
+      unsigned int i;
+
+      fpr_index_size *= 2;
+      fpr_index = xtrycalloc (fpr_index_size, sizeof *fpr_index);
+      if (!fpr_index)
+        {
+          xfree (old);
+          fpr_index_size = fpr_index_used = 0;
+          return;  /* Use the on-disk hash table.  */
+        }
+      fpr_index_used = 0;
+      for (i=0; i < old_size; i++)
+        if (old[i].recno && old[i].recno != FPR_INDEX_DELETED)
+          {
+            item = fpr_index_slot (old[i].fpr);
+            *item = old[i];
+            fpr_index_used++;
+          }
+      xfree (old);
+    }
+
+  item = fpr_index_slot (fpr);
+  if (!item->recno)
+    fpr_index_used++;
+  memcpy (item->fpr, fpr, 20);
+  item->recno = recno;
+}
+
+
+/* Remove FPR from the index.  */
+static void
+fpr_index_del (const byte *fpr)
+{
+  struct fpr_index_item *item;
+
+  item = fpr_index_slot (fpr);
+  if (item->recno && item->recno != FPR_INDEX_DELETED)
+    item->recno = FPR_INDEX_DELETED;
+}
+
+
+/* Build the fingerprint index by reading the entire trustdb.  Returns
+ * true if the index is available.  */
+static int
+build_fpr_index (void)
+{
+  byte buf[128 * TRUST_RECORD_LEN];
+  struct stat st;
+  ulong recno, nrecs;
+  off_t offset;
+  int n = 0;
+  int i;
+
+  if (fpr_index)
+    return 1;
+  if (fpr_index_lookups < FPR_INDEX_MIN_LOOKUPS
+      || fpr_index_builds >= FPR_INDEX_MAX_BUILDS
+      || cache_is_dirty)
+    return 0;
+  fpr_index_builds++;
+
+  if (fstat (db_fd, &st))
+    return 0;
+  nrecs = st.st_size / TRUST_RECORD_LEN;
+  for (fpr_index_size = 1024; fpr_index_size < nrecs; fpr_index_size *= 2)
+    ;
+  fpr_index = xtrycalloc (fpr_index_size, sizeof *fpr_index);
+  if (!fpr_index)
+    return 0;
+  fpr_index_used = 0;
+
+  if (lseek (db_fd, 0, SEEK_SET) == -1)
+    goto failure;
+  for (recno = 0, offset = 0; offset < st.st_size; offset += n)
+    {
+      n = read (db_fd, buf, sizeof buf);
+      if (n < 0)
+        goto failure;
+      if (!n)
+        break;
+      for (i=0; i + TRUST_RECORD_LEN <= n; i += TRUST_RECORD_LEN, recno++)
+        if (buf[i] == RECTYPE_TRUST)
+          {
+            fpr_index_put (buf + i + 2, recno);
+            if (!fpr_index)
+              return 0;
+          }
+      if (n % TRUST_RECORD_LEN)
+        break;  /* Ignore a truncated last record.  */
+    }
+  fpr_index_filesize = st.st_size;
+
+  if (DBG_CACHE)
+    log_debug ("tdbio: indexed %u trust records\n", fpr_index_used);
+  return 1;
+
+ failure:
+  log_error (_("trustdb: read failed (n=%d): %s\n"), n, strerror (errno));
+  release_fpr_index ();
   return 0;
 }
-#endif  /* Not yet used.  */
 
 
-
+/* Lookup the trust record for FINGERPRINT using the index.  Returns 0
+ * and stores the record at REC if found, GPG_ERR_NOT_FOUND if there is
+ * no trust record for FINGERPRINT, and GPG_ERR_NO_DATA if the on-disk
+ * hash table needs to be used instead.  */
+static gpg_error_t
+lookup_fpr_index (const byte *fingerprint, TRUSTREC *rec)
+{
+  struct fpr_index_item *item;
+  struct stat st;
+
+  fpr_index_lookups++;
+  if (!build_fpr_index ())
+    return gpg_error (GPG_ERR_NO_DATA);
+
+  item = fpr_index_slot (fingerprint);
+  if (!item->recno || item->recno == FPR_INDEX_DELETED)
+    {
+      /* Another process may have added the record.  */
+      if (!fstat (db_fd, &st) && st.st_size == fpr_index_filesize)
+        return gpg_error (GPG_ERR_NOT_FOUND);
+    }
+  else if (!tdbio_read_record (item->recno, rec, 0)
+           && rec->rectype == RECTYPE_TRUST
+           && !memcmp (rec->r.trust.fingerprint, fingerprint, 20))
+    return 0;
+
+  /* The index is stale.  */
+  release_fpr_index ();
+  return gpg_error (GPG_ERR_NO_DATA);
+}
+
+
+
 /********************************************************
  **************** cached I/O functions ******************
  ********************************************************/
@@ -552,8 +855,9 @@ cleanup (void)
 
 
 /*
- * Update an existing trustdb record.  The caller must call
- * tdbio_sync.
+ * Update an existing trustdb record.  This is called after a full
+ * validation of the trustdb and thus also sets TDB_VERFLAG_DEPTH.
+ * The caller must call tdbio_sync.
  *
  * Returns: 0 on success or an error code.
  */
@@ -574,6 +878,7 @@ tdbio_update_version_record (ctrl_t ctrl)
       rec.r.ver.cert_depth  = opt.max_cert_depth;
       rec.r.ver.trust_model = opt.trust_model;
       rec.r.ver.min_cert_level = opt.min_cert_level;
+      rec.r.ver.flags      |= TDB_VERFLAG_DEPTH;
       rc = tdbio_write_record (ctrl, &rec);
     }
 
@@ -642,6 +947,7 @@ tdbio_set_dbname (ctrl_t ctrl, const char *new_dbname,
       atexit (cleanup);
       initialized = 1;
     }
+  db_generation++;
 
   *r_nofile = 0;
 
@@ -936,6 +1242,24 @@ tdbio_read_nextcheck ()
 }
 
 
+/*
+ * Read and return the flags of the version record.  On a read problem
+ * the process is terminated.
+ */
+ulong
+tdbio_read_verflags (void)
+{
+  TRUSTREC vr;
+  int rc;
+
+  rc = tdbio_read_record (0, &vr, RECTYPE_VER);
+  if (rc)
+    log_fatal (_("%s: error reading version record: %s\n"),
+               db_name, gpg_strerror (rc));
+  return vr.r.ver.flags;
+}
+
+
 /*
  * Write the STAMP nextstamp timestamp to the trustdb.  On a read or
  * write problem the process is terminated.
@@ -1404,8 +1728,13 @@ lookup_hashtable (ulong table, const byte *key, size_t keylen,
 static int
 update_trusthashtbl (ctrl_t ctrl, TRUSTREC *tr)
 {
-  return upd_hashtable (ctrl, get_trusthashrec (ctrl),
-                        tr->r.trust.fingerprint, 20, tr->recnum);
+  int rc;
+
+  rc = upd_hashtable (ctrl, get_trusthashrec (ctrl),
+                      tr->r.trust.fingerprint, 20, tr->recnum);
+  if (!rc && fpr_index)
+    fpr_index_put (tr->r.trust.fingerprint, tr->recnum);
+  return rc;
 }
 
 
@@ -1428,7 +1757,8 @@ tdbio_dump_record (TRUSTREC *rec, estream_t fp)
 
     case RECTYPE_VER:
       es_fprintf (fp,
-         "version, td=%lu, f=%lu, m/c/d=%d/%d/%d tm=%d mcl=%d nc=%lu (%s)\n",
+         "version, td=%lu, f=%lu, m/c/d=%d/%d/%d tm=%d mcl=%d nc=%lu (%s)"
+                  " fl=%lu\n",
                   rec->r.ver.trusthashtbl,
                   rec->r.ver.firstfree,
                   rec->r.ver.marginals,
@@ -1437,7 +1767,8 @@ tdbio_dump_record (TRUSTREC *rec, estream_t fp)
                   rec->r.ver.trust_model,
                   rec->r.ver.min_cert_level,
                   rec->r.ver.nextcheck,
-                  strtimestamp(rec->r.ver.nextcheck)
+                  strtimestamp(rec->r.ver.nextcheck),
+                  rec->r.ver.flags
                   );
       break;
 
@@ -1522,6 +1853,9 @@ tdbio_read_record (ulong recnum, TRUSTREC *rec, int expected)
           return err;
 	}
       buf = readbuf;
+      err = put_record_into_cache (recnum, readbuf, 0);
+      if (err)
+        return err;
     }
   rec->recnum = recnum;
   rec->dirty = 0;
@@ -1559,6 +1893,7 @@ tdbio_read_record (ulong recnum, TRUSTREC *rec, int expected)
           p += 4;
           rec->r.ver.nextcheck = buf32_to_ulong(p);
           p += 4;
+          rec->r.ver.flags = buf32_to_ulong(p);
           p += 4;
           p += 4;
           rec->r.ver.firstfree = buf32_to_ulong(p);
@@ -1650,6 +1985,7 @@ tdbio_write_record (ctrl_t ctrl, TRUSTREC *rec)
   if (db_fd == -1)
     open_db ();
 
+  db_generation++;
   memset (buf, 0, TRUST_RECORD_LEN);
   p = buf;
   *p++ = rec->rectype; p++;
@@ -1672,7 +2008,7 @@ tdbio_write_record (ctrl_t ctrl, TRUSTREC *rec)
       p += 2;
       ulongtobuf(p, rec->r.ver.created); p += 4;
       ulongtobuf(p, rec->r.ver.nextcheck); p += 4;
-      p += 4;
+      ulongtobuf(p, rec->r.ver.flags); p += 4;
       p += 4;
       ulongtobuf(p, rec->r.ver.firstfree ); p += 4;
       p += 4;
@@ -1719,7 +2055,7 @@ tdbio_write_record (ctrl_t ctrl, TRUSTREC *rec)
       BUG();
     }
 
-  rc = put_record_into_cache (recnum, buf);
+  rc = put_record_into_cache (recnum, buf, 1);
   if (rc)
     ;
   else if (rec->rectype == RECTYPE_TRUST)
@@ -1729,6 +2065,16 @@ tdbio_write_record (ctrl_t ctrl, TRUSTREC *rec)
 }
 
 
+/*
+ * Return a counter which changes whenever the trustdb is modified.
+ */
+unsigned int
+tdbio_get_generation (void)
+{
+  return db_generation;
+}
+
+
 /*
  * Delete the record at record number RECNUm from the trustdb.
  *
@@ -1740,6 +2086,8 @@ tdbio_delete_record (ctrl_t ctrl, ulong recnum)
   TRUSTREC vr, rec;
   int rc;
 
+  db_generation++;
+
   /* Must read the record fist, so we can drop it from the hash tables */
   rc = tdbio_read_record (recnum, &rec, 0);
   if (rc)
@@ -1748,6 +2096,8 @@ tdbio_delete_record (ctrl_t ctrl, ulong recnum)
     {
       rc = drop_from_hashtable (ctrl, get_trusthashrec (ctrl),
                                 rec.r.trust.fingerprint, 20, rec.recnum);
+      if (!rc && fpr_index)
+        fpr_index_del (rec.r.trust.fingerprint);
     }
 
   if (rc)
@@ -1771,6 +2121,87 @@ tdbio_delete_record (ctrl_t ctrl, ulong recnum)
 }
 
 
+/*
+ * Append a chunk of unused records to the file for use by
+ * tdbio_new_recnum during a transaction.  This is done with a single
+ * write.
+ *
+ * Returns: 0 on success or an error code.
+ */
+static int
+append_spare_records (void)
+{
+  gpg_error_t err;
+  off_t offset;
+  char *buffer;
+  size_t length;
+  ssize_t n;
+
+  offset = lseek (db_fd, 0, SEEK_END);
+  if (offset == (off_t)(-1))
+    log_fatal ("trustdb: lseek to end failed: %s\n", strerror (errno));
+  length = spare_chunk * TRUST_RECORD_LEN;
+  buffer = xtrycalloc (1, length);
+  if (!buffer)
+    return gpg_error_from_syserror ();
+  n = write (db_fd, buffer, length);
+  err = n == length? 0 : gpg_error_from_syserror ();
+  xfree (buffer);
+  if (err)
+    {
+      log_error (_("trustdb rec %lu: write failed (n=%d): %s\n"),
+                 (ulong)(offset / TRUST_RECORD_LEN), (int)n,
+                 gpg_strerror (err));
+      return err;
+    }
+
+  spare_recnum = offset / TRUST_RECORD_LEN;
+  spare_count = spare_chunk;
+  if (fpr_index && offset == fpr_index_filesize)
+    fpr_index_filesize += length;
+  if (spare_chunk < SPARE_CHUNK_MAX)
+    spare_chunk *= 2;
+  return 0;
+}
+
+
+/*
+ * Put the unused records appended by append_spare_records on the
+ * free list.
+ */
+static void
+release_spare_records (void)
+{
+  TRUSTREC vr, rec;
+  int rc;
+
+  if (!spare_count)
+    return;
+
+  rc = tdbio_read_record (0, &vr, RECTYPE_VER);
+  if (rc)
+    log_fatal (_("%s: error reading version record: %s\n"),
+               db_name, gpg_strerror (rc));
+  /* The CTRL is only needed for trust records.  */
+  for (; spare_count; spare_count--, spare_recnum++)
+    {
+      memset (&rec, 0, sizeof rec);
+      rec.recnum = spare_recnum;
+      rec.rectype = RECTYPE_FREE;
+      rec.r.free.next = vr.r.ver.firstfree;
+      vr.r.ver.firstfree = spare_recnum;
+      rc = tdbio_write_record (NULL, &rec);
+      if (rc)
+        log_fatal (_("%s: failed to zero a record: %s\n"),
+                   db_name, gpg_strerror (rc));
+    }
+  rc = tdbio_write_record (NULL, &vr);
+  if (rc)
+    log_fatal (_("%s: error writing dir record: %s\n"),
+               db_name, gpg_strerror (rc));
+}
+
+
 /*
  * Create a new record and return its record number.
  */
@@ -1810,6 +2241,15 @@ tdbio_new_recnum (ctrl_t ctrl)
         log_fatal (_("%s: failed to zero a record: %s\n"),
                    db_name, gpg_strerror (rc));
     }
+  else if (in_transaction)
+    {
+      /* Take one of the records appended in a chunk.  */
+      if (!spare_count && (rc = append_spare_records ()))
+        log_fatal (_("%s: failed to append a record: %s\n"),
+                   db_name, gpg_strerror (rc));
+      recnum = spare_recnum++;
+      spare_count--;
+    }
   else /* Not found - append a new record.  */
     {
       offset = lseek (db_fd, 0, SEEK_END);
@@ -1845,6 +2285,8 @@ tdbio_new_recnum (ctrl_t ctrl)
       if (rc)
         log_fatal (_("%s: failed to append a record: %s\n"),
                    db_name, gpg_strerror (rc));
+      if (fpr_index && offset == fpr_index_filesize)
+        fpr_index_filesize += TRUST_RECORD_LEN;
     }
 
   return recnum ;
@@ -1872,6 +2314,14 @@ tdbio_search_trust_byfpr (ctrl_t ctrl, const byte *fingerprint, TRUSTREC *rec)
 {
   int rc;
 
+  if (db_fd == -1)
+    open_db ();
+
+  /* Try the in-memory index first.  */
+  rc = lookup_fpr_index (fingerprint, rec);
+  if (gpg_err_code (rc) != GPG_ERR_NO_DATA)
+    return rc;
+
   /* Locate the trust record using the hash table */
   rc = lookup_hashtable (get_trusthashrec (ctrl), fingerprint, 20,
                          cmp_trec_fpr, fingerprint, rec );
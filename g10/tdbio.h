@@ -40,6 +40,10 @@
 #define RECTYPE_VALID 13
 #define RECTYPE_FREE 254
 
+/* Flags of the version record.  */
+#define TDB_VERFLAG_DEPTH 1  /* The depth of a trust record is the depth
+                                at which the key became fully valid.  */
+
 
 struct trust_record {
     int  rectype;
@@ -57,7 +61,7 @@ struct trust_record {
 	    byte  min_cert_level;
 	    ulong created;   /* timestamp of trustdb creation  */
 	    ulong nextcheck; /* timestamp of next scheduled check */
-	    ulong reserved;
+	    ulong flags;     /* TDB_VERFLAG_* values */
 	    ulong reserved2;
 	    ulong firstfree;
 	    ulong reserved3;
@@ -102,6 +106,7 @@ int tdbio_write_record (ctrl_t ctrl, TRUSTREC *rec);
 int tdbio_db_matches_options(void);
 byte tdbio_read_model(void);
 ulong tdbio_read_nextcheck (void);
+ulong tdbio_read_verflags (void);
 int tdbio_write_nextcheck (ctrl_t ctrl, ulong stamp);
 int tdbio_is_dirty(void);
 int tdbio_sync(void);
@@ -109,6 +114,7 @@ int tdbio_begin_transaction(void);
 int tdbio_end_transaction(void);
 int tdbio_cancel_transaction(void);
 int tdbio_delete_record (ctrl_t ctrl, ulong recnum);
+unsigned int tdbio_get_generation (void);
 ulong tdbio_new_recnum (ctrl_t ctrl);
 gpg_error_t tdbio_search_trust_byfpr (ctrl_t ctrl, const byte *fingerprint,
                                       TRUSTREC *rec);
@@ -261,6 +261,17 @@ get_session_key (ctrl_t ctrl, PKT_pubkey_enc *k, DEK *dek)
   return GPG_ERR_GENERAL;
 }
 
+/* Stub: */
+gpg_error_t
+get_session_key_from_list (ctrl_t ctrl, struct pubkey_enc_list *list,
+                           DEK *dek)
+{
+  (void)ctrl;
+  (void)list;
+  (void)dek;
+  return GPG_ERR_GENERAL;
+}
+
 /* Stub: */
 gpg_error_t
 get_override_session_key (DEK *dek, const char *string)
@@ -549,3 +560,67 @@ get_revocation_reason (PKT_signature *sig, char **r_reason,
     *r_comment = NULL;
   return 0;
 }
+
+gpg_error_t
+sigcache_lookup (const byte *key)
+{
+  (void)key;
+  return gpg_error (GPG_ERR_NOT_FOUND);
+}
+
+void
+sigcache_store (const byte *key, gpg_error_t rc)
+{
+  (void)key;
+  (void)rc;
+}
+
+void
+sigcache_dump_stats (void)
+{
+}
+
+/* Stubs:
+ * No threads here; the signatures are checked without a workpool.
+ */
+gpg_error_t
+workpool_new (workpool_t *r_pool, int nthreads)
+{
+  (void)nthreads;
+  *r_pool = NULL;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+void
+workpool_release (workpool_t pool)
+{
+  (void)pool;
+}
+
+gpg_error_t
+workpool_get_shared (workpool_t *r_pool)
+{
+  *r_pool = NULL;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+int
+workpool_nthreads (workpool_t pool)
+{
+  (void)pool;
+  return 0;
+}
+
+void
+workpool_submit (workpool_t pool, workpool_job_t job)
+{
+  (void)pool;
+  (void)job;
+}
+
+void
+workpool_wait (workpool_t pool, workpool_job_t job)
+{
+  (void)pool;
+  (void)job;
+}
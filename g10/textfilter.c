@@ -42,22 +42,42 @@
 			  /* to make sure that a warning is displayed while */
 			  /* creating a message */
 
-static unsigned
-len_without_trailing_chars( byte *line, unsigned len, const char *trimchars )
+/* The size of the buffer used to collect the text for the message
+ * digest.  Feeding the digest in large slices instead of line by line
+ * saves a lot of overhead for text with short lines.  */
+#define MD_BUFFER_SIZE 32768
+
+struct md_buffer_s
 {
-    byte *p, *mark;
-    unsigned n;
+  gcry_md_hd_t md;
+  size_t len;
+  byte buf[MD_BUFFER_SIZE];
+};
 
-    for(mark=NULL, p=line, n=0; n < len; n++, p++ ) {
-	if( strchr( trimchars, *p ) ) {
-	    if( !mark )
-		mark = p;
-	}
-	else
-	    mark = NULL;
-    }
 
-    return mark? (mark - line) : len;
+static void
+md_buffer_flush (struct md_buffer_s *mb)
+{
+  if (mb->len)
+    gcry_md_write (mb->md, mb->buf, mb->len);
+  mb->len = 0;
+}
+
+
+static void
+md_buffer_write (struct md_buffer_s *mb, const void *data, size_t len)
+{
+  if (mb->len + len > MD_BUFFER_SIZE)
+    {
+      md_buffer_flush (mb);
+      if (len > MD_BUFFER_SIZE)
+        {
+          gcry_md_write (mb->md, data, len);
+          return;
+        }
+    }
+  memcpy (mb->buf + mb->len, data, len);
+  mb->len += len;
 }
 
 
@@ -73,9 +93,14 @@ standard( text_filter_context_t *tfx, IOBUF a,
     size -= 2;	/* reserve 2 bytes to append CR,LF */
     while( !rc && len < size ) {
 	int lf_seen;
+	size_t n;
 
-	while( len < size && tfx->buffer_pos < tfx->buffer_len )
-	    buf[len++] = tfx->buffer[tfx->buffer_pos++];
+	n = tfx->buffer_len - tfx->buffer_pos;
+	if( n > size - len )
+	    n = size - len;
+	memcpy( buf + len, tfx->buffer + tfx->buffer_pos, n );
+	len += n;
+	tfx->buffer_pos += n;
 	if( len >= size )
 	    continue;
 
@@ -168,12 +193,17 @@ copy_clearsig_text( IOBUF out, IOBUF inp, gcry_md_hd_t md,
     unsigned int n;
     int truncated = 0;
     int pending_lf = 0;
+    struct md_buffer_s *mb;
 
    if( !escape_dash )
 	escape_from = 0;
 
     write_status_begin_signing (md);
 
+    mb = xmalloc (sizeof *mb);
+    mb->md = md;
+    mb->len = 0;
+
     for(;;) {
 	maxlen = MAX_LINELEN;
 	n = iobuf_read_line( inp, &buffer, &bufsize, &maxlen );
@@ -185,15 +215,14 @@ copy_clearsig_text( IOBUF out, IOBUF inp, gcry_md_hd_t md,
 
 	/* update the message digest */
 	if( escape_dash ) {
-	    if( pending_lf ) {
-		gcry_md_putc ( md, '\r' );
-		gcry_md_putc ( md, '\n' );
-	    }
-	    gcry_md_write ( md, buffer,
-                            len_without_trailing_chars (buffer, n, " \t\r\n"));
+	    if( pending_lf )
+		md_buffer_write ( mb, "\r\n", 2 );
+	    md_buffer_write ( mb, buffer,
+                              length_sans_trailing_chars (buffer, n,
+                                                          " \t\r\n"));
 	}
 	else
-            gcry_md_write ( md, buffer, n );
+            md_buffer_write ( mb, buffer, n );
 	pending_lf = buffer[n-1] == '\n';
 
 	/* write the output */
@@ -234,8 +263,10 @@ copy_clearsig_text( IOBUF out, IOBUF inp, gcry_md_hd_t md,
     if( !pending_lf ) { /* make sure that the file ends with a LF */
 	iobuf_writestr( out, LF );
 	if( !escape_dash )
-	    gcry_md_putc( md, '\n' );
+	    md_buffer_write ( mb, "\n", 1 );
     }
+    md_buffer_flush (mb);
+    xfree (mb);
 
     if( truncated )
 	log_info(_("input line longer than %d characters\n"), MAX_LINELEN );
@@ -55,6 +55,51 @@
  * indicate that a lot of history is available.  */
 #define FULL_TRUST_THRESHOLD  21
 
+/* The number of nesting levels of inner save points for which we
+   cache the statements.  */
+#define TOFU_CACHED_SAVEPOINTS 4
+
+/* The maximum number of inner transactions we commit into one batch
+   transaction.  Once reached, the batch transaction is committed and
+   a new one is started.  This keeps the rollback journal at a sane
+   size when verifying a large number of signatures.  */
+#define TOFU_BATCH_MAX_COMMITS 1000
+
+/* The number of buckets of the policy cache and the maximum number of
+   items we keep in it.  */
+#define POLICY_CACHE_BUCKETS 256
+#define POLICY_CACHE_MAX_ITEMS 8192
+
+/* The maximum number of signatures seen in batch mode which we keep
+   in memory before writing them to the database.  */
+#define TOFU_MAX_PENDING_SIGS 1000
+
+
+/* An item of the in-memory cache of effective policies.  The key is
+   the fingerprint followed by a Nul and the email address.  */
+struct policy_cache_item
+{
+  struct policy_cache_item *next;
+  enum tofu_policy policy;
+  char *email;  /* Points into KEY.  */
+  char key[1];
+};
+
+
+/* A signature which has been seen in batch mode but not yet been
+   written to the database.  EMAIL, SIG_DIGEST and ORIGIN point into
+   FINGERPRINT.  */
+struct pending_sig
+{
+  struct pending_sig *next;
+  time_t sig_time;
+  time_t time;
+  char *email;
+  char *sig_digest;
+  char *origin;
+  char fingerprint[1];
+};
+
 
 /* A struct with data pertaining to the tofu DB.  There is one such
    struct per session and it is cached in session's ctrl structure.
@@ -64,6 +109,9 @@
 struct tofu_dbs_s
 {
   sqlite3 *db;
+  /* A read-only connection to the same database used for lookups
+   * which do not need the write lock.  May be NULL.  */
+  sqlite3 *rodb;
   char *want_lock_file;
   time_t want_lock_file_ctime;
 
@@ -72,9 +120,16 @@ struct tofu_dbs_s
     sqlite3_stmt *savepoint_batch;
     sqlite3_stmt *savepoint_batch_commit;
 
+    /* The statements for the inner save points, indexed by the
+     * nesting level minus one.  */
+    sqlite3_stmt *savepoint_inner[TOFU_CACHED_SAVEPOINTS];
+    sqlite3_stmt *savepoint_inner_release[TOFU_CACHED_SAVEPOINTS];
+    sqlite3_stmt *savepoint_inner_rollback[TOFU_CACHED_SAVEPOINTS];
+
     sqlite3_stmt *record_binding_get_old_policy;
     sqlite3_stmt *record_binding_update;
     sqlite3_stmt *get_policy_select_policy_and_conflict;
+    sqlite3_stmt *get_policy_readonly;
     sqlite3_stmt *get_trust_bindings_with_this_email;
     sqlite3_stmt *get_trust_gather_other_user_ids;
     sqlite3_stmt *get_trust_gather_signature_stats;
@@ -82,17 +137,44 @@ struct tofu_dbs_s
     sqlite3_stmt *register_already_seen;
     sqlite3_stmt *register_signature;
     sqlite3_stmt *register_encryption;
+    sqlite3_stmt *show_statistics_signatures;
+    sqlite3_stmt *show_statistics_encryptions;
+    sqlite3_stmt *set_conflict;
+    sqlite3_stmt *notice_key_changed;
+    sqlite3_stmt *data_version;
   } s;
 
+  /* A cache of the effective policies of bindings without a
+   * conflict.  */
+  struct policy_cache_item *policy_cache[POLICY_CACHE_BUCKETS];
+  unsigned int policy_cache_count;
+  /* The value of PRAGMA data_version when the cache was last
+   * validated.  This changes if another process commits a change to
+   * the database.  */
+  long data_version;
+
   int in_batch_transaction;
   int in_transaction;
   time_t batch_update_started;
+  /* The number of inner transactions committed into the current
+   * batch transaction.  */
+  unsigned int batch_commits;
+
+  /* The signatures not yet written to the database in the order they
+   * have been seen.  */
+  struct pending_sig *pending_sigs;
+  struct pending_sig *pending_sigs_last;
+  unsigned int pending_sigs_count;
 };
 
 
 #define STRINGIFY(s) STRINGIFY2(s)
 #define STRINGIFY2(s) #s
 
+/* The values of the KIND column of the stats table.  */
+#define STATS_KIND_SIGNATURE  0
+#define STATS_KIND_ENCRYPTION 1
+
 /* The grouping parameters when collecting signature statistics.  */
 
 /* If a message is signed a couple of hours in the future, just assume
@@ -110,6 +192,9 @@ struct tofu_dbs_s
 
 /* Local prototypes.  */
 static gpg_error_t end_transaction (ctrl_t ctrl, int only_batch);
+static void policy_cache_flush (tofu_dbs_t dbs);
+static void policy_cache_validate (tofu_dbs_t dbs, int force);
+static gpg_error_t flush_pending_sigs (ctrl_t ctrl);
 static char *email_from_user_id (const char *user_id);
 static int show_statistics (tofu_dbs_t dbs,
                             const char *fingerprint, const char *email,
@@ -163,6 +248,25 @@ tofu_policy_to_trust_level (enum tofu_policy policy)
 
 
 
+/* Execute the save point command CMD ("savepoint", "release" or
+ * "rollback to") for the inner save point of the current nesting
+ * level.  The statements for the first few levels are cached in the
+ * array CACHE.  Returns an SQLite error code and stores an error
+ * message at R_ERR.  */
+static int
+inner_savepoint (tofu_dbs_t dbs, sqlite3_stmt **cache, const char *cmd,
+                 char **r_err)
+{
+  char sql[32];
+
+  snprintf (sql, sizeof sql, "%s inner%d;", cmd, dbs->in_transaction);
+  return gpgsql_stepx (dbs->db,
+                       (dbs->in_transaction <= TOFU_CACHED_SAVEPOINTS
+                        ? &cache[dbs->in_transaction - 1] : NULL),
+                       NULL, NULL, r_err, sql, GPGSQL_ARG_END);
+}
+
+
 /* Start a transaction on DB.  If ONLY_BATCH is set, then this will
    start a batch transaction if we haven't started a batch transaction
    and one has been requested.  */
@@ -211,6 +315,12 @@ begin_transaction (ctrl_t ctrl, int only_batch)
         dbs->batch_update_started = gnupg_get_time ();
     }
 
+  /* Do not let a batch transaction grow without bounds.  */
+  if (dbs->in_transaction == 0
+      && dbs->in_batch_transaction
+      && dbs->batch_commits >= TOFU_BATCH_MAX_COMMITS)
+    end_transaction (ctrl, 2);
+
   if (/* We don't have an open batch transaction.  */
       !dbs->in_batch_transaction
       && (/* Batch mode is enabled or we are starting a new transaction.  */
@@ -236,6 +346,11 @@ begin_transaction (ctrl_t ctrl, int only_batch)
 
       dbs->in_batch_transaction = 1;
       dbs->batch_update_started = gnupg_get_time ();
+      dbs->batch_commits = 0;
+
+      /* Another process might have changed the database while we
+       * did not hold the lock.  */
+      policy_cache_validate (dbs, 1);
 
       if (stat (dbs->want_lock_file, &statbuf) == 0)
         dbs->want_lock_file_ctime = statbuf.st_ctime;
@@ -247,9 +362,7 @@ begin_transaction (ctrl_t ctrl, int only_batch)
   log_assert (dbs->in_transaction >= 0);
   dbs->in_transaction ++;
 
-  rc = gpgsql_exec_printf (dbs->db, NULL, NULL, &err,
-                           "savepoint inner%d;",
-                           dbs->in_transaction);
+  rc = inner_savepoint (dbs, dbs->s.savepoint_inner, "savepoint", &err);
   if (rc)
     {
       log_error (_("error beginning transaction on TOFU database: %s\n"),
@@ -314,10 +427,12 @@ end_transaction (ctrl_t ctrl, int only_batch)
   log_assert (dbs);
   log_assert (dbs->in_transaction > 0);
 
-  rc = gpgsql_exec_printf (dbs->db, NULL, NULL, &err,
-                           "release inner%d;", dbs->in_transaction);
+  rc = inner_savepoint (dbs, dbs->s.savepoint_inner_release,
+                        "release", &err);
 
   dbs->in_transaction --;
+  if (!rc && !dbs->in_transaction && dbs->in_batch_transaction)
+    dbs->batch_commits++;
 
   if (rc)
     {
@@ -341,11 +456,13 @@ rollback_transaction (ctrl_t ctrl)
   log_assert (dbs);
   log_assert (dbs->in_transaction > 0);
 
+  /* The cache may now have entries which have been rolled back.  */
+  policy_cache_flush (dbs);
+
   /* Be careful to not undo any progress made by closed transactions in
      batch mode.  */
-  rc = gpgsql_exec_printf (dbs->db, NULL, NULL, &err,
-                           "rollback to inner%d;",
-                           dbs->in_transaction);
+  rc = inner_savepoint (dbs, dbs->s.savepoint_inner_rollback,
+                        "rollback to", &err);
 
   dbs->in_transaction --;
 
@@ -371,6 +488,8 @@ tofu_end_batch_update (ctrl_t ctrl)
 {
   log_assert (ctrl->tofu.batch_updated_wanted > 0);
   ctrl->tofu.batch_updated_wanted --;
+  if (!ctrl->tofu.batch_updated_wanted)
+    flush_pending_sigs (ctrl);
   end_transaction (ctrl, 1);
 }
 
@@ -656,6 +775,86 @@ check_utks (sqlite3 *db)
   return rc;
 }
 
+/* Create the stats table if it does not yet exist.
+ *
+ * The table summarizes the signatures and encryptions tables: For
+ * each binding, kind of message and day it has the number of
+ * messages and the first and last time one has been seen.  Computing
+ * the statistics of a binding from the full tables takes seconds if
+ * tens of millions of messages have been registered.  The table is
+ * maintained by triggers so that it is also kept up to date by
+ * versions of GnuPG which do not know about it.  */
+static int
+create_stats (sqlite3 *db)
+{
+  int rc;
+  char *err = NULL;
+  unsigned long count;
+
+  rc = sqlite3_exec (db,
+                     "select count(*) from sqlite_master"
+                     " where type='table' and name='stats';",
+                     get_single_unsigned_long_cb, &count, &err);
+  if (rc)
+    {
+      log_error (_("error reading TOFU database: %s\n"), err);
+      print_further_info ("query available tables");
+      sqlite3_free (err);
+      return rc;
+    }
+  if (count)
+    return 0;
+
+  rc = gpgsql_exec_printf
+    (db, NULL, NULL, &err,
+     "create table stats"
+     " (binding INTEGER NOT NULL, kind INTEGER NOT NULL,"
+     "  day INTEGER NOT NULL, count INTEGER,"
+     "  first_time INTEGER, last_time INTEGER,"
+     "  primary key (binding, kind, day));\n"
+     "insert into stats"
+     " select binding, %d, time / (24 * 60 * 60) d,"
+     "  count (*), min (time), max (time)"
+     "  from signatures group by binding, d;\n"
+     "insert into stats"
+     " select binding, %d, time / (24 * 60 * 60) d,"
+     "  count (*), min (time), max (time)"
+     "  from encryptions group by binding, d;\n"
+     "create trigger if not exists stats_signatures"
+     " after insert on signatures\n"
+     " begin\n"
+     "  insert or ignore into stats values"
+     "   (new.binding, %d, new.time / (24 * 60 * 60), 0, new.time, new.time);\n"
+     "  update stats set count = count + 1,"
+     "   first_time = min (first_time, new.time),"
+     "   last_time = max (last_time, new.time)"
+     "   where binding = new.binding and kind = %d"
+     "    and day = new.time / (24 * 60 * 60);\n"
+     " end;\n"
+     "create trigger if not exists stats_encryptions"
+     " after insert on encryptions\n"
+     " begin\n"
+     "  insert or ignore into stats values"
+     "   (new.binding, %d, new.time / (24 * 60 * 60), 0, new.time, new.time);\n"
+     "  update stats set count = count + 1,"
+     "   first_time = min (first_time, new.time),"
+     "   last_time = max (last_time, new.time)"
+     "   where binding = new.binding and kind = %d"
+     "    and day = new.time / (24 * 60 * 60);\n"
+     " end;\n",
+     STATS_KIND_SIGNATURE, STATS_KIND_ENCRYPTION,
+     STATS_KIND_SIGNATURE, STATS_KIND_SIGNATURE,
+     STATS_KIND_ENCRYPTION, STATS_KIND_ENCRYPTION);
+  if (rc)
+    {
+      log_error (_("error initializing TOFU database: %s\n"), err);
+      print_further_info ("create stats");
+      sqlite3_free (err);
+    }
+
+  return rc;
+}
+
 /* If the DB is new, initialize it.  Otherwise, check the DB's
    version.
 
@@ -876,6 +1075,9 @@ initdb (sqlite3 *db)
 	}
     }
 
+  if (! rc)
+    rc = create_stats (db);
+
   if (! rc)
     rc = check_utks (db);
 
@@ -943,6 +1145,7 @@ opendbs (ctrl_t ctrl)
 {
   char *filename;
   sqlite3 *db;
+  sqlite3 *rodb = NULL;
   int rc;
 
   if (!ctrl->tofu.dbs)
@@ -965,6 +1168,13 @@ opendbs (ctrl_t ctrl)
         {
           sqlite3_busy_timeout (db, 5 * 1000);
           sqlite3_busy_handler (db, busy_handler, ctrl);
+
+          /* With a write-ahead log readers neither block nor are
+           * blocked by a writer.  The mode is stored in the
+           * database.  If it can't be enabled, for instance because
+           * the file system does not support shared memory, we just
+           * stay with the rollback journal.  */
+          sqlite3_exec (db, "pragma journal_mode=wal;", NULL, NULL, NULL);
         }
 
       if (db && initdb (db))
@@ -973,10 +1183,28 @@ opendbs (ctrl_t ctrl)
           db = NULL;
         }
 
+      /* Open a second connection for lookups.  This is only an
+       * optimization; thus we do not fail if that does not work.  */
+      if (db)
+        {
+          rc = sqlite3_open_v2 (filename, &rodb, SQLITE_OPEN_READONLY, NULL);
+          if (rc)
+            {
+              if (DBG_TRUST)
+                log_debug ("TOFU: error opening read-only connection: %s\n",
+                           sqlite3_errmsg (rodb));
+              sqlite3_close (rodb);
+              rodb = NULL;
+            }
+          else
+            sqlite3_busy_timeout (rodb, 5 * 1000);
+        }
+
       if (db)
         {
           ctrl->tofu.dbs = xmalloc_clear (sizeof *ctrl->tofu.dbs);
           ctrl->tofu.dbs->db = db;
+          ctrl->tofu.dbs->rodb = rodb;
           ctrl->tofu.dbs->want_lock_file = xasprintf ("%s-want-lock", filename);
         }
 
@@ -1002,6 +1230,7 @@ tofu_closedbs (ctrl_t ctrl)
 
   log_assert (dbs->in_transaction == 0);
 
+  flush_pending_sigs (ctrl);
   end_transaction (ctrl, 2);
 
   /* Arghh, that is a surprising use of the struct.  */
@@ -1010,7 +1239,9 @@ tofu_closedbs (ctrl_t ctrl)
        statements ++)
     sqlite3_finalize (*statements);
 
+  policy_cache_flush (dbs);
   sqlite3_close (dbs->db);
+  sqlite3_close (dbs->rodb);
   xfree (dbs->want_lock_file);
   xfree (dbs);
   ctrl->tofu.dbs = NULL;
@@ -1042,6 +1273,257 @@ get_single_long_cb2 (void *cookie, int argc, char **argv, char **azColName,
   return get_single_long_cb (cookie, argc, argv, azColName);
 }
 
+/* Return the bucket of the policy cache for the binding
+ * <FINGERPRINT, EMAIL>.  */
+static unsigned int
+policy_cache_hash (const char *fingerprint, const char *email)
+{
+  unsigned int h = 0;
+
+  for (; *fingerprint; fingerprint++)
+    h = (h << 5) + h + *(const unsigned char *)fingerprint;
+  for (; *email; email++)
+    h = (h << 5) + h + *(const unsigned char *)email;
+  return h % POLICY_CACHE_BUCKETS;
+}
+
+
+/* Remove all items from the policy cache of DBS.  */
+static void
+policy_cache_flush (tofu_dbs_t dbs)
+{
+  struct policy_cache_item *item, *next;
+  int i;
+
+  if (!dbs->policy_cache_count)
+    return;
+
+  for (i=0; i < POLICY_CACHE_BUCKETS; i++)
+    {
+      for (item = dbs->policy_cache[i]; item; item = next)
+        {
+          next = item->next;
+          xfree (item);
+        }
+      dbs->policy_cache[i] = NULL;
+    }
+  dbs->policy_cache_count = 0;
+}
+
+
+/* Return the data version of the database of DBS or -1 on error.  */
+static long
+get_data_version (tofu_dbs_t dbs)
+{
+  long version = -1;
+
+  if (gpgsql_stepx (dbs->db, &dbs->s.data_version,
+                    get_single_long_cb2, &version, NULL,
+                    "pragma data_version;", GPGSQL_ARG_END))
+    version = -1;
+  return version;
+}
+
+
+/* Flush the policy cache of DBS if another process changed the
+ * database since we last checked.  While we hold the batch
+ * transaction nobody else can write to the database and thus there is
+ * no need to check unless FORCE is set.  */
+static void
+policy_cache_validate (tofu_dbs_t dbs, int force)
+{
+  long version;
+
+  if (!dbs->policy_cache_count || (dbs->in_batch_transaction && !force))
+    return;
+
+  version = get_data_version (dbs);
+  if (version == -1 || version != dbs->data_version)
+    policy_cache_flush (dbs);
+}
+
+
+/* Look up the effective policy of the binding <FINGERPRINT, EMAIL>
+ * in the cache of DBS.  Returns _tofu_GET_POLICY_ERROR if it is not
+ * cached.  */
+static enum tofu_policy
+policy_cache_get (tofu_dbs_t dbs, const char *fingerprint, const char *email)
+{
+  struct policy_cache_item *item;
+
+  policy_cache_validate (dbs, 0);
+
+  item = dbs->policy_cache[policy_cache_hash (fingerprint, email)];
+  for (; item; item = item->next)
+    if (!strcmp (item->key, fingerprint) && !strcmp (item->email, email))
+      return item->policy;
+
+  return _tofu_GET_POLICY_ERROR;
+}
+
+
+/* Remove the binding <FINGERPRINT, EMAIL> from the cache of DBS.  */
+static void
+policy_cache_del (tofu_dbs_t dbs, const char *fingerprint, const char *email)
+{
+  struct policy_cache_item **itemp, *item;
+
+  itemp = &dbs->policy_cache[policy_cache_hash (fingerprint, email)];
+  for (; (item = *itemp); itemp = &item->next)
+    if (!strcmp (item->key, fingerprint) && !strcmp (item->email, email))
+      {
+        *itemp = item->next;
+        xfree (item);
+        dbs->policy_cache_count--;
+        return;
+      }
+}
+
+
+/* Store the effective policy POLICY of the binding <FINGERPRINT,
+ * EMAIL> in the cache of DBS.  */
+static void
+policy_cache_put (tofu_dbs_t dbs, const char *fingerprint, const char *email,
+                  enum tofu_policy policy)
+{
+  struct policy_cache_item *item;
+  size_t fprlen = strlen (fingerprint);
+  unsigned int h;
+
+  policy_cache_del (dbs, fingerprint, email);
+  if (dbs->policy_cache_count >= POLICY_CACHE_MAX_ITEMS)
+    policy_cache_flush (dbs);
+  if (!dbs->policy_cache_count)
+    {
+      dbs->data_version = get_data_version (dbs);
+      if (dbs->data_version == -1)
+        return;
+    }
+
+  item = xtrymalloc (sizeof *item + fprlen + 1 + strlen (email));
+  if (!item)
+    return;  /* Not cached - that is fine.  */
+  strcpy (item->key, fingerprint);
+  item->email = item->key + fprlen + 1;
+  strcpy (item->email, email);
+  item->policy = policy;
+
+  h = policy_cache_hash (fingerprint, email);
+  item->next = dbs->policy_cache[h];
+  dbs->policy_cache[h] = item;
+  dbs->policy_cache_count++;
+}
+
+
+/* Remember that the signature SIG_DIGEST issued at SIG_TIME has been
+ * seen at NOW for the binding <FINGERPRINT, EMAIL>.  The signature is
+ * written to the database by flush_pending_sigs.  */
+static gpg_error_t
+queue_pending_sig (tofu_dbs_t dbs, const char *fingerprint, const char *email,
+                   const char *sig_digest, const char *origin,
+                   time_t sig_time, time_t now)
+{
+  struct pending_sig *item;
+  size_t fprlen = strlen (fingerprint);
+  size_t emaillen = strlen (email);
+  size_t digestlen = strlen (sig_digest);
+
+  /* The same signature may be verified several times in a batch.  */
+  for (item = dbs->pending_sigs; item; item = item->next)
+    if (!strcmp (item->fingerprint, fingerprint)
+        && !strcmp (item->email, email)
+        && !strcmp (item->sig_digest, sig_digest)
+        && !strcmp (item->origin, origin))
+      return 0;
+
+  item = xtrymalloc (sizeof *item + fprlen + 1 + emaillen + 1
+                     + digestlen + 1 + strlen (origin));
+  if (!item)
+    return gpg_error_from_syserror ();
+  item->next = NULL;
+  item->sig_time = sig_time;
+  item->time = now;
+  strcpy (item->fingerprint, fingerprint);
+  item->email = item->fingerprint + fprlen + 1;
+  strcpy (item->email, email);
+  item->sig_digest = item->email + emaillen + 1;
+  strcpy (item->sig_digest, sig_digest);
+  item->origin = item->sig_digest + digestlen + 1;
+  strcpy (item->origin, origin);
+
+  if (dbs->pending_sigs_last)
+    dbs->pending_sigs_last->next = item;
+  else
+    dbs->pending_sigs = item;
+  dbs->pending_sigs_last = item;
+  dbs->pending_sigs_count++;
+
+  return 0;
+}
+
+
+/* Write all signatures queued by queue_pending_sig to the database
+ * using one transaction.  The write lock is released afterwards so
+ * that other processes can go ahead.  */
+static gpg_error_t
+flush_pending_sigs (ctrl_t ctrl)
+{
+  tofu_dbs_t dbs = ctrl->tofu.dbs;
+  struct pending_sig *item, *next;
+  gpg_error_t rc;
+  char *sqlerr = NULL;
+
+  if (!dbs || !dbs->pending_sigs)
+    return 0;
+
+  rc = begin_transaction (ctrl, 0);
+  for (item = dbs->pending_sigs; item && !rc; item = item->next)
+    {
+      /* Another process may have recorded the signature in the
+       * meantime.  */
+      rc = gpgsql_stepx
+        (dbs->db, &dbs->s.register_signature, NULL, NULL, &sqlerr,
+         "insert or ignore into signatures\n"
+         " (binding, sig_digest, origin, sig_time, time)\n"
+         " values\n"
+         " ((select oid from bindings\n"
+         "    where fingerprint = ? and email = ?),\n"
+         "  ?, ?, ?, ?);",
+         GPGSQL_ARG_STRING, item->fingerprint,
+         GPGSQL_ARG_STRING, item->email,
+         GPGSQL_ARG_STRING, item->sig_digest,
+         GPGSQL_ARG_STRING, item->origin,
+         GPGSQL_ARG_LONG_LONG, (long long) item->sig_time,
+         GPGSQL_ARG_LONG_LONG, (long long) item->time,
+         GPGSQL_ARG_END);
+      if (rc)
+        {
+          log_error (_("error updating TOFU database: %s\n"), sqlerr);
+          print_further_info ("insert signatures");
+          sqlite3_free (sqlerr);
+          sqlerr = NULL;
+          rc = gpg_error (GPG_ERR_GENERAL);
+          rollback_transaction (ctrl);
+        }
+    }
+  if (!rc)
+    rc = end_transaction (ctrl, 0);
+
+  for (item = dbs->pending_sigs; item; item = next)
+    {
+      next = item->next;
+      xfree (item);
+    }
+  dbs->pending_sigs = dbs->pending_sigs_last = NULL;
+  dbs->pending_sigs_count = 0;
+
+  if (!rc && !dbs->in_transaction)
+    rc = end_transaction (ctrl, 2);
+
+  return rc;
+}
+
+
 /* Record (or update) a trust policy about a (possibly new)
    binding.
 
@@ -1064,6 +1546,7 @@ record_binding (tofu_dbs_t dbs, const char *fingerprint, const char *email,
 	 || policy == TOFU_POLICY_ASK))
     log_bug ("%s: Bad value for policy (%d)!\n", __func__, policy);
 
+  policy_cache_del (dbs, fingerprint, email);
 
   if (DBG_TRUST || show_old)
     {
@@ -1643,8 +2126,9 @@ ask_about_binding (ctrl_t ctrl,
   strlist_rev (&conflict_set);
   for (iter = conflict_set; iter && ! rc; iter = iter->next)
     {
-#define STATS_SQL(table, time, sign)                         \
-         "select fingerprint, policy, time_ago, count(*)\n" \
+#define STATS_SQL(kind, sign)                                     \
+         "select fingerprint, policy, time_ago,\n" \
+         "  coalesce (sum (msgs), count (*))\n" \
          " from\n" \
          "  (select bindings.*,\n" \
          "     "sign" case\n" \
@@ -1663,12 +2147,12 @@ ask_about_binding (ctrl_t ctrl,
          "       then 5\n" \
          "      else 6\n" \
          "     end time_ago,\n" \
-         "    delta time_ago_raw\n" \
+         "    delta time_ago_raw, ss.count msgs\n" \
          "   from bindings\n" \
          "   left join\n" \
          "     (select *,\n" \
-         "        cast(? - " time " as real) delta\n" \
-         "       from " table ") ss\n" \
+         "        cast(? - last_time as real) delta\n" \
+         "       from stats where kind = " STRINGIFY (kind) ") ss\n" \
          "    on ss.binding = bindings.oid)\n" \
          " where email = ? and fingerprint = ?\n" \
          " group by time_ago\n" \
@@ -1676,11 +2160,13 @@ ask_about_binding (ctrl_t ctrl,
          " order by time_ago desc;\n"
 
       /* Use the time when we saw the signature, not when the
-         signature was created as that can be forged.  */
+         signature was created as that can be forged.  The messages
+         are taken from the stats table and thus all messages of a
+         day go into the bucket of the day's last message.  */
       rc = gpgsql_stepx
         (dbs->db, &dbs->s.get_trust_gather_signature_stats,
          signature_stats_collect_cb, &stats, &sqerr,
-         STATS_SQL ("signatures", "time", ""),
+         STATS_SQL (STATS_KIND_SIGNATURE, ""),
          GPGSQL_ARG_LONG_LONG, (long long) now,
          GPGSQL_ARG_STRING, email,
          GPGSQL_ARG_STRING, iter->d,
@@ -1698,7 +2184,7 @@ ask_about_binding (ctrl_t ctrl,
       rc = gpgsql_stepx
         (dbs->db, &dbs->s.get_trust_gather_encryption_stats,
          signature_stats_collect_cb, &stats, &sqerr,
-         STATS_SQL ("encryptions", "time", "-"),
+         STATS_SQL (STATS_KIND_ENCRYPTION, "-"),
          GPGSQL_ARG_LONG_LONG, (long long) now,
          GPGSQL_ARG_STRING, email,
          GPGSQL_ARG_STRING, iter->d,
@@ -2339,6 +2825,15 @@ get_policy (ctrl_t ctrl, tofu_dbs_t dbs, PKT_public_key *pk,
   strlist_t conflict_set = NULL;
   int conflict_set_count;
 
+  /* Bindings without a conflict are cached.  */
+  effective_policy = policy_cache_get (dbs, fingerprint, email);
+  if (effective_policy != _tofu_GET_POLICY_ERROR)
+    {
+      if (conflict_setp)
+        *conflict_setp = NULL;
+      return effective_policy;
+    }
+
   /* Check if the <FINGERPRINT, EMAIL> binding is known
      (TOFU_POLICY_NONE cannot appear in the DB.  Thus, if POLICY is
      still TOFU_POLICY_NONE after executing the query, then the
@@ -2618,6 +3113,10 @@ get_policy (ctrl_t ctrl, tofu_dbs_t dbs, PKT_public_key *pk,
                      " to %s\n"), tofu_policy_str (policy));
     }
 
+  if (effective_policy != _tofu_GET_POLICY_ERROR
+      && effective_policy != TOFU_POLICY_ASK)
+    policy_cache_put (dbs, fingerprint, email, effective_policy);
+
   /* If the caller wants the set of conflicts, return it.  */
   if (effective_policy == TOFU_POLICY_ASK && conflict_setp)
     {
@@ -2642,6 +3141,51 @@ get_policy (ctrl_t ctrl, tofu_dbs_t dbs, PKT_public_key *pk,
 }
 
 
+/* Return the effective policy of the binding <FINGERPRINT, EMAIL> if
+ * it can be determined without writing to the database.  That is the
+ * case for a known binding without a conflict, which is what we see
+ * almost always.  Otherwise _tofu_GET_POLICY_ERROR is returned and
+ * the caller needs to use get_policy in a transaction.  */
+static enum tofu_policy
+get_policy_readonly (tofu_dbs_t dbs, const char *fingerprint,
+                     const char *email)
+{
+  enum tofu_policy policy;
+  long along;
+
+  policy = policy_cache_get (dbs, fingerprint, email);
+  if (policy != _tofu_GET_POLICY_ERROR)
+    return policy;
+
+  /* The read-only connection does not see the changes of an open
+   * batch transaction.  */
+  if (!dbs->rodb || dbs->in_batch_transaction)
+    return _tofu_GET_POLICY_ERROR;
+
+  along = TOFU_POLICY_NONE;
+  if (gpgsql_stepx (dbs->rodb, &dbs->s.get_policy_readonly,
+                    get_single_long_cb2, &along, NULL,
+                    "select effective_policy from bindings\n"
+                    " where fingerprint = ? and email = ?\n"
+                    "  and effective_policy notnull\n"
+                    "  and (conflict isnull or conflict = '');",
+                    GPGSQL_ARG_STRING, fingerprint,
+                    GPGSQL_ARG_STRING, email,
+                    GPGSQL_ARG_END))
+    return _tofu_GET_POLICY_ERROR;
+
+  policy = along;
+  if (policy != TOFU_POLICY_AUTO
+      && policy != TOFU_POLICY_GOOD
+      && policy != TOFU_POLICY_UNKNOWN
+      && policy != TOFU_POLICY_BAD)
+    return _tofu_GET_POLICY_ERROR;
+
+  policy_cache_put (dbs, fingerprint, email, policy);
+  return policy;
+}
+
+
 /* Return the trust level (TRUST_NEVER, etc.) for the binding
  * <FINGERPRINT, EMAIL> (email is already normalized).  If no policy
  * is registered, returns TOFU_POLICY_NONE.  If an error occurs,
@@ -2693,13 +3237,19 @@ get_trust (ctrl_t ctrl, PKT_public_key *pk,
               && _tofu_GET_TRUST_ERROR != TRUST_FULLY
               && _tofu_GET_TRUST_ERROR != TRUST_ULTIMATE);
 
-  begin_transaction (ctrl, 0);
-  in_transaction = 1;
+  /* A known binding without a conflict does not need the write lock,
+   * which would serialize all processes using the database.  */
+  policy = get_policy_readonly (dbs, fingerprint, email);
+  if (policy == _tofu_GET_POLICY_ERROR)
+    {
+      begin_transaction (ctrl, 0);
+      in_transaction = 1;
 
-  /* We need to call get_policy even if the key is ultimately trusted
-   * to make sure the binding has been registered.  */
-  policy = get_policy (ctrl, dbs, pk, fingerprint, user_id, email,
-                       &conflict_set, now);
+      /* We need to call get_policy even if the key is ultimately
+       * trusted to make sure the binding has been registered.  */
+      policy = get_policy (ctrl, dbs, pk, fingerprint, user_id, email,
+                           &conflict_set, now);
+    }
 
   if (policy == TOFU_POLICY_ASK)
     /* The conflict set should always contain at least one element:
@@ -2783,8 +3333,15 @@ get_trust (ctrl_t ctrl, PKT_public_key *pk,
   if (may_ask)
     {
       /* We can't be in a normal transaction in ask_about_binding.  */
-      end_transaction (ctrl, 0);
-      in_transaction = 0;
+      if (in_transaction)
+        {
+          end_transaction (ctrl, 0);
+          in_transaction = 0;
+        }
+
+      /* The statistics shown to the user shall include the
+       * signatures seen in this batch.  */
+      flush_pending_sigs (ctrl);
 
       /* If we get here, we need to ask the user about the binding.  */
       ask_about_binding (ctrl,
@@ -2819,12 +3376,16 @@ get_trust (ctrl_t ctrl, PKT_public_key *pk,
     {
       /* We don't immediately set the effective policy to 'ask,
          because  */
-      rc = gpgsql_exec_printf
-        (dbs->db, NULL, NULL, &sqerr,
-         "update bindings set effective_policy = %d, conflict = %Q"
-         " where email = %Q and fingerprint = %Q and effective_policy != %d;",
-         TOFU_POLICY_NONE, fingerprint,
-         email, iter->d, TOFU_POLICY_ASK);
+      policy_cache_flush (dbs);
+      rc = gpgsql_stepx
+        (dbs->db, &dbs->s.set_conflict, NULL, NULL, &sqerr,
+         "update bindings set effective_policy = ?, conflict = ?"
+         " where email = ? and fingerprint = ? and effective_policy != ?;",
+         GPGSQL_ARG_INT, (int) TOFU_POLICY_NONE,
+         GPGSQL_ARG_STRING, fingerprint,
+         GPGSQL_ARG_STRING, email, GPGSQL_ARG_STRING, iter->d,
+         GPGSQL_ARG_INT, (int) TOFU_POLICY_ASK,
+         GPGSQL_ARG_END);
       if (rc)
         {
           log_error (_("error changing TOFU policy: %s\n"), sqerr);
@@ -3008,15 +3569,20 @@ show_statistics (tofu_dbs_t dbs,
 
   fingerprint_pp = format_hexfingerprint (fingerprint, NULL, 0);
 
-  /* Get the signature stats.  */
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
-     "select count (*), coalesce (min (signatures.time), 0),\n"
-     "  coalesce (max (signatures.time), 0)\n"
-     " from signatures\n"
-     " left join bindings on signatures.binding = bindings.oid\n"
-     " where fingerprint = %Q and email = %Q;",
-     fingerprint, email);
+  /* Get the signature stats.  The stats table has a row for each
+     day with messages; thus the number of rows is the number of
+     days.  */
+  rc = gpgsql_stepx
+    (dbs->db, &dbs->s.show_statistics_signatures,
+     strings_collect_cb2, &strlist, &err,
+     "select count (*), coalesce (sum (count), 0),\n"
+     "  coalesce (min (first_time), 0), coalesce (max (last_time), 0)\n"
+     " from stats\n"
+     " where kind = " STRINGIFY (STATS_KIND_SIGNATURE) "\n"
+     "  and binding = (select oid from bindings\n"
+     "                  where fingerprint = ? and email = ?);",
+     GPGSQL_ARG_STRING, fingerprint, GPGSQL_ARG_STRING, email,
+     GPGSQL_ARG_END);
   if (rc)
     {
       log_error (_("error reading TOFU database: %s\n"), err);
@@ -3025,23 +3591,6 @@ show_statistics (tofu_dbs_t dbs,
       rc = gpg_error (GPG_ERR_GENERAL);
       goto out;
     }
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
-     "select count (*) from\n"
-     "  (select round(signatures.time / (24 * 60 * 60)) day\n"
-     "    from signatures\n"
-     "    left join bindings on signatures.binding = bindings.oid\n"
-     "    where fingerprint = %Q and email = %Q\n"
-     "    group by day);",
-     fingerprint, email);
-  if (rc)
-    {
-      log_error (_("error reading TOFU database: %s\n"), err);
-      print_further_info ("getting signature statistics (by day)");
-      sqlite3_free (err);
-      rc = gpg_error (GPG_ERR_GENERAL);
-      goto out;
-    }
 
   if (strlist)
     {
@@ -3062,15 +3611,38 @@ show_statistics (tofu_dbs_t dbs,
       strlist = NULL;
     }
 
+  /* Add the signatures not yet written to the database.  They are
+   * newer than those in the database and ordered by time.  */
+  {
+    struct pending_sig *item;
+    unsigned long day = signature_most_recent / (24 * 60 * 60);
+
+    for (item = dbs->pending_sigs; item; item = item->next)
+      if (!strcmp (item->fingerprint, fingerprint)
+          && !strcmp (item->email, email))
+        {
+          if (!signature_count || item->time / (24 * 60 * 60) != day)
+            signature_days++;
+          day = item->time / (24 * 60 * 60);
+          if (!signature_count)
+            signature_first_seen = item->time;
+          signature_most_recent = item->time;
+          signature_count++;
+        }
+  }
+
   /* Get the encryption stats.  */
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
-     "select count (*), coalesce (min (encryptions.time), 0),\n"
-     "  coalesce (max (encryptions.time), 0)\n"
-     " from encryptions\n"
-     " left join bindings on encryptions.binding = bindings.oid\n"
-     " where fingerprint = %Q and email = %Q;",
-     fingerprint, email);
+  rc = gpgsql_stepx
+    (dbs->db, &dbs->s.show_statistics_encryptions,
+     strings_collect_cb2, &strlist, &err,
+     "select count (*), coalesce (sum (count), 0),\n"
+     "  coalesce (min (first_time), 0), coalesce (max (last_time), 0)\n"
+     " from stats\n"
+     " where kind = " STRINGIFY (STATS_KIND_ENCRYPTION) "\n"
+     "  and binding = (select oid from bindings\n"
+     "                  where fingerprint = ? and email = ?);",
+     GPGSQL_ARG_STRING, fingerprint, GPGSQL_ARG_STRING, email,
+     GPGSQL_ARG_END);
   if (rc)
     {
       log_error (_("error reading TOFU database: %s\n"), err);
@@ -3079,23 +3651,6 @@ show_statistics (tofu_dbs_t dbs,
       rc = gpg_error (GPG_ERR_GENERAL);
       goto out;
     }
-  rc = gpgsql_exec_printf
-    (dbs->db, strings_collect_cb, &strlist, &err,
-     "select count (*) from\n"
-     "  (select round(encryptions.time / (24 * 60 * 60)) day\n"
-     "    from encryptions\n"
-     "    left join bindings on encryptions.binding = bindings.oid\n"
-     "    where fingerprint = %Q and email = %Q\n"
-     "    group by day);",
-     fingerprint, email);
-  if (rc)
-    {
-      log_error (_("error reading TOFU database: %s\n"), err);
-      print_further_info ("getting encryption statistics (by day)");
-      sqlite3_free (err);
-      rc = gpg_error (GPG_ERR_GENERAL);
-      goto out;
-    }
 
   if (strlist)
     {
@@ -3322,6 +3877,9 @@ email_from_user_id (const char *user_id)
    This is necessary if there is a conflict or the binding's policy is
    TOFU_POLICY_ASK.
 
+   In batch mode the signature is only written to the database when
+   the batch ends or enough signatures have been collected.
+
    This function returns 0 on success and an error code if an error
    occurred.  */
 gpg_error_t
@@ -3331,7 +3889,7 @@ tofu_register_signature (ctrl_t ctrl,
                          time_t sig_time, const char *origin)
 {
   time_t now = gnupg_get_time ();
-  gpg_error_t rc;
+  gpg_error_t rc = 0;
   tofu_dbs_t dbs;
   char *fingerprint = NULL;
   strlist_t user_id;
@@ -3349,12 +3907,6 @@ tofu_register_signature (ctrl_t ctrl,
       return rc;
     }
 
-  /* We do a query and then an insert.  Make sure they are atomic
-     by wrapping them in a transaction.  */
-  rc = begin_transaction (ctrl, 0);
-  if (rc)
-    return rc;
-
   log_assert (pk_is_primary (pk));
 
   sig_digest = make_radix64_string (sig_digest_bin, sig_digest_bin_len);
@@ -3448,26 +4000,8 @@ tofu_register_signature (ctrl_t ctrl,
 
           log_assert (c == 0);
 
-          rc = gpgsql_stepx
-            (dbs->db, &dbs->s.register_signature, NULL, NULL, &sqlerr,
-             "insert into signatures\n"
-             " (binding, sig_digest, origin, sig_time, time)\n"
-             " values\n"
-             " ((select oid from bindings\n"
-             "    where fingerprint = ? and email = ?),\n"
-             "  ?, ?, ?, ?);",
-             GPGSQL_ARG_STRING, fingerprint, GPGSQL_ARG_STRING, email,
-             GPGSQL_ARG_STRING, sig_digest, GPGSQL_ARG_STRING, origin,
-             GPGSQL_ARG_LONG_LONG, (long long) sig_time,
-             GPGSQL_ARG_LONG_LONG, (long long) now,
-             GPGSQL_ARG_END);
-          if (rc)
-            {
-              log_error (_("error updating TOFU database: %s\n"), sqlerr);
-              print_further_info ("insert signatures");
-              sqlite3_free (sqlerr);
-              rc = gpg_error (GPG_ERR_GENERAL);
-            }
+          rc = queue_pending_sig (dbs, fingerprint, email, sig_digest, origin,
+                                  sig_time, now);
         }
 
       xfree (email);
@@ -3476,12 +4010,11 @@ tofu_register_signature (ctrl_t ctrl,
         break;
     }
 
- leave:
-  if (rc)
-    rollback_transaction (ctrl);
-  else
-    rc = end_transaction (ctrl, 0);
+  if (!rc && (!ctrl->tofu.batch_updated_wanted
+              || dbs->pending_sigs_count >= TOFU_MAX_PENDING_SIGS))
+    rc = flush_pending_sigs (ctrl);
 
+ leave:
   xfree (fingerprint);
   xfree (sig_digest);
 
@@ -3775,9 +4308,9 @@ tofu_get_validity (ctrl_t ctrl, PKT_public_key *pk, strlist_t user_id_list,
   if (!fingerprint)
     log_fatal ("%s: malloc failed\n", __func__);
 
+  /* Note that we do not start the batch transaction here: in the
+   * common case get_trust only reads from the database.  */
   tofu_begin_batch_update (ctrl);
-  /* Start the batch transaction now.  */
-  tofu_resume_batch_transaction (ctrl);
 
   for (user_id = user_id_list; user_id; user_id = user_id->next, bindings ++)
     {
@@ -4031,7 +4564,10 @@ tofu_notice_key_changed (ctrl_t ctrl, kbnode_t kb)
   if (!fingerprint)
     return gpg_error_from_syserror ();
 
-  rc = gpgsql_stepx (dbs->db, NULL, NULL, NULL, &sqlerr,
+  /* The policies of all bindings of the key need to be recomputed.  */
+  policy_cache_flush (dbs);
+  rc = gpgsql_stepx (dbs->db, &dbs->s.notice_key_changed,
+                     NULL, NULL, &sqlerr,
                      "update bindings set effective_policy = ?"
                      " where fingerprint = ?;",
                      GPGSQL_ARG_INT, (int) TOFU_POLICY_NONE,
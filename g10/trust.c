@@ -304,6 +304,28 @@ revalidation_mark (ctrl_t ctrl)
 }
 
 
+void
+revalidation_mark_key (ctrl_t ctrl, PKT_public_key *pk)
+{
+#ifndef NO_TRUST_MODELS
+  tdb_revalidation_mark_key (ctrl, pk);
+#endif
+}
+
+
+/* Return a counter which changes whenever this process modified the
+ * trustdb.  */
+unsigned int
+trust_get_generation (void)
+{
+#ifndef NO_TRUST_MODELS
+  return tdb_get_generation ();
+#else
+  return 0;
+#endif
+}
+
+
 void
 check_trustdb_stale (ctrl_t ctrl)
 {
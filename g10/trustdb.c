@@ -72,7 +72,48 @@ static struct key_item *utk_list;      /* all ultimately trusted keys */
 
 static int pending_check_trustdb;
 
+/* The keys whose keyblocks changed since the trustdb was checked.
+ * See tdb_revalidation_mark_key.  */
+struct changed_key
+{
+  struct changed_key *next;
+  size_t fprlen;
+  byte fpr[MAX_FINGERPRINT_LEN];
+};
+static struct changed_key *changed_keys;
+
+/* Set if a full validation is required regardless of CHANGED_KEYS.  */
+static int need_full_validation;
+
+/* The scheduled check of the trustdb before the first key was
+ * marked as changed.  */
+static ulong changed_keys_nextcheck;
+
+/* The validity records of the last key looked up by
+ * tdb_get_validity_core.  Listing a key asks for the validity of the
+ * key and then for each of its user ids; with this cache the trust
+ * record and its list of validity records are read only once per
+ * key.  Any change of the trustdb invalidates the cache.  */
+struct validity_cache_uid
+{
+  byte namehash[20];
+  byte validity;
+};
+static struct
+{
+  int valid;               /* The fields below are valid.  */
+  unsigned int generation; /* The tdbio generation they belong to.  */
+  size_t fprlen;           /* The fingerprint of the key.  */
+  byte fpr[MAX_FINGERPRINT_LEN];
+  int found;               /* The key has a trust record.  */
+  byte ownertrust;         /* The ownertrust from the trust record.  */
+  unsigned int nuids;      /* Number of used items in UIDS.  */
+  unsigned int uidssize;   /* Allocated number of items in UIDS.  */
+  struct validity_cache_uid *uids;
+} validity_cache;
+
 static int validate_keys (ctrl_t ctrl, int interactive);
+static int validate_changed_keys (ctrl_t ctrl);
 
 
 /**********************************************
@@ -101,6 +142,18 @@ release_key_items (struct key_item *k)
     }
 }
 
+static void
+release_changed_keys (void)
+{
+  struct changed_key *ck;
+
+  while ((ck = changed_keys))
+    {
+      changed_keys = ck->next;
+      xfree (ck);
+    }
+}
+
 #define KEY_HASH_TABLE_SIZE 1024
 
 /*
@@ -387,6 +440,34 @@ do_sync(void)
       }
 }
 
+/*
+ * Start a trustdb transaction and die on error
+ */
+static void
+begin_transaction (void)
+{
+  int rc = tdbio_begin_transaction ();
+  if (rc)
+    {
+      log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc));
+      g10_exit (2);
+    }
+}
+
+/*
+ * Commit a trustdb transaction and die on error
+ */
+static void
+end_transaction (void)
+{
+  int rc = tdbio_end_transaction ();
+  if (rc)
+    {
+      log_error (_("trustdb: sync failed: %s\n"), gpg_strerror (rc));
+      g10_exit (2);
+    }
+}
+
 const char *
 trust_model_string (int model)
 {
@@ -553,7 +634,8 @@ check_trustdb (ctrl_t ctrl)
 	    }
 	}
 
-      validate_keys (ctrl, 0);
+      if (validate_changed_keys (ctrl))
+        validate_keys (ctrl, 0);
     }
   else
     log_info (_("no need for a trustdb check with '%s' trust model\n"),
@@ -583,6 +665,9 @@ tdb_revalidation_mark (ctrl_t ctrl)
   if (trustdb_args.no_trustdb && opt.trust_model == TM_ALWAYS)
     return;
 
+  need_full_validation = 1;
+  release_changed_keys ();
+
   /* We simply set the time for the next check to 1 (far back in 1970)
      so that a --update-trustdb will be scheduled.  */
   if (tdbio_write_nextcheck (ctrl, 1))
@@ -590,12 +675,75 @@ tdb_revalidation_mark (ctrl_t ctrl)
   pending_check_trustdb = 1;
 }
 
+
+/* This is a variant of tdb_revalidation_mark for the case that only
+ * the keyblock of the primary key PK has changed, for example due to
+ * new certifications.  The key is remembered so that check_trustdb
+ * may be able to update the validity of just this key instead of
+ * running a full validation.  */
+void
+tdb_revalidation_mark_key (ctrl_t ctrl, PKT_public_key *pk)
+{
+  struct changed_key *ck;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+
+  init_trustdb (ctrl, 0);
+  if (trustdb_args.no_trustdb && opt.trust_model == TM_ALWAYS)
+    return;
+
+  if (!pending_check_trustdb)
+    {
+      /* A check still pending from another process or a trustdb
+       * last validated by an older version of gpg requires a full
+       * validation.  */
+      changed_keys_nextcheck = tdbio_read_nextcheck ();
+      if (changed_keys_nextcheck == 1
+          || !(tdbio_read_verflags () & TDB_VERFLAG_DEPTH))
+        need_full_validation = 1;
+    }
+  else if (!changed_keys)
+    need_full_validation = 1;  /* Pending for another reason.  */
+
+  fingerprint_from_pk (pk, fpr, &fprlen);
+  if (fprlen != 20 && fprlen != 16)
+    need_full_validation = 1;
+
+  if (!need_full_validation)
+    {
+      for (ck = changed_keys; ck; ck = ck->next)
+        if (ck->fprlen == fprlen && !memcmp (ck->fpr, fpr, fprlen))
+          break;
+      if (!ck)
+        {
+          ck = xmalloc (sizeof *ck);
+          ck->fprlen = fprlen;
+          memcpy (ck->fpr, fpr, fprlen);
+          ck->next = changed_keys;
+          changed_keys = ck;
+        }
+    }
+
+  if (tdbio_write_nextcheck (ctrl, 1))
+    do_sync ();
+  pending_check_trustdb = 1;
+}
+
 int
 trustdb_pending_check(void)
 {
   return pending_check_trustdb;
 }
 
+
+/* Return a counter which changes whenever the trustdb is modified.  */
+unsigned int
+tdb_get_generation (void)
+{
+  return tdbio_get_generation ();
+}
+
+
 /* If the trustdb is dirty, and we're interactive, update it.
    Otherwise, check it unless no-auto-check-trustdb is set. */
 void
@@ -887,7 +1035,8 @@ tdb_clear_ownertrusts (ctrl_t ctrl, PKT_public_key *pk)
 }
 
 /*
- * Note: Caller has to do a sync
+ * Note: Caller has to do a sync.  A negative DEPTH keeps the depth
+ * stored in the trust record.
  */
 static void
 update_validity (ctrl_t ctrl, PKT_public_key *pk, PKT_user_id *uid,
@@ -940,7 +1089,8 @@ update_validity (ctrl_t ctrl, PKT_public_key *pk, PKT_user_id *uid,
   vrec.r.valid.full_count = uid->help_full_count;
   vrec.r.valid.marginal_count = uid->help_marginal_count;
   write_record (ctrl, &vrec);
-  trec.r.trust.depth = depth;
+  if (depth >= 0)
+    trec.r.trust.depth = depth;
   write_record (ctrl, &trec);
 }
 
@@ -1022,12 +1172,69 @@ tdb_check_trustdb_stale (ctrl_t ctrl)
             {
               if (!opt.quiet)
                 log_info (_("checking the trustdb\n"));
-              validate_keys (ctrl, 0);
+              if (validate_changed_keys (ctrl))
+                validate_keys (ctrl, 0);
             }
         }
     }
 }
 
+/* Load the trust record and the validity records of MAIN_PK into
+ * VALIDITY_CACHE unless they are already there.  Returns 0 on
+ * success; if the key has no trust record VALIDITY_CACHE.FOUND is
+ * false.  */
+static gpg_error_t
+load_validity_cache (ctrl_t ctrl, PKT_public_key *main_pk)
+{
+  gpg_error_t err;
+  TRUSTREC trec, vrec;
+  ulong recno;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+
+  fingerprint_from_pk (main_pk, fpr, &fprlen);
+  if (validity_cache.valid
+      && validity_cache.generation == tdbio_get_generation ()
+      && validity_cache.fprlen == fprlen
+      && !memcmp (validity_cache.fpr, fpr, fprlen))
+    return 0;
+
+  validity_cache.valid = 0;
+  validity_cache.nuids = 0;
+  err = read_trust_record (ctrl, main_pk, &trec);
+  if (err && gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+    return err;
+
+  validity_cache.found = !err;
+  if (validity_cache.found)
+    {
+      validity_cache.ownertrust = trec.r.trust.ownertrust;
+      for (recno = trec.r.trust.validlist; recno; recno = vrec.r.valid.next)
+        {
+          read_record (recno, &vrec, RECTYPE_VALID);
+          if (validity_cache.nuids == validity_cache.uidssize)
+            {
+              validity_cache.uidssize += 16;
+              validity_cache.uids = xrealloc (validity_cache.uids,
+                                              (validity_cache.uidssize
+                                               * sizeof *validity_cache.uids));
+            }
+          memcpy (validity_cache.uids[validity_cache.nuids].namehash,
+                  vrec.r.valid.namehash, 20);
+          validity_cache.uids[validity_cache.nuids].validity
+            = vrec.r.valid.validity;
+          validity_cache.nuids++;
+        }
+    }
+
+  validity_cache.fprlen = fprlen;
+  memcpy (validity_cache.fpr, fpr, fprlen);
+  validity_cache.generation = tdbio_get_generation ();
+  validity_cache.valid = 1;
+  return 0;
+}
+
+
 /*
  * Return the validity information for KB/PK (at least one of them
  * must be non-NULL).  This is the core of get_validity.  If SIG is
@@ -1043,9 +1250,8 @@ tdb_get_validity_core (ctrl_t ctrl,
 		       PKT_signature *sig,
 		       int may_ask)
 {
-  TRUSTREC trec, vrec;
   gpg_error_t err = 0;
-  ulong recno;
+  unsigned int i;
 #ifdef USE_TOFU
   unsigned int tofu_validity = TRUST_UNKNOWN;
   int free_kb = 0;
@@ -1206,13 +1412,13 @@ tdb_get_validity_core (ctrl_t ctrl,
       || opt.trust_model == TM_CLASSIC
       || opt.trust_model == TM_PGP)
     {
-      err = read_trust_record (ctrl, main_pk, &trec);
-      if (err && gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+      err = load_validity_cache (ctrl, main_pk);
+      if (err)
 	{
 	  tdbio_invalid ();
 	  return 0;
 	}
-      if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+      if (!validity_cache.found)
 	{
 	  /* No record found.  */
 	  validity = TRUST_UNKNOWN;
@@ -1220,21 +1426,18 @@ tdb_get_validity_core (ctrl_t ctrl,
 	}
 
       /* Loop over all user IDs */
-      recno = trec.r.trust.validlist;
       validity = 0;
-      while (recno)
+      for (i=0; i < validity_cache.nuids; i++)
 	{
-	  read_record (recno, &vrec, RECTYPE_VALID);
-
 	  if(uid)
 	    {
 	      /* If a user ID is given we return the validity for that
 		 user ID ONLY.  If the namehash is not found, then
 		 there is no validity at all (i.e. the user ID wasn't
 		 signed). */
-	      if(memcmp(vrec.r.valid.namehash,uid->namehash,20)==0)
+	      if (!memcmp (validity_cache.uids[i].namehash, uid->namehash, 20))
 		{
-		  validity=(vrec.r.valid.validity & TRUST_MASK);
+		  validity = (validity_cache.uids[i].validity & TRUST_MASK);
 		  break;
 		}
 	    }
@@ -1242,14 +1445,12 @@ tdb_get_validity_core (ctrl_t ctrl,
 	    {
 	      /* If no user ID is given, we take the maximum validity
 		 over all user IDs */
-	      if (validity < (vrec.r.valid.validity & TRUST_MASK))
-		validity = (vrec.r.valid.validity & TRUST_MASK);
+	      if (validity < (validity_cache.uids[i].validity & TRUST_MASK))
+		validity = (validity_cache.uids[i].validity & TRUST_MASK);
 	    }
-
-	  recno = vrec.r.valid.next;
 	}
 
-      if ((trec.r.trust.ownertrust & TRUST_FLAG_DISABLED))
+      if ((validity_cache.ownertrust & TRUST_FLAG_DISABLED))
 	{
 	  validity |= TRUST_FLAG_DISABLED;
 	  pk->flags.disabled = 1;
@@ -1801,6 +2002,64 @@ search_skipfnc (void *opaque, u32 *kid, int dummy_uid_no)
 }
 
 
+/* The number of keyblocks whose certifications are checked at once
+ * by validate_key_list if --sig-check-threads is used.  */
+#define VALIDATE_BATCH_SIZE 128
+
+/*
+ * Helper for validate_key_list to validate the NBATCH keyblocks at
+ * BATCH.  Keyblocks which carry a signature from KLIST are moved to
+ * KEYS; all others are released.
+ */
+static void
+validate_key_batch (ctrl_t ctrl, kbnode_t *batch, int nbatch,
+                    KeyHashTable full_trust, struct key_item *klist,
+                    u32 curtime, u32 *next_expire,
+                    struct key_array **keys, size_t *nkeys, size_t *maxkeys)
+{
+  KBNODE keyblock, node;
+  PKT_public_key *pk;
+  int i;
+
+  /* Verify the certifications of all keyblocks in parallel so that
+   * validate_one_keyblock finds the results in the cache.  */
+  if (nbatch > 1)
+    check_uid_certs_parallel (ctrl, batch, nbatch, klist);
+
+  for (i=0; i < nbatch; i++)
+    {
+      keyblock = batch[i];
+      batch[i] = NULL;
+      pk = keyblock->pkt->pkt.public_key;
+      if (validate_one_keyblock (ctrl, keyblock, klist,
+                                 curtime, next_expire))
+        {
+          if (pk->expiredate && pk->expiredate >= curtime
+              && pk->expiredate < *next_expire)
+            *next_expire = pk->expiredate;
+
+          if (*nkeys == *maxkeys) {
+            *maxkeys += 1000;
+            *keys = xrealloc (*keys, (*maxkeys+1) * sizeof **keys);
+          }
+          (*keys)[(*nkeys)++].keyblock = keyblock;
+
+	  /* Optimization - if all uids are fully trusted, then we
+	     never need to consider this key as a candidate again. */
+
+	  for (node=keyblock; node; node = node->next)
+	    if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
+	      break;
+
+	  if(node==NULL)
+	    mark_keyblock_seen (full_trust, keyblock);
+        }
+      else
+        release_kbnode (keyblock);
+    }
+}
+
+
 /*
  * Scan all keys and return a key_array of all suitable keys from
  * kllist.  The caller has to pass keydb handle so that we don't use
@@ -1817,7 +2076,11 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
   size_t nkeys, maxkeys;
   int rc;
   KEYDB_SEARCH_DESC desc;
+  kbnode_t batch[VALIDATE_BATCH_SIZE];
+  int nbatch = 0;
+  int batchsize;
 
+  batchsize = opt.sig_check_threads > 1? VALIDATE_BATCH_SIZE : 1;
   maxkeys = 1000;
   keys = xmalloc ((maxkeys+1) * sizeof *keys);
   nkeys = 0;
@@ -1876,32 +2139,17 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
           /* it does not make sense to look further at those keys */
           mark_keyblock_seen (full_trust, keyblock);
         }
-      else if (validate_one_keyblock (ctrl, keyblock, klist,
-                                      curtime, next_expire))
+      else
         {
-	  KBNODE node;
-
-          if (pk->expiredate && pk->expiredate >= curtime
-              && pk->expiredate < *next_expire)
-            *next_expire = pk->expiredate;
-
-          if (nkeys == maxkeys) {
-            maxkeys += 1000;
-            keys = xrealloc (keys, (maxkeys+1) * sizeof *keys);
-          }
-          keys[nkeys++].keyblock = keyblock;
-
-	  /* Optimization - if all uids are fully trusted, then we
-	     never need to consider this key as a candidate again. */
-
-	  for (node=keyblock; node; node = node->next)
-	    if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
-	      break;
-
-	  if(node==NULL)
-	    mark_keyblock_seen (full_trust, keyblock);
-
+          batch[nbatch++] = keyblock;
           keyblock = NULL;
+          if (nbatch == batchsize)
+            {
+              validate_key_batch (ctrl, batch, nbatch, full_trust, klist,
+                                  curtime, next_expire,
+                                  &keys, &nkeys, &maxkeys);
+              nbatch = 0;
+            }
         }
 
       release_kbnode (keyblock);
@@ -1915,10 +2163,14 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
       goto die;
     }
 
+  validate_key_batch (ctrl, batch, nbatch, full_trust, klist,
+                      curtime, next_expire, &keys, &nkeys, &maxkeys);
   keys[nkeys].keyblock = NULL;
   return keys;
 
  die:
+  while (nbatch)
+    release_kbnode (batch[--nbatch]);
   keys[nkeys].keyblock = NULL;
   release_key_array (keys);
   return NULL;
@@ -2019,6 +2271,9 @@ validate_keys (ctrl_t ctrl, int interactive)
   if (!kdb)
     return gpg_error_from_syserror ();
 
+  /* Write all changed records at once at the end.  */
+  begin_transaction ();
+
   start_time = make_timestamp ();
   next_expire = 0xffffffff; /* set next expire to the year 2106 */
   stored = new_key_hash_table ();
@@ -2160,8 +2415,17 @@ validate_keys (ctrl_t ctrl, int interactive)
       if (opt.verbose > 1 && DBG_TRUST)
         dump_key_array (depth, keys);
 
+      /* The stored depth is the depth at which a key became fully
+       * valid; validate_changed_keys relies on this.  */
       for (kar=keys; kar->keyblock; kar++)
-        store_validation_status (ctrl, depth, kar->keyblock, stored);
+        {
+          u32 kid[2];
+
+          keyid_from_pk (kar->keyblock->pkt->pkt.public_key, kid);
+          store_validation_status (ctrl,
+                                   test_key_hash_table (used, kid)? -1 : depth,
+                                   kar->keyblock, stored);
+        }
 
       if (!opt.quiet)
         log_info (_("depth: %d  valid: %3d  signed: %3d"
@@ -2252,7 +2516,364 @@ validate_keys (ctrl_t ctrl, int interactive)
 
       do_sync ();
       pending_check_trustdb = 0;
+      need_full_validation = 0;
+      release_changed_keys ();
+    }
+
+  end_transaction ();
+  return rc;
+}
+
+
+/* An item of the list of introducers used by validate_changed_keys.  */
+struct introducer
+{
+  struct key_item ki;  /* ki.next is used to build the klist.  */
+  int depth;           /* Depth of the klist containing the key or -1.  */
+};
+
+
+/* Return true if the keyblock of the key KID carries trust
+ * signatures.  */
+static int
+keyblock_has_trust_sigs (ctrl_t ctrl, u32 *kid)
+{
+  kbnode_t keyblock, node;
+  int any = 0;
+
+  keyblock = get_pubkeyblock (ctrl, kid);
+  for (node = keyblock; node && !any; node = node->next)
+    if (node->pkt->pkttype == PKT_SIGNATURE
+        && node->pkt->pkt.signature->trust_depth)
+      any = 1;
+  release_kbnode (keyblock);
+  return any;
+}
+
+
+/* Collect all keys which certified a user id of KEYBLOCK with the
+ * primary key MAIN_KID.  For each key the depth of the klist used by
+ * validate_keys which contained that key is derived from the
+ * trustdb; keys which were not used as introducers get a depth of
+ * -1.  Returns 0 on success or -1 if this information can't be
+ * derived.  */
+static int
+collect_introducers (ctrl_t ctrl, kbnode_t keyblock, u32 *main_kid,
+                     struct introducer **r_list, size_t *r_count)
+{
+  struct introducer *list = NULL;
+  size_t count = 0, size = 0, i;
+  kbnode_t node;
+  PKT_signature *sig;
+  PKT_public_key *spk;
+  TRUSTREC trec, vrec;
+  ulong recno;
+  unsigned int validity;
+  gpg_error_t err;
+  int rc = 0;
+
+  for (node = keyblock; node && !rc; node = node->next)
+    {
+      if (node->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      sig = node->pkt->pkt.signature;
+      if (!IS_UID_SIG (sig) && !IS_UID_REV (sig))
+        continue;
+      if (sig->keyid[0] == main_kid[0] && sig->keyid[1] == main_kid[1])
+        continue;
+      for (i=0; i < count; i++)
+        if (list[i].ki.kid[0] == sig->keyid[0]
+            && list[i].ki.kid[1] == sig->keyid[1])
+          break;
+      if (i < count)
+        continue;
+
+      if (count == size)
+        {
+          size += 32;
+          list = xrealloc (list, size * sizeof *list);
+        }
+      memset (&list[count], 0, sizeof *list);
+      list[count].ki.kid[0] = sig->keyid[0];
+      list[count].ki.kid[1] = sig->keyid[1];
+      list[count].depth = -1;
+
+      if (tdb_keyid_is_utk (sig->keyid))
+        {
+          /* The UTKs are the klist of depth 0.  */
+          list[count].ki.ownertrust = TRUST_ULTIMATE;
+          list[count].depth = 0;
+          count++;
+          continue;
+        }
+
+      spk = xmalloc_clear (sizeof *spk);
+      if (get_pubkey (ctrl, spk, sig->keyid))
+        ; /* Not in the keyring and thus not an introducer.  */
+      else if (!pk_is_primary (spk))
+        ; /* A subkey is never an introducer.  */
+      else if ((err = read_trust_record (ctrl, spk, &trec)))
+        {
+          if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+            rc = -1;
+        }
+      else
+        {
+          validity = 0;
+          for (recno = trec.r.trust.validlist; recno;
+               recno = vrec.r.valid.next)
+            {
+              read_record (recno, &vrec, RECTYPE_VALID);
+              if ((vrec.r.valid.validity & TRUST_MASK) > validity)
+                validity = vrec.r.valid.validity & TRUST_MASK;
+            }
+
+          /* A fully valid key becomes an introducer at the next
+           * depth.  Ultimate validity of a not ultimately trusted
+           * key and keys which may be part of trust signature chains
+           * are not handled here.  */
+          if (validity == TRUST_ULTIMATE || trec.r.trust.min_ownertrust)
+            rc = -1;
+          else if (validity == TRUST_FULLY
+                   && trec.r.trust.depth + 1 < opt.max_cert_depth)
+            {
+              if ((opt.trust_model == TM_PGP
+                   || opt.trust_model == TM_TOFU_PGP)
+                  && keyblock_has_trust_sigs (ctrl, sig->keyid))
+                rc = -1;
+              list[count].ki.ownertrust = (trec.r.trust.ownertrust
+                                           & TRUST_MASK);
+              list[count].depth = trec.r.trust.depth + 1;
+            }
+        }
+      free_public_key (spk);
+      count++;
+    }
+
+  if (rc)
+    {
+      xfree (list);
+      list = NULL;
+      count = 0;
     }
+  *r_list = list;
+  *r_count = count;
+  return rc;
+}
+
+
+/*
+ * Update the validity of the keys marked by tdb_revalidation_mark_key
+ * without running a full validation.  This is only possible for keys
+ * whose validity can't affect the validity of other keys; i.e. for
+ * keys with an ownertrust below marginal which are not parts of
+ * trust signature chains.  For such a key the validation done by
+ * validate_keys is replayed using only the keys which certified it:
+ * their depth in the web of trust is taken from the trust records
+ * which store the depth at which a key became fully valid.
+ *
+ * Returns: 0 on success or -1 if a full validation is required.
+ */
+static int
+validate_changed_keys (ctrl_t ctrl)
+{
+  struct changed_key *ck;
+  KEYDB_HANDLE kdb;
+  KEYDB_SEARCH_DESC desc;
+  KeyHashTable stored;
+  kbnode_t keyblock = NULL;
+  kbnode_t node;
+  PKT_public_key *pk;
+  struct introducer *intro = NULL;
+  size_t nintro = 0, i;
+  struct key_item *klist;
+  TRUSTREC trec, vrec;
+  ulong recno, nextcheck;
+  u32 kid[2], start_time, next_expire;
+  gpg_error_t err;
+  int depth, used, full, all;
+  int pgp = (opt.trust_model == TM_PGP || opt.trust_model == TM_TOFU_PGP);
+  int count = 0;
+  int rc = -1;
+
+  if (need_full_validation || !changed_keys || !utk_list
+      || !(pgp || opt.trust_model == TM_CLASSIC)
+      || !tdbio_db_matches_options ())
+    return -1;
 
+  start_time = make_timestamp ();
+  next_expire = 0xffffffff;
+  if (changed_keys_nextcheck && changed_keys_nextcheck <= start_time)
+    return -1;  /* A check was due anyway.  */
+
+  kdb = keydb_new ();
+  if (!kdb)
+    return -1;
+  stored = new_key_hash_table ();
+  begin_transaction ();
+
+  for (ck = changed_keys; ck; ck = ck->next)
+    {
+      memset (&desc, 0, sizeof desc);
+      desc.mode = ck->fprlen == 16? KEYDB_SEARCH_MODE_FPR16
+                                  : KEYDB_SEARCH_MODE_FPR20;
+      memcpy (desc.u.fpr, ck->fpr, ck->fprlen);
+      if (keydb_search_reset (kdb)
+          || keydb_search (kdb, &desc, 1, NULL)
+          || keydb_get_keyblock (kdb, &keyblock))
+        goto leave;
+      if (keyblock->pkt->pkttype != PKT_PUBLIC_KEY)
+        goto leave;
+
+      merge_keys_and_selfsig (ctrl, keyblock);
+      pk = keyblock->pkt->pkt.public_key;
+      keyid_from_pk (pk, kid);
+      if (tdb_keyid_is_utk (kid))
+        goto leave;
+
+      /* Make sure that the key is not an introducer and reset its
+       * validity the same way reset_trust_records does.  With the
+       * PGP model a key which was fully valid may have passed on a
+       * trust signature.  */
+      err = read_trust_record (ctrl, pk, &trec);
+      if (!err)
+        {
+          if ((trec.r.trust.ownertrust & TRUST_MASK) >= TRUST_MARGINAL
+              || trec.r.trust.min_ownertrust)
+            goto leave;
+
+          for (recno = trec.r.trust.validlist; recno;
+               recno = vrec.r.valid.next)
+            {
+              read_record (recno, &vrec, RECTYPE_VALID);
+              if (pgp && (vrec.r.valid.validity & TRUST_MASK) >= TRUST_FULLY)
+                goto leave;
+              if ((vrec.r.valid.validity & TRUST_MASK)
+                  || vrec.r.valid.marginal_count
+                  || vrec.r.valid.full_count)
+                {
+                  vrec.r.valid.validity &= ~TRUST_MASK;
+                  vrec.r.valid.marginal_count = vrec.r.valid.full_count = 0;
+                  write_record (ctrl, &vrec);
+                }
+            }
+        }
+      else if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+        goto leave;
+
+      if (collect_introducers (ctrl, keyblock, kid, &intro, &nintro))
+        goto leave;
+
+      if (!pk->has_expired && !pk->flags.revoked)
+        {
+          /* validate_keys sees the expiration of the user ids even
+           * for depths with no certifications from the klist.  */
+          for (node = keyblock; node; node = node->next)
+            if (node->pkt->pkttype == PKT_USER_ID
+                && !node->pkt->pkt.user_id->flags.revoked
+                && !node->pkt->pkt.user_id->flags.expired
+                && node->pkt->pkt.user_id->expiredate
+                && node->pkt->pkt.user_id->expiredate < next_expire)
+              next_expire = node->pkt->pkt.user_id->expiredate;
+
+          used = 0;
+          for (depth = 0; depth < opt.max_cert_depth; depth++)
+            {
+              klist = NULL;
+              for (i=0; i < nintro; i++)
+                if (intro[i].depth == depth)
+                  {
+                    intro[i].ki.next = klist;
+                    klist = &intro[i].ki;
+                  }
+              if (!klist)
+                continue;
+
+              /* Prepare the keyblock as validate_key_list does.  */
+              clear_kbnode_flags (keyblock);
+              pk->trust_value = 0;
+              pk->trust_depth = 0;
+              pk->trust_regexp = NULL;
+
+              if (!validate_one_keyblock (ctrl, keyblock, klist,
+                                          start_time, &next_expire))
+                continue;
+
+              if (pk->expiredate && pk->expiredate >= start_time
+                  && pk->expiredate < next_expire)
+                next_expire = pk->expiredate;
+
+              store_validation_status (ctrl, used? -1 : depth,
+                                       keyblock, stored);
+
+              full = 0;
+              all = 1;
+              for (node = keyblock; node; node = node->next)
+                if (node->pkt->pkttype == PKT_USER_ID)
+                  {
+                    if ((node->flag & 4))
+                      full = 1;
+                    else
+                      all = 0;
+                  }
+
+              if (full && !used)
+                {
+                  /* The key is now used as an introducer for the
+                   * next depth.  This is only harmless without a
+                   * trust signature chain.  */
+                  used = 1;
+                  if (pgp && depth + 1 < opt.max_cert_depth
+                      && (pk->trust_depth || pk->trust_value >= 60))
+                    goto leave;
+                }
+              if (all)
+                break;
+            }
+        }
+
+      xfree (intro);
+      intro = NULL;
+      nintro = 0;
+      release_kbnode (keyblock);
+      keyblock = NULL;
+      count++;
+    }
+
+  /* The old schedule still covers all other keys.  */
+  nextcheck = changed_keys_nextcheck;
+  if (next_expire != 0xffffffff && next_expire >= start_time
+      && (!nextcheck || next_expire < nextcheck))
+    nextcheck = next_expire;
+  tdbio_write_nextcheck (ctrl, nextcheck);
+  if (!opt.quiet)
+    {
+      log_info (ngettext ("validity of %d changed key updated\n",
+                          "validity of %d changed keys updated\n",
+                          count), count);
+      if (nextcheck)
+        log_info (_("next trustdb check due at %s\n"),
+                  strtimestamp (nextcheck));
+    }
+
+  do_sync ();
+  pending_check_trustdb = 0;
+  release_changed_keys ();
+  rc = 0;
+
+ leave:
+  if (rc)
+    {
+      /* Discard the partial update.  */
+      tdbio_cancel_transaction ();
+      if (opt.verbose)
+        log_info ("full validation of the trustdb required\n");
+    }
+  else
+    end_transaction ();
+  xfree (intro);
+  release_kbnode (keyblock);
+  release_key_hash_table (stored);
+  keydb_release (kdb);
   return rc;
 }
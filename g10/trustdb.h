@@ -62,6 +62,8 @@ void update_ownertrust (ctrl_t ctrl,
 int clear_ownertrusts (ctrl_t ctrl, PKT_public_key *pk);
 
 void revalidation_mark (ctrl_t ctrl);
+void revalidation_mark_key (ctrl_t ctrl, PKT_public_key *pk);
+unsigned int trust_get_generation (void);
 void check_trustdb_stale (ctrl_t ctrl);
 void check_or_update_trustdb (ctrl_t ctrl);
 
@@ -91,7 +93,9 @@ gpg_error_t init_trustdb (ctrl_t ctrl, int no_create);
 int have_trustdb (ctrl_t ctrl);
 void tdb_check_trustdb_stale (ctrl_t ctrl);
 void tdb_revalidation_mark (ctrl_t ctrl);
+void tdb_revalidation_mark_key (ctrl_t ctrl, PKT_public_key *pk);
 int trustdb_pending_check(void);
+unsigned int tdb_get_generation (void);
 void tdb_check_or_update (ctrl_t ctrl);
 
 int tdb_cache_disabled_value (ctrl_t ctrl, PKT_public_key *pk);
@@ -35,6 +35,7 @@
 #include "filter.h"
 #include "../common/ttyio.h"
 #include "../common/i18n.h"
+#include "../common/membuf.h"
 
 
 /****************
@@ -85,6 +86,8 @@ verify_signatures (ctrl_t ctrl, int nfiles, char **files )
 
     /* open the signature file */
     fp = iobuf_open(sigfile);
+    if (fp)
+      iobuf_ioctl (fp, IOBUF_IOCTL_NO_CACHE, 1, NULL);
     if (fp && is_secured_file (iobuf_get_fd (fp)))
       {
         iobuf_close (fp);
@@ -171,7 +174,7 @@ verify_one_file (ctrl_t ctrl, const char *name )
 	}
     }
 
-    rc = proc_signature_packets (ctrl, NULL, fp, NULL, name );
+    rc = proc_signature_stream (ctrl, fp, name);
     iobuf_close(fp);
     write_status( STATUS_FILE_DONE );
 
@@ -183,6 +186,91 @@ verify_one_file (ctrl_t ctrl, const char *name )
     return rc;
 }
 
+/* Verify the NSIGS detached signatures in the files SIGFILES against
+ * the signed data in DATAFILE.  The signature packets of all files
+ * are collected into one stream so that the data is read only once
+ * with the union of the digest algorithms enabled; all signatures are
+ * then checked against the finished digests.  This is useful if a
+ * large file has been signed by several people.  */
+int
+verify_detached_signatures (ctrl_t ctrl, const char *datafile,
+                            int nsigs, char **sigfiles)
+{
+  gpg_error_t err = 0;
+  membuf_t mb;
+  byte buffer[4096];
+  char *image;
+  size_t imagelen;
+  IOBUF fp;
+  armor_filter_context_t *afx;
+  strlist_t sl;
+  int i, n;
+
+  if (!nsigs)
+    {
+      log_error (_("no signature files given\n"));
+      return gpg_error (GPG_ERR_NO_DATA);
+    }
+
+  init_membuf (&mb, 4096);
+  for (i=0; i < nsigs; i++)
+    {
+      fp = iobuf_open (sigfiles[i]);
+      if (fp)
+        iobuf_ioctl (fp, IOBUF_IOCTL_NO_CACHE, 1, NULL);
+      if (fp && is_secured_file (iobuf_get_fd (fp)))
+        {
+          iobuf_close (fp);
+          fp = NULL;
+          gpg_err_set_errno (EPERM);
+        }
+      if (!fp)
+        {
+          err = gpg_error_from_syserror ();
+          log_error (_("can't open '%s': %s\n"),
+                     print_fname_stdin (sigfiles[i]), gpg_strerror (err));
+          break;
+        }
+
+      afx = NULL;
+      if (!opt.no_armor && use_armor_filter (fp))
+        {
+          afx = new_armor_context ();
+          push_armor_filter (afx, fp);
+        }
+      while ((n = iobuf_read (fp, buffer, sizeof buffer)) != -1)
+        put_membuf (&mb, buffer, n);
+      err = iobuf_error (fp);
+      iobuf_close (fp);
+      release_armor_context (afx);
+      if (err)
+        {
+          log_error (_("error reading '%s': %s\n"),
+                     print_fname_stdin (sigfiles[i]), gpg_strerror (err));
+          break;
+        }
+    }
+
+  image = get_membuf (&mb, &imagelen);
+  if (err || !image)
+    {
+      if (!err)
+        err = gpg_error_from_syserror ();
+      xfree (image);
+      return err;
+    }
+
+  fp = iobuf_temp_with_content (image, imagelen);
+  xfree (image);
+  sl = NULL;
+  add_to_strlist (&sl, datafile);
+  err = proc_signature_packets (ctrl, NULL, fp, sl, sigfiles[0]);
+  free_strlist (sl);
+  iobuf_close (fp);
+  return err;
+}
+
+
 /****************
  * Verify each file given in the files array or read the names of the
  * files from stdin.
@@ -221,6 +309,90 @@ verify_files (ctrl_t ctrl, int nfiles, char **files )
 
 
 
+/* Verify the signatures listed in the file LISTFILE or, if LISTFILE
+ * is "-", in stdin.  Each line has the name of a detached signature
+ * and, separated by a tab, the name of the signed file.  If there is
+ * no tab, the signature is expected to include the signed data.
+ * Empty lines and lines starting with a '#' are ignored.  The status
+ * lines for each signature are enclosed in FILE_START and FILE_DONE;
+ * thus a caller can verify many signatures with only one process
+ * while still getting a separate result for each one.  */
+int
+verify_signature_list (ctrl_t ctrl, const char *listfile)
+{
+  gpg_error_t err = 0;
+  estream_t fp;
+  char *line = NULL;
+  size_t linesize = 0;
+  size_t maxlen;
+  unsigned int lnr = 0;
+  ssize_t n;
+  char *files[2];
+  char *p;
+
+  if (!strcmp (listfile, "-"))
+    fp = es_stdin;
+  else
+    fp = es_fopen (listfile, "r");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't open '%s': %s\n"), listfile, gpg_strerror (err));
+      return err;
+    }
+
+  for (;;)
+    {
+      maxlen = 8192;
+      n = es_read_line (fp, &line, &linesize, &maxlen);
+      if (n < 0)
+        {
+          err = gpg_error_from_syserror ();
+          log_error (_("error reading '%s': %s\n"),
+                     listfile, gpg_strerror (err));
+          break;
+        }
+      if (!n)
+        break;  /* EOF */
+      lnr++;
+      if (!maxlen)
+        {
+          err = gpg_error (GPG_ERR_LINE_TOO_LONG);
+          log_error (_("input line %u too long or missing LF\n"), lnr);
+          break;
+        }
+      /* We don't strip any spaces, so that we can process nearly all
+       * filenames.  */
+      if (line[n-1] == '\n')
+        line[--n] = 0;
+      if (n && line[n-1] == '\r')
+        line[--n] = 0;
+      if (!*line || *line == '#')
+        continue;
+
+      files[0] = line;
+      p = strchr (line, '\t');
+      if (p)
+        {
+          *p++ = 0;
+          files[1] = p;
+        }
+
+      print_file_status (STATUS_FILE_START, files[0], 1);
+      if (verify_signatures (ctrl, p? 2 : 1, files))
+        print_file_status (STATUS_FILE_ERROR, files[0], 1);
+      write_status (STATUS_FILE_DONE);
+      reset_literals_seen ();
+    }
+
+  xfree (line);
+  if (fp != es_stdin)
+    es_fclose (fp);
+  return err;
+}
+
+
+
 /* Perform a verify operation.  To verify detached signatures, DATA_FD
    shall be the descriptor of the signed data; for regular signatures
    it needs to be -1.  If OUT_FP is not NULL and DATA_FD is not -1 the
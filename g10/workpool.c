@@ -0,0 +1,264 @@
+/* workpool.c - A simple pool of worker threads for CPU bound jobs
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* gpg itself is not a threaded program.  However, some operations
+ * like AEAD en- and decryption work on independent blocks of data
+ * and can thus be spread over several cores.  This module provides a
+ * small pool of nPth threads for such jobs.  The job functions are
+ * run without holding the nPth lock; thus they must only work on data
+ * owned by the job and may in particular not call the log functions
+ * or any other part of gpg which is not thread-safe.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <npth.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "options.h"
+#include "main.h"
+
+
+/* The maximum number of threads we allow for a pool.  */
+#define MAX_WORKPOOL_THREADS 64
+
+
+struct workpool_s
+{
+  /* Lock and conditions protecting the fields below.  */
+  npth_mutex_t lock;
+  npth_cond_t cond_work;   /* A job has been queued or STOP was set.  */
+  npth_cond_t cond_done;   /* A job has been finished.  */
+
+  /* The queue of pending jobs.  */
+  workpool_job_t head;
+  workpool_job_t tail;
+
+  /* Set to request all threads to terminate.  */
+  int stop;
+
+  /* The number of threads in THREADS.  */
+  int nthreads;
+  npth_t threads[1];
+};
+
+
+/* Make sure that nPth has been initialized.  This must be called from
+ * the main thread.  */
+static void
+init_npth (void)
+{
+  static int initialized;
+
+  if (!initialized)
+    {
+      initialized = 1;
+      npth_init ();
+    }
+}
+
+
+/* The thread function of a worker.  */
+static void *
+worker_thread (void *opaque)
+{
+  workpool_t pool = opaque;
+  workpool_job_t job;
+
+  npth_mutex_lock (&pool->lock);
+  for (;;)
+    {
+      while (!pool->head && !pool->stop)
+        npth_cond_wait (&pool->cond_work, &pool->lock);
+      if (!pool->head)
+        break; /* Stop requested and no more jobs.  */
+
+      job = pool->head;
+      pool->head = job->next;
+      if (!pool->head)
+        pool->tail = NULL;
+      npth_mutex_unlock (&pool->lock);
+
+      /* Run the job without the nPth lock so that other workers and
+       * the main thread can run concurrently.  */
+      npth_unprotect ();
+      job->func (job->opaque);
+      npth_protect ();
+
+      npth_mutex_lock (&pool->lock);
+      job->done = 1;
+      npth_cond_broadcast (&pool->cond_done);
+    }
+  npth_mutex_unlock (&pool->lock);
+
+  return NULL;
+}
+
+
+/* Create a new pool with NTHREADS worker threads and store it at
+ * R_POOL.  */
+gpg_error_t
+workpool_new (workpool_t *r_pool, int nthreads)
+{
+  gpg_error_t err;
+  workpool_t pool;
+  npth_attr_t tattr;
+  int i, ret;
+
+  *r_pool = NULL;
+  if (nthreads < 1)
+    nthreads = 1;
+  else if (nthreads > MAX_WORKPOOL_THREADS)
+    nthreads = MAX_WORKPOOL_THREADS;
+
+  init_npth ();
+
+  pool = xtrycalloc (1, sizeof *pool + (nthreads - 1) * sizeof (npth_t));
+  if (!pool)
+    return gpg_error_from_syserror ();
+  npth_mutex_init (&pool->lock, NULL);
+  npth_cond_init (&pool->cond_work, NULL);
+  npth_cond_init (&pool->cond_done, NULL);
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (i=0; i < nthreads; i++)
+    {
+      ret = npth_create (&pool->threads[i], &tattr, worker_thread, pool);
+      if (ret)
+        {
+          err = gpg_error_from_errno (ret);
+          log_error ("error spawning worker thread: %s\n",
+                     gpg_strerror (err));
+          npth_attr_destroy (&tattr);
+          workpool_release (pool);
+          return err;
+        }
+      pool->nthreads++;
+    }
+  npth_attr_destroy (&tattr);
+
+  if (DBG_FILTER)
+    log_debug ("workpool: started %d threads\n", pool->nthreads);
+  *r_pool = pool;
+  return 0;
+}
+
+
+/* Terminate all threads of POOL and release it.  Jobs which are
+ * still queued are run before the threads terminate.  */
+void
+workpool_release (workpool_t pool)
+{
+  int i;
+
+  if (!pool)
+    return;
+
+  npth_mutex_lock (&pool->lock);
+  pool->stop = 1;
+  npth_cond_broadcast (&pool->cond_work);
+  npth_mutex_unlock (&pool->lock);
+
+  for (i=0; i < pool->nthreads; i++)
+    npth_join (pool->threads[i], NULL);
+
+  npth_cond_destroy (&pool->cond_done);
+  npth_cond_destroy (&pool->cond_work);
+  npth_mutex_destroy (&pool->lock);
+  xfree (pool);
+}
+
+
+/* Store the pool shared by all users of this process at R_POOL.  The
+ * pool is created by the first call and never released; thus the
+ * threads are not started again for each message of a --encrypt-files
+ * or --decrypt-files run.  Because AEAD encryption, compression and
+ * hashing may all use the pool at the same time, it is created with
+ * the largest number of threads requested by the options.  Users of
+ * the shared pool must wait for all their jobs themselves.  */
+gpg_error_t
+workpool_get_shared (workpool_t *r_pool)
+{
+  static workpool_t shared_pool;
+  gpg_error_t err;
+  int nthreads;
+
+  if (!shared_pool)
+    {
+      nthreads = opt.aead_threads;
+      if (opt.compress_threads > nthreads)
+        nthreads = opt.compress_threads;
+      if (opt.hash_threads > nthreads)
+        nthreads = opt.hash_threads;
+      err = workpool_new (&shared_pool, nthreads);
+      if (err)
+        {
+          *r_pool = NULL;
+          return err;
+        }
+    }
+  *r_pool = shared_pool;
+  return 0;
+}
+
+
+/* Return the number of threads of POOL.  */
+int
+workpool_nthreads (workpool_t pool)
+{
+  return pool? pool->nthreads : 0;
+}
+
+
+/* Queue JOB for POOL.  The caller must have set the FUNC and OPAQUE
+ * fields of JOB and needs to keep JOB valid until workpool_wait has
+ * returned for it.  */
+void
+workpool_submit (workpool_t pool, workpool_job_t job)
+{
+  log_assert (job->func);
+
+  npth_mutex_lock (&pool->lock);
+  job->next = NULL;
+  job->done = 0;
+  if (pool->tail)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  npth_cond_signal (&pool->cond_work);
+  npth_mutex_unlock (&pool->lock);
+}
+
+
+/* Wait until JOB, which must have been queued for POOL, has been
+ * processed.  */
+void
+workpool_wait (workpool_t pool, workpool_job_t job)
+{
+  npth_mutex_lock (&pool->lock);
+  while (!job->done)
+    npth_cond_wait (&pool->cond_done, &pool->lock);
+  npth_mutex_unlock (&pool->lock);
+}
@@ -59,6 +59,8 @@ enum cmd_and_opt_values {
   aCreate,
   aMount,
   aUmount,
+  aMountBatch,
+  aUmountBatch,
   aSuspend,
   aResume,
   aServer,
@@ -113,6 +115,10 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_c (aCreate, "create", N_("Create a new file system container")),
   ARGPARSE_c (aMount,  "mount",  N_("Mount a file system container") ),
   ARGPARSE_c (aUmount, "umount", N_("Unmount a file system container") ),
+  ARGPARSE_c (aMountBatch,  "mount-batch",
+              N_("Mount several file system containers") ),
+  ARGPARSE_c (aUmountBatch, "umount-batch",
+              N_("Unmount several file system containers") ),
   ARGPARSE_c (aSuspend, "suspend", N_("Suspend a file system container") ),
   ARGPARSE_c (aResume,  "resume",  N_("Resume a file system container") ),
   ARGPARSE_c (aServer, "server", N_("Run in server mode")),
@@ -490,6 +496,8 @@ main ( int argc, char **argv)
         case aServer:
         case aMount:
         case aUmount:
+        case aMountBatch:
+        case aUmountBatch:
         case aSuspend:
         case aResume:
         case aCreate:
@@ -800,6 +808,18 @@ main ( int argc, char **argv)
       }
       break;
 
+    case aMountBatch: /* Mount several containers in parallel.  */
+    case aUmountBatch:
+      {
+        if (argc < 1)
+          wrong_args (cmd == aMountBatch? "--mount-batch filenames"
+                      /**/              : "--umount-batch filenames");
+        if (cmd == aMountBatch)
+          start_idle_task ();
+        err = g13_mount_containers (&ctrl, argv, argc, cmd == aUmountBatch);
+      }
+      break;
+
     case aSuspend: /* Suspend a container. */
       {
         /* Fixme: Should we add a suspend all container option?  */
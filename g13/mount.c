@@ -25,6 +25,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "g13.h"
 #include "../common/i18n.h"
@@ -41,6 +42,22 @@
 #include "call-syshelp.h"
 
 
+/* The maximum number of containers processed at the same time by
+   g13_mount_containers.  */
+#define MAX_BATCH_THREADS 8
+
+/* The state shared by the threads of g13_mount_containers.  */
+struct batch_parm_s
+{
+  ctrl_t ctrl;           /* The caller's control object.  */
+  int umount;            /* Unmount instead of mount.  */
+  char **filenames;      /* The containers.  */
+  int nfiles;            /* The number of containers.  */
+  int next;              /* The index of the next container.  */
+  gpg_error_t err;       /* The first error.  */
+};
+
+
 /* Mount the container with name FILENAME at MOUNTPOINT.  */
 gpg_error_t
 g13_mount_container (ctrl_t ctrl, const char *filename, const char *mountpoint)
@@ -210,6 +227,93 @@ g13_mount_container (ctrl_t ctrl, const char *filename, const char *mountpoint)
 }
 
 
+/* The thread function used by g13_mount_containers.  Each thread has
+   its own control object and thus its own connection to the
+   g13-syshelp so that the keyblobs are decrypted and the devices are
+   set up concurrently.  There is no need for a lock to pick the next
+   container because nPth switches threads only on blocking calls.  */
+static void *
+batch_thread (void *arg)
+{
+  struct batch_parm_s *parm = arg;
+  struct server_control_s ctrlbuf;
+  ctrl_t ctrl = &ctrlbuf;
+  const char *filename;
+  gpg_error_t err;
+
+  memset (ctrl, 0, sizeof *ctrl);
+  g13_init_default_ctrl (ctrl);
+  ctrl->no_server = parm->ctrl->no_server;
+  ctrl->status_fd = parm->ctrl->status_fd;
+  ctrl->server_local = parm->ctrl->server_local;
+  ctrl->with_colons = parm->ctrl->with_colons;
+
+  while (parm->next < parm->nfiles)
+    {
+      filename = parm->filenames[parm->next++];
+      if (parm->umount)
+        err = g13_umount_container (ctrl, filename, NULL);
+      else
+        err = g13_mount_container (ctrl, filename, NULL);
+      if (err)
+        {
+          log_error ("error %smounting container '%s': %s <%s>\n",
+                     parm->umount? "un":"", filename,
+                     gpg_strerror (err), gpg_strsource (err));
+          if (!parm->err)
+            parm->err = err;
+        }
+    }
+
+  g13_deinit_default_ctrl (ctrl);
+  return NULL;
+}
+
+
+/* Mount or, if UMOUNT is set, unmount the NFILES containers given by
+   FILENAMES.  The containers are processed in parallel; the mount
+   points are created as with g13_mount_container without a mount
+   point.  Errors are printed and the first one is returned after all
+   containers have been processed.  */
+gpg_error_t
+g13_mount_containers (ctrl_t ctrl, char **filenames, int nfiles, int umount)
+{
+  struct batch_parm_s parm;
+  npth_attr_t tattr;
+  npth_t threads[MAX_BATCH_THREADS];
+  int nthreads, i;
+
+  memset (&parm, 0, sizeof parm);
+  parm.ctrl = ctrl;
+  parm.umount = umount;
+  parm.filenames = filenames;
+  parm.nfiles = nfiles;
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (nthreads=0; nthreads < nfiles && nthreads < MAX_BATCH_THREADS;
+       nthreads++)
+    {
+      if (npth_create (&threads[nthreads], &tattr, batch_thread, &parm))
+        {
+          log_error ("error spawning batch thread: %s\n",
+                     gpg_strerror (gpg_error_from_syserror ()));
+          break;
+        }
+    }
+  npth_attr_destroy (&tattr);
+
+  /* Without a thread do it here.  */
+  if (!nthreads)
+    batch_thread (&parm);
+
+  for (i=0; i < nthreads; i++)
+    npth_join (threads[i], NULL);
+
+  return parm.err;
+}
+
+
 /* Unmount the container with name FILENAME or the one mounted at
    MOUNTPOINT.  If both are given the FILENAME takes precedence.  */
 gpg_error_t
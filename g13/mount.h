@@ -26,6 +26,8 @@ gpg_error_t g13_mount_container (ctrl_t ctrl,
 gpg_error_t g13_umount_container (ctrl_t ctrl,
                                   const char *filename,
                                   const char *mountpoint);
+gpg_error_t g13_mount_containers (ctrl_t ctrl, char **filenames, int nfiles,
+                                  int umount);
 
 
 #endif /*G13_MOUNT_H*/
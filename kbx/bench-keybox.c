@@ -0,0 +1,296 @@
+/* bench-keybox.c - Benchmark for keybox searches
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* This benchmark creates keyboxes with 10000 and 100000 synthetic
+ * keys and measures the lookup of keys by fingerprint and by mail
+ * address.  The keys consist only of a public key packet with a
+ * random RSA modulus and one user id; this is all the keybox needs
+ * for its searches.  If the envvar BENCH_LARGE is set, a keybox with
+ * one million keys is also tested.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gpg-error.h>
+#include <gcrypt.h>
+
+#include "../common/util.h"
+#include "../common/init.h"
+#include "../common/userids.h"
+#include "keybox-defs.h"
+#include "../common/bench.h"
+
+/* The number of keys looked up for one run.  */
+#define NSAMPLES 100
+
+/* The fingerprints and mail addresses of the sample keys.  */
+static unsigned char sample_fpr[NSAMPLES][20];
+static char sample_mail[NSAMPLES][40];
+
+
+/* Write an OpenPGP packet with TAG and the BODY of LENGTH to P and
+ * return the new end of P.  */
+static unsigned char *
+put_packet (unsigned char *p, int tag, const void *body, size_t length)
+{
+  *p++ = 0xc0 | tag;
+  if (length < 192)
+    *p++ = length;
+  else
+    {
+      *p++ = ((length - 192) >> 8) + 192;
+      *p++ = (length - 192);
+    }
+  memcpy (p, body, length);
+  return p + length;
+}
+
+
+/* Create the keyblock number IDX at BUFFER, which must be large
+ * enough, and return its length.  */
+static size_t
+make_keyblock (unsigned char *buffer, unsigned int idx)
+{
+  unsigned char body[1+4+1+2+256+2+3];
+  unsigned char *p = body;
+  char uid[80];
+  unsigned long stamp = 0x5b000000 + idx;
+
+  *p++ = 4;  /* version */
+  *p++ = stamp >> 24;
+  *p++ = stamp >> 16;
+  *p++ = stamp >> 8;
+  *p++ = stamp;
+  *p++ = 1;  /* RSA */
+  *p++ = 2048 >> 8;
+  *p++ = 2048 & 0xff;
+  bench_randomize (p, 256);
+  *p |= 0x80;
+  p += 256;
+  *p++ = 0;
+  *p++ = 17;
+  *p++ = 0x01;
+  *p++ = 0x00;
+  *p++ = 0x01;
+
+  snprintf (uid, sizeof uid, "Bench User %u <user-%u@example.org>",
+            idx, idx);
+
+  p = put_packet (buffer, 6, body, sizeof body);
+  p = put_packet (p, 13, uid, strlen (uid));
+  return p - buffer;
+}
+
+
+/* Create the keybox FNAME with NKEYS keys and remember the samples.  */
+static void
+create_keybox (const char *fname, unsigned int nkeys)
+{
+  gpg_error_t err;
+  unsigned char image[512];
+  size_t imagelen, nparsed;
+  struct _keybox_openpgp_info info;
+  KEYBOXBLOB blob;
+  unsigned int idx, step;
+  FILE *fp;
+
+  fp = fopen (fname, "wb");
+  if (!fp)
+    {
+      fprintf (stderr, "bench-keybox: error creating '%s': %s\n",
+               fname, strerror (errno));
+      exit (1);
+    }
+
+  err = _keybox_write_header_blob (fp, 1);
+  step = nkeys / NSAMPLES;
+  for (idx=0; !err && idx < nkeys; idx++)
+    {
+      imagelen = make_keyblock (image, idx);
+      err = _keybox_parse_openpgp (image, imagelen, &nparsed, &info);
+      if (err)
+        break;
+      if (!(idx % step) && idx / step < NSAMPLES)
+        {
+          memcpy (sample_fpr[idx / step], info.primary.fpr, 20);
+          snprintf (sample_mail[idx / step], sizeof sample_mail[0],
+                    "<user-%u@example.org>", idx);
+        }
+      err = _keybox_create_openpgp_blob (&blob, &info, image, imagelen,
+                                         NULL, 0);
+      _keybox_destroy_openpgp_info (&info);
+      if (err)
+        break;
+      err = _keybox_write_blob (blob, fp);
+      _keybox_release_blob (blob);
+    }
+
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  if (err)
+    {
+      fprintf (stderr, "bench-keybox: error writing '%s': %s\n",
+               fname, gpg_strerror (err));
+      exit (1);
+    }
+}
+
+
+/* Search all samples in the keybox HD using MODE.  */
+static void
+search_samples (KEYBOX_HANDLE hd, KeydbSearchMode mode, int expect_miss)
+{
+  gpg_error_t err;
+  KEYBOX_SEARCH_DESC desc;
+  int i;
+
+  for (i=0; i < NSAMPLES; i++)
+    {
+      memset (&desc, 0, sizeof desc);
+      if (mode == KEYDB_SEARCH_MODE_FPR)
+        {
+          desc.mode = mode;
+          memcpy (desc.u.fpr, sample_fpr[i], 20);
+          if (expect_miss)
+            desc.u.fpr[19] ^= 0xff;
+        }
+      else if (classify_user_id (sample_mail[i], &desc, 1))
+        {
+          fprintf (stderr, "bench-keybox: bad user id '%s'\n",
+                   sample_mail[i]);
+          exit (1);
+        }
+
+      err = keybox_search_reset (hd);
+      if (!err)
+        err = keybox_search (hd, &desc, 1, KEYBOX_BLOBTYPE_PGP, NULL, NULL);
+      if (expect_miss && (err == -1 || gpg_err_code (err) == GPG_ERR_EOF))
+        err = 0;
+      else if (expect_miss && !err)
+        err = gpg_error (GPG_ERR_BUG);
+      if (err)
+        {
+          fprintf (stderr, "bench-keybox: search %d failed: %s\n",
+                   i, gpg_strerror (err));
+          exit (1);
+        }
+    }
+}
+
+
+/* Run the benchmarks for a keybox with NKEYS keys.  */
+static void
+bench_keybox (unsigned int nkeys)
+{
+  gpg_error_t err;
+  unsigned long long t0, usec;
+  unsigned int run, nruns = bench_repeat ();
+  char fname[60];
+  char name[40];
+  void *token;
+  KEYBOX_HANDLE hd;
+  struct stat st;
+
+  snprintf (fname, sizeof fname, "bench-keybox-%u.kbx", nkeys);
+
+  t0 = bench_now ();
+  create_keybox (fname, nkeys);
+  usec = bench_elapsed (t0, ~0ULL);
+  snprintf (name, sizeof name, "create-%u", nkeys);
+  bench_report ("keybox", name, nkeys,
+                stat (fname, &st)? 0 : (unsigned long long)st.st_size, usec);
+
+  err = keybox_register_file (fname, 0, &token);
+  if (err)
+    {
+      fprintf (stderr, "bench-keybox: error registering '%s': %s\n",
+               fname, gpg_strerror (err));
+      exit (1);
+    }
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    {
+      fprintf (stderr, "bench-keybox: error opening '%s'\n", fname);
+      exit (1);
+    }
+
+  /* The first search may need to build the index; report it
+   * separately.  */
+  t0 = bench_now ();
+  search_samples (hd, KEYDB_SEARCH_MODE_FPR, 0);
+  usec = bench_elapsed (t0, ~0ULL);
+  snprintf (name, sizeof name, "search-fpr-cold-%u", nkeys);
+  bench_report ("keybox", name, NSAMPLES, 0, usec);
+
+  for (run=0, usec=~0ULL; run < nruns; run++)
+    {
+      t0 = bench_now ();
+      search_samples (hd, KEYDB_SEARCH_MODE_FPR, 0);
+      usec = bench_elapsed (t0, usec);
+    }
+  snprintf (name, sizeof name, "search-fpr-%u", nkeys);
+  bench_report ("keybox", name, NSAMPLES, 0, usec);
+
+  for (run=0, usec=~0ULL; run < nruns; run++)
+    {
+      t0 = bench_now ();
+      search_samples (hd, KEYDB_SEARCH_MODE_FPR, 1);
+      usec = bench_elapsed (t0, usec);
+    }
+  snprintf (name, sizeof name, "search-fpr-miss-%u", nkeys);
+  bench_report ("keybox", name, NSAMPLES, 0, usec);
+
+  for (run=0, usec=~0ULL; run < nruns; run++)
+    {
+      t0 = bench_now ();
+      search_samples (hd, KEYDB_SEARCH_MODE_MAIL, 0);
+      usec = bench_elapsed (t0, usec);
+    }
+  snprintf (name, sizeof name, "search-mail-%u", nkeys);
+  bench_report ("keybox", name, NSAMPLES, 0, usec);
+
+  keybox_release (hd);
+  remove (fname);
+  strcat (fname, ".idx");
+  remove (fname);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  unsigned int scale = bench_scale ();
+
+  early_system_init ();
+  gcry_control (GCRYCTL_DISABLE_SECMEM);
+  log_set_prefix ("bench-keybox", GPGRT_LOG_WITH_PREFIX);
+  init_common_subsystems (&argc, &argv);
+
+  bench_keybox (10000 * scale);
+  bench_keybox (100000 * scale);
+  if (getenv ("BENCH_LARGE"))
+    bench_keybox (1000000 * scale);
+
+  return 0;
+}
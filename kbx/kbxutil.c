@@ -62,6 +62,7 @@ enum cmd_and_opt_values {
   oNoArmor,
   oFrom,
   oTo,
+  oThreads,
 
   aTest
 };
@@ -82,9 +83,10 @@ static ARGPARSE_OPTS opts[] = {
 
   { oFrom, "from", 4, "|N|first record to export" },
   { oTo,   "to",   4, "|N|last record to export" },
+  { oThreads, "threads", 1, "|N|use N threads for --stats and --find-dups" },
 /*   { oArmor, "armor",     0, N_("create ascii armored output")}, */
 /*   { oArmor, "armour",     0, "@" }, */
-/*   { oOutput, "output",    2, N_("use as output file")}, */
+  { oOutput, "output",    2, N_("use as output file")},
   { oVerbose, "verbose",   0, N_("verbose") },
   { oQuiet,	"quiet",   0, N_("be somewhat more quiet") },
   { oDryRun, "dry-run",   0, N_("do not make any changes") },
@@ -96,6 +98,9 @@ static ARGPARSE_OPTS opts[] = {
 };
 
 
+/* The initial size of the buffer used to read OpenPGP keyrings.  */
+#define IMPORT_CHUNK_SIZE (1024 * 1024)
+
 void myexit (int rc);
 
 int keybox_errors_seen = 0;
@@ -230,81 +235,6 @@ format_keyid ( const char *s, u32 *kid )
 }
 #endif
 
-static char *
-read_file (const char *fname, size_t *r_length)
-{
-  FILE *fp;
-  char *buf;
-  size_t buflen;
-
-  if (!strcmp (fname, "-"))
-    {
-      size_t nread, bufsize = 0;
-
-      fp = stdin;
-      buf = NULL;
-      buflen = 0;
-#define NCHUNK 8192
-      do
-        {
-          bufsize += NCHUNK;
-          if (!buf)
-            buf = xtrymalloc (bufsize);
-          else
-            buf = xtryrealloc (buf, bufsize);
-          if (!buf)
-            log_fatal ("can't allocate buffer: %s\n", strerror (errno));
-
-          nread = fread (buf+buflen, 1, NCHUNK, fp);
-          if (nread < NCHUNK && ferror (fp))
-            {
-              log_error ("error reading '[stdin]': %s\n", strerror (errno));
-              xfree (buf);
-              return NULL;
-            }
-          buflen += nread;
-        }
-      while (nread == NCHUNK);
-#undef NCHUNK
-
-    }
-  else
-    {
-      struct stat st;
-
-      fp = fopen (fname, "rb");
-      if (!fp)
-        {
-          log_error ("can't open '%s': %s\n", fname, strerror (errno));
-          return NULL;
-        }
-
-      if (fstat (fileno(fp), &st))
-        {
-          log_error ("can't stat '%s': %s\n", fname, strerror (errno));
-          fclose (fp);
-          return NULL;
-        }
-
-      buflen = st.st_size;
-      buf = xtrymalloc (buflen+1);
-      if (!buf)
-        log_fatal ("can't allocate buffer: %s\n", strerror (errno));
-      if (fread (buf, buflen, 1, fp) != 1)
-        {
-          log_error ("error reading '%s': %s\n", fname, strerror (errno));
-          fclose (fp);
-          xfree (buf);
-          return NULL;
-        }
-      fclose (fp);
-    }
-
-  *r_length = buflen;
-  return buf;
-}
-
-
 static void
 dump_fpr (const unsigned char *buffer, size_t len)
 {
@@ -370,24 +300,86 @@ dump_openpgp_key (keybox_openpgp_info_t info, const unsigned char *image)
 }
 
 
-static void
-import_openpgp (const char *filename, int dryrun)
+/* Parse the OpenPGP keyblocks in FILENAME and write them as keybox
+ * blobs to OUTFP.  The file is read in chunks and thus even huge
+ * keyrings can be converted without reading them into memory.
+ * Returns an error if the file could not be read or a blob could not
+ * be written.  */
+static gpg_error_t
+import_openpgp (const char *filename, int dryrun, FILE *outfp)
 {
   gpg_error_t err;
-  char *buffer;
-  size_t buflen, nparsed;
+  gpg_error_t rc = 0;
+  FILE *fp;
+  unsigned char *buffer = NULL;
+  size_t bufsize = 0;
+  size_t buflen = 0;
+  size_t off = 0;
+  size_t nread, nparsed;
+  int eof = 0;
+  int need_more = 0;
   unsigned char *p;
   struct _keybox_openpgp_info info;
   KEYBOXBLOB blob;
 
-  buffer = read_file (filename, &buflen);
-  if (!buffer)
-    return;
-  p = (unsigned char *)buffer;
+  if (!strcmp (filename, "-"))
+    fp = stdin;
+  else
+    {
+      fp = fopen (filename, "rb");
+      if (!fp)
+        {
+          rc = gpg_error_from_syserror ();
+          log_error ("can't open '%s': %s\n", filename, strerror (errno));
+          return rc;
+        }
+    }
+
   for (;;)
     {
-      err = _keybox_parse_openpgp (p, buflen, &nparsed, &info);
-      assert (nparsed <= buflen);
+      if (!eof && (off == buflen || need_more))
+        {
+          /* Move the unparsed data to the front and fill up the
+           * buffer.  A keyblock which does not fit into the buffer
+           * requires a larger buffer.  */
+          memmove (buffer, buffer + off, buflen - off);
+          buflen -= off;
+          off = 0;
+          if (buflen == bufsize)
+            {
+              bufsize = bufsize? 2 * bufsize : IMPORT_CHUNK_SIZE;
+              buffer = xtryrealloc (buffer, bufsize);
+              if (!buffer)
+                log_fatal ("can't allocate buffer: %s\n", strerror (errno));
+            }
+          nread = fread (buffer + buflen, 1, bufsize - buflen, fp);
+          if (nread < bufsize - buflen)
+            {
+              if (ferror (fp))
+                {
+                  rc = gpg_error_from_syserror ();
+                  log_error ("error reading '%s': %s\n",
+                             fp == stdin? "[stdin]" : filename,
+                             strerror (errno));
+                  break;
+                }
+              eof = 1;
+            }
+          buflen += nread;
+          need_more = 0;
+        }
+
+      p = buffer + off;
+      err = _keybox_parse_openpgp (p, buflen - off, &nparsed, &info);
+      assert (nparsed <= buflen - off);
+      if (!eof && (err || off + nparsed == buflen))
+        {
+          /* The keyblock may continue after the end of the buffer.  */
+          if (!err)
+            _keybox_destroy_openpgp_info (&info);
+          need_more = 1;
+          continue;
+        }
       if (err)
         {
           if (gpg_err_code (err) == GPG_ERR_NO_DATA)
@@ -404,6 +396,8 @@ import_openpgp (const char *filename, int dryrun)
               log_info ("%s: failed to parse OpenPGP keyblock: %s\n",
                         filename, gpg_strerror (err));
             }
+          if (!nparsed)
+            break;  /* We can't skip this one.  */
         }
       else
         {
@@ -411,7 +405,8 @@ import_openpgp (const char *filename, int dryrun)
             dump_openpgp_key (&info, p);
           else
             {
-              err = _keybox_create_openpgp_blob (&blob, &info, p, nparsed, 0);
+              err = _keybox_create_openpgp_blob (&blob, &info, p, nparsed,
+                                                 NULL, 0);
               if (err)
                 {
                   fflush (stdout);
@@ -420,26 +415,81 @@ import_openpgp (const char *filename, int dryrun)
                 }
               else
                 {
-                  err = _keybox_write_blob (blob, stdout);
+                  err = _keybox_write_blob (blob, outfp);
                   _keybox_release_blob (blob);
                   if (err)
                     {
                       fflush (stdout);
                       log_error ("%s: failed to write OpenPGP keyblock: %s\n",
                                  filename, gpg_strerror (err));
+                      rc = err;
+                      _keybox_destroy_openpgp_info (&info);
+                      break;
                     }
                 }
             }
 
           _keybox_destroy_openpgp_info (&info);
         }
-      p += nparsed;
-      buflen -= nparsed;
+      off += nparsed;
     }
+
   xfree (buffer);
+  if (fp != stdin)
+    fclose (fp);
+  return rc;
 }
 
 
+/* Convert the OpenPGP keyrings given by ARGC and ARGV into the new
+ * keybox file FNAME.  The keybox is written to a temporary file
+ * which is renamed to FNAME only after all keyblocks have been
+ * written.  */
+static void
+import_openpgp_to_file (const char *fname, int argc, char **argv)
+{
+  gpg_error_t err;
+  char *tmpfname;
+  FILE *fp;
+
+  tmpfname = xstrconcat (fname, ".tmp", NULL);
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      log_error ("can't create '%s': %s\n", tmpfname, strerror (errno));
+      xfree (tmpfname);
+      return;
+    }
+
+  err = _keybox_write_header_blob (fp, 1);
+  if (err)
+    log_error ("error writing '%s': %s\n", tmpfname, gpg_strerror (err));
+  else if (!argc)
+    err = import_openpgp ("-", 0, fp);
+  else
+    {
+      for (; argc && !err; argc--, argv++)
+        err = import_openpgp (*argv, 0, fp);
+    }
+
+  if (fclose (fp) && !err)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error closing '%s': %s\n", tmpfname, gpg_strerror (err));
+    }
+
+  if (err)
+    gnupg_remove (tmpfname);
+  else
+    {
+      err = gnupg_rename_file (tmpfname, fname, NULL);
+      if (err)
+        log_error ("renaming '%s' to '%s' failed: %s\n",
+                   tmpfname, fname, gpg_strerror (err));
+    }
+  xfree (tmpfname);
+}
+
 
 
 int
@@ -449,6 +499,7 @@ main( int argc, char **argv )
   enum cmd_and_opt_values cmd = 0;
   unsigned long from = 0, to = ULONG_MAX;
   int dry_run = 0;
+  const char *outfile = NULL;
 
   early_system_init ();
   set_strusage( my_strusage );
@@ -497,8 +548,10 @@ main( int argc, char **argv )
 
         case oFrom: from = pargs.r.ret_ulong; break;
         case oTo: to = pargs.r.ret_ulong; break;
+        case oThreads: _keybox_dump_set_threads (pargs.r.ret_int); break;
 
         case oDryRun: dry_run = 1; break;
+        case oOutput: outfile = pargs.r.ret_str; break;
 
         default:
           pargs.err = 2;
@@ -555,12 +608,14 @@ main( int argc, char **argv )
     }
   else if (cmd == aImportOpenPGP)
     {
-      if (!argc)
-        import_openpgp ("-", dry_run);
+      if (outfile && !dry_run)
+        import_openpgp_to_file (outfile, argc, argv);
+      else if (!argc)
+        import_openpgp ("-", dry_run, stdout);
       else
         {
           for (; argc; argc--, argv++)
-            import_openpgp (*argv, dry_run);
+            import_openpgp (*argv, dry_run, stdout);
         }
     }
 #if 0
@@ -49,7 +49,8 @@
    - u32  RFU
    - u32  file_created_at
    - u32  last_maintenance_run
-   - u32  RFU
+   - u32  Number of bytes used by deleted blobs since the last
+          maintenance run.  This is only a hint.
    - u32  RFU
 
 ** The OpenPGP and X.509 blobs
@@ -102,8 +103,9 @@
    - u16  Size of signature information (4)
    - NSIGS times:
       - u32  Expiration time of signature with some special values.
-             Since version 2.1.20 these special valuesare not anymore
-             used for OpenPGP:
+             For OpenPGP only the results of checked self-signatures
+             are stored; the other signatures are marked as not
+             checked:
              - 0x00000000 = not checked
              - 0x00000001 = missing key
              - 0x00000002 = bad signature
@@ -119,7 +121,15 @@
    - u32  Latest timestamp in the keyblock (useful for KS syncronsiation?)
    - u32  Blob created at
    - u32  [NRES] Size of reserved space (not including this field)
-   - bN   Reserved space of size NRES for future use.
+   - bN   Reserved space of size NRES for future use.  It holds a
+          sequence of items, each is:
+          - u16  Tag
+          - u16  [NITEM] Length of the item data
+          - bN   Item data of size NITEM
+          Readers shall skip unknown items.  Defined tags are:
+          1 = UID filter.  A Bloom filter over the user ids and mail
+              addresses, see below.
+          2 = Signature status binding, see below.
    - bN   Arbitrary space for example used to store data which is not
           part of the keyblock or certificate.  For example the v3 key
           IDs go here.
@@ -135,6 +145,40 @@
           faster on CPUs with dedicated SHA-1 support.
 
 
+** The UID filter
+
+   The UID filter allows a search for an exact user id or mail
+   address to skip a blob without looking at its user ids.  Its
+   item data is:
+
+   - byte [K] Number of hash functions
+   - byte RFU
+   - bN   Bitmap of NITEM-2 bytes; the bits are numbered from the
+          least significant bit of the first byte.
+
+   For each user id (for X.509 not the issuer) the string "u"
+   followed by the user id and, if it has a mail address, the string
+   "m" followed by the mail address in lowercase is added.  The bits
+   set for such a string are (H1 + I*H2) mod NBITS for I in 0..K-1,
+   where H1 is the low and H2, with its lowest bit set, the high 32
+   bits of the 64 bit FNV-1a hash of the string.
+
+** The signature status binding
+
+   The status values of the signatures of an OpenPGP blob are only
+   used if the blob has this item and its digest matches.  This
+   makes sure that the values were written for exactly this keyblock
+   and not, for example, by another tool which replaced the keyblock
+   but kept the signature information.  The item data is:
+
+   - byte Version (1)
+   - byte RFU
+   - b20  SHA-1 digest over the version byte, the NSIGS status
+          values as u32 and the keyblock.
+
+   The item is only written if at least one status value is not
+   zero.
+
 */
 
 
@@ -155,6 +199,7 @@
 
 
 #include "../common/gettime.h"
+#include "../common/mbox-util.h"
 
 
 /* special values of the signature status */
@@ -208,6 +253,7 @@ struct keyboxblob {
   byte *blob;
   size_t bloblen;
   off_t fileoffset;
+  int mapped;      /* BLOB points into a mapped file and is not owned.  */
 
   /* stuff used only by keybox_create_blob */
   unsigned char *serialbuf;
@@ -225,8 +271,15 @@ struct keyboxblob {
   struct keyid_list *temp_kids;
   struct membuf bufbuf; /* temporary store for the blob */
   struct membuf *buf;
+  const unsigned char *image; /* The OpenPGP keyblock while creating.  */
+  size_t imagelen;
 };
 
+/* The number of hash functions used for the UID filter.  */
+#define UIDFILTER_NHASH   6
+/* The maximum size of the bitmap of the UID filter.  */
+#define UIDFILTER_MAXSIZE 512
+
 
 
 /* A simple implementation of a dynamic buffer.  Use init_membuf() to
@@ -441,11 +494,17 @@ pgp_create_uid_part (KEYBOXBLOB blob, keybox_openpgp_info_t info)
 }
 
 
+/* Store the status values of the signatures.  SIGSTATUS is either
+ * NULL or an array with the number of signatures in the first item
+ * followed by one value for each signature; it is ignored if the
+ * number does not match.  */
 static void
-pgp_create_sig_part (KEYBOXBLOB blob, u32 *sigstatus)
+pgp_create_sig_part (KEYBOXBLOB blob, const u32 *sigstatus)
 {
   int n;
 
+  if (sigstatus && sigstatus[0] != blob->nsigs)
+    sigstatus = NULL;
   for (n=0; n < blob->nsigs; n++)
     {
       blob->sigs[n] = sigstatus? sigstatus[n+1] : 0;
@@ -534,6 +593,164 @@ release_kid_list (struct keyid_list *kl)
 
 
 
+/* Add the string TYPE,NAME to the UID filter with the bitmap BITS of
+   NBYTES.  */
+static void
+uidfilter_add (unsigned char *bits, size_t nbytes, int type,
+               const void *name, size_t namelen)
+{
+  u32 h1, h2;
+  unsigned int nbits = nbytes * 8;
+  unsigned int i, bit;
+
+  _keybox_uidfilter_hash (type, name, namelen, &h1, &h2);
+  for (i=0; i < UIDFILTER_NHASH; i++)
+    {
+      bit = (h1 + i * h2) % nbits;
+      bits[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+
+/* Return the mail address of the OpenPGP user id NAME of LEN at
+   R_OFF and R_LEN.  Returns false if it has no mail address.  This
+   must match what blob_cmp_mail considers the mail address.  */
+static int
+pgp_uid_mailbox (const unsigned char *name, size_t len,
+                 size_t *r_off, size_t *r_len)
+{
+  size_t off, pos;
+
+  for (off=0; len && name[off] != '<'; len--, off++)
+    ;
+  if (len < 2 || name[off] != '<')
+    return 0;
+  off++;
+  len--;
+  for (pos=off; len && name[pos] != '>'; len--, pos++)
+    ;
+  if (!len || name[pos] != '>' || off == pos)
+    return 0;
+  *r_off = off;
+  *r_len = pos - off;
+  return 1;
+}
+
+
+/* Create the UID filter item for the reserved space of BLOB of type
+   BLOBTYPE.  The item is put into the membuf A.  */
+static void
+create_uidfilter (KEYBOXBLOB blob, int blobtype, struct membuf *a)
+{
+  unsigned char *bits;
+  size_t nbytes;
+  const unsigned char *name;
+  size_t namelen, off, len;
+  int i;
+
+  if (blob->nuids < 1 + (blobtype == KEYBOX_BLOBTYPE_X509))
+    return;
+  if (blobtype == KEYBOX_BLOBTYPE_PGP && !blob->image)
+    return;
+
+  /* Use about 16 bits for each of the up to two strings per user id,
+     which gives a false positive rate of about 0.1%.  */
+  for (nbytes=16; nbytes < 4 * blob->nuids && nbytes < UIDFILTER_MAXSIZE; )
+    nbytes *= 2;
+  bits = xtrycalloc (1, nbytes);
+  if (!bits)
+    return;  /* The filter is optional.  */
+
+  for (i = (blobtype == KEYBOX_BLOBTYPE_X509); i < blob->nuids; i++)
+    {
+      if (blobtype == KEYBOX_BLOBTYPE_PGP)
+        name = blob->image + blob->uids[i].off;
+      else
+        name = (const unsigned char *)blob->uids[i].name;
+      namelen = blob->uids[i].len;
+      if (!name || !namelen)
+        continue;
+      uidfilter_add (bits, nbytes, 'u', name, namelen);
+
+      if (blobtype == KEYBOX_BLOBTYPE_X509)
+        {
+          if (namelen > 3 && name[0] == '<' && name[namelen-1] == '>')
+            uidfilter_add (bits, nbytes, 'm', name+1, namelen-2);
+        }
+      else if (pgp_uid_mailbox (name, namelen, &off, &len))
+        uidfilter_add (bits, nbytes, 'm', name+off, len);
+      else if (is_valid_mailbox_mem (name, namelen))
+        uidfilter_add (bits, nbytes, 'm', name, namelen);
+    }
+
+  put16 (a, KEYBOX_RES_UIDFILTER);
+  put16 (a, 2 + nbytes);
+  put8 (a, UIDFILTER_NHASH);
+  put8 (a, 0);
+  put_membuf (a, bits, nbytes);
+  xfree (bits);
+}
+
+
+/* Compute the digest of the signature status binding for the NSIGS
+   status values STATUS and the keyblock IMAGE of IMAGELEN and store
+   it at DIGEST, which must provide space for 20 bytes.  */
+void
+_keybox_sigstatus_digest (const u32 *status, size_t nsigs,
+                          const void *image, size_t imagelen,
+                          unsigned char *digest)
+{
+  gcry_md_hd_t md;
+  unsigned char buf[4];
+  size_t n;
+
+  if (gcry_md_open (&md, GCRY_MD_SHA1, 0))
+    {
+      /* Can't happen; make sure the digest never matches.  */
+      memset (digest, 0, 20);
+      return;
+    }
+  gcry_md_putc (md, SIGSTATUS_BINDING_VERSION);
+  for (n=0; n < nsigs; n++)
+    {
+      buf[0] = status[n] >> 24;
+      buf[1] = status[n] >> 16;
+      buf[2] = status[n] >>  8;
+      buf[3] = status[n];
+      gcry_md_write (md, buf, 4);
+    }
+  gcry_md_write (md, image, imagelen);
+  memcpy (digest, gcry_md_read (md, GCRY_MD_SHA1), 20);
+  gcry_md_close (md);
+}
+
+
+/* Create the signature status binding item for the reserved space of
+   the OpenPGP BLOB.  The item is put into the membuf A.  */
+static void
+create_sigstatus_binding (KEYBOXBLOB blob, struct membuf *a)
+{
+  unsigned char digest[20];
+  int i;
+
+  if (!blob->image)
+    return;
+  for (i=0; i < blob->nsigs; i++)
+    if (blob->sigs[i])
+      break;
+  if (i == blob->nsigs)
+    return;  /* Nothing to protect.  */
+
+  _keybox_sigstatus_digest (blob->sigs, blob->nsigs,
+                            blob->image, blob->imagelen, digest);
+  put16 (a, KEYBOX_RES_SIGSTATUS);
+  put16 (a, 2 + 20);
+  put8 (a, SIGSTATUS_BINDING_VERSION);
+  put8 (a, 0);
+  put_membuf (a, digest, 20);
+}
+
+
 static int
 create_blob_header (KEYBOXBLOB blob, int blobtype, int as_ephemeral)
 {
@@ -588,8 +805,25 @@ create_blob_header (KEYBOXBLOB blob, int blobtype, int as_ephemeral)
   put32 ( a, 0 );  /* time of next recheck */
   put32 ( a, 0 );  /* newest timestamp (none) */
   put32 ( a, make_timestamp() );  /* creation time */
-  put32 ( a, 0 );  /* size of reserved space */
-  /* reserved space (which is currently of size 0) */
+  /* The reserved space with the UID filter and the signature status
+     binding.  */
+  {
+    struct membuf res;
+    unsigned char *resbuf;
+    size_t reslen;
+
+    init_membuf (&res, 64);
+    create_uidfilter (blob, blobtype, &res);
+    if (blobtype == KEYBOX_BLOBTYPE_PGP)
+      create_sigstatus_binding (blob, &res);
+    resbuf = get_membuf (&res, &reslen);
+    if (!resbuf)
+      reslen = 0;  /* Out of core; the reserved space is optional.  */
+    put32 ( a, reslen );  /* size of reserved space */
+    if (reslen)
+      put_membuf (a, resbuf, reslen);
+    xfree (resbuf);
+  }
 
   /* space where we write keyIDs and other stuff so that the
      pointers can actually point to somewhere */
@@ -702,11 +936,39 @@ create_blob_finish (KEYBOXBLOB blob)
 
 
 
+/* Compute the two hash values used by the UID filter for the string
+   TYPE,NAME of NAMELEN at R_H1 and R_H2.  For TYPE 'm' the name is
+   taken in lowercase.  */
+void
+_keybox_uidfilter_hash (int type, const void *name, size_t namelen,
+                        u32 *r_h1, u32 *r_h2)
+{
+  const unsigned char *s = name;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  int c;
+
+  h ^= type;
+  h *= 0x100000001b3ULL;
+  for (; namelen; namelen--, s++)
+    {
+      c = *s;
+      if (type == 'm' && c >= 'A' && c <= 'Z')
+        c += 'a' - 'A';
+      h ^= c;
+      h *= 0x100000001b3ULL;
+    }
+  *r_h1 = h;
+  *r_h2 = (h >> 32) | 1;
+}
+
+
+
 gpg_error_t
 _keybox_create_openpgp_blob (KEYBOXBLOB *r_blob,
                              keybox_openpgp_info_t info,
                              const unsigned char *image,
                              size_t imagelen,
+                             const u32 *sigstatus,
                              int as_ephemeral)
 {
   gpg_error_t err;
@@ -752,11 +1014,15 @@ _keybox_create_openpgp_blob (KEYBOXBLOB *r_blob,
   if (err)
     goto leave;
   pgp_create_uid_part (blob, info);
-  pgp_create_sig_part (blob, NULL);
+  pgp_create_sig_part (blob, sigstatus);
 
   init_membuf (&blob->bufbuf, 1024);
   blob->buf = &blob->bufbuf;
+  blob->image = image;
+  blob->imagelen = imagelen;
   err = create_blob_header (blob, KEYBOX_BLOBTYPE_PGP, as_ephemeral);
+  blob->image = NULL;
+  blob->imagelen = 0;
   if (err)
     goto leave;
   err = pgp_create_blob_keyblock (blob, image, imagelen);
@@ -1017,11 +1283,47 @@ _keybox_release_blob (KEYBOXBLOB blob)
     xfree (blob->uids[i].name);
   xfree (blob->uids );
   xfree (blob->sigs );
-  xfree (blob->blob );
+  if (!blob->mapped)
+    xfree (blob->blob );
   xfree (blob );
 }
 
 
+/* Make BLOB, which must have been created by _keybox_new_blob, refer
+   to the IMAGELEN bytes at IMAGE from a mapped keybox file at file
+   offset OFF.  The image is not copied and must be valid as long as
+   BLOB is used or until _keybox_detach_blob has been called.  */
+void
+_keybox_set_mapped_blob (KEYBOXBLOB blob, const unsigned char *image,
+                         size_t imagelen, off_t off)
+{
+  if (!blob->mapped)
+    xfree (blob->blob);
+  blob->blob = (byte *)image;
+  blob->bloblen = imagelen;
+  blob->fileoffset = off;
+  blob->mapped = 1;
+}
+
+
+/* Make sure that BLOB has its own copy of the image.  */
+gpg_error_t
+_keybox_detach_blob (KEYBOXBLOB blob)
+{
+  byte *image;
+
+  if (!blob->mapped)
+    return 0;
+  image = xtrymalloc (blob->bloblen);
+  if (!image)
+    return gpg_error_from_syserror ();
+  memcpy (image, blob->blob, blob->bloblen);
+  blob->blob = image;
+  blob->mapped = 0;
+  return 0;
+}
+
+
 
 const unsigned char *
 _keybox_get_blob_image ( KEYBOXBLOB blob, size_t *n )
@@ -1051,6 +1353,9 @@ _keybox_update_header_blob (KEYBOXBLOB blob, int for_openpgp)
       blob->blob[20+2] = (val >>  8);
       blob->blob[20+3] = (val      );
 
+      /* The deleted blobs are removed by the maintenance run.  */
+      memset (blob->blob+24, 0, 4);
+
       if (for_openpgp)
         blob->blob[7] |= 0x02;  /* OpenPGP data may be available.  */
     }
@@ -33,14 +33,30 @@
 
 #include <sys/types.h> /* off_t */
 
+#if defined(HAVE_MMAP) && !defined(HAVE_W32_SYSTEM)
+# define KEYBOX_USE_MMAP 1
+#endif
+
 #include "../common/util.h"
 #include "keybox.h"
 
 
 typedef struct keyboxblob *KEYBOXBLOB;
 
+/* The maximum length of a blob we accept.  */
+#define IMAGELEN_LIMIT (5*1024*1024)
+
 
 typedef struct keybox_name *KB_NAME;
+
+/* Identification of a keybox file as used by its index.  */
+struct keybox_index_stamp_s
+{
+  uint64_t size;
+  uint64_t mtime;
+  uint64_t ino;
+};
+
 struct keybox_name
 {
   /* Link to the next resources, so that we can walk all
@@ -65,6 +81,12 @@ struct keybox_name
   /* Not yet used.  */
   int did_full_scan;
 
+  /* The state of the index file or NULL.  See keybox-index.c.  */
+  struct keybox_index_s *index;
+
+  /* A compress run has been deferred.  See keybox_defer_compress.  */
+  int compress_pending;
+
   /* The name of the resource file. */
   char fname[1];
 };
@@ -81,6 +103,8 @@ struct keybox_handle {
   KB_NAME kb;
   int secret;             /* this is for a secret keybox */
   FILE *fp;
+  const unsigned char *map; /* FP mapped into memory or NULL.  */
+  size_t maplen;            /* Length of MAP.  */
   int eof;
   int error;
   int ephemeral;
@@ -146,6 +170,7 @@ gpg_error_t _keybox_create_openpgp_blob (KEYBOXBLOB *r_blob,
                                          keybox_openpgp_info_t info,
                                          const unsigned char *image,
                                          size_t imagelen,
+                                         const u32 *sigstatus,
                                          int as_ephemeral);
 #ifdef KEYBOX_WITH_X509
 int _keybox_create_x509_blob (KEYBOXBLOB *r_blob, ksba_cert_t cert,
@@ -156,9 +181,36 @@ int  _keybox_new_blob (KEYBOXBLOB *r_blob,
                        unsigned char *image, size_t imagelen,
                        off_t off);
 void _keybox_release_blob (KEYBOXBLOB blob);
+void _keybox_set_mapped_blob (KEYBOXBLOB blob, const unsigned char *image,
+                              size_t imagelen, off_t off);
+gpg_error_t _keybox_detach_blob (KEYBOXBLOB blob);
 const unsigned char *_keybox_get_blob_image (KEYBOXBLOB blob, size_t *n);
 off_t _keybox_get_blob_fileoffset (KEYBOXBLOB blob);
 void _keybox_update_header_blob (KEYBOXBLOB blob, int for_openpgp);
+void _keybox_uidfilter_hash (int type, const void *name, size_t namelen,
+                             u32 *r_h1, u32 *r_h2);
+void _keybox_sigstatus_digest (const u32 *status, size_t nsigs,
+                               const void *image, size_t imagelen,
+                               unsigned char *digest);
+
+/* The tags of the items in the reserved space of a blob.  */
+#define KEYBOX_RES_UIDFILTER 1
+#define KEYBOX_RES_SIGSTATUS 2
+
+/* The version of the signature status binding.  */
+#define SIGSTATUS_BINDING_VERSION 1
+
+/*-- keybox-index.c --*/
+void _keybox_index_disable_mmap (int yes);
+void _keybox_index_get_stamp (KB_NAME kb,
+                              struct keybox_index_stamp_s *r_stamp);
+gpg_error_t _keybox_index_lookup (KEYBOX_HANDLE hd,
+                                  KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+                                  off_t **r_offsets, size_t *r_noffsets);
+void _keybox_index_update (KB_NAME kb,
+                           const struct keybox_index_stamp_s *oldstamp,
+                           off_t off, size_t oldlen, size_t newlen,
+                           KEYBOXBLOB blob);
 
 /*-- keybox-openpgp.c --*/
 gpg_error_t _keybox_parse_openpgp (const unsigned char *image, size_t imagelen,
@@ -169,6 +221,9 @@ void _keybox_destroy_openpgp_info (keybox_openpgp_info_t info);
 
 /*-- keybox-file.c --*/
 int _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted);
+void _keybox_map_file (KEYBOX_HANDLE hd);
+void _keybox_unmap_file (KEYBOX_HANDLE hd);
+int _keybox_read_mapped_blob (KEYBOX_HANDLE hd, off_t *r_pos, KEYBOXBLOB blob);
 int _keybox_write_blob (KEYBOXBLOB blob, FILE *fp);
 
 /*-- keybox-search.c --*/
@@ -176,6 +231,9 @@ gpg_err_code_t _keybox_get_flag_location (const unsigned char *buffer,
                                           size_t length,
                                           int what,
                                           size_t *flag_off, size_t *flag_size);
+#ifdef KEYBOX_WITH_X509
+gpg_error_t _keybox_get_x509_keygrip (KEYBOXBLOB blob, unsigned char *grip);
+#endif /*KEYBOX_WITH_X509*/
 
 static inline int
 blob_get_type (KEYBOXBLOB blob)
@@ -193,6 +251,7 @@ blob_get_type (KEYBOXBLOB blob)
 
 /*-- keybox-dump.c --*/
 int _keybox_dump_blob (KEYBOXBLOB blob, FILE *fp);
+void _keybox_dump_set_threads (int nthreads);
 int _keybox_dump_file (const char *filename, int stats_only, FILE *outfp);
 int _keybox_dump_find_dups (const char *filename, int print_them, FILE *outfp);
 int _keybox_dump_cut_records (const char *filename, unsigned long from,
@@ -33,6 +33,16 @@ char *bin2hexcolon (const void *buffer, size_t length, char *stringbuf);
 #define get32(a) buf32_to_ulong ((a))
 #define get16(a) buf16_to_ulong ((a))
 
+#if defined(KEYBOX_WITH_THREADS) && defined(KEYBOX_USE_MMAP)
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <npth.h>
+# define USE_PARALLEL_SCAN 1
+#endif
+
+/* The number of threads set by _keybox_dump_set_threads.  */
+static int dump_threads;
+
 
 void
 print_string (FILE *fp, const byte *p, size_t n, int delim)
@@ -63,20 +73,21 @@ print_string (FILE *fp, const byte *p, size_t n, int delim)
 }
 
 
+/* Check the checksum at the end of the blob in BUFFER of LENGTH bytes
+   with UNHASHED bytes not covered by the hash.  Returns 1 if the
+   checksum is valid, 0 if it is bad, -1 if UNHASHED is too short and
+   -2 if the blob is too short for a checksum.  The length of the
+   checksum is stored at R_HASHLEN.  */
 static int
-print_checksum (const byte *buffer, size_t length, size_t unhashed, FILE *fp)
+check_checksum (const byte *buffer, size_t length, size_t unhashed,
+                int *r_hashlen)
 {
-  const byte *p;
-  int i;
   int hashlen;
   unsigned char digest[20];
 
-  fprintf (fp, "Checksum: ");
+  *r_hashlen = 0;
   if (unhashed && unhashed < 20)
-    {
-      fputs ("[specified unhashed sized too short]\n", fp);
-      return 0;
-    }
+    return -1;
   if (!unhashed)
     {
       unhashed = 16;
@@ -85,6 +96,33 @@ print_checksum (const byte *buffer, size_t length, size_t unhashed, FILE *fp)
   else
     hashlen = 20;
   if (length < 5+unhashed)
+    return -2;
+  *r_hashlen = hashlen;
+
+  if (hashlen == 16) /* Compatibility method.  */
+    gcry_md_hash_buffer (GCRY_MD_MD5, digest, buffer, length - 16);
+  else
+    gcry_md_hash_buffer (GCRY_MD_SHA1, digest, buffer, length - unhashed);
+  return !memcmp (buffer + length - hashlen, digest, hashlen);
+}
+
+
+static int
+print_checksum (const byte *buffer, size_t length, size_t unhashed, FILE *fp)
+{
+  const byte *p;
+  int i;
+  int hashlen;
+  int valid;
+
+  fprintf (fp, "Checksum: ");
+  valid = check_checksum (buffer, length, unhashed, &hashlen);
+  if (valid == -1)
+    {
+      fputs ("[specified unhashed sized too short]\n", fp);
+      return 0;
+    }
+  if (valid == -2)
     {
       fputs ("[blob too short for a checksum]\n", fp);
       return 0;
@@ -94,22 +132,10 @@ print_checksum (const byte *buffer, size_t length, size_t unhashed, FILE *fp)
   for (i=0; i < hashlen; p++, i++)
     fprintf (fp, "%02x", *p);
 
-  if (hashlen == 16) /* Compatibility method.  */
-    {
-      gcry_md_hash_buffer (GCRY_MD_MD5, digest, buffer, length - 16);
-      if (!memcmp (buffer + length - 16, digest, 16))
-        fputs (" [valid]\n", fp);
-      else
-        fputs (" [bad]\n", fp);
-    }
+  if (valid)
+    fputs (" [valid]\n", fp);
   else
-    {
-      gcry_md_hash_buffer (GCRY_MD_SHA1, digest, buffer, length - unhashed);
-      if (!memcmp (buffer + length - hashlen, digest, hashlen))
-        fputs (" [valid]\n", fp);
-      else
-        fputs (" [bad]\n", fp);
-    }
+    fputs (" [bad]\n", fp);
   return 0;
 }
 
@@ -404,6 +430,24 @@ _keybox_dump_blob (KEYBOXBLOB blob, FILE *fp)
   fprintf (fp, "Created-At: %lu\n", n );
   n = get32 (p );
   fprintf (fp, "Reserved-Space: %lu\n", n );
+  if (p + 4 + n <= buffer + length)
+    {
+      const byte *item = p + 4;
+      ulong nres = n;
+      ulong itemlen;
+
+      for (; nres >= 4; item += 4 + itemlen, nres -= 4 + itemlen)
+        {
+          itemlen = get16 (item + 2);
+          if (itemlen > nres - 4)
+            break;
+          if (get16 (item) == KEYBOX_RES_UIDFILTER && itemlen > 2)
+            fprintf (fp, "Uid-Filter: %lu bits, %d hashes\n",
+                     (itemlen - 2) * 8, item[4]);
+          else if (get16 (item) == KEYBOX_RES_SIGSTATUS && itemlen >= 2)
+            fprintf (fp, "Sig-Status-Binding: version %d\n", item[4]);
+        }
+    }
 
   if (n >= 4 && unhashed >= 24)
     {
@@ -415,18 +459,16 @@ _keybox_dump_blob (KEYBOXBLOB blob, FILE *fp)
 }
 
 
-/* Compute the SHA-1 checksum of the rawdata in BLOB and put it into
-   DIGEST. */
+/* Compute the SHA-1 checksum of the rawdata in the blob BUFFER of
+   LENGTH bytes and put it into DIGEST. */
 static int
-hash_blob_rawdata (KEYBOXBLOB blob, unsigned char *digest)
+hash_blob_rawdata (const unsigned char *buffer, size_t length,
+                   unsigned char *digest)
 {
-  const unsigned char *buffer;
-  size_t n, length;
+  size_t n;
   int type;
   ulong rawdata_off, rawdata_len;
 
-  buffer = _keybox_get_blob_image (blob, &length);
-
   if (length < 32)
     return -1;
   n = get32 (buffer);
@@ -454,7 +496,7 @@ hash_blob_rawdata (KEYBOXBLOB blob, unsigned char *digest)
   rawdata_len = get32 (buffer + 12);
 
   if (rawdata_off > length || rawdata_len > length
-      || rawdata_off+rawdata_off > length)
+      || rawdata_off+rawdata_len > length)
     return -1; /* Out of bounds.  */
 
   gcry_md_hash_buffer (GCRY_MD_SHA1, digest, buffer+rawdata_off, rawdata_len);
@@ -476,17 +518,17 @@ struct file_stats_s
   unsigned long secret_flagged;
   unsigned long ephemeral_flagged;
   unsigned long skipped_long_blobs;
+  unsigned long bad_checksums;
 };
 
 static int
-update_stats (KEYBOXBLOB blob, struct file_stats_s *s)
+update_stats (const unsigned char *buffer, size_t length,
+              struct file_stats_s *s)
 {
-  const unsigned char *buffer;
-  size_t length;
-  int type;
+  int type, hashlen;
   unsigned long n;
+  ulong rawdata_off, rawdata_len;
 
-  buffer = _keybox_get_blob_image (blob, &length);
   if (length < 32)
     {
       s->too_short_blobs++;
@@ -537,11 +579,57 @@ update_stats (KEYBOXBLOB blob, struct file_stats_s *s)
   else
     s->non_flagged++;
 
+  rawdata_off = get32 (buffer + 8);
+  rawdata_len = get32 (buffer + 12);
+  if (rawdata_off > length || rawdata_len > length
+      || rawdata_off+rawdata_len > length
+      || check_checksum (buffer, length,
+                         length - rawdata_off - rawdata_len, &hashlen) != 1)
+    s->bad_checksums++;
+
   return 0;
 }
 
 
-
+static void
+print_stats (const struct file_stats_s *stats, FILE *outfp)
+{
+  fprintf (outfp,
+           "Total number of blobs: %8lu\n"
+           "               header: %8lu\n"
+           "                empty: %8lu\n"
+           "              openpgp: %8lu\n"
+           "                 x509: %8lu\n"
+           "          non flagged: %8lu\n"
+           "       secret flagged: %8lu\n"
+           "    ephemeral flagged: %8lu\n",
+           stats->total_blob_count,
+           stats->header_blob_count,
+           stats->empty_blob_count,
+           stats->pgp_blob_count,
+           stats->x509_blob_count,
+           stats->non_flagged,
+           stats->secret_flagged,
+           stats->ephemeral_flagged);
+  if (stats->skipped_long_blobs)
+    fprintf (outfp, "   skipped long blobs: %8lu\n",
+             stats->skipped_long_blobs);
+  if (stats->unknown_blob_count)
+    fprintf (outfp, "   unknown blob types: %8lu\n",
+             stats->unknown_blob_count);
+  if (stats->too_short_blobs)
+    fprintf (outfp, "      too short blobs: %8lu (error)\n",
+             stats->too_short_blobs);
+  if (stats->too_large_blobs)
+    fprintf (outfp, "      too large blobs: %8lu (error)\n",
+             stats->too_large_blobs);
+  if (stats->bad_checksums)
+    fprintf (outfp, "        bad checksums: %8lu (error)\n",
+             stats->bad_checksums);
+}
+
+
+
 static FILE *
 open_file (const char **filename, FILE *outfp)
 {
@@ -565,6 +653,591 @@ open_file (const char **filename, FILE *outfp)
 
 
 
+struct dupitem_s
+{
+  unsigned long recno;
+  unsigned char digest[20];
+};
+
+
+static int
+cmp_dupitems (const void *arg_a, const void *arg_b)
+{
+  struct dupitem_s *a = (struct dupitem_s *)arg_a;
+  struct dupitem_s *b = (struct dupitem_s *)arg_b;
+  int cmp;
+
+  cmp = memcmp (a->digest, b->digest, 20);
+  if (!cmp)
+    cmp = a->recno < b->recno? -1 : a->recno > b->recno;
+  return cmp;
+}
+
+
+/* Print the groups of items with the same digest from the sorted
+   array DUPITEMS of COUNT items.  */
+static void
+print_dups (const struct dupitem_s *dupitems, size_t count, FILE *outfp)
+{
+  size_t lastn, n;
+  char fprbuf[3*20+1];
+
+  for (lastn=0, n=1; n < count; lastn=n, n++)
+    {
+      if (!memcmp (dupitems[lastn].digest, dupitems[n].digest, 20))
+        {
+          bin2hexcolon (dupitems[lastn].digest, 20, fprbuf);
+          fprintf (outfp, "fpr=%s recno=%lu", fprbuf, dupitems[lastn].recno);
+          do
+            fprintf (outfp, " %lu", dupitems[n].recno);
+          while (++n < count
+                 && !memcmp (dupitems[lastn].digest, dupitems[n].digest, 20));
+          putc ('\n', outfp);
+          n--;
+        }
+    }
+}
+
+
+
+#ifdef USE_PARALLEL_SCAN
+/* The parallel scanner used for --stats and --find-dups.  The file is
+ * mapped into memory and the main thread walks the chain of blob
+ * lengths to cut it at blob boundaries into chunks of about
+ * SCAN_CHUNK_SIZE bytes.  The chunks are queued for a set of nPth
+ * threads which update their own statistics and duplicate lists
+ * without holding the nPth lock.  Because the main thread counts the
+ * records while walking, each chunk already knows the record number
+ * of its first blob and the results can simply be merged at the end.
+ * The worker threads must not use stdio or the log functions.  */
+
+/* The maximum number of scan threads.  */
+#define MAX_SCAN_THREADS 64
+
+/* The number of bytes handed out to a worker at once.  */
+#define SCAN_CHUNK_SIZE (16*1024*1024)
+
+/* A range of complete blobs in the mapped file.  */
+struct scan_chunk_s
+{
+  struct scan_chunk_s *next;
+  size_t off;                 /* Offset of the first blob.  */
+  size_t end;                 /* Offset after the last blob.  */
+  unsigned long first_recno;  /* Record number of the first blob.  */
+};
+
+struct scan_s
+{
+  const unsigned char *map;
+  size_t maplen;
+  int find_dups;              /* Collect digests instead of stats.  */
+
+  /* Lock and condition protecting the fields below.  */
+  npth_mutex_t lock;
+  npth_cond_t cond;
+  struct scan_chunk_s *head;
+  struct scan_chunk_s *tail;
+  int eof;                    /* No more chunks will be queued.  */
+};
+
+/* The state and the results of one worker thread.  */
+struct scan_worker_s
+{
+  struct scan_s *scan;
+  npth_t thread;
+  gpg_error_t err;            /* Set on a memory allocation failure.  */
+  struct file_stats_s stats;
+  struct dupitem_s *dupitems;
+  size_t dupitems_size;
+  size_t dupitems_count;
+  unsigned long *badrecs;     /* Records which could not be hashed.  */
+  size_t badrecs_size;
+  size_t badrecs_count;
+};
+
+
+static void
+init_npth (void)
+{
+  static int initialized;
+
+  if (!initialized)
+    {
+      initialized = 1;
+      npth_init ();
+    }
+}
+
+
+static void
+add_stats (struct file_stats_s *d, const struct file_stats_s *s)
+{
+  d->too_short_blobs    += s->too_short_blobs;
+  d->too_large_blobs    += s->too_large_blobs;
+  d->total_blob_count   += s->total_blob_count;
+  d->empty_blob_count   += s->empty_blob_count;
+  d->header_blob_count  += s->header_blob_count;
+  d->pgp_blob_count     += s->pgp_blob_count;
+  d->x509_blob_count    += s->x509_blob_count;
+  d->unknown_blob_count += s->unknown_blob_count;
+  d->non_flagged        += s->non_flagged;
+  d->secret_flagged     += s->secret_flagged;
+  d->ephemeral_flagged  += s->ephemeral_flagged;
+  d->skipped_long_blobs += s->skipped_long_blobs;
+  d->bad_checksums      += s->bad_checksums;
+}
+
+
+static int
+cmp_recnos (const void *arg_a, const void *arg_b)
+{
+  unsigned long a = *(const unsigned long *)arg_a;
+  unsigned long b = *(const unsigned long *)arg_b;
+
+  return a < b? -1 : a > b;
+}
+
+
+/* Process the blobs of CHUNK.  This runs without the nPth lock.  */
+static void
+scan_chunk (struct scan_worker_s *w, struct scan_chunk_s *chunk)
+{
+  const unsigned char *map = w->scan->map;
+  size_t pos = chunk->off;
+  size_t imagelen;
+  unsigned long recno = chunk->first_recno;
+  unsigned char zerodigest[20];
+  unsigned char digest[20];
+  void *tmp;
+
+  memset (zerodigest, 0, sizeof zerodigest);
+
+  while (pos < chunk->end)
+    {
+      imagelen = buf32_to_size_t (map + pos);
+      if (!map[pos+4])
+        ; /* Skipped like _keybox_read_blob does.  */
+      else if (imagelen > IMAGELEN_LIMIT)
+        recno++;  /* Already counted by scan_walk.  */
+      else if (!w->scan->find_dups)
+        {
+          update_stats (map + pos, imagelen, &w->stats);
+          recno++;
+        }
+      else if (hash_blob_rawdata (map + pos, imagelen, digest))
+        {
+          if (w->badrecs_count >= w->badrecs_size)
+            {
+              w->badrecs_size += 100;
+              tmp = realloc (w->badrecs,
+                             w->badrecs_size * sizeof *w->badrecs);
+              if (!tmp)
+                {
+                  w->err = gpg_error_from_syserror ();
+                  return;
+                }
+              w->badrecs = tmp;
+            }
+          w->badrecs[w->badrecs_count++] = recno++;
+        }
+      else
+        {
+          if (memcmp (digest, zerodigest, 20))
+            {
+              if (w->dupitems_count >= w->dupitems_size)
+                {
+                  w->dupitems_size += 10000;
+                  tmp = realloc (w->dupitems,
+                                 w->dupitems_size * sizeof *w->dupitems);
+                  if (!tmp)
+                    {
+                      w->err = gpg_error_from_syserror ();
+                      return;
+                    }
+                  w->dupitems = tmp;
+                }
+              w->dupitems[w->dupitems_count].recno = recno;
+              memcpy (w->dupitems[w->dupitems_count].digest, digest, 20);
+              w->dupitems_count++;
+            }
+          recno++;
+        }
+
+      if (imagelen >= chunk->end - pos)
+        break;
+      pos += imagelen;
+    }
+}
+
+
+static void *
+scan_worker_thread (void *opaque)
+{
+  struct scan_worker_s *w = opaque;
+  struct scan_s *scan = w->scan;
+  struct scan_chunk_s *chunk;
+
+  npth_mutex_lock (&scan->lock);
+  for (;;)
+    {
+      while (!scan->head && !scan->eof)
+        npth_cond_wait (&scan->cond, &scan->lock);
+      chunk = scan->head;
+      if (!chunk)
+        break; /* All chunks have been processed.  */
+      scan->head = chunk->next;
+      if (!scan->head)
+        scan->tail = NULL;
+      npth_mutex_unlock (&scan->lock);
+
+      npth_unprotect ();
+      if (!w->err)
+        scan_chunk (w, chunk);
+      free (chunk);
+      npth_protect ();
+
+      npth_mutex_lock (&scan->lock);
+    }
+  npth_mutex_unlock (&scan->lock);
+
+  /* Sort our part of the digests while the others are still busy.  */
+  if (w->dupitems_count)
+    {
+      npth_unprotect ();
+      qsort (w->dupitems, w->dupitems_count, sizeof *w->dupitems,
+             cmp_dupitems);
+      npth_protect ();
+    }
+
+  return NULL;
+}
+
+
+/* Queue the blobs from offset OFF up to END with the record number
+   FIRST_RECNO for the first one.  */
+static gpg_error_t
+scan_queue_chunk (struct scan_s *scan, size_t off, size_t end,
+                  unsigned long first_recno)
+{
+  struct scan_chunk_s *chunk;
+
+  chunk = malloc (sizeof *chunk);
+  if (!chunk)
+    return gpg_error_from_syserror ();
+  chunk->next = NULL;
+  chunk->off = off;
+  chunk->end = end;
+  chunk->first_recno = first_recno;
+
+  npth_protect ();
+  npth_mutex_lock (&scan->lock);
+  if (scan->tail)
+    scan->tail->next = chunk;
+  else
+    scan->head = chunk;
+  scan->tail = chunk;
+  npth_cond_signal (&scan->cond);
+  npth_mutex_unlock (&scan->lock);
+  npth_unprotect ();
+  return 0;
+}
+
+
+/* Walk the blobs of SCAN and queue them in chunks.  This stops at the
+   same errors as the sequential loop over _keybox_read_blob.  The
+   number of too long blobs skipped in stats mode is added to
+   R_SKIPPED.  */
+static gpg_error_t
+scan_walk (struct scan_s *scan, unsigned long *r_skipped)
+{
+  gpg_error_t err = 0;
+  const unsigned char *map = scan->map;
+  size_t maplen = scan->maplen;
+  size_t pos, start, imagelen;
+  unsigned long recno, first_recno;
+
+  /* Don't block the workers while we walk the file.  */
+  npth_unprotect ();
+
+  pos = start = 0;
+  recno = first_recno = 0;
+  while (maplen - pos >= 5)
+    {
+      imagelen = buf32_to_size_t (map + pos);
+      if (imagelen < 5)
+        {
+          err = gpg_error (GPG_ERR_TOO_SHORT);
+          break;
+        }
+      if (!map[pos+4])
+        ; /* Empty blob.  */
+      else if (imagelen > IMAGELEN_LIMIT)
+        {
+          if (scan->find_dups)
+            {
+              err = gpg_error (GPG_ERR_TOO_LARGE);
+              break;
+            }
+          (*r_skipped)++;
+          recno++;
+        }
+      else if (imagelen > maplen - pos)
+        break;  /* Truncated blob; ignored like at EOF.  */
+      else
+        recno++;
+
+      if (imagelen >= maplen - pos)
+        {
+          pos = maplen;
+          break;
+        }
+      pos += imagelen;
+
+      if (pos - start >= SCAN_CHUNK_SIZE)
+        {
+          err = scan_queue_chunk (scan, start, pos, first_recno);
+          if (err)
+            break;
+          start = pos;
+          first_recno = recno;
+        }
+    }
+  if (pos > start)
+    {
+      gpg_error_t tmperr = scan_queue_chunk (scan, start, pos, first_recno);
+      if (!err)
+        err = tmperr;
+    }
+
+  npth_protect ();
+  return err;
+}
+
+
+/* Merge the sorted digest lists of the NWORKERS workers into a new
+   array stored at R_DUPITEMS.  The lists of the workers are
+   released.  */
+static gpg_error_t
+merge_dupitems (struct scan_worker_s *workers, int nworkers,
+                struct dupitem_s **r_dupitems, size_t *r_count)
+{
+  struct dupitem_s *dupitems;
+  size_t *idx;
+  size_t count, n;
+  int i, best;
+
+  *r_dupitems = NULL;
+  *r_count = 0;
+  for (count=0, i=0; i < nworkers; i++)
+    count += workers[i].dupitems_count;
+  dupitems = malloc ((count? count : 1) * sizeof *dupitems);
+  idx = calloc (nworkers, sizeof *idx);
+  if (!dupitems || !idx)
+    {
+      gpg_error_t err = gpg_error_from_syserror ();
+      free (dupitems);
+      free (idx);
+      return err;
+    }
+
+  for (n=0; n < count; n++)
+    {
+      best = -1;
+      for (i=0; i < nworkers; i++)
+        if (idx[i] < workers[i].dupitems_count
+            && (best == -1
+                || cmp_dupitems (workers[i].dupitems + idx[i],
+                                 workers[best].dupitems + idx[best]) < 0))
+          best = i;
+      dupitems[n] = workers[best].dupitems[idx[best]++];
+    }
+
+  free (idx);
+  for (i=0; i < nworkers; i++)
+    {
+      free (workers[i].dupitems);
+      workers[i].dupitems = NULL;
+      workers[i].dupitems_count = 0;
+    }
+  *r_dupitems = dupitems;
+  *r_count = count;
+  return 0;
+}
+
+
+/* Scan FILENAME with NTHREADS threads and print the statistics or,
+   if FIND_DUPS is set, the duplicates to OUTFP.  Returns
+   GPG_ERR_NOT_SUPPORTED if the file can't be mapped or no thread can
+   be started; the caller shall then scan sequentially.  */
+static gpg_error_t
+scan_file_parallel (const char *filename, int find_dups, int nthreads,
+                    FILE *outfp)
+{
+  gpg_error_t err, rc;
+  FILE *fp;
+  struct stat st;
+  void *map;
+  struct scan_s scan;
+  struct scan_worker_s *workers;
+  int nworkers, i, ret;
+  npth_attr_t tattr;
+  struct file_stats_s stats;
+  unsigned long *badrecs = NULL;
+  size_t nbadrecs, n;
+  struct dupitem_s *dupitems;
+  size_t dupitems_count;
+
+  if (nthreads > MAX_SCAN_THREADS)
+    nthreads = MAX_SCAN_THREADS;
+
+  if (!(fp = open_file (&filename, outfp)))
+    return gpg_error_from_syserror ();
+  if (fstat (fileno (fp), &st) || !S_ISREG (st.st_mode)
+      || !st.st_size || (uint64_t)st.st_size > (size_t)(-1))
+    {
+      fclose (fp);
+      return gpg_error (GPG_ERR_NOT_SUPPORTED);
+    }
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fileno (fp), 0);
+  if (map == MAP_FAILED)
+    {
+      fclose (fp);
+      return gpg_error (GPG_ERR_NOT_SUPPORTED);
+    }
+
+  workers = calloc (nthreads, sizeof *workers);
+  if (!workers)
+    {
+      err = gpg_error_from_syserror ();
+      munmap (map, st.st_size);
+      fclose (fp);
+      return err;
+    }
+
+  init_npth ();
+  memset (&scan, 0, sizeof scan);
+  scan.map = map;
+  scan.maplen = st.st_size;
+  scan.find_dups = find_dups;
+  npth_mutex_init (&scan.lock, NULL);
+  npth_cond_init (&scan.cond, NULL);
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (nworkers=0; nworkers < nthreads; nworkers++)
+    {
+      workers[nworkers].scan = &scan;
+      ret = npth_create (&workers[nworkers].thread, &tattr,
+                         scan_worker_thread, workers + nworkers);
+      if (ret)
+        break; /* Go ahead with the threads we have.  */
+    }
+  npth_attr_destroy (&tattr);
+
+  memset (&stats, 0, sizeof stats);
+  if (nworkers)
+    rc = scan_walk (&scan, &stats.skipped_long_blobs);
+  else
+    rc = gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  npth_mutex_lock (&scan.lock);
+  scan.eof = 1;
+  npth_cond_broadcast (&scan.cond);
+  npth_mutex_unlock (&scan.lock);
+  for (i=0; i < nworkers; i++)
+    npth_join (workers[i].thread, NULL);
+  npth_cond_destroy (&scan.cond);
+  npth_mutex_destroy (&scan.lock);
+
+  munmap (map, st.st_size);
+  fclose (fp);
+
+  if (!nworkers)
+    {
+      free (workers);
+      return rc;
+    }
+
+  for (err=0, nbadrecs=0, i=0; i < nworkers; i++)
+    {
+      add_stats (&stats, &workers[i].stats);
+      nbadrecs += workers[i].badrecs_count;
+      if (!err)
+        err = workers[i].err;
+    }
+  if (err)
+    {
+      fprintf (outfp, "error allocating array for '%s': %s\n",
+               filename, gpg_strerror (err));
+      rc = err;
+      goto leave;
+    }
+
+  if (!find_dups)
+    {
+      if (rc)
+        fprintf (outfp, "# error reading '%s': %s\n",
+                 filename, gpg_strerror (rc));
+      print_stats (&stats, outfp);
+      goto leave;
+    }
+
+  if (nbadrecs)
+    {
+      badrecs = malloc (nbadrecs * sizeof *badrecs);
+      if (!badrecs)
+        {
+          err = gpg_error_from_syserror ();
+          fprintf (outfp, "error allocating array for '%s': %s\n",
+                   filename, gpg_strerror (err));
+          rc = err;
+          goto leave;
+        }
+      for (nbadrecs=0, i=0; i < nworkers; i++)
+        for (n=0; n < workers[i].badrecs_count; n++)
+          badrecs[nbadrecs++] = workers[i].badrecs[n];
+      qsort (badrecs, nbadrecs, sizeof *badrecs, cmp_recnos);
+      for (n=0; n < nbadrecs; n++)
+        fprintf (outfp, "error in blob %ld of '%s'\n", badrecs[n], filename);
+    }
+  if (rc)
+    fprintf (outfp, "error reading '%s': %s\n", filename, gpg_strerror (rc));
+
+  err = merge_dupitems (workers, nworkers, &dupitems, &dupitems_count);
+  if (err)
+    {
+      fprintf (outfp, "error allocating array for '%s': %s\n",
+               filename, gpg_strerror (err));
+      rc = err;
+      goto leave;
+    }
+  print_dups (dupitems, dupitems_count, outfp);
+  free (dupitems);
+
+ leave:
+  for (i=0; i < nworkers; i++)
+    {
+      free (workers[i].dupitems);
+      free (workers[i].badrecs);
+    }
+  free (workers);
+  free (badrecs);
+  return rc;
+}
+#endif /*USE_PARALLEL_SCAN*/
+
+
+/* Set the number of threads used by _keybox_dump_file for the
+   statistics and by _keybox_dump_find_dups.  With a value of 1 or
+   less, or if threads are not supported by this build, the file is
+   read sequentially.  */
+void
+_keybox_dump_set_threads (int nthreads)
+{
+  dump_threads = nthreads;
+}
+
+
 int
 _keybox_dump_file (const char *filename, int stats_only, FILE *outfp)
 {
@@ -573,6 +1246,17 @@ _keybox_dump_file (const char *filename, int stats_only, FILE *outfp)
   int rc;
   unsigned long count = 0;
   struct file_stats_s stats;
+  const unsigned char *buffer;
+  size_t length;
+
+#ifdef USE_PARALLEL_SCAN
+  if (stats_only && filename && dump_threads > 1)
+    {
+      rc = scan_file_parallel (filename, 0, dump_threads, outfp);
+      if (gpg_err_code (rc) != GPG_ERR_NOT_SUPPORTED)
+        return rc;
+    }
+#endif /*USE_PARALLEL_SCAN*/
 
   memset (&stats, 0, sizeof stats);
 
@@ -600,7 +1284,8 @@ _keybox_dump_file (const char *filename, int stats_only, FILE *outfp)
 
       if (stats_only)
         {
-          update_stats (blob, &stats);
+          buffer = _keybox_get_blob_image (blob, &length);
+          update_stats (buffer, length, &stats);
         }
       else
         {
@@ -620,60 +1305,12 @@ _keybox_dump_file (const char *filename, int stats_only, FILE *outfp)
     fclose (fp);
 
   if (stats_only)
-    {
-      fprintf (outfp,
-               "Total number of blobs: %8lu\n"
-               "               header: %8lu\n"
-               "                empty: %8lu\n"
-               "              openpgp: %8lu\n"
-               "                 x509: %8lu\n"
-               "          non flagged: %8lu\n"
-               "       secret flagged: %8lu\n"
-               "    ephemeral flagged: %8lu\n",
-               stats.total_blob_count,
-               stats.header_blob_count,
-               stats.empty_blob_count,
-               stats.pgp_blob_count,
-               stats.x509_blob_count,
-               stats.non_flagged,
-               stats.secret_flagged,
-               stats.ephemeral_flagged);
-        if (stats.skipped_long_blobs)
-          fprintf (outfp, "   skipped long blobs: %8lu\n",
-                   stats.skipped_long_blobs);
-        if (stats.unknown_blob_count)
-          fprintf (outfp, "   unknown blob types: %8lu\n",
-                   stats.unknown_blob_count);
-        if (stats.too_short_blobs)
-          fprintf (outfp, "      too short blobs: %8lu (error)\n",
-                   stats.too_short_blobs);
-        if (stats.too_large_blobs)
-          fprintf (outfp, "      too large blobs: %8lu (error)\n",
-                   stats.too_large_blobs);
-    }
+    print_stats (&stats, outfp);
 
   return rc;
 }
 
 
-
-struct dupitem_s
-{
-  unsigned long recno;
-  unsigned char digest[20];
-};
-
-
-static int
-cmp_dupitems (const void *arg_a, const void *arg_b)
-{
-  struct dupitem_s *a = (struct dupitem_s *)arg_a;
-  struct dupitem_s *b = (struct dupitem_s *)arg_b;
-
-  return memcmp (a->digest, b->digest, 20);
-}
-
-
 int
 _keybox_dump_find_dups (const char *filename, int print_them, FILE *outfp)
 {
@@ -683,11 +1320,21 @@ _keybox_dump_find_dups (const char *filename, int print_them, FILE *outfp)
   unsigned long recno = 0;
   unsigned char zerodigest[20];
   struct dupitem_s *dupitems;
-  size_t dupitems_size, dupitems_count, lastn, n;
-  char fprbuf[3*20+1];
+  size_t dupitems_size, dupitems_count;
+  const unsigned char *buffer;
+  size_t length;
 
   (void)print_them;
 
+#ifdef USE_PARALLEL_SCAN
+  if (filename && dump_threads > 1)
+    {
+      rc = scan_file_parallel (filename, 1, dump_threads, outfp);
+      if (gpg_err_code (rc) != GPG_ERR_NOT_SUPPORTED)
+        return rc;
+    }
+#endif /*USE_PARALLEL_SCAN*/
+
   memset (zerodigest, 0, sizeof zerodigest);
 
   if (!(fp = open_file (&filename, outfp)))
@@ -708,7 +1355,8 @@ _keybox_dump_find_dups (const char *filename, int print_them, FILE *outfp)
     {
       unsigned char digest[20];
 
-      if (hash_blob_rawdata (blob, digest))
+      buffer = _keybox_get_blob_image (blob, &length);
+      if (hash_blob_rawdata (buffer, length, digest))
         fprintf (outfp, "error in blob %ld of '%s'\n", recno, filename);
       else if (memcmp (digest, zerodigest, 20))
         {
@@ -743,21 +1391,7 @@ _keybox_dump_find_dups (const char *filename, int print_them, FILE *outfp)
     fclose (fp);
 
   qsort (dupitems, dupitems_count, sizeof *dupitems, cmp_dupitems);
-
-  for (lastn=0, n=1; n < dupitems_count; lastn=n, n++)
-    {
-      if (!memcmp (dupitems[lastn].digest, dupitems[n].digest, 20))
-        {
-          bin2hexcolon (dupitems[lastn].digest, 20, fprbuf);
-          fprintf (outfp, "fpr=%s recno=%lu", fprbuf, dupitems[lastn].recno);
-          do
-            fprintf (outfp, " %lu", dupitems[n].recno);
-          while (++n < dupitems_count
-                 && !memcmp (dupitems[lastn].digest, dupitems[n].digest, 20));
-          putc ('\n', outfp);
-          n--;
-        }
-    }
+  print_dups (dupitems, dupitems_count, outfp);
 
   free (dupitems);
 
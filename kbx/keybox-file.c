@@ -23,11 +23,13 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/stat.h>
+#if defined(HAVE_MMAP) && !defined(HAVE_W32_SYSTEM)
+# include <sys/mman.h>
+#endif
 
 #include "keybox-defs.h"
-
-
-#define IMAGELEN_LIMIT (5*1024*1024)
+#include "../common/host2net.h"
 
 
 #if !defined(HAVE_FTELLO) && !defined(ftello)
@@ -45,8 +47,25 @@ ftello (FILE *stream)
 
 
 
+/* Return true if a blob of NEEDED bytes starting at file offset OFF
+   extends beyond the current end of the file FP.  */
+static int
+truncated_at_eof (FILE *fp, off_t off, size_t needed)
+{
+  struct stat st;
+
+  if (fstat (fileno (fp), &st) || !S_ISREG (st.st_mode))
+    return 0;
+  return st.st_size < off || (size_t)(st.st_size - off) < needed;
+}
+
+
 /* Read a block at the current position and return it in R_BLOB.
-   R_BLOB may be NULL to simply skip the current block.  */
+   R_BLOB may be NULL to simply skip the current block.  A block
+   truncated by the current end of the file is considered the end of
+   the file: Searches are done without a lock and thus another process
+   may just be appending that block.  Any other short block gives
+   GPG_ERR_TOO_SHORT.  */
 int
 _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted)
 {
@@ -55,6 +74,7 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted)
   int c1, c2, c3, c4, type;
   int rc;
   off_t off;
+  int retried = 0;
 
   if (skipped_deleted)
     *skipped_deleted = 0;
@@ -71,11 +91,11 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted)
       || (c4 = getc (fp)) == EOF
       || (type = getc (fp)) == EOF)
     {
-      if ( c1 == EOF && !ferror (fp) )
+      if (ferror (fp))
+        return gpg_error_from_syserror ();
+      if (c1 == EOF || truncated_at_eof (fp, off, 5))
         return -1; /* eof */
-      if (!ferror (fp))
-        return gpg_error (GPG_ERR_TOO_SHORT);
-      return gpg_error_from_syserror ();
+      goto short_read;
     }
 
   imagelen = ((unsigned int) c1 << 24) | (c2 << 16) | (c3 << 8 ) | c4;
@@ -116,15 +136,121 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted)
   image[0] = c1; image[1] = c2; image[2] = c3; image[3] = c4; image[4] = type;
   if (fread (image+5, imagelen-5, 1, fp) != 1)
     {
-      gpg_error_t tmperr = gpg_error_from_syserror ();
       xfree (image);
-      return tmperr;
+      if (ferror (fp))
+        return gpg_error_from_syserror ();
+      if (truncated_at_eof (fp, off, imagelen))
+        return -1; /* eof */
+      goto short_read;
     }
 
   rc = _keybox_new_blob (r_blob, image, imagelen, off);
   if (rc)
     xfree (image);
   return rc;
+
+ short_read:
+  /* The file has been extended after we hit its end; read the blob
+     again but only once so that we do not chase a growing file.  */
+  if (retried++)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+  clearerr (fp);
+  if (fseeko (fp, off, SEEK_SET))
+    return gpg_error_from_syserror ();
+  goto again;
+}
+
+
+/* Map the keybox file opened at HD->FP read-only into memory.  This
+   is a no-op if the file is already mapped, mmap is not supported or
+   the mapping fails; callers need to check HD->MAP.  Note that our
+   update functions only append to an existing keybox file or create
+   a new one; a truncation only removes a partly appended blob.  Thus
+   the mapping stays valid as long as HD->FP is open but does not
+   cover blobs appended after it has been created.  */
+void
+_keybox_map_file (KEYBOX_HANDLE hd)
+{
+#ifdef KEYBOX_USE_MMAP
+  struct stat st;
+  void *p;
+
+  if (hd->map || !hd->fp)
+    return;
+  if (fstat (fileno (hd->fp), &st) || !S_ISREG (st.st_mode)
+      || !st.st_size || (uint64_t)st.st_size > (size_t)(-1))
+    return;
+  p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fileno (hd->fp), 0);
+  if (p == MAP_FAILED)
+    return;
+  hd->map = p;
+  hd->maplen = st.st_size;
+#else
+  (void)hd;
+#endif
+}
+
+
+/* Release the mapping of HD.  */
+void
+_keybox_unmap_file (KEYBOX_HANDLE hd)
+{
+#ifdef KEYBOX_USE_MMAP
+  if (hd->map)
+    munmap ((void *)hd->map, hd->maplen);
+#endif
+  hd->map = NULL;
+  hd->maplen = 0;
+}
+
+
+/* This is the same as _keybox_read_blob but works on the mapped file
+   of HD.  The blob at file offset *R_POS is stored in BLOB, which
+   must have been allocated by the caller, without copying the image.
+   On return *R_POS is set to the offset of the next blob.  Returns
+   -1 if the end of the mapping has been reached or the blob at *R_POS
+   does not fit into the mapping; the caller may then check whether
+   the file has been extended.  */
+int
+_keybox_read_mapped_blob (KEYBOX_HANDLE hd, off_t *r_pos, KEYBOXBLOB blob)
+{
+  const unsigned char *image;
+  size_t imagelen;
+  off_t pos = *r_pos;
+
+ again:
+  if (pos < 0 || pos >= hd->maplen)
+    return -1; /* eof */
+  if (hd->maplen - pos < 5)
+    return -1; /* Truncated.  */
+
+  image = hd->map + pos;
+  imagelen = buf32_to_size_t (image);
+  if (imagelen < 5)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  if (!image[4])
+    {
+      /* Special treatment for empty blobs. */
+      pos += imagelen;
+      *r_pos = pos;
+      goto again;
+    }
+
+  if (imagelen > IMAGELEN_LIMIT) /* Sanity check. */
+    {
+      /* Skip forward so that the caller may choose to ignore this
+         record.  */
+      *r_pos = pos + imagelen;
+      return gpg_error (GPG_ERR_TOO_LARGE);
+    }
+
+  if (imagelen > hd->maplen - pos)
+    return -1; /* Truncated.  */
+
+  _keybox_set_mapped_blob (blob, image, imagelen, pos);
+  *r_pos = pos + imagelen;
+  return 0;
 }
 
 
@@ -0,0 +1,1814 @@
+/* keybox-index.c - Sidecar index for keybox files
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* A large keybox is searched linearly for each lookup by fingerprint,
+ * long keyid, keygrip, user id, issuer or subject.  To speed this up
+ * we maintain an index file next to the keybox with the name of the
+ * keybox file and the suffix ".idx".  The index is only a hint: each
+ * blob found via the index is read from the keybox and compared as in
+ * a normal search.  An index is only used if it matches the keybox's
+ * size, inode and modification time; otherwise it is rebuilt or, if
+ * that is not possible, the keybox is scanned as usual.
+ *
+ * The index file is made up of a header followed by the sorted
+ * entries:
+ *
+ *   - b4   Magic 'KBXi'
+ *   - byte Version number (3)
+ *   - byte Flags
+ *          bit 0 - Keygrips of X.509 blobs are included
+ *   - u16  RFU
+ *   - u32  Number of entries
+ *   - u32  Number of blocks of the keyid filter or 0
+ *   - u64  Size of the keybox file
+ *   - u64  Modification time of the keybox file
+ *   - u64  Inode number of the keybox file
+ *   - u64  RFU
+ *
+ *   Each entry is 32 bytes long:
+ *   - byte Kind of the entry (1 = fingerprint, 2 = long keyid,
+ *          3 = keygrip, 4 = mailbox, 5 = trigram, 6 = issuer,
+ *          7 = issuer and serial number, 8 = subject)
+ *   - b23  The value, right padded with zeroes
+ *   - u64  File offset of the blob
+ *
+ * The entries are sorted by their first 24 bytes and the offset.  Note
+ * that the keyid is taken from the fingerprint as done by
+ * has_long_kid in keybox-search.c.
+ *
+ * The entries are followed by a blocked Bloom filter of the long
+ * keyids of all keys.  It consists of blocks of 64 bytes; a keyid
+ * sets FILTER_NBITS bits in the block selected by its hash.  A
+ * lookup by fingerprint or keyid of a key which is not in the keybox
+ * thus needs to read only one block instead of doing a binary search.
+ * Older versions left the number of blocks as zero and ignore the
+ * filter; hence the version number is unchanged.
+ *
+ * For a mailbox the value is the SHA-1 hash of the addr-spec, mapped
+ * to lowercase and truncated to INDEX_MAX_MAILLEN bytes.  For
+ * substring searches each blob has one entry for each distinct
+ * sequence of 3 bytes (trigram) found in its user ids, again mapped
+ * to lowercase; trigrams with delimiters like spaces or angle
+ * brackets are not indexed.  A substring search then only needs to look at the
+ * blobs which have all trigrams of the search string; we start with
+ * the rarest trigram and stop intersecting once only a few
+ * candidates are left.
+ *
+ * For X.509 blobs the issuer DN (the first user id) and the subject
+ * DN (the second user id) are indexed with the SHA-1 hash of the DN
+ * string.  The key for the issuer and serial number is the SHA-1 hash
+ * of the issuer DN, a zero byte and the binary serial number.  This
+ * makes the searches used by gpgsm to build a certificate chain fast;
+ * in particular a search for the issuer by its subject key identifier
+ * only needs to parse the few certificates with the right subject.
+ *
+ * Where mmap is available the index file is mapped read-only and
+ * shared.  Many processes looking up keys at the same time (e.g. a
+ * mail server starting one gpg per message) then use the same page
+ * cache pages for the index instead of each reading it into its own
+ * stdio buffers, and a lookup touches only the pages of its binary
+ * search.  Because an index file is never modified but only replaced
+ * by a rename, a mapping stays consistent as long as it is open; the
+ * stamp check tells us when to switch to the new file.
+ *
+ * Rewriting the index for each change of the keybox would make an
+ * import of many keys quadratic.  Changes which do not move blobs
+ * (appending a blob, marking a blob as deleted or setting a flag) are
+ * thus appended to a delta file with the suffix ".idd":
+ *
+ *   - b4   Magic 'KBXd'
+ *   - byte Version number (1)
+ *   - b3   RFU
+ *   - u64  Size of the keybox file as given by the index
+ *   - u64  Modification time of the keybox file as given by the index
+ *   - u64  Inode number of the keybox file as given by the index
+ *
+ *   followed by a record for each change:
+ *   - u32  Number of entries
+ *   - u32  RFU
+ *   - u64  Size of the keybox file after the change
+ *   - u64  Modification time of the keybox file after the change
+ *   - u64  Inode number of the keybox file after the change
+ *   - The entries for an appended blob in the same format as in the
+ *     index file.
+ *
+ * The delta is only used if its header matches the index; a
+ * truncated last record is ignored.  The entries of the delta are
+ * kept sorted in memory and searched in addition to the index.  The
+ * entries of a blob marked as deleted are not removed; the search
+ * skips deleted blobs anyway.  Once the delta has more than
+ * INDEX_MAX_DELTA entries or for other changes, the delta is merged
+ * into a new index file.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gcrypt.h>
+
+#include "keybox-defs.h"
+#ifdef KEYBOX_USE_MMAP
+# include <sys/mman.h>
+#endif
+#include "../common/sysutils.h"
+#include "../common/host2net.h"
+
+
+#define INDEX_VERSION    3
+#define INDEX_HDRLEN     48
+#define INDEX_ENTRYLEN   32
+#define INDEX_KEYLEN     24
+
+#define DELTA_VERSION    1
+#define DELTA_HDRLEN     32
+#define DELTA_RECHDRLEN  32
+
+#define INDEX_FLAG_GRIPS 1
+
+#define INDEX_KIND_FPR   1
+#define INDEX_KIND_KID   2
+#define INDEX_KIND_GRIP  3
+#define INDEX_KIND_MAIL  4
+#define INDEX_KIND_TRI   5
+#define INDEX_KIND_ISSUER     6
+#define INDEX_KIND_ISSUER_SN  7
+#define INDEX_KIND_SUBJECT    8
+
+/* The size of a block of the keyid filter, the number of bits set in
+ * a block for a keyid and the number of keyids per block.  */
+#define FILTER_BLOCKLEN  64
+#define FILTER_NBITS     7
+#define FILTER_PERBLOCK  32
+
+/* Only that many bytes of a mailbox are hashed for the index.  */
+#define INDEX_MAX_MAILLEN 256
+
+/* Stop intersecting the trigram lists if we have no more than this
+ * number of candidates.  */
+#define INDEX_ENOUGH_CANDIDATES 16
+
+/* We do not create an index for smaller keybox files.  */
+#define INDEX_MIN_FILESIZE  (256*1024)
+
+/* The delta is merged into the index once it has more entries.  */
+#define INDEX_MAX_DELTA  4096
+
+#define get16(a) buf16_to_ulong ((a))
+#define get32(a) buf32_to_ulong ((a))
+
+
+/* If set index files are not mapped.  */
+static int index_no_mmap;
+
+
+/* The index state of a keybox resource.  */
+struct keybox_index_s
+{
+  FILE *fp;                     /* The open index file or NULL.  */
+  const unsigned char *map;     /* The mapped index file or NULL.  */
+  size_t maplen;                /* The length of MAP.  */
+  unsigned int nentries;        /* Number of entries in FP.  */
+  unsigned int flags;           /* The flags from the header.  */
+  unsigned int filter_blocks;   /* Number of blocks of the keyid filter.  */
+  struct keybox_index_stamp_s base_stamp;  /* The stamp from the header.  */
+
+  /* The sorted entries from the delta file.  */
+  unsigned char *delta;
+  unsigned int ndelta;
+  off_t deltalen;               /* Valid length of the delta file or 0.  */
+
+  /* The stamp of the keybox file described by the index and the
+   * delta.  */
+  struct keybox_index_stamp_s stamp;
+
+  /* If we failed to build an index for a keybox with this stamp we
+   * do not try again.  */
+  int build_failed;
+  struct keybox_index_stamp_s failed_stamp;
+};
+
+
+/* An array of entries used while building or updating the index.  */
+struct entry_array_s
+{
+  unsigned char *data;
+  size_t n;
+  size_t allocated;
+  int error;
+};
+
+
+/* An array of trigrams.  */
+struct trigram_array_s
+{
+  u32 *data;
+  size_t n;
+  size_t allocated;
+  int error;
+};
+
+
+
+#if !defined(HAVE_FSEEKO) && !defined(fseeko)
+#include <limits.h>
+static int
+fseeko (FILE * stream, off_t newpos, int whence)
+{
+  while (newpos != (long) newpos)
+    {
+      long pos = newpos < 0 ? LONG_MIN : LONG_MAX;
+      if (fseek (stream, pos, whence) != 0)
+	return -1;
+      newpos -= pos;
+      whence = SEEK_CUR;
+    }
+  return fseek (stream, (long) newpos, whence);
+}
+#endif /* !defined(HAVE_FSEEKO) && !defined(fseeko) */
+
+
+static void
+put32 (unsigned char *p, u32 val)
+{
+  p[0] = val >> 24;
+  p[1] = val >> 16;
+  p[2] = val >>  8;
+  p[3] = val;
+}
+
+static void
+put64 (unsigned char *p, uint64_t val)
+{
+  put32 (p, (val >> 32));
+  put32 (p+4, (val & 0xffffffff));
+}
+
+static uint64_t
+get64 (const unsigned char *p)
+{
+  return (((uint64_t)buf32_to_ulong (p) << 32) | buf32_to_ulong (p+4));
+}
+
+
+/* Return the block number of the keyid filter with NBLOCKS blocks for
+ * the 8 byte KEYID and store the bits of that block in R_BITS.  */
+static u32
+filter_hash (const unsigned char *keyid, u32 nblocks,
+             unsigned int r_bits[FILTER_NBITS])
+{
+  uint64_t h, h2;
+  int i;
+
+  /* Keyids are already random but someone may create keys with very
+   * similar keyids; thus mix the bits.  */
+  h = get64 (keyid) * 0x9e3779b97f4a7c15ULL;
+  h2 = (h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ULL;
+  for (i=0; i < FILTER_NBITS; i++)
+    r_bits[i] = (h2 >> (9 * i)) & (FILTER_BLOCKLEN * 8 - 1);
+  return (h >> 32) % nblocks;
+}
+
+
+/* Return true if the KEYID may be in the keybox described by IDX.  */
+static int
+filter_maybe (struct keybox_index_s *idx, const unsigned char *keyid)
+{
+  unsigned char block[FILTER_BLOCKLEN];
+  unsigned int bits[FILTER_NBITS];
+  u32 blockno;
+  int i;
+
+  const unsigned char *p;
+  off_t off;
+
+  if (!idx->filter_blocks)
+    return 1;
+  blockno = filter_hash (keyid, idx->filter_blocks, bits);
+  off = (INDEX_HDRLEN + (off_t)idx->nentries * INDEX_ENTRYLEN
+         + (off_t)blockno * FILTER_BLOCKLEN);
+  if (idx->map)
+    p = idx->map + off;  /* Size has been checked by open_index.  */
+  else if (fseeko (idx->fp, off, SEEK_SET)
+           || fread (block, FILTER_BLOCKLEN, 1, idx->fp) != 1)
+    return 1;
+  else
+    p = block;
+  for (i=0; i < FILTER_NBITS; i++)
+    if (!(p[bits[i] / 8] & (1 << (bits[i] % 8))))
+      return 0;
+  return 1;
+}
+
+
+static char *
+index_fname (KB_NAME kb)
+{
+  return strconcat (kb->fname, EXTSEP_S "idx", NULL);
+}
+
+static char *
+delta_fname (KB_NAME kb)
+{
+  return strconcat (kb->fname, EXTSEP_S "idd", NULL);
+}
+
+
+static int
+get_stamp (int fd, struct keybox_index_stamp_s *stamp)
+{
+  struct stat st;
+
+  if (fstat (fd, &st))
+    return -1;
+  stamp->size = st.st_size;
+  stamp->mtime = st.st_mtime;
+#ifdef HAVE_W32_SYSTEM
+  stamp->ino = 0;
+#else
+  stamp->ino = st.st_ino;
+#endif
+  return 0;
+}
+
+static int
+stamp_equal (const struct keybox_index_stamp_s *a,
+             const struct keybox_index_stamp_s *b)
+{
+  return (a->size == b->size && a->mtime == b->mtime && a->ino == b->ino);
+}
+
+static void
+put_stamp (unsigned char *p, const struct keybox_index_stamp_s *stamp)
+{
+  put64 (p, stamp->size);
+  put64 (p + 8, stamp->mtime);
+  put64 (p + 16, stamp->ino);
+}
+
+static void
+get_stamp_buf (const unsigned char *p, struct keybox_index_stamp_s *stamp)
+{
+  stamp->size = get64 (p);
+  stamp->mtime = get64 (p + 8);
+  stamp->ino = get64 (p + 16);
+}
+
+
+/* Return the stamp of the keybox file of KB at R_STAMP.  A zeroed
+ * stamp is returned if the file does not exist.  */
+void
+_keybox_index_get_stamp (KB_NAME kb, struct keybox_index_stamp_s *r_stamp)
+{
+  FILE *fp;
+
+  memset (r_stamp, 0, sizeof *r_stamp);
+  fp = fopen (kb->fname, "rb");
+  if (fp)
+    {
+      if (get_stamp (fileno (fp), r_stamp))
+        memset (r_stamp, 0, sizeof *r_stamp);
+      fclose (fp);
+    }
+}
+
+
+static int
+cmp_entries (const void *a, const void *b)
+{
+  return memcmp (a, b, INDEX_ENTRYLEN);
+}
+
+
+static void
+add_entry (struct entry_array_s *array, int kind,
+           const unsigned char *value, size_t valuelen, off_t off)
+{
+  unsigned char *p;
+
+  if (array->error)
+    return;
+  if (array->n == array->allocated)
+    {
+      size_t newsize = array->allocated? 2 * array->allocated : 1024;
+
+      p = xtryrealloc (array->data, newsize * INDEX_ENTRYLEN);
+      if (!p)
+        {
+          array->error = gpg_error_from_syserror ();
+          return;
+        }
+      array->data = p;
+      array->allocated = newsize;
+    }
+  p = array->data + array->n++ * INDEX_ENTRYLEN;
+  memset (p, 0, INDEX_ENTRYLEN);
+  p[0] = kind;
+  memcpy (p+1, value, valuelen);
+  put64 (p + INDEX_KEYLEN, off);
+}
+
+
+/* Compute the key for the mailbox S of length LEN and store it at
+ * KEY, which has INDEX_KEYLEN bytes.  */
+static void
+mail_key (unsigned char *key, const unsigned char *s, size_t len)
+{
+  unsigned char buffer[INDEX_MAX_MAILLEN];
+  size_t n;
+
+  if (len > sizeof buffer)
+    len = sizeof buffer;
+  for (n=0; n < len; n++)
+    buffer[n] = ascii_tolower (s[n]);
+  memset (key, 0, INDEX_KEYLEN);
+  key[0] = INDEX_KIND_MAIL;
+  gcry_md_hash_buffer (GCRY_MD_SHA1, key+1, buffer, len);
+}
+
+
+/* Compute the key of KIND for the distinguished name NAME of length
+ * NAMELEN and store it at KEY, which has INDEX_KEYLEN bytes.  If SN
+ * is not NULL the serial number SN of length SNLEN is also hashed; an
+ * SNLEN of -1 indicates that SN is a hex string as used by the search
+ * descriptor.  */
+static gpg_error_t
+dn_key (unsigned char *key, int kind,
+        const unsigned char *name, size_t namelen,
+        const unsigned char *sn, int snlen)
+{
+  gpg_error_t err;
+  gcry_md_hd_t md;
+  const unsigned char *s;
+  int i;
+
+  err = gcry_md_open (&md, GCRY_MD_SHA1, 0);
+  if (err)
+    return err;
+  gcry_md_write (md, name, namelen);
+  if (sn)
+    {
+      gcry_md_putc (md, 0);
+      if (snlen == -1)
+        {
+          /* Convert as done by keybox_search.  */
+          for (s=sn, i=0; *s && *s != '/'; s++, i++)
+            ;
+          s = sn;
+          if ((i & 1))
+            {
+              gcry_md_putc (md, xtoi_1 (s));
+              s++;
+            }
+          for (; *s && *s != '/'; s += 2)
+            gcry_md_putc (md, xtoi_2 (s));
+        }
+      else
+        gcry_md_write (md, sn, snlen);
+    }
+  memset (key, 0, INDEX_KEYLEN);
+  key[0] = kind;
+  memcpy (key+1, gcry_md_read (md, 0), 20);
+  gcry_md_close (md);
+  return 0;
+}
+
+
+/* Return the mailbox part of the user id S with length LEN and store
+ * its length at R_LEN.  Returns NULL if there is no mailbox.  This
+ * is the same as done by blob_cmp_mail in keybox-search.c but does
+ * not check that a plain user id is a valid mailbox.  */
+static const unsigned char *
+get_mailbox (const unsigned char *s, size_t len, int x509, size_t *r_len)
+{
+  const unsigned char *p;
+  size_t n;
+
+  if (x509)
+    {
+      if (len < 4 || s[0] != '<' || s[len-1] != '>')
+        return NULL;
+      *r_len = len - 2;
+      return s + 1;
+    }
+
+  for (p = s, n = len; n && *p != '<'; n--, p++)
+    ;
+  if (n < 2)
+    {
+      /* No angle brackets; the entire user id may be the mailbox.  */
+      if (!len)
+        return NULL;
+      *r_len = len;
+      return s;
+    }
+  p++;
+  n--;
+  s = p;
+  for (; n && *p != '>'; n--, p++)
+    ;
+  if (!n || p == s)
+    return NULL;
+  *r_len = p - s;
+  return s;
+}
+
+
+/* Return true if trigrams with the character C are indexed.  To keep
+ * the index small we skip most delimiters.  */
+static int
+indexed_char (int c)
+{
+  return !(c == ' ' || c == '(' || c == ')' || c == '<' || c == '>'
+           || c == '"' || c == ',');
+}
+
+
+/* Add the indexed trigrams of S with length LEN to ARRAY.  */
+static void
+add_trigrams (struct trigram_array_s *array,
+              const unsigned char *s, size_t len)
+{
+  u32 tri;
+  size_t n;
+
+  if (array->error || len < 3)
+    return;
+  if (array->n + len - 2 > array->allocated)
+    {
+      size_t newsize = array->allocated? array->allocated : 64;
+      u32 *p;
+
+      while (newsize < array->n + len - 2)
+        newsize *= 2;
+      p = xtryrealloc (array->data, newsize * sizeof *p);
+      if (!p)
+        {
+          array->error = gpg_error_from_syserror ();
+          return;
+        }
+      array->data = p;
+      array->allocated = newsize;
+    }
+
+  tri = (ascii_tolower (s[0]) << 8) | ascii_tolower (s[1]);
+  for (n=2; n < len; n++)
+    {
+      tri = ((tri << 8) | ascii_tolower (s[n])) & 0xffffff;
+      if (indexed_char (s[n]) && indexed_char (s[n-1])
+          && indexed_char (s[n-2]))
+        array->data[array->n++] = tri;
+    }
+}
+
+
+static int
+cmp_trigrams (const void *a, const void *b)
+{
+  u32 aa = *(const u32 *)a;
+  u32 bb = *(const u32 *)b;
+
+  return aa < bb? -1 : aa > bb? 1 : 0;
+}
+
+
+/* Sort ARRAY and remove duplicates.  */
+static void
+unique_trigrams (struct trigram_array_s *array)
+{
+  size_t i, n;
+
+  if (array->n < 2)
+    return;
+  qsort (array->data, array->n, sizeof *array->data, cmp_trigrams);
+  for (i=0, n=1; n < array->n; n++)
+    if (array->data[n] != array->data[i])
+      array->data[++i] = array->data[n];
+  array->n = i + 1;
+}
+
+
+static void
+trigram_key (unsigned char *key, u32 tri)
+{
+  memset (key, 0, INDEX_KEYLEN);
+  key[0] = INDEX_KIND_TRI;
+  key[1] = tri >> 16;
+  key[2] = tri >> 8;
+  key[3] = tri;
+}
+
+
+/* Add the mailbox and trigram entries for the user ids of BLOB.  */
+static void
+add_uid_entries (struct entry_array_s *array, KEYBOXBLOB blob, off_t off)
+{
+  const unsigned char *buffer;
+  size_t length, pos, uidoff, uidlen, mboxlen;
+  size_t nkeys, keyinfolen, nserial, nuids, uidinfolen, idx;
+  const unsigned char *mbox, *serial;
+  unsigned char key[INDEX_KEYLEN];
+  struct trigram_array_s trigrams;
+  int x509;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  x509 = (buffer[4] == KEYBOX_BLOBTYPE_X509);
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18);
+  pos = 20 + keyinfolen*nkeys;
+  if ((uint64_t)pos + 2 > (uint64_t)length)
+    return;
+  nserial = get16 (buffer + pos);
+  serial = buffer + pos + 2;
+  pos += 2 + nserial;
+  if (pos + 4 > length)
+    return;
+  nuids = get16 (buffer + pos);
+  uidinfolen = get16 (buffer + pos + 2);
+  pos += 4;
+  if (uidinfolen < 12 || (uint64_t)pos + uidinfolen*nuids > (uint64_t)length)
+    return;
+
+  memset (&trigrams, 0, sizeof trigrams);
+  for (idx=0; idx < nuids; idx++, pos += uidinfolen)
+    {
+      uidoff = get32 (buffer + pos);
+      uidlen = get32 (buffer + pos + 4);
+      if ((uint64_t)uidoff + (uint64_t)uidlen > (uint64_t)length)
+        break;
+      if (x509 && idx < 2)
+        {
+          /* The issuer and the subject.  */
+          gpg_error_t err;
+
+          err = dn_key (key, idx? INDEX_KIND_SUBJECT : INDEX_KIND_ISSUER,
+                        buffer + uidoff, uidlen, NULL, 0);
+          if (!err)
+            add_entry (array, key[0], key+1, INDEX_KEYLEN-1, off);
+          if (!err && !idx)
+            {
+              err = dn_key (key, INDEX_KIND_ISSUER_SN, buffer + uidoff, uidlen,
+                            serial, nserial);
+              if (!err)
+                add_entry (array, key[0], key+1, INDEX_KEYLEN-1, off);
+            }
+          if (err && !array->error)
+            array->error = err;
+        }
+      if (!uidlen)
+        continue;
+      mbox = get_mailbox (buffer + uidoff, uidlen, x509, &mboxlen);
+      if (mbox)
+        {
+          mail_key (key, mbox, mboxlen);
+          add_entry (array, key[0], key+1, INDEX_KEYLEN-1, off);
+        }
+      add_trigrams (&trigrams, buffer + uidoff, uidlen);
+    }
+
+  if (trigrams.error)
+    array->error = trigrams.error;
+  else
+    {
+      unique_trigrams (&trigrams);
+      for (idx=0; idx < trigrams.n; idx++)
+        {
+          trigram_key (key, trigrams.data[idx]);
+          add_entry (array, key[0], key+1, INDEX_KEYLEN-1, off);
+        }
+    }
+  xfree (trigrams.data);
+}
+
+
+/* Add the entries for BLOB at file offset OFF to ARRAY.  */
+static void
+add_blob_entries (struct entry_array_s *array, KEYBOXBLOB blob, off_t off,
+                  int with_grips)
+{
+  const unsigned char *buffer;
+  size_t length, nkeys, keyinfolen, idx;
+  const unsigned char *fpr;
+  int blobtype;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 40)
+    return;
+  blobtype = buffer[4];
+  if (blobtype != KEYBOX_BLOBTYPE_PGP && blobtype != KEYBOX_BLOBTYPE_X509)
+    return;
+
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18);
+  if (keyinfolen < 28
+      || 20 + (uint64_t)keyinfolen*nkeys > (uint64_t)length)
+    return;
+
+  for (idx=0; idx < nkeys; idx++)
+    {
+      fpr = buffer + 20 + idx*keyinfolen;
+      add_entry (array, INDEX_KIND_FPR, fpr, 20, off);
+      add_entry (array, INDEX_KIND_KID, fpr+12, 8, off);
+    }
+
+  add_uid_entries (array, blob, off);
+
+#ifdef KEYBOX_WITH_X509
+  if (with_grips && blobtype == KEYBOX_BLOBTYPE_X509)
+    {
+      unsigned char grip[20];
+
+      if (!_keybox_get_x509_keygrip (blob, grip))
+        add_entry (array, INDEX_KIND_GRIP, grip, 20, off);
+    }
+#else
+  (void)with_grips;
+#endif
+}
+
+
+static void
+close_index (KB_NAME kb)
+{
+  if (!kb->index)
+    return;
+#ifdef KEYBOX_USE_MMAP
+  if (kb->index->map)
+    munmap ((void *)kb->index->map, kb->index->maplen);
+#endif
+  kb->index->map = NULL;
+  kb->index->maplen = 0;
+  if (kb->index->fp)
+    {
+      fclose (kb->index->fp);
+      kb->index->fp = NULL;
+    }
+  xfree (kb->index->delta);
+  kb->index->delta = NULL;
+  kb->index->ndelta = 0;
+  kb->index->deltalen = 0;
+}
+
+
+/* Do not map index files opened from now on if YES is set.  This is
+ * used by the tests to exercise the stdio functions.  */
+void
+_keybox_index_disable_mmap (int yes)
+{
+  index_no_mmap = yes;
+}
+
+
+/* Map the index file opened at KB->INDEX->FP read-only into memory.
+ * This is a no-op if mmap is not supported or fails; the stdio
+ * functions are then used.  */
+static void
+map_index (KB_NAME kb)
+{
+#ifdef KEYBOX_USE_MMAP
+  struct keybox_index_s *idx = kb->index;
+  struct stat st;
+  void *p;
+
+  if (idx->map || !idx->fp || index_no_mmap)
+    return;
+  if (fstat (fileno (idx->fp), &st) || !S_ISREG (st.st_mode)
+      || !st.st_size || (uint64_t)st.st_size > (size_t)(-1))
+    return;
+  p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fileno (idx->fp), 0);
+  if (p == MAP_FAILED)
+    return;
+  idx->map = p;
+  idx->maplen = st.st_size;
+#else
+  (void)kb;
+#endif
+}
+
+
+/* Read the delta file of KB.  The index file must already be open.
+ * A missing or unusable delta is ignored.  */
+static void
+read_delta (KB_NAME kb)
+{
+  struct keybox_index_s *idx = kb->index;
+  char *fname;
+  FILE *fp;
+  unsigned char hdr[DELTA_HDRLEN];
+  struct keybox_index_stamp_s stamp;
+  unsigned char *p;
+  size_t n;
+  off_t len;
+
+  fname = delta_fname (kb);
+  if (!fname)
+    return;
+  fp = fopen (fname, "rb");
+  xfree (fname);
+  if (!fp)
+    return;
+
+  if (fread (hdr, DELTA_HDRLEN, 1, fp) != 1
+      || memcmp (hdr, "KBXd", 4) || hdr[4] != DELTA_VERSION)
+    goto leave;
+  get_stamp_buf (hdr + 8, &stamp);
+  if (!stamp_equal (&stamp, &idx->base_stamp))
+    goto leave;  /* Belongs to another index.  */
+  len = DELTA_HDRLEN;
+
+  /* Read the records up to the first truncated one.  */
+  while (fread (hdr, DELTA_RECHDRLEN, 1, fp) == 1)
+    {
+      n = get32 (hdr);
+      if (n > INDEX_MAX_DELTA - idx->ndelta)
+        break;
+      if (n)
+        {
+          p = xtryrealloc (idx->delta, (idx->ndelta + n) * INDEX_ENTRYLEN);
+          if (!p)
+            break;
+          idx->delta = p;
+          if (fread (p + (size_t)idx->ndelta * INDEX_ENTRYLEN,
+                     INDEX_ENTRYLEN, n, fp) != n)
+            break;
+        }
+      idx->ndelta += n;
+      get_stamp_buf (hdr + 8, &idx->stamp);
+      len += DELTA_RECHDRLEN + (off_t)n * INDEX_ENTRYLEN;
+    }
+  idx->deltalen = len;
+  if (idx->ndelta > 1)
+    qsort (idx->delta, idx->ndelta, INDEX_ENTRYLEN, cmp_entries);
+
+ leave:
+  fclose (fp);
+}
+
+
+/* Open the index file of KB and read its header and its delta.  */
+static gpg_error_t
+open_index (KB_NAME kb)
+{
+  gpg_error_t err;
+  char *fname;
+  unsigned char hdr[INDEX_HDRLEN];
+  struct keybox_index_s *idx = kb->index;
+
+  close_index (kb);
+
+  fname = index_fname (kb);
+  if (!fname)
+    return gpg_error_from_syserror ();
+  idx->fp = fopen (fname, "rb");
+  xfree (fname);
+  if (!idx->fp)
+    return gpg_error_from_syserror ();
+
+  if (fread (hdr, INDEX_HDRLEN, 1, idx->fp) != 1
+      || memcmp (hdr, "KBXi", 4) || hdr[4] != INDEX_VERSION)
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      close_index (kb);
+      return err;
+    }
+  idx->flags = hdr[5];
+  idx->nentries = get32 (hdr + 8);
+  idx->filter_blocks = get32 (hdr + 12);
+  get_stamp_buf (hdr + 16, &idx->base_stamp);
+  idx->stamp = idx->base_stamp;
+
+  map_index (kb);
+  if (idx->map
+      && (idx->maplen < INDEX_HDRLEN
+          || (idx->maplen - INDEX_HDRLEN) / INDEX_ENTRYLEN < idx->nentries))
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      close_index (kb);
+      return err;
+    }
+  if (idx->map
+      && ((idx->maplen - INDEX_HDRLEN - (size_t)idx->nentries * INDEX_ENTRYLEN)
+          / FILTER_BLOCKLEN) < idx->filter_blocks)
+    idx->filter_blocks = 0;  /* Truncated filter - ignore it.  */
+
+  read_delta (kb);
+  return 0;
+}
+
+
+/* Write the entries from ARRAY as new index for KB.  STAMP is the
+ * stamp of the keybox file the entries belong to.  */
+static gpg_error_t
+write_index (KB_NAME kb, struct entry_array_s *array,
+             const struct keybox_index_stamp_s *stamp, unsigned int flags)
+{
+  gpg_error_t err = 0;
+  char *fname, *tmpfname;
+  unsigned char hdr[INDEX_HDRLEN];
+  FILE *fp;
+  const unsigned char *p;
+  unsigned char *filter;
+  unsigned int bits[FILTER_NBITS];
+  size_t n, nkids;
+  u32 nblocks, blockno;
+  int i;
+
+  close_index (kb);
+
+  qsort (array->data, array->n, INDEX_ENTRYLEN, cmp_entries);
+
+  /* Build the keyid filter.  */
+  for (p = array->data, n = nkids = 0; n < array->n; p += INDEX_ENTRYLEN, n++)
+    if (*p == INDEX_KIND_KID)
+      nkids++;
+  nblocks = (nkids + FILTER_PERBLOCK - 1) / FILTER_PERBLOCK;
+  filter = nblocks? xtrycalloc (nblocks, FILTER_BLOCKLEN) : NULL;
+  if (!filter)
+    nblocks = 0;
+  for (p = array->data, n = 0; filter && n < array->n;
+       p += INDEX_ENTRYLEN, n++)
+    {
+      if (*p != INDEX_KIND_KID)
+        continue;
+      blockno = filter_hash (p + 1, nblocks, bits);
+      for (i=0; i < FILTER_NBITS; i++)
+        filter[blockno * FILTER_BLOCKLEN + bits[i] / 8] |= 1 << (bits[i] % 8);
+    }
+
+  memset (hdr, 0, sizeof hdr);
+  memcpy (hdr, "KBXi", 4);
+  hdr[4] = INDEX_VERSION;
+  hdr[5] = flags;
+  put32 (hdr + 8, array->n);
+  put32 (hdr + 12, nblocks);
+  put_stamp (hdr + 16, stamp);
+
+  fname = index_fname (kb);
+  if (!fname)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (filter);
+      return err;
+    }
+  /* The index may also be written by a process which only searches
+   * the keybox and thus does not hold the lock; hence we need a
+   * unique name for the temporary file.  */
+  tmpfname = xtryasprintf ("%s.%lu" EXTSEP_S "tmp",
+                           fname, (unsigned long)getpid ());
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (fname);
+      xfree (filter);
+      return err;
+    }
+
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      if (fwrite (hdr, INDEX_HDRLEN, 1, fp) != 1
+          || (array->n
+              && fwrite (array->data, INDEX_ENTRYLEN, array->n, fp) != array->n)
+          || (nblocks
+              && fwrite (filter, FILTER_BLOCKLEN, nblocks, fp) != nblocks))
+        err = gpg_error_from_syserror ();
+      if (fclose (fp) && !err)
+        err = gpg_error_from_syserror ();
+      if (!err)
+        err = gnupg_rename_file (tmpfname, fname, NULL);
+      if (err)
+        gnupg_remove (tmpfname);
+    }
+
+  xfree (tmpfname);
+  xfree (fname);
+  xfree (filter);
+  return err;
+}
+
+
+/* Scan the keybox file FP and write a new index for KB.  STAMP is
+ * the stamp of FP.  The file position of FP is not restored.  */
+static gpg_error_t
+build_index (KB_NAME kb, FILE *fp, const struct keybox_index_stamp_s *stamp)
+{
+  gpg_error_t err;
+  struct entry_array_s array;
+  KEYBOXBLOB blob;
+  int with_grips;
+
+#ifdef KEYBOX_WITH_X509
+  with_grips = 1;
+#else
+  with_grips = 0;
+#endif
+
+  if (fseeko (fp, 0, SEEK_SET))
+    return gpg_error_from_syserror ();
+
+  memset (&array, 0, sizeof array);
+  while (!(err = _keybox_read_blob (&blob, fp, NULL)))
+    {
+      add_blob_entries (&array, blob, _keybox_get_blob_fileoffset (blob),
+                        with_grips);
+      _keybox_release_blob (blob);
+    }
+  if (gpg_err_code (err) == GPG_ERR_TOO_LARGE
+      && gpg_err_source (err) == GPG_ERR_SOURCE_KEYBOX)
+    err = gpg_error (GPG_ERR_NOT_SUPPORTED); /* Can't index that.  */
+  else if (err == -1)
+    err = 0;
+  if (!err)
+    err = array.error;
+  if (!err)
+    err = write_index (kb, &array, stamp, with_grips? INDEX_FLAG_GRIPS : 0);
+
+  xfree (array.data);
+  return err;
+}
+
+
+/* Return the name of the user id search DESC at R_LEN; for mailbox
+ * searches the angle brackets are removed as done by has_mail.  */
+static const unsigned char *
+desc_name (KEYBOX_SEARCH_DESC *desc, size_t *r_len)
+{
+  const char *name = desc->u.name;
+  size_t len;
+
+  if (!name)
+    {
+      *r_len = 0;
+      return (const unsigned char *)"";
+    }
+  if ((desc->mode == KEYDB_SEARCH_MODE_MAIL
+       || desc->mode == KEYDB_SEARCH_MODE_MAILSUB) && *name == '<')
+    name++;
+  len = strlen (name);
+  if ((desc->mode == KEYDB_SEARCH_MODE_MAIL
+       || desc->mode == KEYDB_SEARCH_MODE_MAILSUB)
+      && len && name[len-1] == '>')
+    len--;
+  *r_len = len;
+  return (const unsigned char *)name;
+}
+
+
+/* Return true if the modes in DESC can be answered by the index.
+ * Store at R_NEED_GRIPS whether keygrips are needed.  */
+static int
+indexable_desc (KEYBOX_SEARCH_DESC *desc, size_t ndesc, int *r_need_grips)
+{
+  size_t n, len;
+
+  *r_need_grips = 0;
+  if (!ndesc)
+    return 0;
+  for (n=0; n < ndesc; n++)
+    {
+      switch (desc[n].mode)
+        {
+        case KEYDB_SEARCH_MODE_LONG_KID:
+        case KEYDB_SEARCH_MODE_FPR:
+        case KEYDB_SEARCH_MODE_FPR20:
+          break;
+        case KEYDB_SEARCH_MODE_MAIL:
+          desc_name (desc + n, &len);
+          if (!len)
+            return 0;
+          break;
+        case KEYDB_SEARCH_MODE_ISSUER:
+        case KEYDB_SEARCH_MODE_SUBJECT:
+          if (!desc[n].u.name)
+            return 0;
+          break;
+        case KEYDB_SEARCH_MODE_ISSUER_SN:
+          if (!desc[n].u.name || !desc[n].sn)
+            return 0;
+          break;
+        case KEYDB_SEARCH_MODE_MAILSUB:
+        case KEYDB_SEARCH_MODE_SUBSTR:
+        case KEYDB_SEARCH_MODE_EXACT:
+          desc_name (desc + n, &len);
+          if (len < 3)
+            return 0; /* Too short for the trigram index.  */
+          break;
+        case KEYDB_SEARCH_MODE_KEYGRIP:
+#ifdef KEYBOX_WITH_X509
+          *r_need_grips = 1;
+          break;
+#else
+          return 0; /* OpenPGP blobs have no keygrips.  */
+#endif
+        default:
+          return 0;
+        }
+    }
+  return 1;
+}
+
+
+/* Return entry number N of the index IDX.  If the index is not
+ * mapped the entry is read into BUFFER.  Returns NULL on error.  */
+static const unsigned char *
+read_entry (struct keybox_index_s *idx, unsigned int n,
+            unsigned char *buffer)
+{
+  if (idx->map)
+    return idx->map + INDEX_HDRLEN + (size_t)n * INDEX_ENTRYLEN;
+  if (fseeko (idx->fp, INDEX_HDRLEN + (off_t)n * INDEX_ENTRYLEN, SEEK_SET)
+      || fread (buffer, INDEX_ENTRYLEN, 1, idx->fp) != 1)
+    return NULL;
+  return buffer;
+}
+
+
+/* The entries matching a key: FIRST up to END in the index and
+ * DFIRST up to DEND in the delta.  */
+struct index_range_s
+{
+  unsigned int first;
+  unsigned int end;
+  unsigned int dfirst;
+  unsigned int dend;
+};
+
+
+/* Return the number of the first entry of the delta of IDX which is
+ * not less than KEY or, if UPPER is set, greater than KEY.  */
+static unsigned int
+delta_bound (struct keybox_index_s *idx, const unsigned char *key, int upper)
+{
+  unsigned int lo, hi, mid;
+  int cmp;
+
+  lo = 0;
+  hi = idx->ndelta;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      cmp = memcmp (idx->delta + (size_t)mid * INDEX_ENTRYLEN,
+                    key, INDEX_KEYLEN);
+      if (cmp < 0 || (upper && !cmp))
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+
+/* Store the range of the entries matching KEY at R_RANGE.  If
+ * WITH_BASE is false only the delta is searched.  */
+static gpg_error_t
+find_range (struct keybox_index_s *idx, const unsigned char *key,
+            int with_base, struct index_range_s *r_range)
+{
+  unsigned char buffer[INDEX_ENTRYLEN];
+  const unsigned char *entry;
+  unsigned int lo, hi, mid;
+
+  r_range->dfirst = delta_bound (idx, key, 0);
+  r_range->dend = delta_bound (idx, key, 1);
+  r_range->first = r_range->end = 0;
+  if (!with_base)
+    return 0;
+
+  /* Find the first entry not less than KEY.  */
+  lo = 0;
+  hi = idx->nentries;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      entry = read_entry (idx, mid, buffer);
+      if (!entry)
+        return gpg_error (GPG_ERR_INV_OBJ);
+      if (memcmp (entry, key, INDEX_KEYLEN) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  r_range->first = lo;
+
+  /* Find the first entry greater than KEY.  */
+  hi = idx->nentries;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      entry = read_entry (idx, mid, buffer);
+      if (!entry)
+        return gpg_error (GPG_ERR_INV_OBJ);
+      if (memcmp (entry, key, INDEX_KEYLEN) <= 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  r_range->end = lo;
+  return 0;
+}
+
+
+/* Return the number of entries in RANGE.  */
+static unsigned int
+range_length (const struct index_range_s *range)
+{
+  return (range->end - range->first) + (range->dend - range->dfirst);
+}
+
+
+/* Append the offsets of the entries in RANGE to the array R_OFFSETS
+ * which has R_NOFFSETS items and space for R_NALLOC items.  The
+ * appended offsets are sorted because the delta only describes blobs
+ * appended after those in the index.  */
+static gpg_error_t
+read_range (struct keybox_index_s *idx, const struct index_range_s *range,
+            off_t **r_offsets, size_t *r_noffsets, size_t *r_nalloc)
+{
+  unsigned char entry[INDEX_ENTRYLEN];
+  const unsigned char *p;
+  unsigned int first, count;
+
+  count = range_length (range);
+  if (!count)
+    return 0;
+
+  if (*r_noffsets + count > *r_nalloc)
+    {
+      off_t *newp;
+      size_t newsize = *r_nalloc? *r_nalloc : 8;
+
+      while (newsize < *r_noffsets + count)
+        newsize *= 2;
+      newp = xtryrealloc (*r_offsets, newsize * sizeof *newp);
+      if (!newp)
+        return gpg_error_from_syserror ();
+      *r_offsets = newp;
+      *r_nalloc = newsize;
+    }
+
+  first = range->first;
+  if (first >= range->end)
+    ;
+  else if (idx->map)
+    {
+      p = idx->map + INDEX_HDRLEN + (size_t)first * INDEX_ENTRYLEN;
+      for (; first < range->end; first++, p += INDEX_ENTRYLEN)
+        (*r_offsets)[(*r_noffsets)++] = get64 (p + INDEX_KEYLEN);
+    }
+  else
+    {
+      if (fseeko (idx->fp, INDEX_HDRLEN + (off_t)first * INDEX_ENTRYLEN,
+                  SEEK_SET))
+        return gpg_error (GPG_ERR_INV_OBJ);
+      for (; first < range->end; first++)
+        {
+          if (fread (entry, INDEX_ENTRYLEN, 1, idx->fp) != 1)
+            return gpg_error (GPG_ERR_INV_OBJ);
+          (*r_offsets)[(*r_noffsets)++] = get64 (entry + INDEX_KEYLEN);
+        }
+    }
+
+  p = idx->delta + (size_t)range->dfirst * INDEX_ENTRYLEN;
+  for (first = range->dfirst; first < range->dend;
+       first++, p += INDEX_ENTRYLEN)
+    (*r_offsets)[(*r_noffsets)++] = get64 (p + INDEX_KEYLEN);
+  return 0;
+}
+
+
+/* Append the offsets of all entries matching KEY to the array
+ * R_OFFSETS which has R_NOFFSETS items and space for R_NALLOC
+ * items.  If WITH_BASE is false only the delta is searched.  */
+static gpg_error_t
+lookup_key (struct keybox_index_s *idx, const unsigned char *key,
+            int with_base,
+            off_t **r_offsets, size_t *r_noffsets, size_t *r_nalloc)
+{
+  gpg_error_t err;
+  struct index_range_s range;
+
+  err = find_range (idx, key, with_base, &range);
+  if (!err)
+    err = read_range (idx, &range, r_offsets, r_noffsets, r_nalloc);
+  return err;
+}
+
+
+static int
+cmp_ranges (const void *a, const void *b)
+{
+  unsigned int alen = range_length (a);
+  unsigned int blen = range_length (b);
+
+  return alen < blen? -1 : alen > blen? 1 : 0;
+}
+
+
+/* Append the offsets of the candidate blobs for a substring search
+ * for NAME of length NAMELEN to R_OFFSETS; see lookup_key.  */
+static gpg_error_t
+lookup_trigrams (struct keybox_index_s *idx,
+                 const unsigned char *name, size_t namelen,
+                 off_t **r_offsets, size_t *r_noffsets, size_t *r_nalloc)
+{
+  gpg_error_t err;
+  struct trigram_array_s trigrams;
+  struct index_range_s *ranges = NULL;
+  unsigned char key[INDEX_KEYLEN];
+  size_t base, ncand, nother, i, j, k;
+
+  memset (&trigrams, 0, sizeof trigrams);
+  add_trigrams (&trigrams, name, namelen);
+  if (trigrams.error)
+    return trigrams.error;
+  unique_trigrams (&trigrams);
+  if (!trigrams.n)
+    {
+      xfree (trigrams.data);
+      return gpg_error (GPG_ERR_NOT_SUPPORTED);
+    }
+
+  ranges = xtrycalloc (trigrams.n, sizeof *ranges);
+  if (!ranges)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (i=0; i < trigrams.n; i++)
+    {
+      trigram_key (key, trigrams.data[i]);
+      err = find_range (idx, key, 1, ranges + i);
+      if (err)
+        goto leave;
+    }
+  qsort (ranges, trigrams.n, sizeof *ranges, cmp_ranges);
+
+  /* Start with the rarest trigram and intersect with the others.
+   * The offsets of a range are sorted and each blob has only one
+   * entry for a trigram.  We use the space after the candidates for
+   * the offsets of the other trigram.  */
+  base = *r_noffsets;
+  err = read_range (idx, ranges, r_offsets, r_noffsets, r_nalloc);
+  ncand = *r_noffsets - base;
+  for (i=1; !err && i < trigrams.n && ncand > INDEX_ENOUGH_CANDIDATES; i++)
+    {
+      off_t *cand, *other;
+
+      err = read_range (idx, ranges + i, r_offsets, r_noffsets, r_nalloc);
+      if (err)
+        break;
+      cand = *r_offsets + base;
+      other = cand + ncand;
+      nother = *r_noffsets - base - ncand;
+      for (j=k=0; j < ncand && nother; )
+        {
+          if (cand[j] < *other)
+            j++;
+          else if (cand[j] > *other)
+            {
+              other++;
+              nother--;
+            }
+          else
+            {
+              cand[k++] = cand[j++];
+              other++;
+              nother--;
+            }
+        }
+      ncand = k;
+      *r_noffsets = base + ncand;
+    }
+
+ leave:
+  xfree (ranges);
+  xfree (trigrams.data);
+  return err;
+}
+
+
+static int
+cmp_offsets (const void *a, const void *b)
+{
+  off_t aa = *(const off_t *)a;
+  off_t bb = *(const off_t *)b;
+
+  return aa < bb? -1 : aa > bb? 1 : 0;
+}
+
+
+/* Use the index of the keybox at HD to find the candidate blobs for a
+ * search with DESC and NDESC.  On success a sorted array with the
+ * file offsets of all candidate blobs is stored at R_OFFSETS and its
+ * length at R_NOFFSETS; the caller needs to release it.  If the
+ * index can't be used for this search GPG_ERR_NOT_SUPPORTED or
+ * another error is returned and the caller should scan the keybox.
+ * HD->FP must be open.  The file position of HD->FP may be changed if
+ * the index needs to be rebuilt.  */
+gpg_error_t
+_keybox_index_lookup (KEYBOX_HANDLE hd,
+                      KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+                      off_t **r_offsets, size_t *r_noffsets)
+{
+  gpg_error_t err;
+  KB_NAME kb = hd->kb;
+  struct keybox_index_s *idx;
+  struct keybox_index_stamp_s stamp;
+  int need_grips, with_base;
+  unsigned char key[INDEX_KEYLEN];
+  const unsigned char *name;
+  size_t namelen;
+  off_t *offsets = NULL;
+  size_t noffsets = 0;
+  size_t nalloc = 0;
+  size_t n, i;
+
+  *r_offsets = NULL;
+  *r_noffsets = 0;
+
+  if (!kb || !hd->fp || !indexable_desc (desc, ndesc, &need_grips))
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  if (get_stamp (fileno (hd->fp), &stamp))
+    return gpg_error_from_syserror ();
+
+  if (!kb->index)
+    {
+      kb->index = xtrycalloc (1, sizeof *kb->index);
+      if (!kb->index)
+        return gpg_error_from_syserror ();
+    }
+  idx = kb->index;
+
+  if (!idx->fp || !stamp_equal (&idx->stamp, &stamp)
+      || (need_grips && !(idx->flags & INDEX_FLAG_GRIPS)))
+    {
+      /* We have no open index or it does not match the keybox; maybe
+       * it has been updated in the meantime.  */
+      if (open_index (kb)
+          || !stamp_equal (&idx->stamp, &stamp)
+          || (need_grips && !(idx->flags & INDEX_FLAG_GRIPS)))
+        {
+          close_index (kb);
+          if (stamp.size < INDEX_MIN_FILESIZE
+              || (idx->build_failed
+                  && stamp_equal (&idx->failed_stamp, &stamp)))
+            return gpg_error (GPG_ERR_NOT_SUPPORTED);
+          if (build_index (kb, hd->fp, &stamp) || open_index (kb)
+              || !stamp_equal (&idx->stamp, &stamp))
+            {
+              close_index (kb);
+              idx->build_failed = 1;
+              idx->failed_stamp = stamp;
+              return gpg_error (GPG_ERR_NOT_SUPPORTED);
+            }
+        }
+    }
+
+  for (n=0; n < ndesc; n++)
+    {
+      memset (key, 0, sizeof key);
+      switch (desc[n].mode)
+        {
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          key[0] = INDEX_KIND_KID;
+          put32 (key+1, desc[n].u.kid[0]);
+          put32 (key+5, desc[n].u.kid[1]);
+          break;
+        case KEYDB_SEARCH_MODE_KEYGRIP:
+          key[0] = INDEX_KIND_GRIP;
+          memcpy (key+1, desc[n].u.grip, 20);
+          break;
+        case KEYDB_SEARCH_MODE_MAIL:
+          name = desc_name (desc + n, &namelen);
+          mail_key (key, name, namelen);
+          break;
+        case KEYDB_SEARCH_MODE_ISSUER:
+        case KEYDB_SEARCH_MODE_SUBJECT:
+        case KEYDB_SEARCH_MODE_ISSUER_SN:
+          name = (const unsigned char *)desc[n].u.name;
+          err = dn_key (key,
+                        (desc[n].mode == KEYDB_SEARCH_MODE_ISSUER?
+                         INDEX_KIND_ISSUER :
+                         desc[n].mode == KEYDB_SEARCH_MODE_SUBJECT?
+                         INDEX_KIND_SUBJECT : INDEX_KIND_ISSUER_SN),
+                        name, strlen (desc[n].u.name),
+                        (desc[n].mode == KEYDB_SEARCH_MODE_ISSUER_SN?
+                         desc[n].sn : NULL),
+                        desc[n].snlen);
+          if (err)
+            {
+              xfree (offsets);
+              close_index (kb);
+              return err;
+            }
+          break;
+        case KEYDB_SEARCH_MODE_MAILSUB:
+        case KEYDB_SEARCH_MODE_SUBSTR:
+        case KEYDB_SEARCH_MODE_EXACT:
+          break;  /* Use the trigrams.  */
+        default:
+          key[0] = INDEX_KIND_FPR;
+          memcpy (key+1, desc[n].u.fpr, 20);
+          break;
+        }
+      /* The keyid filter does not cover the delta.  */
+      if (key[0] == INDEX_KIND_KID)
+        with_base = filter_maybe (idx, key + 1);
+      else if (key[0] == INDEX_KIND_FPR)
+        with_base = filter_maybe (idx, key + 1 + 12);
+      else
+        with_base = 1;
+      if (key[0])
+        err = lookup_key (idx, key, with_base, &offsets, &noffsets, &nalloc);
+      else
+        {
+          name = desc_name (desc + n, &namelen);
+          err = lookup_trigrams (idx, name, namelen,
+                                 &offsets, &noffsets, &nalloc);
+        }
+      if (err)
+        {
+          xfree (offsets);
+          close_index (kb);
+          return err;
+        }
+    }
+
+  /* Sort and remove duplicates.  */
+  if (noffsets > 1)
+    {
+      qsort (offsets, noffsets, sizeof *offsets, cmp_offsets);
+      for (i=0, n=1; n < noffsets; n++)
+        if (offsets[n] != offsets[i])
+          offsets[++i] = offsets[n];
+      noffsets = i + 1;
+    }
+
+  *r_offsets = offsets;
+  *r_noffsets = noffsets;
+  return 0;
+}
+
+
+/* Append a record for the change of the keybox file to STAMP with
+ * the entries from ARRAY to the delta file of KB.  The index of KB
+ * must be open.  */
+static gpg_error_t
+append_delta (KB_NAME kb, struct entry_array_s *array,
+              const struct keybox_index_stamp_s *stamp)
+{
+  gpg_error_t err = 0;
+  struct keybox_index_s *idx = kb->index;
+  char *fname, *tmpfname = NULL;
+  unsigned char *buffer;
+  size_t buflen, hdrlen;
+  FILE *fp;
+  struct stat st;
+
+  /* Without a valid delta we need to write a new file.  */
+  hdrlen = idx->deltalen? 0 : DELTA_HDRLEN;
+  buflen = hdrlen + DELTA_RECHDRLEN + array->n * INDEX_ENTRYLEN;
+  buffer = xtrycalloc (1, buflen);
+  if (!buffer)
+    return gpg_error_from_syserror ();
+  if (hdrlen)
+    {
+      memcpy (buffer, "KBXd", 4);
+      buffer[4] = DELTA_VERSION;
+      put_stamp (buffer + 8, &idx->base_stamp);
+    }
+  put32 (buffer + hdrlen, array->n);
+  put_stamp (buffer + hdrlen + 8, stamp);
+  if (array->n)
+    {
+      qsort (array->data, array->n, INDEX_ENTRYLEN, cmp_entries);
+      memcpy (buffer + hdrlen + DELTA_RECHDRLEN, array->data,
+              array->n * INDEX_ENTRYLEN);
+    }
+
+  fname = delta_fname (kb);
+  if (!fname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  if (idx->deltalen)
+    {
+      /* The caller holds the lock; thus we may append in place.  A
+       * truncated record left by a crash would hide our record.  */
+      fp = fopen (fname, "ab");
+      if (!fp)
+        err = gpg_error_from_syserror ();
+      else if (fstat (fileno (fp), &st))
+        err = gpg_error_from_syserror ();
+      else if (st.st_size != idx->deltalen)
+        err = gpg_error (GPG_ERR_INV_OBJ);
+      else if (fwrite (buffer, buflen, 1, fp) != 1)
+        err = gpg_error_from_syserror ();
+      if (fp && fclose (fp) && !err)
+        err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Create the file under a temporary name so that readers never see
+   * a partial header.  */
+  tmpfname = xtryasprintf ("%s.%lu" EXTSEP_S "tmp",
+                           fname, (unsigned long)getpid ());
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      if (fwrite (buffer, buflen, 1, fp) != 1)
+        err = gpg_error_from_syserror ();
+      if (fclose (fp) && !err)
+        err = gpg_error_from_syserror ();
+      if (!err)
+        err = gnupg_rename_file (tmpfname, fname, NULL);
+      if (err)
+        gnupg_remove (tmpfname);
+    }
+
+ leave:
+  xfree (tmpfname);
+  xfree (fname);
+  xfree (buffer);
+  return err;
+}
+
+
+/* Remove the delta file of KB.  */
+static void
+remove_delta (KB_NAME kb)
+{
+  char *fname;
+
+  fname = delta_fname (kb);
+  if (fname)
+    gnupg_remove (fname);
+  xfree (fname);
+}
+
+
+/* Update the index of KB after a change of the keybox file.
+ * OLDSTAMP is the stamp of the file before the change as returned by
+ * _keybox_index_get_stamp.  The blob at file offset OFF with a length
+ * of OLDLEN has been replaced by NEWLEN bytes; all entries for the old
+ * blob are removed and the entries for BLOB, which may be NULL, are
+ * added.  An insert is described by an OLDLEN of 0 and a delete which
+ * only marks the blob as deleted by equal lengths and no BLOB.  If
+ * the index did not match the keybox before the change or the change
+ * can't be verified the index is removed.  The caller must hold the
+ * lock of the keybox.
+ *
+ * Changes which do not move other blobs are appended to the delta
+ * file; the entries of a deleted blob are then kept.  Other changes
+ * and a delta which grew too large are merged into a new index
+ * file.  */
+void
+_keybox_index_update (KB_NAME kb, const struct keybox_index_stamp_s *oldstamp,
+                      off_t off, size_t oldlen, size_t newlen,
+                      KEYBOXBLOB blob)
+{
+  gpg_error_t err;
+  struct keybox_index_s *idx;
+  struct keybox_index_stamp_s stamp;
+  struct entry_array_s array;
+  unsigned char *p;
+  size_t n;
+  off_t entryoff;
+  char *fname;
+  int with_grips;
+
+  if (!kb->index)
+    {
+      kb->index = xtrycalloc (1, sizeof *kb->index);
+      if (!kb->index)
+        return;
+    }
+  idx = kb->index;
+
+  if (open_index (kb))
+    return;  /* No index.  */
+  if (!oldstamp->size || !stamp_equal (&idx->stamp, oldstamp))
+    goto remove;  /* The old index was already stale.  */
+
+  _keybox_index_get_stamp (kb, &stamp);
+  if (stamp.size != oldstamp->size + newlen - oldlen)
+    goto remove;  /* The index would not match.  */
+
+  with_grips = !!(idx->flags & INDEX_FLAG_GRIPS);
+#ifndef KEYBOX_WITH_X509
+  /* We can't compute the keygrip of a new X.509 blob.  */
+  if (blob && blob_get_type (blob) == KEYBOX_BLOBTYPE_X509)
+    with_grips = 0;
+#endif
+
+  memset (&array, 0, sizeof array);
+  if (with_grips == !!(idx->flags & INDEX_FLAG_GRIPS)
+      && (oldlen == newlen || (!oldlen && off == (off_t)oldstamp->size)))
+    {
+      if (blob)
+        add_blob_entries (&array, blob, off, with_grips);
+      if (!array.error
+          && array.n <= INDEX_MAX_DELTA - idx->ndelta
+          && !append_delta (kb, &array, &stamp))
+        {
+          xfree (array.data);
+          close_index (kb);
+          return;
+        }
+      /* Merge the delta into a new index.  */
+      xfree (array.data);
+      memset (&array, 0, sizeof array);
+    }
+
+  array.n = array.allocated = idx->nentries + idx->ndelta;
+  if (array.n)
+    {
+      array.data = xtrymalloc (array.n * INDEX_ENTRYLEN);
+      if (!array.data)
+        goto remove;
+      if (idx->map)
+        memcpy (array.data, idx->map + INDEX_HDRLEN,
+                (size_t)idx->nentries * INDEX_ENTRYLEN);
+      else if (fseeko (idx->fp, INDEX_HDRLEN, SEEK_SET)
+               || (idx->nentries
+                   && fread (array.data, INDEX_ENTRYLEN, idx->nentries,
+                             idx->fp) != idx->nentries))
+        {
+          xfree (array.data);
+          goto remove;
+        }
+      if (idx->ndelta)
+        memcpy (array.data + (size_t)idx->nentries * INDEX_ENTRYLEN,
+                idx->delta, (size_t)idx->ndelta * INDEX_ENTRYLEN);
+    }
+
+  /* Remove the entries of the old blob and shift the offsets of the
+   * following blobs.  */
+  for (p = array.data, n = 0; n < array.n; )
+    {
+      entryoff = get64 (p + INDEX_KEYLEN);
+      if (oldlen && entryoff >= off && entryoff < off + (off_t)oldlen)
+        {
+          memmove (p, p + INDEX_ENTRYLEN, (array.n - n - 1) * INDEX_ENTRYLEN);
+          array.n--;
+          continue;
+        }
+      if (entryoff >= off + (off_t)oldlen && newlen != oldlen)
+        put64 (p + INDEX_KEYLEN, entryoff + (off_t)newlen - (off_t)oldlen);
+      p += INDEX_ENTRYLEN;
+      n++;
+    }
+
+  if (blob)
+    add_blob_entries (&array, blob, off, with_grips);
+
+  err = array.error;
+  if (!err)
+    err = write_index (kb, &array, &stamp, with_grips? INDEX_FLAG_GRIPS : 0);
+  xfree (array.data);
+  if (!err)
+    {
+      remove_delta (kb);
+      return;
+    }
+
+ remove:
+  close_index (kb);
+  fname = index_fname (kb);
+  if (fname)
+    gnupg_remove (fname);
+  xfree (fname);
+  remove_delta (kb);
+}
@@ -63,6 +63,8 @@ keybox_register_file (const char *fname, int secret, void **r_token)
   kr->lockhd = NULL;
   kr->is_locked = 0;
   kr->did_full_scan = 0;
+  kr->index = NULL;
+  kr->compress_pending = 0;
   /* keep a list of all issued pointers */
   kr->next = kb_names;
   kb_names = kr;
@@ -177,6 +179,7 @@ keybox_release (KEYBOX_HANDLE hd)
     }
   _keybox_release_blob (hd->found.blob);
   _keybox_release_blob (hd->saved_found.blob);
+  _keybox_unmap_file (hd);
   if (hd->fp)
     {
       fclose (hd->fp);
@@ -250,6 +253,7 @@ _keybox_close_file (KEYBOX_HANDLE hd)
   for (idx=0; idx < hd->kb->handle_table_size; idx++)
     if ((roverhd = hd->kb->handle_table[idx]))
       {
+        _keybox_unmap_file (roverhd);
         if (roverhd->fp)
           {
             fclose (roverhd->fp);
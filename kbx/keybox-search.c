@@ -498,12 +498,11 @@ blob_cmp_mail (KEYBOXBLOB blob, const char *name, size_t namelen, int substr,
 
 
 #ifdef KEYBOX_WITH_X509
-/* Return true if the key in BLOB matches the 20 bytes keygrip GRIP.
-   We don't have the keygrips as meta data, thus we need to parse the
-   certificate. Fixme: We might want to return proper error codes
-   instead of failing a search for invalid certificates etc.  */
-static int
-blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
+/* Compute the 20 byte keygrip of the certificate in the X.509 BLOB
+   and store it at GRIP.  We don't have the keygrips as meta data,
+   thus we need to parse the certificate.  */
+gpg_error_t
+_keybox_get_x509_keygrip (KEYBOXBLOB blob, unsigned char *grip)
 {
   int rc;
   const unsigned char *buffer;
@@ -513,56 +512,71 @@ blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
   ksba_cert_t cert = NULL;
   ksba_sexp_t p = NULL;
   gcry_sexp_t s_pkey;
-  unsigned char array[20];
   unsigned char *rcp;
   size_t n;
 
   buffer = _keybox_get_blob_image (blob, &length);
   if (length < 40)
-    return 0; /* Too short. */
+    return gpg_error (GPG_ERR_TOO_SHORT);
   cert_off = get32 (buffer+8);
   cert_len = get32 (buffer+12);
   if ((uint64_t)cert_off+(uint64_t)cert_len > (uint64_t)length)
-    return 0; /* Too short.  */
+    return gpg_error (GPG_ERR_TOO_SHORT);
 
   rc = ksba_reader_new (&reader);
   if (rc)
-    return 0; /* Problem with ksba. */
+    return rc; /* Problem with ksba. */
   rc = ksba_reader_set_mem (reader, buffer+cert_off, cert_len);
   if (rc)
-    goto failed;
+    goto leave;
   rc = ksba_cert_new (&cert);
   if (rc)
-    goto failed;
+    goto leave;
   rc = ksba_cert_read_der (cert, reader);
   if (rc)
-    goto failed;
+    goto leave;
   p = ksba_cert_get_public_key (cert);
   if (!p)
-    goto failed;
+    {
+      rc = gpg_error (GPG_ERR_INV_CERT_OBJ);
+      goto leave;
+    }
   n = gcry_sexp_canon_len (p, 0, NULL, NULL);
   if (!n)
-    goto failed;
+    {
+      rc = gpg_error (GPG_ERR_INV_SEXP);
+      goto leave;
+    }
   rc = gcry_sexp_sscan (&s_pkey, NULL, (char*)p, n);
   if (rc)
     {
       gcry_sexp_release (s_pkey);
-      goto failed;
+      goto leave;
     }
-  rcp = gcry_pk_get_keygrip (s_pkey, array);
+  rcp = gcry_pk_get_keygrip (s_pkey, grip);
   gcry_sexp_release (s_pkey);
   if (!rcp)
-    goto failed; /* Can't calculate keygrip. */
+    rc = gpg_error (GPG_ERR_INV_CERT_OBJ); /* Can't calculate keygrip. */
 
+ leave:
   xfree (p);
   ksba_cert_release (cert);
   ksba_reader_release (reader);
+  return rc;
+}
+
+
+/* Return true if the key in BLOB matches the 20 bytes keygrip GRIP.
+   Fixme: We might want to return proper error codes instead of
+   failing a search for invalid certificates etc.  */
+static int
+blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
+{
+  unsigned char array[20];
+
+  if (_keybox_get_x509_keygrip (blob, array))
+    return 0;
   return !memcmp (array, grip, 20);
- failed:
-  xfree (p);
-  ksba_cert_release (cert);
-  ksba_reader_release (reader);
-  return 0;
 }
 #endif /*KEYBOX_WITH_X509*/
 
@@ -674,6 +688,93 @@ has_subject (KEYBOXBLOB blob, const char *name)
 }
 
 
+/* Return the data of the item with TAG from the reserved space of
+   the blob BUFFER of LENGTH and store its length at R_LEN.  Returns
+   NULL if the blob has no such item.  */
+static const unsigned char *
+get_reserved_item (const unsigned char *buffer, size_t length,
+                   unsigned int tag, size_t *r_len)
+{
+  size_t pos, nkeys, keyinfolen, nuids, uidinfolen, nsigs, siginfolen;
+  size_t nres, itemtag, itemlen;
+
+  if (length < 40)
+    return NULL;
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18);
+  pos = 20 + keyinfolen * nkeys;
+  if (pos + 2 > length)
+    return NULL;
+  pos += 2 + get16 (buffer + pos);  /* Skip the serial.  */
+  if (pos + 4 > length)
+    return NULL;
+  nuids = get16 (buffer + pos);
+  uidinfolen = get16 (buffer + pos + 2);
+  pos += 4 + uidinfolen * nuids;
+  if (pos + 4 > length)
+    return NULL;
+  nsigs = get16 (buffer + pos);
+  siginfolen = get16 (buffer + pos + 2);
+  pos += 4 + siginfolen * nsigs;
+  /* Ownertrust, validity, RFU, recheck, latest and created.  */
+  pos += 16;
+  if (pos + 4 > length)
+    return NULL;
+  nres = get32 (buffer + pos);
+  pos += 4;
+  if (nres > length - pos)
+    return NULL;
+
+  while (nres >= 4)
+    {
+      itemtag = get16 (buffer + pos);
+      itemlen = get16 (buffer + pos + 2);
+      pos += 4;
+      nres -= 4;
+      if (itemlen > nres)
+        break;
+      if (itemtag == tag)
+        {
+          *r_len = itemlen;
+          return buffer + pos;
+        }
+      pos += itemlen;
+      nres -= itemlen;
+    }
+  return NULL;
+}
+
+
+/* Return false if BLOB does surely not have the string TYPE,NAME as
+   user id or mail address.  See keybox-blob.c for the UID filter.  */
+static int
+uidfilter_maybe (KEYBOXBLOB blob, int type, const char *name, size_t namelen)
+{
+  const unsigned char *buffer, *filter;
+  size_t length, filterlen;
+  unsigned int nhash, nbits, i, bit;
+  u32 h1, h2;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  filter = get_reserved_item (buffer, length, KEYBOX_RES_UIDFILTER,
+                              &filterlen);
+  if (!filter || filterlen <= 2)
+    return 1;  /* No filter - need to look at the user ids.  */
+
+  nhash = filter[0];
+  filter += 2;
+  nbits = (filterlen - 2) * 8;
+  _keybox_uidfilter_hash (type, name, namelen, &h1, &h2);
+  for (i=0; i < nhash; i++)
+    {
+      bit = (h1 + i * h2) % nbits;
+      if (!(filter[bit / 8] & (1 << (bit % 8))))
+        return 0;
+    }
+  return 1;
+}
+
+
 static inline int
 has_username (KEYBOXBLOB blob, const char *name, int substr)
 {
@@ -687,6 +788,8 @@ has_username (KEYBOXBLOB blob, const char *name, int substr)
     return 0;
 
   namelen = strlen (name);
+  if (!substr && namelen && !uidfilter_maybe (blob, 'u', name, namelen))
+    return 0;
   return blob_cmp_name (blob, -1 /* all subject/user names */, name,
                         namelen, substr, (btype == KEYBOX_BLOBTYPE_X509));
 }
@@ -710,6 +813,8 @@ has_mail (KEYBOXBLOB blob, const char *name, int substr)
   namelen = strlen (name);
   if (namelen && name[namelen-1] == '>')
     namelen--;
+  if (!substr && namelen && !uidfilter_maybe (blob, 'm', name, namelen))
+    return 0;
   return blob_cmp_mail (blob, name, namelen, substr,
                         (btype == KEYBOX_BLOBTYPE_X509));
 }
@@ -767,6 +872,7 @@ keybox_search_reset (KEYBOX_HANDLE hd)
         {
           /* Ooops.  Seek did not work.  Close so that the search will
            * open the file again.  */
+          _keybox_unmap_file (hd);
           fclose (hd->fp);
           hd->fp = NULL;
         }
@@ -793,6 +899,12 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
   KEYBOXBLOB blob = NULL;
   struct sn_array_s *sn_array = NULL;
   int pk_no, uid_no;
+  off_t *offsets = NULL;
+  size_t noffsets = 0;
+  size_t offidx = 0;
+  int use_index = 0;
+  KEYBOXBLOB mblob = NULL;
+  off_t pos = 0;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -847,6 +959,40 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         }
     }
 
+  _keybox_map_file (hd);
+
+  /* For searches by fingerprint, keyid, keygrip, user id, issuer or
+     subject we try to get the candidate blobs from the index.  Only
+     those blobs located after the current file position are
+     considered.  */
+
+  {
+    off_t curpos = ftello (hd->fp);
+
+    if (hd->map)
+      {
+        /* In mmap mode we keep track of the position in POS and blobs
+           are compared in-place using MBLOB.  */
+        if (curpos == (off_t)(-1) || _keybox_new_blob (&mblob, NULL, 0, 0))
+          _keybox_unmap_file (hd);
+        pos = curpos;
+      }
+
+    if (curpos != (off_t)(-1)
+        && !_keybox_index_lookup (hd, desc, ndesc, &offsets, &noffsets))
+      {
+        use_index = 1;
+        while (offidx < noffsets && offsets[offidx] < curpos)
+          offidx++;
+      }
+    else if (curpos != (off_t)(-1) && fseeko (hd->fp, curpos, SEEK_SET))
+      {
+        hd->error = gpg_error_from_syserror ();
+        xfree (sn_array);
+        return hd->error;
+      }
+  }
+
   /* Kludge: We need to convert an SN given as hexstring to its binary
      representation - in some cases we are not able to store it in the
      search descriptor, because due to the way we use it, it is not
@@ -914,18 +1060,64 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       unsigned int blobflags;
       int blobtype;
 
-      _keybox_release_blob (blob); blob = NULL;
-      rc = _keybox_read_blob (&blob, hd->fp, NULL);
+      if (blob != mblob)
+        _keybox_release_blob (blob);
+      blob = NULL;
+      if (use_index)
+        {
+          if (offidx >= noffsets)
+            {
+              rc = -1; /* No more candidates.  */
+              break;
+            }
+          pos = offsets[offidx];
+          if (!hd->map && fseeko (hd->fp, pos, SEEK_SET))
+            {
+              rc = gpg_error_from_syserror ();
+              break;
+            }
+        }
+      if (hd->map)
+        {
+          rc = _keybox_read_mapped_blob (hd, &pos, mblob);
+          if (!rc)
+            blob = mblob;
+          else if (rc == -1)
+            {
+              /* End of the mapping; check whether the file has been
+                 extended in the meantime.  */
+              if (fseeko (hd->fp, pos, SEEK_SET))
+                rc = gpg_error_from_syserror ();
+              else
+                {
+                  rc = _keybox_read_blob (&blob, hd->fp, NULL);
+                  pos = ftello (hd->fp);
+                }
+            }
+        }
+      else
+        rc = _keybox_read_blob (&blob, hd->fp, NULL);
       if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
           && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
         {
           ++*r_skipped;
+          if (use_index)
+            offidx++;
           continue; /* Skip too large records.  */
         }
 
       if (rc)
         break;
 
+      if (use_index)
+        {
+          /* A blob deleted after the index has been written is
+             skipped by _keybox_read_blob; make sure we do not use
+             the next blob instead.  */
+          if (_keybox_get_blob_fileoffset (blob) != offsets[offidx++])
+            continue;
+        }
+
       blobtype = blob_get_type (blob);
       if (blobtype == KEYBOX_BLOBTYPE_HEADER)
         continue;
@@ -1036,6 +1228,16 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         break; /* got it */
     }
 
+  /* Only a matching blob is copied out of the mapping.  */
+  if (!rc && blob == mblob)
+    {
+      rc = _keybox_detach_blob (blob);
+      if (!rc)
+        mblob = NULL;
+    }
+  if (hd->map && fseeko (hd->fp, pos, SEEK_SET) && !rc)
+    rc = gpg_error_from_syserror ();
+
   if (!rc)
     {
       hd->found.blob = blob;
@@ -1044,17 +1246,21 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
     }
   else if (rc == -1 || gpg_err_code (rc) == GPG_ERR_EOF)
     {
-      _keybox_release_blob (blob);
+      if (blob != mblob)
+        _keybox_release_blob (blob);
       hd->eof = 1;
     }
   else
     {
-      _keybox_release_blob (blob);
+      if (blob != mblob)
+        _keybox_release_blob (blob);
       hd->error = rc;
     }
+  _keybox_release_blob (mblob);
 
   if (sn_array)
     release_sn_array (sn_array, ndesc);
+  xfree (offsets);
 
   return rc;
 }
@@ -1071,18 +1277,29 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
 /* Return the last found keyblock.  Returns 0 on success and stores a
  * new iobuf at R_IOBUF.  R_UID_NO and R_PK_NO are used to retun the
  * number of the key or user id which was matched the search criteria;
- * if not known they are set to 0. */
+ * if not known they are set to 0.  If R_SIGSTATUS is not NULL, an
+ * array with the number of signatures in the first item followed by
+ * the stored status of each signature is stored there; the caller
+ * must xfree it.  NULL is stored if there are no signatures or if
+ * the status values are not bound to the keyblock by a matching
+ * signature status binding (see keybox-blob.c).  */
 gpg_error_t
 keybox_get_keyblock (KEYBOX_HANDLE hd, iobuf_t *r_iobuf,
-                     int *r_pk_no, int *r_uid_no)
+                     int *r_pk_no, int *r_uid_no, u32 **r_sigstatus)
 {
   gpg_error_t err;
   const unsigned char *buffer;
   size_t length;
   size_t image_off, image_len;
   size_t siginfo_off, siginfo_len;
+  size_t nsigs, infolen, n, bindlen;
+  const unsigned char *p, *binding;
+  unsigned char digest[20];
+  u32 *sigstatus = NULL;
 
   *r_iobuf = NULL;
+  if (r_sigstatus)
+    *r_sigstatus = NULL;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -1105,9 +1322,44 @@ keybox_get_keyblock (KEYBOX_HANDLE hd, iobuf_t *r_iobuf,
   if (err)
     return err;
 
+  if (r_sigstatus)
+    {
+      p = buffer + siginfo_off;
+      nsigs = get16 (p);
+      infolen = get16 (p + 2);
+      if (nsigs && infolen >= 4
+          && siginfo_off + 4 + nsigs * infolen <= length)
+        {
+          sigstatus = xtrymalloc ((1 + nsigs) * sizeof *sigstatus);
+          if (!sigstatus)
+            return gpg_error_from_syserror ();
+          sigstatus[0] = nsigs;
+          for (p += 4, n=1; n <= nsigs; p += infolen, n++)
+            sigstatus[n] = get32 (p);
+
+          /* Only use the status values if they were written for
+           * this keyblock.  */
+          binding = get_reserved_item (buffer, length,
+                                       KEYBOX_RES_SIGSTATUS, &bindlen);
+          if (binding && bindlen >= 22
+              && binding[0] == SIGSTATUS_BINDING_VERSION)
+            _keybox_sigstatus_digest (sigstatus + 1, nsigs,
+                                      buffer + image_off, image_len, digest);
+          else
+            binding = NULL;
+          if (!binding || memcmp (binding + 2, digest, 20))
+            {
+              xfree (sigstatus);
+              sigstatus = NULL;
+            }
+        }
+    }
+
   *r_pk_no  = hd->found.pk_no;
   *r_uid_no = hd->found.uid_no;
   *r_iobuf = iobuf_temp_with_content (buffer+image_off, image_len);
+  if (r_sigstatus)
+    *r_sigstatus = sigstatus;
   return 0;
 }
 
@@ -1205,6 +1457,16 @@ keybox_offset (KEYBOX_HANDLE hd)
   return ftello (hd->fp);
 }
 
+/* Return the file offset of the blob found by the last search or -1
+   if there is no search result.  */
+off_t
+keybox_found_offset (KEYBOX_HANDLE hd)
+{
+  if (!hd || !hd->found.blob)
+    return -1;
+  return _keybox_get_blob_fileoffset (hd->found.blob);
+}
+
 gpg_error_t
 keybox_seek (KEYBOX_HANDLE hd, off_t offset)
 {
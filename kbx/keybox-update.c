@@ -25,6 +25,8 @@
 #include <time.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "keybox-defs.h"
 #include "../common/sysutils.h"
@@ -37,6 +39,20 @@
 #define FILECOPY_DELETE 2
 #define FILECOPY_UPDATE 3
 
+/* Blobs are appended to the file and replaced or deleted blobs are
+   only flagged as deleted.  The number of bytes used by such garbage
+   is kept in the header blob; once it reaches a quarter of the file
+   size, but not before KEYBOX_MIN_GARBAGE bytes, the file is
+   compressed.  */
+#define KEYBOX_GARBAGE_RATIO 4
+#define KEYBOX_MIN_GARBAGE   (256 * 1024)
+
+/* If set a compress run requested by an update or delete is only
+   recorded and done by keybox_compress_pending.  */
+static int defer_compress;
+
+static int do_compress (KEYBOX_HANDLE hd, int force);
+
 
 #if !defined(HAVE_FSEEKO) && !defined(fseeko)
 
@@ -68,6 +84,12 @@ fseeko (FILE * stream, off_t newpos, int whence)
 }
 #endif /* !defined(HAVE_FSEEKO) && !defined(fseeko) */
 
+#if defined(HAVE_DOSISH_SYSTEM) && !defined(ftruncate)
+#define ftruncate chsize
+#endif
+
+static int do_compress (KEYBOX_HANDLE hd, int force);
+
 
 static int
 create_tmp_file (const char *template,
@@ -353,15 +375,162 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
 }
 
 
-/* Insert the OpenPGP keyblock {IMAGE,IMAGELEN} into HD. */
+/* Append BLOB to the keybox file FNAME.  If the file does not exist
+   it is created.  FOR_OPENPGP indicates that this is called due to an
+   OpenPGP keyblock change.  */
+static gpg_error_t
+append_blob (const char *fname, KEYBOXBLOB blob, int secret, int for_openpgp)
+{
+  gpg_error_t err;
+  FILE *fp;
+  unsigned char buffer[8];
+  struct stat st;
+
+  fp = fopen (fname, "r+b");
+  if (!fp && errno == ENOENT)
+    return blob_filecopy (FILECOPY_INSERT, fname, blob, secret, for_openpgp, 0);
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  /* We don't want any buffered data to show up after a truncation.  */
+  setvbuf (fp, NULL, _IONBF, 0);
+
+  /* If this is for OpenPGP, make sure that the openpgp flag is set
+     in the header.  */
+  if (for_openpgp && fread (buffer, sizeof buffer, 1, fp) == 1
+      && buffer[4] == KEYBOX_BLOBTYPE_HEADER && !(buffer[7] & 0x02))
+    {
+      buffer[7] |= 0x02; /* OpenPGP data may be available.  */
+      if (fseeko (fp, 7, SEEK_SET) || putc (buffer[7], fp) == EOF)
+        {
+          err = gpg_error_from_syserror ();
+          fclose (fp);
+          return err;
+        }
+    }
+
+  if (fseeko (fp, 0, SEEK_END) || fstat (fileno (fp), &st))
+    {
+      err = gpg_error_from_syserror ();
+      fclose (fp);
+      return err;
+    }
+
+  err = _keybox_write_blob (blob, fp);
+  if (!err && fflush (fp))
+    err = gpg_error_from_syserror ();
+  if (err)
+    {
+      /* Remove a partly written blob so that the file stays
+         parsable.  */
+      if (ftruncate (fileno (fp), st.st_size))
+        ;
+    }
+
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  return err;
+}
+
+
+/* Add N to the number of garbage bytes recorded in the header blob
+   of the keybox file opened at FP and return the new value.  Returns
+   0 if the file has no header blob with room for the counter.  The
+   counter is only a hint and thus write errors are ignored.  */
+static u32
+add_garbage (FILE *fp, size_t n)
+{
+  unsigned char buffer[32];
+  u32 garbage;
+
+  if (fseeko (fp, 0, SEEK_SET)
+      || fread (buffer, sizeof buffer, 1, fp) != 1
+      || buf32_to_u32 (buffer) < sizeof buffer
+      || buffer[4] != KEYBOX_BLOBTYPE_HEADER)
+    return 0;
+
+  garbage = buf32_to_u32 (buffer+24);
+  if (n > 0xffffffff - garbage)
+    garbage = 0xffffffff;
+  else
+    garbage += n;
+  buffer[24]   = (garbage >> 24);
+  buffer[24+1] = (garbage >> 16);
+  buffer[24+2] = (garbage >>  8);
+  buffer[24+3] = (garbage      );
+
+  if (fseeko (fp, 24, SEEK_SET) || fwrite (buffer+24, 4, 1, fp) != 1)
+    return 0;
+  return garbage;
+}
+
+
+/* Compress the keybox of HD now or, if compress runs are deferred,
+   when keybox_compress_pending is called.  */
+static void
+request_compress (KEYBOX_HANDLE hd)
+{
+  if (defer_compress)
+    hd->kb->compress_pending = 1;
+  else
+    do_compress (hd, 1);
+}
+
+
+/* Flag the blob of LENGTH bytes at offset OFF of the keybox file
+   FNAME as deleted.  On success R_COMPRESS is set if the garbage in
+   the file is large enough to justify a compress run.  */
+static gpg_error_t
+delete_blob (const char *fname, off_t off, size_t length, int *r_compress)
+{
+  gpg_error_t err;
+  FILE *fp;
+  u32 garbage;
+  struct stat st;
+
+  *r_compress = 0;
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  if (fseeko (fp, off + 4, SEEK_SET))
+    err = gpg_error_from_syserror ();
+  else if (putc (0, fp) == EOF)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      err = 0;
+      garbage = add_garbage (fp, length);
+      if (garbage >= KEYBOX_MIN_GARBAGE
+          && !fflush (fp) && !fstat (fileno (fp), &st)
+          && garbage >= st.st_size / KEYBOX_GARBAGE_RATIO)
+        *r_compress = 1;
+    }
+
+  if (fclose (fp))
+    {
+      if (!err)
+        err = gpg_error_from_syserror ();
+    }
+  return err;
+}
+
+
+/* Insert the OpenPGP keyblock {IMAGE,IMAGELEN} into HD.  SIGSTATUS
+ * is either NULL or an array with the number of signatures in the
+ * first item followed by the status of each signature as described
+ * in keybox-blob.c.  */
 gpg_error_t
-keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
+keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen,
+                        const u32 *sigstatus)
 {
   gpg_error_t err;
   const char *fname;
   KEYBOXBLOB blob;
   size_t nparsed;
   struct _keybox_openpgp_info info;
+  struct keybox_index_stamp_s oldstamp;
+  size_t n;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_HANDLE);
@@ -382,25 +551,28 @@ keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
     return err;
   assert (nparsed <= imagelen);
   err = _keybox_create_openpgp_blob (&blob, &info, image, imagelen,
-                                      hd->ephemeral);
+                                     sigstatus, hd->ephemeral);
   _keybox_destroy_openpgp_info (&info);
   if (!err)
     {
-      err = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 1, 0);
+      _keybox_index_get_stamp (hd->kb, &oldstamp);
+      err = append_blob (fname, blob, hd->secret, 1);
+      if (!err)
+        {
+          _keybox_get_blob_image (blob, &n);
+          _keybox_index_update (hd->kb, &oldstamp, oldstamp.size, 0, n, blob);
+        }
       _keybox_release_blob (blob);
-      /*    if (!rc && !hd->secret && kb_offtbl) */
-      /*      { */
-      /*        update_offset_hash_table_from_kb (kb_offtbl, kb, 0); */
-      /*      } */
     }
   return err;
 }
 
 
 /* Update the current key at HD with the given OpenPGP keyblock in
-   {IMAGE,IMAGELEN}.  */
+   {IMAGE,IMAGELEN}.  SIGSTATUS is used as with keybox_insert_keyblock.  */
 gpg_error_t
-keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
+keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen,
+                        const u32 *sigstatus)
 {
   gpg_error_t err;
   const char *fname;
@@ -408,6 +580,9 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   KEYBOXBLOB blob;
   size_t nparsed;
   struct _keybox_openpgp_info info;
+  struct keybox_index_stamp_s oldstamp;
+  size_t oldlen, newlen;
+  int compress = 0;
 
   if (!hd || !image || !imagelen)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -422,6 +597,7 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
+  _keybox_get_blob_image (hd->found.blob, &oldlen);
 
   /* Close this the file so that we do no mess up the position for a
      next search.  */
@@ -433,15 +609,34 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
     return err;
   assert (nparsed <= imagelen);
   err = _keybox_create_openpgp_blob (&blob, &info, image, imagelen,
-                                     hd->ephemeral);
+                                     sigstatus, hd->ephemeral);
   _keybox_destroy_openpgp_info (&info);
 
-  /* Update the keyblock.  */
+  /* Update the keyblock.  The new blob is appended before the old
+     one is flagged as deleted so that the key is not lost if we are
+     interrupted in between.  */
   if (!err)
     {
-      err = blob_filecopy (FILECOPY_UPDATE, fname, blob, hd->secret, 1, off);
+      _keybox_index_get_stamp (hd->kb, &oldstamp);
+      err = append_blob (fname, blob, hd->secret, 1);
+      if (!err)
+        {
+          _keybox_get_blob_image (blob, &newlen);
+          _keybox_index_update (hd->kb, &oldstamp, oldstamp.size,
+                                0, newlen, blob);
+          _keybox_index_get_stamp (hd->kb, &oldstamp);
+          err = delete_blob (fname, off, oldlen, &compress);
+          if (!err)
+            _keybox_index_update (hd->kb, &oldstamp, off, oldlen, oldlen,
+                                  NULL);
+        }
       _keybox_release_blob (blob);
     }
+
+  /* Errors of the compress run are not reported because the update
+     itself succeeded; the next update will try again.  */
+  if (!err && compress && !hd->secret)
+    request_compress (hd);
   return err;
 }
 
@@ -455,6 +650,8 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   int rc;
   const char *fname;
   KEYBOXBLOB blob;
+  struct keybox_index_stamp_s oldstamp;
+  size_t n;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_HANDLE);
@@ -472,12 +669,14 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   rc = _keybox_create_x509_blob (&blob, cert, sha1_digest, hd->ephemeral);
   if (!rc)
     {
-      rc = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 0, 0);
+      _keybox_index_get_stamp (hd->kb, &oldstamp);
+      rc = append_blob (fname, blob, hd->secret, 0);
+      if (!rc)
+        {
+          _keybox_get_blob_image (blob, &n);
+          _keybox_index_update (hd->kb, &oldstamp, oldstamp.size, 0, n, blob);
+        }
       _keybox_release_blob (blob);
-      /*    if (!rc && !hd->secret && kb_offtbl) */
-      /*      { */
-      /*        update_offset_hash_table_from_kb (kb_offtbl, kb, 0); */
-      /*      } */
     }
   return rc;
 }
@@ -508,6 +707,7 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
   size_t flag_pos, flag_size;
   const unsigned char *buffer;
   size_t length;
+  struct keybox_index_stamp_s oldstamp;
 
   (void)idx;  /* Not yet used.  */
 
@@ -535,6 +735,7 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
   off += flag_pos;
 
   _keybox_close_file (hd);
+  _keybox_index_get_stamp (hd->kb, &oldstamp);
   fp = fopen (hd->kb->fname, "r+b");
   if (!fp)
     return gpg_error_from_syserror ();
@@ -571,6 +772,10 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
         ec = gpg_err_code_from_syserror ();
     }
 
+  /* The offsets did not change; only the stamp needs an update.  */
+  if (!ec)
+    _keybox_index_update (hd->kb, &oldstamp, 0, 0, 0, NULL);
+
   return gpg_error (ec);
 }
 
@@ -581,8 +786,10 @@ keybox_delete (KEYBOX_HANDLE hd)
 {
   off_t off;
   const char *fname;
-  FILE *fp;
   int rc;
+  struct keybox_index_stamp_s oldstamp;
+  size_t length;
+  int compress;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -597,26 +804,19 @@ keybox_delete (KEYBOX_HANDLE hd)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
-  off += 4;
+  _keybox_get_blob_image (hd->found.blob, &length);
 
   _keybox_close_file (hd);
-  fp = fopen (hd->kb->fname, "r+b");
-  if (!fp)
-    return gpg_error_from_syserror ();
-
-  if (fseeko (fp, off, SEEK_SET))
-    rc = gpg_error_from_syserror ();
-  else if (putc (0, fp) == EOF)
-    rc = gpg_error_from_syserror ();
-  else
-    rc = 0;
+  _keybox_index_get_stamp (hd->kb, &oldstamp);
+  rc = delete_blob (fname, off, length, &compress);
 
-  if (fclose (fp))
-    {
-      if (!rc)
-        rc = gpg_error_from_syserror ();
-    }
+  /* The blob is only marked as deleted; thus we need to remove its
+     entries but the offsets of the other blobs stay the same.  */
+  if (!rc)
+    _keybox_index_update (hd->kb, &oldstamp, off, length, length, NULL);
 
+  if (!rc && compress && !hd->secret)
+    request_compress (hd);
   return rc;
 }
 
@@ -625,6 +825,64 @@ keybox_delete (KEYBOX_HANDLE hd)
    locked. */
 int
 keybox_compress (KEYBOX_HANDLE hd)
+{
+  return do_compress (hd, 0);
+}
+
+
+/* Defer the compress runs triggered by updates and deletes if ENABLE
+   is true.  This is used for bulk changes which then call
+   keybox_compress_pending once at the end.  */
+void
+keybox_defer_compress (int enable)
+{
+  defer_compress = enable;
+}
+
+
+/* Run a compress of the keybox of HD if one has been deferred.  This
+   should be run with the file locked.  */
+int
+keybox_compress_pending (KEYBOX_HANDLE hd)
+{
+  if (!hd || !hd->kb || !hd->kb->compress_pending)
+    return 0;
+  hd->kb->compress_pending = 0;
+  return do_compress (hd, 1);
+}
+
+
+/* Reset the garbage counter in the header blob of the keybox file
+   FNAME.  This is used if a compress run did not find anything to
+   remove; for example because the file has been compressed by an
+   older version which does not know about the counter.  */
+static void
+reset_garbage (const char *fname)
+{
+  FILE *fp;
+  unsigned char buffer[32];
+
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    return;
+  if (fread (buffer, sizeof buffer, 1, fp) == 1
+      && buf32_to_u32 (buffer) >= sizeof buffer
+      && buffer[4] == KEYBOX_BLOBTYPE_HEADER
+      && buf32_to_u32 (buffer+24)
+      && !fseeko (fp, 24, SEEK_SET))
+    {
+      memset (buffer+24, 0, 4);
+      fwrite (buffer+24, 4, 1, fp);
+    }
+  fclose (fp);
+}
+
+
+/* The actual compress function.  Unless FORCE is set the file is
+   only compressed if the last compress run is at least 3 hours
+   ago.  */
+static int
+do_compress (KEYBOX_HANDLE hd, int force)
 {
   int read_rc, rc;
   const char *fname;
@@ -675,7 +933,7 @@ keybox_compress (KEYBOX_HANDLE hd)
         {
           u32 last_maint = buf32_to_u32 (buffer+20);
 
-          if ( (last_maint + 3*3600) > time (NULL) )
+          if (!force && (last_maint + 3*3600) > time (NULL) )
             {
               fclose (fp);
               _keybox_release_blob (blob);
@@ -787,7 +1045,11 @@ keybox_compress (KEYBOX_HANDLE hd)
 
   /* Rename or remove the temporary file. */
   if (rc || !any_changes)
-    gnupg_remove (tmpfname);
+    {
+      gnupg_remove (tmpfname);
+      if (!rc)
+        reset_garbage (fname);
+    }
   else
     rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
 
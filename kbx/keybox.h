@@ -85,7 +85,8 @@ int _keybox_write_header_blob (FILE *fp, int openpgp_flag);
 
 /*-- keybox-search.c --*/
 gpg_error_t keybox_get_keyblock (KEYBOX_HANDLE hd, iobuf_t *r_iobuf,
-                                 int *r_uid_no, int *r_pk_no);
+                                 int *r_uid_no, int *r_pk_no,
+                                 u32 **r_sigstatus);
 #ifdef KEYBOX_WITH_X509
 int keybox_get_cert (KEYBOX_HANDLE hd, ksba_cert_t *ret_cert);
 #endif /*KEYBOX_WITH_X509*/
@@ -98,13 +99,16 @@ gpg_error_t keybox_search (KEYBOX_HANDLE hd,
                            size_t *r_descindex, unsigned long *r_skipped);
 
 off_t keybox_offset (KEYBOX_HANDLE hd);
+off_t keybox_found_offset (KEYBOX_HANDLE hd);
 gpg_error_t keybox_seek (KEYBOX_HANDLE hd, off_t offset);
 
 /*-- keybox-update.c --*/
 gpg_error_t keybox_insert_keyblock (KEYBOX_HANDLE hd,
-                                    const void *image, size_t imagelen);
+                                    const void *image, size_t imagelen,
+                                    const u32 *sigstatus);
 gpg_error_t keybox_update_keyblock (KEYBOX_HANDLE hd,
-                                    const void *image, size_t imagelen);
+                                    const void *image, size_t imagelen,
+                                    const u32 *sigstatus);
 
 #ifdef KEYBOX_WITH_X509
 int keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
@@ -116,6 +120,8 @@ int keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value);
 
 int keybox_delete (KEYBOX_HANDLE hd);
 int keybox_compress (KEYBOX_HANDLE hd);
+void keybox_defer_compress (int enable);
+int keybox_compress_pending (KEYBOX_HANDLE hd);
 
 
 /*--  --*/
@@ -0,0 +1,260 @@
+/* t-keybox-index.c - Tests for the sidecar index of keybox files
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* The tests create a keybox with synthetic keys which is large enough
+ * to get an index, look up keys by fingerprint, mailbox and substring
+ * through the index, and check that appended keys are found through
+ * the delta of the index.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gpg-error.h>
+#include <gcrypt.h>
+
+#include "../common/util.h"
+#include "../common/init.h"
+#include "keybox-defs.h"
+
+#include "t-support.h"
+
+#define PGM "t-keybox-index"
+
+/* The number of keys in the initial keybox; this gives a keybox
+ * larger than INDEX_MIN_FILESIZE.  */
+#define NKEYS 1500
+
+/* Create the keyblock number IDX at BUFFER and return its length.
+ * The fingerprint of the key is stored at FPR.  */
+static size_t
+make_index_keyblock (unsigned char *buffer, unsigned int idx,
+                     unsigned char *fpr)
+{
+  char uid[80];
+
+  snprintf (uid, sizeof uid, "Index User %u <user-%u@example.org>",
+            idx, idx);
+  return make_keyblock (buffer, idx, uid, fpr);
+}
+
+
+/* Create the keybox FNAME with NKEYS keys and store their
+ * fingerprints at FPRS.  */
+static void
+create_keybox (const char *fname, unsigned int nkeys,
+               unsigned char (*fprs)[20])
+{
+  gpg_error_t err;
+  unsigned char image[512];
+  size_t imagelen, nparsed;
+  struct _keybox_openpgp_info info;
+  KEYBOXBLOB blob;
+  unsigned int idx;
+  FILE *fp;
+
+  fp = fopen (fname, "wb");
+  if (!fp)
+    {
+      fprintf (stderr, PGM ": error creating '%s': %s\n",
+               fname, strerror (errno));
+      exit (1);
+    }
+
+  err = _keybox_write_header_blob (fp, 1);
+  for (idx=0; !err && idx < nkeys; idx++)
+    {
+      imagelen = make_index_keyblock (image, idx, fprs[idx]);
+      err = _keybox_parse_openpgp (image, imagelen, &nparsed, &info);
+      if (err)
+        break;
+      err = _keybox_create_openpgp_blob (&blob, &info, image, imagelen,
+                                         NULL, 0);
+      _keybox_destroy_openpgp_info (&info);
+      if (err)
+        break;
+      err = _keybox_write_blob (blob, fp);
+      _keybox_release_blob (blob);
+    }
+
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  if (err)
+    {
+      fprintf (stderr, PGM ": error writing '%s': %s\n",
+               fname, gpg_strerror (err));
+      exit (1);
+    }
+}
+
+
+/* Return true if the file FNAME exists and store its inode at
+ * R_INO.  */
+static int
+file_exists (const char *fname, unsigned long *r_ino)
+{
+  struct stat st;
+
+  if (stat (fname, &st))
+    return 0;
+  if (r_ino)
+    *r_ino = st.st_ino;
+  return 1;
+}
+
+
+/* Run the tests for the keybox FNAME.  */
+static void
+run_tests (const char *fname)
+{
+  gpg_error_t err;
+  unsigned char (*fprs)[20];
+  unsigned char fpr[20];
+  unsigned char image[512];
+  size_t imagelen;
+  char *idxname, *iddname;
+  unsigned long ino, ino2;
+  unsigned int idx;
+  void *token;
+  KEYBOX_HANDLE hd;
+
+  idxname = xstrconcat (fname, ".idx", NULL);
+  iddname = xstrconcat (fname, ".idd", NULL);
+  remove (idxname);
+  remove (iddname);
+
+  fprs = xcalloc (NKEYS, sizeof *fprs);
+  create_keybox (fname, NKEYS, fprs);
+
+  err = keybox_register_file (fname, 0, &token);
+  if (err)
+    {
+      fprintf (stderr, PGM ": error registering '%s': %s\n",
+               fname, gpg_strerror (err));
+      exit (1);
+    }
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    {
+      fprintf (stderr, PGM ": error opening '%s'\n", fname);
+      exit (1);
+    }
+
+  /* The first search builds the index.  */
+  if (!search_fpr (hd, fprs[0]))
+    fail (1);
+  if (!file_exists (idxname, &ino))
+    fail (2);
+  for (idx=0; idx < NKEYS; idx += 7)
+    if (!search_fpr (hd, fprs[idx]))
+      fail (3);
+  memcpy (fpr, fprs[1], 20);
+  fpr[19] ^= 0xff;
+  if (search_fpr (hd, fpr))
+    fail (4);
+
+  /* Mailbox and substring searches.  */
+  if (!search_name (hd, "<user-17@example.org>"))
+    fail (20);
+  if (!search_name (hd, "<USER-1234@Example.ORG>"))
+    fail (21);
+  if (search_name (hd, "<user-17@example.com>"))
+    fail (22);
+  if (!search_name (hd, "*user-1234@example"))
+    fail (23);
+  if (!search_name (hd, "*INDEX USER 999 <"))
+    fail (24);
+  if (search_name (hd, "*user-12345@"))
+    fail (25);
+
+  /* Appended keys go to the delta and leave the index alone.  */
+  for (idx=0; idx < 5; idx++)
+    {
+      imagelen = make_index_keyblock (image, NKEYS + idx, fpr);
+      err = keybox_insert_keyblock (hd, image, imagelen, NULL);
+      if (err)
+        fail (5);
+      if (!search_fpr (hd, fpr))
+        fail (6);
+    }
+  if (!file_exists (iddname, NULL))
+    fail (7);
+  if (!file_exists (idxname, &ino2) || ino2 != ino)
+    fail (8);
+  if (!search_fpr (hd, fprs[NKEYS-1]))
+    fail (9);
+  if (!search_name (hd, "<user-1502@example.org>"))
+    fail (26);
+  if (!search_name (hd, "*user-1503@"))
+    fail (27);
+
+  /* A deleted key is not found although the delta keeps its
+   * entries.  */
+  if (!search_fpr (hd, fpr))
+    fail (10);
+  err = keybox_delete (hd);
+  if (err)
+    fail (11);
+  if (search_fpr (hd, fpr))
+    fail (12);
+
+  /* A large delta is merged into the index.  */
+  for (idx=5; idx < 200; idx++)
+    {
+      imagelen = make_index_keyblock (image, NKEYS + idx, fpr);
+      err = keybox_insert_keyblock (hd, image, imagelen, NULL);
+      if (err)
+        fail (13);
+    }
+  if (!file_exists (idxname, &ino2) || ino2 == ino)
+    fail (14);
+  if (!search_fpr (hd, fpr))
+    fail (15);
+  if (!search_fpr (hd, fprs[NKEYS/2]))
+    fail (16);
+
+  keybox_release (hd);
+  remove (fname);
+  remove (idxname);
+  remove (iddname);
+  xfree (idxname);
+  xfree (iddname);
+  xfree (fprs);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  early_system_init ();
+  gcry_control (GCRYCTL_DISABLE_SECMEM);
+  log_set_prefix (PGM, GPGRT_LOG_WITH_PREFIX);
+  init_common_subsystems (&argc, &argv);
+
+  /* Run the tests with a mapped index and with stdio.  */
+  run_tests ("t-keybox-index.kbx");
+  _keybox_index_disable_mmap (1);
+  run_tests ("t-keybox-index-stdio.kbx");
+
+  return 0;
+}
@@ -0,0 +1,328 @@
+/* t-keybox-update.c - Tests for the update functions of keybox files
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* The tests check that inserts, updates and deletes change the
+ * keybox file in place and that a compress run removes the deleted
+ * blobs once enough garbage has been collected.  They also check
+ * that the stored signature status is only returned as long as it
+ * matches the keyblock.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gpg-error.h>
+#include <gcrypt.h>
+
+#include "../common/util.h"
+#include "../common/init.h"
+#include "../common/host2net.h"
+#include "keybox-defs.h"
+
+#include "t-support.h"
+
+#define PGM "t-keybox-update"
+
+/* The number of keys in the keybox and the number of keys we delete
+ * to trigger a compress run.  */
+#define NKEYS    1200
+#define NDELETE  700
+
+/* Create the keyblock number IDX at BUFFER and return its length.
+ * The key is the same for all VERSIONs of a keyblock but the user id
+ * differs.  */
+static size_t
+make_update_keyblock (unsigned char *buffer, unsigned int idx,
+                      unsigned int version)
+{
+  char uid[80];
+
+  snprintf (uid, sizeof uid, "Update User %u <user-%u-v%u@example.org>",
+            idx, idx, version);
+  return make_keyblock (buffer, idx, uid, NULL);
+}
+
+
+/* Search the mailbox of version VERSION of the keyblock IDX in HD.  */
+static int
+search_key (KEYBOX_HANDLE hd, unsigned int idx, unsigned int version)
+{
+  char name[80];
+
+  snprintf (name, sizeof name, "<user-%u-v%u@example.org>", idx, version);
+  return search_name (hd, name);
+}
+
+
+/* Store the inode and the size of FNAME at R_INO and R_SIZE.  */
+static void
+get_file_info (const char *fname, unsigned long *r_ino, off_t *r_size)
+{
+  struct stat st;
+
+  if (stat (fname, &st))
+    {
+      fprintf (stderr, PGM ": can't stat '%s': %s\n",
+               fname, strerror (errno));
+      exit (1);
+    }
+  *r_ino = st.st_ino;
+  *r_size = st.st_size;
+}
+
+
+static void
+run_tests (const char *fname)
+{
+  gpg_error_t err;
+  unsigned char image[512];
+  size_t imagelen;
+  unsigned long ino, ino2;
+  off_t size, size2;
+  unsigned int idx;
+  void *token;
+  KEYBOX_HANDLE hd;
+  char *idxname, *iddname, *bakname;
+  FILE *fp;
+
+  idxname = xstrconcat (fname, ".idx", NULL);
+  iddname = xstrconcat (fname, ".idd", NULL);
+  bakname = xstrconcat (fname, "~", NULL);
+  remove (fname);
+  remove (idxname);
+  remove (iddname);
+  remove (bakname);
+
+  /* Create an empty keybox as done by gpg.  */
+  fp = fopen (fname, "wb");
+  if (!fp || _keybox_write_header_blob (fp, 1) || fclose (fp))
+    {
+      fprintf (stderr, PGM ": error creating '%s'\n", fname);
+      exit (1);
+    }
+
+  err = keybox_register_file (fname, 0, &token);
+  if (err)
+    {
+      fprintf (stderr, PGM ": error registering '%s': %s\n",
+               fname, gpg_strerror (err));
+      exit (1);
+    }
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    {
+      fprintf (stderr, PGM ": error opening '%s'\n", fname);
+      exit (1);
+    }
+
+  /* Inserts append to the file.  */
+  get_file_info (fname, &ino, &size);
+  for (idx=0; idx < NKEYS; idx++)
+    {
+      imagelen = make_update_keyblock (image, idx, 0);
+      if (keybox_insert_keyblock (hd, image, imagelen, NULL))
+        fail (1);
+    }
+  get_file_info (fname, &ino2, &size2);
+  if (ino2 != ino || size2 <= size)
+    fail (2);
+  if (!search_key (hd, 0, 0) || !search_key (hd, NKEYS-1, 0))
+    fail (3);
+
+  /* An update appends the new keyblock and flags the old one as
+   * deleted.  */
+  size = size2;
+  if (!search_key (hd, 42, 0))
+    fail (4);
+  imagelen = make_update_keyblock (image, 42, 1);
+  if (keybox_update_keyblock (hd, image, imagelen, NULL))
+    fail (5);
+  get_file_info (fname, &ino2, &size2);
+  if (ino2 != ino || size2 <= size)
+    fail (6);
+  if (search_key (hd, 42, 0) || !search_key (hd, 42, 1))
+    fail (7);
+
+  /* A delete only flags the keyblock.  */
+  size = size2;
+  if (!search_key (hd, 43, 0))
+    fail (8);
+  if (keybox_delete (hd))
+    fail (9);
+  get_file_info (fname, &ino2, &size2);
+  if (ino2 != ino || size2 != size)
+    fail (10);
+  if (search_key (hd, 43, 0) || !search_key (hd, 44, 0))
+    fail (11);
+
+  /* Enough garbage leads to a compress run.  */
+  keybox_defer_compress (1);
+  for (idx=100; idx < 100 + NDELETE; idx++)
+    {
+      if (!search_key (hd, idx, 0))
+        fail (12);
+      if (keybox_delete (hd))
+        fail (13);
+    }
+  get_file_info (fname, &ino2, &size2);
+  if (ino2 != ino || size2 != size)
+    fail (14);
+  if (keybox_compress_pending (hd))
+    fail (15);
+  keybox_defer_compress (0);
+  get_file_info (fname, &ino2, &size2);
+  if (ino2 == ino || size2 >= size)
+    fail (16);
+  if (search_key (hd, 100, 0) || search_key (hd, 100 + NDELETE - 1, 0))
+    fail (17);
+  if (!search_key (hd, 99, 0) || !search_key (hd, 100 + NDELETE, 0)
+      || !search_key (hd, 42, 1) || !search_key (hd, NKEYS-1, 0))
+    fail (18);
+
+  keybox_release (hd);
+  remove (fname);
+  remove (idxname);
+  remove (iddname);
+  remove (bakname);
+  xfree (idxname);
+  xfree (iddname);
+  xfree (bakname);
+}
+
+
+/* Create the keybox FNAME with one keyblock which has a signature
+ * with the status STATUS.  If TAMPER is set the status is changed
+ * after the blob has been created, as an older version would do.  */
+static void
+write_sigstatus_keybox (const char *fname, u32 status, int tamper)
+{
+  static const unsigned char sigbody[] = { 4, 0x13, 1, 8, 0, 0, 0, 0 };
+  unsigned char image[512];
+  size_t imagelen, nparsed, length, n;
+  u32 sigstatus[2];
+  struct _keybox_openpgp_info info;
+  KEYBOXBLOB blob;
+  const unsigned char *blobimage;
+  unsigned char *buffer;
+  FILE *fp;
+
+  imagelen = make_update_keyblock (image, 1, 0);
+  imagelen = put_packet (image + imagelen, 2, sigbody, sizeof sigbody) - image;
+  sigstatus[0] = 1;
+  sigstatus[1] = status;
+  if (_keybox_parse_openpgp (image, imagelen, &nparsed, &info))
+    fail (30);
+  if (_keybox_create_openpgp_blob (&blob, &info, image, imagelen,
+                                   sigstatus, 0))
+    fail (31);
+  _keybox_destroy_openpgp_info (&info);
+  blobimage = _keybox_get_blob_image (blob, &length);
+  buffer = xmalloc (length);
+  memcpy (buffer, blobimage, length);
+  _keybox_release_blob (blob);
+
+  if (tamper)
+    {
+      for (n=0; n + 4 <= length; n++)
+        if (buf32_to_u32 (buffer + n) == status)
+          break;
+      if (n + 4 > length)
+        fail (32);
+      buffer[n+3] ^= 1;
+    }
+
+  fp = fopen (fname, "wb");
+  if (!fp || _keybox_write_header_blob (fp, 1)
+      || fwrite (buffer, length, 1, fp) != 1 || fclose (fp))
+    {
+      fprintf (stderr, PGM ": error creating '%s'\n", fname);
+      exit (1);
+    }
+  xfree (buffer);
+}
+
+
+/* Return the signature status array of the only keyblock in the
+ * keybox FNAME.  */
+static u32 *
+read_sigstatus (const char *fname)
+{
+  KEYBOX_HANDLE hd;
+  void *token;
+  iobuf_t iobuf;
+  int pk_no, uid_no;
+  u32 *sigstatus;
+
+  if (keybox_register_file (fname, 0, &token))
+    fail (33);
+  hd = keybox_new_openpgp (token, 0);
+  if (!hd)
+    fail (34);
+  if (!search_key (hd, 1, 0))
+    fail (35);
+  if (keybox_get_keyblock (hd, &iobuf, &pk_no, &uid_no, &sigstatus))
+    fail (36);
+  iobuf_close (iobuf);
+  keybox_release (hd);
+  return sigstatus;
+}
+
+
+static void
+test_sigstatus (void)
+{
+  const char *fname1 = "t-keybox-update-1.kbx";
+  const char *fname2 = "t-keybox-update-2.kbx";
+  u32 *sigstatus;
+
+  write_sigstatus_keybox (fname1, 0x7a11ce55, 0);
+  write_sigstatus_keybox (fname2, 0x7a11ce55, 1);
+
+  sigstatus = read_sigstatus (fname1);
+  if (!sigstatus || sigstatus[0] != 1 || sigstatus[1] != 0x7a11ce55)
+    fail (37);
+  xfree (sigstatus);
+
+  /* A status which does not match the binding is not returned.  */
+  sigstatus = read_sigstatus (fname2);
+  if (sigstatus)
+    fail (38);
+
+  remove (fname1);
+  remove (fname2);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  early_system_init ();
+  gcry_control (GCRYCTL_DISABLE_SECMEM);
+  log_set_prefix (PGM, GPGRT_LOG_WITH_PREFIX);
+  init_common_subsystems (&argc, &argv);
+
+  run_tests ("t-keybox-update.kbx");
+  test_sigstatus ();
+
+  return 0;
+}
@@ -0,0 +1,160 @@
+/* t-support.c - Helper for the keybox tests
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* The keyblocks created here consist only of a public key packet and
+ * one user id; this is all the keybox needs for its searches.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gpg-error.h>
+
+#include "../common/util.h"
+#include "../common/userids.h"
+#include "keybox-defs.h"
+
+#include "t-support.h"
+
+
+/* Write an OpenPGP packet with TAG and the BODY of LENGTH to P and
+ * return the new end of P.  */
+unsigned char *
+put_packet (unsigned char *p, int tag, const void *body, size_t length)
+{
+  *p++ = 0xc0 | tag;
+  if (length < 192)
+    *p++ = length;
+  else
+    {
+      *p++ = ((length - 192) >> 8) + 192;
+      *p++ = (length - 192);
+    }
+  memcpy (p, body, length);
+  return p + length;
+}
+
+
+/* Create a keyblock with the user id UID at BUFFER, which must have
+ * space for 512 bytes, and return its length.  The key is an RSA key
+ * made up from the number IDX; keyblocks with the same IDX thus have
+ * the same key.  If FPR is not NULL the fingerprint of the key is
+ * stored there.  */
+size_t
+make_keyblock (unsigned char *buffer, unsigned int idx, const char *uid,
+               unsigned char *fpr)
+{
+  gpg_error_t err;
+  unsigned char body[1+4+1+2+256+2+3];
+  unsigned char *p = body;
+  unsigned long stamp = 0x5b000000 + idx;
+  struct _keybox_openpgp_info info;
+  size_t imagelen, nparsed;
+
+  *p++ = 4;  /* version */
+  *p++ = stamp >> 24;
+  *p++ = stamp >> 16;
+  *p++ = stamp >> 8;
+  *p++ = stamp;
+  *p++ = 1;  /* RSA */
+  *p++ = 2048 >> 8;
+  *p++ = 2048 & 0xff;
+  memset (p, 0x5a, 256);
+  p[0] = 0x80;
+  p[1] = idx >> 24;
+  p[2] = idx >> 16;
+  p[3] = idx >> 8;
+  p[4] = idx;
+  p += 256;
+  *p++ = 0;
+  *p++ = 17;
+  *p++ = 0x01;
+  *p++ = 0x00;
+  *p++ = 0x01;
+
+  p = put_packet (buffer, 6, body, sizeof body);
+  p = put_packet (p, 13, uid, strlen (uid));
+  imagelen = p - buffer;
+
+  if (fpr)
+    {
+      err = _keybox_parse_openpgp (buffer, imagelen, &nparsed, &info);
+      if (err)
+        {
+          log_error ("error parsing key %u: %s\n", idx, gpg_strerror (err));
+          exit (1);
+        }
+      memcpy (fpr, info.primary.fpr, 20);
+      _keybox_destroy_openpgp_info (&info);
+    }
+  return imagelen;
+}
+
+
+/* Run the search DESC on HD.  Returns true if a key has been
+ * found.  */
+static int
+do_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, const char *what)
+{
+  gpg_error_t err;
+
+  err = keybox_search_reset (hd);
+  if (!err)
+    err = keybox_search (hd, desc, 1, KEYBOX_BLOBTYPE_PGP, NULL, NULL);
+  if (err == -1 || gpg_err_code (err) == GPG_ERR_EOF)
+    return 0;
+  if (err)
+    {
+      log_error ("search for '%s' failed: %s\n", what, gpg_strerror (err));
+      exit (1);
+    }
+  return 1;
+}
+
+
+/* Search the key with fingerprint FPR in HD.  Returns true if it has
+ * been found.  */
+int
+search_fpr (KEYBOX_HANDLE hd, const unsigned char *fpr)
+{
+  KEYBOX_SEARCH_DESC desc;
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_FPR;
+  memcpy (desc.u.fpr, fpr, 20);
+  return do_search (hd, &desc, "fingerprint");
+}
+
+
+/* Search the user id NAME in HD, which may be given in any format
+ * understood by classify_user_id.  Returns true if it has been
+ * found.  */
+int
+search_name (KEYBOX_HANDLE hd, const char *name)
+{
+  KEYBOX_SEARCH_DESC desc;
+
+  if (classify_user_id (name, &desc, 1))
+    {
+      log_error ("bad user id '%s'\n", name);
+      exit (1);
+    }
+  return do_search (hd, &desc, name);
+}
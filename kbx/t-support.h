@@ -0,0 +1,42 @@
+/* t-support.h - Helper for the keybox tests
+ * Copyright (C) 2018 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#ifndef GNUPG_KBX_T_SUPPORT_H
+#define GNUPG_KBX_T_SUPPORT_H 1
+
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                      exit (1);                                  \
+                   } while(0)
+
+/* Write an OpenPGP packet with TAG and the BODY of LENGTH to P and
+ * return the new end of P.  */
+unsigned char *put_packet (unsigned char *p, int tag,
+                           const void *body, size_t length);
+
+/* Create a keyblock with the key number IDX and the user id UID.  */
+size_t make_keyblock (unsigned char *buffer, unsigned int idx,
+                      const char *uid, unsigned char *fpr);
+
+/* Search a key by fingerprint or by user id.  */
+int search_fpr (KEYBOX_HANDLE hd, const unsigned char *fpr);
+int search_name (KEYBOX_HANDLE hd, const char *name);
+
+#endif /*GNUPG_KBX_T_SUPPORT_H*/
@@ -60,6 +60,7 @@
 #include "../common/exechelp.h"
 #endif /* GNUPG_MAJOR_VERSION != 1 */
 #include "../common/host2net.h"
+#include "../common/tracepoint.h"
 
 #include "iso7816.h"
 #include "apdu.h"
@@ -120,6 +121,7 @@ struct reader_table_s {
     int pinmin;
     int pinmax;
     pcsc_dword_t current_state;
+    struct pcsc_monitor_s *monitor;  /* NULL or the monitor thread.  */
   } pcsc;
 #ifdef USE_G10CODE_RAPDU
   struct {
@@ -133,6 +135,8 @@ struct reader_table_s {
                                               supports variable length pinpad
                                               input.  */
   unsigned int require_get_status:1;
+  unsigned int no_extended_length:1; /* True if the reader can't send
+                                        extended length APDUs.  */
   unsigned char atr[33];
   size_t atrlen;           /* A zero length indicates that the ATR has
                               not yet been read; i.e. the card is not
@@ -174,6 +178,8 @@ static npth_mutex_t reader_table_lock;
 #define PCSC_UNPOWER_CARD    2
 #define PCSC_EJECT_CARD      3
 
+#define PCSC_INFINITE        0xFFFFFFFF
+
 #ifdef HAVE_W32_SYSTEM
 # define PCSC_UNKNOWN    0x0000  /* The driver is not aware of the status.  */
 # define PCSC_ABSENT     0x0001  /* Card is absent.  */
@@ -333,6 +339,7 @@ long (* DLSTDCALL pcsc_transmit) (long card,
                                   pcsc_dword_t *recv_len);
 long (* DLSTDCALL pcsc_set_timeout) (long context,
                                      pcsc_dword_t timeout);
+long (* DLSTDCALL pcsc_cancel) (long context);
 long (* DLSTDCALL pcsc_control) (long card,
                                  pcsc_dword_t control_code,
                                  const void *send_buffer,
@@ -451,11 +458,13 @@ new_reader_slot (void)
   reader_table[reader].is_spr532 = 0;
   reader_table[reader].pinpad_varlen_supported = 0;
   reader_table[reader].require_get_status = 1;
+  reader_table[reader].no_extended_length = 0;
   reader_table[reader].pcsc.verify_ioctl = 0;
   reader_table[reader].pcsc.modify_ioctl = 0;
   reader_table[reader].pcsc.pinmin = -1;
   reader_table[reader].pcsc.pinmax = -1;
   reader_table[reader].pcsc.current_state = PCSC_STATE_UNAWARE;
+  reader_table[reader].pcsc.monitor = NULL;
 
   return reader;
 }
@@ -790,9 +799,157 @@ control_pcsc (int slot, pcsc_dword_t ioctl_code,
 }
 
 
+#ifdef USE_NPTH
+/* The state shared by a PC/SC reader slot and its monitor thread.
+   The object is released by the thread if the slot has been closed
+   before the thread terminated, and by close_pcsc_reader
+   otherwise.  */
+struct pcsc_monitor_s
+{
+  long context;      /* The thread's own context.  */
+  char *rdrname;
+  unsigned int closed:1;  /* The slot has been closed.  */
+  unsigned int done:1;    /* The thread has terminated.  */
+};
+
+
+/* A thread waiting for a change of the reader state and waking up
+   the main loop if there is one.  Using this instead of polling the
+   reader with the ticker lets scdaemon sleep while idle.  A second
+   context is required because a context may not be used by two
+   threads at the same time.  */
+static void *
+pcsc_monitor_thread (void *arg)
+{
+  struct pcsc_monitor_s *monitor = arg;
+  struct pcsc_readerstate_s rdrstates[1];
+  pcsc_dword_t current_state = PCSC_STATE_UNAWARE;
+  long err;
+
+  for (;;)
+    {
+      memset (rdrstates, 0, sizeof *rdrstates);
+      rdrstates[0].reader = monitor->rdrname;
+      rdrstates[0].current_state = current_state;
+      npth_unprotect ();
+      err = pcsc_get_status_change (monitor->context, PCSC_INFINITE,
+                                    rdrstates, 1);
+      npth_protect ();
+      if (monitor->closed)
+        break;
+      if (err == PCSC_E_TIMEOUT)
+        continue;
+      if (err)
+        {
+          /* Even the main context won't work anymore; let the main
+             loop take care of it.  */
+          if (err != PCSC_E_CANCELLED)
+            log_info ("pcsc_get_status_change failed: %s (0x%lx)\n",
+                      pcsc_error_string (err), err);
+          monitor->done = 1;
+          scd_kick_the_loop ();
+          return NULL;
+        }
+
+      if ((rdrstates[0].event_state & PCSC_STATE_CHANGED))
+        {
+          current_state = (rdrstates[0].event_state & ~PCSC_STATE_CHANGED);
+          if (DBG_READER)
+            log_debug ("pcsc monitor: reader '%s' changed state to 0x%lx\n",
+                       monitor->rdrname, (unsigned long)current_state);
+          scd_kick_the_loop ();
+        }
+    }
+
+  pcsc_release_context (monitor->context);
+  xfree (monitor->rdrname);
+  xfree (monitor);
+  return NULL;
+}
+
+
+/* Start a monitor thread for the PC/SC reader in SLOT.  Returns true
+   on success.  */
+static int
+start_pcsc_monitor (int slot)
+{
+  struct pcsc_monitor_s *monitor;
+  npth_attr_t tattr;
+  npth_t thread;
+  long err;
+
+  if (!pcsc_cancel)
+    return 0;  /* We would not be able to stop the thread.  */
+
+  monitor = xtrycalloc (1, sizeof *monitor);
+  if (!monitor)
+    return 0;
+  monitor->rdrname = xtrystrdup (reader_table[slot].rdrname);
+  if (!monitor->rdrname)
+    {
+      xfree (monitor);
+      return 0;
+    }
+  err = pcsc_establish_context (PCSC_SCOPE_SYSTEM, NULL, NULL,
+                                &monitor->context);
+  if (err)
+    {
+      log_error ("pcsc_establish_context failed: %s (0x%lx)\n",
+                 pcsc_error_string (err), err);
+      xfree (monitor->rdrname);
+      xfree (monitor);
+      return 0;
+    }
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  err = npth_create (&thread, &tattr, pcsc_monitor_thread, monitor);
+  npth_attr_destroy (&tattr);
+  if (err)
+    {
+      log_error ("error spawning pcsc monitor: %s\n", strerror (err));
+      pcsc_release_context (monitor->context);
+      xfree (monitor->rdrname);
+      xfree (monitor);
+      return 0;
+    }
+
+  reader_table[slot].pcsc.monitor = monitor;
+  return 1;
+}
+
+
+/* Stop the monitor thread of the PC/SC reader in SLOT.  */
+static void
+stop_pcsc_monitor (int slot)
+{
+  struct pcsc_monitor_s *monitor = reader_table[slot].pcsc.monitor;
+
+  if (!monitor)
+    return;
+  reader_table[slot].pcsc.monitor = NULL;
+
+  if (monitor->done)
+    {
+      pcsc_release_context (monitor->context);
+      xfree (monitor->rdrname);
+      xfree (monitor);
+    }
+  else
+    {
+      monitor->closed = 1;
+      pcsc_cancel (monitor->context);
+    }
+}
+#endif /*USE_NPTH*/
+
+
 static int
 close_pcsc_reader (int slot)
 {
+#ifdef USE_NPTH
+  stop_pcsc_monitor (slot);
+#endif
   pcsc_release_context (reader_table[slot].pcsc.context);
   return 0;
 }
@@ -1147,6 +1304,13 @@ open_pcsc_reader (const char *portstr)
   reader_table[slot].send_apdu_reader = pcsc_send_apdu;
   reader_table[slot].dump_status_reader = dump_pcsc_reader_status;
 
+#ifdef USE_NPTH
+  /* With a monitor thread, status changes are signaled and there is
+     no need to poll the reader.  */
+  if (start_pcsc_monitor (slot))
+    reader_table[slot].require_get_status = 0;
+#endif
+
   dump_reader_status (slot);
   unlock_slot (slot);
   return slot;
@@ -1549,6 +1713,8 @@ open_ccid_reader (struct dev_list *dl)
      flag.  */
   reader_table[slot].is_t0 = 0;
   reader_table[slot].require_get_status = require_get_status;
+  reader_table[slot].no_extended_length
+    = !ccid_extended_length_p (slotp->ccid.handle);
 
   dump_reader_status (slot);
   unlock_slot (slot);
@@ -1982,6 +2148,7 @@ apdu_open_one_reader (const char *portstr)
       pcsc_transmit          = dlsym (handle, "SCardTransmit");
       pcsc_set_timeout       = dlsym (handle, "SCardSetTimeout");
       pcsc_control           = dlsym (handle, "SCardControl");
+      pcsc_cancel            = dlsym (handle, "SCardCancel");
 
       if (!pcsc_establish_context
           || !pcsc_release_context
@@ -2599,16 +2766,21 @@ static int
 send_apdu (int slot, unsigned char *apdu, size_t apdulen,
            unsigned char *buffer, size_t *buflen, pininfo_t *pininfo)
 {
+  int sw;
+
   if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used )
     return SW_HOST_NO_DRIVER;
 
-  if (reader_table[slot].send_apdu_reader)
-    return reader_table[slot].send_apdu_reader (slot,
-                                                apdu, apdulen,
-                                                buffer, buflen,
-                                                pininfo);
-  else
+  if (!reader_table[slot].send_apdu_reader)
     return SW_HOST_NOT_SUPPORTED;
+
+  GNUPG_TRACE3 (apdu_send, slot, apdulen > 1? apdu[1] : 0, apdulen);
+  sw = reader_table[slot].send_apdu_reader (slot,
+                                            apdu, apdulen,
+                                            buffer, buflen,
+                                            pininfo);
+  GNUPG_TRACE3 (apdu_receive, slot, sw, *buflen);
+  return sw;
 }
 
 
@@ -2702,7 +2874,7 @@ send_le (int slot, int class, int ins, int p0, int p1,
 
   if (use_extended_length)
     {
-      if (reader_table[slot].is_t0)
+      if (reader_table[slot].is_t0 || reader_table[slot].no_extended_length)
         return SW_HOST_NOT_SUPPORTED;
 
       /* Space for: cls/ins/p1/p2+Z+2_byte_Lc+Lc+2_byte_Le.  */
@@ -3261,6 +3433,19 @@ apdu_get_reader_name (int slot)
   return reader_table[slot].rdrname;
 }
 
+
+/* Return true if extended length APDUs can be used with the card in
+   SLOT.  This is not the case for T=0 and for readers which support
+   only short APDUs.  Note that for PC/SC T=0 is only known after
+   apdu_connect.  */
+int
+apdu_extended_length_p (int slot)
+{
+  if (slot < 0 || slot >= MAX_READER || !reader_table[slot].used)
+    return 0;
+  return !reader_table[slot].is_t0 && !reader_table[slot].no_extended_length;
+}
+
 gpg_error_t
 apdu_init (void)
 {
@@ -140,5 +140,6 @@ int apdu_send_direct (int slot, size_t extended_length,
                       int handle_more,
                       unsigned char **retbuf, size_t *retbuflen);
 const char *apdu_get_reader_name (int slot);
+int apdu_extended_length_p (int slot);
 
 #endif /*APDU_H*/
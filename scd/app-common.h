@@ -40,6 +40,11 @@ struct app_ctx_s {
 
   npth_mutex_t lock;
 
+  /* Number of connections waiting for or holding LOCK and the number
+     of commands run with LOCK held; used for the statistics.  */
+  unsigned int lock_queue;
+  unsigned long ncommands;
+
   /* Number of connections currently using this application context.
      If this is not 0 the application has been initialized and the
      function pointers may be used.  Note that for unsupported
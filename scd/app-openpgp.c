@@ -65,6 +65,7 @@
 #include "../common/util.h"
 #include "../common/i18n.h"
 #include "iso7816.h"
+#include "apdu.h"
 #include "app-common.h"
 #include "../common/tlv.h"
 #include "../common/host2net.h"
@@ -102,11 +103,11 @@ static struct {
   { 0x006E, 1,    0, 1, 0, 0, 0, 0, "Application Related Data" },
   { 0x004F, 0, 0x6E, 1, 0, 0, 0, 0, "AID" },
   { 0x0073, 1,    0, 1, 0, 0, 0, 0, "Discretionary Data Objects" },
-  { 0x0047, 0, 0x6E, 1, 1, 0, 0, 0, "Card Capabilities" },
-  { 0x00C0, 0, 0x6E, 1, 1, 0, 0, 0, "Extended Card Capabilities" },
-  { 0x00C1, 0, 0x6E, 1, 1, 0, 0, 0, "Algorithm Attributes Signature" },
-  { 0x00C2, 0, 0x6E, 1, 1, 0, 0, 0, "Algorithm Attributes Decryption" },
-  { 0x00C3, 0, 0x6E, 1, 1, 0, 0, 0, "Algorithm Attributes Authentication" },
+  { 0x0047, 0, 0x6E, 1, 0, 0, 0, 0, "Card Capabilities" },
+  { 0x00C0, 0, 0x6E, 1, 0, 0, 0, 0, "Extended Card Capabilities" },
+  { 0x00C1, 0, 0x6E, 1, 0, 0, 0, 0, "Algorithm Attributes Signature" },
+  { 0x00C2, 0, 0x6E, 1, 0, 0, 0, 0, "Algorithm Attributes Decryption" },
+  { 0x00C3, 0, 0x6E, 1, 0, 0, 0, 0, "Algorithm Attributes Authentication" },
   { 0x00C4, 0, 0x6E, 1, 0, 1, 1, 0, "CHV Status Bytes" },
   { 0x00C5, 0, 0x6E, 1, 0, 0, 0, 0, "Fingerprints" },
   { 0x00C6, 0, 0x6E, 1, 0, 0, 0, 0, "CA Fingerprints" },
@@ -119,6 +120,7 @@ static struct {
   { 0x0104, 0,    0, 0, 0, 0, 0, 2, "Private DO 4"},
   { 0x7F21, 1,    0, 1, 0, 0, 0, 1, "Cardholder certificate"},
   /* V3.0 */
+  { 0x7F66, 0, 0x6E, 1, 0, 0, 0, 0, "Extended length information"},
   { 0x7F74, 0,    0, 1, 0, 0, 0, 0, "General Feature Management"},
   { 0x00D5, 0,    0, 1, 0, 0, 0, 0, "AES key data"},
   { 0x00F9, 0,    0, 1, 0, 0, 0, 0, "KDF data object"},
@@ -208,6 +210,8 @@ struct app_local_s {
     unsigned int max_certlen_3:16;
     unsigned int max_get_challenge:16; /* Maximum size for get_challenge.   */
     unsigned int max_special_do:16;    /* Maximum size for special DOs.     */
+    unsigned int max_cmd_data:16;      /* Maximum data size for a command.  */
+    unsigned int max_rsp_data:16;      /* Maximum data size for a response. */
   } extcap;
 
   /* Flags used to control the application.  */
@@ -394,6 +398,15 @@ flush_cache_item (app_t app, int tag)
   if (!app->app_local)
     return;
 
+  /* The DOs to write a single fingerprint or generation time are
+     returned by the card only as part of the DO with all of them.  */
+  if (tag >= 0x00C7 && tag <= 0x00C9)
+    tag = 0x00C5;
+  else if (tag >= 0x00CA && tag <= 0x00CC)
+    tag = 0x00C6;
+  else if (tag >= 0x00CE && tag <= 0x00D0)
+    tag = 0x00CD;
+
   for (c=app->app_local->cache, cprev=NULL; c ; cprev=c, c = c->next)
     if (c->tag == tag)
       {
@@ -448,6 +461,25 @@ flush_cache (app_t app)
 }
 
 
+/* Read the constructed DOs which hold most of the simple DOs into
+   the cache.  This is done once after selecting the application so
+   that later requests for the card's attributes do not require a
+   GET DATA command each.  Errors are ignored; the DOs are then read
+   on demand.  */
+static void
+prefetch_cache (app_t app)
+{
+  static int const tags[] = { 0x006E, 0x0065 };
+  unsigned char *buffer;
+  size_t buflen;
+  int i;
+
+  for (i=0; i < DIM (tags); i++)
+    if (!get_cached_data (app, tags[i], &buffer, &buflen, 0, 0))
+      xfree (buffer);
+}
+
+
 /* Get the DO identified by TAG from the card in SLOT and return a
    buffer with its content in RESULT and NBYTES.  The return value is
    NULL if not found or a pointer which must be used to release the
@@ -4739,6 +4771,8 @@ do_decipher (app_t app, const char *keyidstr,
     return gpg_error (GPG_ERR_INV_VALUE);
 
   if (app->app_local->cardcap.ext_lc_le
+      && (!app->app_local->extcap.max_cmd_data
+          || indatalen < app->app_local->extcap.max_cmd_data)
       && (indatalen > 254
           || (app->app_local->keyattr[1].key_type == KEY_TYPE_RSA
               && app->app_local->keyattr[1].rsa.n_bits > RSA_SMALL_SIZE_OP)))
@@ -4913,6 +4947,11 @@ show_caps (struct app_local_s *s)
       log_info ("MSE-Support ....: %s\n", s->extcap.mse? "yes":"no");
       log_info ("Max-Special-DOs : %u\n", s->extcap.max_special_do);
     }
+  if (s->extcap.max_cmd_data)
+    {
+      log_info ("Max-Cmd-Data ...: %u\n", s->extcap.max_cmd_data);
+      log_info ("Max-Rsp-Data ...: %u\n", s->extcap.max_rsp_data);
+    }
   log_info ("Cmd-Chaining ...: %s\n", s->cardcap.cmd_chaining?"yes":"no");
   log_info ("Ext-Lc-Le ......: %s\n", s->cardcap.ext_lc_le?"yes":"no");
   log_info ("Status-Indicator: %02X\n", s->status_indicator);
@@ -5167,6 +5206,8 @@ app_select_openpgp (app_t app)
       if (app->card_version >= 0x0300)
         app->app_local->extcap.extcap_v3 = 1;
 
+      prefetch_cache (app);
+
       /* Read the historical bytes.  */
       relptr = get_one_do (app, 0x5f52, &buffer, &buflen, NULL);
       if (relptr)
@@ -5234,6 +5275,33 @@ app_select_openpgp (app_t app)
       if (app->card_version <= 0x0100 && manufacturer == 1)
         app->app_local->extcap.change_force_chv = 1;
 
+      /* Cards supporting extended length APDUs announce the maximum
+         sizes in the "Extended length information" DO.  Some cards
+         do this without setting the bit in the historical bytes.  */
+      relptr = get_one_do (app, 0x7f66, &buffer, &buflen, NULL);
+      if (relptr)
+        {
+          if (buflen >= 8 && buffer[0] == 0x02 && buffer[1] == 0x02
+              && buffer[4] == 0x02 && buffer[5] == 0x02)
+            {
+              app->app_local->extcap.max_cmd_data
+                = (buffer[2] << 8 | buffer[3]);
+              app->app_local->extcap.max_rsp_data
+                = (buffer[6] << 8 | buffer[7]);
+              app->app_local->cardcap.ext_lc_le = 1;
+            }
+          xfree (relptr);
+        }
+
+      /* The reader needs to support extended length APDUs as well;
+         if not we fall back to command chaining.  */
+      if (app->app_local->cardcap.ext_lc_le && !apdu_extended_length_p (slot))
+        {
+          if (opt.verbose)
+            log_info ("reader does not support extended length APDUs\n");
+          app->app_local->cardcap.ext_lc_le = 0;
+        }
+
       /* Check optional DO of "General Feature Management" for button.  */
       relptr = get_one_do (app, 0x7f74, &buffer, &buflen, NULL);
       if (relptr)
@@ -40,9 +40,17 @@
 #include "iso7816.h"
 #include "app-common.h"
 #include "../common/tlv.h"
+#include "../common/host2net.h"
 #include "apdu.h" /* fixme: we should move the card detection to a
                      separate file */
 
+/* The directory below the home directory with the cached card files
+   and the maximum size of such a cache file.  */
+#define P15_CACHE_DIR     "p15-cache.d"
+#define P15_CACHE_MAXSIZE (512 * 1024)
+#define P15_CACHE_MAGIC   "GnuPG-P15-Cache-1\n"
+
+
 /* Types of cards we know and which needs special treatment. */
 typedef enum
   {
@@ -272,6 +280,18 @@ struct aodf_object_s
 typedef struct aodf_object_s *aodf_object_t;
 
 
+/* A file or certificate in the on-disk cache.  The KEY identifies
+   the object; e.g. "ef:5031" for the ODF.  */
+struct p15cache_item_s
+{
+  struct p15cache_item_s *next;
+  char key[48];
+  size_t datalen;
+  unsigned char data[1];
+};
+typedef struct p15cache_item_s *p15cache_item_t;
+
+
 /* Context local to this application. */
 struct app_local_s
 {
@@ -317,6 +337,12 @@ struct app_local_s
   /* Information on all authentication objects. */
   aodf_object_t auth_object_info;
 
+  /* The name of the cache file and the cached objects if
+     --enable-p15-cache is used.  CACHE_DIRTY is set if objects have
+     been added since the file was read.  */
+  char *cache_fname;
+  p15cache_item_t cache;
+  int cache_dirty;
 };
 
 
@@ -380,6 +406,23 @@ release_aodflist (aodf_object_t a)
 }
 
 
+/* Release the cached objects and forget the cache file.  */
+static void
+release_p15cache (app_t app)
+{
+  p15cache_item_t item;
+
+  while ((item = app->app_local->cache))
+    {
+      app->app_local->cache = item->next;
+      xfree (item);
+    }
+  xfree (app->app_local->cache_fname);
+  app->app_local->cache_fname = NULL;
+  app->app_local->cache_dirty = 0;
+}
+
+
 /* Release all local resources.  */
 static void
 do_deinit (app_t app)
@@ -391,6 +434,7 @@ do_deinit (app_t app)
       release_cdflist (app->app_local->useful_certificate_info);
       release_prkdflist (app->app_local->private_key_info);
       release_aodflist (app->app_local->auth_object_info);
+      release_p15cache (app);
       xfree (app->app_local->serialno);
       xfree (app->app_local);
       app->app_local = NULL;
@@ -475,6 +519,240 @@ select_ef_by_path (app_t app, const unsigned short *path, size_t pathlen)
   return 0;
 }
 
+
+/* Add a copy of the DATALEN bytes at DATA to the cache of APP using
+   KEY.  Does nothing if the cache is not used.  */
+static void
+p15cache_put (app_t app, const char *key,
+              const unsigned char *data, size_t datalen)
+{
+  p15cache_item_t item;
+
+  if (!app->app_local->cache_fname || !*key || strlen (key) >= sizeof item->key)
+    return;
+  item = xtrymalloc (sizeof *item + datalen);
+  if (!item)
+    return;
+  strcpy (item->key, key);
+  item->datalen = datalen;
+  memcpy (item->data, data, datalen);
+  item->next = app->app_local->cache;
+  app->app_local->cache = item;
+  app->app_local->cache_dirty = 1;
+}
+
+
+/* Return a malloced copy of the object KEY from the cache of APP at
+   R_BUFFER and R_BUFLEN.  Returns false if it has not been cached.  */
+static int
+p15cache_get (app_t app, const char *key,
+              unsigned char **r_buffer, size_t *r_buflen)
+{
+  p15cache_item_t item;
+
+  if (!*key)
+    return 0;
+  for (item = app->app_local->cache; item; item = item->next)
+    if (!strcmp (item->key, key))
+      {
+        *r_buffer = xtrymalloc (item->datalen? item->datalen : 1);
+        if (!*r_buffer)
+          return 0;
+        memcpy (*r_buffer, item->data, item->datalen);
+        *r_buflen = item->datalen;
+        return 1;
+      }
+  return 0;
+}
+
+
+/* Parse the cache file image BUFFER of BUFLEN and store the objects
+   in the cache of APP.  Returns false if the file is not valid.  */
+static int
+parse_p15cache (app_t app, const unsigned char *buffer, size_t buflen)
+{
+  size_t n, keylen, datalen;
+  char key[48];
+
+  n = strlen (P15_CACHE_MAGIC);
+  if (buflen < n || memcmp (buffer, P15_CACHE_MAGIC, n))
+    return 0;
+  buffer += n;
+  buflen -= n;
+  while (buflen)
+    {
+      keylen = *buffer;
+      if (!keylen || keylen >= sizeof key || buflen < 1 + keylen + 4)
+        return 0;
+      memcpy (key, buffer + 1, keylen);
+      key[keylen] = 0;
+      datalen = buf32_to_size_t (buffer + 1 + keylen);
+      buffer += 1 + keylen + 4;
+      buflen -= 1 + keylen + 4;
+      if (datalen > buflen)
+        return 0;
+      p15cache_put (app, key, buffer, datalen);
+      buffer += datalen;
+      buflen -= datalen;
+    }
+  return 1;
+}
+
+
+/* Setup the on-disk cache of APP.  TOKENINFO is the image of
+   EF(TokenInfo) just read from the card.  PKCS#15 has no change
+   counter; the cache file of the card's serial number is thus only
+   used if the stored TokenInfo, which includes the optional
+   lastUpdate field, is identical to the one of the card.  */
+static void
+p15cache_open (app_t app, const unsigned char *tokeninfo, size_t tokeninfolen)
+{
+  char *hexsn;
+  estream_t fp;
+  unsigned char *buffer = NULL;
+  size_t buflen;
+  unsigned char *cached;
+  size_t cachedlen;
+
+  if (!opt.enable_p15_cache || !app->serialno || app->app_local->cache_fname)
+    return;
+
+  hexsn = bin2hex (app->serialno, app->serialnolen, NULL);
+  if (!hexsn)
+    return;
+  app->app_local->cache_fname = make_filename_try (gnupg_homedir (),
+                                                   P15_CACHE_DIR, hexsn, NULL);
+  xfree (hexsn);
+  if (!app->app_local->cache_fname)
+    return;
+
+  fp = es_fopen (app->app_local->cache_fname, "rb");
+  if (fp)
+    {
+      buffer = xtrymalloc (P15_CACHE_MAXSIZE);
+      if (buffer
+          && !es_read (fp, buffer, P15_CACHE_MAXSIZE, &buflen)
+          && buflen < P15_CACHE_MAXSIZE
+          && parse_p15cache (app, buffer, buflen)
+          && p15cache_get (app, "tokeninfo", &cached, &cachedlen))
+        {
+          if (cachedlen == tokeninfolen
+              && !memcmp (cached, tokeninfo, tokeninfolen))
+            {
+              app->app_local->cache_dirty = 0;
+              if (opt.verbose)
+                log_info ("using cached PKCS#15 data from '%s'\n",
+                          app->app_local->cache_fname);
+            }
+          xfree (cached);
+        }
+      xfree (buffer);
+      es_fclose (fp);
+    }
+
+  if (app->app_local->cache_dirty || !app->app_local->cache)
+    {
+      /* Not usable: Start a new cache.  */
+      p15cache_item_t item;
+
+      while ((item = app->app_local->cache))
+        {
+          app->app_local->cache = item->next;
+          xfree (item);
+        }
+      p15cache_put (app, "tokeninfo", tokeninfo, tokeninfolen);
+    }
+}
+
+
+/* Write the cache of APP back if it has been changed.  Errors are
+   logged but otherwise ignored.  */
+static void
+p15cache_flush (app_t app)
+{
+  gpg_error_t err;
+  char *dirname, *tmpname;
+  estream_t fp;
+  p15cache_item_t item;
+  unsigned char hdr[1+48+4];
+  size_t keylen;
+
+  if (!app->app_local->cache_fname || !app->app_local->cache_dirty)
+    return;
+  app->app_local->cache_dirty = 0;
+
+  dirname = make_filename_try (gnupg_homedir (), P15_CACHE_DIR, NULL);
+  if (!dirname)
+    return;
+  if (gnupg_mkdir (dirname, "-rwx") && errno != EEXIST)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("can't create directory '%s': %s\n",
+                 dirname, gpg_strerror (err));
+      xfree (dirname);
+      return;
+    }
+  xfree (dirname);
+
+  tmpname = strconcat (app->app_local->cache_fname, ".tmp", NULL);
+  if (!tmpname)
+    return;
+  fp = es_fopen (tmpname, "wb,mode=-rw");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("can't create '%s': %s\n", tmpname, gpg_strerror (err));
+      xfree (tmpname);
+      return;
+    }
+  es_fputs (P15_CACHE_MAGIC, fp);
+  for (item = app->app_local->cache; item; item = item->next)
+    {
+      keylen = strlen (item->key);
+      hdr[0] = keylen;
+      memcpy (hdr + 1, item->key, keylen);
+      hdr[1 + keylen]     = item->datalen >> 24;
+      hdr[1 + keylen + 1] = item->datalen >> 16;
+      hdr[1 + keylen + 2] = item->datalen >> 8;
+      hdr[1 + keylen + 3] = item->datalen;
+      es_fwrite (hdr, 1 + keylen + 4, 1, fp);
+      es_fwrite (item->data, item->datalen, 1, fp);
+    }
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error writing '%s': %s\n", tmpname, gpg_strerror (err));
+      gnupg_remove (tmpname);
+    }
+  else if ((err = gnupg_rename_file (tmpname, app->app_local->cache_fname,
+                                     NULL)))
+    {
+      log_error ("error renaming '%s': %s\n", tmpname, gpg_strerror (err));
+      gnupg_remove (tmpname);
+    }
+  xfree (tmpname);
+}
+
+
+/* Same as select_and_read_binary but use the on-disk cache if
+   possible.  */
+static gpg_error_t
+read_ef_cached (app_t app, unsigned short efid, const char *efid_desc,
+                unsigned char **buffer, size_t *buflen)
+{
+  gpg_error_t err;
+  char key[20];
+
+  snprintf (key, sizeof key, "ef:%04X", efid);
+  if (p15cache_get (app, key, buffer, buflen))
+    return 0;
+  err = select_and_read_binary (app->slot, efid, efid_desc, buffer, buflen);
+  if (!err)
+    p15cache_put (app, key, *buffer, *buflen);
+  return err;
+}
+
+
 /* Parse a cert Id string (or a key Id string) and return the binary
    object Id string in a newly allocated buffer stored at R_OBJID and
    R_OBJIDLEN.  On Error NULL will be stored there and an error code
@@ -612,7 +890,7 @@ read_ef_odf (app_t app, unsigned short odf_fid)
   unsigned short value;
   size_t offset;
 
-  err = select_and_read_binary (app->slot, odf_fid, "ODF", &buffer, &buflen);
+  err = read_ef_cached (app, odf_fid, "ODF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -826,7 +1104,7 @@ read_ef_prkdf (app_t app, unsigned short fid, prkdf_object_t *result)
   if (!fid)
     return gpg_error (GPG_ERR_NO_DATA); /* No private keys. */
 
-  err = select_and_read_binary (app->slot, fid, "PrKDF", &buffer, &buflen);
+  err = read_ef_cached (app, fid, "PrKDF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -1282,7 +1560,7 @@ read_ef_cdf (app_t app, unsigned short fid, cdf_object_t *result)
   if (!fid)
     return gpg_error (GPG_ERR_NO_DATA); /* No certificates. */
 
-  err = select_and_read_binary (app->slot, fid, "CDF", &buffer, &buflen);
+  err = read_ef_cached (app, fid, "CDF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -1555,7 +1833,7 @@ read_ef_aodf (app_t app, unsigned short fid, aodf_object_t *result)
   if (!fid)
     return gpg_error (GPG_ERR_NO_DATA); /* No authentication objects. */
 
-  err = select_and_read_binary (app->slot, fid, "AODF", &buffer, &buflen);
+  err = read_ef_cached (app, fid, "AODF", &buffer, &buflen);
   if (err)
     return err;
 
@@ -2206,7 +2484,7 @@ TokenFlags ::= BIT STRING {
 
  */
 static gpg_error_t
-read_ef_tokeninfo (app_t app)
+read_ef_tokeninfo (app_t app, unsigned char **r_image, size_t *r_imagelen)
 {
   gpg_error_t err;
   unsigned char *buffer = NULL;
@@ -2276,6 +2554,11 @@ read_ef_tokeninfo (app_t app)
   app->app_local->serialnolen = objlen;
   log_printhex (p, objlen, "Serialnumber from EF(TokenInfo) is:");
 
+  /* Return the image for the cache.  */
+  *r_image = buffer;
+  *r_imagelen = buflen;
+  buffer = NULL;
+
  leave:
   xfree (buffer);
   return err;
@@ -2289,8 +2572,10 @@ static gpg_error_t
 read_p15_info (app_t app)
 {
   gpg_error_t err;
+  unsigned char *tokeninfo = NULL;
+  size_t tokeninfolen = 0;
 
-  if (!read_ef_tokeninfo (app))
+  if (!read_ef_tokeninfo (app, &tokeninfo, &tokeninfolen))
     {
       /* If we don't have a serial number yet but the TokenInfo provides
          one, use that. */
@@ -2302,8 +2587,15 @@ read_p15_info (app_t app)
           app->app_local->serialnolen = 0;
           err = app_munge_serialno (app);
           if (err)
-            return err;
+            {
+              xfree (tokeninfo);
+              return err;
+            }
         }
+
+      /* With the serial number known we can look at the cache.  */
+      p15cache_open (app, tokeninfo, tokeninfolen);
+      xfree (tokeninfo);
     }
 
   /* Read the ODF so that we know the location of all directory
@@ -2346,6 +2638,8 @@ read_p15_info (app_t app)
   if (gpg_err_code (err) == GPG_ERR_NO_DATA)
     err = 0;
 
+  if (!err)
+    p15cache_flush (app);
 
   return err;
 }
@@ -2531,6 +2825,7 @@ readcert_by_cdf (app_t app, cdf_object_t cdf,
   size_t totobjlen, objlen, hdrlen;
   int rootca;
   int i;
+  char key[48];
 
   *r_cert = NULL;
   *r_certlen = 0;
@@ -2546,6 +2841,20 @@ readcert_by_cdf (app_t app, cdf_object_t cdf,
       return 0;
     }
 
+  /* The key of the certificate in the on-disk cache is its location
+     on the card.  */
+  snprintf (key, sizeof key, "cert:%lu:%lu:", cdf->off, cdf->len);
+  for (i=0; i < cdf->pathlen && strlen (key) + 5 < sizeof key; i++)
+    snprintf (key + strlen (key), sizeof key - strlen (key),
+              "%04hX", cdf->path[i]);
+  if (i < cdf->pathlen)
+    *key = 0;  /* Too long; don't cache.  */
+  if (p15cache_get (app, key, r_cert, r_certlen))
+    {
+      err = 0;
+      goto cache_it;
+    }
+
   /* Read the entire file.  fixme: This could be optimized by first
      reading the header to figure out how long the certificate
      actually is. */
@@ -2621,7 +2930,10 @@ readcert_by_cdf (app_t app, cdf_object_t cdf,
   *r_cert = buffer;
   buffer = NULL;
   *r_certlen = totobjlen;
+  p15cache_put (app, key, *r_cert, *r_certlen);
+  p15cache_flush (app);
 
+ cache_it:
   /* Try to cache it. */
   if (!cdf->image && (cdf->image = xtrymalloc (*r_certlen)))
     {
@@ -33,6 +33,9 @@
 
 static npth_mutex_t app_list_lock;
 static app_t app_top;
+
+/* Number of status checks skipped because the card was busy.  */
+static unsigned long busy_status_checks;
 
 static void
 print_progress_line (void *opaque, const char *what, int pc, int cur, int tot)
@@ -58,25 +61,47 @@ print_progress_line (void *opaque, const char *what, int pc, int cur, int tot)
 static gpg_error_t
 lock_app (app_t app, ctrl_t ctrl)
 {
+  app->lock_queue++;
   if (npth_mutex_lock (&app->lock))
     {
       gpg_error_t err = gpg_error_from_syserror ();
+      app->lock_queue--;
       log_error ("failed to acquire APP lock for %p: %s\n",
                  app, gpg_strerror (err));
       return err;
     }
+  app->ncommands++;
 
   apdu_set_progress_cb (app->slot, print_progress_line, ctrl);
 
   return 0;
 }
 
+
+/* Same as lock_app but return GPG_ERR_EBUSY instead of waiting if
+   another connection holds the lock.  */
+static gpg_error_t
+trylock_app (app_t app)
+{
+  int res;
+
+  res = npth_mutex_trylock (&app->lock);
+  if (res)
+    return res == EBUSY? gpg_error (GPG_ERR_EBUSY) : gpg_error_from_errno (res);
+  app->lock_queue++;
+
+  apdu_set_progress_cb (app->slot, print_progress_line, NULL);
+
+  return 0;
+}
+
 /* Release a lock on the reader.  See lock_reader(). */
 static void
 unlock_app (app_t app)
 {
   apdu_set_progress_cb (app->slot, NULL, NULL);
 
+  app->lock_queue--;
   if (npth_mutex_unlock (&app->lock))
     {
       gpg_error_t err = gpg_error_from_syserror ();
@@ -1033,9 +1058,21 @@ scd_update_reader_status_file (void)
       int sw;
       unsigned int status;
 
-      lock_app (a, NULL);
       app_next = a->next;
 
+      /* Do not wait for a card which is in use by a connection; for
+         example an RSA-4096 signature may take seconds and we don't
+         want to block the other cards while holding APP_LIST_LOCK.
+         A removal of that card will be detected with the next
+         check.  */
+      if (trylock_app (a))
+        {
+          busy_status_checks++;
+          if (a->periodical_check_needed)
+            periodical_check_needed = 1;
+          continue;
+        }
+
       if (a->reset_requested)
         status = 0;
       else
@@ -1106,6 +1143,28 @@ initialize_module_command (void)
   return apdu_init ();
 }
 
+/* Emit the statistics of the applications for the stats registry.
+   For each reader slot the number of connections waiting for or
+   using the card and the number of commands are reported.  */
+void
+app_stats_report (stats_sink_t sink)
+{
+  app_t a;
+  char name[40];
+
+  npth_mutex_lock (&app_list_lock);
+  for (a = app_top; a; a = a->next)
+    {
+      snprintf (name, sizeof name, "slot%d_queue", a->slot);
+      stats_put (sink, name, a->lock_queue);
+      snprintf (name, sizeof name, "slot%d_commands", a->slot);
+      stats_put (sink, name, a->ncommands);
+    }
+  npth_mutex_unlock (&app_list_lock);
+  stats_put (sink, "busy_status_checks", busy_status_checks);
+}
+
+
 void
 app_send_card_list (ctrl_t ctrl)
 {
@@ -1732,6 +1732,18 @@ ccid_require_get_status (ccid_driver_t handle)
 }
 
 
+/* Return true if extended length APDUs can be sent to the card in
+   the reader HANDLE.  Readers working at the TPDU level transfer
+   any APDU; readers working at the short APDU level reject them -
+   except for the Omnikey readers which are driven by TPDUs in this
+   case.  */
+int
+ccid_extended_length_p (ccid_driver_t handle)
+{
+  return !(handle->apdu_level == 1 && handle->id_vendor != VENDOR_OMNIKEY);
+}
+
+
 static void
 do_close_reader (ccid_driver_t handle)
 {
@@ -143,6 +143,7 @@ int ccid_transceive_escape (ccid_driver_t handle,
                             unsigned char *resp, size_t maxresplen,
                             size_t *nresp);
 int ccid_require_get_status (ccid_driver_t handle);
+int ccid_extended_length_p (ccid_driver_t handle);
 
 
 #endif /*CCID_DRIVER_H*/
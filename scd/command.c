@@ -42,6 +42,7 @@
 #endif
 #include "../common/asshelp.h"
 #include "../common/server-help.h"
+#include "../common/stats.h"
 
 /* Maximum length allowed as a PIN; used for INQUIRE NEEDPIN */
 #define MAXLEN_PIN 100
@@ -1395,7 +1396,8 @@ static const char hlp_getinfo[] =
   "                application per line, fields delimited by colons,\n"
   "                first field is the name.\n"
   "  card_list   - Return a list of serial numbers of active cards,\n"
-  "                using a status response.";
+  "                using a status response.\n"
+  "  stats       - Return the statistics as a JSON object.";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
 {
@@ -1472,6 +1474,18 @@ cmd_getinfo (assuan_context_t ctx, char *line)
 
       app_send_card_list (ctrl);
     }
+  else if (!strcmp (line, "stats"))
+    {
+      char *buf = stats_to_json ();
+
+      if (!buf)
+        rc = gpg_error_from_syserror ();
+      else
+        {
+          rc = assuan_send_data (ctx, buf, strlen (buf));
+          xfree (buf);
+        }
+    }
   else
     rc = set_error (GPG_ERR_ASS_PARAMETER, "unknown value for WHAT");
   return rc;
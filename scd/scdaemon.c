@@ -54,6 +54,8 @@
 #include "../common/asshelp.h"
 #include "../common/exechelp.h"
 #include "../common/init.h"
+#include "../common/stats.h"
+#include "../common/asynclog.h"
 
 #ifndef ENAMETOOLONG
 # define ENAMETOOLONG EINVAL
@@ -84,6 +86,7 @@ enum cmd_and_opt_values
   oNoDetach,
   oNoGrab,
   oLogFile,
+  oAsyncLog,
   oServer,
   oMultiServer,
   oDaemon,
@@ -99,6 +102,7 @@ enum cmd_and_opt_values
   oDenyAdmin,
   oDisableApplication,
   oEnablePinpadVarlen,
+  oEnableP15Cache,
   oListenBacklog
 };
 
@@ -130,6 +134,7 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_p_u (oDebugAssuanLogCats, "debug-assuan-log-cats", "@"),
   ARGPARSE_s_n (oNoDetach, "no-detach", N_("do not detach from the console")),
   ARGPARSE_s_s (oLogFile,  "log-file", N_("|FILE|write a log to FILE")),
+  ARGPARSE_s_n (oAsyncLog, "async-log", "@"),
   ARGPARSE_s_s (oReaderPort, "reader-port",
                 N_("|N|connect to reader at port N")),
   ARGPARSE_s_s (octapiDriver, "ctapi-driver",
@@ -156,6 +161,7 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_s (oDisableApplication, "disable-application", "@"),
   ARGPARSE_s_n (oEnablePinpadVarlen, "enable-pinpad-varlen",
                 N_("use variable length input for pinpad")),
+  ARGPARSE_s_n (oEnableP15Cache, "enable-p15-cache", "@"),
   ARGPARSE_s_s (oHomedir,    "homedir",      "@"),
   ARGPARSE_s_i (oListenBacklog, "listen-backlog", "@"),
 
@@ -427,6 +433,7 @@ main (int argc, char **argv )
   int multi_server = 0;
   int is_daemon = 0;
   int nodetach = 0;
+  int async_log = 0;
   int csh_style = 0;
   char *logfile = NULL;
   int debug_wait = 0;
@@ -438,6 +445,8 @@ main (int argc, char **argv )
   npth_t pipecon_handler;
 
   early_system_init ();
+  stats_init ();
+  stats_register ("app", app_stats_report);
   set_strusage (my_strusage);
   gcry_control (GCRYCTL_SUSPEND_SECMEM_WARN);
   /* Please note that we may running SUID(ROOT), so be very CAREFUL
@@ -592,6 +601,7 @@ main (int argc, char **argv )
         case oHomedir: gnupg_set_homedir (pargs.r.ret_str); break;
         case oNoDetach: nodetach = 1; break;
         case oLogFile: logfile = pargs.r.ret_str; break;
+        case oAsyncLog: async_log = 1; break;
         case oCsh: csh_style = 1; break;
         case oSh: csh_style = 0; break;
         case oServer: pipe_server = 1; break;
@@ -617,6 +627,7 @@ main (int argc, char **argv )
           break;
 
         case oEnablePinpadVarlen: opt.enable_pinpad_varlen = 1; break;
+        case oEnableP15Cache: opt.enable_p15_cache = 1; break;
 
         case oListenBacklog:
           listen_backlog = pargs.r.ret_int;
@@ -811,6 +822,9 @@ main (int argc, char **argv )
       npth_setname_np (pipecon_handler, "pipe-connection");
       npth_attr_destroy (&tattr);
 
+      if (async_log && logfile)
+        async_log_set_file (logfile);
+
       /* We run handle_connection to wait for the shutdown signal and
          to run the ticker stuff.  */
       handle_connections (fd);
@@ -947,6 +961,11 @@ main (int argc, char **argv )
           exit (1);
         }
 
+      /* The log writer thread needs to be started by the daemon
+       * process itself.  */
+      if (async_log && logfile)
+        async_log_set_file (logfile);
+
       handle_connections (fd);
 
       close (fd);
@@ -30,6 +30,7 @@
 #include <gcrypt.h>
 #include "../common/util.h"
 #include "../common/sysutils.h"
+#include "../common/stats.h"
 
 /* To convey some special hash algorithms we use algorithm numbers
    reserved for application use. */
@@ -57,6 +58,7 @@ struct
   int disable_ccid;    /* Disable the use of the internal CCID driver. */
   int disable_pinpad;  /* Do not use a pinpad. */
   int enable_pinpad_varlen;  /* Use variable length input for pinpad. */
+  int enable_p15_cache;      /* Cache the PKCS#15 data of cards.  */
   int allow_admin;     /* Allow the use of admin commands for certain
                           cards. */
   strlist_t disabled_applications;  /* Card applications we do not
@@ -129,5 +131,6 @@ int get_active_connection_count (void);
 
 /*-- app.c --*/
 int scd_update_reader_status_file (void);
+void app_stats_report (stats_sink_t sink);
 
 #endif /*SCDAEMON_H*/
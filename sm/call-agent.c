@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
+#include <npth.h>
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
@@ -43,6 +44,30 @@
 
 static assuan_context_t agent_ctx = NULL;
 
+/* Additional connections to the agent.  They are used to run several
+ * requests at the same time and kept for later operations.  */
+#define MAX_AGENT_CONNECTIONS 8
+static assuan_context_t extra_agent_ctx[MAX_AGENT_CONNECTIONS - 1];
+
+/* If several connections are in use this lock serializes the
+ * inquiries which are forwarded to our client.  */
+static npth_mutex_t inquiry_lock;
+static int inquiry_lock_initialized;
+
+/* The keygrips of all secret keys as returned by HAVEKEY --list.
+ * This saves a round trip to the agent for each certificate checked
+ * by gpgsm_agent_havekey.  The list is invalidated by all functions
+ * which may create a secret key.  */
+static struct
+{
+  int state;              /* 0 = not loaded, 1 = loaded, -1 = n/a.  */
+  unsigned char *grips;   /* NGRIPS sorted keygrips of 20 bytes.  */
+  size_t ngrips;
+} havekey_cache;
+
+
+static void havekey_cache_invalidate (void);
+
 
 struct cipher_parm_s
 {
@@ -126,19 +151,21 @@ warn_version_mismatch (ctrl_t ctrl, assuan_context_t ctx,
 
 
 /* Try to connect to the agent via socket or fork it off and work by
-   pipes.  Handle the server's initial greeting */
+   pipes.  Handle the server's initial greeting.  The context is
+   stored at R_CTX; if EXTRA is set this is an additional connection
+   and the version check is skipped.  */
 static int
-start_agent (ctrl_t ctrl)
+start_agent_ctx (ctrl_t ctrl, assuan_context_t *r_ctx, int extra)
 {
   int rc;
 
-  if (agent_ctx)
+  if (*r_ctx)
     rc = 0;      /* fixme: We need a context for each thread or
                     serialize the access to the agent (which is
                     suitable given that the agent is not MT. */
   else
     {
-      rc = start_new_gpg_agent (&agent_ctx,
+      rc = start_new_gpg_agent (r_ctx,
                                 GPG_ERR_SOURCE_DEFAULT,
                                 opt.agent_program,
                                 opt.lc_ctype, opt.lc_messages,
@@ -156,13 +183,14 @@ start_agent (ctrl_t ctrl)
               log_info (_("no gpg-agent running in this session\n"));
             }
         }
-      else if (!rc && !(rc = warn_version_mismatch (ctrl, agent_ctx,
-                                                    GPG_AGENT_NAME, 0)))
+      else if (!rc && (extra
+                       || !(rc = warn_version_mismatch (ctrl, *r_ctx,
+                                                        GPG_AGENT_NAME, 0))))
         {
           /* Tell the agent that we support Pinentry notifications.  No
              error checking so that it will work also with older
              agents.  */
-          assuan_transact (agent_ctx, "OPTION allow-pinentry-notify",
+          assuan_transact (*r_ctx, "OPTION allow-pinentry-notify",
                            NULL, NULL, NULL, NULL, NULL, NULL);
 
           /* Pass on the pinentry mode.  */
@@ -170,7 +198,7 @@ start_agent (ctrl_t ctrl)
             {
               char *tmp = xasprintf ("OPTION pinentry-mode=%s",
                                      str_pinentry_mode (opt.pinentry_mode));
-              rc = assuan_transact (agent_ctx, tmp,
+              rc = assuan_transact (*r_ctx, tmp,
                                NULL, NULL, NULL, NULL, NULL, NULL);
               xfree (tmp);
               if (rc)
@@ -184,7 +212,7 @@ start_agent (ctrl_t ctrl)
             {
               char *tmp = xasprintf ("OPTION pretend-request-origin=%s",
                                      str_request_origin (opt.request_origin));
-              rc = assuan_transact (agent_ctx, tmp,
+              rc = assuan_transact (*r_ctx, tmp,
                                NULL, NULL, NULL, NULL, NULL, NULL);
               xfree (tmp);
               if (rc)
@@ -198,7 +226,7 @@ start_agent (ctrl_t ctrl)
 #ifdef HAVE_W32_SYSTEM
           if (!rc && opt.compliance == CO_DE_VS)
             {
-              if (assuan_transact (agent_ctx, "GETINFO jent_active",
+              if (assuan_transact (*r_ctx, "GETINFO jent_active",
                                    NULL, NULL, NULL, NULL, NULL, NULL))
                 {
                   rc = gpg_error (GPG_ERR_FORBIDDEN);
@@ -223,6 +251,13 @@ start_agent (ctrl_t ctrl)
   return rc;
 }
 
+
+static int
+start_agent (ctrl_t ctrl)
+{
+  return start_agent_ctx (ctrl, &agent_ctx, 0);
+}
+
 /* This is the default inquiry callback.  It mainly handles the
    Pinentry notifications.  */
 static gpg_error_t
@@ -234,7 +269,11 @@ default_inq_cb (void *opaque, const char *line)
 
   if (has_leading_keyword (line, "PINENTRY_LAUNCHED"))
     {
+      if (inquiry_lock_initialized)
+        npth_mutex_lock (&inquiry_lock);
       err = gpgsm_proxy_pinentry_notify (ctrl, line);
+      if (inquiry_lock_initialized)
+        npth_mutex_unlock (&inquiry_lock);
       if (err)
         log_error (_("failed to proxy %s inquiry to client\n"),
                    "PINENTRY_LAUNCHED");
@@ -257,42 +296,99 @@ default_inq_cb (void *opaque, const char *line)
 
 
 
+/* Make sure that up to N connections to the agent are available for
+   gpgsm_agent_pksign_conn and store the number of connections, which
+   is at least 1, at R_N.  Returns an error if not even one connection
+   could be established.  This requires that nPth has been
+   initialized.  */
+gpg_error_t
+gpgsm_agent_open_connections (ctrl_t ctrl, int n, int *r_n)
+{
+  gpg_error_t err;
+  int i;
+
+  *r_n = 0;
+  err = start_agent (ctrl);
+  if (err)
+    return err;
+
+  if (!inquiry_lock_initialized)
+    {
+      npth_mutex_init (&inquiry_lock, NULL);
+      inquiry_lock_initialized = 1;
+    }
+
+  if (n > MAX_AGENT_CONNECTIONS)
+    n = MAX_AGENT_CONNECTIONS;
+  for (i=1; i < n; i++)
+    if (start_agent_ctx (ctrl, &extra_agent_ctx[i-1], 1))
+      {
+        log_info ("using only %d connections to the agent\n", i);
+        break;
+      }
+  *r_n = i;
+  return 0;
+}
+
+
 /* Call the agent to do a sign operation using the key identified by
    the hex string KEYGRIP. */
 int
 gpgsm_agent_pksign (ctrl_t ctrl, const char *keygrip, const char *desc,
                     unsigned char *digest, size_t digestlen, int digestalgo,
                     unsigned char **r_buf, size_t *r_buflen )
+{
+  return gpgsm_agent_pksign_conn (ctrl, 0, keygrip, desc,
+                                  digest, digestlen, digestalgo,
+                                  r_buf, r_buflen);
+}
+
+
+/* Same as gpgsm_agent_pksign but use the connection CONN as opened
+   by gpgsm_agent_open_connections.  Connection 0 is the standard
+   connection.  Different connections may be used by different
+   threads at the same time.  */
+int
+gpgsm_agent_pksign_conn (ctrl_t ctrl, int conn,
+                         const char *keygrip, const char *desc,
+                         unsigned char *digest, size_t digestlen,
+                         int digestalgo,
+                         unsigned char **r_buf, size_t *r_buflen)
 {
   int rc, i;
   char *p, line[ASSUAN_LINELENGTH];
   membuf_t data;
   size_t len;
   struct default_inq_parm_s inq_parm;
+  assuan_context_t ctx;
 
   *r_buf = NULL;
+  if (conn < 0 || conn >= MAX_AGENT_CONNECTIONS
+      || (conn && !extra_agent_ctx[conn-1]))
+    return gpg_error (GPG_ERR_INV_ARG);
   rc = start_agent (ctrl);
   if (rc)
     return rc;
+  ctx = conn? extra_agent_ctx[conn-1] : agent_ctx;
   inq_parm.ctrl = ctrl;
-  inq_parm.ctx = agent_ctx;
+  inq_parm.ctx = ctx;
 
   if (digestlen*2 + 50 > DIM(line))
     return gpg_error (GPG_ERR_GENERAL);
 
-  rc = assuan_transact (agent_ctx, "RESET", NULL, NULL, NULL, NULL, NULL, NULL);
+  rc = assuan_transact (ctx, "RESET", NULL, NULL, NULL, NULL, NULL, NULL);
   if (rc)
     return rc;
 
   snprintf (line, DIM(line), "SIGKEY %s", keygrip);
-  rc = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+  rc = assuan_transact (ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
   if (rc)
     return rc;
 
   if (desc)
     {
       snprintf (line, DIM(line), "SETKEYDESC %s", desc);
-      rc = assuan_transact (agent_ctx, line,
+      rc = assuan_transact (ctx, line,
                             NULL, NULL, NULL, NULL, NULL, NULL);
       if (rc)
         return rc;
@@ -302,12 +398,12 @@ gpgsm_agent_pksign (ctrl_t ctrl, const char *keygrip, const char *desc,
   p = line + strlen (line);
   for (i=0; i < digestlen ; i++, p += 2 )
     sprintf (p, "%02X", digest[i]);
-  rc = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+  rc = assuan_transact (ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
   if (rc)
     return rc;
 
   init_membuf (&data, 1024);
-  rc = assuan_transact (agent_ctx, "PKSIGN",
+  rc = assuan_transact (ctx, "PKSIGN",
                         put_membuf_cb, &data, default_inq_cb, &inq_parm,
                         NULL, NULL);
   if (rc)
@@ -570,6 +666,7 @@ gpgsm_agent_genkey (ctrl_t ctrl,
   unsigned char *buf;
 
   *r_pubkey = NULL;
+  havekey_cache_invalidate ();
   rc = start_agent (ctrl);
   if (rc)
     return rc;
@@ -914,6 +1011,73 @@ gpgsm_agent_marktrusted (ctrl_t ctrl, ksba_cert_t cert)
 
 
 
+/* Drop the cached list of secret keys.  */
+static void
+havekey_cache_invalidate (void)
+{
+  if (havekey_cache.state == 1)
+    {
+      xfree (havekey_cache.grips);
+      havekey_cache.grips = NULL;
+      havekey_cache.ngrips = 0;
+      havekey_cache.state = 0;
+    }
+}
+
+
+/* qsort and bsearch compare function for keygrips.  */
+static int
+cmp_keygrips (const void *a, const void *b)
+{
+  return memcmp (a, b, 20);
+}
+
+
+/* Check the cached list of secret keys for the binary keygrip GRIP.
+ * Returns 0 if the key is available, GPG_ERR_NO_SECKEY if not, and
+ * GPG_ERR_NOT_SUPPORTED if the agent does not support HAVEKEY --list.
+ * The agent must have been started.  */
+static gpg_error_t
+havekey_cache_lookup (const unsigned char *grip)
+{
+  gpg_error_t err;
+  membuf_t data;
+  unsigned char *buf;
+  size_t len;
+
+  if (!havekey_cache.state)
+    {
+      init_membuf (&data, 1024);
+      err = assuan_transact (agent_ctx, "HAVEKEY --list",
+                             put_membuf_cb, &data,
+                             NULL, NULL, NULL, NULL);
+      buf = get_membuf (&data, &len);
+      if (err || !buf)
+        {
+          /* Probably an old agent; do not try again.  */
+          xfree (buf);
+          havekey_cache.state = -1;
+        }
+      else
+        {
+          havekey_cache.grips = buf;
+          havekey_cache.ngrips = len / 20;
+          if (havekey_cache.ngrips > 1)
+            qsort (havekey_cache.grips, havekey_cache.ngrips, 20,
+                   cmp_keygrips);
+          havekey_cache.state = 1;
+        }
+    }
+
+  if (havekey_cache.state != 1)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  if (bsearch (grip, havekey_cache.grips, havekey_cache.ngrips, 20,
+               cmp_keygrips))
+    return 0;
+  return gpg_error (GPG_ERR_NO_SECKEY);
+}
+
+
 /* Ask the agent whether the a corresponding secret key is available
    for the given keygrip */
 int
@@ -921,14 +1085,20 @@ gpgsm_agent_havekey (ctrl_t ctrl, const char *hexkeygrip)
 {
   int rc;
   char line[ASSUAN_LINELENGTH];
+  unsigned char grip[20];
 
   rc = start_agent (ctrl);
   if (rc)
     return rc;
 
-  if (!hexkeygrip || strlen (hexkeygrip) != 40)
+  if (!hexkeygrip || strlen (hexkeygrip) != 40
+      || hex2bin (hexkeygrip, grip, 20) != 40)
     return gpg_error (GPG_ERR_INV_VALUE);
 
+  rc = havekey_cache_lookup (grip);
+  if (gpg_err_code (rc) != GPG_ERR_NOT_SUPPORTED)
+    return rc;
+
   snprintf (line, DIM(line), "HAVEKEY %s", hexkeygrip);
 
   rc = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
@@ -1033,6 +1203,7 @@ gpgsm_agent_learn (ctrl_t ctrl)
   membuf_t data;
   size_t len;
 
+  havekey_cache_invalidate ();
   rc = start_agent (ctrl);
   if (rc)
     return rc;
@@ -1323,6 +1494,7 @@ gpgsm_agent_import_key (ctrl_t ctrl, const void *key, size_t keylen)
   gpg_error_t err;
   struct import_key_parm_s parm;
 
+  havekey_cache_invalidate ();
   err = start_agent (ctrl);
   if (err)
     return err;
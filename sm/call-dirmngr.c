@@ -27,6 +27,7 @@
 #include <time.h>
 #include <assert.h>
 #include <ctype.h>
+#include <npth.h>
 
 #include "gpgsm.h"
 #include <gcrypt.h>
@@ -35,6 +36,7 @@
 #include "../common/i18n.h"
 #include "keydb.h"
 #include "../common/asshelp.h"
+#include "../common/sysutils.h"
 
 
 struct membuf {
@@ -54,6 +56,24 @@ static assuan_context_t dirmngr2_ctx = NULL;
 static int dirmngr_ctx_locked;
 static int dirmngr2_ctx_locked;
 
+/* The connections used for ISVALID requests while validations run in
+ * several threads; see gpgsm_dirmngr_set_parallel.  */
+#define MAX_DIRMNGR_CONNECTIONS 16
+static struct
+{
+  assuan_context_t ctx;
+  int busy;
+  int did_options;
+} isvalid_conn[MAX_DIRMNGR_CONNECTIONS];
+static int isvalid_nconns;
+
+/* The lock held by a thread while it runs gpgsm code.  It is released
+ * while waiting for the response to an ISVALID request.  NULL if not
+ * in parallel mode.  */
+static npth_mutex_t *isvalid_lock;
+static npth_cond_t isvalid_cond;
+static int isvalid_cond_initialized;
+
 struct inq_certificate_parm_s {
   ctrl_t ctrl;
   assuan_context_t ctx;
@@ -333,6 +353,75 @@ release_dirmngr2 (ctrl_t ctrl)
 }
 
 
+/* Switch to parallel mode for ISVALID requests, using up to NCONNS
+ * connections.  LOCK is the mutex held by all threads running gpgsm
+ * code; the caller must hold it.  If LOCK is NULL the parallel mode
+ * is disabled.  The connections are kept open for later use.  */
+void
+gpgsm_dirmngr_set_parallel (npth_mutex_t *lock, int nconns)
+{
+  if (!isvalid_cond_initialized)
+    {
+      npth_cond_init (&isvalid_cond, NULL);
+      isvalid_cond_initialized = 1;
+    }
+  if (nconns > MAX_DIRMNGR_CONNECTIONS)
+    nconns = MAX_DIRMNGR_CONNECTIONS;
+  isvalid_lock = lock;
+  isvalid_nconns = lock? nconns : 0;
+}
+
+
+/* Get a connection for an ISVALID request in parallel mode and store
+ * its index at R_CONN.  Waits until a connection is available.  */
+static gpg_error_t
+acquire_isvalid_conn (ctrl_t ctrl, int *r_conn)
+{
+  gpg_error_t err;
+  int i;
+
+  for (;;)
+    {
+      /* Prefer an already open connection.  Connections are opened
+       * in order, thus the first closed one comes after them.  */
+      for (i=0; i < isvalid_nconns; i++)
+        if (isvalid_conn[i].ctx && !isvalid_conn[i].busy)
+          break;
+      if (i == isvalid_nconns)
+        for (i=0; i < isvalid_nconns; i++)
+          if (!isvalid_conn[i].ctx)
+            break;
+      if (i == isvalid_nconns)
+        {
+          npth_cond_wait (&isvalid_cond, isvalid_lock);
+          continue;
+        }
+
+      isvalid_conn[i].busy = 1;
+      err = start_dirmngr_ext (ctrl, &isvalid_conn[i].ctx);
+      if (!err)
+        break;
+      isvalid_conn[i].busy = 0;
+      if (!i)
+        return err;
+      /* The dirmngr does not accept more connections.  */
+      log_info ("using only %d connections to the dirmngr\n", i);
+      isvalid_nconns = i;
+    }
+
+  *r_conn = i;
+  return 0;
+}
+
+
+static void
+release_isvalid_conn (int conn)
+{
+  isvalid_conn[conn].busy = 0;
+  npth_cond_broadcast (&isvalid_cond);
+}
+
+
 
 /* Handle a SENDCERT inquiry. */
 static gpg_error_t
@@ -480,6 +569,30 @@ isvalid_status_cb (void *opaque, const char *line)
 }
 
 
+/* The callbacks used in parallel mode: they run while ISVALID_LOCK is
+ * not held by the thread waiting for the response.  */
+static gpg_error_t
+inq_certificate_locked (void *opaque, const char *line)
+{
+  gpg_error_t err;
+
+  npth_mutex_lock (isvalid_lock);
+  err = inq_certificate (opaque, line);
+  npth_mutex_unlock (isvalid_lock);
+  return err;
+}
+
+static gpg_error_t
+isvalid_status_cb_locked (void *opaque, const char *line)
+{
+  gpg_error_t err;
+
+  npth_mutex_lock (isvalid_lock);
+  err = isvalid_status_cb (opaque, line);
+  npth_mutex_unlock (isvalid_lock);
+  return err;
+}
+
 
 
 /* Call the directory manager to check whether the certificate is valid
@@ -499,22 +612,41 @@ gpgsm_dirmngr_isvalid (ctrl_t ctrl,
                        ksba_cert_t cert, ksba_cert_t issuer_cert, int use_ocsp)
 {
   static int did_options;
+  int *did_optionsp;
   int rc;
   char *certid, *certfpr;
   char line[ASSUAN_LINELENGTH];
   struct inq_certificate_parm_s parm;
   struct isvalid_status_parm_s stparm;
+  assuan_context_t ctx;
+  int conn = -1;
 
-  rc = start_dirmngr (ctrl);
-  if (rc)
-    return rc;
+  if (isvalid_lock)
+    {
+      rc = acquire_isvalid_conn (ctrl, &conn);
+      if (rc)
+        return rc;
+      ctx = isvalid_conn[conn].ctx;
+      did_optionsp = &isvalid_conn[conn].did_options;
+    }
+  else
+    {
+      rc = start_dirmngr (ctrl);
+      if (rc)
+        return rc;
+      ctx = dirmngr_ctx;
+      did_optionsp = &did_options;
+    }
 
   certfpr = gpgsm_get_fingerprint_hexstring (cert, GCRY_MD_SHA1);
   certid = gpgsm_get_certid (cert);
   if (!certid)
     {
       log_error ("error getting the certificate ID\n");
-      release_dirmngr (ctrl);
+      if (conn != -1)
+        release_isvalid_conn (conn);
+      else
+        release_dirmngr (ctrl);
       return gpg_error (GPG_ERR_GENERAL);
     }
 
@@ -526,7 +658,7 @@ gpgsm_dirmngr_isvalid (ctrl_t ctrl,
       xfree (fpr);
     }
 
-  parm.ctx = dirmngr_ctx;
+  parm.ctx = ctx;
   parm.ctrl = ctrl;
   parm.cert = cert;
   parm.issuer_cert = issuer_cert;
@@ -535,14 +667,14 @@ gpgsm_dirmngr_isvalid (ctrl_t ctrl,
   stparm.seen = 0;
   memset (stparm.fpr, 0, 20);
 
-  /* It is sufficient to send the options only once because we have
-   * one connection per process only.  */
-  if (!did_options)
+  /* It is sufficient to send the options only once for each
+   * connection.  */
+  if (!*did_optionsp)
     {
       if (opt.force_crl_refresh)
-        assuan_transact (dirmngr_ctx, "OPTION force-crl-refresh=1",
+        assuan_transact (ctx, "OPTION force-crl-refresh=1",
                          NULL, NULL, NULL, NULL, NULL, NULL);
-      did_options = 1;
+      *did_optionsp = 1;
     }
   snprintf (line, DIM(line), "ISVALID%s%s %s%s%s",
             use_ocsp == 2 || opt.no_crl_check ? " --only-ocsp":"",
@@ -553,9 +685,19 @@ gpgsm_dirmngr_isvalid (ctrl_t ctrl,
   xfree (certid);
   xfree (certfpr);
 
-  rc = assuan_transact (dirmngr_ctx, line, NULL, NULL,
-                        inq_certificate, &parm,
-                        isvalid_status_cb, &stparm);
+  if (conn != -1)
+    {
+      /* Let the other threads run while the dirmngr is working.  */
+      npth_mutex_unlock (isvalid_lock);
+      rc = assuan_transact (ctx, line, NULL, NULL,
+                            inq_certificate_locked, &parm,
+                            isvalid_status_cb_locked, &stparm);
+      npth_mutex_lock (isvalid_lock);
+    }
+  else
+    rc = assuan_transact (ctx, line, NULL, NULL,
+                          inq_certificate, &parm,
+                          isvalid_status_cb, &stparm);
   if (opt.verbose > 1)
     log_info ("response of dirmngr: %s\n", rc? gpg_strerror (rc): "okay");
 
@@ -571,7 +713,7 @@ gpgsm_dirmngr_isvalid (ctrl_t ctrl,
         {
           ksba_cert_t rspcert = NULL;
 
-          if (get_cached_cert (dirmngr_ctx, stparm.fpr, &rspcert))
+          if (get_cached_cert (ctx, stparm.fpr, &rspcert))
             {
               /* Ooops: Something went wrong getting the certificate
                  from the dirmngr.  Try our own cert store now.  */
@@ -615,7 +757,10 @@ gpgsm_dirmngr_isvalid (ctrl_t ctrl,
           ksba_cert_release (rspcert);
         }
     }
-  release_dirmngr (ctrl);
+  if (conn != -1)
+    release_isvalid_conn (conn);
+  else
+    release_dirmngr (ctrl);
   return rc;
 }
 
@@ -668,6 +813,95 @@ lookup_cb (void *opaque, const void *buffer, size_t length)
   return 0;
 }
 
+
+/* Ask the dirmngr to write the certificates returned by the next
+ * LOOKUP to a temporary file instead of sending each one as data
+ * lines.  Returns the stream of that file or NULL if the file
+ * descriptor can't be passed; the data lines are then used.  */
+static estream_t
+setup_lookup_tmpfile (assuan_context_t ctx)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)ctx;
+  return NULL;
+#else
+  estream_t fp;
+
+  fp = es_tmpfile ();
+  if (!fp)
+    return NULL;
+  if (assuan_sendfd (ctx, INT2FD (es_fileno (fp)))
+      || assuan_transact (ctx, "OUTPUT FD", NULL, NULL, NULL, NULL,
+                          NULL, NULL))
+    {
+      es_fclose (fp);
+      return NULL;
+    }
+  return fp;
+#endif
+}
+
+
+/* Parse the concatenated DER encoded certificates written by the
+ * dirmngr to FP and pass them to the callback of PARM.  */
+static gpg_error_t
+process_lookup_tmpfile (struct lookup_parm_s *parm, estream_t fp)
+{
+  gpg_error_t err = 0;
+  struct membuf mb;
+  char buffer[4096];
+  char *buf;
+  size_t len, nread;
+  ksba_reader_t reader = NULL;
+  ksba_cert_t cert = NULL;
+
+  es_rewind (fp);
+  init_membuf (&mb, 4096);
+  while (!es_read (fp, buffer, sizeof buffer, &nread) && nread)
+    put_membuf (&mb, buffer, nread);
+  if (es_ferror (fp))
+    err = gpg_error_from_syserror ();
+  buf = get_membuf (&mb, &len);
+  if (err || !buf)
+    {
+      if (!err)
+        err = gpg_error (GPG_ERR_ENOMEM);
+      xfree (buf);
+      return err;
+    }
+  if (!len)
+    goto leave;
+
+  err = ksba_reader_new (&reader);
+  if (!err)
+    err = ksba_reader_set_mem (reader, buf, len);
+  while (!err)
+    {
+      err = ksba_cert_new (&cert);
+      if (err)
+        break;
+      err = ksba_cert_read_der (cert, reader);
+      if (err)
+        {
+          if (gpg_err_code (err) == GPG_ERR_EOF)
+            err = 0;
+          else
+            log_error ("failed to parse a certificate: %s\n",
+                       gpg_strerror (err));
+          break;
+        }
+      parm->cb (parm->cb_value, cert);
+      ksba_cert_release (cert);
+      cert = NULL;
+    }
+
+ leave:
+  ksba_cert_release (cert);
+  ksba_reader_release (reader);
+  xfree (buf);
+  return err;
+}
+
 /* Return a properly escaped pattern from NAMES.  The only error
    return is NULL to indicate a malloc failure. */
 static char *
@@ -770,6 +1004,7 @@ gpgsm_dirmngr_lookup (ctrl_t ctrl, strlist_t names, int cache_only,
   struct lookup_parm_s parm;
   size_t len;
   assuan_context_t ctx;
+  estream_t outfp;
 
   /* The lookup function can be invoked from the callback of a lookup
      function, for example to walk the chain.  */
@@ -813,6 +1048,7 @@ gpgsm_dirmngr_lookup (ctrl_t ctrl, strlist_t names, int cache_only,
   parm.error = 0;
   init_membuf (&parm.data, 4096);
 
+  outfp = setup_lookup_tmpfile (ctx);
   rc = assuan_transact (ctx, line, lookup_cb, &parm,
                         NULL, NULL, lookup_status_cb, &parm);
   xfree (get_membuf (&parm.data, &len));
@@ -822,6 +1058,12 @@ gpgsm_dirmngr_lookup (ctrl_t ctrl, strlist_t names, int cache_only,
   else
     release_dirmngr2 (ctrl);
 
+  /* The certificates in the file are processed only after releasing
+   * the context so that the callback may again do a lookup.  */
+  if (!rc && !parm.error && outfp)
+    parm.error = process_lookup_tmpfile (&parm, outfp);
+  es_fclose (outfp);
+
   if (rc)
       return rc;
   return parm.error;
@@ -829,6 +1071,89 @@ gpgsm_dirmngr_lookup (ctrl_t ctrl, strlist_t names, int cache_only,
 
 
 
+/* Inquiry handler for gpgsm_dirmngr_issuers.  */
+static gpg_error_t
+issuers_inq_cb (void *opaque, const char *line)
+{
+  struct inq_certificate_parm_s *parm = opaque;
+  const unsigned char *der;
+  size_t derlen;
+
+  if (has_leading_keyword (line, "TARGETCERT"))
+    {
+      der = ksba_cert_get_image (parm->cert, &derlen);
+      if (!der)
+        return gpg_error (GPG_ERR_INV_CERT_OBJ);
+      return assuan_send_data (parm->ctx, der, derlen);
+    }
+
+  return inq_certificate (opaque, line);
+}
+
+
+/* Ask the Directory Manager for the chain of issuer certificates of
+   CERT.  The caller must provide the callback CB which will be passed
+   cert by cert, starting with the direct issuer.  This saves a
+   separate lookup for each missing certificate of the chain.  Note
+   that CTRL is optional.  */
+gpg_error_t
+gpgsm_dirmngr_issuers (ctrl_t ctrl, ksba_cert_t cert,
+                       void (*cb)(void*, ksba_cert_t), void *cb_value)
+{
+  gpg_error_t err;
+  struct lookup_parm_s parm;
+  struct inq_certificate_parm_s inq_parm;
+  size_t len;
+  assuan_context_t ctx;
+
+  /* See gpgsm_dirmngr_lookup for the use of two contexts.  */
+  if (!dirmngr_ctx_locked)
+    {
+      err = start_dirmngr (ctrl);
+      if (err)
+	return err;
+      ctx = dirmngr_ctx;
+    }
+  else if (!dirmngr2_ctx_locked)
+    {
+      err = start_dirmngr2 (ctrl);
+      if (err)
+	return err;
+      ctx = dirmngr2_ctx;
+    }
+  else
+    {
+      log_fatal ("both dirmngr contexts are in use\n");
+    }
+
+  parm.ctrl = ctrl;
+  parm.ctx = ctx;
+  parm.cb = cb;
+  parm.cb_value = cb_value;
+  parm.error = 0;
+  init_membuf (&parm.data, 4096);
+
+  inq_parm.ctrl = ctrl;
+  inq_parm.ctx = ctx;
+  inq_parm.cert = cert;
+  inq_parm.issuer_cert = NULL;
+
+  err = assuan_transact (ctx, "ISSUERS", lookup_cb, &parm,
+                         issuers_inq_cb, &inq_parm, lookup_status_cb, &parm);
+  xfree (get_membuf (&parm.data, &len));
+
+  if (ctx == dirmngr_ctx)
+    release_dirmngr (ctrl);
+  else
+    release_dirmngr2 (ctrl);
+
+  if (err)
+    return err;
+  return parm.error;
+}
+
+
+
 static gpg_error_t
 get_cached_cert_data_cb (void *opaque, const void *buffer, size_t length)
 {
@@ -47,6 +47,31 @@ struct marktrusted_info_s
 static struct marktrusted_info_s *marktrusted_info;
 
 
+/* The maximum number of items in the validation cache and the number
+   of seconds an item is used.  The time limit makes sure that a long
+   running server notices revocations and changes of the trust
+   list.  */
+#define MAX_VALIDATION_CACHE_ITEMS 64
+#define VALIDATION_CACHE_TTL      300
+
+/* Object to cache the successful validation of a chain.  */
+struct validation_cache_s
+{
+  struct validation_cache_s *next;
+  unsigned char fpr[20];      /* The fingerprint of the leaf cert.  */
+  ksba_isotime_t checktime;   /* The requested check time.  */
+  unsigned int flags;         /* The requested VALIDATE_FLAG_*.  */
+  unsigned int offline:1;     /* Copy of ctrl->offline.  */
+  unsigned int use_ocsp:1;    /* Copy of ctrl->use_ocsp.  */
+  unsigned int listmode:1;    /* Validated in list mode.  */
+  ksba_isotime_t exptime;     /* The returned expiration time.  */
+  unsigned int retflags;      /* The returned flags.  */
+  time_t expires;             /* The time the item becomes invalid.  */
+};
+typedef struct validation_cache_s *validation_cache_t;
+static validation_cache_t validation_cache;
+
+
 /* While running the validation function we want to keep track of the
    certificates in the chain.  This type is used for that.  */
 struct chain_item_s
@@ -584,6 +609,54 @@ find_up_external (ctrl_t ctrl, KEYDB_HANDLE kh,
 }
 
 
+/* Helper for find_up().  Ask the dirmngr for the chain of issuers of
+   CERT.  All returned certificates are stored in the ephemeral DB so
+   that the next steps up the chain find them there without another
+   request.  ISSUER and the optional KEYID are used to locate the
+   direct issuer.  On success 0 is returned and the certificate may be
+   retrieved from the keydb using keydb_get_cert().  */
+static int
+find_up_issuers (ctrl_t ctrl, KEYDB_HANDLE kh, ksba_cert_t cert,
+                 const char *issuer, ksba_sexp_t keyid)
+{
+  int rc;
+  int old;
+  struct find_up_store_certs_s find_up_store_certs_parm;
+
+  find_up_store_certs_parm.ctrl = ctrl;
+  find_up_store_certs_parm.count = 0;
+
+  if (opt.verbose)
+    log_info (_("looking up the issuer chain via the Dirmngr\n"));
+  rc = gpgsm_dirmngr_issuers (ctrl, cert, find_up_store_certs_cb,
+                              &find_up_store_certs_parm);
+  if (opt.verbose)
+    log_info (_("number of issuers returned: %d\n"),
+              find_up_store_certs_parm.count);
+  if (rc)
+    {
+      /* An old Dirmngr does not know the command; be silent then.  */
+      if (gpg_err_code (rc) != GPG_ERR_ASS_UNKNOWN_CMD && !opt.quiet)
+        log_info ("dirmngr issuer chain lookup failed: %s\n",
+                  gpg_strerror (rc));
+      return -1;
+    }
+  if (!find_up_store_certs_parm.count)
+    return -1;
+
+  old = keydb_set_ephemeral (kh, 1);
+  if (keyid)
+    rc = find_up_search_by_keyid (ctrl, kh, issuer, keyid);
+  else
+    {
+      keydb_search_reset (kh);
+      rc = keydb_search_subject (ctrl, kh, issuer);
+    }
+  keydb_set_ephemeral (kh, old);
+  return rc;
+}
+
+
 /* Helper for find_up().  Ask the dirmngr for the certificate for
    ISSUER with optional SERIALNO.  KH is the keydb context we are
    currently using.  With SUBJECT_MODE set, ISSUER is searched as the
@@ -743,6 +816,15 @@ find_up (ctrl_t ctrl, KEYDB_HANDLE kh,
             log_debug ("  found via authid and issuer from dirmngr cache\n");
         }
 
+      /* If we still didn't found it, ask the dirmngr for the entire
+         chain.  */
+      if (rc == -1 && opt.auto_issuer_key_retrieve && !find_next)
+        {
+          rc = find_up_issuers (ctrl, kh, cert, issuer, keyid);
+          if (!rc && DBG_X509)
+            log_debug ("  found via authid and issuer chain lookup\n");
+        }
+
       /* If we still didn't found it, try an external lookup.  */
       if (rc == -1 && opt.auto_issuer_key_retrieve && !find_next)
         {
@@ -806,7 +888,14 @@ find_up (ctrl_t ctrl, KEYDB_HANDLE kh,
         log_debug ("  found via issuer\n");
     }
 
-  /* Still not found.  If enabled, try an external lookup.  */
+  /* Still not found.  If enabled, try an external lookup; first for
+     the entire chain.  */
+  if (rc == -1 && opt.auto_issuer_key_retrieve && !find_next)
+    {
+      rc = find_up_issuers (ctrl, kh, cert, issuer, NULL);
+      if (!rc && DBG_X509)
+        log_debug ("  found via issuer and issuer chain lookup\n");
+    }
   if (rc == -1 && opt.auto_issuer_key_retrieve && !find_next)
     {
       rc = find_up_external (ctrl, kh, issuer, NULL);
@@ -1873,6 +1962,93 @@ do_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime_arg,
 }
 
 
+/* Flush the validation cache.  This needs to be called whenever the
+   flags of a certificate are changed.  */
+void
+gpgsm_flush_validation_cache (void)
+{
+  validation_cache_t vc;
+
+  while ((vc = validation_cache))
+    {
+      validation_cache = vc->next;
+      xfree (vc);
+    }
+}
+
+
+/* Return the validation cache item for the validation of the
+   certificate with the fingerprint FPR or NULL if there is none.
+   CHECKTIME and FLAGS are the parameters of the validation.  */
+static validation_cache_t
+get_validation_cache (ctrl_t ctrl, const unsigned char *fpr,
+                      const ksba_isotime_t checktime, unsigned int flags,
+                      int listmode)
+{
+  validation_cache_t vc, *vcp;
+  time_t now = gnupg_get_time ();
+
+  for (vcp = &validation_cache; (vc = *vcp); )
+    {
+      if (vc->expires <= now)
+        {
+          *vcp = vc->next;
+          xfree (vc);
+          continue;
+        }
+      if (!memcmp (vc->fpr, fpr, 20)
+          && vc->flags == flags
+          && vc->offline == !!ctrl->offline
+          && vc->use_ocsp == !!ctrl->use_ocsp
+          && vc->listmode == !!listmode
+          && !strcmp (vc->checktime, checktime))
+        return vc;
+      vcp = &vc->next;
+    }
+  return NULL;
+}
+
+
+/* Store the successful validation of the certificate with the
+   fingerprint FPR in the cache.  */
+static void
+put_validation_cache (ctrl_t ctrl, const unsigned char *fpr,
+                      const ksba_isotime_t checktime, unsigned int flags,
+                      int listmode,
+                      const ksba_isotime_t exptime, unsigned int retflags)
+{
+  validation_cache_t vc, *vcp;
+  int count;
+
+  vc = xtrycalloc (1, sizeof *vc);
+  if (!vc)
+    return;  /* Out of core - we ignore this.  */
+  memcpy (vc->fpr, fpr, 20);
+  gnupg_copy_time (vc->checktime, checktime);
+  vc->flags = flags;
+  vc->offline = !!ctrl->offline;
+  vc->use_ocsp = !!ctrl->use_ocsp;
+  vc->listmode = !!listmode;
+  gnupg_copy_time (vc->exptime, exptime);
+  vc->retflags = retflags;
+  vc->expires = gnupg_get_time () + VALIDATION_CACHE_TTL;
+  vc->next = validation_cache;
+  validation_cache = vc;
+
+  /* Remove the oldest items.  */
+  for (count=0, vcp = &validation_cache; *vcp; vcp = &(*vcp)->next)
+    if (++count > MAX_VALIDATION_CACHE_ITEMS)
+      {
+        while ((vc = *vcp))
+          {
+            *vcp = vc->next;
+            xfree (vc);
+          }
+        break;
+      }
+}
+
+
 /* Validate a certificate chain.  For a description see
    do_validate_chain.  This function is a wrapper to handle a root
    certificate with the chain_model flag set.  If RETFLAGS is not
@@ -1894,6 +2070,11 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
   int rc;
   struct rootca_flags_s rootca_flags;
   unsigned int dummy_retflags;
+  unsigned char fpr[20];
+  ksba_isotime_t exptime;
+  unsigned int orig_flags;
+  int use_cache;
+  validation_cache_t vc;
 
   if (!retflags)
     retflags = &dummy_retflags;
@@ -1908,11 +2089,33 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
   /* If the chain model was forced, set this immediately into
      RETFLAGS.  */
   *retflags = (flags & VALIDATE_FLAG_CHAIN_MODEL);
+  *exptime = 0;
+
+  /* A certificate used for several signatures or listed several
+     times is validated only once.  We can't use the cache if the
+     output of the validation is required.  */
+  use_cache = (!(listmode && listfp) && !ctrl->audit && checktime);
+  orig_flags = flags;
+  if (use_cache)
+    {
+      gpgsm_get_fingerprint (cert, GCRY_MD_SHA1, fpr, NULL);
+      vc = get_validation_cache (ctrl, fpr, checktime, orig_flags,
+                                 listmode);
+      if (vc)
+        {
+          if (DBG_X509)
+            log_debug ("validation result taken from the cache\n");
+          if (r_exptime)
+            gnupg_copy_time (r_exptime, vc->exptime);
+          *retflags = vc->retflags;
+          return 0;
+        }
+    }
 
   memset (&rootca_flags, 0, sizeof rootca_flags);
 
   rc = do_validate_chain (ctrl, cert, checktime,
-                          r_exptime, listmode, listfp, flags,
+                          exptime, listmode, listfp, flags,
                           &rootca_flags);
   if (!rc && (flags & VALIDATE_FLAG_STEED))
     {
@@ -1924,12 +2127,18 @@ gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t checktime,
     {
       do_list (0, listmode, listfp, _("switching to chain model"));
       rc = do_validate_chain (ctrl, cert, checktime,
-                              r_exptime, listmode, listfp,
+                              exptime, listmode, listfp,
                               (flags |= VALIDATE_FLAG_CHAIN_MODEL),
                               &rootca_flags);
       *retflags |= VALIDATE_FLAG_CHAIN_MODEL;
     }
 
+  if (r_exptime)
+    gnupg_copy_time (r_exptime, exptime);
+  if (!rc && use_cache)
+    put_validation_cache (ctrl, fpr, checktime, orig_flags, listmode,
+                          exptime, *retflags);
+
   if (opt.verbose)
     do_list (0, listmode, listfp, _("validation model used: %s"),
              (*retflags & VALIDATE_FLAG_STEED)?
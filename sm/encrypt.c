@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "gpgsm.h"
 #include <gcrypt.h>
@@ -165,17 +166,39 @@ encode_session_key (DEK dek, gcry_sexp_t * r_data)
 }
 
 
-/* Encrypt the DEK under the key contained in CERT and return it as a
-   canonical S-Exp in encval. */
+/* Object to encrypt the DEK for one recipient in a worker thread.  */
+struct encrypt_dek_job_s
+{
+  gcry_sexp_t s_pkey;   /* The public key of the recipient.  */
+  gcry_sexp_t s_data;   /* The encoded DEK.  */
+  gcry_sexp_t s_ciph;   /* The result.  */
+  gpg_error_t err;
+};
+
+/* The jobs of one message and the lock to take the next job.  */
+struct encrypt_dek_jobs_s
+{
+  npth_mutex_t lock;
+  struct encrypt_dek_job_s *jobs;
+  int njobs;
+  int next;
+};
+
+
+/* Prepare the encryption of the DEK under the key contained in CERT
+   and store the S-expressions for gcry_pk_encrypt at R_PKEY and
+   R_DATA.  */
 static int
-encrypt_dek (const DEK dek, ksba_cert_t cert, unsigned char **encval)
+prepare_encrypt_dek (const DEK dek, ksba_cert_t cert,
+                     gcry_sexp_t *r_pkey, gcry_sexp_t *r_data)
 {
-  gcry_sexp_t s_ciph, s_data, s_pkey;
+  gcry_sexp_t s_data, s_pkey;
   int rc;
   ksba_sexp_t buf;
   size_t len;
 
-  *encval = NULL;
+  *r_pkey = NULL;
+  *r_data = NULL;
 
   /* get the key from the cert */
   buf = ksba_cert_get_public_key (cert);
@@ -204,9 +227,30 @@ encrypt_dek (const DEK dek, ksba_cert_t cert, unsigned char **encval)
   if (rc)
     {
       log_error ("encode_session_key failed: %s\n", gpg_strerror (rc));
+      gcry_sexp_release (s_pkey);
       return rc;
     }
 
+  *r_pkey = s_pkey;
+  *r_data = s_data;
+  return 0;
+}
+
+
+/* Encrypt the DEK under the key contained in CERT and return it as a
+   canonical S-Exp in encval. */
+static int
+encrypt_dek (const DEK dek, ksba_cert_t cert, unsigned char **encval)
+{
+  gcry_sexp_t s_ciph, s_data, s_pkey;
+  int rc;
+
+  *encval = NULL;
+
+  rc = prepare_encrypt_dek (dek, cert, &s_pkey, &s_data);
+  if (rc)
+    return rc;
+
   /* pass it to libgcrypt */
   rc = gcry_pk_encrypt (&s_ciph, s_data, s_pkey);
   gcry_sexp_release (s_data);
@@ -222,6 +266,121 @@ encrypt_dek (const DEK dek, ksba_cert_t cert, unsigned char **encval)
 }
 
 
+/* The thread function to run the jobs described by OPAQUE.  It is
+   also called by the main thread.  */
+static void *
+encrypt_dek_worker (void *opaque)
+{
+  struct encrypt_dek_jobs_s *parm = opaque;
+  struct encrypt_dek_job_s *job;
+
+  for (;;)
+    {
+      npth_mutex_lock (&parm->lock);
+      job = parm->next < parm->njobs? parm->jobs + parm->next++ : NULL;
+      npth_mutex_unlock (&parm->lock);
+      if (!job)
+        break;
+      if (job->err)
+        continue;  /* Preparation failed.  */
+
+      /* Only libgcrypt is used here, which is thread-safe; thus we
+         can allow the other threads to run.  */
+      npth_unprotect ();
+      job->err = gcry_pk_encrypt (&job->s_ciph, job->s_data, job->s_pkey);
+      npth_protect ();
+    }
+  return NULL;
+}
+
+
+/* Release the NJOBS JOBS.  */
+static void
+release_encrypt_dek_jobs (struct encrypt_dek_job_s *jobs, int njobs)
+{
+  int i;
+
+  if (!jobs)
+    return;
+  for (i=0; i < njobs; i++)
+    {
+      gcry_sexp_release (jobs[i].s_pkey);
+      gcry_sexp_release (jobs[i].s_data);
+      gcry_sexp_release (jobs[i].s_ciph);
+    }
+  xfree (jobs);
+}
+
+
+/* Encrypt the DEK for all NRECP recipients of RECPLIST using
+   opt.pubkey_enc_threads threads.  Returns an array with the results
+   in the order of RECPLIST or NULL if the threads could not be used;
+   the caller then needs to use encrypt_dek.  */
+static struct encrypt_dek_job_s *
+encrypt_dek_threaded (const DEK dek, certlist_t recplist, int nrecp)
+{
+  struct encrypt_dek_jobs_s parm;
+  struct encrypt_dek_job_s *jobs;
+  npth_t threads[64];
+  npth_attr_t tattr;
+  certlist_t cl;
+  int i, nthreads, ret;
+
+  jobs = xtrycalloc (nrecp, sizeof *jobs);
+  if (!jobs)
+    return NULL;
+
+  /* Building the S-expressions may log errors and thus it is done by
+     the main thread.  */
+  for (i=0, cl = recplist; cl && i < nrecp; i++, cl = cl->next)
+    jobs[i].err = prepare_encrypt_dek (dek, cl->cert,
+                                       &jobs[i].s_pkey, &jobs[i].s_data);
+
+  memset (&parm, 0, sizeof parm);
+  npth_mutex_init (&parm.lock, NULL);
+  parm.jobs = jobs;
+  parm.njobs = nrecp;
+
+  /* The main thread is the first worker.  */
+  nthreads = opt.pubkey_enc_threads - 1;
+  if (nthreads > nrecp - 1)
+    nthreads = nrecp - 1;
+  if (nthreads > (int)DIM (threads))
+    nthreads = DIM (threads);
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (i=0; i < nthreads; i++)
+    {
+      ret = npth_create (&threads[i], &tattr, encrypt_dek_worker, &parm);
+      if (ret)
+        {
+          log_error ("error spawning worker thread: %s\n", strerror (ret));
+          break;
+        }
+    }
+  nthreads = i;
+  npth_attr_destroy (&tattr);
+
+  encrypt_dek_worker (&parm);
+  for (i=0; i < nthreads; i++)
+    npth_join (threads[i], NULL);
+  npth_mutex_destroy (&parm.lock);
+
+  return jobs;
+}
+
+
+/* Convert the result of JOB to a canonical S-Exp at ENCVAL.  */
+static int
+finish_encrypt_dek (struct encrypt_dek_job_s *job, unsigned char **encval)
+{
+  *encval = NULL;
+  if (job->err)
+    return job->err;
+  return make_canon_sexp (job->s_ciph, encval, NULL);
+}
+
+
 
 /* do the actual encryption */
 static int
@@ -312,8 +471,9 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
   int recpno;
   estream_t data_fp = NULL;
   certlist_t cl;
-  int count;
+  int count = 0;
   int compliant;
+  struct encrypt_dek_job_s *jobs = NULL;
 
   memset (&encparm, 0, sizeof encparm);
 
@@ -470,6 +630,12 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
   compliant = gnupg_cipher_is_compliant (CO_DE_VS, dek->algo,
                                          GCRY_CIPHER_MODE_CBC);
 
+  /* With many recipients the public key operations are the expensive
+     part; run them in parallel if requested.  The recipients are
+     still added in their order below.  */
+  if (opt.pubkey_enc_threads > 1 && count > 1)
+    jobs = encrypt_dek_threaded (dek, recplist, count);
+
   /* Gather certificates of recipients, encrypt the session key for
      each and store them in the CMS object */
   for (recpno = 0, cl = recplist; cl; recpno++, cl = cl->next)
@@ -498,7 +664,10 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
           && !gnupg_pk_is_compliant (CO_DE_VS, pk_algo, NULL, nbits, NULL))
         compliant = 0;
 
-      rc = encrypt_dek (dek, cl->cert, &encval);
+      if (jobs)
+        rc = finish_encrypt_dek (jobs + recpno, &encval);
+      else
+        rc = encrypt_dek (dek, cl->cert, &encval);
       if (rc)
         {
           audit_log_cert (ctrl->audit, AUDIT_ENCRYPTED_TO, cl->cert, rc);
@@ -566,6 +735,7 @@ gpgsm_encrypt (ctrl_t ctrl, certlist_t recplist, int data_fd, estream_t out_fp)
   log_info ("encrypted data created\n");
 
  leave:
+  release_encrypt_dek_jobs (jobs, count);
   ksba_cms_release (cms);
   gnupg_ksba_destroy_writer (b64writer);
   ksba_reader_release (reader);
@@ -26,6 +26,7 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <npth.h>
 /*#include <mcheck.h>*/
 
 #include "gpgsm.h"
@@ -168,6 +169,9 @@ enum cmd_and_opt_values {
   oCipherAlgo,
   oDigestAlgo,
   oExtraDigestAlgo,
+  oPubkeyEncThreads,
+  oPksignThreads,
+  oValidationThreads,
   oNoVerbose,
   oNoSecmemWarn,
   oNoDefKeyring,
@@ -355,6 +359,9 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_s (oDigestAlgo, "digest-algo",
                 N_("|NAME|use message digest algorithm NAME")),
   ARGPARSE_s_s (oExtraDigestAlgo, "extra-digest-algo", "@"),
+  ARGPARSE_s_i (oPubkeyEncThreads, "pubkey-enc-threads", "@"),
+  ARGPARSE_s_i (oPksignThreads, "pksign-threads", "@"),
+  ARGPARSE_s_i (oValidationThreads, "validation-threads", "@"),
 
 
   ARGPARSE_group (302, N_(
@@ -459,6 +466,10 @@ static int default_validation_model;
 /* The default cipher algo.  */
 #define DEFAULT_CIPHER_ALGO "AES"
 
+/* The Assuan system hooks used with --pubkey-enc-threads,
+   --pksign-threads and --validation-threads.  */
+ASSUAN_SYSTEM_NPTH_IMPL;
+
 
 static char *build_list (const char *text,
 			 const char *(*mapf)(int), int (*chkf)(int));
@@ -1424,6 +1435,30 @@ main ( int argc, char **argv)
           extra_digest_algo = pargs.r.ret_str;
           break;
 
+        case oPubkeyEncThreads:
+          opt.pubkey_enc_threads = pargs.r.ret_int;
+          if (opt.pubkey_enc_threads < 0)
+            opt.pubkey_enc_threads = 0;
+          else if (opt.pubkey_enc_threads > 64)
+            opt.pubkey_enc_threads = 64;
+          break;
+
+        case oPksignThreads:
+          opt.pksign_threads = pargs.r.ret_int;
+          if (opt.pksign_threads < 0)
+            opt.pksign_threads = 0;
+          else if (opt.pksign_threads > 8)
+            opt.pksign_threads = 8;
+          break;
+
+        case oValidationThreads:
+          opt.validation_threads = pargs.r.ret_int;
+          if (opt.validation_threads < 0)
+            opt.validation_threads = 0;
+          else if (opt.validation_threads > 16)
+            opt.validation_threads = 16;
+          break;
+
         case oIgnoreTimeConflict: opt.ignore_time_conflict = 1; break;
         case oNoRandomSeedFile: use_random_seed = 0; break;
         case oNoCommonCertsImport: no_common_certs_import = 1; break;
@@ -1512,6 +1547,16 @@ main ( int argc, char **argv)
      control structure.  */
   gpgsm_init_default_ctrl (&ctrl);
 
+  /* The options to use several threads require nPth.  This must be
+     initialized before the first Assuan context is created so that
+     the agent connections don't block the other threads.  */
+  if (opt.pubkey_enc_threads > 1 || opt.pksign_threads > 1
+      || opt.validation_threads > 1)
+    {
+      npth_init ();
+      assuan_set_system_hooks (ASSUAN_SYSTEM_NPTH);
+    }
+
   if (nogreeting)
     greeting = 0;
 
@@ -29,6 +29,7 @@
 
 
 #include <ksba.h>
+#include <npth.h>
 #include "../common/util.h"
 #include "../common/status.h"
 #include "../common/audit.h"
@@ -39,6 +40,9 @@
 
 #define MAX_DIGEST_LEN 64
 
+/* The size of the buffer used to hash detached data.  */
+#define HASH_DATA_BUFSIZE (64*1024)
+
 struct keyserver_spec
 {
   struct keyserver_spec *next;
@@ -114,6 +118,14 @@ struct
   int extra_digest_algo;  /* A digest algorithm also used for
                              verification of signatures.  */
 
+  int pubkey_enc_threads; /* If > 1 the number of threads used to
+                             encrypt the session key.  */
+  int pksign_threads;     /* If > 1 the number of signatures created
+                             at the same time.  */
+  int validation_threads; /* If > 1 the number of certificates
+                             validated at the same time by a
+                             listing.  */
+
   int always_trust;       /* Trust the given keys even if there is no
                              valid certification chain */
   int skip_verify;        /* do not check signatures on data */
@@ -316,6 +328,7 @@ int gpgsm_validate_chain (ctrl_t ctrl, ksba_cert_t cert,
                           int listmode, estream_t listfp,
                           unsigned int flags, unsigned int *retflags);
 int gpgsm_basic_cert_check (ctrl_t ctrl, ksba_cert_t cert);
+void gpgsm_flush_validation_cache (void);
 
 /*-- certlist.c --*/
 int gpgsm_cert_use_sign_p (ksba_cert_t cert);
@@ -385,6 +398,12 @@ int gpgsm_agent_pksign (ctrl_t ctrl, const char *keygrip, const char *desc,
                         size_t digestlen,
                         int digestalgo,
                         unsigned char **r_buf, size_t *r_buflen);
+gpg_error_t gpgsm_agent_open_connections (ctrl_t ctrl, int n, int *r_n);
+int gpgsm_agent_pksign_conn (ctrl_t ctrl, int conn,
+                             const char *keygrip, const char *desc,
+                             unsigned char *digest, size_t digestlen,
+                             int digestalgo,
+                             unsigned char **r_buf, size_t *r_buflen);
 int gpgsm_scd_pksign (ctrl_t ctrl, const char *keyid, const char *desc,
                       unsigned char *digest, size_t digestlen, int digestalgo,
                       unsigned char **r_buf, size_t *r_buflen);
@@ -419,11 +438,15 @@ gpg_error_t gpgsm_agent_export_key (ctrl_t ctrl, const char *keygrip,
                                     size_t *r_resultlen);
 
 /*-- call-dirmngr.c --*/
+void gpgsm_dirmngr_set_parallel (npth_mutex_t *lock, int nconns);
 int gpgsm_dirmngr_isvalid (ctrl_t ctrl,
                            ksba_cert_t cert, ksba_cert_t issuer_cert,
                            int use_ocsp);
 int gpgsm_dirmngr_lookup (ctrl_t ctrl, strlist_t names, int cache_only,
                           void (*cb)(void*, ksba_cert_t), void *cb_value);
+gpg_error_t gpgsm_dirmngr_issuers (ctrl_t ctrl, ksba_cert_t cert,
+                                   void (*cb)(void*, ksba_cert_t),
+                                   void *cb_value);
 int gpgsm_dirmngr_run_command (ctrl_t ctrl, const char *command,
                                int argc, char **argv);
 
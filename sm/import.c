@@ -34,6 +34,7 @@
 #include "../common/exechelp.h"
 #include "../common/i18n.h"
 #include "../common/sysutils.h"
+#include "../common/host2net.h"
 #include "../kbx/keybox.h" /* for KEYBOX_FLAG_* */
 #include "../common/membuf.h"
 #include "minip12.h"
@@ -42,6 +43,17 @@
 #define MAX_P12OBJ_SIZE 128 /*kb*/
 
 
+/* A set of the SHA-1 fingerprints of the certificates already stored
+   by this import.  Bundles with thousands of certificates usually
+   carry the same intermediate certificates over and over again; with
+   this set each of them is checked and stored only once.  */
+struct fpr_set_s {
+  unsigned int size;  /* Number of slots; a power of 2 or 0.  */
+  unsigned int used;  /* Number of used slots.  */
+  unsigned char (*slots)[20];
+};
+
+
 struct stats_s {
   unsigned long count;
   unsigned long imported;
@@ -50,6 +62,7 @@ struct stats_s {
   unsigned long secret_read;
   unsigned long secret_imported;
   unsigned long secret_dups;
+  struct fpr_set_s stored;
  };
 
 
@@ -69,6 +82,58 @@ static gpg_error_t parse_p12 (ctrl_t ctrl, ksba_reader_t reader,
 
 
 
+/* Return true if FPR is in SET.  An all zero slot is unused; such a
+   fingerprint is not expected from SHA-1.  */
+static int
+fpr_set_find (struct fpr_set_s *set, const unsigned char *fpr)
+{
+  static const unsigned char zero[20];
+  unsigned int i;
+
+  if (!set->size)
+    return 0;
+
+  for (i = buf32_to_uint (fpr) & (set->size - 1);
+       memcmp (set->slots[i], zero, 20);
+       i = (i + 1) & (set->size - 1))
+    if (!memcmp (set->slots[i], fpr, 20))
+      return 1;
+  return 0;
+}
+
+
+/* Add FPR to SET.  */
+static void
+fpr_set_add (struct fpr_set_s *set, const unsigned char *fpr)
+{
+  static const unsigned char zero[20];
+  unsigned int i;
+
+  if (fpr_set_find (set, fpr))
+    return;
+
+  if (set->used + 1 > set->size / 2)
+    {
+      struct fpr_set_s old = *set;
+
+      set->size = set->size? set->size * 2 : 256;
+      set->slots = xcalloc (set->size, sizeof *set->slots);
+      set->used = 0;
+      for (i=0; i < old.size; i++)
+        if (memcmp (old.slots[i], zero, 20))
+          fpr_set_add (set, old.slots[i]);
+      xfree (old.slots);
+    }
+
+  for (i = buf32_to_uint (fpr) & (set->size - 1);
+       memcmp (set->slots[i], zero, 20);
+       i = (i + 1) & (set->size - 1))
+    ;
+  memcpy (set->slots[i], fpr, 20);
+  set->used++;
+}
+
+
 static void
 print_imported_status (ctrl_t ctrl, ksba_cert_t cert, int new_cert)
 {
@@ -168,6 +233,14 @@ check_and_store (ctrl_t ctrl, struct stats_s *stats,
                  ksba_cert_t cert, int depth)
 {
   int rc;
+  unsigned char fpr[20];
+  struct stats_s *import_stats = stats;
+  struct fpr_set_s *stored = &stats->stored;
+
+  /* The statistics are only updated for the certificates given by
+     the user and not for the issuer certificates.  */
+  if (depth)
+    stats = NULL;
 
   if (stats)
     stats->count++;
@@ -190,6 +263,19 @@ check_and_store (ctrl_t ctrl, struct stats_s *stats,
 
      Optionally we do a full validation in addition to the basic test.
   */
+  gpgsm_get_fingerprint (cert, GCRY_MD_SHA1, fpr, NULL);
+  if (fpr_set_find (stored, fpr))
+    {
+      /* Already stored by this import; this also means that the
+         chain above it has already been walked.  */
+      print_imported_status (ctrl, cert, 0);
+      if (stats)
+        stats->unchanged++;
+      if (opt.verbose > 1)
+        log_info ("certificate already in DB\n");
+      return;
+    }
+
   rc = gpgsm_basic_cert_check (ctrl, cert);
   if (!rc && ctrl->with_validation)
     rc = gpgsm_validate_chain (ctrl, cert, "", NULL, 0, NULL, 0, NULL);
@@ -203,6 +289,7 @@ check_and_store (ctrl_t ctrl, struct stats_s *stats,
         {
           ksba_cert_t next = NULL;
 
+          fpr_set_add (stored, fpr);
           if (!existed)
             {
               print_imported_status (ctrl, cert, 1);
@@ -237,7 +324,11 @@ check_and_store (ctrl_t ctrl, struct stats_s *stats,
              update the statistics, though. */
           if (!gpgsm_walk_cert_chain (ctrl, cert, &next))
             {
-              check_and_store (ctrl, NULL, next, depth+1);
+              unsigned char nextfpr[20];
+
+              gpgsm_get_fingerprint (next, GCRY_MD_SHA1, nextfpr, NULL);
+              if (!fpr_set_find (stored, nextfpr))
+                check_and_store (ctrl, import_stats, next, depth+1);
               ksba_cert_release (next);
             }
         }
@@ -522,7 +613,15 @@ gpgsm_import (ctrl_t ctrl, int in_fd, int reimport_mode)
   if (reimport_mode)
     rc = reimport_one (ctrl, &stats, in_fd);
   else
-    rc = import_one (ctrl, &stats, in_fd);
+    {
+      rc = keydb_begin_batch ();
+      if (!rc)
+        {
+          rc = import_one (ctrl, &stats, in_fd);
+          keydb_commit_batch ();
+        }
+    }
+  xfree (stats.stored.slots);
   print_imported_summary (ctrl, &stats);
   /* If we never printed an error message do it now so that a command
      line invocation will return with an error (log_error keeps a
@@ -542,6 +641,11 @@ gpgsm_import_files (ctrl_t ctrl, int nfiles, char **files,
 
   memset (&stats, 0, sizeof stats);
 
+  /* Keep the keybox locked while importing all files.  */
+  rc = keydb_begin_batch ();
+  if (rc)
+    goto leave;
+
   if (!nfiles)
     rc = import_one (ctrl, &stats, 0);
   else
@@ -555,6 +659,10 @@ gpgsm_import_files (ctrl_t ctrl, int nfiles, char **files,
             rc = 0;
         }
     }
+  keydb_commit_batch ();
+
+ leave:
+  xfree (stats.stored.slots);
   print_imported_summary (ctrl, &stats);
   /* If we never printed an error message do it now so that a command
      line invocation will return with an error (log_error keeps a
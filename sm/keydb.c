@@ -68,6 +68,12 @@ struct keydb_handle {
 };
 
 
+/* The handle holding the locks during a batch of changes and the
+   nesting level of keydb_begin_batch.  */
+static KEYDB_HANDLE batch_hd;
+static int batch_level;
+
+
 static int lock_all (KEYDB_HANDLE hd);
 static void unlock_all (KEYDB_HANDLE hd);
 
@@ -549,6 +555,14 @@ lock_all (KEYDB_HANDLE hd)
   /* Fixme: This locking scheme may lead to deadlock if the resources
      are not added in the same order by all processes.  We are
      currently only allowing one resource so it is not a problem. */
+
+  /* During a batch the locks are already held by BATCH_HD.  */
+  if (batch_hd && hd != batch_hd)
+    {
+      hd->locked = 1;
+      return 0;
+    }
+
   for (i=0; i < hd->used; i++)
     {
       switch (hd->active[i].type)
@@ -597,6 +611,13 @@ unlock_all (KEYDB_HANDLE hd)
   if (!hd->locked)
     return;
 
+  /* During a batch the locks are held by BATCH_HD.  */
+  if (batch_hd && hd != batch_hd)
+    {
+      hd->locked = 0;
+      return;
+    }
+
   for (i=hd->used-1; i >= 0; i--)
     {
       switch (hd->active[i].type)
@@ -613,6 +634,59 @@ unlock_all (KEYDB_HANDLE hd)
 }
 
 
+
+/* Start a batch of changes.  Until keydb_commit_batch is called all
+   resources are kept locked so that a large import does not need to
+   take and release the locks for each certificate.  Calls may be
+   nested.  */
+gpg_error_t
+keydb_begin_batch (void)
+{
+  gpg_error_t err;
+
+  if (batch_level++)
+    return 0;
+
+  batch_hd = keydb_new ();
+  if (!batch_hd)
+    {
+      err = gpg_error_from_syserror ();
+      batch_level = 0;
+      return err;
+    }
+
+  err = keydb_lock (batch_hd);
+  if (err)
+    {
+      keydb_release (batch_hd);
+      batch_hd = NULL;
+      batch_level = 0;
+      return err;
+    }
+
+  return 0;
+}
+
+
+/* Finish a batch started by keydb_begin_batch and release the
+   locks.  */
+gpg_error_t
+keydb_commit_batch (void)
+{
+  KEYDB_HANDLE hd;
+
+  if (!batch_level)
+    return gpg_error (GPG_ERR_INV_STATE);
+  if (--batch_level)
+    return 0;
+
+  hd = batch_hd;
+  batch_hd = NULL;
+  keydb_release (hd);
+  return 0;
+}
+
+
 
 /* Push the last found state if any.  */
 void
@@ -865,6 +939,7 @@ keydb_delete (KEYDB_HANDLE hd, int unlock)
       rc = keybox_delete (hd->active[hd->found].u.kr);
       break;
     }
+  gpgsm_flush_validation_cache ();
 
   if (unlock)
     unlock_all (hd);
@@ -1262,6 +1337,8 @@ keydb_set_cert_flags (ctrl_t ctrl, ksba_cert_t cert, int ephemeral,
           keydb_release (kh);
           return err;
         }
+      /* The validity of a chain may depend on the flags.  */
+      gpgsm_flush_validation_cache ();
     }
 
   keydb_release (kh);
@@ -1356,6 +1433,7 @@ keydb_clear_some_cert_flags (ctrl_t ctrl, strlist_t names)
     log_error ("keydb_search failed: %s\n", gpg_strerror (rc));
 
  leave:
+  gpgsm_flush_validation_cache ();
   xfree (desc);
   keydb_release (hd);
 }
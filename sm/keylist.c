@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "gpgsm.h"
 
@@ -50,6 +51,45 @@ struct list_external_parm_s
 };
 
 
+/* A validation run ahead of the listing with --validation-threads.  */
+struct prevalidation_s
+{
+  struct prevalidation_s *next;
+  ksba_cert_t cert;        /* The certificate as read ahead.  */
+  estream_t fp;            /* The listing output of the validation.  */
+  gpg_error_t err;         /* The result of the validation.  */
+  unsigned int started:1;
+  unsigned int done:1;
+};
+
+/* The context for the parallel validations of a listing.  */
+struct prevalidate_s
+{
+  ctrl_t ctrl;
+  npth_mutex_t lock;       /* Held by each thread running gpgsm code.  */
+  npth_cond_t cond;        /* Signals new and finished jobs.  */
+  KEYDB_HANDLE hd;         /* The handle used to read ahead.  */
+  KEYDB_SEARCH_DESC *desc;
+  int ndesc;
+  int names;               /* DESC has been given by the user.  */
+  int eof;                 /* The read ahead reached the end.  */
+  ksba_cert_t lastcert;    /* The last certificate read ahead.  */
+  int with_output;         /* Capture the output of the validations.  */
+  int stop;                /* Terminate the workers.  */
+  struct prevalidation_s *jobs;  /* The queued jobs in keybox order.  */
+  struct prevalidation_s *lastjob;
+  int njobs;
+  int maxjobs;
+  npth_t threads[16];
+  int nthreads;
+};
+
+/* The parallel validation of the certificate which is listed right
+   now and that certificate.  */
+static struct prevalidation_s *current_prevalidation;
+static ksba_cert_t current_prevalidation_cert;
+
+
 /* This table is to map Extended Key Usage OIDs to human readable
    names.  */
 struct
@@ -397,6 +437,51 @@ print_compliance_flags (ksba_cert_t cert, int algo, unsigned int nbits,
 }
 
 
+static void
+release_prevalidation (struct prevalidation_s *job)
+{
+  if (!job)
+    return;
+  ksba_cert_release (job->cert);
+  es_fclose (job->fp);
+  xfree (job);
+}
+
+
+/* Validate CERT for a listing and write diagnostics to FP.  If the
+   validation has already been done by a worker thread, its result is
+   used instead.  */
+static gpg_error_t
+validate_for_listing (ctrl_t ctrl, ksba_cert_t cert, estream_t fp)
+{
+  struct prevalidation_s *job = current_prevalidation;
+  gpg_error_t err;
+  char buffer[512];
+  size_t n;
+
+  if (!job || cert != current_prevalidation_cert)
+    return gpgsm_validate_chain (ctrl, cert, "", NULL, 1, fp, 0, NULL);
+
+  current_prevalidation = NULL;
+  if (job->fp && fp)
+    {
+      es_rewind (job->fp);
+      while (!es_read (job->fp, buffer, sizeof buffer, &n) && n)
+        es_write (fp, buffer, n, NULL);
+    }
+
+  /* The validation notes the qualified status with the certificate
+     object it has been using.  */
+  if (!ksba_cert_get_user_data (job->cert, "is_qualified",
+                                buffer, 1, &n) && n)
+    ksba_cert_set_user_data (cert, "is_qualified", buffer, 1);
+
+  err = job->err;
+  release_prevalidation (job);
+  return err;
+}
+
+
 /* List one certificate in colon mode */
 static void
 list_cert_colon (ctrl_t ctrl, ksba_cert_t cert, unsigned int validity,
@@ -418,7 +503,7 @@ list_cert_colon (ctrl_t ctrl, ksba_cert_t cert, unsigned int validity,
   char *kludge_uid;
 
   if (ctrl->with_validation)
-    valerr = gpgsm_validate_chain (ctrl, cert, "", NULL, 1, NULL, 0, NULL);
+    valerr = validate_for_listing (ctrl, cert, NULL);
   else
     valerr = 0;
 
@@ -1070,7 +1155,7 @@ list_cert_raw (ctrl_t ctrl, KEYDB_HANDLE hd,
 
   if (with_validation)
     {
-      err = gpgsm_validate_chain (ctrl, cert, "", NULL, 1, fp, 0, NULL);
+      err = validate_for_listing (ctrl, cert, fp);
       if (!err)
         es_fprintf (fp, "  [certificate is good]\n");
       else
@@ -1315,7 +1400,7 @@ list_cert_std (ctrl_t ctrl, ksba_cert_t cert, estream_t fp, int have_secret,
       size_t buflen;
       char buffer[1];
 
-      err = gpgsm_validate_chain (ctrl, cert, "", NULL, 1, fp, 0, NULL);
+      err = validate_for_listing (ctrl, cert, fp);
       tmperr = ksba_cert_get_user_data (cert, "is_qualified",
                                         &buffer, sizeof (buffer), &buflen);
       if (!tmperr && buflen)
@@ -1366,6 +1451,222 @@ list_cert_chain (ctrl_t ctrl, KEYDB_HANDLE hd,
 
 
 
+/* The thread function of a validation worker.  */
+static void *
+prevalidate_worker (void *opaque)
+{
+  struct prevalidate_s *parm = opaque;
+  struct prevalidation_s *job;
+
+  npth_mutex_lock (&parm->lock);
+  while (!parm->stop)
+    {
+      for (job = parm->jobs; job && job->started; job = job->next)
+        ;
+      if (!job)
+        {
+          npth_cond_wait (&parm->cond, &parm->lock);
+          continue;
+        }
+      job->started = 1;
+      job->err = gpgsm_validate_chain (parm->ctrl, job->cert, "", NULL, 1,
+                                       job->fp, 0, NULL);
+      job->done = 1;
+      npth_cond_broadcast (&parm->cond);
+    }
+  npth_mutex_unlock (&parm->lock);
+  return NULL;
+}
+
+
+/* Read ahead using the search in PARM and queue validation jobs until
+   the queue is full.  */
+static void
+prevalidate_fill (struct prevalidate_s *parm)
+{
+  struct prevalidation_s *job;
+  ksba_cert_t cert;
+  int any = 0;
+
+  while (!parm->eof && parm->njobs < parm->maxjobs)
+    {
+      if (keydb_search (parm->ctrl, parm->hd, parm->desc, parm->ndesc)
+          || keydb_get_cert (parm->hd, &cert))
+        {
+          parm->eof = 1;
+          break;
+        }
+      if (!parm->names)
+        parm->desc[0].mode = KEYDB_SEARCH_MODE_NEXT;
+
+      /* Skip duplicates the same way the listing does.  */
+      if (gpgsm_certs_identical_p (cert, parm->lastcert))
+        {
+          ksba_cert_release (cert);
+          continue;
+        }
+      ksba_cert_release (parm->lastcert);
+      parm->lastcert = cert;
+
+      job = xtrycalloc (1, sizeof *job);
+      if (job && parm->with_output
+          && !(job->fp = es_fopenmem (0, "w+b")))
+        {
+          xfree (job);
+          job = NULL;
+        }
+      if (!job)
+        {
+          parm->eof = 1;
+          break;
+        }
+      ksba_cert_ref (cert);
+      job->cert = cert;
+      if (parm->lastjob)
+        parm->lastjob->next = job;
+      else
+        parm->jobs = job;
+      parm->lastjob = job;
+      parm->njobs++;
+      any = 1;
+    }
+
+  if (any)
+    npth_cond_broadcast (&parm->cond);
+}
+
+
+/* Wait for the validation of CERT, which is the next certificate to
+   be listed, and make it available to validate_for_listing.  */
+static void
+prevalidate_take (struct prevalidate_s *parm, ksba_cert_t cert)
+{
+  struct prevalidation_s *job;
+
+  release_prevalidation (current_prevalidation);
+  current_prevalidation = NULL;
+
+  prevalidate_fill (parm);
+  while ((job = parm->jobs))
+    {
+      while (!job->done)
+        npth_cond_wait (&parm->cond, &parm->lock);
+      parm->jobs = job->next;
+      if (!parm->jobs)
+        parm->lastjob = NULL;
+      parm->njobs--;
+      if (gpgsm_certs_identical_p (job->cert, cert))
+        {
+          current_prevalidation = job;
+          current_prevalidation_cert = cert;
+          break;
+        }
+      /* The read ahead is out of sync; for example the keybox may
+         have been changed meanwhile.  */
+      release_prevalidation (job);
+    }
+
+  /* Keep the workers busy while we are listing.  */
+  prevalidate_fill (parm);
+}
+
+
+/* Start the worker threads for a listing of the certificates matching
+   DESC.  Returns NULL if the certificates shall be validated
+   sequentially.  On success the caller holds the lock of the returned
+   context.  */
+static struct prevalidate_s *
+prevalidate_start (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, int ndesc,
+                   int names, int want_ephemeral)
+{
+  struct prevalidate_s *parm;
+  npth_attr_t tattr;
+  int i, ret;
+
+  parm = xtrycalloc (1, sizeof *parm);
+  if (!parm)
+    return NULL;
+  parm->ctrl = ctrl;
+  parm->hd = keydb_new ();
+  parm->desc = xtrycalloc (ndesc? ndesc : 1, sizeof *desc);
+  if (!parm->hd || !parm->desc)
+    {
+      keydb_release (parm->hd);
+      xfree (parm->desc);
+      xfree (parm);
+      return NULL;
+    }
+  if (want_ephemeral)
+    keydb_set_ephemeral (parm->hd, 1);
+  memcpy (parm->desc, desc, ndesc * sizeof *desc);
+  parm->ndesc = ndesc;
+  parm->names = names;
+  parm->with_output = !ctrl->with_colons;
+  parm->maxjobs = 4 * opt.validation_threads;
+
+  npth_mutex_init (&parm->lock, NULL);
+  npth_cond_init (&parm->cond, NULL);
+  npth_mutex_lock (&parm->lock);
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (i=0; i < opt.validation_threads && i < DIM (parm->threads); i++)
+    {
+      ret = npth_create (&parm->threads[i], &tattr, prevalidate_worker, parm);
+      if (ret)
+        {
+          log_error ("error spawning worker thread: %s\n", strerror (ret));
+          break;
+        }
+    }
+  npth_attr_destroy (&tattr);
+  parm->nthreads = i;
+  if (!parm->nthreads)
+    {
+      npth_mutex_unlock (&parm->lock);
+      keydb_release (parm->hd);
+      xfree (parm->desc);
+      xfree (parm);
+      return NULL;
+    }
+
+  gpgsm_dirmngr_set_parallel (&parm->lock, parm->nthreads);
+  return parm;
+}
+
+
+/* Terminate the workers and release PARM.  */
+static void
+prevalidate_stop (struct prevalidate_s *parm)
+{
+  struct prevalidation_s *job;
+  int i;
+
+  if (!parm)
+    return;
+
+  release_prevalidation (current_prevalidation);
+  current_prevalidation = NULL;
+
+  parm->stop = 1;
+  npth_cond_broadcast (&parm->cond);
+  npth_mutex_unlock (&parm->lock);
+  for (i=0; i < parm->nthreads; i++)
+    npth_join (parm->threads[i], NULL);
+  gpgsm_dirmngr_set_parallel (NULL, 0);
+
+  while ((job = parm->jobs))
+    {
+      parm->jobs = job->next;
+      release_prevalidation (job);
+    }
+  ksba_cert_release (parm->lastcert);
+  keydb_release (parm->hd);
+  xfree (parm->desc);
+  xfree (parm);
+}
+
+
 /* List all internal keys or just the keys given as NAMES.  MODE is a
    bit vector to specify what keys are to be included; see
    gpgsm_list_keys (below) for details.  If RAW_MODE is true, the raw
@@ -1385,6 +1686,7 @@ list_internal_keys (ctrl_t ctrl, strlist_t names, estream_t fp,
   const char *lastresname, *resname;
   int have_secret;
   int want_ephemeral = ctrl->with_ephemeral_keys;
+  struct prevalidate_s *pv = NULL;
 
   hd = keydb_new ();
   if (!hd)
@@ -1449,6 +1751,13 @@ list_internal_keys (ctrl_t ctrl, strlist_t names, estream_t fp,
   if (want_ephemeral)
     keydb_set_ephemeral (hd, 1);
 
+  /* With --validation-threads the certificates are validated by
+     worker threads which read ahead using another handle.  This is
+     not done for secret key listings because most certificates would
+     be skipped.  */
+  if (ctrl->with_validation && opt.validation_threads > 1 && !mode)
+    pv = prevalidate_start (ctrl, desc, ndesc, !!names, want_ephemeral);
+
   /* It would be nice to see which of the given users did actually
      match one in the keyring.  To implement this we need to have a
      found flag for each entry in desc and to set this we must check
@@ -1522,6 +1831,9 @@ list_internal_keys (ctrl_t ctrl, strlist_t names, estream_t fp,
       if (!mode          || ((mode & 1) && !have_secret)
           || ((mode & 2) && have_secret)  )
         {
+          if (pv)
+            prevalidate_take (pv, cert);
+
           if (ctrl->with_colons)
             list_cert_colon (ctrl, cert, validity, fp, have_secret);
           else if (ctrl->with_chain)
@@ -1549,6 +1861,7 @@ list_internal_keys (ctrl_t ctrl, strlist_t names, estream_t fp,
     log_error ("keydb_search failed: %s\n", gpg_strerror (rc));
 
  leave:
+  prevalidate_stop (pv);
   ksba_cert_release (cert);
   ksba_cert_release (lastcert);
   xfree (desc);
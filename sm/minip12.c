@@ -111,6 +111,21 @@ static unsigned char const oid_pkcs5PBES2[9] = {
   0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x05, 0x0D };
 static unsigned char const oid_aes128_CBC[9] = {
   0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x01, 0x02 };
+static unsigned char const oid_aes192_CBC[9] = {
+  0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x01, 0x16 };
+static unsigned char const oid_aes256_CBC[9] = {
+  0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x01, 0x2A };
+
+static unsigned char const oid_hmacWithSHA1[8] = {
+  0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x02, 0x07 };
+static unsigned char const oid_hmacWithSHA224[8] = {
+  0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x02, 0x08 };
+static unsigned char const oid_hmacWithSHA256[8] = {
+  0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x02, 0x09 };
+static unsigned char const oid_hmacWithSHA384[8] = {
+  0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x02, 0x0A };
+static unsigned char const oid_hmacWithSHA512[8] = {
+  0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x02, 0x0B };
 
 static unsigned char const oid_rsaEncryption[9] = {
   0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x01 };
@@ -327,17 +342,21 @@ cram_octet_string (const unsigned char *input, size_t *length,
 
 
 
+/* Derive REQ_KEYLEN bytes of key material for the purpose ID (1 for
+   the key, 2 for the IV) into KEYBUF using the PKCS#12 KDF from RFC
+   7292, appendix B with SHA-1.  A single hash context is used for all
+   blocks and the block update I_j = (I_j + B + 1) mod 2^512 is done
+   directly on the bytes.  */
 static int
 string_to_key (int id, char *salt, size_t saltlen, int iter, const char *pw,
                int req_keylen, unsigned char *keybuf)
 {
   int rc, i, j;
   gcry_md_hd_t md;
-  gcry_mpi_t num_b1 = NULL;
   int pwlen;
-  unsigned char hash[20], buf_b[64], buf_i[128], *p;
+  unsigned char hash[20], buf_d[64], buf_i[128], *p;
   size_t cur_keylen;
-  size_t n;
+  unsigned int carry;
 
   cur_keylen = 0;
   pwlen = strlen (pw);
@@ -364,64 +383,46 @@ string_to_key (int id, char *salt, size_t saltlen, int iter, const char *pw,
       if (++j > pwlen) /* Note, that we include the trailing zero */
         j = 0;
     }
+  memset (buf_d, id, 64);
+
+  rc = gcry_md_open (&md, GCRY_MD_SHA1, 0);
+  if (rc)
+    {
+      log_error ( "gcry_md_open failed: %s\n", gpg_strerror (rc));
+      return rc;
+    }
 
   for (;;)
     {
-      rc = gcry_md_open (&md, GCRY_MD_SHA1, 0);
-      if (rc)
-        {
-          log_error ( "gcry_md_open failed: %s\n", gpg_strerror (rc));
-          return rc;
-        }
-      for(i=0; i < 64; i++)
-        gcry_md_putc (md, id);
+      gcry_md_write (md, buf_d, 64);
       gcry_md_write (md, buf_i, 128);
       memcpy (hash, gcry_md_read (md, 0), 20);
-      gcry_md_close (md);
+      gcry_md_reset (md);
       for (i=1; i < iter; i++)
         gcry_md_hash_buffer (GCRY_MD_SHA1, hash, hash, 20);
 
       for (i=0; i < 20 && cur_keylen < req_keylen; i++)
         keybuf[cur_keylen++] = hash[i];
       if (cur_keylen == req_keylen)
-        {
-          gcry_mpi_release (num_b1);
-          return 0; /* ready */
-        }
+        break; /* ready */
 
-      /* need more bytes. */
-      for(i=0; i < 64; i++)
-        buf_b[i] = hash[i % 20];
-      rc = gcry_mpi_scan (&num_b1, GCRYMPI_FMT_USG, buf_b, 64, &n);
-      if (rc)
-        {
-          log_error ( "gcry_mpi_scan failed: %s\n", gpg_strerror (rc));
-          return -1;
-        }
-      gcry_mpi_add_ui (num_b1, num_b1, 1);
-      for (i=0; i < 128; i += 64)
+      /* need more bytes.  B is HASH repeated to 64 bytes. */
+      for (j=0; j < 128; j += 64)
         {
-          gcry_mpi_t num_ij;
-
-          rc = gcry_mpi_scan (&num_ij, GCRYMPI_FMT_USG, buf_i + i, 64, &n);
-          if (rc)
+          carry = 1;
+          for (i=63; i >= 0; i--)
             {
-              log_error ( "gcry_mpi_scan failed: %s\n",
-                       gpg_strerror (rc));
-              return -1;
+              carry += buf_i[j+i] + hash[i % 20];
+              buf_i[j+i] = carry;
+              carry >>= 8;
             }
-          gcry_mpi_add (num_ij, num_ij, num_b1);
-          gcry_mpi_clear_highbit (num_ij, 64*8);
-          rc = gcry_mpi_print (GCRYMPI_FMT_USG, buf_i + i, 64, &n, num_ij);
-          if (rc)
-            {
-              log_error ( "gcry_mpi_print failed: %s\n",
-                          gpg_strerror (rc));
-              return -1;
-            }
-          gcry_mpi_release (num_ij);
         }
     }
+
+  gcry_md_close (md);
+  wipememory (buf_i, sizeof buf_i);
+  wipememory (hash, sizeof hash);
+  return 0;
 }
 
 
@@ -456,7 +457,8 @@ set_key_iv (gcry_cipher_hd_t chd, char *salt, size_t saltlen, int iter,
 
 static int
 set_key_iv_pbes2 (gcry_cipher_hd_t chd, char *salt, size_t saltlen, int iter,
-                  const void *iv, size_t ivlen, const char *pw, int algo)
+                  const void *iv, size_t ivlen, const char *pw, int algo,
+                  int digest_algo)
 {
   unsigned char *keybuf;
   size_t keylen;
@@ -470,7 +472,7 @@ set_key_iv_pbes2 (gcry_cipher_hd_t chd, char *salt, size_t saltlen, int iter,
     return -1;
 
   rc = gcry_kdf_derive (pw, strlen (pw),
-                        GCRY_KDF_PBKDF2, GCRY_MD_SHA1,
+                        GCRY_KDF_PBKDF2, digest_algo,
                         salt, saltlen, iter, keylen, keybuf);
   if (rc)
     {
@@ -498,10 +500,13 @@ set_key_iv_pbes2 (gcry_cipher_hd_t chd, char *salt, size_t saltlen, int iter,
 }
 
 
+/* En- or decrypt BUFFER of LENGTH in place.  If DIGEST_ALGO is 0
+   the key and IV are derived with the PKCS#12 KDF; else this is PBES2
+   with PBKDF2 using HMAC with DIGEST_ALGO and the given IV.  */
 static void
 crypt_block (unsigned char *buffer, size_t length, char *salt, size_t saltlen,
              int iter, const void *iv, size_t ivlen,
-             const char *pw, int cipher_algo, int encrypt)
+             const char *pw, int cipher_algo, int digest_algo, int encrypt)
 {
   gcry_cipher_hd_t chd;
   int rc;
@@ -514,8 +519,9 @@ crypt_block (unsigned char *buffer, size_t length, char *salt, size_t saltlen,
       return;
     }
 
-  if (cipher_algo == GCRY_CIPHER_AES128
-      ? set_key_iv_pbes2 (chd, salt, saltlen, iter, iv, ivlen, pw, cipher_algo)
+  if (digest_algo
+      ? set_key_iv_pbes2 (chd, salt, saltlen, iter, iv, ivlen, pw, cipher_algo,
+                          digest_algo)
       : set_key_iv (chd, salt, saltlen, iter, pw,
                     cipher_algo == GCRY_CIPHER_RFC2268_40? 5:24))
     {
@@ -542,7 +548,8 @@ crypt_block (unsigned char *buffer, size_t length, char *salt, size_t saltlen,
    CIPHERTEXT is the encrypted data of size LENGTH bytes; PLAINTEXT is
    a buffer of the same size to receive the decryption result. SALT,
    SALTLEN, ITER and PW are the information required for decryption
-   and CIPHER_ALGO is the algorithm id to use.  CHECK_FNC is a
+   and CIPHER_ALGO is the algorithm id to use; DIGEST_ALGO is the PRF
+   for PBES2 or 0 for the PKCS#12 KDF.  CHECK_FNC is a
    function called with the plaintext and used to check whether the
    decryption succeeded; i.e. that a correct passphrase has been
    given.  That function shall return true if the decryption has likely
@@ -551,7 +558,7 @@ static void
 decrypt_block (const void *ciphertext, unsigned char *plaintext, size_t length,
                char *salt, size_t saltlen,
                int iter, const void *iv, size_t ivlen,
-               const char *pw, int cipher_algo,
+               const char *pw, int cipher_algo, int digest_algo,
                int (*check_fnc) (const void *, size_t))
 {
   static const char * const charsets[] = {
@@ -618,12 +625,16 @@ decrypt_block (const void *ciphertext, unsigned char *plaintext, size_t length,
             }
           *outptr = 0;
           jnlib_iconv_close (cd);
+          /* An ASCII passphrase is the same in most charsets; do not
+             run the KDF again for a passphrase already tried.  */
+          if (!strcmp (convertedpw, pw))
+            continue;
           log_info ("decryption failed; trying charset '%s'\n",
                     charsets[charsetidx]);
         }
       memcpy (plaintext, ciphertext, length);
       crypt_block (plaintext, length, salt, saltlen, iter, iv, ivlen,
-                   convertedpw? convertedpw:pw, cipher_algo, 0);
+                   convertedpw? convertedpw:pw, cipher_algo, digest_algo, 0);
       if (check_fnc (plaintext, length))
         break; /* Decryption succeeded. */
     }
@@ -660,6 +671,154 @@ bag_decrypted_data_p (const void *plaintext, size_t length)
 
 /* Note: If R_RESULT is passed as NULL, a key object as already be
    processed and thus we need to skip it here. */
+/* Parse the PBES2-params at *R_P of length *R_N.  On success the
+   salt is stored at SALT which must have room for 20 bytes, its length
+   at R_SALTLEN, the iteration count at R_ITER, the 16 byte IV at IV,
+   the cipher algorithm at R_CIPHER_ALGO and the digest algorithm of
+   the PBKDF2 PRF at R_DIGEST_ALGO; *R_P and *R_N are then updated.
+   Besides the old AES-128 with HMAC-SHA1 this supports AES-192,
+   AES-256 and the SHA-2 PRFs as used by current software.  Returns 0
+   on success or -1 on error.  */
+static int
+parse_pbes2_params (const unsigned char **r_p, size_t *r_n,
+                    char *salt, size_t *r_saltlen, unsigned int *r_iter,
+                    char *iv, int *r_cipher_algo, int *r_digest_algo)
+{
+  static const struct {
+    const unsigned char *oid;
+    int algo;
+  } prf_list[] = {
+    { oid_hmacWithSHA1,   GCRY_MD_SHA1 },
+    { oid_hmacWithSHA224, GCRY_MD_SHA224 },
+    { oid_hmacWithSHA256, GCRY_MD_SHA256 },
+    { oid_hmacWithSHA384, GCRY_MD_SHA384 },
+    { oid_hmacWithSHA512, GCRY_MD_SHA512 },
+    { NULL }
+  }, cipher_list[] = {
+    { oid_aes128_CBC, GCRY_CIPHER_AES128 },
+    { oid_aes192_CBC, GCRY_CIPHER_AES192 },
+    { oid_aes256_CBC, GCRY_CIPHER_AES256 },
+    { NULL }
+  };
+  const unsigned char *p = *r_p;
+  size_t n = *r_n;
+  struct tag_info ti;
+  size_t rest, prfrest;
+  unsigned int iter;
+  int i;
+
+  if (parse_tag (&p, &n, &ti))
+    return -1;
+  if (ti.class || ti.tag != TAG_SEQUENCE)
+    return -1;
+  if (parse_tag (&p, &n, &ti))
+    return -1;
+  if (ti.class || ti.tag != TAG_SEQUENCE)
+    return -1;
+  if (parse_tag (&p, &n, &ti))
+    return -1;
+  if (!(!ti.class && ti.tag == TAG_OBJECT_ID
+        && ti.length == DIM(oid_pkcs5PBKDF2)
+        && !memcmp (p, oid_pkcs5PBKDF2, ti.length)))
+    return -1; /* Not PBKDF2.  */
+  p += ti.length;
+  n -= ti.length;
+  if (parse_tag (&p, &n, &ti))
+    return -1;
+  if (ti.class || ti.tag != TAG_SEQUENCE)
+    return -1;
+  rest = n - ti.length;  /* N after the PBKDF2-params.  */
+  if (parse_tag (&p, &n, &ti))
+    return -1;
+  if (!(!ti.class && ti.tag == TAG_OCTET_STRING
+        && ti.length >= 8 && ti.length < 20))
+    return -1;  /* No salt or unsupported length.  */
+  *r_saltlen = ti.length;
+  memcpy (salt, p, ti.length);
+  p += ti.length;
+  n -= ti.length;
+
+  if (parse_tag (&p, &n, &ti))
+    return -1;
+  if (!(!ti.class && ti.tag == TAG_INTEGER && ti.length))
+    return -1;  /* No valid iteration count.  */
+  for (iter=0; ti.length; ti.length--)
+    {
+      iter <<= 8;
+      iter |= (*p++) & 0xff;
+      n--;
+    }
+  *r_iter = iter;
+
+  /* The optional keyLength and prf.  The keyLength is implied by the
+     cipher and thus ignored.  */
+  *r_digest_algo = GCRY_MD_SHA1;
+  while (n > rest)
+    {
+      if (parse_tag (&p, &n, &ti))
+        return -1;
+      if (!ti.class && ti.tag == TAG_INTEGER)
+        {
+          p += ti.length;
+          n -= ti.length;
+        }
+      else if (!ti.class && ti.tag == TAG_SEQUENCE)
+        {
+          prfrest = n - ti.length;
+          if (parse_tag (&p, &n, &ti))
+            return -1;
+          if (ti.class || ti.tag != TAG_OBJECT_ID)
+            return -1;
+          for (i=0; prf_list[i].oid; i++)
+            if (ti.length == DIM(oid_hmacWithSHA1)
+                && !memcmp (p, prf_list[i].oid, ti.length))
+              break;
+          if (!prf_list[i].oid)
+            return -1; /* Unsupported PRF.  */
+          *r_digest_algo = prf_list[i].algo;
+          /* Skip the rest including the optional NULL parameter.  */
+          if (n < prfrest)
+            return -1;
+          p += n - prfrest;
+          n = prfrest;
+        }
+      else
+        return -1;
+    }
+  if (n != rest)
+    return -1;
+
+  if (parse_tag (&p, &n, &ti))
+    return -1;
+  if (ti.class || ti.tag != TAG_SEQUENCE)
+    return -1;
+  if (parse_tag (&p, &n, &ti))
+    return -1;
+  if (ti.class || ti.tag != TAG_OBJECT_ID)
+    return -1;
+  for (i=0; cipher_list[i].oid; i++)
+    if (ti.length == DIM(oid_aes128_CBC)
+        && !memcmp (p, cipher_list[i].oid, ti.length))
+      break;
+  if (!cipher_list[i].oid)
+    return -1; /* Unsupported cipher.  */
+  *r_cipher_algo = cipher_list[i].algo;
+  p += ti.length;
+  n -= ti.length;
+  if (parse_tag (&p, &n, &ti))
+    return -1;
+  if (!(!ti.class && ti.tag == TAG_OCTET_STRING && ti.length == 16))
+    return -1; /* Bad IV.  */
+  memcpy (iv, p, 16);
+  p += 16;
+  n -= 16;
+
+  *r_p = p;
+  *r_n = n;
+  return 0;
+}
+
+
 static int
 parse_bag_encrypted_data (const unsigned char *buffer, size_t length,
                           int startoffset, size_t *r_consumed, const char *pw,
@@ -682,6 +841,8 @@ parse_bag_encrypted_data (const unsigned char *buffer, size_t length,
   size_t consumed = 0; /* Number of bytes consumed from the original buffer. */
   int is_3des = 0;
   int is_pbes2 = 0;
+  int cipher_algo = 0;
+  int digest_algo = 0;
   gcry_mpi_t *result = NULL;
   int result_count;
 
@@ -755,67 +916,9 @@ parse_bag_encrypted_data (const unsigned char *buffer, size_t length,
   if (is_pbes2)
     {
       where = "pkcs5PBES2-params";
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (ti.class || ti.tag != TAG_SEQUENCE)
-        goto bailout;
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (ti.class || ti.tag != TAG_SEQUENCE)
-        goto bailout;
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (!(!ti.class && ti.tag == TAG_OBJECT_ID
-            && ti.length == DIM(oid_pkcs5PBKDF2)
-            && !memcmp (p, oid_pkcs5PBKDF2, ti.length)))
-        goto bailout; /* Not PBKDF2.  */
-      p += ti.length;
-      n -= ti.length;
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (ti.class || ti.tag != TAG_SEQUENCE)
-        goto bailout;
-      if (parse_tag (&p, &n, &ti))
+      if (parse_pbes2_params (&p, &n, salt, &saltlen, &iter, iv,
+                              &cipher_algo, &digest_algo))
         goto bailout;
-      if (!(!ti.class && ti.tag == TAG_OCTET_STRING
-            && ti.length >= 8 && ti.length < sizeof salt))
-        goto bailout;  /* No salt or unsupported length.  */
-      saltlen = ti.length;
-      memcpy (salt, p, saltlen);
-      p += saltlen;
-      n -= saltlen;
-
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (!(!ti.class && ti.tag == TAG_INTEGER && ti.length))
-        goto bailout;  /* No valid iteration count.  */
-      for (iter=0; ti.length; ti.length--)
-        {
-          iter <<= 8;
-          iter |= (*p++) & 0xff;
-          n--;
-        }
-      /* Note: We don't support the optional parameters but assume
-         that the algorithmIdentifier follows. */
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (ti.class || ti.tag != TAG_SEQUENCE)
-        goto bailout;
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (!(!ti.class && ti.tag == TAG_OBJECT_ID
-            && ti.length == DIM(oid_aes128_CBC)
-            && !memcmp (p, oid_aes128_CBC, ti.length)))
-        goto bailout; /* Not AES-128.  */
-      p += ti.length;
-      n -= ti.length;
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (!(!ti.class && ti.tag == TAG_OCTET_STRING && ti.length == sizeof iv))
-        goto bailout; /* Bad IV.  */
-      memcpy (iv, p, sizeof iv);
-      p += sizeof iv;
-      n -= sizeof iv;
     }
   else
     {
@@ -870,7 +973,8 @@ parse_bag_encrypted_data (const unsigned char *buffer, size_t length,
     goto bailout;
 
   log_info ("%lu bytes of %s encrypted text\n",ti.length,
-            is_pbes2?"AES128":is_3des?"3DES":"RC2");
+            is_pbes2? gcry_cipher_algo_name (cipher_algo) :
+            is_3des?"3DES":"RC2");
 
   plain = gcry_malloc_secure (ti.length);
   if (!plain)
@@ -880,8 +984,9 @@ parse_bag_encrypted_data (const unsigned char *buffer, size_t length,
     }
   decrypt_block (p, plain, ti.length, salt, saltlen, iter,
                  iv, is_pbes2?16:0, pw,
-                 is_pbes2 ? GCRY_CIPHER_AES128 :
+                 is_pbes2 ? cipher_algo :
                  is_3des  ? GCRY_CIPHER_3DES : GCRY_CIPHER_RFC2268_40,
+                 is_pbes2 ? digest_algo : 0,
                  bag_decrypted_data_p);
   n = ti.length;
   startoffset = 0;
@@ -1195,6 +1300,8 @@ parse_bag_data (const unsigned char *buffer, size_t length, int startoffset,
   unsigned char *cram_buffer = NULL;
   size_t consumed = 0; /* Number of bytes consumed from the original buffer. */
   int is_pbes2 = 0;
+  int cipher_algo = 0;
+  int digest_algo = 0;
 
   where = "start";
   if (parse_tag (&p, &n, &ti))
@@ -1280,67 +1387,9 @@ parse_bag_data (const unsigned char *buffer, size_t length, int startoffset,
   if (is_pbes2)
     {
       where = "pkcs5PBES2-params";
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (ti.class || ti.tag != TAG_SEQUENCE)
-        goto bailout;
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (ti.class || ti.tag != TAG_SEQUENCE)
-        goto bailout;
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (!(!ti.class && ti.tag == TAG_OBJECT_ID
-            && ti.length == DIM(oid_pkcs5PBKDF2)
-            && !memcmp (p, oid_pkcs5PBKDF2, ti.length)))
-        goto bailout; /* Not PBKDF2.  */
-      p += ti.length;
-      n -= ti.length;
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (ti.class || ti.tag != TAG_SEQUENCE)
-        goto bailout;
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (!(!ti.class && ti.tag == TAG_OCTET_STRING
-            && ti.length >= 8 && ti.length < sizeof salt))
-        goto bailout;  /* No salt or unsupported length.  */
-      saltlen = ti.length;
-      memcpy (salt, p, saltlen);
-      p += saltlen;
-      n -= saltlen;
-
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (!(!ti.class && ti.tag == TAG_INTEGER && ti.length))
-        goto bailout;  /* No valid iteration count.  */
-      for (iter=0; ti.length; ti.length--)
-        {
-          iter <<= 8;
-          iter |= (*p++) & 0xff;
-          n--;
-        }
-      /* Note: We don't support the optional parameters but assume
-         that the algorithmIdentifier follows. */
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (ti.class || ti.tag != TAG_SEQUENCE)
-        goto bailout;
-      if (parse_tag (&p, &n, &ti))
-        goto bailout;
-      if (!(!ti.class && ti.tag == TAG_OBJECT_ID
-            && ti.length == DIM(oid_aes128_CBC)
-            && !memcmp (p, oid_aes128_CBC, ti.length)))
-        goto bailout; /* Not AES-128.  */
-      p += ti.length;
-      n -= ti.length;
-      if (parse_tag (&p, &n, &ti))
+      if (parse_pbes2_params (&p, &n, salt, &saltlen, &iter, iv,
+                              &cipher_algo, &digest_algo))
         goto bailout;
-      if (!(!ti.class && ti.tag == TAG_OCTET_STRING && ti.length == sizeof iv))
-        goto bailout; /* Bad IV.  */
-      memcpy (iv, p, sizeof iv);
-      p += sizeof iv;
-      n -= sizeof iv;
     }
   else
     {
@@ -1377,7 +1426,7 @@ parse_bag_data (const unsigned char *buffer, size_t length, int startoffset,
     goto bailout;
 
   log_info ("%lu bytes of %s encrypted text\n",
-            ti.length, is_pbes2? "AES128":"3DES");
+            ti.length, is_pbes2? gcry_cipher_algo_name (cipher_algo):"3DES");
 
   plain = gcry_malloc_secure (ti.length);
   if (!plain)
@@ -1388,7 +1437,8 @@ parse_bag_data (const unsigned char *buffer, size_t length, int startoffset,
   consumed += p - p_start + ti.length;
   decrypt_block (p, plain, ti.length, salt, saltlen, iter,
                  iv, is_pbes2? 16:0, pw,
-                 is_pbes2? GCRY_CIPHER_AES128 : GCRY_CIPHER_3DES,
+                 is_pbes2? cipher_algo : GCRY_CIPHER_3DES,
+                 is_pbes2? digest_algo : 0,
                  bag_data_p);
   n = ti.length;
   startoffset = 0;
@@ -2459,7 +2509,7 @@ p12_build (gcry_mpi_t *kparms, const void *cert, size_t certlen,
       /* Encrypt it. */
       gcry_randomize (salt, 8, GCRY_STRONG_RANDOM);
       crypt_block (buffer, buflen, salt, 8, 2048, NULL, 0, pw,
-                   GCRY_CIPHER_RFC2268_40, 1);
+                   GCRY_CIPHER_RFC2268_40, 0, 1);
 
       /* Encode the encrypted stuff into a bag. */
       seqlist[seqlistidx].buffer = build_cert_bag (buffer, buflen, salt, &n);
@@ -2482,7 +2532,7 @@ p12_build (gcry_mpi_t *kparms, const void *cert, size_t certlen,
       /* Encrypt it. */
       gcry_randomize (salt, 8, GCRY_STRONG_RANDOM);
       crypt_block (buffer, buflen, salt, 8, 2048, NULL, 0,
-                   pw, GCRY_CIPHER_3DES, 1);
+                   pw, GCRY_CIPHER_3DES, 0, 1);
 
       /* Encode the encrypted stuff into a bag. */
       if (cert && certlen)
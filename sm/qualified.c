@@ -27,15 +27,29 @@
 
 #include "gpgsm.h"
 #include "../common/i18n.h"
+#include "../common/sysutils.h"
 #include <ksba.h>
 
 
-/* We open the file only once and keep the open file pointer as well
-   as the name of the file here.  Note that, a listname not equal to
-   NULL indicates that this module has been initialized and if the
-   LISTFP is also NULL, no list of qualified signatures exists. */
+/* An entry of the list of qualified certificates.  */
+struct qualitem_s
+{
+  unsigned char fpr[20];  /* The binary fingerprint.  */
+  char country[3];        /* The country code.  */
+  int lnr;                /* The line number; used to keep the first of
+                             duplicate entries.  */
+};
+typedef struct qualitem_s qualitem_t;
+
+/* The name of the list; NULL if this module has not been initialized.
+   The list is read into the table QUALTABLE which is sorted by
+   fingerprint.  QUALTABLE_VALID is set if the table reflects the file
+   with the state LISTSTAMP; a missing file gives an empty table.  */
 static char *listname;
-static FILE *listfp;
+static qualitem_t *qualtable;
+static size_t qualtablesize;
+static int qualtable_valid;
+static gnupg_file_stamp_t liststamp;
 
 
 /* Read the trustlist and return entry by entry.  KEY must point to a
@@ -47,30 +61,14 @@ static FILE *listfp;
    and any other error condition is indicated by the appropriate error
    code. */
 static gpg_error_t
-read_list (char *key, char *country, int *lnr)
+read_list (FILE *listfp, char *key, char *country, int *lnr)
 {
-  gpg_error_t err;
   int c, i, j;
   char *p, line[256];
 
   *key = 0;
   *country = 0;
 
-  if (!listname)
-    {
-      listname = make_filename (gnupg_sysconfdir (), "qualified.txt", NULL);
-      listfp = fopen (listname, "r");
-      if (!listfp && errno != ENOENT)
-        {
-          err = gpg_error_from_syserror ();
-          log_error (_("can't open '%s': %s\n"), listname, gpg_strerror (err));
-          return err;
-        }
-    }
-
-  if (!listfp)
-    return gpg_error (GPG_ERR_EOF);
-
   do
     {
       if (!fgets (line, DIM(line)-1, listfp) )
@@ -128,6 +126,133 @@ read_list (char *key, char *country, int *lnr)
 }
 
 
+/* Sort function for the table entries.  */
+static int
+compare_qualitems (const void *arg_a, const void *arg_b)
+{
+  const qualitem_t *a = arg_a;
+  const qualitem_t *b = arg_b;
+  int cmp;
+
+  cmp = memcmp (a->fpr, b->fpr, 20);
+  if (!cmp)
+    cmp = a->lnr < b->lnr? -1 : a->lnr > b->lnr;
+  return cmp;
+}
+
+
+/* Read the list of qualified certificates into QUALTABLE unless the
+   table is still up to date.  Only the state of the file is checked
+   if it has not changed; thus a bulk verification of signatures
+   does not need to read the file for each signature.  */
+static gpg_error_t
+load_qualified_list (void)
+{
+  gpg_error_t err;
+  gnupg_file_stamp_t stamp;
+  FILE *listfp;
+  qualitem_t *table, *tmp;
+  size_t tablesize, tableidx, i, n;
+  char key[41];
+  int lnr = 0;
+
+  if (!listname)
+    listname = make_filename (gnupg_sysconfdir (), "qualified.txt", NULL);
+
+  /* Take the stamp first so that a change while reading the file
+     leads to another read at the next check.  */
+  gnupg_get_file_stamp (listname, &stamp);
+  if (qualtable_valid && gnupg_file_stamp_equal (&stamp, &liststamp))
+    return 0;
+
+  xfree (qualtable);
+  qualtable = NULL;
+  qualtablesize = 0;
+  qualtable_valid = 0;
+
+  listfp = fopen (listname, "r");
+  if (!listfp)
+    {
+      if (errno == ENOENT)
+        {
+          qualtable_valid = 1;
+          liststamp = stamp;
+          return 0;
+        }
+      err = gpg_error_from_syserror ();
+      log_error (_("can't open '%s': %s\n"), listname, gpg_strerror (err));
+      return err;
+    }
+
+  tablesize = 16;
+  tableidx = 0;
+  table = xtrycalloc (tablesize, sizeof *table);
+  if (!table)
+    {
+      err = gpg_error_from_syserror ();
+      fclose (listfp);
+      return err;
+    }
+  while (!(err = read_list (listfp, key, table[tableidx].country, &lnr)))
+    {
+      hex2bin (key, table[tableidx].fpr, 20);
+      table[tableidx].lnr = lnr;
+      if (++tableidx == tablesize)
+        {
+          tmp = xtryrealloc (table, 2 * tablesize * sizeof *table);
+          if (!tmp)
+            {
+              err = gpg_error_from_syserror ();
+              break;
+            }
+          table = tmp;
+          tablesize *= 2;
+        }
+    }
+  fclose (listfp);
+  if (gpg_err_code (err) != GPG_ERR_EOF)
+    {
+      xfree (table);
+      return err;
+    }
+
+  /* Sort the table and drop the duplicates; the first entry of the
+     file wins as it did with the former linear search.  */
+  qsort (table, tableidx, sizeof *table, compare_qualitems);
+  for (i=n=0; i < tableidx; i++)
+    if (!n || memcmp (table[n-1].fpr, table[i].fpr, 20))
+      table[n++] = table[i];
+
+  qualtable = table;
+  qualtablesize = n;
+  qualtable_valid = 1;
+  liststamp = stamp;
+  return 0;
+}
+
+
+/* Return the entry for the binary fingerprint FPR or NULL.  */
+static qualitem_t *
+find_qualitem (const unsigned char *fpr)
+{
+  size_t lo = 0;
+  size_t hi = qualtablesize;
+  size_t mid;
+  int cmp;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      cmp = memcmp (qualtable[mid].fpr, fpr, 20);
+      if (!cmp)
+        return qualtable + mid;
+      if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return NULL;
+}
 
 
 /* Check whether the certificate CERT is included in the list of
@@ -146,39 +271,26 @@ gpg_error_t
 gpgsm_is_in_qualified_list (ctrl_t ctrl, ksba_cert_t cert, char *country)
 {
   gpg_error_t err;
-  char *fpr;
-  char key[41];
-  char mycountry[3];
-  int lnr = 0;
+  unsigned char fpr[20];
+  qualitem_t *item;
 
   (void)ctrl;
 
   if (country)
     *country = 0;
 
-  fpr = gpgsm_get_fingerprint_hexstring (cert, GCRY_MD_SHA1);
-  if (!fpr)
-    return gpg_error (GPG_ERR_GENERAL);
-
-  if (listfp)
-    {
-      /* W32ce has no rewind, thus we use the equivalent code.  */
-      fseek (listfp, 0, SEEK_SET);
-      clearerr (listfp);
-    }
-  while (!(err = read_list (key, mycountry, &lnr)))
-    {
-      if (!strcmp (key, fpr))
-        break;
-    }
-  if (gpg_err_code (err) == GPG_ERR_EOF)
-    err = gpg_error (GPG_ERR_NOT_FOUND);
+  err = load_qualified_list ();
+  if (err)
+    return err;
 
-  if (!err && country)
-    strcpy (country, mycountry);
+  gpgsm_get_fingerprint (cert, GCRY_MD_SHA1, fpr, NULL);
+  item = find_qualitem (fpr);
+  if (!item)
+    return gpg_error (GPG_ERR_NOT_FOUND);
 
-  xfree (fpr);
-  return err;
+  if (country)
+    strcpy (country, item->country);
+  return 0;
 }
 
 
@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "gpgsm.h"
 #include <gcrypt.h>
@@ -40,20 +41,31 @@ static int
 hash_data (int fd, gcry_md_hd_t md)
 {
   estream_t fp;
-  char buffer[4096];
-  int nread;
+  char *buffer;
+  size_t nread;
   int rc = 0;
 
+  buffer = xtrymalloc (HASH_DATA_BUFSIZE);
+  if (!buffer)
+    {
+      log_error ("error allocating buffer: %s\n", strerror (errno));
+      return -1;
+    }
+
   fp = es_fdopen_nc (fd, "rb");
   if (!fp)
     {
       log_error ("fdopen(%d) failed: %s\n", fd, strerror (errno));
+      xfree (buffer);
       return -1;
     }
 
+  /* Read directly into our buffer so that the data is not copied
+     through the stream buffer.  */
+  es_setvbuf (fp, NULL, _IONBF, 0);
   do
     {
-      nread = es_fread (buffer, 1, DIM(buffer), fp);
+      nread = es_fread (buffer, 1, HASH_DATA_BUFSIZE, fp);
       gcry_md_write (md, buffer, nread);
     }
   while (nread);
@@ -63,6 +75,7 @@ hash_data (int fd, gcry_md_hd_t md)
       rc = -1;
     }
   es_fclose (fp);
+  xfree (buffer);
   return rc;
 }
 
@@ -304,6 +317,179 @@ add_certificate_list (ctrl_t ctrl, ksba_cms_t cms, ksba_cert_t cert)
 
 
 
+/* A signature to be created in a worker thread.  */
+struct sign_job_s
+{
+  ctrl_t ctrl;
+  char *grip;             /* The keygrip of the signer.  */
+  char *desc;             /* The description for the Pinentry.  */
+  unsigned char digest[MAX_DIGEST_LEN];
+  size_t digestlen;
+  int mdalgo;
+  unsigned char *sigval;  /* The result.  */
+  gpg_error_t err;
+};
+
+/* The jobs run by one worker thread.  */
+struct sign_worker_s
+{
+  struct sign_job_s *jobs;
+  int njobs;
+  int conn;               /* The agent connection of this worker.  */
+  int nconns;             /* The number of connections.  */
+};
+
+
+/* Release the NJOBS JOBS.  */
+static void
+release_sign_jobs (struct sign_job_s *jobs, int njobs)
+{
+  int i;
+
+  if (!jobs)
+    return;
+  for (i=0; i < njobs; i++)
+    {
+      xfree (jobs[i].grip);
+      xfree (jobs[i].desc);
+      xfree (jobs[i].sigval);
+    }
+  xfree (jobs);
+}
+
+
+/* The thread function of a worker.  It creates the signatures of all
+   jobs assigned to its agent connection.  */
+static void *
+sign_worker (void *opaque)
+{
+  struct sign_worker_s *w = opaque;
+  struct sign_job_s *job;
+  size_t siglen;
+  int i;
+
+  for (i = w->conn; i < w->njobs; i += w->nconns)
+    {
+      job = w->jobs + i;
+      if (job->err)
+        continue;
+      job->err = gpgsm_agent_pksign_conn (job->ctrl, w->conn,
+                                          job->grip, job->desc,
+                                          job->digest, job->digestlen,
+                                          job->mdalgo,
+                                          &job->sigval, &siglen);
+    }
+  return NULL;
+}
+
+
+/* Hash the signed attributes of all signers in SIGNERLIST using MD
+   and create their signatures using several connections to the
+   agent.  On success an array with the results in the order of
+   SIGNERLIST is stored at R_JOBS and its length at R_NJOBS.  */
+static gpg_error_t
+create_signatures_threaded (ctrl_t ctrl, ksba_cms_t cms,
+                            certlist_t signerlist, gcry_md_hd_t md,
+                            struct sign_job_s **r_jobs, int *r_njobs)
+{
+  gpg_error_t err;
+  struct sign_job_s *jobs;
+  struct sign_worker_s workers[8];
+  npth_t threads[8];
+  npth_attr_t tattr;
+  certlist_t cl, cl_tmp;
+  const unsigned char *digest;
+  int njobs, nconns, nthreads, i, ret;
+
+  *r_jobs = NULL;
+  *r_njobs = 0;
+
+  for (njobs=0, cl=signerlist; cl; cl = cl->next)
+    njobs++;
+  jobs = xtrycalloc (njobs, sizeof *jobs);
+  if (!jobs)
+    return gpg_error_from_syserror ();
+
+  /* Hashing the signed attributes uses the CMS object and thus it is
+     done for all signers before the threads are started.  */
+  for (cl=signerlist, i=0; cl; cl = cl->next, i++)
+    {
+      if (i)
+        gcry_md_reset (md);
+      for (cl_tmp=signerlist; cl_tmp; cl_tmp = cl_tmp->next)
+        gcry_md_enable (md, cl_tmp->hash_algo);
+
+      err = ksba_cms_hash_signed_attrs (cms, i);
+      if (err)
+        {
+          log_debug ("hashing signed attrs failed: %s\n", gpg_strerror (err));
+          release_sign_jobs (jobs, njobs);
+          return err;
+        }
+
+      jobs[i].ctrl = ctrl;
+      jobs[i].mdalgo = cl->hash_algo;
+      digest = gcry_md_read (md, cl->hash_algo);
+      jobs[i].digestlen = gcry_md_get_algo_dlen (cl->hash_algo);
+      if (!digest || !jobs[i].digestlen
+          || jobs[i].digestlen > sizeof jobs[i].digest)
+        {
+          log_error ("problem getting the hash of the data\n");
+          release_sign_jobs (jobs, njobs);
+          return gpg_error (GPG_ERR_BUG);
+        }
+      memcpy (jobs[i].digest, digest, jobs[i].digestlen);
+      jobs[i].grip = gpgsm_get_keygrip_hexstring (cl->cert);
+      if (!jobs[i].grip)
+        jobs[i].err = gpg_error (GPG_ERR_BAD_CERT);
+      jobs[i].desc = gpgsm_format_keydesc (cl->cert);
+    }
+
+  nconns = opt.pksign_threads < njobs? opt.pksign_threads : njobs;
+  if (nconns > (int)DIM (workers))
+    nconns = DIM (workers);
+  err = gpgsm_agent_open_connections (ctrl, nconns, &nconns);
+  if (err)
+    {
+      release_sign_jobs (jobs, njobs);
+      return err;
+    }
+
+  for (i=0; i < nconns; i++)
+    {
+      workers[i].jobs = jobs;
+      workers[i].njobs = njobs;
+      workers[i].conn = i;
+      workers[i].nconns = nconns;
+    }
+
+  /* The main thread uses the first connection.  If a thread can't be
+     created its jobs are run by the main thread too.  */
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (nthreads=1; nthreads < nconns; nthreads++)
+    {
+      ret = npth_create (&threads[nthreads], &tattr,
+                         sign_worker, &workers[nthreads]);
+      if (ret)
+        {
+          log_error ("error spawning worker thread: %s\n", strerror (ret));
+          break;
+        }
+    }
+  npth_attr_destroy (&tattr);
+  sign_worker (&workers[0]);
+  for (i=nthreads; i < nconns; i++)
+    sign_worker (&workers[i]);
+  for (i=1; i < nthreads; i++)
+    npth_join (threads[i], NULL);
+
+  *r_jobs = jobs;
+  *r_njobs = njobs;
+  return 0;
+}
+
+
 /* Perform a sign operation.
 
    Sign the data received on DATA-FD in embedded mode or in detached
@@ -328,6 +514,8 @@ gpgsm_sign (ctrl_t ctrl, certlist_t signerlist,
   ksba_isotime_t signed_at;
   certlist_t cl;
   int release_signerlist = 0;
+  struct sign_job_s *sign_jobs = NULL;
+  int nsign_jobs = 0;
 
   audit_set_type (ctrl->audit, AUDIT_TYPE_SIGN);
 
@@ -719,36 +907,61 @@ gpgsm_sign (ctrl_t ctrl, certlist_t signerlist,
           if (DBG_HASHING)
             gcry_md_debug (md, "sign.attr");
           ksba_cms_set_hash_function (cms, HASH_FNC, md);
+
+          /* With several signers the signatures may be created at
+             the same time; for example to let a smartcard and a soft
+             key work in parallel.  We don't do that with an audit
+             log to keep its order.  */
+          if (opt.pksign_threads > 1 && signerlist->next && !ctrl->audit)
+            {
+              rc = create_signatures_threaded (ctrl, cms, signerlist, md,
+                                               &sign_jobs, &nsign_jobs);
+              if (rc)
+                {
+                  gcry_md_close (md);
+                  goto leave;
+                }
+            }
+
           for (cl=signerlist,signer=0; cl; cl = cl->next, signer++)
             {
               unsigned char *sigval = NULL;
               char *buf, *fpr;
 
-              audit_log_i (ctrl->audit, AUDIT_NEW_SIG, signer);
-              if (signer)
-                gcry_md_reset (md);
-              {
-                certlist_t cl_tmp;
-
-                for (cl_tmp=signerlist; cl_tmp; cl_tmp = cl_tmp->next)
+              if (sign_jobs)
+                {
+                  rc = sign_jobs[signer].err;
+                  sigval = sign_jobs[signer].sigval;
+                  sign_jobs[signer].sigval = NULL;
+                }
+              else
+                {
+                  audit_log_i (ctrl->audit, AUDIT_NEW_SIG, signer);
+                  if (signer)
+                    gcry_md_reset (md);
                   {
-                    gcry_md_enable (md, cl_tmp->hash_algo);
-                    audit_log_i (ctrl->audit, AUDIT_ATTR_HASH_ALGO,
-                                 cl_tmp->hash_algo);
+                    certlist_t cl_tmp;
+
+                    for (cl_tmp=signerlist; cl_tmp; cl_tmp = cl_tmp->next)
+                      {
+                        gcry_md_enable (md, cl_tmp->hash_algo);
+                        audit_log_i (ctrl->audit, AUDIT_ATTR_HASH_ALGO,
+                                     cl_tmp->hash_algo);
+                      }
                   }
-              }
 
-              rc = ksba_cms_hash_signed_attrs (cms, signer);
-              if (rc)
-                {
-                  log_debug ("hashing signed attrs failed: %s\n",
-                             gpg_strerror (rc));
-                  gcry_md_close (md);
-                  goto leave;
+                  rc = ksba_cms_hash_signed_attrs (cms, signer);
+                  if (rc)
+                    {
+                      log_debug ("hashing signed attrs failed: %s\n",
+                                 gpg_strerror (rc));
+                      gcry_md_close (md);
+                      goto leave;
+                    }
+
+                  rc = gpgsm_create_cms_signature (ctrl, cl->cert, md,
+                                                   cl->hash_algo, &sigval);
                 }
-
-              rc = gpgsm_create_cms_signature (ctrl, cl->cert,
-                                               md, cl->hash_algo, &sigval);
               if (rc)
                 {
                   audit_log_cert (ctrl->audit, AUDIT_SIGNED_BY, cl->cert, rc);
@@ -820,6 +1033,7 @@ gpgsm_sign (ctrl_t ctrl, certlist_t signerlist,
                gpg_strerror (rc), gpg_strsource (rc) );
   if (release_signerlist)
     gpgsm_release_certlist (signerlist);
+  release_sign_jobs (sign_jobs, nsign_jobs);
   ksba_cms_release (cms);
   gnupg_ksba_destroy_writer (b64writer);
   keydb_release (kh);
@@ -55,20 +55,32 @@ hash_data (int fd, gcry_md_hd_t md)
 {
   gpg_error_t err = 0;
   estream_t fp;
-  char buffer[4096];
-  int nread;
+  char *buffer;
+  size_t nread;
+
+  buffer = xtrymalloc (HASH_DATA_BUFSIZE);
+  if (!buffer)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error allocating buffer: %s\n", gpg_strerror (err));
+      return err;
+    }
 
   fp = es_fdopen_nc (fd, "rb");
   if (!fp)
     {
       err = gpg_error_from_syserror ();
       log_error ("fdopen(%d) failed: %s\n", fd, gpg_strerror (err));
+      xfree (buffer);
       return err;
     }
 
+  /* Read directly into our buffer so that the data is not copied
+     through the stream buffer.  */
+  es_setvbuf (fp, NULL, _IONBF, 0);
   do
     {
-      nread = es_fread (buffer, 1, DIM(buffer), fp);
+      nread = es_fread (buffer, 1, HASH_DATA_BUFSIZE, fp);
       gcry_md_write (md, buffer, nread);
     }
   while (nread);
@@ -78,6 +90,7 @@ hash_data (int fd, gcry_md_hd_t md)
       log_error ("read error on fd %d: %s\n", fd, gpg_strerror (err));
     }
   es_fclose (fp);
+  xfree (buffer);
   return err;
 }
 
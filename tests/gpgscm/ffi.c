@@ -532,6 +532,26 @@ do_get_time (scheme *sc, pointer args)
   FFI_RETURN_INT (sc, gnupg_get_time ());
 }
 
+/* Return the number of online processors or 1 if that is not
+ * known.  */
+static pointer
+do_get_cpu_count (scheme *sc, pointer args)
+{
+  FFI_PROLOG ();
+  long n = -1;
+  FFI_ARGS_DONE_OR_RETURN (sc, args);
+#ifdef HAVE_W32_SYSTEM
+  {
+    SYSTEM_INFO si;
+    GetSystemInfo (&si);
+    n = si.dwNumberOfProcessors;
+  }
+#elif defined(_SC_NPROCESSORS_ONLN)
+  n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  FFI_RETURN_INT (sc, n > 0 ? n : 1);
+}
+
 static pointer
 do_getpid (scheme *sc, pointer args)
 {
@@ -1382,6 +1402,7 @@ ffi_init (scheme *sc, const char *argv0, const char *scriptname,
   ffi_define_function (sc, rmdir);
   ffi_define_function (sc, get_isotime);
   ffi_define_function (sc, get_time);
+  ffi_define_function (sc, get_cpu_count);
   ffi_define_function (sc, getpid);
 
   /* Random numbers.  */
@@ -603,6 +603,32 @@
 	(current-environment))
       (define (filter-tests status)
 	(filter (lambda (p) (eq? status (p::status))) procs))
+
+      ;; Return the N tests of TESTS with the longest run time.
+      (define (slowest-tests tests n)
+	(define (insert t lst)
+	  (if (null? lst)
+	      (list t)
+	      (let ((u (car lst)))
+		(if (> (t::duration) (u::duration))
+		    (cons t lst)
+		    (cons u (insert t (cdr lst)))))))
+	(define (take lst n)
+	  (if (or (= n 0) (null? lst))
+	      '()
+	      (cons (car lst) (take (cdr lst) (- n 1)))))
+	(let loop ((acc '()) (tests' tests))
+	  (if (null? tests')
+	      acc
+	      (loop (take (insert (car tests') acc) n) (cdr tests')))))
+      (define (print-timings tests)
+	(unless (null? tests)
+		(echo "Slowest tests:")
+		(for-each
+		 (lambda (t)
+		   (echo (string-append "  " (number->string (t::duration)) "s")
+			 t::name))
+		 tests)))
       (define (report)
 	(define (print-tests tests message)
 	  (unless (null? tests)
@@ -624,6 +650,7 @@
 	  (print-tests xfailed "Expectedly failed tests:")
 	  (print-tests xpassed "Unexpectedly passed tests:")
 	  (print-tests skipped "Skipped tests:")
+	  (print-timings (slowest-tests procs 10))
           (echo "===================")
 	  (+ (length failed) (length xpassed))))
 
@@ -709,6 +736,9 @@
 	(set! start-time (get-time)))
       (define (set-end-time!)
 	(set! end-time (get-time)))
+      ;; The run time of the test in seconds.
+      (define (duration)
+	(- end-time start-time))
 
       ;; Has the test been started yet?
       (define (started?)
@@ -731,6 +761,7 @@
 	      (close (:read-end p))
 	      (set! pid pid')
 	      (set! retcode (wait-process name pid' #t)))))
+	(set-end-time!)
 	(report)
 	(current-environment))
       (define (run-sync-quiet . args)
@@ -765,7 +796,8 @@
 		(seek logfd 0 SEEK_SET)
 		(splice logfd STDERR_FILENO)
 		(close logfd))
-	(echo (string-append (status-string) ":") name))
+	(echo (string-append (status-string) ":") name
+	      (string-append "(" (number->string (duration)) "s)")))
 
       (define (xml)
 	(xx::tag
@@ -825,10 +857,12 @@
 		(cdr tests'))))))
 
 ;; Run tests either in sequence or in parallel, depending on the
-;; number of tests and the command line flags.
+;; number of tests and the command line flags.  Most of the time the
+;; tests wait for the processes they spawn, hence by default twice as
+;; many parallel jobs as processors are used.
 (define (run-tests tests)
   (let ((parallel (flag "--parallel" *args*))
-	(default-parallel-jobs 32))
+	(default-parallel-jobs (* 2 (get-cpu-count))))
     (if (and parallel (> (length tests) 1))
 	(run-tests-parallel tests (if (and (pair? parallel)
 					   (string->number (car parallel)))
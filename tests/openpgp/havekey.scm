@@ -0,0 +1,61 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2018 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-legacy-environment)
+
+;; Send the assuan command COMMAND to the agent and return the
+;; response lines.
+(define (agent-command command)
+  (filter (lambda (line) (not (string=? line "")))
+	  (string-split (call-popen `(,(tool 'gpg-connect-agent))
+				    command)
+			#\newline)))
+
+(define (have-key? . grips)
+  (string-prefix? (car (agent-command
+			(apply string-append "HAVEKEY" (map (lambda (grip)
+							      (string-append " " grip))
+							    grips))))
+		  "OK"))
+
+(define (keyinfo-list-has? grip)
+  (pair? (filter (lambda (line)
+		   (string-prefix? line (string-append "S KEYINFO " grip)))
+		 (agent-command "KEYINFO --list"))))
+
+(define missing-grip "0000000000000000000000000000000000000000")
+
+(info "Checking HAVEKEY on key files...")
+(let* ((key keys::alfa)
+       (subkey (car key::subkeys)))
+  (assert (have-secret-key-file? key))
+  (assert (have-key? key::grip))
+  (assert (have-key? subkey::grip))
+  (assert (have-key? missing-grip key::grip))
+  (assert (not (have-key? missing-grip)))
+  (assert (keyinfo-list-has? key::grip))
+  (assert (keyinfo-list-has? subkey::grip))
+  (assert (not (keyinfo-list-has? missing-grip)))
+
+  ;; A deleted key file is not reported anymore.
+  (agent-command (string-append "DELETE_KEY --force " subkey::grip))
+  (assert (not (have-key? subkey::grip)))
+  (assert (not (keyinfo-list-has? subkey::grip)))
+  (assert (have-key? key::grip)))
@@ -37,13 +37,13 @@
 #endif
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <regex.h>
 #include <ctype.h>
 
 #include "../common/util.h"
 #include "../common/i18n.h"
 #include "../common/sysutils.h"
 #include "../common/init.h"
+#include "../common/check-pattern.h"
 
 
 enum cmd_and_opt_values
@@ -88,40 +88,9 @@ static struct
 } opt;
 
 
-enum {
-  PAT_NULL,    /* Indicates end of the array.  */
-  PAT_STRING,  /* The pattern is a simple string.  */
-  PAT_REGEX    /* The pattern is an extended regualr expression. */
-};
-
-
-/* An object to decibe an item of our pattern table. */
-struct pattern_s
-{
-  int type;
-  unsigned int lineno;     /* Line number of the pattern file.  */
-  union {
-    struct {
-      const char *string;  /* Pointer to the actual string (nul termnated).  */
-      size_t length;       /* The length of this string (strlen).  */
-    } s; /*PAT_STRING*/
-    struct {
-      /* We allocate the regex_t because this type is larger than what
-         we need for PAT_STRING and we expect only a few regex in a
-         patternfile.  It would be a waste of core to have so many
-         unused stuff in the table.  */
-      regex_t *regex;
-    } r; /*PAT_REGEX*/
-  } u;
-};
-typedef struct pattern_s pattern_t;
-
-
-
 /*** Local prototypes ***/
 static char *read_file (const char *fname, size_t *r_length);
-static pattern_t *parse_pattern_file (char *data, size_t datalen);
-static void process (FILE *fp, pattern_t *patarray);
+static void process (FILE *fp, pattern_list_t patlist);
 
 
 
@@ -160,7 +129,7 @@ main (int argc, char **argv )
   ARGPARSE_ARGS pargs;
   char *raw_pattern;
   size_t raw_pattern_length;
-  pattern_t *patternarray;
+  pattern_list_t patlist;
 
   early_system_init ();
   set_strusage (my_strusage);
@@ -204,16 +173,17 @@ main (int argc, char **argv )
   if (!raw_pattern)
     exit (2);
 
-  patternarray = parse_pattern_file (raw_pattern, raw_pattern_length);
-  if (!patternarray)
+  if (check_pattern_compile (raw_pattern, raw_pattern_length, &patlist)
+      && !opt.checkonly)
     exit (1);
+  xfree (raw_pattern);
   if (opt.checkonly)
     return 0;
 
 #ifdef HAVE_DOSISH_SYSTEM
   setmode (fileno (stdin) , O_BINARY );
 #endif
-  process (stdin, patternarray);
+  process (stdin, patlist);
 
   return log_get_errorcount(0)? 1 : 0;
 }
@@ -299,154 +269,16 @@ read_file (const char *fname, size_t *r_length)
 
 
 
-static char *
-get_regerror (int errcode, regex_t *compiled)
-{
-  size_t length = regerror (errcode, compiled, NULL, 0);
-  char *buffer = xmalloc (length);
-  regerror (errcode, compiled, buffer, length);
-  return buffer;
-}
-
-/* Parse the pattern given in the memory aread DATA/DATALEN and return
-   a new pattern array.  The end of the array is indicated by a NULL
-   entry.  On error an error message is printed and the function
-   returns NULL.  Note that the function modifies DATA and assumes
-   that data is nul terminated (even if this is one byte past
-   DATALEN).  */
-static pattern_t *
-parse_pattern_file (char *data, size_t datalen)
-{
-  char *p, *p2;
-  size_t n;
-  pattern_t *array;
-  size_t arraysize, arrayidx;
-  unsigned int lineno = 0;
-
-  /* Estimate the number of entries by counting the non-comment lines.  */
-  arraysize = 0;
-  p = data;
-  for (n = datalen; n && (p2 = memchr (p, '\n', n)); p2++, n -= p2 - p, p = p2)
-    if (*p != '#')
-      arraysize++;
-  arraysize += 2; /* For the terminating NULL and a last line w/o a LF.  */
-
-  array = xcalloc (arraysize, sizeof *array);
-  arrayidx = 0;
-
-  /* Loop over all lines.  */
-  while (datalen && data)
-    {
-      lineno++;
-      p = data;
-      p2 = data = memchr (p, '\n', datalen);
-      if (p2)
-        {
-          *data++ = 0;
-          datalen -= data - p;
-        }
-      else
-        p2 = p + datalen;
-      assert (!*p2);
-      p2--;
-      while (isascii (*p) && isspace (*p))
-        p++;
-      if (*p == '#')
-        continue;
-      while (p2 > p && isascii (*p2) && isspace (*p2))
-        *p2-- = 0;
-      if (!*p)
-        continue;
-      assert (arrayidx < arraysize);
-      array[arrayidx].lineno = lineno;
-      if (*p == '/')
-        {
-          int rerr;
-
-          p++;
-          array[arrayidx].type = PAT_REGEX;
-          if (*p && p[strlen(p)-1] == '/')
-            p[strlen(p)-1] = 0;  /* Remove optional delimiter.  */
-          array[arrayidx].u.r.regex = xcalloc (1, sizeof (regex_t));
-          rerr = regcomp (array[arrayidx].u.r.regex, p,
-                          REG_ICASE|REG_NOSUB|REG_EXTENDED);
-          if (rerr)
-            {
-              char *rerrbuf = get_regerror (rerr, array[arrayidx].u.r.regex);
-              log_error ("invalid r.e. at line %u: %s\n", lineno, rerrbuf);
-              xfree (rerrbuf);
-              if (!opt.checkonly)
-                exit (1);
-            }
-        }
-      else
-        {
-          array[arrayidx].type = PAT_STRING;
-          array[arrayidx].u.s.string = p;
-          array[arrayidx].u.s.length = strlen (p);
-        }
-      arrayidx++;
-    }
-  assert (arrayidx < arraysize);
-  array[arrayidx].type = PAT_NULL;
-
-  return array;
-}
-
-
-/* Check whether string macthes any of the pattern in PATARRAY and
-   returns the matching pattern item or NULL.  */
-static pattern_t *
-match_p (const char *string, pattern_t *patarray)
-{
-  pattern_t *pat;
-
-  if (!*string)
-    {
-      if (opt.verbose)
-        log_info ("zero length input line - ignored\n");
-      return NULL;
-    }
-
-  for (pat = patarray; pat->type != PAT_NULL; pat++)
-    {
-      if (pat->type == PAT_STRING)
-        {
-          if (!strcasecmp (pat->u.s.string, string))
-            return pat;
-        }
-      else if (pat->type == PAT_REGEX)
-        {
-          int rerr;
-
-          rerr = regexec (pat->u.r.regex, string, 0, NULL, 0);
-          if (!rerr)
-            return pat;
-          else if (rerr != REG_NOMATCH)
-            {
-              char *rerrbuf = get_regerror (rerr, pat->u.r.regex);
-              log_error ("matching r.e. failed: %s\n", rerrbuf);
-              xfree (rerrbuf);
-              return pat;  /* Better indicate a match on error.  */
-            }
-        }
-      else
-        BUG ();
-    }
-  return NULL;
-}
-
-
 /* Actual processing of the input.  This function does not return an
    error code but exits as soon as a match has been found.  */
 static void
-process (FILE *fp, pattern_t *patarray)
+process (FILE *fp, pattern_list_t patlist)
 {
   char buffer[2048];
   size_t idx;
   int c;
   unsigned long lineno = 0;
-  pattern_t *pat;
+  unsigned int patlineno;
 
   idx = 0;
   c = 0;
@@ -463,13 +295,17 @@ process (FILE *fp, pattern_t *patarray)
                 idx--;
             }
           buffer[idx] = 0;
-          pat = match_p (buffer, patarray);
-          if (pat)
+          if (!*buffer)
+            {
+              if (opt.verbose)
+                log_info ("zero length input line - ignored\n");
+            }
+          else if (check_pattern_match (patlist, buffer, &patlineno))
             {
               if (opt.verbose)
                 log_error ("input line %lu matches pattern at line %u"
                            " - rejected\n",
-                           lineno, pat->lineno);
+                           lineno, patlineno);
               exit (1);
             }
           idx = 0;
@@ -28,6 +28,10 @@
 #include <assuan.h>
 #include <unistd.h>
 #include <assert.h>
+#ifndef HAVE_W32_SYSTEM
+# include <sys/time.h>
+# include <sys/wait.h>
+#endif
 
 #include "../common/i18n.h"
 #include "../common/util.h"
@@ -66,6 +70,8 @@ enum cmd_and_opt_values
     oDirmngr,
     oUIServer,
     oNoAutostart,
+    oLoad,
+    oLoadCount,
 
   };
 
@@ -91,6 +97,11 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_s (oRun,  "run",
                 N_("|FILE|run commands from FILE on startup")),
   ARGPARSE_s_n (oSubst, "subst",     N_("run /subst on startup")),
+  ARGPARSE_s_i (oLoad, "load",
+                N_("|N|run the commands over N connections and"
+                   " print latencies")),
+  ARGPARSE_s_i (oLoadCount, "load-count",
+                N_("|N|run the commands N times per connection")),
 
   ARGPARSE_s_n (oNoAutostart, "no-autostart", "@"),
   ARGPARSE_s_n (oNoVerbose, "no-verbose", "@"),
@@ -121,6 +132,8 @@ struct
   unsigned int connect_flags;    /* Flags used for connecting. */
   int enable_varsubst;  /* Set if variable substitution is enabled.  */
   int trim_leading_spaces;
+  int load;             /* Number of connections for --load or 0.  */
+  int load_count;       /* Number of runs per connection.  */
 } opt;
 
 
@@ -1143,6 +1156,376 @@ help_cmd_p (const char *line)
 
 
 /* gpg-connect-agent's entry point. */
+
+/* Load generation.  With --load N the commands given on the command
+ * line (or the lines of the --run file) are sent over N connections
+ * in parallel, each connection running them --load-count times in
+ * order.  The latency of each command is recorded in a histogram with
+ * logarithmic buckets of LOAD_SUBBUCKETS linear sub-buckets each;
+ * this gives a relative error of about 3% for all values.  The
+ * connections are run by child processes which send their results to
+ * the parent via a pipe.  Data lines and status lines are ignored;
+ * inquiries are not supported and thus counted as errors.  */
+#define MAX_LOAD_CONNECTIONS  256
+#define MAX_LOAD_COMMANDS      32
+#define LOAD_SUBBUCKETS        32
+#define LOAD_BUCKETS          (34 * LOAD_SUBBUCKETS)
+
+struct load_stats_s
+{
+  unsigned int count;            /* Number of commands run.  */
+  unsigned int errors;           /* Number of commands failed.  */
+  unsigned long long sum;        /* Sum of all latencies.  */
+  unsigned long long max;        /* Largest latency.  */
+  unsigned int hist[LOAD_BUCKETS];
+};
+
+
+#ifndef HAVE_W32_SYSTEM
+/* Return the current time in microseconds.  */
+static unsigned long long
+load_now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/* Return the histogram bucket for USEC.  */
+static unsigned int
+load_bucket (unsigned long long usec)
+{
+  unsigned int shift = 0;
+
+  while ((usec >> shift) >= 2 * LOAD_SUBBUCKETS)
+    shift++;
+  if (shift)
+    {
+      unsigned int idx = ((shift + 1) * LOAD_SUBBUCKETS
+                          + (unsigned int)(usec >> shift) - LOAD_SUBBUCKETS);
+      return idx < LOAD_BUCKETS? idx : LOAD_BUCKETS - 1;
+    }
+  return (unsigned int)usec;
+}
+
+
+/* Return the lowest value of the histogram bucket IDX.  */
+static unsigned long long
+load_bucket_value (unsigned int idx)
+{
+  unsigned int shift;
+
+  if (idx < 2 * LOAD_SUBBUCKETS)
+    return idx;
+  shift = idx / LOAD_SUBBUCKETS - 1;
+  return (unsigned long long)(LOAD_SUBBUCKETS
+                              + idx % LOAD_SUBBUCKETS) << shift;
+}
+
+
+/* Return the latency below which PERMILLE per mille of the commands
+ * in ST have completed.  */
+static unsigned long long
+load_percentile (struct load_stats_s *st, unsigned int permille)
+{
+  unsigned long long want, seen;
+  unsigned int idx;
+
+  want = ((unsigned long long)st->count * permille + 999) / 1000;
+  for (seen=idx=0; idx < LOAD_BUCKETS; idx++)
+    {
+      seen += st->hist[idx];
+      if (seen && seen >= want)
+        return load_bucket_value (idx);
+    }
+  return st->max;
+}
+
+
+/* Helper for load_connection to ignore data lines.  */
+static gpg_error_t
+load_data_cb (void *opaque, const void *buffer, size_t length)
+{
+  (void)opaque;
+  (void)buffer;
+  (void)length;
+  return 0;
+}
+
+
+/* Connect to the server for the load generator.  */
+static assuan_context_t
+load_connect (void)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+
+  if (!opt.raw_socket && !opt.tcp_socket)
+    return start_agent ();
+
+  err = assuan_new (&ctx);
+  if (err)
+    {
+      log_error ("assuan_new failed: %s\n", gpg_strerror (err));
+      exit (1);
+    }
+  if (opt.raw_socket)
+    err = assuan_socket_connect
+      (ctx, opt.raw_socket, 0,
+       (opt.connect_flags & 1) ? ASSUAN_SOCKET_CONNECT_FDPASSING : 0);
+  else
+    err = assuan_socket_connect (ctx, opt.tcp_socket, 0, 0);
+  if (err)
+    {
+      log_error ("can't connect to server '%s': %s\n",
+                 opt.raw_socket? opt.raw_socket : opt.tcp_socket,
+                 gpg_strerror (err));
+      exit (1);
+    }
+  return ctx;
+}
+
+
+/* Run the NCMDS commands CMDS over a new connection and write the
+ * statistics and the elapsed time to the file descriptor FD.  This
+ * is called in a child process.  */
+static void
+load_connection (char **cmds, int ncmds, int fd)
+{
+  static struct load_stats_s stats[MAX_LOAD_COMMANDS];
+  assuan_context_t ctx;
+  unsigned long long start, t0, usec;
+  gpg_error_t err;
+  int run, i;
+  size_t nleft;
+  const char *p;
+  ssize_t n;
+
+  ctx = load_connect ();
+  start = load_now ();
+  for (run=0; run < opt.load_count; run++)
+    for (i=0; i < ncmds; i++)
+      {
+        t0 = load_now ();
+        err = assuan_transact (ctx, cmds[i], load_data_cb, NULL,
+                               NULL, NULL, NULL, NULL);
+        usec = load_now () - t0;
+        stats[i].count++;
+        if (err)
+          {
+            if (opt.verbose && !stats[i].errors)
+              log_info ("command '%s' failed: %s\n",
+                        cmds[i], gpg_strerror (err));
+            stats[i].errors++;
+          }
+        stats[i].sum += usec;
+        if (usec > stats[i].max)
+          stats[i].max = usec;
+        stats[i].hist[load_bucket (usec)]++;
+      }
+  usec = load_now () - start;
+  assuan_release (ctx);
+
+  /* The elapsed time is sent first.  */
+  if (write (fd, &usec, sizeof usec) != sizeof usec)
+    _exit (1);
+  for (p = (const char *)stats, nleft = ncmds * sizeof *stats; nleft;
+       p += n, nleft -= n)
+    {
+      n = write (fd, p, nleft);
+      if (n < 0 && errno == EINTR)
+        n = 0;
+      else if (n <= 0)
+        _exit (1);
+    }
+  close (fd);
+  _exit (0);
+}
+
+
+/* Read the results of one connection from FD and add them to STATS.
+ * Returns the elapsed time of the connection or 0 on error.  */
+static unsigned long long
+load_collect (int fd, struct load_stats_s *stats, int ncmds)
+{
+  static struct load_stats_s tmp[MAX_LOAD_COMMANDS];
+  unsigned long long usec;
+  char *p;
+  size_t nleft;
+  ssize_t n;
+  int i, idx;
+
+  usec = 0;
+  for (p = (char *)&usec, nleft = sizeof usec; nleft; p += n, nleft -= n)
+    if ((n = read (fd, p, nleft)) <= 0 && !(n < 0 && errno == EINTR))
+      return 0;
+    else if (n < 0)
+      n = 0;
+  for (p = (char *)tmp, nleft = ncmds * sizeof *tmp; nleft;
+       p += n, nleft -= n)
+    if ((n = read (fd, p, nleft)) <= 0 && !(n < 0 && errno == EINTR))
+      return 0;
+    else if (n < 0)
+      n = 0;
+
+  for (i=0; i < ncmds; i++)
+    {
+      stats[i].count += tmp[i].count;
+      stats[i].errors += tmp[i].errors;
+      stats[i].sum += tmp[i].sum;
+      if (tmp[i].max > stats[i].max)
+        stats[i].max = tmp[i].max;
+      for (idx=0; idx < LOAD_BUCKETS; idx++)
+        stats[i].hist[idx] += tmp[i].hist[idx];
+    }
+  return usec;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Run the load generator with the NCMDS commands CMDS.  Returns the
+ * exit code for the process.  */
+static int
+run_load (char **cmds, int ncmds)
+{
+#ifdef HAVE_W32_SYSTEM
+  (void)cmds;
+  (void)ncmds;
+  log_error ("option '%s' is not supported on this platform\n", "--load");
+  return 1;
+#else
+  static struct load_stats_s stats[MAX_LOAD_COMMANDS];
+  int fds[MAX_LOAD_CONNECTIONS];
+  pid_t pids[MAX_LOAD_CONNECTIONS];
+  int filedes[2];
+  unsigned long long usec, elapsed;
+  unsigned int total, errors;
+  int i, nconn, status;
+  int rc = 0;
+
+  if (!ncmds)
+    {
+      log_error ("no commands given for '%s'\n", "--load");
+      return 1;
+    }
+  if (ncmds > MAX_LOAD_COMMANDS)
+    {
+      log_error ("too many commands for '%s' (max. %d)\n",
+                 "--load", MAX_LOAD_COMMANDS);
+      return 1;
+    }
+  for (i=0; i < ncmds; i++)
+    if (*cmds[i] == '/' || !*cmds[i])
+      {
+        log_error ("command '%s' can't be used with '%s'\n",
+                   cmds[i], "--load");
+        return 1;
+      }
+
+  /* Connect once so that the server is started if required.  */
+  assuan_release (load_connect ());
+
+  es_fflush (es_stdout);
+  for (nconn=0; nconn < opt.load; nconn++)
+    {
+      if (pipe (filedes))
+        {
+          log_error ("error creating a pipe: %s\n", strerror (errno));
+          rc = 1;
+          break;
+        }
+      pids[nconn] = fork ();
+      if (pids[nconn] == (pid_t)(-1))
+        {
+          log_error ("error forking process: %s\n", strerror (errno));
+          close (filedes[0]);
+          close (filedes[1]);
+          rc = 1;
+          break;
+        }
+      if (!pids[nconn])
+        {
+          for (i=0; i < nconn; i++)
+            close (fds[i]);
+          close (filedes[0]);
+          load_connection (cmds, ncmds, filedes[1]);
+          /*NOTREACHED*/
+        }
+      close (filedes[1]);
+      fds[nconn] = filedes[0];
+    }
+
+  elapsed = 0;
+  for (i=0; i < nconn; i++)
+    {
+      usec = load_collect (fds[i], stats, ncmds);
+      close (fds[i]);
+      if (waitpid (pids[i], &status, 0) == (pid_t)(-1)
+          || !WIFEXITED (status) || WEXITSTATUS (status) || !usec)
+        {
+          log_error ("connection %d failed\n", i);
+          rc = 1;
+        }
+      if (usec > elapsed)
+        elapsed = usec;
+    }
+
+  total = errors = 0;
+  es_printf ("%-24s %8s %6s %8s %8s %8s %8s %8s %8s\n",
+             "command", "count", "errors", "mean",
+             "p50", "p90", "p99", "p99.9", "max");
+  for (i=0; i < ncmds; i++)
+    {
+      total += stats[i].count;
+      errors += stats[i].errors;
+      es_printf ("%-24.24s %8u %6u %8llu %8llu %8llu %8llu %8llu %8llu\n",
+                 cmds[i], stats[i].count, stats[i].errors,
+                 stats[i].count? stats[i].sum / stats[i].count : 0,
+                 load_percentile (stats+i, 500),
+                 load_percentile (stats+i, 900),
+                 load_percentile (stats+i, 990),
+                 load_percentile (stats+i, 999),
+                 stats[i].max);
+    }
+  es_printf ("%d connections, %u commands, %u errors, %llu.%03llu s,"
+             " %llu commands/s (latencies in microseconds)\n",
+             nconn, total, errors, elapsed / 1000000,
+             (elapsed / 1000) % 1000,
+             elapsed? (unsigned long long)total * 1000000 / elapsed : 0);
+
+  return rc;
+#endif /*!HAVE_W32_SYSTEM*/
+}
+
+
+/* Read the commands for --load from the file FP into an array and
+ * store the number of commands at R_NCMDS.  Empty lines and comment
+ * lines are skipped.  */
+static char **
+read_load_commands (gpgrt_stream_t fp, int *r_ncmds)
+{
+  char **cmds = NULL;
+  int ncmds = 0;
+  char line[2048];
+  char *p;
+
+  while (es_fgets (line, sizeof line, fp))
+    {
+      trim_spaces (line);
+      if (!*line || *line == '#')
+        continue;
+      if (ncmds == MAX_LOAD_COMMANDS + 1)
+        break;  /* run_load shows the error.  */
+      p = xstrdup (line);
+      cmds = xrealloc (cmds, (ncmds + 1) * sizeof *cmds);
+      cmds[ncmds++] = p;
+    }
+  *r_ncmds = ncmds;
+  return cmds;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -1212,6 +1595,8 @@ main (int argc, char **argv)
           opt.enable_varsubst = 1;
           opt.trim_leading_spaces = 1;
           break;
+        case oLoad:      opt.load = pargs.r.ret_int; break;
+        case oLoadCount: opt.load_count = pargs.r.ret_int; break;
 
         default: pargs.err = 2; break;
 	}
@@ -1278,6 +1663,31 @@ main (int argc, char **argv)
       exit (1);
     }
 
+  if (opt.load > 0)
+    {
+      char **cmds;
+      int ncmds;
+
+      if (opt.exec)
+        {
+          log_error ("option \"%s\" can't be used with \"%s\"\n",
+                     "--load", "--exec");
+          exit (1);
+        }
+      if (opt.load > MAX_LOAD_CONNECTIONS)
+        opt.load = MAX_LOAD_CONNECTIONS;
+      if (opt.load_count < 1)
+        opt.load_count = 100;
+      if (script_fp)
+        cmds = read_load_commands (script_fp, &ncmds);
+      else
+        {
+          cmds = argv;
+          ncmds = argc;
+        }
+      exit (run_load (cmds, ncmds));
+    }
+
 
   if (opt.exec)
     {
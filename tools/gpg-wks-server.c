@@ -31,6 +31,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#ifndef HAVE_W32_SYSTEM
+# include <sys/wait.h>
+#endif
 
 #include "../common/util.h"
 #include "../common/init.h"
@@ -39,6 +42,7 @@
 #include "../common/ccparray.h"
 #include "../common/exectool.h"
 #include "../common/zb32.h"
+#include "../common/host2net.h"
 #include "../common/mbox-util.h"
 #include "../common/name-value.h"
 #include "mime-maker.h"
@@ -62,6 +66,7 @@ enum cmd_and_opt_values
     oDebug      = 500,
 
     aReceive,
+    aReceiveMaildir,
     aCron,
     aListDomains,
     aInstallKey,
@@ -75,6 +80,7 @@ enum cmd_and_opt_values
     oHeader,
     oWithDir,
     oWithFile,
+    oJobs,
 
     oDummy
   };
@@ -86,6 +92,8 @@ static ARGPARSE_OPTS opts[] = {
 
   ARGPARSE_c (aReceive,   "receive",
               ("receive a submission or confirmation")),
+  ARGPARSE_c (aReceiveMaildir, "receive-maildir",
+              ("receive all mails queued in a maildir")),
   ARGPARSE_c (aCron,      "cron",
               ("run regular jobs")),
   ARGPARSE_c (aListDomains, "list-domains",
@@ -113,6 +121,7 @@ static ARGPARSE_OPTS opts[] = {
                 "|NAME=VALUE|add \"NAME: VALUE\" as header to all mails"),
   ARGPARSE_s_n (oWithDir, "with-dir", "@"),
   ARGPARSE_s_n (oWithFile, "with-file", "@"),
+  ARGPARSE_s_i (oJobs, "jobs", "|N|process up to N mails concurrently"),
 
   ARGPARSE_end ()
 };
@@ -146,6 +155,8 @@ typedef struct server_ctx_s *server_ctx_t;
 static int opt_with_dir;
 /* Flag for --with-file.  */
 static int opt_with_file;
+/* Value for --jobs.  */
+static int opt_jobs = 1;
 
 
 /* Prototypes.  */
@@ -156,10 +167,13 @@ static gpg_error_t command_receive_cb (void *opaque,
                                        unsigned int flags);
 static gpg_error_t command_list_domains (void);
 static gpg_error_t command_install_key (const char *fname, const char *userid);
+static gpg_error_t command_install_key_list (const char *fname);
+static void flush_hu_indices (void);
 static gpg_error_t command_remove_key (const char *mailaddr);
 static gpg_error_t command_revoke_key (const char *mailaddr);
 static gpg_error_t command_check_key (const char *mailaddr);
 static gpg_error_t command_cron (void);
+static gpg_error_t command_receive_maildir (const char *dirname);
 
 
 
@@ -243,8 +257,14 @@ parse_arguments (ARGPARSE_ARGS *pargs, ARGPARSE_OPTS *popts)
         case oWithFile:
           opt_with_file = 1;
           break;
+        case oJobs:
+          opt_jobs = pargs->r.ret_int;
+          if (opt_jobs < 1)
+            opt_jobs = 1;
+          break;
 
 	case aReceive:
+        case aReceiveMaildir:
         case aCron:
         case aListDomains:
         case aCheck:
@@ -366,6 +386,12 @@ main (int argc, char **argv)
       err = wks_receive (es_stdin, command_receive_cb, NULL);
       break;
 
+    case aReceiveMaildir:
+      if (argc != 1)
+        wrong_args ("--receive-maildir DIR");
+      err = command_receive_maildir (*argv);
+      break;
+
     case aCron:
       if (argc)
         wrong_args ("--cron");
@@ -377,9 +403,15 @@ main (int argc, char **argv)
       break;
 
     case aInstallKey:
-      if (argc != 2)
-        wrong_args ("--install-key FILE USER-ID");
-      err = command_install_key (*argv, argv[1]);
+      if (argc == 1)
+        err = command_install_key_list (*argv);
+      else if (argc == 2)
+        {
+          err = command_install_key (*argv, argv[1]);
+          flush_hu_indices ();
+        }
+      else
+        wrong_args ("--install-key FILE [USER-ID]");
       break;
 
     case aRemoveKey:
@@ -1415,6 +1447,416 @@ compute_hu_fname (char **r_fname, const char *addrspec)
 }
 
 
+/* The index of the published keys of a domain.  This is the file
+ * "hu-index" in the domain's directory with one line for each
+ * published key:
+ *
+ *   HUNAME FPR CREATED MTIME ADDRSPEC
+ *
+ * HUNAME is the name of the file in the "hu" directory, FPR the
+ * fingerprint of the key, CREATED the creation time of the user id
+ * and MTIME the modification time of the file in the "hu" directory
+ * as of its last publication.  The index allows to skip keys which
+ * are already published.  It is only a hint: An entry is only used if
+ * the modification time of the file still matches and thus a lost or
+ * an outdated entry merely forces a new publication.  */
+#define HU_INDEX_NAME "hu-index"
+
+struct hu_index_item_s
+{
+  char *addrspec;   /* NULL for an unused slot.  */
+  char *fpr;
+  unsigned char sha1[20];  /* Hash of the local part.  */
+  unsigned long created;
+  unsigned long mtime;
+};
+typedef struct hu_index_item_s *hu_index_item_t;
+
+/* The in-memory version of an index using open addressing over the
+ * hash of the local part.  */
+struct hu_index_s
+{
+  struct hu_index_s *next;
+  char *domain;
+  hu_index_item_t items;
+  unsigned int size;    /* A power of 2.  */
+  unsigned int used;    /* Number of slots with an addrspec.  */
+  int dirty;            /* The index needs to be written.  */
+};
+typedef struct hu_index_s *hu_index_t;
+
+/* The list of loaded indices.  */
+static hu_index_t hu_indices;
+
+
+/* Return a new item in INDEX for the hash SHA1 or the existing one.
+ * Returns NULL on error.  */
+static hu_index_item_t
+hu_index_slot (hu_index_t index, const unsigned char *sha1, int create)
+{
+  unsigned int i;
+
+  if (create && (!index->items || index->used + 1 > index->size / 2))
+    {
+      hu_index_item_t old = index->items;
+      unsigned int old_size = index->size;
+      unsigned int j;
+      hu_index_item_t item;
+
+      index->size = index->size? index->size * 2 : 256;
+      index->items = xtrycalloc (index->size, sizeof *index->items);
+      if (!index->items)
+        {
+          index->items = old;
+          index->size = old_size;
+          return NULL;
+        }
+      index->used = 0;
+      for (j=0; j < old_size; j++)
+        if (old[j].addrspec)
+          {
+            item = hu_index_slot (index, old[j].sha1, 1);
+            *item = old[j];
+            index->used++;
+          }
+      xfree (old);
+    }
+
+  if (!index->items)
+    return NULL;
+
+  i = buf32_to_uint (sha1) & (index->size - 1);
+  for (; index->items[i].addrspec; i = (i + 1) & (index->size - 1))
+    if (!memcmp (index->items[i].sha1, sha1, 20))
+      return index->items + i;
+  return create? index->items + i : NULL;
+}
+
+
+/* Compute the hash of the local part of ADDRSPEC at SHA1.  */
+static gpg_error_t
+hash_local_part (unsigned char *sha1, const char *addrspec)
+{
+  const char *s;
+
+  s = strchr (addrspec, '@');
+  if (!s || s == addrspec || !s[1])
+    return gpg_error (GPG_ERR_INV_ARG);
+  gcry_md_hash_buffer (GCRY_MD_SHA1, sha1, addrspec, s - addrspec);
+  return 0;
+}
+
+
+/* Return the index of DOMAIN.  The index is read from the domain's
+ * directory if it has not yet been loaded.  */
+static gpg_error_t
+get_hu_index (hu_index_t *r_index, const char *domain)
+{
+  gpg_error_t err;
+  hu_index_t index;
+  hu_index_item_t item;
+  char *fname = NULL;
+  estream_t fp = NULL;
+  char *line = NULL;
+  size_t length_of_line = 0;
+  size_t maxlen;
+  ssize_t len;
+  char *fields[5];
+  unsigned char sha1[20];
+
+  *r_index = NULL;
+  for (index = hu_indices; index; index = index->next)
+    if (!strcmp (index->domain, domain))
+      {
+        *r_index = index;
+        return 0;
+      }
+
+  index = xtrycalloc (1, sizeof *index);
+  if (!index)
+    return gpg_error_from_syserror ();
+  index->domain = xtrystrdup (domain);
+  if (!index->domain)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (index);
+      return err;
+    }
+  index->next = hu_indices;
+  hu_indices = index;
+  *r_index = index;
+
+  fname = make_filename_try (opt.directory, domain, HU_INDEX_NAME, NULL);
+  if (!fname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      if (gpg_err_code (err) == GPG_ERR_ENOENT)
+        err = 0;
+      else
+        log_error ("error reading '%s': %s\n", fname, gpg_strerror (err));
+      goto leave;
+    }
+
+  maxlen = 2048;
+  while ((len = es_read_line (fp, &line, &length_of_line, &maxlen)) > 0)
+    {
+      if (!maxlen)
+        {
+          err = gpg_error (GPG_ERR_LINE_TOO_LONG);
+          log_error ("error reading '%s': %s\n", fname, gpg_strerror (err));
+          goto leave;
+        }
+      maxlen = 2048;
+      if (split_fields (line, fields, DIM (fields)) < DIM (fields)
+          || hash_local_part (sha1, fields[4]))
+        continue;  /* Ignore garbage.  */
+
+      item = hu_index_slot (index, sha1, 1);
+      if (!item)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      if (!item->addrspec)
+        index->used++;
+      xfree (item->addrspec);
+      xfree (item->fpr);
+      memcpy (item->sha1, sha1, 20);
+      item->addrspec = xtrystrdup (fields[4]);
+      item->fpr = xtrystrdup (fields[1]);
+      item->created = strtoul (fields[2], NULL, 10);
+      item->mtime = strtoul (fields[3], NULL, 10);
+      if (!item->addrspec || !item->fpr)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+  if (len < 0 || es_ferror (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error reading '%s': %s\n", fname, gpg_strerror (err));
+      goto leave;
+    }
+  err = 0;
+  if (opt.verbose > 1)
+    log_info ("domain %s: %u keys in the index\n", domain, index->used);
+
+ leave:
+  xfree (line);
+  es_fclose (fp);
+  xfree (fname);
+  return err;
+}
+
+
+/* Return true if the key FPR with the user id created at CREATED is
+ * already published for ADDRSPEC at the file HUNAME.  */
+static int
+hu_index_is_published (const char *addrspec, const char *fpr,
+                       unsigned long created, const char *huname)
+{
+  const char *domain;
+  hu_index_t index;
+  hu_index_item_t item;
+  unsigned char sha1[20];
+  struct stat sb;
+
+  domain = strchr (addrspec, '@');
+  if (!domain || hash_local_part (sha1, addrspec))
+    return 0;
+  if (get_hu_index (&index, domain + 1))
+    return 0;
+  item = hu_index_slot (index, sha1, 0);
+  if (!item
+      || strcmp (item->addrspec, addrspec)
+      || strcmp (item->fpr, fpr)
+      || item->created != created)
+    return 0;
+
+  return !stat (huname, &sb) && (unsigned long)sb.st_mtime == item->mtime;
+}
+
+
+/* Record that the key FPR with the user id created at CREATED has
+ * been published for ADDRSPEC at the file HUNAME.  If FPR is NULL the
+ * entry is removed.  Errors are not fatal because the index is only a
+ * hint.  */
+static void
+hu_index_update (const char *addrspec, const char *fpr,
+                 unsigned long created, const char *huname)
+{
+  const char *domain;
+  hu_index_t index;
+  hu_index_item_t item;
+  unsigned char sha1[20];
+  struct stat sb;
+  char *p1, *p2;
+
+  domain = strchr (addrspec, '@');
+  if (!domain || hash_local_part (sha1, addrspec))
+    return;
+  if (get_hu_index (&index, domain + 1))
+    return;
+
+  if (!fpr)
+    {
+      unsigned int i, j, k;
+
+      item = hu_index_slot (index, sha1, 0);
+      if (!item)
+        return;
+      xfree (item->addrspec);
+      xfree (item->fpr);
+      memset (item, 0, sizeof *item);
+      index->used--;
+      index->dirty = 1;
+
+      /* Move the following items of the cluster into the gap.  */
+      i = item - index->items;
+      for (j = (i + 1) & (index->size - 1); index->items[j].addrspec;
+           j = (j + 1) & (index->size - 1))
+        {
+          k = buf32_to_uint (index->items[j].sha1) & (index->size - 1);
+          if (i <= j? (i < k && k <= j) : (i < k || k <= j))
+            continue;  /* Already at a suitable slot.  */
+          index->items[i] = index->items[j];
+          memset (index->items + j, 0, sizeof *item);
+          i = j;
+        }
+      return;
+    }
+
+  if (stat (huname, &sb))
+    return;
+  p1 = xtrystrdup (addrspec);
+  p2 = xtrystrdup (fpr);
+  item = (p1 && p2)? hu_index_slot (index, sha1, 1) : NULL;
+  if (!item)
+    {
+      xfree (p1);
+      xfree (p2);
+      return;
+    }
+  if (!item->addrspec)
+    index->used++;
+  xfree (item->addrspec);
+  xfree (item->fpr);
+  memcpy (item->sha1, sha1, 20);
+  item->addrspec = p1;
+  item->fpr = p2;
+  item->created = created;
+  item->mtime = sb.st_mtime;
+  index->dirty = 1;
+}
+
+
+/* Write INDEX to the domain's directory.  */
+static gpg_error_t
+write_hu_index (hu_index_t index)
+{
+  gpg_error_t err;
+  char *fname, *tmpname = NULL;
+  estream_t fp = NULL;
+  hu_index_item_t item;
+  char *hash;
+  unsigned int i;
+
+  fname = make_filename_try (opt.directory, index->domain,
+                             HU_INDEX_NAME, NULL);
+  if (!fname)
+    return gpg_error_from_syserror ();
+  tmpname = strconcat (fname, ".tmp", NULL);
+  if (!tmpname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  fp = es_fopen (tmpname, "w");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error creating '%s': %s\n", tmpname, gpg_strerror (err));
+      goto leave;
+    }
+  /* The index reveals the mail addresses; thus keep it private.  */
+  if (gnupg_chmod (tmpname, "-rw"))
+    log_error ("can't set permissions of '%s': %s\n",
+               tmpname, gpg_strerror (gpg_err_code_from_syserror ()));
+  for (i=0; i < index->size; i++)
+    {
+      item = index->items + i;
+      if (!item->addrspec)
+        continue;
+      hash = zb32_encode (item->sha1, 8*20);
+      if (!hash)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      es_fprintf (fp, "%s %s %lu %lu %s\n",
+                  hash, item->fpr, item->created, item->mtime,
+                  item->addrspec);
+      xfree (hash);
+    }
+  if (es_fclose (fp))
+    {
+      fp = NULL;
+      err = gpg_error_from_syserror ();
+      log_error ("error writing '%s': %s\n", tmpname, gpg_strerror (err));
+      goto leave;
+    }
+  fp = NULL;
+
+  err = gnupg_rename_file (tmpname, fname, NULL);
+  if (err)
+    log_error ("error renaming '%s' to '%s': %s\n",
+               tmpname, fname, gpg_strerror (err));
+
+ leave:
+  if (fp)
+    es_fclose (fp);
+  if (err && tmpname)
+    gnupg_remove (tmpname);
+  xfree (tmpname);
+  xfree (fname);
+  return err;
+}
+
+
+/* Write all modified indices and release them.  The indices are
+ * released so that a long running process does not keep using an
+ * index which has since been updated by another process.  */
+static void
+flush_hu_indices (void)
+{
+  hu_index_t index;
+  unsigned int i;
+
+  while ((index = hu_indices))
+    {
+      hu_indices = index->next;
+      if (index->dirty)
+        write_hu_index (index);
+      for (i=0; i < index->size; i++)
+        {
+          xfree (index->items[i].addrspec);
+          xfree (index->items[i].fpr);
+        }
+      xfree (index->items);
+      xfree (index->domain);
+      xfree (index);
+    }
+}
+
+
 /* Check that we have send a request with NONCE and publish the key.  */
 static gpg_error_t
 check_and_publish (server_ctx_t ctx, const char *address, const char *nonce)
@@ -1509,6 +1951,8 @@ check_and_publish (server_ctx_t ctx, const char *address, const char *nonce)
                fnewname, gpg_strerror (gpg_err_code_from_syserror()));
 
   log_info ("key %s published for '%s'\n", ctx->fpr, address);
+  hu_index_update (address, ctx->fpr, sl->created, fnewname);
+  flush_hu_indices ();
   send_congratulation_message (address, fnewname);
 
   /* Try to publish as DANE record if the DANE directory exists.  */
@@ -1666,6 +2110,189 @@ command_receive_cb (void *opaque, const char *mediatype,
 }
 
 
+
+/* Claim the next mail queued in the maildir DIRNAME.  This is done
+ * by renaming the mail from the "new" to the "cur" subdirectory,
+ * which is atomic and thus several processes can work on the same
+ * maildir.  DIR is the open "new" directory.  On success the name of
+ * the claimed mail is stored at R_FNAME; NULL is stored there if no
+ * more mails are found in DIR.  */
+static gpg_error_t
+claim_next_mail (const char *dirname, DIR *dir, char **r_fname)
+{
+  gpg_error_t err;
+  struct dirent *dentry;
+  char *src, *dst;
+
+  *r_fname = NULL;
+  while ((dentry = readdir (dir)))
+    {
+      if (*dentry->d_name == '.')
+        continue;
+      src = xstrconcat (dirname, "/new/", dentry->d_name, NULL);
+      /* Maildir uses the suffix ":2," followed by flags for mails in
+       * "cur"; we mark the mail as seen.  */
+      dst = xstrconcat (dirname, "/cur/", dentry->d_name,
+                        strchr (dentry->d_name, ':')? "" : ":2,S", NULL);
+      if (!rename (src, dst))
+        {
+          xfree (src);
+          *r_fname = dst;
+          return 0;
+        }
+      err = gpg_error_from_syserror ();
+      xfree (dst);
+      /* ENOENT means that another process claimed the mail.  */
+      if (gpg_err_code (err) != GPG_ERR_ENOENT)
+        {
+          log_error ("error claiming '%s': %s\n", src, gpg_strerror (err));
+          xfree (src);
+          return err;
+        }
+      xfree (src);
+    }
+
+  return 0;
+}
+
+
+/* Process all mails queued in the maildir DIRNAME until no more
+ * mails are found.  Successfully processed mails are removed and
+ * those which failed are kept in "cur".  */
+static gpg_error_t
+receive_maildir_worker (const char *dirname)
+{
+  gpg_error_t err;
+  gpg_error_t firsterr = 0;
+  char *newdir;
+  char *fname;
+  DIR *dir;
+  estream_t fp;
+  int nclaimed;
+
+  newdir = xstrconcat (dirname, "/new", NULL);
+  do
+    {
+      dir = opendir (newdir);
+      if (!dir)
+        {
+          err = gpg_error_from_syserror ();
+          log_error (("can't access directory '%s': %s\n"),
+                     newdir, gpg_strerror (err));
+          firsterr = err;
+          break;
+        }
+
+      /* Mails which arrive while we scan the directory are picked up
+       * by the next scan.  */
+      nclaimed = 0;
+      while (!(err = claim_next_mail (dirname, dir, &fname)) && fname)
+        {
+          nclaimed++;
+          if (opt.verbose)
+            log_info ("processing '%s'\n", fname);
+          fp = es_fopen (fname, "rb");
+          if (!fp)
+            err = gpg_error_from_syserror ();
+          else
+            {
+              err = wks_receive (fp, command_receive_cb, NULL);
+              es_fclose (fp);
+            }
+          if (err)
+            {
+              log_error ("error processing '%s': %s\n",
+                         fname, gpg_strerror (err));
+              if (!firsterr)
+                firsterr = err;
+              err = 0;
+            }
+          else if (remove (fname))
+            {
+              err = gpg_error_from_syserror ();
+              log_error ("error removing '%s': %s\n",
+                         fname, gpg_strerror (err));
+              err = 0;
+            }
+          xfree (fname);
+        }
+      closedir (dir);
+      if (err && !firsterr)
+        firsterr = err;
+    }
+  while (!err && nclaimed);
+
+  xfree (newdir);
+  return firsterr;
+}
+
+
+/* Process all mails queued in the maildir DIRNAME.  With --jobs
+ * several worker processes are used so that the time spent waiting
+ * for gpg and sendmail overlaps.  */
+static gpg_error_t
+command_receive_maildir (const char *dirname)
+{
+#ifdef HAVE_W32_SYSTEM
+  return receive_maildir_worker (dirname);
+#else
+  gpg_error_t err = 0;
+  pid_t pid;
+  int i, nrunning, status;
+
+  if (opt_jobs < 2)
+    return receive_maildir_worker (dirname);
+
+  /* Mails written to stdout by concurrent workers would be mixed.  */
+  if (!opt.use_sendmail && !opt.output)
+    {
+      log_error ("option '%s' requires '%s' or '%s'\n",
+                 "--jobs", "--send", "--output");
+      return gpg_error (GPG_ERR_INV_ARG);
+    }
+
+  es_fflush (NULL);
+  for (nrunning = i = 0; i < opt_jobs; i++)
+    {
+      pid = fork ();
+      if (pid == (pid_t)(-1))
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error forking process: %s\n", gpg_strerror (err));
+          break;
+        }
+      if (!pid)
+        {
+          /* This is a worker.  */
+          err = receive_maildir_worker (dirname);
+          es_fflush (NULL);
+          _exit ((err || log_get_errorcount (0))? 1 : 0);
+        }
+      nrunning++;
+    }
+
+  for (; nrunning; nrunning--)
+    {
+      if (wait (&status) == (pid_t)(-1))
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("waiting for worker failed: %s\n", gpg_strerror (err));
+          break;
+        }
+      if (!WIFEXITED (status) || WEXITSTATUS (status))
+        {
+          log_error ("a worker process failed\n");
+          if (!err)
+            err = gpg_error (GPG_ERR_GENERAL);
+        }
+    }
+
+  return err;
+#endif /*!HAVE_W32_SYSTEM*/
+}
+
+
+
 
 /* Return a list of all configured domains.  ECh list element is the
  * top directory for the domain.  To figure out the actual domain
@@ -1747,6 +2374,9 @@ expire_one_domain (const char *top_dirname, const char *domain)
   struct dirent *dentry;
   struct stat sb;
   time_t now = gnupg_get_time ();
+#ifdef HAVE_FSTATAT
+  int dfd;
+#endif
 
   dirname = make_filename_try (top_dirname, "pending", NULL);
   if (!dirname)
@@ -1766,10 +2396,23 @@ expire_one_domain (const char *top_dirname, const char *domain)
       goto leave;
     }
 
+#ifdef HAVE_FSTATAT
+  /* With a large number of pending keys it pays off not to build the
+   * full file name of each key and to avoid its lookup.  */
+  dfd = dirfd (dir);
+#endif
+
   while ((dentry = readdir (dir)))
     {
       if (*dentry->d_name == '.')
         continue;
+#ifdef HAVE_FSTATAT
+      if (strlen (dentry->d_name) == 32
+          && !fstatat (dfd, dentry->d_name, &sb, 0)
+          && !S_ISDIR (sb.st_mode)
+          && !(sb.st_mtime + PENDING_TTL < now))
+        continue;  /* Not yet expired.  */
+#endif
       xfree (fname);
       fname = make_filename_try (dirname, dentry->d_name, NULL);
       if (!fname)
@@ -1965,8 +2608,17 @@ command_list_domains (void)
           wks_free_policy (&policy);
         }
 
+      /* Tell the number of published keys as known by the index.  */
+      if (opt.verbose)
+        {
+          hu_index_t index;
 
+          if (!get_hu_index (&index, domain))
+            log_info ("domain %s: %u keys in the index\n",
+                      domain, index->used);
+        }
     }
+  flush_hu_indices ();
   err = 0;
 
  leave:
@@ -2084,6 +2736,20 @@ command_install_key (const char *fname, const char *userid)
   if (opt.verbose)
     log_info ("using key with user id '%s'\n", thisuid->uid);
 
+  /* Hash user ID and create filename.  */
+  err = compute_hu_fname (&huname, addrspec);
+  if (err)
+    goto leave;
+
+  /* Skip the filtering and copying if the index tells us that this
+   * key has already been published.  */
+  if (hu_index_is_published (addrspec, fpr, thisuid->created, huname))
+    {
+      if (opt.verbose)
+        log_info ("key %s already published for '%s'\n", fpr, addrspec);
+      goto leave;
+    }
+
   {
     estream_t fp2;
 
@@ -2099,11 +2765,6 @@ command_install_key (const char *fname, const char *userid)
     fp = fp2;
   }
 
-  /* Hash user ID and create filename.  */
-  err = compute_hu_fname (&huname, addrspec);
-  if (err)
-    goto leave;
-
   /* Publish.  */
   err = write_to_file (fp, huname);
   if (err)
@@ -2119,6 +2780,7 @@ command_install_key (const char *fname, const char *userid)
 
   if (!opt.quiet)
     log_info ("key %s published for '%s'\n", fpr, addrspec);
+  hu_index_update (addrspec, fpr, thisuid->created, huname);
 
  leave:
   xfree (huname);
@@ -2130,6 +2792,90 @@ command_install_key (const char *fname, const char *userid)
 }
 
 
+/* Install the keys listed in FNAME into the WKD.  Each line of the
+ * file has the FILE and USER-ID arguments of --install-key separated
+ * by white space; empty lines and lines starting with a '#' are
+ * ignored.  A FNAME of "-" reads the list from stdin.  Installing all
+ * keys in one run reads and writes the index of a domain only once.
+ * Errors are counted but do not stop the processing.  */
+static gpg_error_t
+command_install_key_list (const char *fname)
+{
+  gpg_error_t err;
+  estream_t fp;
+  char *line = NULL;
+  size_t length_of_line = 0;
+  size_t maxlen;
+  ssize_t len;
+  char *p, *userid;
+  unsigned int lnr = 0;
+  unsigned int count = 0;
+  unsigned int nerrors = 0;
+
+  if (!strcmp (fname, "-"))
+    fp = es_stdin;
+  else
+    fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error reading '%s': %s\n", fname, gpg_strerror (err));
+      return err;
+    }
+
+  maxlen = 2048;
+  while ((len = es_read_line (fp, &line, &length_of_line, &maxlen)) > 0)
+    {
+      lnr++;
+      if (!maxlen)
+        {
+          err = gpg_error (GPG_ERR_LINE_TOO_LONG);
+          log_error ("%s:%u: %s\n", fname, lnr, gpg_strerror (err));
+          goto leave;
+        }
+      maxlen = 2048;
+      trim_spaces (line);
+      if (!*line || *line == '#')
+        continue;
+
+      for (p = line; *p && !spacep (p); p++)
+        ;
+      if (!*p)
+        {
+          log_error ("%s:%u: missing user id\n", fname, lnr);
+          nerrors++;
+          continue;
+        }
+      *p++ = 0;
+      userid = p;
+      while (spacep (userid))
+        userid++;
+
+      if (command_install_key (line, userid))
+        nerrors++;
+      else
+        count++;
+    }
+  if (len < 0 || es_ferror (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error reading '%s': %s\n", fname, gpg_strerror (err));
+      goto leave;
+    }
+
+  if (!opt.quiet)
+    log_info ("%u keys installed, %u errors\n", count, nerrors);
+  err = nerrors? gpg_error (GPG_ERR_GENERAL) : 0;
+
+ leave:
+  flush_hu_indices ();
+  xfree (line);
+  if (fp != es_stdin)
+    es_fclose (fp);
+  return err;
+}
+
+
 /* Return the filename and optionally the addrspec for USERID at
  * R_FNAME and R_ADDRSPEC.  R_ADDRSPEC might also be set on error.  */
 static gpg_error_t
@@ -2249,18 +2995,21 @@ command_remove_key (const char *userid)
           if (!opt.quiet)
             log_info ("key for '%s' is not installed\n", addrspec);
           log_inc_errorcount ();
+          hu_index_update (addrspec, NULL, 0, NULL);
           err = 0;
         }
       else
         log_error ("error removing '%s': %s\n", fname, gpg_strerror (err));
       goto leave;
     }
+  hu_index_update (addrspec, NULL, 0, NULL);
 
   if (opt.verbose)
     log_info ("key for '%s' removed\n", addrspec);
   err = 0;
 
  leave:
+  flush_hu_indices ();
   xfree (fname);
   xfree (addrspec);
   return err;
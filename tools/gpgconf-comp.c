@@ -27,6 +27,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <errno.h>
 #include <time.h>
@@ -49,6 +50,7 @@
 #include "../common/exechelp.h"
 #include "../common/sysutils.h"
 #include "../common/status.h"
+#include "../common/membuf.h"
 
 #include "../common/gc-opt-flags.h"
 #include "gpgconf.h"
@@ -511,6 +513,12 @@ static gc_option_t gc_options_gpg_agent[] =
    { "enable-extended-key-format", GC_OPT_FLAG_RUNTIME, GC_LEVEL_INVISIBLE,
      NULL, NULL,
      GC_ARG_TYPE_NONE, GC_BACKEND_GPG_AGENT },
+   { "secmem-size", GC_OPT_FLAG_NONE, GC_LEVEL_EXPERT,
+     "gnupg", "|N|use N bytes of secure memory",
+     GC_ARG_TYPE_UINT32, GC_BACKEND_GPG_AGENT },
+   { "auto-expand-secmem", GC_OPT_FLAG_ARG_OPT, GC_LEVEL_EXPERT,
+     "gnupg", "|N|let the secure memory grow in steps of N bytes",
+     GC_ARG_TYPE_UINT32, GC_BACKEND_GPG_AGENT },
 
    { "Debug",
      GC_OPT_FLAG_GROUP, GC_LEVEL_ADVANCED,
@@ -1716,23 +1724,29 @@ collect_error_output (estream_t fp, const char *tag)
 }
 
 
-/* Check the options of a single component.  Returns 0 if everything
-   is OK.  */
-int
-gc_component_check_options (int component, estream_t out, const char *conf_file)
+/* The state of a program started to check the options of a
+   component.  */
+struct check_process_s
 {
-  gpg_error_t err;
+  const char *pgmname;
+  pid_t pid;
+  estream_t errfp;
   unsigned int result;
+};
+
+
+/* Start the program to check the options of COMPONENT and store its
+   state at PROC.  Returns false if the component has no program.  */
+static int
+check_options_start (int component, const char *conf_file,
+                     struct check_process_s *proc)
+{
+  gpg_error_t err;
   int backend_seen[GC_BACKEND_NR];
   gc_backend_t backend;
   gc_option_t *option;
-  const char *pgmname;
   const char *argv[4];
   int i;
-  pid_t pid;
-  int exitcode;
-  estream_t errfp;
-  error_line_t errlines;
 
   for (backend = 0; backend < GC_BACKEND_NR; backend++)
     backend_seen[backend] = 0;
@@ -1757,7 +1771,7 @@ gc_component_check_options (int component, estream_t out, const char *conf_file)
   if (! option || ! option->name)
     return 0;
 
-  pgmname = gnupg_module_name (gc_backend[backend].module_name);
+  proc->pgmname = gnupg_module_name (gc_backend[backend].module_name);
   i = 0;
   if (conf_file)
     {
@@ -1770,25 +1784,42 @@ gc_component_check_options (int component, estream_t out, const char *conf_file)
     argv[i++] = "--gpgconf-test";
   argv[i++] = NULL;
 
-  result = 0;
-  errlines = NULL;
-  err = gnupg_spawn_process (pgmname, argv, NULL, NULL, 0,
-                             NULL, NULL, &errfp, &pid);
+  proc->result = 0;
+  proc->errfp = NULL;
+  err = gnupg_spawn_process (proc->pgmname, argv, NULL, NULL, 0,
+                             NULL, NULL, &proc->errfp, &proc->pid);
   if (err)
-    result |= 1; /* Program could not be run.  */
-  else
+    proc->result |= 1; /* Program could not be run.  */
+  return 1;
+}
+
+
+/* Wait for the program PROC started by check_options_start for
+   COMPONENT and print the result to OUT.  Returns 0 if everything is
+   OK.  */
+static int
+check_options_finish (int component, struct check_process_s *proc,
+                      estream_t out)
+{
+  unsigned int result = proc->result;
+  const char *pgmname = proc->pgmname;
+  int exitcode;
+  error_line_t errlines;
+
+  errlines = NULL;
+  if (!(result & 1))
     {
-      errlines = collect_error_output (errfp,
+      errlines = collect_error_output (proc->errfp,
 				       gc_component[component].name);
-      if (gnupg_wait_process (pgmname, pid, 1, &exitcode))
+      if (gnupg_wait_process (pgmname, proc->pid, 1, &exitcode))
 	{
 	  if (exitcode == -1)
 	    result |= 1; /* Program could not be run or it
 			    terminated abnormally.  */
 	  result |= 2; /* Program returned an error.  */
 	}
-      gnupg_release_process (pid);
-      es_fclose (errfp);
+      gnupg_release_process (proc->pid);
+      es_fclose (proc->errfp);
     }
 
   /* If the program could not be run, we can't tell whether
@@ -1834,19 +1865,40 @@ gc_component_check_options (int component, estream_t out, const char *conf_file)
 }
 
 
+/* Check the options of a single component.  Returns 0 if everything
+   is OK.  */
+int
+gc_component_check_options (int component, estream_t out, const char *conf_file)
+{
+  struct check_process_s proc;
+
+  if (!check_options_start (component, conf_file, &proc))
+    return 0;
+  return check_options_finish (component, &proc, out);
+}
 
-/* Check all components that are available.  */
+
+
+/* Check all components that are available.  All programs are started
+   before the first one is waited for so that they run in parallel;
+   the output is still printed in the order of the components.  */
 void
 gc_check_programs (estream_t out)
 {
   gc_component_t component;
+  struct check_process_s proc[GC_COMPONENT_NR];
+  int started[GC_COMPONENT_NR];
 
   for (component = 0; component < GC_COMPONENT_NR; component++)
-    gc_component_check_options (component, out, NULL);
+    started[component] = check_options_start (component, NULL,
+                                              proc + component);
+  for (component = 0; component < GC_COMPONENT_NR; component++)
+    if (started[component])
+      check_options_finish (component, proc + component, out);
 }
 
 
-
+
 /* Find the component with the name NAME.  Returns -1 if not
    found.  */
 int
@@ -2090,6 +2142,146 @@ get_config_filename (gc_component_t component, gc_backend_t backend)
 }
 
 
+/* The output of --gpgconf-list depends only on the program, the home
+ * directory, and the options set in the default configuration file.
+ * To avoid running the program for each invocation of gpgconf the
+ * output is cached in a file "gpgconf-COMPONENT.cache" in the socket
+ * directory, which is specific to the home directory.  The first line
+ * of the file is
+ *
+ *   gpgconf-cache:1:VERSION:PGMNAME:PGMSTAMP:CONFNAME:CONFSTAMP
+ *
+ * with the names percent escaped and the stamps as returned by
+ * schema_cache_stamp.  The rest of the file is the verbatim output of
+ * the program.  The cache is used only if all fields still match.  */
+
+/* Return a string describing the modification state of the file
+ * FNAME.  The caller must release the result.  */
+static char *
+schema_cache_stamp (const char *fname)
+{
+  struct stat st;
+
+  if (stat (fname, &st))
+    return xstrdup ("-");
+  return xasprintf ("%lu.%llu", (unsigned long)st.st_mtime,
+                    (unsigned long long)st.st_size);
+}
+
+
+/* Open the cached --gpgconf-list output of COMPONENT as produced by
+ * PGMNAME.  On success the stream is positioned at the first line of
+ * the output and the name of the cache file is stored at
+ * R_CACHENAME.  If there is no valid cache NULL is returned and the
+ * name of the cache file to create is stored at R_CACHENAME; that
+ * name is NULL if no cache should be created.  */
+static estream_t
+schema_cache_open (gc_component_t component, const char *pgmname,
+                   char **r_cachename)
+{
+  char *fname;
+  char *line = NULL;
+  size_t line_len = 0;
+  ssize_t length;
+  char *fields[7];
+  char *stamp = NULL;
+  estream_t fp;
+  int okay = 0;
+
+  *r_cachename = NULL;
+  if (opt.dry_run)
+    return NULL;
+
+  fname = xstrconcat (gnupg_socketdir (), DIRSEP_S, "gpgconf-",
+                      gc_component[component].name, ".cache", NULL);
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    {
+      *r_cachename = fname;
+      return NULL;
+    }
+
+  length = es_read_line (fp, &line, &line_len, NULL);
+  if (length > 0 && line[length-1] == '\n')
+    {
+      line[--length] = 0;
+      if (split_fields_colon (line, fields, DIM (fields)) == DIM (fields)
+          && !strcmp (fields[0], "gpgconf-cache")
+          && !strcmp (fields[1], "1")
+          && !strcmp (fields[2], VERSION)
+          && !strcmp (fields[3], gc_percent_escape (pgmname)))
+        {
+          stamp = schema_cache_stamp (pgmname);
+          if (!strcmp (fields[4], stamp))
+            {
+              xfree (stamp);
+              stamp = schema_cache_stamp (percent_deescape (fields[5]));
+              okay = !strcmp (fields[6], stamp);
+            }
+        }
+    }
+  xfree (stamp);
+  xfree (line);
+
+  if (!okay)
+    {
+      es_fclose (fp);
+      fp = NULL;
+    }
+  else if (opt.verbose)
+    log_info ("using cached options of '%s'\n", pgmname);
+
+  *r_cachename = fname;
+  return fp;
+}
+
+
+/* Write the --gpgconf-list output of PGMNAME from MB to the cache
+ * file CACHENAME.  CONFNAME is the configuration file of the program.
+ * Errors are not fatal because the cache is only an optimization.  */
+static void
+schema_cache_store (const char *cachename, const char *pgmname,
+                    const char *confname, membuf_t *mb)
+{
+  char *tmpname;
+  char *pgmstamp, *confstamp;
+  estream_t fp;
+  void *data;
+  size_t datalen;
+  int okay;
+
+  data = get_membuf (mb, &datalen);
+  if (!data)
+    return;
+
+  tmpname = xasprintf ("%s.%u.tmp", cachename, (unsigned int)getpid ());
+  fp = es_fopen (tmpname, "wb");
+  if (!fp)
+    {
+      xfree (tmpname);
+      xfree (data);
+      return;
+    }
+
+  pgmstamp = schema_cache_stamp (pgmname);
+  confstamp = schema_cache_stamp (confname);
+  es_fprintf (fp, "gpgconf-cache:1:%s:%s:%s:", VERSION,
+              gc_percent_escape (pgmname), pgmstamp);
+  es_fprintf (fp, "%s:%s\n", gc_percent_escape (confname), confstamp);
+  es_fwrite (data, datalen, 1, fp);
+  okay = !es_ferror (fp);
+  if (es_fclose (fp))
+    okay = 0;
+  if (!okay || gnupg_rename_file (tmpname, cachename, NULL))
+    gnupg_remove (tmpname);
+
+  xfree (confstamp);
+  xfree (pgmstamp);
+  xfree (tmpname);
+  xfree (data);
+}
+
+
 /* Retrieve the options for the component COMPONENT from backend
  * BACKEND, which we already know is a program-type backend.  With
  * ONLY_INSTALLED set components which are not installed are silently
@@ -2109,6 +2301,9 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
   ssize_t length;
   estream_t config;
   char *config_filename;
+  char *cachename;
+  membuf_t cache_mb;
+  int from_cache;
 
   pgmname = (gc_backend[backend].module_name
              ? gnupg_module_name (gc_backend[backend].module_name)
@@ -2121,12 +2316,19 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
       return;  /* The component is not installed.  */
     }
 
-  err = gnupg_spawn_process (pgmname, argv, NULL, NULL, 0,
-                             NULL, &outfp, NULL, &pid);
-  if (err)
+  outfp = schema_cache_open (component, pgmname, &cachename);
+  from_cache = !!outfp;
+  if (!from_cache)
     {
-      gc_error (1, 0, "could not gather active options from '%s': %s",
-                pgmname, gpg_strerror (err));
+      err = gnupg_spawn_process (pgmname, argv, NULL, NULL, 0,
+                                 NULL, &outfp, NULL, &pid);
+      if (err)
+        {
+          gc_error (1, 0, "could not gather active options from '%s': %s",
+                    pgmname, gpg_strerror (err));
+        }
+      if (cachename)
+        init_membuf (&cache_mb, 4096);
     }
 
   while ((length = es_read_line (outfp, &line, &line_len, NULL)) > 0)
@@ -2136,6 +2338,9 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
       unsigned long flags = 0;
       char *default_value = NULL;
 
+      if (!from_cache && cachename)
+        put_membuf (&cache_mb, line, length);
+
       /* Strip newline and carriage return, if present.  */
       while (length > 0
 	     && (line[length - 1] == '\n' || line[length - 1] == '\r'))
@@ -2203,16 +2408,23 @@ retrieve_options_from_program (gc_component_t component, gc_backend_t backend,
   if (es_fclose (outfp))
     gc_error (1, errno, "error closing %s", pgmname);
 
-  err = gnupg_wait_process (pgmname, pid, 1, &exitcode);
-  if (err)
-    gc_error (1, 0, "running %s failed (exitcode=%d): %s",
-              pgmname, exitcode, gpg_strerror (err));
-  gnupg_release_process (pid);
+  if (!from_cache)
+    {
+      err = gnupg_wait_process (pgmname, pid, 1, &exitcode);
+      if (err)
+        gc_error (1, 0, "running %s failed (exitcode=%d): %s",
+                  pgmname, exitcode, gpg_strerror (err));
+      gnupg_release_process (pid);
+    }
 
 
   /* At this point, we can parse the configuration file.  */
   config_filename = get_config_filename (component, backend);
 
+  if (!from_cache && cachename)
+    schema_cache_store (cachename, pgmname, config_filename, &cache_mb);
+  xfree (cachename);
+
   config = es_fopen (config_filename, "r");
   if (!config)
     {
@@ -630,6 +630,7 @@ parse_message (FILE *fp)
   msg = rfc822parse_open (message_cb, &info);
   if (!msg)
     die ("can't open parser: %s", strerror (errno));
+  rfc822parse_set_streaming (msg);
 
   /* Fixme: We should not use fgets because it can't cope with
      embedded nul characters. */
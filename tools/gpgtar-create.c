@@ -25,6 +25,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <signal.h>
+#include <fcntl.h>
 #ifdef HAVE_W32_SYSTEM
 # define WIN32_LEAN_AND_MEAN
 # include <windows.h>
@@ -35,8 +37,9 @@
 #endif /*!HAVE_W32_SYSTEM*/
 #include <assert.h>
 
+#include "../common/util.h"
 #include "../common/i18n.h"
-#include "../common/exectool.h"
+#include "../common/exechelp.h"
 #include "../common/sysutils.h"
 #include "../common/ccparray.h"
 #include "gpgtar.h"
@@ -45,18 +48,25 @@
 #define lstat(a,b) stat ((a), (b))
 #endif
 
+/* The size of the buffer used to copy the files into the tarball; a
+   multiple of RECORDSIZE.  */
+#define COPYBUFSIZE (128 * RECORDSIZE)
 
-/* Object to control the file scanning.  */
+
+/* Object to control the file scanning.  It holds the entries of one
+   directory.  */
 struct scanctrl_s;
 typedef struct scanctrl_s *scanctrl_t;
 struct scanctrl_s
 {
   tar_header_t flist;
   tar_header_t *flist_tail;
-  int nestlevel;
 };
 
 
+static gpg_error_t write_file (estream_t stream, tar_header_t hdr);
+
+
 
 
 /* Given a fresh header object HDR with only the name field set, try
@@ -390,33 +400,55 @@ scan_directory (const char *dname, scanctrl_t scanctrl)
 }
 
 
+/* Release the entries of SCANCTRL.  */
+static void
+release_entries (scanctrl_t scanctrl)
+{
+  tar_header_t hdr;
+
+  while ((hdr = scanctrl->flist))
+    {
+      scanctrl->flist = hdr->next;
+      xfree (hdr);
+    }
+  scanctrl->flist_tail = &scanctrl->flist;
+}
+
+
+/* Write the entries of the directory DNAME to STREAM and then descend
+   into its subdirectories.  NESTLEVEL is the depth of DNAME.  Only
+   the entries of the directories on the current path are kept in
+   memory and thus the size of the tree does not matter.  The order of
+   the entries is the same as if all entries were collected first.  */
 static gpg_error_t
-scan_recursive (const char *dname, scanctrl_t scanctrl)
+scan_recursive (estream_t stream, const char *dname, int nestlevel)
 {
   gpg_error_t err = 0;
-  tar_header_t hdr, *start_tail, *stop_tail;
+  struct scanctrl_s scanctrl;
+  tar_header_t hdr;
 
-  if (scanctrl->nestlevel > 200)
+  if (nestlevel > 200)
     {
       log_error ("directories too deeply nested\n");
-      return gpg_error (GPG_ERR_RESOURCE_LIMIT);
+      return 0;  /* Skip the subtree.  */
     }
-  scanctrl->nestlevel++;
 
-  assert (scanctrl->flist_tail);
-  start_tail = scanctrl->flist_tail;
-  scan_directory (dname, scanctrl);
-  stop_tail = scanctrl->flist_tail;
-  hdr = *start_tail;
-  for (; hdr && hdr != *stop_tail; hdr = hdr->next)
+  memset (&scanctrl, 0, sizeof scanctrl);
+  scanctrl.flist_tail = &scanctrl.flist;
+  scan_directory (dname, &scanctrl);
+
+  for (hdr = scanctrl.flist; hdr && !err; hdr = hdr->next)
+    err = write_file (stream, hdr);
+
+  for (hdr = scanctrl.flist; hdr && !err; hdr = hdr->next)
     if (hdr->typeflag == TF_DIRECTORY)
       {
         if (opt.verbose > 1)
           log_info ("scanning directory '%s'\n", hdr->name);
-        scan_recursive (hdr->name, scanctrl);
+        err = scan_recursive (stream, hdr->name, nestlevel + 1);
       }
 
-  scanctrl->nestlevel--;
+  release_entries (&scanctrl);
   return err;
 }
 
@@ -654,10 +686,12 @@ build_header (void *record, tar_header_t hdr)
 static gpg_error_t
 write_file (estream_t stream, tar_header_t hdr)
 {
+  static char copybuf[COPYBUFSIZE];
   gpg_error_t err;
   char record[RECORDSIZE];
   estream_t infp;
-  size_t nread, nbytes;
+  size_t nread, nbytes, nwritten;
+  unsigned long long left;
   int any;
 
   err = build_header (record, hdr);
@@ -681,6 +715,8 @@ write_file (estream_t stream, tar_header_t hdr)
                      hdr->name, gpg_strerror (err));
           return err;
         }
+      /* We read large blocks; an extra buffer would only add a copy.  */
+      es_setvbuf (infp, NULL, _IONBF, 0);
     }
   else
     infp = NULL;
@@ -693,12 +729,10 @@ write_file (estream_t stream, tar_header_t hdr)
     {
       hdr->nrecords = (hdr->size + RECORDSIZE-1)/RECORDSIZE;
       any = 0;
-      while (hdr->nrecords--)
+      for (left = hdr->size; left; left -= nbytes)
         {
-          nbytes = hdr->nrecords? RECORDSIZE : (hdr->size % RECORDSIZE);
-          if (!nbytes)
-            nbytes = RECORDSIZE;
-          nread = es_fread (record, 1, nbytes, infp);
+          nbytes = left < COPYBUFSIZE? left : COPYBUFSIZE;
+          nread = es_fread (copybuf, 1, nbytes, infp);
           if (nread != nbytes)
             {
               err = gpg_error_from_syserror ();
@@ -708,9 +742,16 @@ write_file (estream_t stream, tar_header_t hdr)
               goto leave;
             }
           any = 1;
-          err = write_record (stream, record);
-          if (err)
-            goto leave;
+          /* Pad the last record with zeroes.  */
+          nwritten = (nbytes + RECORDSIZE - 1) / RECORDSIZE * RECORDSIZE;
+          memset (copybuf + nbytes, 0, nwritten - nbytes);
+          if (es_fwrite (copybuf, 1, nwritten, stream) != nwritten)
+            {
+              err = gpg_error_from_syserror ();
+              log_error ("error writing '%s': %s\n",
+                         es_fname_get (stream), gpg_strerror (err));
+              goto leave;
+            }
         }
       nread = es_fread (record, 1, 1, infp);
       if (nread)
@@ -742,25 +783,135 @@ write_eof_mark (estream_t stream)
 
 
 
+/* Start the gpg process to encrypt and/or sign what we write to the
+   stream stored at R_INFP.  The output of gpg goes to OUTSTREAM.  The
+   pid of the process is stored at R_PID.  */
+static gpg_error_t
+start_gpg (estream_t outstream, int encrypt, int sign,
+           estream_t *r_infp, pid_t *r_pid)
+{
+  gpg_error_t err;
+  strlist_t arg;
+  ccparray_t ccp;
+  const char **argv;
+  int filedes[2];
+
+  /* '--encrypt' may be combined with '--symmetric', but 'encrypt'
+     is set either way.  Clear it if no recipients are specified.
+     XXX: Fix command handling.  */
+  if (opt.symmetric && opt.recipients == NULL)
+    encrypt = 0;
+
+  ccparray_init (&ccp, 0);
+  if (encrypt)
+    ccparray_put (&ccp, "--encrypt");
+  if (sign)
+    ccparray_put (&ccp, "--sign");
+  if (opt.user)
+    {
+      ccparray_put (&ccp, "--local-user");
+      ccparray_put (&ccp, opt.user);
+    }
+  if (opt.symmetric)
+    ccparray_put (&ccp, "--symmetric");
+  for (arg = opt.recipients; arg; arg = arg->next)
+    {
+      ccparray_put (&ccp, "--recipient");
+      ccparray_put (&ccp, arg->d);
+    }
+  for (arg = opt.gpg_arguments; arg; arg = arg->next)
+    ccparray_put (&ccp, arg->d);
+
+  ccparray_put (&ccp, NULL);
+  argv = ccparray_get (&ccp, NULL);
+  if (!argv)
+    return gpg_error_from_syserror ();
+
+  err = gnupg_create_outbound_pipe (filedes, r_infp, 0);
+  if (err)
+    {
+      log_error ("error creating a pipe: %s\n", gpg_strerror (err));
+      xfree (argv);
+      return err;
+    }
+#ifdef F_SETPIPE_SZ
+  /* A larger pipe lets gpg and us switch less often.  */
+  fcntl (filedes[1], F_SETPIPE_SZ, 1024 * 1024);
+#endif
+
+#ifdef SIGPIPE
+  /* Get an error instead of being killed if gpg fails early.  */
+  signal (SIGPIPE, SIG_IGN);
+#endif
+
+  /* gpg writes directly to our output.  */
+  es_fflush (outstream);
+  err = gnupg_spawn_process_fd (opt.gpg_program, argv, filedes[0],
+                                es_fileno (outstream), es_fileno (es_stderr),
+                                r_pid);
+  close (filedes[0]);
+  xfree (argv);
+  if (err)
+    {
+      log_error ("error running '%s': %s\n",
+                 opt.gpg_program, gpg_strerror (err));
+      es_fclose (*r_infp);
+      *r_infp = NULL;
+    }
+  return err;
+}
+
+
 /* Create a new tarball using the names in the array INPATTERN.  If
    INPATTERN is NULL take the pattern as null terminated strings from
-   stdin.  */
+   stdin.  The entries are written while the directories are scanned
+   and when encrypting or signing, gpg reads the tarball from a pipe;
+   thus neither the list of all files nor the tarball needs to be kept
+   in memory.  */
 gpg_error_t
 gpgtar_create (char **inpattern, int encrypt, int sign)
 {
   gpg_error_t err = 0;
-  struct scanctrl_s scanctrl_buffer;
-  scanctrl_t scanctrl = &scanctrl_buffer;
-  tar_header_t hdr, *start_tail;
+  struct scanctrl_s scanctrl;
   estream_t outstream = NULL;
   estream_t cipher_stream = NULL;
+  pid_t pid = (pid_t)(-1);
   int eof_seen = 0;
 
   if (!inpattern)
     es_set_binary (es_stdin);
 
-  memset (scanctrl, 0, sizeof *scanctrl);
-  scanctrl->flist_tail = &scanctrl->flist;
+  memset (&scanctrl, 0, sizeof scanctrl);
+  scanctrl.flist_tail = &scanctrl.flist;
+
+  if (opt.outfile)
+    {
+      if (!strcmp (opt.outfile, "-"))
+        outstream = es_stdout;
+      else
+        outstream = es_fopen (opt.outfile, "wb");
+      if (!outstream)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+  else
+    {
+      outstream = es_stdout;
+    }
+
+  if (outstream == es_stdout)
+    es_set_binary (es_stdout);
+
+  if (encrypt || sign)
+    {
+      cipher_stream = outstream;
+      outstream = NULL;
+      err = start_gpg (cipher_stream, encrypt, sign, &outstream, &pid);
+      if (err)
+        goto leave;
+    }
 
   while (!eof_seen)
     {
@@ -838,104 +989,38 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
       if (opt.verbose > 1)
         log_info ("scanning '%s'\n", pat);
 
-      start_tail = scanctrl->flist_tail;
       if (skip_this || !pattern_valid_p (pat))
         log_error ("skipping invalid name '%s'\n", pat);
-      else if (!add_entry (pat, NULL, scanctrl)
-               && *start_tail && ((*start_tail)->typeflag & TF_DIRECTORY))
-        scan_recursive (pat, scanctrl);
-
-      xfree (pat);
-    }
-
-  if (opt.outfile)
-    {
-      if (!strcmp (opt.outfile, "-"))
-        outstream = es_stdout;
-      else
-        outstream = es_fopen (opt.outfile, "wb");
-      if (!outstream)
+      else if (!add_entry (pat, NULL, &scanctrl) && scanctrl.flist)
         {
-          err = gpg_error_from_syserror ();
-          goto leave;
+          err = write_file (outstream, scanctrl.flist);
+          if (!err && (scanctrl.flist->typeflag & TF_DIRECTORY))
+            err = scan_recursive (outstream, pat, 1);
         }
-    }
-  else
-    {
-      outstream = es_stdout;
-    }
+      release_entries (&scanctrl);
 
-  if (outstream == es_stdout)
-    es_set_binary (es_stdout);
-
-  if (encrypt || sign)
-    {
-      cipher_stream = outstream;
-      outstream = es_fopenmem (0, "rwb");
-      if (! outstream)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
-    }
-
-  for (hdr = scanctrl->flist; hdr; hdr = hdr->next)
-    {
-      err = write_file (outstream, hdr);
+      xfree (pat);
       if (err)
         goto leave;
     }
+
   err = write_eof_mark (outstream);
   if (err)
     goto leave;
 
   if (encrypt || sign)
     {
-      strlist_t arg;
-      ccparray_t ccp;
-      const char **argv;
-
-      err = es_fseek (outstream, 0, SEEK_SET);
+      /* Close the pipe so that gpg sees the end of the tarball.  */
+      err = es_fclose (outstream);
+      outstream = NULL;
       if (err)
-        goto leave;
-
-      /* '--encrypt' may be combined with '--symmetric', but 'encrypt'
-         is set either way.  Clear it if no recipients are specified.
-         XXX: Fix command handling.  */
-      if (opt.symmetric && opt.recipients == NULL)
-        encrypt = 0;
-
-      ccparray_init (&ccp, 0);
-      if (encrypt)
-        ccparray_put (&ccp, "--encrypt");
-      if (sign)
-        ccparray_put (&ccp, "--sign");
-      if (opt.user)
-        {
-          ccparray_put (&ccp, "--local-user");
-          ccparray_put (&ccp, opt.user);
-        }
-      if (opt.symmetric)
-        ccparray_put (&ccp, "--symmetric");
-      for (arg = opt.recipients; arg; arg = arg->next)
-        {
-          ccparray_put (&ccp, "--recipient");
-          ccparray_put (&ccp, arg->d);
-        }
-      for (arg = opt.gpg_arguments; arg; arg = arg->next)
-        ccparray_put (&ccp, arg->d);
-
-      ccparray_put (&ccp, NULL);
-      argv = ccparray_get (&ccp, NULL);
-      if (!argv)
         {
           err = gpg_error_from_syserror ();
           goto leave;
         }
-
-      err = gnupg_exec_tool_stream (opt.gpg_program, argv,
-                                    outstream, NULL, cipher_stream, NULL, NULL);
-      xfree (argv);
+      err = gnupg_wait_process (opt.gpg_program, pid, 1, NULL);
+      gnupg_release_process (pid);
+      pid = (pid_t)(-1);
       if (err)
         goto leave;
     }
@@ -943,15 +1028,15 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
  leave:
   if (!err)
     {
-      gpg_error_t first_err;
-      if (outstream != es_stdout)
+      gpg_error_t first_err = 0;
+      if (outstream && outstream != es_stdout)
         first_err = es_fclose (outstream);
-      else
+      else if (outstream)
         first_err = es_fflush (outstream);
       outstream = NULL;
-      if (cipher_stream != es_stdout)
+      if (cipher_stream && cipher_stream != es_stdout)
         err = es_fclose (cipher_stream);
-      else
+      else if (cipher_stream)
         err = es_fflush (cipher_stream);
       cipher_stream = NULL;
       if (! err)
@@ -965,14 +1050,15 @@ gpgtar_create (char **inpattern, int encrypt, int sign)
         es_fclose (outstream);
       if (cipher_stream && cipher_stream != es_stdout)
         es_fclose (cipher_stream);
+      if (pid != (pid_t)(-1))
+        {
+          gnupg_kill_process (pid);
+          gnupg_wait_process (opt.gpg_program, pid, 1, NULL);
+          gnupg_release_process (pid);
+        }
       if (opt.outfile)
         gnupg_remove (opt.outfile);
     }
-  scanctrl->flist_tail = NULL;
-  while ( (hdr = scanctrl->flist) )
-    {
-      scanctrl->flist = hdr->next;
-      xfree (hdr);
-    }
+  release_entries (&scanctrl);
   return err;
 }
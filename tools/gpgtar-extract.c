@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "../common/i18n.h"
 #include "../common/exectool.h"
@@ -34,12 +35,298 @@
 #include "gpgtar.h"
 
 
+/* With --threads the regular files up to WRITE_BEHIND_MAX_FILE bytes
+   are read into memory and written by a pool of threads while the
+   main thread continues with the next entries.  Restoring many small
+   files is limited by the file creation and not by the reading of
+   the archive; on most file systems several files can be created at
+   the same time.  The directories and large files are still written
+   by the main thread.  At most WRITE_BEHIND_MAX_JOBS files with at
+   most WRITE_BEHIND_MAX_BYTES bytes are queued.  */
+#define WRITE_BEHIND_MAX_FILE  (1024 * 1024)
+#define WRITE_BEHIND_MAX_BYTES (64 * 1024 * 1024)
+#define WRITE_BEHIND_MAX_JOBS  256
+
+/* A file to be written by a thread.  */
+struct write_job_s
+{
+  struct write_job_s *next;
+  int running;    /* A thread is writing this file.  */
+  char *fname;    /* The file to create.  */
+  size_t length;  /* The length of DATA.  */
+  char data[1];   /* The content of the file.  */
+};
+typedef struct write_job_s *write_job_t;
+
+/* The state of the write-behind threads.  */
+static struct
+{
+  /* Lock and condition protecting the fields below.  The condition is
+     signaled whenever a job has been queued or finished.  */
+  npth_mutex_t lock;
+  npth_cond_t cond;
+
+  /* The queued and running jobs in the order of the archive.  */
+  write_job_t jobs;
+  write_job_t *jobs_tail;
+  unsigned int njobs;
+  size_t nbytes;
+
+  /* The first error of a job.  */
+  gpg_error_t err;
+
+  /* Set to request all threads to terminate.  */
+  int stop;
+
+  int nthreads;
+  npth_t threads[MAX_GPGTAR_THREADS];
+} write_behind;
+
+
+/* Write DATA of LENGTH to the new file FNAME.  This is called by the
+   threads without holding the nPth lock and thus must not log
+   anything.  */
 static gpg_error_t
-extract_regular (estream_t stream, const char *dirname,
+write_behind_write_file (const char *fname, const char *data, size_t length)
+{
+  gpg_error_t err = 0;
+  estream_t outfp;
+
+  outfp = es_fopen (fname, "wb");
+  if (!outfp)
+    return gpg_error_from_syserror ();
+  if (length && es_fwrite (data, 1, length, outfp) != length)
+    err = gpg_error_from_syserror ();
+  if (es_fclose (outfp) && !err)
+    err = gpg_error_from_syserror ();
+  if (err)
+    gnupg_remove (fname);
+  return err;
+}
+
+
+/* The thread function of the write-behind threads.  */
+static void *
+write_behind_thread (void *arg)
+{
+  write_job_t job, *jobp;
+  gpg_error_t err;
+
+  (void)arg;
+
+  npth_mutex_lock (&write_behind.lock);
+  for (;;)
+    {
+      for (job = write_behind.jobs; job && job->running; job = job->next)
+        ;
+      if (!job)
+        {
+          if (write_behind.stop)
+            break;
+          npth_cond_wait (&write_behind.cond, &write_behind.lock);
+          continue;
+        }
+      job->running = 1;
+      npth_mutex_unlock (&write_behind.lock);
+
+      npth_unprotect ();
+      err = write_behind_write_file (job->fname, job->data, job->length);
+      npth_protect ();
+
+      if (err)
+        log_error ("error writing '%s': %s\n", job->fname, gpg_strerror (err));
+      else if (opt.verbose)
+        log_info ("extracted '%s'\n", job->fname);
+
+      npth_mutex_lock (&write_behind.lock);
+      if (err && !write_behind.err)
+        write_behind.err = err;
+      for (jobp = &write_behind.jobs; *jobp != job; jobp = &(*jobp)->next)
+        ;
+      *jobp = job->next;
+      if (write_behind.jobs_tail == &job->next)
+        write_behind.jobs_tail = jobp;
+      write_behind.njobs--;
+      write_behind.nbytes -= job->length;
+      npth_cond_broadcast (&write_behind.cond);
+      xfree (job->fname);
+      xfree (job);
+    }
+  npth_mutex_unlock (&write_behind.lock);
+  return NULL;
+}
+
+
+/* Start the write-behind threads as requested by --threads.  If no
+   thread can be started the files are written by the main thread.  */
+static void
+write_behind_start (void)
+{
+  static int npth_initialized;
+  npth_attr_t tattr;
+  int i;
+
+  if (opt.threads < 2 || opt.dry_run)
+    return;
+
+  if (!npth_initialized)
+    {
+      npth_initialized = 1;
+      npth_init ();
+    }
+
+  npth_mutex_init (&write_behind.lock, NULL);
+  npth_cond_init (&write_behind.cond, NULL);
+  write_behind.jobs = NULL;
+  write_behind.jobs_tail = &write_behind.jobs;
+  write_behind.njobs = 0;
+  write_behind.nbytes = 0;
+  write_behind.err = 0;
+  write_behind.stop = 0;
+  write_behind.nthreads = 0;
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (i=0; i < opt.threads && i < MAX_GPGTAR_THREADS; i++)
+    {
+      if (npth_create (&write_behind.threads[i], &tattr,
+                       write_behind_thread, NULL))
+        {
+          log_info ("error creating thread: %s\n",
+                    gpg_strerror (gpg_error_from_syserror ()));
+          break;
+        }
+      write_behind.nthreads++;
+    }
+  npth_attr_destroy (&tattr);
+}
+
+
+/* Return true if a file FNAME is queued or being written.  Must be
+   called with the lock held.  */
+static int
+write_behind_pending_p (const char *fname)
+{
+  write_job_t job;
+
+  for (job = write_behind.jobs; job; job = job->next)
+    if (!strcmp (job->fname, fname))
+      return 1;
+  return 0;
+}
+
+
+/* Wait until the queued file FNAME, if any, has been written.  This
+   is required before the main thread writes a file of the same name
+   because the later entry of the archive shall win.  */
+static gpg_error_t
+write_behind_wait (const char *fname)
+{
+  gpg_error_t err;
+
+  if (!write_behind.nthreads)
+    return 0;
+
+  npth_mutex_lock (&write_behind.lock);
+  while (write_behind_pending_p (fname))
+    npth_cond_wait (&write_behind.cond, &write_behind.lock);
+  err = write_behind.err;
+  npth_mutex_unlock (&write_behind.lock);
+  return err;
+}
+
+
+/* Queue the file FNAME with the content read from RR as described by
+   HDR.  FNAME is taken over.  */
+static gpg_error_t
+write_behind_queue (record_reader_t rr, char *fname, tar_header_t hdr)
+{
+  gpg_error_t err;
+  write_job_t job;
+  const char *record;
+  size_t n;
+
+  job = xtrymalloc (sizeof *job + hdr->nrecords * RECORDSIZE);
+  if (!job)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (fname);
+      return err;
+    }
+  job->next = NULL;
+  job->running = 0;
+  job->fname = fname;
+  job->length = hdr->size;
+  for (n=0; n < hdr->nrecords; n++)
+    {
+      err = record_reader_next (rr, &record);
+      if (err)
+        {
+          xfree (job->fname);
+          xfree (job);
+          return err;
+        }
+      memcpy (job->data + n * RECORDSIZE, record, RECORDSIZE);
+    }
+
+  npth_mutex_lock (&write_behind.lock);
+  while (!write_behind.err
+         && write_behind.njobs
+         && (write_behind.njobs >= WRITE_BEHIND_MAX_JOBS
+             || write_behind.nbytes + job->length > WRITE_BEHIND_MAX_BYTES
+             || write_behind_pending_p (fname)))
+    npth_cond_wait (&write_behind.cond, &write_behind.lock);
+  err = write_behind.err;
+  if (!err)
+    {
+      *write_behind.jobs_tail = job;
+      write_behind.jobs_tail = &job->next;
+      write_behind.njobs++;
+      write_behind.nbytes += job->length;
+      npth_cond_signal (&write_behind.cond);
+      job = NULL;
+    }
+  npth_mutex_unlock (&write_behind.lock);
+  if (job)
+    {
+      xfree (job->fname);
+      xfree (job);
+    }
+  return err;
+}
+
+
+/* Wait for all queued files and stop the threads.  Returns the first
+   error of a job.  */
+static gpg_error_t
+write_behind_finish (void)
+{
+  int i;
+
+  if (!write_behind.nthreads)
+    return 0;
+
+  npth_mutex_lock (&write_behind.lock);
+  write_behind.stop = 1;
+  npth_cond_broadcast (&write_behind.cond);
+  npth_mutex_unlock (&write_behind.lock);
+
+  for (i=0; i < write_behind.nthreads; i++)
+    npth_join (write_behind.threads[i], NULL);
+  write_behind.nthreads = 0;
+
+  npth_cond_destroy (&write_behind.cond);
+  npth_mutex_destroy (&write_behind.lock);
+  return write_behind.err;
+}
+
+
+static gpg_error_t
+extract_regular (record_reader_t rr, const char *dirname,
                  tar_header_t hdr)
 {
   gpg_error_t err;
-  char record[RECORDSIZE];
+  const char *record;
   size_t n, nbytes, nwritten;
   char *fname;
   estream_t outfp = NULL;
@@ -54,6 +341,13 @@ extract_regular (estream_t stream, const char *dirname,
   else
     err = 0;
 
+  if (write_behind.nthreads && hdr->size <= WRITE_BEHIND_MAX_FILE)
+    return write_behind_queue (rr, fname, hdr);
+
+  err = write_behind_wait (fname);
+  if (err)
+    goto leave;
+
   if (opt.dry_run)
     outfp = es_fopenmem (0, "wb");
   else
@@ -67,7 +361,7 @@ extract_regular (estream_t stream, const char *dirname,
 
   for (n=0; n < hdr->nrecords;)
     {
-      err = read_record (stream, record);
+      err = record_reader_next (rr, &record);
       if (err)
         goto leave;
       n++;
@@ -163,7 +457,7 @@ extract_directory (const char *dirname, tar_header_t hdr)
 
 
 static gpg_error_t
-extract (estream_t stream, const char *dirname, tar_header_t hdr)
+extract (record_reader_t rr, const char *dirname, tar_header_t hdr)
 {
   gpg_error_t err;
   size_t n;
@@ -190,17 +484,14 @@ extract (estream_t stream, const char *dirname, tar_header_t hdr)
     }
 
   if (hdr->typeflag == TF_REGULAR || hdr->typeflag == TF_UNKNOWN)
-    err = extract_regular (stream, dirname, hdr);
+    err = extract_regular (rr, dirname, hdr);
   else if (hdr->typeflag == TF_DIRECTORY)
     err = extract_directory (dirname, hdr);
   else
     {
-      char record[RECORDSIZE];
-
       log_info ("unsupported file type %d for '%s' - skipped\n",
                 (int)hdr->typeflag, hdr->name);
-      for (err = 0, n=0; !err && n < hdr->nrecords; n++)
-        err = read_record (stream, record);
+      err = record_reader_skip (rr, hdr->nrecords);
     }
   return err;
 }
@@ -279,6 +570,7 @@ gpgtar_extract (const char *filename, int decrypt)
   gpg_error_t err;
   estream_t stream;
   estream_t cipher_stream = NULL;
+  record_reader_t rr = NULL;
   tar_header_t header = NULL;
   const char *dirprefix = NULL;
   char *dirname = NULL;
@@ -376,13 +668,19 @@ gpgtar_extract (const char *filename, int decrypt)
   if (opt.verbose)
     log_info ("extracting to '%s/'\n", dirname);
 
+  /* All data is extracted and thus there is no need to seek.  */
+  err = record_reader_new (stream, (off_t)(-1), &rr);
+  if (err)
+    goto leave;
+
+  write_behind_start ();
   for (;;)
     {
-      err = gpgtar_read_header (stream, &header);
+      err = gpgtar_read_header (rr, &header);
       if (err || header == NULL)
         goto leave;
 
-      err = extract (stream, dirname, header);
+      err = extract (rr, dirname, header);
       if (err)
         goto leave;
       xfree (header);
@@ -391,7 +689,13 @@ gpgtar_extract (const char *filename, int decrypt)
 
 
  leave:
+  {
+    gpg_error_t err2 = write_behind_finish ();
+    if (!err)
+      err = err2;
+  }
   xfree (header);
+  record_reader_release (rr);
   xfree (dirname);
   if (stream != es_stdin)
     es_fclose (stream);
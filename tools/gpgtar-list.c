@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "../common/i18n.h"
 #include "gpgtar.h"
@@ -174,13 +176,13 @@ parse_header (const void *record, const char *filename)
    consumed, R_HEADER is set to NULL.  In case of an error an error
    message has been printed.  */
 static gpg_error_t
-read_header (estream_t stream, tar_header_t *r_header)
+read_header (record_reader_t rr, tar_header_t *r_header)
 {
   gpg_error_t err;
-  char record[RECORDSIZE];
+  const char *record;
   int i;
 
-  err = read_record (stream, record);
+  err = record_reader_next (rr, &record);
   if (err)
     return err;
 
@@ -190,7 +192,7 @@ read_header (estream_t stream, tar_header_t *r_header)
     {
       /* All zero header - check whether it is the first part of an
          end of archive mark.  */
-      err = read_record (stream, record);
+      err = record_reader_next (rr, &record);
       if (err)
         return err;
 
@@ -198,7 +200,7 @@ read_header (estream_t stream, tar_header_t *r_header)
         ;
       if (i != RECORDSIZE)
         log_info ("%s: warning: skipping empty header\n",
-                  es_fname_get (stream));
+                  record_reader_fname (rr));
       else
         {
           /* End of archive - FIXME: we might want to check for garbage.  */
@@ -207,30 +209,11 @@ read_header (estream_t stream, tar_header_t *r_header)
         }
     }
 
-  *r_header = parse_header (record, es_fname_get (stream));
+  *r_header = parse_header (record, record_reader_fname (rr));
   return *r_header ? 0 : gpg_error_from_syserror ();
 }
 
 
-/* Skip the data records according to HEADER.  Prints an error message
-   on error and return -1. */
-static int
-skip_data (estream_t stream, tar_header_t header)
-{
-  char record[RECORDSIZE];
-  unsigned long long n;
-
-  for (n=0; n < header->nrecords; n++)
-    {
-      if (read_record (stream, record))
-        return -1;
-    }
-
-  return 0;
-}
-
-
-
 static void
 print_header (tar_header_t header, estream_t out)
 {
@@ -278,6 +261,9 @@ gpgtar_list (const char *filename, int decrypt)
   estream_t stream;
   estream_t cipher_stream = NULL;
   tar_header_t header = NULL;
+  record_reader_t rr = NULL;
+  off_t length = (off_t)(-1);
+  struct stat st;
 
   if (filename)
     {
@@ -332,20 +318,29 @@ gpgtar_list (const char *filename, int decrypt)
       if (err)
         goto leave;
 
+      length = es_ftello (stream);
       err = es_fseek (stream, 0, SEEK_SET);
       if (err)
         goto leave;
     }
+  else if (stream != es_stdin
+           && !fstat (es_fileno (stream), &st) && S_ISREG (st.st_mode))
+    length = st.st_size;
+
+  err = record_reader_new (stream, length, &rr);
+  if (err)
+    goto leave;
 
   for (;;)
     {
-      err = read_header (stream, &header);
+      err = read_header (rr, &header);
       if (err || header == NULL)
         goto leave;
 
       print_header (header, es_stdout);
 
-      if (skip_data (stream, header))
+      err = record_reader_skip (rr, header->nrecords);
+      if (err)
         goto leave;
       xfree (header);
       header = NULL;
@@ -354,6 +349,7 @@ gpgtar_list (const char *filename, int decrypt)
 
  leave:
   xfree (header);
+  record_reader_release (rr);
   if (stream != es_stdin)
     es_fclose (stream);
   if (stream != cipher_stream)
@@ -362,9 +358,9 @@ gpgtar_list (const char *filename, int decrypt)
 }
 
 gpg_error_t
-gpgtar_read_header (estream_t stream, tar_header_t *r_header)
+gpgtar_read_header (record_reader_t rr, tar_header_t *r_header)
 {
-  return read_header (stream, r_header);
+  return read_header (rr, r_header);
 }
 
 void
@@ -76,6 +76,7 @@ enum cmd_and_opt_values
     /* Compatibility with gpg-zip.  */
     oGpgArgs,
     oTarArgs,
+    oThreads,
 
     /* Debugging.  */
     oDryRun,
@@ -108,6 +109,8 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_s (oSetFilename, "set-filename", "@"),
   ARGPARSE_s_n (oOpenPGP, "openpgp", "@"),
   ARGPARSE_s_n (oCMS, "cms", "@"),
+  ARGPARSE_s_i (oThreads, "threads",
+                N_("|N|write up to N files at the same time")),
 
   ARGPARSE_group (302, N_("@\nTar options:\n ")),
 
@@ -394,6 +397,14 @@ parse_arguments (ARGPARSE_ARGS *pargs, ARGPARSE_OPTS *popts)
           }
           break;
 
+        case oThreads:
+          opt.threads = pargs->r.ret_int;
+          if (opt.threads < 0)
+            opt.threads = 0;
+          else if (opt.threads > MAX_GPGTAR_THREADS)
+            opt.threads = MAX_GPGTAR_THREADS;
+          break;
+
         case oDryRun:
           opt.dry_run = 1;
           break;
@@ -505,33 +516,154 @@ main (int argc, char **argv)
 }
 
 
-/* Read the next record from STREAM.  RECORD is a buffer provided by
-   the caller and must be at leadt of size RECORDSIZE.  The function
-   return 0 on success and error code on failure; a diagnostic
-   printed as well.  Note that there is no need for an EOF indicator
-   because a tarball has an explicit EOF record. */
+/* The object used by the record_reader functions.  */
+struct record_reader_s
+{
+  estream_t stream;  /* The stream to read from.  */
+  off_t length;      /* Length of a seekable stream or -1.  */
+  off_t nread;       /* Number of bytes read from STREAM.  */
+  size_t start;      /* Offset of the next record in BUFFER.  */
+  size_t end;        /* Number of valid bytes in BUFFER.  */
+  char buffer[128 * RECORDSIZE];
+};
+
+
+/* Create a new reader for the records of the tarball STREAM and
+   store it at R_READER.  If LENGTH is not -1, STREAM is seekable and
+   LENGTH gives the number of bytes from the current position to its
+   end; this allows to skip data by seeking.  The reader does its own
+   buffering and thus STREAM is switched to unbuffered mode; STREAM
+   must not be used directly while the reader is in use.  */
 gpg_error_t
-read_record (estream_t stream, void *record)
+record_reader_new (estream_t stream, off_t length, record_reader_t *r_reader)
+{
+  record_reader_t rr;
+
+  *r_reader = NULL;
+  rr = xtrymalloc (sizeof *rr);
+  if (!rr)
+    return gpg_error_from_syserror ();
+  rr->stream = stream;
+  rr->length = length;
+  rr->nread = 0;
+  rr->start = rr->end = 0;
+  es_setvbuf (stream, NULL, _IONBF, 0);
+  *r_reader = rr;
+  return 0;
+}
+
+
+/* Release the reader RR.  The stream is not closed.  */
+void
+record_reader_release (record_reader_t rr)
+{
+  xfree (rr);
+}
+
+
+/* Return the name of the stream of RR for use in diagnostics.  */
+const char *
+record_reader_fname (record_reader_t rr)
+{
+  return es_fname_get (rr->stream);
+}
+
+
+/* Read the next record from RR and store a pointer to it at R_RECORD.
+   The record has a size of RECORDSIZE and is valid until the next
+   call of a record_reader function.  The function return 0 on
+   success and error code on failure; a diagnostic printed as well.
+   Note that there is no need for an EOF indicator because a tarball
+   has an explicit EOF record. */
+gpg_error_t
+record_reader_next (record_reader_t rr, const char **r_record)
 {
   gpg_error_t err;
-  size_t nread;
+  size_t n, nread;
 
-  nread = es_fread (record, 1, RECORDSIZE, stream);
-  if (nread != RECORDSIZE)
+  if (rr->end - rr->start < RECORDSIZE)
     {
-      err = gpg_error_from_syserror ();
-      if (es_ferror (stream))
-        log_error ("error reading '%s': %s\n",
-                   es_fname_get (stream), gpg_strerror (err));
-      else
-        log_error ("error reading '%s': premature EOF "
-                   "(size of last record: %zu)\n",
-                   es_fname_get (stream), nread);
+      n = rr->end - rr->start;
+      if (n)
+        memmove (rr->buffer, rr->buffer + rr->start, n);
+      rr->start = 0;
+      rr->end = n;
+      do
+        {
+          if (es_read (rr->stream, rr->buffer + rr->end,
+                       sizeof rr->buffer - rr->end, &nread))
+            {
+              err = gpg_error_from_syserror ();
+              log_error ("error reading '%s': %s\n",
+                         es_fname_get (rr->stream), gpg_strerror (err));
+              return err;
+            }
+          rr->end += nread;
+          rr->nread += nread;
+        }
+      while (nread && rr->end < RECORDSIZE);
+
+      if (rr->end < RECORDSIZE)
+        {
+          log_error ("error reading '%s': premature EOF "
+                     "(size of last record: %zu)\n",
+                     es_fname_get (rr->stream), rr->end);
+          return gpg_error (GPG_ERR_EOF);
+        }
     }
-  else
-    err = 0;
 
-  return err;
+  *r_record = rr->buffer + rr->start;
+  rr->start += RECORDSIZE;
+  return 0;
+}
+
+
+/* Skip the next NRECORDS records of RR.  If the stream is seekable
+   the records which are not yet buffered are skipped by seeking
+   instead of reading them.  If the stream is too short the records
+   are read to get the usual diagnostic.  */
+gpg_error_t
+record_reader_skip (record_reader_t rr, unsigned long long nrecords)
+{
+  gpg_error_t err;
+  const char *record;
+  size_t n;
+
+  n = (rr->end - rr->start) / RECORDSIZE;
+  if (n > nrecords)
+    n = nrecords;
+  rr->start += n * RECORDSIZE;
+  nrecords -= n;
+  if (!nrecords)
+    return 0;
+
+  if (rr->length != (off_t)(-1)
+      && rr->nread <= rr->length
+      && nrecords <= (unsigned long long)(rr->length - rr->nread) / RECORDSIZE)
+    {
+      /* The buffer now holds less than a record; this is the start of
+         the data to skip.  */
+      if (es_fseeko (rr->stream,
+                     (off_t)(nrecords * RECORDSIZE)
+                     - (off_t)(rr->end - rr->start), SEEK_CUR))
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error seeking in '%s': %s\n",
+                     es_fname_get (rr->stream), gpg_strerror (err));
+          return err;
+        }
+      rr->nread += nrecords * RECORDSIZE - (rr->end - rr->start);
+      rr->start = rr->end = 0;
+      return 0;
+    }
+
+  for (; nrecords; nrecords--)
+    {
+      err = record_reader_next (rr, &record);
+      if (err)
+        return err;
+    }
+  return 0;
 }
 
 
@@ -38,9 +38,14 @@ struct
   int symmetric;
   const char *filename;
   const char *directory;
+  int threads;
 } opt;
 
 
+/* The maximum number of threads for --threads.  */
+#define MAX_GPGTAR_THREADS 32
+
+
 /* The size of a tar record.  All IO is done in chunks of this size.
    Note that we don't care about blocking because this version of tar
    is not expected to be used directly on a tape drive in fact it is
@@ -114,8 +119,19 @@ struct tar_header_s
 };
 
 
+/* A buffered reader for the records of a tarball.  */
+struct record_reader_s;
+typedef struct record_reader_s *record_reader_t;
+
+
 /*-- gpgtar.c --*/
-gpg_error_t read_record (estream_t stream, void *record);
+gpg_error_t record_reader_new (estream_t stream, off_t length,
+                               record_reader_t *r_reader);
+void record_reader_release (record_reader_t rr);
+const char *record_reader_fname (record_reader_t rr);
+gpg_error_t record_reader_next (record_reader_t rr, const char **r_record);
+gpg_error_t record_reader_skip (record_reader_t rr,
+                                unsigned long long nrecords);
 gpg_error_t write_record (estream_t stream, const void *record);
 
 /*-- gpgtar-create.c --*/
@@ -126,7 +142,7 @@ gpg_error_t gpgtar_extract (const char *filename, int decrypt);
 
 /*-- gpgtar-list.c --*/
 gpg_error_t gpgtar_list (const char *filename, int decrypt);
-gpg_error_t gpgtar_read_header (estream_t stream, tar_header_t *r_header);
+gpg_error_t gpgtar_read_header (record_reader_t rr, tar_header_t *r_header);
 void gpgtar_print_header (tar_header_t header, estream_t out);
 
 
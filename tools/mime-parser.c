@@ -28,6 +28,15 @@
 #include "mime-parser.h"
 
 
+/* The maximum length of a line without the LF.  Longer lines are
+ * split.  */
+#define MAX_LINELEN 4999
+
+/* The size of the read buffer.  This must be larger than
+ * MAX_LINELEN.  */
+#define READBUFSIZE 32768
+
+
 enum pgpmime_states
   {
     PGPMIME_NONE = 0,
@@ -95,8 +104,15 @@ struct mime_parser_context_s
 
   struct b64state *b64state;     /* NULL or malloced Base64 decoder state.  */
 
-  /* A buffer for reading a mail line,  */
-  char line[5000];
+  /* The buffer for reading the mail.  The lines are passed to the
+   * rfc822 parser and the callbacks directly from here.  */
+  struct {
+    size_t pos;          /* Offset of the next line.  */
+    size_t len;          /* Number of valid bytes.  */
+    int saved;           /* The char overwritten by a split or -1.  */
+    unsigned int eof:1;  /* EOF or read error seen.  */
+    char data[READBUFSIZE];
+  } buf;
 };
 
 
@@ -671,6 +687,77 @@ process_part_data (mime_parser_t ctx, char *line, size_t *length)
 }
 
 
+/* Helper for mime_parser_parse to get the next line from FP.  The
+ * line is stored without the LF at R_LINE and its length at R_LENGTH.
+ * R_LINE points into the read buffer; it is Nul terminated, may be
+ * modified by the caller and is valid until the next call.  Lines
+ * may contain Nul characters.  If the line was not terminated by a LF
+ * true is stored at R_NOLF.  Returns GPG_ERR_EOF at the end of the
+ * message.  */
+static gpg_error_t
+next_line (mime_parser_t ctx, estream_t fp,
+           char **r_line, size_t *r_length, int *r_nolf)
+{
+  char *start, *p;
+  size_t n, nread;
+
+  if (ctx->buf.saved != -1)
+    {
+      ctx->buf.data[ctx->buf.pos] = ctx->buf.saved;
+      ctx->buf.saved = -1;
+    }
+
+  for (;;)
+    {
+      start = ctx->buf.data + ctx->buf.pos;
+      n = ctx->buf.len - ctx->buf.pos;
+      p = memchr (start, '\n', n > MAX_LINELEN? MAX_LINELEN + 1 : n);
+      if (p)
+        {
+          *p = 0;
+          *r_line = start;
+          *r_length = p - start;
+          *r_nolf = 0;
+          ctx->buf.pos += p - start + 1;
+          return 0;
+        }
+      if (n > MAX_LINELEN)
+        {
+          /* Too long - split the line.  */
+          ctx->buf.saved = (unsigned char)start[MAX_LINELEN];
+          start[MAX_LINELEN] = 0;
+          *r_line = start;
+          *r_length = MAX_LINELEN;
+          *r_nolf = 1;
+          ctx->buf.pos += MAX_LINELEN;
+          return 0;
+        }
+      if (ctx->buf.eof)
+        {
+          if (!n)
+            return gpg_error (GPG_ERR_EOF);
+          start[n] = 0;  /* There is always room for the Nul.  */
+          *r_line = start;
+          *r_length = n;
+          *r_nolf = 1;
+          ctx->buf.pos += n;
+          return 0;
+        }
+
+      /* Move the partial line to the front and read more.  */
+      memmove (ctx->buf.data, start, n);
+      ctx->buf.pos = 0;
+      ctx->buf.len = n;
+      if (es_read (fp, ctx->buf.data + n, sizeof ctx->buf.data - 1 - n,
+                   &nread))
+        return gpg_error_from_syserror ();
+      if (!nread)
+        ctx->buf.eof = 1;
+      ctx->buf.len += nread;
+    }
+}
+
+
 /* Read and parse a message from FP and call the appropriate
  * callbacks.  */
 gpg_error_t
@@ -679,10 +766,9 @@ mime_parser_parse (mime_parser_t ctx, estream_t fp)
   gpg_error_t err;
   rfc822parse_t msg = NULL;
   unsigned int lineno = 0;
-  size_t length;
-  char *line;
-
-  line = ctx->line;
+  size_t length = 0;
+  char *line = NULL;
+  int nolf = 0;
 
   msg = rfc822parse_open (parse_message_cb, ctx);
   if (!msg)
@@ -691,19 +777,20 @@ mime_parser_parse (mime_parser_t ctx, estream_t fp)
       log_error ("can't open mail parser: %s", gpg_strerror (err));
       goto leave;
     }
-
-  /* Fixme: We should not use fgets because it can't cope with
-     embedded nul characters. */
-  while (es_fgets (ctx->line, sizeof (ctx->line), fp))
+  /* We don't need the headers of parts once they have been
+   * processed.  */
+  rfc822parse_set_streaming (msg);
+
+  ctx->buf.pos = ctx->buf.len = 0;
+  ctx->buf.saved = -1;
+  ctx->buf.eof = 0;
+  while (!(err = next_line (ctx, fp, &line, &length, &nolf)))
     {
       lineno++;
       if (lineno == 1 && !strncmp (line, "From ", 5))
         continue;  /* We better ignore a leading From line. */
 
-      length = strlen (line);
-      if (length && line[length - 1] == '\n')
-	line[--length] = 0;
-      else
+      if (nolf)
         log_error ("mail parser detected too long or"
                    " non terminated last line (lnr=%u)\n", lineno);
       if (length && line[length - 1] == '\r')
@@ -822,6 +909,11 @@ mime_parser_parse (mime_parser_t ctx, estream_t fp)
             goto leave;
         }
     }
+  if (gpg_err_code (err) != GPG_ERR_EOF)
+    {
+      log_error ("error reading mail: %s\n", gpg_strerror (err));
+      goto leave;
+    }
 
   rfc822parse_close (msg);
   msg = NULL;
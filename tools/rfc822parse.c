@@ -78,6 +78,7 @@ struct part
 {
   struct part *right;     /* The next part. */
   struct part *down;      /* A contained part. */
+  struct part *parent;    /* The containing part or NULL. */
   HDR_LINE hdr_lines;       /* Header lines os that part. */
   HDR_LINE *hdr_lines_tail; /* Helper for adding lines. */
   char *boundary;           /* Only used in the first part. */
@@ -91,6 +92,7 @@ struct rfc822parse_context
   int callback_error;
   int in_body;
   int in_preamble;      /* Wether we are before the first boundary. */
+  int streaming;        /* Release the parts already parsed.  */
   part_t parts;         /* The tree of parts. */
   part_t current_part;  /* Whom we are processing (points into parts). */
   const char *boundary; /* Current boundary. */
@@ -282,48 +284,31 @@ rfc822parse_close (rfc822parse_t msg)
     }
 }
 
-static part_t
-find_parent (part_t tree, part_t target)
-{
-  part_t part;
 
-  for (part = tree->down; part; part = part->right)
-    {
-      if (part == target)
-        return tree; /* Found. */
-      if (part->down)
-        {
-          part_t tmp = find_parent (part, target);
-          if (tmp)
-            return tmp;
-        }
-    }
-  return NULL;
+/* Switch MSG into streaming mode.  In this mode a part is released
+ * as soon as the next part at the same level starts.  Thus the memory
+ * used does not grow with the number of parts; only the headers of
+ * the current part and of the parts containing it are kept.  This
+ * should be called right after rfc822parse_open.  */
+void
+rfc822parse_set_streaming (rfc822parse_t msg)
+{
+  msg->streaming = 1;
 }
 
+
 static void
 set_current_part_to_parent (rfc822parse_t msg)
 {
   part_t parent;
 
   assert (msg->current_part);
-  parent = find_parent (msg->parts, msg->current_part);
+  parent = msg->current_part->parent;
   if (!parent)
     return; /* Already at the top. */
 
-#ifndef NDEBUG
-  {
-    part_t part;
-    for (part = parent->down; part; part = part->right)
-      if (part == msg->current_part)
-        break;
-    assert (part);
-  }
-#endif
   msg->current_part = parent;
-
-  parent = find_parent (msg->parts, parent);
-  msg->boundary = parent? parent->boundary: NULL;
+  msg->boundary = parent->parent? parent->parent->boundary: NULL;
 }
 
 
@@ -373,6 +358,7 @@ transition_to_body (rfc822parse_t msg)
                         }
                       rc = do_callback (msg, RFC822PARSE_LEVEL_DOWN);
                       assert (!msg->current_part->down);
+                      part->parent = msg->current_part;
                       msg->current_part->down = part;
                       msg->current_part = part;
                       msg->in_preamble = 1;
@@ -400,7 +386,16 @@ transition_to_header (rfc822parse_t msg)
   if (!part)
     return -1;
 
-  msg->current_part->right = part;
+  part->parent = msg->current_part->parent;
+  if (msg->streaming && part->parent)
+    {
+      /* The finished part is the only one left at this level.  */
+      assert (part->parent->down == msg->current_part);
+      part->parent->down = part;
+      release_part (msg->current_part);
+    }
+  else
+    msg->current_part->right = part;
   msg->current_part = part;
   return 0;
 }
@@ -50,6 +50,7 @@ typedef int (*rfc822parse_cb_t) (void *opaque,
 
 
 rfc822parse_t rfc822parse_open (rfc822parse_cb_t cb, void *opaque_value);
+void rfc822parse_set_streaming (rfc822parse_t msg);
 
 void rfc822parse_close (rfc822parse_t msg);
 